@@ -399,6 +399,32 @@ typedef struct SSMHANDLE *PSSMHANDLE;
 /** Pointer to a const SSM stream method table. */
 typedef struct SSMSTRMOPS const *PCSSMSTRMOPS;
 
+/**
+ * How the saved state data should be compressed.
+ */
+typedef enum SSMCOMPRESSION
+{
+    /** Invalid. */
+    SSMCOMPRESSION_INVALID = 0,
+    /** The default, currently the same as SSMCOMPRESSION_FAST. */
+    SSMCOMPRESSION_DEFAULT,
+    /** No compression, only zero blocks are squeezed.
+     * Largest files, but the cheapest to save and restore. */
+    SSMCOMPRESSION_NONE,
+    /** Fast compression using LZF.  This is what older versions always did. */
+    SSMCOMPRESSION_FAST,
+    /** zlib at a fast level.  Noticeably smaller than LZF at a higher CPU cost.
+     * @remarks Streams using this cannot be read by older versions. */
+    SSMCOMPRESSION_SMALL,
+    /** zlib at the best level, for archival snapshots.
+     * @remarks Streams using this cannot be read by older versions. */
+    SSMCOMPRESSION_MAX,
+    /** End of valid values. */
+    SSMCOMPRESSION_END,
+    /** Blow the type up to 32 bits. */
+    SSMCOMPRESSION_32BIT_HACK = 0x7fffffff
+} SSMCOMPRESSION;
+
 /** Pointer to a CPUMCTX. */
 typedef struct CPUMCTX *PCPUMCTX;
 /** Pointer to a const CPUMCTX. */
@@ -108,6 +108,24 @@ typedef struct VDMETAXFER *PVDMETAXFER;
 /** Pointer to a metadata transfer handle. */
 typedef PVDMETAXFER *PPVDMETAXFER;
 
+/**
+ * Metadata table cache entry.
+ *
+ * The cache is shared by all images and bounded by a global memory budget,
+ * the backends only see this part of an entry.
+ */
+typedef struct VDMETACACHEENTRY
+{
+    /** Offset of the table in the image, used as the search key. */
+    uint64_t    uOffset;
+    /** Size of the table in bytes. */
+    size_t      cbData;
+    /** The cached table, owned by the cache. */
+    void       *pvData;
+} VDMETACACHEENTRY;
+/** Pointer to a metadata table cache entry. */
+typedef VDMETACACHEENTRY *PVDMETACACHEENTRY;
+
 
 /**
  * Internal I/O interface between the generic VD layer and the backends.
@@ -244,10 +262,16 @@ typedef struct VDINTERFACEIOINT
      * @param   uOffset        The offset to start reading from.
      * @param   pIoCtx         I/O context passed in the read/write callback.
      * @param   cbRead         How many bytes to read.
+     * @param   pfnCompleted   Optional completion callback, called once after the
+     *                         whole transfer completed if VERR_VD_ASYNC_IO_IN_PROGRESS
+     *                         is returned.
+     * @param   pvCompleteUser Opaque user data passed in the completion callback.
      */
     DECLR3CALLBACKMEMBER(int, pfnReadUser, (void *pvUser, PVDIOSTORAGE pStorage,
                                             uint64_t uOffset, PVDIOCTX pIoCtx,
-                                            size_t cbRead));
+                                            size_t cbRead,
+                                            PFNVDXFERCOMPLETED pfnComplete,
+                                            void *pvCompleteUser));
 
     /**
      * Initiate a write request for user data.
@@ -258,7 +282,9 @@ typedef struct VDINTERFACEIOINT
      * @param   uOffset        The offset to start writing to.
      * @param   pIoCtx         I/O context passed in the read/write callback.
      * @param   cbWrite        How many bytes to write.
-     * @param   pfnCompleted   Completion callback.
+     * @param   pfnCompleted   Optional completion callback, called once after the
+     *                         whole transfer completed if VERR_VD_ASYNC_IO_IN_PROGRESS
+     *                         is returned.
      * @param   pvCompleteUser Opaque user data passed in the completion callback.
      */
     DECLR3CALLBACKMEMBER(int, pfnWriteUser, (void *pvUser, PVDIOSTORAGE pStorage,
@@ -443,6 +469,64 @@ typedef struct VDINTERFACEIOINT
      */
     DECLR3CALLBACKMEMBER(size_t, pfnIoCtxGetDataUnitSize, (void *pvUser, PVDIOCTX pIoCtx));
 
+    /**
+     * Searches the metadata table cache for the table at the given offset
+     * and retains it.
+     *
+     * @returns Pointer to the retained cache entry or NULL if the table is not cached.
+     * @param   pvUser         The opaque user data passed on container creation.
+     * @param   pStorage       The storage handle the table belongs to.
+     * @param   uOffset        Offset of the table in the image.
+     */
+    DECLR3CALLBACKMEMBER(PVDMETACACHEENTRY, pfnMetaCacheLookup, (void *pvUser, PVDIOSTORAGE pStorage,
+                                                                 uint64_t uOffset));
+
+    /**
+     * Allocates a new retained metadata table cache entry, evicting tables
+     * not in use if the cache exceeds its memory budget.
+     *
+     * @returns Pointer to the cache entry or NULL if out of memory.
+     * @param   pvUser         The opaque user data passed on container creation.
+     * @param   pStorage       The storage handle the table belongs to.
+     * @param   uOffset        Offset of the table in the image.
+     * @param   cbData         Size of the table in bytes.
+     *
+     * @note    The entry is not visible to lookups until it was inserted with
+     *          VDINTERFACEIOINT::pfnMetaCacheEntryInsert, which the backend
+     *          should do only after the table was read or written successfully.
+     *          The content of the table is undefined.
+     */
+    DECLR3CALLBACKMEMBER(PVDMETACACHEENTRY, pfnMetaCacheEntryAlloc, (void *pvUser, PVDIOSTORAGE pStorage,
+                                                                     uint64_t uOffset, size_t cbData));
+
+    /**
+     * Makes an allocated metadata table cache entry visible to lookups.
+     *
+     * @returns nothing.
+     * @param   pvUser         The opaque user data passed on container creation.
+     * @param   pEntry         The cache entry to insert.
+     */
+    DECLR3CALLBACKMEMBER(void, pfnMetaCacheEntryInsert, (void *pvUser, PVDMETACACHEENTRY pEntry));
+
+    /**
+     * Retains an additional reference to a metadata table cache entry.
+     *
+     * @returns nothing.
+     * @param   pvUser         The opaque user data passed on container creation.
+     * @param   pEntry         The cache entry.
+     */
+    DECLR3CALLBACKMEMBER(void, pfnMetaCacheEntryRetain, (void *pvUser, PVDMETACACHEENTRY pEntry));
+
+    /**
+     * Releases a reference to a metadata table cache entry.
+     * An entry which was never inserted is freed when the last reference is gone.
+     *
+     * @returns nothing.
+     * @param   pvUser         The opaque user data passed on container creation.
+     * @param   pEntry         The cache entry.
+     */
+    DECLR3CALLBACKMEMBER(void, pfnMetaCacheEntryRelease, (void *pvUser, PVDMETACACHEENTRY pEntry));
+
 } VDINTERFACEIOINT, *PVDINTERFACEIOINT;
 
 /**
@@ -545,7 +629,17 @@ DECLINLINE(int) vdIfIoIntFileReadUser(PVDINTERFACEIOINT pIfIoInt, PVDIOSTORAGE p
                                       uint64_t uOffset, PVDIOCTX pIoCtx, size_t cbRead)
 {
     return pIfIoInt->pfnReadUser(pIfIoInt->Core.pvUser, pStorage,
-                                 uOffset, pIoCtx, cbRead);
+                                 uOffset, pIoCtx, cbRead, NULL, NULL);
+}
+
+DECLINLINE(int) vdIfIoIntFileReadUserEx(PVDINTERFACEIOINT pIfIoInt, PVDIOSTORAGE pStorage,
+                                        uint64_t uOffset, PVDIOCTX pIoCtx, size_t cbRead,
+                                        PFNVDXFERCOMPLETED pfnComplete,
+                                        void *pvCompleteUser)
+{
+    return pIfIoInt->pfnReadUser(pIfIoInt->Core.pvUser, pStorage,
+                                 uOffset, pIoCtx, cbRead, pfnComplete,
+                                 pvCompleteUser);
 }
 
 DECLINLINE(int) vdIfIoIntFileWriteUser(PVDINTERFACEIOINT pIfIoInt, PVDIOSTORAGE pStorage,
@@ -635,6 +729,33 @@ DECLINLINE(size_t) vdIfIoIntIoCtxGetDataUnitSize(PVDINTERFACEIOINT pIfIoInt, PVD
     return pIfIoInt->pfnIoCtxGetDataUnitSize(pIfIoInt->Core.pvUser, pIoCtx);
 }
 
+DECLINLINE(PVDMETACACHEENTRY) vdIfIoIntMetaCacheLookup(PVDINTERFACEIOINT pIfIoInt, PVDIOSTORAGE pStorage,
+                                                       uint64_t uOffset)
+{
+    return pIfIoInt->pfnMetaCacheLookup(pIfIoInt->Core.pvUser, pStorage, uOffset);
+}
+
+DECLINLINE(PVDMETACACHEENTRY) vdIfIoIntMetaCacheEntryAlloc(PVDINTERFACEIOINT pIfIoInt, PVDIOSTORAGE pStorage,
+                                                           uint64_t uOffset, size_t cbData)
+{
+    return pIfIoInt->pfnMetaCacheEntryAlloc(pIfIoInt->Core.pvUser, pStorage, uOffset, cbData);
+}
+
+DECLINLINE(void) vdIfIoIntMetaCacheEntryInsert(PVDINTERFACEIOINT pIfIoInt, PVDMETACACHEENTRY pEntry)
+{
+    pIfIoInt->pfnMetaCacheEntryInsert(pIfIoInt->Core.pvUser, pEntry);
+}
+
+DECLINLINE(void) vdIfIoIntMetaCacheEntryRetain(PVDINTERFACEIOINT pIfIoInt, PVDMETACACHEENTRY pEntry)
+{
+    pIfIoInt->pfnMetaCacheEntryRetain(pIfIoInt->Core.pvUser, pEntry);
+}
+
+DECLINLINE(void) vdIfIoIntMetaCacheEntryRelease(PVDINTERFACEIOINT pIfIoInt, PVDMETACACHEENTRY pEntry)
+{
+    pIfIoInt->pfnMetaCacheEntryRelease(pIfIoInt->Core.pvUser, pEntry);
+}
+
 /**
  * Interface for the metadata traverse callback.
  *
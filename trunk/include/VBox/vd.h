@@ -90,6 +90,9 @@ RT_C_DECLS_BEGIN
 /** VDI: Fill new blocks with zeroes while expanding image file. Only valid
  * for newly created images, never set for opened existing images. */
 #define VD_VDI_IMAGE_FLAGS_ZERO_EXPAND          (0x0100)
+/** QCOW: Store newly written clusters compressed (creates a version 2 image).
+ * Only valid for newly created images, never set for opened existing images. */
+#define VD_QCOW_IMAGE_FLAGS_COMPRESSED          (0x0200)
 
 /** Mask of valid image flags for VMDK. */
 #define VD_VMDK_IMAGE_FLAGS_MASK            (   VD_IMAGE_FLAGS_FIXED | VD_IMAGE_FLAGS_DIFF | VD_IMAGE_FLAGS_NONE \
@@ -99,8 +102,11 @@ RT_C_DECLS_BEGIN
 /** Mask of valid image flags for VDI. */
 #define VD_VDI_IMAGE_FLAGS_MASK             (VD_IMAGE_FLAGS_FIXED | VD_IMAGE_FLAGS_DIFF | VD_IMAGE_FLAGS_NONE | VD_VDI_IMAGE_FLAGS_ZERO_EXPAND)
 
+/** Mask of valid image flags for QCOW. */
+#define VD_QCOW_IMAGE_FLAGS_MASK            (VD_IMAGE_FLAGS_FIXED | VD_IMAGE_FLAGS_DIFF | VD_IMAGE_FLAGS_NONE | VD_QCOW_IMAGE_FLAGS_COMPRESSED)
+
 /** Mask of all valid image flags for all formats. */
-#define VD_IMAGE_FLAGS_MASK                 (VD_VMDK_IMAGE_FLAGS_MASK | VD_VDI_IMAGE_FLAGS_MASK)
+#define VD_IMAGE_FLAGS_MASK                 (VD_VMDK_IMAGE_FLAGS_MASK | VD_VDI_IMAGE_FLAGS_MASK | VD_QCOW_IMAGE_FLAGS_MASK)
 
 /** Default image flags. */
 #define VD_IMAGE_FLAGS_DEFAULT              (VD_IMAGE_FLAGS_NONE)
@@ -494,6 +500,27 @@ typedef VDGEOMETRY *PVDGEOMETRY;
 /** Pointer to constant disk geometry. */
 typedef const VDGEOMETRY *PCVDGEOMETRY;
 
+/**
+ * Statistics of the metadata table cache shared by all image backends.
+ */
+typedef struct VDMETACACHESTATS
+{
+    /** Maximum amount of memory the cache may use. */
+    size_t      cbMax;
+    /** Amount of memory currently used by cached tables. */
+    size_t      cbUsed;
+    /** Number of cached tables. */
+    uint32_t    cEntries;
+    /** Number of lookups which found the table in the cache. */
+    uint64_t    cHits;
+    /** Number of lookups which had to read the table from the image. */
+    uint64_t    cMisses;
+    /** Number of tables evicted to stay within the memory budget. */
+    uint64_t    cEvictions;
+} VDMETACACHESTATS;
+/** Pointer to the metadata cache statistics. */
+typedef VDMETACACHESTATS *PVDMETACACHESTATS;
+
 /**
  * VBox HDD Container main structure.
  */
@@ -548,6 +575,25 @@ VBOXDDU_DECL(int) VDPluginUnloadFromFilename(const char *pszFilename);
  */
 VBOXDDU_DECL(int) VDPluginUnloadFromPath(const char *pszPath);
 
+/**
+ * Sets the amount of memory the backends may use for caching metadata tables
+ * (L2 tables for QCOW and QED) of all opened images together.
+ *
+ * @returns VBox status code.
+ * @param   cbMax           The new memory budget in bytes. Tables which are
+ *                          not in use are evicted immediately if the cache
+ *                          exceeds the new budget.
+ */
+VBOXDDU_DECL(int) VDMetaCacheSetMaxSize(size_t cbMax);
+
+/**
+ * Queries the statistics of the metadata table cache.
+ *
+ * @returns VBox status code.
+ * @param   pStats          Where to store the statistics.
+ */
+VBOXDDU_DECL(int) VDMetaCacheQueryStats(PVDMETACACHESTATS pStats);
+
 /**
  * Lists all HDD backends and their capabilities in a caller-provided buffer.
  *
@@ -760,6 +806,12 @@ VBOXDDU_DECL(int) VDCreateCache(PVBOXHDD pDisk, const char *pszBackend,
  * @param   nImageFrom      Image number to merge from, counts from 0. 0 is always base image of container.
  * @param   nImageTo        Image number to merge to, counts from 0. 0 is always base image of container.
  * @param   pVDIfsOperation Pointer to the per-operation VD interface list.
+ *
+ * @note The data is transferred in chunks with several transfers in flight.
+ *       The optional configuration interface in pVDIfsOperation can tune this
+ *       with the "CopyChunkSize" (bytes), "CopyQueueDepth" (transfers per
+ *       thread) and "CopyThreads" keys, the latter splitting the disk into
+ *       stripes processed by separate threads.
  */
 VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
                           unsigned nImageTo, PVDINTERFACE pVDIfsOperation);
@@ -839,6 +891,9 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
  *          the diff image for changed data and copy it to the destination diff
  *          image which is achieved with nImageFromSame and nImageToSame.
  *          Setting both to 0 can suppress a lot of I/O.
+ *
+ * @note The transfer can be tuned with the same configuration keys as
+ *       VDMerge(), taken from pVDIfsOperation or pDstVDIfsOperation.
  */
 VBOXDDU_DECL(int) VDCopyEx(PVBOXHDD pDiskFrom, unsigned nImage, PVBOXHDD pDiskTo,
                            const char *pszBackend, const char *pszFilename,
@@ -1346,6 +1401,69 @@ VBOXDDU_DECL(int) VDAsyncWrite(PVBOXHDD pDisk, uint64_t off, size_t cbWrite,
                                PFNVDASYNCTRANSFERCOMPLETE pfnComplete,
                                void *pvUser1, void *pvUser2);
 
+/** Maximum number of independent I/O queues per HDD container. */
+#define VD_IO_QUEUES_MAX        16
+/** I/O queue identifier selecting the default (unqueued) submission path. */
+#define VD_IO_QUEUE_ID_NONE     UINT32_MAX
+
+/**
+ * Sets the number of independent I/O queues for asynchronous read and write
+ * requests of the given HDD container.
+ *
+ * Every queue has its own submission list and completes its requests outside
+ * of the disk lock, so completion callbacks of different queues can run
+ * concurrently. The image backend calls mapping a queued request are still
+ * serialized by the disk lock, but the resulting data transfers are handed to
+ * the I/O interface after the lock was released, so different threads submit
+ * them concurrently. Requests changing metadata (growing writes, flushes and
+ * discards) still synchronize with all other requests.
+ *
+ * @return  VBox status code.
+ * @retval  VERR_VD_INVALID_STATE if there is I/O active on the container.
+ * @param   pDisk           Pointer to the HDD container.
+ * @param   cIoQueues       Number of queues, 0 disables queued submission.
+ *                          Must not exceed VD_IO_QUEUES_MAX.
+ */
+VBOXDDU_DECL(int) VDIoQueuesSet(PVBOXHDD pDisk, uint32_t cIoQueues);
+
+/**
+ * Start an asynchronous read request on the given I/O queue.
+ *
+ * @return  VBox status code.
+ * @param   pDisk           Pointer to the HDD container.
+ * @param   idIoQueue       The queue to submit the request to, VD_IO_QUEUE_ID_NONE
+ *                          for the default submission path.
+ * @param   off             The offset of the virtual disk to read from.
+ * @param   cbRead          How many bytes to read.
+ * @param   pcSgBuf         Pointer to the S/G buffer to read into.
+ * @param   pfnComplete     Completion callback.
+ * @param   pvUser1         User data which is passed on completion.
+ * @param   pvUser2         User data which is passed on completion.
+ */
+VBOXDDU_DECL(int) VDAsyncReadQueued(PVBOXHDD pDisk, uint32_t idIoQueue, uint64_t off,
+                                    size_t cbRead, PCRTSGBUF pcSgBuf,
+                                    PFNVDASYNCTRANSFERCOMPLETE pfnComplete,
+                                    void *pvUser1, void *pvUser2);
+
+/**
+ * Start an asynchronous write request on the given I/O queue.
+ *
+ * @return  VBox status code.
+ * @param   pDisk           Pointer to the HDD container.
+ * @param   idIoQueue       The queue to submit the request to, VD_IO_QUEUE_ID_NONE
+ *                          for the default submission path.
+ * @param   off             The offset of the virtual disk to write to.
+ * @param   cbWrite         How many bytes to write.
+ * @param   pcSgBuf         Pointer to the S/G buffer to write from.
+ * @param   pfnComplete     Completion callback.
+ * @param   pvUser1         User data which is passed on completion.
+ * @param   pvUser2         User data which is passed on completion.
+ */
+VBOXDDU_DECL(int) VDAsyncWriteQueued(PVBOXHDD pDisk, uint32_t idIoQueue, uint64_t off,
+                                     size_t cbWrite, PCRTSGBUF pcSgBuf,
+                                     PFNVDASYNCTRANSFERCOMPLETE pfnComplete,
+                                     void *pvUser1, void *pvUser2);
+
 
 /**
  * Start an asynchronous flush request.
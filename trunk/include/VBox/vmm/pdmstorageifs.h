@@ -642,6 +642,28 @@ typedef struct PDMIMEDIAEXPORT
     DECLR3CALLBACKMEMBER(int, pfnIoReqQueryBuf, (PPDMIMEDIAEXPORT pInterface, PDMMEDIAEXIOREQ hIoReq,
                                                  void *pvIoReqAlloc, void **ppvBuf, size_t *pcbBuf));
 
+    /**
+     * Queries the memory of the request from the drive/device above as a list of segments
+     * so the data can be transferred without copying it through an intermediate buffer.
+     *
+     * @returns VBox status code.
+     * @retval  VERR_NOT_SUPPORTED if this is not supported for this request.
+     * @param   pInterface      Pointer to the interface structure containing the called function pointer.
+     * @param   hIoReq          The I/O request handle.
+     * @param   pvIoReqAlloc    The allocator specific memory for this request.
+     * @param   paSegs          Where to store the segments on success.
+     * @param   pcSegs          On input the number of entries in the segment array,
+     *                          on success the number of segments used.
+     * @param   pcbBuf          Where to store the size of the complete buffer on success.
+     *
+     * @note Optional like PDMIMEDIAEXPORT::pfnIoReqQueryBuf. The memory stays accessible
+     *       until the request completed. Every segment starts at a 512 byte boundary and is
+     *       a multiple of 512 bytes in size so it can be used for unbuffered I/O.
+     */
+    DECLR3CALLBACKMEMBER(int, pfnIoReqQuerySgBuf, (PPDMIMEDIAEXPORT pInterface, PDMMEDIAEXIOREQ hIoReq,
+                                                   void *pvIoReqAlloc, PRTSGSEG paSegs, unsigned *pcSegs,
+                                                   size_t *pcbBuf));
+
     /**
      * Queries the specified amount of ranges to discard from the callee for the given I/O request.
      *
@@ -682,7 +704,7 @@ typedef struct PDMIMEDIAEXPORT
 } PDMIMEDIAEXPORT;
 
 /** PDMIMEDIAAEXPORT interface ID. */
-#define PDMIMEDIAEXPORT_IID                  "0ae2e534-6c28-41d6-9a88-7f88f2cb2ff8"
+#define PDMIMEDIAEXPORT_IID                  "5b2e0d19-8a4c-4d0e-b3a7-2c91f4e6d855"
 
 
 /** Pointer to an extended media interface. */
@@ -31,6 +31,7 @@
 #include <iprt/semaphore.h>
 #ifdef IN_RING3
 # include <iprt/mem.h>
+# include <iprt/string.h>
 # include <iprt/uuid.h>
 #endif /* IN_RING3 */
 #include <VBox/VBoxPktDmp.h>
@@ -49,7 +50,7 @@
 #ifdef IN_RING3
 
 #define VNET_PCI_CLASS               0x0200
-#define VNET_N_QUEUES                3
+#define VNET_N_QUEUES                3  /**< Without VNET_F_MQ: RX, TX and CTL. */
 #define VNET_NAME_FMT                "VNet%d"
 
 #if 0
@@ -64,10 +65,16 @@
 #endif /* VBOX_DEVICE_STRUCT_TESTCASE */
 
 
-#define VNET_TX_DELAY           150   /**< 150 microseconds */
 #define VNET_MAX_FRAME_SIZE     65535 + 18  /**< Max IP packet size + Ethernet header with VLAN tag */
 #define VNET_MAC_FILTER_LEN     32
 #define VNET_MAX_VID            (1 << 12)
+/** Maximum number of RX/TX queue pairs with VNET_F_MQ, the control queue follows the last pair. */
+#define VNET_MAX_QUEUE_PAIRS    8
+AssertCompile(VNET_MAX_QUEUE_PAIRS * 2 + 1 <= VIRTIO_MAX_NQUEUES);
+/** Log2 of the number of entries in the receive steering table. */
+#define VNET_RX_STEERING_SHIFT  7
+/** Number of entries in the receive steering table. */
+#define VNET_RX_STEERING_SIZE   (1 << VNET_RX_STEERING_SHIFT)
 
 /** @name Virtio net features
  * @{  */
@@ -88,6 +95,7 @@
 #define VNET_F_CTRL_VQ    0x00020000  /**< Control channel available */
 #define VNET_F_CTRL_RX    0x00040000  /**< Control channel RX mode support */
 #define VNET_F_CTRL_VLAN  0x00080000  /**< Control channel VLAN filtering */
+#define VNET_F_MQ         0x00400000  /**< Multiple RX/TX queue pairs with automatic steering */
 /** @} */
 
 #define VNET_S_LINK_UP    1
@@ -104,8 +112,55 @@ struct __attribute__ ((__packed__)) VNetPCIConfig /** @todo r=bird: Use #pragma
 {
     RTMAC    mac;
     uint16_t uStatus;
+    uint16_t uMaxVirtqueuePairs;
 };
 AssertCompileMemberOffset(struct VNetPCIConfig, uStatus, 6);
+AssertCompileMemberOffset(struct VNetPCIConfig, uMaxVirtqueuePairs, 8);
+
+/**
+ * A receive/transmit queue pair.
+ *
+ * Each pair has its own transmit worker thread so that guests spreading their
+ * traffic over several vCPUs do not serialize on a single EMT or timer.
+ */
+typedef struct VNETQUEUEPAIR
+{
+    /** The receive queue. */
+    R3PTRTYPE(PVQUEUE)      pRxQueue;
+    /** The transmit queue. */
+    R3PTRTYPE(PVQUEUE)      pTxQueue;
+    /** The transmit worker thread. */
+    R3PTRTYPE(PPDMTHREAD)   pTxThread;
+    /** Event semaphore the transmit worker waits on. */
+    R3PTRTYPE(RTSEMEVENT)   hTxEvt;
+    /** Index of this pair. */
+    uint32_t                iPair;
+    /** Set while the transmit worker is waiting for work. */
+    bool volatile           fTxSleeping;
+    /** Set while the transmit worker tries to get or waits for the transmit
+     *  session of the driver, the owner wakes it up when ending its session. */
+    bool volatile           fTxBlocked;
+    bool                    afAlignment[2];
+    /** Name of the receive queue. */
+    char                    szRxName[8];
+    /** Name of the transmit queue. */
+    char                    szTxName[8];
+
+    /** @name Statistic
+     * @{ */
+    STAMCOUNTER             StatReceivePackets;
+    STAMCOUNTER             StatReceiveBytes;
+    STAMCOUNTER             StatTransmitPackets;
+    STAMCOUNTER             StatTransmitBytes;
+    STAMCOUNTER             StatTransmitKicks;
+    STAMCOUNTER             StatTransmitRetries;
+#if defined(VBOX_WITH_STATISTICS)
+    STAMPROFILEADV          StatTransmit;
+#endif
+    /** @}  */
+} VNETQUEUEPAIR;
+/** Pointer to a receive/transmit queue pair. */
+typedef VNETQUEUEPAIR *PVNETQUEUEPAIR;
 
 /**
  * Device state structure. Holds the current state of device.
@@ -136,28 +191,6 @@ typedef struct VNetState_st
     /**< Link Up(/Restore) Timer. */
     PTMTIMERR3              pLinkUpTimer;
 
-#ifdef VNET_TX_DELAY
-    /**< Transmit Delay Timer - R3. */
-    PTMTIMERR3              pTxTimerR3;
-    /**< Transmit Delay Timer - R0. */
-    PTMTIMERR0              pTxTimerR0;
-    /**< Transmit Delay Timer - GC. */
-    PTMTIMERRC              pTxTimerRC;
-
-# if HC_ARCH_BITS == 64
-    uint32_t                padding2;
-# endif
-
-    uint32_t                u32i;
-    uint32_t                u32AvgDiff;
-    uint32_t                u32MinDiff;
-    uint32_t                u32MaxDiff;
-    uint64_t                u64NanoTS;
-#endif /* VNET_TX_DELAY */
-
-    /** Indicates transmission in progress -- only one thread is allowed. */
-    uint32_t                uIsTransmitting;
-
     /** PCI config area holding MAC address as well as TBD. */
     struct VNetPCIConfig    config;
     /** MAC address obtained from the configuration. */
@@ -186,9 +219,23 @@ typedef struct VNetState_st
     /** Bit array of VLAN filter, one bit per VLAN ID. */
     uint8_t                 aVlanFilter[VNET_MAX_VID / sizeof(uint8_t)];
 
-    R3PTRTYPE(PVQUEUE)      pRxQueue;
-    R3PTRTYPE(PVQUEUE)      pTxQueue;
     R3PTRTYPE(PVQUEUE)      pCtlQueue;
+
+    /** Number of queue pairs offered to the guest, VNET_F_MQ is offered if more than one. */
+    uint32_t                cQueuePairsMax;
+    /** Number of queue pairs the guest enabled via the control queue. */
+    uint32_t volatile       cQueuePairs;
+    /** RX: The queue pair the last rejected TCP or UDP frame was steered to,
+     *  UINT32_MAX if the receive thread can wait for any of them. */
+    uint32_t volatile       iRxPairBlocked;
+    /** Whether the guest negotiated VNET_F_MQ, i.e. the queue layout has the control queue last. */
+    bool                    fMultiQueue;
+    bool                    afAlignment2[3];
+    /** Receive steering table, maps flow hashes to queue pairs. Updated by the
+     *  transmit workers so that replies land on the queue the flow was sent from. */
+    uint8_t                 aRxSteering[VNET_RX_STEERING_SIZE];
+    /** The receive/transmit queue pairs. */
+    VNETQUEUEPAIR           aQueuePairs[VNET_MAX_QUEUE_PAIRS];
     /* Receive-blocking-related fields ***************************************/
 
     /** EMT: Gets signalled when more RX descriptors become available. */
@@ -205,10 +252,10 @@ typedef struct VNetState_st
 #if defined(VBOX_WITH_STATISTICS)
     STAMPROFILE             StatReceive;
     STAMPROFILE             StatReceiveStore;
-    STAMPROFILEADV          StatTransmit;
     STAMPROFILE             StatTransmitSend;
     STAMPROFILE             StatRxOverflow;
     STAMCOUNTER             StatRxOverflowWakeup;
+    STAMCOUNTER             StatRxSteeringFallback;
 #endif /* VBOX_WITH_STATISTICS */
     /** @}  */
 } VNETSTATE;
@@ -264,6 +311,9 @@ typedef uint8_t VNETCTLACK;
 #define VNET_CTRL_CMD_VLAN_ADD         0
 #define VNET_CTRL_CMD_VLAN_DEL         1
 
+#define VNET_CTRL_CLS_MQ               4
+#define VNET_CTRL_CMD_MQ_VQ_PAIRS_SET  0
+
 
 struct VNetCtlHdr
 {
@@ -368,7 +418,8 @@ DECLINLINE(void) vnetPrintFeatures(PVNETSTATE pThis, uint32_t fFeatures, const c
         { VNET_F_STATUS,     "virtio_net_config.status available" },
         { VNET_F_CTRL_VQ,    "control channel available" },
         { VNET_F_CTRL_RX,    "control channel RX mode support" },
-        { VNET_F_CTRL_VLAN,  "control channel VLAN filtering" }
+        { VNET_F_CTRL_VLAN,  "control channel VLAN filtering" },
+        { VNET_F_MQ,         "multiple RX/TX queue pairs" }
     };
 
     Log3(("%s %s:\n", INSTANCE(pThis), pcszText));
@@ -384,7 +435,7 @@ DECLINLINE(void) vnetPrintFeatures(PVNETSTATE pThis, uint32_t fFeatures, const c
 
 static DECLCALLBACK(uint32_t) vnetIoCb_GetHostFeatures(void *pvState)
 {
-    RT_NOREF_PV(pvState);
+    PVNETSTATE pThis = (PVNETSTATE)pvState;
 
     /* We support:
      * - Host-provided MAC address
@@ -393,8 +444,10 @@ static DECLCALLBACK(uint32_t) vnetIoCb_GetHostFeatures(void *pvState)
      * - RX mode setting
      * - MAC filter table
      * - VLAN filter
+     * - Multiple queue pairs (if configured)
      */
-    return VNET_F_MAC
+    return (pThis->cQueuePairsMax > 1 ? VNET_F_MQ : 0)
+        | VNET_F_MAC
         | VNET_F_STATUS
         | VNET_F_CTRL_VQ
         | VNET_F_CTRL_RX
@@ -421,12 +474,87 @@ static DECLCALLBACK(uint32_t) vnetIoCb_GetHostMinimalFeatures(void *pvState)
     return VNET_F_MAC;
 }
 
-static DECLCALLBACK(void) vnetIoCb_SetHostFeatures(void *pvState, uint32_t fFeatures)
+#ifdef IN_RING3
+
+static DECLCALLBACK(void) vnetQueueReceive(void *pvState, PVQUEUE pQueue);
+static DECLCALLBACK(void) vnetQueueTransmit(void *pvState, PVQUEUE pQueue);
+static DECLCALLBACK(void) vnetQueueControl(void *pvState, PVQUEUE pQueue);
+
+/**
+ * Sets up the virtqueue layout.
+ *
+ * Without VNET_F_MQ the device has a single RX/TX pair followed by the control
+ * queue.  With VNET_F_MQ there are cQueuePairsMax pairs (RX at 2N, TX at 2N+1)
+ * and the control queue comes last.  The guest negotiates features before it
+ * sets up the rings, so the ring state of the affected queues is still reset.
+ *
+ * @param   pThis       The device state structure.
+ * @param   fMultiQueue Whether VNET_F_MQ was negotiated.
+ */
+static void vnetSetupQueues(PVNETSTATE pThis, bool fMultiQueue)
+{
+    uint32_t const cPairs = fMultiQueue ? pThis->cQueuePairsMax : 1;
+
+    for (uint32_t i = 0; i < cPairs; i++)
+    {
+        PVNETQUEUEPAIR pPair = &pThis->aQueuePairs[i];
+        PVQUEUE        pRxQueue = &pThis->VPCI.Queues[i * 2];
+        PVQUEUE        pTxQueue = &pThis->VPCI.Queues[i * 2 + 1];
+
+        pRxQueue->VRing.uSize = 256;
+        pRxQueue->pfnCallback = vnetQueueReceive;
+        pRxQueue->pcszName    = pPair->szRxName;
+        pTxQueue->VRing.uSize = 256;
+        pTxQueue->pfnCallback = vnetQueueTransmit;
+        pTxQueue->pcszName    = pPair->szTxName;
+        pPair->pRxQueue = pRxQueue;
+        pPair->pTxQueue = pTxQueue;
+    }
+
+    pThis->pCtlQueue = &pThis->VPCI.Queues[cPairs * 2];
+    pThis->pCtlQueue->VRing.uSize = 16;
+    pThis->pCtlQueue->pfnCallback = vnetQueueControl;
+    pThis->pCtlQueue->pcszName    = "CTL";
+
+    pThis->VPCI.nQueues = cPairs * 2 + 1;
+    pThis->fMultiQueue  = fMultiQueue;
+}
+
+/**
+ * Spreads the receive steering table evenly over the enabled queue pairs.
+ *
+ * @param   pThis       The device state structure.
+ * @param   cPairs      The number of enabled queue pairs.
+ */
+static void vnetRxSteeringInit(PVNETSTATE pThis, uint32_t cPairs)
+{
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aRxSteering); i++)
+        pThis->aRxSteering[i] = (uint8_t)(i % cPairs);
+}
+
+#endif /* IN_RING3 */
+
+static DECLCALLBACK(int) vnetIoCb_SetHostFeatures(void *pvState, uint32_t fFeatures)
 {
-    /** @todo Nothing to do here yet */
     PVNETSTATE pThis = (PVNETSTATE)pvState;
     LogFlow(("%s vnetIoCb_SetHostFeatures: uFeatures=%x\n", INSTANCE(pThis), fFeatures));
     vnetPrintFeatures(pThis, fFeatures, "The guest negotiated the following features");
+
+    bool fMultiQueue = !!(fFeatures & VNET_F_MQ);
+    if (fMultiQueue == pThis->fMultiQueue)
+        return VINF_SUCCESS;
+#ifndef IN_RING3
+    /* The queue callbacks are ring-3 pointers, change the layout there. */
+    return VINF_IOM_R3_IOPORT_WRITE;
+#else
+    Log(("%s vnetIoCb_SetHostFeatures: switching to %u queue pairs\n",
+         INSTANCE(pThis), fMultiQueue ? pThis->cQueuePairsMax : 1));
+    vnetSetupQueues(pThis, fMultiQueue);
+    /* The guest enables additional pairs explicitly via VNET_CTRL_CMD_MQ_VQ_PAIRS_SET. */
+    vnetRxSteeringInit(pThis, 1);
+    ASMAtomicWriteU32(&pThis->cQueuePairs, 1);
+    return VINF_SUCCESS;
+#endif
 }
 
 static DECLCALLBACK(int) vnetIoCb_GetConfig(void *pvState, uint32_t offCfg, uint32_t cb, void *data)
@@ -491,10 +619,13 @@ static DECLCALLBACK(int) vnetIoCb_Reset(void *pvState)
     pThis->nMacFilterEntries = 0;
     memset(pThis->aMacFilter,  0, VNET_MAC_FILTER_LEN * sizeof(RTMAC));
     memset(pThis->aVlanFilter, 0, sizeof(pThis->aVlanFilter));
-    pThis->uIsTransmitting   = 0;
 #ifndef IN_RING3
     return VINF_IOM_R3_IOPORT_WRITE;
 #else
+    /* Back to a single queue pair until the guest negotiates VNET_F_MQ again. */
+    vnetSetupQueues(pThis, false);
+    vnetRxSteeringInit(pThis, 1);
+    ASMAtomicWriteU32(&pThis->cQueuePairs, 1);
     if (pThis->pDrv)
         pThis->pDrv->pfnSetPromiscuousMode(pThis->pDrv, true);
     return VINF_SUCCESS;
@@ -640,27 +771,28 @@ PDMBOTHCBDECL(int) vnetIOPortOut(PPDMDEVINS pDevIns, void *pvUser, RTIOPORT port
  *          It disables notification if it can receive.
  *
  * @returns VERR_NET_NO_BUFFER_SPACE if it cannot.
- * @param   pInterface      Pointer to the interface structure containing the called function pointer.
+ * @param   pThis           The device state structure.
+ * @param   pPair           The queue pair to check the receive queue of.
  * @thread  RX
  */
-static int vnetCanReceive(PVNETSTATE pThis)
+static int vnetCanReceive(PVNETSTATE pThis, PVNETQUEUEPAIR pPair)
 {
     int rc = vnetCsRxEnter(pThis, VERR_SEM_BUSY);
     AssertRCReturn(rc, rc);
 
-    LogFlow(("%s vnetCanReceive\n", INSTANCE(pThis)));
+    LogFlow(("%s vnetCanReceive: pair %u\n", INSTANCE(pThis), pPair->iPair));
     if (!(pThis->VPCI.uStatus & VPCI_STATUS_DRV_OK))
         rc = VERR_NET_NO_BUFFER_SPACE;
-    else if (!vqueueIsReady(&pThis->VPCI, pThis->pRxQueue))
+    else if (!vqueueIsReady(&pThis->VPCI, pPair->pRxQueue))
         rc = VERR_NET_NO_BUFFER_SPACE;
-    else if (vqueueIsEmpty(&pThis->VPCI, pThis->pRxQueue))
+    else if (vqueueIsEmpty(&pThis->VPCI, pPair->pRxQueue))
     {
-        vringSetNotification(&pThis->VPCI, &pThis->pRxQueue->VRing, true);
+        vringSetNotification(&pThis->VPCI, &pPair->pRxQueue->VRing, true);
         rc = VERR_NET_NO_BUFFER_SPACE;
     }
     else
     {
-        vringSetNotification(&pThis->VPCI, &pThis->pRxQueue->VRing, false);
+        vringSetNotification(&pThis->VPCI, &pPair->pRxQueue->VRing, false);
         rc = VINF_SUCCESS;
     }
 
@@ -669,6 +801,37 @@ static int vnetCanReceive(PVNETSTATE pThis)
     return rc;
 }
 
+/**
+ * Check if the receive queue the next frame is waiting for can take it.
+ *
+ * A TCP or UDP frame rejected by vnetNetworkDown_ReceiveGso() waits for the
+ * queue it is steered to.  Otherwise which queue the next frame goes to is only
+ * known once the frame is there, so any enabled queue with buffers will do and
+ * every queue is checked so that notifications get enabled on all the empty ones.
+ *
+ * @returns VERR_NET_NO_BUFFER_SPACE if it cannot.
+ * @param   pThis           The device state structure.
+ * @thread  RX
+ */
+static int vnetCanReceiveNext(PVNETSTATE pThis)
+{
+    uint32_t const cPairs = ASMAtomicReadU32(&pThis->cQueuePairs);
+    uint32_t const iPairBlocked = ASMAtomicReadU32(&pThis->iRxPairBlocked);
+    if (iPairBlocked < cPairs)
+        return vnetCanReceive(pThis, &pThis->aQueuePairs[iPairBlocked]);
+
+    int rcRet = VERR_NET_NO_BUFFER_SPACE;
+    for (uint32_t i = 0; i < cPairs; i++)
+    {
+        int rc = vnetCanReceive(pThis, &pThis->aQueuePairs[i]);
+        if (RT_SUCCESS(rc))
+            rcRet = VINF_SUCCESS;
+        else if (rc != VERR_NET_NO_BUFFER_SPACE)
+            return rc;
+    }
+    return rcRet;
+}
+
 /**
  * @interface_method_impl{PDMINETWORKDOWN,pfnWaitReceiveAvail}
  */
@@ -676,7 +839,7 @@ static DECLCALLBACK(int) vnetNetworkDown_WaitReceiveAvail(PPDMINETWORKDOWN pInte
 {
     PVNETSTATE pThis = RT_FROM_MEMBER(pInterface, VNETSTATE, INetworkDown);
     LogFlow(("%s vnetNetworkDown_WaitReceiveAvail(cMillies=%u)\n", INSTANCE(pThis), cMillies));
-    int rc = vnetCanReceive(pThis);
+    int rc = vnetCanReceiveNext(pThis);
 
     if (RT_SUCCESS(rc))
         return VINF_SUCCESS;
@@ -691,7 +854,7 @@ static DECLCALLBACK(int) vnetNetworkDown_WaitReceiveAvail(PPDMINETWORKDOWN pInte
     while (RT_LIKELY(   (enmVMState = PDMDevHlpVMState(pThis->VPCI.CTX_SUFF(pDevIns))) == VMSTATE_RUNNING
                      ||  enmVMState == VMSTATE_RUNNING_LS))
     {
-        int rc2 = vnetCanReceive(pThis);
+        int rc2 = vnetCanReceiveNext(pThis);
         if (RT_SUCCESS(rc2))
         {
             rc = VINF_SUCCESS;
@@ -788,6 +951,105 @@ static bool vnetAddressFilter(PVNETSTATE pThis, const void *pvBuf, size_t cb)
     return false;
 }
 
+/**
+ * Computes a direction independent hash of the flow a frame belongs to.
+ *
+ * Source and destination are combined symmetrically so that a frame and its
+ * reply hash to the same value, which lets the transmit path train the
+ * receive steering table.  TCP and UDP ports are included unless the IPv4
+ * datagram is a fragment.  IPv6 extension headers are not walked.
+ *
+ * @returns true if the frame is IPv4 or IPv6 and a hash was computed.
+ * @param   pbFrame         The ethernet frame.
+ * @param   cbFrame         The size of the frame.
+ * @param   puHash          Where to return the hash.
+ * @param   pfPorts         Where to return whether TCP or UDP ports are part
+ *                          of the hash.  Optional.
+ */
+static bool vnetFlowHash(const uint8_t *pbFrame, size_t cbFrame, uint32_t *puHash, bool *pfPorts = NULL)
+{
+    size_t offHdr = sizeof(RTNETETHERHDR);
+    if (cbFrame < offHdr)
+        return false;
+    uint16_t uEtherType = RT_BE2H_U16(((PCRTNETETHERHDR)pbFrame)->EtherType);
+    if (uEtherType == RTNET_ETHERTYPE_VLAN)
+    {
+        if (cbFrame < offHdr + 4)
+            return false;
+        uEtherType = RT_BE2H_U16(*(uint16_t const *)(pbFrame + offHdr + 2));
+        offHdr += 4;
+    }
+
+    uint32_t uHash;
+    uint8_t  bProtocol;
+    if (uEtherType == RTNET_ETHERTYPE_IPV4)
+    {
+        if (cbFrame < offHdr + RTNETIPV4_MIN_LEN)
+            return false;
+        PCRTNETIPV4 pIpHdr = (PCRTNETIPV4)(pbFrame + offHdr);
+        uHash     = pIpHdr->ip_src.u ^ pIpHdr->ip_dst.u;
+        bProtocol = pIpHdr->ip_p;
+        if (RT_BE2H_U16(pIpHdr->ip_off) & (RTNETIPV4_FLAGS_MF | 0x1fff))
+            bProtocol = 0; /* Only the first fragment has the ports. */
+        offHdr   += pIpHdr->ip_hl * 4;
+    }
+    else if (uEtherType == RTNET_ETHERTYPE_IPV6)
+    {
+        if (cbFrame < offHdr + sizeof(RTNETIPV6))
+            return false;
+        PCRTNETIPV6 pIp6Hdr = (PCRTNETIPV6)(pbFrame + offHdr);
+        uHash = 0;
+        for (unsigned i = 0; i < RT_ELEMENTS(pIp6Hdr->ip6_src.au32); i++)
+            uHash ^= pIp6Hdr->ip6_src.au32[i] ^ pIp6Hdr->ip6_dst.au32[i];
+        bProtocol = pIp6Hdr->ip6_nxt;
+        offHdr   += sizeof(RTNETIPV6);
+    }
+    else
+        return false;
+
+    bool fPorts = false;
+    if (   (bProtocol == RTNETIPV4_PROT_TCP || bProtocol == RTNETIPV4_PROT_UDP)
+        && cbFrame >= offHdr + 2 * sizeof(uint16_t))
+    {
+        uint16_t const *pau16Ports = (uint16_t const *)(pbFrame + offHdr);
+        uHash ^= (uint32_t)(pau16Ports[0] ^ pau16Ports[1]) << 16;
+        fPorts = true;
+    }
+    uHash ^= bProtocol;
+    if (pfPorts)
+        *pfPorts = fPorts;
+
+    /* Fibonacci hashing, the steering table is indexed by the top bits. */
+    *puHash = uHash * UINT32_C(0x9e3779b9);
+    return true;
+}
+
+/**
+ * Selects the queue pair to deliver a received frame to.
+ *
+ * @returns The queue pair, pair 0 for anything that is not IP or when only one
+ *          pair is enabled.
+ * @param   pThis           The device state structure.
+ * @param   pvBuf           The ethernet frame.
+ * @param   cb              The size of the frame.
+ * @param   pfFlow          Where to return whether the frame was steered as part
+ *                          of a TCP or UDP flow.
+ * @thread  RX
+ */
+static PVNETQUEUEPAIR vnetRxSelectQueuePair(PVNETSTATE pThis, const void *pvBuf, size_t cb, bool *pfFlow)
+{
+    uint32_t const cPairs = ASMAtomicReadU32(&pThis->cQueuePairs);
+    uint32_t       uHash;
+    *pfFlow = false;
+    if (cPairs > 1 && vnetFlowHash((const uint8_t *)pvBuf, cb, &uHash, pfFlow))
+    {
+        uint8_t iPair = ASMAtomicUoReadU8(&pThis->aRxSteering[uHash >> (32 - VNET_RX_STEERING_SHIFT)]);
+        if (iPair < cPairs)
+            return &pThis->aQueuePairs[iPair];
+    }
+    return &pThis->aQueuePairs[0];
+}
+
 /**
  * Pad and store received packet.
  *
@@ -796,11 +1058,12 @@ static bool vnetAddressFilter(PVNETSTATE pThis, const void *pvBuf, size_t cb)
  *
  * @returns VBox status code.
  * @param   pThis          The device state structure.
+ * @param   pPair           The queue pair to store the packet in.
  * @param   pvBuf           The available data.
  * @param   cb              Number of bytes available in the buffer.
  * @thread  RX
  */
-static int vnetHandleRxPacket(PVNETSTATE pThis, const void *pvBuf, size_t cb,
+static int vnetHandleRxPacket(PVNETSTATE pThis, PVNETQUEUEPAIR pPair, const void *pvBuf, size_t cb,
                               PCPDMNETWORKGSO pGso)
 {
     VNETHDRMRX   Hdr;
@@ -854,7 +1117,7 @@ static int vnetHandleRxPacket(PVNETSTATE pThis, const void *pvBuf, size_t cb,
         VQUEUEELEM elem;
         unsigned int nSeg = 0, uElemSize = 0, cbReserved = 0;
 
-        if (!vqueueGet(&pThis->VPCI, pThis->pRxQueue, &elem))
+        if (!vqueueGet(&pThis->VPCI, pPair->pRxQueue, &elem))
         {
             /*
              * @todo: It is possible to run out of RX buffers if only a few
@@ -898,7 +1161,7 @@ static int vnetHandleRxPacket(PVNETSTATE pThis, const void *pvBuf, size_t cb,
             uElemSize += uSize;
         }
         STAM_PROFILE_START(&pThis->StatReceiveStore, a);
-        vqueuePut(&pThis->VPCI, pThis->pRxQueue, &elem, uElemSize, cbReserved);
+        vqueuePut(&pThis->VPCI, pPair->pRxQueue, &elem, uElemSize, cbReserved);
         STAM_PROFILE_STOP(&pThis->StatReceiveStore, a);
         if (!vnetMergeableRxBuffers(pThis))
             break;
@@ -915,7 +1178,7 @@ static int vnetHandleRxPacket(PVNETSTATE pThis, const void *pvBuf, size_t cb,
             return rc;
         }
     }
-    vqueueSync(&pThis->VPCI, pThis->pRxQueue);
+    vqueueSync(&pThis->VPCI, pPair->pRxQueue);
     if (uOffset < cb)
     {
         Log(("%s vnetHandleRxPacket: Packet did not fit into RX queue (packet size=%u)!\n", INSTANCE(pThis), cb));
@@ -961,8 +1224,36 @@ static DECLCALLBACK(int) vnetNetworkDown_ReceiveGso(PPDMINETWORKDOWN pInterface,
         }
     }
 
-    Log2(("%s vnetNetworkDown_ReceiveGso: pvBuf=%p cb=%u pGso=%p\n", INSTANCE(pThis), pvBuf, cb, pGso));
-    int rc = vnetCanReceive(pThis);
+    bool fFlow;
+    PVNETQUEUEPAIR pPair = vnetRxSelectQueuePair(pThis, pvBuf, cb, &fFlow);
+    int rc = vnetCanReceive(pThis, pPair);
+    ASMAtomicWriteU32(&pThis->iRxPairBlocked, UINT32_MAX);
+    if (rc == VERR_NET_NO_BUFFER_SPACE && fFlow)
+    {
+        /*
+         * Delivering a TCP or UDP frame on another queue would reorder the flow
+         * in the guest, let vnetNetworkDown_WaitReceiveAvail() wait for this one.
+         */
+        ASMAtomicWriteU32(&pThis->iRxPairBlocked, pPair->iPair);
+    }
+    else if (rc == VERR_NET_NO_BUFFER_SPACE)
+    {
+        /*
+         * Frames without a TCP or UDP flow don't need to stay on their queue,
+         * use the first queue with buffers instead of holding up the others.
+         */
+        uint32_t const cPairs = ASMAtomicReadU32(&pThis->cQueuePairs);
+        for (uint32_t i = 0; i < cPairs; i++)
+            if (   i != pPair->iPair
+                && vnetCanReceive(pThis, &pThis->aQueuePairs[i]) == VINF_SUCCESS)
+            {
+                STAM_COUNTER_INC(&pThis->StatRxSteeringFallback);
+                pPair = &pThis->aQueuePairs[i];
+                rc = VINF_SUCCESS;
+                break;
+            }
+    }
+    Log2(("%s vnetNetworkDown_ReceiveGso: pvBuf=%p cb=%u pGso=%p pair=%u\n", INSTANCE(pThis), pvBuf, cb, pGso, pPair->iPair));
     if (RT_FAILURE(rc))
         return rc;
 
@@ -980,8 +1271,10 @@ static DECLCALLBACK(int) vnetNetworkDown_ReceiveGso(PPDMINETWORKDOWN pInterface,
         rc = vnetCsRxEnter(pThis, VERR_SEM_BUSY);
         if (RT_SUCCESS(rc))
         {
-            rc = vnetHandleRxPacket(pThis, pvBuf, cb, pGso);
+            rc = vnetHandleRxPacket(pThis, pPair, pvBuf, cb, pGso);
             STAM_REL_COUNTER_ADD(&pThis->StatReceiveBytes, cb);
+            STAM_REL_COUNTER_INC(&pPair->StatReceivePackets);
+            STAM_REL_COUNTER_ADD(&pPair->StatReceiveBytes, cb);
             vnetCsRxLeave(pThis);
         }
     }
@@ -1153,33 +1446,81 @@ DECLINLINE(void) vnetCompleteChecksum(uint8_t *pBuf, unsigned cbSize, uint16_t u
     *(uint16_t*)(pBuf + uStart + uOffset) = vnetCSum16(pBuf + uStart, cbSize - uStart);
 }
 
-static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fOnWorkerThread)
+/**
+ * Records the queue pair a flow was transmitted from in the receive steering
+ * table, so that the replies are delivered to the same queue pair.
+ *
+ * @param   pThis           The device state structure.
+ * @param   pPair           The queue pair the frame was taken from.
+ * @param   pbFrame         The ethernet frame.
+ * @param   cbFrame         The size of the frame.
+ * @thread  TX worker of @a pPair
+ */
+DECLINLINE(void) vnetRxSteeringLearn(PVNETSTATE pThis, PVNETQUEUEPAIR pPair, const uint8_t *pbFrame, size_t cbFrame)
 {
-    /*
-     * Only one thread is allowed to transmit at a time, others should skip
-     * transmission as the packets will be picked up by the transmitting
-     * thread.
-     */
-    if (!ASMAtomicCmpXchgU32(&pThis->uIsTransmitting, 1, 0))
-        return;
+    uint32_t uHash;
+    if (vnetFlowHash(pbFrame, cbFrame, &uHash))
+        ASMAtomicUoWriteU8(&pThis->aRxSteering[uHash >> (32 - VNET_RX_STEERING_SHIFT)], (uint8_t)pPair->iPair);
+}
+
+/**
+ * Wakes up the transmit workers which found the transmit session of the driver
+ * busy, called after the session ended.
+ *
+ * @param   pThis           The device state structure.
+ */
+static void vnetTxWakeupBlocked(PVNETSTATE pThis)
+{
+    /* All pairs, one may have been disabled by the guest while it was waiting. */
+    for (uint32_t i = 0; i < pThis->cQueuePairsMax; i++)
+    {
+        PVNETQUEUEPAIR pPair = &pThis->aQueuePairs[i];
+        if (ASMAtomicXchgBool(&pPair->fTxBlocked, false))
+        {
+            int rc = RTSemEventSignal(pPair->hTxEvt);
+            AssertRC(rc);
+        }
+    }
+}
+
+/**
+ * Transmits the frames pending in the transmit queue of a queue pair.
+ *
+ * @returns VINF_SUCCESS if the queue was drained (or there is nothing to do),
+ *          VERR_SEM_BUSY if the transmit session is owned by another queue pair
+ *          or the driver, VERR_TRY_AGAIN if the driver ran out of buffers.
+ * @param   pThis           The device state structure.
+ * @param   pPair           The queue pair to transmit from.
+ * @param   fOnWorkerThread Whether we're called on a worker thread.
+ * @thread  TX worker of @a pPair
+ */
+static int vnetTransmitPendingPackets(PVNETSTATE pThis, PVNETQUEUEPAIR pPair, bool fOnWorkerThread)
+{
+    PVQUEUE pQueue = pPair->pTxQueue;
 
     if ((pThis->VPCI.uStatus & VPCI_STATUS_DRV_OK) == 0)
     {
         Log(("%s Ignoring transmit requests from non-existent driver (status=0x%x).\n", INSTANCE(pThis), pThis->VPCI.uStatus));
-        return;
+        return VINF_SUCCESS;
     }
 
+    /*
+     * The driver allows a single transmit session at a time, queue pairs
+     * finding it busy wait until the owner ends it.  The flag is raised before
+     * trying so that an owner ending its session in between sees it.
+     */
     PPDMINETWORKUP pDrv = pThis->pDrv;
     if (pDrv)
     {
+        ASMAtomicWriteBool(&pPair->fTxBlocked, true);
         int rc = pDrv->pfnBeginXmit(pDrv, fOnWorkerThread);
         Assert(rc == VINF_SUCCESS || rc == VERR_TRY_AGAIN);
         if (rc == VERR_TRY_AGAIN)
-        {
-            ASMAtomicWriteU32(&pThis->uIsTransmitting, 0);
-            return;
-        }
+            return VERR_SEM_BUSY;
+        ASMAtomicWriteBool(&pPair->fTxBlocked, false);
     }
+    int rcRet = VINF_SUCCESS;
+    bool const fSteering = ASMAtomicReadU32(&pThis->cQueuePairs) > 1;
 
     unsigned int uHdrLen;
     if (vnetMergeableRxBuffers(pThis))
@@ -1187,8 +1528,8 @@ static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fO
     else
         uHdrLen = sizeof(VNETHDR);
 
-    Log3(("%s vnetTransmitPendingPackets: About to transmit %d pending packets\n",
-          INSTANCE(pThis), vringReadAvailIndex(&pThis->VPCI, &pThis->pTxQueue->VRing) - pThis->pTxQueue->uNextAvailIndex));
+    Log3(("%s vnetTransmitPendingPackets: About to transmit %d pending packets on %s\n",
+          INSTANCE(pThis), vringReadAvailIndex(&pThis->VPCI, &pQueue->VRing) - pQueue->uNextAvailIndex, pPair->szTxName));
 
     vpciSetWriteLed(&pThis->VPCI, true);
 
@@ -1200,16 +1541,16 @@ static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fO
     while (vqueuePeek(&pThis->VPCI, pQueue, &elem))
     {
         unsigned int uOffset = 0;
+        STAM_PROFILE_ADV_START(&pPair->StatTransmit, a);
         if (elem.nOut < 2 || elem.aSegsOut[0].cb != uHdrLen)
         {
+            /* Drop the chain, leaving it at the head would make the worker spin on it. */
             Log(("%s vnetQueueTransmit: The first segment is not the header! (%u < 2 || %u != %u).\n",
                  INSTANCE(pThis), elem.nOut, elem.aSegsOut[0].cb, uHdrLen));
-            break; /* For now we simply ignore the header, but it must be there anyway! */
         }
         else
         {
             unsigned int uSize = 0;
-            STAM_PROFILE_ADV_START(&pThis->StatTransmit, a);
             /* Compute total frame size. */
             for (unsigned int i = 1; i < elem.nOut; i++)
                 uSize += elem.aSegsOut[i].cb;
@@ -1224,6 +1565,7 @@ static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fO
                                   &Hdr, sizeof(Hdr));
 
                 STAM_REL_COUNTER_INC(&pThis->StatTransmitPackets);
+                STAM_REL_COUNTER_INC(&pPair->StatTransmitPackets);
 
                 STAM_PROFILE_START(&pThis->StatTransmitSend, a);
 
@@ -1244,6 +1586,8 @@ static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fO
                     }
                     pSgBuf->cbUsed = uSize;
                     vnetPacketDump(pThis, (uint8_t *)pSgBuf->aSegs[0].pvSeg, uSize, "--> Outgoing");
+                    if (fSteering)
+                        vnetRxSteeringLearn(pThis, pPair, (uint8_t *)pSgBuf->aSegs[0].pvSeg, uSize);
                     if (pGso)
                     {
                         /* Some guests (RHEL) may report HdrLen excluding transport layer header! */
@@ -1294,26 +1638,45 @@ static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fO
                 {
                     Log4(("virtio-net: failed to allocate SG buffer: size=%u rc=%Rrc\n", uSize, rc));
                     STAM_PROFILE_STOP(&pThis->StatTransmitSend, a);
-                    STAM_PROFILE_ADV_STOP(&pThis->StatTransmit, a);
+                    STAM_PROFILE_ADV_STOP(&pPair->StatTransmit, a);
                     /* Stop trying to fetch TX descriptors until we get more bandwidth. */
+                    rcRet = VERR_TRY_AGAIN;
                     break;
                 }
 
                 STAM_PROFILE_STOP(&pThis->StatTransmitSend, a);
                 STAM_REL_COUNTER_ADD(&pThis->StatTransmitBytes, uOffset);
+                STAM_REL_COUNTER_ADD(&pPair->StatTransmitBytes, uOffset);
             }
         }
         /* Remove this descriptor chain from the available ring */
         vqueueSkip(&pThis->VPCI, pQueue);
         vqueuePut(&pThis->VPCI, pQueue, &elem, sizeof(VNETHDR) + uOffset);
         vqueueSync(&pThis->VPCI, pQueue);
-        STAM_PROFILE_ADV_STOP(&pThis->StatTransmit, a);
+        STAM_PROFILE_ADV_STOP(&pPair->StatTransmit, a);
     }
     vpciSetWriteLed(&pThis->VPCI, false);
 
     if (pDrv)
+    {
         pDrv->pfnEndXmit(pDrv);
-    ASMAtomicWriteU32(&pThis->uIsTransmitting, 0);
+        vnetTxWakeupBlocked(pThis);
+    }
+    return rcRet;
+}
+
+/**
+ * Wakes up the transmit worker of a queue pair if it is waiting for work.
+ *
+ * @param   pPair           The queue pair.
+ */
+DECLINLINE(void) vnetTxWakeupWorker(PVNETQUEUEPAIR pPair)
+{
+    if (ASMAtomicReadBool(&pPair->fTxSleeping))
+    {
+        int rc = RTSemEventSignal(pPair->hTxEvt);
+        AssertRC(rc);
+    }
 }
 
 /**
@@ -1322,81 +1685,128 @@ static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fO
 static DECLCALLBACK(void) vnetNetworkDown_XmitPending(PPDMINETWORKDOWN pInterface)
 {
     PVNETSTATE pThis = RT_FROM_MEMBER(pInterface, VNETSTATE, INetworkDown);
-    vnetTransmitPendingPackets(pThis, pThis->pTxQueue, false /*fOnWorkerThread*/);
-}
 
-#ifdef VNET_TX_DELAY
+    /*
+     * The driver has resources again or ended a session of its own, let the
+     * workers retry.
+     */
+    vnetTxWakeupBlocked(pThis);
+    uint32_t const cPairs = ASMAtomicReadU32(&pThis->cQueuePairs);
+    for (uint32_t i = 0; i < cPairs; i++)
+        vnetTxWakeupWorker(&pThis->aQueuePairs[i]);
+}
 
+/**
+ * Guest notification on a transmit queue.
+ *
+ * Further notifications are suppressed until the worker of the queue pair has
+ * drained the queue.
+ */
 static DECLCALLBACK(void) vnetQueueTransmit(void *pvState, PVQUEUE pQueue)
 {
-    PVNETSTATE pThis = (PVNETSTATE)pvState;
+    PVNETSTATE     pThis = (PVNETSTATE)pvState;
+    PVNETQUEUEPAIR pPair = &pThis->aQueuePairs[(pQueue - &pThis->VPCI.Queues[0]) / 2];
+    Assert(pPair->pTxQueue == pQueue);
 
-    if (TMTimerIsActive(pThis->CTX_SUFF(pTxTimer)))
-    {
-        TMTimerStop(pThis->CTX_SUFF(pTxTimer));
-        Log3(("%s vnetQueueTransmit: Got kicked with notification disabled, re-enable notification and flush TX queue\n", INSTANCE(pThis)));
-        vnetTransmitPendingPackets(pThis, pQueue, false /*fOnWorkerThread*/);
-        if (RT_FAILURE(vnetCsEnter(pThis, VERR_SEM_BUSY)))
-            LogRel(("vnetQueueTransmit: Failed to enter critical section!/n"));
-        else
-        {
-            vringSetNotification(&pThis->VPCI, &pThis->pTxQueue->VRing, true);
-            vnetCsLeave(pThis);
-        }
-    }
+    STAM_REL_COUNTER_INC(&pPair->StatTransmitKicks);
+    if (RT_FAILURE(vnetCsEnter(pThis, VERR_SEM_BUSY)))
+        LogRel(("vnetQueueTransmit: Failed to enter critical section!/n"));
     else
     {
-        if (RT_FAILURE(vnetCsEnter(pThis, VERR_SEM_BUSY)))
-            LogRel(("vnetQueueTransmit: Failed to enter critical section!/n"));
-        else
-        {
-            vringSetNotification(&pThis->VPCI, &pThis->pTxQueue->VRing, false);
-            TMTimerSetMicro(pThis->CTX_SUFF(pTxTimer), VNET_TX_DELAY);
-            pThis->u64NanoTS = RTTimeNanoTS();
-            vnetCsLeave(pThis);
-        }
+        vringSetNotification(&pThis->VPCI, &pQueue->VRing, false);
+        vnetCsLeave(pThis);
     }
+    vnetTxWakeupWorker(pPair);
 }
 
 /**
- * @callback_method_impl{FNTMTIMERDEV, Transmit Delay Timer handler.}
+ * Checks whether the transmit queue of a queue pair is usable, i.e. the driver
+ * is ready, the guest enabled the pair and set up the ring.
+ *
+ * @param   pThis           The device state structure.
+ * @param   pPair           The queue pair.
  */
-static DECLCALLBACK(void) vnetTxTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer, void *pvUser)
+DECLINLINE(bool) vnetTxQueueIsReady(PVNETSTATE pThis, PVNETQUEUEPAIR pPair)
 {
-    RT_NOREF(pDevIns, pTimer);
-    PVNETSTATE pThis = (PVNETSTATE)pvUser;
+    return (pThis->VPCI.uStatus & VPCI_STATUS_DRV_OK)
+        && pPair->iPair < ASMAtomicReadU32(&pThis->cQueuePairs)
+        && vqueueIsReady(&pThis->VPCI, pPair->pTxQueue);
+}
 
-    uint32_t u32MicroDiff = (uint32_t)((RTTimeNanoTS() - pThis->u64NanoTS)/1000);
-    if (u32MicroDiff < pThis->u32MinDiff)
-        pThis->u32MinDiff = u32MicroDiff;
-    if (u32MicroDiff > pThis->u32MaxDiff)
-        pThis->u32MaxDiff = u32MicroDiff;
-    pThis->u32AvgDiff = (pThis->u32AvgDiff * pThis->u32i + u32MicroDiff) / (pThis->u32i + 1);
-    pThis->u32i++;
-    Log3(("vnetTxTimer: Expired, diff %9d usec, avg %9d usec, min %9d usec, max %9d usec\n",
-          u32MicroDiff, pThis->u32AvgDiff, pThis->u32MinDiff, pThis->u32MaxDiff));
-
-//    Log3(("%s vnetTxTimer: Expired\n", INSTANCE(pThis)));
-    vnetTransmitPendingPackets(pThis, pThis->pTxQueue, false /*fOnWorkerThread*/);
-    if (RT_FAILURE(vnetCsEnter(pThis, VERR_SEM_BUSY)))
+/**
+ * @callback_method_impl{FNPDMTHREADDEV, Transmit worker of a queue pair.}
+ */
+static DECLCALLBACK(int) vnetTxThread(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
+{
+    PVNETSTATE     pThis = PDMINS_2_DATA(pDevIns, PVNETSTATE);
+    PVNETQUEUEPAIR pPair = (PVNETQUEUEPAIR)pThread->pvUser;
+
+    if (pThread->enmState == PDMTHREADSTATE_INITIALIZING)
+        return VINF_SUCCESS;
+
+    while (pThread->enmState == PDMTHREADSTATE_RUNNING)
     {
-        LogRel(("vnetTxTimer: Failed to enter critical section!/n"));
-        return;
-    }
-    vringSetNotification(&pThis->VPCI, &pThis->pTxQueue->VRing, true);
-    vnetCsLeave(pThis);
-}
+        ASMAtomicWriteBool(&pPair->fTxSleeping, true);
+        if (   !vnetTxQueueIsReady(pThis, pPair)
+            || vqueueIsEmpty(&pThis->VPCI, pPair->pTxQueue))
+        {
+            int rc = RTSemEventWait(pPair->hTxEvt, RT_INDEFINITE_WAIT);
+            AssertLogRelMsgReturn(RT_SUCCESS(rc) || rc == VERR_INTERRUPTED, ("%Rrc\n", rc), rc);
+            if (RT_UNLIKELY(pThread->enmState != PDMTHREADSTATE_RUNNING))
+                break;
+        }
+        ASMAtomicWriteBool(&pPair->fTxSleeping, false);
 
-#else /* !VNET_TX_DELAY */
+        if (!vnetTxQueueIsReady(pThis, pPair))
+            continue;
 
-static DECLCALLBACK(void) vnetQueueTransmit(void *pvState, PVQUEUE pQueue)
-{
-    PVNETSTATE pThis = (PVNETSTATE)pvState;
+        int rc = vnetTransmitPendingPackets(pThis, pPair, true /*fOnWorkerThread*/);
+        if (rc == VERR_SEM_BUSY)
+        {
+            /*
+             * Another queue pair or the driver owns the transmit session, the
+             * owner signals us when ending it (vnetTxWakeupBlocked).
+             */
+            STAM_REL_COUNTER_INC(&pPair->StatTransmitRetries);
+            rc = RTSemEventWait(pPair->hTxEvt, RT_INDEFINITE_WAIT);
+            AssertLogRelMsgReturn(RT_SUCCESS(rc) || rc == VERR_INTERRUPTED, ("%Rrc\n", rc), rc);
+            continue;
+        }
+        if (rc == VERR_TRY_AGAIN)
+        {
+            /*
+             * The driver is out of buffers.  Back off briefly, pfnXmitPending or
+             * a guest kick wakes us up earlier.
+             */
+            STAM_REL_COUNTER_INC(&pPair->StatTransmitRetries);
+            ASMAtomicWriteBool(&pPair->fTxSleeping, true);
+            RTSemEventWait(pPair->hTxEvt, 1);
+            continue;
+        }
 
-    vnetTransmitPendingPackets(pThis, pQueue, false /*fOnWorkerThread*/);
+        /*
+         * The queue is drained, re-enable guest notifications.  The loop
+         * re-checks the queue before sleeping so that frames queued before
+         * the guest saw notifications enabled are not left behind.
+         */
+        if (RT_SUCCESS(vnetCsEnter(pThis, VERR_SEM_BUSY)))
+        {
+            vringSetNotification(&pThis->VPCI, &pPair->pTxQueue->VRing, true);
+            vnetCsLeave(pThis);
+        }
+    }
+    return VINF_SUCCESS;
 }
 
-#endif /* !VNET_TX_DELAY */
+/**
+ * @callback_method_impl{FNPDMTHREADWAKEUPDEV}
+ */
+static DECLCALLBACK(int) vnetTxThreadWakeUp(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
+{
+    RT_NOREF(pDevIns);
+    PVNETQUEUEPAIR pPair = (PVNETQUEUEPAIR)pThread->pvUser;
+    return RTSemEventSignal(pPair->hTxEvt);
+}
 
 static uint8_t vnetControlRx(PVNETSTATE pThis, PVNETCTLHDR pCtlHdr, PVQUEUEELEM pElem)
 {
@@ -1544,6 +1954,38 @@ static uint8_t vnetControlVlan(PVNETSTATE pThis, PVNETCTLHDR pCtlHdr, PVQUEUEELE
     return u8Ack;
 }
 
+static uint8_t vnetControlMq(PVNETSTATE pThis, PVNETCTLHDR pCtlHdr, PVQUEUEELEM pElem)
+{
+    uint16_t cPairs;
+
+    if (   pCtlHdr->u8Command != VNET_CTRL_CMD_MQ_VQ_PAIRS_SET
+        || pElem->nOut != 2
+        || pElem->aSegsOut[1].cb < sizeof(cPairs))
+    {
+        Log(("%s vnetControlMq: Segment layout is wrong (u8Command=%u nOut=%u cb=%u)\n",
+             INSTANCE(pThis), pCtlHdr->u8Command, pElem->nOut, pElem->aSegsOut[1].cb));
+        return VNET_ERROR;
+    }
+
+    PDMDevHlpPhysRead(pThis->VPCI.CTX_SUFF(pDevIns),
+                      pElem->aSegsOut[1].addr,
+                      &cPairs, sizeof(cPairs));
+
+    if (   !pThis->fMultiQueue
+        || cPairs < 1
+        || cPairs > pThis->cQueuePairsMax)
+    {
+        Log(("%s vnetControlMq: Invalid number of queue pairs (cPairs=%u fMultiQueue=%RTbool)\n",
+             INSTANCE(pThis), cPairs, pThis->fMultiQueue));
+        return VNET_ERROR;
+    }
+
+    Log(("%s vnetControlMq: Using %u queue pairs\n", INSTANCE(pThis), cPairs));
+    vnetRxSteeringInit(pThis, cPairs);
+    ASMAtomicWriteU32(&pThis->cQueuePairs, cPairs);
+    return VNET_OK;
+}
+
 
 static DECLCALLBACK(void) vnetQueueControl(void *pvState, PVQUEUE pQueue)
 {
@@ -1582,6 +2024,9 @@ static DECLCALLBACK(void) vnetQueueControl(void *pvState, PVQUEUE pQueue)
                 case VNET_CTRL_CLS_VLAN:
                     u8Ack = vnetControlVlan(pThis, &CtlHdr, &elem);
                     break;
+                case VNET_CTRL_CLS_MQ:
+                    u8Ack = vnetControlMq(pThis, &CtlHdr, &elem);
+                    break;
                 default:
                     u8Ack = VNET_ERROR;
             }
@@ -1665,6 +2110,8 @@ static DECLCALLBACK(int) vnetSaveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
     AssertRCReturn(rc, rc);
     rc = SSMR3PutMem( pSSM, pThis->aVlanFilter, sizeof(pThis->aVlanFilter));
     AssertRCReturn(rc, rc);
+    rc = SSMR3PutU32( pSSM, pThis->cQueuePairs);
+    AssertRCReturn(rc, rc);
     Log(("%s State has been saved\n", INSTANCE(pThis)));
     return VINF_SUCCESS;
 }
@@ -1708,6 +2155,14 @@ static DECLCALLBACK(int) vnetLoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint3
 
     if (uPass == SSM_PASS_FINAL)
     {
+        /* Restore the queue layout the guest negotiated. */
+        bool fMultiQueue = !!(pThis->VPCI.uGuestFeatures & VNET_F_MQ);
+        if (   pThis->VPCI.nQueues != (fMultiQueue ? pThis->cQueuePairsMax * 2 + 1 : VNET_N_QUEUES)
+            || (fMultiQueue && pThis->cQueuePairsMax < 2))
+            return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("The number of queue pairs differs: saved=%u config=%u"),
+                                    (pThis->VPCI.nQueues - 1) / 2, pThis->cQueuePairsMax);
+        vnetSetupQueues(pThis, fMultiQueue);
+
         rc = SSMR3GetMem( pSSM, pThis->config.mac.au8,
                           sizeof(pThis->config.mac));
         AssertRCReturn(rc, rc);
@@ -1743,6 +2198,17 @@ static DECLCALLBACK(int) vnetLoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint3
             if (pThis->pDrv)
                 pThis->pDrv->pfnSetPromiscuousMode(pThis->pDrv, true);
         }
+
+        uint32_t cPairs = 1;
+        if (uVersion > VIRTIO_SAVEDSTATE_VERSION_PRE_MQ)
+        {
+            rc = SSMR3GetU32(pSSM, &cPairs);
+            AssertRCReturn(rc, rc);
+            AssertLogRelMsgReturn(cPairs >= 1 && cPairs <= (fMultiQueue ? pThis->cQueuePairsMax : 1),
+                                  ("%s cQueuePairs=%u\n", INSTANCE(pThis), cPairs), VERR_SSM_LOAD_CONFIG_MISMATCH);
+        }
+        vnetRxSteeringInit(pThis, cPairs);
+        ASMAtomicWriteU32(&pThis->cQueuePairs, cPairs);
     }
 
     return rc;
@@ -1928,9 +2394,6 @@ static DECLCALLBACK(void) vnetRelocate(PPDMDEVINS pDevIns, RTGCINTPTR offDelta)
     PVNETSTATE pThis = PDMINS_2_DATA(pDevIns, PVNETSTATE);
     vpciRelocate(pDevIns, offDelta);
     pThis->pCanRxQueueRC = PDMQueueRCPtr(pThis->pCanRxQueueR3);
-#ifdef VNET_TX_DELAY
-    pThis->pTxTimerRC    = TMTimerRCPtr(pThis->pTxTimerR3);
-#endif /* VNET_TX_DELAY */
     // TBD
 }
 
@@ -1943,8 +2406,6 @@ static DECLCALLBACK(int) vnetDestruct(PPDMDEVINS pDevIns)
     PVNETSTATE pThis = PDMINS_2_DATA(pDevIns, PVNETSTATE);
     PDMDEV_CHECK_VERSIONS_RETURN_QUIET(pDevIns);
 
-    LogRel(("TxTimer stats (avg/min/max): %7d usec %7d usec %7d usec\n",
-            pThis->u32AvgDiff, pThis->u32MinDiff, pThis->u32MaxDiff));
     Log(("%s Destroying instance\n", INSTANCE(pThis)));
     if (pThis->hEventMoreRxDescAvail != NIL_RTSEMEVENT)
     {
@@ -1953,6 +2414,21 @@ static DECLCALLBACK(int) vnetDestruct(PPDMDEVINS pDevIns)
         pThis->hEventMoreRxDescAvail = NIL_RTSEMEVENT;
     }
 
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aQueuePairs); i++)
+    {
+        PVNETQUEUEPAIR pPair = &pThis->aQueuePairs[i];
+        if (pPair->pTxThread)
+        {
+            PDMR3ThreadDestroy(pPair->pTxThread, NULL);
+            pPair->pTxThread = NULL;
+        }
+        if (pPair->hTxEvt != NIL_RTSEMEVENT)
+        {
+            RTSemEventDestroy(pPair->hTxEvt);
+            pPair->hTxEvt = NIL_RTSEMEVENT;
+        }
+    }
+
     // if (PDMCritSectIsInitialized(&pThis->csRx))
     //     PDMR3CritSectDelete(&pThis->csRx);
 
@@ -1971,6 +2447,9 @@ static DECLCALLBACK(int) vnetConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMN
 
     /* Initialize the instance data suffiencently for the destructor not to blow up. */
     pThis->hEventMoreRxDescAvail = NIL_RTSEMEVENT;
+    pThis->iRxPairBlocked        = UINT32_MAX;
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aQueuePairs); i++)
+        pThis->aQueuePairs[i].hTxEvt = NIL_RTSEMEVENT;
 
     /* Do our own locking. */
     rc = PDMDevHlpSetDeviceCritSect(pDevIns, PDMDevHlpCritSectGetNop(pDevIns));
@@ -1981,16 +2460,20 @@ static DECLCALLBACK(int) vnetConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMN
     rc = vpciConstruct(pDevIns, &pThis->VPCI, iInstance,
                        VNET_NAME_FMT, VIRTIO_NET_ID,
                        VNET_PCI_CLASS, VNET_N_QUEUES);
-    pThis->pRxQueue  = vpciAddQueue(&pThis->VPCI, 256, vnetQueueReceive,  "RX ");
-    pThis->pTxQueue  = vpciAddQueue(&pThis->VPCI, 256, vnetQueueTransmit, "TX ");
-    pThis->pCtlQueue = vpciAddQueue(&pThis->VPCI, 16,  vnetQueueControl,  "CTL");
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuePairs); i++)
+    {
+        pThis->aQueuePairs[i].iPair = i;
+        RTStrPrintf(pThis->aQueuePairs[i].szRxName, sizeof(pThis->aQueuePairs[i].szRxName), "RX%u", i);
+        RTStrPrintf(pThis->aQueuePairs[i].szTxName, sizeof(pThis->aQueuePairs[i].szTxName), "TX%u", i);
+    }
+    vnetSetupQueues(pThis, false);
 
     Log(("%s Constructing new instance\n", INSTANCE(pThis)));
 
     /*
      * Validate configuration.
      */
-    if (!CFGMR3AreValuesValid(pCfg, "MAC\0" "CableConnected\0" "LineSpeed\0" "LinkUpDelay\0"))
+    if (!CFGMR3AreValuesValid(pCfg, "MAC\0" "CableConnected\0" "LineSpeed\0" "LinkUpDelay\0" "QueuePairs\0"))
                     return PDMDEV_SET_ERROR(pDevIns, VERR_PDM_DEVINS_UNKNOWN_CFG_VALUES,
                                             N_("Invalid configuration for VirtioNet device"));
 
@@ -2017,12 +2500,27 @@ static DECLCALLBACK(int) vnetConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMN
     Log(("%s Link up delay is set to %u seconds\n",
          INSTANCE(pThis), pThis->cMsLinkUpDelay / 1000));
 
+    /** @cfgm{QueuePairs, uint32_t, 1}
+     * The number of receive/transmit queue pairs offered to the guest.  Values
+     * above 1 enable VNET_F_MQ; each pair gets its own transmit worker. */
+    rc = CFGMR3QueryU32Def(pCfg, "QueuePairs", &pThis->cQueuePairsMax, 1);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("Configuration error: Failed to get the value of 'QueuePairs'"));
+    if (pThis->cQueuePairsMax < 1 || pThis->cQueuePairsMax > VNET_MAX_QUEUE_PAIRS)
+        return PDMDevHlpVMSetError(pDevIns, VERR_OUT_OF_RANGE, RT_SRC_POS,
+                                   N_("Configuration error: 'QueuePairs' must be between 1 and %u"), VNET_MAX_QUEUE_PAIRS);
+    pThis->cQueuePairs = 1;
+    vnetRxSteeringInit(pThis, 1);
+    Log(("%s Offering %u queue pairs\n", INSTANCE(pThis), pThis->cQueuePairsMax));
+
 
     vnetPrintFeatures(pThis, vnetIoCb_GetHostFeatures(pThis), "Device supports the following features");
 
     /* Initialize PCI config space */
     memcpy(pThis->config.mac.au8, pThis->macConfigured.au8, sizeof(pThis->config.mac.au8));
     pThis->config.uStatus = 0;
+    pThis->config.uMaxVirtqueuePairs = (uint16_t)pThis->cQueuePairsMax;
 
     /* Initialize state structure */
     pThis->u32PktNo     = 1;
@@ -2075,19 +2573,22 @@ static DECLCALLBACK(int) vnetConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMN
     if (RT_FAILURE(rc))
         return rc;
 
-#ifdef VNET_TX_DELAY
-    /* Create Transmit Delay Timer */
-    rc = PDMDevHlpTMTimerCreate(pDevIns, TMCLOCK_VIRTUAL, vnetTxTimer, pThis,
-                                TMTIMER_FLAGS_NO_CRIT_SECT,
-                                "VirtioNet TX Delay Timer", &pThis->pTxTimerR3);
-    if (RT_FAILURE(rc))
-        return rc;
-    pThis->pTxTimerR0 = TMTimerR0Ptr(pThis->pTxTimerR3);
-    pThis->pTxTimerRC = TMTimerRCPtr(pThis->pTxTimerR3);
+    /* Create the transmit workers, one per queue pair. */
+    for (uint32_t i = 0; i < pThis->cQueuePairsMax; i++)
+    {
+        PVNETQUEUEPAIR pPair = &pThis->aQueuePairs[i];
+        rc = RTSemEventCreate(&pPair->hTxEvt);
+        if (RT_FAILURE(rc))
+            return rc;
 
-    pThis->u32i = pThis->u32AvgDiff = pThis->u32MaxDiff = 0;
-    pThis->u32MinDiff = UINT32_MAX;
-#endif /* VNET_TX_DELAY */
+        char szName[16];
+        RTStrPrintf(szName, sizeof(szName), "VNet%dTx%u", iInstance, i);
+        rc = PDMDevHlpThreadCreate(pDevIns, &pPair->pTxThread, pPair, vnetTxThread, vnetTxThreadWakeUp,
+                                   0, RTTHREADTYPE_IO, szName);
+        if (RT_FAILURE(rc))
+            return PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS,
+                                       N_("VirtioNet: Failed to create the transmit worker %u"), i);
+    }
 
     rc = PDMDevHlpDriverAttach(pDevIns, 0, &pThis->VPCI.IBase, &pThis->pDrvBase, "Network Port");
     if (RT_SUCCESS(rc))
@@ -2126,12 +2627,24 @@ static DECLCALLBACK(int) vnetConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMN
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatTransmitPackets,    STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,          "Number of sent packets",             "/Devices/VNet%d/Packets/Transmit", iInstance);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatTransmitGSO,        STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,          "Number of sent GSO packets",         "/Devices/VNet%d/Packets/Transmit-Gso", iInstance);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatTransmitCSum,       STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,          "Number of completed TX checksums",   "/Devices/VNet%d/Packets/Transmit-Csum", iInstance);
+    for (uint32_t i = 0; i < pThis->cQueuePairsMax; i++)
+    {
+        PVNETQUEUEPAIR pPair = &pThis->aQueuePairs[i];
+        PDMDevHlpSTAMRegisterF(pDevIns, &pPair->StatReceivePackets,  STAMTYPE_COUNTER, STAMVISIBILITY_USED,   STAMUNIT_COUNT,          "Number of packets received",         "/Devices/VNet%d/Queue%u/ReceivePackets", iInstance, i);
+        PDMDevHlpSTAMRegisterF(pDevIns, &pPair->StatReceiveBytes,    STAMTYPE_COUNTER, STAMVISIBILITY_USED,   STAMUNIT_BYTES,          "Amount of data received",            "/Devices/VNet%d/Queue%u/ReceiveBytes", iInstance, i);
+        PDMDevHlpSTAMRegisterF(pDevIns, &pPair->StatTransmitPackets, STAMTYPE_COUNTER, STAMVISIBILITY_USED,   STAMUNIT_COUNT,          "Number of packets transmitted",      "/Devices/VNet%d/Queue%u/TransmitPackets", iInstance, i);
+        PDMDevHlpSTAMRegisterF(pDevIns, &pPair->StatTransmitBytes,   STAMTYPE_COUNTER, STAMVISIBILITY_USED,   STAMUNIT_BYTES,          "Amount of data transmitted",         "/Devices/VNet%d/Queue%u/TransmitBytes", iInstance, i);
+        PDMDevHlpSTAMRegisterF(pDevIns, &pPair->StatTransmitKicks,   STAMTYPE_COUNTER, STAMVISIBILITY_USED,   STAMUNIT_OCCURENCES,     "Number of transmit notifications",   "/Devices/VNet%d/Queue%u/TransmitKicks", iInstance, i);
+        PDMDevHlpSTAMRegisterF(pDevIns, &pPair->StatTransmitRetries, STAMTYPE_COUNTER, STAMVISIBILITY_USED,   STAMUNIT_OCCURENCES,     "Transmit retries, session busy or out of buffers", "/Devices/VNet%d/Queue%u/TransmitRetries", iInstance, i);
+    }
 #if defined(VBOX_WITH_STATISTICS)
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReceive,            STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL, "Profiling receive",                  "/Devices/VNet%d/Receive/Total", iInstance);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReceiveStore,       STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL, "Profiling receive storing",          "/Devices/VNet%d/Receive/Store", iInstance);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatRxOverflow,         STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_OCCURENCE, "Profiling RX overflows",        "/Devices/VNet%d/RxOverflow", iInstance);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatRxOverflowWakeup,   STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Nr of RX overflow wakeups",          "/Devices/VNet%d/RxOverflowWakeup", iInstance);
-    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatTransmit,           STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL, "Profiling transmits in HC",          "/Devices/VNet%d/Transmit/Total", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatRxSteeringFallback, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Non TCP/UDP frames delivered to another queue, the steered one had no buffers", "/Devices/VNet%d/RxSteeringFallback", iInstance);
+    for (uint32_t i = 0; i < pThis->cQueuePairsMax; i++)
+        PDMDevHlpSTAMRegisterF(pDevIns, &pThis->aQueuePairs[i].StatTransmit, STAMTYPE_PROFILE, STAMVISIBILITY_USED, STAMUNIT_TICKS_PER_CALL, "Profiling transmits in HC", "/Devices/VNet%d/Queue%u/Transmit", iInstance, i);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatTransmitSend,       STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL, "Profiling send transmit in HC",      "/Devices/VNet%d/Transmit/Send", iInstance);
 #endif /* VBOX_WITH_STATISTICS */
 
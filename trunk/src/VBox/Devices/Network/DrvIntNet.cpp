@@ -141,8 +141,27 @@ typedef struct DRVINTNET
     /** Set if data transmission should start immediately and deactivate
      * as late as possible. */
     bool                            fActivateEarlyDeactivateLate;
+    /** Set when EndXmit left committed frames in the send ring for the xmit
+     * thread to push thru the switch within the latency bound. (atomic) */
+    bool volatile                   fXmitFlushDeferred;
     /** Padding. */
-    bool                            afReserved[HC_ARCH_BITS == 64 ? 3 : 3];
+    bool                            afReserved[HC_ARCH_BITS == 64 ? 2 : 2];
+    /** Number of frames committed to the send ring since the last time it was
+     * handed to the switch.  Always accessed while owning the XmitLock. */
+    uint32_t                        cXmitBatched;
+    /** The number of frames in the previous batch handed to the switch. */
+    uint32_t                        cXmitLastBatch;
+    /** The max number of frames to accumulate before handing the send ring to
+     * the switch.  1 means every frame is pushed immediately (no batching). */
+    uint32_t                        cXmitBatchMax;
+    /** Max time (ns) a deferred batch may linger in the send ring.  0 disables
+     * the adaptive deferral and the batch is flushed on EndXmit. */
+    uint32_t                        cNsXmitBatchLatency;
+    /** The time (ns) the receive thread spins on the receive ring before
+     * blocking in ring-0 while frames are arriving.  0 disables polling. */
+    uint32_t                        cNsRecvPollWindow;
+    /** Explicit alignment padding. */
+    uint32_t                        u32Alignment;
     /** Scratch space for holding the ring-0 scatter / gather descriptor.
      * The PDMSCATTERGATHER::fFlags member is used to indicate whether it is in
      * use or not.  Always accessed while owning the XmitLock. */
@@ -168,6 +187,16 @@ typedef struct DRVINTNET
     STAMCOUNTER                     StatXmitWakeupR3;
     /** The times the xmit thread has been told to process the ring. */
     STAMCOUNTER                     StatXmitProcessRing;
+    /** Frames per send ring hand-over to the switch (IntNetR0IfSend call). */
+    STAMPROFILE                     StatXmitFramesPerSend;
+    /** Number of batches flushed by the xmit thread after deferral. */
+    STAMCOUNTER                     StatXmitFlushDeferred;
+    /** Frames per receive ring-0 wait call. */
+    STAMPROFILE                     StatRecvFramesPerWait;
+    /** Number of times the receive polling window found more frames. */
+    STAMCOUNTER                     StatRecvPollHits;
+    /** Number of times the receive polling window expired without frames. */
+    STAMCOUNTER                     StatRecvPollMisses;
 #ifdef VBOX_WITH_STATISTICS
     /** Profiling packet transmit runs. */
     STAMPROFILE                     StatTransmit;
@@ -293,6 +322,14 @@ DECLINLINE(int) drvIntNetProcessXmit(PDRVINTNET pThis)
 {
     Assert(PDMCritSectIsOwner(&pThis->XmitLock));
 
+    uint32_t const cFrames = pThis->cXmitBatched;
+    if (cFrames)
+    {
+        pThis->cXmitBatched   = 0;
+        pThis->cXmitLastBatch = cFrames;
+        STAM_REL_PROFILE_ADD_PERIOD(&pThis->StatXmitFramesPerSend, cFrames);
+    }
+
 #ifdef IN_RING3
     INTNETIFSENDREQ SendReq;
     SendReq.Hdr.u32Magic = SUPVMMR0REQHDR_MAGIC;
@@ -503,11 +540,17 @@ PDMBOTHCBDECL(int) drvIntNetUp_SendBuf(PPDMINETWORKUP pInterface, PPDMSCATTERGAT
     PDMDrvHlpFTSetCheckpoint(pThis->CTX_SUFF(pDrvIns), FTMCHECKPOINTTYPE_NETWORK);
 
     /*
-     * Commit the frame and push it thru the switch.
+     * Commit the frame and push the ring thru the switch once the batch is
+     * full or the ring is getting crowded.  Whatever is left is flushed by
+     * EndXmit (or by the xmit thread in the adaptive mode).
      */
-    PINTNETHDR pHdr = (PINTNETHDR)pSgBuf->pvAllocator;
-    IntNetRingCommitFrameEx(&pThis->CTX_SUFF(pBuf)->Send, pHdr, pSgBuf->cbUsed);
-    int rc = drvIntNetProcessXmit(pThis);
+    PINTNETHDR     pHdr     = (PINTNETHDR)pSgBuf->pvAllocator;
+    PINTNETRINGBUF pRingBuf = &pThis->CTX_SUFF(pBuf)->Send;
+    IntNetRingCommitFrameEx(pRingBuf, pHdr, pSgBuf->cbUsed);
+    int rc = VINF_SUCCESS;
+    if (   ++pThis->cXmitBatched >= pThis->cXmitBatchMax
+        || IntNetRingGetReadable(pRingBuf) >= pThis->CTX_SUFF(pBuf)->cbSend / 2)
+        rc = drvIntNetProcessXmit(pThis);
     STAM_PROFILE_STOP(&pThis->StatTransmit, a);
 
     /*
@@ -529,6 +572,29 @@ PDMBOTHCBDECL(int) drvIntNetUp_SendBuf(PPDMINETWORKUP pInterface, PPDMSCATTERGAT
 PDMBOTHCBDECL(void) drvIntNetUp_EndXmit(PPDMINETWORKUP pInterface)
 {
     PDRVINTNET pThis = RT_FROM_MEMBER(pInterface, DRVINTNET, CTX_SUFF(INetworkUp));
+
+    /*
+     * Flush the frames accumulated by SendBuf.  In the adaptive mode we leave
+     * them in the ring for the xmit thread when the traffic comes in bursts,
+     * letting the switch drain more frames per call at the cost of a bounded
+     * latency.  Single frames and the xmit thread itself flush right away.
+     */
+    if (pThis->cXmitBatched)
+    {
+        if (   pThis->cNsXmitBatchLatency
+            && (pThis->cXmitBatched > 1 || pThis->cXmitLastBatch > 1)
+            && !ASMAtomicUoReadBool(&pThis->fXmitOnXmitThread))
+        {
+            if (!ASMAtomicXchgBool(&pThis->fXmitFlushDeferred, true))
+            {
+                int rc = SUPSemEventSignal(pThis->pSupDrvSession, pThis->hXmitEvt);
+                AssertRC(rc);
+            }
+        }
+        else
+            drvIntNetProcessXmit(pThis);
+    }
+
     ASMAtomicUoWriteBool(&pThis->fXmitOnXmitThread, false);
     PDMCritSectLeave(&pThis->XmitLock);
 }
@@ -598,6 +664,22 @@ static DECLCALLBACK(int) drvR3IntNetXmitThread(PPDMDRVINS pDrvIns, PPDMTHREAD pT
 
     while (pThread->enmState == PDMTHREADSTATE_RUNNING)
     {
+        /*
+         * Flush a deferred batch, giving it up to the latency bound to fill up.
+         */
+        if (ASMAtomicReadBool(&pThis->fXmitFlushDeferred))
+        {
+            int rc = SUPSemEventWaitNsRelIntr(pThis->pSupDrvSession, pThis->hXmitEvt, pThis->cNsXmitBatchLatency);
+            AssertLogRelMsgReturn(RT_SUCCESS(rc) || rc == VERR_TIMEOUT || rc == VERR_INTERRUPTED, ("%Rrc\n", rc), rc);
+
+            STAM_REL_COUNTER_INC(&pThis->StatXmitFlushDeferred);
+            PDMCritSectEnter(&pThis->XmitLock, VERR_IGNORED);
+            ASMAtomicWriteBool(&pThis->fXmitFlushDeferred, false);
+            if (pThis->cXmitBatched)
+                drvIntNetProcessXmit(pThis);
+            PDMCritSectLeave(&pThis->XmitLock);
+        }
+
         /*
          * Transmit any pending packets.
          */
@@ -688,14 +770,17 @@ static int drvR3IntNetRecvRun(PDRVINTNET pThis)
     STAM_PROFILE_ADV_START(&pThis->StatReceive, a);
     PINTNETBUF      pBuf     = pThis->CTX_SUFF(pBuf);
     PINTNETRINGBUF  pRingBuf = &pBuf->Recv;
+    uint32_t        cFrames  = 0;
     for (;;)
     {
         /*
          * Process the receive buffer.
          */
+        uint32_t const cFramesStart = cFrames;
         PINTNETHDR pHdr;
         while ((pHdr = IntNetRingGetNextFrameToRead(pRingBuf)) != NULL)
         {
+            cFrames++;
             /*
              * Check the state and then inspect the packet.
              */
@@ -850,6 +935,33 @@ static int drvR3IntNetRecvRun(PDRVINTNET pThis)
             LogFlow(("drvR3IntNetRecvRun: returns VINF_SUCCESS (state changed - #1)\n"));
             return VERR_STATE_CHANGED;
         }
+
+        /*
+         * While frames keep arriving, spin on the ring for a little while
+         * before blocking so a busy interface doesn't pay for a ring-0 wait
+         * (and the wakeup) per burst.
+         */
+        if (   pThis->cNsRecvPollWindow
+            && cFrames != cFramesStart)
+        {
+            uint64_t const nsStart = RTTimeNanoTS();
+            while (   !IntNetRingHasMoreToRead(pRingBuf)
+                   && RTTimeNanoTS() - nsStart < pThis->cNsRecvPollWindow
+                   && pThis->enmRecvState == RECVSTATE_RUNNING)
+                ASMNopPause();
+            if (IntNetRingHasMoreToRead(pRingBuf))
+            {
+                STAM_REL_COUNTER_INC(&pThis->StatRecvPollHits);
+                continue;
+            }
+            STAM_REL_COUNTER_INC(&pThis->StatRecvPollMisses);
+        }
+        if (cFrames)
+        {
+            STAM_REL_PROFILE_ADD_PERIOD(&pThis->StatRecvFramesPerWait, cFrames);
+            cFrames = 0;
+        }
+
         INTNETIFWAITREQ WaitReq;
         WaitReq.Hdr.u32Magic = SUPVMMR0REQHDR_MAGIC;
         WaitReq.Hdr.cbReq    = sizeof(WaitReq);
@@ -1241,6 +1353,11 @@ static DECLCALLBACK(void) drvR3IntNetDestruct(PPDMDRVINS pDrvIns)
         PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatXmitWakeupR0);
         PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatXmitWakeupR3);
         PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatXmitProcessRing);
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatXmitFramesPerSend);
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatXmitFlushDeferred);
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatRecvFramesPerWait);
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatRecvPollHits);
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatRecvPollMisses);
     }
 
     /*
@@ -1408,6 +1525,9 @@ static DECLCALLBACK(int) drvR3IntNetConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg
                                   "|TrunkPolicyHost"
                                   "|TrunkPolicyWire"
                                   "|IsService"
+                                  "|XmitBatchMax"
+                                  "|XmitBatchLatency"
+                                  "|RecvPollWindow"
                                   "|IgnoreConnectFailure"
                                   "|Workaround1",
                                   "");
@@ -1666,6 +1786,54 @@ static DECLCALLBACK(int) drvR3IntNetConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg
         return PDMDRV_SET_ERROR(pDrvIns, rc,
                                 N_("Configuration error: Failed to get the \"IsService\" value"));
 
+    /** @cfgm{XmitBatchMax, uint32_t, 32}
+     * The max number of frames to commit to the send ring before handing it to
+     * the switch.  The batch is flushed at the latest when the device ends the
+     * transmit run.  1 pushes every frame immediately.
+     */
+    rc = CFGMR3QueryU32Def(pCfg, "XmitBatchMax", &pThis->cXmitBatchMax, 32);
+    if (RT_FAILURE(rc))
+        return PDMDRV_SET_ERROR(pDrvIns, rc,
+                                N_("Configuration error: Failed to get the \"XmitBatchMax\" value"));
+    if (pThis->cXmitBatchMax < 1 || pThis->cXmitBatchMax > 1024)
+        return PDMDrvHlpVMSetError(pDrvIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("Configuration error: \"XmitBatchMax\" must be in the range 1..1024, not %u"),
+                                   pThis->cXmitBatchMax);
+
+    /** @cfgm{XmitBatchLatency, uint32_t, 0}
+     * Enables the adaptive batching mode and specifies how long (in
+     * microseconds) bursty traffic may be held back in the send ring so the
+     * switch can drain more frames per call.  0 disables it.
+     */
+    uint32_t cUsXmitBatchLatency;
+    rc = CFGMR3QueryU32Def(pCfg, "XmitBatchLatency", &cUsXmitBatchLatency, 0);
+    if (RT_FAILURE(rc))
+        return PDMDRV_SET_ERROR(pDrvIns, rc,
+                                N_("Configuration error: Failed to get the \"XmitBatchLatency\" value"));
+    if (cUsXmitBatchLatency > RT_US_1SEC)
+        return PDMDrvHlpVMSetError(pDrvIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("Configuration error: \"XmitBatchLatency\" must not exceed 1000000 us, not %u"),
+                                   cUsXmitBatchLatency);
+    pThis->cNsXmitBatchLatency = cUsXmitBatchLatency * RT_NS_1US;
+
+    /** @cfgm{RecvPollWindow, uint32_t, 0}
+     * How long (in microseconds) the receive thread polls the receive ring for
+     * more frames before blocking in ring-0 while under load.  This trades CPU
+     * time for lower wakeup latency.  0 disables polling.
+     */
+    uint32_t cUsRecvPollWindow;
+    rc = CFGMR3QueryU32Def(pCfg, "RecvPollWindow", &cUsRecvPollWindow, 0);
+    if (RT_FAILURE(rc))
+        return PDMDRV_SET_ERROR(pDrvIns, rc,
+                                N_("Configuration error: Failed to get the \"RecvPollWindow\" value"));
+    if (cUsRecvPollWindow > RT_US_1SEC)
+        return PDMDrvHlpVMSetError(pDrvIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("Configuration error: \"RecvPollWindow\" must not exceed 1000000 us, not %u"),
+                                   cUsRecvPollWindow);
+    pThis->cNsRecvPollWindow = cUsRecvPollWindow * RT_NS_1US;
+    LogRel(("IntNet#%u: XmitBatchMax=%u XmitBatchLatency=%uus RecvPollWindow=%uus\n",
+            pDrvIns->iInstance, pThis->cXmitBatchMax, cUsXmitBatchLatency, cUsRecvPollWindow));
+
 
     /** @cfgm{IgnoreConnectFailure, boolean, false}
      * When set only raise a runtime error if we cannot connect to the internal
@@ -1818,6 +1986,11 @@ static DECLCALLBACK(int) drvR3IntNetConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg
     PDMDrvHlpSTAMRegCounter(pDrvIns, &pThis->StatXmitWakeupR0,           "XmitWakeup-R0",        "Xmit thread wakeups from ring-0.");
     PDMDrvHlpSTAMRegCounter(pDrvIns, &pThis->StatXmitWakeupR3,           "XmitWakeup-R3",        "Xmit thread wakeups from ring-3.");
     PDMDrvHlpSTAMRegCounter(pDrvIns, &pThis->StatXmitProcessRing,        "XmitProcessRing",      "Time xmit thread was told to process the ring.");
+    PDMDrvHlpSTAMRegProfileEx(pDrvIns, &pThis->StatXmitFramesPerSend,  "XmitFramesPerSend",    STAMUNIT_COUNT, "Frames per send ring hand-over to the switch.");
+    PDMDrvHlpSTAMRegCounter(pDrvIns, &pThis->StatXmitFlushDeferred,      "XmitFlushDeferred",    "Batches flushed by the xmit thread after deferral.");
+    PDMDrvHlpSTAMRegProfileEx(pDrvIns, &pThis->StatRecvFramesPerWait,  "RecvFramesPerWait",    STAMUNIT_COUNT, "Frames received per ring-0 wait call.");
+    PDMDrvHlpSTAMRegCounter(pDrvIns, &pThis->StatRecvPollHits,           "RecvPollHits",         "Times the receive polling window found more frames.");
+    PDMDrvHlpSTAMRegCounter(pDrvIns, &pThis->StatRecvPollMisses,         "RecvPollMisses",       "Times the receive polling window expired empty.");
 
     /*
      * Create the async I/O threads.
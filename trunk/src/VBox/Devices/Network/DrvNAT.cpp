@@ -806,7 +806,44 @@ static DECLCALLBACK(int) drvNATAsyncIoThread(PPDMDRVINS pDrvIns, PPDMTHREAD pThr
         /*
          * To prevent concurrent execution of sending/receiving threads
          */
-#ifndef RT_OS_WINDOWS
+#ifdef VBOX_NAT_WITH_EPOLL
+        /*
+         * The socket interest set lives in slirp's epoll descriptor, so there
+         * is nothing to allocate here and only ready sockets are handed back.
+         */
+        bool fWakeup = false;
+        slirp_select_fill(pThis->pNATState, &nFDs);
+
+        int cChangedFDs = slirp_select_wait(pThis->pNATState, slirp_get_timeout_ms(pThis->pNATState), &fWakeup);
+        if (cChangedFDs < 0)
+        {
+            if (errno == EINTR)
+            {
+                Log2(("NAT: signal was caught while sleep on epoll_wait\n"));
+                cChangedFDs = 0;
+            }
+            else if (cPollNegRet++ > 128)
+            {
+                LogRel(("NAT: epoll_wait returns (%s) suppressed %d\n", strerror(errno), cPollNegRet));
+                cPollNegRet = 0;
+            }
+        }
+
+        if (cChangedFDs >= 0)
+        {
+            slirp_select_poll(pThis->pNATState);
+            if (fWakeup)
+            {
+                /* drain the pipe, see the poll() variant below */
+                char ch;
+                size_t cbRead;
+                RTPipeRead(pThis->hPipeRead, &ch, 1, &cbRead);
+            }
+        }
+        /* process _all_ outstanding requests but don't wait */
+        RTReqQueueProcess(pThis->hSlirpReqQueue, 0);
+
+#elif !defined(RT_OS_WINDOWS)
         nFDs = slirp_get_nsock(pThis->pNATState);
         /* allocation for all sockets + Management pipe */
         struct pollfd *polls = (struct pollfd *)RTMemAlloc((1 + nFDs) * sizeof(struct pollfd) + sizeof(uint32_t));
@@ -1745,6 +1782,10 @@ static DECLCALLBACK(int) drvNATConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uin
              */
             rc = RTPipeCreate(&pThis->hPipeRead, &pThis->hPipeWrite, 0 /*fFlags*/);
             AssertRCReturn(rc, rc);
+# ifdef VBOX_NAT_WITH_EPOLL
+            rc = slirp_register_wakeup_fd(pThis->pNATState, (int)RTPipeToNative(pThis->hPipeRead));
+            AssertRCReturn(rc, rc);
+# endif
 #else
             pThis->hWakeupEvent = CreateEvent(NULL, FALSE, FALSE, NULL); /* auto-reset event */
             slirp_register_external_event(pThis->pNATState, pThis->hWakeupEvent,
@@ -30,6 +30,7 @@
 #include <iprt/ctype.h>
 #include <iprt/file.h>
 #include <iprt/mem.h>
+#include <iprt/net.h>
 #include <iprt/path.h>
 #include <iprt/pipe.h>
 #include <iprt/semaphore.h>
@@ -61,15 +62,59 @@
 #else
 # include <sys/fcntl.h>
 #endif
+#ifdef RT_OS_LINUX
+# include <sys/uio.h>
+# include <net/if.h>
+# include <linux/if_tun.h>
+#endif
 #include <errno.h>
 #include <unistd.h>
 
 #include "VBoxDD.h"
 
 
+/*********************************************************************************************************************************
+*   Defined Constants And Macros                                                                                                 *
+*********************************************************************************************************************************/
+/** The max number of frames the I/O thread reads per poll() wakeup. */
+#define DRVTAP_RECV_BATCH_MAX       64
+/** The size of the receive buffer for plain frames. */
+#define DRVTAP_RECV_BUF_SIZE        16384
+#ifdef RT_OS_LINUX
+/** The size of the receive buffer when the kernel may hand us GSO frames. */
+# define DRVTAP_RECV_BUF_SIZE_GSO   RT_ALIGN_Z(sizeof(DRVTAPVNETHDR) + _64K + 128, _1K)
+
+/** @name Virtio-net header flags and GSO types (see DRVTAPVNETHDR).
+ * @{ */
+# define DRVTAP_VNETHDR_F_NEEDS_CSUM    1
+# define DRVTAP_VNETHDR_GSO_NONE        0
+# define DRVTAP_VNETHDR_GSO_TCPV4       1
+# define DRVTAP_VNETHDR_GSO_TCPV6       4
+# define DRVTAP_VNETHDR_GSO_ECN         0x80
+/** @} */
+#endif
+
+
 /*********************************************************************************************************************************
 *   Structures and Typedefs                                                                                                      *
 *********************************************************************************************************************************/
+#ifdef RT_OS_LINUX
+/**
+ * The virtio-net header preceding each frame on a TAP descriptor with
+ * IFF_VNET_HDR set (struct virtio_net_hdr; linux/virtio_net.h isn't C++ safe).
+ */
+typedef struct DRVTAPVNETHDR
+{
+    uint8_t  u8Flags;
+    uint8_t  u8GSOType;
+    uint16_t u16HdrLen;
+    uint16_t u16GSOSize;
+    uint16_t u16CSumStart;
+    uint16_t u16CSumOffset;
+} DRVTAPVNETHDR;
+AssertCompileSize(DRVTAPVNETHDR, 10);
+#endif
+
 /**
  * TAP driver instance data.
  *
@@ -103,6 +148,18 @@ typedef struct DRVTAP
     RTPIPE                  hPipeRead;
     /** Reader thread. */
     PPDMTHREAD              pThread;
+    /** The receive buffer used by the reader thread. */
+    uint8_t                *pbRecvBuf;
+    /** The size of the receive buffer. */
+    size_t                  cbRecvBuf;
+#ifdef RT_OS_LINUX
+    /** Set if we opened the TAP device ourselves and must close it. */
+    bool                    fOwnDevice;
+    /** Set if every frame is preceded by a virtio-net header (IFF_VNET_HDR). */
+    bool                    fVNetHdr;
+    /** Set if GSO frames are passed to and taken from the kernel as-is. */
+    bool                    fOffload;
+#endif
 
     /** @todo The transmit thread. */
     /** Transmit lock used by drvTAPNetworkUp_BeginXmit. */
@@ -117,6 +174,12 @@ typedef struct DRVTAP
     STAMCOUNTER             StatPktRecv;
     /** Number of received bytes. */
     STAMCOUNTER             StatPktRecvBytes;
+    /** Number of GSO frames handed to the kernel without segmenting. */
+    STAMCOUNTER             StatPktSentGso;
+    /** Number of GSO frames received from the kernel. */
+    STAMCOUNTER             StatPktRecvGso;
+    /** Frames read per poll() wakeup. */
+    STAMPROFILE             StatRecvBatch;
     /** Profiling packet transmit runs. */
     STAMPROFILE             StatTransmit;
     /** Profiling packet receive runs. */
@@ -232,6 +295,98 @@ static DECLCALLBACK(int) drvTAPNetworkUp_FreeBuf(PPDMINETWORKUP pInterface, PPDM
 }
 
 
+#ifdef RT_OS_LINUX
+/**
+ * Writes a frame preceded by a virtio-net header to the TAP device.
+ *
+ * @returns VBox status code.
+ * @param   pThis           The instance data.
+ * @param   pVNetHdr        The virtio-net header.
+ * @param   pvFrame         The frame.
+ * @param   cbFrame         The frame size.
+ */
+static int drvTAPLinuxWriteVNetFrame(PDRVTAP pThis, DRVTAPVNETHDR const *pVNetHdr, const void *pvFrame, size_t cbFrame)
+{
+    struct iovec aSegs[2];
+    aSegs[0].iov_base = (void *)pVNetHdr;
+    aSegs[0].iov_len  = sizeof(*pVNetHdr);
+    aSegs[1].iov_base = (void *)pvFrame;
+    aSegs[1].iov_len  = cbFrame;
+    if (writev(RTFileToNative(pThis->hFileDevice), &aSegs[0], RT_ELEMENTS(aSegs)) >= 0)
+        return VINF_SUCCESS;
+    return RTErrConvertFromErrno(errno);
+}
+
+
+/**
+ * Tries to hand a GSO frame to the kernel in one go, letting it do the
+ * segmentation (and checksumming) instead of carving it up here.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_NOT_SUPPORTED if the frame must be segmented by the caller.
+ * @param   pThis           The instance data.
+ * @param   pGso            The GSO context.
+ * @param   pvFrame         The GSO frame.
+ * @param   cbFrame         The frame size.
+ */
+static int drvTAPLinuxSendGso(PDRVTAP pThis, PCPDMNETWORKGSO pGso, void *pvFrame, size_t cbFrame)
+{
+    if (!pThis->fOffload)
+        return VERR_NOT_SUPPORTED;
+
+    DRVTAPVNETHDR VNetHdr;
+    RT_ZERO(VNetHdr);
+    switch ((PDMNETWORKGSOTYPE)pGso->u8Type)
+    {
+        case PDMNETWORKGSOTYPE_IPV4_TCP:
+            VNetHdr.u8GSOType     = DRVTAP_VNETHDR_GSO_TCPV4;
+            VNetHdr.u16CSumOffset = RT_OFFSETOF(RTNETTCP, th_sum);
+            break;
+        case PDMNETWORKGSOTYPE_IPV6_TCP:
+            VNetHdr.u8GSOType     = DRVTAP_VNETHDR_GSO_TCPV6;
+            VNetHdr.u16CSumOffset = RT_OFFSETOF(RTNETTCP, th_sum);
+            break;
+        default:
+            /* UFO is gone from recent kernels and 6in4 has no virtio-net encoding. */
+            return VERR_NOT_SUPPORTED;
+    }
+    VNetHdr.u8Flags      = DRVTAP_VNETHDR_F_NEEDS_CSUM;
+    VNetHdr.u16HdrLen    = pGso->cbHdrsTotal;
+    VNetHdr.u16GSOSize   = pGso->cbMaxSeg;
+    VNetHdr.u16CSumStart = pGso->offHdr2;
+
+    /* The kernel wants sane IP lengths and the pseudo header checksum in the TCP header. */
+    PDMNetGsoPrepForDirectUse(pGso, pvFrame, cbFrame, PDMNETCSUMTYPE_PSEUDO);
+    int rc = drvTAPLinuxWriteVNetFrame(pThis, &VNetHdr, pvFrame, cbFrame);
+    if (RT_SUCCESS(rc))
+        STAM_COUNTER_INC(&pThis->StatPktSentGso);
+    return rc;
+}
+#endif /* RT_OS_LINUX */
+
+
+/**
+ * Writes a single frame to the TAP device.
+ *
+ * @returns VBox status code.
+ * @param   pThis           The instance data.
+ * @param   pvFrame         The frame.
+ * @param   cbFrame         The frame size.
+ */
+static int drvTAPWriteFrame(PDRVTAP pThis, const void *pvFrame, size_t cbFrame)
+{
+#ifdef RT_OS_LINUX
+    if (pThis->fVNetHdr)
+    {
+        DRVTAPVNETHDR VNetHdr;
+        RT_ZERO(VNetHdr);
+        return drvTAPLinuxWriteVNetFrame(pThis, &VNetHdr, pvFrame, cbFrame);
+    }
+#endif
+    return RTFileWrite(pThis->hFileDevice, pvFrame, cbFrame, NULL);
+}
+
+
 /**
  * @interface_method_impl{PDMINETWORKUP,pfnSendBuf}
  */
@@ -263,23 +418,29 @@ static DECLCALLBACK(int) drvTAPNetworkUp_SendBuf(PPDMINETWORKUP pInterface, PPDM
               "%.*Rhxd\n",
               pSgBuf->aSegs[0].pvSeg, pSgBuf->cbUsed, pSgBuf->cbUsed, pSgBuf->aSegs[0].pvSeg));
 
-        rc = RTFileWrite(pThis->hFileDevice, pSgBuf->aSegs[0].pvSeg, pSgBuf->cbUsed, NULL);
+        rc = drvTAPWriteFrame(pThis, pSgBuf->aSegs[0].pvSeg, pSgBuf->cbUsed);
     }
     else
     {
         uint8_t         abHdrScratch[256];
         uint8_t const  *pbFrame = (uint8_t const *)pSgBuf->aSegs[0].pvSeg;
         PCPDMNETWORKGSO pGso    = (PCPDMNETWORKGSO)pSgBuf->pvUser;
-        uint32_t const  cSegs   = PDMNetGsoCalcSegmentCount(pGso, pSgBuf->cbUsed);  Assert(cSegs > 1);
-        rc = VINF_SUCCESS;
-        for (size_t iSeg = 0; iSeg < cSegs; iSeg++)
+#ifdef RT_OS_LINUX
+        rc = drvTAPLinuxSendGso(pThis, pGso, pSgBuf->aSegs[0].pvSeg, pSgBuf->cbUsed);
+        if (rc == VERR_NOT_SUPPORTED)
+#endif
         {
-            uint32_t cbSegFrame;
-            void *pvSegFrame = PDMNetGsoCarveSegmentQD(pGso, (uint8_t *)pbFrame, pSgBuf->cbUsed, abHdrScratch,
-                                                       iSeg, cSegs, &cbSegFrame);
-            rc = RTFileWrite(pThis->hFileDevice, pvSegFrame, cbSegFrame, NULL);
-            if (RT_FAILURE(rc))
-                break;
+            uint32_t const  cSegs   = PDMNetGsoCalcSegmentCount(pGso, pSgBuf->cbUsed);  Assert(cSegs > 1);
+            rc = VINF_SUCCESS;
+            for (size_t iSeg = 0; iSeg < cSegs; iSeg++)
+            {
+                uint32_t cbSegFrame;
+                void *pvSegFrame = PDMNetGsoCarveSegmentQD(pGso, (uint8_t *)pbFrame, pSgBuf->cbUsed, abHdrScratch,
+                                                           iSeg, cSegs, &cbSegFrame);
+                rc = drvTAPWriteFrame(pThis, pvSegFrame, cbSegFrame);
+                if (RT_FAILURE(rc))
+                    break;
+            }
         }
     }
 
@@ -330,6 +491,126 @@ static DECLCALLBACK(void) drvTAPNetworkUp_NotifyLinkChanged(PPDMINETWORKUP pInte
 }
 
 
+/**
+ * Waits for the device above to have room for another frame.
+ *
+ * @returns VBox status code, failure if woken up by a VM state transition.
+ * @param   pThis           The instance data.
+ */
+static int drvTAPRecvWaitForSpace(PDRVTAP pThis)
+{
+    STAM_PROFILE_ADV_STOP(&pThis->StatReceive, a);
+    int rc = pThis->pIAboveNet->pfnWaitReceiveAvail(pThis->pIAboveNet, RT_INDEFINITE_WAIT);
+    STAM_PROFILE_ADV_START(&pThis->StatReceive, a);
+    return rc;
+}
+
+
+#ifdef RT_OS_LINUX
+/**
+ * Passes a frame preceded by a virtio-net header up the driver chain.
+ *
+ * GSO frames are handed over as-is if the device above can take them,
+ * otherwise they are segmented here.  Frames with a partial checksum get
+ * their checksum completed.
+ *
+ * The caller has already waited for room for the first frame.
+ *
+ * @returns VBox status code, failure if woken up by a VM state transition.
+ * @param   pThis           The instance data.
+ * @param   pbBuf           The data read from the TAP device.
+ * @param   cbBuf           The number of bytes read.
+ */
+static int drvTAPLinuxRecvVNetFrame(PDRVTAP pThis, uint8_t *pbBuf, size_t cbBuf)
+{
+    if (cbBuf < sizeof(DRVTAPVNETHDR) + sizeof(RTNETETHERHDR))
+        return VINF_SUCCESS; /* runt, drop it */
+
+    DRVTAPVNETHDR const *pVNetHdr = (DRVTAPVNETHDR const *)pbBuf;
+    uint8_t        *pbFrame    = pbBuf + sizeof(*pVNetHdr);
+    size_t const    cbFrame    = cbBuf - sizeof(*pVNetHdr);
+    uint16_t const  offCSum    = pVNetHdr->u16CSumStart;
+    bool const      fNeedsCSum = RT_BOOL(pVNetHdr->u8Flags & DRVTAP_VNETHDR_F_NEEDS_CSUM);
+
+    uint8_t const   u8GsoType  = pVNetHdr->u8GSOType & ~DRVTAP_VNETHDR_GSO_ECN;
+    if (u8GsoType != DRVTAP_VNETHDR_GSO_NONE)
+    {
+        /*
+         * Set up the GSO context.  The kernel's hdr_len may cover more than
+         * the headers, so take the header length from the TCP header itself.
+         */
+        PDMNETWORKGSO Gso;
+        Gso.u8Type      = u8GsoType == DRVTAP_VNETHDR_GSO_TCPV4 ? PDMNETWORKGSOTYPE_IPV4_TCP
+                        : u8GsoType == DRVTAP_VNETHDR_GSO_TCPV6 ? PDMNETWORKGSOTYPE_IPV6_TCP
+                        :                                         PDMNETWORKGSOTYPE_INVALID;
+        Gso.offHdr1     = sizeof(RTNETETHERHDR);
+        Gso.offHdr2     = (uint8_t)offCSum;
+        Gso.cbMaxSeg    = pVNetHdr->u16GSOSize;
+        Gso.cbHdrsTotal = 0;
+        if (   fNeedsCSum
+            && offCSum <= UINT8_MAX
+            && (size_t)offCSum + sizeof(RTNETTCP) <= cbFrame)
+        {
+            PCRTNETTCP pTcpHdr = (PCRTNETTCP)(pbFrame + offCSum);
+            if ((unsigned)offCSum + pTcpHdr->th_off * 4 <= UINT8_MAX)
+                Gso.cbHdrsTotal = (uint8_t)(offCSum + pTcpHdr->th_off * 4);
+        }
+        Gso.cbHdrsSeg   = Gso.cbHdrsTotal;
+        if (!PDMNetGsoIsValid(&Gso, sizeof(Gso), cbFrame))
+        {
+            LogRelMax(16, ("TAP#%u: Dropping invalid GSO frame: type=%#x csum_start=%#x gso_size=%#x cbFrame=%#zx\n",
+                           pThis->pDrvIns->iInstance, pVNetHdr->u8GSOType, offCSum, pVNetHdr->u16GSOSize, cbFrame));
+            return VINF_SUCCESS;
+        }
+        STAM_COUNTER_INC(&pThis->StatPktRecvGso);
+
+        if (   pThis->pIAboveNet->pfnReceiveGso
+            && RT_SUCCESS(pThis->pIAboveNet->pfnReceiveGso(pThis->pIAboveNet, pbFrame, cbFrame, &Gso)))
+            return VINF_SUCCESS;
+
+        /*
+         * The device doesn't do LRO, so segment it here.
+         */
+        uint8_t         abHdrScratch[256];
+        uint32_t const  cSegs = PDMNetGsoCalcSegmentCount(&Gso, cbFrame);
+        for (uint32_t iSeg = 0; iSeg < cSegs; iSeg++)
+        {
+            uint32_t cbSegFrame;
+            void    *pvSegFrame = PDMNetGsoCarveSegmentQD(&Gso, pbFrame, cbFrame, abHdrScratch, iSeg, cSegs, &cbSegFrame);
+            if (iSeg > 0)
+            {
+                int rc = drvTAPRecvWaitForSpace(pThis);
+                if (RT_FAILURE(rc))
+                    return rc; /* we drop the rest. */
+            }
+            int rc = pThis->pIAboveNet->pfnReceive(pThis->pIAboveNet, pvSegFrame, cbSegFrame);
+            AssertRC(rc);
+        }
+        return VINF_SUCCESS;
+    }
+
+    /*
+     * Complete the checksum the kernel left for the (virtual) hardware to do.
+     */
+    if (fNeedsCSum)
+    {
+        size_t const offCSumField = (size_t)offCSum + pVNetHdr->u16CSumOffset;
+        if (   offCSum < cbFrame
+            && (size_t)offCSumField + sizeof(uint16_t) <= cbFrame)
+        {
+            bool fOdd = false;
+            uint32_t u32Sum = RTNetIPv4AddDataChecksum(pbFrame + offCSum, cbFrame - offCSum, 0, &fOdd);
+            *(uint16_t *)(pbFrame + offCSumField) = RTNetIPv4FinalizeChecksum(u32Sum);
+        }
+    }
+
+    int rc = pThis->pIAboveNet->pfnReceive(pThis->pIAboveNet, pbFrame, cbFrame);
+    AssertRC(rc);
+    return VINF_SUCCESS;
+}
+#endif /* RT_OS_LINUX */
+
+
 /**
  * Asynchronous I/O thread for handling receive.
  *
@@ -376,16 +657,20 @@ static DECLCALLBACK(int) drvTAPAsyncIoThread(PPDMDRVINS pDrvIns, PPDMTHREAD pThr
             &&  !aFDs[1].revents)
         {
             /*
-             * Read the frame.
+             * Read the frames.  The descriptor is non-blocking, so keep reading
+             * until the kernel runs dry or the batch is full before going back
+             * to poll().
              */
-            char achBuf[16384];
-            size_t cbRead = 0;
-            /** @note At least on Linux we will never receive more than one network packet
-             *        after poll() returned successfully. I don't know why but a second
-             *        RTFileRead() operation will return with VERR_TRY_AGAIN in any case. */
-            rc = RTFileRead(pThis->hFileDevice, achBuf, sizeof(achBuf), &cbRead);
-            if (RT_SUCCESS(rc))
+            uint32_t cFrames = 0;
+            while (   cFrames < DRVTAP_RECV_BATCH_MAX
+                   && pThread->enmState == PDMTHREADSTATE_RUNNING)
             {
+                size_t cbRead = 0;
+                rc = RTFileRead(pThis->hFileDevice, pThis->pbRecvBuf, pThis->cbRecvBuf, &cbRead);
+                if (RT_FAILURE(rc))
+                    break;
+                cFrames++;
+
                 /*
                  * Wait for the device to have space for this frame.
                  * Most guests use frame-sized receive buffers, hence non-zero cbMax
@@ -399,16 +684,14 @@ static DECLCALLBACK(int) drvTAPAsyncIoThread(PPDMDRVINS pDrvIns, PPDMTHREAD pThr
                  *    of deadlocking because the guest could be waiting for a receive
                  *    overflow error to allocate more receive buffers
                  */
-                STAM_PROFILE_ADV_STOP(&pThis->StatReceive, a);
-                int rc1 = pThis->pIAboveNet->pfnWaitReceiveAvail(pThis->pIAboveNet, RT_INDEFINITE_WAIT);
-                STAM_PROFILE_ADV_START(&pThis->StatReceive, a);
+                int rc1 = drvTAPRecvWaitForSpace(pThis);
 
                 /*
                  * A return code != VINF_SUCCESS means that we were woken up during a VM
                  * state transition. Drop the packet and wait for the next one.
                  */
                 if (RT_FAILURE(rc1))
-                    continue;
+                    break;
 
                 /*
                  * Pass the data up.
@@ -419,12 +702,25 @@ static DECLCALLBACK(int) drvTAPAsyncIoThread(PPDMDRVINS pDrvIns, PPDMTHREAD pThr
                          cbRead, u64Now, u64Now - pThis->u64LastReceiveTS, u64Now - pThis->u64LastTransferTS));
                 pThis->u64LastReceiveTS = u64Now;
 #endif
-                Log2(("drvTAPAsyncIoThread: cbRead=%#x\n" "%.*Rhxd\n", cbRead, cbRead, achBuf));
+                Log2(("drvTAPAsyncIoThread: cbRead=%#x\n" "%.*Rhxd\n", cbRead, cbRead, pThis->pbRecvBuf));
                 STAM_COUNTER_INC(&pThis->StatPktRecv);
                 STAM_COUNTER_ADD(&pThis->StatPktRecvBytes, cbRead);
-                rc1 = pThis->pIAboveNet->pfnReceive(pThis->pIAboveNet, achBuf, cbRead);
-                AssertRC(rc1);
+#ifdef RT_OS_LINUX
+                if (pThis->fVNetHdr)
+                {
+                    rc1 = drvTAPLinuxRecvVNetFrame(pThis, pThis->pbRecvBuf, cbRead);
+                    if (RT_FAILURE(rc1))
+                        break;
+                }
+                else
+#endif
+                {
+                    rc1 = pThis->pIAboveNet->pfnReceive(pThis->pIAboveNet, pThis->pbRecvBuf, cbRead);
+                    AssertRC(rc1);
+                }
             }
+            if (cFrames)
+                STAM_PROFILE_ADD_PERIOD(&pThis->StatRecvBatch, cFrames);
             else
             {
                 LogFlow(("drvTAPAsyncIoThread: RTFileRead -> %Rrc\n", rc));
@@ -750,6 +1046,86 @@ static DECLCALLBACK(int) SolarisTAPAttach(PDRVTAP pThis)
 
 #endif  /* RT_OS_SOLARIS */
 
+#ifdef RT_OS_LINUX
+/**
+ * Opens /dev/net/tun and attaches it to the configured TAP interface.
+ *
+ * Used when we're not handed a descriptor by the frontend.
+ *
+ * @returns VBox status code.
+ * @param   pThis           The instance data.
+ * @param   fVNetHdr        Whether to ask for a virtio-net header with every
+ *                          frame (needed for offloading).
+ */
+static int drvTAPLinuxOpenDevice(PDRVTAP pThis, bool fVNetHdr)
+{
+    int rc = RTFileOpen(&pThis->hFileDevice, "/dev/net/tun", RTFILE_O_READWRITE | RTFILE_O_OPEN | RTFILE_O_DENY_NONE);
+    if (RT_FAILURE(rc))
+        return PDMDrvHlpVMSetError(pThis->pDrvIns, rc, RT_SRC_POS,
+                                   N_("Failed to open /dev/net/tun. rc=%Rrc"), rc);
+    pThis->fOwnDevice = true;
+
+    struct ifreq IfReq;
+    RT_ZERO(IfReq);
+    rc = RTStrCopy(IfReq.ifr_name, sizeof(IfReq.ifr_name), pThis->pszDeviceName);
+    if (RT_FAILURE(rc))
+        return PDMDrvHlpVMSetError(pThis->pDrvIns, VERR_HOSTIF_DEVICE_NAME_TOO_LONG, RT_SRC_POS,
+                                   N_("The TAP interface name '%s' is too long"), pThis->pszDeviceName);
+    IfReq.ifr_flags = IFF_TAP | IFF_NO_PI | (fVNetHdr ? IFF_VNET_HDR : 0);
+    if (ioctl(RTFileToNative(pThis->hFileDevice), TUNSETIFF, &IfReq) != 0)
+        return PDMDrvHlpVMSetError(pThis->pDrvIns, VERR_HOSTIF_INIT_FAILED, RT_SRC_POS,
+                                   N_("Failed to attach to the TAP interface '%s'. errno=%d"), pThis->pszDeviceName, errno);
+
+    LogRel(("TAP#%u: Attached to '%s'\n", pThis->pDrvIns->iInstance, pThis->pszDeviceName));
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Configures the virtio-net header and the kernel offloads if the TAP
+ * descriptor was set up with IFF_VNET_HDR.
+ *
+ * @returns VBox status code.
+ * @param   pThis           The instance data.
+ * @param   fOffload        Whether GSO and checksum offloading is wanted.
+ */
+static int drvTAPLinuxSetupOffload(PDRVTAP pThis, bool fOffload)
+{
+    int const fd = (int)RTFileToNative(pThis->hFileDevice);
+
+    struct ifreq IfReq;
+    RT_ZERO(IfReq);
+    if (ioctl(fd, TUNGETIFF, &IfReq) != 0)
+    {
+        LogRel(("TAP#%u: TUNGETIFF failed (errno=%d), assuming plain frames\n", pThis->pDrvIns->iInstance, errno));
+        return VINF_SUCCESS;
+    }
+    pThis->fVNetHdr = RT_BOOL(IfReq.ifr_flags & IFF_VNET_HDR);
+    if (!pThis->fVNetHdr)
+        return VINF_SUCCESS;
+
+    int cbVNetHdr = sizeof(DRVTAPVNETHDR);
+    if (ioctl(fd, TUNSETVNETHDRSZ, &cbVNetHdr) != 0)
+        return PDMDrvHlpVMSetError(pThis->pDrvIns, VERR_HOSTIF_IOCTL, RT_SRC_POS,
+                                   N_("Failed to set the virtio-net header size of the TAP device. errno=%d"), errno);
+
+    /* What the kernel may hand us; what we send is up to us. */
+    unsigned long fTunOffloads = fOffload ? TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 : 0;
+    if (ioctl(fd, TUNSETOFFLOAD, fTunOffloads) != 0)
+    {
+        LogRel(("TAP#%u: TUNSETOFFLOAD(%#lx) failed (errno=%d), receiving plain frames\n",
+                pThis->pDrvIns->iInstance, fTunOffloads, errno));
+        fTunOffloads = 0;
+        ioctl(fd, TUNSETOFFLOAD, fTunOffloads);
+    }
+    pThis->fOffload = fOffload;
+
+    LogRel(("TAP#%u: Using virtio-net headers, offload=%RTbool kernel offloads=%#lx\n",
+            pThis->pDrvIns->iInstance, fOffload, fTunOffloads));
+    return VINF_SUCCESS;
+}
+#endif /* RT_OS_LINUX */
+
 /* -=-=-=-=- PDMIBASE -=-=-=-=- */
 
 /**
@@ -813,6 +1189,17 @@ static DECLCALLBACK(void) drvTAPDestruct(PPDMDRVINS pDrvIns)
 
 #endif  /* RT_OS_SOLARIS */
 
+#ifdef RT_OS_LINUX
+    if (pThis->fOwnDevice && pThis->hFileDevice != NIL_RTFILE)
+    {
+        rc = RTFileClose(pThis->hFileDevice); AssertRC(rc);
+        pThis->hFileDevice = NIL_RTFILE;
+    }
+#endif
+
+    RTMemFree(pThis->pbRecvBuf);
+    pThis->pbRecvBuf = NULL;
+
 #ifdef RT_OS_SOLARIS
     if (!pThis->fStatic)
         RTStrFree(pThis->pszDeviceName);    /* allocated by drvTAPSetupApplication */
@@ -841,6 +1228,9 @@ static DECLCALLBACK(void) drvTAPDestruct(PPDMDRVINS pDrvIns)
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatPktSentBytes);
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatPktRecv);
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatPktRecvBytes);
+    PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatPktSentGso);
+    PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatPktRecvGso);
+    PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatRecvBatch);
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatTransmit);
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatReceive);
 #endif /* VBOX_WITH_STATISTICS */
@@ -892,6 +1282,9 @@ static DECLCALLBACK(int) drvTAPConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uin
     PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatPktSentBytes,  STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,             "Number of sent bytes.",            "/Drivers/TAP%d/Bytes/Sent", pDrvIns->iInstance);
     PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatPktRecv,       STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,        "Number of received packets.",      "/Drivers/TAP%d/Packets/Received", pDrvIns->iInstance);
     PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatPktRecvBytes,  STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,             "Number of received bytes.",        "/Drivers/TAP%d/Bytes/Received", pDrvIns->iInstance);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatPktSentGso,    STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,        "GSO frames passed to the host unsegmented.", "/Drivers/TAP%d/Packets/Sent-Gso", pDrvIns->iInstance);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatPktRecvGso,    STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,        "GSO frames received from the host.", "/Drivers/TAP%d/Packets/Received-Gso", pDrvIns->iInstance);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatRecvBatch,     STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,             "Frames read per poll wakeup.",     "/Drivers/TAP%d/ReceiveBatch", pDrvIns->iInstance);
     PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatTransmit,      STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL,    "Profiling packet transmit runs.",  "/Drivers/TAP%d/Transmit", pDrvIns->iInstance);
     PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatReceive,       STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL,    "Profiling packet receive runs.",   "/Drivers/TAP%d/Receive", pDrvIns->iInstance);
 #endif /* VBOX_WITH_STATISTICS */
@@ -899,7 +1292,7 @@ static DECLCALLBACK(int) drvTAPConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uin
     /*
      * Validate the config.
      */
-    if (!CFGMR3AreValuesValid(pCfg, "Device\0InitProg\0TermProg\0FileHandle\0TAPSetupApplication\0TAPTerminateApplication\0MAC"))
+    if (!CFGMR3AreValuesValid(pCfg, "Device\0InitProg\0TermProg\0FileHandle\0TAPSetupApplication\0TAPTerminateApplication\0MAC\0Offload"))
         return PDMDRV_SET_ERROR(pDrvIns, VERR_PDM_DRVINS_UNKNOWN_CFG_VALUES, "");
 
     /*
@@ -964,15 +1357,42 @@ static DECLCALLBACK(int) drvTAPConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uin
 
 #else /* !RT_OS_SOLARIS */
 
+# ifdef RT_OS_LINUX
+    /** @cfgm{Offload, boolean, true}
+     * Whether to exchange GSO frames and partial checksums with the host
+     * kernel using virtio-net headers instead of segmenting them here.
+     */
+    bool fOffload;
+    rc = CFGMR3QueryBoolDef(pCfg, "Offload", &fOffload, true);
+    if (RT_FAILURE(rc))
+        return PDMDRV_SET_ERROR(pDrvIns, rc, N_("Configuration error: Failed to get the \"Offload\" value"));
+# endif
+
     uint64_t u64File;
     rc = CFGMR3QueryU64(pCfg, "FileHandle", &u64File);
-    if (RT_FAILURE(rc))
-        return PDMDRV_SET_ERROR(pDrvIns, rc,
-                                N_("Configuration error: Query for \"FileHandle\" 32-bit signed integer failed"));
-    pThis->hFileDevice = (RTFILE)(uintptr_t)u64File;
-    if (!RTFileIsValid(pThis->hFileDevice))
-        return PDMDrvHlpVMSetError(pDrvIns, VERR_INVALID_HANDLE, RT_SRC_POS,
-                                   N_("The TAP file handle %RTfile is not valid"), pThis->hFileDevice);
+# ifdef RT_OS_LINUX
+    if (rc == VERR_CFGM_VALUE_NOT_FOUND)
+    {
+        /* No descriptor from the frontend, attach to the named TAP interface ourselves. */
+        rc = CFGMR3QueryStringAlloc(pCfg, "Device", &pThis->pszDeviceName);
+        if (RT_FAILURE(rc))
+            return PDMDRV_SET_ERROR(pDrvIns, rc,
+                                    N_("Configuration error: Neither \"FileHandle\" nor \"Device\" was specified"));
+        rc = drvTAPLinuxOpenDevice(pThis, fOffload);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+    else
+# endif
+    {
+        if (RT_FAILURE(rc))
+            return PDMDRV_SET_ERROR(pDrvIns, rc,
+                                    N_("Configuration error: Query for \"FileHandle\" 32-bit signed integer failed"));
+        pThis->hFileDevice = (RTFILE)(uintptr_t)u64File;
+        if (!RTFileIsValid(pThis->hFileDevice))
+            return PDMDrvHlpVMSetError(pDrvIns, VERR_INVALID_HANDLE, RT_SRC_POS,
+                                       N_("The TAP file handle %RTfile is not valid"), pThis->hFileDevice);
+    }
 #endif /* !RT_OS_SOLARIS */
 
     /*
@@ -994,6 +1414,21 @@ static DECLCALLBACK(int) drvTAPConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uin
     Log(("drvTAPContruct: %d (from fd)\n", (intptr_t)pThis->hFileDevice));
     rc = VINF_SUCCESS;
 
+    /*
+     * Set up offloading and allocate the receive buffer accordingly.
+     */
+    pThis->cbRecvBuf = DRVTAP_RECV_BUF_SIZE;
+#ifdef RT_OS_LINUX
+    rc = drvTAPLinuxSetupOffload(pThis, fOffload);
+    if (RT_FAILURE(rc))
+        return rc;
+    if (pThis->fVNetHdr)
+        pThis->cbRecvBuf = DRVTAP_RECV_BUF_SIZE_GSO;
+#endif
+    pThis->pbRecvBuf = (uint8_t *)RTMemAlloc(pThis->cbRecvBuf);
+    if (!pThis->pbRecvBuf)
+        return VERR_NO_MEMORY;
+
     /*
      * Create the control pipe.
      */
@@ -65,6 +65,11 @@
 /** The wakeup bit in the INTNETIF::cBusy and INTNETRUNKIF::cBusy counters. */
 #define INTNET_BUSY_WAKEUP_MASK     RT_BIT_32(30)
 
+/** The number of buckets in the MAC address hash (power of two). */
+#define INTNET_MACTAB_HASH_SIZE     256
+/** The end of a MAC address hash chain. */
+#define INTNET_MACTAB_HASH_NIL      UINT32_MAX
+
 
 /*********************************************************************************************************************************
 *   Structures and Typedefs                                                                                                      *
@@ -85,6 +90,9 @@ typedef struct INTNETMACTABENTRY
      * to this interface onto the trunk.  The reasoning for this is that this could
      * be the interface of a VM that just has been teleported to a different host. */
     bool                    fActive;
+    /** Index of the next entry in the same hash bucket, INTNET_MACTAB_HASH_NIL
+     * if last.  Chains are sorted by descending entry index. */
+    uint32_t                iHashNext;
     /** Pointer to the network interface. */
     struct INTNETIF        *pIf;
 } INTNETMACTABENTRY;
@@ -111,6 +119,14 @@ typedef struct INTNETMACTAB
     /** The number of interface entries currently in promicuous mode that
      * shall not see unrelated trunk traffic. */
     uint32_t                cPromiscuousNoTrunkEntries;
+    /** The number of interface entries with a dummy (unknown) MAC address.
+     * These receive all unicast traffic, so the hash can't be used then. */
+    uint32_t                cDummyEntries;
+    /** MAC address hash buckets, each holding the index of the first entry
+     * of the chain or INTNET_MACTAB_HASH_NIL.  Rebuilt by
+     * intnetR0MacTabRehash whenever an entry is added, removed or changes its
+     * address (while owning the spinlock). */
+    uint32_t                aiHashHeads[INTNET_MACTAB_HASH_SIZE];
 
     /** The host MAC address (reported). */
     RTMAC                   HostMac;
@@ -1655,6 +1671,82 @@ DECL_FORCE_INLINE(bool) intnetR0AreMacAddrsEqual(PCRTMAC pDstAddr1, PCRTMAC pDst
 }
 
 
+/**
+ * Calculates the MAC address hash bucket index.
+ *
+ * @returns Bucket index.
+ * @param   pMacAddr            The MAC address.
+ */
+DECL_FORCE_INLINE(uint32_t) intnetR0MacTabHash(PCRTMAC pMacAddr)
+{
+    /* The first three bytes are the OUI which is usually the same for all
+       interfaces on a network, so only the NIC specific part is used. */
+    return (  pMacAddr->au8[3] * UINT32_C(0x9d)
+            + pMacAddr->au8[4] * UINT32_C(0x3b)
+            + pMacAddr->au8[5])
+         & (INTNET_MACTAB_HASH_SIZE - 1);
+}
+
+
+/**
+ * Rebuilds the MAC address hash and the dummy entry count of the table.
+ *
+ * The caller must own the network spinlock.  This is called whenever entries
+ * are added, removed or have their address changed, which is rare compared to
+ * the lookups.
+ *
+ * @param   pTab                The MAC address table.
+ */
+static void intnetR0MacTabRehash(PINTNETMACTAB pTab)
+{
+    for (uint32_t iHash = 0; iHash < RT_ELEMENTS(pTab->aiHashHeads); iHash++)
+        pTab->aiHashHeads[iHash] = INTNET_MACTAB_HASH_NIL;
+    pTab->cDummyEntries = 0;
+
+    /* Insert in ascending order so the chains are sorted by descending index,
+       i.e. the order the linear scans are traversing the table in. */
+    for (uint32_t iIfMac = 0; iIfMac < pTab->cEntries; iIfMac++)
+    {
+        PINTNETMACTABENTRY pEntry = &pTab->paEntries[iIfMac];
+        if (intnetR0IsMacAddrDummy(&pEntry->MacAddr))
+        {
+            pTab->cDummyEntries++;
+            pEntry->iHashNext = INTNET_MACTAB_HASH_NIL;
+        }
+        else
+        {
+            uint32_t const iHash = intnetR0MacTabHash(&pEntry->MacAddr);
+            pEntry->iHashNext = pTab->aiHashHeads[iHash];
+            pTab->aiHashHeads[iHash] = iIfMac;
+        }
+    }
+}
+
+
+/**
+ * Looks up the highest indexed active entry with the given MAC address.
+ *
+ * The caller must own the network spinlock.
+ *
+ * @returns Entry index, INTNET_MACTAB_HASH_NIL if not found.
+ * @param   pTab                The MAC address table.
+ * @param   pMacAddr            The MAC address to look for.
+ */
+DECLINLINE(uint32_t) intnetR0MacTabLookup(PINTNETMACTAB pTab, PCRTMAC pMacAddr)
+{
+    uint32_t iIfMac = pTab->aiHashHeads[intnetR0MacTabHash(pMacAddr)];
+    while (iIfMac != INTNET_MACTAB_HASH_NIL)
+    {
+        PINTNETMACTABENTRY pEntry = &pTab->paEntries[iIfMac];
+        if (   pEntry->fActive
+            && intnetR0AreMacAddrsEqual(&pEntry->MacAddr, pMacAddr))
+            break;
+        iIfMac = pEntry->iHashNext;
+    }
+    return iIfMac;
+}
+
+
 /**
  * Switch a unicast frame based on the network layer address (OSI level 3) and
  * return a destination table.
@@ -1787,29 +1879,47 @@ static INTNETSWDECISION intnetR0NetworkPreSwitchUnicast(PINTNETNETWORK pNetwork,
     PINTNETMACTAB       pTab            = &pNetwork->MacTab;
     RTSpinlockAcquire(pNetwork->hAddrSpinlock);
 
-    /* Iterate the internal network interfaces and look for matching source and
-       destination addresses. */
-    uint32_t iIfMac = pTab->cEntries;
-    while (iIfMac-- > 0)
+    if (!pTab->cDummyEntries)
     {
-        if (pTab->paEntries[iIfMac].fActive)
+        /* Use the hash.  The scan below stops at the highest indexed entry
+           matching either address, so a source match wins if it's higher up. */
+        uint32_t const iIfDst = intnetR0MacTabLookup(pTab, pDstAddr);
+        if (iIfDst != INTNET_MACTAB_HASH_NIL)
         {
-            /* Unknown interface address? */
-            if (intnetR0IsMacAddrDummy(&pTab->paEntries[iIfMac].MacAddr))
-                break;
-
-            /* Paranoia - this shouldn't happen, right? */
-            if (    pSrcAddr
-                &&  intnetR0AreMacAddrsEqual(&pTab->paEntries[iIfMac].MacAddr, pSrcAddr))
-                break;
-
-            /* Exact match? */
-            if (intnetR0AreMacAddrsEqual(&pTab->paEntries[iIfMac].MacAddr, pDstAddr))
-            {
+            uint32_t const iIfSrc = pSrcAddr ? intnetR0MacTabLookup(pTab, pSrcAddr) : INTNET_MACTAB_HASH_NIL;
+            if (   iIfSrc == INTNET_MACTAB_HASH_NIL
+                || iIfSrc < iIfDst)
                 enmSwDecision = pTab->fHostPromiscuousEff && fSrc == INTNETTRUNKDIR_WIRE
                               ? INTNETSWDECISION_BROADCAST
                               : INTNETSWDECISION_INTNET;
-                break;
+        }
+    }
+    else
+    {
+        /* Iterate the internal network interfaces and look for matching source and
+           destination addresses. */
+        uint32_t iIfMac = pTab->cEntries;
+        while (iIfMac-- > 0)
+        {
+            if (pTab->paEntries[iIfMac].fActive)
+            {
+                /* Unknown interface address? */
+                if (intnetR0IsMacAddrDummy(&pTab->paEntries[iIfMac].MacAddr))
+                    break;
+
+                /* Paranoia - this shouldn't happen, right? */
+                if (    pSrcAddr
+                    &&  intnetR0AreMacAddrsEqual(&pTab->paEntries[iIfMac].MacAddr, pSrcAddr))
+                    break;
+
+                /* Exact match? */
+                if (intnetR0AreMacAddrsEqual(&pTab->paEntries[iIfMac].MacAddr, pDstAddr))
+                {
+                    enmSwDecision = pTab->fHostPromiscuousEff && fSrc == INTNETTRUNKDIR_WIRE
+                                  ? INTNETSWDECISION_BROADCAST
+                                  : INTNETSWDECISION_INTNET;
+                    break;
+                }
             }
         }
     }
@@ -1849,19 +1959,18 @@ static INTNETSWDECISION intnetR0NetworkSwitchUnicast(PINTNETNETWORK pNetwork, ui
 
     /* Find exactly matching or promiscuous interfaces. */
     uint32_t cExactHits = 0;
-    uint32_t iIfMac     = pTab->cEntries;
-    while (iIfMac-- > 0)
+    uint32_t iIfMac;
+    if (   !pTab->cPromiscuousEntries
+        && !pTab->cDummyEntries)
     {
-        if (pTab->paEntries[iIfMac].fActive)
+        /* Only exact matches are possible, walk the hash chain for them. */
+        iIfMac = pTab->aiHashHeads[intnetR0MacTabHash(pDstAddr)];
+        while (iIfMac != INTNET_MACTAB_HASH_NIL)
         {
-            bool fExact = intnetR0AreMacAddrsEqual(&pTab->paEntries[iIfMac].MacAddr, pDstAddr);
-            if (   fExact
-                || intnetR0IsMacAddrDummy(&pTab->paEntries[iIfMac].MacAddr)
-                || (   pTab->paEntries[iIfMac].fPromiscuousSeeTrunk
-                    || (!fSrc && pTab->paEntries[iIfMac].fPromiscuousEff) )
-               )
+            if (   pTab->paEntries[iIfMac].fActive
+                && intnetR0AreMacAddrsEqual(&pTab->paEntries[iIfMac].MacAddr, pDstAddr))
             {
-                cExactHits += fExact;
+                cExactHits++;
 
                 PINTNETIF pIf = pTab->paEntries[iIfMac].pIf;        AssertPtr(pIf); Assert(pIf->pNetwork == pNetwork);
                 if (RT_LIKELY(pIf != pIfSender)) /* paranoia */
@@ -1872,6 +1981,35 @@ static INTNETSWDECISION intnetR0NetworkSwitchUnicast(PINTNETNETWORK pNetwork, ui
                     intnetR0BusyIncIf(pIf);
                 }
             }
+            iIfMac = pTab->paEntries[iIfMac].iHashNext;
+        }
+    }
+    else
+    {
+        iIfMac = pTab->cEntries;
+        while (iIfMac-- > 0)
+        {
+            if (pTab->paEntries[iIfMac].fActive)
+            {
+                bool fExact = intnetR0AreMacAddrsEqual(&pTab->paEntries[iIfMac].MacAddr, pDstAddr);
+                if (   fExact
+                    || intnetR0IsMacAddrDummy(&pTab->paEntries[iIfMac].MacAddr)
+                    || (   pTab->paEntries[iIfMac].fPromiscuousSeeTrunk
+                        || (!fSrc && pTab->paEntries[iIfMac].fPromiscuousEff) )
+                   )
+                {
+                    cExactHits += fExact;
+
+                    PINTNETIF pIf = pTab->paEntries[iIfMac].pIf;    AssertPtr(pIf); Assert(pIf->pNetwork == pNetwork);
+                    if (RT_LIKELY(pIf != pIfSender)) /* paranoia */
+                    {
+                        uint32_t iIfDst = pDstTab->cIfs++;
+                        pDstTab->aIfs[iIfDst].pIf            = pIf;
+                        pDstTab->aIfs[iIfDst].fReplaceDstMac = false;
+                        intnetR0BusyIncIf(pIf);
+                    }
+                }
+            }
         }
     }
 
@@ -3971,7 +4109,10 @@ static INTNETSWDECISION intnetR0NetworkSend(PINTNETNETWORK pNetwork, PINTNETIF p
 
         PINTNETMACTABENTRY pIfEntry = intnetR0NetworkFindMacAddrEntry(pNetwork, pIfSender);
         if (pIfEntry)
+        {
             pIfEntry->MacAddr = EthHdr.SrcMac;
+            intnetR0MacTabRehash(&pNetwork->MacTab);
+        }
         pIfSender->MacAddr    = EthHdr.SrcMac;
 
         RTSpinlockRelease(pNetwork->hAddrSpinlock);
@@ -4419,7 +4560,10 @@ INTNETR0DECL(int) IntNetR0IfSetMacAddress(INTNETIFHANDLE hIf, PSUPDRVSESSION pSe
             /* Update the two copies. */
             PINTNETMACTABENTRY pEntry = intnetR0NetworkFindMacAddrEntry(pNetwork, pIf); Assert(pEntry);
             if (RT_LIKELY(pEntry))
+            {
                 pEntry->MacAddr = *pMac;
+                intnetR0MacTabRehash(&pNetwork->MacTab);
+            }
             pIf->MacAddr        = *pMac;
             pIf->fMacSet        = true;
 
@@ -4944,6 +5088,7 @@ static DECLCALLBACK(void) intnetR0IfDestruct(void *pvObj, void *pvUser1, void *p
                             &pNetwork->MacTab.paEntries[iIf + 1],
                             (pNetwork->MacTab.cEntries - iIf - 1) * sizeof(pNetwork->MacTab.paEntries[0]));
                 pNetwork->MacTab.cEntries--;
+                intnetR0MacTabRehash(&pNetwork->MacTab);
                 break;
             }
 
@@ -5182,6 +5327,7 @@ static int intnetR0NetworkCreateIf(PINTNETNETWORK pNetwork, PSUPDRVSESSION pSess
                     pNetwork->MacTab.paEntries[iIf].pIf                  = pIf;
 
                     pNetwork->MacTab.cEntries = iIf + 1;
+                    intnetR0MacTabRehash(&pNetwork->MacTab);
                     pIf->pNetwork = pNetwork;
 
                     /*
@@ -5967,6 +6113,7 @@ static DECLCALLBACK(void) intnetR0NetworkDestruct(void *pvObj, void *pvUser1, vo
         {
             pIf->pNetwork = NULL;
             pNetwork->MacTab.cEntries--;
+            intnetR0MacTabRehash(&pNetwork->MacTab);
         }
     }
 
@@ -6353,6 +6500,7 @@ static int intnetR0CreateNetwork(PINTNET pIntNet, PSUPDRVSESSION pSession, const
     pNetwork->MacTab.cEntriesAllocated      = INTNET_GROW_DSTTAB_SIZE;
     //pNetwork->MacTab.cPromiscuousEntries  = 0;
     //pNetwork->MacTab.cPromiscuousNoTrunkEntries = 0;
+    //pNetwork->MacTab.cDummyEntries        = 0;
     pNetwork->MacTab.paEntries              = NULL;
     pNetwork->MacTab.fHostPromiscuousReal   = false;
     pNetwork->MacTab.fHostPromiscuousEff    = false;
@@ -6361,6 +6509,7 @@ static int intnetR0CreateNetwork(PINTNET pIntNet, PSUPDRVSESSION pSession, const
     pNetwork->MacTab.fWirePromiscuousEff    = false;
     pNetwork->MacTab.fWireActive            = false;
     pNetwork->MacTab.pTrunk                 = NULL;
+    intnetR0MacTabRehash(&pNetwork->MacTab); /* Empties the hash buckets. */
     pNetwork->hEvtBusyIf                    = NIL_RTSEMEVENT;
     pNetwork->pIntNet                       = pIntNet;
     //pNetwork->pvObj                       = NULL;
@@ -71,6 +71,15 @@ COUNTING_COUNTER(TCPHot, "TCP sockets active");
 COUNTING_COUNTER(UDP, "UDP sockets");
 COUNTING_COUNTER(UDPHot, "UDP sockets active");
 
+#  ifdef VBOX_NAT_WITH_EPOLL
+COUNTING_COUNTER(EpollWakeups, "epoll: event loop iterations");
+COUNTING_COUNTER(EpollSockets, "epoll: sockets serviced (total)");
+COUNTING_COUNTER(EpollSocketsLast, "epoll: sockets serviced by the last wakeup");
+COUNTING_COUNTER(EpollCtl, "epoll: interest set updates");
+COUNTING_COUNTER(EpollDirty, "epoll: dirty sockets recalculated");
+COUNTING_COUNTER(EpollResync, "epoll: full resyncs of all sockets");
+#  endif
+
 COUNTING_COUNTER(IORead_in_1, "SB IORead_in_1");
 COUNTING_COUNTER(IORead_in_1_bytes, "SB IORead_in_1_bytes");
 COUNTING_COUNTER(IORead_in_2, "SB IORead_in_2");
@@ -36,6 +36,14 @@ int inet_aton(const char *cp, struct in_addr *ia);
 # include <arpa/inet.h>
 #endif
 
+/*
+ * On Linux the socket interest set is kept in a persistent epoll descriptor
+ * so the NAT loop doesn't have to rebuild and scan a pollfd array every time.
+ */
+#if defined(RT_OS_LINUX) && !defined(VBOX_NAT_WITHOUT_EPOLL)
+# define VBOX_NAT_WITH_EPOLL
+#endif
+
 #include <VBox/types.h>
 #include <iprt/req.h>
 
@@ -57,6 +65,11 @@ void slirp_link_down(PNATState);
 void slirp_select_fill(PNATState pData, int *pndfs);
 
 void slirp_select_poll(PNATState pData, int fTimeout);
+#elif defined(VBOX_NAT_WITH_EPOLL)
+void slirp_select_fill(PNATState pData, int *pnfds);
+int slirp_select_wait(PNATState pData, int cMillies, bool *pfWakeup);
+void slirp_select_poll(PNATState pData);
+int slirp_register_wakeup_fd(PNATState pData, int fd);
 #else /* RT_OS_WINDOWS */
 void slirp_select_fill(PNATState pData, int *pnfds, struct pollfd *polls);
 void slirp_select_poll(PNATState pData, struct pollfd *polls, int ndfs);
@@ -71,7 +71,27 @@
 # include "resolv_conf_parser.h"
 #endif
 
-#ifndef RT_OS_WINDOWS
+#ifdef VBOX_NAT_WITH_EPOLL
+/*
+ * With epoll the wanted events are worked out per socket by the epoll
+ * variant of slirp_select_fill(), there is nothing to engage here.
+ */
+# define DO_POLL_EVENTS(rc, error, so, events, label) do {} while (0)
+
+# define DO_CHECK_FD_SET(so, events, fdset)                        \
+      (((so)->so_poll_revents & N_(fdset ## _poll)) != 0)
+
+  /* specific for Windows Winsock API */
+# define DO_WIN_CHECK_FD_SET(so, events, fdset) 0
+
+/* poll(2) and epoll(7) share the bit values on Linux */
+# define readfds_poll   (EPOLLIN)
+# define writefds_poll  (EPOLLOUT)
+# define xfds_poll      (EPOLLPRI)
+# define closefds_poll  (EPOLLHUP)
+# define rderr_poll     (EPOLLERR)
+
+#elif !defined(RT_OS_WINDOWS)
 # define DO_ENGAGE_EVENT1(so, fdset, label)                        \
    do {                                                            \
        if (   so->so_poll_index != -1                              \
@@ -351,12 +371,25 @@ int slirp_init(PNATState *ppData, uint32_t u32NetAddr, uint32_t u32Netmask,
         }
     }
     pData->phEvents[VBOX_SOCKET_EVENT_INDEX] = CreateEvent(NULL, FALSE, FALSE, NULL);
+#elif defined(VBOX_NAT_WITH_EPOLL)
+    pData->iEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (pData->iEpollFd == -1)
+    {
+        rc = RTErrConvertFromErrno(errno);
+        LogRel(("NAT: epoll_create1 failed: %Rrc\n", rc));
+        RTMemFree(pData);
+        *ppData = NULL;
+        return rc;
+    }
 #endif
 
     rc = bootp_dhcp_init(pData);
     if (RT_FAILURE(rc))
     {
         Log(("NAT: DHCP server initialization failed\n"));
+#ifdef VBOX_NAT_WITH_EPOLL
+        close(pData->iEpollFd);
+#endif
         RTMemFree(pData);
         *ppData = NULL;
         return rc;
@@ -567,6 +600,10 @@ void slirp_term(PNATState pData)
 #ifdef RT_OS_WINDOWS
     WSACleanup();
 #endif
+#ifdef VBOX_NAT_WITH_EPOLL
+    close(pData->iEpollFd);
+    RTMemFree(pData->papEpollService);
+#endif
 #ifdef LOG_ENABLED
     Log(("\n"
          "NAT statistics\n"
@@ -612,25 +649,412 @@ static void updtime(PNATState pData)
 #endif
 }
 
-#ifdef RT_OS_WINDOWS
+#ifdef VBOX_NAT_WITH_EPOLL
+/**
+ * Queues a socket for having its wanted events recalculated by the next
+ * slirp_select_fill().
+ *
+ * Only the sockets on this list and the ones reported by epoll_wait() are
+ * looked at per wakeup, so anything changing the state or the buffers of a
+ * socket outside of slirp_select_poll() should queue it here.  The periodic
+ * full resync catches what slips through.
+ */
+void slirpEpollMarkDirty(PNATState pData, struct socket *so)
+{
+    if (so->so_epoll_pprev)
+        return;
+    so->so_epoll_next = pData->pEpollDirty;
+    if (so->so_epoll_next)
+        so->so_epoll_next->so_epoll_pprev = &so->so_epoll_next;
+    so->so_epoll_pprev = &pData->pEpollDirty;
+    pData->pEpollDirty = so;
+}
+
+static void slirpEpollUnlinkDirty(struct socket *so)
+{
+    *so->so_epoll_pprev = so->so_epoll_next;
+    if (so->so_epoll_next)
+        so->so_epoll_next->so_epoll_pprev = so->so_epoll_pprev;
+    so->so_epoll_next = NULL;
+    so->so_epoll_pprev = NULL;
+}
+
+/**
+ * Drops all references the epoll code keeps to a socket about to be freed.
+ */
+void slirpEpollForget(PNATState pData, struct socket *so)
+{
+    if (so->so_epoll_events)
+    {
+        /* don't leave a reference to the freed socket in the epoll set */
+        if (   so->s != -1
+            && so->s == so->so_epoll_fd)
+            epoll_ctl(pData->iEpollFd, EPOLL_CTL_DEL, so->s, NULL);
+        so->so_epoll_events = 0;
+        pData->cEpollSockets--;
+    }
+    if (so->so_epoll_pprev)
+        slirpEpollUnlinkDirty(so);
+    if (   so->so_epoll_gen == pData->uEpollGen
+        && so->so_epoll_slot < pData->cEpollService
+        && pData->papEpollService[so->so_epoll_slot] == so)
+        pData->papEpollService[so->so_epoll_slot] = NULL;
+}
+
+/**
+ * Brings the epoll registration of a socket in line with the events wanted.
+ *
+ * epoll_ctl() is only called when the wanted events differ from the ones
+ * registered, so idle and steady state sockets cost nothing here.
+ */
+static void slirpEpollUpdate(PNATState pData, struct socket *so, uint32_t fEvents)
+{
+    struct epoll_event Event;
+    int rc;
+
+    /* A closed or replaced descriptor has already been dropped by the kernel. */
+    if (   so->so_epoll_events
+        && so->so_epoll_fd != so->s)
+    {
+        so->so_epoll_events = 0;
+        pData->cEpollSockets--;
+    }
+    if (so->s == -1)
+        fEvents = 0;
+    if (fEvents == so->so_epoll_events)
+        return;
+
+    STAM_COUNTER_INC(&pData->StatEpollCtl);
+    RT_ZERO(Event);
+    Event.events = fEvents;
+    Event.data.ptr = so;
+    if (!fEvents)
+    {
+        epoll_ctl(pData->iEpollFd, EPOLL_CTL_DEL, so->s, &Event);
+        so->so_epoll_events = 0;
+        pData->cEpollSockets--;
+        return;
+    }
+
+    if (so->so_epoll_events)
+    {
+        rc = epoll_ctl(pData->iEpollFd, EPOLL_CTL_MOD, so->s, &Event);
+        if (rc == -1 && errno == ENOENT) /* closed and reused behind our back */
+            rc = epoll_ctl(pData->iEpollFd, EPOLL_CTL_ADD, so->s, &Event);
+    }
+    else
+    {
+        rc = epoll_ctl(pData->iEpollFd, EPOLL_CTL_ADD, so->s, &Event);
+        if (rc == -1 && errno == EEXIST)
+            rc = epoll_ctl(pData->iEpollFd, EPOLL_CTL_MOD, so->s, &Event);
+    }
+
+    if (RT_LIKELY(rc == 0))
+    {
+        if (!so->so_epoll_events)
+            pData->cEpollSockets++;
+        so->so_epoll_events = fEvents;
+        so->so_epoll_fd = so->s;
+    }
+    else
+    {
+        Log(("NAT: epoll_ctl(%R[natsock], %#x) failed: %s\n", so, fEvents, strerror(errno)));
+        if (so->so_epoll_events)
+            pData->cEpollSockets--;
+        so->so_epoll_events = 0;
+    }
+}
+
+/**
+ * Works out the events a TCP socket waits for, following the rules of the
+ * poll(2) variant of slirp_select_fill().
+ */
+static uint32_t slirpEpollTcpEvents(PNATState pData, struct socket *so)
+{
+    uint32_t fEvents = 0;
+
+    /*
+     * See if we need a tcp_fasttimo
+     */
+    if (    time_fasttimo == 0
+            && so->so_tcpcb != NULL
+            && so->so_tcpcb->t_flags & TF_DELACK)
+        time_fasttimo = curtime; /* Flag when we want a fasttimo */
+
+    /*
+     * NOFDREF can include still connecting to local-host,
+     * newly socreated() sockets etc. Don't want to select these.
+     */
+    if (so->so_state & SS_NOFDREF || so->s == -1)
+        return 0;
+
+    /* accepting */
+    if (so->so_state & SS_FACCEPTCONN)
+        return readfds_poll;
+
+    /* connecting */
+    if (so->so_state & SS_ISFCONNECTING)
+        fEvents |= writefds_poll;
+
+    /* connected, can send more and have something to send */
+    if (CONN_CANFSEND(so) && SBUF_LEN(&so->so_rcv))
+        fEvents |= writefds_poll;
+
+    /* connected, can receive more and have room for it */
+    if (   CONN_CANFRCV(so)
+        && (SBUF_LEN(&so->so_snd) < (SBUF_SIZE(&so->so_snd)/2)))
+        fEvents |= readfds_poll | xfds_poll;
+
+    return fEvents;
+}
+
+/**
+ * Works out the events a UDP socket waits for.
+ */
+static uint32_t slirpEpollUdpEvents(struct socket *so)
+{
+#ifdef VBOX_WITH_NAT_UDP_SOCKET_CLONE
+    /* clones share the descriptor of the socket they were cloned of */
+    if (so->so_cloneOf)
+        return 0;
+#endif
+    if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4)
+        return readfds_poll;
+    return 0;
+}
+
+/**
+ * Recalculates the wanted events of all sockets and expires UDP sockets.
+ *
+ * Done when the link state changes and every 500ms, which also picks up
+ * whatever changed without the socket being marked dirty.
+ */
+static void slirpEpollResync(PNATState pData)
+{
+    struct socket *so, *so_next;
+    uint32_t fEvents;
+
+    STAM_COUNTER_INC(&pData->StatEpollResync);
+    STAM_COUNTER_RESET(&pData->StatTCP);
+    STAM_COUNTER_RESET(&pData->StatTCPHot);
+    STAM_COUNTER_RESET(&pData->StatUDP);
+    STAM_COUNTER_RESET(&pData->StatUDPHot);
+
+    /* every socket is looked at below, only the draining ones stay queued */
+    while (pData->pEpollDirty)
+        slirpEpollUnlinkDirty(pData->pEpollDirty);
+
+    QSOCKET_FOREACH(so, so_next, tcp)
+    /* { */
+        Assert(so->so_type == IPPROTO_TCP);
+        STAM_COUNTER_INC(&pData->StatTCP);
+        fEvents = link_up ? slirpEpollTcpEvents(pData, so) : 0;
+        if (fEvents)
+            STAM_COUNTER_INC(&pData->StatTCPHot);
+        slirpEpollUpdate(pData, so, fEvents);
+        if (so->so_close == 1)
+            slirpEpollMarkDirty(pData, so);
+        LOOP_LABEL(tcp, so, so_next);
+    }
+
+    QSOCKET_FOREACH(so, so_next, udp)
+    /* { */
+        Assert(so->so_type == IPPROTO_UDP);
+        STAM_COUNTER_INC(&pData->StatUDP);
+
+        /*
+         * See if it's timed out
+         */
+        if (   link_up
+            && so->so_expire
+            && so->so_expire <= curtime)
+        {
+            Log2(("NAT: %R[natsock] expired\n", so));
+            if (so->so_timeout != NULL)
+            {
+                /* so_timeout - might change the so_expire value or
+                 * drop so_timeout* from so.
+                 */
+                so->so_timeout(pData, so, so->so_timeout_arg);
+                if (   so_next->so_prev != so /* so_timeout freed the socket */
+                    || so->so_timeout)  /* so_timeout just freed so_timeout */
+                  CONTINUE_NO_UNLOCK(udp);
+            }
+            UDP_DETACH(pData, so, so_next);
+            CONTINUE_NO_UNLOCK(udp);
+        }
+
+        fEvents = link_up ? slirpEpollUdpEvents(so) : 0;
+        if (fEvents)
+            STAM_COUNTER_INC(&pData->StatUDPHot);
+        slirpEpollUpdate(pData, so, fEvents);
+        LOOP_LABEL(udp, so, so_next);
+    }
+
+    pData->fEpollLinkUp = link_up;
+    pData->uEpollLastResync = curtime;
+}
+
 void slirp_select_fill(PNATState pData, int *pnfds)
-#else /* RT_OS_WINDOWS */
+{
+    struct socket *so, *so_next;
+    int i;
+
+    STAM_PROFILE_START(&pData->StatFill, a);
+
+    /*
+     * *_slowtimo needs calling if there are IP fragments
+     * in the fragment queue, or there are TCP connections active
+     */
+    do_slowtimo = 0;
+    if (link_up)
+    {
+        do_slowtimo = (tcb.so_next != &tcb);
+        for (i = 0; i < IPREASS_NHASH && !do_slowtimo; i++)
+            if (!TAILQ_EMPTY(&ipq[i]))
+                do_slowtimo = 1;
+    }
+
+    if (   RT_BOOL(link_up) != pData->fEpollLinkUp
+        || (link_up && curtime - pData->uEpollLastResync >= 500))
+        slirpEpollResync(pData);
+    else if (link_up)
+    {
+        /* only the sockets queued since the last fill */
+        for (so = pData->pEpollDirty; so; so = so_next)
+        {
+            so_next = so->so_epoll_next;
+            STAM_COUNTER_INC(&pData->StatEpollDirty);
+            if (so->so_type == IPPROTO_TCP)
+            {
+                slirpEpollUpdate(pData, so, slirpEpollTcpEvents(pData, so));
+                /* still draining, slirp_select_wait() hands it to the poll again */
+                if (so->so_close == 1)
+                    continue;
+            }
+            else if (so->so_type == IPPROTO_UDP)
+                slirpEpollUpdate(pData, so, slirpEpollUdpEvents(so));
+            slirpEpollUnlinkDirty(so);
+        }
+    }
+
+    /* always add the ICMP socket */
+    slirpEpollUpdate(pData, &pData->icmp_socket, link_up ? readfds_poll : 0);
+
+    *pnfds = pData->cEpollSockets;
+
+    STAM_PROFILE_STOP(&pData->StatFill, a);
+}
+
+/**
+ * Queues a socket for servicing by slirp_select_poll(), once per wakeup.
+ */
+static void slirpEpollQueueService(PNATState pData, struct socket *so)
+{
+    if (so->so_epoll_gen == pData->uEpollGen)
+        return;
+
+    if (pData->cEpollService >= pData->cEpollServiceMax)
+    {
+        int cNew = pData->cEpollServiceMax ? pData->cEpollServiceMax * 2 : 128;
+        struct socket **papNew = (struct socket **)RTMemRealloc(pData->papEpollService, cNew * sizeof(papNew[0]));
+        if (!papNew)
+            return; /* epoll is level triggered, the socket is reported again */
+        pData->papEpollService = papNew;
+        pData->cEpollServiceMax = cNew;
+    }
+
+    so->so_epoll_gen = pData->uEpollGen;
+    so->so_epoll_slot = pData->cEpollService;
+    pData->papEpollService[pData->cEpollService++] = so;
+}
+
+/**
+ * Forgets the sockets serviced by the last wakeup and their events.
+ */
+static void slirpEpollServiceDone(PNATState pData)
+{
+    int i;
+
+    for (i = 0; i < pData->cEpollService; i++)
+        if (pData->papEpollService[i])
+            pData->papEpollService[i]->so_poll_revents = 0;
+    pData->cEpollService = 0;
+}
+
+/**
+ * Waits for events on the sockets registered by slirp_select_fill() or on
+ * the wakeup descriptor.
+ *
+ * The returned events are stored in the sockets and the sockets queued for
+ * slirp_select_poll(), together with the ones still draining.
+ *
+ * @returns Number of ready descriptors, 0 on timeout, -1 and errno on failure.
+ * @param   pData       The NAT state.
+ * @param   cMillies    How long to wait.
+ * @param   pfWakeup    Where to return whether the wakeup descriptor fired.
+ */
+int slirp_select_wait(PNATState pData, int cMillies, bool *pfWakeup)
+{
+    struct socket *so;
+    int cEvents;
+    int i;
+
+    *pfWakeup = false;
+    STAM_COUNTER_INC(&pData->StatEpollWakeups);
+
+    /* the previous wakeup wasn't serviced if epoll_wait() failed */
+    slirpEpollServiceDone(pData);
+    pData->uEpollGen++;
+
+    cEvents = epoll_wait(pData->iEpollFd, &pData->aEpollEvents[0], RT_ELEMENTS(pData->aEpollEvents), cMillies);
+    for (i = 0; i < cEvents; i++)
+    {
+        so = (struct socket *)pData->aEpollEvents[i].data.ptr;
+        if (so == NULL)
+            *pfWakeup = true;
+        else
+        {
+            so->so_poll_revents = pData->aEpollEvents[i].events;
+            slirpEpollQueueService(pData, so);
+        }
+    }
+
+    /* the fill leaves only the draining sockets on the dirty list */
+    for (so = pData->pEpollDirty; so; so = so->so_epoll_next)
+        if (   so->so_type == IPPROTO_TCP
+            && so->so_close == 1)
+            slirpEpollQueueService(pData, so);
+
+    STAM_COUNTER_RESET(&pData->StatEpollSocketsLast);
+    STAM_COUNTER_ADD(&pData->StatEpollSocketsLast, pData->cEpollService);
+    STAM_COUNTER_ADD(&pData->StatEpollSockets, pData->cEpollService);
+    return cEvents;
+}
+#endif /* VBOX_NAT_WITH_EPOLL */
+
+#ifndef VBOX_NAT_WITH_EPOLL
+# ifdef RT_OS_WINDOWS
+void slirp_select_fill(PNATState pData, int *pnfds)
+# else /* RT_OS_WINDOWS */
 void slirp_select_fill(PNATState pData, int *pnfds, struct pollfd *polls)
-#endif /* !RT_OS_WINDOWS */
+# endif /* !RT_OS_WINDOWS */
 {
     struct socket *so, *so_next;
-    int nfds;
 #if defined(RT_OS_WINDOWS)
     int rc;
     int error;
 #else
+    int nfds;
     int poll_index = 0;
 #endif
     int i;
 
     STAM_PROFILE_START(&pData->StatFill, a);
 
+#if !defined(RT_OS_WINDOWS)
     nfds = *pnfds;
+#endif
 
     /*
      * First, TCP sockets
@@ -659,7 +1083,7 @@ void slirp_select_fill(PNATState pData, int *pnfds, struct pollfd *polls)
         }
     }
     /* always add the ICMP socket */
-#ifndef RT_OS_WINDOWS
+#if !defined(RT_OS_WINDOWS)
     pData->icmp_socket.so_poll_index = -1;
 #endif
     ICMP_ENGAGE_EVENT(&pData->icmp_socket, readfds);
@@ -819,6 +1243,7 @@ done:
 
     STAM_PROFILE_STOP(&pData->StatFill, a);
 }
+#endif /* !VBOX_NAT_WITH_EPOLL */
 
 
 /**
@@ -891,6 +1316,8 @@ static bool slirpConnectOrWrite(PNATState pData, struct socket *so, bool fConnec
 
 #if defined(RT_OS_WINDOWS)
 void slirp_select_poll(PNATState pData, int fTimeout)
+#elif defined(VBOX_NAT_WITH_EPOLL)
+void slirp_select_poll(PNATState pData)
 #else /* RT_OS_WINDOWS */
 void slirp_select_poll(PNATState pData, struct pollfd *polls, int ndfs)
 #endif /* !RT_OS_WINDOWS */
@@ -901,6 +1328,8 @@ void slirp_select_poll(PNATState pData, struct pollfd *polls, int ndfs)
     WSANETWORKEVENTS NetworkEvents;
     int rc;
     int error;
+#elif defined(VBOX_NAT_WITH_EPOLL)
+    int i;
 #endif
 
     STAM_PROFILE_START(&pData->StatPoll, a);
@@ -949,8 +1378,20 @@ void slirp_select_poll(PNATState pData, struct pollfd *polls, int ndfs)
     /*
      * Check TCP sockets
      */
+#ifdef VBOX_NAT_WITH_EPOLL
+    /* only the sockets reported by epoll_wait() or still draining */
+    for (i = 0; i < pData->cEpollService; i++)
+    {
+        so = pData->papEpollService[i];
+        if (!so || so->so_type != IPPROTO_TCP) /* freed meanwhile or not TCP */
+            continue;
+        so_next = so->so_next;
+        /* servicing may change the events the socket waits for */
+        slirpEpollMarkDirty(pData, so);
+#else
     QSOCKET_FOREACH(so, so_next, tcp)
     /* { */
+#endif
         /* TCP socket can't be cloned */
 #ifdef VBOX_WITH_NAT_UDP_SOCKET_CLONE
         Assert((!so->so_cloneOf));
@@ -1221,8 +1662,16 @@ void slirp_select_poll(PNATState pData, struct pollfd *polls, int ndfs)
      * Incoming packets are sent straight away, they're not buffered.
      * Incoming UDP data isn't buffered either.
      */
+#ifdef VBOX_NAT_WITH_EPOLL
+    for (i = 0; i < pData->cEpollService; i++)
+    {
+        so = pData->papEpollService[i];
+        if (!so || so->so_type != IPPROTO_UDP)
+            continue;
+#else
      QSOCKET_FOREACH(so, so_next, udp)
      /* { */
+#endif
 #ifdef VBOX_WITH_NAT_UDP_SOCKET_CLONE
         if (so->so_cloneOf)
             CONTINUE_NO_UNLOCK(udp);
@@ -1246,6 +1695,9 @@ void slirp_select_poll(PNATState pData, struct pollfd *polls, int ndfs)
     }
 
 done:
+#ifdef VBOX_NAT_WITH_EPOLL
+    slirpEpollServiceDone(pData);
+#endif
 
     STAM_PROFILE_STOP(&pData->StatPoll, a);
 }
@@ -1636,6 +2088,24 @@ void slirp_register_external_event(PNATState pData, HANDLE hEvent, int index)
 }
 #endif
 
+#ifdef VBOX_NAT_WITH_EPOLL
+/**
+ * Adds the descriptor used to wake up the NAT thread to the epoll set,
+ * slirp_select_wait() reports it via its pfWakeup argument.
+ */
+int slirp_register_wakeup_fd(PNATState pData, int fd)
+{
+    struct epoll_event Event;
+
+    RT_ZERO(Event);
+    Event.events = EPOLLIN | EPOLLPRI;
+    Event.data.ptr = NULL;
+    if (epoll_ctl(pData->iEpollFd, EPOLL_CTL_ADD, fd, &Event) == -1)
+        return RTErrConvertFromErrno(errno);
+    return VINF_SUCCESS;
+}
+#endif
+
 unsigned int slirp_get_timeout_ms(PNATState pData)
 {
     if (link_up)
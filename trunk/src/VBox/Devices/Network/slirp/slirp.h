@@ -263,6 +263,9 @@ int inet_aton (const char *cp, struct in_addr *ia);
 #endif
 
 #include "libslirp.h"
+#ifdef VBOX_NAT_WITH_EPOLL
+# include <sys/epoll.h>
+#endif
 
 #include "debug.h"
 
@@ -368,6 +371,10 @@ void slirp_arp_who_has(PNATState pData, uint32_t dst);
 int slirp_arp_cache_update_or_add(PNATState pData, uint32_t dst, const uint8_t *mac);
 int slirp_init_dns_list(PNATState pData);
 void slirp_release_dns_list(PNATState pData);
+#ifdef VBOX_NAT_WITH_EPOLL
+void slirpEpollMarkDirty(PNATState pData, struct socket *so);
+void slirpEpollForget(PNATState pData, struct socket *so);
+#endif
 #define MIN_MRU 128
 #define MAX_MRU 16384
 
@@ -189,6 +189,26 @@ typedef struct NATState
 #  define NSOCK_DEC() do {pData->nsock--;} while (0)
 #  define NSOCK_INC_EX(ex) do {ex->pData->nsock++;} while (0)
 #  define NSOCK_DEC_EX(ex) do {ex->pData->nsock--;} while (0)
+#  ifdef VBOX_NAT_WITH_EPOLL
+    /* persistent epoll set holding the interest of all sockets and the
+     * wakeup descriptor (registered with a NULL data pointer) */
+    int iEpollFd;
+    /* events returned by the last epoll_wait() */
+    struct epoll_event aEpollEvents[64];
+    /* number of sockets registered with the epoll set */
+    int cEpollSockets;
+    /* sockets whose wanted events need recalculating by the next fill */
+    struct socket *pEpollDirty;
+    /* sockets to service by the next poll, collected by slirp_select_wait() */
+    struct socket **papEpollService;
+    int cEpollService;
+    int cEpollServiceMax;
+    /* incremented by every slirp_select_wait(), see so_epoll_gen */
+    uint32_t uEpollGen;
+    /* link state and time of the last full resync of all sockets */
+    bool fEpollLinkUp;
+    uint32_t uEpollLastResync;
+#  endif
 # else
 #  define NSOCK_INC() do {} while (0)
 #  define NSOCK_DEC() do {} while (0)
@@ -220,6 +220,10 @@ sofree(PNATState pData, struct socket *so)
         so->so_ohdr = NULL;
     }
 
+#ifdef VBOX_NAT_WITH_EPOLL
+    slirpEpollForget(pData, so);
+#endif
+
     if (so->so_next && so->so_prev)
     {
         remque(pData, so);  /* crashes if so is not in a queue */
@@ -951,6 +955,10 @@ sosendto(PNATState pData, struct socket *so, struct mbuf *m)
      */
     if (so->so_expire)
         so->so_expire = curtime + SO_EXPIRE;
+#ifdef VBOX_NAT_WITH_EPOLL
+    if (so->so_state != SS_ISFCONNECTED)
+        slirpEpollMarkDirty(pData, so);
+#endif
     so->so_state = SS_ISFCONNECTED; /* So that it gets select()ed */
     return 0;
 }
@@ -988,6 +996,9 @@ solisten(PNATState pData, u_int32_t bind_addr, u_int port, u_int32_t laddr, u_in
     insque(pData, so,&tcb);
     NSOCK_INC();
     QSOCKET_UNLOCK(tcb);
+#ifdef VBOX_NAT_WITH_EPOLL
+    slirpEpollMarkDirty(pData, so);
+#endif
 
     /*
      * SS_FACCEPTONCE sockets must time out.
@@ -89,6 +89,15 @@ struct socket
 #ifndef RT_OS_WINDOWS
     int so_poll_index;
 #endif /* !RT_OS_WINDOWS */
+#ifdef VBOX_NAT_WITH_EPOLL
+    uint32_t so_poll_revents;    /* Events reported by slirp_select_wait */
+    uint32_t so_epoll_events;    /* Events registered with the epoll set, 0 if none */
+    int so_epoll_fd;             /* Descriptor registered with the epoll set */
+    struct socket *so_epoll_next;   /* Next socket on the dirty list */
+    struct socket **so_epoll_pprev; /* Link pointing to us on the dirty list, NULL if not on it */
+    uint32_t so_epoll_gen;       /* Wakeup the socket was last queued for servicing in */
+    int so_epoll_slot;           /* Index in the service array of that wakeup */
+#endif
     /*
      * FD_CLOSE/POLLHUP event has been occurred on socket
      */
@@ -546,6 +546,11 @@ findso:
         TCP_STATE_SWITCH_TO(tp, TCPS_LISTEN);
     }
 
+#ifdef VBOX_NAT_WITH_EPOLL
+    /* the segment may change what the socket waits for */
+    slirpEpollMarkDirty(pData, so);
+#endif
+
     /*
      * If this is a still-connecting socket, this probably
      * a retransmit of the SYN.  Whether it's a retransmit SYN
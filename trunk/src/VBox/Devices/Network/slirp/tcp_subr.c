@@ -641,5 +641,8 @@ tcp_attach(PNATState pData, struct socket *so)
     insque(pData, so, &tcb);
     NSOCK_INC();
     QSOCKET_UNLOCK(tcb);
+#ifdef VBOX_NAT_WITH_EPOLL
+    slirpEpollMarkDirty(pData, so);
+#endif
     return 0;
 }
@@ -589,6 +589,9 @@ udp_attach(PNATState pData, struct socket *so)
     insque(pData, so, &udb);
     NSOCK_INC();
     QSOCKET_UNLOCK(udb);
+#ifdef VBOX_NAT_WITH_EPOLL
+    slirpEpollMarkDirty(pData, so);
+#endif
     so->so_type = IPPROTO_UDP;
     return so->s;
 error:
@@ -656,6 +659,9 @@ udp_listen(PNATState pData, u_int32_t bind_addr, u_int port, u_int32_t laddr, u_
     insque(pData, so, &udb);
     NSOCK_INC();
     QSOCKET_UNLOCK(udb);
+#ifdef VBOX_NAT_WITH_EPOLL
+    slirpEpollMarkDirty(pData, so);
+#endif
 
     memset(&addr, 0, sizeof(addr));
 #ifdef RT_OS_DARWIN
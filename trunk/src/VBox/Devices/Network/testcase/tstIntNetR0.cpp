@@ -731,6 +731,97 @@ static void doTest(PTSTSTATE pThis, uint32_t cbRecv, uint32_t cbSend)
 }
 
 
+/**
+ * Measures the unicast switching rate against the number of interfaces on
+ * the network.
+ *
+ * A single interface sends unicast frames round robin to all the others, so
+ * the frames/second figure mostly reflects the cost of the destination
+ * lookup as the network grows.
+ *
+ * @param   cIfs                The number of interfaces to create.
+ * @param   cFrames             The number of frames to send.
+ */
+static void doSwitchBenchmark(uint32_t cIfs, uint32_t cFrames)
+{
+    RTTestISubF("switch benchmark, cIfs=%u, cFrames=%u", cIfs, cFrames);
+
+    PINTNETIFHANDLE pahIfs  = (PINTNETIFHANDLE)RTMemAllocZ(sizeof(pahIfs[0]) * cIfs);
+    PINTNETBUF     *papBufs = (PINTNETBUF *)RTMemAllocZ(sizeof(papBufs[0]) * cIfs);
+    RTTESTI_CHECK_RETV(pahIfs && papBufs);
+
+    /*
+     * Open and activate the interfaces, giving each a unique MAC address.
+     */
+    uint32_t cIfsOpened = 0;
+    while (cIfsOpened < cIfs)
+    {
+        uint32_t const i = cIfsOpened;
+        pahIfs[i] = INTNET_HANDLE_INVALID;
+        int rc;
+        RTTESTI_CHECK_RC_OK_BREAK(rc = IntNetR0Open(g_pSession, "bench", kIntNetTrunkType_None, "", 0 /*fFlags*/,
+                                                    1536 * 2 + 4, 0x8000, &pahIfs[i]));
+        cIfsOpened++;
+        RTTESTI_CHECK_RC_OK_BREAK(rc = IntNetR0IfGetBufferPtrs(pahIfs[i], g_pSession, &papBufs[i], NULL));
+
+        RTMAC Mac;
+        Mac.au16[0] = 0x8086;
+        Mac.au16[1] = 0x0100;
+        Mac.au16[2] = (uint16_t)i;
+        RTTESTI_CHECK_RC_OK_BREAK(rc = IntNetR0IfSetMacAddress(pahIfs[i], g_pSession, &Mac));
+        RTTESTI_CHECK_RC_OK_BREAK(rc = IntNetR0IfSetActive(pahIfs[i], g_pSession, true));
+    }
+
+    if (!RTTestIErrorCount())
+    {
+        /*
+         * Send the frames, dropping them at the receiving end right away.
+         */
+        uint16_t au16Frame[32];
+        RT_ZERO(au16Frame);
+        au16Frame[0] = 0x8086; au16Frame[1] = 0x0100; /* dst */
+        au16Frame[3] = 0x8086; au16Frame[4] = 0x0100; au16Frame[5] = 0; /* src */
+        au16Frame[6] = 0x0800;
+
+        uint32_t cLost   = 0;
+        uint64_t nsStart = RTTimeNanoTS();
+        for (uint32_t iFrame = 0; iFrame < cFrames; iFrame++)
+        {
+            uint32_t const iIfDst = 1 + iFrame % (cIfs - 1);
+            au16Frame[2] = (uint16_t)iIfDst;
+
+            int rc = tstIntNetSendBuf(&papBufs[0]->Send, pahIfs[0], g_pSession, au16Frame, sizeof(au16Frame));
+            if (RT_FAILURE(rc))
+            {
+                RTTestIFailed("Sending frame %u to interface %u failed: %Rrc\n", iFrame, iIfDst, rc);
+                break;
+            }
+
+            if (IntNetRingHasMoreToRead(&papBufs[iIfDst]->Recv))
+                IntNetRingSkipFrame(&papBufs[iIfDst]->Recv);
+            else
+                cLost++;
+        }
+        uint64_t const cNsElapsed = RTTimeNanoTS() - nsStart;
+
+        RTTESTI_CHECK_MSG(cLost == 0, ("%u of %u frames did not reach their destination\n", cLost, cFrames));
+        RTTestIValueF(cNsElapsed / RT_MAX(cFrames, 1), RTTESTUNIT_NS_PER_FRAME, "Unicast, %u interfaces", cIfs);
+        RTTestIValueF((uint64_t)(cFrames * 1000000000.0 / RT_MAX(cNsElapsed, 1)), RTTESTUNIT_FRAMES_PER_SEC,
+                      "Unicast, %u interfaces", cIfs);
+    }
+
+    /*
+     * Cleanup.
+     */
+    while (cIfsOpened-- > 0)
+        RTTESTI_CHECK_RC_OK(IntNetR0IfClose(pahIfs[cIfsOpened], g_pSession));
+    RTTESTI_CHECK(IntNetR0GetNetworkCount() == 0);
+
+    RTMemFree(papBufs);
+    RTMemFree(pahIfs);
+}
+
+
 int main(int argc, char **argv)
 {
     int rc = RTTestInitAndCreate("tstIntNetR0", &g_hTest);
@@ -745,10 +836,14 @@ int main(int argc, char **argv)
         { "--recv-buffer",   'r', RTGETOPT_REQ_UINT32 },
         { "--send-buffer",   's', RTGETOPT_REQ_UINT32 },
         { "--transfer-size", 'l', RTGETOPT_REQ_UINT32 },
+        { "--bench-ifs",     'i', RTGETOPT_REQ_UINT32 },
+        { "--bench-frames",  'f', RTGETOPT_REQ_UINT32 },
     };
 
     uint32_t cbSend = 1536*2 + 4;
     uint32_t cbRecv = 0x8000;
+    uint32_t cBenchIfsMax = 256;
+    uint32_t cBenchFrames = _1M;
 
     int ch;
     RTGETOPTUNION Value;
@@ -769,6 +864,14 @@ int main(int argc, char **argv)
                 cbSend = Value.u32;
                 break;
 
+            case 'i':
+                cBenchIfsMax = Value.u32;
+                break;
+
+            case 'f':
+                cBenchFrames = Value.u32;
+                break;
+
             default:
                 return RTGetOptPrintError(ch, &Value);
         }
@@ -780,6 +883,17 @@ int main(int argc, char **argv)
     RT_ZERO(This);
     doTest(&This, cbRecv, cbSend);
 
+    /*
+     * Switching rate against the network size.
+     */
+    if (!RTTestIErrorCount())
+    {
+        RTTESTI_CHECK_RC(IntNetR0Init(), VINF_SUCCESS);
+        for (uint32_t cIfs = 2; cIfs <= RT_MIN(cBenchIfsMax, INTNET_MAX_IFS); cIfs *= 2)
+            doSwitchBenchmark(cIfs, cBenchFrames);
+        IntNetR0Term();
+    }
+
     return RTTestSummaryAndDestroy(g_hTest);
 }
 
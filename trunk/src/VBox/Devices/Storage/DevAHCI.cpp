@@ -77,6 +77,13 @@
 /** Maximum number of command slots available. */
 #define AHCI_NR_COMMAND_SLOTS   32
 
+/** Default maximum delay of a completion interrupt with interrupt moderation enabled (in microseconds). */
+#define AHCI_INTR_MOD_MAX_DELAY_US_DEF  100
+/** Upper bound of the configurable maximum completion interrupt delay (in microseconds). */
+#define AHCI_INTR_MOD_MAX_DELAY_US_MAX  10000
+/** Default maximum number of completions coalesced into a single interrupt. */
+#define AHCI_INTR_MOD_MAX_BATCH_DEF     8
+
 /** The current saved state version. */
 #define AHCI_SAVED_STATE_VERSION                        9
 /** The saved state version before the ATAPI emulation was removed and the generic SCSI driver was used. */
@@ -228,6 +235,10 @@ typedef struct AHCIREQ *PAHCIREQ;
  * the other way around .*/
 #define AHCI_REQ_XFER_2_HOST RT_BIT_32(5)
 
+/** Maximum number of guest pages which can be mapped for a request
+ * to transfer the data directly from/to guest memory. */
+#define AHCI_REQ_MAPPED_PAGES_MAX 64
+
 /**
  * A task state.
  */
@@ -259,10 +270,10 @@ typedef struct AHCIREQ
     uint32_t                   fFlags;
     /** SCSI status code. */
     uint8_t                    u8ScsiSts;
-    /** Flag when the buffer is mapped. */
-    bool                       fMapped;
-    /** Page lock when the buffer is mapped. */
-    PGMPAGEMAPLOCK             PgLck;
+    /** Number of mapped guest pages, 0 if the buffer is not mapped. */
+    uint32_t                   cPgLcks;
+    /** Page locks for the mapped guest pages. */
+    PGMPAGEMAPLOCK             aPgLcks[AHCI_REQ_MAPPED_PAGES_MAX];
 } AHCIREQ;
 
 /**
@@ -580,6 +591,35 @@ typedef struct AHCI
 
     /** The support driver session handle. */
     R3R0PTRTYPE(PSUPDRVSESSION)     pSupDrvSession;
+
+    /** Timer asserting deferred completion interrupts (host driven interrupt moderation) - R3 ptr. */
+    PTMTIMERR3                      pIntrModTimerR3;
+#if HC_ARCH_BITS == 32
+    uint32_t                        Alignment8;
+#endif
+    /** Virtual timestamp of the first completion deferred in the current batch. */
+    uint64_t                        u64IntrModFirstTS;
+    /** Maximum time a completion interrupt is deferred in microseconds. */
+    uint32_t                        cIntrModMaxDelayUs;
+    /** Maximum number of completions coalesced into a single interrupt. */
+    uint32_t                        cIntrModMaxBatch;
+    /** Number of completions whose interrupt is currently deferred. */
+    uint32_t                        cIntrModPending;
+    /** Bitmask of ports with a deferred completion interrupt. */
+    uint32_t                        fIntrModPortsPending;
+    /** Flag whether the host driven interrupt moderation is enabled. */
+    bool                            fIntrModEnabled;
+    /** Padding. */
+    bool                            afAlignment9[7];
+
+    /** Number of command completions signalled to the guest. */
+    STAMCOUNTER                     StatIntrModCompletions;
+    /** Number of completion interrupts asserted. */
+    STAMCOUNTER                     StatIntrModInterrupts;
+    /** Number of completions whose interrupt got deferred. */
+    STAMCOUNTER                     StatIntrModDeferred;
+    /** Latency added to the completions by deferring the interrupt. */
+    STAMPROFILE                     StatIntrModLatency;
 } AHCI;
 /** Pointer to the state of an AHCI device. */
 typedef AHCI *PAHCI;
@@ -948,6 +988,133 @@ static DECLCALLBACK(void) ahciCccTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer, void
     AssertRC(rc);
 }
 
+/**
+ * Asserts the interrupt for all completions deferred by the host driven
+ * interrupt moderation.
+ *
+ * @returns nothing.
+ * @param   pAhci    The AHCI controller instance.
+ *
+ * @note Must be called with the controller lock held.
+ */
+static void ahciR3IntrModFlush(PAHCI pAhci)
+{
+    Assert(PDMCritSectIsOwner(&pAhci->lock));
+
+    uint32_t fPorts = pAhci->fIntrModPortsPending;
+    if (!fPorts)
+        return;
+
+    if (TMTimerIsActive(pAhci->pIntrModTimerR3))
+        TMTimerStop(pAhci->pIntrModTimerR3);
+
+    STAM_REL_COUNTER_INC(&pAhci->StatIntrModInterrupts);
+    STAM_REL_PROFILE_ADD_PERIOD(&pAhci->StatIntrModLatency,
+                                TMTimerGet(pAhci->pIntrModTimerR3) - pAhci->u64IntrModFirstTS);
+
+    pAhci->fIntrModPortsPending = 0;
+    pAhci->cIntrModPending      = 0;
+
+    while (fPorts)
+    {
+        unsigned iPort = ASMBitFirstSetU32(fPorts) - 1;
+        fPorts &= ~RT_BIT_32(iPort);
+
+        int rc = ahciHbaSetInterrupt(pAhci, (uint8_t)iPort, VERR_IGNORED);
+        AssertRC(rc);
+    }
+}
+
+/**
+ * Asserts the interrupt for all deferred completions right away, taking the
+ * controller lock.
+ *
+ * Used when the VM is suspended or saved: the timer runs on the virtual clock
+ * which stops while the VM is suspended, requests going to the suspended state
+ * don't complete and the pending completions are not part of the saved state.
+ *
+ * @returns nothing.
+ * @param   pAhci    The AHCI controller instance.
+ */
+static void ahciR3IntrModFlushNow(PAHCI pAhci)
+{
+    int rc = PDMCritSectEnter(&pAhci->lock, VERR_IGNORED);
+    AssertRC(rc);
+    ahciR3IntrModFlush(pAhci);
+    PDMCritSectLeave(&pAhci->lock);
+}
+
+/**
+ * Asserts the interrupt for deferred completions once the maximum delay
+ * of the host driven interrupt moderation elapsed.
+ */
+static DECLCALLBACK(void) ahciR3IntrModTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer, void *pvUser)
+{
+    RT_NOREF(pDevIns, pTimer);
+    PAHCI pAhci = (PAHCI)pvUser;
+
+    ahciR3IntrModFlushNow(pAhci);
+}
+
+/**
+ * Signals a completed command to the guest, deferring the interrupt if the
+ * host driven interrupt moderation is enabled and the port is under load.
+ *
+ * The moderation adapts to the queue depth: The request being completed is still
+ * accounted for in cTasksActive, so anything above one means that more completions
+ * are going to follow and can share the interrupt. The batch is therefore limited by
+ * the number of outstanding requests and the configured maximum, and the last
+ * completion of a burst (or every completion at queue depth 1) asserts the
+ * interrupt immediately without adding any latency. Requests which get suspended
+ * never complete, so the deferred interrupts are flushed when that happens and when
+ * the VM is suspended or saved (see ahciR3IntrModFlushNow()).
+ *
+ * @returns nothing.
+ * @param   pAhciPort    The port the command completed on.
+ * @param   fDefer       Flag whether the interrupt may be deferred,
+ *                       false to assert it immediately (errors for instance).
+ */
+static void ahciR3IntrModSetInterrupt(PAHCIPort pAhciPort, bool fDefer)
+{
+    PAHCI    pAhci = pAhciPort->CTX_SUFF(pAhci);
+    uint32_t iPort = pAhciPort->iLUN;
+
+    STAM_REL_COUNTER_INC(&pAhci->StatIntrModCompletions);
+
+    /* The guest does the coalescing on its own if it enabled CCC for this port. */
+    if (   !pAhci->fIntrModEnabled
+        || (   (pAhci->regHbaCccCtl & AHCI_HBA_CCC_CTL_EN)
+            && (pAhci->regHbaCccPorts & RT_BIT_32(iPort))))
+    {
+        STAM_REL_COUNTER_INC(&pAhci->StatIntrModInterrupts);
+        int rc = ahciHbaSetInterrupt(pAhci, (uint8_t)iPort, VERR_IGNORED);
+        AssertRC(rc);
+        return;
+    }
+
+    int rc = PDMCritSectEnter(&pAhci->lock, VERR_IGNORED);
+    AssertRC(rc);
+
+    if (!pAhci->cIntrModPending)
+        pAhci->u64IntrModFirstTS = TMTimerGet(pAhci->pIntrModTimerR3);
+    pAhci->fIntrModPortsPending |= RT_BIT_32(iPort);
+    pAhci->cIntrModPending++;
+
+    uint32_t cTasksActive = ASMAtomicReadU32(&pAhciPort->cTasksActive);
+    if (   !fDefer
+        || cTasksActive <= 1
+        || pAhci->cIntrModPending >= RT_MIN(pAhci->cIntrModMaxBatch, cTasksActive))
+        ahciR3IntrModFlush(pAhci);
+    else
+    {
+        STAM_REL_COUNTER_INC(&pAhci->StatIntrModDeferred);
+        if (pAhci->cIntrModPending == 1)
+            TMTimerSetMicro(pAhci->pIntrModTimerR3, pAhci->cIntrModMaxDelayUs);
+    }
+
+    PDMCritSectLeave(&pAhci->lock);
+}
+
 /**
  * Finishes the port reset of the given port.
  *
@@ -2038,6 +2205,14 @@ static void ahciHBAReset(PAHCI pThis)
             AssertMsgFailed(("%s: Failed to stop timer!\n", __FUNCTION__));
     }
 
+    /* Drop any deferred completion interrupt, the guest doesn't expect them anymore. */
+    PDMCritSectEnter(&pThis->lock, VERR_IGNORED);
+    if (TMTimerIsActive(pThis->pIntrModTimerR3))
+        TMTimerStop(pThis->pIntrModTimerR3);
+    pThis->fIntrModPortsPending = 0;
+    pThis->cIntrModPending      = 0;
+    PDMCritSectLeave(&pThis->lock);
+
     /* Reset every port */
     for (i = 0; i < pThis->cPortsImpl; i++)
     {
@@ -3194,8 +3369,10 @@ static void ahciSendD2HFis(PAHCIPort pAhciPort, uint32_t uTag, uint8_t *pCmdFis,
  * @param   pAhciPort           The port for which the SDB Fis is send.
  * @param   uFinishedTasks      Bitmask of finished tasks.
  * @param   fInterrupt          If an interrupt should be asserted.
+ * @param   fModerate           Flag whether the interrupt is subject to the host
+ *                              driven interrupt moderation (command completions).
  */
-static void ahciSendSDBFis(PAHCIPort pAhciPort, uint32_t uFinishedTasks, bool fInterrupt)
+static void ahciSendSDBFis(PAHCIPort pAhciPort, uint32_t uFinishedTasks, bool fInterrupt, bool fModerate)
 {
     uint32_t sdbFis[2];
     bool fAssertIntr = false;
@@ -3248,8 +3425,13 @@ static void ahciSendSDBFis(PAHCIPort pAhciPort, uint32_t uFinishedTasks, bool fI
 
         if (fAssertIntr)
         {
-            int rc = ahciHbaSetInterrupt(pAhci, pAhciPort->iLUN, VERR_IGNORED);
-            AssertRC(rc);
+            if (fModerate)
+                ahciR3IntrModSetInterrupt(pAhciPort, !pTaskErr /* fDefer */);
+            else
+            {
+                int rc = ahciHbaSetInterrupt(pAhci, pAhciPort->iLUN, VERR_IGNORED);
+                AssertRC(rc);
+            }
         }
     }
 }
@@ -3640,7 +3822,7 @@ static PAHCIREQ ahciR3ReqAlloc(PAHCIPort pAhciPort, uint32_t uTag)
     if (RT_SUCCESS(rc))
     {
         pAhciReq->hIoReq  = hIoReq;
-        pAhciReq->fMapped = false;
+        pAhciReq->cPgLcks = 0;
     }
     else
         pAhciReq = NULL;
@@ -3664,6 +3846,20 @@ static void ahciR3ReqFree(PAHCIPort pAhciPort, PAHCIREQ pAhciReq)
     }
 }
 
+/**
+ * Releases all guest pages mapped for the given request.
+ *
+ * @returns nothing.
+ * @param   pThis        The AHCI controller device instance.
+ * @param   pAhciReq     The request to release the mappings for.
+ */
+static void ahciR3ReqPgLcksRelease(PAHCI pThis, PAHCIREQ pAhciReq)
+{
+    for (uint32_t i = 0; i < pAhciReq->cPgLcks; i++)
+        PDMDevHlpPhysReleasePageMappingLock(pThis->CTX_SUFF(pDevIns), &pAhciReq->aPgLcks[i]);
+    pAhciReq->cPgLcks = 0;
+}
+
 /**
  * Complete a data transfer task by freeing all occupied resources
  * and notifying the guest.
@@ -3683,9 +3879,8 @@ static bool ahciTransferComplete(PAHCIPort pAhciPort, PAHCIREQ pAhciReq, int rcR
 
     VBOXDD_AHCI_REQ_COMPLETED(pAhciReq, rcReq, pAhciReq->uOffset, pAhciReq->cbTransfer);
 
-    if (pAhciReq->fMapped)
-        PDMDevHlpPhysReleasePageMappingLock(pAhciPort->CTX_SUFF(pAhci)->CTX_SUFF(pDevIns),
-                                            &pAhciReq->PgLck);
+    if (pAhciReq->cPgLcks)
+        ahciR3ReqPgLcksRelease(pAhciPort->CTX_SUFF(pAhci), pAhciReq);
 
     if (rcReq != VERR_PDM_MEDIAEX_IOREQ_CANCELED)
     {
@@ -3811,11 +4006,13 @@ static bool ahciTransferComplete(PAHCIPort pAhciPort, PAHCIREQ pAhciReq, int rcR
         if (fFlags & AHCI_REQ_IS_QUEUED)
         {
             /*
-             * Always raise an interrupt after task completion; delaying
-             * this (interrupt coalescing) increases latency and has a significant
-             * impact on performance (see @bugref{5071})
+             * Always raise an interrupt after task completion unless the host driven
+             * interrupt moderation is enabled; delaying this (interrupt coalescing)
+             * increases latency and has a significant impact on performance
+             * (see @bugref{5071}), so the moderation never defers the interrupt
+             * when there is no other request outstanding on the port.
              */
-            ahciSendSDBFis(pAhciPort, 0, true);
+            ahciSendSDBFis(pAhciPort, 0, true, true /* fModerate */);
         }
         else
             ahciSendD2HFis(pAhciPort, uTag, &cmdFis[0], true);
@@ -3919,7 +4116,8 @@ static DECLCALLBACK(int) ahciR3IoReqQueryBuf(PPDMIMEDIAEXPORT pInterface, PDMMED
 
     /* Only allow single 4KB page aligned buffers at the moment. */
     if (   pIoReq->cPrdtlEntries == 1
-        && pIoReq->cbTransfer    == _4K)
+        && pIoReq->cbTransfer    == _4K
+        && !pIoReq->cPgLcks)
     {
         RTGCPHYS GCPhysPrdt = pIoReq->GCPhysPrdtl;
         SGLEntry PrdtEntry;
@@ -3933,10 +4131,10 @@ static DECLCALLBACK(int) ahciR3IoReqQueryBuf(PPDMIMEDIAEXPORT pInterface, PDMMED
             && !(GCPhysAddrDataBase & (_4K - 1)))
         {
             rc = PDMDevHlpPhysGCPhys2CCPtr(pThis->pDevInsR3, GCPhysAddrDataBase,
-                                           0, ppvBuf, &pIoReq->PgLck);
+                                           0, ppvBuf, &pIoReq->aPgLcks[0]);
             if (RT_SUCCESS(rc))
             {
-                pIoReq->fMapped = true;
+                pIoReq->cPgLcks = 1;
                 *pcbBuf = cbData;
             }
             else
@@ -3947,6 +4145,121 @@ static DECLCALLBACK(int) ahciR3IoReqQueryBuf(PPDMIMEDIAEXPORT pInterface, PDMMED
     return rc;
 }
 
+/**
+ * @interface_method_impl{PDMIMEDIAEXPORT,pfnIoReqQuerySgBuf}
+ */
+static DECLCALLBACK(int) ahciR3IoReqQuerySgBuf(PPDMIMEDIAEXPORT pInterface, PDMMEDIAEXIOREQ hIoReq,
+                                               void *pvIoReqAlloc, PRTSGSEG paSegs, unsigned *pcSegs,
+                                               size_t *pcbBuf)
+{
+    RT_NOREF(hIoReq);
+    int rc              = VINF_SUCCESS;
+    PAHCIPort pAhciPort = RT_FROM_MEMBER(pInterface, AHCIPort, IMediaExPort);
+    PAHCIREQ pIoReq     = (PAHCIREQ)pvIoReqAlloc;
+    PAHCI pThis         = pAhciPort->CTX_SUFF(pAhci);
+    RTGCPHYS GCPhysPrdtl   = pIoReq->GCPhysPrdtl;
+    unsigned cPrdtlEntries = pIoReq->cPrdtlEntries;
+    size_t cbLeft          = pIoReq->cbTransfer;
+    unsigned cSegs         = 0;
+
+    if (   (   pIoReq->enmType != PDMMEDIAEXIOREQTYPE_READ
+            && pIoReq->enmType != PDMMEDIAEXIOREQTYPE_WRITE)
+        || !cbLeft
+        || !cPrdtlEntries
+        || pIoReq->cPgLcks)
+        return VERR_NOT_SUPPORTED;
+
+    /*
+     * Lock every guest page of the PRDTL, anything not suitable for unbuffered I/O
+     * (unaligned entries, MMIO or too many pages) is left to the copy path which
+     * also takes care of setting the overflow status if the PRDTL is too small.
+     */
+    while (   cPrdtlEntries
+           && cbLeft
+           && RT_SUCCESS(rc))
+    {
+        SGLEntry aPrdtlEntries[32];
+        uint32_t cPrdtlEntriesRead = RT_MIN(cPrdtlEntries, RT_ELEMENTS(aPrdtlEntries));
+
+        PDMDevHlpPhysRead(pThis->pDevInsR3, GCPhysPrdtl, &aPrdtlEntries[0],
+                          cPrdtlEntriesRead * sizeof(SGLEntry));
+
+        for (uint32_t i = 0; i < cPrdtlEntriesRead && cbLeft && RT_SUCCESS(rc); i++)
+        {
+            RTGCPHYS GCPhys = AHCI_RTGCPHYS_FROM_U32(aPrdtlEntries[i].u32DBAUp, aPrdtlEntries[i].u32DBA);
+            size_t cbThis   = RT_MIN((aPrdtlEntries[i].u32DescInf & SGLENTRY_DESCINF_DBC) + 1, cbLeft);
+
+            if (   (GCPhys & 511)
+                || (cbThis & 511))
+            {
+                rc = VERR_NOT_SUPPORTED;
+                break;
+            }
+
+            cbLeft -= cbThis;
+            while (   cbThis
+                   && RT_SUCCESS(rc))
+            {
+                size_t cbPage = RT_MIN(cbThis, PAGE_SIZE - (GCPhys & PAGE_OFFSET_MASK));
+                PPGMPAGEMAPLOCK pPgLck = &pIoReq->aPgLcks[pIoReq->cPgLcks];
+                void *pvPage = NULL;
+
+                if (pIoReq->cPgLcks == AHCI_REQ_MAPPED_PAGES_MAX)
+                {
+                    rc = VERR_NOT_SUPPORTED;
+                    break;
+                }
+
+                /* Guest memory is only read when writing to the medium. */
+                if (pIoReq->enmType == PDMMEDIAEXIOREQTYPE_WRITE)
+                    rc = PDMDevHlpPhysGCPhys2CCPtrReadOnly(pThis->pDevInsR3, GCPhys, 0, (void const **)&pvPage, pPgLck);
+                else
+                    rc = PDMDevHlpPhysGCPhys2CCPtr(pThis->pDevInsR3, GCPhys, 0, &pvPage, pPgLck);
+                if (RT_FAILURE(rc))
+                {
+                    rc = VERR_NOT_SUPPORTED;
+                    break;
+                }
+
+                pIoReq->cPgLcks++;
+
+                /* Merge with the previous segment if the host mappings happen to be contiguous. */
+                if (   cSegs
+                    && (uint8_t *)paSegs[cSegs - 1].pvSeg + paSegs[cSegs - 1].cbSeg == (uint8_t *)pvPage)
+                    paSegs[cSegs - 1].cbSeg += cbPage;
+                else if (cSegs < *pcSegs)
+                {
+                    paSegs[cSegs].pvSeg = pvPage;
+                    paSegs[cSegs].cbSeg = cbPage;
+                    cSegs++;
+                }
+                else
+                    rc = VERR_NOT_SUPPORTED;
+
+                GCPhys += cbPage;
+                cbThis -= cbPage;
+            }
+        }
+
+        GCPhysPrdtl   += cPrdtlEntriesRead * sizeof(SGLEntry);
+        cPrdtlEntries -= cPrdtlEntriesRead;
+    }
+
+    if (   RT_SUCCESS(rc)
+        && cbLeft)
+        rc = VERR_NOT_SUPPORTED;
+
+    if (RT_SUCCESS(rc))
+    {
+        *pcSegs = cSegs;
+        *pcbBuf = pIoReq->cbTransfer;
+    }
+    else
+        ahciR3ReqPgLcksRelease(pThis, pIoReq);
+
+    return rc;
+}
+
 /**
  * @interface_method_impl{PDMIMEDIAEXPORT,pfnIoReqQueryDiscardRanges}
  */
@@ -3987,6 +4300,12 @@ static DECLCALLBACK(void) ahciR3IoReqStateChanged(PPDMIMEDIAEXPORT pInterface, P
     {
         case PDMMEDIAEXIOREQSTATE_SUSPENDED:
         {
+            /*
+             * Completions deferred in the expectation of this request completing
+             * would wait for the timer which stops with the VM, signal them now.
+             */
+            ahciR3IntrModFlushNow(pAhciPort->pAhciR3);
+
             /* Make sure the request is not accounted for so the VM can suspend successfully. */
             uint32_t cTasksActive = ASMAtomicDecU32(&pAhciPort->cTasksActive);
             if (!cTasksActive && pAhciPort->pAhciR3->fSignalIdle)
@@ -4253,7 +4572,7 @@ static PDMMEDIAEXIOREQTYPE ahciProcessCmd(PAHCIPort pAhciPort, PAHCIREQ pAhciReq
                          */
                         bool fAbortedAll = ahciCancelActiveTasks(pAhciPort);
                         Assert(fAbortedAll); NOREF(fAbortedAll);
-                        ahciSendSDBFis(pAhciPort, 0xffffffff, true);
+                        ahciSendSDBFis(pAhciPort, 0xffffffff, true, false /* fModerate */);
 
                         break;
                     }
@@ -4651,7 +4970,7 @@ static DECLCALLBACK(int) ahciAsyncIOLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
                 AHCIREQ Req;
                 Req.uTag       = idx;
                 Req.fFlags     = AHCI_REQ_IS_ON_STACK;
-                Req.fMapped    = false;
+                Req.cPgLcks    = 0;
                 Req.cbTransfer = 0;
                 Req.uOffset    = 0;
                 Req.enmType    = PDMMEDIAEXIOREQTYPE_INVALID;
@@ -4746,6 +5065,9 @@ static DECLCALLBACK(void) ahciR3Info(PPDMDEVINS pDevIns, PCDBGFINFOHLP pHlp, con
     pHlp->pfnPrintf(pHlp, "HbaCccCtl=%#x\n", pThis->regHbaCccCtl);
     pHlp->pfnPrintf(pHlp, "HbaCccPorts=%#x\n", pThis->regHbaCccPorts);
     pHlp->pfnPrintf(pHlp, "PortsInterrupted=%#x\n", pThis->u32PortsInterrupted);
+    pHlp->pfnPrintf(pHlp, "IntrModeration=%RTbool MaxDelay=%uus MaxBatch=%u Pending=%u PortsPending=%#x\n",
+                    pThis->fIntrModEnabled, pThis->cIntrModMaxDelayUs, pThis->cIntrModMaxBatch,
+                    pThis->cIntrModPending, pThis->fIntrModPortsPending);
 
     /*
      * Per port data.
@@ -4822,8 +5144,10 @@ static bool ahciR3AllAsyncIOIsFinished(PPDMDEVINS pDevIns)
  */
 static DECLCALLBACK(int) ahciR3SavePrep(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
 {
-    RT_NOREF(pDevIns, pSSM);
+    RT_NOREF(pSSM);
     Assert(ahciR3AllAsyncIOIsFinished(pDevIns));
+    /* Deferred completions are not part of the saved state, signal them before saving the registers. */
+    ahciR3IntrModFlushNow(PDMINS_2_DATA(pDevIns, PAHCI));
     return VINF_SUCCESS;
 }
 
@@ -5353,6 +5677,7 @@ static DECLCALLBACK(bool) ahciR3IsAsyncSuspendOrPowerOffDone(PPDMDEVINS pDevIns)
         return false;
 
     PAHCI pThis = PDMINS_2_DATA(pDevIns, PAHCI);
+    ahciR3IntrModFlushNow(pThis);
     ASMAtomicWriteBool(&pThis->fSignalIdle, false);
     return true;
 }
@@ -5368,7 +5693,10 @@ static void ahciR3SuspendOrPowerOff(PPDMDEVINS pDevIns)
     if (!ahciR3AllAsyncIOIsFinished(pDevIns))
         PDMDevHlpSetAsyncNotification(pDevIns, ahciR3IsAsyncSuspendOrPowerOffDone);
     else
+    {
+        ahciR3IntrModFlushNow(pThis);
         ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+    }
 }
 
 /**
@@ -5750,6 +6078,9 @@ static DECLCALLBACK(int) ahciR3Destruct(PPDMDEVINS pDevIns)
         TMR3TimerDestroy(pThis->CTX_SUFF(pHbaCccTimer));
         pThis->CTX_SUFF(pHbaCccTimer) = NULL;
 
+        TMR3TimerDestroy(pThis->pIntrModTimerR3);
+        pThis->pIntrModTimerR3 = NULL;
+
         Log(("%s: Destruct every port\n", __FUNCTION__));
         for (unsigned iActPort = 0; iActPort < pThis->cPortsImpl; iActPort++)
         {
@@ -5795,7 +6126,10 @@ static DECLCALLBACK(int) ahciR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFG
                                     "SecondarySlave\0"
                                     "PortCount\0"
                                     "Bootable\0"
-                                    "CmdSlotsAvail\0"))
+                                    "CmdSlotsAvail\0"
+                                    "IntrModeration\0"
+                                    "IntrModerationMaxDelay\0"
+                                    "IntrModerationMaxBatch\0"))
         return PDMDEV_SET_ERROR(pDevIns, VERR_PDM_DEVINS_UNKNOWN_CFG_VALUES,
                                 N_("AHCI configuration error: unknown option specified"));
 
@@ -5844,6 +6178,33 @@ static DECLCALLBACK(int) ahciR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFG
                                    N_("AHCI configuration error: CmdSlotsAvail=%u should be at least 1"),
                                    pThis->cCmdSlotsAvail);
 
+    rc = CFGMR3QueryBoolDef(pCfg, "IntrModeration", &pThis->fIntrModEnabled, false);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("AHCI configuration error: failed to read IntrModeration as boolean"));
+
+    rc = CFGMR3QueryU32Def(pCfg, "IntrModerationMaxDelay", &pThis->cIntrModMaxDelayUs, AHCI_INTR_MOD_MAX_DELAY_US_DEF);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("AHCI configuration error: failed to read IntrModerationMaxDelay as integer"));
+    if (   pThis->cIntrModMaxDelayUs < 1
+        || pThis->cIntrModMaxDelayUs > AHCI_INTR_MOD_MAX_DELAY_US_MAX)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("AHCI configuration error: IntrModerationMaxDelay=%u should be between 1 and %u"),
+                                   pThis->cIntrModMaxDelayUs, AHCI_INTR_MOD_MAX_DELAY_US_MAX);
+
+    rc = CFGMR3QueryU32Def(pCfg, "IntrModerationMaxBatch", &pThis->cIntrModMaxBatch, AHCI_INTR_MOD_MAX_BATCH_DEF);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("AHCI configuration error: failed to read IntrModerationMaxBatch as integer"));
+    if (   pThis->cIntrModMaxBatch < 2
+        || pThis->cIntrModMaxBatch > AHCI_NR_COMMAND_SLOTS)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("AHCI configuration error: IntrModerationMaxBatch=%u should be between 2 and %u"),
+                                   pThis->cIntrModMaxBatch, AHCI_NR_COMMAND_SLOTS);
+    Log(("%s: fIntrModEnabled=%RTbool cIntrModMaxDelayUs=%u cIntrModMaxBatch=%u\n", __FUNCTION__,
+         pThis->fIntrModEnabled, pThis->cIntrModMaxDelayUs, pThis->cIntrModMaxBatch));
+
     /*
      * Initialize the instance data (everything touched by the destructor need
      * to be initialized here!).
@@ -5993,6 +6354,24 @@ static DECLCALLBACK(int) ahciR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFG
     pThis->pHbaCccTimerR0 = TMTimerR0Ptr(pThis->pHbaCccTimerR3);
     pThis->pHbaCccTimerRC = TMTimerRCPtr(pThis->pHbaCccTimerR3);
 
+    /* Create the timer for the host driven interrupt moderation. */
+    rc = PDMDevHlpTMTimerCreate(pDevIns, TMCLOCK_VIRTUAL, ahciR3IntrModTimer, pThis,
+                                TMTIMER_FLAGS_NO_CRIT_SECT, "AHCI Interrupt Moderation Timer", &pThis->pIntrModTimerR3);
+    if (RT_FAILURE(rc))
+    {
+        AssertMsgFailed(("pfnTMTimerCreate -> %Rrc\n", rc));
+        return rc;
+    }
+
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatIntrModCompletions, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of queued command completions.",         "/Devices/AHCI%d/IntrMod/Completions", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatIntrModInterrupts,  STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of completion interrupts asserted.",     "/Devices/AHCI%d/IntrMod/Interrupts", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatIntrModDeferred,    STAMTYPE_COUNTER, STAMVISIBILITY_USED,   STAMUNIT_OCCURENCES,
+                           "Number of completions with deferred interrupt.", "/Devices/AHCI%d/IntrMod/Deferred", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatIntrModLatency,     STAMTYPE_PROFILE, STAMVISIBILITY_USED,   STAMUNIT_NS_PER_CALL,
+                           "Latency added per interrupt by deferring it.",  "/Devices/AHCI%d/IntrMod/Latency", iInstance);
+
     /* Status LUN. */
     pThis->IBase.pfnQueryInterface = ahciR3Status_QueryInterface;
     pThis->ILeds.pfnQueryStatusLed = ahciR3Status_QueryStatusLed;
@@ -6028,6 +6407,7 @@ static DECLCALLBACK(int) ahciR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFG
         pAhciPort->IMediaExPort.pfnIoReqCopyFromBuf        = ahciR3IoReqCopyFromBuf;
         pAhciPort->IMediaExPort.pfnIoReqCopyToBuf          = ahciR3IoReqCopyToBuf;
         pAhciPort->IMediaExPort.pfnIoReqQueryBuf           = ahciR3IoReqQueryBuf;
+        pAhciPort->IMediaExPort.pfnIoReqQuerySgBuf         = ahciR3IoReqQuerySgBuf;
         pAhciPort->IMediaExPort.pfnIoReqQueryDiscardRanges = ahciR3IoReqQueryDiscardRanges;
         pAhciPort->IMediaExPort.pfnIoReqStateChanged       = ahciR3IoReqStateChanged;
         pAhciPort->IMediaExPort.pfnMediumEjected           = ahciR3MediumEjected;
@@ -0,0 +1,4554 @@
+/* $Id$ */
+/** @file
+ * DevNVMe - NVM Express controller device emulation.
+ *
+ * Implements a subset of the NVM Express specification revision 1.2.
+ */
+
+/*
+ * Copyright (C) 2016 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/** @page pg_dev_nvme   NVMe - NVM Express Controller Emulation.
+ *
+ * This component implements an NVM Express controller with one namespace per
+ * attached medium.  Like the AHCI device the emulation is split into a register
+ * interface and a data transfer part.
+ *
+ * The register interface lives in the MMIO handlers which are available in all
+ * contexts.  Doorbell writes only update the queue indexes and kick the worker
+ * thread responsible for the submission queue, so the common I/O path never
+ * leaves R0/RC.  Only controller configuration changes (enabling, resetting and
+ * shutting down the controller) are deferred to ring-3.
+ *
+ * Data transfers are done by a small pool of worker threads.  The admin
+ * submission queue is served by a dedicated thread, the I/O submission queues
+ * are distributed round robin over the remaining ones.  A worker fetches the
+ * commands of its queues in batches, reserving a completion queue slot for
+ * every command before it is fetched so a full completion queue never
+ * loses a completion.  The commands are submitted to the driver below through
+ * the extended media interface and completed asynchronously if possible.
+ * Every completion queue can be assigned a dedicated MSI-X vector, INTx is
+ * used if the guest doesn't enable MSI-X.
+ */
+
+
+/*********************************************************************************************************************************
+*   Header Files                                                                                                                 *
+*********************************************************************************************************************************/
+#define LOG_GROUP LOG_GROUP_DEV_NVME
+#include <VBox/vmm/pdmdev.h>
+#include <VBox/vmm/pdmstorageifs.h>
+#include <VBox/vmm/pdmqueue.h>
+#include <VBox/vmm/pdmthread.h>
+#include <VBox/vmm/pdmcritsect.h>
+#include <VBox/msi.h>
+#include <VBox/sup.h>
+#include <iprt/assert.h>
+#include <iprt/asm.h>
+#include <iprt/string.h>
+#ifdef IN_RING3
+# include <iprt/param.h>
+# include <iprt/thread.h>
+# include <iprt/semaphore.h>
+# include <iprt/alloc.h>
+# include <iprt/uuid.h>
+#endif
+#ifdef VBOX_IN_EXTPACK_R3
+# include <VBox/version.h>
+#endif
+#include "VBoxDD.h"
+
+
+/*********************************************************************************************************************************
+*   Defined Constants And Macros                                                                                                 *
+*********************************************************************************************************************************/
+/** The current saved state version. */
+#define NVME_SAVED_STATE_VERSION                1
+
+/** The NVMe specification version implemented (1.2). */
+#define NVME_VERSION                            UINT32_C(0x00010200)
+
+/** Maximum number of queues (submission and completion each) including the admin queues. */
+#define NVME_QUEUES_MAX                         32
+/** Maximum number of I/O worker threads (the admin queue has its own). */
+#define NVME_WRK_THRDS_MAX                      16
+/** Maximum number of namespaces. */
+#define NVME_NAMESPACES_MAX                     255
+/** Maximum number of entries per queue (CAP.MQES is 16bit, 0's based). */
+#define NVME_QUEUE_ENTRIES_MAX                  _64K
+/** Default number of entries per queue. */
+#define NVME_QUEUE_ENTRIES_DEF                  1024
+/** Minimum number of entries per queue. */
+#define NVME_QUEUE_ENTRIES_MIN                  2
+/** Maximum number of outstanding asynchronous event requests. */
+#define NVME_ASYNC_EVT_REQS_MAX                 4
+/** Maximum number of commands fetched from one submission queue before the
+ * worker moves on to the next queue it serves. */
+#define NVME_SUBM_QUEUE_BATCH                   32
+
+/** The memory page size supported (CAP.MPSMIN == CAP.MPSMAX == 0). */
+#define NVME_PAGE_SHIFT                         12
+/** The memory page size in bytes. */
+#define NVME_PAGE_SIZE                          RT_BIT_32(NVME_PAGE_SHIFT)
+/** The page offset mask. */
+#define NVME_PAGE_OFFSET_MASK                   (NVME_PAGE_SIZE - 1)
+/** Maximum data transfer size in pages as a power of two (Identify MDTS). */
+#define NVME_MDTS                               6
+/** Maximum data transfer size in bytes. */
+#define NVME_XFER_SIZE_MAX                      (NVME_PAGE_SIZE << NVME_MDTS)
+/** Maximum number of PRP entries for a transfer (an unaligned start adds one page). */
+#define NVME_PRPS_MAX                           ((NVME_XFER_SIZE_MAX / NVME_PAGE_SIZE) + 1)
+
+/** Size of a submission queue entry as a power of two. */
+#define NVME_SQES_LOG2                          6
+/** Size of a completion queue entry as a power of two. */
+#define NVME_CQES_LOG2                          4
+
+/** Size of the register BAR (registers + doorbells). */
+#define NVME_MMIO_SIZE                          _8K
+/** Offset of the first doorbell register. */
+#define NVME_DOORBELL_OFF                       0x1000
+/** The MSI-X table BAR. */
+#define NVME_MSIX_BAR                           4
+/** Offset of the power management capability in the PCI config space. */
+#define NVME_PCI_PM_CAP_OFF                     0x40
+/** Offset of the MSI-X capability in the PCI config space. */
+#define NVME_PCI_MSIX_CAP_OFF                   0x80
+
+/** Length of the serial number field in the identify data. */
+#define NVME_SERIAL_NUMBER_LENGTH               20
+/** Length of the model number field in the identify data. */
+#define NVME_MODEL_NUMBER_LENGTH                40
+/** Length of the firmware revision field in the identify data. */
+#define NVME_FIRMWARE_REVISION_LENGTH           8
+
+/** @name Controller registers.
+ * @{ */
+#define NVME_REG_CAP                            0x00
+#define NVME_REG_CAP_HI                         0x04
+#define NVME_REG_VS                             0x08
+#define NVME_REG_INTMS                          0x0c
+#define NVME_REG_INTMC                          0x10
+#define NVME_REG_CC                             0x14
+#define NVME_REG_CSTS                           0x1c
+#define NVME_REG_NSSR                           0x20
+#define NVME_REG_AQA                            0x24
+#define NVME_REG_ASQ                            0x28
+#define NVME_REG_ASQ_HI                         0x2c
+#define NVME_REG_ACQ                            0x30
+#define NVME_REG_ACQ_HI                         0x34
+/** @} */
+
+/** @name Controller capabilities (CAP).
+ * @{ */
+#define NVME_CAP_MQES_SET(a_cEntries)           ((uint64_t)((a_cEntries) - 1) & 0xffff)
+#define NVME_CAP_CQR                            RT_BIT_64(16)
+#define NVME_CAP_TO_SET(a_c500ms)               ((uint64_t)(a_c500ms) << 24)
+#define NVME_CAP_DSTRD_SET(a_uStride)           ((uint64_t)(a_uStride) << 32)
+#define NVME_CAP_CSS_NVM                        RT_BIT_64(37)
+#define NVME_CAP_MPSMIN_SET(a_uMps)             ((uint64_t)(a_uMps) << 48)
+#define NVME_CAP_MPSMAX_SET(a_uMps)             ((uint64_t)(a_uMps) << 52)
+/** @} */
+
+/** @name Controller configuration (CC).
+ * @{ */
+#define NVME_CC_EN                              RT_BIT_32(0)
+#define NVME_CC_CSS_GET(a_u32Cc)                (((a_u32Cc) >> 4) & 0x7)
+#define NVME_CC_MPS_GET(a_u32Cc)                (((a_u32Cc) >> 7) & 0xf)
+#define NVME_CC_AMS_GET(a_u32Cc)                (((a_u32Cc) >> 11) & 0x7)
+#define NVME_CC_SHN_GET(a_u32Cc)                (((a_u32Cc) >> 14) & 0x3)
+#define NVME_CC_IOSQES_GET(a_u32Cc)             (((a_u32Cc) >> 16) & 0xf)
+#define NVME_CC_IOCQES_GET(a_u32Cc)             (((a_u32Cc) >> 20) & 0xf)
+#define NVME_CC_WRITABLE_MASK                   UINT32_C(0x00fffff1)
+/** @} */
+
+/** @name Controller status (CSTS).
+ * @{ */
+#define NVME_CSTS_RDY                           RT_BIT_32(0)
+#define NVME_CSTS_CFS                           RT_BIT_32(1)
+#define NVME_CSTS_SHST_MASK                     (RT_BIT_32(2) | RT_BIT_32(3))
+#define NVME_CSTS_SHST_NORMAL                   0
+#define NVME_CSTS_SHST_OCCURRING                RT_BIT_32(2)
+#define NVME_CSTS_SHST_COMPLETE                 RT_BIT_32(3)
+/** @} */
+
+/** @name Admin queue attributes (AQA).
+ * @{ */
+#define NVME_AQA_ASQS_GET(a_u32Aqa)             (((a_u32Aqa) & 0xfff) + 1)
+#define NVME_AQA_ACQS_GET(a_u32Aqa)             ((((a_u32Aqa) >> 16) & 0xfff) + 1)
+#define NVME_AQA_WRITABLE_MASK                  UINT32_C(0x0fff0fff)
+/** @} */
+
+/** @name Admin command set opcodes.
+ * @{ */
+#define NVME_ADM_OPC_DELETE_IO_SQ               0x00
+#define NVME_ADM_OPC_CREATE_IO_SQ               0x01
+#define NVME_ADM_OPC_GET_LOG_PAGE               0x02
+#define NVME_ADM_OPC_DELETE_IO_CQ               0x04
+#define NVME_ADM_OPC_CREATE_IO_CQ               0x05
+#define NVME_ADM_OPC_IDENTIFY                   0x06
+#define NVME_ADM_OPC_ABORT                      0x08
+#define NVME_ADM_OPC_SET_FEATURES               0x09
+#define NVME_ADM_OPC_GET_FEATURES               0x0a
+#define NVME_ADM_OPC_ASYNC_EVT_REQ              0x0c
+/** @} */
+
+/** @name NVM command set opcodes.
+ * @{ */
+#define NVME_NVM_OPC_FLUSH                      0x00
+#define NVME_NVM_OPC_WRITE                      0x01
+#define NVME_NVM_OPC_READ                       0x02
+#define NVME_NVM_OPC_DSM                        0x09
+/** @} */
+
+/** @name Identify CNS values.
+ * @{ */
+#define NVME_IDENTIFY_CNS_NAMESPACE             0x00
+#define NVME_IDENTIFY_CNS_CONTROLLER            0x01
+#define NVME_IDENTIFY_CNS_ACTIVE_NS_LIST        0x02
+/** @} */
+
+/** @name Feature identifiers.
+ * @{ */
+#define NVME_FEAT_ARBITRATION                   0x01
+#define NVME_FEAT_POWER_MGMT                    0x02
+#define NVME_FEAT_TEMP_THRESHOLD                0x04
+#define NVME_FEAT_ERROR_RECOVERY                0x05
+#define NVME_FEAT_VOLATILE_WRITE_CACHE          0x06
+#define NVME_FEAT_NUMBER_OF_QUEUES              0x07
+#define NVME_FEAT_INTR_COALESCING               0x08
+#define NVME_FEAT_INTR_VECTOR_CONFIG            0x09
+#define NVME_FEAT_WRITE_ATOMICITY               0x0a
+#define NVME_FEAT_ASYNC_EVT_CONFIG              0x0b
+/** Number of feature values kept (indexed by the feature identifier). */
+#define NVME_FEAT_COUNT                         0x0c
+/** @} */
+
+/** @name Log page identifiers.
+ * @{ */
+#define NVME_LOG_PAGE_ERROR_INFO                0x01
+#define NVME_LOG_PAGE_SMART_HEALTH              0x02
+#define NVME_LOG_PAGE_FIRMWARE_SLOT             0x03
+/** @} */
+
+/** @name Status code types.
+ * @{ */
+#define NVME_SCT_GENERIC                        0x0
+#define NVME_SCT_CMD_SPECIFIC                   0x1
+#define NVME_SCT_MEDIA                          0x2
+/** @} */
+
+/** @name Generic command status codes.
+ * @{ */
+#define NVME_SC_SUCCESS                         0x00
+#define NVME_SC_INVALID_OPCODE                  0x01
+#define NVME_SC_INVALID_FIELD                   0x02
+#define NVME_SC_CID_CONFLICT                    0x03
+#define NVME_SC_DATA_XFER_ERROR                 0x04
+#define NVME_SC_INTERNAL_ERROR                  0x06
+#define NVME_SC_ABORT_REQUESTED                 0x07
+#define NVME_SC_INVALID_NAMESPACE               0x0b
+#define NVME_SC_CMD_SEQ_ERROR                   0x0c
+#define NVME_SC_PRP_OFFSET_INVALID              0x13
+#define NVME_SC_LBA_OUT_OF_RANGE                0x80
+#define NVME_SC_NS_NOT_READY                    0x82
+/** @} */
+
+/** @name Command specific status codes.
+ * @{ */
+#define NVME_SC_CQ_INVALID                      0x00
+#define NVME_SC_QID_INVALID                     0x01
+#define NVME_SC_QUEUE_SIZE_INVALID              0x02
+#define NVME_SC_AER_LIMIT_EXCEEDED              0x05
+#define NVME_SC_INTR_VEC_INVALID                0x08
+#define NVME_SC_LOG_PAGE_INVALID                0x09
+#define NVME_SC_QUEUE_DELETION_INVALID          0x0c
+#define NVME_SC_FEAT_NOT_SAVEABLE               0x0d
+/** @} */
+
+/** @name Media and data integrity status codes.
+ * @{ */
+#define NVME_SC_WRITE_FAULT                     0x80
+#define NVME_SC_UNRECOVERED_READ_ERROR          0x81
+/** @} */
+
+/** Builds the status field of a completion queue entry (without the phase tag). */
+#define NVME_STATUS_MAKE(a_uSct, a_uSc)         ((uint16_t)(((a_uSct) << 9) | ((a_uSc) << 1)))
+/** Do not retry bit of the status field. */
+#define NVME_STATUS_DNR                         RT_BIT(15)
+/** Generic success status. */
+#define NVME_STATUS_SUCCESS                     NVME_STATUS_MAKE(NVME_SCT_GENERIC, NVME_SC_SUCCESS)
+/** Generic error status which shouldn't be retried. */
+#define NVME_STATUS_GENERIC(a_uSc)              (NVME_STATUS_MAKE(NVME_SCT_GENERIC, (a_uSc)) | NVME_STATUS_DNR)
+/** Command specific error status which shouldn't be retried. */
+#define NVME_STATUS_CMD_SPECIFIC(a_uSc)         (NVME_STATUS_MAKE(NVME_SCT_CMD_SPECIFIC, (a_uSc)) | NVME_STATUS_DNR)
+
+/** Builds the I/O request ID from the submission queue and command identifier. */
+#define NVME_IOREQID_MAKE(a_u16SqId, a_u16Cid)  (((PDMMEDIAEXIOREQID)(a_u16Cid) << 16) | (a_u16SqId))
+/** I/O request ID used for internal requests not originating from a submission queue. */
+#define NVME_IOREQID_INTERNAL                   UINT64_C(0xffffffffffff0000)
+
+
+/*********************************************************************************************************************************
+*   Structures and Typedefs                                                                                                      *
+*********************************************************************************************************************************/
+
+/**
+ * Submission queue entry.
+ */
+typedef struct NVMECMD
+{
+    /** Opcode. */
+    uint8_t             u8Opc;
+    /** Fused operation (bits 1:0) and PRP or SGL selector (bits 7:6). */
+    uint8_t             u8Flags;
+    /** Command identifier. */
+    uint16_t            u16Cid;
+    /** Namespace identifier. */
+    uint32_t            u32Nsid;
+    /** Reserved. */
+    uint64_t            u64Rsvd;
+    /** Metadata pointer. */
+    uint64_t            u64Mptr;
+    /** PRP entry 1. */
+    uint64_t            u64Prp1;
+    /** PRP entry 2. */
+    uint64_t            u64Prp2;
+    /** Command dwords 10 to 15. */
+    uint32_t            au32Cdw[6];
+} NVMECMD;
+AssertCompileSize(NVMECMD, RT_BIT_32(NVME_SQES_LOG2));
+/** Pointer to a submission queue entry. */
+typedef NVMECMD *PNVMECMD;
+/** Pointer to a const submission queue entry. */
+typedef const NVMECMD *PCNVMECMD;
+
+/** Accessor for command dword 10 to 15. */
+#define NVME_CMD_CDW(a_pCmd, a_iDw)             ((a_pCmd)->au32Cdw[(a_iDw) - 10])
+
+/**
+ * Completion queue entry.
+ */
+typedef struct NVMECQE
+{
+    /** Command specific dword 0. */
+    uint32_t            u32Dw0;
+    /** Reserved. */
+    uint32_t            u32Rsvd;
+    /** Current submission queue head pointer. */
+    uint16_t            u16SqHead;
+    /** Submission queue identifier. */
+    uint16_t            u16SqId;
+    /** Command identifier. */
+    uint16_t            u16Cid;
+    /** Status field, bit 0 holds the phase tag. */
+    uint16_t            u16Status;
+} NVMECQE;
+AssertCompileSize(NVMECQE, RT_BIT_32(NVME_CQES_LOG2));
+/** Pointer to a completion queue entry. */
+typedef NVMECQE *PNVMECQE;
+
+#pragma pack(1)
+/**
+ * Power state descriptor.
+ */
+typedef struct NVMEPWRSTATEDESC
+{
+    /** Maximum power in centiwatts. */
+    uint16_t            u16Mp;
+    uint8_t             u8Rsvd0;
+    /** Max power scale (bit 0) and non-operational state (bit 1). */
+    uint8_t             u8Flags;
+    /** Entry latency in microseconds. */
+    uint32_t            u32EnLat;
+    /** Exit latency in microseconds. */
+    uint32_t            u32ExLat;
+    /** Relative read throughput. */
+    uint8_t             u8Rrt;
+    /** Relative read latency. */
+    uint8_t             u8Rrl;
+    /** Relative write throughput. */
+    uint8_t             u8Rwt;
+    /** Relative write latency. */
+    uint8_t             u8Rwl;
+    uint8_t             abRsvd1[16];
+} NVMEPWRSTATEDESC;
+AssertCompileSize(NVMEPWRSTATEDESC, 32);
+
+/**
+ * Identify controller data structure.
+ */
+typedef struct NVMEIDCTRL
+{
+    /** PCI vendor ID. */
+    uint16_t            u16Vid;
+    /** PCI subsystem vendor ID. */
+    uint16_t            u16SsVid;
+    /** Serial number, ASCII padded with spaces. */
+    char                achSn[NVME_SERIAL_NUMBER_LENGTH];
+    /** Model number, ASCII padded with spaces. */
+    char                achMn[NVME_MODEL_NUMBER_LENGTH];
+    /** Firmware revision, ASCII padded with spaces. */
+    char                achFr[NVME_FIRMWARE_REVISION_LENGTH];
+    /** Recommended arbitration burst. */
+    uint8_t             u8Rab;
+    /** IEEE OUI identifier. */
+    uint8_t             au8Ieee[3];
+    /** Controller multi-path I/O and namespace sharing capabilities. */
+    uint8_t             u8Cmic;
+    /** Maximum data transfer size. */
+    uint8_t             u8Mdts;
+    /** Controller ID. */
+    uint16_t            u16CntlId;
+    /** Version. */
+    uint32_t            u32Ver;
+    /** RTD3 resume latency. */
+    uint32_t            u32Rtd3r;
+    /** RTD3 entry latency. */
+    uint32_t            u32Rtd3e;
+    /** Optional asynchronous events supported. */
+    uint32_t            u32Oaes;
+    uint8_t             abRsvd0[160];
+    /** Optional admin command support. */
+    uint16_t            u16Oacs;
+    /** Abort command limit (0's based). */
+    uint8_t             u8Acl;
+    /** Asynchronous event request limit (0's based). */
+    uint8_t             u8Aerl;
+    /** Firmware updates. */
+    uint8_t             u8Frmw;
+    /** Log page attributes. */
+    uint8_t             u8Lpa;
+    /** Error log page entries (0's based). */
+    uint8_t             u8Elpe;
+    /** Number of power states supported (0's based). */
+    uint8_t             u8Npss;
+    /** Admin vendor specific command configuration. */
+    uint8_t             u8Avscc;
+    /** Autonomous power state transition attributes. */
+    uint8_t             u8Apsta;
+    /** Warning composite temperature threshold. */
+    uint16_t            u16WcTemp;
+    /** Critical composite temperature threshold. */
+    uint16_t            u16CcTemp;
+    uint8_t             abRsvd1[242];
+    /** Submission queue entry size. */
+    uint8_t             u8Sqes;
+    /** Completion queue entry size. */
+    uint8_t             u8Cqes;
+    /** Maximum outstanding commands. */
+    uint16_t            u16MaxCmd;
+    /** Number of namespaces. */
+    uint32_t            u32Nn;
+    /** Optional NVM command support. */
+    uint16_t            u16Oncs;
+    /** Fused operation support. */
+    uint16_t            u16Fuses;
+    /** Format NVM attributes. */
+    uint8_t             u8Fna;
+    /** Volatile write cache. */
+    uint8_t             u8Vwc;
+    /** Atomic write unit normal. */
+    uint16_t            u16Awun;
+    /** Atomic write unit power fail. */
+    uint16_t            u16Awupf;
+    /** NVM vendor specific command configuration. */
+    uint8_t             u8Nvscc;
+    uint8_t             u8Rsvd2;
+    /** Atomic compare & write unit. */
+    uint16_t            u16Acwu;
+    uint16_t            u16Rsvd3;
+    /** SGL support. */
+    uint32_t            u32Sgls;
+    uint8_t             abRsvd4[1508];
+    /** Power state descriptors. */
+    NVMEPWRSTATEDESC    aPsd[32];
+    /** Vendor specific. */
+    uint8_t             abVendor[1024];
+} NVMEIDCTRL;
+AssertCompileSize(NVMEIDCTRL, NVME_PAGE_SIZE);
+AssertCompileMemberOffset(NVMEIDCTRL, u16Oacs, 256);
+AssertCompileMemberOffset(NVMEIDCTRL, u8Sqes, 512);
+AssertCompileMemberOffset(NVMEIDCTRL, aPsd, 2048);
+
+/**
+ * LBA format descriptor.
+ */
+typedef struct NVMELBAFMT
+{
+    /** Metadata size. */
+    uint16_t            u16Ms;
+    /** LBA data size as a power of two. */
+    uint8_t             u8LbaDs;
+    /** Relative performance. */
+    uint8_t             u8Rp;
+} NVMELBAFMT;
+AssertCompileSize(NVMELBAFMT, 4);
+
+/**
+ * Identify namespace data structure.
+ */
+typedef struct NVMEIDNS
+{
+    /** Namespace size in logical blocks. */
+    uint64_t            u64Nsze;
+    /** Namespace capacity in logical blocks. */
+    uint64_t            u64Ncap;
+    /** Namespace utilization in logical blocks. */
+    uint64_t            u64Nuse;
+    /** Namespace features. */
+    uint8_t             u8NsFeat;
+    /** Number of LBA formats (0's based). */
+    uint8_t             u8Nlbaf;
+    /** Formatted LBA size. */
+    uint8_t             u8Flbas;
+    /** Metadata capabilities. */
+    uint8_t             u8Mc;
+    /** End-to-end data protection capabilities. */
+    uint8_t             u8Dpc;
+    /** End-to-end data protection type settings. */
+    uint8_t             u8Dps;
+    /** Namespace multi-path I/O and namespace sharing capabilities. */
+    uint8_t             u8Nmic;
+    /** Reservation capabilities. */
+    uint8_t             u8Rescap;
+    /** Format progress indicator. */
+    uint8_t             u8Fpi;
+    uint8_t             u8Rsvd0;
+    /** Namespace atomic write unit normal. */
+    uint16_t            u16Nawun;
+    /** Namespace atomic write unit power fail. */
+    uint16_t            u16Nawupf;
+    /** Namespace atomic compare & write unit. */
+    uint16_t            u16Nacwu;
+    /** Namespace atomic boundary size normal. */
+    uint16_t            u16Nabsn;
+    /** Namespace atomic boundary offset. */
+    uint16_t            u16Nabo;
+    /** Namespace atomic boundary size power fail. */
+    uint16_t            u16Nabspf;
+    uint16_t            u16Rsvd1;
+    /** NVM capacity in bytes. */
+    uint8_t             abNvmCap[16];
+    uint8_t             abRsvd2[40];
+    /** Namespace globally unique identifier. */
+    uint8_t             au8Nguid[16];
+    /** IEEE extended unique identifier. */
+    uint64_t            u64Eui64;
+    /** LBA format support. */
+    NVMELBAFMT          aLbaF[16];
+    uint8_t             abRsvd3[192];
+    /** Vendor specific. */
+    uint8_t             abVendor[3712];
+} NVMEIDNS;
+AssertCompileSize(NVMEIDNS, NVME_PAGE_SIZE);
+AssertCompileMemberOffset(NVMEIDNS, aLbaF, 128);
+
+/**
+ * SMART / health information log page.
+ */
+typedef struct NVMELOGSMART
+{
+    /** Critical warning. */
+    uint8_t             u8CritWarn;
+    /** Composite temperature in Kelvin. */
+    uint16_t            u16CompTemp;
+    /** Available spare in percent. */
+    uint8_t             u8AvailSpare;
+    /** Available spare threshold in percent. */
+    uint8_t             u8AvailSpareThresh;
+    /** Percentage used. */
+    uint8_t             u8PercUsed;
+    uint8_t             abRsvd0[26];
+    /** Data units (1000 * 512 bytes) read. */
+    uint64_t            au64DataUnitsRead[2];
+    /** Data units (1000 * 512 bytes) written. */
+    uint64_t            au64DataUnitsWritten[2];
+    /** Number of read commands completed. */
+    uint64_t            au64HostReadCmds[2];
+    /** Number of write commands completed. */
+    uint64_t            au64HostWriteCmds[2];
+    /** Controller busy time in minutes. */
+    uint64_t            au64CtrlBusyTime[2];
+    /** Number of power cycles. */
+    uint64_t            au64PowerCycles[2];
+    /** Number of power on hours. */
+    uint64_t            au64PowerOnHours[2];
+    /** Number of unsafe shutdowns. */
+    uint64_t            au64UnsafeShutdowns[2];
+    /** Number of unrecovered data integrity errors. */
+    uint64_t            au64MediaErrors[2];
+    /** Number of error information log entries. */
+    uint64_t            au64ErrLogEntries[2];
+    uint8_t             abRsvd1[320];
+} NVMELOGSMART;
+AssertCompileSize(NVMELOGSMART, 512);
+AssertCompileMemberOffset(NVMELOGSMART, au64DataUnitsRead, 32);
+
+/**
+ * Firmware slot information log page.
+ */
+typedef struct NVMELOGFWSLOT
+{
+    /** Active firmware info. */
+    uint8_t             u8Afi;
+    uint8_t             abRsvd0[7];
+    /** Firmware revision for the slots 1 to 7. */
+    char                aachFrs[7][NVME_FIRMWARE_REVISION_LENGTH];
+    uint8_t             abRsvd1[448];
+} NVMELOGFWSLOT;
+AssertCompileSize(NVMELOGFWSLOT, 512);
+
+/**
+ * Dataset management range.
+ */
+typedef struct NVMEDSMRANGE
+{
+    /** Context attributes. */
+    uint32_t            u32CtxAttr;
+    /** Length in logical blocks. */
+    uint32_t            cLbas;
+    /** Starting LBA. */
+    uint64_t            u64LbaStart;
+} NVMEDSMRANGE;
+AssertCompileSize(NVMEDSMRANGE, 16);
+#pragma pack()
+
+/**
+ * Controller state.
+ */
+typedef enum NVMESTATE
+{
+    /** Invalid state. */
+    NVMESTATE_INVALID = 0,
+    /** Disabled (CC.EN is clear and the reset is complete). */
+    NVMESTATE_DISABLED,
+    /** Enabled and processing commands. */
+    NVMESTATE_READY,
+    /** Reset in progress, waiting for outstanding requests. */
+    NVMESTATE_RESETTING,
+    /** Fatal controller error, CSTS.CFS is set. */
+    NVMESTATE_FATAL,
+    /** 32bit hack. */
+    NVMESTATE_32BIT_HACK = 0x7fffffff
+} NVMESTATE;
+
+/**
+ * Queue state.
+ */
+typedef enum NVMEQUEUESTATE
+{
+    /** Queue doesn't exist. */
+    NVMEQUEUESTATE_INVALID = 0,
+    /** Queue was created and is usable. */
+    NVMEQUEUESTATE_CREATED,
+    /** Queue is being deleted, waiting for outstanding requests. */
+    NVMEQUEUESTATE_DELETING,
+    /** 32bit hack. */
+    NVMEQUEUESTATE_32BIT_HACK = 0x7fffffff
+} NVMEQUEUESTATE;
+
+/**
+ * Queue type.
+ */
+typedef enum NVMEQUEUETYPE
+{
+    /** Invalid type. */
+    NVMEQUEUETYPE_INVALID = 0,
+    /** Submission queue. */
+    NVMEQUEUETYPE_SUBMISSION,
+    /** Completion queue. */
+    NVMEQUEUETYPE_COMPLETION,
+    /** 32bit hack. */
+    NVMEQUEUETYPE_32BIT_HACK = 0x7fffffff
+} NVMEQUEUETYPE;
+
+/**
+ * Common queue data.
+ */
+typedef struct NVMEQUEUEHDR
+{
+    /** The queue identifier. */
+    uint16_t                        u16Id;
+    /** Alignment. */
+    uint16_t                        u16Alignment0;
+    /** Number of entries in the queue. */
+    uint32_t                        cEntries;
+    /** The queue state. */
+    volatile NVMEQUEUESTATE         enmState;
+    /** Size of one entry in bytes. */
+    uint32_t                        cbEntry;
+    /** Guest physical base address of the queue. */
+    RTGCPHYS                        GCPhysBase;
+    /** Head index (written by the device for submission, by the guest for completion queues). */
+    volatile uint32_t               idxHead;
+    /** Tail index (written by the guest for submission, by the device for completion queues). */
+    volatile uint32_t               idxTail;
+    /** Flag whether the queue is physically contiguous. */
+    bool                            fPhysCont;
+    /** Alignment. */
+    bool                            afAlignment1[3];
+    /** The queue type. */
+    NVMEQUEUETYPE                   enmType;
+} NVMEQUEUEHDR;
+AssertCompileSizeAlignment(NVMEQUEUEHDR, 8);
+/** Pointer to the common queue data. */
+typedef NVMEQUEUEHDR *PNVMEQUEUEHDR;
+
+/**
+ * Submission queue.
+ */
+typedef struct NVMEQUEUESUBM
+{
+    /** Common queue data. */
+    NVMEQUEUEHDR                    Hdr;
+    /** Identifier of the completion queue this queue is bound to. */
+    uint16_t                        u16CompletionQueueId;
+    /** Command identifier of a pending delete command. */
+    uint16_t                        u16CidDelete;
+    /** Queue priority (only round robin arbitration is implemented). */
+    uint32_t                        u32Priority;
+    /** Index of the worker thread serving this queue. */
+    uint32_t                        idxWrkThrd;
+    /** Number of requests fetched from this queue which are not completed yet. */
+    volatile uint32_t               cReqsActive;
+} NVMEQUEUESUBM;
+AssertCompileSizeAlignment(NVMEQUEUESUBM, 8);
+/** Pointer to a submission queue. */
+typedef NVMEQUEUESUBM *PNVMEQUEUESUBM;
+
+/**
+ * Completion queue.
+ */
+typedef struct NVMEQUEUECOMP
+{
+    /** Common queue data. */
+    NVMEQUEUEHDR                    Hdr;
+    /** Flag whether interrupts are enabled for this queue. */
+    bool                            fIntrEnabled;
+    /** The current phase tag. */
+    bool                            fPhase;
+    /** Alignment. */
+    bool                            afAlignment0[2];
+    /** The interrupt vector assigned. */
+    uint32_t                        u32IntrVec;
+    /** Number of submission queues bound to this queue. */
+    volatile uint32_t               cSubmQueuesRef;
+    /** Number of workers waiting for a free entry. */
+    volatile uint32_t               cWaiters;
+    /** Number of entries reserved for fetched but not completed commands. */
+    volatile uint32_t               cReserved;
+    /** Alignment. */
+    uint32_t                        u32Alignment1;
+    /** Mutex serializing completion entry posting. */
+    RTSEMFASTMUTEX                  hMtx;
+} NVMEQUEUECOMP;
+AssertCompileSizeAlignment(NVMEQUEUECOMP, 8);
+/** Pointer to a completion queue. */
+typedef NVMEQUEUECOMP *PNVMEQUEUECOMP;
+
+/**
+ * Worker thread.
+ */
+typedef struct NVMEWRKTHRD
+{
+    /** The thread handle. */
+    R3PTRTYPE(PPDMTHREAD)           pThreadR3;
+    /** Event semaphore the thread waits on. */
+    SUPSEMEVENT                     hEvtProcess;
+    /** Flag whether the thread is sleeping. */
+    volatile bool                   fWrkThrdSleeping;
+    /** Alignment. */
+    bool                            afAlignment0[3];
+    /** Index of the thread. */
+    uint32_t                        idx;
+} NVMEWRKTHRD;
+AssertCompileSizeAlignment(NVMEWRKTHRD, 8);
+/** Pointer to a worker thread. */
+typedef NVMEWRKTHRD *PNVMEWRKTHRD;
+
+/** Pointer to the shared NVMe controller state. */
+typedef struct NVME *PNVME;
+
+/**
+ * A namespace, one for every attached medium (ring-3 only).
+ */
+typedef struct NVMENAMESPACE
+{
+    /** Pointer to the controller. */
+    PNVME                           pNvmeR3;
+    /** The LUN, the namespace identifier is the LUN + 1. */
+    uint32_t                        iLUN;
+    /** Size of one logical block in bytes. */
+    uint32_t                        cbSector;
+    /** Number of logical blocks. */
+    uint64_t                        cSectors;
+    /** Flag whether the medium supports discarding. */
+    bool                            fDiscard;
+    /** Alignment. */
+    bool                            afAlignment0[7];
+    /** Pointer to the attached driver's base interface. */
+    PPDMIBASE                       pDrvBase;
+    /** Pointer to the attached driver's media interface. */
+    PPDMIMEDIA                      pDrvMedia;
+    /** Pointer to the attached driver's extended media interface. */
+    PPDMIMEDIAEX                    pDrvMediaEx;
+    /** Our base interface. */
+    PDMIBASE                        IBase;
+    /** Our media port interface. */
+    PDMIMEDIAPORT                   IPort;
+    /** Our extended media port interface. */
+    PDMIMEDIAEXPORT                 IMediaExPort;
+    /** The status LED. */
+    PDMLED                          Led;
+    /** Description used when attaching the driver. */
+    char                            szDesc[16];
+} NVMENAMESPACE;
+/** Pointer to a namespace. */
+typedef NVMENAMESPACE *PNVMENAMESPACE;
+
+/**
+ * A command which was suspended when the state was saved and is redone after loading it (ring-3 only).
+ */
+typedef struct NVMECMDREDO
+{
+    /** Identifier of the submission queue the command was fetched from. */
+    uint16_t                        u16SqId;
+    /** Alignment. */
+    uint16_t                        au16Alignment0[3];
+    /** The command. */
+    NVMECMD                         Cmd;
+} NVMECMDREDO;
+/** Pointer to a command to redo. */
+typedef NVMECMDREDO *PNVMECMDREDO;
+
+/**
+ * The NVMe controller instance data.
+ */
+typedef struct NVME
+{
+    /** The PCI device structure. */
+    PDMPCIDEV                       PciDev;
+    /** Pointer to the device instance - R3 ptr. */
+    PPDMDEVINSR3                    pDevInsR3;
+    /** Pointer to the device instance - R0 ptr. */
+    PPDMDEVINSR0                    pDevInsR0;
+    /** Pointer to the device instance - RC ptr. */
+    PPDMDEVINSRC                    pDevInsRC;
+    /** Alignment. */
+    RTRCPTR                         RCPtrAlignment0;
+
+    /** Status LUN: The base interface. */
+    PDMIBASE                        IBase;
+    /** Status LUN: Leds interface. */
+    PDMILEDPORTS                    ILeds;
+    /** Status LUN: Partner of ILeds. */
+    R3PTRTYPE(PPDMILEDCONNECTORS)   pLedsConnector;
+    /** The support driver session handle. */
+    R3R0PTRTYPE(PSUPDRVSESSION)     pSupDrvSession;
+
+    /** Queue to kick the worker threads from RC - R3 ptr. */
+    R3PTRTYPE(PPDMQUEUE)            pNotifierQueueR3;
+    /** Queue to kick the worker threads from RC - R0 ptr. */
+    R0PTRTYPE(PPDMQUEUE)            pNotifierQueueR0;
+    /** Queue to kick the worker threads from RC - RC ptr. */
+    RCPTRTYPE(PPDMQUEUE)            pNotifierQueueRC;
+    /** Alignment. */
+    RTRCPTR                         RCPtrAlignment1;
+
+    /** Base address of the register BAR. */
+    RTGCPHYS                        GCPhysMMIO;
+
+    /** Maximum number of I/O submission queues (configured). */
+    uint32_t                        cQueuesSubmMax;
+    /** Maximum number of I/O completion queues (configured). */
+    uint32_t                        cQueuesCompMax;
+    /** Maximum number of entries per queue (configured). */
+    uint32_t                        cQueueEntriesMax;
+    /** Number of I/O worker threads (configured). */
+    uint32_t                        cWrkThrdsMax;
+    /** Number of namespaces (configured). */
+    uint32_t                        cNamespaces;
+    /** Number of MSI-X vectors, 0 if MSI-X is not available. */
+    uint32_t                        cMsixVectors;
+
+    /** The serial number reported. */
+    char                            szSerialNumber[NVME_SERIAL_NUMBER_LENGTH+1];
+    /** The model number reported. */
+    char                            szModelNumber[NVME_MODEL_NUMBER_LENGTH+1];
+    /** The firmware revision reported. */
+    char                            szFirmwareRevision[NVME_FIRMWARE_REVISION_LENGTH+1];
+    /** Flag whether RC is enabled. */
+    bool                            fRCEnabled;
+    /** Flag whether R0 is enabled. */
+    bool                            fR0Enabled;
+    /** Flag whether we are signalling the completion of an async notification. */
+    volatile bool                   fSignalIdle;
+    /** Alignment. */
+    bool                            afAlignment2[4];
+
+    /** The controller state. */
+    volatile NVMESTATE              enmState;
+    /** Controller configuration register. */
+    volatile uint32_t               u32RegCc;
+    /** Controller status register. */
+    volatile uint32_t               u32RegCsts;
+    /** Admin queue attributes register. */
+    uint32_t                        u32RegAqa;
+    /** Admin submission queue base address register. */
+    uint64_t                        u64RegAsq;
+    /** Admin completion queue base address register. */
+    uint64_t                        u64RegAcq;
+    /** Interrupt mask (INTMS/INTMC), only relevant for INTx. */
+    volatile uint32_t               u32IntrMask;
+    /** Number of I/O submission queues granted to the guest (Set Features). */
+    uint32_t                        cQueuesSubmAlloc;
+    /** Number of I/O completion queues granted to the guest (Set Features). */
+    uint32_t                        cQueuesCompAlloc;
+    /** Number of outstanding asynchronous event requests. */
+    uint32_t                        cAsyncEvtReqs;
+    /** Command identifiers of the outstanding asynchronous event requests. */
+    uint16_t                        au16AsyncEvtReqCids[NVME_ASYNC_EVT_REQS_MAX];
+    /** Current feature values, indexed by feature identifier. */
+    uint32_t                        au32Features[NVME_FEAT_COUNT];
+
+    /** Number of active requests over all queues. */
+    volatile uint32_t               cReqsActive;
+    /** Number of active worker threads. */
+    volatile uint32_t               cThreadsActive;
+
+    /** Number of bytes read (for the SMART log). */
+    volatile uint64_t               cbRead;
+    /** Number of bytes written (for the SMART log). */
+    volatile uint64_t               cbWritten;
+    /** Number of read commands completed (for the SMART log). */
+    volatile uint64_t               cReadCmds;
+    /** Number of write commands completed (for the SMART log). */
+    volatile uint64_t               cWriteCmds;
+
+    /** Critical section protecting the INTx level. */
+    PDMCRITSECT                     CritSectIntr;
+
+    /** The submission queues, index 0 is the admin queue. */
+    NVMEQUEUESUBM                   aQueuesSubm[NVME_QUEUES_MAX];
+    /** The completion queues, index 0 is the admin queue. */
+    NVMEQUEUECOMP                   aQueuesComp[NVME_QUEUES_MAX];
+    /** The worker threads, index 0 serves the admin queue. */
+    NVMEWRKTHRD                     aWrkThrds[NVME_WRK_THRDS_MAX + 1];
+
+    /** Array of namespaces - R3 ptr. */
+    R3PTRTYPE(PNVMENAMESPACE)       paNamespacesR3;
+    /** Commands to redo after the state was loaded - R3 ptr. */
+    R3PTRTYPE(PNVMECMDREDO)         paCmdsRedoR3;
+    /** Number of commands to redo. */
+    uint32_t                        cCmdsRedo;
+    /** Alignment. */
+    uint32_t                        u32Alignment3;
+
+#ifdef VBOX_WITH_STATISTICS
+    /** Number of doorbell writes in R3. */
+    STAMCOUNTER                     StatDoorbellWritesR3;
+    /** Number of doorbell writes in R0/RC. */
+    STAMCOUNTER                     StatDoorbellWritesRZ;
+    /** Number of commands fetched per submission queue. */
+    STAMCOUNTER                     aStatSubmQueueCmds[NVME_QUEUES_MAX];
+    /** Number of times a worker found a completion queue full. */
+    STAMCOUNTER                     aStatCompQueueFull[NVME_QUEUES_MAX];
+#endif
+} NVME;
+AssertCompileMemberAlignment(NVME, aQueuesSubm, 8);
+AssertCompileMemberAlignment(NVME, CritSectIntr, 8);
+
+/**
+ * Notifier queue item used to kick a worker thread from RC.
+ */
+typedef struct NVMENOTIFIERQUEUEITEM
+{
+    /** The core part owned by the queue manager. */
+    PDMQUEUEITEMCORE                Core;
+    /** Index of the worker thread to kick. */
+    uint32_t                        idxWrkThrd;
+} NVMENOTIFIERQUEUEITEM;
+/** Pointer to a notifier queue item. */
+typedef NVMENOTIFIERQUEUEITEM *PNVMENOTIFIERQUEUEITEM;
+
+/**
+ * The PRP entries describing a data transfer.
+ */
+typedef struct NVMEPRPS
+{
+    /** Number of valid entries. */
+    uint32_t                        cPrps;
+    /** Number of bytes described. */
+    uint32_t                        cbXfer;
+    /** Guest physical address of every page, only the first one can have an offset. */
+    RTGCPHYS                        aGCPhys[NVME_PRPS_MAX];
+} NVMEPRPS;
+/** Pointer to a PRP array. */
+typedef NVMEPRPS *PNVMEPRPS;
+/** Pointer to a const PRP array. */
+typedef const NVMEPRPS *PCNVMEPRPS;
+
+/**
+ * An I/O request, allocated by the driver below (ring-3 only).
+ */
+typedef struct NVMEREQ
+{
+    /** The I/O request handle. */
+    PDMMEDIAEXIOREQ                 hIoReq;
+    /** The submission queue the command was fetched from. */
+    PNVMEQUEUESUBM                  pSq;
+    /** The namespace the request is for. */
+    PNVMENAMESPACE                  pNs;
+    /** The request type. */
+    PDMMEDIAEXIOREQTYPE             enmType;
+    /** Number of discard ranges. */
+    uint32_t                        cRanges;
+    /** Number of bytes to transfer. */
+    size_t                          cbTransfer;
+    /** Number of locked guest pages. */
+    uint32_t                        cPgLcks;
+    /** Copy of the command (needed to redo it after restoring a saved state). */
+    NVMECMD                         Cmd;
+    /** The PRP entries. */
+    NVMEPRPS                        Prps;
+    /** Locks for the guest pages mapped for unbuffered I/O. */
+    PGMPAGEMAPLOCK                  aPgLcks[NVME_PRPS_MAX];
+} NVMEREQ;
+/** Pointer to an I/O request. */
+typedef NVMEREQ *PNVMEREQ;
+
+#ifndef VBOX_DEVICE_STRUCT_TESTCASE
+
+#define PDMIBASE_2_PNVME(pInterface)                ( (PNVME)((uintptr_t)(pInterface) - RT_OFFSETOF(NVME, IBase)) )
+#define PDMILEDPORTS_2_PNVME(pInterface)            ( (PNVME)((uintptr_t)(pInterface) - RT_OFFSETOF(NVME, ILeds)) )
+#define PDMIBASE_2_PNVMENAMESPACE(pInterface)       ( (PNVMENAMESPACE)((uintptr_t)(pInterface) - RT_OFFSETOF(NVMENAMESPACE, IBase)) )
+#define PDMIMEDIAPORT_2_PNVMENAMESPACE(pInterface)  ( (PNVMENAMESPACE)((uintptr_t)(pInterface) - RT_OFFSETOF(NVMENAMESPACE, IPort)) )
+
+
+/*********************************************************************************************************************************
+*   Internal Functions                                                                                                           *
+*********************************************************************************************************************************/
+RT_C_DECLS_BEGIN
+PDMBOTHCBDECL(int) nvmeMMIOWrite(PPDMDEVINS pDevIns, void *pvUser, RTGCPHYS GCPhysAddr, void const *pv, unsigned cb);
+PDMBOTHCBDECL(int) nvmeMMIORead(PPDMDEVINS pDevIns, void *pvUser, RTGCPHYS GCPhysAddr, void *pv, unsigned cb);
+RT_C_DECLS_END
+#ifdef IN_RING3
+static int  nvmeR3RegCcWrite(PNVME pThis, uint32_t u32Value);
+static void nvmeR3CtrlIdleCheck(PNVME pThis);
+static void nvmeR3ReqSubmit(PNVME pThis, PNVMEQUEUESUBM pSq, PNVMENAMESPACE pNs, PCNVMECMD pCmd,
+                            PDMMEDIAEXIOREQTYPE enmType, uint64_t offStart, size_t cbTransfer);
+#endif
+
+
+/**
+ * Kicks a worker thread.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   idxWrkThrd  Index of the worker thread to kick.
+ */
+static void nvmeWrkThrdKick(PNVME pThis, uint32_t idxWrkThrd)
+{
+    PNVMEWRKTHRD pWrkThrd = &pThis->aWrkThrds[idxWrkThrd];
+
+    if (!ASMAtomicReadBool(&pWrkThrd->fWrkThrdSleeping))
+        return;
+
+#ifdef IN_RC
+    PNVMENOTIFIERQUEUEITEM pItem = (PNVMENOTIFIERQUEUEITEM)PDMQueueAlloc(pThis->CTX_SUFF(pNotifierQueue));
+    AssertMsg(VALID_PTR(pItem), ("Allocating item for queue failed\n"));
+
+    if (pItem)
+    {
+        pItem->idxWrkThrd = idxWrkThrd;
+        PDMQueueInsert(pThis->CTX_SUFF(pNotifierQueue), (PPDMQUEUEITEMCORE)pItem);
+    }
+#else
+    LogFlowFunc(("Signal event semaphore of worker %u\n", idxWrkThrd));
+    int rc = SUPSemEventSignal(pThis->pSupDrvSession, pWrkThrd->hEvtProcess);
+    AssertRC(rc);
+#endif
+}
+
+/**
+ * Kicks all worker threads serving submission queues bound to the given completion queue.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pCq         The completion queue.
+ */
+static void nvmeCompQueueWaitersKick(PNVME pThis, PNVMEQUEUECOMP pCq)
+{
+    uint32_t fWrkThrdsKicked = 0;
+    AssertCompile(RT_ELEMENTS(pThis->aWrkThrds) <= 32);
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesSubm); i++)
+    {
+        PNVMEQUEUESUBM pSq = &pThis->aQueuesSubm[i];
+
+        if (   pSq->Hdr.enmState != NVMEQUEUESTATE_INVALID
+            && pSq->u16CompletionQueueId == pCq->Hdr.u16Id
+            && !(fWrkThrdsKicked & RT_BIT_32(pSq->idxWrkThrd)))
+        {
+            fWrkThrdsKicked |= RT_BIT_32(pSq->idxWrkThrd);
+            nvmeWrkThrdKick(pThis, pSq->idxWrkThrd);
+        }
+    }
+}
+
+/**
+ * Returns whether MSI-X was enabled by the guest.
+ *
+ * @returns true if MSI-X is enabled, false if INTx is used.
+ * @param   pThis       The NVMe controller instance.
+ */
+DECLINLINE(bool) nvmeMsixIsEnabled(PNVME pThis)
+{
+    if (!pThis->cMsixVectors)
+        return false;
+
+    uint16_t u16MsgCtrl = PCIDevGetWord(&pThis->PciDev, NVME_PCI_MSIX_CAP_OFF + VBOX_MSIX_CAP_MESSAGE_CONTROL);
+    return RT_BOOL(u16MsgCtrl & VBOX_PCI_MSIX_FLAGS_ENABLE);
+}
+
+/**
+ * Recalculates the INTx level from the completion queue states, the caller must
+ * hold the interrupt critical section.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ */
+static void nvmeIntxUpdate(PNVME pThis)
+{
+    int iLevel = PDM_IRQ_LEVEL_LOW;
+
+    Assert(PDMCritSectIsOwner(&pThis->CritSectIntr));
+
+    if (!(ASMAtomicReadU32(&pThis->u32IntrMask) & RT_BIT_32(0)))
+    {
+        for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesComp); i++)
+        {
+            PNVMEQUEUECOMP pCq = &pThis->aQueuesComp[i];
+
+            if (   pCq->Hdr.enmState == NVMEQUEUESTATE_CREATED
+                && pCq->fIntrEnabled
+                && ASMAtomicReadU32(&pCq->Hdr.idxHead) != ASMAtomicReadU32(&pCq->Hdr.idxTail))
+            {
+                iLevel = PDM_IRQ_LEVEL_HIGH;
+                break;
+            }
+        }
+    }
+
+    PDMDevHlpPCISetIrq(pThis->CTX_SUFF(pDevIns), 0, iLevel);
+}
+
+/**
+ * Handles a submission queue tail doorbell write.
+ *
+ * @returns VBox status code.
+ * @param   pThis       The NVMe controller instance.
+ * @param   u16QueueId  The submission queue identifier.
+ * @param   u32Value    The new tail index.
+ */
+static int nvmeDoorbellSubmQueueWrite(PNVME pThis, uint16_t u16QueueId, uint32_t u32Value)
+{
+    PNVMEQUEUESUBM pSq = &pThis->aQueuesSubm[u16QueueId];
+
+    if (RT_UNLIKELY(   pSq->Hdr.enmState != NVMEQUEUESTATE_CREATED
+                    || u32Value >= pSq->Hdr.cEntries))
+    {
+        Log(("nvmeDoorbellSubmQueueWrite: Invalid doorbell write to SQ %u with value %#x ignored\n", u16QueueId, u32Value));
+        return VINF_SUCCESS;
+    }
+
+    ASMAtomicWriteU32(&pSq->Hdr.idxTail, u32Value);
+    if (ASMAtomicReadU32((volatile uint32_t *)&pThis->enmState) == NVMESTATE_READY)
+        nvmeWrkThrdKick(pThis, pSq->idxWrkThrd);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Handles a completion queue head doorbell write.
+ *
+ * @returns VBox status code.
+ * @param   pThis       The NVMe controller instance.
+ * @param   u16QueueId  The completion queue identifier.
+ * @param   u32Value    The new head index.
+ */
+static int nvmeDoorbellCompQueueWrite(PNVME pThis, uint16_t u16QueueId, uint32_t u32Value)
+{
+    PNVMEQUEUECOMP pCq = &pThis->aQueuesComp[u16QueueId];
+
+    if (RT_UNLIKELY(   pCq->Hdr.enmState != NVMEQUEUESTATE_CREATED
+                    || u32Value >= pCq->Hdr.cEntries))
+    {
+        Log(("nvmeDoorbellCompQueueWrite: Invalid doorbell write to CQ %u with value %#x ignored\n", u16QueueId, u32Value));
+        return VINF_SUCCESS;
+    }
+
+    bool fMsix = nvmeMsixIsEnabled(pThis);
+    if (!fMsix)
+    {
+        int rc = PDMCritSectEnter(&pThis->CritSectIntr, VINF_IOM_R3_MMIO_WRITE);
+        if (rc != VINF_SUCCESS)
+            return rc;
+    }
+
+    ASMAtomicWriteU32(&pCq->Hdr.idxHead, u32Value);
+
+    /* Wake up everyone waiting for a free completion queue entry. */
+    if (ASMAtomicXchgU32(&pCq->cWaiters, 0))
+        nvmeCompQueueWaitersKick(pThis, pCq);
+
+    if (!fMsix)
+    {
+        nvmeIntxUpdate(pThis);
+        PDMCritSectLeave(&pThis->CritSectIntr);
+    }
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Handles a write to one of the doorbell registers.
+ *
+ * @returns VBox status code.
+ * @param   pThis       The NVMe controller instance.
+ * @param   offReg      Offset of the doorbell register relative to the first one.
+ * @param   u32Value    The value written.
+ */
+static int nvmeDoorbellWrite(PNVME pThis, uint32_t offReg, uint32_t u32Value)
+{
+    uint32_t idxDoorbell = offReg / sizeof(uint32_t);
+    uint16_t u16QueueId  = (uint16_t)(idxDoorbell / 2);
+
+    STAM_COUNTER_INC(&pThis->CTX_SUFF_Z(StatDoorbellWrites));
+
+    if (RT_UNLIKELY(u16QueueId >= NVME_QUEUES_MAX))
+    {
+        Log(("nvmeDoorbellWrite: Doorbell write to non existing queue %u ignored\n", u16QueueId));
+        return VINF_SUCCESS;
+    }
+
+    if (ASMAtomicReadU32((volatile uint32_t *)&pThis->enmState) != NVMESTATE_READY)
+    {
+        Log(("nvmeDoorbellWrite: Doorbell write while the controller is not ready ignored\n"));
+        return VINF_SUCCESS;
+    }
+
+    if (!(idxDoorbell & 1))
+        return nvmeDoorbellSubmQueueWrite(pThis, u16QueueId, u32Value);
+    return nvmeDoorbellCompQueueWrite(pThis, u16QueueId, u32Value);
+}
+
+/**
+ * Handles a write to one of the controller registers.
+ *
+ * @returns VBox status code.
+ * @param   pThis       The NVMe controller instance.
+ * @param   offReg      Offset of the register.
+ * @param   u32Value    The value written.
+ */
+static int nvmeRegWrite(PNVME pThis, uint32_t offReg, uint32_t u32Value)
+{
+    int rc = VINF_SUCCESS;
+
+    switch (offReg)
+    {
+        case NVME_REG_INTMS:
+        case NVME_REG_INTMC:
+        {
+            /* Only vector 0 exists with INTx, and the registers must not be used with MSI-X. */
+            if (nvmeMsixIsEnabled(pThis))
+                break;
+
+            rc = PDMCritSectEnter(&pThis->CritSectIntr, VINF_IOM_R3_MMIO_WRITE);
+            if (rc != VINF_SUCCESS)
+                break;
+
+            if (offReg == NVME_REG_INTMS)
+                ASMAtomicOrU32(&pThis->u32IntrMask, u32Value & RT_BIT_32(0));
+            else
+                ASMAtomicAndU32(&pThis->u32IntrMask, ~(u32Value & RT_BIT_32(0)));
+            nvmeIntxUpdate(pThis);
+            PDMCritSectLeave(&pThis->CritSectIntr);
+            break;
+        }
+        case NVME_REG_CC:
+        {
+#ifndef IN_RING3
+            rc = VINF_IOM_R3_MMIO_WRITE;
+#else
+            rc = nvmeR3RegCcWrite(pThis, u32Value);
+#endif
+            break;
+        }
+        case NVME_REG_AQA:
+        {
+            if (!(ASMAtomicReadU32(&pThis->u32RegCc) & NVME_CC_EN))
+                pThis->u32RegAqa = u32Value & NVME_AQA_WRITABLE_MASK;
+            break;
+        }
+        case NVME_REG_ASQ:
+        case NVME_REG_ASQ_HI:
+        case NVME_REG_ACQ:
+        case NVME_REG_ACQ_HI:
+        {
+            if (ASMAtomicReadU32(&pThis->u32RegCc) & NVME_CC_EN)
+                break;
+
+            uint64_t *pu64Reg = offReg < NVME_REG_ACQ ? &pThis->u64RegAsq : &pThis->u64RegAcq;
+            if (!(offReg & 0x4))
+                *pu64Reg = RT_MAKE_U64(u32Value & ~NVME_PAGE_OFFSET_MASK, RT_HI_U32(*pu64Reg));
+            else
+                *pu64Reg = RT_MAKE_U64(RT_LO_U32(*pu64Reg), u32Value);
+            break;
+        }
+        case NVME_REG_NSSR:
+            /* NVM subsystem resets are not supported (CAP.NSSRS is clear). */
+        default:
+            Log(("nvmeRegWrite: Write to read-only or reserved register %#x ignored\n", offReg));
+            break;
+    }
+
+    return rc;
+}
+
+/**
+ * Reads one of the controller registers.
+ *
+ * @returns Register value.
+ * @param   pThis       The NVMe controller instance.
+ * @param   offReg      Offset of the register.
+ */
+static uint32_t nvmeRegRead(PNVME pThis, uint32_t offReg)
+{
+    uint64_t u64Cap =   NVME_CAP_MQES_SET(pThis->cQueueEntriesMax)
+                      | NVME_CAP_CQR
+                      | NVME_CAP_TO_SET(40) /* 20 seconds */
+                      | NVME_CAP_DSTRD_SET(0)
+                      | NVME_CAP_CSS_NVM
+                      | NVME_CAP_MPSMIN_SET(NVME_PAGE_SHIFT - 12)
+                      | NVME_CAP_MPSMAX_SET(NVME_PAGE_SHIFT - 12);
+
+    switch (offReg)
+    {
+        case NVME_REG_CAP:
+            return RT_LO_U32(u64Cap);
+        case NVME_REG_CAP_HI:
+            return RT_HI_U32(u64Cap);
+        case NVME_REG_VS:
+            return NVME_VERSION;
+        case NVME_REG_INTMS:
+        case NVME_REG_INTMC:
+            return ASMAtomicReadU32(&pThis->u32IntrMask);
+        case NVME_REG_CC:
+            return ASMAtomicReadU32(&pThis->u32RegCc);
+        case NVME_REG_CSTS:
+            return ASMAtomicReadU32(&pThis->u32RegCsts);
+        case NVME_REG_AQA:
+            return pThis->u32RegAqa;
+        case NVME_REG_ASQ:
+            return RT_LO_U32(pThis->u64RegAsq);
+        case NVME_REG_ASQ_HI:
+            return RT_HI_U32(pThis->u64RegAsq);
+        case NVME_REG_ACQ:
+            return RT_LO_U32(pThis->u64RegAcq);
+        case NVME_REG_ACQ_HI:
+            return RT_HI_U32(pThis->u64RegAcq);
+        default:
+            /* Reserved and the optional controller memory buffer registers read as zero. */
+            return 0;
+    }
+}
+
+/**
+ * Memory mapped I/O handler for write operations.
+ *
+ * @returns VBox status code.
+ *
+ * @param   pDevIns     The device instance.
+ * @param   pvUser      User argument.
+ * @param   GCPhysAddr  Physical address (in GC) where the read starts.
+ * @param   pv          Where to fetch the result.
+ * @param   cb          Number of bytes to write.
+ */
+PDMBOTHCBDECL(int) nvmeMMIOWrite(PPDMDEVINS pDevIns, void *pvUser, RTGCPHYS GCPhysAddr, void const *pv, unsigned cb)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    uint32_t offReg = (uint32_t)(GCPhysAddr - pThis->GCPhysMMIO);
+    RT_NOREF1(pvUser);
+
+    Log2(("#%d nvmeMMIOWrite: pvUser=%p:{%.*Rhxs} cb=%d GCPhysAddr=%RGp\n",
+          pDevIns->iInstance, pv, cb, pv, cb, GCPhysAddr));
+
+    /* Break up 64-bit accesses into two dword ones. */
+    Assert(cb == 4 || cb == 8);
+    Assert(!(offReg & 0x3));
+    int rc = VINF_SUCCESS;
+    for (unsigned off = 0; off < cb && rc == VINF_SUCCESS; off += sizeof(uint32_t))
+    {
+        uint32_t u32Value = ((uint32_t const *)pv)[off / sizeof(uint32_t)];
+
+        if (offReg + off >= NVME_DOORBELL_OFF)
+            rc = nvmeDoorbellWrite(pThis, offReg + off - NVME_DOORBELL_OFF, u32Value);
+        else
+            rc = nvmeRegWrite(pThis, offReg + off, u32Value);
+    }
+
+    return rc;
+}
+
+/**
+ * Memory mapped I/O handler for read operations.
+ *
+ * @returns VBox status code.
+ *
+ * @param   pDevIns     The device instance.
+ * @param   pvUser      User argument.
+ * @param   GCPhysAddr  Physical address (in GC) where the read starts.
+ * @param   pv          Where to store the result.
+ * @param   cb          Number of bytes read.
+ */
+PDMBOTHCBDECL(int) nvmeMMIORead(PPDMDEVINS pDevIns, void *pvUser, RTGCPHYS GCPhysAddr, void *pv, unsigned cb)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    uint32_t offReg = (uint32_t)(GCPhysAddr - pThis->GCPhysMMIO);
+    RT_NOREF1(pvUser);
+
+    /* IOMMMIO_FLAGS_READ_DWORD makes sure we only see aligned dword reads. */
+    Assert(cb == 4); Assert(!(offReg & 0x3)); RT_NOREF1(cb);
+
+    /* The doorbells are write only. */
+    if (offReg >= NVME_DOORBELL_OFF)
+        *(uint32_t *)pv = 0;
+    else
+        *(uint32_t *)pv = nvmeRegRead(pThis, offReg);
+
+    Log2(("#%d nvmeMMIORead: return pvUser=%p:{%.*Rhxs} cb=%d GCPhysAddr=%RGp\n",
+          pDevIns->iInstance, pv, cb, pv, cb, GCPhysAddr));
+    return VINF_SUCCESS;
+}
+
+#ifdef IN_RING3
+
+/* -=-=-=-=- PRP handling -=-=-=-=- */
+
+/**
+ * Resolves the PRP entries of a command into a list of guest pages.
+ *
+ * @returns NVMe status code.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pPrps       Where to store the PRP entries.
+ * @param   u64Prp1     PRP entry 1 of the command.
+ * @param   u64Prp2     PRP entry 2 of the command.
+ * @param   cbXfer      Number of bytes to transfer.
+ */
+static uint16_t nvmeR3PrpsBuild(PNVME pThis, PNVMEPRPS pPrps, uint64_t u64Prp1, uint64_t u64Prp2, uint32_t cbXfer)
+{
+    uint32_t offPage = (uint32_t)(u64Prp1 & NVME_PAGE_OFFSET_MASK);
+
+    Assert(cbXfer <= NVME_XFER_SIZE_MAX);
+
+    if (offPage & 0x3)
+        return NVME_STATUS_GENERIC(NVME_SC_PRP_OFFSET_INVALID);
+
+    pPrps->cbXfer     = cbXfer;
+    pPrps->cPrps      = 1;
+    pPrps->aGCPhys[0] = u64Prp1;
+
+    uint32_t cbLeft = cbXfer - RT_MIN(cbXfer, NVME_PAGE_SIZE - offPage);
+    uint32_t cPagesLeft = RT_ALIGN_32(cbLeft, NVME_PAGE_SIZE) / NVME_PAGE_SIZE;
+    if (!cPagesLeft)
+        return NVME_STATUS_SUCCESS;
+
+    if (cPagesLeft == 1)
+    {
+        /* PRP entry 2 points to the second page directly. */
+        if (u64Prp2 & NVME_PAGE_OFFSET_MASK)
+            return NVME_STATUS_GENERIC(NVME_SC_PRP_OFFSET_INVALID);
+        pPrps->aGCPhys[pPrps->cPrps++] = u64Prp2;
+        return NVME_STATUS_SUCCESS;
+    }
+
+    /* PRP entry 2 points to a PRP list, the last entry of a full list page chains to the next one. */
+    RTGCPHYS GCPhysList = u64Prp2;
+    if (GCPhysList & 0x7)
+        return NVME_STATUS_GENERIC(NVME_SC_PRP_OFFSET_INVALID);
+
+    while (cPagesLeft)
+    {
+        uint32_t cEntriesPage = (NVME_PAGE_SIZE - (uint32_t)(GCPhysList & NVME_PAGE_OFFSET_MASK)) / sizeof(uint64_t);
+        uint32_t cEntriesRead = RT_MIN(cPagesLeft, cEntriesPage);
+        bool     fChain       = cPagesLeft > cEntriesPage;
+
+        if (fChain)
+            cEntriesRead--;
+
+        AssertReturn(pPrps->cPrps + cEntriesRead <= RT_ELEMENTS(pPrps->aGCPhys), NVME_STATUS_GENERIC(NVME_SC_INTERNAL_ERROR));
+        PDMDevHlpPCIPhysRead(pThis->CTX_SUFF(pDevIns), GCPhysList, &pPrps->aGCPhys[pPrps->cPrps],
+                             cEntriesRead * sizeof(uint64_t));
+        for (uint32_t i = 0; i < cEntriesRead; i++)
+        {
+            RTGCPHYS GCPhys = RT_LE2H_U64(pPrps->aGCPhys[pPrps->cPrps + i]);
+            if (GCPhys & NVME_PAGE_OFFSET_MASK)
+                return NVME_STATUS_GENERIC(NVME_SC_PRP_OFFSET_INVALID);
+            pPrps->aGCPhys[pPrps->cPrps + i] = GCPhys;
+        }
+
+        pPrps->cPrps += cEntriesRead;
+        cPagesLeft   -= cEntriesRead;
+
+        if (fChain)
+        {
+            uint64_t u64Next = 0;
+            PDMDevHlpPCIPhysRead(pThis->CTX_SUFF(pDevIns), GCPhysList + cEntriesRead * sizeof(uint64_t),
+                                 &u64Next, sizeof(u64Next));
+            GCPhysList = RT_LE2H_U64(u64Next);
+            if (GCPhysList & NVME_PAGE_OFFSET_MASK)
+                return NVME_STATUS_GENERIC(NVME_SC_PRP_OFFSET_INVALID);
+        }
+    }
+
+    return NVME_STATUS_SUCCESS;
+}
+
+/**
+ * Copies data between the guest pages described by the given PRP entries and a S/G buffer.
+ *
+ * @returns Number of bytes copied.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pPrps       The PRP entries.
+ * @param   offXfer     Offset into the transfer to start at.
+ * @param   pSgBuf      The S/G buffer to copy from or to.
+ * @param   cbCopy      Number of bytes to copy.
+ * @param   fToGuest    Flag whether to copy to guest memory (true) or from guest memory (false).
+ */
+static size_t nvmeR3PrpsCopy(PNVME pThis, PCNVMEPRPS pPrps, uint32_t offXfer, PRTSGBUF pSgBuf, size_t cbCopy, bool fToGuest)
+{
+    PPDMDEVINS pDevIns = pThis->CTX_SUFF(pDevIns);
+    size_t cbCopied = 0;
+
+    cbCopy = RT_MIN(cbCopy, pPrps->cbXfer - RT_MIN(offXfer, pPrps->cbXfer));
+
+    for (uint32_t i = 0; i < pPrps->cPrps && cbCopy; i++)
+    {
+        RTGCPHYS GCPhys = pPrps->aGCPhys[i];
+        uint32_t cbPage = NVME_PAGE_SIZE - (uint32_t)(GCPhys & NVME_PAGE_OFFSET_MASK);
+
+        if (offXfer >= cbPage)
+        {
+            offXfer -= cbPage;
+            continue;
+        }
+
+        GCPhys += offXfer;
+        cbPage -= offXfer;
+        offXfer = 0;
+
+        size_t cbThis = RT_MIN(cbPage, cbCopy);
+        cbCopy -= cbThis;
+        while (cbThis)
+        {
+            size_t cbSeg = cbThis;
+            void *pvSeg = RTSgBufGetNextSegment(pSgBuf, &cbSeg);
+            if (!pvSeg)
+                return cbCopied;
+
+            if (fToGuest)
+                PDMDevHlpPCIPhysWrite(pDevIns, GCPhys, pvSeg, cbSeg);
+            else
+                PDMDevHlpPCIPhysRead(pDevIns, GCPhys, pvSeg, cbSeg);
+
+            GCPhys   += cbSeg;
+            cbThis   -= cbSeg;
+            cbCopied += cbSeg;
+        }
+    }
+
+    return cbCopied;
+}
+
+/**
+ * Transfers the data of an admin command between the guest and the given buffer.
+ *
+ * @returns NVMe status code.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pCmd        The command.
+ * @param   pvBuf       The buffer.
+ * @param   cbBuf       Size of the buffer, the transfer size.
+ * @param   fToGuest    Flag whether to copy to guest memory (true) or from guest memory (false).
+ */
+static uint16_t nvmeR3AdmDataXfer(PNVME pThis, PCNVMECMD pCmd, void *pvBuf, size_t cbBuf, bool fToGuest)
+{
+    NVMEPRPS Prps;
+    uint16_t u16Status = nvmeR3PrpsBuild(pThis, &Prps, pCmd->u64Prp1, pCmd->u64Prp2, (uint32_t)cbBuf);
+    if (u16Status == NVME_STATUS_SUCCESS)
+    {
+        RTSGSEG Seg;
+        RTSGBUF SgBuf;
+
+        Seg.pvSeg = pvBuf;
+        Seg.cbSeg = cbBuf;
+        RTSgBufInit(&SgBuf, &Seg, 1);
+        nvmeR3PrpsCopy(pThis, &Prps, 0, &SgBuf, cbBuf, fToGuest);
+    }
+
+    return u16Status;
+}
+
+
+/* -=-=-=-=- Queue handling -=-=-=-=- */
+
+/**
+ * Returns the number of entries of the completion queue not occupied or reserved.
+ *
+ * @returns Number of free entries.
+ * @param   pCq         The completion queue.
+ * @param   cReserved   The number of reserved entries to take into account.
+ */
+DECLINLINE(uint32_t) nvmeR3CompQueueFreeGet(PNVMEQUEUECOMP pCq, uint32_t cReserved)
+{
+    /* The tail is read after the reservation count, see nvmeR3CompQueuePost(). */
+    uint32_t idxTail = ASMAtomicReadU32(&pCq->Hdr.idxTail);
+    uint32_t idxHead = ASMAtomicReadU32(&pCq->Hdr.idxHead);
+    uint32_t cUsed   = (idxTail + pCq->Hdr.cEntries - idxHead) % pCq->Hdr.cEntries;
+    uint32_t cFree   = pCq->Hdr.cEntries - 1 - cUsed;
+
+    return cFree > cReserved ? cFree - cReserved : 0;
+}
+
+/**
+ * Reserves completion queue entries for commands about to be fetched.
+ *
+ * @returns Number of entries reserved, might be less than requested.
+ * @param   pCq         The completion queue.
+ * @param   cEntries    Number of entries to reserve.
+ */
+static uint32_t nvmeR3CompQueueReserve(PNVMEQUEUECOMP pCq, uint32_t cEntries)
+{
+    for (;;)
+    {
+        uint32_t cReserved = ASMAtomicReadU32(&pCq->cReserved);
+        uint32_t cFree     = nvmeR3CompQueueFreeGet(pCq, cReserved);
+        if (!cFree)
+            return 0;
+
+        uint32_t cReserve = RT_MIN(cFree, cEntries);
+        if (ASMAtomicCmpXchgU32(&pCq->cReserved, cReserved + cReserve, cReserved))
+            return cReserve;
+    }
+}
+
+/**
+ * Signals the interrupt of the given completion queue.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pCq         The completion queue.
+ */
+static void nvmeR3CompQueueIntrSignal(PNVME pThis, PNVMEQUEUECOMP pCq)
+{
+    if (!pCq->fIntrEnabled)
+        return;
+
+    if (nvmeMsixIsEnabled(pThis))
+        PDMDevHlpPCISetIrq(pThis->CTX_SUFF(pDevIns), pCq->u32IntrVec, PDM_IRQ_LEVEL_HIGH);
+    else
+    {
+        int rc = PDMCritSectEnter(&pThis->CritSectIntr, VERR_IGNORED);
+        AssertRC(rc);
+        nvmeIntxUpdate(pThis);
+        PDMCritSectLeave(&pThis->CritSectIntr);
+    }
+}
+
+/**
+ * Posts a completion entry for a command, consuming the reservation made when the command was fetched.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pSq         The submission queue the command was fetched from.
+ * @param   u16Cid      The command identifier.
+ * @param   u32Dw0      Command specific dword 0.
+ * @param   u16Status   The status.
+ */
+static void nvmeR3CompQueuePost(PNVME pThis, PNVMEQUEUESUBM pSq, uint16_t u16Cid, uint32_t u32Dw0, uint16_t u16Status)
+{
+    PNVMEQUEUECOMP pCq = &pThis->aQueuesComp[pSq->u16CompletionQueueId];
+    NVMECQE Cqe;
+
+    Log2(("nvmeR3CompQueuePost: SQ=%u CQ=%u CID=%#x Dw0=%#x Status=%#x\n",
+          pSq->Hdr.u16Id, pCq->Hdr.u16Id, u16Cid, u32Dw0, u16Status));
+
+    Cqe.u32Dw0    = RT_H2LE_U32(u32Dw0);
+    Cqe.u32Rsvd   = 0;
+    Cqe.u16SqHead = RT_H2LE_U16((uint16_t)ASMAtomicReadU32(&pSq->Hdr.idxHead));
+    Cqe.u16SqId   = RT_H2LE_U16(pSq->Hdr.u16Id);
+    Cqe.u16Cid    = RT_H2LE_U16(u16Cid);
+
+    int rc = RTSemFastMutexRequest(pCq->hMtx);
+    AssertRC(rc);
+
+    uint32_t idxTail = pCq->Hdr.idxTail;
+    Cqe.u16Status = RT_H2LE_U16(u16Status | (pCq->fPhase ? 1 : 0));
+    PDMDevHlpPCIPhysWrite(pThis->CTX_SUFF(pDevIns), pCq->Hdr.GCPhysBase + idxTail * sizeof(NVMECQE),
+                          &Cqe, sizeof(Cqe));
+
+    idxTail++;
+    if (idxTail == pCq->Hdr.cEntries)
+    {
+        idxTail = 0;
+        pCq->fPhase = !pCq->fPhase;
+    }
+
+    /* Advance the tail before releasing the reservation so nobody sees the entry as free in between. */
+    ASMAtomicWriteU32(&pCq->Hdr.idxTail, idxTail);
+    ASMAtomicDecU32(&pCq->cReserved);
+
+    RTSemFastMutexRelease(pCq->hMtx);
+
+    nvmeR3CompQueueIntrSignal(pThis, pCq);
+}
+
+/**
+ * Returns the completion queue entry reserved for a command without posting anything.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pSq         The submission queue the command was fetched from.
+ */
+DECLINLINE(void) nvmeR3CompQueueUnreserve(PNVME pThis, PNVMEQUEUESUBM pSq)
+{
+    PNVMEQUEUECOMP pCq = &pThis->aQueuesComp[pSq->u16CompletionQueueId];
+
+    ASMAtomicDecU32(&pCq->cReserved);
+    if (ASMAtomicXchgU32(&pCq->cWaiters, 0))
+        nvmeCompQueueWaitersKick(pThis, pCq);
+}
+
+/**
+ * Completes a command, posting the completion entry only if the controller is
+ * still operational.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pSq         The submission queue the command was fetched from.
+ * @param   u16Cid      The command identifier.
+ * @param   u32Dw0      Command specific dword 0.
+ * @param   u16Status   The status.
+ */
+static void nvmeR3CmdComplete(PNVME pThis, PNVMEQUEUESUBM pSq, uint16_t u16Cid, uint32_t u32Dw0, uint16_t u16Status)
+{
+    if (ASMAtomicReadU32((volatile uint32_t *)&pThis->enmState) == NVMESTATE_READY)
+        nvmeR3CompQueuePost(pThis, pSq, u16Cid, u32Dw0, u16Status);
+    else
+        nvmeR3CompQueueUnreserve(pThis, pSq);
+}
+
+/**
+ * Initializes the common queue data.
+ *
+ * @returns nothing.
+ * @param   pHdr        The queue header.
+ * @param   u16Id       The queue identifier.
+ * @param   enmType     The queue type.
+ * @param   GCPhysBase  Guest physical base address.
+ * @param   cEntries    Number of entries.
+ */
+static void nvmeR3QueueHdrInit(PNVMEQUEUEHDR pHdr, uint16_t u16Id, NVMEQUEUETYPE enmType, RTGCPHYS GCPhysBase,
+                               uint32_t cEntries)
+{
+    pHdr->u16Id      = u16Id;
+    pHdr->cEntries   = cEntries;
+    pHdr->cbEntry    =   enmType == NVMEQUEUETYPE_SUBMISSION
+                       ? RT_BIT_32(NVME_SQES_LOG2)
+                       : RT_BIT_32(NVME_CQES_LOG2);
+    pHdr->GCPhysBase = GCPhysBase;
+    pHdr->idxHead    = 0;
+    pHdr->idxTail    = 0;
+    pHdr->fPhysCont  = true;
+    pHdr->enmType    = enmType;
+}
+
+/**
+ * Sets up a completion queue.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   u16Id       The queue identifier.
+ * @param   GCPhysBase  Guest physical base address.
+ * @param   cEntries    Number of entries.
+ * @param   fIntrEnabled Flag whether interrupts are enabled.
+ * @param   u32IntrVec  The interrupt vector.
+ */
+static void nvmeR3CompQueueCreate(PNVME pThis, uint16_t u16Id, RTGCPHYS GCPhysBase, uint32_t cEntries,
+                                  bool fIntrEnabled, uint32_t u32IntrVec)
+{
+    PNVMEQUEUECOMP pCq = &pThis->aQueuesComp[u16Id];
+
+    nvmeR3QueueHdrInit(&pCq->Hdr, u16Id, NVMEQUEUETYPE_COMPLETION, GCPhysBase, cEntries);
+    pCq->fIntrEnabled   = fIntrEnabled;
+    pCq->fPhase         = true;
+    pCq->u32IntrVec     = u32IntrVec;
+    pCq->cSubmQueuesRef = 0;
+    pCq->cWaiters       = 0;
+    pCq->cReserved      = 0;
+    ASMAtomicWriteU32((volatile uint32_t *)&pCq->Hdr.enmState, NVMEQUEUESTATE_CREATED);
+}
+
+/**
+ * Sets up a submission queue.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   u16Id       The queue identifier.
+ * @param   GCPhysBase  Guest physical base address.
+ * @param   cEntries    Number of entries.
+ * @param   u16CqId     The completion queue to bind to.
+ * @param   u32Priority The queue priority.
+ */
+static void nvmeR3SubmQueueCreate(PNVME pThis, uint16_t u16Id, RTGCPHYS GCPhysBase, uint32_t cEntries,
+                                  uint16_t u16CqId, uint32_t u32Priority)
+{
+    PNVMEQUEUESUBM pSq = &pThis->aQueuesSubm[u16Id];
+
+    nvmeR3QueueHdrInit(&pSq->Hdr, u16Id, NVMEQUEUETYPE_SUBMISSION, GCPhysBase, cEntries);
+    pSq->u16CompletionQueueId = u16CqId;
+    pSq->u16CidDelete         = 0;
+    pSq->u32Priority          = u32Priority;
+    /* The admin queue has a dedicated worker, the I/O queues are distributed over the others. */
+    pSq->idxWrkThrd           = u16Id ? 1 + (u16Id - 1) % pThis->cWrkThrdsMax : 0;
+    pSq->cReqsActive          = 0;
+    ASMAtomicIncU32(&pThis->aQueuesComp[u16CqId].cSubmQueuesRef);
+    ASMAtomicWriteU32((volatile uint32_t *)&pSq->Hdr.enmState, NVMEQUEUESTATE_CREATED);
+}
+
+/**
+ * Finishes the deletion of a submission queue once all its requests completed.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pSq         The submission queue.
+ */
+static void nvmeR3SubmQueueDeleteFinish(PNVME pThis, PNVMEQUEUESUBM pSq)
+{
+    if (!ASMAtomicCmpXchgU32((volatile uint32_t *)&pSq->Hdr.enmState, NVMEQUEUESTATE_INVALID, NVMEQUEUESTATE_DELETING))
+        return;
+
+    LogFlowFunc(("SQ %u deleted\n", pSq->Hdr.u16Id));
+    ASMAtomicDecU32(&pThis->aQueuesComp[pSq->u16CompletionQueueId].cSubmQueuesRef);
+
+    /* Complete the delete command, the entry was reserved when it was fetched. */
+    nvmeR3CmdComplete(pThis, &pThis->aQueuesSubm[0], pSq->u16CidDelete, 0, NVME_STATUS_SUCCESS);
+}
+
+/**
+ * Drops a reference to the submission queue taken by a worker or for a request,
+ * finishing a pending deletion if it was the last one.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pSq         The submission queue.
+ */
+static void nvmeR3SubmQueueRelease(PNVME pThis, PNVMEQUEUESUBM pSq)
+{
+    uint32_t cRefs = ASMAtomicDecU32(&pSq->cReqsActive);
+    if (   !cRefs
+        && ASMAtomicReadU32((volatile uint32_t *)&pSq->Hdr.enmState) == NVMEQUEUESTATE_DELETING)
+        nvmeR3SubmQueueDeleteFinish(pThis, pSq);
+}
+
+/**
+ * Drops the active request count of the controller.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ */
+DECLINLINE(void) nvmeR3ReqsActiveDec(PNVME pThis)
+{
+    if (!ASMAtomicDecU32(&pThis->cReqsActive))
+        nvmeR3CtrlIdleCheck(pThis);
+}
+
+
+/* -=-=-=-=- Controller state handling -=-=-=-=- */
+
+/**
+ * Resets the feature values to the defaults.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ */
+static void nvmeR3FeaturesReset(PNVME pThis)
+{
+    RT_ZERO(pThis->au32Features);
+    pThis->au32Features[NVME_FEAT_TEMP_THRESHOLD]       = 0x0157; /* 70 degrees Celsius. */
+    pThis->au32Features[NVME_FEAT_VOLATILE_WRITE_CACHE] = RT_BIT_32(0);
+    pThis->au32Features[NVME_FEAT_NUMBER_OF_QUEUES]     = RT_MAKE_U32(pThis->cQueuesSubmMax - 1, pThis->cQueuesCompMax - 1);
+    pThis->cQueuesSubmAlloc = pThis->cQueuesSubmMax;
+    pThis->cQueuesCompAlloc = pThis->cQueuesCompMax;
+}
+
+/**
+ * Finishes a controller reset once all outstanding requests are gone.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ */
+static void nvmeR3CtrlResetFinish(PNVME pThis)
+{
+    LogFlowFunc(("pThis=%#p\n", pThis));
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesSubm); i++)
+    {
+        PNVMEQUEUESUBM pSq = &pThis->aQueuesSubm[i];
+
+        Assert(!pSq->cReqsActive);
+        ASMAtomicWriteU32((volatile uint32_t *)&pSq->Hdr.enmState, NVMEQUEUESTATE_INVALID);
+        pSq->Hdr.idxHead = 0;
+        pSq->Hdr.idxTail = 0;
+    }
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesComp); i++)
+    {
+        PNVMEQUEUECOMP pCq = &pThis->aQueuesComp[i];
+
+        ASMAtomicWriteU32((volatile uint32_t *)&pCq->Hdr.enmState, NVMEQUEUESTATE_INVALID);
+        pCq->Hdr.idxHead    = 0;
+        pCq->Hdr.idxTail    = 0;
+        pCq->fIntrEnabled   = false;
+        pCq->cSubmQueuesRef = 0;
+        pCq->cWaiters       = 0;
+        pCq->cReserved      = 0;
+    }
+
+    pThis->cAsyncEvtReqs = 0;
+    nvmeR3FeaturesReset(pThis);
+
+    int rc = PDMCritSectEnter(&pThis->CritSectIntr, VERR_IGNORED);
+    AssertRC(rc);
+    ASMAtomicWriteU32(&pThis->u32IntrMask, 0);
+    PDMDevHlpPCISetIrq(pThis->CTX_SUFF(pDevIns), 0, PDM_IRQ_LEVEL_LOW);
+    PDMCritSectLeave(&pThis->CritSectIntr);
+
+    ASMAtomicWriteU32(&pThis->u32RegCsts, 0);
+}
+
+/**
+ * Checks whether the controller became idle and finishes any pending state change.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ */
+static void nvmeR3CtrlIdleCheck(PNVME pThis)
+{
+    if (   ASMAtomicReadU32(&pThis->cThreadsActive)
+        || ASMAtomicReadU32(&pThis->cReqsActive))
+        return;
+
+    if (ASMAtomicCmpXchgU32((volatile uint32_t *)&pThis->enmState, NVMESTATE_DISABLED, NVMESTATE_RESETTING))
+        nvmeR3CtrlResetFinish(pThis);
+
+    uint32_t u32Csts = ASMAtomicReadU32(&pThis->u32RegCsts);
+    if ((u32Csts & NVME_CSTS_SHST_MASK) == NVME_CSTS_SHST_OCCURRING)
+        ASMAtomicCmpXchgU32(&pThis->u32RegCsts, (u32Csts & ~NVME_CSTS_SHST_MASK) | NVME_CSTS_SHST_COMPLETE, u32Csts);
+
+    if (ASMAtomicReadBool(&pThis->fSignalIdle))
+        PDMDevHlpAsyncNotificationCompleted(pThis->pDevInsR3);
+}
+
+/**
+ * Starts a controller reset, it completes once all outstanding requests are gone.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ */
+static void nvmeR3CtrlReset(PNVME pThis)
+{
+    LogFlowFunc(("pThis=%#p\n", pThis));
+
+    ASMAtomicWriteU32((volatile uint32_t *)&pThis->enmState, NVMESTATE_RESETTING);
+
+    for (uint32_t i = 0; i < pThis->cNamespaces; i++)
+    {
+        PNVMENAMESPACE pNs = &pThis->paNamespacesR3[i];
+        if (pNs->pDrvMediaEx)
+            pNs->pDrvMediaEx->pfnIoReqCancelAll(pNs->pDrvMediaEx);
+    }
+
+    nvmeR3CtrlIdleCheck(pThis);
+}
+
+/**
+ * Enables the controller, setting up the admin queues.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   u32Cc       The new controller configuration.
+ */
+static void nvmeR3CtrlEnable(PNVME pThis, uint32_t u32Cc)
+{
+    uint32_t cEntriesSq = NVME_AQA_ASQS_GET(pThis->u32RegAqa);
+    uint32_t cEntriesCq = NVME_AQA_ACQS_GET(pThis->u32RegAqa);
+
+    if (pThis->enmState != NVMESTATE_DISABLED)
+    {
+        LogRel(("NVMe#%u: Guest enabled the controller while it is not disabled (state %d)\n",
+                pThis->pDevInsR3->iInstance, pThis->enmState));
+        return;
+    }
+
+    if (   NVME_CC_CSS_GET(u32Cc) != 0
+        || NVME_CC_MPS_GET(u32Cc) != NVME_PAGE_SHIFT - 12
+        || NVME_CC_AMS_GET(u32Cc) != 0
+        || cEntriesSq < NVME_QUEUE_ENTRIES_MIN
+        || cEntriesCq < NVME_QUEUE_ENTRIES_MIN
+        || cEntriesSq > pThis->cQueueEntriesMax
+        || cEntriesCq > pThis->cQueueEntriesMax
+        || !pThis->u64RegAsq
+        || !pThis->u64RegAcq)
+    {
+        LogRel(("NVMe#%u: Invalid controller configuration CC=%#x AQA=%#x ASQ=%#RX64 ACQ=%#RX64\n",
+                pThis->pDevInsR3->iInstance, u32Cc, pThis->u32RegAqa, pThis->u64RegAsq, pThis->u64RegAcq));
+        ASMAtomicWriteU32((volatile uint32_t *)&pThis->enmState, NVMESTATE_FATAL);
+        ASMAtomicOrU32(&pThis->u32RegCsts, NVME_CSTS_CFS);
+        return;
+    }
+
+    nvmeR3CompQueueCreate(pThis, 0, pThis->u64RegAcq, cEntriesCq, true /*fIntrEnabled*/, 0 /*u32IntrVec*/);
+    nvmeR3SubmQueueCreate(pThis, 0, pThis->u64RegAsq, cEntriesSq, 0 /*u16CqId*/, 0 /*u32Priority*/);
+
+    ASMAtomicWriteU32((volatile uint32_t *)&pThis->enmState, NVMESTATE_READY);
+    ASMAtomicOrU32(&pThis->u32RegCsts, NVME_CSTS_RDY);
+}
+
+/**
+ * Starts the shutdown processing by flushing all namespaces, it completes
+ * once all outstanding requests are gone.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ */
+static void nvmeR3CtrlShutdown(PNVME pThis)
+{
+    LogFlowFunc(("pThis=%#p\n", pThis));
+
+    uint32_t u32Csts = ASMAtomicReadU32(&pThis->u32RegCsts);
+    ASMAtomicWriteU32(&pThis->u32RegCsts, (u32Csts & ~NVME_CSTS_SHST_MASK) | NVME_CSTS_SHST_OCCURRING);
+
+    for (uint32_t i = 0; i < pThis->cNamespaces; i++)
+    {
+        PNVMENAMESPACE pNs = &pThis->paNamespacesR3[i];
+        if (pNs->pDrvMediaEx)
+            nvmeR3ReqSubmit(pThis, NULL /*pSq*/, pNs, NULL /*pCmd*/, PDMMEDIAEXIOREQTYPE_FLUSH, 0, 0);
+    }
+
+    nvmeR3CtrlIdleCheck(pThis);
+}
+
+/**
+ * Handles a write to the controller configuration register.
+ *
+ * @returns VBox status code.
+ * @param   pThis       The NVMe controller instance.
+ * @param   u32Value    The value written.
+ */
+static int nvmeR3RegCcWrite(PNVME pThis, uint32_t u32Value)
+{
+    uint32_t u32CcOld = ASMAtomicReadU32(&pThis->u32RegCc);
+    uint32_t u32CcNew = u32Value & NVME_CC_WRITABLE_MASK;
+
+    LogFlowFunc(("CC %#x -> %#x\n", u32CcOld, u32CcNew));
+    ASMAtomicWriteU32(&pThis->u32RegCc, u32CcNew);
+
+    if ((u32CcOld & NVME_CC_EN) && !(u32CcNew & NVME_CC_EN))
+        nvmeR3CtrlReset(pThis);
+    else if (!(u32CcOld & NVME_CC_EN) && (u32CcNew & NVME_CC_EN))
+        nvmeR3CtrlEnable(pThis, u32CcNew);
+
+    if (   NVME_CC_SHN_GET(u32CcNew)
+        && !NVME_CC_SHN_GET(u32CcOld)
+        && pThis->enmState == NVMESTATE_READY)
+        nvmeR3CtrlShutdown(pThis);
+
+    return VINF_SUCCESS;
+}
+
+
+/* -=-=-=-=- I/O requests -=-=-=-=- */
+
+/**
+ * Releases all guest pages locked for unbuffered I/O.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pReq        The request.
+ */
+static void nvmeR3ReqPgLcksRelease(PNVME pThis, PNVMEREQ pReq)
+{
+    for (uint32_t i = 0; i < pReq->cPgLcks; i++)
+        PDMDevHlpPhysReleasePageMappingLock(pThis->CTX_SUFF(pDevIns), &pReq->aPgLcks[i]);
+    pReq->cPgLcks = 0;
+}
+
+/**
+ * Completes an I/O request.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pReq        The request to complete.
+ * @param   rcReq       The status code the request completed with.
+ */
+static void nvmeR3ReqComplete(PNVME pThis, PNVMEREQ pReq, int rcReq)
+{
+    PNVMEQUEUESUBM pSq = pReq->pSq;
+    PNVMENAMESPACE pNs = pReq->pNs;
+    uint16_t u16Status = NVME_STATUS_SUCCESS;
+    uint16_t u16Cid    = pReq->Cmd.u16Cid;
+
+    nvmeR3ReqPgLcksRelease(pThis, pReq);
+
+    if (pReq->enmType == PDMMEDIAEXIOREQTYPE_READ)
+    {
+        pNs->Led.Actual.s.fReading = 0;
+        if (RT_SUCCESS(rcReq))
+        {
+            ASMAtomicAddU64(&pThis->cbRead, pReq->cbTransfer);
+            ASMAtomicIncU64(&pThis->cReadCmds);
+        }
+    }
+    else if (pReq->enmType == PDMMEDIAEXIOREQTYPE_WRITE)
+    {
+        pNs->Led.Actual.s.fWriting = 0;
+        if (RT_SUCCESS(rcReq))
+        {
+            ASMAtomicAddU64(&pThis->cbWritten, pReq->cbTransfer);
+            ASMAtomicIncU64(&pThis->cWriteCmds);
+        }
+    }
+
+    if (RT_FAILURE(rcReq))
+    {
+        if (rcReq == VERR_PDM_MEDIAEX_IOREQ_CANCELED)
+            u16Status = NVME_STATUS_GENERIC(NVME_SC_ABORT_REQUESTED);
+        else if (   rcReq == VERR_PDM_MEDIAEX_IOBUF_OVERFLOW
+                 || rcReq == VERR_PDM_MEDIAEX_IOBUF_UNDERRUN)
+            u16Status = NVME_STATUS_GENERIC(NVME_SC_DATA_XFER_ERROR);
+        else
+        {
+            LogRelMax(10, ("NVMe#%u: Namespace %u: %s request at offset %llu failed with %Rrc\n",
+                           pThis->pDevInsR3->iInstance, pNs->iLUN + 1,
+                             pReq->enmType == PDMMEDIAEXIOREQTYPE_READ
+                           ? "Read"
+                           : pReq->enmType == PDMMEDIAEXIOREQTYPE_WRITE
+                           ? "Write"
+                           : pReq->enmType == PDMMEDIAEXIOREQTYPE_FLUSH
+                           ? "Flush"
+                           : "Discard",
+                           pReq->enmType == PDMMEDIAEXIOREQTYPE_READ || pReq->enmType == PDMMEDIAEXIOREQTYPE_WRITE
+                           ? RT_MAKE_U64(NVME_CMD_CDW(&pReq->Cmd, 10), NVME_CMD_CDW(&pReq->Cmd, 11)) * pNs->cbSector
+                           : 0, rcReq));
+
+            if (pReq->enmType == PDMMEDIAEXIOREQTYPE_READ)
+                u16Status = NVME_STATUS_MAKE(NVME_SCT_MEDIA, NVME_SC_UNRECOVERED_READ_ERROR);
+            else if (pReq->enmType == PDMMEDIAEXIOREQTYPE_WRITE)
+                u16Status = NVME_STATUS_MAKE(NVME_SCT_MEDIA, NVME_SC_WRITE_FAULT);
+            else
+                u16Status = NVME_STATUS_GENERIC(NVME_SC_INTERNAL_ERROR);
+        }
+    }
+
+    /* Free the request first so the guest can reuse the command identifier as soon as it sees the completion. */
+    pNs->pDrvMediaEx->pfnIoReqFree(pNs->pDrvMediaEx, pReq->hIoReq);
+
+    if (pSq)
+    {
+        nvmeR3CmdComplete(pThis, pSq, u16Cid, 0, u16Status);
+        nvmeR3SubmQueueRelease(pThis, pSq);
+    }
+
+    nvmeR3ReqsActiveDec(pThis);
+}
+
+/**
+ * Allocates and submits an I/O request to the driver below.
+ *
+ * The active request count of the controller and the reference of the
+ * submission queue taken for the command are dropped when the request completes.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pSq         The submission queue the command was fetched from,
+ *                      NULL for internal requests not visible to the guest.
+ * @param   pNs         The namespace.
+ * @param   pCmd        The command, NULL for internal requests.
+ * @param   enmType     The request type.
+ * @param   offStart    Start offset for reads and writes.
+ * @param   cbTransfer  Number of bytes to transfer.
+ */
+static void nvmeR3ReqSubmit(PNVME pThis, PNVMEQUEUESUBM pSq, PNVMENAMESPACE pNs, PCNVMECMD pCmd,
+                            PDMMEDIAEXIOREQTYPE enmType, uint64_t offStart, size_t cbTransfer)
+{
+    PPDMIMEDIAEX pDrvMediaEx = pNs->pDrvMediaEx;
+    PDMMEDIAEXIOREQ hIoReq = NULL;
+    PNVMEREQ pReq = NULL;
+    uint16_t u16Status = NVME_STATUS_SUCCESS;
+
+    if (!pSq)
+        ASMAtomicIncU32(&pThis->cReqsActive);
+
+    int rc = pDrvMediaEx->pfnIoReqAlloc(pDrvMediaEx, &hIoReq, (void **)&pReq,
+                                          pSq
+                                        ? NVME_IOREQID_MAKE(pSq->Hdr.u16Id, pCmd->u16Cid)
+                                        : NVME_IOREQID_INTERNAL,
+                                        PDMIMEDIAEX_F_SUSPEND_ON_RECOVERABLE_ERR);
+    if (RT_FAILURE(rc))
+    {
+        if (pSq)
+        {
+            u16Status =   rc == VERR_PDM_MEDIAEX_IOREQID_CONFLICT
+                        ? NVME_STATUS_GENERIC(NVME_SC_CID_CONFLICT)
+                        : NVME_STATUS_GENERIC(NVME_SC_INTERNAL_ERROR);
+            nvmeR3CmdComplete(pThis, pSq, pCmd->u16Cid, 0, u16Status);
+            nvmeR3SubmQueueRelease(pThis, pSq);
+        }
+        nvmeR3ReqsActiveDec(pThis);
+        return;
+    }
+
+    pReq->hIoReq     = hIoReq;
+    pReq->pSq        = pSq;
+    pReq->pNs        = pNs;
+    pReq->enmType    = enmType;
+    pReq->cbTransfer = cbTransfer;
+    pReq->cRanges    = 0;
+    pReq->cPgLcks    = 0;
+    if (pCmd)
+        pReq->Cmd    = *pCmd;
+    else
+        RT_ZERO(pReq->Cmd);
+
+    switch (enmType)
+    {
+        case PDMMEDIAEXIOREQTYPE_READ:
+        case PDMMEDIAEXIOREQTYPE_WRITE:
+        {
+            u16Status = nvmeR3PrpsBuild(pThis, &pReq->Prps, pCmd->u64Prp1, pCmd->u64Prp2, (uint32_t)cbTransfer);
+            if (u16Status != NVME_STATUS_SUCCESS)
+                break;
+
+            if (enmType == PDMMEDIAEXIOREQTYPE_READ)
+            {
+                pNs->Led.Asserted.s.fReading = pNs->Led.Actual.s.fReading = 1;
+                rc = pDrvMediaEx->pfnIoReqRead(pDrvMediaEx, hIoReq, offStart, cbTransfer);
+            }
+            else
+            {
+                pNs->Led.Asserted.s.fWriting = pNs->Led.Actual.s.fWriting = 1;
+                rc = pDrvMediaEx->pfnIoReqWrite(pDrvMediaEx, hIoReq, offStart, cbTransfer);
+            }
+            break;
+        }
+        case PDMMEDIAEXIOREQTYPE_FLUSH:
+        {
+            rc = pDrvMediaEx->pfnIoReqFlush(pDrvMediaEx, hIoReq);
+            break;
+        }
+        case PDMMEDIAEXIOREQTYPE_DISCARD:
+        {
+            /* The range list is read again when the driver queries the ranges. */
+            pReq->cRanges = (NVME_CMD_CDW(pCmd, 10) & 0xff) + 1;
+            u16Status = nvmeR3PrpsBuild(pThis, &pReq->Prps, pCmd->u64Prp1, pCmd->u64Prp2,
+                                        pReq->cRanges * sizeof(NVMEDSMRANGE));
+            if (u16Status == NVME_STATUS_SUCCESS)
+                rc = pDrvMediaEx->pfnIoReqDiscard(pDrvMediaEx, hIoReq, pReq->cRanges);
+            break;
+        }
+        default:
+            AssertMsgFailed(("Invalid request type %d\n", enmType));
+            u16Status = NVME_STATUS_GENERIC(NVME_SC_INTERNAL_ERROR);
+    }
+
+    if (u16Status != NVME_STATUS_SUCCESS)
+    {
+        /* Only guest commands can fail validation. */
+        Assert(pSq);
+        pDrvMediaEx->pfnIoReqFree(pDrvMediaEx, hIoReq);
+        nvmeR3CmdComplete(pThis, pSq, pCmd->u16Cid, 0, u16Status);
+        nvmeR3SubmQueueRelease(pThis, pSq);
+        nvmeR3ReqsActiveDec(pThis);
+    }
+    else if (rc != VINF_PDM_MEDIAEX_IOREQ_IN_PROGRESS)
+        nvmeR3ReqComplete(pThis, pReq, rc);
+}
+
+
+/* -=-=-=-=- NVM command set -=-=-=-=- */
+
+/**
+ * Processes a command fetched from an I/O submission queue.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pSq         The submission queue the command was fetched from.
+ * @param   pCmd        The command.
+ */
+static void nvmeR3NvmCmdProcess(PNVME pThis, PNVMEQUEUESUBM pSq, PCNVMECMD pCmd)
+{
+    uint16_t u16Status = NVME_STATUS_SUCCESS;
+    uint32_t u32Nsid = pCmd->u32Nsid;
+    PNVMENAMESPACE pNs = NULL;
+
+    LogFlowFunc(("SQ=%u CID=%#x Opc=%#x NSID=%u\n", pSq->Hdr.u16Id, pCmd->u16Cid, pCmd->u8Opc, u32Nsid));
+
+    if (   u32Nsid
+        && u32Nsid <= pThis->cNamespaces)
+        pNs = &pThis->paNamespacesR3[u32Nsid - 1];
+
+    if (pCmd->u8Flags)
+        u16Status = NVME_STATUS_GENERIC(NVME_SC_INVALID_FIELD); /* Neither fused operations nor SGLs are supported. */
+    else if (   pCmd->u8Opc != NVME_NVM_OPC_FLUSH
+             && pCmd->u8Opc != NVME_NVM_OPC_WRITE
+             && pCmd->u8Opc != NVME_NVM_OPC_READ
+             && pCmd->u8Opc != NVME_NVM_OPC_DSM)
+        u16Status = NVME_STATUS_GENERIC(NVME_SC_INVALID_OPCODE);
+    else if (!pNs)
+        u16Status = NVME_STATUS_GENERIC(NVME_SC_INVALID_NAMESPACE);
+    else if (!pNs->pDrvMediaEx)
+        u16Status = NVME_STATUS_MAKE(NVME_SCT_GENERIC, NVME_SC_NS_NOT_READY);
+    else
+    {
+        switch (pCmd->u8Opc)
+        {
+            case NVME_NVM_OPC_READ:
+            case NVME_NVM_OPC_WRITE:
+            {
+                uint64_t uLbaStart = RT_MAKE_U64(NVME_CMD_CDW(pCmd, 10), NVME_CMD_CDW(pCmd, 11));
+                uint32_t cLbas     = (NVME_CMD_CDW(pCmd, 12) & 0xffff) + 1;
+
+                if (   uLbaStart >= pNs->cSectors
+                    || cLbas > pNs->cSectors - uLbaStart)
+                    u16Status = NVME_STATUS_GENERIC(NVME_SC_LBA_OUT_OF_RANGE);
+                else if ((uint64_t)cLbas * pNs->cbSector > NVME_XFER_SIZE_MAX)
+                    u16Status = NVME_STATUS_GENERIC(NVME_SC_INVALID_FIELD);
+                else
+                {
+                    nvmeR3ReqSubmit(pThis, pSq, pNs, pCmd,
+                                      pCmd->u8Opc == NVME_NVM_OPC_READ
+                                    ? PDMMEDIAEXIOREQTYPE_READ
+                                    : PDMMEDIAEXIOREQTYPE_WRITE,
+                                    uLbaStart * pNs->cbSector, (size_t)cLbas * pNs->cbSector);
+                    return;
+                }
+                break;
+            }
+            case NVME_NVM_OPC_FLUSH:
+            {
+                nvmeR3ReqSubmit(pThis, pSq, pNs, pCmd, PDMMEDIAEXIOREQTYPE_FLUSH, 0, 0);
+                return;
+            }
+            case NVME_NVM_OPC_DSM:
+            {
+                /* Only deallocation is acted upon, the other attributes are hints. */
+                if (   (NVME_CMD_CDW(pCmd, 11) & RT_BIT_32(2))
+                    && pNs->fDiscard)
+                {
+                    nvmeR3ReqSubmit(pThis, pSq, pNs, pCmd, PDMMEDIAEXIOREQTYPE_DISCARD, 0, 0);
+                    return;
+                }
+                break;
+            }
+            default:
+                AssertFailed();
+        }
+    }
+
+    nvmeR3CmdComplete(pThis, pSq, pCmd->u16Cid, 0, u16Status);
+    nvmeR3SubmQueueRelease(pThis, pSq);
+    nvmeR3ReqsActiveDec(pThis);
+}
+
+
+/* -=-=-=-=- Admin command set -=-=-=-=- */
+
+/** Status returned by admin command workers completing the command later. */
+#define NVME_STATUS_DEFERRED    UINT16_MAX
+
+/**
+ * Copies a string into a space padded identify data field.
+ *
+ * @returns nothing.
+ * @param   pachDst     The destination field.
+ * @param   cchDst      Size of the destination field.
+ * @param   pszSrc      The source string.
+ */
+static void nvmeR3IdStrCopy(char *pachDst, size_t cchDst, const char *pszSrc)
+{
+    size_t cchSrc = RT_MIN(strlen(pszSrc), cchDst);
+    memcpy(pachDst, pszSrc, cchSrc);
+    memset(pachDst + cchSrc, ' ', cchDst - cchSrc);
+}
+
+/**
+ * Identify command worker.
+ */
+static uint16_t nvmeR3AdmIdentify(PNVME pThis, PCNVMECMD pCmd)
+{
+    uint8_t  u8Cns   = (uint8_t)(NVME_CMD_CDW(pCmd, 10) & 0xff);
+    uint32_t u32Nsid = pCmd->u32Nsid;
+    uint8_t *pbData = (uint8_t *)RTMemAllocZ(NVME_PAGE_SIZE);
+    if (!pbData)
+        return NVME_STATUS_GENERIC(NVME_SC_INTERNAL_ERROR);
+
+    uint16_t u16Status = NVME_STATUS_SUCCESS;
+    switch (u8Cns)
+    {
+        case NVME_IDENTIFY_CNS_CONTROLLER:
+        {
+            NVMEIDCTRL *pIdCtrl = (NVMEIDCTRL *)pbData;
+
+            pIdCtrl->u16Vid    = RT_H2LE_U16(PCIDevGetVendorId(&pThis->PciDev));
+            pIdCtrl->u16SsVid  = RT_H2LE_U16(PCIDevGetVendorId(&pThis->PciDev));
+            nvmeR3IdStrCopy(pIdCtrl->achSn, sizeof(pIdCtrl->achSn), pThis->szSerialNumber);
+            nvmeR3IdStrCopy(pIdCtrl->achMn, sizeof(pIdCtrl->achMn), pThis->szModelNumber);
+            nvmeR3IdStrCopy(pIdCtrl->achFr, sizeof(pIdCtrl->achFr), pThis->szFirmwareRevision);
+            pIdCtrl->u8Rab     = 6;
+            pIdCtrl->u8Mdts    = NVME_MDTS;
+            pIdCtrl->u16CntlId = 0;
+            pIdCtrl->u32Ver    = RT_H2LE_U32(NVME_VERSION);
+            pIdCtrl->u8Acl     = 3;
+            pIdCtrl->u8Aerl    = NVME_ASYNC_EVT_REQS_MAX - 1;
+            pIdCtrl->u8Frmw    = RT_BIT(0) | (1 << 1); /* One read-only firmware slot. */
+            pIdCtrl->u8Elpe    = 0;
+            pIdCtrl->u8Npss    = 0;
+            pIdCtrl->u16WcTemp = RT_H2LE_U16(0x0157);
+            pIdCtrl->u16CcTemp = RT_H2LE_U16(0x0175);
+            pIdCtrl->u8Sqes    = (NVME_SQES_LOG2 << 4) | NVME_SQES_LOG2;
+            pIdCtrl->u8Cqes    = (NVME_CQES_LOG2 << 4) | NVME_CQES_LOG2;
+            pIdCtrl->u32Nn     = RT_H2LE_U32(pThis->cNamespaces);
+            pIdCtrl->u16Oncs   = RT_H2LE_U16(RT_BIT(2)); /* Dataset management. */
+            pIdCtrl->u8Vwc     = RT_BIT(0);
+            pIdCtrl->aPsd[0].u16Mp = RT_H2LE_U16(2500); /* 25W */
+            break;
+        }
+        case NVME_IDENTIFY_CNS_NAMESPACE:
+        {
+            if (   !u32Nsid
+                || u32Nsid > pThis->cNamespaces)
+            {
+                u16Status = NVME_STATUS_GENERIC(NVME_SC_INVALID_NAMESPACE);
+                break;
+            }
+
+            /* Namespaces without a medium attached are reported as inactive (all zero). */
+            PNVMENAMESPACE pNs = &pThis->paNamespacesR3[u32Nsid - 1];
+            if (pNs->pDrvMediaEx)
+            {
+                NVMEIDNS *pIdNs = (NVMEIDNS *)pbData;
+
+                pIdNs->u64Nsze  = RT_H2LE_U64(pNs->cSectors);
+                pIdNs->u64Ncap  = RT_H2LE_U64(pNs->cSectors);
+                pIdNs->u64Nuse  = RT_H2LE_U64(pNs->cSectors);
+                pIdNs->u8NsFeat = pNs->fDiscard ? RT_BIT(0) : 0; /* Thin provisioning. */
+                pIdNs->u8Nlbaf  = 0;
+                pIdNs->u8Flbas  = 0;
+                pIdNs->aLbaF[0].u8LbaDs = (uint8_t)(ASMBitFirstSetU32(pNs->cbSector) - 1);
+            }
+            break;
+        }
+        case NVME_IDENTIFY_CNS_ACTIVE_NS_LIST:
+        {
+            uint32_t *pau32NsIds = (uint32_t *)pbData;
+            uint32_t idx = 0;
+
+            if (u32Nsid >= UINT32_C(0xfffffffe))
+            {
+                u16Status = NVME_STATUS_GENERIC(NVME_SC_INVALID_NAMESPACE);
+                break;
+            }
+
+            for (uint32_t i = u32Nsid; i < pThis->cNamespaces && idx < NVME_PAGE_SIZE / sizeof(uint32_t); i++)
+                if (pThis->paNamespacesR3[i].pDrvMediaEx)
+                    pau32NsIds[idx++] = RT_H2LE_U32(i + 1);
+            break;
+        }
+        default:
+            u16Status = NVME_STATUS_GENERIC(NVME_SC_INVALID_FIELD);
+    }
+
+    if (u16Status == NVME_STATUS_SUCCESS)
+        u16Status = nvmeR3AdmDataXfer(pThis, pCmd, pbData, NVME_PAGE_SIZE, true /*fToGuest*/);
+
+    RTMemFree(pbData);
+    return u16Status;
+}
+
+/**
+ * Create I/O Completion Queue command worker.
+ */
+static uint16_t nvmeR3AdmCreateIoCq(PNVME pThis, PCNVMECMD pCmd)
+{
+    uint16_t u16Id       = (uint16_t)(NVME_CMD_CDW(pCmd, 10) & 0xffff);
+    uint32_t cEntries    = (NVME_CMD_CDW(pCmd, 10) >> 16) + 1;
+    bool     fPhysCont   = RT_BOOL(NVME_CMD_CDW(pCmd, 11) & RT_BIT_32(0));
+    bool     fIntrEnabled = RT_BOOL(NVME_CMD_CDW(pCmd, 11) & RT_BIT_32(1));
+    uint32_t u32IntrVec  = NVME_CMD_CDW(pCmd, 11) >> 16;
+
+    if (   !u16Id
+        || u16Id > pThis->cQueuesCompAlloc
+        || pThis->aQueuesComp[u16Id].Hdr.enmState != NVMEQUEUESTATE_INVALID)
+        return NVME_STATUS_CMD_SPECIFIC(NVME_SC_QID_INVALID);
+    if (   cEntries < NVME_QUEUE_ENTRIES_MIN
+        || cEntries > pThis->cQueueEntriesMax)
+        return NVME_STATUS_CMD_SPECIFIC(NVME_SC_QUEUE_SIZE_INVALID);
+    if (   !fPhysCont
+        || (pCmd->u64Prp1 & NVME_PAGE_OFFSET_MASK)
+        || NVME_CC_IOCQES_GET(pThis->u32RegCc) != NVME_CQES_LOG2)
+        return NVME_STATUS_GENERIC(NVME_SC_INVALID_FIELD);
+    if (   fIntrEnabled
+        && u32IntrVec >= RT_MAX(pThis->cMsixVectors, 1))
+        return NVME_STATUS_CMD_SPECIFIC(NVME_SC_INTR_VEC_INVALID);
+
+    nvmeR3CompQueueCreate(pThis, u16Id, pCmd->u64Prp1, cEntries, fIntrEnabled, u32IntrVec);
+    return NVME_STATUS_SUCCESS;
+}
+
+/**
+ * Create I/O Submission Queue command worker.
+ */
+static uint16_t nvmeR3AdmCreateIoSq(PNVME pThis, PCNVMECMD pCmd)
+{
+    uint16_t u16Id       = (uint16_t)(NVME_CMD_CDW(pCmd, 10) & 0xffff);
+    uint32_t cEntries    = (NVME_CMD_CDW(pCmd, 10) >> 16) + 1;
+    bool     fPhysCont   = RT_BOOL(NVME_CMD_CDW(pCmd, 11) & RT_BIT_32(0));
+    uint32_t u32Priority = (NVME_CMD_CDW(pCmd, 11) >> 1) & 0x3;
+    uint16_t u16CqId     = (uint16_t)(NVME_CMD_CDW(pCmd, 11) >> 16);
+
+    if (   !u16Id
+        || u16Id > pThis->cQueuesSubmAlloc
+        || pThis->aQueuesSubm[u16Id].Hdr.enmState != NVMEQUEUESTATE_INVALID)
+        return NVME_STATUS_CMD_SPECIFIC(NVME_SC_QID_INVALID);
+    if (   !u16CqId
+        || u16CqId >= RT_ELEMENTS(pThis->aQueuesComp)
+        || pThis->aQueuesComp[u16CqId].Hdr.enmState != NVMEQUEUESTATE_CREATED)
+        return NVME_STATUS_CMD_SPECIFIC(NVME_SC_CQ_INVALID);
+    if (   cEntries < NVME_QUEUE_ENTRIES_MIN
+        || cEntries > pThis->cQueueEntriesMax)
+        return NVME_STATUS_CMD_SPECIFIC(NVME_SC_QUEUE_SIZE_INVALID);
+    if (   !fPhysCont
+        || (pCmd->u64Prp1 & NVME_PAGE_OFFSET_MASK)
+        || NVME_CC_IOSQES_GET(pThis->u32RegCc) != NVME_SQES_LOG2)
+        return NVME_STATUS_GENERIC(NVME_SC_INVALID_FIELD);
+
+    nvmeR3SubmQueueCreate(pThis, u16Id, pCmd->u64Prp1, cEntries, u16CqId, u32Priority);
+    return NVME_STATUS_SUCCESS;
+}
+
+/**
+ * Delete I/O Submission Queue command worker, completes once all requests of the queue are done.
+ */
+static uint16_t nvmeR3AdmDeleteIoSq(PNVME pThis, PCNVMECMD pCmd)
+{
+    uint16_t u16Id = (uint16_t)(NVME_CMD_CDW(pCmd, 10) & 0xffff);
+
+    if (   !u16Id
+        || u16Id >= RT_ELEMENTS(pThis->aQueuesSubm)
+        || pThis->aQueuesSubm[u16Id].Hdr.enmState != NVMEQUEUESTATE_CREATED)
+        return NVME_STATUS_CMD_SPECIFIC(NVME_SC_QID_INVALID);
+
+    PNVMEQUEUESUBM pSq = &pThis->aQueuesSubm[u16Id];
+    pSq->u16CidDelete = pCmd->u16Cid;
+
+    /* Take a reference so the deletion is finished here if nothing is outstanding. */
+    ASMAtomicIncU32(&pSq->cReqsActive);
+    ASMAtomicWriteU32((volatile uint32_t *)&pSq->Hdr.enmState, NVMEQUEUESTATE_DELETING);
+    nvmeR3SubmQueueRelease(pThis, pSq);
+    return NVME_STATUS_DEFERRED;
+}
+
+/**
+ * Delete I/O Completion Queue command worker.
+ */
+static uint16_t nvmeR3AdmDeleteIoCq(PNVME pThis, PCNVMECMD pCmd)
+{
+    uint16_t u16Id = (uint16_t)(NVME_CMD_CDW(pCmd, 10) & 0xffff);
+
+    if (   !u16Id
+        || u16Id >= RT_ELEMENTS(pThis->aQueuesComp)
+        || pThis->aQueuesComp[u16Id].Hdr.enmState != NVMEQUEUESTATE_CREATED)
+        return NVME_STATUS_CMD_SPECIFIC(NVME_SC_QID_INVALID);
+
+    PNVMEQUEUECOMP pCq = &pThis->aQueuesComp[u16Id];
+    if (ASMAtomicReadU32(&pCq->cSubmQueuesRef))
+        return NVME_STATUS_CMD_SPECIFIC(NVME_SC_QUEUE_DELETION_INVALID);
+
+    ASMAtomicWriteU32((volatile uint32_t *)&pCq->Hdr.enmState, NVMEQUEUESTATE_INVALID);
+
+    /* Drop the interrupt if this queue was the last one with pending entries. */
+    if (pCq->fIntrEnabled && !nvmeMsixIsEnabled(pThis))
+    {
+        int rc = PDMCritSectEnter(&pThis->CritSectIntr, VERR_IGNORED);
+        AssertRC(rc);
+        nvmeIntxUpdate(pThis);
+        PDMCritSectLeave(&pThis->CritSectIntr);
+    }
+
+    return NVME_STATUS_SUCCESS;
+}
+
+/**
+ * Get Log Page command worker.
+ */
+static uint16_t nvmeR3AdmGetLogPage(PNVME pThis, PCNVMECMD pCmd)
+{
+    uint8_t  u8Lid  = (uint8_t)(NVME_CMD_CDW(pCmd, 10) & 0xff);
+    uint32_t cbXfer = (((NVME_CMD_CDW(pCmd, 10) >> 16) & 0xfff) + 1) * sizeof(uint32_t);
+    union
+    {
+        NVMELOGSMART  Smart;
+        NVMELOGFWSLOT FwSlot;
+        uint8_t       abErrInfo[64];
+    } Log;
+
+    RT_ZERO(Log);
+    switch (u8Lid)
+    {
+        case NVME_LOG_PAGE_ERROR_INFO:
+            /* No errors are logged. */
+            break;
+        case NVME_LOG_PAGE_SMART_HEALTH:
+        {
+            /* Data units are thousands of 512 byte units, rounded up. */
+            Log.Smart.u16CompTemp          = RT_H2LE_U16(0x0136); /* 37 degrees Celsius. */
+            Log.Smart.u8AvailSpare         = 100;
+            Log.Smart.u8AvailSpareThresh   = 10;
+            Log.Smart.au64DataUnitsRead[0]    = RT_H2LE_U64((ASMAtomicReadU64(&pThis->cbRead) / 512 + 999) / 1000);
+            Log.Smart.au64DataUnitsWritten[0] = RT_H2LE_U64((ASMAtomicReadU64(&pThis->cbWritten) / 512 + 999) / 1000);
+            Log.Smart.au64HostReadCmds[0]     = RT_H2LE_U64(ASMAtomicReadU64(&pThis->cReadCmds));
+            Log.Smart.au64HostWriteCmds[0]    = RT_H2LE_U64(ASMAtomicReadU64(&pThis->cWriteCmds));
+            Log.Smart.au64PowerCycles[0]      = RT_H2LE_U64(1);
+            break;
+        }
+        case NVME_LOG_PAGE_FIRMWARE_SLOT:
+        {
+            Log.FwSlot.u8Afi = 1;
+            nvmeR3IdStrCopy(Log.FwSlot.aachFrs[0], sizeof(Log.FwSlot.aachFrs[0]), pThis->szFirmwareRevision);
+            break;
+        }
+        default:
+            return NVME_STATUS_CMD_SPECIFIC(NVME_SC_LOG_PAGE_INVALID);
+    }
+
+    /* Anything beyond the log page reads as zero. */
+    cbXfer = RT_MIN(cbXfer, NVME_PAGE_SIZE);
+    uint8_t *pbBuf = (uint8_t *)RTMemAllocZ(cbXfer);
+    if (!pbBuf)
+        return NVME_STATUS_GENERIC(NVME_SC_INTERNAL_ERROR);
+
+    memcpy(pbBuf, &Log, RT_MIN(cbXfer, sizeof(Log)));
+    uint16_t u16Status = nvmeR3AdmDataXfer(pThis, pCmd, pbBuf, cbXfer, true /*fToGuest*/);
+    RTMemFree(pbBuf);
+    return u16Status;
+}
+
+/**
+ * Set Features command worker.
+ */
+static uint16_t nvmeR3AdmSetFeatures(PNVME pThis, PCNVMECMD pCmd, uint32_t *pu32Dw0)
+{
+    uint8_t  u8Fid    = (uint8_t)(NVME_CMD_CDW(pCmd, 10) & 0xff);
+    bool     fSave    = RT_BOOL(NVME_CMD_CDW(pCmd, 10) & RT_BIT_32(31));
+    uint32_t u32Value = NVME_CMD_CDW(pCmd, 11);
+
+    if (fSave)
+        return NVME_STATUS_CMD_SPECIFIC(NVME_SC_FEAT_NOT_SAVEABLE);
+
+    switch (u8Fid)
+    {
+        case NVME_FEAT_NUMBER_OF_QUEUES:
+        {
+            uint32_t cSqs = (u32Value & 0xffff) + 1;
+            uint32_t cCqs = (u32Value >> 16) + 1;
+
+            if (   cSqs > UINT16_MAX
+                || cCqs > UINT16_MAX)
+                return NVME_STATUS_GENERIC(NVME_SC_INVALID_FIELD);
+
+            /* The number of queues can't change once I/O queues exist. */
+            for (uint32_t i = 1; i < RT_ELEMENTS(pThis->aQueuesComp); i++)
+                if (pThis->aQueuesComp[i].Hdr.enmState != NVMEQUEUESTATE_INVALID)
+                    return NVME_STATUS_GENERIC(NVME_SC_CMD_SEQ_ERROR);
+
+            pThis->cQueuesSubmAlloc = RT_MIN(cSqs, pThis->cQueuesSubmMax);
+            pThis->cQueuesCompAlloc = RT_MIN(cCqs, pThis->cQueuesCompMax);
+            pThis->au32Features[u8Fid] = RT_MAKE_U32(pThis->cQueuesSubmAlloc - 1, pThis->cQueuesCompAlloc - 1);
+            *pu32Dw0 = pThis->au32Features[u8Fid];
+            return NVME_STATUS_SUCCESS;
+        }
+        case NVME_FEAT_POWER_MGMT:
+            /* Only power state 0 exists. */
+            if (u32Value & 0x1f)
+                return NVME_STATUS_GENERIC(NVME_SC_INVALID_FIELD);
+            /* fall thru */
+        case NVME_FEAT_ARBITRATION:
+        case NVME_FEAT_TEMP_THRESHOLD:
+        case NVME_FEAT_ERROR_RECOVERY:
+        case NVME_FEAT_VOLATILE_WRITE_CACHE:
+        case NVME_FEAT_INTR_COALESCING:
+        case NVME_FEAT_WRITE_ATOMICITY:
+        case NVME_FEAT_ASYNC_EVT_CONFIG:
+            pThis->au32Features[u8Fid] = u32Value;
+            return NVME_STATUS_SUCCESS;
+        case NVME_FEAT_INTR_VECTOR_CONFIG:
+            /* Interrupt coalescing is not implemented, nothing to configure per vector. */
+            if ((u32Value & 0xffff) >= RT_MAX(pThis->cMsixVectors, 1))
+                return NVME_STATUS_GENERIC(NVME_SC_INVALID_FIELD);
+            return NVME_STATUS_SUCCESS;
+        default:
+            return NVME_STATUS_GENERIC(NVME_SC_INVALID_FIELD);
+    }
+}
+
+/**
+ * Get Features command worker.
+ */
+static uint16_t nvmeR3AdmGetFeatures(PNVME pThis, PCNVMECMD pCmd, uint32_t *pu32Dw0)
+{
+    uint8_t u8Fid = (uint8_t)(NVME_CMD_CDW(pCmd, 10) & 0xff);
+    uint8_t u8Sel = (uint8_t)((NVME_CMD_CDW(pCmd, 10) >> 8) & 0x7);
+
+    if (   u8Fid == 0
+        || u8Fid == 0x03 /* LBA range type, optional */
+        || u8Fid >= NVME_FEAT_COUNT)
+        return NVME_STATUS_GENERIC(NVME_SC_INVALID_FIELD);
+
+    switch (u8Sel)
+    {
+        case 0: /* Current */
+            if (u8Fid == NVME_FEAT_INTR_VECTOR_CONFIG)
+                *pu32Dw0 = NVME_CMD_CDW(pCmd, 11) & 0xffff;
+            else
+                *pu32Dw0 = pThis->au32Features[u8Fid];
+            break;
+        case 1: /* Default */
+        case 2: /* Saved, nothing is saveable so this is the default. */
+        {
+            if (u8Fid == NVME_FEAT_TEMP_THRESHOLD)
+                *pu32Dw0 = 0x0157;
+            else if (u8Fid == NVME_FEAT_VOLATILE_WRITE_CACHE)
+                *pu32Dw0 = RT_BIT_32(0);
+            else if (u8Fid == NVME_FEAT_NUMBER_OF_QUEUES)
+                *pu32Dw0 = RT_MAKE_U32(pThis->cQueuesSubmMax - 1, pThis->cQueuesCompMax - 1);
+            else if (u8Fid == NVME_FEAT_INTR_VECTOR_CONFIG)
+                *pu32Dw0 = NVME_CMD_CDW(pCmd, 11) & 0xffff;
+            else
+                *pu32Dw0 = 0;
+            break;
+        }
+        case 3: /* Supported capabilities: changeable, not saveable, not namespace specific. */
+            *pu32Dw0 = RT_BIT_32(2);
+            break;
+        default:
+            return NVME_STATUS_GENERIC(NVME_SC_INVALID_FIELD);
+    }
+
+    return NVME_STATUS_SUCCESS;
+}
+
+/**
+ * Asynchronous Event Request command worker, the request is kept until an event
+ * occurs (no events are generated currently) or the controller is reset.
+ */
+static uint16_t nvmeR3AdmAsyncEvtReq(PNVME pThis, PCNVMECMD pCmd)
+{
+    if (pThis->cAsyncEvtReqs == NVME_ASYNC_EVT_REQS_MAX)
+        return NVME_STATUS_CMD_SPECIFIC(NVME_SC_AER_LIMIT_EXCEEDED);
+
+    pThis->au16AsyncEvtReqCids[pThis->cAsyncEvtReqs++] = pCmd->u16Cid;
+    return NVME_STATUS_DEFERRED;
+}
+
+/**
+ * Processes a command fetched from the admin submission queue.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pSq         The admin submission queue.
+ * @param   pCmd        The command.
+ */
+static void nvmeR3AdmCmdProcess(PNVME pThis, PNVMEQUEUESUBM pSq, PCNVMECMD pCmd)
+{
+    uint16_t u16Status = NVME_STATUS_SUCCESS;
+    uint32_t u32Dw0 = 0;
+
+    LogFlowFunc(("CID=%#x Opc=%#x NSID=%u\n", pCmd->u16Cid, pCmd->u8Opc, pCmd->u32Nsid));
+
+    if (pCmd->u8Flags)
+        u16Status = NVME_STATUS_GENERIC(NVME_SC_INVALID_FIELD);
+    else
+    {
+        switch (pCmd->u8Opc)
+        {
+            case NVME_ADM_OPC_DELETE_IO_SQ:
+                u16Status = nvmeR3AdmDeleteIoSq(pThis, pCmd);
+                break;
+            case NVME_ADM_OPC_CREATE_IO_SQ:
+                u16Status = nvmeR3AdmCreateIoSq(pThis, pCmd);
+                break;
+            case NVME_ADM_OPC_GET_LOG_PAGE:
+                u16Status = nvmeR3AdmGetLogPage(pThis, pCmd);
+                break;
+            case NVME_ADM_OPC_DELETE_IO_CQ:
+                u16Status = nvmeR3AdmDeleteIoCq(pThis, pCmd);
+                break;
+            case NVME_ADM_OPC_CREATE_IO_CQ:
+                u16Status = nvmeR3AdmCreateIoCq(pThis, pCmd);
+                break;
+            case NVME_ADM_OPC_IDENTIFY:
+                u16Status = nvmeR3AdmIdentify(pThis, pCmd);
+                break;
+            case NVME_ADM_OPC_ABORT:
+                /* Commands are never aborted, bit 0 tells the host the command was not aborted. */
+                u32Dw0 = RT_BIT_32(0);
+                break;
+            case NVME_ADM_OPC_SET_FEATURES:
+                u16Status = nvmeR3AdmSetFeatures(pThis, pCmd, &u32Dw0);
+                break;
+            case NVME_ADM_OPC_GET_FEATURES:
+                u16Status = nvmeR3AdmGetFeatures(pThis, pCmd, &u32Dw0);
+                break;
+            case NVME_ADM_OPC_ASYNC_EVT_REQ:
+                u16Status = nvmeR3AdmAsyncEvtReq(pThis, pCmd);
+                break;
+            default:
+                u16Status = NVME_STATUS_GENERIC(NVME_SC_INVALID_OPCODE);
+        }
+    }
+
+    /* Deferred commands keep their completion queue entry reserved but don't count as active. */
+    if (u16Status != NVME_STATUS_DEFERRED)
+        nvmeR3CmdComplete(pThis, pSq, pCmd->u16Cid, u32Dw0, u16Status);
+    nvmeR3SubmQueueRelease(pThis, pSq);
+    nvmeR3ReqsActiveDec(pThis);
+}
+
+
+/* -=-=-=-=- Worker threads -=-=-=-=- */
+
+/**
+ * Fetches and processes a batch of commands from the given submission queue.
+ *
+ * @returns Flag whether any command was processed.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pSq         The submission queue.
+ */
+static bool nvmeR3SubmQueueProcess(PNVME pThis, PNVMEQUEUESUBM pSq)
+{
+    NVMECMD aCmds[NVME_SUBM_QUEUE_BATCH];
+
+    /* Keep the queue from being deleted while we are working on it. */
+    ASMAtomicIncU32(&pSq->cReqsActive);
+    if (ASMAtomicReadU32((volatile uint32_t *)&pSq->Hdr.enmState) != NVMEQUEUESTATE_CREATED)
+    {
+        nvmeR3SubmQueueRelease(pThis, pSq);
+        return false;
+    }
+
+    PNVMEQUEUECOMP pCq = &pThis->aQueuesComp[pSq->u16CompletionQueueId];
+    uint32_t cEntries = pSq->Hdr.cEntries;
+    uint32_t idxHead  = pSq->Hdr.idxHead;
+    uint32_t idxTail  = ASMAtomicReadU32(&pSq->Hdr.idxTail);
+    uint32_t cCmds    = RT_MIN((idxTail + cEntries - idxHead) % cEntries, NVME_SUBM_QUEUE_BATCH);
+
+    if (cCmds)
+    {
+        /* Reserve the completion entries first, re-checking after registering as waiter to not miss a head update. */
+        uint32_t cReserved = nvmeR3CompQueueReserve(pCq, cCmds);
+        if (!cReserved)
+        {
+            ASMAtomicIncU32(&pCq->cWaiters);
+            cReserved = nvmeR3CompQueueReserve(pCq, cCmds);
+        }
+
+        if (cReserved)
+        {
+            uint32_t cCmdsFirst = RT_MIN(cReserved, cEntries - idxHead);
+
+            PDMDevHlpPCIPhysRead(pThis->CTX_SUFF(pDevIns), pSq->Hdr.GCPhysBase + idxHead * sizeof(NVMECMD),
+                                 &aCmds[0], cCmdsFirst * sizeof(NVMECMD));
+            if (cReserved > cCmdsFirst)
+                PDMDevHlpPCIPhysRead(pThis->CTX_SUFF(pDevIns), pSq->Hdr.GCPhysBase,
+                                     &aCmds[cCmdsFirst], (cReserved - cCmdsFirst) * sizeof(NVMECMD));
+
+            STAM_COUNTER_ADD(&pThis->aStatSubmQueueCmds[pSq->Hdr.u16Id], cReserved);
+
+            for (uint32_t i = 0; i < cReserved; i++)
+            {
+                /* Advance the head before processing so the completion reports the consumed entry. */
+                idxHead = (idxHead + 1) % cEntries;
+                ASMAtomicWriteU32(&pSq->Hdr.idxHead, idxHead);
+
+                ASMAtomicIncU32(&pSq->cReqsActive);
+                ASMAtomicIncU32(&pThis->cReqsActive);
+                if (pSq->Hdr.u16Id == 0)
+                    nvmeR3AdmCmdProcess(pThis, pSq, &aCmds[i]);
+                else
+                    nvmeR3NvmCmdProcess(pThis, pSq, &aCmds[i]);
+            }
+        }
+        else
+            STAM_COUNTER_INC(&pThis->aStatCompQueueFull[pCq->Hdr.u16Id]);
+
+        cCmds = cReserved;
+    }
+
+    nvmeR3SubmQueueRelease(pThis, pSq);
+    return cCmds != 0;
+}
+
+/**
+ * Checks whether any submission queue served by the given worker has commands which can be processed.
+ *
+ * @returns Flag whether there is work.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pWrkThrd    The worker thread.
+ */
+static bool nvmeR3WrkThrdHasWork(PNVME pThis, PNVMEWRKTHRD pWrkThrd)
+{
+    if (   ASMAtomicReadBool(&pThis->fSignalIdle)
+        || ASMAtomicReadU32((volatile uint32_t *)&pThis->enmState) != NVMESTATE_READY)
+        return false;
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesSubm); i++)
+    {
+        PNVMEQUEUESUBM pSq = &pThis->aQueuesSubm[i];
+
+        if (   pSq->idxWrkThrd == pWrkThrd->idx
+            && ASMAtomicReadU32((volatile uint32_t *)&pSq->Hdr.enmState) == NVMEQUEUESTATE_CREATED
+            && pSq->Hdr.idxHead != ASMAtomicReadU32(&pSq->Hdr.idxTail))
+        {
+            PNVMEQUEUECOMP pCq = &pThis->aQueuesComp[pSq->u16CompletionQueueId];
+            if (nvmeR3CompQueueFreeGet(pCq, ASMAtomicReadU32(&pCq->cReserved)))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @callback_method_impl{FNPDMTHREADDEV, The worker thread processing submission queues.}
+ */
+static DECLCALLBACK(int) nvmeR3WrkThrdLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    PNVMEWRKTHRD pWrkThrd = (PNVMEWRKTHRD)pThread->pvUser;
+
+    if (pThread->enmState == PDMTHREADSTATE_INITIALIZING)
+        return VINF_SUCCESS;
+
+    while (pThread->enmState == PDMTHREADSTATE_RUNNING)
+    {
+        ASMAtomicWriteBool(&pWrkThrd->fWrkThrdSleeping, true);
+        if (!nvmeR3WrkThrdHasWork(pThis, pWrkThrd))
+        {
+            int rc = SUPSemEventWaitNoResume(pThis->pSupDrvSession, pWrkThrd->hEvtProcess, RT_INDEFINITE_WAIT);
+            AssertLogRelMsgReturn(RT_SUCCESS(rc) || rc == VERR_INTERRUPTED, ("%Rrc\n", rc), rc);
+            if (RT_UNLIKELY(pThread->enmState != PDMTHREADSTATE_RUNNING))
+                break;
+        }
+
+        ASMAtomicWriteBool(&pWrkThrd->fWrkThrdSleeping, false);
+        ASMAtomicIncU32(&pThis->cThreadsActive);
+
+        /* Round robin over all queues served until none of them has anything left. */
+        bool fProgress;
+        do
+        {
+            fProgress = false;
+
+            for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesSubm); i++)
+            {
+                PNVMEQUEUESUBM pSq = &pThis->aQueuesSubm[i];
+
+                if (   ASMAtomicReadBool(&pThis->fSignalIdle)
+                    || ASMAtomicReadU32((volatile uint32_t *)&pThis->enmState) != NVMESTATE_READY)
+                {
+                    fProgress = false;
+                    break;
+                }
+
+                if (pSq->idxWrkThrd == pWrkThrd->idx)
+                    fProgress |= nvmeR3SubmQueueProcess(pThis, pSq);
+            }
+        } while (fProgress);
+
+        if (!ASMAtomicDecU32(&pThis->cThreadsActive))
+            nvmeR3CtrlIdleCheck(pThis);
+    }
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * @callback_method_impl{FNPDMTHREADWAKEUPDEV}
+ */
+static DECLCALLBACK(int) nvmeR3WrkThrdWakeUp(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    PNVMEWRKTHRD pWrkThrd = (PNVMEWRKTHRD)pThread->pvUser;
+    return SUPSemEventSignal(pThis->pSupDrvSession, pWrkThrd->hEvtProcess);
+}
+
+/**
+ * Transmit queue consumer, kicks the worker thread when a doorbell was written in RC.
+ *
+ * @returns Success indicator.
+ *          If false the item will not be removed and the flushing will stop.
+ * @param   pDevIns     The device instance.
+ * @param   pItem       The item to consume. Upon return this item will be freed.
+ */
+static DECLCALLBACK(bool) nvmeR3NotifyQueueConsumer(PPDMDEVINS pDevIns, PPDMQUEUEITEMCORE pItem)
+{
+    PNVMENOTIFIERQUEUEITEM pNotifierItem = (PNVMENOTIFIERQUEUEITEM)pItem;
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    AssertReturn(pNotifierItem->idxWrkThrd < RT_ELEMENTS(pThis->aWrkThrds), true);
+    int rc = SUPSemEventSignal(pThis->pSupDrvSession, pThis->aWrkThrds[pNotifierItem->idxWrkThrd].hEvtProcess);
+    AssertRC(rc);
+    return true;
+}
+
+
+
+/* -=-=-=-=- IMediaExPort -=-=-=-=- */
+
+/**
+ * @interface_method_impl{PDMIMEDIAEXPORT,pfnIoReqCompleteNotify}
+ */
+static DECLCALLBACK(int) nvmeR3IoReqCompleteNotify(PPDMIMEDIAEXPORT pInterface, PDMMEDIAEXIOREQ hIoReq,
+                                                   void *pvIoReqAlloc, int rcReq)
+{
+    RT_NOREF(hIoReq);
+    PNVMENAMESPACE pNs = RT_FROM_MEMBER(pInterface, NVMENAMESPACE, IMediaExPort);
+    nvmeR3ReqComplete(pNs->pNvmeR3, (PNVMEREQ)pvIoReqAlloc, rcReq);
+    return VINF_SUCCESS;
+}
+
+/**
+ * @interface_method_impl{PDMIMEDIAEXPORT,pfnIoReqCopyFromBuf}
+ */
+static DECLCALLBACK(int) nvmeR3IoReqCopyFromBuf(PPDMIMEDIAEXPORT pInterface, PDMMEDIAEXIOREQ hIoReq,
+                                                void *pvIoReqAlloc, uint32_t offDst, PRTSGBUF pSgBuf,
+                                                size_t cbCopy)
+{
+    RT_NOREF(hIoReq);
+    PNVMENAMESPACE pNs = RT_FROM_MEMBER(pInterface, NVMENAMESPACE, IMediaExPort);
+    PNVMEREQ pReq = (PNVMEREQ)pvIoReqAlloc;
+
+    size_t cbCopied = nvmeR3PrpsCopy(pNs->pNvmeR3, &pReq->Prps, offDst, pSgBuf, cbCopy, true /*fToGuest*/);
+    return cbCopied == cbCopy ? VINF_SUCCESS : VERR_PDM_MEDIAEX_IOBUF_OVERFLOW;
+}
+
+/**
+ * @interface_method_impl{PDMIMEDIAEXPORT,pfnIoReqCopyToBuf}
+ */
+static DECLCALLBACK(int) nvmeR3IoReqCopyToBuf(PPDMIMEDIAEXPORT pInterface, PDMMEDIAEXIOREQ hIoReq,
+                                              void *pvIoReqAlloc, uint32_t offSrc, PRTSGBUF pSgBuf,
+                                              size_t cbCopy)
+{
+    RT_NOREF(hIoReq);
+    PNVMENAMESPACE pNs = RT_FROM_MEMBER(pInterface, NVMENAMESPACE, IMediaExPort);
+    PNVMEREQ pReq = (PNVMEREQ)pvIoReqAlloc;
+
+    size_t cbCopied = nvmeR3PrpsCopy(pNs->pNvmeR3, &pReq->Prps, offSrc, pSgBuf, cbCopy, false /*fToGuest*/);
+    return cbCopied == cbCopy ? VINF_SUCCESS : VERR_PDM_MEDIAEX_IOBUF_UNDERRUN;
+}
+
+/**
+ * @interface_method_impl{PDMIMEDIAEXPORT,pfnIoReqQuerySgBuf}
+ */
+static DECLCALLBACK(int) nvmeR3IoReqQuerySgBuf(PPDMIMEDIAEXPORT pInterface, PDMMEDIAEXIOREQ hIoReq,
+                                               void *pvIoReqAlloc, PRTSGSEG paSegs, unsigned *pcSegs,
+                                               size_t *pcbBuf)
+{
+    RT_NOREF(hIoReq);
+    int rc             = VINF_SUCCESS;
+    PNVMENAMESPACE pNs = RT_FROM_MEMBER(pInterface, NVMENAMESPACE, IMediaExPort);
+    PNVMEREQ pReq      = (PNVMEREQ)pvIoReqAlloc;
+    PNVME pThis        = pNs->pNvmeR3;
+    size_t cbLeft      = pReq->cbTransfer;
+    unsigned cSegs     = 0;
+
+    if (   (   pReq->enmType != PDMMEDIAEXIOREQTYPE_READ
+            && pReq->enmType != PDMMEDIAEXIOREQTYPE_WRITE)
+        || !cbLeft
+        || pReq->cPgLcks)
+        return VERR_NOT_SUPPORTED;
+
+    /*
+     * Lock every page described by the PRPs, the first one is the only one which can
+     * start at an offset.  Anything not suitable for unbuffered I/O is left to the copy path.
+     */
+    for (uint32_t i = 0; i < pReq->Prps.cPrps && cbLeft && RT_SUCCESS(rc); i++)
+    {
+        RTGCPHYS GCPhys = pReq->Prps.aGCPhys[i];
+        size_t cbThis   = RT_MIN(cbLeft, NVME_PAGE_SIZE - (GCPhys & NVME_PAGE_OFFSET_MASK));
+        PPGMPAGEMAPLOCK pPgLck = &pReq->aPgLcks[pReq->cPgLcks];
+        void *pvPage = NULL;
+
+        if (   (GCPhys & 511)
+            || (cbThis & 511))
+        {
+            rc = VERR_NOT_SUPPORTED;
+            break;
+        }
+
+        /* Guest memory is only read when writing to the medium. */
+        if (pReq->enmType == PDMMEDIAEXIOREQTYPE_WRITE)
+            rc = PDMDevHlpPhysGCPhys2CCPtrReadOnly(pThis->pDevInsR3, GCPhys, 0, (void const **)&pvPage, pPgLck);
+        else
+            rc = PDMDevHlpPhysGCPhys2CCPtr(pThis->pDevInsR3, GCPhys, 0, &pvPage, pPgLck);
+        if (RT_FAILURE(rc))
+        {
+            rc = VERR_NOT_SUPPORTED;
+            break;
+        }
+
+        pReq->cPgLcks++;
+
+        /* Merge with the previous segment if the host mappings happen to be contiguous. */
+        if (   cSegs
+            && (uint8_t *)paSegs[cSegs - 1].pvSeg + paSegs[cSegs - 1].cbSeg == (uint8_t *)pvPage)
+            paSegs[cSegs - 1].cbSeg += cbThis;
+        else if (cSegs < *pcSegs)
+        {
+            paSegs[cSegs].pvSeg = pvPage;
+            paSegs[cSegs].cbSeg = cbThis;
+            cSegs++;
+        }
+        else
+            rc = VERR_NOT_SUPPORTED;
+
+        cbLeft -= cbThis;
+    }
+
+    if (   RT_SUCCESS(rc)
+        && cbLeft)
+        rc = VERR_NOT_SUPPORTED;
+
+    if (RT_SUCCESS(rc))
+    {
+        *pcSegs = cSegs;
+        *pcbBuf = pReq->cbTransfer;
+    }
+    else
+        nvmeR3ReqPgLcksRelease(pThis, pReq);
+
+    return rc;
+}
+
+/**
+ * @interface_method_impl{PDMIMEDIAEXPORT,pfnIoReqQueryDiscardRanges}
+ */
+static DECLCALLBACK(int) nvmeR3IoReqQueryDiscardRanges(PPDMIMEDIAEXPORT pInterface, PDMMEDIAEXIOREQ hIoReq,
+                                                       void *pvIoReqAlloc, uint32_t idxRangeStart,
+                                                       uint32_t cRanges, PRTRANGE paRanges,
+                                                       uint32_t *pcRanges)
+{
+    RT_NOREF(hIoReq);
+    PNVMENAMESPACE pNs = RT_FROM_MEMBER(pInterface, NVMENAMESPACE, IMediaExPort);
+    PNVMEREQ pReq = (PNVMEREQ)pvIoReqAlloc;
+    uint32_t cRangesCopied = 0;
+
+    AssertReturn(idxRangeStart <= pReq->cRanges, VERR_INVALID_PARAMETER);
+
+    cRanges = RT_MIN(cRanges, pReq->cRanges - idxRangeStart);
+    for (uint32_t i = 0; i < cRanges; i++)
+    {
+        NVMEDSMRANGE Range;
+        RTSGSEG Seg;
+        RTSGBUF SgBuf;
+
+        Seg.pvSeg = &Range;
+        Seg.cbSeg = sizeof(Range);
+        RTSgBufInit(&SgBuf, &Seg, 1);
+
+        size_t cbCopied = nvmeR3PrpsCopy(pNs->pNvmeR3, &pReq->Prps, (idxRangeStart + i) * sizeof(NVMEDSMRANGE),
+                                         &SgBuf, sizeof(Range), false /*fToGuest*/);
+        if (cbCopied != sizeof(Range))
+            return VERR_PDM_MEDIAEX_IOBUF_UNDERRUN;
+
+        if (   Range.u64LbaStart >= pNs->cSectors
+            || Range.cLbas > pNs->cSectors - Range.u64LbaStart)
+            return VERR_OUT_OF_RANGE;
+
+        paRanges[i].offStart = Range.u64LbaStart * pNs->cbSector;
+        paRanges[i].cbRange  = (size_t)Range.cLbas * pNs->cbSector;
+        cRangesCopied++;
+    }
+
+    *pcRanges = cRangesCopied;
+    return VINF_SUCCESS;
+}
+
+/**
+ * @interface_method_impl{PDMIMEDIAEXPORT,pfnIoReqStateChanged}
+ */
+static DECLCALLBACK(void) nvmeR3IoReqStateChanged(PPDMIMEDIAEXPORT pInterface, PDMMEDIAEXIOREQ hIoReq,
+                                                  void *pvIoReqAlloc, PDMMEDIAEXIOREQSTATE enmState)
+{
+    RT_NOREF(hIoReq, pvIoReqAlloc);
+    PNVMENAMESPACE pNs = RT_FROM_MEMBER(pInterface, NVMENAMESPACE, IMediaExPort);
+    PNVME pThis = pNs->pNvmeR3;
+
+    switch (enmState)
+    {
+        case PDMMEDIAEXIOREQSTATE_SUSPENDED:
+            /* Make sure the request is not accounted for so the VM can suspend successfully. */
+            nvmeR3ReqsActiveDec(pThis);
+            break;
+        case PDMMEDIAEXIOREQSTATE_ACTIVE:
+            /* Make sure the request is accounted for so the VM suspends only when the request is complete. */
+            ASMAtomicIncU32(&pThis->cReqsActive);
+            break;
+        default:
+            AssertMsgFailed(("Invalid request state given %u\n", enmState));
+    }
+}
+
+/**
+ * @interface_method_impl{PDMIMEDIAEXPORT,pfnMediumEjected}
+ */
+static DECLCALLBACK(void) nvmeR3MediumEjected(PPDMIMEDIAEXPORT pInterface)
+{
+    RT_NOREF(pInterface);
+    /* Namespaces are backed by fixed disks only. */
+}
+
+
+/* -=-=-=-=- IBase and IMediaPort -=-=-=-=- */
+
+/**
+ * @interface_method_impl{PDMIBASE,pfnQueryInterface}
+ */
+static DECLCALLBACK(void *) nvmeR3NamespaceQueryInterface(PPDMIBASE pInterface, const char *pszIID)
+{
+    PNVMENAMESPACE pNs = PDMIBASE_2_PNVMENAMESPACE(pInterface);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBASE, &pNs->IBase);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIMEDIAPORT, &pNs->IPort);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIMEDIAEXPORT, &pNs->IMediaExPort);
+    return NULL;
+}
+
+/**
+ * @interface_method_impl{PDMIMEDIAPORT,pfnQueryDeviceLocation}
+ */
+static DECLCALLBACK(int) nvmeR3NamespaceQueryDeviceLocation(PPDMIMEDIAPORT pInterface, const char **ppcszController,
+                                                            uint32_t *piInstance, uint32_t *piLUN)
+{
+    PNVMENAMESPACE pNs = PDMIMEDIAPORT_2_PNVMENAMESPACE(pInterface);
+    PPDMDEVINS pDevIns = pNs->pNvmeR3->pDevInsR3;
+
+    AssertPtrReturn(ppcszController, VERR_INVALID_POINTER);
+    AssertPtrReturn(piInstance, VERR_INVALID_POINTER);
+    AssertPtrReturn(piLUN, VERR_INVALID_POINTER);
+
+    *ppcszController = pDevIns->pReg->szName;
+    *piInstance = pDevIns->iInstance;
+    *piLUN = pNs->iLUN;
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Gets the pointer to the status LED of a unit.
+ *
+ * @returns VBox status code.
+ * @param   pInterface      Pointer to the interface structure containing the called function pointer.
+ * @param   iLUN            The unit which status LED we desire.
+ * @param   ppLed           Where to store the LED pointer.
+ */
+static DECLCALLBACK(int) nvmeR3Status_QueryStatusLed(PPDMILEDPORTS pInterface, unsigned iLUN, PPDMLED *ppLed)
+{
+    PNVME pThis = PDMILEDPORTS_2_PNVME(pInterface);
+    if (iLUN < pThis->cNamespaces)
+    {
+        *ppLed = &pThis->paNamespacesR3[iLUN].Led;
+        Assert((*ppLed)->u32Magic == PDMLED_MAGIC);
+        return VINF_SUCCESS;
+    }
+    return VERR_PDM_LUN_NOT_FOUND;
+}
+
+/**
+ * @interface_method_impl{PDMIBASE,pfnQueryInterface}
+ */
+static DECLCALLBACK(void *) nvmeR3Status_QueryInterface(PPDMIBASE pInterface, const char *pszIID)
+{
+    PNVME pThis = PDMIBASE_2_PNVME(pInterface);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBASE, &pThis->IBase);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMILEDPORTS, &pThis->ILeds);
+    return NULL;
+}
+
+
+/* -=-=-=-=- Debug info -=-=-=-=- */
+
+/**
+ * NVMe status info callback.
+ *
+ * @param   pDevIns     The device instance.
+ * @param   pHlp        The output helpers.
+ * @param   pszArgs     The arguments.
+ */
+static DECLCALLBACK(void) nvmeR3Info(PPDMDEVINS pDevIns, PCDBGFINFOHLP pHlp, const char *pszArgs)
+{
+    RT_NOREF(pszArgs);
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    pHlp->pfnPrintf(pHlp,
+                    "%s#%d: mmio=%RGp namespaces=%u queues=%u/%u workers=%u msix=%u GC=%RTbool R0=%RTbool\n",
+                    pDevIns->pReg->szName,
+                    pDevIns->iInstance,
+                    pThis->GCPhysMMIO,
+                    pThis->cNamespaces,
+                    pThis->cQueuesSubmMax,
+                    pThis->cQueuesCompMax,
+                    pThis->cWrkThrdsMax,
+                    pThis->cMsixVectors,
+                    pThis->fRCEnabled,
+                    pThis->fR0Enabled);
+
+    pHlp->pfnPrintf(pHlp, "State=%u\n", pThis->enmState);
+    pHlp->pfnPrintf(pHlp, "CC=%#x\n", pThis->u32RegCc);
+    pHlp->pfnPrintf(pHlp, "CSTS=%#x\n", pThis->u32RegCsts);
+    pHlp->pfnPrintf(pHlp, "AQA=%#x\n", pThis->u32RegAqa);
+    pHlp->pfnPrintf(pHlp, "ASQ=%#llx\n", pThis->u64RegAsq);
+    pHlp->pfnPrintf(pHlp, "ACQ=%#llx\n", pThis->u64RegAcq);
+    pHlp->pfnPrintf(pHlp, "IntrMask=%#x MSI-X=%RTbool\n", pThis->u32IntrMask, nvmeMsixIsEnabled(pThis));
+    pHlp->pfnPrintf(pHlp, "ReqsActive=%u ThreadsActive=%u AsyncEvtReqs=%u\n",
+                    pThis->cReqsActive, pThis->cThreadsActive, pThis->cAsyncEvtReqs);
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesSubm); i++)
+    {
+        PNVMEQUEUESUBM pSq = &pThis->aQueuesSubm[i];
+        if (pSq->Hdr.enmState != NVMEQUEUESTATE_INVALID)
+            pHlp->pfnPrintf(pHlp, "SQ %u: state=%u base=%RGp entries=%u head=%u tail=%u cq=%u worker=%u active=%u\n",
+                            i, pSq->Hdr.enmState, pSq->Hdr.GCPhysBase, pSq->Hdr.cEntries, pSq->Hdr.idxHead,
+                            pSq->Hdr.idxTail, pSq->u16CompletionQueueId, pSq->idxWrkThrd, pSq->cReqsActive);
+    }
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesComp); i++)
+    {
+        PNVMEQUEUECOMP pCq = &pThis->aQueuesComp[i];
+        if (pCq->Hdr.enmState != NVMEQUEUESTATE_INVALID)
+            pHlp->pfnPrintf(pHlp, "CQ %u: base=%RGp entries=%u head=%u tail=%u phase=%RTbool ien=%RTbool vector=%u reserved=%u\n",
+                            i, pCq->Hdr.GCPhysBase, pCq->Hdr.cEntries, pCq->Hdr.idxHead, pCq->Hdr.idxTail,
+                            pCq->fPhase, pCq->fIntrEnabled, pCq->u32IntrVec, pCq->cReserved);
+    }
+
+    for (uint32_t i = 0; i < pThis->cNamespaces; i++)
+    {
+        PNVMENAMESPACE pNs = &pThis->paNamespacesR3[i];
+        pHlp->pfnPrintf(pHlp, "Namespace %u: attached=%RTbool blocks=%llu blocksize=%u discard=%RTbool\n",
+                        i + 1, pNs->pDrvBase != NULL, pNs->cSectors, pNs->cbSector, pNs->fDiscard);
+    }
+}
+
+
+/* -=-=-=-=- Helper -=-=-=-=- */
+
+/**
+ * Checks if all asynchronous I/O is finished.
+ *
+ * Used by nvmeR3Reset, nvmeR3Suspend and nvmeR3PowerOff. nvmeR3SavePrep makes
+ * use of it in strict builds (which is why it's up here).
+ *
+ * @returns true if quiesced, false if busy.
+ * @param   pDevIns         The device instance.
+ */
+static bool nvmeR3AllAsyncIOIsFinished(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    return    !ASMAtomicReadU32(&pThis->cThreadsActive)
+           && !ASMAtomicReadU32(&pThis->cReqsActive);
+}
+
+/**
+ * Kicks every worker thread, used when processing can continue after the VM was stopped.
+ *
+ * @returns nothing.
+ * @param   pThis       The NVMe controller instance.
+ */
+static void nvmeR3WrkThrdsKickAll(PNVME pThis)
+{
+    for (uint32_t i = 0; i <= pThis->cWrkThrdsMax; i++)
+    {
+        int rc = SUPSemEventSignal(pThis->pSupDrvSession, pThis->aWrkThrds[i].hEvtProcess);
+        AssertRC(rc);
+    }
+}
+
+/* -=-=-=-=- Saved State -=-=-=-=- */
+
+/**
+ * @callback_method_impl{FNSSMDEVSAVEPREP}
+ */
+static DECLCALLBACK(int) nvmeR3SavePrep(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
+{
+    RT_NOREF(pDevIns, pSSM);
+    Assert(nvmeR3AllAsyncIOIsFinished(pDevIns));
+    return VINF_SUCCESS;
+}
+
+/**
+ * @callback_method_impl{FNSSMDEVLOADPREP}
+ */
+static DECLCALLBACK(int) nvmeR3LoadPrep(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
+{
+    RT_NOREF(pDevIns, pSSM);
+    Assert(nvmeR3AllAsyncIOIsFinished(pDevIns));
+    return VINF_SUCCESS;
+}
+
+/**
+ * @callback_method_impl{FNSSMDEVLIVEEXEC}
+ */
+static DECLCALLBACK(int) nvmeR3LiveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint32_t uPass)
+{
+    RT_NOREF(uPass);
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    /* config. */
+    SSMR3PutU32(pSSM, pThis->cNamespaces);
+    SSMR3PutU32(pSSM, pThis->cQueuesSubmMax);
+    SSMR3PutU32(pSSM, pThis->cQueuesCompMax);
+    SSMR3PutU32(pSSM, pThis->cQueueEntriesMax);
+    SSMR3PutU32(pSSM, pThis->cMsixVectors);
+    for (uint32_t i = 0; i < pThis->cNamespaces; i++)
+        SSMR3PutBool(pSSM, pThis->paNamespacesR3[i].pDrvBase != NULL);
+
+    return VINF_SSM_DONT_CALL_AGAIN;
+}
+
+/**
+ * @callback_method_impl{FNSSMDEVSAVEEXEC}
+ */
+static DECLCALLBACK(int) nvmeR3SaveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    uint32_t cReqsSuspended = 0;
+
+    /* config */
+    nvmeR3LiveExec(pDevIns, pSSM, SSM_PASS_FINAL);
+
+    /* registers and controller state. */
+    SSMR3PutU32(pSSM, pThis->enmState);
+    SSMR3PutU32(pSSM, pThis->u32RegCc);
+    SSMR3PutU32(pSSM, pThis->u32RegCsts);
+    SSMR3PutU32(pSSM, pThis->u32RegAqa);
+    SSMR3PutU64(pSSM, pThis->u64RegAsq);
+    SSMR3PutU64(pSSM, pThis->u64RegAcq);
+    SSMR3PutU32(pSSM, pThis->u32IntrMask);
+    SSMR3PutU32(pSSM, pThis->cQueuesSubmAlloc);
+    SSMR3PutU32(pSSM, pThis->cQueuesCompAlloc);
+    SSMR3PutU32(pSSM, pThis->cAsyncEvtReqs);
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->au16AsyncEvtReqCids); i++)
+        SSMR3PutU16(pSSM, pThis->au16AsyncEvtReqCids[i]);
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->au32Features); i++)
+        SSMR3PutU32(pSSM, pThis->au32Features[i]);
+    SSMR3PutU64(pSSM, pThis->cbRead);
+    SSMR3PutU64(pSSM, pThis->cbWritten);
+    SSMR3PutU64(pSSM, pThis->cReadCmds);
+    SSMR3PutU64(pSSM, pThis->cWriteCmds);
+
+    /* queues. */
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesComp); i++)
+    {
+        PNVMEQUEUECOMP pCq = &pThis->aQueuesComp[i];
+
+        SSMR3PutU32(pSSM, pCq->Hdr.enmState);
+        if (pCq->Hdr.enmState == NVMEQUEUESTATE_INVALID)
+            continue;
+
+        SSMR3PutGCPhys(pSSM, pCq->Hdr.GCPhysBase);
+        SSMR3PutU32(pSSM, pCq->Hdr.cEntries);
+        SSMR3PutU32(pSSM, pCq->Hdr.idxHead);
+        SSMR3PutU32(pSSM, pCq->Hdr.idxTail);
+        SSMR3PutBool(pSSM, pCq->fPhase);
+        SSMR3PutBool(pSSM, pCq->fIntrEnabled);
+        SSMR3PutU32(pSSM, pCq->u32IntrVec);
+    }
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesSubm); i++)
+    {
+        PNVMEQUEUESUBM pSq = &pThis->aQueuesSubm[i];
+
+        SSMR3PutU32(pSSM, pSq->Hdr.enmState);
+        if (pSq->Hdr.enmState == NVMEQUEUESTATE_INVALID)
+            continue;
+
+        SSMR3PutGCPhys(pSSM, pSq->Hdr.GCPhysBase);
+        SSMR3PutU32(pSSM, pSq->Hdr.cEntries);
+        SSMR3PutU32(pSSM, pSq->Hdr.idxHead);
+        SSMR3PutU32(pSSM, pSq->Hdr.idxTail);
+        SSMR3PutU16(pSSM, pSq->u16CompletionQueueId);
+        SSMR3PutU16(pSSM, pSq->u16CidDelete);
+        SSMR3PutU32(pSSM, pSq->u32Priority);
+    }
+
+    /*
+     * Save the commands of all suspended requests, they are redone after the state was loaded.
+     * Internal requests are not visible to the guest and just dropped.
+     */
+    for (uint32_t i = 0; i < pThis->cNamespaces; i++)
+    {
+        PNVMENAMESPACE pNs = &pThis->paNamespacesR3[i];
+        if (pNs->pDrvMediaEx)
+            cReqsSuspended += pNs->pDrvMediaEx->pfnIoReqGetSuspendedCount(pNs->pDrvMediaEx);
+    }
+
+    for (uint32_t i = 0; i < pThis->cNamespaces && cReqsSuspended; i++)
+    {
+        PNVMENAMESPACE pNs = &pThis->paNamespacesR3[i];
+        if (!pNs->pDrvMediaEx)
+            continue;
+
+        uint32_t cThisReqsSuspended = pNs->pDrvMediaEx->pfnIoReqGetSuspendedCount(pNs->pDrvMediaEx);
+        if (cThisReqsSuspended)
+        {
+            PDMMEDIAEXIOREQ hIoReq;
+            PNVMEREQ pReq;
+            int rc = pNs->pDrvMediaEx->pfnIoReqQuerySuspendedStart(pNs->pDrvMediaEx, &hIoReq, (void **)&pReq);
+            AssertRCBreak(rc);
+
+            for (;;)
+            {
+                if (pReq->pSq)
+                {
+                    SSMR3PutU32(pSSM, pReq->pSq->Hdr.u16Id);
+                    SSMR3PutMem(pSSM, &pReq->Cmd, sizeof(pReq->Cmd));
+                }
+
+                cThisReqsSuspended--;
+                if (!cThisReqsSuspended)
+                    break;
+
+                rc = pNs->pDrvMediaEx->pfnIoReqQuerySuspendedNext(pNs->pDrvMediaEx, hIoReq, &hIoReq, (void **)&pReq);
+                AssertRCBreak(rc);
+            }
+        }
+    }
+
+    return SSMR3PutU32(pSSM, UINT32_MAX);
+}
+
+/**
+ * @callback_method_impl{FNSSMDEVLOADEXEC}
+ */
+static DECLCALLBACK(int) nvmeR3LoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t uPass)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    uint32_t u32;
+    int rc;
+
+    if (uVersion != NVME_SAVED_STATE_VERSION)
+        return VERR_SSM_UNSUPPORTED_DATA_UNIT_VERSION;
+
+    /* Verify config. */
+    SSMR3GetU32(pSSM, &u32);
+    if (u32 != pThis->cNamespaces)
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("Config mismatch: NamespacesMax - saved=%u config=%u"),
+                                u32, pThis->cNamespaces);
+    SSMR3GetU32(pSSM, &u32);
+    if (u32 != pThis->cQueuesSubmMax)
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("Config mismatch: QueuesMax - saved=%u config=%u"),
+                                u32, pThis->cQueuesSubmMax);
+    SSMR3GetU32(pSSM, &u32);
+    if (u32 != pThis->cQueuesCompMax)
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("Config mismatch: QueuesMax - saved=%u config=%u"),
+                                u32, pThis->cQueuesCompMax);
+    SSMR3GetU32(pSSM, &u32);
+    if (u32 != pThis->cQueueEntriesMax)
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("Config mismatch: QueueEntriesMax - saved=%u config=%u"),
+                                u32, pThis->cQueueEntriesMax);
+    SSMR3GetU32(pSSM, &u32);
+    if (u32 != pThis->cMsixVectors)
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("Config mismatch: MSI-X vectors - saved=%u config=%u"),
+                                u32, pThis->cMsixVectors);
+    for (uint32_t i = 0; i < pThis->cNamespaces; i++)
+    {
+        bool fInUse;
+        rc = SSMR3GetBool(pSSM, &fInUse);
+        AssertRCReturn(rc, rc);
+        if (fInUse != (pThis->paNamespacesR3[i].pDrvBase != NULL))
+            return SSMR3SetCfgError(pSSM, RT_SRC_POS,
+                                    N_("The %s VM is missing a device for namespace %u. "
+                                       "Please make sure the source and target VMs have compatible storage configurations"),
+                                    fInUse ? "target" : "source", i + 1);
+    }
+
+    if (uPass != SSM_PASS_FINAL)
+        return VINF_SUCCESS;
+
+    /* registers and controller state. */
+    SSMR3GetU32(pSSM, &u32);
+    AssertLogRelMsgReturn(   u32 == NVMESTATE_DISABLED
+                          || u32 == NVMESTATE_READY
+                          || u32 == NVMESTATE_FATAL,
+                          ("NVMe: Invalid controller state %u in saved state\n", u32),
+                          VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+    pThis->enmState = (NVMESTATE)u32;
+    SSMR3GetU32(pSSM, (uint32_t *)&pThis->u32RegCc);
+    SSMR3GetU32(pSSM, (uint32_t *)&pThis->u32RegCsts);
+    SSMR3GetU32(pSSM, &pThis->u32RegAqa);
+    SSMR3GetU64(pSSM, &pThis->u64RegAsq);
+    SSMR3GetU64(pSSM, &pThis->u64RegAcq);
+    SSMR3GetU32(pSSM, (uint32_t *)&pThis->u32IntrMask);
+    SSMR3GetU32(pSSM, &pThis->cQueuesSubmAlloc);
+    SSMR3GetU32(pSSM, &pThis->cQueuesCompAlloc);
+    SSMR3GetU32(pSSM, &pThis->cAsyncEvtReqs);
+    AssertLogRelMsgReturn(pThis->cAsyncEvtReqs <= NVME_ASYNC_EVT_REQS_MAX,
+                          ("NVMe: Invalid number of asynchronous event requests %u in saved state\n", pThis->cAsyncEvtReqs),
+                          VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->au16AsyncEvtReqCids); i++)
+        SSMR3GetU16(pSSM, &pThis->au16AsyncEvtReqCids[i]);
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->au32Features); i++)
+        SSMR3GetU32(pSSM, &pThis->au32Features[i]);
+    SSMR3GetU64(pSSM, (uint64_t *)&pThis->cbRead);
+    SSMR3GetU64(pSSM, (uint64_t *)&pThis->cbWritten);
+    SSMR3GetU64(pSSM, (uint64_t *)&pThis->cReadCmds);
+    SSMR3GetU64(pSSM, (uint64_t *)&pThis->cWriteCmds);
+
+    /* queues. */
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesComp); i++)
+    {
+        PNVMEQUEUECOMP pCq = &pThis->aQueuesComp[i];
+        RTGCPHYS GCPhysBase;
+        uint32_t cEntries, idxHead, idxTail, u32IntrVec;
+        bool fPhase, fIntrEnabled;
+
+        rc = SSMR3GetU32(pSSM, &u32);
+        AssertRCReturn(rc, rc);
+        if (u32 == NVMEQUEUESTATE_INVALID)
+        {
+            pCq->Hdr.enmState = NVMEQUEUESTATE_INVALID;
+            continue;
+        }
+
+        SSMR3GetGCPhys(pSSM, &GCPhysBase);
+        SSMR3GetU32(pSSM, &cEntries);
+        SSMR3GetU32(pSSM, &idxHead);
+        SSMR3GetU32(pSSM, &idxTail);
+        SSMR3GetBool(pSSM, &fPhase);
+        SSMR3GetBool(pSSM, &fIntrEnabled);
+        rc = SSMR3GetU32(pSSM, &u32IntrVec);
+        AssertRCReturn(rc, rc);
+        AssertLogRelMsgReturn(   u32 == NVMEQUEUESTATE_CREATED
+                              && cEntries >= NVME_QUEUE_ENTRIES_MIN
+                              && cEntries <= pThis->cQueueEntriesMax
+                              && idxHead < cEntries
+                              && idxTail < cEntries,
+                              ("NVMe: CQ %u invalid in saved state (state=%u entries=%u head=%u tail=%u)\n",
+                               i, u32, cEntries, idxHead, idxTail),
+                              VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+
+        nvmeR3CompQueueCreate(pThis, (uint16_t)i, GCPhysBase, cEntries, fIntrEnabled, u32IntrVec);
+        pCq->Hdr.idxHead = idxHead;
+        pCq->Hdr.idxTail = idxTail;
+        pCq->fPhase      = fPhase;
+    }
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesSubm); i++)
+    {
+        PNVMEQUEUESUBM pSq = &pThis->aQueuesSubm[i];
+        RTGCPHYS GCPhysBase;
+        uint32_t cEntries, idxHead, idxTail, u32Priority;
+        uint16_t u16CqId, u16CidDelete;
+
+        rc = SSMR3GetU32(pSSM, &u32);
+        AssertRCReturn(rc, rc);
+        if (u32 == NVMEQUEUESTATE_INVALID)
+        {
+            pSq->Hdr.enmState = NVMEQUEUESTATE_INVALID;
+            continue;
+        }
+
+        SSMR3GetGCPhys(pSSM, &GCPhysBase);
+        SSMR3GetU32(pSSM, &cEntries);
+        SSMR3GetU32(pSSM, &idxHead);
+        SSMR3GetU32(pSSM, &idxTail);
+        SSMR3GetU16(pSSM, &u16CqId);
+        SSMR3GetU16(pSSM, &u16CidDelete);
+        rc = SSMR3GetU32(pSSM, &u32Priority);
+        AssertRCReturn(rc, rc);
+        AssertLogRelMsgReturn(   (   u32 == NVMEQUEUESTATE_CREATED
+                                  || u32 == NVMEQUEUESTATE_DELETING)
+                              && cEntries >= NVME_QUEUE_ENTRIES_MIN
+                              && cEntries <= pThis->cQueueEntriesMax
+                              && idxHead < cEntries
+                              && idxTail < cEntries
+                              && u16CqId < RT_ELEMENTS(pThis->aQueuesComp)
+                              && pThis->aQueuesComp[u16CqId].Hdr.enmState == NVMEQUEUESTATE_CREATED,
+                              ("NVMe: SQ %u invalid in saved state (state=%u entries=%u head=%u tail=%u cq=%u)\n",
+                               i, u32, cEntries, idxHead, idxTail, u16CqId),
+                              VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+
+        nvmeR3SubmQueueCreate(pThis, (uint16_t)i, GCPhysBase, cEntries, u16CqId, u32Priority);
+        pSq->Hdr.idxHead  = idxHead;
+        pSq->Hdr.idxTail  = idxTail;
+        pSq->u16CidDelete = u16CidDelete;
+        if (u32 == NVMEQUEUESTATE_DELETING)
+        {
+            /* The completion of the pending delete command has an admin completion queue entry reserved. */
+            pSq->Hdr.enmState = NVMEQUEUESTATE_DELETING;
+            pThis->aQueuesComp[0].cReserved++;
+        }
+    }
+
+    /* Outstanding asynchronous event requests have an admin completion queue entry reserved as well. */
+    pThis->aQueuesComp[0].cReserved += pThis->cAsyncEvtReqs;
+
+    /* The commands to redo. */
+    rc = SSMR3GetU32(pSSM, &u32);
+    while (   RT_SUCCESS(rc)
+           && u32 != UINT32_MAX)
+    {
+        AssertLogRelMsgReturn(   u32 > 0
+                              && u32 < RT_ELEMENTS(pThis->aQueuesSubm)
+                              && pThis->aQueuesSubm[u32].Hdr.enmState != NVMEQUEUESTATE_INVALID,
+                              ("NVMe: Invalid submission queue %u for suspended command in saved state\n", u32),
+                              VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+
+        if (!(pThis->cCmdsRedo % 16))
+        {
+            PNVMECMDREDO paCmdsRedo = (PNVMECMDREDO)RTMemRealloc(pThis->paCmdsRedoR3,
+                                                                 (pThis->cCmdsRedo + 16) * sizeof(NVMECMDREDO));
+            if (RT_UNLIKELY(!paCmdsRedo))
+                return VERR_NO_MEMORY;
+            pThis->paCmdsRedoR3 = paCmdsRedo;
+        }
+
+        PNVMECMDREDO pCmdRedo = &pThis->paCmdsRedoR3[pThis->cCmdsRedo];
+        pCmdRedo->u16SqId = (uint16_t)u32;
+        rc = SSMR3GetMem(pSSM, &pCmdRedo->Cmd, sizeof(pCmdRedo->Cmd));
+        if (RT_SUCCESS(rc))
+        {
+            pThis->cCmdsRedo++;
+            rc = SSMR3GetU32(pSSM, &u32);
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * @callback_method_impl{FNSSMDEVLOADDONE}
+ */
+static DECLCALLBACK(int) nvmeR3LoadDone(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
+{
+    RT_NOREF(pSSM);
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    /* Kick of any commands we need to redo, the completion entries were reserved when they were fetched. */
+    for (uint32_t i = 0; i < pThis->cCmdsRedo && pThis->enmState == NVMESTATE_READY; i++)
+    {
+        PNVMECMDREDO pCmdRedo = &pThis->paCmdsRedoR3[i];
+        PNVMEQUEUESUBM pSq = &pThis->aQueuesSubm[pCmdRedo->u16SqId];
+
+        ASMAtomicIncU32(&pThis->aQueuesComp[pSq->u16CompletionQueueId].cReserved);
+        ASMAtomicIncU32(&pSq->cReqsActive);
+        ASMAtomicIncU32(&pThis->cReqsActive);
+        nvmeR3NvmCmdProcess(pThis, pSq, &pCmdRedo->Cmd);
+    }
+
+    if (pThis->paCmdsRedoR3)
+    {
+        RTMemFree(pThis->paCmdsRedoR3);
+        pThis->paCmdsRedoR3 = NULL;
+        pThis->cCmdsRedo = 0;
+    }
+
+    /* Finish deleting submission queues whose last command was completed in the old VM. */
+    for (uint32_t i = 1; i < RT_ELEMENTS(pThis->aQueuesSubm); i++)
+    {
+        PNVMEQUEUESUBM pSq = &pThis->aQueuesSubm[i];
+        if (   pSq->Hdr.enmState == NVMEQUEUESTATE_DELETING
+            && !ASMAtomicReadU32(&pSq->cReqsActive))
+            nvmeR3SubmQueueDeleteFinish(pThis, pSq);
+    }
+
+    return VINF_SUCCESS;
+}
+
+
+/* -=-=-=-=- device PDM interface -=-=-=-=- */
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnRelocate}
+ */
+static DECLCALLBACK(void) nvmeR3Relocate(PPDMDEVINS pDevIns, RTGCINTPTR offDelta)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    pThis->pDevInsRC += offDelta;
+    pThis->pNotifierQueueRC = PDMQueueRCPtr(pThis->pNotifierQueueR3);
+}
+
+/**
+ * Callback employed by nvmeR3Suspend and nvmeR3PowerOff.
+ *
+ * @returns true if we've quiesced, false if we're still working.
+ * @param   pDevIns     The device instance.
+ */
+static DECLCALLBACK(bool) nvmeR3IsAsyncSuspendOrPowerOffDone(PPDMDEVINS pDevIns)
+{
+    if (!nvmeR3AllAsyncIOIsFinished(pDevIns))
+        return false;
+
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+    return true;
+}
+
+/**
+ * Common worker for nvmeR3Suspend and nvmeR3PowerOff.
+ */
+static void nvmeR3SuspendOrPowerOff(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    ASMAtomicWriteBool(&pThis->fSignalIdle, true);
+    if (!nvmeR3AllAsyncIOIsFinished(pDevIns))
+        PDMDevHlpSetAsyncNotification(pDevIns, nvmeR3IsAsyncSuspendOrPowerOffDone);
+    else
+        ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+}
+
+/**
+ * Suspend notification.
+ *
+ * @param   pDevIns     The device instance data.
+ */
+static DECLCALLBACK(void) nvmeR3Suspend(PPDMDEVINS pDevIns)
+{
+    Log(("nvmeR3Suspend\n"));
+    nvmeR3SuspendOrPowerOff(pDevIns);
+}
+
+/**
+ * Resume notification.
+ *
+ * @param   pDevIns     The device instance data.
+ */
+static DECLCALLBACK(void) nvmeR3Resume(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    Log(("nvmeR3Resume\n"));
+
+    /* The workers stopped fetching commands while the VM was suspending, let them continue. */
+    nvmeR3WrkThrdsKickAll(pThis);
+}
+
+/**
+ * Poweroff notification.
+ *
+ * @param   pDevIns Pointer to the device instance
+ */
+static DECLCALLBACK(void) nvmeR3PowerOff(PPDMDEVINS pDevIns)
+{
+    Log(("nvmeR3PowerOff\n"));
+    nvmeR3SuspendOrPowerOff(pDevIns);
+}
+
+/**
+ * Common reset worker.
+ *
+ * @param   pDevIns     The device instance data.
+ */
+static void nvmeR3ResetCommon(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    ASMAtomicWriteU32((volatile uint32_t *)&pThis->enmState, NVMESTATE_DISABLED);
+    nvmeR3CtrlResetFinish(pThis);
+    pThis->u32RegCc  = 0;
+    pThis->u32RegAqa = 0;
+    pThis->u64RegAsq = 0;
+    pThis->u64RegAcq = 0;
+}
+
+/**
+ * Callback employed by nvmeR3Reset.
+ *
+ * @returns true if we've quiesced, false if we're still working.
+ * @param   pDevIns     The device instance.
+ */
+static DECLCALLBACK(bool) nvmeR3IsAsyncResetDone(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    if (!nvmeR3AllAsyncIOIsFinished(pDevIns))
+        return false;
+    ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+
+    nvmeR3ResetCommon(pDevIns);
+    return true;
+}
+
+/**
+ * Reset notification.
+ *
+ * @param   pDevIns     The device instance data.
+ */
+static DECLCALLBACK(void) nvmeR3Reset(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    ASMAtomicWriteBool(&pThis->fSignalIdle, true);
+    if (!nvmeR3AllAsyncIOIsFinished(pDevIns))
+    {
+        /* Keep the outstanding requests from posting completions and cancel them. */
+        PDMDevHlpSetAsyncNotification(pDevIns, nvmeR3IsAsyncResetDone);
+        nvmeR3CtrlReset(pThis);
+    }
+    else
+    {
+        ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+        nvmeR3ResetCommon(pDevIns);
+    }
+}
+
+/**
+ * Configure the attached medium of a namespace.
+ *
+ * @returns VBox status code
+ * @param   pDevIns     The device instance data.
+ * @param   pNs         The namespace for which the medium is to be configured.
+ */
+static int nvmeR3NamespaceConfigure(PPDMDEVINS pDevIns, PNVMENAMESPACE pNs)
+{
+    /* Query the media interface. */
+    pNs->pDrvMedia = PDMIBASE_QUERY_INTERFACE(pNs->pDrvBase, PDMIMEDIA);
+    AssertMsgReturn(VALID_PTR(pNs->pDrvMedia),
+                    ("NVMe configuration error: LUN#%d misses the basic media interface!\n", pNs->iLUN),
+                    VERR_PDM_MISSING_INTERFACE);
+
+    /* Get the extended media interface. */
+    pNs->pDrvMediaEx = PDMIBASE_QUERY_INTERFACE(pNs->pDrvBase, PDMIMEDIAEX);
+    AssertMsgReturn(VALID_PTR(pNs->pDrvMediaEx),
+                    ("NVMe configuration error: LUN#%d misses the extended media interface!\n", pNs->iLUN),
+                    VERR_PDM_MISSING_INTERFACE);
+
+    /*
+     * Validate type.
+     */
+    PDMMEDIATYPE enmType = pNs->pDrvMedia->pfnGetType(pNs->pDrvMedia);
+    AssertMsgReturn(enmType == PDMMEDIATYPE_HARD_DISK,
+                    ("NVMe configuration error: LUN#%d isn't a disk. enmType=%u\n", pNs->iLUN, enmType),
+                    VERR_PDM_UNSUPPORTED_BLOCK_TYPE);
+
+    int rc = pNs->pDrvMediaEx->pfnIoReqAllocSizeSet(pNs->pDrvMediaEx, sizeof(NVMEREQ));
+    if (RT_FAILURE(rc))
+        return PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS,
+                                   N_("NVMe configuration error: LUN#%u: Failed to set I/O request size!"),
+                                   pNs->iLUN);
+
+    uint32_t fFeatures = 0;
+    rc = pNs->pDrvMediaEx->pfnQueryFeatures(pNs->pDrvMediaEx, &fFeatures);
+    if (RT_FAILURE(rc))
+        return PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS,
+                                   N_("NVMe configuration error: LUN#%u: Failed to query features of device"),
+                                   pNs->iLUN);
+
+    pNs->fDiscard = RT_BOOL(fFeatures & PDMIMEDIAEX_FEATURE_F_DISCARD);
+    pNs->cbSector = pNs->pDrvMedia->pfnGetSectorSize(pNs->pDrvMedia);
+    if (   pNs->cbSector < 512
+        || pNs->cbSector > NVME_PAGE_SIZE
+        || !RT_IS_POWER_OF_TWO(pNs->cbSector))
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("NVMe configuration error: LUN#%u: Sector size %u is not supported"),
+                                   pNs->iLUN, pNs->cbSector);
+    pNs->cSectors = pNs->pDrvMedia->pfnGetSize(pNs->pDrvMedia) / pNs->cbSector;
+
+    LogRel(("NVMe#%u: Namespace %u: %llu blocks of %u bytes%s\n", pDevIns->iInstance, pNs->iLUN + 1,
+            pNs->cSectors, pNs->cbSector, pNs->fDiscard ? ", discard supported" : ""));
+    return VINF_SUCCESS;
+}
+
+/**
+ * Detach notification.
+ *
+ * One namespace is going to be detached.
+ *
+ * @param   pDevIns     The device instance.
+ * @param   iLUN        The logical unit which is being detached.
+ * @param   fFlags      Flags, combination of the PDMDEVATT_FLAGS_* \#defines.
+ */
+static DECLCALLBACK(void) nvmeR3Detach(PPDMDEVINS pDevIns, unsigned iLUN, uint32_t fFlags)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    AssertMsgReturnVoid(fFlags & PDM_TACH_FLAGS_NOT_HOT_PLUG,
+                        ("NVMe: Device does not support hotplugging\n"));
+    AssertMsgReturnVoid(iLUN < pThis->cNamespaces, ("iLUN=%u", iLUN));
+
+    PNVMENAMESPACE pNs = &pThis->paNamespacesR3[iLUN];
+    pNs->pDrvBase    = NULL;
+    pNs->pDrvMedia   = NULL;
+    pNs->pDrvMediaEx = NULL;
+}
+
+/**
+ * Attach command.
+ *
+ * This is called when we change block driver.
+ *
+ * @returns VBox status code.
+ * @param   pDevIns     The device instance.
+ * @param   iLUN        The logical unit which is being attached.
+ * @param   fFlags      Flags, combination of the PDMDEVATT_FLAGS_* \#defines.
+ */
+static DECLCALLBACK(int) nvmeR3Attach(PPDMDEVINS pDevIns, unsigned iLUN, uint32_t fFlags)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    AssertMsgReturn(fFlags & PDM_TACH_FLAGS_NOT_HOT_PLUG,
+                    ("NVMe: Device does not support hotplugging\n"),
+                    VERR_INVALID_PARAMETER);
+    AssertMsgReturn(iLUN < pThis->cNamespaces, ("iLUN=%u", iLUN), VERR_PDM_LUN_NOT_FOUND);
+
+    PNVMENAMESPACE pNs = &pThis->paNamespacesR3[iLUN];
+    AssertRelease(!pNs->pDrvBase);
+    AssertRelease(!pNs->pDrvMedia);
+    AssertRelease(!pNs->pDrvMediaEx);
+
+    int rc = PDMDevHlpDriverAttach(pDevIns, pNs->iLUN, &pNs->IBase, &pNs->pDrvBase, pNs->szDesc);
+    if (RT_SUCCESS(rc))
+        rc = nvmeR3NamespaceConfigure(pDevIns, pNs);
+    else
+        AssertMsgFailed(("Failed to attach LUN#%d. rc=%Rrc\n", pNs->iLUN, rc));
+
+    if (RT_FAILURE(rc))
+    {
+        pNs->pDrvBase    = NULL;
+        pNs->pDrvMedia   = NULL;
+        pNs->pDrvMediaEx = NULL;
+    }
+
+    return rc;
+}
+
+/**
+ * Destroy a driver instance.
+ *
+ * Most VM resources are freed by the VM. This callback is provided so that any non-VM
+ * resources can be freed correctly.
+ *
+ * @param   pDevIns     The device instance data.
+ */
+static DECLCALLBACK(int) nvmeR3Destruct(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    PDMDEV_CHECK_VERSIONS_RETURN_QUIET(pDevIns);
+
+    /*
+     * At this point the worker threads are suspended and will not enter
+     * this module again. So, no coordination is needed here and PDM
+     * will take care of terminating and cleaning up the threads.
+     */
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aWrkThrds); i++)
+    {
+        PNVMEWRKTHRD pWrkThrd = &pThis->aWrkThrds[i];
+
+        if (pWrkThrd->hEvtProcess != NIL_SUPSEMEVENT)
+        {
+            SUPSemEventClose(pThis->pSupDrvSession, pWrkThrd->hEvtProcess);
+            pWrkThrd->hEvtProcess = NIL_SUPSEMEVENT;
+        }
+    }
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesComp); i++)
+    {
+        PNVMEQUEUECOMP pCq = &pThis->aQueuesComp[i];
+
+        if (pCq->hMtx != NIL_RTSEMFASTMUTEX)
+        {
+            RTSemFastMutexDestroy(pCq->hMtx);
+            pCq->hMtx = NIL_RTSEMFASTMUTEX;
+        }
+    }
+
+    if (pThis->paCmdsRedoR3)
+    {
+        RTMemFree(pThis->paCmdsRedoR3);
+        pThis->paCmdsRedoR3 = NULL;
+    }
+
+    if (PDMCritSectIsInitialized(&pThis->CritSectIntr))
+        PDMR3CritSectDelete(&pThis->CritSectIntr);
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * @callback_method_impl{FNPCIIOREGIONMAP}
+ */
+static DECLCALLBACK(int) nvmeR3MMIOMap(PPDMDEVINS pDevIns, PPDMPCIDEV pPciDev, uint32_t iRegion,
+                                       RTGCPHYS GCPhysAddress, RTGCPHYS cb, PCIADDRESSSPACE enmType)
+{
+    RT_NOREF(pPciDev, iRegion, enmType);
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    Log2(("%s: registering MMIO area at GCPhysAddr=%RGp cb=%RGp\n", __FUNCTION__, GCPhysAddress, cb));
+
+    Assert(cb >= NVME_MMIO_SIZE);
+
+    int rc = PDMDevHlpMMIORegister(pDevIns, GCPhysAddress, cb, NULL /*pvUser*/,
+                                   IOMMMIO_FLAGS_READ_DWORD | IOMMMIO_FLAGS_WRITE_ONLY_DWORD_QWORD,
+                                   nvmeMMIOWrite, nvmeMMIORead, "NVMe");
+    if (RT_FAILURE(rc))
+        return rc;
+
+    if (pThis->fR0Enabled)
+    {
+        rc = PDMDevHlpMMIORegisterR0(pDevIns, GCPhysAddress, cb, NIL_RTR0PTR /*pvUser*/, "nvmeMMIOWrite", "nvmeMMIORead");
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+
+    if (pThis->fRCEnabled)
+    {
+        rc = PDMDevHlpMMIORegisterRC(pDevIns, GCPhysAddress, cb, NIL_RTRCPTR /*pvUser*/, "nvmeMMIOWrite", "nvmeMMIORead");
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+
+    pThis->GCPhysMMIO = GCPhysAddress;
+    return rc;
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnConstruct}
+ */
+static DECLCALLBACK(int) nvmeR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGMNODE pCfg)
+{
+    PNVME      pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    PPDMIBASE  pBase;
+    uint32_t   cQueuesMax;
+    int        rc = VINF_SUCCESS;
+    PDMDEV_CHECK_VERSIONS_RETURN(pDevIns);
+
+    LogFlowFunc(("pThis=%#p\n", pThis));
+
+    /*
+     * Initialize the instance data (everything touched by the destructor need
+     * to be initialized here!).
+     */
+    pThis->pDevInsR3      = pDevIns;
+    pThis->pDevInsR0      = PDMDEVINS_2_R0PTR(pDevIns);
+    pThis->pDevInsRC      = PDMDEVINS_2_RCPTR(pDevIns);
+    pThis->pSupDrvSession = PDMDevHlpGetSupDrvSession(pDevIns);
+    pThis->enmState       = NVMESTATE_DISABLED;
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aWrkThrds); i++)
+    {
+        pThis->aWrkThrds[i].hEvtProcess      = NIL_SUPSEMEVENT;
+        pThis->aWrkThrds[i].idx              = i;
+        pThis->aWrkThrds[i].fWrkThrdSleeping = true;
+    }
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesComp); i++)
+        pThis->aQueuesComp[i].hMtx = NIL_RTSEMFASTMUTEX;
+
+    /*
+     * Validate and read configuration.
+     */
+    if (!CFGMR3AreValuesValid(pCfg, "NamespacesMax\0"
+                                    "QueuesMax\0"
+                                    "QueueEntriesMax\0"
+                                    "WorkerThreadsMax\0"
+                                    "SerialNumber\0"
+                                    "ModelNumber\0"
+                                    "FirmwareRevision\0"
+                                    "GCEnabled\0"
+                                    "R0Enabled\0"))
+        return PDMDEV_SET_ERROR(pDevIns, VERR_PDM_DEVINS_UNKNOWN_CFG_VALUES,
+                                N_("NVMe configuration error: unknown option specified"));
+
+    rc = CFGMR3QueryBoolDef(pCfg, "GCEnabled", &pThis->fRCEnabled, true);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read GCEnabled as boolean"));
+
+    rc = CFGMR3QueryBoolDef(pCfg, "R0Enabled", &pThis->fR0Enabled, true);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read R0Enabled as boolean"));
+
+    rc = CFGMR3QueryU32Def(pCfg, "NamespacesMax", &pThis->cNamespaces, 1);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read NamespacesMax as integer"));
+    if (   pThis->cNamespaces < 1
+        || pThis->cNamespaces > NVME_NAMESPACES_MAX)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("NVMe configuration error: NamespacesMax=%u should be between 1 and %u"),
+                                   pThis->cNamespaces, NVME_NAMESPACES_MAX);
+
+    rc = CFGMR3QueryU32Def(pCfg, "QueuesMax", &cQueuesMax, 16);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read QueuesMax as integer"));
+    if (   cQueuesMax < 1
+        || cQueuesMax > NVME_QUEUES_MAX - 1)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("NVMe configuration error: QueuesMax=%u should be between 1 and %u"),
+                                   cQueuesMax, NVME_QUEUES_MAX - 1);
+    pThis->cQueuesSubmMax = cQueuesMax;
+    pThis->cQueuesCompMax = cQueuesMax;
+
+    rc = CFGMR3QueryU32Def(pCfg, "QueueEntriesMax", &pThis->cQueueEntriesMax, NVME_QUEUE_ENTRIES_DEF);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read QueueEntriesMax as integer"));
+    if (   pThis->cQueueEntriesMax < NVME_QUEUE_ENTRIES_MIN
+        || pThis->cQueueEntriesMax > NVME_QUEUE_ENTRIES_MAX)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("NVMe configuration error: QueueEntriesMax=%u should be between %u and %u"),
+                                   pThis->cQueueEntriesMax, NVME_QUEUE_ENTRIES_MIN, NVME_QUEUE_ENTRIES_MAX);
+
+    rc = CFGMR3QueryU32Def(pCfg, "WorkerThreadsMax", &pThis->cWrkThrdsMax, RT_MIN(cQueuesMax, 4));
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read WorkerThreadsMax as integer"));
+    if (   pThis->cWrkThrdsMax < 1
+        || pThis->cWrkThrdsMax > NVME_WRK_THRDS_MAX)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("NVMe configuration error: WorkerThreadsMax=%u should be between 1 and %u"),
+                                   pThis->cWrkThrdsMax, NVME_WRK_THRDS_MAX);
+    /* More threads than I/O queues would just sleep. */
+    pThis->cWrkThrdsMax = RT_MIN(pThis->cWrkThrdsMax, cQueuesMax);
+
+    char szSerial[NVME_SERIAL_NUMBER_LENGTH + 1];
+    RTStrPrintf(szSerial, sizeof(szSerial), "VBOX-NVME-%04u", iInstance);
+    rc = CFGMR3QueryStringDef(pCfg, "SerialNumber", pThis->szSerialNumber, sizeof(pThis->szSerialNumber), szSerial);
+    if (RT_FAILURE(rc))
+    {
+        if (rc == VERR_CFGM_NOT_ENOUGH_SPACE)
+            return PDMDEV_SET_ERROR(pDevIns, VERR_INVALID_PARAMETER,
+                                    N_("NVMe configuration error: \"SerialNumber\" is longer than 20 bytes"));
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read \"SerialNumber\" as string"));
+    }
+
+    rc = CFGMR3QueryStringDef(pCfg, "ModelNumber", pThis->szModelNumber, sizeof(pThis->szModelNumber),
+                              "ORCL-VBOX-NVME-VER12");
+    if (RT_FAILURE(rc))
+    {
+        if (rc == VERR_CFGM_NOT_ENOUGH_SPACE)
+            return PDMDEV_SET_ERROR(pDevIns, VERR_INVALID_PARAMETER,
+                                    N_("NVMe configuration error: \"ModelNumber\" is longer than 40 bytes"));
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read \"ModelNumber\" as string"));
+    }
+
+    rc = CFGMR3QueryStringDef(pCfg, "FirmwareRevision", pThis->szFirmwareRevision, sizeof(pThis->szFirmwareRevision),
+                              "1.0");
+    if (RT_FAILURE(rc))
+    {
+        if (rc == VERR_CFGM_NOT_ENOUGH_SPACE)
+            return PDMDEV_SET_ERROR(pDevIns, VERR_INVALID_PARAMETER,
+                                    N_("NVMe configuration error: \"FirmwareRevision\" is longer than 8 bytes"));
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read \"FirmwareRevision\" as string"));
+    }
+
+    /*
+     * PCI configuration space.
+     */
+    PCIDevSetVendorId      (&pThis->PciDev, 0x80ee); /* Oracle */
+    PCIDevSetDeviceId      (&pThis->PciDev, 0x4e56); /* "NV" */
+    PCIDevSetCommand       (&pThis->PciDev, 0x0000);
+    PCIDevSetStatus        (&pThis->PciDev, VBOX_PCI_STATUS_CAP_LIST);
+    PCIDevSetCapabilityList(&pThis->PciDev, NVME_PCI_PM_CAP_OFF);
+    PCIDevSetRevisionId    (&pThis->PciDev, 0x00);
+    PCIDevSetClassProg     (&pThis->PciDev, 0x02); /* NVM Express */
+    PCIDevSetClassSub      (&pThis->PciDev, 0x08); /* Non-volatile memory controller */
+    PCIDevSetClassBase     (&pThis->PciDev, 0x01); /* Mass storage controller */
+    PCIDevSetInterruptLine (&pThis->PciDev, 0x00);
+    PCIDevSetInterruptPin  (&pThis->PciDev, 0x01);
+
+    pThis->PciDev.abConfig[NVME_PCI_PM_CAP_OFF]     = VBOX_PCI_CAP_ID_PM; /* Capability ID: PCI Power Management Interface */
+    pThis->PciDev.abConfig[NVME_PCI_PM_CAP_OFF + 1] = NVME_PCI_MSIX_CAP_OFF; /* next */
+    pThis->PciDev.abConfig[NVME_PCI_PM_CAP_OFF + 2] = 0x03; /* version */
+
+    /*
+     * Init locks, using explicit locking where necessary.
+     */
+    rc = PDMDevHlpSetDeviceCritSect(pDevIns, PDMDevHlpCritSectGetNop(pDevIns));
+    if (RT_FAILURE(rc))
+        return rc;
+
+    rc = PDMDevHlpCritSectInit(pDevIns, &pThis->CritSectIntr, RT_SRC_POS, "NVMe#%uIntr", iInstance);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe: cannot create critical section for the interrupt state"));
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueuesComp); i++)
+    {
+        rc = RTSemFastMutexCreate(&pThis->aQueuesComp[i].hMtx);
+        if (RT_FAILURE(rc))
+            return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe: cannot create completion queue mutex"));
+    }
+
+    /*
+     * Register the PCI device, it's I/O regions.
+     */
+    rc = PDMDevHlpPCIRegister(pDevIns, &pThis->PciDev);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    /* One vector per completion queue, the admin queue included. */
+    pThis->cMsixVectors = pThis->cQueuesCompMax + 1;
+#ifdef VBOX_WITH_MSI_DEVICES
+    PDMMSIREG MsiReg;
+    RT_ZERO(MsiReg);
+    MsiReg.cMsixVectors    = pThis->cMsixVectors;
+    MsiReg.iMsixCapOffset  = NVME_PCI_MSIX_CAP_OFF;
+    MsiReg.iMsixNextOffset = 0x00;
+    MsiReg.iMsixBar        = NVME_MSIX_BAR;
+    rc = PDMDevHlpPCIRegisterMsi(pDevIns, &MsiReg);
+    if (RT_FAILURE(rc))
+#endif
+    {
+        /* That's OK, we can work with INTx only */
+        pThis->cMsixVectors = 0;
+        pThis->PciDev.abConfig[NVME_PCI_PM_CAP_OFF + 1] = 0x00;
+    }
+
+    rc = PDMDevHlpPCIIORegionRegister(pDevIns, 0, NVME_MMIO_SIZE,
+                                      (PCIADDRESSSPACE)(PCI_ADDRESS_SPACE_MEM | PCI_ADDRESS_SPACE_BAR64), nvmeR3MMIOMap);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe cannot register PCI memory region for registers"));
+
+    /*
+     * Create the notification queue, used to kick the worker threads from RC.
+     * We need 2 items for every worker because of SMP races.
+     */
+    rc = PDMDevHlpQueueCreate(pDevIns, sizeof(NVMENOTIFIERQUEUEITEM), (NVME_WRK_THRDS_MAX + 1) * 2, 0,
+                              nvmeR3NotifyQueueConsumer, true, "NVMe-Xmit", &pThis->pNotifierQueueR3);
+    if (RT_FAILURE(rc))
+        return rc;
+    pThis->pNotifierQueueR0 = PDMQueueR0Ptr(pThis->pNotifierQueueR3);
+    pThis->pNotifierQueueRC = PDMQueueRCPtr(pThis->pNotifierQueueR3);
+
+    /*
+     * Create the worker threads, the admin queue one and the I/O ones.
+     */
+    for (uint32_t i = 0; i <= pThis->cWrkThrdsMax; i++)
+    {
+        PNVMEWRKTHRD pWrkThrd = &pThis->aWrkThrds[i];
+        char szName[24];
+
+        RTStrPrintf(szName, sizeof(szName), "NVMe-%u-%u", iInstance, i);
+
+        rc = SUPSemEventCreate(pThis->pSupDrvSession, &pWrkThrd->hEvtProcess);
+        if (RT_FAILURE(rc))
+            return PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS,
+                                       N_("NVMe: Failed to create SUP event semaphore"));
+
+        rc = PDMDevHlpThreadCreate(pDevIns, &pWrkThrd->pThreadR3, pWrkThrd, nvmeR3WrkThrdLoop,
+                                   nvmeR3WrkThrdWakeUp, 0, RTTHREADTYPE_IO, szName);
+        if (RT_FAILURE(rc))
+            return PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS,
+                                       N_("NVMe: Failed to create worker thread %s"), szName);
+    }
+
+    /*
+     * Attach the namespaces.
+     */
+    pThis->paNamespacesR3 = (PNVMENAMESPACE)PDMDevHlpMMHeapAllocZ(pDevIns, pThis->cNamespaces * sizeof(NVMENAMESPACE));
+    if (!pThis->paNamespacesR3)
+        return PDMDEV_SET_ERROR(pDevIns, VERR_NO_MEMORY, N_("NVMe: Failed to allocate memory for the namespaces"));
+
+    for (uint32_t i = 0; i < pThis->cNamespaces; i++)
+    {
+        PNVMENAMESPACE pNs = &pThis->paNamespacesR3[i];
+
+        pNs->pNvmeR3                                 = pThis;
+        pNs->iLUN                                    = i;
+        pNs->Led.u32Magic                            = PDMLED_MAGIC;
+        pNs->IBase.pfnQueryInterface                 = nvmeR3NamespaceQueryInterface;
+        pNs->IPort.pfnQueryDeviceLocation            = nvmeR3NamespaceQueryDeviceLocation;
+        pNs->IMediaExPort.pfnIoReqCompleteNotify     = nvmeR3IoReqCompleteNotify;
+        pNs->IMediaExPort.pfnIoReqCopyFromBuf        = nvmeR3IoReqCopyFromBuf;
+        pNs->IMediaExPort.pfnIoReqCopyToBuf          = nvmeR3IoReqCopyToBuf;
+        pNs->IMediaExPort.pfnIoReqQueryBuf           = NULL;
+        pNs->IMediaExPort.pfnIoReqQuerySgBuf         = nvmeR3IoReqQuerySgBuf;
+        pNs->IMediaExPort.pfnIoReqQueryDiscardRanges = nvmeR3IoReqQueryDiscardRanges;
+        pNs->IMediaExPort.pfnIoReqStateChanged       = nvmeR3IoReqStateChanged;
+        pNs->IMediaExPort.pfnMediumEjected           = nvmeR3MediumEjected;
+        RTStrPrintf(pNs->szDesc, sizeof(pNs->szDesc), "Namespace%u", i + 1);
+
+        rc = PDMDevHlpDriverAttach(pDevIns, i, &pNs->IBase, &pNs->pDrvBase, pNs->szDesc);
+        if (RT_SUCCESS(rc))
+        {
+            rc = nvmeR3NamespaceConfigure(pDevIns, pNs);
+            if (RT_FAILURE(rc))
+            {
+                Log(("%s: Failed to configure %s.\n", __FUNCTION__, pNs->szDesc));
+                return rc;
+            }
+        }
+        else if (rc == VERR_PDM_NO_ATTACHED_DRIVER)
+        {
+            pNs->pDrvBase = NULL;
+            rc = VINF_SUCCESS;
+            LogRel(("NVMe: %s: No driver attached\n", pNs->szDesc));
+        }
+        else
+            return PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS,
+                                       N_("NVMe: Failed to attach drive to %s"), pNs->szDesc);
+    }
+
+    /*
+     * Attach status driver (optional).
+     */
+    pThis->IBase.pfnQueryInterface = nvmeR3Status_QueryInterface;
+    pThis->ILeds.pfnQueryStatusLed = nvmeR3Status_QueryStatusLed;
+    rc = PDMDevHlpDriverAttach(pDevIns, PDM_STATUS_LUN, &pThis->IBase, &pBase, "Status Port");
+    if (RT_SUCCESS(rc))
+        pThis->pLedsConnector = PDMIBASE_QUERY_INTERFACE(pBase, PDMILEDCONNECTORS);
+    else if (rc != VERR_PDM_NO_ATTACHED_DRIVER)
+    {
+        AssertMsgFailed(("Failed to attach to status driver. rc=%Rrc\n", rc));
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe cannot attach to status driver"));
+    }
+
+    rc = PDMDevHlpSSMRegisterEx(pDevIns, NVME_SAVED_STATE_VERSION, sizeof(*pThis), NULL,
+                                NULL,           nvmeR3LiveExec, NULL,
+                                nvmeR3SavePrep, nvmeR3SaveExec, NULL,
+                                nvmeR3LoadPrep, nvmeR3LoadExec, nvmeR3LoadDone);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe cannot register save state handlers"));
+
+#ifdef VBOX_WITH_STATISTICS
+    /*
+     * Register the statistics.
+     */
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatDoorbellWritesR3, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of doorbell writes in R3", "/Devices/NVMe%u/DoorbellWritesR3", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatDoorbellWritesRZ, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of doorbell writes in R0/RC", "/Devices/NVMe%u/DoorbellWritesRZ", iInstance);
+    for (uint32_t i = 0; i < NVME_QUEUES_MAX; i++)
+    {
+        PDMDevHlpSTAMRegisterF(pDevIns, &pThis->aStatSubmQueueCmds[i], STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_OCCURENCES,
+                               "Number of commands fetched", "/Devices/NVMe%u/SQ%u/Cmds", iInstance, i);
+        PDMDevHlpSTAMRegisterF(pDevIns, &pThis->aStatCompQueueFull[i], STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_OCCURENCES,
+                               "Number of times the completion queue was full", "/Devices/NVMe%u/CQ%u/Full", iInstance, i);
+    }
+#endif
+
+    /*
+     * Register the info item.
+     */
+    char szTmp[128];
+    RTStrPrintf(szTmp, sizeof(szTmp), "%s%d", pDevIns->pReg->szName, pDevIns->iInstance);
+    PDMDevHlpDBGFInfoRegister(pDevIns, szTmp, "NVMe info", nvmeR3Info);
+
+    nvmeR3FeaturesReset(pThis);
+    return VINF_SUCCESS;
+}
+
+/**
+ * The device registration structure.
+ */
+const PDMDEVREG g_DeviceNVMe =
+{
+    /* u32Version */
+    PDM_DEVREG_VERSION,
+    /* szName */
+    "nvme",
+    /* szRCMod */
+    "VBoxDDRC.rc",
+    /* szR0Mod */
+    "VBoxDDR0.r0",
+    /* pszDescription */
+    "NVMe controller.\n",
+    /* fFlags */
+    PDM_DEVREG_FLAGS_DEFAULT_BITS | PDM_DEVREG_FLAGS_RC | PDM_DEVREG_FLAGS_R0 |
+    PDM_DEVREG_FLAGS_FIRST_SUSPEND_NOTIFICATION | PDM_DEVREG_FLAGS_FIRST_POWEROFF_NOTIFICATION |
+    PDM_DEVREG_FLAGS_FIRST_RESET_NOTIFICATION,
+    /* fClass */
+    PDM_DEVREG_CLASS_STORAGE,
+    /* cMaxInstances */
+    ~0U,
+    /* cbInstance */
+    sizeof(NVME),
+    /* pfnConstruct */
+    nvmeR3Construct,
+    /* pfnDestruct */
+    nvmeR3Destruct,
+    /* pfnRelocate */
+    nvmeR3Relocate,
+    /* pfnMemSetup */
+    NULL,
+    /* pfnPowerOn */
+    NULL,
+    /* pfnReset */
+    nvmeR3Reset,
+    /* pfnSuspend */
+    nvmeR3Suspend,
+    /* pfnResume */
+    nvmeR3Resume,
+    /* pfnAttach */
+    nvmeR3Attach,
+    /* pfnDetach */
+    nvmeR3Detach,
+    /* pfnQueryInterface. */
+    NULL,
+    /* pfnInitComplete */
+    NULL,
+    /* pfnPowerOff */
+    nvmeR3PowerOff,
+    /* pfnSoftReset */
+    NULL,
+    /* u32VersionEnd */
+    PDM_DEVREG_VERSION
+};
+
+# ifdef VBOX_IN_EXTPACK_R3
+/**
+ * @callback_method_impl{FNPDMVBOXDEVICESREGISTER}
+ */
+extern "C" DECLEXPORT(int) VBoxDevicesRegister(PPDMDEVREGCB pCallbacks, uint32_t u32Version)
+{
+    LogFlow(("VBoxDevicesRegister: u32Version=%#x\n", u32Version));
+
+    AssertLogRelMsgReturn(u32Version >= VBOX_VERSION,
+                          ("VirtualBox version %#x, expected %#x or higher\n", u32Version, VBOX_VERSION),
+                          VERR_VERSION_MISMATCH);
+    AssertLogRelMsgReturn(pCallbacks->u32Version == PDM_DEVREG_CB_VERSION,
+                          ("callback version %#x, expected %#x\n", pCallbacks->u32Version, PDM_DEVREG_CB_VERSION),
+                          VERR_VERSION_MISMATCH);
+
+    return pCallbacks->pfnRegister(pCallbacks, &g_DeviceNVMe);
+}
+# endif /* VBOX_IN_EXTPACK_R3 */
+
+#endif /* IN_RING3 */
+#endif /* !VBOX_DEVICE_STRUCT_TESTCASE */
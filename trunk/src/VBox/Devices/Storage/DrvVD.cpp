@@ -102,6 +102,28 @@ extern bool DevINIPConfigured(void);
 /** Maximum number of request errors in the release log before muting. */
 #define DRVVD_MAX_LOG_REL_ERRORS        100
 
+/** Maximum number of segments for a request transferring data directly from/to
+ * the memory of the device/driver above. */
+#define DRVVD_IOREQ_DIRECT_SEGS_MAX     64
+
+/** Number of buckets of the per queue latency histogram. */
+#define DRVVD_IOQUEUE_LATENCY_BUCKETS   6
+
+/**
+ * Per I/O queue statistics.
+ */
+typedef struct DRVVDIOQUEUESTATS
+{
+    /** Number of transfers submitted to the queue. */
+    STAMCOUNTER              StatReqs;
+    /** Transfer latency from submission to completion. */
+    STAMPROFILE              StatLatency;
+    /** Latency histogram, the limits are in g_acNsIoQueueLatencyLimits. */
+    STAMCOUNTER              aStatLatency[DRVVD_IOQUEUE_LATENCY_BUCKETS];
+} DRVVDIOQUEUESTATS;
+/** Pointer to the statistics of an I/O queue. */
+typedef DRVVDIOQUEUESTATS *PDRVVDIOQUEUESTATS;
+
 /** Forward declaration for the dis kcontainer. */
 typedef struct VBOXDISK *PVBOXDISK;
 
@@ -189,6 +211,11 @@ typedef struct PDMMEDIAEXIOREQINT
     uint32_t                      fFlags;
     /** Timestamp when the request was submitted. */
     uint64_t                      tsSubmit;
+    /** The VD I/O queue the request is submitted to, VD_IO_QUEUE_ID_NONE if queues are disabled. */
+    uint32_t                      idIoQueue;
+    /** Nanosecond timestamp when the current transfer was passed to the I/O queue,
+     * 0 if there is none in progress. */
+    uint64_t                      tsIoQueueSubmitNs;
     /** Type dependent data. */
     union
     {
@@ -214,8 +241,8 @@ typedef struct PDMMEDIAEXIOREQINT
                 /** Direct buffer. */
                 struct
                 {
-                    /** Segment for the data buffer. */
-                    RTSGSEG               Seg;
+                    /** Segments for the data buffer. */
+                    RTSGSEG               aSegs[DRVVD_IOREQ_DIRECT_SEGS_MAX];
                     /** S/G buffer structure. */
                     RTSGBUF               SgBuf;
                 } Direct;
@@ -341,6 +368,8 @@ typedef struct VBOXDISK
     bool                    fBiosVisible;
     /** Flag whether this medium should be presented as non rotational. */
     bool                    fNonRotational;
+    /** Number of independent VD I/O queues requests are spread over, 0 if disabled. */
+    uint32_t                cIoQueues;
 #ifdef VBOX_PERIODIC_FLUSH
     /** HACK: Configuration value for number of bytes written after which to flush. */
     uint32_t                cbFlushInterval;
@@ -389,6 +418,9 @@ typedef struct VBOXDISK
     RTMEMCACHE               hIoReqCache;
     /** I/O buffer manager. */
     IOBUFMGR                 hIoBufMgr;
+    /** Flag whether the memory of the device/driver above can be used for transfers
+     * directly, false if there is a filter modifying the data in place. */
+    bool                     fIoBufDirect;
     /** Active request counter. */
     volatile uint32_t        cIoReqsActive;
     /** Bins for allocated requests. */
@@ -418,6 +450,13 @@ typedef struct VBOXDISK
     STAMCOUNTER              StatQueryBufAttempts;
     /** How many attempts to query a direct buffer pointer succeeded. */
     STAMCOUNTER              StatQueryBufSuccess;
+    /** How many attempts were made to query a direct S/G buffer from the
+     * device/driver above. */
+    STAMCOUNTER              StatQuerySgBufAttempts;
+    /** How many attempts to query a direct S/G buffer succeeded. */
+    STAMCOUNTER              StatQuerySgBufSuccess;
+    /** Number of bytes transferred without copying them through an I/O buffer. */
+    STAMCOUNTER              StatBytesDirect;
     /** Release statistics: number of bytes written. */
     STAMCOUNTER              StatBytesWritten;
     /** Release statistics: number of bytes read. */
@@ -438,9 +477,33 @@ typedef struct VBOXDISK
     STAMCOUNTER              StatReqsDiscard;
     /** Release statistics: Number of I/O requests processed per second. */
     STAMCOUNTER              StatReqsPerSec;
+    /** Release statistics: Per I/O queue statistics. */
+    DRVVDIOQUEUESTATS        aStatIoQueues[VD_IO_QUEUES_MAX];
     /** @} */
 } VBOXDISK;
 
+/** Upper latency limits in nanoseconds of the I/O queue histogram buckets. */
+static const uint64_t g_acNsIoQueueLatencyLimits[DRVVD_IOQUEUE_LATENCY_BUCKETS] =
+{
+    50 * RT_NS_1US,
+    200 * RT_NS_1US,
+    RT_NS_1MS,
+    5 * RT_NS_1MS,
+    25 * RT_NS_1MS,
+    UINT64_MAX
+};
+
+/** Names of the I/O queue histogram buckets. */
+static const char * const g_apszIoQueueLatencyNames[DRVVD_IOQUEUE_LATENCY_BUCKETS] =
+{
+    "Latency50us",
+    "Latency200us",
+    "Latency1ms",
+    "Latency5ms",
+    "Latency25ms",
+    "LatencyMore"
+};
+
 
 /*********************************************************************************************************************************
 *   Internal Functions                                                                                                           *
@@ -3011,7 +3074,33 @@ DECLINLINE(int) drvvdMediaExIoReqBufAlloc(PVBOXDISK pThis, PPDMMEDIAEXIOREQINT p
     int rc = VERR_NOT_SUPPORTED;
     LogFlowFunc(("pThis=%#p pIoReq=%#p cb=%zu\n", pThis, pIoReq, cb));
 
-    if (   cb == _4K
+    if (   pThis->fIoBufDirect
+        && pThis->pDrvMediaExPort->pfnIoReqQuerySgBuf)
+    {
+        /* Try to use the memory of the device/driver above directly. */
+        unsigned cSegs = RT_ELEMENTS(pIoReq->ReadWrite.Direct.aSegs);
+        size_t cbBuf = 0;
+
+        STAM_COUNTER_INC(&pThis->StatQuerySgBufAttempts);
+        rc = pThis->pDrvMediaExPort->pfnIoReqQuerySgBuf(pThis->pDrvMediaExPort, pIoReq, &pIoReq->abAlloc[0],
+                                                        &pIoReq->ReadWrite.Direct.aSegs[0], &cSegs, &cbBuf);
+        if (   RT_SUCCESS(rc)
+            && cbBuf >= cb)
+        {
+            STAM_COUNTER_INC(&pThis->StatQuerySgBufSuccess);
+            STAM_COUNTER_ADD(&pThis->StatBytesDirect, cb);
+            pIoReq->ReadWrite.cbIoBuf    = cbBuf;
+            pIoReq->ReadWrite.fDirectBuf = true;
+            RTSgBufInit(&pIoReq->ReadWrite.Direct.SgBuf, &pIoReq->ReadWrite.Direct.aSegs[0], cSegs);
+            pIoReq->ReadWrite.pSgBuf = &pIoReq->ReadWrite.Direct.SgBuf;
+        }
+        else
+            rc = VERR_NOT_SUPPORTED; /* The mappings are released by the owner when the request completes. */
+    }
+
+    if (   RT_FAILURE(rc)
+        && cb == _4K
+        && pThis->fIoBufDirect
         && pThis->pDrvMediaExPort->pfnIoReqQueryBuf)
     {
         /* Try to get a direct pointer to the buffer first. */
@@ -3024,11 +3113,12 @@ DECLINLINE(int) drvvdMediaExIoReqBufAlloc(PVBOXDISK pThis, PPDMMEDIAEXIOREQINT p
         if (RT_SUCCESS(rc))
         {
             STAM_COUNTER_INC(&pThis->StatQueryBufSuccess);
-            pIoReq->ReadWrite.cbIoBuf           = cbBuf;
-            pIoReq->ReadWrite.fDirectBuf        = true;
-            pIoReq->ReadWrite.Direct.Seg.pvSeg  = pvBuf;
-            pIoReq->ReadWrite.Direct.Seg.cbSeg  = cbBuf;
-            RTSgBufInit(&pIoReq->ReadWrite.Direct.SgBuf, &pIoReq->ReadWrite.Direct.Seg, 1);
+            STAM_COUNTER_ADD(&pThis->StatBytesDirect, cb);
+            pIoReq->ReadWrite.cbIoBuf               = cbBuf;
+            pIoReq->ReadWrite.fDirectBuf            = true;
+            pIoReq->ReadWrite.Direct.aSegs[0].pvSeg = pvBuf;
+            pIoReq->ReadWrite.Direct.aSegs[0].cbSeg = cbBuf;
+            RTSgBufInit(&pIoReq->ReadWrite.Direct.SgBuf, &pIoReq->ReadWrite.Direct.aSegs[0], 1);
             pIoReq->ReadWrite.pSgBuf = &pIoReq->ReadWrite.Direct.SgBuf;
         }
     }
@@ -3058,6 +3148,30 @@ DECLINLINE(int) drvvdMediaExIoReqBufAlloc(PVBOXDISK pThis, PPDMMEDIAEXIOREQINT p
     return rc;
 }
 
+/**
+ * Records the latency of a transfer which completed on one of the VD I/O queues.
+ *
+ * @returns nothing.
+ * @param   pThis     VBox disk container instance data.
+ * @param   pIoReq    The I/O request whose transfer completed.
+ */
+DECLINLINE(void) drvvdMediaExIoReqIoQueueLatencyRecord(PVBOXDISK pThis, PPDMMEDIAEXIOREQINT pIoReq)
+{
+    if (pIoReq->tsIoQueueSubmitNs)
+    {
+        PDRVVDIOQUEUESTATS pStats = &pThis->aStatIoQueues[pIoReq->idIoQueue];
+        uint64_t cNsLatency = RTTimeNanoTS() - pIoReq->tsIoQueueSubmitNs;
+        unsigned idxBucket = 0;
+
+        while (cNsLatency > g_acNsIoQueueLatencyLimits[idxBucket])
+            idxBucket++;
+
+        STAM_REL_PROFILE_ADD_PERIOD(&pStats->StatLatency, cNsLatency);
+        STAM_REL_COUNTER_INC(&pStats->aStatLatency[idxBucket]);
+        pIoReq->tsIoQueueSubmitNs = 0;
+    }
+}
+
 /**
  * Wrapper around the various ways to read from the underlying medium (cache, async vs. sync).
  *
@@ -3087,6 +3201,15 @@ static int drvvdMediaExIoReqReadWrapper(PVBOXDISK pThis, PPDMMEDIAEXIOREQINT pIo
             else if (rc == VINF_AIO_TASK_PENDING)
                 rc = VERR_VD_ASYNC_IO_IN_PROGRESS;
         }
+        else if (pIoReq->idIoQueue != VD_IO_QUEUE_ID_NONE)
+        {
+            STAM_REL_COUNTER_INC(&pThis->aStatIoQueues[pIoReq->idIoQueue].StatReqs);
+            pIoReq->tsIoQueueSubmitNs = RTTimeNanoTS();
+            rc = VDAsyncReadQueued(pThis->pDisk, pIoReq->idIoQueue, pIoReq->ReadWrite.offStart, cbReqIo,
+                                   pIoReq->ReadWrite.pSgBuf, drvvdMediaExIoReqComplete, pThis, pIoReq);
+            if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                drvvdMediaExIoReqIoQueueLatencyRecord(pThis, pIoReq);
+        }
         else
             rc = VDAsyncRead(pThis->pDisk, pIoReq->ReadWrite.offStart, cbReqIo, pIoReq->ReadWrite.pSgBuf,
                              drvvdMediaExIoReqComplete, pThis, pIoReq);
@@ -3136,6 +3259,15 @@ static int drvvdMediaExIoReqWriteWrapper(PVBOXDISK pThis, PPDMMEDIAEXIOREQINT pI
             else if (rc == VINF_AIO_TASK_PENDING)
                 rc = VERR_VD_ASYNC_IO_IN_PROGRESS;
         }
+        else if (pIoReq->idIoQueue != VD_IO_QUEUE_ID_NONE)
+        {
+            STAM_REL_COUNTER_INC(&pThis->aStatIoQueues[pIoReq->idIoQueue].StatReqs);
+            pIoReq->tsIoQueueSubmitNs = RTTimeNanoTS();
+            rc = VDAsyncWriteQueued(pThis->pDisk, pIoReq->idIoQueue, pIoReq->ReadWrite.offStart, cbReqIo,
+                                    pIoReq->ReadWrite.pSgBuf, drvvdMediaExIoReqComplete, pThis, pIoReq);
+            if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                drvvdMediaExIoReqIoQueueLatencyRecord(pThis, pIoReq);
+        }
         else
             rc = VDAsyncWrite(pThis->pDisk, pIoReq->ReadWrite.offStart, cbReqIo, pIoReq->ReadWrite.pSgBuf,
                               drvvdMediaExIoReqComplete, pThis, pIoReq);
@@ -3491,6 +3623,7 @@ static DECLCALLBACK(void) drvvdMediaExIoReqComplete(void *pvUser1, void *pvUser2
     PVBOXDISK pThis = (PVBOXDISK)pvUser1;
     PPDMMEDIAEXIOREQINT pIoReq = (PPDMMEDIAEXIOREQINT)pvUser2;
 
+    drvvdMediaExIoReqIoQueueLatencyRecord(pThis, pIoReq);
     drvvdMediaExIoReqCompleteWorker(pThis, pIoReq, rcReq, true /* fUpNotify */);
 }
 
@@ -3585,6 +3718,9 @@ static DECLCALLBACK(int) drvvdIoReqAlloc(PPDMIMEDIAEX pInterface, PPDMMEDIAEXIOR
     pIoReq->pDisk         = pThis;
     pIoReq->enmState      = VDIOREQSTATE_ALLOCATED;
     pIoReq->enmType       = PDMMEDIAEXIOREQTYPE_INVALID;
+    /* Devices hand out request IDs from their own tag/slot space, spreading them over the queues. */
+    pIoReq->idIoQueue     = pThis->cIoQueues ? (uint32_t)(uIoReqId % pThis->cIoQueues) : VD_IO_QUEUE_ID_NONE;
+    pIoReq->tsIoQueueSubmitNs = 0;
 
     int rc = drvvdMediaExIoReqInsert(pThis, pIoReq);
     if (RT_SUCCESS(rc))
@@ -4211,6 +4347,8 @@ static int drvvdSetupFilters(PVBOXDISK pThis, PCFGMNODE pCfg)
             AssertRC(rc);
 
             rc = VDFilterAdd(pThis->pDisk, pszFilterName, VD_FILTER_FLAGS_DEFAULT, pVDIfsFilter);
+            if (RT_SUCCESS(rc))
+                pThis->fIoBufDirect = false; /* Filters work on the data buffer in place. */
 
             MMR3HeapFree(pszFilterName);
         }
@@ -4325,6 +4463,15 @@ static int drvvdStatsRegister(PVBOXDISK pThis)
             PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatQueryBufSuccess, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS,
                                    STAMUNIT_COUNT, "Number of succeeded attempts to query a direct buffer.",
                                    "/Devices/%s%u/Port%u/QueryBufSuccess", pszCtrlUpper, iInstance, iLUN);
+            PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatQuerySgBufAttempts, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS,
+                                   STAMUNIT_COUNT, "Number of attempts to query a direct S/G buffer.",
+                                   "/Devices/%s%u/Port%u/QuerySgBufAttempts", pszCtrlUpper, iInstance, iLUN);
+            PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatQuerySgBufSuccess, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS,
+                                   STAMUNIT_COUNT, "Number of succeeded attempts to query a direct S/G buffer.",
+                                   "/Devices/%s%u/Port%u/QuerySgBufSuccess", pszCtrlUpper, iInstance, iLUN);
+            PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatBytesDirect, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_BYTES,
+                                   "Amount of data transferred without an intermediate buffer.",
+                                   "/Devices/%s%u/Port%u/DirectBytes", pszCtrlUpper, iInstance, iLUN);
 
             PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatBytesRead, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_BYTES,
                                    "Amount of data read.", "/Devices/%s%u/Port%u/ReadBytes", pszCtrlUpper, iInstance, iLUN);
@@ -4350,6 +4497,23 @@ static int drvvdStatsRegister(PVBOXDISK pThis)
                                    "Number of processed I/O requests per second.", "/Devices/%s%u/Port%u/ReqsPerSec",
                                    pszCtrlUpper, iInstance, iLUN);
 
+            for (uint32_t i = 0; i < pThis->cIoQueues; i++)
+            {
+                PDRVVDIOQUEUESTATS pStats = &pThis->aStatIoQueues[i];
+
+                PDMDrvHlpSTAMRegisterF(pDrvIns, &pStats->StatReqs, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_COUNT,
+                                       "Number of transfers submitted to the I/O queue.",
+                                       "/Devices/%s%u/Port%u/IoQueue%u/Reqs", pszCtrlUpper, iInstance, iLUN, i);
+                PDMDrvHlpSTAMRegisterF(pDrvIns, &pStats->StatLatency, STAMTYPE_PROFILE, STAMVISIBILITY_USED, STAMUNIT_NS_PER_CALL,
+                                       "Latency of transfers on the I/O queue.",
+                                       "/Devices/%s%u/Port%u/IoQueue%u/Latency", pszCtrlUpper, iInstance, iLUN, i);
+                for (unsigned idxBucket = 0; idxBucket < RT_ELEMENTS(pStats->aStatLatency); idxBucket++)
+                    PDMDrvHlpSTAMRegisterF(pDrvIns, &pStats->aStatLatency[idxBucket], STAMTYPE_COUNTER, STAMVISIBILITY_USED,
+                                           STAMUNIT_COUNT, "Number of transfers completed within the given latency.",
+                                           "/Devices/%s%u/Port%u/IoQueue%u/%s", pszCtrlUpper, iInstance, iLUN, i,
+                                           g_apszIoQueueLatencyNames[idxBucket]);
+            }
+
             RTStrFree(pszCtrlUpper);
         }
         else
@@ -4371,6 +4535,9 @@ static void drvvdStatsDeregister(PVBOXDISK pThis)
 
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatQueryBufAttempts);
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatQueryBufSuccess);
+    PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatQuerySgBufAttempts);
+    PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatQuerySgBufSuccess);
+    PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatBytesDirect);
 
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatBytesRead);
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatBytesWritten);
@@ -4382,6 +4549,14 @@ static void drvvdStatsDeregister(PVBOXDISK pThis)
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatReqsRead);
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatReqsDiscard);
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatReqsPerSec);
+
+    for (uint32_t i = 0; i < pThis->cIoQueues; i++)
+    {
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->aStatIoQueues[i].StatReqs);
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->aStatIoQueues[i].StatLatency);
+        for (unsigned idxBucket = 0; idxBucket < RT_ELEMENTS(pThis->aStatIoQueues[i].aStatLatency); idxBucket++)
+            PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->aStatIoQueues[i].aStatLatency[idxBucket]);
+    }
 }
 
 /*********************************************************************************************************************************
@@ -4476,6 +4651,15 @@ static void drvvdPowerOffOrDestructOrUnmount(PPDMDRVINS pDrvIns)
     {
         VDDestroy(pThis->pDisk);
         pThis->pDisk = NULL;
+
+        /* The metadata table cache is shared by all disks, so this is a snapshot of the global state. */
+        VDMETACACHESTATS MetaCacheStats;
+        int rc = VDMetaCacheQueryStats(&MetaCacheStats);
+        if (   RT_SUCCESS(rc)
+            && (MetaCacheStats.cHits || MetaCacheStats.cMisses))
+            LogRel(("VD#%u: Metadata cache: %llu hits, %llu misses, %llu evictions, %u tables using %zu of %zu bytes\n",
+                    pDrvIns->iInstance, MetaCacheStats.cHits, MetaCacheStats.cMisses, MetaCacheStats.cEvictions,
+                    MetaCacheStats.cEntries, MetaCacheStats.cbUsed, MetaCacheStats.cbMax));
     }
     drvvdFreeImages(pThis);
 }
@@ -4726,6 +4910,7 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
     pThis->pIfSecKey                    = NULL;
     pThis->hIoReqCache                  = NIL_RTMEMCACHE;
     pThis->hIoBufMgr                    = NIL_IOBUFMGR;
+    pThis->fIoBufDirect                 = true;
 
     for (unsigned i = 0; i < RT_ELEMENTS(pThis->aIoReqAllocBins); i++)
         pThis->aIoReqAllocBins[i].hMtxLstIoReqAlloc = NIL_RTSEMFASTMUTEX;
@@ -4862,7 +5047,7 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
                                           "CachePath\0CacheFormat\0Discard\0InformAboutZeroBlocks\0"
                                           "SkipConsistencyChecks\0"
                                           "Locked\0BIOSVisible\0Cylinders\0Heads\0Sectors\0Mountable\0"
-                                          "EmptyDrive\0IoBufMax\0NonRotationalMedium\0"
+                                          "EmptyDrive\0IoBufMax\0NonRotationalMedium\0MetaCacheSize\0IoQueues\0"
 #if defined(VBOX_PERIODIC_FLUSH) || defined(VBOX_IGNORE_FLUSH)
                                           "FlushInterval\0IgnoreFlush\0IgnoreFlushAsync\0"
 #endif /* !(VBOX_PERIODIC_FLUSH || VBOX_IGNORE_FLUSH) */
@@ -5141,6 +5326,31 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
             if (RT_FAILURE(rc))
                 return PDMDRV_SET_ERROR(pDrvIns, rc,
                                         N_("DrvVD configuration error: Querying \"NonRotationalMedium\" as boolean failed"));
+
+            rc = CFGMR3QueryU32Def(pCfg, "IoQueues", &pThis->cIoQueues, 0);
+            if (RT_FAILURE(rc))
+                return PDMDRV_SET_ERROR(pDrvIns, rc,
+                                        N_("DrvVD configuration error: Querying \"IoQueues\" as integer failed"));
+            if (pThis->cIoQueues > VD_IO_QUEUES_MAX)
+                return PDMDrvHlpVMSetError(pDrvIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                           N_("DrvVD configuration error: \"IoQueues\" exceeds the maximum of %u"),
+                                           VD_IO_QUEUES_MAX);
+
+            /* The metadata table cache is shared by all disks, the last configured budget wins. */
+            uint64_t cbMetaCache = 0;
+            rc = CFGMR3QueryU64(pCfg, "MetaCacheSize", &cbMetaCache);
+            if (RT_SUCCESS(rc))
+            {
+                rc = VDMetaCacheSetMaxSize((size_t)RT_MIN(cbMetaCache, (uint64_t)~(size_t)0));
+                if (RT_FAILURE(rc))
+                    return PDMDRV_SET_ERROR(pDrvIns, rc, N_("DrvVD: Failed to set the metadata cache size"));
+                LogRel(("VD#%u: Metadata cache size set to %llu bytes\n", pDrvIns->iInstance, cbMetaCache));
+            }
+            else if (rc == VERR_CFGM_VALUE_NOT_FOUND)
+                rc = VINF_SUCCESS;
+            else
+                return PDMDRV_SET_ERROR(pDrvIns, rc,
+                                        N_("DrvVD configuration error: Querying \"MetaCacheSize\" as integer failed"));
         }
 
         PCFGMNODE pParent = CFGMR3GetChild(pCurNode, "Parent");
@@ -5209,6 +5419,23 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
         if (pThis->pDrvMediaExPort && fUseNewIo)
             pThis->fAsyncIOSupported = true;
 
+        /* The I/O queues are only used by the extended media interface without the block cache. */
+        if (   RT_SUCCESS(rc)
+            && pThis->cIoQueues
+            && !pThis->fAsyncIOSupported)
+            pThis->cIoQueues = 0;
+
+        if (   RT_SUCCESS(rc)
+            && pThis->cIoQueues)
+        {
+            rc = VDIoQueuesSet(pThis->pDisk, pThis->cIoQueues);
+            if (RT_SUCCESS(rc))
+                LogRel(("VD#%u: Using %u independent I/O queues\n", pDrvIns->iInstance, pThis->cIoQueues));
+            else
+                rc = PDMDrvHlpVMSetError(pDrvIns, rc, RT_SRC_POS,
+                                         N_("DrvVD: Failed to create %u I/O queues"), pThis->cIoQueues);
+        }
+
         uint64_t tsStart = RTTimeNanoTS();
 
         unsigned iImageIdx = 0;
@@ -5293,6 +5520,8 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
             /* Check VDConfig for encryption config. */
             if (pCfgVDConfig)
                 pThis->pCfgCrypto = CFGMR3GetChild(pCfgVDConfig, "CRYPT");
+            if (pThis->pCfgCrypto)
+                pThis->fIoBufDirect = false; /* Data is encrypted in place. */
 
             if (pThis->pCfgCrypto)
             {
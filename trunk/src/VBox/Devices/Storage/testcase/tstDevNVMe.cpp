@@ -0,0 +1,1556 @@
+/* $Id$ */
+/** @file
+ * NVMe controller - Usermode testcase running a synthetic queue workload.
+ *
+ * This is a bit hackish as the device is driven directly through its MMIO
+ * handlers with a minimal fake of the PDM device helpers below it, however it
+ * is very useful when making changes to the queue handling of the device.
+ */
+
+/*
+ * Copyright (C) 2016 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+
+/*********************************************************************************************************************************
+*   Header Files                                                                                                                 *
+*********************************************************************************************************************************/
+#define LOG_GROUP LOG_GROUP_DEV_NVME
+#include <VBox/vmm/pdmdev.h>
+#include <VBox/vmm/pdmstorageifs.h>
+#include <VBox/vmm/pdmqueue.h>
+#include <VBox/vmm/pdmthread.h>
+#include <VBox/vmm/pdmcritsect.h>
+#include <VBox/vmm/cfgm.h>
+#include <VBox/sup.h>
+#include <VBox/err.h>
+#include <iprt/asm.h>
+#include <iprt/critsect.h>
+#include <iprt/mem.h>
+#include <iprt/semaphore.h>
+#include <iprt/sg.h>
+#include <iprt/stream.h>
+#include <iprt/string.h>
+#include <iprt/test.h>
+#include <iprt/thread.h>
+#include <iprt/time.h>
+
+
+/*********************************************************************************************************************************
+*   Ring-3 replacements for the VMM parts used by the device                                                                     *
+*********************************************************************************************************************************/
+/** The critical section standing in for the interrupt critical section of the device. */
+static RTCRITSECT   g_CritSectIntr;
+/** The NOP critical section handed out to the device. */
+static PDMCRITSECT  g_CritSectNop;
+
+static int tstCritSectEnter(PPDMCRITSECT pCritSect, int rcBusy)
+{
+    RT_NOREF2(pCritSect, rcBusy);
+    return RTCritSectEnter(&g_CritSectIntr);
+}
+
+static int tstCritSectLeave(PPDMCRITSECT pCritSect)
+{
+    RT_NOREF1(pCritSect);
+    return RTCritSectLeave(&g_CritSectIntr);
+}
+
+static bool tstCritSectIsOwner(PCPDMCRITSECT pCritSect)
+{
+    RT_NOREF1(pCritSect);
+    return RTCritSectIsOwner(&g_CritSectIntr);
+}
+
+static bool tstCritSectIsInitialized(PCPDMCRITSECT pCritSect)
+{
+    RT_NOREF1(pCritSect);
+    return RTCritSectIsInitialized(&g_CritSectIntr);
+}
+
+static int tstCritSectDelete(PPDMCRITSECT pCritSect)
+{
+    RT_NOREF1(pCritSect);
+    return RTCritSectDelete(&g_CritSectIntr);
+}
+
+static int tstSemEventCreate(PSUPDRVSESSION pSession, PSUPSEMEVENT phEvent)
+{
+    RT_NOREF1(pSession);
+    RTSEMEVENT hEvt = NIL_RTSEMEVENT;
+    int rc = RTSemEventCreate(&hEvt);
+    *phEvent = (SUPSEMEVENT)hEvt;
+    return rc;
+}
+
+static int tstSemEventClose(PSUPDRVSESSION pSession, SUPSEMEVENT hEvent)
+{
+    RT_NOREF1(pSession);
+    return RTSemEventDestroy((RTSEMEVENT)hEvent);
+}
+
+static int tstSemEventSignal(PSUPDRVSESSION pSession, SUPSEMEVENT hEvent)
+{
+    RT_NOREF1(pSession);
+    return RTSemEventSignal((RTSEMEVENT)hEvent);
+}
+
+static int tstSemEventWaitNoResume(PSUPDRVSESSION pSession, SUPSEMEVENT hEvent, uint32_t cMillies)
+{
+    RT_NOREF1(pSession);
+    return RTSemEventWaitNoResume((RTSEMEVENT)hEvent, cMillies);
+}
+
+static R0PTRTYPE(PPDMQUEUE) tstQueueR0Ptr(PPDMQUEUE pQueue)
+{
+    RT_NOREF1(pQueue);
+    return NIL_RTR0PTR;
+}
+
+static RCPTRTYPE(PPDMQUEUE) tstQueueRCPtr(PPDMQUEUE pQueue)
+{
+    RT_NOREF1(pQueue);
+    return NIL_RTRCPTR;
+}
+
+/* Strict builds turn PDMCritSectEnter into a macro passing the caller position. */
+#undef  PDMCritSectEnter
+#define PDMCritSectEnter            tstCritSectEnter
+#define PDMCritSectLeave            tstCritSectLeave
+#define PDMCritSectIsOwner          tstCritSectIsOwner
+#define PDMCritSectIsInitialized    tstCritSectIsInitialized
+#define PDMR3CritSectDelete         tstCritSectDelete
+#define SUPSemEventCreate           tstSemEventCreate
+#define SUPSemEventClose            tstSemEventClose
+#define SUPSemEventSignal           tstSemEventSignal
+#define SUPSemEventWaitNoResume     tstSemEventWaitNoResume
+#define PDMQueueR0Ptr               tstQueueR0Ptr
+#define PDMQueueRCPtr               tstQueueRCPtr
+
+#include "../DevNVMe.cpp"
+
+
+/*********************************************************************************************************************************
+*   Defined Constants And Macros                                                                                                 *
+*********************************************************************************************************************************/
+/** Size of the fake guest RAM. */
+#define TST_RAM_SIZE                _8M
+/** Where the register BAR is mapped. */
+#define TST_GCPHYS_MMIO             UINT64_C(0xf0000000)
+/** Size of the RAM disk backing namespace 1. */
+#define TST_DISK_SIZE               _32M
+/** Sector size of the RAM disk. */
+#define TST_DISK_SECTOR_SIZE        512
+
+/** Number of admin queue entries. */
+#define TST_ADM_QUEUE_ENTRIES       64
+/** Admin submission queue. */
+#define TST_GCPHYS_ASQ              UINT64_C(0x1000)
+/** Admin completion queue. */
+#define TST_GCPHYS_ACQ              UINT64_C(0x2000)
+/** Buffer for the identify data. */
+#define TST_GCPHYS_IDENTIFY         UINT64_C(0x3000)
+
+/** Number of I/O queue pairs running the workload in parallel. */
+#define TST_IO_QUEUES               4
+/** The I/O queue pair used for the completion queue overflow test. */
+#define TST_IO_QUEUE_SMALL          (TST_IO_QUEUES + 1)
+/** Number of entries of the I/O queues. */
+#define TST_IO_QUEUE_ENTRIES        32
+/** Number of commands each I/O queue keeps in flight. */
+#define TST_IO_QUEUE_DEPTH          16
+/** Number of write/read rounds done on every I/O queue. */
+#define TST_IO_ROUNDS               64
+/** Base of the submission and completion queues of the given I/O queue. */
+#define TST_GCPHYS_IO_SQ(a_idQueue) ((RTGCPHYS)(a_idQueue) * 0x10000)
+#define TST_GCPHYS_IO_CQ(a_idQueue) ((RTGCPHYS)(a_idQueue) * 0x10000 + 0x8000)
+/** Data buffers of the given I/O queue, one 32KB slot per command in flight. */
+#define TST_GCPHYS_IO_DATA(a_idQueue) ((RTGCPHYS)(a_idQueue) * _1M)
+/** Size of the data slot of a command (5 pages of data + the PRP list). */
+#define TST_IO_SLOT_SIZE            _32K
+/** Offset of the PRP list in a data slot. */
+#define TST_IO_SLOT_PRP_LIST_OFF    0x6000
+/** Number of sectors of the RAM disk reserved for every I/O queue. */
+#define TST_IO_QUEUE_SECTORS        (TST_IO_QUEUE_DEPTH * (TST_IO_SLOT_SIZE / TST_DISK_SECTOR_SIZE))
+
+/** Extracts the status code from the status field of a completion entry. */
+#define TST_STATUS_SC(a_u16Status)  (((a_u16Status) >> 1) & 0xff)
+/** Extracts the status code type from the status field of a completion entry. */
+#define TST_STATUS_SCT(a_u16Status) (((a_u16Status) >> 9) & 0x7)
+
+
+/*********************************************************************************************************************************
+*   Structures and Typedefs                                                                                                      *
+*********************************************************************************************************************************/
+/**
+ * A request of the RAM disk driver.
+ */
+typedef struct TSTDISKREQ
+{
+    /** Next request in the list of requests waiting for the completer. */
+    struct TSTDISKREQ          *pNext;
+    /** The request type. */
+    PDMMEDIAEXIOREQTYPE         enmType;
+    /** Flag whether the data is transferred through the S/G buffer of the device. */
+    bool                        fSgBuf;
+    /** Start offset. */
+    uint64_t                    off;
+    /** Number of bytes to transfer. */
+    size_t                      cbXfer;
+    /** Number of discard ranges. */
+    unsigned                    cRanges;
+    /** The memory allocated for the device. */
+    uint64_t                    au64Alloc[1];
+} TSTDISKREQ;
+/** Pointer to a RAM disk request. */
+typedef TSTDISKREQ *PTSTDISKREQ;
+
+/**
+ * The RAM disk driver attached to namespace 1.
+ */
+typedef struct TSTDISK
+{
+    /** The base interface. */
+    PDMIBASE                    IBase;
+    /** The media interface. */
+    PDMIMEDIA                   IMedia;
+    /** The extended media interface. */
+    PDMIMEDIAEX                 IMediaEx;
+    /** The extended media port interface of the device. */
+    PPDMIMEDIAEXPORT            pPort;
+    /** The disk content. */
+    uint8_t                    *pbDisk;
+    /** Size of the memory the device wants to have for every request. */
+    size_t                      cbIoReqAlloc;
+    /** Protects the list of requests waiting for the completer. */
+    RTCRITSECT                  CritSect;
+    /** Requests waiting for the completer. */
+    PTSTDISKREQ                 pReqsPending;
+    /** Event the completer waits on. */
+    RTSEMEVENT                  hEvtPending;
+    /** The completer thread. */
+    RTTHREAD                    hThrdCompleter;
+    /** Flag whether the completer should terminate. */
+    volatile bool               fShutdown;
+    /** Number of submitted requests, used to select the completion path. */
+    volatile uint32_t           cReqsSubmitted;
+    /** Number of allocated requests. */
+    volatile uint32_t           cReqsAllocated;
+    /** Number of requests which transferred data through the S/G buffer of the device. */
+    volatile uint32_t           cReqsSgBuf;
+    /** Number of requests which copied the data. */
+    volatile uint32_t           cReqsCopy;
+} TSTDISK;
+/** Pointer to the RAM disk driver. */
+typedef TSTDISK *PTSTDISK;
+
+/**
+ * Guest side state of a queue pair.
+ */
+typedef struct TSTQUEUE
+{
+    /** The queue identifier. */
+    uint16_t                    idQueue;
+    /** Number of submission queue entries. */
+    uint32_t                    cSqEntries;
+    /** Number of completion queue entries. */
+    uint32_t                    cCqEntries;
+    /** The submission queue. */
+    RTGCPHYS                    GCPhysSq;
+    /** The completion queue. */
+    RTGCPHYS                    GCPhysCq;
+    /** The submission queue tail. */
+    uint32_t                    idxSqTail;
+    /** The completion queue head. */
+    uint32_t                    idxCqHead;
+    /** The expected phase tag. */
+    bool                        fPhase;
+} TSTQUEUE;
+/** Pointer to the guest side state of a queue pair. */
+typedef TSTQUEUE *PTSTQUEUE;
+
+
+/*********************************************************************************************************************************
+*   Global Variables                                                                                                             *
+*********************************************************************************************************************************/
+/** The test handle.*/
+static RTTEST               g_hTest = NIL_RTTEST;
+/** The fake guest RAM. */
+static uint8_t             *g_pbRam = NULL;
+/** Serializes device writes to and test reads of the completion queues. */
+static RTSEMFASTMUTEX       g_hMtxRam = NIL_RTSEMFASTMUTEX;
+/** The device helpers. */
+static PDMDEVHLPR3          g_DevHlp;
+/** The RAM disk driver. */
+static TSTDISK              g_Disk;
+/** The worker threads created by the device. */
+static PPDMTHREAD           g_apThreads[NVME_WRK_THRDS_MAX + 1];
+/** Number of worker threads created. */
+static uint32_t             g_cThreads = 0;
+/** Number of interrupts signalled per MSI-X vector. */
+static uint32_t volatile    g_acIrqs[NVME_QUEUES_MAX];
+/** The admin queue. */
+static TSTQUEUE             g_AdmQueue;
+/** The I/O queues. */
+static TSTQUEUE             g_aIoQueues[TST_IO_QUEUE_SMALL + 1];
+
+
+/* -=-=-=-=- Fake device helpers -=-=-=-=- */
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnPCIPhysRead} */
+static DECLCALLBACK(int) tstDevHlpPCIPhysRead(PPDMDEVINS pDevIns, PPDMPCIDEV pPciDev, RTGCPHYS GCPhys, void *pvBuf, size_t cbRead)
+{
+    RT_NOREF2(pDevIns, pPciDev);
+    if (   GCPhys >= TST_RAM_SIZE
+        || cbRead > TST_RAM_SIZE - GCPhys)
+    {
+        RTTestFailed(g_hTest, "Device reads outside of the guest RAM: %RGp LB %#zx\n", GCPhys, cbRead);
+        memset(pvBuf, 0xff, cbRead);
+        return VINF_SUCCESS;
+    }
+
+    memcpy(pvBuf, &g_pbRam[GCPhys], cbRead);
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnPCIPhysWrite} */
+static DECLCALLBACK(int) tstDevHlpPCIPhysWrite(PPDMDEVINS pDevIns, PPDMPCIDEV pPciDev, RTGCPHYS GCPhys, const void *pvBuf, size_t cbWrite)
+{
+    RT_NOREF2(pDevIns, pPciDev);
+    if (   GCPhys >= TST_RAM_SIZE
+        || cbWrite > TST_RAM_SIZE - GCPhys)
+    {
+        RTTestFailed(g_hTest, "Device writes outside of the guest RAM: %RGp LB %#zx\n", GCPhys, cbWrite);
+        return VINF_SUCCESS;
+    }
+
+    RTSemFastMutexRequest(g_hMtxRam);
+    memcpy(&g_pbRam[GCPhys], pvBuf, cbWrite);
+    RTSemFastMutexRelease(g_hMtxRam);
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnPhysGCPhys2CCPtr} */
+static DECLCALLBACK(int) tstDevHlpPhysGCPhys2CCPtr(PPDMDEVINS pDevIns, RTGCPHYS GCPhys, uint32_t fFlags, void **ppv,
+                                                   PPGMPAGEMAPLOCK pLock)
+{
+    RT_NOREF3(pDevIns, fFlags, pLock);
+    if (GCPhys >= TST_RAM_SIZE)
+        return VERR_PGM_PHYS_PAGE_RESERVED;
+
+    *ppv = &g_pbRam[GCPhys];
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnPhysGCPhys2CCPtrReadOnly} */
+static DECLCALLBACK(int) tstDevHlpPhysGCPhys2CCPtrReadOnly(PPDMDEVINS pDevIns, RTGCPHYS GCPhys, uint32_t fFlags,
+                                                           void const **ppv, PPGMPAGEMAPLOCK pLock)
+{
+    return tstDevHlpPhysGCPhys2CCPtr(pDevIns, GCPhys, fFlags, (void **)ppv, pLock);
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnPhysReleasePageMappingLock} */
+static DECLCALLBACK(void) tstDevHlpPhysReleasePageMappingLock(PPDMDEVINS pDevIns, PPGMPAGEMAPLOCK pLock)
+{
+    RT_NOREF2(pDevIns, pLock);
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnPCISetIrq} */
+static DECLCALLBACK(void) tstDevHlpPCISetIrq(PPDMDEVINS pDevIns, PPDMPCIDEV pPciDev, int iIrq, int iLevel)
+{
+    RT_NOREF2(pDevIns, pPciDev);
+    if (   iLevel == PDM_IRQ_LEVEL_HIGH
+        && (unsigned)iIrq < RT_ELEMENTS(g_acIrqs))
+        ASMAtomicIncU32(&g_acIrqs[iIrq]);
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnPCIRegister} */
+static DECLCALLBACK(int) tstDevHlpPCIRegister(PPDMDEVINS pDevIns, PPDMPCIDEV pPciDev, uint32_t idxDevCfg, uint32_t fFlags,
+                                              uint8_t uPciDevNo, uint8_t uPciFunNo, const char *pszName)
+{
+    RT_NOREF7(pDevIns, pPciDev, idxDevCfg, fFlags, uPciDevNo, uPciFunNo, pszName);
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnPCIRegisterMsi} */
+static DECLCALLBACK(int) tstDevHlpPCIRegisterMsi(PPDMDEVINS pDevIns, PPDMPCIDEV pPciDev, PPDMMSIREG pMsiReg)
+{
+    RT_NOREF3(pDevIns, pPciDev, pMsiReg);
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnPCIIORegionRegister} */
+static DECLCALLBACK(int) tstDevHlpPCIIORegionRegister(PPDMDEVINS pDevIns, PPDMPCIDEV pPciDev, uint32_t iRegion, RTGCPHYS cbRegion,
+                                                      PCIADDRESSSPACE enmType, PFNPCIIOREGIONMAP pfnCallback)
+{
+    /* Map the region right away, there is no guest programming the BARs. */
+    return pfnCallback(pDevIns, pPciDev, iRegion, TST_GCPHYS_MMIO, cbRegion, enmType);
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnMMIORegister} */
+static DECLCALLBACK(int) tstDevHlpMMIORegister(PPDMDEVINS pDevIns, RTGCPHYS GCPhysStart, RTGCPHYS cbRange, RTHCPTR pvUser,
+                                               PFNIOMMMIOWRITE pfnWrite, PFNIOMMMIOREAD pfnRead, PFNIOMMMIOFILL pfnFill,
+                                               uint32_t fFlags, const char *pszDesc)
+{
+    RT_NOREF9(pDevIns, GCPhysStart, cbRange, pvUser, pfnWrite, pfnRead, pfnFill, fFlags, pszDesc);
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnCritSectGetNop} */
+static DECLCALLBACK(PPDMCRITSECT) tstDevHlpCritSectGetNop(PPDMDEVINS pDevIns)
+{
+    RT_NOREF1(pDevIns);
+    return &g_CritSectNop;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnSetDeviceCritSect} */
+static DECLCALLBACK(int) tstDevHlpSetDeviceCritSect(PPDMDEVINS pDevIns, PPDMCRITSECT pCritSect)
+{
+    pDevIns->pCritSectRoR3 = pCritSect;
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnCritSectInit} */
+static DECLCALLBACK(int) tstDevHlpCritSectInit(PPDMDEVINS pDevIns, PPDMCRITSECT pCritSect, RT_SRC_POS_DECL,
+                                               const char *pszNameFmt, va_list va)
+{
+    RT_NOREF3(pDevIns, pCritSect, pszNameFmt); RT_SRC_POS_NOREF(); NOREF(va);
+    return RTCritSectInit(&g_CritSectIntr);
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnGetSupDrvSession} */
+static DECLCALLBACK(PSUPDRVSESSION) tstDevHlpGetSupDrvSession(PPDMDEVINS pDevIns)
+{
+    RT_NOREF1(pDevIns);
+    return NIL_RTR0PTR;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnQueueCreate} */
+static DECLCALLBACK(int) tstDevHlpQueueCreate(PPDMDEVINS pDevIns, size_t cbItem, uint32_t cItems, uint32_t cMilliesInterval,
+                                              PFNPDMQUEUEDEV pfnCallback, bool fRZEnabled, const char *pszName, PPDMQUEUE *ppQueue)
+{
+    /* Only used for kicking the workers from raw-mode which isn't there. */
+    RT_NOREF7(pDevIns, cbItem, cItems, cMilliesInterval, pfnCallback, fRZEnabled, pszName);
+    *ppQueue = NULL;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Thread function running a device thread.
+ */
+static DECLCALLBACK(int) tstDevThreadMain(RTTHREAD hSelf, void *pvUser)
+{
+    RT_NOREF1(hSelf);
+    PPDMTHREAD pThread = (PPDMTHREAD)pvUser;
+    return pThread->u.Dev.pfnThread(pThread->u.Dev.pDevIns, pThread);
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnThreadCreate} */
+static DECLCALLBACK(int) tstDevHlpThreadCreate(PPDMDEVINS pDevIns, PPPDMTHREAD ppThread, void *pvUser, PFNPDMTHREADDEV pfnThread,
+                                               PFNPDMTHREADWAKEUPDEV pfnWakeUp, size_t cbStack, RTTHREADTYPE enmType, const char *pszName)
+{
+    AssertReturn(g_cThreads < RT_ELEMENTS(g_apThreads), VERR_TOO_MANY_OPEN_FILES);
+
+    PPDMTHREAD pThread = (PPDMTHREAD)RTMemAllocZ(sizeof(*pThread));
+    if (!pThread)
+        return VERR_NO_MEMORY;
+
+    /* There is no suspended state here, the threads start running right away. */
+    pThread->u32Version      = PDMTHREAD_VERSION;
+    pThread->enmState        = PDMTHREADSTATE_RUNNING;
+    pThread->pvUser          = pvUser;
+    pThread->u.Dev.pDevIns   = pDevIns;
+    pThread->u.Dev.pfnThread = pfnThread;
+    pThread->u.Dev.pfnWakeUp = pfnWakeUp;
+
+    int rc = RTThreadCreate(&pThread->Thread, tstDevThreadMain, pThread, cbStack, enmType, RTTHREADFLAGS_WAITABLE, pszName);
+    if (RT_FAILURE(rc))
+    {
+        RTMemFree(pThread);
+        return rc;
+    }
+
+    g_apThreads[g_cThreads++] = pThread;
+    *ppThread = pThread;
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnMMHeapAllocZ} */
+static DECLCALLBACK(void *) tstDevHlpMMHeapAllocZ(PPDMDEVINS pDevIns, size_t cb)
+{
+    RT_NOREF1(pDevIns);
+    return RTMemAllocZ(cb);
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnMMHeapFree} */
+static DECLCALLBACK(void) tstDevHlpMMHeapFree(PPDMDEVINS pDevIns, void *pv)
+{
+    RT_NOREF1(pDevIns);
+    RTMemFree(pv);
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnDriverAttach} */
+static DECLCALLBACK(int) tstDevHlpDriverAttach(PPDMDEVINS pDevIns, uint32_t iLun, PPDMIBASE pBaseInterface,
+                                               PPDMIBASE *ppBaseInterface, const char *pszDesc)
+{
+    RT_NOREF2(pDevIns, pszDesc);
+
+    /* Only namespace 1 has a medium. */
+    if (iLun != 0)
+        return VERR_PDM_NO_ATTACHED_DRIVER;
+
+    g_Disk.pPort = PDMIBASE_QUERY_INTERFACE(pBaseInterface, PDMIMEDIAEXPORT);
+    RTTEST_CHECK_RET(g_hTest, g_Disk.pPort != NULL, VERR_PDM_MISSING_INTERFACE_ABOVE);
+    *ppBaseInterface = &g_Disk.IBase;
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnSSMRegister} */
+static DECLCALLBACK(int) tstDevHlpSSMRegister(PPDMDEVINS pDevIns, uint32_t uVersion, size_t cbGuess, const char *pszBefore,
+                                              PFNSSMDEVLIVEPREP pfnLivePrep, PFNSSMDEVLIVEEXEC pfnLiveExec, PFNSSMDEVLIVEVOTE pfnLiveVote,
+                                              PFNSSMDEVSAVEPREP pfnSavePrep, PFNSSMDEVSAVEEXEC pfnSaveExec, PFNSSMDEVSAVEDONE pfnSaveDone,
+                                              PFNSSMDEVLOADPREP pfnLoadPrep, PFNSSMDEVLOADEXEC pfnLoadExec, PFNSSMDEVLOADDONE pfnLoadDone)
+{
+    RT_NOREF4(pDevIns, uVersion, cbGuess, pszBefore);
+    RT_NOREF9(pfnLivePrep, pfnLiveExec, pfnLiveVote, pfnSavePrep, pfnSaveExec, pfnSaveDone, pfnLoadPrep, pfnLoadExec, pfnLoadDone);
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnSTAMRegisterV} */
+static DECLCALLBACK(void) tstDevHlpSTAMRegisterV(PPDMDEVINS pDevIns, void *pvSample, STAMTYPE enmType,
+                                                 STAMVISIBILITY enmVisibility, STAMUNIT enmUnit, const char *pszDesc,
+                                                 const char *pszName, va_list args)
+{
+    RT_NOREF7(pDevIns, pvSample, enmType, enmVisibility, enmUnit, pszDesc, pszName); NOREF(args);
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnDBGFInfoRegister} */
+static DECLCALLBACK(int) tstDevHlpDBGFInfoRegister(PPDMDEVINS pDevIns, const char *pszName, const char *pszDesc,
+                                                   PFNDBGFHANDLERDEV pfnHandler)
+{
+    RT_NOREF4(pDevIns, pszName, pszDesc, pfnHandler);
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnVMSetErrorV} */
+static DECLCALLBACK(int) tstDevHlpVMSetErrorV(PPDMDEVINS pDevIns, int rc, RT_SRC_POS_DECL, const char *pszFormat, va_list va)
+{
+    RT_NOREF1(pDevIns);
+    RTTestFailed(g_hTest, "Error: %s:%u:%s: %Rrc\n", RT_SRC_POS_ARGS, rc);
+    RTTestFailureDetailsV(g_hTest, pszFormat, va);
+    return rc;
+}
+
+/** @interface_method_impl{PDMDEVHLPR3,pfnVMSetError} */
+static DECLCALLBACK(int) tstDevHlpVMSetError(PPDMDEVINS pDevIns, int rc, RT_SRC_POS_DECL, const char *pszFormat, ...)
+{
+    va_list va;
+    va_start(va, pszFormat);
+    tstDevHlpVMSetErrorV(pDevIns, rc, RT_SRC_POS_ARGS, pszFormat, va);
+    va_end(va);
+    return rc;
+}
+
+
+/* -=-=-=-=- RAM disk driver -=-=-=-=- */
+
+/**
+ * Executes a request of the RAM disk.
+ *
+ * @returns VBox status code of the request.
+ * @param   pDisk       The RAM disk.
+ * @param   pReq        The request.
+ */
+static int tstDiskReqExec(PTSTDISK pDisk, PTSTDISKREQ pReq)
+{
+    PPDMIMEDIAEXPORT pPort = pDisk->pPort;
+    int rc = VINF_SUCCESS;
+
+    switch (pReq->enmType)
+    {
+        case PDMMEDIAEXIOREQTYPE_READ:
+        case PDMMEDIAEXIOREQTYPE_WRITE:
+        {
+            if (   pReq->off >= TST_DISK_SIZE
+                || pReq->cbXfer > TST_DISK_SIZE - pReq->off)
+            {
+                RTTestFailed(g_hTest, "Request outside of the disk: %#RX64 LB %#zx\n", pReq->off, pReq->cbXfer);
+                return VERR_EOF;
+            }
+
+            uint8_t *pbDisk = &pDisk->pbDisk[pReq->off];
+            if (pReq->fSgBuf)
+            {
+                RTSGSEG aSegs[NVME_PRPS_MAX];
+                unsigned cSegs = RT_ELEMENTS(aSegs);
+                size_t cbBuf = 0;
+
+                rc = pPort->pfnIoReqQuerySgBuf(pPort, (PDMMEDIAEXIOREQ)pReq, &pReq->au64Alloc[0], &aSegs[0], &cSegs, &cbBuf);
+                if (RT_SUCCESS(rc))
+                {
+                    RTTEST_CHECK(g_hTest, cbBuf == pReq->cbXfer);
+                    for (unsigned i = 0; i < cSegs; i++)
+                    {
+                        if (pReq->enmType == PDMMEDIAEXIOREQTYPE_READ)
+                            memcpy(aSegs[i].pvSeg, pbDisk, aSegs[i].cbSeg);
+                        else
+                            memcpy(pbDisk, aSegs[i].pvSeg, aSegs[i].cbSeg);
+                        pbDisk += aSegs[i].cbSeg;
+                    }
+                    ASMAtomicIncU32(&pDisk->cReqsSgBuf);
+                    break;
+                }
+
+                /* Not suitable for unbuffered I/O, copy the data like everybody else. */
+                RTTEST_CHECK(g_hTest, rc == VERR_NOT_SUPPORTED);
+            }
+
+            RTSGSEG Seg;
+            RTSGBUF SgBuf;
+            Seg.pvSeg = pbDisk;
+            Seg.cbSeg = pReq->cbXfer;
+            RTSgBufInit(&SgBuf, &Seg, 1);
+            if (pReq->enmType == PDMMEDIAEXIOREQTYPE_READ)
+                rc = pPort->pfnIoReqCopyToBuf(pPort, (PDMMEDIAEXIOREQ)pReq, &pReq->au64Alloc[0], 0, &SgBuf, pReq->cbXfer);
+            else
+                rc = pPort->pfnIoReqCopyFromBuf(pPort, (PDMMEDIAEXIOREQ)pReq, &pReq->au64Alloc[0], 0, &SgBuf, pReq->cbXfer);
+            ASMAtomicIncU32(&pDisk->cReqsCopy);
+            break;
+        }
+        case PDMMEDIAEXIOREQTYPE_FLUSH:
+            break;
+        case PDMMEDIAEXIOREQTYPE_DISCARD:
+        {
+            RTRANGE aRanges[16];
+            uint32_t cRanges = 0;
+
+            rc = pPort->pfnIoReqQueryDiscardRanges(pPort, (PDMMEDIAEXIOREQ)pReq, &pReq->au64Alloc[0], 0,
+                                                   RT_MIN(pReq->cRanges, RT_ELEMENTS(aRanges)), &aRanges[0], &cRanges);
+            for (uint32_t i = 0; i < cRanges && RT_SUCCESS(rc); i++)
+            {
+                if (   aRanges[i].offStart < TST_DISK_SIZE
+                    && aRanges[i].cbRange <= TST_DISK_SIZE - aRanges[i].offStart)
+                    memset(&pDisk->pbDisk[aRanges[i].offStart], 0, aRanges[i].cbRange);
+                else
+                    rc = VERR_EOF;
+            }
+            break;
+        }
+        default:
+            RTTestFailed(g_hTest, "Invalid request type %d\n", pReq->enmType);
+            rc = VERR_INVALID_PARAMETER;
+    }
+
+    return rc;
+}
+
+/**
+ * Submits a request of the RAM disk, completing every third request right away
+ * and the others from the completer thread.
+ *
+ * @returns VBox status code.
+ * @param   pDisk       The RAM disk.
+ * @param   pReq        The request.
+ */
+static int tstDiskReqSubmit(PTSTDISK pDisk, PTSTDISKREQ pReq)
+{
+    uint32_t iReq = ASMAtomicIncU32(&pDisk->cReqsSubmitted);
+
+    pReq->fSgBuf = RT_BOOL(iReq & 1);
+    if (!(iReq % 3))
+        return tstDiskReqExec(pDisk, pReq);
+
+    RTCritSectEnter(&pDisk->CritSect);
+    pReq->pNext = pDisk->pReqsPending;
+    pDisk->pReqsPending = pReq;
+    RTCritSectLeave(&pDisk->CritSect);
+    RTSemEventSignal(pDisk->hEvtPending);
+    return VINF_PDM_MEDIAEX_IOREQ_IN_PROGRESS;
+}
+
+/**
+ * The completer thread of the RAM disk.
+ */
+static DECLCALLBACK(int) tstDiskCompleter(RTTHREAD hSelf, void *pvUser)
+{
+    RT_NOREF1(hSelf);
+    PTSTDISK pDisk = (PTSTDISK)pvUser;
+
+    while (!ASMAtomicReadBool(&pDisk->fShutdown))
+    {
+        RTCritSectEnter(&pDisk->CritSect);
+        PTSTDISKREQ pReq = pDisk->pReqsPending;
+        pDisk->pReqsPending = NULL;
+        RTCritSectLeave(&pDisk->CritSect);
+
+        if (!pReq)
+        {
+            RTSemEventWait(pDisk->hEvtPending, RT_INDEFINITE_WAIT);
+            continue;
+        }
+
+        while (pReq)
+        {
+            /* The request is gone once the device got notified. */
+            PTSTDISKREQ pNext = pReq->pNext;
+            int rcReq = tstDiskReqExec(pDisk, pReq);
+            pDisk->pPort->pfnIoReqCompleteNotify(pDisk->pPort, (PDMMEDIAEXIOREQ)pReq, &pReq->au64Alloc[0], rcReq);
+            pReq = pNext;
+        }
+    }
+
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMIBASE,pfnQueryInterface} */
+static DECLCALLBACK(void *) tstDiskQueryInterface(PPDMIBASE pInterface, const char *pszIID)
+{
+    PTSTDISK pDisk = RT_FROM_MEMBER(pInterface, TSTDISK, IBase);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBASE, &pDisk->IBase);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIMEDIA, &pDisk->IMedia);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIMEDIAEX, &pDisk->IMediaEx);
+    return NULL;
+}
+
+/** @interface_method_impl{PDMIMEDIA,pfnGetSize} */
+static DECLCALLBACK(uint64_t) tstDiskGetSize(PPDMIMEDIA pInterface)
+{
+    RT_NOREF1(pInterface);
+    return TST_DISK_SIZE;
+}
+
+/** @interface_method_impl{PDMIMEDIA,pfnGetSectorSize} */
+static DECLCALLBACK(uint32_t) tstDiskGetSectorSize(PPDMIMEDIA pInterface)
+{
+    RT_NOREF1(pInterface);
+    return TST_DISK_SECTOR_SIZE;
+}
+
+/** @interface_method_impl{PDMIMEDIA,pfnGetType} */
+static DECLCALLBACK(PDMMEDIATYPE) tstDiskGetType(PPDMIMEDIA pInterface)
+{
+    RT_NOREF1(pInterface);
+    return PDMMEDIATYPE_HARD_DISK;
+}
+
+/** @interface_method_impl{PDMIMEDIAEX,pfnQueryFeatures} */
+static DECLCALLBACK(int) tstDiskQueryFeatures(PPDMIMEDIAEX pInterface, uint32_t *pfFeatures)
+{
+    RT_NOREF1(pInterface);
+    *pfFeatures = PDMIMEDIAEX_FEATURE_F_ASYNC | PDMIMEDIAEX_FEATURE_F_DISCARD;
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMIMEDIAEX,pfnIoReqAllocSizeSet} */
+static DECLCALLBACK(int) tstDiskIoReqAllocSizeSet(PPDMIMEDIAEX pInterface, size_t cbIoReqAlloc)
+{
+    PTSTDISK pDisk = RT_FROM_MEMBER(pInterface, TSTDISK, IMediaEx);
+    pDisk->cbIoReqAlloc = cbIoReqAlloc;
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMIMEDIAEX,pfnIoReqAlloc} */
+static DECLCALLBACK(int) tstDiskIoReqAlloc(PPDMIMEDIAEX pInterface, PPDMMEDIAEXIOREQ phIoReq, void **ppvIoReqAlloc,
+                                           PDMMEDIAEXIOREQID uIoReqId, uint32_t fFlags)
+{
+    PTSTDISK pDisk = RT_FROM_MEMBER(pInterface, TSTDISK, IMediaEx);
+    RT_NOREF1(uIoReqId);
+    AssertReturn(!(fFlags & ~PDMIMEDIAEX_F_VALID), VERR_INVALID_PARAMETER);
+
+    PTSTDISKREQ pReq = (PTSTDISKREQ)RTMemAllocZ(RT_OFFSETOF(TSTDISKREQ, au64Alloc) + pDisk->cbIoReqAlloc);
+    if (!pReq)
+        return VERR_NO_MEMORY;
+
+    ASMAtomicIncU32(&pDisk->cReqsAllocated);
+    *phIoReq       = (PDMMEDIAEXIOREQ)pReq;
+    *ppvIoReqAlloc = &pReq->au64Alloc[0];
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMIMEDIAEX,pfnIoReqFree} */
+static DECLCALLBACK(int) tstDiskIoReqFree(PPDMIMEDIAEX pInterface, PDMMEDIAEXIOREQ hIoReq)
+{
+    PTSTDISK pDisk = RT_FROM_MEMBER(pInterface, TSTDISK, IMediaEx);
+
+    ASMAtomicDecU32(&pDisk->cReqsAllocated);
+    RTMemFree(hIoReq);
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMIMEDIAEX,pfnIoReqCancelAll} */
+static DECLCALLBACK(int) tstDiskIoReqCancelAll(PPDMIMEDIAEX pInterface)
+{
+    /* Pending requests complete soon enough anyway. */
+    RT_NOREF1(pInterface);
+    return VINF_SUCCESS;
+}
+
+/** @interface_method_impl{PDMIMEDIAEX,pfnIoReqRead} */
+static DECLCALLBACK(int) tstDiskIoReqRead(PPDMIMEDIAEX pInterface, PDMMEDIAEXIOREQ hIoReq, uint64_t off, size_t cbRead)
+{
+    PTSTDISK pDisk = RT_FROM_MEMBER(pInterface, TSTDISK, IMediaEx);
+    PTSTDISKREQ pReq = (PTSTDISKREQ)hIoReq;
+
+    pReq->enmType = PDMMEDIAEXIOREQTYPE_READ;
+    pReq->off     = off;
+    pReq->cbXfer  = cbRead;
+    return tstDiskReqSubmit(pDisk, pReq);
+}
+
+/** @interface_method_impl{PDMIMEDIAEX,pfnIoReqWrite} */
+static DECLCALLBACK(int) tstDiskIoReqWrite(PPDMIMEDIAEX pInterface, PDMMEDIAEXIOREQ hIoReq, uint64_t off, size_t cbWrite)
+{
+    PTSTDISK pDisk = RT_FROM_MEMBER(pInterface, TSTDISK, IMediaEx);
+    PTSTDISKREQ pReq = (PTSTDISKREQ)hIoReq;
+
+    pReq->enmType = PDMMEDIAEXIOREQTYPE_WRITE;
+    pReq->off     = off;
+    pReq->cbXfer  = cbWrite;
+    return tstDiskReqSubmit(pDisk, pReq);
+}
+
+/** @interface_method_impl{PDMIMEDIAEX,pfnIoReqFlush} */
+static DECLCALLBACK(int) tstDiskIoReqFlush(PPDMIMEDIAEX pInterface, PDMMEDIAEXIOREQ hIoReq)
+{
+    PTSTDISK pDisk = RT_FROM_MEMBER(pInterface, TSTDISK, IMediaEx);
+    PTSTDISKREQ pReq = (PTSTDISKREQ)hIoReq;
+
+    pReq->enmType = PDMMEDIAEXIOREQTYPE_FLUSH;
+    return tstDiskReqSubmit(pDisk, pReq);
+}
+
+/** @interface_method_impl{PDMIMEDIAEX,pfnIoReqDiscard} */
+static DECLCALLBACK(int) tstDiskIoReqDiscard(PPDMIMEDIAEX pInterface, PDMMEDIAEXIOREQ hIoReq, unsigned cRangesMax)
+{
+    PTSTDISK pDisk = RT_FROM_MEMBER(pInterface, TSTDISK, IMediaEx);
+    PTSTDISKREQ pReq = (PTSTDISKREQ)hIoReq;
+
+    pReq->enmType = PDMMEDIAEXIOREQTYPE_DISCARD;
+    pReq->cRanges = cRangesMax;
+    return tstDiskReqSubmit(pDisk, pReq);
+}
+
+/** @interface_method_impl{PDMIMEDIAEX,pfnIoReqGetActiveCount} */
+static DECLCALLBACK(uint32_t) tstDiskIoReqGetActiveCount(PPDMIMEDIAEX pInterface)
+{
+    PTSTDISK pDisk = RT_FROM_MEMBER(pInterface, TSTDISK, IMediaEx);
+    return ASMAtomicReadU32(&pDisk->cReqsAllocated);
+}
+
+/** @interface_method_impl{PDMIMEDIAEX,pfnIoReqGetSuspendedCount} */
+static DECLCALLBACK(uint32_t) tstDiskIoReqGetSuspendedCount(PPDMIMEDIAEX pInterface)
+{
+    RT_NOREF1(pInterface);
+    return 0;
+}
+
+/**
+ * Creates the RAM disk.
+ *
+ * @returns VBox status code.
+ * @param   pDisk       The RAM disk to initialize.
+ */
+static int tstDiskCreate(PTSTDISK pDisk)
+{
+    RT_ZERO(*pDisk);
+    pDisk->IBase.pfnQueryInterface             = tstDiskQueryInterface;
+    pDisk->IMedia.pfnGetSize                   = tstDiskGetSize;
+    pDisk->IMedia.pfnGetSectorSize             = tstDiskGetSectorSize;
+    pDisk->IMedia.pfnGetType                   = tstDiskGetType;
+    pDisk->IMediaEx.pfnQueryFeatures           = tstDiskQueryFeatures;
+    pDisk->IMediaEx.pfnIoReqAllocSizeSet       = tstDiskIoReqAllocSizeSet;
+    pDisk->IMediaEx.pfnIoReqAlloc              = tstDiskIoReqAlloc;
+    pDisk->IMediaEx.pfnIoReqFree               = tstDiskIoReqFree;
+    pDisk->IMediaEx.pfnIoReqCancelAll          = tstDiskIoReqCancelAll;
+    pDisk->IMediaEx.pfnIoReqRead               = tstDiskIoReqRead;
+    pDisk->IMediaEx.pfnIoReqWrite              = tstDiskIoReqWrite;
+    pDisk->IMediaEx.pfnIoReqFlush              = tstDiskIoReqFlush;
+    pDisk->IMediaEx.pfnIoReqDiscard            = tstDiskIoReqDiscard;
+    pDisk->IMediaEx.pfnIoReqGetActiveCount     = tstDiskIoReqGetActiveCount;
+    pDisk->IMediaEx.pfnIoReqGetSuspendedCount  = tstDiskIoReqGetSuspendedCount;
+    pDisk->hEvtPending                         = NIL_RTSEMEVENT;
+    pDisk->hThrdCompleter                      = NIL_RTTHREAD;
+
+    pDisk->pbDisk = (uint8_t *)RTMemPageAllocZ(TST_DISK_SIZE);
+    if (!pDisk->pbDisk)
+        return VERR_NO_MEMORY;
+
+    int rc = RTCritSectInit(&pDisk->CritSect);
+    if (RT_SUCCESS(rc))
+        rc = RTSemEventCreate(&pDisk->hEvtPending);
+    if (RT_SUCCESS(rc))
+        rc = RTThreadCreate(&pDisk->hThrdCompleter, tstDiskCompleter, pDisk, 0, RTTHREADTYPE_IO,
+                            RTTHREADFLAGS_WAITABLE, "DiskCompl");
+    return rc;
+}
+
+/**
+ * Destroys the RAM disk.
+ *
+ * @returns nothing.
+ * @param   pDisk       The RAM disk.
+ */
+static void tstDiskDestroy(PTSTDISK pDisk)
+{
+    if (pDisk->hThrdCompleter != NIL_RTTHREAD)
+    {
+        ASMAtomicWriteBool(&pDisk->fShutdown, true);
+        RTSemEventSignal(pDisk->hEvtPending);
+        RTThreadWait(pDisk->hThrdCompleter, RT_INDEFINITE_WAIT, NULL);
+    }
+    if (pDisk->hEvtPending != NIL_RTSEMEVENT)
+        RTSemEventDestroy(pDisk->hEvtPending);
+    if (RTCritSectIsInitialized(&pDisk->CritSect))
+        RTCritSectDelete(&pDisk->CritSect);
+    if (pDisk->pbDisk)
+        RTMemPageFree(pDisk->pbDisk, TST_DISK_SIZE);
+}
+
+
+/* -=-=-=-=- Guest side -=-=-=-=- */
+
+static uint32_t tstRegRead(PPDMDEVINS pDevIns, uint32_t offReg)
+{
+    uint32_t u32Value = 0;
+    nvmeMMIORead(pDevIns, NULL, TST_GCPHYS_MMIO + offReg, &u32Value, sizeof(u32Value));
+    return u32Value;
+}
+
+static void tstRegWrite(PPDMDEVINS pDevIns, uint32_t offReg, uint32_t u32Value)
+{
+    nvmeMMIOWrite(pDevIns, NULL, TST_GCPHYS_MMIO + offReg, &u32Value, sizeof(u32Value));
+}
+
+/**
+ * Waits for CSTS.RDY to reach the given state.
+ *
+ * @returns true if the state was reached, false on timeout.
+ * @param   pDevIns     The device instance.
+ * @param   fRdy        The state to wait for.
+ */
+static bool tstCtrlWaitRdy(PPDMDEVINS pDevIns, bool fRdy)
+{
+    uint64_t const msStart = RTTimeMilliTS();
+    while (RT_BOOL(tstRegRead(pDevIns, NVME_REG_CSTS) & NVME_CSTS_RDY) != fRdy)
+    {
+        if (RTTimeMilliTS() - msStart > 10000)
+            return false;
+        RTThreadSleep(1);
+    }
+    return true;
+}
+
+static void tstQueueInit(PTSTQUEUE pQueue, uint16_t idQueue, uint32_t cSqEntries, uint32_t cCqEntries,
+                         RTGCPHYS GCPhysSq, RTGCPHYS GCPhysCq)
+{
+    pQueue->idQueue    = idQueue;
+    pQueue->cSqEntries = cSqEntries;
+    pQueue->cCqEntries = cCqEntries;
+    pQueue->GCPhysSq   = GCPhysSq;
+    pQueue->GCPhysCq   = GCPhysCq;
+    pQueue->idxSqTail  = 0;
+    pQueue->idxCqHead  = 0;
+    pQueue->fPhase     = true;
+    memset(&g_pbRam[GCPhysSq], 0, cSqEntries * sizeof(NVMECMD));
+    memset(&g_pbRam[GCPhysCq], 0, cCqEntries * sizeof(NVMECQE));
+}
+
+/**
+ * Places a command into the submission queue without ringing the doorbell.
+ */
+static void tstQueuePut(PTSTQUEUE pQueue, PCNVMECMD pCmd)
+{
+    memcpy(&g_pbRam[pQueue->GCPhysSq + pQueue->idxSqTail * sizeof(NVMECMD)], pCmd, sizeof(*pCmd));
+    pQueue->idxSqTail = (pQueue->idxSqTail + 1) % pQueue->cSqEntries;
+}
+
+static void tstQueueDoorbell(PPDMDEVINS pDevIns, PTSTQUEUE pQueue)
+{
+    ASMCompilerBarrier();
+    tstRegWrite(pDevIns, NVME_DOORBELL_OFF + 2 * pQueue->idQueue * sizeof(uint32_t), pQueue->idxSqTail);
+}
+
+/**
+ * Returns whether the completion queue entry at the given distance from the head was posted.
+ */
+static bool tstQueuePeek(PTSTQUEUE pQueue, uint32_t iEntry, PNVMECQE pCqe)
+{
+    uint32_t idx    = (pQueue->idxCqHead + iEntry) % pQueue->cCqEntries;
+    bool     fPhase = pQueue->idxCqHead + iEntry < pQueue->cCqEntries ? pQueue->fPhase : !pQueue->fPhase;
+
+    RTSemFastMutexRequest(g_hMtxRam);
+    memcpy(pCqe, &g_pbRam[pQueue->GCPhysCq + idx * sizeof(NVMECQE)], sizeof(*pCqe));
+    RTSemFastMutexRelease(g_hMtxRam);
+
+    return RT_BOOL(pCqe->u16Status & 1) == fPhase;
+}
+
+/**
+ * Waits for the next completion queue entry and consumes it.
+ *
+ * @returns true if an entry was consumed, false on timeout.
+ */
+static bool tstQueueReap(PPDMDEVINS pDevIns, PTSTQUEUE pQueue, PNVMECQE pCqe)
+{
+    uint64_t const msStart = RTTimeMilliTS();
+    while (!tstQueuePeek(pQueue, 0, pCqe))
+    {
+        if (RTTimeMilliTS() - msStart > 30000)
+        {
+            RTTestFailed(g_hTest, "Timed out waiting for a completion on queue %u\n", pQueue->idQueue);
+            return false;
+        }
+        RTThreadYield();
+    }
+
+    RTTEST_CHECK(g_hTest, pCqe->u16SqId == pQueue->idQueue);
+
+    pQueue->idxCqHead++;
+    if (pQueue->idxCqHead == pQueue->cCqEntries)
+    {
+        pQueue->idxCqHead = 0;
+        pQueue->fPhase    = !pQueue->fPhase;
+    }
+    tstRegWrite(pDevIns, NVME_DOORBELL_OFF + (2 * pQueue->idQueue + 1) * sizeof(uint32_t), pQueue->idxCqHead);
+    return true;
+}
+
+/**
+ * Executes a single command on the given queue and waits for it to complete.
+ *
+ * @returns The status field of the completion (without the phase tag), UINT16_MAX on timeout.
+ */
+static uint16_t tstCmdExec(PPDMDEVINS pDevIns, PTSTQUEUE pQueue, PNVMECMD pCmd, uint32_t *pu32Dw0)
+{
+    static uint16_t volatile s_u16Cid = 0;
+    NVMECQE Cqe;
+
+    pCmd->u16Cid = ASMAtomicIncU16(&s_u16Cid);
+    tstQueuePut(pQueue, pCmd);
+    tstQueueDoorbell(pDevIns, pQueue);
+    if (!tstQueueReap(pDevIns, pQueue, &Cqe))
+        return UINT16_MAX;
+
+    RTTEST_CHECK(g_hTest, Cqe.u16Cid == pCmd->u16Cid);
+    if (pu32Dw0)
+        *pu32Dw0 = Cqe.u32Dw0;
+    return Cqe.u16Status & ~(uint16_t)1;
+}
+
+static uint16_t tstAdmCmdExec(PPDMDEVINS pDevIns, PNVMECMD pCmd, uint32_t *pu32Dw0)
+{
+    return tstCmdExec(pDevIns, &g_AdmQueue, pCmd, pu32Dw0);
+}
+
+/**
+ * Creates an I/O queue pair.
+ */
+static void tstIoQueueCreate(PPDMDEVINS pDevIns, uint16_t idQueue, uint32_t cCqEntries, uint32_t cSqEntries)
+{
+    PTSTQUEUE pQueue = &g_aIoQueues[idQueue];
+    NVMECMD Cmd;
+
+    tstQueueInit(pQueue, idQueue, cSqEntries, cCqEntries, TST_GCPHYS_IO_SQ(idQueue), TST_GCPHYS_IO_CQ(idQueue));
+
+    RT_ZERO(Cmd);
+    Cmd.u8Opc   = NVME_ADM_OPC_CREATE_IO_CQ;
+    Cmd.u64Prp1 = pQueue->GCPhysCq;
+    NVME_CMD_CDW(&Cmd, 10) = ((cCqEntries - 1) << 16) | idQueue;
+    NVME_CMD_CDW(&Cmd, 11) = ((uint32_t)idQueue << 16) | RT_BIT_32(1) /* IEN */ | RT_BIT_32(0) /* PC */;
+    RTTEST_CHECK(g_hTest, tstAdmCmdExec(pDevIns, &Cmd, NULL) == NVME_STATUS_SUCCESS);
+
+    RT_ZERO(Cmd);
+    Cmd.u8Opc   = NVME_ADM_OPC_CREATE_IO_SQ;
+    Cmd.u64Prp1 = pQueue->GCPhysSq;
+    NVME_CMD_CDW(&Cmd, 10) = ((cSqEntries - 1) << 16) | idQueue;
+    NVME_CMD_CDW(&Cmd, 11) = ((uint32_t)idQueue << 16) | RT_BIT_32(0) /* PC */;
+    RTTEST_CHECK(g_hTest, tstAdmCmdExec(pDevIns, &Cmd, NULL) == NVME_STATUS_SUCCESS);
+}
+
+/**
+ * Deletes an I/O queue pair.
+ */
+static void tstIoQueueDelete(PPDMDEVINS pDevIns, uint16_t idQueue)
+{
+    NVMECMD Cmd;
+
+    RT_ZERO(Cmd);
+    Cmd.u8Opc = NVME_ADM_OPC_DELETE_IO_SQ;
+    NVME_CMD_CDW(&Cmd, 10) = idQueue;
+    RTTEST_CHECK(g_hTest, tstAdmCmdExec(pDevIns, &Cmd, NULL) == NVME_STATUS_SUCCESS);
+
+    RT_ZERO(Cmd);
+    Cmd.u8Opc = NVME_ADM_OPC_DELETE_IO_CQ;
+    NVME_CMD_CDW(&Cmd, 10) = idQueue;
+    RTTEST_CHECK(g_hTest, tstAdmCmdExec(pDevIns, &Cmd, NULL) == NVME_STATUS_SUCCESS);
+}
+
+/**
+ * Returns the byte of the test pattern at the given offset of a transfer.
+ */
+DECLINLINE(uint8_t) tstPatternByte(uint16_t idQueue, uint32_t iSlot, uint32_t iRound, uint32_t off)
+{
+    return (uint8_t)(off * 7 + (off >> 9) + iSlot * 13 + iRound * 29 + idQueue * 71);
+}
+
+/**
+ * Fills in a read or write command for the given slot of an I/O queue, the
+ * slots use different sizes and alignments to cover PRP lists and both the
+ * copy and the S/G buffer path of the device.
+ *
+ * @returns Pointer to the guest buffer of the slot.
+ */
+static uint8_t *tstIoCmdPrepare(uint16_t idQueue, uint32_t iSlot, uint8_t u8Opc, PNVMECMD pCmd, uint32_t *pcbXfer)
+{
+    RTGCPHYS GCPhysSlot = TST_GCPHYS_IO_DATA(idQueue) + iSlot * TST_IO_SLOT_SIZE;
+    RTGCPHYS GCPhysData = GCPhysSlot + (iSlot % 3 == 0 ? 0 : iSlot % 3 == 1 ? 0x200 : 0x100);
+    uint32_t cbXfer     = ((iSlot % 4) + 1) * NVME_PAGE_SIZE;
+    uint64_t uLba       = (uint64_t)(idQueue - 1) * TST_IO_QUEUE_SECTORS + iSlot * (TST_IO_SLOT_SIZE / TST_DISK_SECTOR_SIZE);
+
+    RT_ZERO(*pCmd);
+    pCmd->u8Opc   = u8Opc;
+    pCmd->u16Cid  = (uint16_t)iSlot;
+    pCmd->u32Nsid = 1;
+    pCmd->u64Prp1 = GCPhysData;
+    NVME_CMD_CDW(pCmd, 10) = (uint32_t)uLba;
+    NVME_CMD_CDW(pCmd, 11) = (uint32_t)(uLba >> 32);
+    NVME_CMD_CDW(pCmd, 12) = cbXfer / TST_DISK_SECTOR_SIZE - 1;
+
+    /* Pages following the first one, PRP 2 points to a list if there are more than one. */
+    uint32_t cPages = (uint32_t)(((GCPhysData & NVME_PAGE_OFFSET_MASK) + cbXfer + NVME_PAGE_SIZE - 1) >> NVME_PAGE_SHIFT);
+    if (cPages == 2)
+        pCmd->u64Prp2 = GCPhysSlot + NVME_PAGE_SIZE;
+    else if (cPages > 2)
+    {
+        uint64_t *pau64PrpList = (uint64_t *)&g_pbRam[GCPhysSlot + TST_IO_SLOT_PRP_LIST_OFF];
+        for (uint32_t i = 1; i < cPages; i++)
+            pau64PrpList[i - 1] = GCPhysSlot + i * NVME_PAGE_SIZE;
+        pCmd->u64Prp2 = GCPhysSlot + TST_IO_SLOT_PRP_LIST_OFF;
+    }
+
+    *pcbXfer = cbXfer;
+    return &g_pbRam[GCPhysData];
+}
+
+/**
+ * Submits a full queue depth of commands and waits for all of them to complete.
+ *
+ * @returns Number of failed commands.
+ */
+static uint32_t tstIoQueueRun(PPDMDEVINS pDevIns, PTSTQUEUE pQueue, uint8_t u8Opc, uint32_t iRound)
+{
+    uint32_t cErrors = 0;
+
+    for (uint32_t iSlot = 0; iSlot < TST_IO_QUEUE_DEPTH; iSlot++)
+    {
+        NVMECMD Cmd;
+        uint32_t cbXfer;
+        uint8_t *pbData = tstIoCmdPrepare(pQueue->idQueue, iSlot, u8Opc, &Cmd, &cbXfer);
+
+        if (u8Opc == NVME_NVM_OPC_WRITE)
+        {
+            for (uint32_t off = 0; off < cbXfer; off++)
+                pbData[off] = tstPatternByte(pQueue->idQueue, iSlot, iRound, off);
+        }
+        else
+            memset(pbData, 0xf6, cbXfer);
+
+        tstQueuePut(pQueue, &Cmd);
+
+        /* Ring the doorbell in bursts of varying size. */
+        if ((iSlot + iRound) % 5 == 4 || iSlot == TST_IO_QUEUE_DEPTH - 1)
+            tstQueueDoorbell(pDevIns, pQueue);
+    }
+
+    uint32_t fSlotsDone = 0;
+    AssertCompile(TST_IO_QUEUE_DEPTH <= 32);
+    for (uint32_t i = 0; i < TST_IO_QUEUE_DEPTH; i++)
+    {
+        NVMECQE Cqe;
+        if (!tstQueueReap(pDevIns, pQueue, &Cqe))
+            return cErrors + TST_IO_QUEUE_DEPTH - i;
+
+        if (   Cqe.u16Cid >= TST_IO_QUEUE_DEPTH
+            || (fSlotsDone & RT_BIT_32(Cqe.u16Cid)))
+        {
+            RTTestFailed(g_hTest, "Queue %u: unexpected or duplicate completion for CID %#x\n", pQueue->idQueue, Cqe.u16Cid);
+            cErrors++;
+            continue;
+        }
+        fSlotsDone |= RT_BIT_32(Cqe.u16Cid);
+
+        if ((Cqe.u16Status & ~(uint16_t)1) != NVME_STATUS_SUCCESS)
+        {
+            RTTestFailed(g_hTest, "Queue %u: command %#x failed with %#x\n", pQueue->idQueue, Cqe.u16Cid, Cqe.u16Status);
+            cErrors++;
+            continue;
+        }
+
+        if (u8Opc == NVME_NVM_OPC_READ)
+        {
+            NVMECMD Cmd;
+            uint32_t cbXfer;
+            uint8_t *pbData = tstIoCmdPrepare(pQueue->idQueue, Cqe.u16Cid, u8Opc, &Cmd, &cbXfer);
+
+            for (uint32_t off = 0; off < cbXfer; off++)
+                if (pbData[off] != tstPatternByte(pQueue->idQueue, Cqe.u16Cid, iRound, off))
+                {
+                    RTTestFailed(g_hTest, "Queue %u: data mismatch for CID %#x at offset %#x in round %u\n",
+                                 pQueue->idQueue, Cqe.u16Cid, off, iRound);
+                    cErrors++;
+                    break;
+                }
+        }
+    }
+
+    return cErrors;
+}
+
+
+/**
+ * State of a thread running the workload on one I/O queue pair.
+ */
+typedef struct TSTIOTHREAD
+{
+    /** The device instance. */
+    PPDMDEVINS                  pDevIns;
+    /** The queue pair used. */
+    PTSTQUEUE                   pQueue;
+    /** The thread handle. */
+    RTTHREAD                    hThread;
+    /** Number of failed commands. */
+    uint32_t                    cErrors;
+} TSTIOTHREAD;
+/** Pointer to the state of a workload thread. */
+typedef TSTIOTHREAD *PTSTIOTHREAD;
+
+/**
+ * Thread running the write/read-verify workload on one I/O queue pair.
+ */
+static DECLCALLBACK(int) tstIoQueueThread(RTTHREAD hSelf, void *pvUser)
+{
+    RT_NOREF1(hSelf);
+    PTSTIOTHREAD pIoThrd = (PTSTIOTHREAD)pvUser;
+
+    for (uint32_t iRound = 0; iRound < TST_IO_ROUNDS && !pIoThrd->cErrors; iRound++)
+    {
+        pIoThrd->cErrors += tstIoQueueRun(pIoThrd->pDevIns, pIoThrd->pQueue, NVME_NVM_OPC_WRITE, iRound);
+        pIoThrd->cErrors += tstIoQueueRun(pIoThrd->pDevIns, pIoThrd->pQueue, NVME_NVM_OPC_READ, iRound);
+    }
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Checks that malformed commands complete with the proper status.
+ */
+static void tstIoErrors(PPDMDEVINS pDevIns, PTSTQUEUE pQueue)
+{
+    RTTestSub(g_hTest, "Error handling");
+
+    NVMECMD Cmd;
+    uint32_t cbXfer;
+
+    /* Namespace without a medium. */
+    tstIoCmdPrepare(pQueue->idQueue, 0, NVME_NVM_OPC_READ, &Cmd, &cbXfer);
+    Cmd.u32Nsid = 2;
+    uint16_t u16Status = tstCmdExec(pDevIns, pQueue, &Cmd, NULL);
+    RTTEST_CHECK_MSG(g_hTest,    TST_STATUS_SCT(u16Status) == NVME_SCT_GENERIC
+                              && TST_STATUS_SC(u16Status) == NVME_SC_NS_NOT_READY, (g_hTest, "%#x\n", u16Status));
+
+    /* Namespace which doesn't exist. */
+    tstIoCmdPrepare(pQueue->idQueue, 0, NVME_NVM_OPC_READ, &Cmd, &cbXfer);
+    Cmd.u32Nsid = 3;
+    u16Status = tstCmdExec(pDevIns, pQueue, &Cmd, NULL);
+    RTTEST_CHECK_MSG(g_hTest,    TST_STATUS_SCT(u16Status) == NVME_SCT_GENERIC
+                              && TST_STATUS_SC(u16Status) == NVME_SC_INVALID_NAMESPACE, (g_hTest, "%#x\n", u16Status));
+
+    /* Transfer crossing the end of the namespace. */
+    tstIoCmdPrepare(pQueue->idQueue, 0, NVME_NVM_OPC_WRITE, &Cmd, &cbXfer);
+    NVME_CMD_CDW(&Cmd, 10) = TST_DISK_SIZE / TST_DISK_SECTOR_SIZE - 1;
+    u16Status = tstCmdExec(pDevIns, pQueue, &Cmd, NULL);
+    RTTEST_CHECK_MSG(g_hTest,    TST_STATUS_SCT(u16Status) == NVME_SCT_GENERIC
+                              && TST_STATUS_SC(u16Status) == NVME_SC_LBA_OUT_OF_RANGE, (g_hTest, "%#x\n", u16Status));
+
+    /* Unknown opcode. */
+    RT_ZERO(Cmd);
+    Cmd.u8Opc   = 0x7f;
+    Cmd.u32Nsid = 1;
+    u16Status = tstCmdExec(pDevIns, pQueue, &Cmd, NULL);
+    RTTEST_CHECK_MSG(g_hTest,    TST_STATUS_SCT(u16Status) == NVME_SCT_GENERIC
+                              && TST_STATUS_SC(u16Status) == NVME_SC_INVALID_OPCODE, (g_hTest, "%#x\n", u16Status));
+
+    /* A flush and a discard of the first slot should just work. */
+    RT_ZERO(Cmd);
+    Cmd.u8Opc   = NVME_NVM_OPC_FLUSH;
+    Cmd.u32Nsid = 1;
+    RTTEST_CHECK(g_hTest, tstCmdExec(pDevIns, pQueue, &Cmd, NULL) == NVME_STATUS_SUCCESS);
+
+    NVMEDSMRANGE *pRange = (NVMEDSMRANGE *)&g_pbRam[TST_GCPHYS_IDENTIFY];
+    RT_ZERO(*pRange);
+    pRange->cLbas       = 8;
+    pRange->u64LbaStart = (uint64_t)(pQueue->idQueue - 1) * TST_IO_QUEUE_SECTORS;
+    RT_ZERO(Cmd);
+    Cmd.u8Opc   = NVME_NVM_OPC_DSM;
+    Cmd.u32Nsid = 1;
+    Cmd.u64Prp1 = TST_GCPHYS_IDENTIFY;
+    NVME_CMD_CDW(&Cmd, 11) = RT_BIT_32(2); /* AD */
+    RTTEST_CHECK(g_hTest, tstCmdExec(pDevIns, pQueue, &Cmd, NULL) == NVME_STATUS_SUCCESS);
+    RTTEST_CHECK(g_hTest, ASMMemIsZero(&g_Disk.pbDisk[pRange->u64LbaStart * TST_DISK_SECTOR_SIZE], 8 * TST_DISK_SECTOR_SIZE));
+}
+
+/**
+ * Checks that a completion queue which is too small for the commands
+ * submitted holds back the completions instead of overwriting entries.
+ */
+static void tstIoCompQueueFull(PPDMDEVINS pDevIns)
+{
+    RTTestSub(g_hTest, "Completion queue full");
+
+    uint32_t const cCqEntries = 4;
+    uint32_t const cCmds      = 12;
+    PTSTQUEUE pQueue = &g_aIoQueues[TST_IO_QUEUE_SMALL];
+    tstIoQueueCreate(pDevIns, TST_IO_QUEUE_SMALL, cCqEntries, TST_IO_QUEUE_ENTRIES);
+
+    for (uint32_t i = 0; i < cCmds; i++)
+    {
+        NVMECMD Cmd;
+        RT_ZERO(Cmd);
+        Cmd.u8Opc   = NVME_NVM_OPC_FLUSH;
+        Cmd.u16Cid  = (uint16_t)i;
+        Cmd.u32Nsid = 1;
+        tstQueuePut(pQueue, &Cmd);
+    }
+
+    tstQueueDoorbell(pDevIns, pQueue);
+
+    /* Give the worker time to overrun the queue if it is broken. */
+    RTThreadSleep(100);
+    uint32_t cPosted = 0;
+    NVMECQE Cqe;
+    while (cPosted < cCqEntries && tstQueuePeek(pQueue, cPosted, &Cqe))
+        cPosted++;
+    RTTEST_CHECK_MSG(g_hTest, cPosted > 0 && cPosted < cCqEntries, (g_hTest, "cPosted=%u\n", cPosted));
+
+    uint32_t fCidsDone = 0;
+    for (uint32_t i = 0; i < cCmds; i++)
+    {
+        if (!tstQueueReap(pDevIns, pQueue, &Cqe))
+            break;
+        RTTEST_CHECK(g_hTest, (Cqe.u16Status & ~(uint16_t)1) == NVME_STATUS_SUCCESS);
+        RTTEST_CHECK(g_hTest, Cqe.u16Cid < cCmds && !(fCidsDone & RT_BIT_32(Cqe.u16Cid)));
+        fCidsDone |= RT_BIT_32(Cqe.u16Cid & 31);
+    }
+    RTTEST_CHECK(g_hTest, fCidsDone == RT_BIT_32(cCmds) - 1);
+
+    tstIoQueueDelete(pDevIns, TST_IO_QUEUE_SMALL);
+}
+
+/**
+ * Enables the controller and runs the workload.
+ */
+static void tstWorkload(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    RTTestSub(g_hTest, "Controller enable");
+
+    uint32_t u32Cap = tstRegRead(pDevIns, NVME_REG_CAP);
+    RTTEST_CHECK(g_hTest, (u32Cap & 0xffff) + 1 >= TST_ADM_QUEUE_ENTRIES);
+    RTTEST_CHECK(g_hTest, tstRegRead(pDevIns, NVME_REG_VS) == NVME_VERSION);
+
+    /* Use MSI-X so every completion queue signals its own vector. */
+    RTTEST_CHECK_RETV(g_hTest, pThis->cMsixVectors > TST_IO_QUEUE_SMALL);
+    uint16_t u16MsgCtrl = PCIDevGetWord(&pThis->PciDev, NVME_PCI_MSIX_CAP_OFF + VBOX_MSIX_CAP_MESSAGE_CONTROL);
+    PCIDevSetWord(&pThis->PciDev, NVME_PCI_MSIX_CAP_OFF + VBOX_MSIX_CAP_MESSAGE_CONTROL, u16MsgCtrl | VBOX_PCI_MSIX_FLAGS_ENABLE);
+
+    tstQueueInit(&g_AdmQueue, 0, TST_ADM_QUEUE_ENTRIES, TST_ADM_QUEUE_ENTRIES, TST_GCPHYS_ASQ, TST_GCPHYS_ACQ);
+    tstRegWrite(pDevIns, NVME_REG_AQA, ((TST_ADM_QUEUE_ENTRIES - 1) << 16) | (TST_ADM_QUEUE_ENTRIES - 1));
+    tstRegWrite(pDevIns, NVME_REG_ASQ, (uint32_t)TST_GCPHYS_ASQ);
+    tstRegWrite(pDevIns, NVME_REG_ASQ_HI, 0);
+    tstRegWrite(pDevIns, NVME_REG_ACQ, (uint32_t)TST_GCPHYS_ACQ);
+    tstRegWrite(pDevIns, NVME_REG_ACQ_HI, 0);
+    tstRegWrite(pDevIns, NVME_REG_CC, NVME_CC_EN | (NVME_SQES_LOG2 << 16) | (NVME_CQES_LOG2 << 20));
+    RTTEST_CHECK_RETV(g_hTest, tstCtrlWaitRdy(pDevIns, true));
+
+    RTTestSub(g_hTest, "Admin commands");
+
+    NVMECMD Cmd;
+    RT_ZERO(Cmd);
+    Cmd.u8Opc   = NVME_ADM_OPC_IDENTIFY;
+    Cmd.u64Prp1 = TST_GCPHYS_IDENTIFY;
+    NVME_CMD_CDW(&Cmd, 10) = NVME_IDENTIFY_CNS_CONTROLLER;
+    RTTEST_CHECK(g_hTest, tstAdmCmdExec(pDevIns, &Cmd, NULL) == NVME_STATUS_SUCCESS);
+    NVMEIDCTRL *pIdCtrl = (NVMEIDCTRL *)&g_pbRam[TST_GCPHYS_IDENTIFY];
+    RTTEST_CHECK(g_hTest, pIdCtrl->u32Nn == 1);
+    RTTEST_CHECK(g_hTest, pIdCtrl->u8Sqes == ((NVME_SQES_LOG2 << 4) | NVME_SQES_LOG2));
+    RTTEST_CHECK(g_hTest, !memcmp(pIdCtrl->achMn, "ORCL-VBOX-NVME-VER12", sizeof("ORCL-VBOX-NVME-VER12") - 1));
+
+    RT_ZERO(Cmd);
+    Cmd.u8Opc   = NVME_ADM_OPC_IDENTIFY;
+    Cmd.u32Nsid = 1;
+    Cmd.u64Prp1 = TST_GCPHYS_IDENTIFY;
+    NVME_CMD_CDW(&Cmd, 10) = NVME_IDENTIFY_CNS_NAMESPACE;
+    RTTEST_CHECK(g_hTest, tstAdmCmdExec(pDevIns, &Cmd, NULL) == NVME_STATUS_SUCCESS);
+    RTTEST_CHECK(g_hTest, *(uint64_t *)&g_pbRam[TST_GCPHYS_IDENTIFY] == TST_DISK_SIZE / TST_DISK_SECTOR_SIZE);
+
+    uint32_t u32Dw0 = 0;
+    RT_ZERO(Cmd);
+    Cmd.u8Opc = NVME_ADM_OPC_SET_FEATURES;
+    NVME_CMD_CDW(&Cmd, 10) = NVME_FEAT_NUMBER_OF_QUEUES;
+    NVME_CMD_CDW(&Cmd, 11) = ((TST_IO_QUEUE_SMALL - 1) << 16) | (TST_IO_QUEUE_SMALL - 1);
+    RTTEST_CHECK(g_hTest, tstAdmCmdExec(pDevIns, &Cmd, &u32Dw0) == NVME_STATUS_SUCCESS);
+    RTTEST_CHECK(g_hTest, (u32Dw0 & 0xffff) + 1 >= TST_IO_QUEUE_SMALL && (u32Dw0 >> 16) + 1 >= TST_IO_QUEUE_SMALL);
+
+    /* Creating a submission queue for a non existing completion queue must fail. */
+    RT_ZERO(Cmd);
+    Cmd.u8Opc   = NVME_ADM_OPC_CREATE_IO_SQ;
+    Cmd.u64Prp1 = TST_GCPHYS_IO_SQ(1);
+    NVME_CMD_CDW(&Cmd, 10) = ((TST_IO_QUEUE_ENTRIES - 1) << 16) | 1;
+    NVME_CMD_CDW(&Cmd, 11) = (1 << 16) | RT_BIT_32(0);
+    RTTEST_CHECK(g_hTest, tstAdmCmdExec(pDevIns, &Cmd, NULL) == NVME_STATUS_CMD_SPECIFIC(NVME_SC_CQ_INVALID));
+
+    for (uint16_t idQueue = 1; idQueue <= TST_IO_QUEUES; idQueue++)
+        tstIoQueueCreate(pDevIns, idQueue, TST_IO_QUEUE_ENTRIES, TST_IO_QUEUE_ENTRIES);
+    if (RTTestErrorCount(g_hTest))
+        return;
+
+    RTTestSub(g_hTest, "Parallel I/O queues");
+
+    TSTIOTHREAD aIoThrds[TST_IO_QUEUES];
+    for (uint32_t i = 0; i < RT_ELEMENTS(aIoThrds); i++)
+    {
+        aIoThrds[i].pDevIns = pDevIns;
+        aIoThrds[i].pQueue  = &g_aIoQueues[i + 1];
+        aIoThrds[i].cErrors = 0;
+        int rc = RTThreadCreateF(&aIoThrds[i].hThread, tstIoQueueThread, &aIoThrds[i], 0, RTTHREADTYPE_DEFAULT,
+                                 RTTHREADFLAGS_WAITABLE, "IoQueue%u", i + 1);
+        RTTESTI_CHECK_RC_OK(rc);
+        if (RT_FAILURE(rc))
+            aIoThrds[i].hThread = NIL_RTTHREAD;
+    }
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(aIoThrds); i++)
+        if (aIoThrds[i].hThread != NIL_RTTHREAD)
+        {
+            RTThreadWait(aIoThrds[i].hThread, RT_INDEFINITE_WAIT, NULL);
+            RTTEST_CHECK_MSG(g_hTest, !aIoThrds[i].cErrors, (g_hTest, "Queue %u: %u errors\n", i + 1, aIoThrds[i].cErrors));
+        }
+
+    /* Every completion queue has its own vector, the admin one included. */
+    for (uint32_t i = 0; i <= TST_IO_QUEUES; i++)
+        RTTEST_CHECK_MSG(g_hTest, g_acIrqs[i] > 0, (g_hTest, "No interrupt on vector %u\n", i));
+    RTTestPrintf(g_hTest, RTTESTLVL_ALWAYS, "%u requests with direct guest memory access, %u copied\n",
+                 g_Disk.cReqsSgBuf, g_Disk.cReqsCopy);
+    RTTEST_CHECK(g_hTest, g_Disk.cReqsSgBuf > 0 && g_Disk.cReqsCopy > 0);
+
+    tstIoErrors(pDevIns, &g_aIoQueues[1]);
+    tstIoCompQueueFull(pDevIns);
+
+    RTTestSub(g_hTest, "Controller disable");
+
+    for (uint16_t idQueue = 1; idQueue <= TST_IO_QUEUES; idQueue++)
+        tstIoQueueDelete(pDevIns, idQueue);
+
+    tstRegWrite(pDevIns, NVME_REG_CC, 0);
+    RTTEST_CHECK(g_hTest, tstCtrlWaitRdy(pDevIns, false));
+    RTTEST_CHECK(g_hTest, ASMAtomicReadU32(&g_Disk.cReqsAllocated) == 0);
+}
+
+int main()
+{
+    int rc = RTTestInitAndCreate("tstDevNVMe", &g_hTest);
+    if (rc)
+        return rc;
+    RTTestBanner(g_hTest);
+
+    g_pbRam = (uint8_t *)RTMemPageAllocZ(TST_RAM_SIZE);
+    RTTEST_CHECK_RET(g_hTest, g_pbRam != NULL, RTTestSummaryAndDestroy(g_hTest));
+    RTTESTI_CHECK_RC_OK_RET(RTSemFastMutexCreate(&g_hMtxRam), RTTestSummaryAndDestroy(g_hTest));
+    RTTESTI_CHECK_RC_OK_RET(tstDiskCreate(&g_Disk), RTTestSummaryAndDestroy(g_hTest));
+
+    g_DevHlp.u32Version                     = PDM_DEVHLPR3_VERSION;
+    g_DevHlp.pfnMMIORegister                = tstDevHlpMMIORegister;
+    g_DevHlp.pfnSSMRegister                 = tstDevHlpSSMRegister;
+    g_DevHlp.pfnPCIPhysRead                 = tstDevHlpPCIPhysRead;
+    g_DevHlp.pfnPCIPhysWrite                = tstDevHlpPCIPhysWrite;
+    g_DevHlp.pfnPCIRegister                 = tstDevHlpPCIRegister;
+    g_DevHlp.pfnPCIRegisterMsi              = tstDevHlpPCIRegisterMsi;
+    g_DevHlp.pfnPCIIORegionRegister         = tstDevHlpPCIIORegionRegister;
+    g_DevHlp.pfnPCISetIrq                   = tstDevHlpPCISetIrq;
+    g_DevHlp.pfnPhysGCPhys2CCPtr            = tstDevHlpPhysGCPhys2CCPtr;
+    g_DevHlp.pfnPhysGCPhys2CCPtrReadOnly    = tstDevHlpPhysGCPhys2CCPtrReadOnly;
+    g_DevHlp.pfnPhysReleasePageMappingLock  = tstDevHlpPhysReleasePageMappingLock;
+    g_DevHlp.pfnCritSectGetNop              = tstDevHlpCritSectGetNop;
+    g_DevHlp.pfnSetDeviceCritSect           = tstDevHlpSetDeviceCritSect;
+    g_DevHlp.pfnCritSectInit                = tstDevHlpCritSectInit;
+    g_DevHlp.pfnGetSupDrvSession            = tstDevHlpGetSupDrvSession;
+    g_DevHlp.pfnQueueCreate                 = tstDevHlpQueueCreate;
+    g_DevHlp.pfnThreadCreate                = tstDevHlpThreadCreate;
+    g_DevHlp.pfnMMHeapAllocZ                = tstDevHlpMMHeapAllocZ;
+    g_DevHlp.pfnMMHeapFree                  = tstDevHlpMMHeapFree;
+    g_DevHlp.pfnDriverAttach                = tstDevHlpDriverAttach;
+    g_DevHlp.pfnSTAMRegisterV               = tstDevHlpSTAMRegisterV;
+    g_DevHlp.pfnDBGFInfoRegister            = tstDevHlpDBGFInfoRegister;
+    g_DevHlp.pfnVMSetError                  = tstDevHlpVMSetError;
+    g_DevHlp.pfnVMSetErrorV                 = tstDevHlpVMSetErrorV;
+    g_DevHlp.u32TheEnd                      = PDM_DEVHLPR3_VERSION;
+
+    /*
+     * Construct the device with ring-0 and raw-mode disabled, the doorbells are
+     * written from the workload threads directly.
+     */
+    RTTestSub(g_hTest, "Construct");
+    PCFGMNODE pCfg = CFGMR3CreateTree(NULL);
+    RTTEST_CHECK_RET(g_hTest, pCfg != NULL, RTTestSummaryAndDestroy(g_hTest));
+    RTTESTI_CHECK_RC_OK(CFGMR3InsertInteger(pCfg, "GCEnabled", 0));
+    RTTESTI_CHECK_RC_OK(CFGMR3InsertInteger(pCfg, "R0Enabled", 0));
+    RTTESTI_CHECK_RC_OK(CFGMR3InsertInteger(pCfg, "NamespacesMax", 2));
+    RTTESTI_CHECK_RC_OK(CFGMR3InsertInteger(pCfg, "QueuesMax", 8));
+    /* Fewer workers than I/O queues so a worker has to serve several queues. */
+    RTTESTI_CHECK_RC_OK(CFGMR3InsertInteger(pCfg, "WorkerThreadsMax", 2));
+
+    PPDMDEVINS pDevIns = (PPDMDEVINS)RTMemAllocZ(RT_OFFSETOF(PDMDEVINS, achInstanceData[g_DeviceNVMe.cbInstance]));
+    RTTEST_CHECK_RET(g_hTest, pDevIns != NULL, RTTestSummaryAndDestroy(g_hTest));
+    pDevIns->u32Version       = PDM_DEVINS_VERSION;
+    pDevIns->iInstance        = 0;
+    pDevIns->pHlpR3           = &g_DevHlp;
+    pDevIns->pvInstanceDataR3 = &pDevIns->achInstanceData[0];
+    pDevIns->pReg             = &g_DeviceNVMe;
+    pDevIns->pCfg             = pCfg;
+
+    rc = g_DeviceNVMe.pfnConstruct(pDevIns, 0, pCfg);
+    RTTESTI_CHECK_RC_OK(rc);
+    if (RT_SUCCESS(rc))
+        tstWorkload(pDevIns);
+
+    /*
+     * Stop the worker threads like PDM does when powering off and destroy everything.
+     */
+    for (uint32_t i = 0; i < g_cThreads; i++)
+    {
+        PPDMTHREAD pThread = g_apThreads[i];
+        ASMAtomicWriteU32((volatile uint32_t *)&pThread->enmState, PDMTHREADSTATE_TERMINATING);
+        pThread->u.Dev.pfnWakeUp(pDevIns, pThread);
+        RTThreadWait(pThread->Thread, RT_INDEFINITE_WAIT, NULL);
+        RTMemFree(pThread);
+    }
+
+    g_DeviceNVMe.pfnDestruct(pDevIns);
+    RTMemFree(PDMINS_2_DATA(pDevIns, PNVME)->paNamespacesR3);
+    RTMemFree(pDevIns);
+    CFGMR3RemoveNode(pCfg);
+    tstDiskDestroy(&g_Disk);
+    RTSemFastMutexDestroy(g_hMtxRam);
+    RTMemPageFree(g_pbRam, TST_RAM_SIZE);
+
+    return RTTestSummaryAndDestroy(g_hTest);
+}
@@ -518,7 +518,7 @@ int vpciIOPortOut(PPDMDEVINS                pDevIns,
                     pState->uGuestFeatures = u32 & uHostFeatures;
                 }
             }
-            pCallbacks->pfnSetHostFeatures(pState, pState->uGuestFeatures);
+            rc = pCallbacks->pfnSetHostFeatures(pState, pState->uGuestFeatures);
             break;
         }
 
@@ -786,6 +786,9 @@ int vpciLoadExec(PVPCISTATE pState, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t
         {
             rc = SSMR3GetU32(pSSM, &pState->nQueues);
             AssertRCReturn(rc, rc);
+            AssertLogRelMsgReturn(pState->nQueues <= VIRTIO_MAX_NQUEUES,
+                                  ("%s nQueues=%u\n", INSTANCE(pState), pState->nQueues),
+                                  VERR_SSM_LOAD_CONFIG_MISMATCH);
         }
         else
             pState->nQueues = nQueues;
@@ -1377,6 +1377,17 @@ int main()
     GEN_CHECK_OFF(AHCI, cCmdSlotsAvail);
     GEN_CHECK_OFF(AHCI, f8ByteMMIO4BytesWrittenSuccessfully);
     GEN_CHECK_OFF(AHCI, pSupDrvSession);
+    GEN_CHECK_OFF(AHCI, pIntrModTimerR3);
+    GEN_CHECK_OFF(AHCI, u64IntrModFirstTS);
+    GEN_CHECK_OFF(AHCI, cIntrModMaxDelayUs);
+    GEN_CHECK_OFF(AHCI, cIntrModMaxBatch);
+    GEN_CHECK_OFF(AHCI, cIntrModPending);
+    GEN_CHECK_OFF(AHCI, fIntrModPortsPending);
+    GEN_CHECK_OFF(AHCI, fIntrModEnabled);
+    GEN_CHECK_OFF(AHCI, StatIntrModCompletions);
+    GEN_CHECK_OFF(AHCI, StatIntrModInterrupts);
+    GEN_CHECK_OFF(AHCI, StatIntrModDeferred);
+    GEN_CHECK_OFF(AHCI, StatIntrModLatency);
 #endif /* VBOX_WITH_AHCI */
 
 #ifdef VBOX_WITH_E1000
@@ -1505,22 +1516,32 @@ int main()
     GEN_CHECK_OFF(VNETSTATE, pCanRxQueueR0);
     GEN_CHECK_OFF(VNETSTATE, pCanRxQueueRC);
     GEN_CHECK_OFF(VNETSTATE, pLinkUpTimer);
-# ifdef VNET_TX_DELAY
-    GEN_CHECK_OFF(VNETSTATE, pTxTimerR3);
-    GEN_CHECK_OFF(VNETSTATE, pTxTimerR0);
-    GEN_CHECK_OFF(VNETSTATE, pTxTimerRC);
-# endif /* VNET_TX_DELAY */
     GEN_CHECK_OFF(VNETSTATE, config);
     GEN_CHECK_OFF(VNETSTATE, macConfigured);
     GEN_CHECK_OFF(VNETSTATE, fCableConnected);
     GEN_CHECK_OFF(VNETSTATE, u32PktNo);
     GEN_CHECK_OFF(VNETSTATE, fPromiscuous);
     GEN_CHECK_OFF(VNETSTATE, fAllMulti);
-    GEN_CHECK_OFF(VNETSTATE, pRxQueue);
-    GEN_CHECK_OFF(VNETSTATE, pTxQueue);
     GEN_CHECK_OFF(VNETSTATE, pCtlQueue);
+    GEN_CHECK_OFF(VNETSTATE, cQueuePairsMax);
+    GEN_CHECK_OFF(VNETSTATE, cQueuePairs);
+    GEN_CHECK_OFF(VNETSTATE, iRxPairBlocked);
+    GEN_CHECK_OFF(VNETSTATE, fMultiQueue);
+    GEN_CHECK_OFF(VNETSTATE, aRxSteering);
+    GEN_CHECK_OFF(VNETSTATE, aQueuePairs);
+    GEN_CHECK_OFF(VNETSTATE, aQueuePairs[1]);
     GEN_CHECK_OFF(VNETSTATE, fMaybeOutOfSpace);
     GEN_CHECK_OFF(VNETSTATE, hEventMoreRxDescAvail);
+    GEN_CHECK_SIZE(VNETQUEUEPAIR);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, pRxQueue);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, pTxQueue);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, pTxThread);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, hTxEvt);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, iPair);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, fTxSleeping);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, fTxBlocked);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, szRxName);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, StatReceivePackets);
 #endif /* VBOX_WITH_VIRTIO */
 
 #ifdef VBOX_WITH_SCSI
@@ -1917,8 +1938,8 @@ int main()
     GEN_CHECK_OFF(NVMEQUEUEHDR, u16Id);
     GEN_CHECK_OFF(NVMEQUEUEHDR, cEntries);
     GEN_CHECK_OFF(NVMEQUEUEHDR, enmState);
-    GEN_CHECK_OFF(NVMEQUEUEHDR, GCPhysBase);
     GEN_CHECK_OFF(NVMEQUEUEHDR, cbEntry);
+    GEN_CHECK_OFF(NVMEQUEUEHDR, GCPhysBase);
     GEN_CHECK_OFF(NVMEQUEUEHDR, idxHead);
     GEN_CHECK_OFF(NVMEQUEUEHDR, idxTail);
     GEN_CHECK_OFF(NVMEQUEUEHDR, fPhysCont);
@@ -1927,21 +1948,27 @@ int main()
     GEN_CHECK_SIZE(NVMEQUEUESUBM);
     GEN_CHECK_OFF(NVMEQUEUESUBM, Hdr);
     GEN_CHECK_OFF(NVMEQUEUESUBM, u16CompletionQueueId);
-    GEN_CHECK_OFF(NVMEQUEUESUBM, enmPriority);
-    GEN_CHECK_OFF(NVMEQUEUESUBM, hEvtProcess);
-    GEN_CHECK_OFF(NVMEQUEUESUBM, pWrkThrdR3);
-    GEN_CHECK_OFF(NVMEQUEUESUBM, NdLstWrkThrdAssgnd);
+    GEN_CHECK_OFF(NVMEQUEUESUBM, u16CidDelete);
+    GEN_CHECK_OFF(NVMEQUEUESUBM, u32Priority);
+    GEN_CHECK_OFF(NVMEQUEUESUBM, idxWrkThrd);
     GEN_CHECK_OFF(NVMEQUEUESUBM, cReqsActive);
 
     GEN_CHECK_SIZE(NVMEQUEUECOMP);
     GEN_CHECK_OFF(NVMEQUEUECOMP, Hdr);
     GEN_CHECK_OFF(NVMEQUEUECOMP, fIntrEnabled);
+    GEN_CHECK_OFF(NVMEQUEUECOMP, fPhase);
     GEN_CHECK_OFF(NVMEQUEUECOMP, u32IntrVec);
     GEN_CHECK_OFF(NVMEQUEUECOMP, cSubmQueuesRef);
     GEN_CHECK_OFF(NVMEQUEUECOMP, cWaiters);
-    GEN_CHECK_OFF(NVMEQUEUECOMP, LstCompletionsWaiting);
+    GEN_CHECK_OFF(NVMEQUEUECOMP, cReserved);
     GEN_CHECK_OFF(NVMEQUEUECOMP, hMtx);
 
+    GEN_CHECK_SIZE(NVMEWRKTHRD);
+    GEN_CHECK_OFF(NVMEWRKTHRD, pThreadR3);
+    GEN_CHECK_OFF(NVMEWRKTHRD, hEvtProcess);
+    GEN_CHECK_OFF(NVMEWRKTHRD, fWrkThrdSleeping);
+    GEN_CHECK_OFF(NVMEWRKTHRD, idx);
+
     GEN_CHECK_SIZE(NVME);
     GEN_CHECK_OFF(NVME, PciDev);
     GEN_CHECK_OFF(NVME, pDevInsR3);
@@ -1951,56 +1978,55 @@ int main()
     GEN_CHECK_OFF(NVME, ILeds);
     GEN_CHECK_OFF(NVME, pLedsConnector);
     GEN_CHECK_OFF(NVME, pSupDrvSession);
+    GEN_CHECK_OFF(NVME, pNotifierQueueR3);
+    GEN_CHECK_OFF(NVME, pNotifierQueueR0);
+    GEN_CHECK_OFF(NVME, pNotifierQueueRC);
     GEN_CHECK_OFF(NVME, GCPhysMMIO);
-    GEN_CHECK_OFF(NVME, IOPortBase);
     GEN_CHECK_OFF(NVME, cQueuesSubmMax);
     GEN_CHECK_OFF(NVME, cQueuesCompMax);
     GEN_CHECK_OFF(NVME, cQueueEntriesMax);
-    GEN_CHECK_OFF(NVME, cTimeoutMax);
     GEN_CHECK_OFF(NVME, cWrkThrdsMax);
-    GEN_CHECK_OFF(NVME, cCompQueuesWaitersMax);
     GEN_CHECK_OFF(NVME, cNamespaces);
+    GEN_CHECK_OFF(NVME, cMsixVectors);
     GEN_CHECK_OFF(NVME, szSerialNumber);
     GEN_CHECK_OFF(NVME, szModelNumber);
     GEN_CHECK_OFF(NVME, szFirmwareRevision);
     GEN_CHECK_OFF(NVME, fRCEnabled);
     GEN_CHECK_OFF(NVME, fR0Enabled);
+    GEN_CHECK_OFF(NVME, fSignalIdle);
     GEN_CHECK_OFF(NVME, enmState);
+    GEN_CHECK_OFF(NVME, u32RegCc);
+    GEN_CHECK_OFF(NVME, u32RegCsts);
+    GEN_CHECK_OFF(NVME, u32RegAqa);
+    GEN_CHECK_OFF(NVME, u64RegAsq);
+    GEN_CHECK_OFF(NVME, u64RegAcq);
     GEN_CHECK_OFF(NVME, u32IntrMask);
-    GEN_CHECK_OFF(NVME, aIntrVecs);
-    GEN_CHECK_OFF(NVME, u32IoCompletionQueueEntrySize);
-    GEN_CHECK_OFF(NVME, u32IoSubmissionQueueEntrySize);
-    GEN_CHECK_OFF(NVME, uShutdwnNotifierLast);
-    GEN_CHECK_OFF(NVME, uAmsSet);
-    GEN_CHECK_OFF(NVME, uMpsSet);
-    GEN_CHECK_OFF(NVME, uCssSet);
-    GEN_CHECK_OFF(NVME, u32RegIdx);
-    GEN_CHECK_OFF(NVME, cbPage);
-    GEN_CHECK_OFF(NVME, paQueuesSubmR3);
-    GEN_CHECK_OFF(NVME, paQueuesCompR3);
-    GEN_CHECK_OFF(NVME, paQueuesSubmR0);
-    GEN_CHECK_OFF(NVME, paQueuesCompR0);
-    GEN_CHECK_OFF(NVME, paQueuesSubmRC);
-    GEN_CHECK_OFF(NVME, paQueuesCompRC);
-    GEN_CHECK_OFF(NVME, pvCtrlMemBufR3);
-    GEN_CHECK_OFF(NVME, GCPhysCtrlMemBuf);
-    GEN_CHECK_OFF(NVME, cbCtrlMemBuf);
-    GEN_CHECK_OFF(NVME, u32CtrlMemBufSz);
-    GEN_CHECK_OFF(NVME, pWakeQueueR3);
-    GEN_CHECK_OFF(NVME, pWakeQueueR0);
-    GEN_CHECK_OFF(NVME, pWakeQueueRC);
-    GEN_CHECK_OFF(NVME, cAsyncEvtReqsMax);
-    GEN_CHECK_OFF(NVME, CritSectAsyncEvtReqs);
-    GEN_CHECK_OFF(NVME, paAsyncEvtReqCids);
-    GEN_CHECK_OFF(NVME, paNamespaces);
-    GEN_CHECK_OFF(NVME, cWrkThrdsCur);
-    GEN_CHECK_OFF(NVME, cWrkThrdsActive);
-    GEN_CHECK_OFF(NVME, LstWrkThrds);
-    GEN_CHECK_OFF(NVME, CritSectWrkThrds);
-    GEN_CHECK_OFF(NVME, fSignalIdle);
+    GEN_CHECK_OFF(NVME, cQueuesSubmAlloc);
+    GEN_CHECK_OFF(NVME, cQueuesCompAlloc);
+    GEN_CHECK_OFF(NVME, cAsyncEvtReqs);
+    GEN_CHECK_OFF(NVME, au16AsyncEvtReqCids);
+    GEN_CHECK_OFF(NVME, au32Features);
+    GEN_CHECK_OFF(NVME, cReqsActive);
+    GEN_CHECK_OFF(NVME, cThreadsActive);
+    GEN_CHECK_OFF(NVME, cbRead);
+    GEN_CHECK_OFF(NVME, cbWritten);
+    GEN_CHECK_OFF(NVME, cReadCmds);
+    GEN_CHECK_OFF(NVME, cWriteCmds);
+    GEN_CHECK_OFF(NVME, CritSectIntr);
+    GEN_CHECK_OFF(NVME, aQueuesSubm);
+    GEN_CHECK_OFF(NVME, aQueuesSubm[1]);
+    GEN_CHECK_OFF(NVME, aQueuesComp);
+    GEN_CHECK_OFF(NVME, aQueuesComp[1]);
+    GEN_CHECK_OFF(NVME, aWrkThrds);
+    GEN_CHECK_OFF(NVME, aWrkThrds[1]);
+    GEN_CHECK_OFF(NVME, paNamespacesR3);
+    GEN_CHECK_OFF(NVME, paCmdsRedoR3);
+    GEN_CHECK_OFF(NVME, cCmdsRedo);
 # ifdef VBOX_WITH_STATISTICS
-    GEN_CHECK_OFF(NVME, aStatMemXfer[0]);
-    GEN_CHECK_OFF(NVME, aStatMemXfer[NVME_CMBSZ_SUPP_BIT_IDX_MAX]);
+    GEN_CHECK_OFF(NVME, StatDoorbellWritesR3);
+    GEN_CHECK_OFF(NVME, StatDoorbellWritesRZ);
+    GEN_CHECK_OFF(NVME, aStatSubmQueueCmds);
+    GEN_CHECK_OFF(NVME, aStatCompQueueFull);
 # endif
 #endif
 
@@ -6518,6 +6518,7 @@ HRESULT Console::i_saveState(Reason_T aReason, const ComPtr<IProgress> &aProgres
     int vrc = VMR3Save(ptrVM.rawUVM(),
                        aStateFilePath.c_str(),
                        fContinueAfterwards,
+                       SSMCOMPRESSION_DEFAULT,
                        Console::i_stateProgressCallback,
                        static_cast<IProgress *>(aProgress),
                        &aLeftPaused);
@@ -249,6 +249,24 @@ public:
                                 sizeof(VDINTERFACEPROGRESS),
                                 &mVDOperationIfaces);
         AssertRC(vrc);
+        if (RT_FAILURE(vrc))
+        {
+            mRC = E_FAIL;
+            return;
+        }
+
+        /* Per-operation tuning of the copy and merge engine, taken from the
+         * "Special/" properties of the medium the task is working on. */
+        mVDIfConfig.pfnAreKeysValid = vdConfigAreKeysValid;
+        mVDIfConfig.pfnQuerySize    = vdConfigQuerySize;
+        mVDIfConfig.pfnQuery        = vdConfigQuery;
+        vrc = VDInterfaceAdd(&mVDIfConfig.Core,
+                             "Medium::Task::vdInterfaceConfig",
+                             VDINTERFACETYPE_CONFIG,
+                             aMedium,
+                             sizeof(VDINTERFACECONFIG),
+                             &mVDOperationIfaces);
+        AssertRC(vrc);
         if (RT_FAILURE(vrc))
             mRC = E_FAIL;
     }
@@ -316,8 +334,13 @@ private:
     const ComObjPtr<Progress> mProgress;
 
     static DECLCALLBACK(int) vdProgressCall(void *pvUser, unsigned uPercent);
+    static bool vdConfigFind(void *pvUser, const char *pszName, Utf8Str &strValue);
+    static DECLCALLBACK(bool) vdConfigAreKeysValid(void *pvUser, const char *pszzValid);
+    static DECLCALLBACK(int) vdConfigQuerySize(void *pvUser, const char *pszName, size_t *pcbValue);
+    static DECLCALLBACK(int) vdConfigQuery(void *pvUser, const char *pszName, char *pszValue, size_t cchValue);
 
     VDINTERFACEPROGRESS mVDIfProgress;
+    VDINTERFACECONFIG mVDIfConfig;
 
     /* Must have a strong VirtualBox reference during a task otherwise the
      * reference count might drop to 0 while a task is still running. This
@@ -880,6 +903,71 @@ DECLCALLBACK(int) Medium::Task::vdProgressCall(void *pvUser, unsigned uPercent)
     return VINF_SUCCESS;
 }
 
+/**
+ * Looks up the value of a per-operation configuration key, which is stored
+ * as the "Special/" property of the same name of the medium.
+ *
+ * The task runs on its own thread while the properties can be changed through
+ * the API, so the value is copied while holding the medium lock.
+ *
+ * @returns true if the key is set, false otherwise.
+ * @param pvUser      Pointer to the Medium instance.
+ * @param pszName     Name of the configuration key.
+ * @param strValue    Where to store the value.
+ */
+/*static*/
+bool Medium::Task::vdConfigFind(void *pvUser, const char *pszName, Utf8Str &strValue)
+{
+    Medium *that = static_cast<Medium *>(pvUser);
+    AssertReturn(that != NULL, false);
+
+    AutoReadLock alock(that COMMA_LOCKVAL_SRC_POS);
+
+    settings::StringsMap::const_iterator it = that->m->mapProperties.find(Utf8StrFmt("Special/%s", pszName));
+    if (   it == that->m->mapProperties.end()
+        || it->second.isEmpty())
+        return false;
+
+    strValue = it->second;
+    return true;
+}
+
+/*static*/
+DECLCALLBACK(bool) Medium::Task::vdConfigAreKeysValid(void *pvUser, const char * /* pszzValid */)
+{
+    NOREF(pvUser);
+    return true;
+}
+
+/*static*/
+DECLCALLBACK(int) Medium::Task::vdConfigQuerySize(void *pvUser, const char *pszName, size_t *pcbValue)
+{
+    AssertReturn(VALID_PTR(pcbValue), VERR_INVALID_POINTER);
+
+    Utf8Str strValue;
+    if (!vdConfigFind(pvUser, pszName, strValue))
+        return VERR_CFGM_VALUE_NOT_FOUND;
+
+    *pcbValue = strValue.length() + 1 /* include terminator */;
+    return VINF_SUCCESS;
+}
+
+/*static*/
+DECLCALLBACK(int) Medium::Task::vdConfigQuery(void *pvUser, const char *pszName, char *pszValue, size_t cchValue)
+{
+    AssertReturn(VALID_PTR(pszValue), VERR_INVALID_POINTER);
+
+    Utf8Str strValue;
+    if (!vdConfigFind(pvUser, pszName, strValue))
+        return VERR_CFGM_VALUE_NOT_FOUND;
+
+    if (strValue.length() >= cchValue)
+        return VERR_CFGM_NOT_ENOUGH_SPACE;
+
+    memcpy(pszValue, strValue.c_str(), strValue.length() + 1);
+    return VINF_SUCCESS;
+}
+
 /**
  * Implementation code for the "create base" task.
  */
@@ -0,0 +1,298 @@
+; $Id$
+;; @file
+; IPRT - CRC32 and CRC32C, AMD64 and X86 Assembly Workers.
+;
+
+;
+; Copyright (C) 2016 Oracle Corporation
+;
+; This file is part of VirtualBox Open Source Edition (OSE), as
+; available from http://www.virtualbox.org. This file is free software;
+; you can redistribute it and/or modify it under the terms of the GNU
+; General Public License (GPL) as published by the Free Software
+; Foundation, in version 2 as it comes in the "COPYING" file of the
+; VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+; hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+;
+; The contents of this file may alternatively be used under the terms
+; of the Common Development and Distribution License Version 1.0
+; (CDDL) only, as it comes in the "COPYING.CDDL" file of the
+; VirtualBox OSE distribution, in which case the provisions of the
+; CDDL are applicable instead of those of the GPL.
+;
+; You may elect to license modified versions of this file under the
+; terms and conditions of either the GPL or the CDDL or both.
+;
+
+
+;*********************************************************************************************************************************
+;*  Header Files                                                                                                                 *
+;*********************************************************************************************************************************
+%define RT_ASM_WITH_SEH64
+%include "iprt/asmdefs.mac"
+
+
+;*********************************************************************************************************************************
+;*  Defined Constants And Macros                                                                                                 *
+;*********************************************************************************************************************************
+;;
+; Loads a 128-bit constant into an XMM register, given as four dwords
+; starting with the least significant one.  Trashes eax.
+;
+; This avoids RIP relative / PIC addressing of constant data.
+;
+%macro LOAD_XMM_CONST 5
+        mov     eax, %2
+        movd    %1, eax
+        mov     eax, %3
+        pinsrd  %1, eax, 1
+        mov     eax, %4
+        pinsrd  %1, eax, 2
+        mov     eax, %5
+        pinsrd  %1, eax, 3
+%endmacro
+
+;;
+; Folds 128 bits in %1 by the constants in xmm0 and adds the next 128 bits
+; from memory at %2, using xmm5 as temporary.
+;
+%macro FOLD_128_MEM 2
+        movdqa  xmm5, %1
+        pclmulqdq %1, xmm0, 000h
+        pclmulqdq xmm5, xmm0, 011h
+        pxor    %1, xmm5
+        movdqu  xmm5, %2
+        pxor    %1, xmm5
+%endmacro
+
+;;
+; Folds 128 bits in xmm1 by the constants in xmm0 and adds register %1,
+; using xmm5 as temporary.
+;
+%macro FOLD_128_REG 1
+        movdqa  xmm5, xmm1
+        pclmulqdq xmm1, xmm0, 000h
+        pclmulqdq xmm5, xmm0, 011h
+        pxor    xmm1, xmm5
+        pxor    xmm1, %1
+%endmacro
+
+
+BEGINCODE
+
+;;
+; Updates a CRC-32C value using the SSE4.2 CRC32 instruction.
+;
+; @returns  The updated CRC-32C value (not finalized).
+; @param    uCrc32C     x86:[esp +  4]  gcc:edi  msc:ecx
+; @param    pv          x86:[esp +  8]  gcc:rsi  msc:rdx
+; @param    cb          x86:[esp + 12]  gcc:rdx  msc:r8
+;
+; @remarks  The caller must make sure the CPU supports SSE4.2.
+;
+BEGINPROC rtCrc32CProcessSse42
+%ifdef RT_ARCH_AMD64
+ %ifdef ASM_CALL64_GCC
+        mov     eax, edi
+        mov     r10, rsi
+        mov     r11, rdx
+ %else
+        mov     eax, ecx
+        mov     r10, rdx
+        mov     r11, r8
+ %endif
+ %define pbBuf  r10
+ %define cbBuf  r11
+ %define cLeft  r9
+SEH64_END_PROLOGUE
+%elifdef RT_ARCH_X86
+        push    esi
+        mov     eax, [esp + 08h]
+        mov     edx, [esp + 0ch]
+        mov     ecx, [esp + 10h]
+ %define pbBuf  edx
+ %define cbBuf  ecx
+ %define cLeft  esi
+%else
+ %error "Unsupported arch!"
+%endif
+
+        ;
+        ; Do single bytes till the buffer is aligned.
+        ;
+.unaligned_head:
+        test    cbBuf, cbBuf
+        jz      .return
+        test    pbBuf, xCB - 1
+        jz      .aligned
+        crc32   eax, byte [pbBuf]
+        inc     pbBuf
+        dec     cbBuf
+        jmp     .unaligned_head
+
+        ;
+        ; Do register sized chunks.
+        ;
+.aligned:
+        mov     cLeft, cbBuf
+%ifdef RT_ARCH_AMD64
+        shr     cLeft, 3
+%else
+        shr     cLeft, 2
+%endif
+        jz      .tail
+.next_chunk:
+%ifdef RT_ARCH_AMD64
+        crc32   rax, qword [pbBuf]
+%else
+        crc32   eax, dword [pbBuf]
+%endif
+        add     pbBuf, xCB
+        dec     cLeft
+        jnz     .next_chunk
+        and     cbBuf, xCB - 1
+
+        ;
+        ; Do the remaining bytes.
+        ;
+.tail:
+        test    cbBuf, cbBuf
+        jz      .return
+.next_tail_byte:
+        crc32   eax, byte [pbBuf]
+        inc     pbBuf
+        dec     cbBuf
+        jnz     .next_tail_byte
+
+.return:
+%ifdef RT_ARCH_X86
+        pop     esi
+%endif
+        ret
+%undef pbBuf
+%undef cbBuf
+%undef cLeft
+ENDPROC   rtCrc32CProcessSse42
+
+
+;;
+; Updates a CRC-32 value by folding the data using PCLMULQDQ.
+;
+; This is the folding algorithm from the Intel white paper "Fast CRC
+; Computation for Generic Polynomials Using PCLMULQDQ Instruction", using
+; the constants for the bit reflected CRC-32 polynomial (0xedb88320).  Four
+; 128-bit lanes are folded in parallel, reduced to 128 bits, 64 bits and 32
+; bits and finally put thru a Barrett reduction.
+;
+; @returns  The updated CRC-32 value (not finalized).
+; @param    uCrc32      x86:[esp +  4]  gcc:edi  msc:ecx
+; @param    pv          x86:[esp +  8]  gcc:rsi  msc:rdx
+; @param    cb          x86:[esp + 12]  gcc:rdx  msc:r8
+;
+; @remarks  The caller must make sure the CPU supports PCLMULQDQ and SSE4.1,
+;           that cb is at least 64 and that it is a multiple of 16.  Only
+;           xmm0 thru xmm5 are used, so nothing needs saving on Windows.
+;
+BEGINPROC rtCrc32ProcessPclmul
+%ifdef RT_ARCH_AMD64
+ %ifdef ASM_CALL64_GCC
+        movd    xmm5, edi
+        mov     r10, rsi
+        mov     r11, rdx
+ %else
+        movd    xmm5, ecx
+        mov     r10, rdx
+        mov     r11, r8
+ %endif
+ %define pbBuf  r10
+ %define cbBuf  r11
+SEH64_END_PROLOGUE
+%elifdef RT_ARCH_X86
+        movd    xmm5, [esp + 04h]
+        mov     edx, [esp + 08h]
+        mov     ecx, [esp + 0ch]
+ %define pbBuf  edx
+ %define cbBuf  ecx
+%else
+ %error "Unsupported arch!"
+%endif
+
+        ;
+        ; Load the first 64 bytes into the four lanes and add the CRC.
+        ;
+        movdqu  xmm1, [pbBuf]
+        movdqu  xmm2, [pbBuf + 10h]
+        movdqu  xmm3, [pbBuf + 20h]
+        movdqu  xmm4, [pbBuf + 30h]
+        pxor    xmm1, xmm5
+        add     pbBuf, 40h
+        sub     cbBuf, 40h
+
+        ;
+        ; Fold 64 bytes at a time.
+        ;
+        cmp     cbBuf, 40h
+        jb      .fold_lanes
+        LOAD_XMM_CONST xmm0, 054442bd4h, 000000001h, 0c6e41596h, 000000001h ; R1, R2
+.next_64_bytes:
+        FOLD_128_MEM xmm1, [pbBuf]
+        FOLD_128_MEM xmm2, [pbBuf + 10h]
+        FOLD_128_MEM xmm3, [pbBuf + 20h]
+        FOLD_128_MEM xmm4, [pbBuf + 30h]
+        add     pbBuf, 40h
+        sub     cbBuf, 40h
+        cmp     cbBuf, 40h
+        jae     .next_64_bytes
+
+        ;
+        ; Fold the four lanes into xmm1.
+        ;
+.fold_lanes:
+        LOAD_XMM_CONST xmm0, 0751997d0h, 000000001h, 0ccaa009eh, 000000000h ; R3, R4
+        FOLD_128_REG xmm2
+        FOLD_128_REG xmm3
+        FOLD_128_REG xmm4
+
+        ;
+        ; Fold the remaining 16 byte blocks.
+        ;
+        test    cbBuf, cbBuf
+        jz      .fold_64
+.next_16_bytes:
+        FOLD_128_MEM xmm1, [pbBuf]
+        add     pbBuf, 10h
+        sub     cbBuf, 10h
+        jnz     .next_16_bytes
+
+        ;
+        ; Fold 128 bits down to 64 bits (+ 32 zero bits), then to 32 bits.
+        ;
+.fold_64:
+        pclmulqdq xmm0, xmm1, 001h      ; R4 * xmm1.lo
+        psrldq  xmm1, 8
+        pxor    xmm1, xmm0
+
+        LOAD_XMM_CONST xmm3, 0ffffffffh, 0, 0, 0 ; mask32
+        LOAD_XMM_CONST xmm0, 063cd6124h, 000000001h, 0, 0 ; R5
+        movdqa  xmm2, xmm1
+        psrldq  xmm2, 4
+        pand    xmm1, xmm3
+        pclmulqdq xmm1, xmm0, 000h
+        pxor    xmm1, xmm2
+
+        ;
+        ; Barrett reduction from 64 to 32 bits.
+        ;
+        LOAD_XMM_CONST xmm0, 0db710641h, 000000001h, 0f7011641h, 000000001h ; P', u'
+        movdqa  xmm2, xmm1
+        pand    xmm1, xmm3
+        pclmulqdq xmm1, xmm0, 010h
+        pand    xmm1, xmm3
+        pclmulqdq xmm1, xmm0, 000h
+        pxor    xmm1, xmm2
+        pextrd  eax, xmm1, 1
+        ret
+%undef pbBuf
+%undef cbBuf
+ENDPROC   rtCrc32ProcessPclmul
+
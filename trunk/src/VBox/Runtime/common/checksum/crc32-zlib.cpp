@@ -30,9 +30,20 @@
 *********************************************************************************************************************************/
 #include "internal/iprt.h"
 #include <iprt/crc.h>
+#include "internal/crc.h"
 
 #include <zlib.h>
 
+
+/*********************************************************************************************************************************
+*   Global Variables                                                                                                             *
+*********************************************************************************************************************************/
+#ifdef IPRT_CRC_WITH_ASM
+/** RTCRC_HWACCEL_F_XXX, zero until checked. */
+static uint32_t volatile g_fCrc32HwAccel = 0;
+#endif
+
+
 /** @todo Check if we can't just use the zlib code directly here. */
 
 /**
@@ -47,18 +58,36 @@ static uint32_t rtCrc32ProcessTooBig(uint32_t uCRC32, const void *pv, size_t cb)
         uCRC32 = crc32(uCRC32, pb, cbChunk);
         pb += cbChunk;
         cb -= cbChunk;
-    } while (!cb);
+    } while (cb);
     return uCRC32;
 }
 
+
+/**
+ * Updates the CRC32, folding large blocks using PCLMULQDQ in ring-3 when
+ * available and leaving the rest to zlib.
+ */
+static uint32_t rtCrc32ProcessInt(uint32_t uCRC32, const void *pv, size_t cb)
+{
+#ifdef IPRT_CRC_WITH_ASM
+    if (   cb >= RTCRC32_PCLMUL_MIN_BYTES
+        && (rtCrcHwAccelQuery(&g_fCrc32HwAccel) & RTCRC_HWACCEL_F_PCLMUL))
+    {
+        /* zlib works on the finalized value, the folding code on the raw one. */
+        size_t const cbBulk = cb & ~(size_t)15;
+        uCRC32 = ~rtCrc32ProcessPclmul(~uCRC32, pv, cbBulk);
+        pv  = (const uint8_t *)pv + cbBulk;
+        cb -= cbBulk;
+    }
+#endif
+    if (RT_LIKELY((uInt)cb == cb))
+        return crc32(uCRC32, (const Bytef *)pv, (uInt)cb);
+    return rtCrc32ProcessTooBig(uCRC32, pv, cb);
+}
+
 RTDECL(uint32_t) RTCrc32(const void *pv, register size_t cb)
 {
-    uint32_t uCrc = crc32(0, NULL, 0);
-    if (RT_UNLIKELY((uInt)cb == cb))
-        uCrc = crc32(uCrc, (const Bytef *)pv, (uInt)cb);
-    else
-        uCrc = rtCrc32ProcessTooBig(uCrc, pv, cb);
-    return uCrc;
+    return rtCrc32ProcessInt(crc32(0, NULL, 0), pv, cb);
 }
 RT_EXPORT_SYMBOL(RTCrc32);
 
@@ -72,11 +101,7 @@ RT_EXPORT_SYMBOL(RTCrc32Start);
 
 RTDECL(uint32_t) RTCrc32Process(uint32_t uCRC32, const void *pv, size_t cb)
 {
-    if (RT_UNLIKELY((uInt)cb == cb))
-        uCRC32 = crc32(uCRC32, (const Bytef *)pv, (uInt)cb);
-    else
-        uCRC32 = rtCrc32ProcessTooBig(uCRC32, pv, cb);
-    return uCRC32;
+    return rtCrc32ProcessInt(uCRC32, pv, cb);
 }
 RT_EXPORT_SYMBOL(RTCrc32Process);
 
@@ -0,0 +1,144 @@
+/* $Id$ */
+/** @file
+ * IPRT - Internal header for the CRC32 and CRC32C implementations.
+ */
+
+/*
+ * Copyright (C) 2016 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ *
+ * The contents of this file may alternatively be used under the terms
+ * of the Common Development and Distribution License Version 1.0
+ * (CDDL) only, as it comes in the "COPYING.CDDL" file of the
+ * VirtualBox OSE distribution, in which case the provisions of the
+ * CDDL are applicable instead of those of the GPL.
+ *
+ * You may elect to license modified versions of this file under the
+ * terms and conditions of either the GPL or the CDDL or both.
+ */
+
+#ifndef ___internal_crc_h
+#define ___internal_crc_h
+
+#include <iprt/types.h>
+
+/** @def IPRT_CRC_WITH_ASM
+ * Use the SSE4.2 and PCLMULQDQ workers in crc32-amd64-x86.asm when the CPU
+ * supports them.  Ring-3 only as the FPU/SIMD state isn't ours to trash in
+ * ring-0 and raw-mode context. */
+#if defined(IN_RING3) && (defined(RT_ARCH_AMD64) || defined(RT_ARCH_X86))
+# define IPRT_CRC_WITH_ASM
+# include <iprt/asm-amd64-x86.h>
+# include <iprt/x86.h>
+#endif
+
+
+/** @name RTCRC_HWACCEL_F_XXX - CPU features usable for CRC calculations.
+ * @{ */
+/** The SSE4.2 CRC32 instruction is available (CRC-32C only). */
+#define RTCRC_HWACCEL_F_SSE42       RT_BIT_32(0)
+/** PCLMULQDQ and SSE4.1 are available (CRC-32 folding). */
+#define RTCRC_HWACCEL_F_PCLMUL      RT_BIT_32(1)
+/** Set once the CPU has been checked so that the result is never zero. */
+#define RTCRC_HWACCEL_F_INITIALIZED RT_BIT_32(31)
+/** @} */
+
+/** Minimum number of bytes to hand to rtCrc32ProcessPclmul, smaller blocks
+ * are faster using the tables. */
+#define RTCRC32_PCLMUL_MIN_BYTES    256
+
+
+RT_C_DECLS_BEGIN
+
+#ifdef IPRT_CRC_WITH_ASM
+DECLASM(uint32_t) rtCrc32CProcessSse42(uint32_t uCrc32C, const void *pv, size_t cb);
+DECLASM(uint32_t) rtCrc32ProcessPclmul(uint32_t uCrc32, const void *pv, size_t cb);
+
+/**
+ * Gets the CPU features usable for CRC calculations, checking the CPU on the
+ * first call.
+ *
+ * @returns RTCRC_HWACCEL_F_XXX.
+ * @param   pfCache     Per module cache variable, initialized to zero.  Racing
+ *                      threads all come to the same result, so no locking.
+ */
+DECLINLINE(uint32_t) rtCrcHwAccelQuery(uint32_t volatile *pfCache)
+{
+    uint32_t fFeatures = *pfCache;
+    if (RT_LIKELY(fFeatures))
+        return fFeatures;
+
+    fFeatures = RTCRC_HWACCEL_F_INITIALIZED;
+    if (ASMHasCpuId())
+    {
+        uint32_t uEAX, uEBX, uECX, uEDX;
+        ASMCpuId(1, &uEAX, &uEBX, &uECX, &uEDX);
+        if (uECX & X86_CPUID_FEATURE_ECX_SSE4_2)
+            fFeatures |= RTCRC_HWACCEL_F_SSE42;
+        if (   (uECX & X86_CPUID_FEATURE_ECX_PCLMUL)
+            && (uECX & X86_CPUID_FEATURE_ECX_SSE4_1))
+            fFeatures |= RTCRC_HWACCEL_F_PCLMUL;
+    }
+    *pfCache = fFeatures;
+    return fFeatures;
+}
+#endif /* IPRT_CRC_WITH_ASM */
+
+
+/**
+ * Updates a reflected CRC using the slice-by-8 algorithm.
+ *
+ * This processes eight bytes per step using eight lookup tables, where table
+ * N gives the CRC contribution of a byte followed by N zero bytes.
+ *
+ * @returns Updated CRC (not finalized).
+ * @param   pau32T0     The normal byte-at-a-time table.
+ * @param   paau32T     Tables 1 thru 7.
+ * @param   uCrc        The current CRC.
+ * @param   pv          The data.
+ * @param   cb          Number of bytes.
+ */
+DECLINLINE(uint32_t) rtCrcProcessSlice8(uint32_t const *pau32T0, uint32_t const (*paau32T)[256],
+                                        uint32_t uCrc, const void *pv, size_t cb)
+{
+    const uint8_t *pb = (const uint8_t *)pv;
+
+    /* Align the pointer so the loads below are natural. */
+    while (cb > 0 && ((uintptr_t)pb & 7))
+    {
+        uCrc = pau32T0[(uCrc ^ *pb++) & 0xff] ^ (uCrc >> 8);
+        cb--;
+    }
+
+    while (cb >= 8)
+    {
+        uint32_t const u32Lo = RT_LE2H_U32(((uint32_t const *)pb)[0]) ^ uCrc;
+        uint32_t const u32Hi = RT_LE2H_U32(((uint32_t const *)pb)[1]);
+        uCrc = paau32T[6][ u32Lo        & 0xff]
+             ^ paau32T[5][(u32Lo >>  8) & 0xff]
+             ^ paau32T[4][(u32Lo >> 16) & 0xff]
+             ^ paau32T[3][ u32Lo >> 24        ]
+             ^ paau32T[2][ u32Hi        & 0xff]
+             ^ paau32T[1][(u32Hi >>  8) & 0xff]
+             ^ paau32T[0][(u32Hi >> 16) & 0xff]
+             ^ pau32T0[    u32Hi >> 24        ];
+        pb += 8;
+        cb -= 8;
+    }
+
+    while (cb-- > 0)
+        uCrc = pau32T0[(uCrc ^ *pb++) & 0xff] ^ (uCrc >> 8);
+    return uCrc;
+}
+
+RT_C_DECLS_END
+
+#endif
+
@@ -40,6 +40,20 @@
  * compensated if the user of this API implements caching itself. The next
  * limitation is that data buffers must be aligned at a 512 byte boundary or the
  * request will fail.
+ *
+ * Newer kernels (5.11 and later) have io_uring which is used instead when
+ * available.  Requests are put into a submission ring shared with the kernel
+ * and a whole batch is handed over with one io_uring_enter call, completions
+ * are picked up from the completion ring without entering the kernel at all
+ * unless we have to wait.  Unlike the io_* syscalls, io_uring doesn't block
+ * the submitter on buffered files or file metadata but punts the request to a
+ * kernel worker.  Setting the IPRT_FILEAIO_NO_IO_URING environment variable
+ * forces the io_* syscalls, for comparing the two.
+ *
+ * Fixed (registered) files and buffers are not used, the RTFileAio API has no
+ * way of telling when a file associated with a context is closed or which
+ * buffers will be used, and a registered file would stay open in the kernel
+ * until the context is destroyed.
  */
 /** @todo r=bird: What's this about "must be opened with O_DIRECT"? An
  *        explanation would be nice, esp. seeing what Linus is quoted saying
@@ -53,6 +67,8 @@
 #include <iprt/asm.h>
 #include <iprt/mem.h>
 #include <iprt/assert.h>
+#include <iprt/critsect.h>
+#include <iprt/env.h>
 #include <iprt/string.h>
 #include <iprt/err.h>
 #include <iprt/log.h>
@@ -60,6 +76,7 @@
 #include "internal/fileaio.h"
 
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
 #include <errno.h>
 
@@ -167,13 +184,167 @@ typedef struct LNXKAIOIOEVENT
 } LNXKAIOIOEVENT, *PLNXKAIOIOEVENT;
 
 
+/**
+ * io_uring submission queue entry.
+ *
+ * Redefined here as the build hosts might not have the header, only the
+ * fields needed for reads, writes and flushes are named.
+ */
+typedef struct LNXIOURINGSQE
+{
+    /** The operation (LNXIOURING_OP_XXX). */
+    uint8_t     u8OpCode;
+    /** Submission flags. */
+    uint8_t     fSqe;
+    /** Request priority. */
+    uint16_t    u16IoPrio;
+    /** The file descriptor. */
+    int32_t     iFd;
+    /** At which offset to start the transfer. */
+    uint64_t    off;
+    /** The userspace pointer to the buffer containing/receiving the data. */
+    uint64_t    u64PtrBuf;
+    /** How many bytes to transfer. */
+    uint32_t    cbTransfer;
+    /** Operation specific flags (RWF_XXX, IORING_FSYNC_XXX). */
+    uint32_t    fOp;
+    /** Opaque data returned in the completion entry, the request. */
+    uint64_t    u64User;
+    /** Padding and fields not used here. */
+    uint64_t    au64Reserved[3];
+} LNXIOURINGSQE;
+AssertCompileSize(LNXIOURINGSQE, 64);
+/** Pointer to a io_uring submission queue entry. */
+typedef LNXIOURINGSQE *PLNXIOURINGSQE;
+
+/**
+ * io_uring completion queue entry.
+ */
+typedef struct LNXIOURINGCQE
+{
+    /** The u64User value of the submission queue entry. */
+    uint64_t    u64User;
+    /** Bytes transferred or negative errno. */
+    int32_t     rcLnx;
+    /** Flags. */
+    uint32_t    fCqe;
+} LNXIOURINGCQE;
+AssertCompileSize(LNXIOURINGCQE, 16);
+/** Pointer to a io_uring completion queue entry. */
+typedef LNXIOURINGCQE *PLNXIOURINGCQE;
+
+/**
+ * io_uring_setup parameters, in and out.
+ */
+typedef struct LNXIOURINGPARAMS
+{
+    uint32_t    cSqEntries;
+    uint32_t    cCqEntries;
+    uint32_t    fSetup;
+    uint32_t    idSqThreadCpu;
+    uint32_t    cMsSqThreadIdle;
+    uint32_t    fFeatures;
+    uint32_t    iFdWq;
+    uint32_t    au32Reserved[3];
+    /** Offsets of the submission ring members (io_sqring_offsets). */
+    struct
+    {
+        uint32_t    offHead;
+        uint32_t    offTail;
+        uint32_t    offRingMask;
+        uint32_t    offRingEntries;
+        uint32_t    offFlags;
+        uint32_t    offDropped;
+        uint32_t    offArray;
+        uint32_t    u32Reserved;
+        uint64_t    u64Reserved;
+    } SqOffsets;
+    /** Offsets of the completion ring members (io_cqring_offsets). */
+    struct
+    {
+        uint32_t    offHead;
+        uint32_t    offTail;
+        uint32_t    offRingMask;
+        uint32_t    offRingEntries;
+        uint32_t    offOverflow;
+        uint32_t    offCqes;
+        uint32_t    offFlags;
+        uint32_t    u32Reserved;
+        uint64_t    u64Reserved;
+    } CqOffsets;
+} LNXIOURINGPARAMS;
+AssertCompileSize(LNXIOURINGPARAMS, 120);
+
+/**
+ * Extended io_uring_enter argument (io_uring_getevents_arg).
+ */
+typedef struct LNXIOURINGGETEVENTSARG
+{
+    uint64_t    u64PtrSigMask;
+    uint32_t    cbSigMask;
+    uint32_t    u32Padding;
+    /** Pointer to the relative timeout (struct __kernel_timespec). */
+    uint64_t    u64PtrTimeout;
+} LNXIOURINGGETEVENTSARG;
+
+/**
+ * 64-bit timespec as used by io_uring on all architectures.
+ */
+typedef struct LNXKERNELTIMESPEC
+{
+    int64_t     cSecs;
+    int64_t     cNanoSecs;
+} LNXKERNELTIMESPEC;
+
+/**
+ * The io_uring state of a context.
+ */
+typedef struct LNXIOURING
+{
+    /** The ring file descriptor. */
+    int                 iFdRing;
+    /** Number of submission (and completion) queue entries we use. */
+    uint32_t            cEntries;
+    /** The mapping of the submission and completion rings. */
+    void               *pvRings;
+    /** Size of the ring mapping. */
+    size_t              cbRings;
+    /** The submission queue entries. */
+    PLNXIOURINGSQE      paSqes;
+    /** Size of the submission queue entry mapping. */
+    size_t              cbSqes;
+    /** Submission ring head, advanced by the kernel. */
+    uint32_t volatile  *pu32SqHead;
+    /** Submission ring tail, advanced by us. */
+    uint32_t volatile  *pu32SqTail;
+    /** Submission ring index mask. */
+    uint32_t            fSqMask;
+    /** Submission ring array of indexes into paSqes. */
+    uint32_t volatile  *pau32SqArray;
+    /** Completion ring head, advanced by us. */
+    uint32_t volatile  *pu32CqHead;
+    /** Completion ring tail, advanced by the kernel. */
+    uint32_t volatile  *pu32CqTail;
+    /** Completion ring index mask. */
+    uint32_t            fCqMask;
+    /** The completion ring entries. */
+    PLNXIOURINGCQE      paCqes;
+    /** Serializes submissions from different threads. */
+    RTCRITSECT          CritSectSubmit;
+} LNXIOURING;
+/** Pointer to the io_uring state of a context. */
+typedef LNXIOURING *PLNXIOURING;
+
+
 /**
  * Async I/O completion context state.
  */
 typedef struct RTFILEAIOCTXINTERNAL
 {
-    /** Handle to the async I/O context. */
+    /** Handle to the async I/O context, 0 if io_uring is used. */
     LNXKAIOCONTEXT      AioContext;
+    /** The io_uring state, NULL if the io_* syscalls are used. */
+    PLNXIOURING         pIoUring;
     /** Maximum number of requests this context can handle. */
     int                 cRequestsMax;
     /** Current number of requests active on this context. */
@@ -223,6 +394,41 @@ typedef RTFILEAIOREQINTERNAL *PRTFILEAIOREQINTERNAL;
 /** The max number of events to get in one call. */
 #define AIO_MAXIMUM_REQUESTS_PER_CONTEXT 64
 
+/** @name io_uring system call numbers, the same on all architectures.
+ * @{ */
+#ifndef __NR_io_uring_setup
+# define __NR_io_uring_setup        425
+#endif
+#ifndef __NR_io_uring_enter
+# define __NR_io_uring_enter        426
+#endif
+/** @} */
+
+/** @name io_uring constants.
+ * @{ */
+#define LNXIOURING_OP_FSYNC         3
+#define LNXIOURING_OP_READ          22
+#define LNXIOURING_OP_WRITE         23
+#define LNXIOURING_SETUP_CLAMP      RT_BIT_32(4)
+#define LNXIOURING_FEAT_SINGLE_MMAP RT_BIT_32(0)
+#define LNXIOURING_FEAT_NODROP      RT_BIT_32(1)
+#define LNXIOURING_FEAT_EXT_ARG     RT_BIT_32(8)
+#define LNXIOURING_ENTER_GETEVENTS  RT_BIT_32(0)
+#define LNXIOURING_ENTER_EXT_ARG    RT_BIT_32(3)
+#define LNXIOURING_OFF_SQ_RING      UINT64_C(0)
+#define LNXIOURING_OFF_SQES         UINT64_C(0x10000000)
+/** The features we require: one mapping for both rings, no dropped
+ * completions and timeouts for waiting (kernel 5.11). */
+#define LNXIOURING_FEAT_REQUIRED    (LNXIOURING_FEAT_SINGLE_MMAP | LNXIOURING_FEAT_NODROP | LNXIOURING_FEAT_EXT_ARG)
+/** @} */
+
+
+/*********************************************************************************************************************************
+*   Global Variables                                                                                                             *
+*********************************************************************************************************************************/
+/** Whether io_uring is usable: 0 if not yet checked, 1 if usable, -1 if not. */
+static int32_t volatile g_iIoUringUsable = 0;
+
 
 /**
  * Creates a new async I/O context.
@@ -293,6 +499,139 @@ DECLINLINE(int) rtFileAsyncIoLinuxGetEvents(LNXKAIOCONTEXT AioContext, long cReq
     return rc;
 }
 
+/**
+ * Enters the kernel to submit and/or wait for io_uring requests.
+ * @returns Number of submitted requests (natural number w/ 0), IPRT error code (negative).
+ */
+DECLINLINE(int) rtFileAioLinuxIoUringEnter(PLNXIOURING pIoUring, uint32_t cToSubmit, uint32_t cMinComplete,
+                                           uint32_t fFlags, LNXIOURINGGETEVENTSARG *pArg)
+{
+    int rc = syscall(__NR_io_uring_enter, pIoUring->iFdRing, cToSubmit, cMinComplete, fFlags,
+                     pArg, pArg ? sizeof(*pArg) : 0);
+    if (RT_UNLIKELY(rc == -1))
+    {
+        if (errno == ETIME)
+            return VERR_TIMEOUT;
+        return RTErrConvertFromErrno(errno);
+    }
+
+    return rc;
+}
+
+/**
+ * Destroys an io_uring, also used for cleaning up after a failed creation.
+ */
+static void rtFileAioLinuxIoUringDestroy(PLNXIOURING pIoUring)
+{
+    if (pIoUring->paSqes)
+        munmap(pIoUring->paSqes, pIoUring->cbSqes);
+    if (pIoUring->pvRings)
+        munmap(pIoUring->pvRings, pIoUring->cbRings);
+    if (pIoUring->iFdRing >= 0)
+        close(pIoUring->iFdRing);
+    if (RTCritSectIsInitialized(&pIoUring->CritSectSubmit))
+        RTCritSectDelete(&pIoUring->CritSectSubmit);
+    RTMemFree(pIoUring);
+}
+
+/**
+ * Creates an io_uring and maps its rings.
+ *
+ * @returns IPRT status code, VERR_NOT_SUPPORTED if the kernel lacks features
+ *          we need.
+ * @param   cEntries        Maximum number of requests in flight.
+ * @param   ppIoUring       Where to store the io_uring state on success.
+ */
+static int rtFileAioLinuxIoUringCreate(uint32_t cEntries, PLNXIOURING *ppIoUring)
+{
+    PLNXIOURING pIoUring = (PLNXIOURING)RTMemAllocZ(sizeof(*pIoUring));
+    if (RT_UNLIKELY(!pIoUring))
+        return VERR_NO_MEMORY;
+
+    int rc;
+    LNXIOURINGPARAMS Params;
+    RT_ZERO(Params);
+    Params.fSetup = LNXIOURING_SETUP_CLAMP;
+    pIoUring->iFdRing = syscall(__NR_io_uring_setup, cEntries, &Params);
+    if (pIoUring->iFdRing >= 0)
+    {
+        if ((Params.fFeatures & LNXIOURING_FEAT_REQUIRED) == LNXIOURING_FEAT_REQUIRED)
+        {
+            /* Both rings live in one mapping, the entries in another. */
+            pIoUring->cEntries = RT_MIN(cEntries, Params.cSqEntries);
+            pIoUring->cbRings  = RT_MAX(Params.SqOffsets.offArray + Params.cSqEntries * sizeof(uint32_t),
+                                        Params.CqOffsets.offCqes  + Params.cCqEntries * sizeof(LNXIOURINGCQE));
+            void *pvRings = mmap(NULL, pIoUring->cbRings, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 pIoUring->iFdRing, LNXIOURING_OFF_SQ_RING);
+            if (pvRings != MAP_FAILED)
+            {
+                pIoUring->pvRings = pvRings;
+                pIoUring->cbSqes  = Params.cSqEntries * sizeof(LNXIOURINGSQE);
+                void *pvSqes = mmap(NULL, pIoUring->cbSqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                    pIoUring->iFdRing, LNXIOURING_OFF_SQES);
+                if (pvSqes != MAP_FAILED)
+                {
+                    uint8_t *pbRings = (uint8_t *)pvRings;
+                    pIoUring->paSqes       = (PLNXIOURINGSQE)pvSqes;
+                    pIoUring->pu32SqHead   = (uint32_t volatile *)(pbRings + Params.SqOffsets.offHead);
+                    pIoUring->pu32SqTail   = (uint32_t volatile *)(pbRings + Params.SqOffsets.offTail);
+                    pIoUring->fSqMask      = *(uint32_t *)(pbRings + Params.SqOffsets.offRingMask);
+                    pIoUring->pau32SqArray = (uint32_t volatile *)(pbRings + Params.SqOffsets.offArray);
+                    pIoUring->pu32CqHead   = (uint32_t volatile *)(pbRings + Params.CqOffsets.offHead);
+                    pIoUring->pu32CqTail   = (uint32_t volatile *)(pbRings + Params.CqOffsets.offTail);
+                    pIoUring->fCqMask      = *(uint32_t *)(pbRings + Params.CqOffsets.offRingMask);
+                    pIoUring->paCqes       = (PLNXIOURINGCQE)(pbRings + Params.CqOffsets.offCqes);
+
+                    rc = RTCritSectInit(&pIoUring->CritSectSubmit);
+                    if (RT_SUCCESS(rc))
+                    {
+                        *ppIoUring = pIoUring;
+                        return VINF_SUCCESS;
+                    }
+                }
+                else
+                    rc = RTErrConvertFromErrno(errno);
+            }
+            else
+                rc = RTErrConvertFromErrno(errno);
+        }
+        else
+            rc = VERR_NOT_SUPPORTED;
+    }
+    else
+        rc = RTErrConvertFromErrno(errno);
+
+    rtFileAioLinuxIoUringDestroy(pIoUring);
+    return rc;
+}
+
+/**
+ * Checks whether io_uring can be used, checking the kernel on the first call.
+ */
+static bool rtFileAioLinuxIoUringIsUsable(void)
+{
+    int32_t iUsable = ASMAtomicReadS32(&g_iIoUringUsable);
+    if (RT_LIKELY(iUsable))
+        return iUsable > 0;
+
+    /* Racing threads all come to the same result, so no locking. */
+    iUsable = -1;
+    if (!RTEnvExist("IPRT_FILEAIO_NO_IO_URING"))
+    {
+        PLNXIOURING pIoUring;
+        int rc = rtFileAioLinuxIoUringCreate(1, &pIoUring);
+        if (RT_SUCCESS(rc))
+        {
+            rtFileAioLinuxIoUringDestroy(pIoUring);
+            iUsable = 1;
+        }
+        else
+            Log(("RTFileAio: io_uring is not usable (%Rrc), using the io_* system calls\n", rc));
+    }
+    ASMAtomicWriteS32(&g_iIoUringUsable, iUsable);
+    return iUsable > 0;
+}
+
 RTR3DECL(int) RTFileAioGetLimits(PRTFILEAIOLIMITS pAioLimits)
 {
     int rc = VINF_SUCCESS;
@@ -302,14 +641,17 @@ RTR3DECL(int) RTFileAioGetLimits(PRTFILEAIOLIMITS pAioLimits)
      * Check if the API is implemented by creating a
      * completion port.
      */
-    LNXKAIOCONTEXT AioContext = 0;
-    rc = rtFileAsyncIoLinuxCreate(1, &AioContext);
-    if (RT_FAILURE(rc))
-        return rc;
+    if (!rtFileAioLinuxIoUringIsUsable())
+    {
+        LNXKAIOCONTEXT AioContext = 0;
+        rc = rtFileAsyncIoLinuxCreate(1, &AioContext);
+        if (RT_FAILURE(rc))
+            return rc;
 
-    rc = rtFileAsyncIoLinuxDestroy(AioContext);
-    if (RT_FAILURE(rc))
-        return rc;
+        rc = rtFileAsyncIoLinuxDestroy(AioContext);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
 
     /* Supported - fill in the limits. The alignment is the only restriction. */
     pAioLimits->cReqsOutstandingMax = RTFILEAIO_UNLIMITED_REQS;
@@ -442,6 +784,10 @@ RTDECL(int) RTFileAioReqCancel(RTFILEAIOREQ hReq)
     RTFILEAIOREQ_VALID_RETURN(pReqInt);
     RTFILEAIOREQ_STATE_RETURN_RC(pReqInt, SUBMITTED, VERR_FILE_AIO_NOT_SUBMITTED);
 
+    /* io_uring always posts a completion, even for canceled requests, so let it complete normally. */
+    if (pReqInt->pCtxInt->pIoUring)
+        return VERR_FILE_AIO_IN_PROGRESS;
+
     LNXKAIOIOEVENT AioEvent;
     int rc = rtFileAsyncIoLinuxCancel(pReqInt->AioContext, &pReqInt->AioCB, &AioEvent);
     if (RT_SUCCESS(rc))
@@ -495,8 +841,16 @@ RTDECL(int) RTFileAioCtxCreate(PRTFILEAIOCTX phAioCtx, uint32_t cAioReqsMax,
     if (RT_UNLIKELY(!pCtxInt))
         return VERR_NO_MEMORY;
 
-    /* Init the event handle. */
-    int rc = rtFileAsyncIoLinuxCreate(cAioReqsMax, &pCtxInt->AioContext);
+    /* Init the event handle, preferring io_uring. */
+    int rc = VERR_NOT_SUPPORTED;
+    if (rtFileAioLinuxIoUringIsUsable())
+    {
+        rc = rtFileAioLinuxIoUringCreate(cAioReqsMax, &pCtxInt->pIoUring);
+        if (RT_SUCCESS(rc))
+            cAioReqsMax = pCtxInt->pIoUring->cEntries;
+    }
+    if (RT_FAILURE(rc))
+        rc = rtFileAsyncIoLinuxCreate(cAioReqsMax, &pCtxInt->AioContext);
     if (RT_SUCCESS(rc))
     {
         pCtxInt->fWokenUp     = false;
@@ -527,9 +881,14 @@ RTDECL(int) RTFileAioCtxDestroy(RTFILEAIOCTX hAioCtx)
         return VERR_FILE_AIO_BUSY;
 
     /* The native bit first, then mark it as dead and free it. */
-    int rc = rtFileAsyncIoLinuxDestroy(pCtxInt->AioContext);
-    if (RT_FAILURE(rc))
-        return rc;
+    if (pCtxInt->pIoUring)
+        rtFileAioLinuxIoUringDestroy(pCtxInt->pIoUring);
+    else
+    {
+        int rc = rtFileAsyncIoLinuxDestroy(pCtxInt->AioContext);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
     ASMAtomicUoWriteU32(&pCtxInt->u32Magic, RTFILEAIOCTX_MAGIC_DEAD);
     RTMemFree(pCtxInt);
 
@@ -558,6 +917,110 @@ RTDECL(int) RTFileAioCtxAssociateWithFile(RTFILEAIOCTX hAioCtx, RTFILE hFile)
     return VINF_SUCCESS;
 }
 
+/**
+ * Submits requests through the io_uring of a context.
+ *
+ * All requests are put into the submission ring and handed to the kernel with
+ * a single io_uring_enter call in the normal case.
+ *
+ * @returns IPRT status code.
+ * @param   pCtxInt         The context, using io_uring.
+ * @param   pahReqs         The requests, already in the submitted state.
+ * @param   cReqs           Number of requests.
+ */
+static int rtFileAioCtxSubmitIoUring(PRTFILEAIOCTXINTERNAL pCtxInt, PRTFILEAIOREQ pahReqs, size_t cReqs)
+{
+    PLNXIOURING pIoUring = pCtxInt->pIoUring;
+    int         rc       = VINF_SUCCESS;
+
+    RTCritSectEnter(&pIoUring->CritSectSubmit);
+
+    /*
+     * Never have more requests in flight than the rings were sized for,
+     * so the completion ring can't overflow.
+     */
+    uint32_t const cInFlight = (uint32_t)RT_MAX(ASMAtomicReadS32(&pCtxInt->cRequests), 0);
+    uint32_t const cToSubmit = (uint32_t)RT_MIN(cReqs, pIoUring->cEntries - RT_MIN(cInFlight, pIoUring->cEntries));
+    uint32_t const uTail     = *pIoUring->pu32SqTail;
+    for (uint32_t i = 0; i < cToSubmit; i++)
+    {
+        PRTFILEAIOREQINTERNAL pReqInt = pahReqs[i];
+        uint32_t const        idxSqe  = (uTail + i) & pIoUring->fSqMask;
+        PLNXIOURINGSQE        pSqe    = &pIoUring->paSqes[idxSqe];
+
+        RT_ZERO(*pSqe);
+        switch (pReqInt->AioCB.u16IoOpCode)
+        {
+            case LNXKAIO_IOCB_CMD_READ:  pSqe->u8OpCode = LNXIOURING_OP_READ;  break;
+            case LNXKAIO_IOCB_CMD_WRITE: pSqe->u8OpCode = LNXIOURING_OP_WRITE; break;
+            default:
+                AssertMsgFailed(("Invalid opcode %u\n", pReqInt->AioCB.u16IoOpCode));
+                /* fall thru */
+            case LNXKAIO_IOCB_CMD_FSYNC: pSqe->u8OpCode = LNXIOURING_OP_FSYNC; break;
+        }
+        pSqe->iFd        = (int32_t)pReqInt->AioCB.uFileDesc;
+        pSqe->off        = (uint64_t)pReqInt->AioCB.off;
+        pSqe->u64PtrBuf  = (uintptr_t)pReqInt->AioCB.pvBuf;
+        pSqe->cbTransfer = (uint32_t)pReqInt->AioCB.cbTransfer;
+        pSqe->u64User    = (uintptr_t)pReqInt;
+        pIoUring->pau32SqArray[idxSqe] = idxSqe;
+    }
+    ASMAtomicWriteU32(pIoUring->pu32SqTail, uTail + cToSubmit);
+
+    /*
+     * Count them before the kernel sees them, the waiter might get the
+     * completions before we return from the system call.
+     */
+    ASMAtomicAddS32(&pCtxInt->cRequests, (int32_t)cToSubmit);
+
+    uint32_t cSubmitted = 0;
+    while (cSubmitted < cToSubmit)
+    {
+        rc = rtFileAioLinuxIoUringEnter(pIoUring, cToSubmit - cSubmitted, 0, 0, NULL);
+        if (rc <= 0)
+        {
+            if (rc == 0)
+                rc = VERR_TRY_AGAIN;
+            break;
+        }
+        cSubmitted += (uint32_t)rc;
+        rc = VINF_SUCCESS;
+    }
+
+    if (cSubmitted < cToSubmit)
+    {
+        /* Take back what the kernel didn't consume so it isn't submitted with the next batch. */
+        ASMAtomicWriteU32(pIoUring->pu32SqTail, uTail + cSubmitted);
+        ASMAtomicSubS32(&pCtxInt->cRequests, (int32_t)(cToSubmit - cSubmitted));
+    }
+
+    RTCritSectLeave(&pIoUring->CritSectSubmit);
+
+    if (cSubmitted == cReqs)
+        return VINF_SUCCESS;
+
+    /* Revert the requests which weren't submitted into the prepared state. */
+    for (size_t i = cSubmitted; i < cReqs; i++)
+    {
+        PRTFILEAIOREQINTERNAL pReqInt = pahReqs[i];
+        pReqInt->pCtxInt = NULL;
+        RTFILEAIOREQ_SET_STATE(pReqInt, PREPARED);
+    }
+
+    if (   RT_SUCCESS(rc)
+        || rc == VERR_TRY_AGAIN
+        || rc == VERR_NO_MEMORY
+        || rc == VERR_RESOURCE_BUSY)
+        return VERR_FILE_AIO_INSUFFICIENT_RESSOURCES;
+
+    /* The first request not submitted failed. */
+    PRTFILEAIOREQINTERNAL pReqInt = pahReqs[cSubmitted];
+    RTFILEAIOREQ_SET_STATE(pReqInt, COMPLETED);
+    pReqInt->Rc = rc;
+    pReqInt->cbTransfered = 0;
+    return rc;
+}
+
 RTDECL(int) RTFileAioCtxSubmit(RTFILEAIOCTX hAioCtx, PRTFILEAIOREQ pahReqs, size_t cReqs)
 {
     int rc = VINF_SUCCESS;
@@ -596,6 +1059,9 @@ RTDECL(int) RTFileAioCtxSubmit(RTFILEAIOCTX hAioCtx, PRTFILEAIOREQ pahReqs, size
         RTFILEAIOREQ_SET_STATE(pReqInt, SUBMITTED);
     }
 
+    if (pCtxInt->pIoUring)
+        return rtFileAioCtxSubmitIoUring(pCtxInt, pahReqs, cReqs);
+
     do
     {
         /*
@@ -652,6 +1118,93 @@ RTDECL(int) RTFileAioCtxSubmit(RTFILEAIOCTX hAioCtx, PRTFILEAIOREQ pahReqs, size
 }
 
 
+/**
+ * Collects completed requests from the io_uring of a context, waiting for
+ * more if necessary.
+ *
+ * @returns IPRT status code.
+ * @param   pCtxInt         The context, using io_uring.
+ * @param   cMinReqs        Minimum number of requests to wait for, at least 1.
+ * @param   cMillies        The timeout.
+ * @param   pahReqs         Where to store the completed requests.
+ * @param   cReqs           Size of the array.
+ * @param   pcReqs          Where to store the number of completed requests.
+ */
+static int rtFileAioCtxWaitIoUring(PRTFILEAIOCTXINTERNAL pCtxInt, size_t cMinReqs, RTMSINTERVAL cMillies,
+                                   PRTFILEAIOREQ pahReqs, size_t cReqs, int *pcReqs)
+{
+    PLNXIOURING             pIoUring    = pCtxInt->pIoUring;
+    uint64_t const          StartNanoTS = cMillies != RT_INDEFINITE_WAIT ? RTTimeNanoTS() : 0;
+    LNXKERNELTIMESPEC       Timeout     = { 0, 0 };
+    LNXIOURINGGETEVENTSARG  Arg;
+    RT_ZERO(Arg);
+
+    int    rc    = VINF_SUCCESS;
+    size_t cDone = 0;
+    while (!pCtxInt->fWokenUp)
+    {
+        /*
+         * Process whatever is in the completion ring, no system call needed.
+         */
+        uint32_t       uHead = *pIoUring->pu32CqHead;
+        uint32_t const uTail = ASMAtomicReadU32(pIoUring->pu32CqTail);
+        while (   uHead != uTail
+               && cDone < cReqs)
+        {
+            PLNXIOURINGCQE        pCqe    = &pIoUring->paCqes[uHead & pIoUring->fCqMask];
+            PRTFILEAIOREQINTERNAL pReqInt = (PRTFILEAIOREQINTERNAL)(uintptr_t)pCqe->u64User;
+            AssertPtr(pReqInt);
+            Assert(pReqInt->u32Magic == RTFILEAIOREQ_MAGIC);
+
+            if (RT_UNLIKELY(pCqe->rcLnx < 0))
+                pReqInt->Rc = RTErrConvertFromErrno(-pCqe->rcLnx);
+            else
+            {
+                pReqInt->Rc = VINF_SUCCESS;
+                pReqInt->cbTransfered = pCqe->rcLnx;
+            }
+
+            /* Mark the request as finished. */
+            RTFILEAIOREQ_SET_STATE(pReqInt, COMPLETED);
+
+            pahReqs[cDone++] = (RTFILEAIOREQ)pReqInt;
+            uHead++;
+        }
+        ASMAtomicWriteU32(pIoUring->pu32CqHead, uHead);
+
+        if (cDone >= cMinReqs)
+            break;
+
+        /*
+         * Wait for the rest.
+         */
+        if (cMillies != RT_INDEFINITE_WAIT)
+        {
+            uint64_t cMilliesElapsed = (RTTimeNanoTS() - StartNanoTS) / RT_NS_1MS;
+            if (cMilliesElapsed >= cMillies)
+            {
+                rc = VERR_TIMEOUT;
+                break;
+            }
+            Timeout.cSecs     = (cMillies - (RTMSINTERVAL)cMilliesElapsed) / 1000;
+            Timeout.cNanoSecs = (cMillies - (RTMSINTERVAL)cMilliesElapsed) % 1000 * RT_NS_1MS;
+            Arg.u64PtrTimeout = (uintptr_t)&Timeout;
+        }
+
+        ASMAtomicXchgBool(&pCtxInt->fWaiting, true);
+        if (!ASMAtomicReadBool(&pCtxInt->fWokenUp)) /* RTFileAioCtxWakeup only pokes us when we're waiting. */
+            rc = rtFileAioLinuxIoUringEnter(pIoUring, 0, (uint32_t)(cMinReqs - cDone),
+                                            LNXIOURING_ENTER_GETEVENTS | LNXIOURING_ENTER_EXT_ARG, &Arg);
+        ASMAtomicXchgBool(&pCtxInt->fWaiting, false);
+        if (RT_FAILURE(rc))
+            break;
+        rc = VINF_SUCCESS;
+    }
+
+    *pcReqs = (int)cDone;
+    return rc;
+}
+
 RTDECL(int) RTFileAioCtxWait(RTFILEAIOCTX hAioCtx, size_t cMinReqs, RTMSINTERVAL cMillies,
                              PRTFILEAIOREQ pahReqs, size_t cReqs, uint32_t *pcReqs)
 {
@@ -701,72 +1254,77 @@ RTDECL(int) RTFileAioCtxWait(RTFILEAIOCTX hAioCtx, size_t cMinReqs, RTMSINTERVAL
      */
     int rc = VINF_SUCCESS;
     int cRequestsCompleted = 0;
-    while (!pCtxInt->fWokenUp)
+    if (pCtxInt->pIoUring)
+        rc = rtFileAioCtxWaitIoUring(pCtxInt, cMinReqs, cMillies, pahReqs, cReqs, &cRequestsCompleted);
+    else
     {
-        LNXKAIOIOEVENT  aPortEvents[AIO_MAXIMUM_REQUESTS_PER_CONTEXT];
-        int             cRequestsToWait = RT_MIN(cReqs, AIO_MAXIMUM_REQUESTS_PER_CONTEXT);
-        ASMAtomicXchgBool(&pCtxInt->fWaiting, true);
-        rc = rtFileAsyncIoLinuxGetEvents(pCtxInt->AioContext, cMinReqs, cRequestsToWait, &aPortEvents[0], pTimeout);
-        ASMAtomicXchgBool(&pCtxInt->fWaiting, false);
-        if (RT_FAILURE(rc))
-            break;
-        uint32_t const cDone = rc;
-        rc = VINF_SUCCESS;
-
-        /*
-         * Process received events / requests.
-         */
-        for (uint32_t i = 0; i < cDone; i++)
+        while (!pCtxInt->fWokenUp)
         {
-            /*
-             * The iocb is the first element in our request structure.
-             * So we can safely cast it directly to the handle (see above)
-             */
-            PRTFILEAIOREQINTERNAL pReqInt = (PRTFILEAIOREQINTERNAL)aPortEvents[i].pIoCB;
-            AssertPtr(pReqInt);
-            Assert(pReqInt->u32Magic == RTFILEAIOREQ_MAGIC);
+            LNXKAIOIOEVENT  aPortEvents[AIO_MAXIMUM_REQUESTS_PER_CONTEXT];
+            int             cRequestsToWait = RT_MIN(cReqs, AIO_MAXIMUM_REQUESTS_PER_CONTEXT);
+            ASMAtomicXchgBool(&pCtxInt->fWaiting, true);
+            rc = rtFileAsyncIoLinuxGetEvents(pCtxInt->AioContext, cMinReqs, cRequestsToWait, &aPortEvents[0], pTimeout);
+            ASMAtomicXchgBool(&pCtxInt->fWaiting, false);
+            if (RT_FAILURE(rc))
+                break;
+            uint32_t const cDone = rc;
+            rc = VINF_SUCCESS;
 
-            /** @todo aeichner: The rc field contains the result code
-             *  like you can find in errno for the normal read/write ops.
-             *  But there is a second field called rc2. I don't know the
-             *  purpose for it yet.
+            /*
+             * Process received events / requests.
              */
-            if (RT_UNLIKELY(aPortEvents[i].rc < 0))
-                pReqInt->Rc = RTErrConvertFromErrno(-aPortEvents[i].rc); /* Convert to positive value. */
-            else
+            for (uint32_t i = 0; i < cDone; i++)
             {
-                pReqInt->Rc = VINF_SUCCESS;
-                pReqInt->cbTransfered = aPortEvents[i].rc;
-            }
-
-            /* Mark the request as finished. */
-            RTFILEAIOREQ_SET_STATE(pReqInt, COMPLETED);
+                /*
+                 * The iocb is the first element in our request structure.
+                 * So we can safely cast it directly to the handle (see above)
+                 */
+                PRTFILEAIOREQINTERNAL pReqInt = (PRTFILEAIOREQINTERNAL)aPortEvents[i].pIoCB;
+                AssertPtr(pReqInt);
+                Assert(pReqInt->u32Magic == RTFILEAIOREQ_MAGIC);
+
+                /** @todo aeichner: The rc field contains the result code
+                 *  like you can find in errno for the normal read/write ops.
+                 *  But there is a second field called rc2. I don't know the
+                 *  purpose for it yet.
+                 */
+                if (RT_UNLIKELY(aPortEvents[i].rc < 0))
+                    pReqInt->Rc = RTErrConvertFromErrno(-aPortEvents[i].rc); /* Convert to positive value. */
+                else
+                {
+                    pReqInt->Rc = VINF_SUCCESS;
+                    pReqInt->cbTransfered = aPortEvents[i].rc;
+                }
+
+                /* Mark the request as finished. */
+                RTFILEAIOREQ_SET_STATE(pReqInt, COMPLETED);
 
-            pahReqs[cRequestsCompleted++] = (RTFILEAIOREQ)pReqInt;
-        }
+                pahReqs[cRequestsCompleted++] = (RTFILEAIOREQ)pReqInt;
+            }
 
-        /*
-         * Done Yet? If not advance and try again.
-         */
-        if (cDone >= cMinReqs)
-            break;
-        cMinReqs -= cDone;
-        cReqs    -= cDone;
+            /*
+             * Done Yet? If not advance and try again.
+             */
+            if (cDone >= cMinReqs)
+                break;
+            cMinReqs -= cDone;
+            cReqs    -= cDone;
 
-        if (cMillies != RT_INDEFINITE_WAIT)
-        {
-            /* The API doesn't return ETIMEDOUT, so we have to fix that ourselves. */
-            uint64_t NanoTS = RTTimeNanoTS();
-            uint64_t cMilliesElapsed = (NanoTS - StartNanoTS) / 1000000;
-            if (cMilliesElapsed >= cMillies)
+            if (cMillies != RT_INDEFINITE_WAIT)
             {
-                rc = VERR_TIMEOUT;
-                break;
+                /* The API doesn't return ETIMEDOUT, so we have to fix that ourselves. */
+                uint64_t NanoTS = RTTimeNanoTS();
+                uint64_t cMilliesElapsed = (NanoTS - StartNanoTS) / 1000000;
+                if (cMilliesElapsed >= cMillies)
+                {
+                    rc = VERR_TIMEOUT;
+                    break;
+                }
+
+                /* The syscall supposedly updates it, but we're paranoid. :-) */
+                Timeout.tv_sec  = (cMillies - (RTMSINTERVAL)cMilliesElapsed) / 1000;
+                Timeout.tv_nsec = (cMillies - (RTMSINTERVAL)cMilliesElapsed) % 1000 * 1000000;
             }
-
-            /* The syscall supposedly updates it, but we're paranoid. :-) */
-            Timeout.tv_sec  = (cMillies - (RTMSINTERVAL)cMilliesElapsed) / 1000;
-            Timeout.tv_nsec = (cMillies - (RTMSINTERVAL)cMilliesElapsed) % 1000 * 1000000;
         }
     }
 
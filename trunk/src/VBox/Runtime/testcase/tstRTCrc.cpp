@@ -0,0 +1,246 @@
+/* $Id$ */
+/** @file
+ * IPRT Testcase - CRC32 and CRC32C, correctness and throughput.
+ */
+
+/*
+ * Copyright (C) 2016 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ *
+ * The contents of this file may alternatively be used under the terms
+ * of the Common Development and Distribution License Version 1.0
+ * (CDDL) only, as it comes in the "COPYING.CDDL" file of the
+ * VirtualBox OSE distribution, in which case the provisions of the
+ * CDDL are applicable instead of those of the GPL.
+ *
+ * You may elect to license modified versions of this file under the
+ * terms and conditions of either the GPL or the CDDL or both.
+ */
+
+
+/*********************************************************************************************************************************
+*   Header Files                                                                                                                 *
+*********************************************************************************************************************************/
+#include <iprt/crc.h>
+
+#include <iprt/mem.h>
+#include <iprt/rand.h>
+#include <iprt/string.h>
+#include <iprt/test.h>
+#include <iprt/time.h>
+
+#include "internal/crc.h"
+
+
+/*********************************************************************************************************************************
+*   Structures and Typedefs                                                                                                      *
+*********************************************************************************************************************************/
+/** Raw CRC update worker (no start / finish inversion). */
+typedef uint32_t FNTSTCRCPROCESS(uint32_t uCrc, const void *pv, size_t cb);
+typedef FNTSTCRCPROCESS *PFNTSTCRCPROCESS;
+
+
+/*********************************************************************************************************************************
+*   Global Variables                                                                                                             *
+*********************************************************************************************************************************/
+/** The test handle. */
+static RTTEST   g_hTest;
+/** Byte-at-a-time reference tables, generated at startup. */
+static uint32_t g_au32RefCrc32[256];
+static uint32_t g_au32RefCrc32C[256];
+/** The benchmark buffer size. */
+static size_t   g_cbBench = _16M;
+/** The benchmark buffer. */
+static uint8_t *g_pbBench;
+/** Sink for the benchmark results. */
+static uint32_t volatile g_uSink;
+#ifdef IPRT_CRC_WITH_ASM
+/** RTCRC_HWACCEL_F_XXX for this CPU. */
+static uint32_t volatile g_fHwAccel = 0;
+#endif
+
+
+static void tstInitRefTable(uint32_t *pau32Table, uint32_t uPoly)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t uCrc = i;
+        for (unsigned iBit = 0; iBit < 8; iBit++)
+            uCrc = uCrc & 1 ? (uCrc >> 1) ^ uPoly : uCrc >> 1;
+        pau32Table[i] = uCrc;
+    }
+}
+
+
+static uint32_t tstRefProcess(uint32_t const *pau32Table, uint32_t uCrc, const void *pv, size_t cb)
+{
+    const uint8_t *pb = (const uint8_t *)pv;
+    while (cb-- > 0)
+        uCrc = pau32Table[(uCrc ^ *pb++) & 0xff] ^ (uCrc >> 8);
+    return uCrc;
+}
+
+static uint32_t tstRefCrc32Process(uint32_t uCrc, const void *pv, size_t cb)
+{
+    return tstRefProcess(g_au32RefCrc32, uCrc, pv, cb);
+}
+
+static uint32_t tstRefCrc32CProcess(uint32_t uCrc, const void *pv, size_t cb)
+{
+    return tstRefProcess(g_au32RefCrc32C, uCrc, pv, cb);
+}
+
+static uint32_t tstApiCrc32Process(uint32_t uCrc, const void *pv, size_t cb)
+{
+    return RTCrc32Process(uCrc, pv, cb);
+}
+
+static uint32_t tstApiCrc32CProcess(uint32_t uCrc, const void *pv, size_t cb)
+{
+    return RTCrc32CProcess(uCrc, pv, cb);
+}
+
+#ifdef IPRT_CRC_WITH_ASM
+static uint32_t tstPclmulCrc32Process(uint32_t uCrc, const void *pv, size_t cb)
+{
+    /* The worker only does whole 16 byte blocks. */
+    return rtCrc32ProcessPclmul(uCrc, pv, cb & ~(size_t)15);
+}
+
+static uint32_t tstSse42Crc32CProcess(uint32_t uCrc, const void *pv, size_t cb)
+{
+    return rtCrc32CProcessSse42(uCrc, pv, cb);
+}
+#endif
+
+
+/**
+ * Checks the APIs against the reference for lots of sizes and alignments,
+ * both in one go and chopped up.
+ */
+static void tstCorrectness(void)
+{
+    RTTestSub(g_hTest, "Known values");
+    RTTESTI_CHECK(RTCrc32("123456789", 9)  == UINT32_C(0xcbf43926));
+    RTTESTI_CHECK(RTCrc32C("123456789", 9) == UINT32_C(0xe3069283));
+    RTTESTI_CHECK(RTCrc32("", 0)  == 0);
+    RTTESTI_CHECK(RTCrc32C("", 0) == 0);
+
+    RTTestSub(g_hTest, "Sizes and alignments");
+    uint8_t abBuf[4096 + 64];
+    RTRandBytes(abBuf, sizeof(abBuf));
+    for (size_t off = 0; off < 16; off++)
+        for (size_t cb = 0; cb <= 4096 + 32; cb += cb < 320 ? 1 : 61)
+        {
+            uint32_t const uRef32  = tstRefProcess(g_au32RefCrc32,  UINT32_MAX, &abBuf[off], cb) ^ UINT32_MAX;
+            uint32_t const uRef32C = tstRefProcess(g_au32RefCrc32C, UINT32_MAX, &abBuf[off], cb) ^ UINT32_MAX;
+            RTTESTI_CHECK_MSG(RTCrc32(&abBuf[off], cb) == uRef32, ("off=%zu cb=%zu\n", off, cb));
+            RTTESTI_CHECK_MSG(RTCrc32C(&abBuf[off], cb) == uRef32C, ("off=%zu cb=%zu\n", off, cb));
+
+            size_t const cbFirst = cb / 3;
+            uint32_t uCrc = RTCrc32Start();
+            uCrc = RTCrc32Process(uCrc, &abBuf[off], cbFirst);
+            uCrc = RTCrc32Process(uCrc, &abBuf[off + cbFirst], cb - cbFirst);
+            RTTESTI_CHECK_MSG(RTCrc32Finish(uCrc) == uRef32, ("off=%zu cb=%zu (chained)\n", off, cb));
+
+            uCrc = RTCrc32CStart();
+            uCrc = RTCrc32CProcess(uCrc, &abBuf[off], cbFirst);
+            uCrc = RTCrc32CProcess(uCrc, &abBuf[off + cbFirst], cb - cbFirst);
+            RTTESTI_CHECK_MSG(RTCrc32CFinish(uCrc) == uRef32C, ("off=%zu cb=%zu (chained)\n", off, cb));
+        }
+
+#ifdef IPRT_CRC_WITH_ASM
+    /*
+     * The assembly workers directly, as the API may not be using them.
+     */
+    uint32_t const fFeatures = rtCrcHwAccelQuery(&g_fHwAccel);
+    if (fFeatures & RTCRC_HWACCEL_F_SSE42)
+    {
+        RTTestSub(g_hTest, "SSE4.2 CRC32C worker");
+        for (size_t off = 0; off < 16; off++)
+            for (size_t cb = 0; cb <= 1024; cb++)
+                RTTESTI_CHECK_MSG(   rtCrc32CProcessSse42(0x12345678, &abBuf[off], cb)
+                                  == tstRefProcess(g_au32RefCrc32C, 0x12345678, &abBuf[off], cb),
+                                  ("off=%zu cb=%zu\n", off, cb));
+    }
+    else
+        RTTestIPrintf(RTTESTLVL_ALWAYS, "SSE4.2 not supported, skipping its checks\n");
+
+    if (fFeatures & RTCRC_HWACCEL_F_PCLMUL)
+    {
+        RTTestSub(g_hTest, "PCLMULQDQ CRC32 worker");
+        for (size_t off = 0; off < 16; off++)
+            for (size_t cb = 64; cb <= 4096; cb += 16)
+                RTTESTI_CHECK_MSG(   rtCrc32ProcessPclmul(0x87654321, &abBuf[off], cb)
+                                  == tstRefProcess(g_au32RefCrc32, 0x87654321, &abBuf[off], cb),
+                                  ("off=%zu cb=%zu\n", off, cb));
+    }
+    else
+        RTTestIPrintf(RTTESTLVL_ALWAYS, "PCLMULQDQ not supported, skipping its checks\n");
+#endif
+}
+
+
+/**
+ * Runs one variant over the benchmark buffer and reports the throughput.
+ */
+static void tstBenchmark(const char *pszName, PFNTSTCRCPROCESS pfnProcess, unsigned cIterations)
+{
+    uint32_t       uCrc    = 0;
+    uint64_t const nsStart = RTTimeNanoTS();
+    for (unsigned i = 0; i < cIterations; i++)
+        uCrc = pfnProcess(uCrc, g_pbBench, g_cbBench);
+    uint64_t const cNs = RT_MAX(RTTimeNanoTS() - nsStart, 1);
+    g_uSink += uCrc;
+
+    uint64_t const cbTotal = (uint64_t)g_cbBench * cIterations;
+    RTTestValueF(g_hTest, cbTotal * RT_NS_1SEC / cNs / _1M, RTTESTUNIT_MEGABYTES_PER_SEC, "%s", pszName);
+}
+
+
+int main(int argc, char **argv)
+{
+    RTEXITCODE rcExit = RTTestInitAndCreate("tstRTCrc", &g_hTest);
+    if (rcExit != RTEXITCODE_SUCCESS)
+        return rcExit;
+    if (argc > 1)
+        g_cbBench = RT_MAX(RTStrToUInt32(argv[1]), 1) * (size_t)_1M;
+    RTTestBanner(g_hTest);
+
+    tstInitRefTable(g_au32RefCrc32,  UINT32_C(0xedb88320));
+    tstInitRefTable(g_au32RefCrc32C, UINT32_C(0x82f63b78));
+
+    tstCorrectness();
+
+    g_pbBench = (uint8_t *)RTMemPageAlloc(g_cbBench);
+    RTTESTI_CHECK_RET(g_pbBench != NULL, RTTestSummaryAndDestroy(g_hTest));
+    RTRandBytes(g_pbBench, g_cbBench);
+
+    RTTestSub(g_hTest, "CRC32 throughput");
+    tstBenchmark("CRC32 bytewise", tstRefCrc32Process, 1);
+    tstBenchmark("CRC32 API", tstApiCrc32Process, 8);
+#ifdef IPRT_CRC_WITH_ASM
+    uint32_t const fFeatures = rtCrcHwAccelQuery(&g_fHwAccel);
+    if (fFeatures & RTCRC_HWACCEL_F_PCLMUL)
+        tstBenchmark("CRC32 PCLMULQDQ", tstPclmulCrc32Process, 8);
+#endif
+
+    RTTestSub(g_hTest, "CRC32C throughput");
+    tstBenchmark("CRC32C bytewise", tstRefCrc32CProcess, 1);
+    tstBenchmark("CRC32C API", tstApiCrc32CProcess, 8);
+#ifdef IPRT_CRC_WITH_ASM
+    if (fFeatures & RTCRC_HWACCEL_F_SSE42)
+        tstBenchmark("CRC32C SSE4.2", tstSse42Crc32CProcess, 8);
+#endif
+
+    RTMemPageFree(g_pbBench, g_cbBench);
+    return RTTestSummaryAndDestroy(g_hTest);
+}
+
@@ -0,0 +1,2847 @@
+/* $Id$ */
+/** @file
+ * DDI - Deduplicating Disk Image.
+ */
+
+/*
+ * Copyright (C) 2026 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+
+/*********************************************************************************************************************************
+*   Header Files                                                                                                                 *
+*********************************************************************************************************************************/
+#define LOG_GROUP LOG_GROUP_VD_DDI
+#include <VBox/vd-plugin.h>
+#include <VBox/err.h>
+
+#include <VBox/log.h>
+#include <iprt/asm.h>
+#include <iprt/assert.h>
+#include <iprt/string.h>
+#include <iprt/alloc.h>
+#include <iprt/uuid.h>
+#include <iprt/sha.h>
+#include <iprt/path.h>
+
+#include "VDBackends.h"
+
+/**
+ * The DDI backend implements a copy-on-write image format where the data
+ * blocks are addressed by their content. Every logical block of the disk maps
+ * to a block in the store of the image and identical blocks are stored only
+ * once, no matter where they appear on the disk.
+ *
+ * A differencing image can also reference blocks in the store of its parent,
+ * so disks created as differencing images of a common template store only
+ * the blocks which differ from the template. A full block write which doesn't
+ * find its content in the own store looks it up in the store of the parent
+ * before allocating a new block. The parent is opened privately in read-only
+ * mode using the filename recorded in the header and is marked as shared when
+ * the differencing image is created. A shared image doesn't hand out freed
+ * blocks again before it is reopened because a child might still reference
+ * them, which matters while a child is merged into its parent.
+ *
+ * References reach the direct parent only. Merging deletes images without
+ * telling their grandchildren, a reference to an image further up the chain
+ * could end up pointing to a deleted file. When the parent of an image changes
+ * (e.g. during a merge) all blocks referenced in the old parent are copied to
+ * the own store before the old parent is deleted.
+ *
+ * File layout:
+ *    - The header in the first 4KB.
+ *    - The block map, one 32bit entry per logical block of the disk. Entries
+ *      with the top bit set reference a block in the store of the parent.
+ *    - The store, organised in groups which are appended as the image grows.
+ *      Each group starts with a 4KB entry page holding the SHA-256 hash and
+ *      reference count of the following 64 data blocks.
+ *
+ * The entry pages form the persistent hash index. When the image is opened
+ * the entries are loaded into an in memory hash table which is used to look
+ * up the content of full block writes. A block is freed when its last
+ * reference is dropped. Because a freed block might still be referenced by
+ * a map entry which is not on the disk yet, dropped references are only
+ * applied after the next flush completed.
+ *
+ * The header is marked dirty on the first modification and cleaned when the
+ * image is closed. If the image was not closed properly the reference counts
+ * and hashes are rebuilt from the block map when it is opened again.
+ *
+ * Missing things to implement:
+ *    - references to blocks further up the parent chain
+ *    - resizing (requires relocating the store)
+ *    - compaction of unused groups
+ */
+
+
+/*********************************************************************************************************************************
+*   Structures in a DDI image, little endian                                                                                     *
+*********************************************************************************************************************************/
+
+/** Size of the parent filename in the header, terminator included. */
+#define DDI_PARENT_FILENAME_MAX     2048
+
+#pragma pack(1)
+/**
+ * Geometry stored in the header.
+ */
+typedef struct DdiGeometry
+{
+    /** Number of cylinders. */
+    uint32_t    cCylinders;
+    /** Number of heads. */
+    uint32_t    cHeads;
+    /** Number of sectors per track. */
+    uint32_t    cSectors;
+} DdiGeometry;
+
+/**
+ * The DDI header.
+ */
+typedef struct DdiHeader
+{
+    /** Magic value. */
+    uint32_t    u32Magic;
+    /** Format version. */
+    uint32_t    u32Version;
+    /** Size of this header structure in bytes. */
+    uint32_t    cbHeader;
+    /** Header flags, DDI_HDR_F_XXX. */
+    uint32_t    fFlags;
+    /** Image flags (VD_IMAGE_FLAGS_XXX) the image was created with. */
+    uint32_t    fImageFlags;
+    /** Block size in bytes. */
+    uint32_t    cbBlock;
+    /** Logical image size as seen by the guest. */
+    uint64_t    cbDisk;
+    /** Number of entries in the block map. */
+    uint32_t    cBlocks;
+    /** Reserved, must be 0. */
+    uint32_t    u32Reserved;
+    /** Offset of the block map in bytes. */
+    uint64_t    offMap;
+    /** Offset of the first store group in bytes. */
+    uint64_t    offStore;
+    /** UUID of the image. */
+    RTUUID      UuidCreate;
+    /** UUID of the last modification. */
+    RTUUID      UuidModify;
+    /** UUID of the parent image. */
+    RTUUID      UuidParent;
+    /** UUID of the parent image modification. */
+    RTUUID      UuidParentModify;
+    /** Physical geometry. */
+    DdiGeometry PCHSGeometry;
+    /** Logical geometry. */
+    DdiGeometry LCHSGeometry;
+    /** Filename of the parent image whose store is referenced, zero terminated.
+     * Added with version 2. */
+    char        szParentFilename[DDI_PARENT_FILENAME_MAX];
+} DdiHeader;
+
+/**
+ * Entry describing one block of the store.
+ */
+typedef struct DdiBlockEntry
+{
+    /** SHA-256 hash of the block content. */
+    uint8_t     abHash[RTSHA256_HASH_SIZE];
+    /** Number of map entries referencing the block, 0 if the block is free. */
+    uint32_t    cRefs;
+    /** Reserved, must be 0. */
+    uint8_t     abReserved[28];
+} DdiBlockEntry;
+#pragma pack()
+AssertCompileSize(DdiBlockEntry, 64);
+AssertCompile(sizeof(DdiHeader) <= _4K);
+/** Pointer to a on disk DDI header. */
+typedef DdiHeader *PDdiHeader;
+
+/** DDI magic value. */
+#define DDI_MAGIC                   UINT32_C(0x00494444) /* DDI\0 */
+/** The current version of the format. */
+#define DDI_VERSION                 2
+/** Size of the header in version 1 images which don't have a parent filename. */
+#define DDI_HEADER_V1_SIZE          RT_OFFSETOF(DdiHeader, szParentFilename)
+/** Size reserved for the header. */
+#define DDI_HEADER_SIZE             _4K
+/** Block size minimum. */
+#define DDI_BLOCK_SIZE_MIN          _4K
+/** Block size maximum. */
+#define DDI_BLOCK_SIZE_MAX          _1M
+/** Default block size when creating an image. */
+#define DDI_BLOCK_SIZE_DEFAULT      (64 * _1K)
+/** Number of blocks in a store group. */
+#define DDI_GROUP_BLOCKS            64
+/** Size of the entry page at the start of a group. */
+#define DDI_GROUP_ENTRY_PAGE_SIZE   (DDI_GROUP_BLOCKS * sizeof(DdiBlockEntry))
+AssertCompile(DDI_GROUP_ENTRY_PAGE_SIZE == _4K);
+
+/** Header flags.
+ * @{
+ */
+/** The image was modified and not closed properly. */
+#define DDI_HDR_F_DIRTY             RT_BIT_32(0)
+/** Blocks of the store are referenced by differencing images. */
+#define DDI_HDR_F_SHARED            RT_BIT_32(1)
+/** Mask of valid header flags. */
+#define DDI_HDR_F_MASK              (DDI_HDR_F_DIRTY | DDI_HDR_F_SHARED)
+/** @} */
+
+/** Block map entry values.
+ * @{
+ */
+/** The block is not allocated in this image. */
+#define DDI_BLOCK_FREE              UINT32_C(0)
+/** The block reads as zero. */
+#define DDI_BLOCK_ZERO              UINT32_MAX
+/** Flag marking a reference to a block in the store of the parent. */
+#define DDI_BLOCK_PARENT_F          RT_BIT_32(31)
+/** Highest store block ID. */
+#define DDI_BLOCK_ID_MAX            (DDI_BLOCK_PARENT_F - 1)
+/** Checks whether the map entry references a block in the own store. */
+#define DDI_BLOCK_IS_STORED(a_idBlock) ((a_idBlock) != DDI_BLOCK_FREE && !((a_idBlock) & DDI_BLOCK_PARENT_F))
+/** Checks whether the map entry references a block in the store of the parent. */
+#define DDI_BLOCK_IS_PARENT(a_idBlock) (((a_idBlock) & DDI_BLOCK_PARENT_F) && (a_idBlock) != DDI_BLOCK_ZERO)
+/** @} */
+
+
+/*********************************************************************************************************************************
+*   Constants And Macros, Structures and Typedefs                                                                                *
+*********************************************************************************************************************************/
+
+/** Number of hash bytes kept in memory to identify the content of a block. */
+#define DDI_HASH_KEY_SIZE           16
+/** Initial number of slots in the in memory hash index. */
+#define DDI_INDEX_SLOTS_MIN         _4K
+
+/**
+ * In memory state of a block in the store.
+ */
+typedef struct DDISTOREBLOCK
+{
+    /** The leading bytes of the SHA-256 hash of the content. */
+    uint8_t             abKey[DDI_HASH_KEY_SIZE];
+    /** Number of references. */
+    uint32_t            cRefs;
+} DDISTOREBLOCK;
+/** Pointer to the in memory state of a store block. */
+typedef DDISTOREBLOCK *PDDISTOREBLOCK;
+
+/**
+ * A growable array of block IDs.
+ */
+typedef struct DDIIDARRAY
+{
+    /** The IDs. */
+    uint32_t           *paIds;
+    /** Number of valid entries. */
+    uint32_t            cIds;
+    /** Number of entries the array has room for. */
+    uint32_t            cIdsMax;
+} DDIIDARRAY;
+/** Pointer to an ID array. */
+typedef DDIIDARRAY *PDDIIDARRAY;
+
+/** Pointer to the DDI image data structure. */
+typedef struct DDIIMAGE *PDDIIMAGE;
+
+/**
+ * DDI image data structure.
+ */
+typedef struct DDIIMAGE
+{
+    /** Image name. */
+    const char          *pszFilename;
+    /** Storage handle. */
+    PVDIOSTORAGE        pStorage;
+
+    /** Pointer to the per-disk VD interface list. */
+    PVDINTERFACE        pVDIfsDisk;
+    /** Pointer to the per-image VD interface list. */
+    PVDINTERFACE        pVDIfsImage;
+    /** Error interface. */
+    PVDINTERFACEERROR   pIfError;
+    /** I/O interface. */
+    PVDINTERFACEIOINT   pIfIo;
+
+    /** Open flags passed by VBoxHD layer. */
+    unsigned            uOpenFlags;
+    /** Image flags defined during creation or determined during open. */
+    unsigned            uImageFlags;
+    /** Total size of the image. */
+    uint64_t            cbSize;
+    /** Physical geometry of this image. */
+    VDGEOMETRY          PCHSGeometry;
+    /** Logical geometry of this image. */
+    VDGEOMETRY          LCHSGeometry;
+    /** Image UUID. */
+    RTUUID              UuidCreate;
+    /** Modification UUID. */
+    RTUUID              UuidModify;
+    /** Parent image UUID. */
+    RTUUID              UuidParent;
+    /** Parent modification UUID. */
+    RTUUID              UuidParentModify;
+    /** Flag whether the header on the disk is marked dirty. */
+    bool                fDirty;
+    /** Flag whether differencing images reference blocks of the store. */
+    bool                fShared;
+    /** Flag whether this is a private instance providing the store of a parent. */
+    bool                fParentStore;
+    /** Filename of the parent as recorded in the header. */
+    char                szParentFilename[DDI_PARENT_FILENAME_MAX];
+    /** The privately opened parent whose store is referenced, NULL if none. */
+    PDDIIMAGE           pParent;
+
+    /** Block size in bytes. */
+    uint32_t            cbBlock;
+    /** Number of bits to shift an offset to get the block index. */
+    uint32_t            cBlockShift;
+    /** Number of logical blocks. */
+    uint32_t            cBlocks;
+    /** Offset of the block map. */
+    uint64_t            offMap;
+    /** Offset of the first store group. */
+    uint64_t            offStore;
+    /** Size of a store group in bytes. */
+    uint64_t            cbGroup;
+    /** The block map in host endianess. */
+    uint32_t           *pau32Map;
+
+    /** Number of groups in the store. */
+    uint32_t            cGroups;
+    /** State of the store blocks, indexed by block ID - 1. */
+    PDDISTOREBLOCK      paStoreBlocks;
+    /** Hash index, open addressing table of store block IDs (0 marks a free slot). */
+    uint32_t           *pau32Index;
+    /** Number of slots in the hash index, power of two. */
+    uint32_t            cIndexSlots;
+    /** Number of used slots in the hash index. */
+    uint32_t            cIndexUsed;
+    /** Unreferenced store blocks ready for reuse. */
+    DDIIDARRAY          FreeBlocks;
+    /** Store blocks which lost a reference since the last flush. */
+    DDIIDARRAY          ReleasePending;
+    /** Sink for the data of writes which were satisfied by an existing block. */
+    void               *pvScratch;
+
+    /** Number of full block writes which found their content in the store. */
+    uint64_t            cDedupHits;
+    /** Number of full block writes which found their content in the store of the parent. */
+    uint64_t            cDedupParentHits;
+    /** Number of full block writes which stored a new block. */
+    uint64_t            cDedupMisses;
+} DDIIMAGE;
+
+/**
+ * State of a data block write to a newly allocated store block.
+ */
+typedef struct DDIBLOCKALLOC
+{
+    /** The logical block index to link the new block to. */
+    uint32_t            idxBlock;
+    /** The store block ID. */
+    uint32_t            idBlock;
+    /** Hash of the content being written. */
+    uint8_t             abHash[RTSHA256_HASH_SIZE];
+} DDIBLOCKALLOC, *PDDIBLOCKALLOC;
+
+/**
+ * References released before a flush, applied once the flush completed.
+ */
+typedef struct DDIFLUSHRELEASE
+{
+    /** The released store block IDs. */
+    DDIIDARRAY          Ids;
+} DDIFLUSHRELEASE, *PDDIFLUSHRELEASE;
+
+
+/*********************************************************************************************************************************
+*   Static Variables                                                                                                             *
+*********************************************************************************************************************************/
+
+/** NULL-terminated array of supported file extensions. */
+static const VDFILEEXTENSION s_aDdiFileExtensions[] =
+{
+    {"ddi", VDTYPE_HDD},
+    {NULL,  VDTYPE_INVALID}
+};
+
+
+/*********************************************************************************************************************************
+*   Internal Functions                                                                                                           *
+*********************************************************************************************************************************/
+
+static int ddiFreeImage(PDDIIMAGE pImage, bool fDelete);
+static int ddiOpenImage(PDDIIMAGE pImage, unsigned uOpenFlags);
+
+/**
+ * Converts the image header to the host endianess and performs basic checks.
+ *
+ * @returns Whether the given header is valid or not.
+ * @param   pHeader    Pointer to the header to convert.
+ */
+static bool ddiHdrConvertToHostEndianess(PDdiHeader pHeader)
+{
+    pHeader->u32Magic                    = RT_LE2H_U32(pHeader->u32Magic);
+    pHeader->u32Version                  = RT_LE2H_U32(pHeader->u32Version);
+    pHeader->cbHeader                    = RT_LE2H_U32(pHeader->cbHeader);
+    pHeader->fFlags                      = RT_LE2H_U32(pHeader->fFlags);
+    pHeader->fImageFlags                 = RT_LE2H_U32(pHeader->fImageFlags);
+    pHeader->cbBlock                     = RT_LE2H_U32(pHeader->cbBlock);
+    pHeader->cbDisk                      = RT_LE2H_U64(pHeader->cbDisk);
+    pHeader->cBlocks                     = RT_LE2H_U32(pHeader->cBlocks);
+    pHeader->offMap                      = RT_LE2H_U64(pHeader->offMap);
+    pHeader->offStore                    = RT_LE2H_U64(pHeader->offStore);
+    pHeader->PCHSGeometry.cCylinders     = RT_LE2H_U32(pHeader->PCHSGeometry.cCylinders);
+    pHeader->PCHSGeometry.cHeads         = RT_LE2H_U32(pHeader->PCHSGeometry.cHeads);
+    pHeader->PCHSGeometry.cSectors       = RT_LE2H_U32(pHeader->PCHSGeometry.cSectors);
+    pHeader->LCHSGeometry.cCylinders     = RT_LE2H_U32(pHeader->LCHSGeometry.cCylinders);
+    pHeader->LCHSGeometry.cHeads         = RT_LE2H_U32(pHeader->LCHSGeometry.cHeads);
+    pHeader->LCHSGeometry.cSectors       = RT_LE2H_U32(pHeader->LCHSGeometry.cSectors);
+
+    if (RT_UNLIKELY(pHeader->u32Magic != DDI_MAGIC))
+        return false;
+    if (RT_UNLIKELY(   pHeader->u32Version < 1
+                    || pHeader->u32Version > DDI_VERSION
+                    || pHeader->cbHeader < (pHeader->u32Version == 1 ? DDI_HEADER_V1_SIZE : sizeof(DdiHeader))
+                    || pHeader->cbHeader > DDI_HEADER_SIZE))
+        return false;
+    if (pHeader->cbHeader < sizeof(DdiHeader))
+        memset((uint8_t *)pHeader + pHeader->cbHeader, 0, sizeof(DdiHeader) - pHeader->cbHeader);
+    if (RT_UNLIKELY(!RTStrEnd(pHeader->szParentFilename, sizeof(pHeader->szParentFilename))))
+        return false;
+    if (RT_UNLIKELY(pHeader->fFlags & ~DDI_HDR_F_MASK))
+        return false;
+    if (RT_UNLIKELY(   pHeader->cbBlock < DDI_BLOCK_SIZE_MIN
+                    || pHeader->cbBlock > DDI_BLOCK_SIZE_MAX
+                    || !RT_IS_POWER_OF_TWO(pHeader->cbBlock)))
+        return false;
+    if (RT_UNLIKELY(   pHeader->cbDisk % 512 != 0
+                    || (pHeader->cbDisk + pHeader->cbBlock - 1) / pHeader->cbBlock != pHeader->cBlocks))
+        return false;
+    if (RT_UNLIKELY(   pHeader->offMap < DDI_HEADER_SIZE
+                    || pHeader->offStore < pHeader->offMap + (uint64_t)pHeader->cBlocks * sizeof(uint32_t)))
+        return false;
+
+    return true;
+}
+
+/**
+ * Creates a DDI header from the given image state.
+ *
+ * @returns nothing.
+ * @param   pImage     Image instance data.
+ * @param   pHeader    Pointer to the header to convert.
+ */
+static void ddiHdrConvertFromHostEndianess(PDDIIMAGE pImage, PDdiHeader pHeader)
+{
+    RT_ZERO(*pHeader);
+    pHeader->u32Magic                    = RT_H2LE_U32(DDI_MAGIC);
+    pHeader->u32Version                  = RT_H2LE_U32(DDI_VERSION);
+    pHeader->cbHeader                    = RT_H2LE_U32(sizeof(DdiHeader));
+    pHeader->fFlags                      = RT_H2LE_U32(  (pImage->fDirty ? DDI_HDR_F_DIRTY : 0)
+                                                           | (pImage->fShared ? DDI_HDR_F_SHARED : 0));
+    pHeader->fImageFlags                 = RT_H2LE_U32(pImage->uImageFlags);
+    pHeader->cbBlock                     = RT_H2LE_U32(pImage->cbBlock);
+    pHeader->cbDisk                      = RT_H2LE_U64(pImage->cbSize);
+    pHeader->cBlocks                     = RT_H2LE_U32(pImage->cBlocks);
+    pHeader->offMap                      = RT_H2LE_U64(pImage->offMap);
+    pHeader->offStore                    = RT_H2LE_U64(pImage->offStore);
+    pHeader->UuidCreate                  = pImage->UuidCreate;
+    pHeader->UuidModify                  = pImage->UuidModify;
+    pHeader->UuidParent                  = pImage->UuidParent;
+    pHeader->UuidParentModify            = pImage->UuidParentModify;
+    pHeader->PCHSGeometry.cCylinders     = RT_H2LE_U32(pImage->PCHSGeometry.cCylinders);
+    pHeader->PCHSGeometry.cHeads         = RT_H2LE_U32(pImage->PCHSGeometry.cHeads);
+    pHeader->PCHSGeometry.cSectors       = RT_H2LE_U32(pImage->PCHSGeometry.cSectors);
+    pHeader->LCHSGeometry.cCylinders     = RT_H2LE_U32(pImage->LCHSGeometry.cCylinders);
+    pHeader->LCHSGeometry.cHeads         = RT_H2LE_U32(pImage->LCHSGeometry.cHeads);
+    pHeader->LCHSGeometry.cSectors       = RT_H2LE_U32(pImage->LCHSGeometry.cSectors);
+    memcpy(pHeader->szParentFilename, pImage->szParentFilename, sizeof(pHeader->szParentFilename));
+}
+
+/**
+ * Writes the header to the image.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pIoCtx    The I/O context, NULL for a synchronous write.
+ */
+static int ddiHdrWrite(PDDIIMAGE pImage, PVDIOCTX pIoCtx)
+{
+    DdiHeader Header;
+
+    ddiHdrConvertFromHostEndianess(pImage, &Header);
+    return vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage, 0, &Header, sizeof(Header),
+                                  pIoCtx, NULL, NULL);
+}
+
+/**
+ * Marks the image as dirty on the first modification.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pIoCtx    The I/O context, NULL for a synchronous write.
+ */
+static int ddiMarkDirty(PDDIIMAGE pImage, PVDIOCTX pIoCtx)
+{
+    if (pImage->fDirty)
+        return VINF_SUCCESS;
+
+    pImage->fDirty = true;
+    int rc = ddiHdrWrite(pImage, pIoCtx);
+    if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+        pImage->fDirty = false;
+    return rc;
+}
+
+/**
+ * Appends the given ID to the array, growing it if required.
+ *
+ * @returns VBox status code.
+ * @param   pArray    The array.
+ * @param   idBlock   The ID to append.
+ */
+static int ddiIdArrayAppend(PDDIIDARRAY pArray, uint32_t idBlock)
+{
+    if (pArray->cIds == pArray->cIdsMax)
+    {
+        uint32_t cIdsMaxNew = RT_MAX(pArray->cIdsMax * 2, DDI_GROUP_BLOCKS);
+        uint32_t *paIdsNew = (uint32_t *)RTMemRealloc(pArray->paIds, cIdsMaxNew * sizeof(uint32_t));
+        if (RT_UNLIKELY(!paIdsNew))
+            return VERR_NO_MEMORY;
+        pArray->paIds   = paIdsNew;
+        pArray->cIdsMax = cIdsMaxNew;
+    }
+
+    pArray->paIds[pArray->cIds++] = idBlock;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Frees the memory of the given ID array.
+ *
+ * @returns nothing.
+ * @param   pArray    The array.
+ */
+static void ddiIdArrayDestroy(PDDIIDARRAY pArray)
+{
+    if (pArray->paIds)
+        RTMemFree(pArray->paIds);
+    pArray->paIds   = NULL;
+    pArray->cIds    = 0;
+    pArray->cIdsMax = 0;
+}
+
+/**
+ * Returns the number of blocks the store has room for.
+ *
+ * @returns Number of store blocks.
+ * @param   pImage    The image instance data.
+ */
+DECLINLINE(uint32_t) ddiStoreGetBlockCount(PDDIIMAGE pImage)
+{
+    return pImage->cGroups * DDI_GROUP_BLOCKS;
+}
+
+/**
+ * Returns the in memory state of the given store block.
+ *
+ * @returns Pointer to the store block state.
+ * @param   pImage    The image instance data.
+ * @param   idBlock   The store block ID.
+ */
+DECLINLINE(PDDISTOREBLOCK) ddiStoreBlockGet(PDDIIMAGE pImage, uint32_t idBlock)
+{
+    Assert(idBlock && idBlock <= ddiStoreGetBlockCount(pImage));
+    return &pImage->paStoreBlocks[idBlock - 1];
+}
+
+/**
+ * Returns the offset of the entry page of the given group.
+ *
+ * @returns Offset in the image file.
+ * @param   pImage    The image instance data.
+ * @param   idxGroup  The group index.
+ */
+DECLINLINE(uint64_t) ddiStoreGroupGetOffset(PDDIIMAGE pImage, uint32_t idxGroup)
+{
+    return pImage->offStore + idxGroup * pImage->cbGroup;
+}
+
+/**
+ * Returns the offset of the entry for the given store block.
+ *
+ * @returns Offset in the image file.
+ * @param   pImage    The image instance data.
+ * @param   idBlock   The store block ID.
+ */
+DECLINLINE(uint64_t) ddiStoreBlockGetEntryOffset(PDDIIMAGE pImage, uint32_t idBlock)
+{
+    return   ddiStoreGroupGetOffset(pImage, (idBlock - 1) / DDI_GROUP_BLOCKS)
+           + ((idBlock - 1) % DDI_GROUP_BLOCKS) * sizeof(DdiBlockEntry);
+}
+
+/**
+ * Returns the offset of the data for the given store block.
+ *
+ * @returns Offset in the image file.
+ * @param   pImage    The image instance data.
+ * @param   idBlock   The store block ID.
+ */
+DECLINLINE(uint64_t) ddiStoreBlockGetDataOffset(PDDIIMAGE pImage, uint32_t idBlock)
+{
+    return   ddiStoreGroupGetOffset(pImage, (idBlock - 1) / DDI_GROUP_BLOCKS)
+           + DDI_GROUP_ENTRY_PAGE_SIZE
+           + (uint64_t)((idBlock - 1) % DDI_GROUP_BLOCKS) * pImage->cbBlock;
+}
+
+/**
+ * Returns the hash index slot to start the search for the given key at.
+ *
+ * @returns Slot index.
+ * @param   pImage    The image instance data.
+ * @param   pabKey    The hash key.
+ */
+DECLINLINE(uint32_t) ddiIndexGetSlot(PDDIIMAGE pImage, const uint8_t *pabKey)
+{
+    uint32_t u32;
+    memcpy(&u32, pabKey, sizeof(u32)); /* The hash is uniformly distributed, any bytes will do. */
+    return u32 & (pImage->cIndexSlots - 1);
+}
+
+/**
+ * Looks up the store block with the given content in the hash index.
+ *
+ * @returns ID of the store block or 0 if no block with the content is stored.
+ * @param   pImage    The image instance data.
+ * @param   pabHash   The SHA-256 hash of the content.
+ */
+static uint32_t ddiIndexLookup(PDDIIMAGE pImage, const uint8_t *pabHash)
+{
+    if (!pImage->cIndexSlots)
+        return 0;
+
+    uint32_t idxSlot = ddiIndexGetSlot(pImage, pabHash);
+    uint32_t idBlock;
+    while ((idBlock = pImage->pau32Index[idxSlot]) != 0)
+    {
+        if (!memcmp(ddiStoreBlockGet(pImage, idBlock)->abKey, pabHash, DDI_HASH_KEY_SIZE))
+            return idBlock;
+        idxSlot = (idxSlot + 1) & (pImage->cIndexSlots - 1);
+    }
+
+    return 0;
+}
+
+/**
+ * Inserts the given block into the hash index slot array without growing it.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ * @param   idBlock   The store block ID.
+ */
+static void ddiIndexInsertWorker(PDDIIMAGE pImage, uint32_t idBlock)
+{
+    uint32_t idxSlot = ddiIndexGetSlot(pImage, ddiStoreBlockGet(pImage, idBlock)->abKey);
+    while (pImage->pau32Index[idxSlot])
+        idxSlot = (idxSlot + 1) & (pImage->cIndexSlots - 1);
+    pImage->pau32Index[idxSlot] = idBlock;
+    pImage->cIndexUsed++;
+}
+
+/**
+ * Inserts the given block into the hash index, growing the index if it gets
+ * too crowded.
+ *
+ * The index is only used to find duplicates, a block which can't be inserted
+ * because the memory is exhausted is simply not deduplicated.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ * @param   idBlock   The store block ID.
+ */
+static void ddiIndexInsert(PDDIIMAGE pImage, uint32_t idBlock)
+{
+    if ((pImage->cIndexUsed + 1) * 2 > pImage->cIndexSlots)
+    {
+        uint32_t cSlotsNew = RT_MAX(pImage->cIndexSlots * 2, DDI_INDEX_SLOTS_MIN);
+        uint32_t *pau32IndexNew = (uint32_t *)RTMemAllocZ(cSlotsNew * sizeof(uint32_t));
+        if (pau32IndexNew)
+        {
+            uint32_t *pau32IndexOld = pImage->pau32Index;
+            uint32_t cSlotsOld = pImage->cIndexSlots;
+
+            pImage->pau32Index  = pau32IndexNew;
+            pImage->cIndexSlots = cSlotsNew;
+            pImage->cIndexUsed  = 0;
+            for (uint32_t i = 0; i < cSlotsOld; i++)
+                if (pau32IndexOld[i])
+                    ddiIndexInsertWorker(pImage, pau32IndexOld[i]);
+
+            if (pau32IndexOld)
+                RTMemFree(pau32IndexOld);
+        }
+        else if (pImage->cIndexUsed + 1 >= pImage->cIndexSlots)
+        {
+            LogFlowFunc(("Out of memory growing the hash index, block %u is not indexed\n", idBlock));
+            return;
+        }
+    }
+
+    ddiIndexInsertWorker(pImage, idBlock);
+}
+
+/**
+ * Removes the given block from the hash index.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ * @param   idBlock   The store block ID.
+ */
+static void ddiIndexRemove(PDDIIMAGE pImage, uint32_t idBlock)
+{
+    if (!pImage->cIndexSlots)
+        return;
+
+    uint32_t fMask = pImage->cIndexSlots - 1;
+    uint32_t idxSlot = ddiIndexGetSlot(pImage, ddiStoreBlockGet(pImage, idBlock)->abKey);
+    while (   pImage->pau32Index[idxSlot]
+           && pImage->pau32Index[idxSlot] != idBlock)
+        idxSlot = (idxSlot + 1) & fMask;
+
+    if (!pImage->pau32Index[idxSlot])
+        return; /* Not indexed. */
+
+    /* Shift the following entries of the probe sequence back to close the gap. */
+    uint32_t idxNext = idxSlot;
+    for (;;)
+    {
+        idxNext = (idxNext + 1) & fMask;
+        uint32_t idNext = pImage->pau32Index[idxNext];
+        if (!idNext)
+            break;
+
+        uint32_t idxHome = ddiIndexGetSlot(pImage, ddiStoreBlockGet(pImage, idNext)->abKey);
+        if (((idxNext - idxHome) & fMask) >= ((idxNext - idxSlot) & fMask))
+        {
+            pImage->pau32Index[idxSlot] = idNext;
+            idxSlot = idxNext;
+        }
+    }
+
+    pImage->pau32Index[idxSlot] = 0;
+    pImage->cIndexUsed--;
+}
+
+/**
+ * Adds a new group to the store and puts its blocks on the free list.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ */
+static int ddiStoreGroupAdd(PDDIIMAGE pImage)
+{
+    uint32_t cStoreBlocks = ddiStoreGetBlockCount(pImage);
+    if (cStoreBlocks + DDI_GROUP_BLOCKS > DDI_BLOCK_ID_MAX)
+        return VERR_DISK_FULL;
+
+    /* Reserve the memory first so nothing has to be undone later. */
+    PDDISTOREBLOCK paStoreBlocksNew = (PDDISTOREBLOCK)RTMemRealloc(pImage->paStoreBlocks,
+                                                                    (cStoreBlocks + DDI_GROUP_BLOCKS) * sizeof(DDISTOREBLOCK));
+    if (RT_UNLIKELY(!paStoreBlocksNew))
+        return VERR_NO_MEMORY;
+    pImage->paStoreBlocks = paStoreBlocksNew;
+
+    if (pImage->FreeBlocks.cIds + DDI_GROUP_BLOCKS > pImage->FreeBlocks.cIdsMax)
+    {
+        uint32_t cIdsMaxNew = pImage->FreeBlocks.cIds + DDI_GROUP_BLOCKS;
+        uint32_t *paIdsNew = (uint32_t *)RTMemRealloc(pImage->FreeBlocks.paIds, cIdsMaxNew * sizeof(uint32_t));
+        if (RT_UNLIKELY(!paIdsNew))
+            return VERR_NO_MEMORY;
+        pImage->FreeBlocks.paIds   = paIdsNew;
+        pImage->FreeBlocks.cIdsMax = cIdsMaxNew;
+    }
+
+    /*
+     * Extend the file to cover the entry page which reads as zero afterwards,
+     * the data blocks extend the file when they are written.
+     */
+    uint64_t offGroup = ddiStoreGroupGetOffset(pImage, pImage->cGroups);
+    uint64_t cbFile = 0;
+    int rc = vdIfIoIntFileGetSize(pImage->pIfIo, pImage->pStorage, &cbFile);
+    if (   RT_SUCCESS(rc)
+        && cbFile < offGroup + DDI_GROUP_ENTRY_PAGE_SIZE)
+        rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, offGroup + DDI_GROUP_ENTRY_PAGE_SIZE);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    memset(&pImage->paStoreBlocks[cStoreBlocks], 0, DDI_GROUP_BLOCKS * sizeof(DDISTOREBLOCK));
+    pImage->cGroups++;
+
+    /* Push in reverse order so the blocks are handed out in ascending order. */
+    for (uint32_t i = DDI_GROUP_BLOCKS; i > 0; i--)
+        pImage->FreeBlocks.paIds[pImage->FreeBlocks.cIds++] = cStoreBlocks + i;
+
+    LogFlowFunc(("Added store group %u at offset %llu\n", pImage->cGroups - 1, offGroup));
+    return VINF_SUCCESS;
+}
+
+/**
+ * Allocates an unused block from the store.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pidBlock  Where to store the ID of the allocated block.
+ */
+static int ddiStoreBlockAlloc(PDDIIMAGE pImage, uint32_t *pidBlock)
+{
+    if (!pImage->FreeBlocks.cIds)
+    {
+        int rc = ddiStoreGroupAdd(pImage);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+
+    *pidBlock = pImage->FreeBlocks.paIds[--pImage->FreeBlocks.cIds];
+    Assert(!ddiStoreBlockGet(pImage, *pidBlock)->cRefs);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Writes the reference count of the given store block to the image.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pIoCtx    The I/O context, NULL for a synchronous write.
+ * @param   idBlock   The store block ID.
+ */
+static int ddiStoreBlockRefsWrite(PDDIIMAGE pImage, PVDIOCTX pIoCtx, uint32_t idBlock)
+{
+    uint32_t cRefs = RT_H2LE_U32(ddiStoreBlockGet(pImage, idBlock)->cRefs);
+    return vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                  ddiStoreBlockGetEntryOffset(pImage, idBlock) + RT_OFFSETOF(DdiBlockEntry, cRefs),
+                                  &cRefs, sizeof(cRefs), pIoCtx, NULL, NULL);
+}
+
+/**
+ * Writes the hash of the given store block to the image.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pIoCtx    The I/O context, NULL for a synchronous write.
+ * @param   idBlock   The store block ID.
+ * @param   pabHash   The full SHA-256 hash of the block content.
+ */
+static int ddiStoreBlockHashWrite(PDDIIMAGE pImage, PVDIOCTX pIoCtx, uint32_t idBlock, uint8_t *pabHash)
+{
+    return vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                  ddiStoreBlockGetEntryOffset(pImage, idBlock) + RT_OFFSETOF(DdiBlockEntry, abHash),
+                                  pabHash, RTSHA256_HASH_SIZE, pIoCtx, NULL, NULL);
+}
+
+/**
+ * Adds a reference to the given store block.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pIoCtx    The I/O context, NULL for a synchronous write.
+ * @param   idBlock   The store block ID.
+ */
+static int ddiStoreBlockRetain(PDDIIMAGE pImage, PVDIOCTX pIoCtx, uint32_t idBlock)
+{
+    ddiStoreBlockGet(pImage, idBlock)->cRefs++;
+    return ddiStoreBlockRefsWrite(pImage, pIoCtx, idBlock);
+}
+
+/**
+ * Drops the given references now. Blocks without any reference left are
+ * removed from the index and put on the free list unless children might
+ * still reference them.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pIoCtx    The I/O context, NULL for a synchronous write.
+ * @param   pIds      The store block IDs to release.
+ */
+static int ddiStoreBlocksRelease(PDDIIMAGE pImage, PVDIOCTX pIoCtx, PDDIIDARRAY pIds)
+{
+    int rc = VINF_SUCCESS;
+
+    for (uint32_t i = 0; i < pIds->cIds; i++)
+    {
+        uint32_t idBlock = pIds->paIds[i];
+        PDDISTOREBLOCK pBlock = ddiStoreBlockGet(pImage, idBlock);
+
+        Assert(pBlock->cRefs);
+        pBlock->cRefs--;
+        int rc2 = ddiStoreBlockRefsWrite(pImage, pIoCtx, idBlock);
+        if (RT_FAILURE(rc2) && rc2 != VERR_VD_ASYNC_IO_IN_PROGRESS)
+        {
+            pBlock->cRefs++; /* Keep it, leaking the block is better than losing data. */
+            rc = rc2;
+            continue;
+        }
+        if (rc2 == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            rc = rc2;
+
+        if (!pBlock->cRefs)
+        {
+            ddiIndexRemove(pImage, idBlock);
+
+            /* The content must stay intact for the children until the image is reopened. */
+            if (!pImage->fShared)
+            {
+                rc2 = ddiIdArrayAppend(&pImage->FreeBlocks, idBlock);
+                if (RT_FAILURE(rc2))
+                    LogFlowFunc(("Out of memory, store block %u is leaked until the image is reopened\n", idBlock));
+            }
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * Writes the map entry of the given logical block to the image.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pIoCtx    The I/O context, NULL for a synchronous write.
+ * @param   idxBlock  The logical block index.
+ */
+static int ddiBlockMapWrite(PDDIIMAGE pImage, PVDIOCTX pIoCtx, uint32_t idxBlock)
+{
+    uint32_t u32Entry = RT_H2LE_U32(pImage->pau32Map[idxBlock]);
+    return vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                  pImage->offMap + idxBlock * sizeof(uint32_t),
+                                  &u32Entry, sizeof(u32Entry), pIoCtx, NULL, NULL);
+}
+
+/**
+ * Links the given logical block to a new target, releasing the reference to
+ * the old store block after the next flush.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pIoCtx    The I/O context.
+ * @param   idxBlock  The logical block index.
+ * @param   idBlock   The new map entry.
+ */
+static int ddiBlockMapSet(PDDIIMAGE pImage, PVDIOCTX pIoCtx, uint32_t idxBlock, uint32_t idBlock)
+{
+    uint32_t idBlockOld = pImage->pau32Map[idxBlock];
+
+    if (idBlockOld == idBlock)
+        return VINF_SUCCESS;
+
+    pImage->pau32Map[idxBlock] = idBlock;
+    int rc = ddiBlockMapWrite(pImage, pIoCtx, idxBlock);
+    if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+        pImage->pau32Map[idxBlock] = idBlockOld;
+    else if (   DDI_BLOCK_IS_STORED(idBlockOld)
+             && RT_FAILURE(ddiIdArrayAppend(&pImage->ReleasePending, idBlockOld)))
+        LogFlowFunc(("Out of memory, store block %u is leaked until the image is reopened\n", idBlockOld));
+
+    return rc;
+}
+
+/**
+ * Computes the SHA-256 hash of the data in the I/O context without advancing it.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pIoCtx    The I/O context.
+ * @param   cb        Number of bytes to hash.
+ * @param   pabHash   Where to store the hash.
+ */
+static int ddiIoCtxHash(PDDIIMAGE pImage, PVDIOCTX pIoCtx, size_t cb, uint8_t *pabHash)
+{
+    RTSGSEG  aSegsStack[16];
+    PRTSGSEG paSegs = &aSegsStack[0];
+    unsigned cSegs = 0;
+
+    vdIfIoIntIoCtxSegArrayCreate(pImage->pIfIo, pIoCtx, NULL, &cSegs, cb);
+    if (cSegs > RT_ELEMENTS(aSegsStack))
+    {
+        paSegs = (PRTSGSEG)RTMemTmpAlloc(cSegs * sizeof(RTSGSEG));
+        if (RT_UNLIKELY(!paSegs))
+            return VERR_NO_MEMORY;
+    }
+
+    size_t cbSegs = vdIfIoIntIoCtxSegArrayCreate(pImage->pIfIo, pIoCtx, paSegs, &cSegs, cb);
+    Assert(cbSegs == cb); NOREF(cbSegs);
+
+    RTSHA256CONTEXT Ctx;
+    RTSha256Init(&Ctx);
+    for (unsigned i = 0; i < cSegs; i++)
+        RTSha256Update(&Ctx, paSegs[i].pvSeg, paSegs[i].cbSeg);
+    RTSha256Final(&Ctx, pabHash);
+
+    if (paSegs != &aSegsStack[0])
+        RTMemTmpFree(paSegs);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Updates the state of a write to a newly allocated store block.
+ *
+ * @returns VBox status code.
+ * @param   pBackendData    The opaque backend data.
+ * @param   pIoCtx          I/O context associated with this request.
+ * @param   pvUser          Opaque user data passed during a read/write request.
+ * @param   rcReq           Status code for the completed request.
+ */
+static DECLCALLBACK(int) ddiBlockAllocUpdate(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    PDDIBLOCKALLOC pBlockAlloc = (PDDIBLOCKALLOC)pvUser;
+    int rc = rcReq;
+
+    if (RT_SUCCESS(rcReq))
+    {
+        /*
+         * The data is in place, write the entry and link the block into the map
+         * afterwards. The worst case which can happen is a leaked block.
+         */
+        PDDISTOREBLOCK pBlock = ddiStoreBlockGet(pImage, pBlockAlloc->idBlock);
+
+        memcpy(pBlock->abKey, pBlockAlloc->abHash, DDI_HASH_KEY_SIZE);
+        pBlock->cRefs = 1;
+
+        rc = ddiStoreBlockHashWrite(pImage, pIoCtx, pBlockAlloc->idBlock, pBlockAlloc->abHash);
+        if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            rc = ddiStoreBlockRefsWrite(pImage, pIoCtx, pBlockAlloc->idBlock);
+        if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            rc = ddiBlockMapSet(pImage, pIoCtx, pBlockAlloc->idxBlock, pBlockAlloc->idBlock);
+
+        if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+        {
+            ddiIndexInsert(pImage, pBlockAlloc->idBlock);
+            rc = VINF_SUCCESS;
+        }
+        else
+            pBlock->cRefs = 0; /* Not linked, the block is free again. */
+    }
+
+    if (   RT_FAILURE(rc)
+        && RT_FAILURE(ddiIdArrayAppend(&pImage->FreeBlocks, pBlockAlloc->idBlock)))
+        LogFlowFunc(("Out of memory, store block %u is leaked until the image is reopened\n", pBlockAlloc->idBlock));
+
+    RTMemFree(pBlockAlloc);
+    return rc;
+}
+
+/**
+ * Applies the references released before a flush once it completed.
+ *
+ * @returns VBox status code.
+ * @param   pBackendData    The opaque backend data.
+ * @param   pIoCtx          I/O context associated with this request.
+ * @param   pvUser          Opaque user data passed during a read/write request.
+ * @param   rcReq           Status code for the completed request.
+ */
+static DECLCALLBACK(int) ddiFlushUpdate(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    PDDIFLUSHRELEASE pRelease = (PDDIFLUSHRELEASE)pvUser;
+    int rc = rcReq;
+
+    if (RT_SUCCESS(rcReq))
+    {
+        rc = ddiStoreBlocksRelease(pImage, pIoCtx, &pRelease->Ids);
+        if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            rc = VINF_SUCCESS;
+    }
+    else
+    {
+        /* The map updates might not be on the disk, try again with the next flush. */
+        for (uint32_t i = 0; i < pRelease->Ids.cIds; i++)
+            if (RT_FAILURE(ddiIdArrayAppend(&pImage->ReleasePending, pRelease->Ids.paIds[i])))
+                break;
+    }
+
+    ddiIdArrayDestroy(&pRelease->Ids);
+    RTMemFree(pRelease);
+    return rc;
+}
+
+/**
+ * Internal. Flush image data to disk, applying all released references.
+ */
+static int ddiFlushImage(PDDIIMAGE pImage)
+{
+    int rc = VINF_SUCCESS;
+
+    if (   pImage->pStorage
+        && !(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
+    {
+        /* Make the map updates durable before dropping the references to the old blocks. */
+        rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+        if (RT_SUCCESS(rc))
+        {
+            rc = ddiStoreBlocksRelease(pImage, NULL, &pImage->ReleasePending);
+            pImage->ReleasePending.cIds = 0;
+        }
+
+        if (RT_SUCCESS(rc))
+        {
+            pImage->fDirty = false;
+            rc = ddiHdrWrite(pImage, NULL);
+            if (RT_SUCCESS(rc))
+                rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * Closes the privately opened parent.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ */
+static void ddiParentClose(PDDIIMAGE pImage)
+{
+    if (pImage->pParent)
+    {
+        ddiFreeImage(pImage->pParent, false);
+        RTMemFree(pImage->pParent);
+        pImage->pParent = NULL;
+    }
+}
+
+/**
+ * Internal. Free all allocated space for representing an image except pImage,
+ * and optionally delete the image from disk.
+ */
+static int ddiFreeImage(PDDIIMAGE pImage, bool fDelete)
+{
+    int rc = VINF_SUCCESS;
+
+    /* Freeing a never allocated image (e.g. because the open failed) is
+     * not signalled as an error. After all nothing bad happens. */
+    if (pImage)
+    {
+        ddiParentClose(pImage);
+
+        if (pImage->pStorage)
+        {
+            /* No point updating the file that is deleted anyway. */
+            if (!fDelete)
+                ddiFlushImage(pImage);
+
+            rc = vdIfIoIntFileClose(pImage->pIfIo, pImage->pStorage);
+            pImage->pStorage = NULL;
+        }
+
+        if (pImage->pau32Map)
+        {
+            RTMemFree(pImage->pau32Map);
+            pImage->pau32Map = NULL;
+        }
+
+        if (pImage->paStoreBlocks)
+        {
+            RTMemFree(pImage->paStoreBlocks);
+            pImage->paStoreBlocks = NULL;
+        }
+
+        if (pImage->pau32Index)
+        {
+            RTMemFree(pImage->pau32Index);
+            pImage->pau32Index = NULL;
+        }
+
+        if (pImage->pvScratch)
+        {
+            RTMemPageFree(pImage->pvScratch, pImage->cbBlock);
+            pImage->pvScratch = NULL;
+        }
+
+        ddiIdArrayDestroy(&pImage->FreeBlocks);
+        ddiIdArrayDestroy(&pImage->ReleasePending);
+        pImage->cGroups     = 0;
+        pImage->cIndexSlots = 0;
+        pImage->cIndexUsed  = 0;
+
+        if (fDelete && pImage->pszFilename)
+            vdIfIoIntFileDelete(pImage->pIfIo, pImage->pszFilename);
+    }
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/**
+ * Initializes the in memory state derived from the image geometry.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ */
+static int ddiImageStateInit(PDDIIMAGE pImage)
+{
+    pImage->cBlockShift = ASMBitFirstSetU32(pImage->cbBlock) - 1;
+    pImage->cbGroup     = DDI_GROUP_ENTRY_PAGE_SIZE + (uint64_t)DDI_GROUP_BLOCKS * pImage->cbBlock;
+
+    pImage->pau32Map = (uint32_t *)RTMemAllocZ(RT_MAX(pImage->cBlocks, 1) * sizeof(uint32_t));
+    pImage->pvScratch = RTMemPageAlloc(pImage->cbBlock);
+    if (   !pImage->pau32Map
+        || !pImage->pvScratch)
+        return VERR_NO_MEMORY;
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Loads the entries of all store groups.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   cbFile    Size of the image file.
+ */
+static int ddiStoreLoad(PDDIIMAGE pImage, uint64_t cbFile)
+{
+    int rc = VINF_SUCCESS;
+
+    uint64_t cGroups = cbFile > pImage->offStore
+                     ? (cbFile - pImage->offStore + pImage->cbGroup - 1) / pImage->cbGroup
+                     : 0;
+    if (cGroups * DDI_GROUP_BLOCKS > DDI_BLOCK_ID_MAX)
+        return VERR_VD_GEN_INVALID_HEADER;
+
+    if (cGroups)
+    {
+        pImage->paStoreBlocks = (PDDISTOREBLOCK)RTMemAllocZ(cGroups * DDI_GROUP_BLOCKS * sizeof(DDISTOREBLOCK));
+        if (!pImage->paStoreBlocks)
+            return VERR_NO_MEMORY;
+    }
+    pImage->cGroups = (uint32_t)cGroups;
+
+    DdiBlockEntry *paEntries = (DdiBlockEntry *)RTMemTmpAlloc(DDI_GROUP_ENTRY_PAGE_SIZE);
+    if (!paEntries)
+        return VERR_NO_MEMORY;
+
+    for (uint32_t idxGroup = 0; idxGroup < pImage->cGroups && RT_SUCCESS(rc); idxGroup++)
+    {
+        rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, ddiStoreGroupGetOffset(pImage, idxGroup),
+                                   paEntries, DDI_GROUP_ENTRY_PAGE_SIZE);
+        if (RT_SUCCESS(rc))
+        {
+            for (uint32_t i = 0; i < DDI_GROUP_BLOCKS; i++)
+            {
+                PDDISTOREBLOCK pBlock = &pImage->paStoreBlocks[idxGroup * DDI_GROUP_BLOCKS + i];
+
+                memcpy(pBlock->abKey, paEntries[i].abHash, DDI_HASH_KEY_SIZE);
+                pBlock->cRefs = RT_LE2H_U32(paEntries[i].cRefs);
+            }
+        }
+    }
+
+    RTMemTmpFree(paEntries);
+    return rc;
+}
+
+/**
+ * Rebuilds the reference counts and hashes of the store from the block map
+ * after the image was not closed properly.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ */
+static int ddiCheckImage(PDDIIMAGE pImage)
+{
+    int rc = VINF_SUCCESS;
+    uint32_t cStoreBlocks = ddiStoreGetBlockCount(pImage);
+    uint32_t *pacRefs = (uint32_t *)RTMemAllocZ(RT_MAX(cStoreBlocks, 1) * sizeof(uint32_t));
+
+    if (!pacRefs)
+        return VERR_NO_MEMORY;
+
+    /* Count the references, dropping map entries pointing outside of the store. */
+    for (uint32_t idxBlock = 0; idxBlock < pImage->cBlocks && RT_SUCCESS(rc); idxBlock++)
+    {
+        uint32_t idBlock = pImage->pau32Map[idxBlock];
+
+        if (!DDI_BLOCK_IS_STORED(idBlock))
+            continue;
+
+        if (idBlock > cStoreBlocks)
+        {
+            vdIfErrorMessage(pImage->pIfError, "Map entry %u points to invalid block %u, clearing\n",
+                             idxBlock, idBlock);
+            pImage->pau32Map[idxBlock] = DDI_BLOCK_FREE;
+            rc = ddiBlockMapWrite(pImage, NULL, idxBlock);
+        }
+        else
+            pacRefs[idBlock - 1]++;
+    }
+
+    /*
+     * Rehash every referenced block, the entry might not have made it to the
+     * disk before the data and map were written.
+     */
+    for (uint32_t idBlock = 1; idBlock <= cStoreBlocks && RT_SUCCESS(rc); idBlock++)
+    {
+        PDDISTOREBLOCK pBlock = ddiStoreBlockGet(pImage, idBlock);
+
+        if (pacRefs[idBlock - 1])
+        {
+            uint8_t abHash[RTSHA256_HASH_SIZE];
+
+            rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, ddiStoreBlockGetDataOffset(pImage, idBlock),
+                                       pImage->pvScratch, pImage->cbBlock);
+            if (RT_FAILURE(rc))
+                break;
+
+            RTSha256(pImage->pvScratch, pImage->cbBlock, abHash);
+            if (memcmp(pBlock->abKey, abHash, DDI_HASH_KEY_SIZE))
+            {
+                memcpy(pBlock->abKey, abHash, DDI_HASH_KEY_SIZE);
+                rc = ddiStoreBlockHashWrite(pImage, NULL, idBlock, abHash);
+            }
+        }
+
+        if (   RT_SUCCESS(rc)
+            && pBlock->cRefs != pacRefs[idBlock - 1])
+        {
+            pBlock->cRefs = pacRefs[idBlock - 1];
+            rc = ddiStoreBlockRefsWrite(pImage, NULL, idBlock);
+        }
+    }
+
+    RTMemFree(pacRefs);
+
+    if (RT_SUCCESS(rc))
+        rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+
+    return rc;
+}
+
+/**
+ * Builds the hash index and free list from the loaded store entries.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ */
+static int ddiIndexBuild(PDDIIMAGE pImage)
+{
+    uint32_t cStoreBlocks = ddiStoreGetBlockCount(pImage);
+
+    /* Walk backwards so the free blocks are handed out in ascending order. */
+    for (uint32_t idBlock = cStoreBlocks; idBlock > 0; idBlock--)
+    {
+        if (ddiStoreBlockGet(pImage, idBlock)->cRefs)
+            ddiIndexInsert(pImage, idBlock);
+        else
+        {
+            int rc = ddiIdArrayAppend(&pImage->FreeBlocks, idBlock);
+            if (RT_FAILURE(rc))
+                return rc;
+        }
+    }
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Opens the given parent privately to reference blocks of its store.
+ *
+ * @returns VBox status code.
+ * @param   pImage        The image instance data.
+ * @param   pszFilename   The filename of the parent.
+ * @param   fMarkShared   Flag whether to mark the store of the parent as shared,
+ *                        the parent is opened in read/write mode for a moment.
+ */
+static int ddiParentOpenWorker(PDDIIMAGE pImage, const char *pszFilename, bool fMarkShared)
+{
+    size_t cbFilename = strlen(pszFilename) + 1;
+    PDDIIMAGE pParent = (PDDIIMAGE)RTMemAllocZ(sizeof(DDIIMAGE) + cbFilename);
+    if (RT_UNLIKELY(!pParent))
+        return VERR_NO_MEMORY;
+
+    /* The filename lives right after the instance data. */
+    memcpy(pParent + 1, pszFilename, cbFilename);
+    pParent->pszFilename  = (const char *)(pParent + 1);
+    pParent->pVDIfsDisk   = pImage->pVDIfsDisk;
+    pParent->pVDIfsImage  = pImage->pVDIfsImage;
+    pParent->fParentStore = true;
+
+    int rc = VINF_SUCCESS;
+    if (fMarkShared)
+    {
+        /* A parent which can't be written to is still fine if it is shared already. */
+        if (RT_SUCCESS(ddiOpenImage(pParent, 0 /* uOpenFlags */)))
+        {
+            pParent->fShared = true;
+            rc = ddiFlushImage(pParent);
+            ddiFreeImage(pParent, false);
+        }
+    }
+
+    if (RT_SUCCESS(rc))
+        rc = ddiOpenImage(pParent, VD_OPEN_FLAGS_READONLY);
+    if (RT_SUCCESS(rc))
+    {
+        /* Blocks can only be referenced in the store of the right parent with the same block size. */
+        if (RTUuidCompare(&pParent->UuidCreate, &pImage->UuidParent))
+            rc = VERR_VD_UUID_MISMATCH;
+        else if (   !pParent->fShared
+                 || pParent->cbBlock != pImage->cbBlock)
+            rc = VERR_NOT_SUPPORTED;
+
+        if (RT_SUCCESS(rc))
+            pImage->pParent = pParent;
+        else
+            ddiFreeImage(pParent, false);
+    }
+
+    if (RT_FAILURE(rc))
+        RTMemFree(pParent);
+    return rc;
+}
+
+/**
+ * Opens the parent recorded in the header privately to reference blocks of
+ * its store.
+ *
+ * @returns VBox status code.
+ * @param   pImage        The image instance data.
+ * @param   fMarkShared   Flag whether to mark the store of the parent as shared.
+ */
+static int ddiParentOpen(PDDIIMAGE pImage, bool fMarkShared)
+{
+    int rc = ddiParentOpenWorker(pImage, pImage->szParentFilename, fMarkShared);
+    const char *pszName = RTPathFilename(pImage->szParentFilename);
+    if (   RT_FAILURE(rc)
+        && pszName
+        && pszName != &pImage->szParentFilename[0])
+    {
+        /* The images might have been moved together, try the directory of the image. */
+        char szFilename[RTPATH_MAX];
+        int rc2 = RTStrCopy(szFilename, sizeof(szFilename), pImage->pszFilename);
+        if (RT_SUCCESS(rc2))
+        {
+            RTPathStripFilename(szFilename);
+            rc2 = RTPathAppend(szFilename, sizeof(szFilename), pszName);
+        }
+        if (RT_SUCCESS(rc2))
+            rc = ddiParentOpenWorker(pImage, szFilename, fMarkShared);
+    }
+
+    return rc;
+}
+
+/**
+ * Returns the number of map entries referencing blocks in the store of the
+ * parent.
+ *
+ * @returns Number of references.
+ * @param   pImage    The image instance data.
+ */
+static uint32_t ddiParentGetRefCount(PDDIIMAGE pImage)
+{
+    uint32_t cRefs = 0;
+    for (uint32_t idxBlock = 0; idxBlock < pImage->cBlocks; idxBlock++)
+        if (DDI_BLOCK_IS_PARENT(pImage->pau32Map[idxBlock]))
+            cRefs++;
+    return cRefs;
+}
+
+/**
+ * Opens the parent when the image is opened, the image can't be accessed
+ * without it if it references blocks in the store of the parent.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ */
+static int ddiParentAttach(PDDIIMAGE pImage)
+{
+    uint32_t cRefs = ddiParentGetRefCount(pImage);
+    if (   !pImage->szParentFilename[0]
+        && !cRefs)
+        return VINF_SUCCESS;
+
+    int rc = VERR_FILE_NOT_FOUND;
+    if (pImage->szParentFilename[0])
+        rc = ddiParentOpen(pImage, false /* fMarkShared */);
+    if (RT_SUCCESS(rc))
+    {
+        uint32_t cStoreBlocks = ddiStoreGetBlockCount(pImage->pParent);
+        for (uint32_t idxBlock = 0; idxBlock < pImage->cBlocks; idxBlock++)
+        {
+            uint32_t idBlock = pImage->pau32Map[idxBlock];
+            if (   DDI_BLOCK_IS_PARENT(idBlock)
+                && (   !(idBlock & ~DDI_BLOCK_PARENT_F)
+                    || (idBlock & ~DDI_BLOCK_PARENT_F) > cStoreBlocks))
+            {
+                rc = VERR_VD_GEN_INVALID_HEADER;
+                break;
+            }
+        }
+    }
+
+    if (RT_FAILURE(rc))
+    {
+        ddiParentClose(pImage);
+        if (cRefs)
+            return vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                             N_("DDI: The parent '%s' holding %u blocks of image '%s' can't be opened"),
+                             pImage->szParentFilename, cRefs, pImage->pszFilename);
+
+        LogRel(("DDI: The parent '%s' of image '%s' can't be opened (%Rrc), blocks are not shared with it\n",
+                pImage->szParentFilename, pImage->pszFilename, rc));
+        rc = VINF_SUCCESS;
+    }
+
+    return rc;
+}
+
+/**
+ * Copies all blocks referenced in the store of the parent to the own store
+ * and forgets about the parent. Used when the parent is about to change.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ */
+static int ddiParentDetach(PDDIIMAGE pImage)
+{
+    int rc = VINF_SUCCESS;
+
+    if (   !pImage->szParentFilename[0]
+        && !pImage->pParent)
+        return VINF_SUCCESS;
+
+    /* Images opened for querying information only don't open the parent. */
+    uint32_t cRefs = ddiParentGetRefCount(pImage);
+    if (   cRefs
+        && !pImage->pParent)
+    {
+        rc = ddiParentOpen(pImage, false /* fMarkShared */);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+
+    PDDIIMAGE pParent = pImage->pParent;
+    void *pvBuf = NULL;
+    if (cRefs)
+    {
+        pvBuf = RTMemTmpAlloc(pImage->cbBlock);
+        if (RT_UNLIKELY(!pvBuf))
+            return VERR_NO_MEMORY;
+        rc = ddiMarkDirty(pImage, NULL);
+    }
+
+    for (uint32_t idxBlock = 0; idxBlock < pImage->cBlocks && cRefs && RT_SUCCESS(rc); idxBlock++)
+    {
+        uint32_t idBlockParent = pImage->pau32Map[idxBlock];
+        if (!DDI_BLOCK_IS_PARENT(idBlockParent))
+            continue;
+
+        rc = vdIfIoIntFileReadSync(pParent->pIfIo, pParent->pStorage,
+                                   ddiStoreBlockGetDataOffset(pParent, idBlockParent & ~DDI_BLOCK_PARENT_F),
+                                   pvBuf, pImage->cbBlock);
+        if (RT_FAILURE(rc))
+            break;
+
+        uint8_t abHash[RTSHA256_HASH_SIZE];
+        RTSha256(pvBuf, pImage->cbBlock, abHash);
+
+        uint32_t idBlock = ddiIndexLookup(pImage, abHash);
+        if (idBlock)
+            rc = ddiStoreBlockRetain(pImage, NULL, idBlock);
+        else
+        {
+            rc = ddiStoreBlockAlloc(pImage, &idBlock);
+            if (RT_SUCCESS(rc))
+            {
+                PDDISTOREBLOCK pBlock = ddiStoreBlockGet(pImage, idBlock);
+
+                memcpy(pBlock->abKey, abHash, DDI_HASH_KEY_SIZE);
+                pBlock->cRefs = 1;
+
+                rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage,
+                                            ddiStoreBlockGetDataOffset(pImage, idBlock),
+                                            pvBuf, pImage->cbBlock);
+                if (RT_SUCCESS(rc))
+                    rc = ddiStoreBlockHashWrite(pImage, NULL, idBlock, abHash);
+                if (RT_SUCCESS(rc))
+                    rc = ddiStoreBlockRefsWrite(pImage, NULL, idBlock);
+                if (RT_SUCCESS(rc))
+                    ddiIndexInsert(pImage, idBlock);
+                else
+                {
+                    pBlock->cRefs = 0;
+                    ddiIdArrayAppend(&pImage->FreeBlocks, idBlock);
+                }
+            }
+        }
+
+        /* A failure leaves the image dirty, the reference counts are rebuilt when it is opened again. */
+        if (RT_SUCCESS(rc))
+            rc = ddiBlockMapSet(pImage, NULL, idxBlock, idBlock);
+        cRefs--;
+    }
+
+    if (pvBuf)
+        RTMemTmpFree(pvBuf);
+
+    if (RT_SUCCESS(rc))
+    {
+        ddiParentClose(pImage);
+        RT_ZERO(pImage->szParentFilename);
+        rc = ddiFlushImage(pImage);
+    }
+
+    return rc;
+}
+
+/**
+ * Internal: Open an image, constructing all necessary data structures.
+ */
+static int ddiOpenImage(PDDIIMAGE pImage, unsigned uOpenFlags)
+{
+    pImage->uOpenFlags = uOpenFlags;
+
+    pImage->pIfError = VDIfErrorGet(pImage->pVDIfsDisk);
+    pImage->pIfIo = VDIfIoIntGet(pImage->pVDIfsImage);
+    AssertPtrReturn(pImage->pIfIo, VERR_INVALID_PARAMETER);
+
+    /* Open the image. */
+    int rc = vdIfIoIntFileOpen(pImage->pIfIo, pImage->pszFilename,
+                               VDOpenFlagsToFileOpenFlags(uOpenFlags,
+                                                          false /* fCreate */),
+                               &pImage->pStorage);
+    if (RT_SUCCESS(rc))
+    {
+        uint64_t cbFile;
+        rc = vdIfIoIntFileGetSize(pImage->pIfIo, pImage->pStorage, &cbFile);
+        if (   RT_SUCCESS(rc)
+            && cbFile >= DDI_HEADER_SIZE)
+        {
+            DdiHeader Header;
+
+            rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, 0, &Header, sizeof(Header));
+            if (   RT_SUCCESS(rc)
+                && ddiHdrConvertToHostEndianess(&Header))
+            {
+                pImage->uImageFlags                = Header.fImageFlags;
+                pImage->fDirty                     = RT_BOOL(Header.fFlags & DDI_HDR_F_DIRTY);
+                pImage->fShared                    = RT_BOOL(Header.fFlags & DDI_HDR_F_SHARED);
+                pImage->cbSize                     = Header.cbDisk;
+                pImage->cbBlock                    = Header.cbBlock;
+                pImage->cBlocks                    = Header.cBlocks;
+                pImage->offMap                     = Header.offMap;
+                pImage->offStore                   = Header.offStore;
+                pImage->UuidCreate                 = Header.UuidCreate;
+                pImage->UuidModify                 = Header.UuidModify;
+                pImage->UuidParent                 = Header.UuidParent;
+                pImage->UuidParentModify           = Header.UuidParentModify;
+                pImage->PCHSGeometry.cCylinders    = Header.PCHSGeometry.cCylinders;
+                pImage->PCHSGeometry.cHeads        = Header.PCHSGeometry.cHeads;
+                pImage->PCHSGeometry.cSectors      = Header.PCHSGeometry.cSectors;
+                pImage->LCHSGeometry.cCylinders    = Header.LCHSGeometry.cCylinders;
+                pImage->LCHSGeometry.cHeads        = Header.LCHSGeometry.cHeads;
+                pImage->LCHSGeometry.cSectors      = Header.LCHSGeometry.cSectors;
+                memcpy(pImage->szParentFilename, Header.szParentFilename, sizeof(pImage->szParentFilename));
+
+                rc = ddiImageStateInit(pImage);
+                if (RT_SUCCESS(rc))
+                {
+                    rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, pImage->offMap,
+                                               pImage->pau32Map, pImage->cBlocks * sizeof(uint32_t));
+                    if (RT_SUCCESS(rc))
+                    {
+#if defined(RT_BIG_ENDIAN)
+                        for (uint32_t i = 0; i < pImage->cBlocks; i++)
+                            pImage->pau32Map[i] = RT_LE2H_U32(pImage->pau32Map[i]);
+#endif
+                        rc = ddiStoreLoad(pImage, cbFile);
+                        if (   RT_SUCCESS(rc)
+                            && pImage->fDirty
+                            && !(uOpenFlags & VD_OPEN_FLAGS_READONLY))
+                        {
+                            /* Image was not closed properly, repair the store. */
+                            rc = ddiCheckImage(pImage);
+                        }
+                        if (RT_SUCCESS(rc))
+                            rc = ddiIndexBuild(pImage);
+                        if (RT_FAILURE(rc))
+                            rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                                           N_("DDI: Loading the block store of image '%s' failed"),
+                                           pImage->pszFilename);
+                        else if (   !pImage->fParentStore
+                                 && !(uOpenFlags & VD_OPEN_FLAGS_INFO))
+                            rc = ddiParentAttach(pImage);
+                    }
+                    else
+                        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                                       N_("DDI: Reading the block map of image '%s' failed"),
+                                       pImage->pszFilename);
+                }
+                else
+                    rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                                   N_("DDI: Out of memory allocating the block map of image '%s'"),
+                                   pImage->pszFilename);
+            }
+            else if (RT_SUCCESS(rc))
+                rc = VERR_VD_GEN_INVALID_HEADER;
+        }
+        else if (RT_SUCCESS(rc))
+            rc = VERR_VD_GEN_INVALID_HEADER;
+    }
+    /* else: Do NOT signal an appropriate error here, as the VD layer has the
+     *       choice of retrying the open if it failed. */
+
+    if (RT_FAILURE(rc))
+        ddiFreeImage(pImage, false);
+    return rc;
+}
+
+/**
+ * Internal: Create a DDI image.
+ */
+static int ddiCreateImage(PDDIIMAGE pImage, uint64_t cbSize,
+                          unsigned uImageFlags, const char *pszComment,
+                          PCVDGEOMETRY pPCHSGeometry,
+                          PCVDGEOMETRY pLCHSGeometry, unsigned uOpenFlags,
+                          PVDINTERFACEPROGRESS pIfProgress,
+                          unsigned uPercentStart, unsigned uPercentSpan)
+{
+    RT_NOREF1(pszComment);
+    int rc;
+
+    if (!(uImageFlags & VD_IMAGE_FLAGS_FIXED))
+    {
+        pImage->uOpenFlags   = uOpenFlags & ~VD_OPEN_FLAGS_READONLY;
+        pImage->uImageFlags  = uImageFlags;
+        pImage->PCHSGeometry = *pPCHSGeometry;
+        pImage->LCHSGeometry = *pLCHSGeometry;
+
+        pImage->pIfError = VDIfErrorGet(pImage->pVDIfsDisk);
+        pImage->pIfIo = VDIfIoIntGet(pImage->pVDIfsImage);
+        AssertPtrReturn(pImage->pIfIo, VERR_INVALID_PARAMETER);
+
+        uint64_t cBlocks = (cbSize + DDI_BLOCK_SIZE_DEFAULT - 1) / DDI_BLOCK_SIZE_DEFAULT;
+        if (cBlocks < DDI_BLOCK_ZERO)
+        {
+            /* Create image file. */
+            uint32_t fOpen = VDOpenFlagsToFileOpenFlags(pImage->uOpenFlags, true /* fCreate */);
+            rc = vdIfIoIntFileOpen(pImage->pIfIo, pImage->pszFilename, fOpen, &pImage->pStorage);
+            if (RT_SUCCESS(rc))
+            {
+                /* Init image state. */
+                pImage->cbSize   = cbSize;
+                pImage->cbBlock  = DDI_BLOCK_SIZE_DEFAULT;
+                pImage->cBlocks  = (uint32_t)cBlocks;
+                pImage->offMap   = DDI_HEADER_SIZE;
+                pImage->offStore = RT_ALIGN_64(pImage->offMap + cBlocks * sizeof(uint32_t), _4K);
+                pImage->fDirty   = false;
+
+                rc = ddiImageStateInit(pImage);
+                if (RT_SUCCESS(rc))
+                {
+                    /* The block map is all free, extending the file takes care of it. */
+                    rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, pImage->offStore);
+                    if (RT_SUCCESS(rc))
+                    {
+                        vdIfProgress(pIfProgress, uPercentStart + uPercentSpan * 98 / 100);
+                        rc = ddiFlushImage(pImage);
+                    }
+                    else
+                        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("DDI: setting the size of image '%s' failed"),
+                                       pImage->pszFilename);
+                }
+                else
+                    rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("DDI: cannot allocate memory for block map of image '%s'"),
+                                   pImage->pszFilename);
+            }
+            else
+                rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("DDI: cannot create image '%s'"), pImage->pszFilename);
+        }
+        else
+            rc = vdIfError(pImage->pIfError, VERR_VD_INVALID_SIZE, RT_SRC_POS, N_("DDI: image '%s' is too large"),
+                           pImage->pszFilename);
+    }
+    else
+        rc = vdIfError(pImage->pIfError, VERR_VD_INVALID_TYPE, RT_SRC_POS, N_("DDI: cannot create fixed image '%s'"), pImage->pszFilename);
+
+    if (RT_SUCCESS(rc))
+        vdIfProgress(pIfProgress, uPercentStart + uPercentSpan);
+    else
+        ddiFreeImage(pImage, rc != VERR_ALREADY_EXISTS);
+
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnProbe */
+static DECLCALLBACK(int) ddiProbe(const char *pszFilename, PVDINTERFACE pVDIfsDisk,
+                                  PVDINTERFACE pVDIfsImage, VDTYPE *penmType)
+{
+    RT_NOREF1(pVDIfsDisk);
+    LogFlowFunc(("pszFilename=\"%s\" pVDIfsDisk=%#p pVDIfsImage=%#p\n", pszFilename, pVDIfsDisk, pVDIfsImage));
+    PVDIOSTORAGE pStorage = NULL;
+    int rc = VINF_SUCCESS;
+
+    /* Get I/O interface. */
+    PVDINTERFACEIOINT pIfIo = VDIfIoIntGet(pVDIfsImage);
+    AssertPtrReturn(pIfIo, VERR_INVALID_PARAMETER);
+    AssertReturn((VALID_PTR(pszFilename) && *pszFilename), VERR_INVALID_PARAMETER);
+
+    /*
+     * Open the file and read the header.
+     */
+    rc = vdIfIoIntFileOpen(pIfIo, pszFilename,
+                           VDOpenFlagsToFileOpenFlags(VD_OPEN_FLAGS_READONLY,
+                                                      false /* fCreate */),
+                           &pStorage);
+    if (RT_SUCCESS(rc))
+    {
+        uint64_t cbFile;
+
+        rc = vdIfIoIntFileGetSize(pIfIo, pStorage, &cbFile);
+        if (   RT_SUCCESS(rc)
+            && cbFile >= DDI_HEADER_SIZE)
+        {
+            DdiHeader Header;
+
+            rc = vdIfIoIntFileReadSync(pIfIo, pStorage, 0, &Header, sizeof(Header));
+            if (   RT_SUCCESS(rc)
+                && ddiHdrConvertToHostEndianess(&Header))
+                *penmType = VDTYPE_HDD;
+            else
+                rc = VERR_VD_GEN_INVALID_HEADER;
+        }
+        else
+            rc = VERR_VD_GEN_INVALID_HEADER;
+    }
+
+    if (pStorage)
+        vdIfIoIntFileClose(pIfIo, pStorage);
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnOpen */
+static DECLCALLBACK(int) ddiOpen(const char *pszFilename, unsigned uOpenFlags,
+                                 PVDINTERFACE pVDIfsDisk, PVDINTERFACE pVDIfsImage,
+                                 VDTYPE enmType, void **ppBackendData)
+{
+    RT_NOREF1(enmType);
+
+    LogFlowFunc(("pszFilename=\"%s\" uOpenFlags=%#x pVDIfsDisk=%#p pVDIfsImage=%#p enmType=%u ppBackendData=%#p\n",
+                 pszFilename, uOpenFlags, pVDIfsDisk, pVDIfsImage, enmType, ppBackendData));
+    int rc;
+
+    /* Check open flags. All valid flags are supported. */
+    AssertReturn(!(uOpenFlags & ~VD_OPEN_FLAGS_MASK), VERR_INVALID_PARAMETER);
+    AssertReturn((VALID_PTR(pszFilename) && *pszFilename), VERR_INVALID_PARAMETER);
+
+    PDDIIMAGE pImage = (PDDIIMAGE)RTMemAllocZ(sizeof(DDIIMAGE));
+    if (RT_LIKELY(pImage))
+    {
+        pImage->pszFilename = pszFilename;
+        pImage->pStorage = NULL;
+        pImage->pVDIfsDisk = pVDIfsDisk;
+        pImage->pVDIfsImage = pVDIfsImage;
+
+        rc = ddiOpenImage(pImage, uOpenFlags);
+        if (RT_SUCCESS(rc))
+            *ppBackendData = pImage;
+        else
+            RTMemFree(pImage);
+    }
+    else
+        rc = VERR_NO_MEMORY;
+
+    LogFlowFunc(("returns %Rrc (pBackendData=%#p)\n", rc, *ppBackendData));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnCreate */
+static DECLCALLBACK(int) ddiCreate(const char *pszFilename, uint64_t cbSize,
+                                   unsigned uImageFlags, const char *pszComment,
+                                   PCVDGEOMETRY pPCHSGeometry, PCVDGEOMETRY pLCHSGeometry,
+                                   PCRTUUID pUuid, unsigned uOpenFlags,
+                                   unsigned uPercentStart, unsigned uPercentSpan,
+                                   PVDINTERFACE pVDIfsDisk, PVDINTERFACE pVDIfsImage,
+                                   PVDINTERFACE pVDIfsOperation, VDTYPE enmType,
+                                   void **ppBackendData)
+{
+    LogFlowFunc(("pszFilename=\"%s\" cbSize=%llu uImageFlags=%#x pszComment=\"%s\" pPCHSGeometry=%#p pLCHSGeometry=%#p Uuid=%RTuuid uOpenFlags=%#x uPercentStart=%u uPercentSpan=%u pVDIfsDisk=%#p pVDIfsImage=%#p pVDIfsOperation=%#p enmType=%d ppBackendData=%#p",
+                 pszFilename, cbSize, uImageFlags, pszComment, pPCHSGeometry, pLCHSGeometry, pUuid, uOpenFlags, uPercentStart, uPercentSpan, pVDIfsDisk, pVDIfsImage, pVDIfsOperation, enmType, ppBackendData));
+    int rc;
+
+    /* Check the VD container type. */
+    if (enmType != VDTYPE_HDD)
+        return VERR_VD_INVALID_TYPE;
+
+    /* Check open flags. All valid flags are supported. */
+    AssertReturn(!(uOpenFlags & ~VD_OPEN_FLAGS_MASK), VERR_INVALID_PARAMETER);
+    AssertReturn(   VALID_PTR(pszFilename)
+                 && *pszFilename
+                 && VALID_PTR(pPCHSGeometry)
+                 && VALID_PTR(pLCHSGeometry), VERR_INVALID_PARAMETER);
+
+    PDDIIMAGE pImage = (PDDIIMAGE)RTMemAllocZ(sizeof(DDIIMAGE));
+    if (RT_LIKELY(pImage))
+    {
+        PVDINTERFACEPROGRESS pIfProgress = VDIfProgressGet(pVDIfsOperation);
+
+        pImage->pszFilename = pszFilename;
+        pImage->pStorage = NULL;
+        pImage->pVDIfsDisk = pVDIfsDisk;
+        pImage->pVDIfsImage = pVDIfsImage;
+        if (pUuid)
+            pImage->UuidCreate = *pUuid;
+        RTUuidCreate(&pImage->UuidModify);
+
+        rc = ddiCreateImage(pImage, cbSize, uImageFlags, pszComment,
+                            pPCHSGeometry, pLCHSGeometry, uOpenFlags,
+                            pIfProgress, uPercentStart, uPercentSpan);
+        if (RT_SUCCESS(rc))
+        {
+            /* So far the image is opened in read/write mode. Make sure the
+             * image is opened in read-only mode if the caller requested that. */
+            if (uOpenFlags & VD_OPEN_FLAGS_READONLY)
+            {
+                ddiFreeImage(pImage, false);
+                rc = ddiOpenImage(pImage, uOpenFlags);
+            }
+
+            if (RT_SUCCESS(rc))
+                *ppBackendData = pImage;
+        }
+
+        if (RT_FAILURE(rc))
+            RTMemFree(pImage);
+    }
+    else
+        rc = VERR_NO_MEMORY;
+
+    LogFlowFunc(("returns %Rrc (pBackendData=%#p)\n", rc, *ppBackendData));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnRename */
+static DECLCALLBACK(int) ddiRename(void *pBackendData, const char *pszFilename)
+{
+    LogFlowFunc(("pBackendData=%#p pszFilename=%#p\n", pBackendData, pszFilename));
+    int rc = VINF_SUCCESS;
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    /* Check arguments. */
+    AssertReturn((pImage && pszFilename && *pszFilename), VERR_INVALID_PARAMETER);
+
+    /* Close the image. */
+    rc = ddiFreeImage(pImage, false);
+    if (RT_SUCCESS(rc))
+    {
+        /* Rename the file. */
+        rc = vdIfIoIntFileMove(pImage->pIfIo, pImage->pszFilename, pszFilename, 0);
+        if (RT_SUCCESS(rc))
+        {
+            /* Update pImage with the new information. */
+            pImage->pszFilename = pszFilename;
+
+            /* Open the old image with new name. */
+            rc = ddiOpenImage(pImage, pImage->uOpenFlags);
+        }
+        else
+        {
+            /* The move failed, try to reopen the original image. */
+            int rc2 = ddiOpenImage(pImage, pImage->uOpenFlags);
+            if (RT_FAILURE(rc2))
+                rc = rc2;
+        }
+    }
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnClose */
+static DECLCALLBACK(int) ddiClose(void *pBackendData, bool fDelete)
+{
+    LogFlowFunc(("pBackendData=%#p fDelete=%d\n", pBackendData, fDelete));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    int rc = ddiFreeImage(pImage, fDelete);
+    RTMemFree(pImage);
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnRead */
+static DECLCALLBACK(int) ddiRead(void *pBackendData, uint64_t uOffset, size_t cbToRead,
+                                 PVDIOCTX pIoCtx, size_t *pcbActuallyRead)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu pIoCtx=%#p cbToRead=%zu pcbActuallyRead=%#p\n",
+                 pBackendData, uOffset, pIoCtx, cbToRead, pcbActuallyRead));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    AssertPtr(pImage);
+    Assert(uOffset % 512 == 0);
+    Assert(cbToRead % 512 == 0);
+    AssertReturn((VALID_PTR(pIoCtx) && cbToRead), VERR_INVALID_PARAMETER);
+    AssertReturn(uOffset + cbToRead <= pImage->cbSize, VERR_INVALID_PARAMETER);
+
+    uint32_t idxBlock = (uint32_t)(uOffset >> pImage->cBlockShift);
+    uint32_t offRead  = (uint32_t)(uOffset & (pImage->cbBlock - 1));
+
+    /* Clip read size to remain in the block. */
+    cbToRead = RT_MIN(cbToRead, pImage->cbBlock - offRead);
+
+    uint32_t idBlock = pImage->pau32Map[idxBlock];
+    if (idBlock == DDI_BLOCK_FREE)
+        rc = VERR_VD_BLOCK_FREE;
+    else if (idBlock == DDI_BLOCK_ZERO)
+        vdIfIoIntIoCtxSet(pImage->pIfIo, pIoCtx, 0, cbToRead);
+    else if (DDI_BLOCK_IS_PARENT(idBlock))
+    {
+        if (pImage->pParent)
+            rc = vdIfIoIntFileReadUser(pImage->pIfIo, pImage->pParent->pStorage,
+                                       ddiStoreBlockGetDataOffset(pImage->pParent, idBlock & ~DDI_BLOCK_PARENT_F) + offRead,
+                                       pIoCtx, cbToRead);
+        else
+            rc = VERR_VD_NOT_OPENED; /* Opened for querying information only. */
+    }
+    else
+        rc = vdIfIoIntFileReadUser(pImage->pIfIo, pImage->pStorage,
+                                   ddiStoreBlockGetDataOffset(pImage, idBlock) + offRead,
+                                   pIoCtx, cbToRead);
+
+    if (   (   RT_SUCCESS(rc)
+            || rc == VERR_VD_BLOCK_FREE
+            || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+        && pcbActuallyRead)
+        *pcbActuallyRead = cbToRead;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnWrite */
+static DECLCALLBACK(int) ddiWrite(void *pBackendData, uint64_t uOffset, size_t cbToWrite,
+                                  PVDIOCTX pIoCtx, size_t *pcbWriteProcess, size_t *pcbPreRead,
+                                  size_t *pcbPostRead, unsigned fWrite)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu pIoCtx=%#p cbToWrite=%zu pcbWriteProcess=%#p pcbPreRead=%#p pcbPostRead=%#p\n",
+                 pBackendData, uOffset, pIoCtx, cbToWrite, pcbWriteProcess, pcbPreRead, pcbPostRead));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    AssertPtr(pImage);
+    Assert(!(uOffset % 512));
+    Assert(!(cbToWrite % 512));
+    AssertReturn((VALID_PTR(pIoCtx) && cbToWrite), VERR_INVALID_PARAMETER);
+    AssertReturn(uOffset + cbToWrite <= (uint64_t)pImage->cBlocks * pImage->cbBlock, VERR_INVALID_PARAMETER);
+
+    if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        return VERR_VD_IMAGE_READ_ONLY;
+
+    uint32_t idxBlock = (uint32_t)(uOffset >> pImage->cBlockShift);
+    uint32_t offWrite = (uint32_t)(uOffset & (pImage->cbBlock - 1));
+
+    /* Clip write size to remain in the block. */
+    cbToWrite = RT_MIN(cbToWrite, pImage->cbBlock - offWrite);
+
+    *pcbPreRead  = 0;
+    *pcbPostRead = 0;
+
+    do
+    {
+        uint32_t idBlockOld = pImage->pau32Map[idxBlock];
+
+        if (cbToWrite != pImage->cbBlock)
+        {
+            /*
+             * Blocks are never modified in place because they can be shared,
+             * let the upper layer assemble the whole block.
+             */
+            *pcbPreRead  = offWrite;
+            *pcbPostRead = pImage->cbBlock - cbToWrite - offWrite;
+            rc = VERR_VD_BLOCK_FREE;
+            break;
+        }
+
+        if (   idBlockOld == DDI_BLOCK_FREE
+            && (fWrite & VD_WRITE_NO_ALLOC))
+        {
+            rc = VERR_VD_BLOCK_FREE;
+            break;
+        }
+
+        rc = ddiMarkDirty(pImage, pIoCtx);
+        if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+            break;
+
+        /* Zero blocks need no room in the store. */
+        if (   !(pImage->uOpenFlags & VD_OPEN_FLAGS_HONOR_ZEROES)
+            && vdIfIoIntIoCtxIsZero(pImage->pIfIo, pIoCtx, cbToWrite, true))
+        {
+            rc = ddiBlockMapSet(pImage, pIoCtx, idxBlock, DDI_BLOCK_ZERO);
+            break;
+        }
+
+        uint8_t abHash[RTSHA256_HASH_SIZE];
+        rc = ddiIoCtxHash(pImage, pIoCtx, cbToWrite, abHash);
+        if (RT_FAILURE(rc))
+            break;
+
+        uint32_t idBlock = ddiIndexLookup(pImage, abHash);
+        uint32_t idBlockParent = 0;
+        if (   !idBlock
+            && pImage->pParent)
+            idBlockParent = ddiIndexLookup(pImage->pParent, abHash);
+
+        if (idBlock)
+        {
+            /* The content is already stored, just reference it. */
+            pImage->cDedupHits++;
+            vdIfIoIntIoCtxCopyFrom(pImage->pIfIo, pIoCtx, pImage->pvScratch, cbToWrite);
+
+            if (idBlock != idBlockOld)
+            {
+                rc = ddiStoreBlockRetain(pImage, pIoCtx, idBlock);
+                if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+                    rc = ddiBlockMapSet(pImage, pIoCtx, idxBlock, idBlock);
+                if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                    ddiStoreBlockGet(pImage, idBlock)->cRefs--;
+            }
+        }
+        else if (idBlockParent)
+        {
+            /* The parent stores the content, reference its block instead of storing it again. */
+            pImage->cDedupParentHits++;
+            vdIfIoIntIoCtxCopyFrom(pImage->pIfIo, pIoCtx, pImage->pvScratch, cbToWrite);
+            rc = ddiBlockMapSet(pImage, pIoCtx, idxBlock, idBlockParent | DDI_BLOCK_PARENT_F);
+        }
+        else
+        {
+            /* New content, write it to an unused block. */
+            pImage->cDedupMisses++;
+
+            PDDIBLOCKALLOC pBlockAlloc = (PDDIBLOCKALLOC)RTMemAllocZ(sizeof(DDIBLOCKALLOC));
+            if (RT_UNLIKELY(!pBlockAlloc))
+            {
+                rc = VERR_NO_MEMORY;
+                break;
+            }
+
+            rc = ddiStoreBlockAlloc(pImage, &idBlock);
+            if (RT_FAILURE(rc))
+            {
+                RTMemFree(pBlockAlloc);
+                break;
+            }
+
+            pBlockAlloc->idxBlock = idxBlock;
+            pBlockAlloc->idBlock  = idBlock;
+            memcpy(pBlockAlloc->abHash, abHash, sizeof(abHash));
+
+            rc = vdIfIoIntFileWriteUser(pImage->pIfIo, pImage->pStorage,
+                                        ddiStoreBlockGetDataOffset(pImage, idBlock),
+                                        pIoCtx, cbToWrite, ddiBlockAllocUpdate, pBlockAlloc);
+            if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+                break;
+            else if (RT_FAILURE(rc))
+            {
+                ddiIdArrayAppend(&pImage->FreeBlocks, idBlock);
+                RTMemFree(pBlockAlloc);
+                break;
+            }
+
+            rc = ddiBlockAllocUpdate(pImage, pIoCtx, pBlockAlloc, rc);
+        }
+    } while (0);
+
+    if (pcbWriteProcess)
+        *pcbWriteProcess = cbToWrite;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnFlush */
+static DECLCALLBACK(int) ddiFlush(void *pBackendData, PVDIOCTX pIoCtx)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    AssertPtr(pImage);
+    AssertPtrReturn(pIoCtx, VERR_INVALID_PARAMETER);
+
+    if (   pImage->pStorage
+        && !(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
+    {
+        /* Take over the references released so far, they are dropped once the flush completed. */
+        PDDIFLUSHRELEASE pRelease = NULL;
+        if (pImage->ReleasePending.cIds)
+        {
+            pRelease = (PDDIFLUSHRELEASE)RTMemAllocZ(sizeof(DDIFLUSHRELEASE));
+            if (pRelease)
+            {
+                pRelease->Ids = pImage->ReleasePending;
+                RT_ZERO(pImage->ReleasePending);
+            }
+            /* else: Try again with the next flush. */
+        }
+
+        rc = ddiHdrWrite(pImage, pIoCtx);
+        if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            rc = vdIfIoIntFileFlush(pImage->pIfIo, pImage->pStorage, pIoCtx,
+                                    pRelease ? ddiFlushUpdate : NULL, pRelease);
+
+        if (pRelease && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+            rc = ddiFlushUpdate(pImage, pIoCtx, pRelease, rc);
+    }
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnDiscard */
+static DECLCALLBACK(int) ddiDiscard(void *pBackendData, PVDIOCTX pIoCtx,
+                                    uint64_t uOffset, size_t cbDiscard,
+                                    size_t *pcbPreAllocated, size_t *pcbPostAllocated,
+                                    size_t *pcbActuallyDiscarded, void **ppbmAllocationBitmap,
+                                    unsigned fDiscard)
+{
+    RT_NOREF1(fDiscard);
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    LogFlowFunc(("pBackendData=%#p pIoCtx=%#p uOffset=%llu cbDiscard=%zu pcbPreAllocated=%#p pcbPostAllocated=%#p pcbActuallyDiscarded=%#p ppbmAllocationBitmap=%#p fDiscard=%#x\n",
+                 pBackendData, pIoCtx, uOffset, cbDiscard, pcbPreAllocated, pcbPostAllocated, pcbActuallyDiscarded, ppbmAllocationBitmap, fDiscard));
+
+    AssertPtr(pImage);
+    Assert(!(uOffset % 512));
+    Assert(!(cbDiscard % 512));
+
+    AssertMsgReturn(!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY),
+                    ("Image is readonly\n"), VERR_VD_IMAGE_READ_ONLY);
+    AssertMsgReturn(   uOffset + cbDiscard <= pImage->cbSize
+                    && cbDiscard,
+                    ("Invalid parameters uOffset=%llu cbDiscard=%zu\n",
+                     uOffset, cbDiscard),
+                     VERR_INVALID_PARAMETER);
+
+    uint32_t idxBlock   = (uint32_t)(uOffset >> pImage->cBlockShift);
+    uint32_t offDiscard = (uint32_t)(uOffset & (pImage->cbBlock - 1));
+
+    /* Clip range to at most the rest of the block. */
+    cbDiscard = RT_MIN(cbDiscard, pImage->cbBlock - offDiscard);
+
+    if (pcbPreAllocated)
+        *pcbPreAllocated = 0;
+    if (pcbPostAllocated)
+        *pcbPostAllocated = 0;
+
+    if (   DDI_BLOCK_IS_STORED(pImage->pau32Map[idxBlock])
+        || DDI_BLOCK_IS_PARENT(pImage->pau32Map[idxBlock]))
+    {
+        if (cbDiscard == pImage->cbBlock)
+        {
+            /*
+             * Drop the reference to the block, the parent must not show through
+             * so differencing images keep a zero block.
+             */
+            rc = ddiMarkDirty(pImage, pIoCtx);
+            if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+                rc = ddiBlockMapSet(pImage, pIoCtx, idxBlock,
+                                      (pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF)
+                                    ? DDI_BLOCK_ZERO
+                                    : DDI_BLOCK_FREE);
+        }
+        else
+        {
+            /*
+             * Only whole blocks can be dropped, let the upper layer track the
+             * discarded parts until the whole block can go.
+             */
+            uint32_t cSectors = pImage->cbBlock / 512;
+            void *pbmAllocated = RTMemAlloc(cSectors / 8);
+            if (pbmAllocated)
+            {
+                ASMBitSetRange(pbmAllocated, 0, cSectors);
+                ASMBitClearRange(pbmAllocated, offDiscard / 512, (offDiscard + (uint32_t)cbDiscard) / 512);
+
+                *pcbPreAllocated      = offDiscard;
+                *pcbPostAllocated     = pImage->cbBlock - (uint32_t)cbDiscard - offDiscard;
+                *ppbmAllocationBitmap = pbmAllocated;
+                rc = VERR_VD_DISCARD_ALIGNMENT_NOT_MET;
+            }
+            else
+                rc = VERR_NO_MEMORY;
+        }
+    }
+    /* else: nothing to do. */
+
+    if (pcbActuallyDiscarded)
+        *pcbActuallyDiscarded = cbDiscard;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetVersion */
+static DECLCALLBACK(unsigned) ddiGetVersion(void *pBackendData)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, 0);
+
+    return DDI_VERSION;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetSectorSize */
+static DECLCALLBACK(uint32_t) ddiGetSectorSize(void *pBackendData)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    uint32_t cb = 0;
+
+    AssertPtrReturn(pImage, 0);
+
+    if (pImage->pStorage)
+        cb = 512;
+
+    LogFlowFunc(("returns %u\n", cb));
+    return cb;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetSize */
+static DECLCALLBACK(uint64_t) ddiGetSize(void *pBackendData)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    uint64_t cb = 0;
+
+    AssertPtrReturn(pImage, 0);
+
+    if (pImage->pStorage)
+        cb = pImage->cbSize;
+
+    LogFlowFunc(("returns %llu\n", cb));
+    return cb;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetFileSize */
+static DECLCALLBACK(uint64_t) ddiGetFileSize(void *pBackendData)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    uint64_t cb = 0;
+
+    AssertPtrReturn(pImage, 0);
+
+    uint64_t cbFile;
+    if (pImage->pStorage)
+    {
+        int rc = vdIfIoIntFileGetSize(pImage->pIfIo, pImage->pStorage, &cbFile);
+        if (RT_SUCCESS(rc))
+            cb += cbFile;
+    }
+
+    LogFlowFunc(("returns %lld\n", cb));
+    return cb;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetPCHSGeometry */
+static DECLCALLBACK(int) ddiGetPCHSGeometry(void *pBackendData,
+                                            PVDGEOMETRY pPCHSGeometry)
+{
+    LogFlowFunc(("pBackendData=%#p pPCHSGeometry=%#p\n", pBackendData, pPCHSGeometry));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    if (pImage->PCHSGeometry.cCylinders)
+        *pPCHSGeometry = pImage->PCHSGeometry;
+    else
+        rc = VERR_VD_GEOMETRY_NOT_SET;
+
+    LogFlowFunc(("returns %Rrc (PCHS=%u/%u/%u)\n", rc, pPCHSGeometry->cCylinders, pPCHSGeometry->cHeads, pPCHSGeometry->cSectors));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnSetPCHSGeometry */
+static DECLCALLBACK(int) ddiSetPCHSGeometry(void *pBackendData,
+                                            PCVDGEOMETRY pPCHSGeometry)
+{
+    LogFlowFunc(("pBackendData=%#p pPCHSGeometry=%#p PCHS=%u/%u/%u\n",
+                 pBackendData, pPCHSGeometry, pPCHSGeometry->cCylinders, pPCHSGeometry->cHeads, pPCHSGeometry->cSectors));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        rc = VERR_VD_IMAGE_READ_ONLY;
+    else
+        pImage->PCHSGeometry = *pPCHSGeometry;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetLCHSGeometry */
+static DECLCALLBACK(int) ddiGetLCHSGeometry(void *pBackendData, PVDGEOMETRY pLCHSGeometry)
+{
+    LogFlowFunc(("pBackendData=%#p pLCHSGeometry=%#p\n", pBackendData, pLCHSGeometry));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    if (pImage->LCHSGeometry.cCylinders)
+        *pLCHSGeometry = pImage->LCHSGeometry;
+    else
+        rc = VERR_VD_GEOMETRY_NOT_SET;
+
+    LogFlowFunc(("returns %Rrc (LCHS=%u/%u/%u)\n", rc, pLCHSGeometry->cCylinders,
+                 pLCHSGeometry->cHeads, pLCHSGeometry->cSectors));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnSetLCHSGeometry */
+static DECLCALLBACK(int) ddiSetLCHSGeometry(void *pBackendData, PCVDGEOMETRY pLCHSGeometry)
+{
+    LogFlowFunc(("pBackendData=%#p pLCHSGeometry=%#p LCHS=%u/%u/%u\n", pBackendData,
+                 pLCHSGeometry, pLCHSGeometry->cCylinders, pLCHSGeometry->cHeads, pLCHSGeometry->cSectors));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        rc = VERR_VD_IMAGE_READ_ONLY;
+    else
+        pImage->LCHSGeometry = *pLCHSGeometry;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetImageFlags */
+static DECLCALLBACK(unsigned) ddiGetImageFlags(void *pBackendData)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, 0);
+
+    LogFlowFunc(("returns %#x\n", pImage->uImageFlags));
+    return pImage->uImageFlags;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetOpenFlags */
+static DECLCALLBACK(unsigned) ddiGetOpenFlags(void *pBackendData)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, 0);
+
+    LogFlowFunc(("returns %#x\n", pImage->uOpenFlags));
+    return pImage->uOpenFlags;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnSetOpenFlags */
+static DECLCALLBACK(int) ddiSetOpenFlags(void *pBackendData, unsigned uOpenFlags)
+{
+    LogFlowFunc(("pBackendData=%#p\n uOpenFlags=%#x", pBackendData, uOpenFlags));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    /* Image must be opened and the new flags must be valid. */
+    if (!pImage || (uOpenFlags & ~(  VD_OPEN_FLAGS_READONLY | VD_OPEN_FLAGS_INFO
+                                   | VD_OPEN_FLAGS_ASYNC_IO | VD_OPEN_FLAGS_SHAREABLE
+                                   | VD_OPEN_FLAGS_SEQUENTIAL | VD_OPEN_FLAGS_SKIP_CONSISTENCY_CHECKS)))
+        rc = VERR_INVALID_PARAMETER;
+    else
+    {
+        /* Implement this operation via reopening the image. */
+        rc = ddiFreeImage(pImage, false);
+        if (RT_SUCCESS(rc))
+            rc = ddiOpenImage(pImage, uOpenFlags);
+    }
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetComment */
+static DECLCALLBACK(int) ddiGetComment(void *pBackendData, char *pszComment,
+                                       size_t cbComment)
+{
+    RT_NOREF2(pszComment, cbComment);
+    LogFlowFunc(("pBackendData=%#p pszComment=%#p cbComment=%zu\n", pBackendData, pszComment, cbComment));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    LogFlowFunc(("returns %Rrc comment='%s'\n", VERR_NOT_SUPPORTED, pszComment));
+    return VERR_NOT_SUPPORTED;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnSetComment */
+static DECLCALLBACK(int) ddiSetComment(void *pBackendData, const char *pszComment)
+{
+    RT_NOREF1(pszComment);
+    LogFlowFunc(("pBackendData=%#p pszComment=\"%s\"\n", pBackendData, pszComment));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    int rc;
+    if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        rc = VERR_VD_IMAGE_READ_ONLY;
+    else
+        rc = VERR_NOT_SUPPORTED;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetUuid */
+static DECLCALLBACK(int) ddiGetUuid(void *pBackendData, PRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    *pUuid = pImage->UuidCreate;
+
+    LogFlowFunc(("returns %Rrc (%RTuuid)\n", VINF_SUCCESS, pUuid));
+    return VINF_SUCCESS;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnSetUuid */
+static DECLCALLBACK(int) ddiSetUuid(void *pBackendData, PCRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    int rc = VINF_SUCCESS;
+    if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        rc = VERR_VD_IMAGE_READ_ONLY;
+    else
+        pImage->UuidCreate = *pUuid;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetModificationUuid */
+static DECLCALLBACK(int) ddiGetModificationUuid(void *pBackendData, PRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    *pUuid = pImage->UuidModify;
+
+    LogFlowFunc(("returns %Rrc (%RTuuid)\n", VINF_SUCCESS, pUuid));
+    return VINF_SUCCESS;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnSetModificationUuid */
+static DECLCALLBACK(int) ddiSetModificationUuid(void *pBackendData, PCRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    int rc = VINF_SUCCESS;
+    if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        rc = VERR_VD_IMAGE_READ_ONLY;
+    else
+        pImage->UuidModify = *pUuid;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetParentUuid */
+static DECLCALLBACK(int) ddiGetParentUuid(void *pBackendData, PRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    *pUuid = pImage->UuidParent;
+
+    LogFlowFunc(("returns %Rrc (%RTuuid)\n", VINF_SUCCESS, pUuid));
+    return VINF_SUCCESS;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnSetParentUuid */
+static DECLCALLBACK(int) ddiSetParentUuid(void *pBackendData, PCRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    int rc = VINF_SUCCESS;
+    if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        rc = VERR_VD_IMAGE_READ_ONLY;
+    else
+    {
+        /* The old parent is going away (e.g. merged), keep the blocks referenced in it. */
+        if (RTUuidCompare(&pImage->UuidParent, pUuid))
+            rc = ddiParentDetach(pImage);
+        if (RT_SUCCESS(rc))
+            pImage->UuidParent = *pUuid;
+    }
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetParentModificationUuid */
+static DECLCALLBACK(int) ddiGetParentModificationUuid(void *pBackendData, PRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    *pUuid = pImage->UuidParentModify;
+
+    LogFlowFunc(("returns %Rrc (%RTuuid)\n", VINF_SUCCESS, pUuid));
+    return VINF_SUCCESS;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnSetParentModificationUuid */
+static DECLCALLBACK(int) ddiSetParentModificationUuid(void *pBackendData, PCRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    int rc = VINF_SUCCESS;
+    if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        rc = VERR_VD_IMAGE_READ_ONLY;
+    else
+        pImage->UuidParentModify = *pUuid;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetParentFilename */
+static DECLCALLBACK(int) ddiGetParentFilename(void *pBackendData, char **ppszParentFilename)
+{
+    LogFlowFunc(("pBackendData=%#p ppszParentFilename=%#p\n", pBackendData, ppszParentFilename));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    int rc = VINF_SUCCESS;
+    if (!pImage->szParentFilename[0])
+        rc = VERR_NOT_FOUND;
+    else
+    {
+        *ppszParentFilename = RTStrDup(pImage->szParentFilename);
+        if (!*ppszParentFilename)
+            rc = VERR_NO_MEMORY;
+    }
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnSetParentFilename */
+static DECLCALLBACK(int) ddiSetParentFilename(void *pBackendData, const char *pszParentFilename)
+{
+    LogFlowFunc(("pBackendData=%#p pszParentFilename=%s\n", pBackendData, pszParentFilename));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturn(pImage, VERR_VD_NOT_OPENED);
+
+    int rc = VINF_SUCCESS;
+    if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        rc = VERR_VD_IMAGE_READ_ONLY;
+    else if (strlen(pszParentFilename) >= sizeof(pImage->szParentFilename))
+        rc = VERR_FILENAME_TOO_LONG;
+    else if (RTStrCmp(pImage->szParentFilename, pszParentFilename))
+    {
+        /* Keep the blocks referenced in a previous parent. */
+        rc = ddiParentDetach(pImage);
+        if (RT_SUCCESS(rc))
+        {
+            RTStrCopy(pImage->szParentFilename, sizeof(pImage->szParentFilename), pszParentFilename);
+
+            /* Not being able to share the store of the parent only costs space. */
+            if (!(pImage->uOpenFlags & VD_OPEN_FLAGS_INFO))
+            {
+                int rc2 = ddiParentOpen(pImage, true /* fMarkShared */);
+                if (RT_FAILURE(rc2))
+                    LogRel(("DDI: Blocks of image '%s' are not shared with the parent '%s' (%Rrc)\n",
+                            pImage->pszFilename, pszParentFilename, rc2));
+            }
+
+            /* The filename must be on the disk before any block of the parent is referenced. */
+            rc = ddiHdrWrite(pImage, NULL);
+        }
+    }
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnDump */
+static DECLCALLBACK(void) ddiDump(void *pBackendData)
+{
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtrReturnVoid(pImage);
+    uint32_t cStoreBlocks = ddiStoreGetBlockCount(pImage);
+    uint32_t cStoreBlocksUsed = cStoreBlocks - pImage->FreeBlocks.cIds;
+    uint32_t cParentRefs = ddiParentGetRefCount(pImage);
+    uint64_t cRefs = 0;
+    for (uint32_t i = 0; i < cStoreBlocks; i++)
+        cRefs += pImage->paStoreBlocks[i].cRefs;
+
+    vdIfErrorMessage(pImage->pIfError, "Header: Geometry PCHS=%u/%u/%u LCHS=%u/%u/%u cbSector=%llu\n",
+                     pImage->PCHSGeometry.cCylinders, pImage->PCHSGeometry.cHeads, pImage->PCHSGeometry.cSectors,
+                     pImage->LCHSGeometry.cCylinders, pImage->LCHSGeometry.cHeads, pImage->LCHSGeometry.cSectors,
+                     pImage->cbSize / 512);
+    vdIfErrorMessage(pImage->pIfError, "Store: cbBlock=%u cGroups=%u cBlocksUsed=%u cRefs=%llu cIndexSlots=%u\n",
+                     pImage->cbBlock, pImage->cGroups, cStoreBlocksUsed, cRefs, pImage->cIndexSlots);
+    vdIfErrorMessage(pImage->pIfError, "Dedup: cHits=%llu cParentHits=%llu cMisses=%llu cbSaved=%llu\n",
+                     pImage->cDedupHits, pImage->cDedupParentHits, pImage->cDedupMisses,
+                     (cRefs - RT_MIN(cRefs, cStoreBlocksUsed) + cParentRefs) * pImage->cbBlock);
+    if (pImage->szParentFilename[0])
+        vdIfErrorMessage(pImage->pIfError, "Parent: \"%s\" fOpened=%RTbool cBlocksReferenced=%u\n",
+                         pImage->szParentFilename, pImage->pParent != NULL, cParentRefs);
+}
+
+
+const VDIMAGEBACKEND g_DdiBackend =
+{
+    /* u32Version */
+    VD_IMGBACKEND_VERSION,
+    /* pszBackendName */
+    "DDI",
+    /* uBackendCaps */
+      VD_CAP_UUID | VD_CAP_FILE | VD_CAP_VFS | VD_CAP_CREATE_DYNAMIC | VD_CAP_DIFF
+    | VD_CAP_ASYNC | VD_CAP_DISCARD,
+    /* paFileExtensions */
+    s_aDdiFileExtensions,
+    /* paConfigInfo */
+    NULL,
+    /* pfnProbe */
+    ddiProbe,
+    /* pfnOpen */
+    ddiOpen,
+    /* pfnCreate */
+    ddiCreate,
+    /* pfnRename */
+    ddiRename,
+    /* pfnClose */
+    ddiClose,
+    /* pfnRead */
+    ddiRead,
+    /* pfnWrite */
+    ddiWrite,
+    /* pfnFlush */
+    ddiFlush,
+    /* pfnDiscard */
+    ddiDiscard,
+    /* pfnGetVersion */
+    ddiGetVersion,
+    /* pfnGetSectorSize */
+    ddiGetSectorSize,
+    /* pfnGetSize */
+    ddiGetSize,
+    /* pfnGetFileSize */
+    ddiGetFileSize,
+    /* pfnGetPCHSGeometry */
+    ddiGetPCHSGeometry,
+    /* pfnSetPCHSGeometry */
+    ddiSetPCHSGeometry,
+    /* pfnGetLCHSGeometry */
+    ddiGetLCHSGeometry,
+    /* pfnSetLCHSGeometry */
+    ddiSetLCHSGeometry,
+    /* pfnGetImageFlags */
+    ddiGetImageFlags,
+    /* pfnGetOpenFlags */
+    ddiGetOpenFlags,
+    /* pfnSetOpenFlags */
+    ddiSetOpenFlags,
+    /* pfnGetComment */
+    ddiGetComment,
+    /* pfnSetComment */
+    ddiSetComment,
+    /* pfnGetUuid */
+    ddiGetUuid,
+    /* pfnSetUuid */
+    ddiSetUuid,
+    /* pfnGetModificationUuid */
+    ddiGetModificationUuid,
+    /* pfnSetModificationUuid */
+    ddiSetModificationUuid,
+    /* pfnGetParentUuid */
+    ddiGetParentUuid,
+    /* pfnSetParentUuid */
+    ddiSetParentUuid,
+    /* pfnGetParentModificationUuid */
+    ddiGetParentModificationUuid,
+    /* pfnSetParentModificationUuid */
+    ddiSetParentModificationUuid,
+    /* pfnDump */
+    ddiDump,
+    /* pfnGetTimestamp */
+    NULL,
+    /* pfnGetParentTimestamp */
+    NULL,
+    /* pfnSetParentTimestamp */
+    NULL,
+    /* pfnGetParentFilename */
+    ddiGetParentFilename,
+    /* pfnSetParentFilename */
+    ddiSetParentFilename,
+    /* pfnComposeLocation */
+    genericFileComposeLocation,
+    /* pfnComposeName */
+    genericFileComposeName,
+    /* pfnCompact */
+    NULL,
+    /* pfnResize */
+    NULL,
+    /* pfnRepair */
+    NULL,
+    /* pfnTraverseMetadata */
+    NULL,
+    /* u32Version */
+    VD_IMGBACKEND_VERSION
+};
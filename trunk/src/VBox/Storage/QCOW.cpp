@@ -30,6 +30,11 @@
 #include <iprt/alloc.h>
 #include <iprt/path.h>
 #include <iprt/list.h>
+#include <iprt/avl.h>
+#include <iprt/mp.h>
+#include <iprt/req.h>
+
+#include <zlib.h>
 
 #include "VDBackends.h"
 
@@ -39,10 +44,24 @@
  * at http://people.gnome.org/~markmc/qcow-image-format.html for version 2
  * and http://people.gnome.org/~markmc/qcow-image-format-version-1.html for version 1.
  *
+ * Compressed clusters are supported for reading and writing. The data of a
+ * compressed cluster is a raw deflate stream with a 4KB window (qemu compatible)
+ * starting at an arbitrary sector in the image. Reads of compressed clusters
+ * go through a small cache of decompressed clusters because guests tend to
+ * access the same cluster many times in small pieces. Writing compressed
+ * clusters is enabled with VD_QCOW_IMAGE_FLAGS_COMPRESSED when creating an image
+ * (used by converters): full cluster writes are collected, compressed in parallel
+ * on a request pool and written sequentially after the previous compressed data.
+ * Writes to compressed clusters of an image without that flag store the cluster
+ * uncompressed in a newly allocated cluster.
+ *
+ * Version 2 images are only created for compressed images. The reference count
+ * table is not maintained while the image is in use but regenerated when an image
+ * which had clusters allocated is closed.
+ *
  * Missing things to implement:
- *    - v2 image creation and handling of the reference count table. (Blocker to enable support for V2 images)
  *    - cluster encryption
- *    - cluster compression
+ *    - snapshots
  *    - compaction
  *    - resizing
  */
@@ -136,32 +155,67 @@ typedef QCowHeader *PQCowHeader;
 *   Constants And Macros, Structures and Typedefs                                                                                *
 *********************************************************************************************************************************/
 
-/**
- * QCOW L2 cache entry.
- */
-typedef struct QCOWL2CACHEENTRY
-{
-    /** List node for the search list. */
-    RTLISTNODE              NodeSearch;
-    /** List node for the LRU list. */
-    RTLISTNODE              NodeLru;
-    /** Reference counter. */
-    uint32_t                cRefs;
-    /** The offset of the L2 table, used as search key. */
-    uint64_t                offL2Tbl;
-    /** Pointer to the cached L2 table. */
-    uint64_t               *paL2Tbl;
-} QCOWL2CACHEENTRY, *PQCOWL2CACHEENTRY;
-
-/** Maximum amount of memory the cache is allowed to use. */
-#define QCOW_L2_CACHE_MEMORY_MAX (2*_1M)
-
 /** QCOW default cluster size for image version 2. */
 #define QCOW2_CLUSTER_SIZE_DEFAULT (64*_1K)
 /** QCOW default cluster size for image version 1. */
 #define QCOW_CLUSTER_SIZE_DEFAULT (4*_1K)
 /** QCOW default L2 table size in clusters. */
 #define QCOW_L2_CLUSTERS_DEFAULT (1)
+/** Window size in bits of the deflate streams used for compressed clusters. */
+#define QCOW_COMPRESSED_WINDOW_BITS (12)
+/** Maximum number of threads compressing clusters. */
+#define QCOW_COMPRESS_THREADS_MAX (8)
+/** Number of clusters collected per compression thread before they are written. */
+#define QCOW_COMPRESS_CLUSTERS_PER_THREAD (4)
+/** Maximum amount of memory used for the decompressed cluster cache. */
+#define QCOW_COMPRESSED_CACHE_SIZE_MAX (4*_1M)
+/** Number of image clusters kept to assemble compressed clusters spanning clusters. */
+#define QCOW_COMPRESSED_TILES (8)
+
+/**
+ * Cluster waiting to be compressed and written to the image.
+ */
+typedef struct QCOWCOMPRESSSLOT
+{
+    /** Logical offset of the cluster. */
+    uint64_t            offCluster;
+    /** Status code of the compression. */
+    int                 rcCompress;
+    /** Size of the compressed data, 0 if the cluster is stored uncompressed. */
+    size_t              cbCompressed;
+    /** The uncompressed data of the cluster. */
+    uint8_t            *pbData;
+    /** Buffer for the compressed data, one cluster big. */
+    uint8_t            *pbCompressed;
+} QCOWCOMPRESSSLOT, *PQCOWCOMPRESSSLOT;
+
+/**
+ * Decompressed cluster cache entry.
+ */
+typedef struct QCOWCOMPCACHEENTRY
+{
+    /** AVL tree core, the key is the L2 table entry of the compressed cluster. */
+    AVLRU64NODECORE     Core;
+    /** LRU list node. */
+    RTLISTNODE          NodeLru;
+    /** The decompressed cluster data. */
+    uint8_t             abData[1];
+} QCOWCOMPCACHEENTRY, *PQCOWCOMPCACHEENTRY;
+
+/**
+ * Image cluster holding compressed data.
+ */
+typedef struct QCOWCOMPTILE
+{
+    /** Offset of the cluster in the image, 0 if the tile is unused. */
+    uint64_t            offTile;
+    /** Number of valid bytes in the tile. */
+    size_t              cbTile;
+    /** Last use of the tile for replacement. */
+    uint64_t            uLastUse;
+    /** The data, one cluster big. */
+    uint8_t            *pbData;
+} QCOWCOMPTILE, *PQCOWCOMPTILE;
 
 /**
  * QCOW image data structure.
@@ -205,8 +259,10 @@ typedef struct QCOWIMAGE
     /** Size of the backing filename excluding \0. */
     uint32_t            cbBackingFilename;
 
-    /** Next offset of a new cluster, aligned to sector size. */
+    /** Next offset of a new cluster, aligned to the cluster size. */
     uint64_t            offNextCluster;
+    /** Size of the image file when it was opened. */
+    uint64_t            cbFileOpen;
     /** Cluster size in bytes. */
     uint32_t            cbCluster;
     /** Number of entries in the L1 table. */
@@ -222,12 +278,6 @@ typedef struct QCOWIMAGE
     uint32_t            cbL2Table;
     /** Number of entries in the L2 table. */
     uint32_t            cL2TableEntries;
-    /** Memory occupied by the L2 table cache. */
-    size_t              cbL2Cache;
-    /** The sorted L2 entry list used for searching. */
-    RTLISTNODE          ListSearch;
-    /** The LRU L2 entry list used for eviction. */
-    RTLISTNODE          ListLru;
 
     /** Offset of the refcount table. */
     uint64_t            offRefcountTable;
@@ -237,6 +287,9 @@ typedef struct QCOWIMAGE
     uint32_t            cRefcountTableEntries;
     /** Pointer to the refcount table. */
     uint64_t           *paRefcountTable;
+    /** Flag whether clusters were allocated and the refcounts need to be
+     * regenerated when the image is closed (version 2 only). */
+    bool                fRefcountsStale;
 
     /** Offset mask for a cluster. */
     uint64_t            fOffsetMask;
@@ -246,10 +299,46 @@ typedef struct QCOWIMAGE
     uint64_t            fL2Mask;
     /** Number of bits to shift to get the L2 index. */
     uint32_t            cL2Shift;
+    /** Number of bits to shift to get the size of a compressed cluster. */
+    uint32_t            cCompressedShift;
+    /** Mask to get the image offset of a compressed cluster. */
+    uint64_t            fCompressedOffMask;
 
     /** Pointer to the L2 table we are currently allocating
      * (can be only one at a time). */
-    PQCOWL2CACHEENTRY   pL2TblAlloc;
+    PVDMETACACHEENTRY   pL2TblAlloc;
+
+    /** Flag whether newly written clusters are stored compressed. */
+    bool                fCompress;
+    /** Request pool compressing clusters in parallel, NIL_RTREQPOOL to compress
+     * on the calling thread. */
+    RTREQPOOL           hReqPoolCompress;
+    /** Array of clusters waiting to be compressed. */
+    PQCOWCOMPRESSSLOT   paCompressSlots;
+    /** Number of entries in the array. */
+    unsigned            cCompressSlotsMax;
+    /** Number of clusters waiting to be compressed. */
+    unsigned            cCompressSlots;
+    /** Offset of the next free byte for compressed data, 0 if none is left. */
+    uint64_t            offCompressedNext;
+    /** End of the clusters allocated for compressed data. */
+    uint64_t            offCompressedEnd;
+    /** Copy of the last cluster allocated for compressed data, it is still
+     * being filled and reads must not cache it in the tiles below. */
+    uint8_t            *pbCompressedTail;
+
+    /** Decompressed cluster cache, keyed by the L2 table entry. */
+    AVLRU64TREE         TreeCompCache;
+    /** LRU list of the decompressed cluster cache, most recently used first. */
+    RTLISTANCHOR        LstCompCacheLru;
+    /** Number of entries in the decompressed cluster cache. */
+    unsigned            cCompCacheEntries;
+    /** Maximum number of entries in the decompressed cluster cache. */
+    unsigned            cCompCacheEntriesMax;
+    /** Image clusters holding compressed data, allocated on first use. */
+    PQCOWCOMPTILE       paCompTiles;
+    /** Use counter for the tile replacement. */
+    uint64_t            uCompTileUse;
 
 } QCOWIMAGE, *PQCOWIMAGE;
 
@@ -288,9 +377,11 @@ typedef struct QCOWCLUSTERASYNCALLOC
     /** Start offset of the allocated cluster. */
     uint64_t                   offClusterNew;
     /** L2 cache entry if a L2 table is allocated. */
-    PQCOWL2CACHEENTRY          pL2Entry;
+    PVDMETACACHEENTRY          pL2Entry;
     /** Number of bytes to write. */
     size_t                     cbToWrite;
+    /** The L2 table entry replaced by the new cluster (compressed cluster), restored on rollback. */
+    uint64_t                   u64L2EntryOld;
 } QCOWCLUSTERASYNCALLOC, *PQCOWCLUSTERASYNCALLOC;
 
 
@@ -456,42 +547,27 @@ static void qcowTableConvertFromHostEndianess(uint64_t *paTblImg, uint64_t *paTb
 }
 
 /**
- * Creates the L2 table cache.
+ * Initializes the L2 table cache state of the image. The tables are kept
+ * in the metadata cache shared by all images.
  *
  * @returns VBox status code.
  * @param   pImage    The image instance data.
  */
 static int qcowL2TblCacheCreate(PQCOWIMAGE pImage)
 {
-    pImage->cbL2Cache = 0;
-    RTListInit(&pImage->ListSearch);
-    RTListInit(&pImage->ListLru);
-
+    pImage->pL2TblAlloc = NULL;
     return VINF_SUCCESS;
 }
 
 /**
- * Destroys the L2 table cache.
+ * Returns the L2 table of the given cache entry.
  *
- * @returns nothing.
- * @param   pImage    The image instance data.
+ * @returns Pointer to the L2 table.
+ * @param   pL2Entry  The L2 cache entry.
  */
-static void qcowL2TblCacheDestroy(PQCOWIMAGE pImage)
+DECLINLINE(uint64_t *) qcowL2TblCacheEntryGetTbl(PVDMETACACHEENTRY pL2Entry)
 {
-    PQCOWL2CACHEENTRY pL2Entry;
-    PQCOWL2CACHEENTRY pL2Next;
-    RTListForEachSafe(&pImage->ListSearch, pL2Entry, pL2Next, QCOWL2CACHEENTRY, NodeSearch)
-    {
-        Assert(!pL2Entry->cRefs);
-
-        RTListNodeRemove(&pL2Entry->NodeSearch);
-        RTMemPageFree(pL2Entry->paL2Tbl, pImage->cbL2Table);
-        RTMemFree(pL2Entry);
-    }
-
-    pImage->cbL2Cache       = 0;
-    RTListInit(&pImage->ListSearch);
-    RTListInit(&pImage->ListLru);
+    return (uint64_t *)pL2Entry->pvData;
 }
 
 /**
@@ -501,400 +577,1409 @@ static void qcowL2TblCacheDestroy(PQCOWIMAGE pImage)
  * @param   pImage    The image instance data.
  * @param   offL2Tbl  Offset of the L2 table to search for.
  */
-static PQCOWL2CACHEENTRY qcowL2TblCacheRetain(PQCOWIMAGE pImage, uint64_t offL2Tbl)
+static PVDMETACACHEENTRY qcowL2TblCacheRetain(PQCOWIMAGE pImage, uint64_t offL2Tbl)
 {
     if (   pImage->pL2TblAlloc
-        && pImage->pL2TblAlloc->offL2Tbl == offL2Tbl)
+        && pImage->pL2TblAlloc->uOffset == offL2Tbl)
     {
-        pImage->pL2TblAlloc->cRefs++;
+        vdIfIoIntMetaCacheEntryRetain(pImage->pIfIo, pImage->pL2TblAlloc);
         return pImage->pL2TblAlloc;
     }
 
-    PQCOWL2CACHEENTRY pL2Entry;
-    RTListForEach(&pImage->ListSearch, pL2Entry, QCOWL2CACHEENTRY, NodeSearch)
-    {
-        if (pL2Entry->offL2Tbl == offL2Tbl)
-            break;
-    }
-
-    if (!RTListNodeIsDummy(&pImage->ListSearch, pL2Entry, QCOWL2CACHEENTRY, NodeSearch))
-    {
-        /* Update LRU list. */
-        RTListNodeRemove(&pL2Entry->NodeLru);
-        RTListPrepend(&pImage->ListLru, &pL2Entry->NodeLru);
-        pL2Entry->cRefs++;
-        return pL2Entry;
-    }
-
-    return NULL;
+    return vdIfIoIntMetaCacheLookup(pImage->pIfIo, pImage->pStorage, offL2Tbl);
 }
 
 /**
- * Releases a L2 table cache entry.
+ * Releases a L2 table cache entry, an entry which is not in the cache yet
+ * is freed when the last reference is released.
  *
  * @returns nothing.
- * @param   pL2Entry    The L2 cache entry.
+ * @param   pImage    The image instance data.
+ * @param   pL2Entry  The L2 cache entry.
  */
-static void qcowL2TblCacheEntryRelease(PQCOWL2CACHEENTRY pL2Entry)
+static void qcowL2TblCacheEntryRelease(PQCOWIMAGE pImage, PVDMETACACHEENTRY pL2Entry)
 {
-    Assert(pL2Entry->cRefs > 0);
-    pL2Entry->cRefs--;
+    vdIfIoIntMetaCacheEntryRelease(pImage->pIfIo, pL2Entry);
 }
 
 /**
- * Allocates a new L2 table from the cache evicting old entries if required.
+ * Allocates a new L2 table from the metadata cache shared by all images.
  *
  * @returns Pointer to the L2 cache entry or NULL.
  * @param   pImage    The image instance data.
+ * @param   offL2Tbl  Offset of the L2 table in the image.
  */
-static PQCOWL2CACHEENTRY qcowL2TblCacheEntryAlloc(PQCOWIMAGE pImage)
+static PVDMETACACHEENTRY qcowL2TblCacheEntryAlloc(PQCOWIMAGE pImage, uint64_t offL2Tbl)
 {
-    PQCOWL2CACHEENTRY pL2Entry = NULL;
+    return vdIfIoIntMetaCacheEntryAlloc(pImage->pIfIo, pImage->pStorage, offL2Tbl, pImage->cbL2Table);
+}
+
+/**
+ * Inserts an entry in the L2 table cache.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ * @param   pL2Entry  The L2 cache entry to insert.
+ */
+static void qcowL2TblCacheEntryInsert(PQCOWIMAGE pImage, PVDMETACACHEENTRY pL2Entry)
+{
+    Assert(pL2Entry->uOffset > 0);
+    vdIfIoIntMetaCacheEntryInsert(pImage->pIfIo, pL2Entry);
+}
+
+/**
+ * Fetches the L2 from the given offset trying the LRU cache first and
+ * reading it from the image after a cache miss.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   pIoCtx    The I/O context.
+ * @param   offL2Tbl  The offset of the L2 table in the image.
+ * @param   ppL2Entry Where to store the L2 table on success.
+ */
+static int qcowL2TblCacheFetch(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, uint64_t offL2Tbl,
+                               PVDMETACACHEENTRY *ppL2Entry)
+{
+    int rc = VINF_SUCCESS;
 
-    if (pImage->cbL2Cache + pImage->cbL2Table <= QCOW_L2_CACHE_MEMORY_MAX)
+    /* Try to fetch the L2 table from the cache first. */
+    PVDMETACACHEENTRY pL2Entry = qcowL2TblCacheRetain(pImage, offL2Tbl);
+    if (!pL2Entry)
     {
-        /* Add a new entry. */
-        pL2Entry = (PQCOWL2CACHEENTRY)RTMemAllocZ(sizeof(QCOWL2CACHEENTRY));
+        pL2Entry = qcowL2TblCacheEntryAlloc(pImage, offL2Tbl);
+
         if (pL2Entry)
         {
-            pL2Entry->paL2Tbl = (uint64_t *)RTMemPageAllocZ(pImage->cbL2Table);
-            if (RT_UNLIKELY(!pL2Entry->paL2Tbl))
+            /* Read from the image, synchronously if there is no I/O context. */
+            PVDMETAXFER pMetaXfer = NULL;
+
+            rc = vdIfIoIntFileReadMeta(pImage->pIfIo, pImage->pStorage,
+                                       offL2Tbl, pL2Entry->pvData,
+                                       pImage->cbL2Table, pIoCtx,
+                                       pIoCtx ? &pMetaXfer : NULL, NULL, NULL);
+            if (RT_SUCCESS(rc))
             {
-                RTMemFree(pL2Entry);
-                pL2Entry = NULL;
+                vdIfIoIntMetaXferRelease(pImage->pIfIo, pMetaXfer);
+#if defined(RT_LITTLE_ENDIAN)
+                qcowTableConvertToHostEndianess(qcowL2TblCacheEntryGetTbl(pL2Entry), pImage->cL2TableEntries);
+#endif
+                qcowL2TblCacheEntryInsert(pImage, pL2Entry);
             }
             else
-            {
-                pL2Entry->cRefs    = 1;
-                pImage->cbL2Cache += pImage->cbL2Table;
-            }
+                qcowL2TblCacheEntryRelease(pImage, pL2Entry); /* Frees it, the fetch is retried after the read completed. */
         }
+        else
+            rc = VERR_NO_MEMORY;
     }
+
+    if (RT_SUCCESS(rc))
+        *ppL2Entry = pL2Entry;
+
+    return rc;
+}
+
+/**
+ * Sets the L1, L2 and offset bitmasks and L1 and L2 bit shift members.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ */
+static void qcowTableMasksInit(PQCOWIMAGE pImage)
+{
+    uint32_t cClusterBits, cL2TableBits;
+
+    cClusterBits = qcowGetPowerOfTwo(pImage->cbCluster);
+    cL2TableBits = qcowGetPowerOfTwo(pImage->cL2TableEntries);
+
+    Assert(cClusterBits + cL2TableBits < 64);
+
+    pImage->fOffsetMask = ((uint64_t)pImage->cbCluster - 1);
+    pImage->fL2Mask     = ((uint64_t)pImage->cL2TableEntries - 1) << cClusterBits;
+    pImage->cL2Shift    = cClusterBits;
+    pImage->cL1Shift    = cClusterBits + cL2TableBits;
+
+    /*
+     * The size of a compressed cluster is stored above the image offset,
+     * version 1 stores the size in bytes, version 2 the number of additional sectors.
+     */
+    if (pImage->uVersion == 2)
+        pImage->cCompressedShift = 62 - (cClusterBits - 8);
     else
+        pImage->cCompressedShift = 63 - cClusterBits;
+    pImage->fCompressedOffMask = RT_BIT_64(pImage->cCompressedShift) - 1;
+}
+
+/**
+ * Converts a given logical offset into the
+ *
+ * @returns nothing.
+ * @param   pImage         The image instance data.
+ * @param   off            The logical offset to convert.
+ * @param   pidxL1         Where to store the index in the L1 table on success.
+ * @param   pidxL2         Where to store the index in the L2 table on success.
+ * @param   poffCluster    Where to store the offset in the cluster on success.
+ */
+DECLINLINE(void) qcowConvertLogicalOffset(PQCOWIMAGE pImage, uint64_t off, uint32_t *pidxL1,
+                                          uint32_t *pidxL2, uint32_t *poffCluster)
+{
+    AssertPtr(pidxL1);
+    AssertPtr(pidxL2);
+    AssertPtr(poffCluster);
+
+    *poffCluster = off & pImage->fOffsetMask;
+    *pidxL1      = off >> pImage->cL1Shift;
+    *pidxL2      = (off & pImage->fL2Mask) >> pImage->cL2Shift;
+}
+
+/**
+ * Converts Cluster size to a byte size.
+ *
+ * @returns Number of bytes derived from the given number of clusters.
+ * @param   pImage    The image instance data.
+ * @param   cClusters The clusters to convert.
+ */
+DECLINLINE(uint64_t) qcowCluster2Byte(PQCOWIMAGE pImage, uint64_t cClusters)
+{
+    return cClusters * pImage->cbCluster;
+}
+
+/**
+ * Converts number of bytes to cluster size rounding to the next cluster.
+ *
+ * @returns Number of bytes derived from the given number of clusters.
+ * @param   pImage    The image instance data.
+ * @param   cb        Number of bytes to convert.
+ */
+DECLINLINE(uint64_t) qcowByte2Cluster(PQCOWIMAGE pImage, uint64_t cb)
+{
+    return cb / pImage->cbCluster + (cb % pImage->cbCluster ? 1 : 0);
+}
+
+/**
+ * Allocates a new cluster in the image.
+ *
+ * @returns The start offset of the new cluster in the image.
+ * @param   pImage    The image instance data.
+ * @param   cClusters Number of clusters to allocate.
+ */
+DECLINLINE(uint64_t) qcowClusterAllocate(PQCOWIMAGE pImage, uint32_t cClusters)
+{
+    uint64_t offCluster;
+
+    offCluster = pImage->offNextCluster;
+    pImage->offNextCluster += cClusters*pImage->cbCluster;
+    if (pImage->uVersion == 2)
+        pImage->fRefcountsStale = true;
+
+    return offCluster;
+}
+
+/**
+ * Returns the L2 table entry for a given cluster.
+ *
+ * @returns VBox status code.
+ *          VERR_VD_BLOCK_FREE if the cluster is not yet allocated.
+ * @param   pImage        The image instance data.
+ * @param   pIoCtx        The I/O context, NULL for synchronous I/O.
+ * @param   idxL1         The L1 index.
+ * @param   idxL2         The L2 index.
+ * @param   pu64L2Entry   Where to store the L2 table entry on success.
+ */
+static int qcowL2EntryQuery(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, uint32_t idxL1,
+                            uint32_t idxL2, uint64_t *pu64L2Entry)
+{
+    int rc = VERR_VD_BLOCK_FREE;
+
+    AssertReturn(idxL1 < pImage->cL1TableEntries, VERR_INVALID_PARAMETER);
+    AssertReturn(idxL2 < pImage->cL2TableEntries, VERR_INVALID_PARAMETER);
+
+    if (pImage->paL1Table[idxL1])
     {
-        /* Evict the last not in use entry and use it */
-        Assert(!RTListIsEmpty(&pImage->ListLru));
+        PVDMETACACHEENTRY pL2Entry;
 
-        RTListForEachReverse(&pImage->ListLru, pL2Entry, QCOWL2CACHEENTRY, NodeLru)
+        rc = qcowL2TblCacheFetch(pImage, pIoCtx, pImage->paL1Table[idxL1], &pL2Entry);
+        if (RT_SUCCESS(rc))
         {
-            if (!pL2Entry->cRefs)
-                break;
-        }
+            uint64_t *paL2Tbl = qcowL2TblCacheEntryGetTbl(pL2Entry);
 
-        if (!RTListNodeIsDummy(&pImage->ListSearch, pL2Entry, QCOWL2CACHEENTRY, NodeSearch))
-        {
-            RTListNodeRemove(&pL2Entry->NodeSearch);
-            RTListNodeRemove(&pL2Entry->NodeLru);
-            pL2Entry->offL2Tbl = 0;
-            pL2Entry->cRefs    = 1;
+            if (paL2Tbl[idxL2])
+                *pu64L2Entry = paL2Tbl[idxL2];
+            else
+                rc = VERR_VD_BLOCK_FREE;
+
+            qcowL2TblCacheEntryRelease(pImage, pL2Entry);
         }
-        else
-            pL2Entry = NULL;
     }
 
-    return pL2Entry;
+    return rc;
 }
 
 /**
- * Frees a L2 table cache entry.
+ * Returns whether the given L2 table entry references a compressed cluster.
  *
- * @returns nothing.
- * @param   pImage    The image instance data.
- * @param   pL2Entry  The L2 cache entry to free.
+ * @returns true if the cluster is compressed, false otherwise.
+ * @param   pImage        The image instance data.
+ * @param   u64L2Entry    The L2 table entry.
+ */
+DECLINLINE(bool) qcowL2EntryIsCompressed(PQCOWIMAGE pImage, uint64_t u64L2Entry)
+{
+    if (pImage->uVersion == 2)
+        return RT_BOOL(u64L2Entry & QCOW_V2_COMPRESSED_FLAG);
+    return RT_BOOL(u64L2Entry & QCOW_V1_COMPRESSED_FLAG);
+}
+
+/**
+ * Returns the image offset of an uncompressed cluster from the given L2 table entry.
+ *
+ * @returns Image offset of the cluster.
+ * @param   pImage        The image instance data.
+ * @param   u64L2Entry    The L2 table entry.
  */
-static void qcowL2TblCacheEntryFree(PQCOWIMAGE pImage, PQCOWL2CACHEENTRY pL2Entry)
+DECLINLINE(uint64_t) qcowL2EntryGetOffset(PQCOWIMAGE pImage, uint64_t u64L2Entry)
 {
-    Assert(!pL2Entry->cRefs);
-    RTMemPageFree(pL2Entry->paL2Tbl, pImage->cbL2Table);
-    RTMemFree(pL2Entry);
+    Assert(!qcowL2EntryIsCompressed(pImage, u64L2Entry));
 
-    pImage->cbL2Cache -= pImage->cbL2Table;
+    /* Strip flags */
+    if (pImage->uVersion == 2)
+        return u64L2Entry & ~(QCOW_V2_COMPRESSED_FLAG | QCOW_V2_COPIED_FLAG);
+    return u64L2Entry & ~QCOW_V1_COMPRESSED_FLAG;
 }
 
 /**
- * Inserts an entry in the L2 table cache.
+ * Creates the L2 table entry of an uncompressed cluster.
  *
- * @returns nothing.
- * @param   pImage    The image instance data.
- * @param   pL2Entry  The L2 cache entry to insert.
+ * @returns The L2 table entry.
+ * @param   pImage        The image instance data.
+ * @param   offCluster    Image offset of the cluster.
  */
-static void qcowL2TblCacheEntryInsert(PQCOWIMAGE pImage, PQCOWL2CACHEENTRY pL2Entry)
+DECLINLINE(uint64_t) qcowL2EntryFromOffset(PQCOWIMAGE pImage, uint64_t offCluster)
 {
-    Assert(pL2Entry->offL2Tbl > 0);
+    /* The cluster is referenced only once, which is what the copied flag says. */
+    if (pImage->uVersion == 2)
+        return offCluster | QCOW_V2_COPIED_FLAG;
+    return offCluster;
+}
 
-    /* Insert at the top of the LRU list. */
-    RTListPrepend(&pImage->ListLru, &pL2Entry->NodeLru);
+/**
+ * Returns the image offset and size of the data of a compressed cluster.
+ *
+ * @returns nothing.
+ * @param   pImage        The image instance data.
+ * @param   u64L2Entry    The L2 table entry of the compressed cluster.
+ * @param   poffData      Where to store the image offset of the compressed data.
+ * @param   pcbData       Where to store the number of bytes to read.
+ */
+static void qcowL2EntryCompressedDecode(PQCOWIMAGE pImage, uint64_t u64L2Entry,
+                                        uint64_t *poffData, size_t *pcbData)
+{
+    uint64_t offData = u64L2Entry & pImage->fCompressedOffMask;
 
-    if (RTListIsEmpty(&pImage->ListSearch))
+    if (pImage->uVersion == 2)
     {
-        RTListAppend(&pImage->ListSearch, &pL2Entry->NodeSearch);
+        /* The size is given in sectors, the data can start anywhere in the first one. */
+        uint64_t cSectors = ((u64L2Entry >> pImage->cCompressedShift) & (RT_BIT_64(62 - pImage->cCompressedShift) - 1)) + 1;
+        *pcbData = (size_t)(cSectors * 512 - (offData & 511));
     }
     else
+        *pcbData = (size_t)((u64L2Entry >> pImage->cCompressedShift) & pImage->fOffsetMask);
+
+    *poffData = offData;
+}
+
+/**
+ * Creates the L2 table entry of a compressed cluster.
+ *
+ * @returns The L2 table entry.
+ * @param   pImage        The image instance data.
+ * @param   offData       Image offset of the compressed data.
+ * @param   cbData        Size of the compressed data in bytes.
+ */
+static uint64_t qcowL2EntryCompressedEncode(PQCOWIMAGE pImage, uint64_t offData, size_t cbData)
+{
+    Assert(!(offData & ~pImage->fCompressedOffMask));
+    Assert(cbData > 0 && cbData < pImage->cbCluster);
+
+    if (pImage->uVersion == 2)
+    {
+        uint64_t cSectors = ((offData + cbData - 1) >> 9) - (offData >> 9) + 1;
+        return QCOW_V2_COMPRESSED_FLAG | ((cSectors - 1) << pImage->cCompressedShift) | offData;
+    }
+
+    return QCOW_V1_COMPRESSED_FLAG | ((uint64_t)cbData << pImage->cCompressedShift) | offData;
+}
+
+/**
+ * Returns the real image offset for a given cluster or an error if the cluster is not
+ * yet allocated.
+ *
+ * @returns VBox status code.
+ *          VERR_VD_BLOCK_FREE if the cluster is not yet allocated.
+ * @param   pImage        The image instance data.
+ * @param   pIoCtx        The I/O context.
+ * @param   idxL1         The L1 index.
+ * @param   idxL2         The L2 index.
+ * @param   offCluster    Offset inside the cluster.
+ * @param   poffImage     Where to store the image offset on success.
+ * @param   pu64L2Entry   Where to store the L2 table entry if the cluster is
+ *                        compressed, 0 otherwise. The image offset is
+ *                        not valid for compressed clusters.
+ */
+static int qcowConvertToImageOffset(PQCOWIMAGE pImage, PVDIOCTX pIoCtx,
+                                    uint32_t idxL1, uint32_t idxL2,
+                                    uint32_t offCluster, uint64_t *poffImage,
+                                    uint64_t *pu64L2Entry)
+{
+    uint64_t u64L2Entry = 0;
+    int rc = qcowL2EntryQuery(pImage, pIoCtx, idxL1, idxL2, &u64L2Entry);
+    if (RT_SUCCESS(rc))
     {
-        /* Insert into search list. */
-        PQCOWL2CACHEENTRY pIt;
-        pIt = RTListGetFirst(&pImage->ListSearch, QCOWL2CACHEENTRY, NodeSearch);
-        if (pIt->offL2Tbl > pL2Entry->offL2Tbl)
-            RTListPrepend(&pImage->ListSearch, &pL2Entry->NodeSearch);
+        if (RT_UNLIKELY(qcowL2EntryIsCompressed(pImage, u64L2Entry)))
+        {
+            *pu64L2Entry = u64L2Entry;
+            *poffImage   = 0;
+        }
         else
         {
-            bool fInserted = false;
-
-            RTListForEach(&pImage->ListSearch, pIt, QCOWL2CACHEENTRY, NodeSearch)
-            {
-                Assert(pIt->offL2Tbl != pL2Entry->offL2Tbl);
-                if (pIt->offL2Tbl < pL2Entry->offL2Tbl)
-                {
-                    RTListNodeInsertAfter(&pIt->NodeSearch, &pL2Entry->NodeSearch);
-                    fInserted = true;
-                    break;
-                }
-            }
-            Assert(fInserted);
+            *pu64L2Entry = 0;
+            *poffImage   = qcowL2EntryGetOffset(pImage, u64L2Entry) + offCluster;
         }
     }
+
+    return rc;
 }
 
 /**
- * Fetches the L2 from the given offset trying the LRU cache first and
- * reading it from the image after a cache miss.
+ * Write the given table to image converting to the image endianess if required.
  *
  * @returns VBox status code.
- * @param   pImage    Image instance data.
+ * @param   pImage        The image instance data.
+ * @param   pIoCtx        The I/O context.
+ * @param   offTbl        The offset the table should be written to.
+ * @param   paTbl         The table to write.
+ * @param   cbTbl         Size of the table in bytes.
+ * @param   cTblEntries   Number entries in the table.
+ * @param   pfnComplete   Callback called when the write completes.
+ * @param   pvUser        Opaque user data to pass in the completion callback.
+ */
+static int qcowTblWrite(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, uint64_t offTbl, uint64_t *paTbl,
+                        size_t cbTbl, unsigned cTblEntries,
+                        PFNVDXFERCOMPLETED pfnComplete, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+
+#if defined(RT_LITTLE_ENDIAN)
+    uint64_t *paTblImg = (uint64_t *)RTMemAllocZ(cbTbl);
+    if (paTblImg)
+    {
+        qcowTableConvertFromHostEndianess(paTblImg, paTbl, cTblEntries);
+        rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                    offTbl, paTblImg, cbTbl,
+                                    pIoCtx, pfnComplete, pvUser);
+        RTMemFree(paTblImg);
+    }
+    else
+        rc = VERR_NO_MEMORY;
+#else
+    /* Write table directly. */
+    RT_NOREF(cTblEntries);
+    rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                offTbl, paTbl, cbTbl, pIoCtx,
+                                pfnComplete, pvUser);
+#endif
+
+    return rc;
+}
+
+/**
+ * Writes the L1 table to the image, setting the copied flag for version 2 images.
+ *
+ * @returns VBox status code.
+ * @param   pImage        The image instance data.
+ * @param   pIoCtx        The I/O context, NULL for synchronous I/O.
+ * @param   pfnComplete   Callback called when the write completes.
+ * @param   pvUser        Opaque user data to pass in the completion callback.
+ */
+static int qcowL1TblWrite(PQCOWIMAGE pImage, PVDIOCTX pIoCtx,
+                          PFNVDXFERCOMPLETED pfnComplete, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    uint64_t *paL1TblImg = (uint64_t *)RTMemAllocZ(pImage->cbL1Table);
+    if (paL1TblImg)
+    {
+        /* Every L2 table is referenced exactly once. */
+        uint64_t fCopied = pImage->uVersion == 2 ? QCOW_V2_COPIED_FLAG : 0;
+
+        for (uint32_t i = 0; i < pImage->cL1TableEntries; i++)
+            if (pImage->paL1Table[i])
+                paL1TblImg[i] = RT_H2BE_U64(pImage->paL1Table[i] | fCopied);
+
+        rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                    pImage->offL1Table, paL1TblImg, pImage->cbL1Table,
+                                    pIoCtx, pfnComplete, pvUser);
+        RTMemFree(paL1TblImg);
+    }
+    else
+        rc = VERR_NO_MEMORY;
+
+    return rc;
+}
+
+/**
+ * Compresses the given cluster into a raw deflate stream as used for compressed clusters.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_BUFFER_OVERFLOW if the compressed data doesn't fit into the destination buffer.
+ * @param   pvSrc     The cluster data.
+ * @param   cbSrc     Size of the cluster in bytes.
+ * @param   pvDst     Where to store the compressed data.
+ * @param   cbDst     Size of the destination buffer.
+ * @param   pcbDst    Where to store the size of the compressed data on success.
+ */
+static int qcowDeflateCluster(const void *pvSrc, size_t cbSrc, void *pvDst, size_t cbDst, size_t *pcbDst)
+{
+    int rc = VINF_SUCCESS;
+    z_stream Stream;
+
+    RT_ZERO(Stream);
+
+    /* qemu uses a 4KB window for compressed clusters and can't read anything else. */
+    int rcZlib = deflateInit2(&Stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -QCOW_COMPRESSED_WINDOW_BITS,
+                              9 /* memLevel */, Z_DEFAULT_STRATEGY);
+    if (rcZlib != Z_OK)
+        return VERR_NO_MEMORY;
+
+    Stream.next_in   = (Bytef *)pvSrc;
+    Stream.avail_in  = (uInt)cbSrc;
+    Stream.next_out  = (Bytef *)pvDst;
+    Stream.avail_out = (uInt)cbDst;
+
+    rcZlib = deflate(&Stream, Z_FINISH);
+    if (rcZlib == Z_STREAM_END)
+        *pcbDst = cbDst - Stream.avail_out;
+    else if (rcZlib == Z_OK || rcZlib == Z_BUF_ERROR)
+        rc = VERR_BUFFER_OVERFLOW;
+    else
+        rc = VERR_ZIP_ERROR;
+
+    deflateEnd(&Stream);
+    return rc;
+}
+
+/**
+ * Decompresses the data of a compressed cluster.
+ *
+ * @returns VBox status code.
+ * @param   pvSrc     The compressed data.
+ * @param   cbSrc     Size of the compressed data, may include padding.
+ * @param   pvDst     Where to store the cluster data.
+ * @param   cbDst     Size of the cluster in bytes.
+ */
+static int qcowInflateCluster(const void *pvSrc, size_t cbSrc, void *pvDst, size_t cbDst)
+{
+    int rc = VINF_SUCCESS;
+    z_stream Stream;
+
+    RT_ZERO(Stream);
+
+    /* The biggest window can decode streams with smaller windows as well. */
+    int rcZlib = inflateInit2(&Stream, -MAX_WBITS);
+    if (rcZlib != Z_OK)
+        return VERR_NO_MEMORY;
+
+    Stream.next_in   = (Bytef *)pvSrc;
+    Stream.avail_in  = (uInt)cbSrc;
+    Stream.next_out  = (Bytef *)pvDst;
+    Stream.avail_out = (uInt)cbDst;
+
+    /* The compressed data is padded to the next sector, the stream end might not be seen. */
+    rcZlib = inflate(&Stream, Z_FINISH);
+    if (   (rcZlib != Z_STREAM_END && rcZlib != Z_OK && rcZlib != Z_BUF_ERROR)
+        || Stream.avail_out)
+        rc = VERR_ZIP_CORRUPTED;
+
+    inflateEnd(&Stream);
+    return rc;
+}
+
+/**
+ * Initializes the decompressed cluster cache.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ */
+static void qcowCompCacheInit(PQCOWIMAGE pImage)
+{
+    pImage->TreeCompCache        = NULL;
+    RTListInit(&pImage->LstCompCacheLru);
+    pImage->cCompCacheEntries    = 0;
+    pImage->cCompCacheEntriesMax = RT_MAX(QCOW_COMPRESSED_CACHE_SIZE_MAX / pImage->cbCluster, 1);
+    pImage->paCompTiles          = NULL;
+    pImage->uCompTileUse         = 0;
+}
+
+/**
+ * @callback_method_impl{FNAVLRU64CALLBACK, Frees a decompressed cluster cache entry.}
+ */
+static DECLCALLBACK(int) qcowCompCacheEntryDestroy(PAVLRU64NODECORE pNode, void *pvUser)
+{
+    RT_NOREF1(pvUser);
+    RTMemFree(pNode);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Frees all resources of the decompressed cluster cache.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ */
+static void qcowCompCacheDestroy(PQCOWIMAGE pImage)
+{
+    RTAvlrU64Destroy(&pImage->TreeCompCache, qcowCompCacheEntryDestroy, NULL);
+    RTListInit(&pImage->LstCompCacheLru);
+    pImage->cCompCacheEntries = 0;
+
+    if (pImage->paCompTiles)
+    {
+        for (unsigned i = 0; i < QCOW_COMPRESSED_TILES; i++)
+            RTMemFree(pImage->paCompTiles[i].pbData);
+        RTMemFree(pImage->paCompTiles);
+        pImage->paCompTiles = NULL;
+    }
+}
+
+/**
+ * Returns the decompressed cluster for the given L2 table entry from the cache.
+ *
+ * @returns Pointer to the cache entry or NULL if the cluster is not cached.
+ * @param   pImage        The image instance data.
+ * @param   u64L2Entry    The L2 table entry of the compressed cluster.
+ */
+static PQCOWCOMPCACHEENTRY qcowCompCacheLookup(PQCOWIMAGE pImage, uint64_t u64L2Entry)
+{
+    PQCOWCOMPCACHEENTRY pEntry = (PQCOWCOMPCACHEENTRY)RTAvlrU64Get(&pImage->TreeCompCache, u64L2Entry);
+    if (pEntry)
+    {
+        /* Move to the front of the LRU list. */
+        RTListNodeRemove(&pEntry->NodeLru);
+        RTListPrepend(&pImage->LstCompCacheLru, &pEntry->NodeLru);
+    }
+
+    return pEntry;
+}
+
+/**
+ * Allocates a new decompressed cluster cache entry, evicting the least recently
+ * used one if the cache is full.
+ *
+ * @returns Pointer to the entry which is not in the cache yet or NULL if out of memory.
+ * @param   pImage        The image instance data.
+ * @param   u64L2Entry    The L2 table entry of the compressed cluster.
+ */
+static PQCOWCOMPCACHEENTRY qcowCompCacheEntryAlloc(PQCOWIMAGE pImage, uint64_t u64L2Entry)
+{
+    PQCOWCOMPCACHEENTRY pEntry = NULL;
+
+    if (pImage->cCompCacheEntries >= pImage->cCompCacheEntriesMax)
+    {
+        pEntry = RTListGetLast(&pImage->LstCompCacheLru, QCOWCOMPCACHEENTRY, NodeLru);
+        RTListNodeRemove(&pEntry->NodeLru);
+        RTAvlrU64Remove(&pImage->TreeCompCache, pEntry->Core.Key);
+        pImage->cCompCacheEntries--;
+    }
+    else
+        pEntry = (PQCOWCOMPCACHEENTRY)RTMemAlloc(RT_OFFSETOF(QCOWCOMPCACHEENTRY, abData) + pImage->cbCluster);
+
+    if (pEntry)
+    {
+        pEntry->Core.Key     = u64L2Entry;
+        pEntry->Core.KeyLast = u64L2Entry;
+    }
+
+    return pEntry;
+}
+
+/**
+ * Inserts an entry into the decompressed cluster cache.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ * @param   pEntry    The entry to insert.
+ */
+static void qcowCompCacheEntryInsert(PQCOWIMAGE pImage, PQCOWCOMPCACHEENTRY pEntry)
+{
+    bool fInserted = RTAvlrU64Insert(&pImage->TreeCompCache, &pEntry->Core);
+    Assert(fInserted); NOREF(fInserted);
+
+    RTListPrepend(&pImage->LstCompCacheLru, &pEntry->NodeLru);
+    pImage->cCompCacheEntries++;
+}
+
+/**
+ * Returns the data of an image cluster holding compressed data, reading it
+ * from the image if it is not available.
+ *
+ * Compressed data is read in whole clusters at cluster aligned offsets so metadata
+ * transfers for different compressed clusters never overlap. The clusters are kept
+ * in a few tiles because compressed data can span two clusters and the request is
+ * restarted after each read completed.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_VD_NOT_ENOUGH_METADATA if the cluster is being read, the request
+ *          is continued when the read completed.
+ * @param   pImage    The image instance data.
  * @param   pIoCtx    The I/O context.
- * @param   offL2Tbl  The offset of the L2 table in the image.
- * @param   ppL2Entry Where to store the L2 table on success.
+ * @param   offTile   Cluster aligned image offset.
+ * @param   ppbTile   Where to store the pointer to the data on success,
+ *                    valid until the next call.
+ * @param   pcbTile   Where to store the number of valid bytes on success.
  */
-static int qcowL2TblCacheFetch(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, uint64_t offL2Tbl,
-                               PQCOWL2CACHEENTRY *ppL2Entry)
+static int qcowCompTileGet(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, uint64_t offTile,
+                           const uint8_t **ppbTile, size_t *pcbTile)
+{
+    int rc = VINF_SUCCESS;
+
+    /* The last cluster for compressed data is still being filled, use the copy. */
+    if (   pImage->offCompressedNext
+        && offTile == pImage->offCompressedEnd - pImage->cbCluster)
+    {
+        *ppbTile = pImage->pbCompressedTail;
+        *pcbTile = pImage->cbCluster;
+        return VINF_SUCCESS;
+    }
+
+    if (!pImage->paCompTiles)
+    {
+        pImage->paCompTiles = (PQCOWCOMPTILE)RTMemAllocZ(QCOW_COMPRESSED_TILES * sizeof(QCOWCOMPTILE));
+        if (!pImage->paCompTiles)
+            return VERR_NO_MEMORY;
+
+        for (unsigned i = 0; i < QCOW_COMPRESSED_TILES && RT_SUCCESS(rc); i++)
+        {
+            pImage->paCompTiles[i].pbData = (uint8_t *)RTMemAlloc(pImage->cbCluster);
+            if (!pImage->paCompTiles[i].pbData)
+                rc = VERR_NO_MEMORY;
+        }
+
+        if (RT_FAILURE(rc))
+        {
+            for (unsigned i = 0; i < QCOW_COMPRESSED_TILES; i++)
+                RTMemFree(pImage->paCompTiles[i].pbData);
+            RTMemFree(pImage->paCompTiles);
+            pImage->paCompTiles = NULL;
+            return rc;
+        }
+    }
+
+    PQCOWCOMPTILE pTileLru = &pImage->paCompTiles[0];
+    for (unsigned i = 0; i < QCOW_COMPRESSED_TILES; i++)
+    {
+        PQCOWCOMPTILE pTile = &pImage->paCompTiles[i];
+
+        if (   pTile->cbTile
+            && pTile->offTile == offTile)
+        {
+            pTile->uLastUse = ++pImage->uCompTileUse;
+            *ppbTile = pTile->pbData;
+            *pcbTile = pTile->cbTile;
+            return VINF_SUCCESS;
+        }
+
+        if (pTile->uLastUse < pTileLru->uLastUse)
+            pTileLru = pTile;
+    }
+
+    /* The image file might end in the middle of a cluster. */
+    size_t cbTile = pImage->cbCluster;
+    if (   offTile < pImage->cbFileOpen
+        && offTile + cbTile > pImage->cbFileOpen)
+        cbTile = (size_t)(pImage->cbFileOpen - offTile);
+
+    /* Replace the least recently used tile. */
+    pTileLru->offTile  = 0;
+    pTileLru->cbTile   = 0;
+    pTileLru->uLastUse = 0;
+
+    PVDMETAXFER pMetaXfer = NULL;
+    rc = vdIfIoIntFileReadMeta(pImage->pIfIo, pImage->pStorage, offTile,
+                               pTileLru->pbData, cbTile, pIoCtx,
+                               &pMetaXfer, NULL, NULL);
+    if (RT_SUCCESS(rc))
+    {
+        vdIfIoIntMetaXferRelease(pImage->pIfIo, pMetaXfer);
+
+        pTileLru->offTile  = offTile;
+        pTileLru->cbTile   = cbTile;
+        pTileLru->uLastUse = ++pImage->uCompTileUse;
+        *ppbTile = pTileLru->pbData;
+        *pcbTile = cbTile;
+    }
+
+    return rc;
+}
+
+/**
+ * Reads data from a compressed cluster, the cluster is decompressed into the
+ * cache if it isn't there already.
+ *
+ * @returns VBox status code.
+ * @param   pImage        The image instance data.
+ * @param   pIoCtx        The I/O context.
+ * @param   u64L2Entry    The L2 table entry of the compressed cluster.
+ * @param   offCluster    Offset inside the cluster to start reading from.
+ * @param   cbToRead      Number of bytes to read, must not cross the cluster boundary.
+ */
+static int qcowReadCompressed(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, uint64_t u64L2Entry,
+                              uint32_t offCluster, size_t cbToRead)
 {
     int rc = VINF_SUCCESS;
+    PQCOWCOMPCACHEENTRY pEntry = qcowCompCacheLookup(pImage, u64L2Entry);
+
+    if (!pEntry)
+    {
+        uint64_t offData = 0;
+        size_t cbData = 0;
+
+        qcowL2EntryCompressedDecode(pImage, u64L2Entry, &offData, &cbData);
+        if (RT_UNLIKELY(   !cbData
+                        || cbData > 2 * (size_t)pImage->cbCluster
+                        || offData < pImage->cbCluster))
+            return vdIfError(pImage->pIfError, VERR_INVALID_STATE, RT_SRC_POS,
+                             N_("QCow: Compressed cluster entry %#llx of image '%s' is invalid"),
+                             u64L2Entry, pImage->pszFilename);
+
+        uint8_t *pbData = (uint8_t *)RTMemTmpAlloc(cbData);
+        if (RT_LIKELY(pbData))
+        {
+            /* Data from images created elsewhere might be cut short by the end of the file. */
+            size_t cbGather = cbData;
+            if (   offData < pImage->cbFileOpen
+                && offData + cbData > pImage->cbFileOpen)
+            {
+                cbGather = (size_t)(pImage->cbFileOpen - offData);
+                memset(pbData + cbGather, 0, cbData - cbGather);
+            }
+
+            /* Gather the compressed data from the image clusters it is stored in. */
+            size_t cbGathered = 0;
+            while (   cbGathered < cbGather
+                   && RT_SUCCESS(rc))
+            {
+                uint64_t offCur  = offData + cbGathered;
+                uint64_t offTile = offCur & ~pImage->fOffsetMask;
+                const uint8_t *pbTile = NULL;
+                size_t cbTile = 0;
+
+                rc = qcowCompTileGet(pImage, pIoCtx, offTile, &pbTile, &cbTile);
+                if (RT_SUCCESS(rc))
+                {
+                    size_t offInTile = (size_t)(offCur - offTile);
+                    size_t cbThisGather = RT_MIN(cbGather - cbGathered, cbTile - offInTile);
+
+                    Assert(offInTile < cbTile);
+                    memcpy(pbData + cbGathered, pbTile + offInTile, cbThisGather);
+                    cbGathered += cbThisGather;
+                }
+            }
+
+            if (RT_SUCCESS(rc))
+            {
+                pEntry = qcowCompCacheEntryAlloc(pImage, u64L2Entry);
+                if (pEntry)
+                {
+                    rc = qcowInflateCluster(pbData, cbData, &pEntry->abData[0], pImage->cbCluster);
+                    if (RT_SUCCESS(rc))
+                        qcowCompCacheEntryInsert(pImage, pEntry);
+                    else
+                    {
+                        RTMemFree(pEntry);
+                        pEntry = NULL;
+                        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                                       N_("QCow: Decompressing the cluster at offset %llu of image '%s' failed"),
+                                       offData, pImage->pszFilename);
+                    }
+                }
+                else
+                    rc = VERR_NO_MEMORY;
+            }
+
+            RTMemTmpFree(pbData);
+        }
+        else
+            rc = VERR_NO_MEMORY;
+    }
+
+    if (pEntry)
+        vdIfIoIntIoCtxCopyTo(pImage->pIfIo, pIoCtx, &pEntry->abData[offCluster], cbToRead);
+
+    return rc;
+}
+
+/**
+ * Sets up compressing newly written clusters.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ */
+static int qcowCompressInit(PQCOWIMAGE pImage)
+{
+    int rc = VINF_SUCCESS;
+    uint32_t cThreads = RT_MIN(RTMpGetOnlineCount(), QCOW_COMPRESS_THREADS_MAX);
+
+    pImage->hReqPoolCompress  = NIL_RTREQPOOL;
+    pImage->cCompressSlots    = 0;
+    pImage->offCompressedNext = 0;
+    pImage->offCompressedEnd  = 0;
+
+    if (cThreads > 1)
+    {
+        rc = RTReqPoolCreate(cThreads, RT_MS_1SEC, UINT32_MAX /* cThreadsPushBackThreshold */,
+                             0 /* cMsMaxPushBack */, "QCowComp", &pImage->hReqPoolCompress);
+        if (RT_FAILURE(rc))
+        {
+            /* Not fatal, compress on the calling thread. */
+            LogRel(("QCow: Creating the compression pool for image '%s' failed with %Rrc\n",
+                    pImage->pszFilename, rc));
+            pImage->hReqPoolCompress = NIL_RTREQPOOL;
+            cThreads = 1;
+            rc = VINF_SUCCESS;
+        }
+    }
+    else
+        cThreads = 1;
+
+    pImage->cCompressSlotsMax = cThreads * QCOW_COMPRESS_CLUSTERS_PER_THREAD;
+    pImage->paCompressSlots   = (PQCOWCOMPRESSSLOT)RTMemAllocZ(pImage->cCompressSlotsMax * sizeof(QCOWCOMPRESSSLOT));
+    pImage->pbCompressedTail  = (uint8_t *)RTMemAllocZ(pImage->cbCluster);
+    if (   pImage->paCompressSlots
+        && pImage->pbCompressedTail)
+    {
+        for (unsigned i = 0; i < pImage->cCompressSlotsMax && RT_SUCCESS(rc); i++)
+        {
+            PQCOWCOMPRESSSLOT pSlot = &pImage->paCompressSlots[i];
+
+            pSlot->pbData = (uint8_t *)RTMemAlloc(2 * pImage->cbCluster);
+            if (pSlot->pbData)
+                pSlot->pbCompressed = pSlot->pbData + pImage->cbCluster;
+            else
+                rc = VERR_NO_MEMORY;
+        }
+    }
+    else
+        rc = VERR_NO_MEMORY;
+
+    if (RT_SUCCESS(rc))
+        pImage->fCompress = true;
+    else
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                       N_("QCow: Allocating memory for compressing clusters of image '%s' failed"),
+                       pImage->pszFilename);
+    return rc;
+}
+
+/**
+ * Frees all resources for compressing newly written clusters, clusters still
+ * waiting for compression are discarded.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ */
+static void qcowCompressTerm(PQCOWIMAGE pImage)
+{
+    if (pImage->hReqPoolCompress != NIL_RTREQPOOL)
+    {
+        RTReqPoolRelease(pImage->hReqPoolCompress);
+        pImage->hReqPoolCompress = NIL_RTREQPOOL;
+    }
+
+    if (pImage->paCompressSlots)
+    {
+        for (unsigned i = 0; i < pImage->cCompressSlotsMax; i++)
+            RTMemFree(pImage->paCompressSlots[i].pbData);
+        RTMemFree(pImage->paCompressSlots);
+        pImage->paCompressSlots = NULL;
+    }
+
+    if (pImage->pbCompressedTail)
+    {
+        RTMemFree(pImage->pbCompressedTail);
+        pImage->pbCompressedTail = NULL;
+    }
+
+    pImage->fCompress         = false;
+    pImage->cCompressSlots    = 0;
+    pImage->cCompressSlotsMax = 0;
+    pImage->offCompressedNext = 0;
+    pImage->offCompressedEnd  = 0;
+}
+
+/**
+ * Returns the slot of a cluster waiting for compression.
+ *
+ * @returns Pointer to the slot or NULL if the cluster is not waiting for compression.
+ * @param   pImage        The image instance data.
+ * @param   offCluster    Logical offset of the cluster.
+ */
+DECLINLINE(PQCOWCOMPRESSSLOT) qcowCompressSlotFind(PQCOWIMAGE pImage, uint64_t offCluster)
+{
+    for (unsigned i = 0; i < pImage->cCompressSlots; i++)
+        if (pImage->paCompressSlots[i].offCluster == offCluster)
+            return &pImage->paCompressSlots[i];
+
+    return NULL;
+}
+
+/**
+ * Compresses the cluster in the given slot, called on the compression pool.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pSlot     The slot to compress.
+ */
+static DECLCALLBACK(int) qcowCompressSlotWorker(PQCOWIMAGE pImage, PQCOWCOMPRESSSLOT pSlot)
+{
+    /* Store the cluster uncompressed if compression doesn't save at least a sector. */
+    size_t cbCompressed = 0;
+    int rc = qcowDeflateCluster(pSlot->pbData, pImage->cbCluster, pSlot->pbCompressed,
+                                pImage->cbCluster - 512, &cbCompressed);
+    if (RT_SUCCESS(rc))
+        pSlot->cbCompressed = cbCompressed;
+    else if (rc == VERR_BUFFER_OVERFLOW)
+    {
+        pSlot->cbCompressed = 0;
+        rc = VINF_SUCCESS;
+    }
+
+    pSlot->rcCompress = rc;
+    return rc;
+}
+
+/**
+ * Allocates space for compressed data. Compressed data is packed into clusters
+ * which are extended as long as they are at the end of the image.
+ *
+ * @returns Image offset of the allocated space.
+ * @param   pImage    The image instance data.
+ * @param   cbData    Number of bytes to allocate, multiple of the sector size.
+ */
+static uint64_t qcowCompressedAlloc(PQCOWIMAGE pImage, size_t cbData)
+{
+    uint64_t offData = pImage->offCompressedNext;
+
+    if (   !offData
+        || offData + cbData > pImage->offCompressedEnd)
+    {
+        if (   offData
+            && pImage->offCompressedEnd == pImage->offNextCluster)
+            qcowClusterAllocate(pImage, (uint32_t)qcowByte2Cluster(pImage, offData + cbData - pImage->offCompressedEnd));
+        else
+            offData = qcowClusterAllocate(pImage, (uint32_t)qcowByte2Cluster(pImage, cbData));
+
+        /* Start a new copy of the last cluster. */
+        pImage->offCompressedEnd = pImage->offNextCluster;
+        memset(pImage->pbCompressedTail, 0, pImage->cbCluster);
+    }
+
+    pImage->offCompressedNext = offData + cbData;
+    return offData;
+}
+
+/**
+ * Writes compressed data to the image.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pbData    The compressed data, the buffer must be padded to the next sector.
+ * @param   cbData    Size of the compressed data in bytes.
+ * @param   poffData  Where to store the image offset of the data on success.
+ */
+static int qcowCompressedWrite(PQCOWIMAGE pImage, uint8_t *pbData, size_t cbData, uint64_t *poffData)
+{
+    size_t cbWrite = RT_ALIGN_Z(cbData, 512);
+
+    memset(pbData + cbData, 0, cbWrite - cbData);
+
+    uint64_t offData = qcowCompressedAlloc(pImage, cbWrite);
+    int rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, offData, pbData, cbWrite);
+    if (RT_SUCCESS(rc))
+    {
+        /* Update the copy of the last cluster for reads. */
+        uint64_t offTail = pImage->offCompressedEnd - pImage->cbCluster;
+        if (offData + cbWrite > offTail)
+        {
+            uint64_t offStart = RT_MAX(offData, offTail);
+            memcpy(pImage->pbCompressedTail + (offStart - offTail), pbData + (offStart - offData),
+                   (size_t)(offData + cbWrite - offStart));
+        }
+
+        *poffData = offData;
+    }
+
+    return rc;
+}
+
+/**
+ * Writes the cluster of the given slot to the image and updates the L2 table in memory.
+ *
+ * @returns VBox status code.
+ * @param   pImage        The image instance data.
+ * @param   pSlot         The slot to write, already compressed.
+ * @param   ppL2Entry     Where to store the referenced L2 table cache entry which needs
+ *                        to be written and released by the caller.
+ */
+static int qcowCompressSlotCommit(PQCOWIMAGE pImage, PQCOWCOMPRESSSLOT pSlot,
+                                  PVDMETACACHEENTRY *ppL2Entry)
+{
+    int rc = VINF_SUCCESS;
+    uint32_t idxL1      = 0;
+    uint32_t idxL2      = 0;
+    uint32_t offCluster = 0;
+    PVDMETACACHEENTRY pL2Entry = NULL;
+
+    qcowConvertLogicalOffset(pImage, pSlot->offCluster, &idxL1, &idxL2, &offCluster);
+    Assert(!offCluster);
+
+    if (!pImage->paL1Table[idxL1])
+    {
+        /* The L2 table is written by the caller before the L1 table is updated on disk. */
+        uint64_t offL2Tbl = qcowClusterAllocate(pImage, (uint32_t)qcowByte2Cluster(pImage, pImage->cbL2Table));
+        pL2Entry = qcowL2TblCacheEntryAlloc(pImage, offL2Tbl);
+        if (pL2Entry)
+        {
+            memset(pL2Entry->pvData, 0, pImage->cbL2Table);
+            pImage->paL1Table[idxL1] = offL2Tbl;
+            qcowL2TblCacheEntryInsert(pImage, pL2Entry);
+        }
+        else
+        {
+            pImage->offNextCluster = offL2Tbl; /* Undo the cluster allocation. */
+            rc = VERR_NO_MEMORY;
+        }
+    }
+    else
+        rc = qcowL2TblCacheFetch(pImage, NULL, pImage->paL1Table[idxL1], &pL2Entry);
+
+    if (RT_SUCCESS(rc))
+    {
+        uint64_t u64L2Entry = 0;
+        uint64_t offData = 0;
+
+        if (pSlot->cbCompressed)
+        {
+            rc = qcowCompressedWrite(pImage, pSlot->pbCompressed, pSlot->cbCompressed, &offData);
+            if (RT_SUCCESS(rc))
+                u64L2Entry = qcowL2EntryCompressedEncode(pImage, offData, pSlot->cbCompressed);
+        }
+        else
+        {
+            offData = qcowClusterAllocate(pImage, 1);
+            rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, offData,
+                                        pSlot->pbData, pImage->cbCluster);
+            if (RT_SUCCESS(rc))
+                u64L2Entry = qcowL2EntryFromOffset(pImage, offData);
+        }
+
+        if (RT_SUCCESS(rc))
+        {
+            qcowL2TblCacheEntryGetTbl(pL2Entry)[idxL2] = u64L2Entry;
+            *ppL2Entry = pL2Entry;
+        }
+        else
+            qcowL2TblCacheEntryRelease(pImage, pL2Entry);
+    }
+
+    return rc;
+}
+
+/**
+ * Compresses all clusters waiting in the slots and writes them to the image.
+ * The clusters are compressed in parallel, writing happens synchronously on
+ * the calling thread.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ */
+static int qcowCompressSlotsFlush(PQCOWIMAGE pImage)
+{
+    int rc = VINF_SUCCESS;
+    unsigned cSlots = pImage->cCompressSlots;
+
+    if (!cSlots)
+        return VINF_SUCCESS;
+
+    LogFlowFunc(("pImage=%#p cSlots=%u\n", pImage, cSlots));
+
+    if (   pImage->hReqPoolCompress != NIL_RTREQPOOL
+        && cSlots > 1)
+    {
+        PRTREQ apReqs[QCOW_COMPRESS_THREADS_MAX * QCOW_COMPRESS_CLUSTERS_PER_THREAD];
+
+        Assert(cSlots <= RT_ELEMENTS(apReqs));
+        for (unsigned i = 0; i < cSlots; i++)
+        {
+            int rc2 = RTReqPoolCallEx(pImage->hReqPoolCompress, 0 /* cMillies */, &apReqs[i], RTREQFLAGS_IPRT_STATUS,
+                                      (PFNRT)qcowCompressSlotWorker, 2, pImage, &pImage->paCompressSlots[i]);
+            if (RT_FAILURE(rc2) && rc2 != VERR_TIMEOUT)
+            {
+                /* Do it here if the request couldn't be queued. */
+                apReqs[i] = NIL_RTREQ;
+                qcowCompressSlotWorker(pImage, &pImage->paCompressSlots[i]);
+            }
+        }
+
+        for (unsigned i = 0; i < cSlots; i++)
+        {
+            if (apReqs[i] != NIL_RTREQ)
+            {
+                int rc2 = RTReqWait(apReqs[i], RT_INDEFINITE_WAIT);
+                AssertRC(rc2);
+                RTReqRelease(apReqs[i]);
+            }
+        }
+    }
+    else
+    {
+        for (unsigned i = 0; i < cSlots; i++)
+            qcowCompressSlotWorker(pImage, &pImage->paCompressSlots[i]);
+    }
+
+    /*
+     * Write the data in the order it arrived and update the L2 tables, every
+     * modified L2 table is written once at the end followed by the L1 table.
+     */
+    PVDMETACACHEENTRY apL2EntriesDirty[QCOW_COMPRESS_THREADS_MAX * QCOW_COMPRESS_CLUSTERS_PER_THREAD];
+    unsigned cL2EntriesDirty = 0;
 
-    /* Try to fetch the L2 table from the cache first. */
-    PQCOWL2CACHEENTRY pL2Entry = qcowL2TblCacheRetain(pImage, offL2Tbl);
-    if (!pL2Entry)
+    for (unsigned i = 0; i < cSlots && RT_SUCCESS(rc); i++)
     {
-        pL2Entry = qcowL2TblCacheEntryAlloc(pImage);
+        PQCOWCOMPRESSSLOT pSlot = &pImage->paCompressSlots[i];
+        PVDMETACACHEENTRY pL2Entry = NULL;
 
-        if (pL2Entry)
+        rc = pSlot->rcCompress;
+        if (RT_SUCCESS(rc))
+            rc = qcowCompressSlotCommit(pImage, pSlot, &pL2Entry);
+        if (RT_SUCCESS(rc))
         {
-            /* Read from the image. */
-            PVDMETAXFER pMetaXfer;
+            unsigned idx = 0;
+            while (   idx < cL2EntriesDirty
+                   && apL2EntriesDirty[idx] != pL2Entry)
+                idx++;
 
-            pL2Entry->offL2Tbl = offL2Tbl;
-            rc = vdIfIoIntFileReadMeta(pImage->pIfIo, pImage->pStorage,
-                                       offL2Tbl, pL2Entry->paL2Tbl,
-                                       pImage->cbL2Table, pIoCtx,
-                                       &pMetaXfer, NULL, NULL);
-            if (RT_SUCCESS(rc))
-            {
-                vdIfIoIntMetaXferRelease(pImage->pIfIo, pMetaXfer);
-#if defined(RT_LITTLE_ENDIAN)
-                qcowTableConvertToHostEndianess(pL2Entry->paL2Tbl, pImage->cL2TableEntries);
-#endif
-                qcowL2TblCacheEntryInsert(pImage, pL2Entry);
-            }
+            if (idx == cL2EntriesDirty)
+                apL2EntriesDirty[cL2EntriesDirty++] = pL2Entry;
             else
-            {
-                qcowL2TblCacheEntryRelease(pL2Entry);
-                qcowL2TblCacheEntryFree(pImage, pL2Entry);
-            }
+                qcowL2TblCacheEntryRelease(pImage, pL2Entry);
         }
-        else
-            rc = VERR_NO_MEMORY;
+    }
+
+    for (unsigned i = 0; i < cL2EntriesDirty; i++)
+    {
+        if (RT_SUCCESS(rc))
+            rc = qcowTblWrite(pImage, NULL, apL2EntriesDirty[i]->uOffset,
+                              qcowL2TblCacheEntryGetTbl(apL2EntriesDirty[i]),
+                              pImage->cbL2Table, pImage->cL2TableEntries, NULL, NULL);
+        qcowL2TblCacheEntryRelease(pImage, apL2EntriesDirty[i]);
     }
 
     if (RT_SUCCESS(rc))
-        *ppL2Entry = pL2Entry;
+        rc = qcowL1TblWrite(pImage, NULL, NULL, NULL);
+
+    /* Make sure the image covers the complete last cluster for compressed data. */
+    if (RT_SUCCESS(rc))
+        rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, pImage->offNextCluster);
+
+    pImage->cCompressSlots = 0;
 
+    LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
 }
 
 /**
- * Sets the L1, L2 and offset bitmasks and L1 and L2 bit shift members.
+ * Adds a full cluster write to the clusters waiting for compression, writing
+ * the waiting clusters if there is no free slot.
  *
- * @returns nothing.
- * @param   pImage    The image instance data.
+ * @returns VBox status code.
+ * @param   pImage        The image instance data.
+ * @param   offCluster    Logical offset of the cluster.
+ * @param   pIoCtx        The I/O context holding the cluster data.
  */
-static void qcowTableMasksInit(PQCOWIMAGE pImage)
+static int qcowCompressSlotAdd(PQCOWIMAGE pImage, uint64_t offCluster, PVDIOCTX pIoCtx)
 {
-    uint32_t cClusterBits, cL2TableBits;
-
-    cClusterBits = qcowGetPowerOfTwo(pImage->cbCluster);
-    cL2TableBits = qcowGetPowerOfTwo(pImage->cL2TableEntries);
+    int rc = VINF_SUCCESS;
 
-    Assert(cClusterBits + cL2TableBits < 64);
+    if (pImage->cCompressSlots == pImage->cCompressSlotsMax)
+        rc = qcowCompressSlotsFlush(pImage);
 
-    pImage->fOffsetMask = ((uint64_t)pImage->cbCluster - 1);
-    pImage->fL2Mask     = ((uint64_t)pImage->cL2TableEntries - 1) << cClusterBits;
-    pImage->cL2Shift    = cClusterBits;
-    pImage->cL1Shift    = cClusterBits + cL2TableBits;
-}
+    if (RT_SUCCESS(rc))
+    {
+        PQCOWCOMPRESSSLOT pSlot = &pImage->paCompressSlots[pImage->cCompressSlots++];
 
-/**
- * Converts a given logical offset into the
- *
- * @returns nothing.
- * @param   pImage         The image instance data.
- * @param   off            The logical offset to convert.
- * @param   pidxL1         Where to store the index in the L1 table on success.
- * @param   pidxL2         Where to store the index in the L2 table on success.
- * @param   poffCluster    Where to store the offset in the cluster on success.
- */
-DECLINLINE(void) qcowConvertLogicalOffset(PQCOWIMAGE pImage, uint64_t off, uint32_t *pidxL1,
-                                          uint32_t *pidxL2, uint32_t *poffCluster)
-{
-    AssertPtr(pidxL1);
-    AssertPtr(pidxL2);
-    AssertPtr(poffCluster);
+        pSlot->offCluster   = offCluster;
+        pSlot->rcCompress   = VINF_SUCCESS;
+        pSlot->cbCompressed = 0;
+        vdIfIoIntIoCtxCopyFrom(pImage->pIfIo, pIoCtx, pSlot->pbData, pImage->cbCluster);
+    }
 
-    *poffCluster = off & pImage->fOffsetMask;
-    *pidxL1      = off >> pImage->cL1Shift;
-    *pidxL2      = (off & pImage->fL2Mask) >> pImage->cL2Shift;
+    return rc;
 }
 
 /**
- * Converts Cluster size to a byte size.
+ * Increments the reference count of all clusters touched by the given image range.
  *
- * @returns Number of bytes derived from the given number of clusters.
- * @param   pImage    The image instance data.
- * @param   cClusters The clusters to convert.
+ * @returns nothing.
+ * @param   pImage           The image instance data.
+ * @param   pau16Refcounts   The reference counts of all clusters.
+ * @param   cClusters        Number of clusters in the array.
+ * @param   off              Start offset of the range.
+ * @param   cb               Size of the range in bytes.
  */
-DECLINLINE(uint64_t) qcowCluster2Byte(PQCOWIMAGE pImage, uint64_t cClusters)
+static void qcowRefcountsAddRange(PQCOWIMAGE pImage, uint16_t *pau16Refcounts, uint64_t cClusters,
+                                  uint64_t off, uint64_t cb)
 {
-    return cClusters * pImage->cbCluster;
-}
+    if (!cb)
+        return;
 
-/**
- * Converts number of bytes to cluster size rounding to the next cluster.
- *
- * @returns Number of bytes derived from the given number of clusters.
- * @param   pImage    The image instance data.
- * @param   cb        Number of bytes to convert.
- */
-DECLINLINE(uint64_t) qcowByte2Cluster(PQCOWIMAGE pImage, uint64_t cb)
-{
-    return cb / pImage->cbCluster + (cb % pImage->cbCluster ? 1 : 0);
+    uint64_t idxLast = (off + cb - 1) / pImage->cbCluster;
+    for (uint64_t idx = off / pImage->cbCluster; idx <= idxLast && idx < cClusters; idx++)
+        if (pau16Refcounts[idx] < UINT16_MAX)
+            pau16Refcounts[idx]++;
 }
 
 /**
- * Allocates a new cluster in the image.
+ * Regenerates the reference counts of a version 2 image from the L1 and L2 tables.
+ * The new refcount table and blocks are appended to the image, the old ones
+ * end up unreferenced.
  *
- * @returns The start offset of the new cluster in the image.
+ * @returns VBox status code.
  * @param   pImage    The image instance data.
- * @param   cClusters Number of clusters to allocate.
  */
-DECLINLINE(uint64_t) qcowClusterAllocate(PQCOWIMAGE pImage, uint32_t cClusters)
+static int qcowRefcountsRebuild(PQCOWIMAGE pImage)
 {
-    uint64_t offCluster;
-
-    offCluster = pImage->offNextCluster;
-    pImage->offNextCluster += cClusters*pImage->cbCluster;
-
-    return offCluster;
-}
+    int rc = VINF_SUCCESS;
+    uint32_t cRefcountsPerBlock = pImage->cbCluster / sizeof(uint16_t);
+    uint64_t cClustersUsed      = qcowByte2Cluster(pImage, pImage->offNextCluster);
+    uint64_t cClustersRefcount  = 0;
+    uint64_t cRefcountBlocks    = 0;
+    uint64_t cRefcountTblClusters = 0;
 
-/**
- * Returns the real image offset for a given cluster or an error if the cluster is not
- * yet allocated.
- *
- * @returns VBox status code.
- *          VERR_VD_BLOCK_FREE if the cluster is not yet allocated.
- * @param   pImage        The image instance data.
- * @param   pIoCtx        The I/O context.
- * @param   idxL1         The L1 index.
- * @param   idxL2         The L2 index.
- * @param   offCluster    Offset inside the cluster.
- * @param   poffImage     Where to store the image offset on success;
- */
-static int qcowConvertToImageOffset(PQCOWIMAGE pImage, PVDIOCTX pIoCtx,
-                                    uint32_t idxL1, uint32_t idxL2,
-                                    uint32_t offCluster, uint64_t *poffImage)
-{
-    int rc = VERR_VD_BLOCK_FREE;
+    Assert(pImage->uVersion == 2);
+    LogFlowFunc(("pImage=%#p cClustersUsed=%llu\n", pImage, cClustersUsed));
 
-    AssertReturn(idxL1 < pImage->cL1TableEntries, VERR_INVALID_PARAMETER);
-    AssertReturn(idxL2 < pImage->cL2TableEntries, VERR_INVALID_PARAMETER);
+    /* The refcount structures are appended and must cover themselves as well. */
+    for (;;)
+    {
+        cRefcountBlocks      = (cClustersUsed + cClustersRefcount + cRefcountsPerBlock - 1) / cRefcountsPerBlock;
+        cRefcountTblClusters = qcowByte2Cluster(pImage, cRefcountBlocks * sizeof(uint64_t));
+        if (cRefcountBlocks + cRefcountTblClusters == cClustersRefcount)
+            break;
+        cClustersRefcount = cRefcountBlocks + cRefcountTblClusters;
+    }
 
-    if (pImage->paL1Table[idxL1])
+    uint64_t cClusters    = cRefcountBlocks * cRefcountsPerBlock;
+    size_t   cbRefcounts  = (size_t)(cRefcountBlocks * pImage->cbCluster);
+    size_t   cbRefcountTbl = (size_t)qcowCluster2Byte(pImage, cRefcountTblClusters);
+    uint16_t *pau16Refcounts = (uint16_t *)RTMemAllocZ(cbRefcounts);
+    uint64_t *paRefcountTbl  = (uint64_t *)RTMemAllocZ(cbRefcountTbl);
+    uint64_t *paL2Tbl        = (uint64_t *)RTMemAlloc(pImage->cbL2Table);
+    if (   pau16Refcounts
+        && paRefcountTbl
+        && paL2Tbl)
     {
-        PQCOWL2CACHEENTRY pL2Entry;
+        /* Header, backing filename if it doesn't fit into the header cluster and L1 table. */
+        qcowRefcountsAddRange(pImage, pau16Refcounts, cClusters, 0, pImage->cbCluster);
+        if (   pImage->cbBackingFilename
+            && pImage->offBackingFilename + pImage->cbBackingFilename > pImage->cbCluster)
+        {
+            uint64_t offStart = RT_MAX(pImage->offBackingFilename, pImage->cbCluster);
+            qcowRefcountsAddRange(pImage, pau16Refcounts, cClusters, offStart,
+                                  pImage->offBackingFilename + pImage->cbBackingFilename - offStart);
+        }
+        qcowRefcountsAddRange(pImage, pau16Refcounts, cClusters, pImage->offL1Table, pImage->cbL1Table);
 
-        rc = qcowL2TblCacheFetch(pImage, pIoCtx, pImage->paL1Table[idxL1], &pL2Entry);
-        if (RT_SUCCESS(rc))
+        /* L2 tables and the clusters they reference. */
+        for (uint32_t idxL1 = 0; idxL1 < pImage->cL1TableEntries && RT_SUCCESS(rc); idxL1++)
         {
-            /* Get real file offset. */
-            if (pL2Entry->paL2Tbl[idxL2])
+            if (!pImage->paL1Table[idxL1])
+                continue;
+
+            qcowRefcountsAddRange(pImage, pau16Refcounts, cClusters, pImage->paL1Table[idxL1], pImage->cbL2Table);
+
+            rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, pImage->paL1Table[idxL1],
+                                       paL2Tbl, pImage->cbL2Table);
+            if (RT_SUCCESS(rc))
             {
-                uint64_t off = pL2Entry->paL2Tbl[idxL2];
+                qcowTableConvertToHostEndianess(paL2Tbl, pImage->cL2TableEntries);
 
-                /* Strip flags */
-                if (pImage->uVersion == 2)
-                {
-                    if (RT_UNLIKELY(off & QCOW_V2_COMPRESSED_FLAG))
-                        rc = VERR_NOT_SUPPORTED;
-                    else
-                        off &= ~(QCOW_V2_COMPRESSED_FLAG | QCOW_V2_COPIED_FLAG);
-                }
-                else
+                for (uint32_t idxL2 = 0; idxL2 < pImage->cL2TableEntries; idxL2++)
                 {
-                    if (RT_UNLIKELY(off & QCOW_V1_COMPRESSED_FLAG))
-                        rc = VERR_NOT_SUPPORTED;
+                    uint64_t u64L2Entry = paL2Tbl[idxL2];
+
+                    if (!u64L2Entry)
+                        continue;
+
+                    if (qcowL2EntryIsCompressed(pImage, u64L2Entry))
+                    {
+                        uint64_t offData = 0;
+                        size_t cbData = 0;
+
+                        qcowL2EntryCompressedDecode(pImage, u64L2Entry, &offData, &cbData);
+                        qcowRefcountsAddRange(pImage, pau16Refcounts, cClusters, offData, cbData);
+                    }
                     else
-                        off &= ~QCOW_V1_COMPRESSED_FLAG;
+                        qcowRefcountsAddRange(pImage, pau16Refcounts, cClusters,
+                                              qcowL2EntryGetOffset(pImage, u64L2Entry), pImage->cbCluster);
                 }
-
-                *poffImage = off + offCluster;
             }
-            else
-                rc = VERR_VD_BLOCK_FREE;
-
-            qcowL2TblCacheEntryRelease(pL2Entry);
         }
-    }
 
-    return rc;
-}
+        if (RT_SUCCESS(rc))
+        {
+            uint64_t offRefcountTbl    = pImage->offNextCluster;
+            uint64_t offRefcountBlocks = offRefcountTbl + cbRefcountTbl;
 
-/**
- * Write the given table to image converting to the image endianess if required.
- *
- * @returns VBox status code.
- * @param   pImage        The image instance data.
- * @param   pIoCtx        The I/O context.
- * @param   offTbl        The offset the table should be written to.
- * @param   paTbl         The table to write.
- * @param   cbTbl         Size of the table in bytes.
- * @param   cTblEntries   Number entries in the table.
- * @param   pfnComplete   Callback called when the write completes.
- * @param   pvUser        Opaque user data to pass in the completion callback.
- */
-static int qcowTblWrite(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, uint64_t offTbl, uint64_t *paTbl,
-                        size_t cbTbl, unsigned cTblEntries,
-                        PFNVDXFERCOMPLETED pfnComplete, void *pvUser)
-{
-    int rc = VINF_SUCCESS;
+            qcowRefcountsAddRange(pImage, pau16Refcounts, cClusters, offRefcountTbl,
+                                  qcowCluster2Byte(pImage, cClustersRefcount));
 
-#if defined(RT_LITTLE_ENDIAN)
-    uint64_t *paTblImg = (uint64_t *)RTMemAllocZ(cbTbl);
-    if (paTblImg)
-    {
-        qcowTableConvertFromHostEndianess(paTblImg, paTbl, cTblEntries);
-        rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
-                                    offTbl, paTblImg, cbTbl,
-                                    pIoCtx, pfnComplete, pvUser);
-        RTMemFree(paTblImg);
+            for (uint64_t i = 0; i < cRefcountBlocks; i++)
+                paRefcountTbl[i] = RT_H2BE_U64(offRefcountBlocks + qcowCluster2Byte(pImage, i));
+            for (uint64_t i = 0; i < cClusters; i++)
+                pau16Refcounts[i] = RT_H2BE_U16(pau16Refcounts[i]);
+
+            rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, offRefcountBlocks,
+                                        pau16Refcounts, cbRefcounts);
+            if (RT_SUCCESS(rc))
+                rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, offRefcountTbl,
+                                            paRefcountTbl, cbRefcountTbl);
+            if (RT_SUCCESS(rc))
+            {
+                pImage->offNextCluster       += qcowCluster2Byte(pImage, cClustersRefcount);
+                pImage->offRefcountTable      = offRefcountTbl;
+                pImage->cbRefcountTable       = (uint32_t)cbRefcountTbl;
+                pImage->cRefcountTableEntries = pImage->cbRefcountTable / sizeof(uint64_t);
+                pImage->fRefcountsStale       = false;
+
+                /* The old table isn't valid anymore and not needed. */
+                if (pImage->paRefcountTable)
+                {
+                    RTMemFree(pImage->paRefcountTable);
+                    pImage->paRefcountTable = NULL;
+                }
+            }
+        }
     }
     else
         rc = VERR_NO_MEMORY;
-#else
-    /* Write table directly. */
-    RT_NOREF(cTblEntries);
-    rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
-                                offTbl, paTbl, cbTbl, pIoCtx,
-                                pfnComplete, pvUser);
-#endif
 
+    RTMemFree(pau16Refcounts);
+    RTMemFree(paRefcountTbl);
+    RTMemFree(paL2Tbl);
+
+    if (RT_FAILURE(rc))
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                       N_("QCow: Regenerating the reference counts of image '%s' failed"),
+                       pImage->pszFilename);
+
+    LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
 }
 
@@ -911,24 +1996,7 @@ static int qcowFlushImage(PQCOWIMAGE pImage)
     {
         QCowHeader Header;
 
-#if defined(RT_LITTLE_ENDIAN)
-        uint64_t *paL1TblImg = (uint64_t *)RTMemAllocZ(pImage->cbL1Table);
-        if (paL1TblImg)
-        {
-            qcowTableConvertFromHostEndianess(paL1TblImg, pImage->paL1Table,
-                                              pImage->cL1TableEntries);
-            rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage,
-                                        pImage->offL1Table, paL1TblImg,
-                                        pImage->cbL1Table);
-            RTMemFree(paL1TblImg);
-        }
-        else
-            rc = VERR_NO_MEMORY;
-#else
-        /* Write L1 table directly. */
-        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, pImage->offL1Table,
-                                    pImage->paL1Table, pImage->cbL1Table);
-#endif
+        rc = qcowL1TblWrite(pImage, NULL, NULL, NULL);
         if (RT_SUCCESS(rc))
         {
             /* Write header. */
@@ -960,22 +2028,46 @@ static int qcowFreeImage(PQCOWIMAGE pImage, bool fDelete)
         {
             /* No point updating the file that is deleted anyway. */
             if (!fDelete)
+            {
+                /*
+                 * Losing the clusters waiting for compression loses guest data,
+                 * report it but still write out the rest of the metadata.
+                 */
+                if (pImage->fCompress)
+                    rc = qcowCompressSlotsFlush(pImage);
+                if (   pImage->fRefcountsStale
+                    && pImage->paL1Table
+                    && !(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
+                    qcowRefcountsRebuild(pImage);
                 qcowFlushImage(pImage);
+            }
 
-            rc = vdIfIoIntFileClose(pImage->pIfIo, pImage->pStorage);
+            int rc2 = vdIfIoIntFileClose(pImage->pIfIo, pImage->pStorage);
+            if (RT_SUCCESS(rc))
+                rc = rc2;
             pImage->pStorage = NULL;
         }
 
         if (pImage->paL1Table)
             RTMemFree(pImage->paL1Table);
 
+        if (pImage->paRefcountTable)
+        {
+            RTMemFree(pImage->paRefcountTable);
+            pImage->paRefcountTable = NULL;
+        }
+
+        qcowCompressTerm(pImage);
+        qcowCompCacheDestroy(pImage);
+
         if (pImage->pszBackingFilename)
         {
             RTMemFree(pImage->pszBackingFilename);
             pImage->pszBackingFilename = NULL;
         }
 
-        qcowL2TblCacheDestroy(pImage);
+        /* Cached L2 tables were dropped when the storage was closed. */
+        pImage->pL2TblAlloc = NULL;
 
         if (fDelete && pImage->pszFilename)
             vdIfIoIntFileDelete(pImage->pIfIo, pImage->pszFilename);
@@ -1074,9 +2166,6 @@ static int qcowOpenImage(PQCOWIMAGE pImage, unsigned uOpenFlags)
                 if (   RT_SUCCESS(rc)
                     && qcowHdrConvertToHostEndianess(&Header))
                 {
-                    pImage->offNextCluster = RT_ALIGN_64(cbFile, 512); /* Align image to sector boundary. */
-                    Assert(pImage->offNextCluster >= cbFile);
-
                     rc = qcowHdrValidate(pImage, &Header, cbFile);
                     if (RT_SUCCESS(rc))
                     {
@@ -1140,11 +2229,6 @@ static int qcowOpenImage(PQCOWIMAGE pImage, unsigned uOpenFlags)
                                            pImage->pszFilename);
                     }
 
-                    /** @todo Check that there are no compressed clusters in the image
-                     *  (by traversing the L2 tables and checking each offset).
-                     *  Refuse to open such images.
-                     */
-
                     if (   RT_SUCCESS(rc)
                         && pImage->cbBackingFilename
                         && pImage->offBackingFilename)
@@ -1190,6 +2274,14 @@ static int qcowOpenImage(PQCOWIMAGE pImage, unsigned uOpenFlags)
                     if (RT_SUCCESS(rc))
                     {
                         qcowTableMasksInit(pImage);
+                        qcowCompCacheInit(pImage);
+
+                        /*
+                         * New clusters are appended cluster aligned, compressed data
+                         * from other tools can end in the middle of a cluster.
+                         */
+                        pImage->cbFileOpen     = cbFile;
+                        pImage->offNextCluster = RT_ALIGN_64(cbFile, pImage->cbCluster);
 
                         /* Allocate L1 table. */
                         pImage->paL1Table = (uint64_t *)RTMemAllocZ(pImage->cbL1Table);
@@ -1200,7 +2292,14 @@ static int qcowOpenImage(PQCOWIMAGE pImage, unsigned uOpenFlags)
                                                        pImage->offL1Table, pImage->paL1Table,
                                                        pImage->cbL1Table);
                             if (RT_SUCCESS(rc))
+                            {
                                 qcowTableConvertToHostEndianess(pImage->paL1Table, pImage->cL1TableEntries);
+
+                                /* The copied flag is added again when the table is written. */
+                                if (pImage->uVersion == 2)
+                                    for (uint32_t i = 0; i < pImage->cL1TableEntries; i++)
+                                        pImage->paL1Table[i] &= ~QCOW_V2_COPIED_FLAG;
+                            }
                             else
                                 rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
                                                N_("QCow: Reading the L1 table for image '%s' failed"),
@@ -1263,30 +2362,57 @@ static int qcowCreateImage(PQCOWIMAGE pImage, uint64_t cbSize,
             rc = vdIfIoIntFileOpen(pImage->pIfIo, pImage->pszFilename, fOpen, &pImage->pStorage);
             if (RT_SUCCESS(rc))
             {
-                /* Init image state. */
-                pImage->uVersion           = 1; /* We create only version 1 images at the moment. */
+                /*
+                 * Init image state. Version 1 images are created unless compressed
+                 * clusters are requested which are stored like qemu does in version 2
+                 * images with the refcounts generated when the image is closed.
+                 */
                 pImage->cbSize             = cbSize;
-                pImage->cbCluster          = QCOW_CLUSTER_SIZE_DEFAULT;
-                pImage->cbL2Table          = qcowCluster2Byte(pImage, QCOW_L2_CLUSTERS_DEFAULT);
-                pImage->cL2TableEntries    = pImage->cbL2Table / sizeof(uint64_t);
-                pImage->cL1TableEntries    = cbSize / (pImage->cbCluster * pImage->cL2TableEntries);
-                if (cbSize % (pImage->cbCluster * pImage->cL2TableEntries))
-                    pImage->cL1TableEntries++;
-                pImage->cbL1Table          = pImage->cL1TableEntries * sizeof(uint64_t);
-                pImage->offL1Table         = QCOW_V1_HDR_SIZE;
                 pImage->cbBackingFilename  = 0;
                 pImage->offBackingFilename = 0;
-                pImage->offNextCluster     = RT_ALIGN_64(QCOW_V1_HDR_SIZE + pImage->cbL1Table, pImage->cbCluster);
+                if (uImageFlags & VD_QCOW_IMAGE_FLAGS_COMPRESSED)
+                {
+                    pImage->uVersion           = 2;
+                    pImage->cbCluster          = QCOW2_CLUSTER_SIZE_DEFAULT;
+                    pImage->cbL2Table          = pImage->cbCluster;
+                    pImage->cL2TableEntries    = pImage->cbL2Table / sizeof(uint64_t);
+                    pImage->cL1TableEntries    = cbSize / (pImage->cbCluster * pImage->cL2TableEntries);
+                    if (cbSize % (pImage->cbCluster * pImage->cL2TableEntries))
+                        pImage->cL1TableEntries++;
+                    pImage->cbL1Table          = RT_ALIGN_32(pImage->cL1TableEntries * sizeof(uint64_t), pImage->cbCluster);
+                    pImage->offL1Table         = pImage->cbCluster;
+                    pImage->offNextCluster     = pImage->offL1Table + pImage->cbL1Table;
+                    pImage->fRefcountsStale    = true;
+                }
+                else
+                {
+                    pImage->uVersion           = 1;
+                    pImage->cbCluster          = QCOW_CLUSTER_SIZE_DEFAULT;
+                    pImage->cbL2Table          = qcowCluster2Byte(pImage, QCOW_L2_CLUSTERS_DEFAULT);
+                    pImage->cL2TableEntries    = pImage->cbL2Table / sizeof(uint64_t);
+                    pImage->cL1TableEntries    = cbSize / (pImage->cbCluster * pImage->cL2TableEntries);
+                    if (cbSize % (pImage->cbCluster * pImage->cL2TableEntries))
+                        pImage->cL1TableEntries++;
+                    pImage->cbL1Table          = pImage->cL1TableEntries * sizeof(uint64_t);
+                    pImage->offL1Table         = QCOW_V1_HDR_SIZE;
+                    pImage->offNextCluster     = RT_ALIGN_64(QCOW_V1_HDR_SIZE + pImage->cbL1Table, pImage->cbCluster);
+                }
+                pImage->cbFileOpen         = 0;
                 qcowTableMasksInit(pImage);
+                qcowCompCacheInit(pImage);
 
                 /* Init L1 table. */
                 pImage->paL1Table = (uint64_t *)RTMemAllocZ(pImage->cbL1Table);
                 if (RT_LIKELY(pImage->paL1Table))
                 {
+                    if (uImageFlags & VD_QCOW_IMAGE_FLAGS_COMPRESSED)
+                        rc = qcowCompressInit(pImage);
+
                     if (RT_SUCCESS(rc))
                         vdIfProgress(pIfProgress, uPercentStart + uPercentSpan * 98 / 100);
 
-                    rc = qcowFlushImage(pImage);
+                    if (RT_SUCCESS(rc))
+                        rc = qcowFlushImage(pImage);
                     if (RT_SUCCESS(rc))
                         rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, pImage->offNextCluster);
                 }
@@ -1336,18 +2462,16 @@ static int qcowAsyncClusterAllocRollback(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, PQC
 
             /* Assumption right now is that the L1 table is not modified on storage if the link fails. */
             rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, pClusterAlloc->offNextClusterOld);
-            qcowL2TblCacheEntryRelease(pClusterAlloc->pL2Entry); /* Release L2 cache entry. */
-            Assert(!pClusterAlloc->pL2Entry->cRefs);
-            qcowL2TblCacheEntryFree(pImage, pClusterAlloc->pL2Entry); /* Free it, it is not in the cache yet. */
+            qcowL2TblCacheEntryRelease(pImage, pClusterAlloc->pL2Entry); /* Frees it, it is not in the cache yet. */
             break;
         }
         case QCOWCLUSTERASYNCALLOCSTATE_USER_ALLOC:
         case QCOWCLUSTERASYNCALLOCSTATE_USER_LINK:
         {
             /* Assumption right now is that the L2 table is not modified if the link fails. */
-            pClusterAlloc->pL2Entry->paL2Tbl[pClusterAlloc->idxL2] = 0;
+            qcowL2TblCacheEntryGetTbl(pClusterAlloc->pL2Entry)[pClusterAlloc->idxL2] = pClusterAlloc->u64L2EntryOld;
             rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, pClusterAlloc->offNextClusterOld);
-            qcowL2TblCacheEntryRelease(pClusterAlloc->pL2Entry); /* Release L2 cache entry. */
+            qcowL2TblCacheEntryRelease(pImage, pClusterAlloc->pL2Entry); /* Release L2 cache entry. */
             break;
         }
         default:
@@ -1384,13 +2508,11 @@ static DECLCALLBACK(int) qcowAsyncClusterAllocUpdate(void *pBackendData, PVDIOCT
         case QCOWCLUSTERASYNCALLOCSTATE_L2_ALLOC:
         {
             /* Update the link in the in memory L1 table now. */
-            pImage->paL1Table[pClusterAlloc->idxL1] = pClusterAlloc->pL2Entry->offL2Tbl;
+            pImage->paL1Table[pClusterAlloc->idxL1] = pClusterAlloc->pL2Entry->uOffset;
 
             /* Update the link in the on disk L1 table now. */
             pClusterAlloc->enmAllocState = QCOWCLUSTERASYNCALLOCSTATE_L2_LINK;
-            rc = qcowTblWrite(pImage, pIoCtx, pImage->offL1Table, pImage->paL1Table,
-                              pImage->cbL1Table, pImage->cL1TableEntries,
-                              qcowAsyncClusterAllocUpdate, pClusterAlloc);
+            rc = qcowL1TblWrite(pImage, pIoCtx, qcowAsyncClusterAllocUpdate, pClusterAlloc);
             if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
                 break;
             else if (RT_FAILURE(rc))
@@ -1429,11 +2551,11 @@ static DECLCALLBACK(int) qcowAsyncClusterAllocUpdate(void *pBackendData, PVDIOCT
         case QCOWCLUSTERASYNCALLOCSTATE_USER_ALLOC:
         {
             pClusterAlloc->enmAllocState = QCOWCLUSTERASYNCALLOCSTATE_USER_LINK;
-            pClusterAlloc->pL2Entry->paL2Tbl[pClusterAlloc->idxL2] = pClusterAlloc->offClusterNew;
+            qcowL2TblCacheEntryGetTbl(pClusterAlloc->pL2Entry)[pClusterAlloc->idxL2] = qcowL2EntryFromOffset(pImage, pClusterAlloc->offClusterNew);
 
             /* Link L2 table and update it. */
             rc = qcowTblWrite(pImage, pIoCtx, pImage->paL1Table[pClusterAlloc->idxL1],
-                              pClusterAlloc->pL2Entry->paL2Tbl,
+                              qcowL2TblCacheEntryGetTbl(pClusterAlloc->pL2Entry),
                               pImage->cbL2Table, pImage->cL2TableEntries,
                               qcowAsyncClusterAllocUpdate, pClusterAlloc);
             if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
@@ -1448,7 +2570,7 @@ static DECLCALLBACK(int) qcowAsyncClusterAllocUpdate(void *pBackendData, PVDIOCT
         case QCOWCLUSTERASYNCALLOCSTATE_USER_LINK:
         {
             /* Everything done without errors, signal completion. */
-            qcowL2TblCacheEntryRelease(pClusterAlloc->pL2Entry);
+            qcowL2TblCacheEntryRelease(pImage, pClusterAlloc->pL2Entry);
             RTMemFree(pClusterAlloc);
             rc = VINF_SUCCESS;
             break;
@@ -1681,11 +2803,27 @@ static DECLCALLBACK(int) qcowRead(void *pBackendData, uint64_t uOffset, size_t c
     /* Clip read size to remain in the cluster. */
     cbToRead = RT_MIN(cbToRead, pImage->cbCluster - offCluster);
 
-    /* Get offset in image. */
-    rc = qcowConvertToImageOffset(pImage, pIoCtx, idxL1, idxL2, offCluster, &offFile);
-    if (RT_SUCCESS(rc))
-        rc = vdIfIoIntFileReadUser(pImage->pIfIo, pImage->pStorage, offFile,
-                                   pIoCtx, cbToRead);
+    /* The cluster might still wait for compression. */
+    PQCOWCOMPRESSSLOT pSlot = pImage->cCompressSlots ? qcowCompressSlotFind(pImage, uOffset - offCluster) : NULL;
+    if (pSlot)
+    {
+        vdIfIoIntIoCtxCopyTo(pImage->pIfIo, pIoCtx, pSlot->pbData + offCluster, cbToRead);
+        rc = VINF_SUCCESS;
+    }
+    else
+    {
+        /* Get offset in image. */
+        uint64_t u64L2Entry = 0;
+        rc = qcowConvertToImageOffset(pImage, pIoCtx, idxL1, idxL2, offCluster, &offFile, &u64L2Entry);
+        if (RT_SUCCESS(rc))
+        {
+            if (!u64L2Entry)
+                rc = vdIfIoIntFileReadUser(pImage->pIfIo, pImage->pStorage, offFile,
+                                           pIoCtx, cbToRead);
+            else
+                rc = qcowReadCompressed(pImage, pIoCtx, u64L2Entry, offCluster, cbToRead);
+        }
+    }
 
     if (   (   RT_SUCCESS(rc)
             || rc == VERR_VD_BLOCK_FREE
@@ -1725,17 +2863,45 @@ static DECLCALLBACK(int) qcowWrite(void *pBackendData, uint64_t uOffset, size_t
         cbToWrite = RT_MIN(cbToWrite, pImage->cbCluster - offCluster);
         Assert(!(cbToWrite % 512));
 
-        /* Get offset in image. */
-        rc = qcowConvertToImageOffset(pImage, pIoCtx, idxL1, idxL2, offCluster, &offImage);
-        if (RT_SUCCESS(rc))
-            rc = vdIfIoIntFileWriteUser(pImage->pIfIo, pImage->pStorage,
-                                        offImage, pIoCtx, cbToWrite, NULL, NULL);
-        else if (rc == VERR_VD_BLOCK_FREE)
+        /* Get offset in image, clusters waiting for compression are updated in place. */
+        uint64_t u64L2Entry = 0;
+        PQCOWCOMPRESSSLOT pSlot = pImage->cCompressSlots ? qcowCompressSlotFind(pImage, uOffset - offCluster) : NULL;
+        if (pSlot)
+            vdIfIoIntIoCtxCopyFrom(pImage->pIfIo, pIoCtx, pSlot->pbData + offCluster, cbToWrite);
+        else
+            rc = qcowConvertToImageOffset(pImage, pIoCtx, idxL1, idxL2, offCluster, &offImage, &u64L2Entry);
+
+        if (   RT_SUCCESS(rc)
+            && !u64L2Entry)
         {
+            if (!pSlot)
+                rc = vdIfIoIntFileWriteUser(pImage->pIfIo, pImage->pStorage,
+                                            offImage, pIoCtx, cbToWrite, NULL, NULL);
+        }
+        else if (   RT_SUCCESS(rc)
+                 || rc == VERR_VD_BLOCK_FREE)
+        {
+            /*
+             * Compressed clusters are never modified in place but handled like
+             * unallocated ones, the upper layer reads the rest of the cluster
+             * which gets written to a new cluster.
+             */
+            rc = VERR_VD_BLOCK_FREE;
+
             if (   cbToWrite == pImage->cbCluster
-                && !(fWrite & VD_WRITE_NO_ALLOC))
+                && !(fWrite & VD_WRITE_NO_ALLOC)
+                && pImage->fCompress)
+            {
+                Assert(!offCluster);
+                rc = qcowCompressSlotAdd(pImage, uOffset, pIoCtx);
+
+                *pcbPreRead = 0;
+                *pcbPostRead = 0;
+            }
+            else if (   cbToWrite == pImage->cbCluster
+                     && !(fWrite & VD_WRITE_NO_ALLOC))
             {
-                PQCOWL2CACHEENTRY pL2Entry = NULL;
+                PVDMETACACHEENTRY pL2Entry = NULL;
 
                 /* Full cluster write to previously unallocated cluster.
                  * Allocate cluster and write data. */
@@ -1757,17 +2923,17 @@ static DECLCALLBACK(int) qcowWrite(void *pBackendData, uint64_t uOffset, size_t
                             break;
                         }
 
-                        pL2Entry = qcowL2TblCacheEntryAlloc(pImage);
+                        offL2Tbl = qcowClusterAllocate(pImage, qcowByte2Cluster(pImage, pImage->cbL2Table));
+                        pL2Entry = qcowL2TblCacheEntryAlloc(pImage, offL2Tbl);
                         if (!pL2Entry)
                         {
+                            pImage->offNextCluster = offL2Tbl; /* Undo the cluster allocation. */
                             rc = VERR_NO_MEMORY;
                             RTMemFree(pL2ClusterAlloc);
                             break;
                         }
 
-                        offL2Tbl = qcowClusterAllocate(pImage, qcowByte2Cluster(pImage, pImage->cbL2Table));
-                        pL2Entry->offL2Tbl = offL2Tbl;
-                        memset(pL2Entry->paL2Tbl, 0, pImage->cbL2Table);
+                        memset(pL2Entry->pvData, 0, pImage->cbL2Table);
 
                         pL2ClusterAlloc->enmAllocState     = QCOWCLUSTERASYNCALLOCSTATE_L2_ALLOC;
                         pL2ClusterAlloc->offNextClusterOld = offL2Tbl;
@@ -1787,14 +2953,15 @@ static DECLCALLBACK(int) qcowWrite(void *pBackendData, uint64_t uOffset, size_t
                          * is a leak of some clusters.
                          */
                         rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
-                                                    offL2Tbl, pL2Entry->paL2Tbl, pImage->cbL2Table, pIoCtx,
+                                                    offL2Tbl, pL2Entry->pvData, pImage->cbL2Table, pIoCtx,
                                                     qcowAsyncClusterAllocUpdate, pL2ClusterAlloc);
                         if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
                             break;
                         else if (RT_FAILURE(rc))
                         {
                             RTMemFree(pL2ClusterAlloc);
-                            qcowL2TblCacheEntryFree(pImage, pL2Entry);
+                            pImage->pL2TblAlloc = NULL;
+                            qcowL2TblCacheEntryRelease(pImage, pL2Entry);
                             break;
                         }
 
@@ -1828,6 +2995,7 @@ static DECLCALLBACK(int) qcowWrite(void *pBackendData, uint64_t uOffset, size_t
                             pDataClusterAlloc->idxL2             = idxL2;
                             pDataClusterAlloc->cbToWrite         = cbToWrite;
                             pDataClusterAlloc->pL2Entry          = pL2Entry;
+                            pDataClusterAlloc->u64L2EntryOld     = u64L2Entry;
 
                             /* Write data. */
                             rc = vdIfIoIntFileWriteUser(pImage->pIfIo, pImage->pStorage,
@@ -1883,8 +3051,11 @@ static DECLCALLBACK(int) qcowFlush(void *pBackendData, PVDIOCTX pIoCtx)
     {
         QCowHeader Header;
 
-        rc = qcowTblWrite(pImage, pIoCtx, pImage->offL1Table, pImage->paL1Table,
-                          pImage->cbL1Table, pImage->cL1TableEntries, NULL, NULL);
+        /* Clusters waiting for compression are written synchronously first. */
+        if (pImage->cCompressSlots)
+            rc = qcowCompressSlotsFlush(pImage);
+        if (RT_SUCCESS(rc))
+            rc = qcowL1TblWrite(pImage, pIoCtx, NULL, NULL);
         if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
         {
             /* Write header. */
@@ -125,26 +125,6 @@ typedef QedHeader *PQedHeader;
 *   Constants And Macros, Structures and Typedefs                                                                                *
 *********************************************************************************************************************************/
 
-/**
- * QED L2 cache entry.
- */
-typedef struct QEDL2CACHEENTRY
-{
-    /** List node for the search list. */
-    RTLISTNODE              NodeSearch;
-    /** List node for the LRU list. */
-    RTLISTNODE              NodeLru;
-    /** Reference counter. */
-    uint32_t                cRefs;
-    /** The offset of the L2 table, used as search key. */
-    uint64_t                offL2Tbl;
-    /** Pointer to the cached L2 table. */
-    uint64_t               *paL2Tbl;
-} QEDL2CACHEENTRY, *PQEDL2CACHEENTRY;
-
-/** Maximum amount of memory the cache is allowed to use. */
-#define QED_L2_CACHE_MEMORY_MAX (2*_1M)
-
 /**
  * QED image data structure.
  */
@@ -208,14 +188,7 @@ typedef struct QEDIMAGE
 
     /** Pointer to the L2 table we are currently allocating
      * (can be only one at a time). */
-    PQEDL2CACHEENTRY    pL2TblAlloc;
-
-    /** Memory occupied by the L2 table cache. */
-    size_t              cbL2Cache;
-    /** The sorted L2 entry list used for searching. */
-    RTLISTNODE          ListSearch;
-    /** The LRU L2 entry list used for eviction. */
-    RTLISTNODE          ListLru;
+    PVDMETACACHEENTRY   pL2TblAlloc;
 
 } QEDIMAGE, *PQEDIMAGE;
 
@@ -254,7 +227,7 @@ typedef struct QEDCLUSTERASYNCALLOC
     /** Start offset of the allocated cluster. */
     uint64_t                  offClusterNew;
     /** L2 cache entry if a L2 table is allocated. */
-    PQEDL2CACHEENTRY          pL2Entry;
+    PVDMETACACHEENTRY         pL2Entry;
     /** Number of bytes to write. */
     size_t                    cbToWrite;
 } QEDCLUSTERASYNCALLOC, *PQEDCLUSTERASYNCALLOC;
@@ -374,42 +347,27 @@ static void qedTableConvertFromHostEndianess(uint64_t *paTblImg, uint64_t *paTbl
 #endif
 
 /**
- * Creates the L2 table cache.
+ * Initializes the L2 table cache state of the image. The tables are kept
+ * in the metadata cache shared by all images.
  *
  * @returns VBox status code.
  * @param   pImage    The image instance data.
  */
 static int qedL2TblCacheCreate(PQEDIMAGE pImage)
 {
-    pImage->cbL2Cache = 0;
-    RTListInit(&pImage->ListSearch);
-    RTListInit(&pImage->ListLru);
-
+    pImage->pL2TblAlloc = NULL;
     return VINF_SUCCESS;
 }
 
 /**
- * Destroys the L2 table cache.
+ * Returns the L2 table of the given cache entry.
  *
- * @returns nothing.
- * @param   pImage    The image instance data.
+ * @returns Pointer to the L2 table.
+ * @param   pL2Entry  The L2 cache entry.
  */
-static void qedL2TblCacheDestroy(PQEDIMAGE pImage)
+DECLINLINE(uint64_t *) qedL2TblCacheEntryGetTbl(PVDMETACACHEENTRY pL2Entry)
 {
-    PQEDL2CACHEENTRY pL2Entry;
-    PQEDL2CACHEENTRY pL2Next;
-    RTListForEachSafe(&pImage->ListSearch, pL2Entry, pL2Next, QEDL2CACHEENTRY, NodeSearch)
-    {
-        Assert(!pL2Entry->cRefs);
-
-        RTListNodeRemove(&pL2Entry->NodeSearch);
-        RTMemPageFree(pL2Entry->paL2Tbl, pImage->cbTable);
-        RTMemFree(pL2Entry);
-    }
-
-    pImage->cbL2Cache       = 0;
-    RTListInit(&pImage->ListSearch);
-    RTListInit(&pImage->ListLru);
+    return (uint64_t *)pL2Entry->pvData;
 }
 
 /**
@@ -419,114 +377,41 @@ static void qedL2TblCacheDestroy(PQEDIMAGE pImage)
  * @param   pImage    The image instance data.
  * @param   offL2Tbl  Offset of the L2 table to search for.
  */
-static PQEDL2CACHEENTRY qedL2TblCacheRetain(PQEDIMAGE pImage, uint64_t offL2Tbl)
+static PVDMETACACHEENTRY qedL2TblCacheRetain(PQEDIMAGE pImage, uint64_t offL2Tbl)
 {
     if (   pImage->pL2TblAlloc
-        && pImage->pL2TblAlloc->offL2Tbl == offL2Tbl)
+        && pImage->pL2TblAlloc->uOffset == offL2Tbl)
     {
-        pImage->pL2TblAlloc->cRefs++;
+        vdIfIoIntMetaCacheEntryRetain(pImage->pIfIo, pImage->pL2TblAlloc);
         return pImage->pL2TblAlloc;
     }
 
-    PQEDL2CACHEENTRY pL2Entry;
-    RTListForEach(&pImage->ListSearch, pL2Entry, QEDL2CACHEENTRY, NodeSearch)
-    {
-        if (pL2Entry->offL2Tbl == offL2Tbl)
-            break;
-    }
-
-    if (!RTListNodeIsDummy(&pImage->ListSearch, pL2Entry, QEDL2CACHEENTRY, NodeSearch))
-    {
-        /* Update LRU list. */
-        RTListNodeRemove(&pL2Entry->NodeLru);
-        RTListPrepend(&pImage->ListLru, &pL2Entry->NodeLru);
-        pL2Entry->cRefs++;
-        return pL2Entry;
-    }
-    else
-        return NULL;
+    return vdIfIoIntMetaCacheLookup(pImage->pIfIo, pImage->pStorage, offL2Tbl);
 }
 
 /**
- * Releases a L2 table cache entry.
+ * Releases a L2 table cache entry, an entry which is not in the cache yet
+ * is freed when the last reference is released.
  *
  * @returns nothing.
- * @param   pL2Entry    The L2 cache entry.
- */
-static void qedL2TblCacheEntryRelease(PQEDL2CACHEENTRY pL2Entry)
-{
-    Assert(pL2Entry->cRefs > 0);
-    pL2Entry->cRefs--;
-}
-
-/**
- * Allocates a new L2 table from the cache evicting old entries if required.
- *
- * @returns Pointer to the L2 cache entry or NULL.
  * @param   pImage    The image instance data.
+ * @param   pL2Entry  The L2 cache entry.
  */
-static PQEDL2CACHEENTRY qedL2TblCacheEntryAlloc(PQEDIMAGE pImage)
+static void qedL2TblCacheEntryRelease(PQEDIMAGE pImage, PVDMETACACHEENTRY pL2Entry)
 {
-    PQEDL2CACHEENTRY pL2Entry = NULL;
-
-    if (pImage->cbL2Cache + pImage->cbTable <= QED_L2_CACHE_MEMORY_MAX)
-    {
-        /* Add a new entry. */
-        pL2Entry = (PQEDL2CACHEENTRY)RTMemAllocZ(sizeof(QEDL2CACHEENTRY));
-        if (pL2Entry)
-        {
-            pL2Entry->paL2Tbl = (uint64_t *)RTMemPageAllocZ(pImage->cbTable);
-            if (RT_UNLIKELY(!pL2Entry->paL2Tbl))
-            {
-                RTMemFree(pL2Entry);
-                pL2Entry = NULL;
-            }
-            else
-            {
-                pL2Entry->cRefs    = 1;
-                pImage->cbL2Cache += pImage->cbTable;
-            }
-        }
-    }
-    else
-    {
-        /* Evict the last not in use entry and use it */
-        Assert(!RTListIsEmpty(&pImage->ListLru));
-
-        RTListForEachReverse(&pImage->ListLru, pL2Entry, QEDL2CACHEENTRY, NodeLru)
-        {
-            if (!pL2Entry->cRefs)
-                break;
-        }
-
-        if (!RTListNodeIsDummy(&pImage->ListSearch, pL2Entry, QEDL2CACHEENTRY, NodeSearch))
-        {
-            RTListNodeRemove(&pL2Entry->NodeSearch);
-            RTListNodeRemove(&pL2Entry->NodeLru);
-            pL2Entry->offL2Tbl = 0;
-            pL2Entry->cRefs    = 1;
-        }
-        else
-            pL2Entry = NULL;
-    }
-
-    return pL2Entry;
+    vdIfIoIntMetaCacheEntryRelease(pImage->pIfIo, pL2Entry);
 }
 
 /**
- * Frees a L2 table cache entry.
+ * Allocates a new L2 table from the metadata cache shared by all images.
  *
- * @returns nothing.
+ * @returns Pointer to the L2 cache entry or NULL.
  * @param   pImage    The image instance data.
- * @param   pL2Entry  The L2 cache entry to free.
+ * @param   offL2Tbl  Offset of the L2 table in the image.
  */
-static void qedL2TblCacheEntryFree(PQEDIMAGE pImage, PQEDL2CACHEENTRY pL2Entry)
+static PVDMETACACHEENTRY qedL2TblCacheEntryAlloc(PQEDIMAGE pImage, uint64_t offL2Tbl)
 {
-    Assert(!pL2Entry->cRefs);
-    RTMemPageFree(pL2Entry->paL2Tbl, pImage->cbTable);
-    RTMemFree(pL2Entry);
-
-    pImage->cbL2Cache -= pImage->cbTable;
+    return vdIfIoIntMetaCacheEntryAlloc(pImage->pIfIo, pImage->pStorage, offL2Tbl, pImage->cbTable);
 }
 
 /**
@@ -536,41 +421,10 @@ static void qedL2TblCacheEntryFree(PQEDIMAGE pImage, PQEDL2CACHEENTRY pL2Entry)
  * @param   pImage    The image instance data.
  * @param   pL2Entry  The L2 cache entry to insert.
  */
-static void qedL2TblCacheEntryInsert(PQEDIMAGE pImage, PQEDL2CACHEENTRY pL2Entry)
+static void qedL2TblCacheEntryInsert(PQEDIMAGE pImage, PVDMETACACHEENTRY pL2Entry)
 {
-    Assert(pL2Entry->offL2Tbl > 0);
-
-    /* Insert at the top of the LRU list. */
-    RTListPrepend(&pImage->ListLru, &pL2Entry->NodeLru);
-
-    if (RTListIsEmpty(&pImage->ListSearch))
-    {
-        RTListAppend(&pImage->ListSearch, &pL2Entry->NodeSearch);
-    }
-    else
-    {
-        /* Insert into search list. */
-        PQEDL2CACHEENTRY pIt;
-        pIt = RTListGetFirst(&pImage->ListSearch, QEDL2CACHEENTRY, NodeSearch);
-        if (pIt->offL2Tbl > pL2Entry->offL2Tbl)
-            RTListPrepend(&pImage->ListSearch, &pL2Entry->NodeSearch);
-        else
-        {
-            bool fInserted = false;
-
-            RTListForEach(&pImage->ListSearch, pIt, QEDL2CACHEENTRY, NodeSearch)
-            {
-                Assert(pIt->offL2Tbl != pL2Entry->offL2Tbl);
-                if (pIt->offL2Tbl < pL2Entry->offL2Tbl)
-                {
-                    RTListNodeInsertAfter(&pIt->NodeSearch, &pL2Entry->NodeSearch);
-                    fInserted = true;
-                    break;
-                }
-            }
-            Assert(fInserted);
-        }
-    }
+    Assert(pL2Entry->uOffset > 0);
+    vdIfIoIntMetaCacheEntryInsert(pImage->pIfIo, pL2Entry);
 }
 
 /**
@@ -584,39 +438,35 @@ static void qedL2TblCacheEntryInsert(PQEDIMAGE pImage, PQEDL2CACHEENTRY pL2Entry
  * @param   ppL2Entry Where to store the L2 table on success.
  */
 static int qedL2TblCacheFetchAsync(PQEDIMAGE pImage, PVDIOCTX pIoCtx,
-                                   uint64_t offL2Tbl, PQEDL2CACHEENTRY *ppL2Entry)
+                                   uint64_t offL2Tbl, PVDMETACACHEENTRY *ppL2Entry)
 {
     int rc = VINF_SUCCESS;
 
     /* Try to fetch the L2 table from the cache first. */
-    PQEDL2CACHEENTRY pL2Entry = qedL2TblCacheRetain(pImage, offL2Tbl);
+    PVDMETACACHEENTRY pL2Entry = qedL2TblCacheRetain(pImage, offL2Tbl);
     if (!pL2Entry)
     {
-        pL2Entry = qedL2TblCacheEntryAlloc(pImage);
+        pL2Entry = qedL2TblCacheEntryAlloc(pImage, offL2Tbl);
 
         if (pL2Entry)
         {
             /* Read from the image. */
             PVDMETAXFER pMetaXfer;
 
-            pL2Entry->offL2Tbl = offL2Tbl;
             rc = vdIfIoIntFileReadMeta(pImage->pIfIo, pImage->pStorage,
-                                       offL2Tbl, pL2Entry->paL2Tbl,
+                                       offL2Tbl, pL2Entry->pvData,
                                        pImage->cbTable, pIoCtx,
                                        &pMetaXfer, NULL, NULL);
             if (RT_SUCCESS(rc))
             {
                 vdIfIoIntMetaXferRelease(pImage->pIfIo, pMetaXfer);
 #if defined(RT_BIG_ENDIAN)
-                qedTableConvertToHostEndianess(pL2Entry->paL2Tbl, pImage->cTableEntries);
+                qedTableConvertToHostEndianess(qedL2TblCacheEntryGetTbl(pL2Entry), pImage->cTableEntries);
 #endif
                 qedL2TblCacheEntryInsert(pImage, pL2Entry);
             }
             else
-            {
-                qedL2TblCacheEntryRelease(pL2Entry);
-                qedL2TblCacheEntryFree(pImage, pL2Entry);
-            }
+                qedL2TblCacheEntryRelease(pImage, pL2Entry); /* Frees it, the fetch is retried after the read completed. */
         }
         else
             rc = VERR_NO_MEMORY;
@@ -756,19 +606,21 @@ static int qedConvertToImageOffset(PQEDIMAGE pImage, PVDIOCTX pIoCtx,
 
     if (pImage->paL1Table[idxL1])
     {
-        PQEDL2CACHEENTRY pL2Entry;
+        PVDMETACACHEENTRY pL2Entry;
 
         rc = qedL2TblCacheFetchAsync(pImage, pIoCtx, pImage->paL1Table[idxL1],
                                      &pL2Entry);
         if (RT_SUCCESS(rc))
         {
+            uint64_t *paL2Tbl = qedL2TblCacheEntryGetTbl(pL2Entry);
+
             /* Get real file offset. */
-            if (pL2Entry->paL2Tbl[idxL2])
-                *poffImage = pL2Entry->paL2Tbl[idxL2] + offCluster;
+            if (paL2Tbl[idxL2])
+                *poffImage = paL2Tbl[idxL2] + offCluster;
             else
                 rc = VERR_VD_BLOCK_FREE;
 
-            qedL2TblCacheEntryRelease(pL2Entry);
+            qedL2TblCacheEntryRelease(pImage, pL2Entry);
         }
     }
 
@@ -1108,7 +960,8 @@ static int qedFreeImage(PQEDIMAGE pImage, bool fDelete)
             pImage->pszBackingFilename = NULL;
         }
 
-        qedL2TblCacheDestroy(pImage);
+        /* Cached L2 tables were dropped when the storage was closed. */
+        pImage->pL2TblAlloc = NULL;
 
         if (fDelete && pImage->pszFilename)
             vdIfIoIntFileDelete(pImage->pIfIo, pImage->pszFilename);
@@ -1342,18 +1195,16 @@ static int qedAsyncClusterAllocRollback(PQEDIMAGE pImage, PVDIOCTX pIoCtx, PQEDC
 
             /* Assumption right now is that the L1 table is not modified on storage if the link fails. */
             rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, pClusterAlloc->cbImageOld);
-            qedL2TblCacheEntryRelease(pClusterAlloc->pL2Entry); /* Release L2 cache entry. */
-            Assert(!pClusterAlloc->pL2Entry->cRefs);
-            qedL2TblCacheEntryFree(pImage, pClusterAlloc->pL2Entry); /* Free it, it is not in the cache yet. */
+            qedL2TblCacheEntryRelease(pImage, pClusterAlloc->pL2Entry); /* Frees it, it is not in the cache yet. */
             break;
         }
         case QEDCLUSTERASYNCALLOCSTATE_USER_ALLOC:
         case QEDCLUSTERASYNCALLOCSTATE_USER_LINK:
         {
             /* Assumption right now is that the L2 table is not modified if the link fails. */
-            pClusterAlloc->pL2Entry->paL2Tbl[pClusterAlloc->idxL2] = 0;
+            qedL2TblCacheEntryGetTbl(pClusterAlloc->pL2Entry)[pClusterAlloc->idxL2] = 0;
             rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, pClusterAlloc->cbImageOld);
-            qedL2TblCacheEntryRelease(pClusterAlloc->pL2Entry); /* Release L2 cache entry. */
+            qedL2TblCacheEntryRelease(pImage, pClusterAlloc->pL2Entry); /* Release L2 cache entry. */
             break;
         }
         default:
@@ -1390,7 +1241,7 @@ static DECLCALLBACK(int) qedAsyncClusterAllocUpdate(void *pBackendData, PVDIOCTX
         case QEDCLUSTERASYNCALLOCSTATE_L2_ALLOC:
         {
             /* Update the link in the in memory L1 table now. */
-            pImage->paL1Table[pClusterAlloc->idxL1] = pClusterAlloc->pL2Entry->offL2Tbl;
+            pImage->paL1Table[pClusterAlloc->idxL1] = pClusterAlloc->pL2Entry->uOffset;
 
             /* Update the link in the on disk L1 table now. */
             pClusterAlloc->enmAllocState = QEDCLUSTERASYNCALLOCSTATE_L2_LINK;
@@ -1434,11 +1285,11 @@ static DECLCALLBACK(int) qedAsyncClusterAllocUpdate(void *pBackendData, PVDIOCTX
         case QEDCLUSTERASYNCALLOCSTATE_USER_ALLOC:
         {
             pClusterAlloc->enmAllocState = QEDCLUSTERASYNCALLOCSTATE_USER_LINK;
-            pClusterAlloc->pL2Entry->paL2Tbl[pClusterAlloc->idxL2] = pClusterAlloc->offClusterNew;
+            qedL2TblCacheEntryGetTbl(pClusterAlloc->pL2Entry)[pClusterAlloc->idxL2] = pClusterAlloc->offClusterNew;
 
             /* Link L2 table and update it. */
             rc = qedTblWrite(pImage, pIoCtx, pImage->paL1Table[pClusterAlloc->idxL1],
-                             pClusterAlloc->pL2Entry->paL2Tbl,
+                             qedL2TblCacheEntryGetTbl(pClusterAlloc->pL2Entry),
                              qedAsyncClusterAllocUpdate, pClusterAlloc);
             if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
                 break;
@@ -1452,7 +1303,7 @@ static DECLCALLBACK(int) qedAsyncClusterAllocUpdate(void *pBackendData, PVDIOCTX
         case QEDCLUSTERASYNCALLOCSTATE_USER_LINK:
         {
             /* Everything done without errors, signal completion. */
-            qedL2TblCacheEntryRelease(pClusterAlloc->pL2Entry);
+            qedL2TblCacheEntryRelease(pImage, pClusterAlloc->pL2Entry);
             RTMemFree(pClusterAlloc);
             rc = VINF_SUCCESS;
             break;
@@ -1741,7 +1592,7 @@ static DECLCALLBACK(int) qedWrite(void *pBackendData, uint64_t uOffset, size_t c
             if (   cbToWrite == pImage->cbCluster
                 && !(fWrite & VD_WRITE_NO_ALLOC))
             {
-                PQEDL2CACHEENTRY pL2Entry = NULL;
+                PVDMETACACHEENTRY pL2Entry = NULL;
 
                 /* Full cluster write to previously unallocated cluster.
                  * Allocate cluster and write data. */
@@ -1763,17 +1614,17 @@ static DECLCALLBACK(int) qedWrite(void *pBackendData, uint64_t uOffset, size_t c
                             break;
                         }
 
-                        pL2Entry = qedL2TblCacheEntryAlloc(pImage);
+                        offL2Tbl = qedClusterAllocate(pImage, qedByte2Cluster(pImage, pImage->cbTable));
+                        pL2Entry = qedL2TblCacheEntryAlloc(pImage, offL2Tbl);
                         if (!pL2Entry)
                         {
+                            pImage->cbImage = offL2Tbl; /* Undo the cluster allocation. */
                             rc = VERR_NO_MEMORY;
                             RTMemFree(pL2ClusterAlloc);
                             break;
                         }
 
-                        offL2Tbl = qedClusterAllocate(pImage, qedByte2Cluster(pImage, pImage->cbTable));
-                        pL2Entry->offL2Tbl = offL2Tbl;
-                        memset(pL2Entry->paL2Tbl, 0, pImage->cbTable);
+                        memset(pL2Entry->pvData, 0, pImage->cbTable);
 
                         pL2ClusterAlloc->enmAllocState = QEDCLUSTERASYNCALLOCSTATE_L2_ALLOC;
                         pL2ClusterAlloc->cbImageOld    = offL2Tbl;
@@ -1793,14 +1644,15 @@ static DECLCALLBACK(int) qedWrite(void *pBackendData, uint64_t uOffset, size_t c
                          * is a leak of some clusters.
                          */
                         rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
-                                                    offL2Tbl, pL2Entry->paL2Tbl, pImage->cbTable, pIoCtx,
+                                                    offL2Tbl, pL2Entry->pvData, pImage->cbTable, pIoCtx,
                                                     qedAsyncClusterAllocUpdate, pL2ClusterAlloc);
                         if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
                             break;
                         else if (RT_FAILURE(rc))
                         {
                             RTMemFree(pL2ClusterAlloc);
-                            qedL2TblCacheEntryFree(pImage, pL2Entry);
+                            pImage->pL2TblAlloc = NULL;
+                            qedL2TblCacheEntryRelease(pImage, pL2Entry);
                             break;
                         }
 
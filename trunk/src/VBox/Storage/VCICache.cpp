@@ -28,6 +28,8 @@
 #include <iprt/alloc.h>
 #include <iprt/file.h>
 #include <iprt/asm.h>
+#include <iprt/string.h>
+#include <iprt/uuid.h>
 
 #include "VDBackends.h"
 
@@ -51,6 +53,10 @@
 /**
  * The VCI header - at the beginning of the file.
  *
+ * The cache is divided into fixed size lines, each caching an aligned range of
+ * the disk.  The line table following the header records which disk range a
+ * line caches and which blocks of it hold valid data.
+ *
  * All entries a stored in little endian order.
  */
 #pragma pack(1)
@@ -67,26 +73,29 @@ typedef struct VciHdr
     uint8_t     fUncleanShutdown;
     /** Cache type. */
     uint32_t    u32CacheType;
-    /** Offset of the B+-Tree root in the image in blocks. */
-    uint64_t    offTreeRoot;
-    /** Offset of the block allocation bitmap in blocks. */
-    uint64_t    offBlkMap;
-    /** Size of the block allocation bitmap in blocks. */
-    uint32_t    cBlkMap;
+    /** Offset of the line table in the image in blocks. */
+    uint64_t    offLineTbl;
+    /** Offset of the first cache line in the image in blocks. */
+    uint64_t    offData;
+    /** Number of blocks a cache line covers. */
+    uint32_t    cBlocksPerLine;
+    /** Number of cache lines. */
+    uint32_t    cLines;
     /** UUID of the image. */
     RTUUID      uuidImage;
     /** Modification UUID for the cache. */
     RTUUID      uuidModification;
     /** Reserved for future use. */
-    uint8_t     abReserved[951];
+    uint8_t     abReserved[947];
 } VciHdr, *PVciHdr;
 #pragma pack()
 AssertCompileSize(VciHdr, 2 * VCI_BLOCK_SIZE);
 
 /** VCI signature to identify a valid image. */
 #define VCI_HDR_SIGNATURE          UINT32_C(0x00494356) /* \0ICV */
-/** Current version we support. */
-#define VCI_HDR_VERSION            UINT32_C(0x00000001)
+/** Current version we support.
+ * Version 1 used a B+-Tree which was never able to hold any data. */
+#define VCI_HDR_VERSION            UINT32_C(0x00000002)
 
 /** Value for an unclean cache shutdown. */
 #define VCI_HDR_UNCLEAN_SHUTDOWN   UINT8_C(0x01)
@@ -99,237 +108,69 @@ AssertCompileSize(VciHdr, 2 * VCI_BLOCK_SIZE);
 #define VCI_HDR_CACHE_TYPE_FIXED   UINT32_C(0x00000002)
 
 /**
- * On disk representation of an extent describing a range of cached data.
+ * On disk representation of a cache line table entry.
  *
  * All entries a stored in little endian order.
  */
 #pragma pack(1)
-typedef struct VciCacheExtent
+typedef struct VciLineEnt
 {
-    /** Block address of the previous extent in the LRU list. */
-    uint64_t    u64ExtentPrev;
-    /** Block address of the next extent in the LRU list. */
-    uint64_t    u64ExtentNext;
-    /** Flags (for compression, encryption etc.) - currently unused and should be always 0. */
-    uint8_t     u8Flags;
-    /** Reserved */
-    uint8_t     u8Reserved;
-    /** First block of cached data the extent represents. */
-    uint64_t    u64BlockOffset;
-    /** Number of blocks the extent represents. */
-    uint32_t    u32Blocks;
-    /** First block in the image where the data is stored. */
-    uint64_t    u64BlockAddr;
-} VciCacheExtent, *PVciCacheExtent;
-#pragma pack()
-AssertCompileSize(VciCacheExtent, 38);
-
-/**
- * On disk representation of an internal node.
- *
- * All entries a stored in little endian order.
- */
-#pragma pack(1)
-typedef struct VciTreeNodeInternal
-{
-    /** First block of cached data the internal node represents. */
-    uint64_t    u64BlockOffset;
-    /** Number of blocks the internal node represents. */
-    uint32_t    u32Blocks;
-    /** Block address in the image where the next node in the tree is stored. */
-    uint64_t    u64ChildAddr;
-} VciTreeNodeInternal, *PVciTreeNodeInternal;
-#pragma pack()
-AssertCompileSize(VciTreeNodeInternal, 20);
-
-/**
- * On-disk representation of a node in the B+-Tree.
- *
- * All entries a stored in little endian order.
- */
-#pragma pack(1)
-typedef struct VciTreeNode
-{
-    /** Type of the node (root, internal, leaf). */
-    uint8_t     u8Type;
-    /** Data in the node. */
-    uint8_t     au8Data[4095];
-} VciTreeNode, *PVciTreeNode;
-#pragma pack()
-AssertCompileSize(VciTreeNode, 8 * VCI_BLOCK_SIZE);
-
-/** Node type: Internal node containing links to other nodes (VciTreeNodeInternal). */
-#define VCI_TREE_NODE_TYPE_INTERNAL UINT8_C(0x01)
-/** Node type: Leaf of the tree (VciCacheExtent). */
-#define VCI_TREE_NODE_TYPE_LEAF     UINT8_C(0x02)
-
-/** Number of cache extents described by one node. */
-#define VCI_TREE_EXTENTS_PER_NODE        ((sizeof(VciTreeNode)-1) / sizeof(VciCacheExtent))
-/** Number of internal nodes managed by one tree node. */
-#define VCI_TREE_INTERNAL_NODES_PER_NODE ((sizeof(VciTreeNode)-1) / sizeof(VciTreeNodeInternal))
-
-/**
- * VCI block bitmap header.
- *
- * All entries a stored in little endian order.
- */
-#pragma pack(1)
-typedef struct VciBlkMap
-{
-    /** Magic of the block bitmap. */
-    uint32_t     u32Magic;
-    /** Version of the block bitmap. */
-    uint32_t     u32Version;
-    /** Number of blocks this block map manages. */
-    uint64_t     cBlocks;
-    /** Number of free blocks. */
-    uint64_t     cBlocksFree;
-    /** Number of blocks allocated for metadata. */
-    uint64_t     cBlocksAllocMeta;
-    /** Number of blocks allocated for actual cached data. */
-    uint64_t     cBlocksAllocData;
+    /** Number of the disk line cached plus one, 0 if the line is free. */
+    uint64_t    u64Line;
+    /** Bitmap of blocks in the line holding valid data. */
+    uint32_t    au32Valid[4];
     /** Reserved for future use. */
-    uint8_t      au8Reserved[472];
-} VciBlkMap, *PVciBlkMap;
+    uint8_t     abReserved[8];
+} VciLineEnt, *PVciLineEnt;
 #pragma pack()
-AssertCompileSize(VciBlkMap, VCI_BLOCK_SIZE);
-
-/** The magic which identifies a block map. */
-#define VCI_BLKMAP_MAGIC   UINT32_C(0x4b4c4256) /* KLBV */
-/** Current version. */
-#define VCI_BLKMAP_VERSION UINT32_C(0x00000001)
+AssertCompileSize(VciLineEnt, 32);
 
-/** Block bitmap entry */
-typedef uint8_t VciBlkMapEnt;
+/** Maximum number of blocks per cache line, limited by the valid bitmap. */
+#define VCI_LINE_BLOCKS_MAX        128
+/** Default size of a cache line. */
+#define VCI_LINE_SIZE_DEFAULT      _64K
+/** Number of line table entries per block. */
+#define VCI_LINE_ENTS_PER_BLOCK    (VCI_BLOCK_SIZE / sizeof(VciLineEnt))
+/** Alignment of the first cache line in blocks. */
+#define VCI_DATA_ALIGNMENT         VCI_BYTE2BLOCK(_4K)
 
 
 /*********************************************************************************************************************************
 *   Constants And Macros, Structures and Typedefs                                                                                *
 *********************************************************************************************************************************/
 
-/**
- * Block range descriptor.
- */
-typedef struct VCIBLKRANGEDESC
-{
-    /** Previous entry in the list. */
-    struct VCIBLKRANGEDESC    *pPrev;
-    /** Next entry in the list. */
-    struct VCIBLKRANGEDESC    *pNext;
-    /** Start address of the range. */
-    uint64_t                   offAddrStart;
-    /** Number of blocks in the range. */
-    uint64_t                   cBlocks;
-    /** Flag whether the range is free or allocated. */
-    bool                       fFree;
-} VCIBLKRANGEDESC, *PVCIBLKRANGEDESC;
-
-/**
- * Block map for the cache image - in memory structure.
- */
-typedef struct VCIBLKMAP
-{
-    /** Number of blocks the map manages. */
-    uint64_t     cBlocks;
-    /** Number of blocks allocated for metadata. */
-    uint64_t     cBlocksAllocMeta;
-    /** Number of blocks allocated for actual cached data. */
-    uint64_t     cBlocksAllocData;
-    /** Number of free blocks. */
-    uint64_t     cBlocksFree;
-
-    /** Pointer to the head of the block range list. */
-    PVCIBLKRANGEDESC pRangesHead;
-    /** Pointer to the tail of the block range list. */
-    PVCIBLKRANGEDESC pRangesTail;
-
-} VCIBLKMAP;
-/** Pointer to a block map. */
-typedef VCIBLKMAP *PVCIBLKMAP;
-
-/**
- * B+-Tree node header.
- */
-typedef struct VCITREENODE
-{
-    /** Type of the node (VCI_TREE_NODE_TYPE_*). */
-    uint8_t             u8Type;
-    /** Block address where the node is stored. */
-    uint64_t            u64BlockAddr;
-    /** Pointer to the parent. */
-    struct VCITREENODE *pParent;
-} VCITREENODE, *PVCITREENODE;
-
-/**
- * B+-Tree node pointer.
- */
-typedef struct VCITREENODEPTR
-{
-    /** Flag whether the node is in memory or still on the disk. */
-    bool         fInMemory;
-    /** Type dependent data. */
-    union
-    {
-        /** Pointer to a in memory node. */
-        PVCITREENODE pNode;
-        /** Start block address of the node. */
-        uint64_t     offAddrBlockNode;
-    } u;
-} VCITREENODEPTR, *PVCITREENODEPTR;
+/** NIL index for the line lists. */
+#define VCI_LINE_NIL               UINT32_MAX
 
 /**
- * Internal node.
+ * Cache line - in memory structure.
  */
-typedef struct VCINODEINTERNAL
+typedef struct VCICACHELINE
 {
-    /** First block of cached data the internal node represents. */
-    uint64_t       u64BlockOffset;
-    /** Number of blocks the internal node represents. */
-    uint32_t       u32Blocks;
-    /** Pointer to the child node. */
-    VCITREENODEPTR PtrChild;
-} VCINODEINTERNAL, *PVCINODEINTERNAL;
-
-/**
- * A in memory internal B+-tree node.
- */
-typedef struct VCITREENODEINT
-{
-    /** Node core. */
-    VCITREENODE     Core;
-    /** Number of used nodes. */
-    unsigned        cUsedNodes;
-    /** Array of internal nodes. */
-    VCINODEINTERNAL aIntNodes[VCI_TREE_INTERNAL_NODES_PER_NODE];
-} VCITREENODEINT, *PVCITREENODEINT;
-
-/**
- * A in memory cache extent.
- */
-typedef struct VCICACHEEXTENT
-{
-    /** First block of cached data the extent represents. */
-    uint64_t    u64BlockOffset;
-    /** Number of blocks the extent represents. */
-    uint32_t    u32Blocks;
-    /** First block in the image where the data is stored. */
-    uint64_t    u64BlockAddr;
-} VCICACHEEXTENT, *PVCICACHEEXTENT;
-
-/**
- * A in memory leaf B+-tree node.
- */
-typedef struct VCITREENODELEAF
-{
-    /** Node core. */
-    VCITREENODE             Core;
-    /** Next leaf node in the list. */
-    struct VCITREENODELEAF *pNext;
-    /** Number of used nodes. */
-    unsigned                cUsedNodes;
-    /** The extents in the node. */
-    VCICACHEEXTENT          aExtents[VCI_TREE_EXTENTS_PER_NODE];
-} VCITREENODELEAF, *PVCITREENODELEAF;
+    /** The disk line cached, only valid if fUsed is true. */
+    uint64_t     uLine;
+    /** Bitmap of blocks holding valid data. */
+    uint32_t     au32Valid[4];
+    /** Previous line in the LRU list (towards the most recently used one). */
+    uint32_t     idxLruPrev;
+    /** Next line in the LRU list (towards the least recently used one). */
+    uint32_t     idxLruNext;
+    /** Next line in the hash bucket. */
+    uint32_t     idxHashNext;
+    /** Generation, incremented on every invalidation so that writes which
+     * were in flight don't mark the blocks as valid when they complete. */
+    uint32_t     uGen;
+    /** Number of writes to this line in flight, the line can't be evicted
+     * while this is not 0. */
+    uint32_t     cWritesPending;
+    /** Number of reads from this line in flight, the line can't be evicted
+     * while this is not 0 or the reads would return data of another line. */
+    uint32_t     cReadsPending;
+    /** Flag whether the line is in use. */
+    bool         fUsed;
+} VCICACHELINE;
+/** Pointer to a cache line. */
+typedef VCICACHELINE *PVCICACHELINE;
 
 /**
  * VCI image data structure.
@@ -357,24 +198,73 @@ typedef struct VCICACHE
     /** Total size of the image. */
     uint64_t          cbSize;
 
-    /** Offset of the B+-Tree in the image in bytes. */
-    uint64_t          offTreeRoot;
-    /** Pointer to the root node of the B+-Tree. */
-    PVCITREENODE      pRoot;
-    /** Offset to the block allocation bitmap in bytes. */
-    uint64_t          offBlksBitmap;
-    /** Block map. */
-    PVCIBLKMAP        pBlkMap;
+    /** UUID of the image. */
+    RTUUID            ImageUuid;
+    /** Modification UUID. */
+    RTUUID            ModificationUuid;
+
+    /** Offset of the line table in blocks. */
+    uint64_t          offLineTbl;
+    /** Offset of the first cache line in blocks. */
+    uint64_t          offData;
+    /** Number of blocks per cache line. */
+    uint32_t          cBlocksPerLine;
+    /** Number of cache lines. */
+    uint32_t          cLines;
+    /** Number of blocks the line table occupies. */
+    uint32_t          cBlocksLineTbl;
+    /** The cache lines. */
+    PVCICACHELINE     paLines;
+    /** Hash table of the used lines, indexed by the disk line number. */
+    uint32_t         *paidxHash;
+    /** Mask for the hash table index. */
+    uint32_t          fHashMask;
+    /** Most recently used line. */
+    uint32_t          idxLruHead;
+    /** Least recently used line, the first one to get evicted. */
+    uint32_t          idxLruTail;
+    /** Stack of free lines below cLinesTouched. */
+    uint32_t         *paidxFree;
+    /** Number of entries on the free stack. */
+    uint32_t          cLinesFree;
+    /** Number of lines used at least once, lines above were never written
+     * which keeps dynamic images from growing before they are needed. */
+    uint32_t          cLinesTouched;
+    /** Bitmap of line table blocks which need to be written. */
+    uint32_t         *pbmTblDirty;
+
+    /** Number of reads which could be satisfied from the cache. */
+    uint64_t          cHits;
+    /** Number of reads which missed the cache. */
+    uint64_t          cMisses;
+    /** Number of bytes read from the cache. */
+    uint64_t          cbHit;
+    /** Number of bytes which missed the cache. */
+    uint64_t          cbMiss;
+    /** Number of lines evicted to make room for new data. */
+    uint64_t          cEvictions;
+    /** Number of line invalidations because the data changed. */
+    uint64_t          cInvalidations;
 } VCICACHE, *PVCICACHE;
 
+/**
+ * State for a write into a cache line.
+ */
+typedef struct VCIWRITESTATE
+{
+    /** The line written to. */
+    uint32_t          idxLine;
+    /** Generation of the line when the write started. */
+    uint32_t          uGen;
+    /** First block written. */
+    uint32_t          iBlock;
+    /** Number of blocks written. */
+    uint32_t          cBlocks;
+} VCIWRITESTATE, *PVCIWRITESTATE;
+
 /** No block free in bitmap error code. */
 #define VERR_VCI_NO_BLOCKS_FREE (-65536)
 
-/** Flags for the block map allocator. */
-#define VCIBLKMAP_ALLOC_DATA 0
-#define VCIBLKMAP_ALLOC_META RT_BIT(0)
-#define VCIBLKMAP_ALLOC_MASK 0x1
-
 
 /*********************************************************************************************************************************
 *   Static Variables                                                                                                             *
@@ -393,817 +283,559 @@ static const char *const s_apszVciFileExtensions[] =
 *********************************************************************************************************************************/
 
 /**
- * Internal. Flush image data to disk.
+ * Internal: Marks the line table block containing the given line as dirty.
  */
-static int vciFlushImage(PVCICACHE pCache)
+DECLINLINE(void) vciLineSetDirty(PVCICACHE pCache, uint32_t idxLine)
 {
-    int rc = VINF_SUCCESS;
-
-    if (   pCache->pStorage
-        && !(pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY))
-    {
-        rc = vdIfIoIntFileFlushSync(pCache->pIfIo, pCache->pStorage);
-    }
+    ASMBitSet(pCache->pbmTblDirty, idxLine / VCI_LINE_ENTS_PER_BLOCK);
+}
 
-    return rc;
+/**
+ * Internal: Returns whether the line doesn't hold any valid data.
+ */
+DECLINLINE(bool) vciLineIsEmpty(PVCICACHELINE pLine)
+{
+    return !(pLine->au32Valid[0] | pLine->au32Valid[1] | pLine->au32Valid[2] | pLine->au32Valid[3]);
 }
 
 /**
- * Internal. Free all allocated space for representing an image except pCache,
- * and optionally delete the image from disk.
+ * Internal: Looks up the cache line for the given disk line.
+ *
+ * @returns Index of the cache line or VCI_LINE_NIL if not cached.
  */
-static int vciFreeImage(PVCICACHE pCache, bool fDelete)
+static uint32_t vciLineLookup(PVCICACHE pCache, uint64_t uLine)
 {
-    int rc = VINF_SUCCESS;
+    uint32_t idxLine = pCache->paidxHash[uLine & pCache->fHashMask];
 
-    /* Freeing a never allocated image (e.g. because the open failed) is
-     * not signalled as an error. After all nothing bad happens. */
-    if (pCache)
-    {
-        if (pCache->pStorage)
-        {
-            /* No point updating the file that is deleted anyway. */
-            if (!fDelete)
-                vciFlushImage(pCache);
+    while (   idxLine != VCI_LINE_NIL
+           && pCache->paLines[idxLine].uLine != uLine)
+        idxLine = pCache->paLines[idxLine].idxHashNext;
 
-            vdIfIoIntFileClose(pCache->pIfIo, pCache->pStorage);
-            pCache->pStorage = NULL;
-        }
+    return idxLine;
+}
 
-        if (fDelete && pCache->pszFilename)
-            vdIfIoIntFileDelete(pCache->pIfIo, pCache->pszFilename);
+/**
+ * Internal: Removes the given line from its hash bucket.
+ */
+static void vciLineHashRemove(PVCICACHE pCache, uint32_t idxLine)
+{
+    uint32_t *pidxCur = &pCache->paidxHash[pCache->paLines[idxLine].uLine & pCache->fHashMask];
+
+    while (*pidxCur != idxLine)
+    {
+        Assert(*pidxCur != VCI_LINE_NIL);
+        pidxCur = &pCache->paLines[*pidxCur].idxHashNext;
     }
 
-    LogFlowFunc(("returns %Rrc\n", rc));
-    return rc;
+    *pidxCur = pCache->paLines[idxLine].idxHashNext;
+    pCache->paLines[idxLine].idxHashNext = VCI_LINE_NIL;
 }
 
 /**
- * Creates a new block map which can manage the given number of blocks.
- *
- * The size of the bitmap is aligned to the VCI block size.
- *
- * @returns VBox status code.
- * @param   cBlocks      The number of blocks the bitmap can manage.
- * @param   ppBlkMap     Where to store the pointer to the block bitmap.
- * @param   pcBlkMap     Where to store the size of the block bitmap in blocks
- *                       needed on the disk.
+ * Internal: Unlinks the given line from the LRU list.
  */
-static int vciBlkMapCreate(uint64_t cBlocks, PVCIBLKMAP *ppBlkMap, uint32_t *pcBlkMap)
+static void vciLineLruUnlink(PVCICACHE pCache, uint32_t idxLine)
 {
-    int rc = VINF_SUCCESS;
-    uint32_t cbBlkMap = RT_ALIGN_Z(cBlocks / sizeof(VciBlkMapEnt) / 8, VCI_BLOCK_SIZE);
-    PVCIBLKMAP pBlkMap = (PVCIBLKMAP)RTMemAllocZ(sizeof(VCIBLKMAP));
-    PVCIBLKRANGEDESC pFree   = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
-
-    LogFlowFunc(("cBlocks=%u ppBlkMap=%#p pcBlkMap=%#p\n", cBlocks, ppBlkMap, pcBlkMap));
+    PVCICACHELINE pLine = &pCache->paLines[idxLine];
 
-    if (pBlkMap && pFree)
-    {
-        pBlkMap->cBlocks          = cBlocks;
-        pBlkMap->cBlocksAllocMeta = 0;
-        pBlkMap->cBlocksAllocData = 0;
-        pBlkMap->cBlocksFree      = cBlocks;
-
-        pFree->pPrev = NULL;
-        pFree->pNext = NULL;
-        pFree->offAddrStart = 0;
-        pFree->cBlocks      = cBlocks;
-        pFree->fFree        = true;
-
-        pBlkMap->pRangesHead = pFree;
-        pBlkMap->pRangesTail = pFree;
-
-        Assert(!((cbBlkMap + sizeof(VciBlkMap)) % VCI_BLOCK_SIZE));
-        *ppBlkMap = pBlkMap;
-        *pcBlkMap = VCI_BYTE2BLOCK(cbBlkMap + sizeof(VciBlkMap));
-    }
+    if (pLine->idxLruPrev != VCI_LINE_NIL)
+        pCache->paLines[pLine->idxLruPrev].idxLruNext = pLine->idxLruNext;
     else
-    {
-        if (pBlkMap)
-            RTMemFree(pBlkMap);
-        if (pFree)
-            RTMemFree(pFree);
+        pCache->idxLruHead = pLine->idxLruNext;
 
-        rc = VERR_NO_MEMORY;
-    }
+    if (pLine->idxLruNext != VCI_LINE_NIL)
+        pCache->paLines[pLine->idxLruNext].idxLruPrev = pLine->idxLruPrev;
+    else
+        pCache->idxLruTail = pLine->idxLruPrev;
 
-    LogFlowFunc(("returns rc=%Rrc cBlkMap=%u\n", rc, *pcBlkMap));
-    return rc;
+    pLine->idxLruPrev = VCI_LINE_NIL;
+    pLine->idxLruNext = VCI_LINE_NIL;
 }
 
-#if 0 /** @todo unsued vciBlkMapDestroy */
 /**
- * Frees a block map.
- *
- * @returns nothing.
- * @param   pBlkMap         The block bitmap to destroy.
+ * Internal: Inserts the given line at the head of the LRU list.
  */
-static void vciBlkMapDestroy(PVCIBLKMAP pBlkMap)
+static void vciLineLruInsertHead(PVCICACHE pCache, uint32_t idxLine)
 {
-    LogFlowFunc(("pBlkMap=%#p\n", pBlkMap));
+    PVCICACHELINE pLine = &pCache->paLines[idxLine];
 
-    PVCIBLKRANGEDESC pRangeCur = pBlkMap->pRangesHead;
+    pLine->idxLruPrev = VCI_LINE_NIL;
+    pLine->idxLruNext = pCache->idxLruHead;
+    if (pCache->idxLruHead != VCI_LINE_NIL)
+        pCache->paLines[pCache->idxLruHead].idxLruPrev = idxLine;
+    else
+        pCache->idxLruTail = idxLine;
+    pCache->idxLruHead = idxLine;
+}
 
-    while (pRangeCur)
+/**
+ * Internal: Makes the given line the most recently used one.
+ */
+static void vciLineTouch(PVCICACHE pCache, uint32_t idxLine)
+{
+    if (pCache->idxLruHead != idxLine)
     {
-        PVCIBLKRANGEDESC pTmp = pRangeCur;
+        vciLineLruUnlink(pCache, idxLine);
+        vciLineLruInsertHead(pCache, idxLine);
+    }
+}
 
-        RTMemFree(pTmp);
+/**
+ * Internal: Assigns a free line to the given disk line.
+ */
+static void vciLineAssign(PVCICACHE pCache, uint32_t idxLine, uint64_t uLine)
+{
+    PVCICACHELINE pLine = &pCache->paLines[idxLine];
+
+    Assert(!pLine->fUsed);
+    pLine->fUsed       = true;
+    pLine->uLine       = uLine;
+    pLine->idxHashNext = pCache->paidxHash[uLine & pCache->fHashMask];
+    pCache->paidxHash[uLine & pCache->fHashMask] = idxLine;
+    vciLineLruInsertHead(pCache, idxLine);
+    vciLineSetDirty(pCache, idxLine);
+}
 
-        pRangeCur = pRangeCur->pNext;
-    }
+/**
+ * Internal: Releases the given line, removing it from all lists.
+ *
+ * @param   pCache       The cache.
+ * @param   idxLine      The line to release.
+ * @param   fFreeStack   Flag whether to put the line onto the free stack.
+ */
+static void vciLineRelease(PVCICACHE pCache, uint32_t idxLine, bool fFreeStack)
+{
+    PVCICACHELINE pLine = &pCache->paLines[idxLine];
+
+    Assert(pLine->fUsed);
+    Assert(!pLine->cWritesPending);
+    Assert(!pLine->cReadsPending);
 
-    RTMemFree(pBlkMap);
+    vciLineHashRemove(pCache, idxLine);
+    vciLineLruUnlink(pCache, idxLine);
+    RT_ZERO(pLine->au32Valid);
+    pLine->fUsed = false;
+    pLine->uGen++;
+    vciLineSetDirty(pCache, idxLine);
 
-    LogFlowFunc(("returns\n"));
+    if (fFreeStack)
+        pCache->paidxFree[pCache->cLinesFree++] = idxLine;
 }
-#endif
 
 /**
- * Loads the block map from the specified medium and creates all necessary
- * in memory structures to manage used and free blocks.
+ * Internal: Allocates a cache line for the given disk line, evicting the least
+ * recently used line if the cache is full.
  *
- * @returns VBox status code.
- * @param   pStorage        Storage handle to read the block bitmap from.
- * @param   offBlkMap       Start of the block bitmap in blocks.
- * @param   cBlkMap         Size of the block bitmap on the disk in blocks.
- * @param   ppBlkMap        Where to store the block bitmap on success.
+ * @returns Index of the line or VCI_LINE_NIL if all lines are busy.
  */
-static int vciBlkMapLoad(PVCICACHE pStorage, uint64_t offBlkMap, uint32_t cBlkMap, PVCIBLKMAP *ppBlkMap)
+static uint32_t vciLineAlloc(PVCICACHE pCache, uint64_t uLine)
 {
-    int rc = VINF_SUCCESS;
-    VciBlkMap BlkMap;
+    uint32_t idxLine = VCI_LINE_NIL;
 
-    LogFlowFunc(("pStorage=%#p offBlkMap=%llu cBlkMap=%u ppBlkMap=%#p\n",
-                 pStorage, offBlkMap, cBlkMap, ppBlkMap));
-
-    if (cBlkMap >= VCI_BYTE2BLOCK(sizeof(VciBlkMap)))
+    if (pCache->cLinesFree)
+        idxLine = pCache->paidxFree[--pCache->cLinesFree];
+    else if (pCache->cLinesTouched < pCache->cLines)
+        idxLine = pCache->cLinesTouched++;
+    else
     {
-        cBlkMap -= VCI_BYTE2BLOCK(sizeof(VciBlkMap));
+        /*
+         * Evict from the tail of the LRU list, lines with reads or writes
+         * in flight are skipped.
+         */
+        idxLine = pCache->idxLruTail;
+        while (   idxLine != VCI_LINE_NIL
+               && (   pCache->paLines[idxLine].cWritesPending
+                   || pCache->paLines[idxLine].cReadsPending))
+            idxLine = pCache->paLines[idxLine].idxLruPrev;
 
-        rc = vdIfIoIntFileReadSync(pStorage->pIfIo, pStorage->pStorage, offBlkMap,
-                                   &BlkMap, VCI_BYTE2BLOCK(sizeof(VciBlkMap)));
-        if (RT_SUCCESS(rc))
+        if (idxLine != VCI_LINE_NIL)
         {
-            offBlkMap += VCI_BYTE2BLOCK(sizeof(VciBlkMap));
-
-            BlkMap.u32Magic         = RT_LE2H_U32(BlkMap.u32Magic);
-            BlkMap.u32Version       = RT_LE2H_U32(BlkMap.u32Version);
-            BlkMap.cBlocks          = RT_LE2H_U32(BlkMap.cBlocks);
-            BlkMap.cBlocksFree      = RT_LE2H_U32(BlkMap.cBlocksFree);
-            BlkMap.cBlocksAllocMeta = RT_LE2H_U32(BlkMap.cBlocksAllocMeta);
-            BlkMap.cBlocksAllocData = RT_LE2H_U32(BlkMap.cBlocksAllocData);
-
-            if (   BlkMap.u32Magic == VCI_BLKMAP_MAGIC
-                && BlkMap.u32Version == VCI_BLKMAP_VERSION
-                && BlkMap.cBlocks == BlkMap.cBlocksFree + BlkMap.cBlocksAllocMeta + BlkMap.cBlocksAllocData
-                && VCI_BYTE2BLOCK(BlkMap.cBlocks / 8) == cBlkMap)
-            {
-                PVCIBLKMAP pBlkMap = (PVCIBLKMAP)RTMemAllocZ(sizeof(VCIBLKMAP));
-                if (pBlkMap)
-                {
-                    pBlkMap->cBlocks          = BlkMap.cBlocks;
-                    pBlkMap->cBlocksFree      = BlkMap.cBlocksFree;
-                    pBlkMap->cBlocksAllocMeta = BlkMap.cBlocksAllocMeta;
-                    pBlkMap->cBlocksAllocData = BlkMap.cBlocksAllocData;
-
-                    /* Load the bitmap and construct the range list. */
-                    PVCIBLKRANGEDESC pRangeCur = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
-
-                    if (pRangeCur)
-                    {
-                        uint8_t abBitmapBuffer[16 * _1K];
-                        uint32_t cBlocksRead = 0;
-                        uint64_t cBlocksLeft = VCI_BYTE2BLOCK(pBlkMap->cBlocks / 8);
-
-                        cBlocksRead = RT_MIN(VCI_BYTE2BLOCK(sizeof(abBitmapBuffer)), cBlocksLeft);
-                        rc = vdIfIoIntFileReadSync(pStorage->pIfIo, pStorage->pStorage,
-                                                   offBlkMap, abBitmapBuffer,
-                                                   cBlocksRead);
-
-                        if (RT_SUCCESS(rc))
-                        {
-                            pRangeCur->fFree        = !(abBitmapBuffer[0] & 0x01);
-                            pRangeCur->offAddrStart = 0;
-                            pRangeCur->cBlocks      = 0;
-                            pRangeCur->pNext        = NULL;
-                            pRangeCur->pPrev        = NULL;
-                            pBlkMap->pRangesHead = pRangeCur;
-                            pBlkMap->pRangesTail = pRangeCur;
-                        }
-                        else
-                            RTMemFree(pRangeCur);
-
-                        while (   RT_SUCCESS(rc)
-                               && cBlocksLeft)
-                        {
-                            int iBit = 0;
-                            uint32_t cBits = VCI_BLOCK2BYTE(cBlocksRead) * 8;
-                            uint32_t iBitPrev = 0xffffffff;
-
-                            while (cBits)
-                            {
-                                if (pRangeCur->fFree)
-                                {
-                                    /* Check for the first set bit. */
-                                    iBit = ASMBitNextSet(abBitmapBuffer, cBits, iBitPrev);
-                                }
-                                else
-                                {
-                                    /* Check for the first free bit. */
-                                    iBit = ASMBitNextClear(abBitmapBuffer, cBits, iBitPrev);
-                                }
-
-                                if (iBit == -1)
-                                {
-                                    /* No change. */
-                                    pRangeCur->cBlocks += cBits;
-                                    cBits = 0;
-                                }
-                                else
-                                {
-                                    Assert((uint32_t)iBit < cBits);
-                                    pRangeCur->cBlocks += iBit;
-
-                                    /* Create a new range descriptor. */
-                                    PVCIBLKRANGEDESC pRangeNew = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
-                                    if (!pRangeNew)
-                                    {
-                                        rc = VERR_NO_MEMORY;
-                                        break;
-                                    }
-
-                                    pRangeNew->fFree = !pRangeCur->fFree;
-                                    pRangeNew->offAddrStart = pRangeCur->offAddrStart + pRangeCur->cBlocks;
-                                    pRangeNew->cBlocks = 0;
-                                    pRangeNew->pPrev = pRangeCur;
-                                    pRangeCur->pNext = pRangeNew;
-                                    pBlkMap->pRangesTail = pRangeNew;
-                                    pRangeCur = pRangeNew;
-                                    cBits -= iBit;
-                                    iBitPrev = iBit;
-                                }
-                            }
-
-                            cBlocksLeft -= cBlocksRead;
-                            offBlkMap   += cBlocksRead;
-
-                            if (   RT_SUCCESS(rc)
-                                && cBlocksLeft)
-                            {
-                                /* Read next chunk. */
-                                cBlocksRead = RT_MIN(VCI_BYTE2BLOCK(sizeof(abBitmapBuffer)), cBlocksLeft);
-                                rc = vdIfIoIntFileReadSync(pStorage->pIfIo, pStorage->pStorage,
-                                                           offBlkMap, abBitmapBuffer, cBlocksRead);
-                            }
-                        }
-                    }
-                    else
-                        rc = VERR_NO_MEMORY;
-
-                    if (RT_SUCCESS(rc))
-                    {
-                        *ppBlkMap = pBlkMap;
-                        LogFlowFunc(("return success\n"));
-                        return VINF_SUCCESS;
-                    }
-
-                    RTMemFree(pBlkMap);
-                }
-                else
-                    rc = VERR_NO_MEMORY;
-            }
-            else
-                rc = VERR_VD_GEN_INVALID_HEADER;
+            vciLineRelease(pCache, idxLine, false /* fFreeStack */);
+            pCache->cEvictions++;
         }
-        else
-            rc = VERR_VD_GEN_INVALID_HEADER;
     }
-    else
-        rc = VERR_VD_GEN_INVALID_HEADER;
 
-    LogFlowFunc(("returns rc=%Rrc\n", rc));
-    return rc;
+    if (idxLine != VCI_LINE_NIL)
+        vciLineAssign(pCache, idxLine, uLine);
+
+    return idxLine;
 }
 
 /**
- * Saves the block map in the cache image. All necessary on disk structures
- * are written.
- *
- * @returns VBox status code.
- * @param   pBlkMap         The block bitmap to save.
- * @param   pStorage        Where the block bitmap should be written to.
- * @param   offBlkMap       Start of the block bitmap in blocks.
- * @param   cBlkMap         Size of the block bitmap on the disk in blocks.
+ * Internal: Finishes a write into a cache line, marking the written blocks as
+ * valid if the line wasn't invalidated in the meantime.
  */
-static int vciBlkMapSave(PVCIBLKMAP pBlkMap, PVCICACHE pStorage, uint64_t offBlkMap, uint32_t cBlkMap)
+static void vciLineWriteFinish(PVCICACHE pCache, PVCIWRITESTATE pWrite, bool fSuccess)
 {
-    int rc = VINF_SUCCESS;
-    VciBlkMap BlkMap;
+    PVCICACHELINE pLine = &pCache->paLines[pWrite->idxLine];
 
-    LogFlowFunc(("pBlkMap=%#p pStorage=%#p offBlkMap=%llu cBlkMap=%u\n",
-                 pBlkMap, pStorage, offBlkMap, cBlkMap));
+    Assert(pLine->cWritesPending > 0);
+    pLine->cWritesPending--;
 
-    /* Make sure the number of blocks allocated for us match our expectations. */
-    if (VCI_BYTE2BLOCK(pBlkMap->cBlocks / 8) + VCI_BYTE2BLOCK(sizeof(VciBlkMap)) == cBlkMap)
+    if (   fSuccess
+        && pLine->fUsed
+        && pLine->uGen == pWrite->uGen)
     {
-        /* Setup the header */
-        memset(&BlkMap, 0, sizeof(VciBlkMap));
-
-        BlkMap.u32Magic         = RT_H2LE_U32(VCI_BLKMAP_MAGIC);
-        BlkMap.u32Version       = RT_H2LE_U32(VCI_BLKMAP_VERSION);
-        BlkMap.cBlocks          = RT_H2LE_U32(pBlkMap->cBlocks);
-        BlkMap.cBlocksFree      = RT_H2LE_U32(pBlkMap->cBlocksFree);
-        BlkMap.cBlocksAllocMeta = RT_H2LE_U32(pBlkMap->cBlocksAllocMeta);
-        BlkMap.cBlocksAllocData = RT_H2LE_U32(pBlkMap->cBlocksAllocData);
-
-        rc = vdIfIoIntFileWriteSync(pStorage->pIfIo, pStorage->pStorage, offBlkMap,
-                                    &BlkMap, VCI_BYTE2BLOCK(sizeof(VciBlkMap)));
-        if (RT_SUCCESS(rc))
-        {
-            uint8_t abBitmapBuffer[16*_1K];
-            unsigned iBit = 0;
-            PVCIBLKRANGEDESC pCur = pBlkMap->pRangesHead;
+        ASMBitSetRange(&pLine->au32Valid[0], pWrite->iBlock, pWrite->iBlock + pWrite->cBlocks);
+        vciLineSetDirty(pCache, pWrite->idxLine);
+    }
+    else if (   pLine->fUsed
+             && !pLine->cWritesPending
+             && !pLine->cReadsPending
+             && vciLineIsEmpty(pLine))
+        vciLineRelease(pCache, pWrite->idxLine, true /* fFreeStack */);
+}
 
-            offBlkMap += VCI_BYTE2BLOCK(sizeof(VciBlkMap));
+/**
+ * Internal: Finishes a read from a cache line, releasing the line if it was
+ * invalidated completely while the read was in flight.
+ */
+static void vciLineReadFinish(PVCICACHE pCache, uint32_t idxLine)
+{
+    PVCICACHELINE pLine = &pCache->paLines[idxLine];
 
-            /* Write the descriptor ranges. */
-            while (pCur)
-            {
-                uint64_t cBlocks = pCur->cBlocks;
+    Assert(pLine->cReadsPending > 0);
+    pLine->cReadsPending--;
 
-                while (cBlocks)
-                {
-                    uint64_t cBlocksMax = RT_MIN(cBlocks, sizeof(abBitmapBuffer) * 8 - iBit);
-
-                    if (pCur->fFree)
-                        ASMBitClearRange(abBitmapBuffer, iBit, iBit + cBlocksMax);
-                    else
-                        ASMBitSetRange(abBitmapBuffer, iBit, iBit + cBlocksMax);
-
-                    iBit    += cBlocksMax;
-                    cBlocks -= cBlocksMax;
-
-                    if (iBit == sizeof(abBitmapBuffer) * 8)
-                    {
-                        /* Buffer is full, write to file and reset. */
-                        rc = vdIfIoIntFileWriteSync(pStorage->pIfIo, pStorage->pStorage,
-                                                    offBlkMap, abBitmapBuffer,
-                                                    VCI_BYTE2BLOCK(sizeof(abBitmapBuffer)));
-                        if (RT_FAILURE(rc))
-                            break;
-
-                        offBlkMap += VCI_BYTE2BLOCK(sizeof(abBitmapBuffer));
-                        iBit = 0;
-                    }
-                }
+    if (   pLine->fUsed
+        && !pLine->cWritesPending
+        && !pLine->cReadsPending
+        && vciLineIsEmpty(pLine))
+        vciLineRelease(pCache, idxLine, true /* fFreeStack */);
+}
 
-                pCur = pCur->pNext;
-            }
+/**
+ * Internal: Write completion callback for cache line writes.
+ */
+static DECLCALLBACK(int) vciWriteComplete(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    RT_NOREF1(pIoCtx);
+    PVCICACHE pCache = (PVCICACHE)pBackendData;
+    PVCIWRITESTATE pWrite = (PVCIWRITESTATE)pvUser;
 
-            Assert(iBit % 8 == 0);
+    vciLineWriteFinish(pCache, pWrite, RT_SUCCESS(rcReq));
+    RTMemFree(pWrite);
+    return VINF_SUCCESS;
+}
 
-            if (RT_SUCCESS(rc) && iBit)
-                rc = vdIfIoIntFileWriteSync(pStorage->pIfIo, pStorage->pStorage,
-                                            offBlkMap, abBitmapBuffer, VCI_BYTE2BLOCK(iBit / 8));
-        }
-    }
-    else
-        rc = VERR_INTERNAL_ERROR; /** @todo Better error code. */
+/**
+ * Internal: Read completion callback for cache line reads.
+ */
+static DECLCALLBACK(int) vciReadComplete(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    RT_NOREF2(pIoCtx, rcReq);
+    PVCICACHE pCache = (PVCICACHE)pBackendData;
 
-    LogFlowFunc(("returns rc=%Rrc\n", rc));
-    return rc;
+    vciLineReadFinish(pCache, (uint32_t)(uintptr_t)pvUser);
+    return VINF_SUCCESS;
 }
 
-#if 0 /* unused */
 /**
- * Finds the range block describing the given block address.
- *
- * @returns Pointer to the block range descriptor or NULL if none could be found.
- * @param   pBlkMap         The block bitmap to search on.
- * @param   offBlockAddr    The block address to search for.
+ * Internal: Allocates the in memory structures for the cache lines.
  */
-static PVCIBLKRANGEDESC vciBlkMapFindByBlock(PVCIBLKMAP pBlkMap, uint64_t offBlockAddr)
+static int vciLinesCreate(PVCICACHE pCache)
 {
-    PVCIBLKRANGEDESC pBlk = pBlkMap->pRangesHead;
+    uint32_t cHash = RT_BIT_32(ASMBitLastSetU32(pCache->cLines));
+    uint32_t cbDirty = RT_ALIGN_32(pCache->cBlocksLineTbl, 32) / 8;
+
+    pCache->paLines     = (PVCICACHELINE)RTMemAllocZ(pCache->cLines * sizeof(VCICACHELINE));
+    pCache->paidxHash   = (uint32_t *)RTMemAlloc(cHash * sizeof(uint32_t));
+    pCache->paidxFree   = (uint32_t *)RTMemAlloc(pCache->cLines * sizeof(uint32_t));
+    pCache->pbmTblDirty = (uint32_t *)RTMemAllocZ(cbDirty);
+    if (   !pCache->paLines
+        || !pCache->paidxHash
+        || !pCache->paidxFree
+        || !pCache->pbmTblDirty)
+        return VERR_NO_MEMORY;
+
+    for (uint32_t i = 0; i < cHash; i++)
+        pCache->paidxHash[i] = VCI_LINE_NIL;
+    for (uint32_t i = 0; i < pCache->cLines; i++)
+    {
+        pCache->paLines[i].idxLruPrev  = VCI_LINE_NIL;
+        pCache->paLines[i].idxLruNext  = VCI_LINE_NIL;
+        pCache->paLines[i].idxHashNext = VCI_LINE_NIL;
+    }
 
-    while (   pBlk
-           && pBlk->offAddrStart < offBlockAddr)
-        pBlk = pBlk->pNext;
+    pCache->fHashMask     = cHash - 1;
+    pCache->idxLruHead    = VCI_LINE_NIL;
+    pCache->idxLruTail    = VCI_LINE_NIL;
+    pCache->cLinesFree    = 0;
+    pCache->cLinesTouched = 0;
+    return VINF_SUCCESS;
+}
 
-    return pBlk;
+/**
+ * Internal: Frees the in memory structures for the cache lines.
+ */
+static void vciLinesDestroy(PVCICACHE pCache)
+{
+    RTMemFree(pCache->paLines);
+    RTMemFree(pCache->paidxHash);
+    RTMemFree(pCache->paidxFree);
+    RTMemFree(pCache->pbmTblDirty);
+    pCache->paLines     = NULL;
+    pCache->paidxHash   = NULL;
+    pCache->paidxFree   = NULL;
+    pCache->pbmTblDirty = NULL;
 }
-#endif
 
 /**
- * Allocates the given number of blocks in the bitmap and returns the start block address.
- *
- * @returns VBox status code.
- * @param   pBlkMap          The block bitmap to allocate the blocks from.
- * @param   cBlocks          How many blocks to allocate.
- * @param   fFlags           Allocation flags, comgination of VCIBLKMAP_ALLOC_*.
- * @param   poffBlockAddr    Where to store the start address of the allocated region.
+ * Internal: Writes all dirty blocks of the line table.
  */
-static int vciBlkMapAllocate(PVCIBLKMAP pBlkMap, uint32_t cBlocks, uint32_t fFlags,
-                             uint64_t *poffBlockAddr)
+static int vciLineTblWrite(PVCICACHE pCache)
 {
-    PVCIBLKRANGEDESC pBestFit = NULL;
-    PVCIBLKRANGEDESC pCur = NULL;
     int rc = VINF_SUCCESS;
+    int iBlock = ASMBitFirstSet(pCache->pbmTblDirty, RT_ALIGN_32(pCache->cBlocksLineTbl, 32));
 
-    LogFlowFunc(("pBlkMap=%#p cBlocks=%u poffBlockAddr=%#p\n",
-                 pBlkMap, cBlocks, poffBlockAddr));
-
-    pCur = pBlkMap->pRangesHead;
-
-    while (pCur)
-    {
-        if (   pCur->fFree
-            && pCur->cBlocks >= cBlocks)
-        {
-            if (   !pBestFit
-                || pCur->cBlocks < pBestFit->cBlocks)
-            {
-                pBestFit = pCur;
-                /* Stop searching if the size is matching exactly. */
-                if (pBestFit->cBlocks == cBlocks)
-                    break;
-            }
-        }
-        pCur = pCur->pNext;
-    }
-
-    Assert(!pBestFit || pBestFit->fFree);
-
-    if (pBestFit)
+    while (   iBlock != -1
+           && RT_SUCCESS(rc))
     {
-        pBestFit->fFree = false;
+        VciLineEnt aEnts[VCI_LINE_ENTS_PER_BLOCK];
+        uint32_t idxLine = (uint32_t)iBlock * VCI_LINE_ENTS_PER_BLOCK;
 
-        if (pBestFit->cBlocks > cBlocks)
+        RT_ZERO(aEnts);
+        for (unsigned i = 0; i < RT_ELEMENTS(aEnts) && idxLine + i < pCache->cLines; i++)
         {
-            /* Create a new free block. */
-            PVCIBLKRANGEDESC pFree = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
+            PVCICACHELINE pLine = &pCache->paLines[idxLine + i];
 
-            if (pFree)
+            if (   pLine->fUsed
+                && !vciLineIsEmpty(pLine))
             {
-                pFree->fFree = true;
-                pFree->cBlocks = pBestFit->cBlocks - cBlocks;
-                pBestFit->cBlocks -= pFree->cBlocks;
-                pFree->offAddrStart = pBestFit->offAddrStart + cBlocks;
-
-                /* Link into the list. */
-                pFree->pNext = pBestFit->pNext;
-                pBestFit->pNext = pFree;
-                pFree->pPrev    = pBestFit;
-                if (!pFree->pNext)
-                    pBlkMap->pRangesTail = pFree;
-
-                *poffBlockAddr = pBestFit->offAddrStart;
-            }
-            else
-            {
-                rc = VERR_NO_MEMORY;
-                pBestFit->fFree = true;
+                aEnts[i].u64Line = RT_H2LE_U64(pLine->uLine + 1);
+                for (unsigned j = 0; j < RT_ELEMENTS(aEnts[i].au32Valid); j++)
+                    aEnts[i].au32Valid[j] = RT_H2LE_U32(pLine->au32Valid[j]);
             }
         }
-    }
-    else
-        rc = VERR_VCI_NO_BLOCKS_FREE;
-
-    if (RT_SUCCESS(rc))
-    {
-        if ((fFlags & VCIBLKMAP_ALLOC_MASK) == VCIBLKMAP_ALLOC_DATA)
-            pBlkMap->cBlocksAllocMeta += cBlocks;
-        else
-            pBlkMap->cBlocksAllocData += cBlocks;
 
-        pBlkMap->cBlocksFree -= cBlocks;
+        rc = vdIfIoIntFileWriteSync(pCache->pIfIo, pCache->pStorage,
+                                    VCI_BLOCK2BYTE(pCache->offLineTbl + iBlock),
+                                    &aEnts[0], sizeof(aEnts));
+        if (RT_SUCCESS(rc))
+        {
+            ASMBitClear(pCache->pbmTblDirty, iBlock);
+            iBlock = ASMBitNextSet(pCache->pbmTblDirty, RT_ALIGN_32(pCache->cBlocksLineTbl, 32), iBlock);
+        }
     }
 
-    LogFlowFunc(("returns rc=%Rrc offBlockAddr=%llu\n", rc, *poffBlockAddr));
     return rc;
 }
 
-#if 0 /* unused */
 /**
- * Try to extend the space of an already allocated block.
+ * Internal: Loads the line table, rebuilding the in memory lists.
  *
  * @returns VBox status code.
- * @param   pBlkMap          The block bitmap to allocate the blocks from.
- * @param   cBlocksNew       How many blocks the extended block should have.
- * @param   offBlockAddrOld  The start address of the block to reallocate.
- * @param   poffBlockAddr    Where to store the start address of the allocated region.
+ * @param   pCache    The cache.
+ * @param   fReset    Flag whether to discard the content, used after an unclean
+ *                    shutdown where the table might not match the data.
  */
-static int vciBlkMapRealloc(PVCIBLKMAP pBlkMap, uint32_t cBlocksNew, uint64_t offBlockAddrOld,
-                            uint64_t *poffBlockAddr)
+static int vciLineTblLoad(PVCICACHE pCache, bool fReset)
 {
     int rc = VINF_SUCCESS;
 
-    LogFlowFunc(("pBlkMap=%#p cBlocksNew=%u offBlockAddrOld=%llu poffBlockAddr=%#p\n",
-                 pBlkMap, cBlocksNew, offBlockAddrOld, poffBlockAddr));
+    if (fReset)
+    {
+        /* Everything is free, write the whole table on the next flush. */
+        ASMBitSetRange(pCache->pbmTblDirty, 0, pCache->cBlocksLineTbl);
+        return VINF_SUCCESS;
+    }
 
-    AssertMsgFailed(("Implement\n"));
-    RT_NOREF4(pBlkMap, cBlocksNew, offBlockAddrOld, poffBlockAddr);
+    uint32_t cEntsChunk = _64K / sizeof(VciLineEnt);
+    PVciLineEnt paEnts = (PVciLineEnt)RTMemAlloc(cEntsChunk * sizeof(VciLineEnt));
+    if (!paEnts)
+        return VERR_NO_MEMORY;
 
-    LogFlowFunc(("returns rc=%Rrc offBlockAddr=%llu\n", rc, *poffBlockAddr));
-    return rc;
-}
-#endif /* unused */
+    for (uint32_t idxStart = 0; idxStart < pCache->cLines && RT_SUCCESS(rc); idxStart += cEntsChunk)
+    {
+        uint32_t cEnts = RT_MIN(cEntsChunk, pCache->cLines - idxStart);
+        size_t cbRead = RT_ALIGN_Z(cEnts * sizeof(VciLineEnt), VCI_BLOCK_SIZE);
 
-#if 0 /* unused */
-/**
- * Frees a range of blocks.
- *
- * @returns nothing.
- * @param   pBlkMap          The block bitmap.
- * @param   offBlockAddr     Address of the first block to free.
- * @param   cBlocks          How many blocks to free.
- * @param   fFlags           Allocation flags, comgination of VCIBLKMAP_ALLOC_*.
- */
-static void vciBlkMapFree(PVCIBLKMAP pBlkMap, uint64_t offBlockAddr, uint32_t cBlocks,
-                          uint32_t fFlags)
-{
-    PVCIBLKRANGEDESC pBlk;
+        rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage,
+                                   VCI_BLOCK2BYTE(pCache->offLineTbl) + idxStart * sizeof(VciLineEnt),
+                                   paEnts, cbRead);
+        if (RT_FAILURE(rc))
+            break;
 
-    LogFlowFunc(("pBlkMap=%#p offBlockAddr=%llu cBlocks=%u\n",
-                 pBlkMap, offBlockAddr, cBlocks));
+        for (uint32_t i = 0; i < cEnts; i++)
+        {
+            uint32_t idxLine = idxStart + i;
+            uint64_t u64Line = RT_LE2H_U64(paEnts[i].u64Line);
+            PVCICACHELINE pLine = &pCache->paLines[idxLine];
 
-    while (cBlocks)
-    {
-        pBlk = vciBlkMapFindByBlock(pBlkMap, offBlockAddr);
-        AssertPtr(pBlk);
+            if (!u64Line)
+                continue;
 
-        /* Easy case, the whole block is freed. */
-        if (   pBlk->offAddrStart == offBlockAddr
-            && pBlk->cBlocks <= cBlocks)
-        {
-            pBlk->fFree = true;
-            cBlocks      -= pBlk->cBlocks;
-            offBlockAddr += pBlk->cBlocks;
+            for (unsigned j = 0; j < RT_ELEMENTS(pLine->au32Valid); j++)
+                pLine->au32Valid[j] = RT_LE2H_U32(paEnts[i].au32Valid[j]);
+            if (pCache->cBlocksPerLine < VCI_LINE_BLOCKS_MAX)
+                ASMBitClearRange(&pLine->au32Valid[0], pCache->cBlocksPerLine, VCI_LINE_BLOCKS_MAX);
 
-            /* Check if it is possible to merge free blocks. */
-            if (   pBlk->pPrev
-                && pBlk->pPrev->fFree)
+            /* Drop empty lines and duplicates. */
+            if (   vciLineIsEmpty(pLine)
+                || vciLineLookup(pCache, u64Line - 1) != VCI_LINE_NIL)
             {
-                PVCIBLKRANGEDESC pBlkPrev = pBlk->pPrev;
-
-                Assert(pBlkPrev->offAddrStart + pBlkPrev->cBlocks == pBlk->offAddrStart);
-                pBlkPrev->cBlocks += pBlk->cBlocks;
-                pBlkPrev->pNext = pBlk->pNext;
-                if (pBlk->pNext)
-                    pBlk->pNext->pPrev = pBlkPrev;
-                else
-                    pBlkMap->pRangesTail = pBlkPrev;
-
-                RTMemFree(pBlk);
-                pBlk = pBlkPrev;
+                RT_ZERO(pLine->au32Valid);
+                vciLineSetDirty(pCache, idxLine);
+                continue;
             }
 
-            /* Now the one to the right. */
-            if (   pBlk->pNext
-                && pBlk->pNext->fFree)
-            {
-                PVCIBLKRANGEDESC pBlkNext = pBlk->pNext;
-
-                Assert(pBlk->offAddrStart + pBlk->cBlocks == pBlkNext->offAddrStart);
-                pBlk->cBlocks += pBlkNext->cBlocks;
-                pBlk->pNext = pBlkNext->pNext;
-                if (pBlkNext->pNext)
-                    pBlkNext->pNext->pPrev = pBlk;
-                else
-                    pBlkMap->pRangesTail = pBlk;
-
-                RTMemFree(pBlkNext);
-            }
-        }
-        else
-        {
-            /* The block is intersecting. */
-            AssertMsgFailed(("TODO\n"));
+            uint32_t au32Valid[4];
+            memcpy(au32Valid, pLine->au32Valid, sizeof(au32Valid));
+            vciLineAssign(pCache, idxLine, u64Line - 1);
+            memcpy(pLine->au32Valid, au32Valid, sizeof(au32Valid));
+            pCache->cLinesTouched = idxLine + 1;
         }
     }
 
-    if ((fFlags & VCIBLKMAP_ALLOC_MASK) == VCIBLKMAP_ALLOC_DATA)
-        pBlkMap->cBlocksAllocMeta -= cBlocks;
-    else
-        pBlkMap->cBlocksAllocData -= cBlocks;
+    RTMemFree(paEnts);
+
+    if (RT_SUCCESS(rc))
+    {
+        /* Assigning lines marked the table dirty, nothing changed though. */
+        RT_BZERO(pCache->pbmTblDirty, RT_ALIGN_32(pCache->cBlocksLineTbl, 32) / 8);
 
-    pBlkMap->cBlocksFree += cBlocks;
+        /* Collect the holes, lowest index on top so the image stays compact. */
+        for (uint32_t idxLine = pCache->cLinesTouched; idxLine-- > 0;)
+            if (!pCache->paLines[idxLine].fUsed)
+                pCache->paidxFree[pCache->cLinesFree++] = idxLine;
+    }
 
-    LogFlowFunc(("returns\n"));
+    return rc;
 }
-#endif /* unused */
 
 /**
- * Converts a tree node from the image to the in memory structure.
- *
- * @returns Pointer to the in memory tree node.
- * @param   offBlockAddrNode    Block address of the node.
- * @param   pNodeImage          Pointer to the image representation of the node.
+ * Internal: Writes the header.
  */
-static PVCITREENODE vciTreeNodeImage2Host(uint64_t offBlockAddrNode, PVciTreeNode pNodeImage)
+static int vciHdrWrite(PVCICACHE pCache, bool fUncleanShutdown)
 {
-    PVCITREENODE pNode = NULL;
-
-    if (pNodeImage->u8Type == VCI_TREE_NODE_TYPE_LEAF)
-    {
-        PVCITREENODELEAF pLeaf = (PVCITREENODELEAF)RTMemAllocZ(sizeof(VCITREENODELEAF));
+    VciHdr Hdr;
 
-        if (pLeaf)
-        {
-            PVciCacheExtent pExtent = (PVciCacheExtent)&pNodeImage->au8Data[0];
+    RT_ZERO(Hdr);
+    Hdr.u32Signature     = RT_H2LE_U32(VCI_HDR_SIGNATURE);
+    Hdr.u32Version       = RT_H2LE_U32(VCI_HDR_VERSION);
+    Hdr.cBlocksCache     = RT_H2LE_U64(VCI_BYTE2BLOCK(pCache->cbSize));
+    Hdr.fUncleanShutdown = fUncleanShutdown ? VCI_HDR_UNCLEAN_SHUTDOWN : VCI_HDR_CLEAN_SHUTDOWN;
+    Hdr.u32CacheType     = pCache->uImageFlags & VD_IMAGE_FLAGS_FIXED
+                           ? RT_H2LE_U32(VCI_HDR_CACHE_TYPE_FIXED)
+                           : RT_H2LE_U32(VCI_HDR_CACHE_TYPE_DYNAMIC);
+    Hdr.offLineTbl       = RT_H2LE_U64(pCache->offLineTbl);
+    Hdr.offData          = RT_H2LE_U64(pCache->offData);
+    Hdr.cBlocksPerLine   = RT_H2LE_U32(pCache->cBlocksPerLine);
+    Hdr.cLines           = RT_H2LE_U32(pCache->cLines);
+    Hdr.uuidImage        = pCache->ImageUuid;
+    Hdr.uuidModification = pCache->ModificationUuid;
+
+    return vdIfIoIntFileWriteSync(pCache->pIfIo, pCache->pStorage, 0, &Hdr, sizeof(Hdr));
+}
 
-            pLeaf->Core.u8Type = VCI_TREE_NODE_TYPE_LEAF;
+/**
+ * Internal: Converts the header to host endianess and checks it for sanity.
+ *
+ * @returns VBox status code.
+ * @param   pHdr      The header read from the image.
+ * @param   cbFile    Size of the image file.
+ */
+static int vciHdrConvertAndValidate(PVciHdr pHdr, uint64_t cbFile)
+{
+    RT_NOREF1(cbFile);
+
+    pHdr->u32Signature   = RT_LE2H_U32(pHdr->u32Signature);
+    pHdr->u32Version     = RT_LE2H_U32(pHdr->u32Version);
+    pHdr->cBlocksCache   = RT_LE2H_U64(pHdr->cBlocksCache);
+    pHdr->u32CacheType   = RT_LE2H_U32(pHdr->u32CacheType);
+    pHdr->offLineTbl     = RT_LE2H_U64(pHdr->offLineTbl);
+    pHdr->offData        = RT_LE2H_U64(pHdr->offData);
+    pHdr->cBlocksPerLine = RT_LE2H_U32(pHdr->cBlocksPerLine);
+    pHdr->cLines         = RT_LE2H_U32(pHdr->cLines);
+
+    if (   pHdr->u32Signature != VCI_HDR_SIGNATURE
+        || pHdr->u32Version != VCI_HDR_VERSION)
+        return VERR_VD_GEN_INVALID_HEADER;
+
+    uint64_t cBlocksLineTbl = VCI_BYTE2BLOCK(RT_ALIGN_64((uint64_t)pHdr->cLines * sizeof(VciLineEnt), VCI_BLOCK_SIZE));
+    if (   !pHdr->cBlocksPerLine
+        || pHdr->cBlocksPerLine > VCI_LINE_BLOCKS_MAX
+        || pHdr->cBlocksPerLine % 32
+        || !pHdr->cLines
+        || pHdr->cLines >= VCI_LINE_NIL / 2
+        || pHdr->offLineTbl < VCI_BYTE2BLOCK(sizeof(VciHdr))
+        || pHdr->offLineTbl + cBlocksLineTbl > pHdr->offData
+        || pHdr->offData + (uint64_t)pHdr->cLines * pHdr->cBlocksPerLine > pHdr->cBlocksCache)
+        return VERR_VD_GEN_INVALID_HEADER;
+
+    return VINF_SUCCESS;
+}
 
-            for (unsigned idx = 0; idx < RT_ELEMENTS(pLeaf->aExtents); idx++)
-            {
-                pLeaf->aExtents[idx].u64BlockOffset = RT_LE2H_U64(pExtent->u64BlockOffset);
-                pLeaf->aExtents[idx].u32Blocks      = RT_LE2H_U32(pExtent->u32Blocks);
-                pLeaf->aExtents[idx].u64BlockAddr   = RT_LE2H_U64(pExtent->u64BlockAddr);
-                pExtent++;
-
-                if (   pLeaf->aExtents[idx].u32Blocks
-                    && pLeaf->aExtents[idx].u64BlockAddr)
-                    pLeaf->cUsedNodes++;
-            }
+/**
+ * Internal. Flush image data to disk.
+ */
+static int vciFlushImage(PVCICACHE pCache)
+{
+    int rc = VINF_SUCCESS;
 
-            pNode = &pLeaf->Core;
-        }
-    }
-    else if (pNodeImage->u8Type == VCI_TREE_NODE_TYPE_INTERNAL)
+    if (   pCache->pStorage
+        && !(pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY))
     {
-        PVCITREENODEINT pInt = (PVCITREENODEINT)RTMemAllocZ(sizeof(VCITREENODEINT));
-
-        if (pInt)
+        /* The data needs to be on the disk before the table says it is valid. */
+        if (   pCache->pbmTblDirty
+            && ASMBitFirstSet(pCache->pbmTblDirty, RT_ALIGN_32(pCache->cBlocksLineTbl, 32)) != -1)
         {
-            PVciTreeNodeInternal pIntImage = (PVciTreeNodeInternal)&pNodeImage->au8Data[0];
-
-            pInt->Core.u8Type = VCI_TREE_NODE_TYPE_INTERNAL;
-
-            for (unsigned idx = 0; idx < RT_ELEMENTS(pInt->aIntNodes); idx++)
-            {
-                pInt->aIntNodes[idx].u64BlockOffset              = RT_LE2H_U64(pIntImage->u64BlockOffset);
-                pInt->aIntNodes[idx].u32Blocks                   = RT_LE2H_U32(pIntImage->u32Blocks);
-                pInt->aIntNodes[idx].PtrChild.fInMemory          = false;
-                pInt->aIntNodes[idx].PtrChild.u.offAddrBlockNode = RT_LE2H_U64(pIntImage->u64ChildAddr);
-                pIntImage++;
-
-                if (   pInt->aIntNodes[idx].u32Blocks
-                    && pInt->aIntNodes[idx].PtrChild.u.offAddrBlockNode)
-                    pInt->cUsedNodes++;
-            }
-
-            pNode = &pInt->Core;
+            rc = vdIfIoIntFileFlushSync(pCache->pIfIo, pCache->pStorage);
+            if (RT_SUCCESS(rc))
+                rc = vciLineTblWrite(pCache);
         }
+        if (RT_SUCCESS(rc))
+            rc = vdIfIoIntFileFlushSync(pCache->pIfIo, pCache->pStorage);
     }
-    else
-        AssertMsgFailed(("Invalid node type %d\n", pNodeImage->u8Type));
-
-    if (pNode)
-        pNode->u64BlockAddr = offBlockAddrNode;
 
-    return pNode;
+    return rc;
 }
 
 /**
- * Looks up the cache extent for the given virtual block address.
- *
- * @returns Pointer to the cache extent or NULL if none could be found.
- * @param   pCache         The cache image instance.
- * @param   offBlockOffset The block offset to search for.
- * @param   ppNextBestFit  Where to store the pointer to the next best fit
- *                         cache extent above offBlockOffset if existing. - Optional
- *                         This is always filled if possible even if the function returns NULL.
+ * Internal. Free all allocated space for representing an image except pCache,
+ * and optionally delete the image from disk.
  */
-static PVCICACHEEXTENT vciCacheExtentLookup(PVCICACHE pCache, uint64_t offBlockOffset,
-                                            PVCICACHEEXTENT *ppNextBestFit)
+static int vciFreeImage(PVCICACHE pCache, bool fDelete)
 {
     int rc = VINF_SUCCESS;
-    PVCICACHEEXTENT pExtent = NULL;
-    PVCITREENODE pNodeCur = pCache->pRoot;
 
-    while (   RT_SUCCESS(rc)
-           && pNodeCur
-           && pNodeCur->u8Type != VCI_TREE_NODE_TYPE_LEAF)
+    /* Freeing a never allocated image (e.g. because the open failed) is
+     * not signalled as an error. After all nothing bad happens. */
+    if (pCache)
     {
-        PVCITREENODEINT pNodeInt = (PVCITREENODEINT)pNodeCur;
-
-        Assert(pNodeCur->u8Type == VCI_TREE_NODE_TYPE_INTERNAL);
-
-        /* Search for the correct internal node. */
-        unsigned idxMin = 0;
-        unsigned idxMax = pNodeInt->cUsedNodes;
-        unsigned idxCur = pNodeInt->cUsedNodes / 2;
-
-        while (idxMin < idxMax)
+        if (pCache->pStorage)
         {
-            PVCINODEINTERNAL pInt = &pNodeInt->aIntNodes[idxCur];
-
-            /* Determine the search direction. */
-            if (offBlockOffset < pInt->u64BlockOffset)
-            {
-                /* Search left from the current extent. */
-                idxMax = idxCur;
-            }
-            else if (offBlockOffset >= pInt->u64BlockOffset + pInt->u32Blocks)
-            {
-                /* Search right from the current extent. */
-                idxMin = idxCur;
-            }
-            else
+            /* No point updating the file that is deleted anyway. */
+            if (!fDelete)
             {
-                /* The block lies in the node, stop searching. */
-                if (pInt->PtrChild.fInMemory)
-                    pNodeCur = pInt->PtrChild.u.pNode;
-                else
+                rc = vciFlushImage(pCache);
+                if (   RT_SUCCESS(rc)
+                    && pCache->paLines
+                    && !(pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY))
                 {
-                    PVCITREENODE pNodeNew;
-                    VciTreeNode NodeTree;
-
-                    /* Read from disk and add to the tree. */
-                    rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage,
-                                               VCI_BLOCK2BYTE(pInt->PtrChild.u.offAddrBlockNode),
-                                               &NodeTree, sizeof(NodeTree));
-                    AssertRC(rc);
-
-                    pNodeNew = vciTreeNodeImage2Host(pInt->PtrChild.u.offAddrBlockNode, &NodeTree);
-                    if (pNodeNew)
-                    {
-                        /* Link to the parent. */
-                        pInt->PtrChild.fInMemory = true;
-                        pInt->PtrChild.u.pNode = pNodeNew;
-                        pNodeNew->pParent = pNodeCur;
-                        pNodeCur = pNodeNew;
-                    }
-                    else
-                        rc = VERR_NO_MEMORY;
+                    rc = vciHdrWrite(pCache, false /* fUncleanShutdown */);
+                    if (RT_SUCCESS(rc))
+                        rc = vdIfIoIntFileFlushSync(pCache->pIfIo, pCache->pStorage);
                 }
-                break;
             }
 
-            idxCur = idxMin + (idxMax - idxMin) / 2;
-        }
-    }
+            if (pCache->paLines)
+                LogRel(("VCI: %s: %llu hits (%llu bytes), %llu misses (%llu bytes), %llu evictions, %llu invalidations\n",
+                        pCache->pszFilename, pCache->cHits, pCache->cbHit, pCache->cMisses, pCache->cbMiss,
+                        pCache->cEvictions, pCache->cInvalidations));
 
-    if (   RT_SUCCESS(rc)
-        && pNodeCur)
-    {
-        PVCITREENODELEAF pLeaf = (PVCITREENODELEAF)pNodeCur;
-        Assert(pNodeCur->u8Type == VCI_TREE_NODE_TYPE_LEAF);
-
-        /* Search the range. */
-        unsigned idxMin = 0;
-        unsigned idxMax = pLeaf->cUsedNodes;
-        unsigned idxCur = pLeaf->cUsedNodes / 2;
-
-        while (idxMin < idxMax)
-        {
-            PVCICACHEEXTENT pExtentCur = &pLeaf->aExtents[idxCur];
-
-            /* Determine the search direction. */
-            if (offBlockOffset < pExtentCur->u64BlockOffset)
-            {
-                /* Search left from the current extent. */
-                idxMax = idxCur;
-            }
-            else if (offBlockOffset >= pExtentCur->u64BlockOffset + pExtentCur->u32Blocks)
-            {
-                /* Search right from the current extent. */
-                idxMin = idxCur;
-            }
-            else
-            {
-                /* We found the extent, stop searching. */
-                pExtent = pExtentCur;
-                break;
-            }
-
-            idxCur = idxMin + (idxMax - idxMin) / 2;
+            vdIfIoIntFileClose(pCache->pIfIo, pCache->pStorage);
+            pCache->pStorage = NULL;
         }
 
-        /* Get the next best fit extent if it exists. */
-        if (ppNextBestFit)
-        {
-            if (idxCur < pLeaf->cUsedNodes - 1)
-                *ppNextBestFit = &pLeaf->aExtents[idxCur + 1];
-            else
-            {
-                /*
-                 * Go up the tree and find the best extent
-                 * in the leftmost tree of the child subtree to the right.
-                 */
-                PVCITREENODEINT pInt = (PVCITREENODEINT)pLeaf->Core.pParent;
+        vciLinesDestroy(pCache);
 
-                while (pInt)
-                {
-
-                }
-            }
-        }
+        if (fDelete && pCache->pszFilename)
+            vdIfIoIntFileDelete(pCache->pIfIo, pCache->pszFilename);
     }
 
-    return pExtent;
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
 }
 
 /**
@@ -1242,48 +874,50 @@ static int vciOpenImage(PVCICACHE pCache, unsigned uOpenFlags)
         goto out;
     }
 
-    rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage, 0, &Hdr,
-                               VCI_BYTE2BLOCK(sizeof(Hdr)));
+    rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage, 0, &Hdr, sizeof(Hdr));
     if (RT_FAILURE(rc))
     {
         rc = VERR_VD_GEN_INVALID_HEADER;
         goto out;
     }
 
-    Hdr.u32Signature = RT_LE2H_U32(Hdr.u32Signature);
-    Hdr.u32Version   = RT_LE2H_U32(Hdr.u32Version);
-    Hdr.cBlocksCache = RT_LE2H_U64(Hdr.cBlocksCache);
-    Hdr.u32CacheType = RT_LE2H_U32(Hdr.u32CacheType);
-    Hdr.offTreeRoot  = RT_LE2H_U64(Hdr.offTreeRoot);
-    Hdr.offBlkMap    = RT_LE2H_U64(Hdr.offBlkMap);
-    Hdr.cBlkMap      = RT_LE2H_U32(Hdr.cBlkMap);
+    rc = vciHdrConvertAndValidate(&Hdr, cbFile);
+    if (RT_FAILURE(rc))
+    {
+        rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: invalid header in '%s'"), pCache->pszFilename);
+        goto out;
+    }
 
-    if (   Hdr.u32Signature == VCI_HDR_SIGNATURE
-        && Hdr.u32Version == VCI_HDR_VERSION)
+    pCache->cbSize           = VCI_BLOCK2BYTE(Hdr.cBlocksCache);
+    pCache->uImageFlags      = Hdr.u32CacheType == VCI_HDR_CACHE_TYPE_FIXED ? VD_IMAGE_FLAGS_FIXED : 0;
+    pCache->offLineTbl       = Hdr.offLineTbl;
+    pCache->offData          = Hdr.offData;
+    pCache->cBlocksPerLine   = Hdr.cBlocksPerLine;
+    pCache->cLines           = Hdr.cLines;
+    pCache->cBlocksLineTbl   = (uint32_t)VCI_BYTE2BLOCK(RT_ALIGN_64((uint64_t)Hdr.cLines * sizeof(VciLineEnt), VCI_BLOCK_SIZE));
+    pCache->ImageUuid        = Hdr.uuidImage;
+    pCache->ModificationUuid = Hdr.uuidModification;
+
+    rc = vciLinesCreate(pCache);
+    if (RT_FAILURE(rc))
+        goto out;
+
+    /* The table can't be trusted if the cache wasn't closed cleanly. */
+    if (Hdr.fUncleanShutdown != VCI_HDR_CLEAN_SHUTDOWN)
+        LogRel(("VCI: %s was not closed cleanly, discarding the cached data\n", pCache->pszFilename));
+    rc = vciLineTblLoad(pCache, Hdr.fUncleanShutdown != VCI_HDR_CLEAN_SHUTDOWN);
+    if (RT_FAILURE(rc))
     {
-        pCache->offTreeRoot   = Hdr.offTreeRoot;
-        pCache->offBlksBitmap = Hdr.offBlkMap;
+        rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot read the line table of '%s'"), pCache->pszFilename);
+        goto out;
+    }
 
-        /* Load the block map. */
-        rc = vciBlkMapLoad(pCache, pCache->offBlksBitmap, Hdr.cBlkMap, &pCache->pBlkMap);
+    if (!(uOpenFlags & VD_OPEN_FLAGS_READONLY))
+    {
+        rc = vciHdrWrite(pCache, true /* fUncleanShutdown */);
         if (RT_SUCCESS(rc))
-        {
-            /* Load the first tree node. */
-            VciTreeNode RootNode;
-
-            rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage,
-                                       pCache->offTreeRoot, &RootNode,
-                                       VCI_BYTE2BLOCK(sizeof(VciTreeNode)));
-            if (RT_SUCCESS(rc))
-            {
-                pCache->pRoot = vciTreeNodeImage2Host(pCache->offTreeRoot, &RootNode);
-                if (!pCache->pRoot)
-                    rc = VERR_NO_MEMORY;
-            }
-        }
+            rc = vdIfIoIntFileFlushSync(pCache->pIfIo, pCache->pStorage);
     }
-    else
-        rc = VERR_VD_GEN_INVALID_HEADER;
 
 out:
     if (RT_FAILURE(rc))
@@ -1296,13 +930,11 @@ out:
  */
 static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
                           unsigned uImageFlags, const char *pszComment,
-                          unsigned uOpenFlags, PFNVDPROGRESS pfnProgress,
-                          void *pvUser, unsigned uPercentStart,
-                          unsigned uPercentSpan)
+                          PCRTUUID pUuid, unsigned uOpenFlags,
+                          PVDINTERFACEPROGRESS pIfProgress,
+                          unsigned uPercentStart, unsigned uPercentSpan)
 {
     RT_NOREF1(pszComment);
-    VciHdr Hdr;
-    VciTreeNode NodeRoot;
     int rc;
     uint64_t cBlocks = cbSize / VCI_BLOCK_SIZE; /* Size of the cache in blocks. */
 
@@ -1319,6 +951,43 @@ static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
         return rc;
     }
 
+    /*
+     * Work out the layout: header, line table and the lines.  Each line costs
+     * its data plus one table entry.
+     */
+    uint32_t cBlocksPerLine = VCI_BYTE2BLOCK(VCI_LINE_SIZE_DEFAULT);
+    uint64_t cBlocksAvail = cBlocks > VCI_BYTE2BLOCK(sizeof(VciHdr)) + VCI_DATA_ALIGNMENT
+                          ? cBlocks - VCI_BYTE2BLOCK(sizeof(VciHdr)) - VCI_DATA_ALIGNMENT
+                          : 0;
+    uint64_t cLines = VCI_BLOCK2BYTE(cBlocksAvail) / (VCI_LINE_SIZE_DEFAULT + sizeof(VciLineEnt));
+    cLines = RT_MIN(cLines, VCI_LINE_NIL / 2 - 1);
+
+    pCache->offLineTbl     = VCI_BYTE2BLOCK(sizeof(VciHdr));
+    pCache->cBlocksPerLine = cBlocksPerLine;
+    for (;;)
+    {
+        pCache->cLines         = (uint32_t)cLines;
+        pCache->cBlocksLineTbl = (uint32_t)VCI_BYTE2BLOCK(RT_ALIGN_64(cLines * sizeof(VciLineEnt), VCI_BLOCK_SIZE));
+        pCache->offData        = RT_ALIGN_64(pCache->offLineTbl + pCache->cBlocksLineTbl, VCI_DATA_ALIGNMENT);
+        if (   !cLines
+            || pCache->offData + cLines * cBlocksPerLine <= cBlocks)
+            break;
+        cLines--;
+    }
+
+    if (!cLines)
+    {
+        rc = vdIfError(pCache->pIfError, VERR_VD_INVALID_SIZE, RT_SRC_POS,
+                       N_("VCI: size of '%s' too small to hold a single cache line"), pCache->pszFilename);
+        return rc;
+    }
+
+    if (pUuid)
+        pCache->ImageUuid = *pUuid;
+    else
+        RTUuidCreate(&pCache->ImageUuid);
+    RTUuidClear(&pCache->ModificationUuid);
+
     do
     {
         /* Create image file. */
@@ -1332,106 +1001,39 @@ static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
             break;
         }
 
-        /* Allocate block bitmap. */
-        uint32_t cBlkMap = 0;
-        rc = vciBlkMapCreate(cBlocks, &pCache->pBlkMap, &cBlkMap);
+        rc = vciLinesCreate(pCache);
         if (RT_FAILURE(rc))
         {
-            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot create block bitmap '%s'"), pCache->pszFilename);
+            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot allocate the cache lines for '%s'"), pCache->pszFilename);
             break;
         }
 
-        /*
-         * Allocate space for the header in the block bitmap.
-         * Because the block map is empty the header has to start at block 0
-         */
-        uint64_t offHdr = 0;
-        rc = vciBlkMapAllocate(pCache->pBlkMap, VCI_BYTE2BLOCK(sizeof(VciHdr)), VCIBLKMAP_ALLOC_META, &offHdr);
-        if (RT_FAILURE(rc))
-        {
-            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot allocate space for header in block bitmap '%s'"), pCache->pszFilename);
-            break;
-        }
-
-        Assert(offHdr == 0);
-
-        /*
-         * Allocate space for the block map itself.
-         */
-        uint64_t offBlkMap = 0;
-        rc = vciBlkMapAllocate(pCache->pBlkMap, cBlkMap, VCIBLKMAP_ALLOC_META, &offBlkMap);
-        if (RT_FAILURE(rc))
-        {
-            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot allocate space for block map in block map '%s'"), pCache->pszFilename);
-            break;
-        }
-
-        /*
-         * Allocate space for the tree root node.
-         */
-        uint64_t offTreeRoot = 0;
-        rc = vciBlkMapAllocate(pCache->pBlkMap, VCI_BYTE2BLOCK(sizeof(VciTreeNode)), VCIBLKMAP_ALLOC_META, &offTreeRoot);
-        if (RT_FAILURE(rc))
-        {
-            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot allocate space for block map in block map '%s'"), pCache->pszFilename);
-            break;
-        }
+        pCache->cbSize = VCI_BLOCK2BYTE(cBlocks);
 
-        /*
-         * Allocate the in memory root node.
-         */
-        pCache->pRoot = (PVCITREENODE)RTMemAllocZ(sizeof(VCITREENODELEAF));
-        if (!pCache->pRoot)
+        if (uImageFlags & VD_IMAGE_FLAGS_FIXED)
         {
-            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot allocate B+-Tree root pointer '%s'"), pCache->pszFilename);
-            break;
+            rc = vdIfIoIntFileSetAllocationSize(pCache->pIfIo, pCache->pStorage, pCache->cbSize, 0 /* fFlags */,
+                                                pIfProgress, uPercentStart, uPercentSpan);
+            if (RT_FAILURE(rc))
+            {
+                rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot set the file size for '%s'"), pCache->pszFilename);
+                break;
+            }
         }
 
-        pCache->pRoot->u8Type = VCI_TREE_NODE_TYPE_LEAF;
-        /* Rest remains 0 as the tree is still empty. */
-
-        /*
-         * Now that we are here we have all the basic structures and know where to place them in the image.
-         * It's time to write it now.
-         */
-
-        /* Setup the header. */
-        memset(&Hdr, 0, sizeof(VciHdr));
-        Hdr.u32Signature     = RT_H2LE_U32(VCI_HDR_SIGNATURE);
-        Hdr.u32Version       = RT_H2LE_U32(VCI_HDR_VERSION);
-        Hdr.cBlocksCache     = RT_H2LE_U64(cBlocks);
-        Hdr.fUncleanShutdown = VCI_HDR_UNCLEAN_SHUTDOWN;
-        Hdr.u32CacheType     = uImageFlags & VD_IMAGE_FLAGS_FIXED
-                               ? RT_H2LE_U32(VCI_HDR_CACHE_TYPE_FIXED)
-                               : RT_H2LE_U32(VCI_HDR_CACHE_TYPE_DYNAMIC);
-        Hdr.offTreeRoot      = RT_H2LE_U64(offTreeRoot);
-        Hdr.offBlkMap        = RT_H2LE_U64(offBlkMap);
-        Hdr.cBlkMap          = RT_H2LE_U32(cBlkMap);
-
-        rc = vdIfIoIntFileWriteSync(pCache->pIfIo, pCache->pStorage, offHdr, &Hdr,
-                                    VCI_BYTE2BLOCK(sizeof(VciHdr)));
+        rc = vciHdrWrite(pCache, true /* fUncleanShutdown */);
         if (RT_FAILURE(rc))
         {
             rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot write header '%s'"), pCache->pszFilename);
             break;
         }
 
-        rc = vciBlkMapSave(pCache->pBlkMap, pCache, offBlkMap, cBlkMap);
+        /* Write the empty line table. */
+        ASMBitSetRange(pCache->pbmTblDirty, 0, pCache->cBlocksLineTbl);
+        rc = vciLineTblWrite(pCache);
         if (RT_FAILURE(rc))
         {
-            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot write block map '%s'"), pCache->pszFilename);
-            break;
-        }
-
-        /* Setup the root tree. */
-        memset(&NodeRoot, 0, sizeof(VciTreeNode));
-        NodeRoot.u8Type = RT_H2LE_U32(VCI_TREE_NODE_TYPE_LEAF);
-
-        rc = vdIfIoIntFileWriteSync(pCache->pIfIo, pCache->pStorage, offTreeRoot,
-                                    &NodeRoot, VCI_BYTE2BLOCK(sizeof(VciTreeNode)));
-        if (RT_FAILURE(rc))
-        {
-            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot write root node '%s'"), pCache->pszFilename);
+            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot write the line table '%s'"), pCache->pszFilename);
             break;
         }
 
@@ -1441,13 +1043,10 @@ static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
             rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot flush '%s'"), pCache->pszFilename);
             break;
         }
-
-        pCache->cbSize = cbSize;
-
     } while (0);
 
-    if (RT_SUCCESS(rc) && pfnProgress)
-        pfnProgress(pvUser, uPercentStart + uPercentSpan);
+    if (RT_SUCCESS(rc))
+        vdIfProgress(pIfProgress, uPercentStart + uPercentSpan);
 
     if (RT_FAILURE(rc))
         vciFreeImage(pCache, rc != VERR_ALREADY_EXISTS);
@@ -1490,19 +1089,7 @@ static DECLCALLBACK(int) vciProbe(const char *pszFilename, PVDINTERFACE pVDIfsDi
         goto out;
     }
 
-    Hdr.u32Signature = RT_LE2H_U32(Hdr.u32Signature);
-    Hdr.u32Version   = RT_LE2H_U32(Hdr.u32Version);
-    Hdr.cBlocksCache = RT_LE2H_U64(Hdr.cBlocksCache);
-    Hdr.u32CacheType = RT_LE2H_U32(Hdr.u32CacheType);
-    Hdr.offTreeRoot  = RT_LE2H_U64(Hdr.offTreeRoot);
-    Hdr.offBlkMap    = RT_LE2H_U64(Hdr.offBlkMap);
-    Hdr.cBlkMap      = RT_LE2H_U32(Hdr.cBlkMap);
-
-    if (   Hdr.u32Signature == VCI_HDR_SIGNATURE
-        && Hdr.u32Version == VCI_HDR_VERSION)
-        rc = VINF_SUCCESS;
-    else
-        rc = VERR_VD_GEN_INVALID_HEADER;
+    rc = vciHdrConvertAndValidate(&Hdr, cbFile);
 
 out:
     if (pStorage)
@@ -1567,20 +1154,12 @@ static DECLCALLBACK(int) vciCreate(const char *pszFilename, uint64_t cbSize,
                                    PVDINTERFACE pVDIfsDisk, PVDINTERFACE pVDIfsImage,
                                    PVDINTERFACE pVDIfsOperation, void **ppBackendData)
 {
-    RT_NOREF1(pUuid);
     LogFlowFunc(("pszFilename=\"%s\" cbSize=%llu uImageFlags=%#x pszComment=\"%s\" Uuid=%RTuuid uOpenFlags=%#x uPercentStart=%u uPercentSpan=%u pVDIfsDisk=%#p pVDIfsImage=%#p pVDIfsOperation=%#p ppBackendData=%#p",
                  pszFilename, cbSize, uImageFlags, pszComment, pUuid, uOpenFlags, uPercentStart, uPercentSpan, pVDIfsDisk, pVDIfsImage, pVDIfsOperation, ppBackendData));
     int rc;
     PVCICACHE pCache;
 
-    PFNVDPROGRESS pfnProgress = NULL;
-    void *pvUser = NULL;
     PVDINTERFACEPROGRESS pIfProgress = VDIfProgressGet(pVDIfsOperation);
-    if (pIfProgress)
-    {
-        pfnProgress = pIfProgress->pfnProgress;
-        pvUser = pIfProgress->Core.pvUser;
-    }
 
     /* Check open flags. All valid flags are supported. */
     if (uOpenFlags & ~VD_OPEN_FLAGS_MASK)
@@ -1608,8 +1187,8 @@ static DECLCALLBACK(int) vciCreate(const char *pszFilename, uint64_t cbSize,
     pCache->pVDIfsDisk = pVDIfsDisk;
     pCache->pVDIfsImage = pVDIfsImage;
 
-    rc = vciCreateImage(pCache, cbSize, uImageFlags, pszComment, uOpenFlags,
-                        pfnProgress, pvUser, uPercentStart, uPercentSpan);
+    rc = vciCreateImage(pCache, cbSize, uImageFlags, pszComment, pUuid, uOpenFlags,
+                        pIfProgress, uPercentStart, uPercentSpan);
     if (RT_SUCCESS(rc))
     {
         /* So far the image is opened in read/write mode. Make sure the
@@ -1656,33 +1235,57 @@ static DECLCALLBACK(int) vciRead(void *pBackendData, uint64_t uOffset, size_t cb
                  pBackendData, uOffset, cbToRead, pIoCtx, pcbActuallyRead));
     PVCICACHE pCache = (PVCICACHE)pBackendData;
     int rc = VINF_SUCCESS;
-    PVCICACHEEXTENT pExtent;
-    uint64_t cBlocksToRead = VCI_BYTE2BLOCK(cbToRead);
-    uint64_t offBlockAddr  = VCI_BYTE2BLOCK(uOffset);
+    uint64_t offBlockAddr = VCI_BYTE2BLOCK(uOffset);
+    uint64_t uLine        = offBlockAddr / pCache->cBlocksPerLine;
+    uint32_t iBlock       = (uint32_t)(offBlockAddr % pCache->cBlocksPerLine);
+    uint32_t cBlocks      = (uint32_t)RT_MIN(VCI_BYTE2BLOCK(cbToRead), pCache->cBlocksPerLine - iBlock);
 
     AssertPtr(pCache);
     Assert(uOffset % 512 == 0);
     Assert(cbToRead % 512 == 0);
 
-    pExtent = vciCacheExtentLookup(pCache, offBlockAddr, NULL);
-    if (pExtent)
+    uint32_t idxLine = vciLineLookup(pCache, uLine);
+    if (   idxLine != VCI_LINE_NIL
+        && ASMBitTest(&pCache->paLines[idxLine].au32Valid[0], iBlock))
     {
-        uint64_t offRead = offBlockAddr - pExtent->u64BlockOffset;
-        cBlocksToRead = RT_MIN(cBlocksToRead, pExtent->u32Blocks - offRead);
-
-        rc = vdIfIoIntFileReadUser(pCache->pIfIo, pCache->pStorage,
-                                   pExtent->u64BlockAddr + offRead,
-                                   pIoCtx, cBlocksToRead);
+        PVCICACHELINE pLine = &pCache->paLines[idxLine];
+
+        /* Read the valid blocks following the start. */
+        int iBlockEnd = ASMBitNextClear(&pLine->au32Valid[0], pCache->cBlocksPerLine, iBlock);
+        if (iBlockEnd != -1)
+            cBlocks = RT_MIN(cBlocks, (uint32_t)iBlockEnd - iBlock);
+
+        pLine->cReadsPending++;
+        rc = vdIfIoIntFileReadUserEx(pCache->pIfIo, pCache->pStorage,
+                                     VCI_BLOCK2BYTE(pCache->offData + (uint64_t)idxLine * pCache->cBlocksPerLine + iBlock),
+                                     pIoCtx, VCI_BLOCK2BYTE(cBlocks), vciReadComplete, (void *)(uintptr_t)idxLine);
+        if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+        {
+            /* Completed already, the callback isn't called in that case. */
+            Assert(pLine->cReadsPending > 0);
+            pLine->cReadsPending--;
+        }
+        vciLineTouch(pCache, idxLine);
+        pCache->cHits++;
+        pCache->cbHit += VCI_BLOCK2BYTE(cBlocks);
     }
     else
     {
-        /** @todo Best fit to check whether we have cached data later and set
-         * pcbActuallyRead accordingly. */
+        /* Report the blocks not in the cache up to the next valid one. */
+        if (idxLine != VCI_LINE_NIL)
+        {
+            int iBlockValid = ASMBitNextSet(&pCache->paLines[idxLine].au32Valid[0], pCache->cBlocksPerLine, iBlock);
+            if (iBlockValid != -1)
+                cBlocks = RT_MIN(cBlocks, (uint32_t)iBlockValid - iBlock);
+        }
+
+        pCache->cMisses++;
+        pCache->cbMiss += VCI_BLOCK2BYTE(cBlocks);
         rc = VERR_VD_BLOCK_FREE;
     }
 
     if (pcbActuallyRead)
-        *pcbActuallyRead = VCI_BLOCK2BYTE(cBlocksToRead);
+        *pcbActuallyRead = VCI_BLOCK2BYTE(cBlocks);
 
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
@@ -1692,23 +1295,59 @@ static DECLCALLBACK(int) vciRead(void *pBackendData, uint64_t uOffset, size_t cb
 static DECLCALLBACK(int) vciWrite(void *pBackendData, uint64_t uOffset, size_t cbToWrite,
                                   PVDIOCTX pIoCtx, size_t *pcbWriteProcess)
 {
-    RT_NOREF5(pBackendData, uOffset, cbToWrite, pIoCtx, pcbWriteProcess);
     LogFlowFunc(("pBackendData=%#p uOffset=%llu cbToWrite=%zu pIoCtx=%#p pcbWriteProcess=%#p\n",
                  pBackendData, uOffset, cbToWrite, pIoCtx, pcbWriteProcess));
     PVCICACHE pCache = (PVCICACHE)pBackendData;
     int rc = VINF_SUCCESS;
-    uint64_t cBlocksToWrite = VCI_BYTE2BLOCK(cbToWrite);
-    //uint64_t offBlockAddr  = VCI_BYTE2BLOCK(uOffset);
+    uint64_t offBlockAddr = VCI_BYTE2BLOCK(uOffset);
+    uint64_t uLine        = offBlockAddr / pCache->cBlocksPerLine;
+    uint32_t iBlock       = (uint32_t)(offBlockAddr % pCache->cBlocksPerLine);
+    uint32_t cBlocks      = (uint32_t)RT_MIN(VCI_BYTE2BLOCK(cbToWrite), pCache->cBlocksPerLine - iBlock);
 
-    AssertPtr(pCache); NOREF(pCache);
+    AssertPtr(pCache);
     Assert(uOffset % 512 == 0);
     Assert(cbToWrite % 512 == 0);
-    while (cBlocksToWrite)
+
+    if (pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        rc = VERR_VD_IMAGE_READ_ONLY;
+    else
     {
+        uint32_t idxLine = vciLineLookup(pCache, uLine);
+        if (idxLine == VCI_LINE_NIL)
+            idxLine = vciLineAlloc(pCache, uLine);
+        else
+            vciLineTouch(pCache, idxLine);
 
+        if (idxLine != VCI_LINE_NIL)
+        {
+            PVCICACHELINE pLine = &pCache->paLines[idxLine];
+            PVCIWRITESTATE pWrite = (PVCIWRITESTATE)RTMemAlloc(sizeof(VCIWRITESTATE));
+            if (pWrite)
+            {
+                pWrite->idxLine = idxLine;
+                pWrite->uGen    = pLine->uGen;
+                pWrite->iBlock  = iBlock;
+                pWrite->cBlocks = cBlocks;
+                pLine->cWritesPending++;
+
+                rc = vdIfIoIntFileWriteUser(pCache->pIfIo, pCache->pStorage,
+                                            VCI_BLOCK2BYTE(pCache->offData + (uint64_t)idxLine * pCache->cBlocksPerLine + iBlock),
+                                            pIoCtx, VCI_BLOCK2BYTE(cBlocks), vciWriteComplete, pWrite);
+                if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                {
+                    /* Completed already, the callback isn't called in that case. */
+                    vciLineWriteFinish(pCache, pWrite, RT_SUCCESS(rc));
+                    RTMemFree(pWrite);
+                }
+            }
+            else
+                rc = VERR_NO_MEMORY;
+        }
+        else
+            rc = VERR_VCI_NO_BLOCKS_FREE; /* All lines are busy, the caller doesn't cache the data. */
     }
 
-    *pcbWriteProcess = cbToWrite; /** @todo Implement. */
+    *pcbWriteProcess = VCI_BLOCK2BYTE(cBlocks);
 
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
@@ -1726,6 +1365,61 @@ static DECLCALLBACK(int) vciFlush(void *pBackendData, PVDIOCTX pIoCtx)
     return rc;
 }
 
+/** @copydoc VDCACHEBACKEND::pfnDiscard */
+static DECLCALLBACK(int) vciDiscard(void *pBackendData, PVDIOCTX pIoCtx,
+                                    uint64_t uOffset, size_t cbDiscard,
+                                    size_t *pcbPreAllocated, size_t *pcbPostAllocated,
+                                    size_t *pcbActuallyDiscarded, void **ppbmAllocationBitmap,
+                                    unsigned fDiscard)
+{
+    RT_NOREF2(pIoCtx, fDiscard);
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbDiscard=%zu\n", pBackendData, uOffset, cbDiscard));
+    PVCICACHE pCache = (PVCICACHE)pBackendData;
+
+    AssertPtr(pCache);
+
+    /*
+     * The range changed on the disk, drop it from the cache.  This only touches
+     * the in memory state, the line table is written during the next flush.
+     */
+    uint64_t offBlockAddr = VCI_BYTE2BLOCK(uOffset);
+    uint64_t offBlockEnd  = VCI_BYTE2BLOCK(uOffset + cbDiscard + VCI_BLOCK_SIZE - 1);
+
+    while (offBlockAddr < offBlockEnd)
+    {
+        uint64_t uLine   = offBlockAddr / pCache->cBlocksPerLine;
+        uint32_t iBlock  = (uint32_t)(offBlockAddr % pCache->cBlocksPerLine);
+        uint32_t cBlocks = (uint32_t)RT_MIN(offBlockEnd - offBlockAddr, pCache->cBlocksPerLine - iBlock);
+        uint32_t idxLine = vciLineLookup(pCache, uLine);
+
+        if (idxLine != VCI_LINE_NIL)
+        {
+            PVCICACHELINE pLine = &pCache->paLines[idxLine];
+
+            ASMBitClearRange(&pLine->au32Valid[0], iBlock, iBlock + cBlocks);
+            pLine->uGen++;
+            pCache->cInvalidations++;
+
+            if (   !pLine->cWritesPending
+                && !pLine->cReadsPending
+                && vciLineIsEmpty(pLine))
+                vciLineRelease(pCache, idxLine, true /* fFreeStack */);
+            else
+                vciLineSetDirty(pCache, idxLine);
+        }
+
+        offBlockAddr += cBlocks;
+    }
+
+    *pcbPreAllocated      = 0;
+    *pcbPostAllocated     = 0;
+    *pcbActuallyDiscarded = cbDiscard;
+    *ppbmAllocationBitmap = NULL;
+
+    LogFlowFunc(("returns VINF_SUCCESS\n"));
+    return VINF_SUCCESS;
+}
+
 /** @copydoc VDCACHEBACKEND::pfnGetVersion */
 static DECLCALLBACK(unsigned) vciGetVersion(void *pBackendData)
 {
@@ -1735,7 +1429,7 @@ static DECLCALLBACK(unsigned) vciGetVersion(void *pBackendData)
     AssertPtr(pCache);
 
     if (pCache)
-        return 1;
+        return VCI_HDR_VERSION;
     else
         return 0;
 }
@@ -1889,7 +1583,6 @@ static DECLCALLBACK(int) vciSetComment(void *pBackendData, const char *pszCommen
 /** @copydoc VDCACHEBACKEND::pfnGetUuid */
 static DECLCALLBACK(int) vciGetUuid(void *pBackendData, PRTUUID pUuid)
 {
-    RT_NOREF1(pUuid);
     LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
     PVCICACHE pCache = (PVCICACHE)pBackendData;
     int rc;
@@ -1897,7 +1590,10 @@ static DECLCALLBACK(int) vciGetUuid(void *pBackendData, PRTUUID pUuid)
     AssertPtr(pCache);
 
     if (pCache)
-        rc = VERR_NOT_SUPPORTED;
+    {
+        *pUuid = pCache->ImageUuid;
+        rc = VINF_SUCCESS;
+    }
     else
         rc = VERR_VD_NOT_OPENED;
 
@@ -1908,7 +1604,6 @@ static DECLCALLBACK(int) vciGetUuid(void *pBackendData, PRTUUID pUuid)
 /** @copydoc VDCACHEBACKEND::pfnSetUuid */
 static DECLCALLBACK(int) vciSetUuid(void *pBackendData, PCRTUUID pUuid)
 {
-    RT_NOREF1(pUuid);
     LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
     PVCICACHE pCache = (PVCICACHE)pBackendData;
     int rc;
@@ -1919,7 +1614,10 @@ static DECLCALLBACK(int) vciSetUuid(void *pBackendData, PCRTUUID pUuid)
     if (pCache)
     {
         if (!(pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY))
-            rc = VERR_NOT_SUPPORTED;
+        {
+            pCache->ImageUuid = *pUuid;
+            rc = vciHdrWrite(pCache, true /* fUncleanShutdown */);
+        }
         else
             rc = VERR_VD_IMAGE_READ_ONLY;
     }
@@ -1933,7 +1631,6 @@ static DECLCALLBACK(int) vciSetUuid(void *pBackendData, PCRTUUID pUuid)
 /** @copydoc VDCACHEBACKEND::pfnGetModificationUuid */
 static DECLCALLBACK(int) vciGetModificationUuid(void *pBackendData, PRTUUID pUuid)
 {
-    RT_NOREF1(pUuid);
     LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
     PVCICACHE pCache = (PVCICACHE)pBackendData;
     int rc;
@@ -1941,7 +1638,10 @@ static DECLCALLBACK(int) vciGetModificationUuid(void *pBackendData, PRTUUID pUui
     AssertPtr(pCache);
 
     if (pCache)
-        rc = VERR_NOT_SUPPORTED;
+    {
+        *pUuid = pCache->ModificationUuid;
+        rc = VINF_SUCCESS;
+    }
     else
         rc = VERR_VD_NOT_OPENED;
 
@@ -1952,7 +1652,6 @@ static DECLCALLBACK(int) vciGetModificationUuid(void *pBackendData, PRTUUID pUui
 /** @copydoc VDCACHEBACKEND::pfnSetModificationUuid */
 static DECLCALLBACK(int) vciSetModificationUuid(void *pBackendData, PCRTUUID pUuid)
 {
-    RT_NOREF1(pUuid);
     LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
     PVCICACHE pCache = (PVCICACHE)pBackendData;
     int rc;
@@ -1962,7 +1661,10 @@ static DECLCALLBACK(int) vciSetModificationUuid(void *pBackendData, PCRTUUID pUu
     if (pCache)
     {
         if (!(pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY))
-            rc = VERR_NOT_SUPPORTED;
+        {
+            pCache->ModificationUuid = *pUuid;
+            rc = vciHdrWrite(pCache, true /* fUncleanShutdown */);
+        }
         else
             rc = VERR_VD_IMAGE_READ_ONLY;
     }
@@ -1976,7 +1678,22 @@ static DECLCALLBACK(int) vciSetModificationUuid(void *pBackendData, PCRTUUID pUu
 /** @copydoc VDCACHEBACKEND::pfnDump */
 static DECLCALLBACK(void) vciDump(void *pBackendData)
 {
-    NOREF(pBackendData);
+    PVCICACHE pCache = (PVCICACHE)pBackendData;
+
+    AssertPtrReturnVoid(pCache);
+
+    uint32_t cLinesUsed = 0;
+    for (uint32_t i = 0; i < pCache->cLinesTouched; i++)
+        if (pCache->paLines[i].fUsed)
+            cLinesUsed++;
+
+    vdIfErrorMessage(pCache->pIfError, "Header: Lines=%u BlocksPerLine=%u offLineTbl=%llu offData=%llu\n",
+                     pCache->cLines, pCache->cBlocksPerLine, pCache->offLineTbl, pCache->offData);
+    vdIfErrorMessage(pCache->pIfError, "Lines: used=%u touched=%u free=%u\n",
+                     cLinesUsed, pCache->cLinesTouched, pCache->cLinesFree);
+    vdIfErrorMessage(pCache->pIfError, "Statistics: hits=%llu (%llu bytes) misses=%llu (%llu bytes) evictions=%llu invalidations=%llu\n",
+                     pCache->cHits, pCache->cbHit, pCache->cMisses, pCache->cbMiss,
+                     pCache->cEvictions, pCache->cInvalidations);
 }
 
 
@@ -1987,7 +1704,7 @@ const VDCACHEBACKEND g_VciCacheBackend =
     /* pszBackendName */
     "vci",
     /* uBackendCaps */
-    VD_CAP_CREATE_FIXED | VD_CAP_CREATE_DYNAMIC | VD_CAP_FILE | VD_CAP_VFS,
+    VD_CAP_CREATE_FIXED | VD_CAP_CREATE_DYNAMIC | VD_CAP_FILE | VD_CAP_VFS | VD_CAP_ASYNC,
     /* papszFileExtensions */
     s_apszVciFileExtensions,
     /* paConfigInfo */
@@ -2007,7 +1724,7 @@ const VDCACHEBACKEND g_VciCacheBackend =
     /* pfnFlush */
     vciFlush,
     /* pfnDiscard */
-    NULL,
+    vciDiscard,
     /* pfnGetVersion */
     vciGetVersion,
     /* pfnGetSize */
@@ -2041,4 +1758,3 @@ const VDCACHEBACKEND g_VciCacheBackend =
     /* u32VersionEnd */
     VD_CACHEBACKEND_VERSION
 };
-
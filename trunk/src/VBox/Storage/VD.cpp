@@ -40,6 +40,9 @@
 #include <iprt/list.h>
 #include <iprt/avl.h>
 #include <iprt/semaphore.h>
+#include <iprt/critsect.h>
+#include <iprt/thread.h>
+#include <iprt/once.h>
 
 #include <VBox/vd-plugin.h>
 
@@ -60,6 +63,23 @@
 /** Maximum number of segments in one I/O task. */
 #define VD_IO_TASK_SEGMENTS_MAX 64
 
+/** Number of threads servicing async requests of the fallback I/O interface. */
+#define VD_IO_FALLBACK_THREADS  8
+
+/** Default size of one transfer of the copy/merge engine. */
+#define VD_COPY_CHUNK_SIZE_DEFAULT  _1M
+/** Default number of transfers the copy/merge engine keeps in flight per thread. */
+#define VD_COPY_REQS_DEFAULT        16
+/** Maximum number of transfers the copy/merge engine keeps in flight per thread. */
+#define VD_COPY_REQS_MAX            256
+/** Maximum number of threads the copy/merge engine splits the disk between. */
+#define VD_COPY_THREADS_MAX         16
+/** Upper limit for the buffer memory of all transfers of one copy/merge operation. */
+#define VD_COPY_BUFFER_MAX          (256 * _1M)
+
+/** Default memory budget of the metadata table cache shared by all images. */
+#define VD_META_CACHE_SIZE_DEFAULT  (64 * _1M)
+
 /** Threshold after not recently used blocks are removed from the list. */
 #define VD_DISCARD_REMOVE_THRESHOLD (10 * _1M) /** @todo experiment */
 
@@ -72,10 +92,49 @@ typedef struct VDIIOFALLBACKSTORAGE
     RTFILE              File;
     /** Completion callback. */
     PFNVDCOMPLETED      pfnCompleted;
-    /** Thread for async access. */
-    RTTHREAD            ThreadAsync;
 } VDIIOFALLBACKSTORAGE, *PVDIIOFALLBACKSTORAGE;
 
+/**
+ * Async request of the fallback I/O interface.
+ */
+typedef struct VDIIOFALLBACKREQ
+{
+    /** Node for the list of pending requests. */
+    RTLISTNODE            NodeReq;
+    /** Storage the request is for. */
+    PVDIIOFALLBACKSTORAGE pStorage;
+    /** Flag whether this is a write, a flush if cSegments is 0. */
+    bool                  fWrite;
+    /** Start offset. */
+    uint64_t              uOffset;
+    /** Opaque user data passed to the completion callback. */
+    void                 *pvCompletion;
+    /** Number of segments. */
+    unsigned              cSegments;
+    /** Segment array - variable in size. */
+    RTSGSEG               aSegments[1];
+} VDIIOFALLBACKREQ, *PVDIIOFALLBACKREQ;
+
+/**
+ * Threads servicing the async requests of the fallback I/O interface
+ * for all images of a disk.
+ */
+typedef struct VDIIOFALLBACKTHREADS
+{
+    /** Critical section protecting the request list. */
+    RTCRITSECT            CritSect;
+    /** List of pending requests - VDIIOFALLBACKREQ. */
+    RTLISTANCHOR          ListReqs;
+    /** Event semaphore the threads wait on for new requests. */
+    RTSEMEVENT            hEvtReqs;
+    /** Flag whether the threads should terminate. */
+    volatile bool         fShutdown;
+    /** Number of threads started. */
+    unsigned              cThreads;
+    /** The thread handles. */
+    RTTHREAD              aThreads[VD_IO_FALLBACK_THREADS];
+} VDIIOFALLBACKTHREADS, *PVDIIOFALLBACKTHREADS;
+
 /**
  * Structure containing everything I/O related
  * for the image and cache descriptors.
@@ -101,6 +160,8 @@ typedef struct VDIO
 
 /** Forward declaration of an I/O task */
 typedef struct VDIOTASK *PVDIOTASK;
+/** Pointer to a data transfer waiting for submission. */
+typedef struct VDIOTASKSUBMIT *PVDIOTASKSUBMIT;
 
 /**
  * VBox HDD Container image descriptor.
@@ -216,6 +277,22 @@ typedef struct VDFILTER
 /** Pointer to a VD filter instance. */
 typedef VDFILTER *PVDFILTER;
 
+/**
+ * Independent I/O queue of a disk.
+ */
+typedef struct VDIOQUEUE
+{
+    /** Head of newly queued I/O contexts - LIFO order. */
+    volatile PVDIOCTX  pIoCtxHead;
+    /** Head of completed I/O contexts waiting for their completion
+     * callback to be called outside of the disk lock - LIFO order. */
+    volatile PVDIOCTX  pIoCtxCompletedHead;
+    /** Flag whether a thread is running the completion callbacks of this queue. */
+    volatile bool      fCompleting;
+} VDIOQUEUE;
+/** Pointer to an I/O queue. */
+typedef VDIOQUEUE *PVDIOQUEUE;
+
 /**
  * VBox HDD Container main structure, private part.
  */
@@ -272,6 +349,20 @@ struct VBOXHDD
     /** Head of halted I/O contexts which are given back to generic
      * disk framework by the backend. - LIFO order. */
     volatile PVDIOCTX      pIoCtxHaltedHead;
+    /** Array of independent I/O queues, NULL if queued submission is disabled. */
+    PVDIOQUEUE             paIoQueues;
+    /** Number of entries in the I/O queue array. */
+    uint32_t               cIoQueues;
+    /** Queue to start with when processing the queued I/O contexts the next time,
+     * rotated for fairness. Only accessed with the disk locked. */
+    uint32_t               iIoQueueNext;
+    /** Number of references to the I/O queue array, held by every queued I/O
+     * context until it is freed and by threads completing queued I/O contexts
+     * after releasing the disk lock. The array can only be replaced if there is none. */
+    volatile uint32_t      cIoQueueRefs;
+    /** Head of data transfers of queued requests which are submitted to the
+     * I/O interface after the disk lock was released - LIFO order. */
+    volatile PVDIOTASKSUBMIT pIoTasksSubmitHead;
 
     /** Head of blocked I/O contexts, processed only
      * after pIoCtxLockOwner was freed - LIFO order. */
@@ -289,6 +380,10 @@ struct VBOXHDD
 
     /** Pointer to the L2 disk cache if any. */
     PVDCACHE               pCache;
+    /** Cache generation, incremented whenever a range in the cache gets invalidated.
+     * Reads which missed the cache only write the data back if this didn't change
+     * in the meantime. */
+    uint32_t               uCacheGeneration;
     /** Pointer to the discard state if any. */
     PVDDISCARDSTATE        pDiscard;
 
@@ -296,6 +391,10 @@ struct VBOXHDD
     RTLISTANCHOR           ListFilterChainRead;
     /** Write filter chain - PVDFILTER. */
     RTLISTANCHOR           ListFilterChainWrite;
+
+    /** Threads servicing async requests of the fallback I/O interface,
+     * created on the first async request - NULL if not started. */
+    PVDIIOFALLBACKTHREADS  pIoFallbackThreads;
 };
 
 # define VD_IS_LOCKED(a_pDisk) \
@@ -367,6 +466,8 @@ typedef struct VDIOCTX
     PFNVDIOCTXTRANSFER           pfnIoCtxTransferNext;
     /** Transfer direction */
     VDIOCTXTXDIR                 enmTxDir;
+    /** I/O queue the root context was submitted to, NULL for the default path. */
+    PVDIOQUEUE                   pIoQueue;
     /** Request type dependent data. */
     union
     {
@@ -396,6 +497,12 @@ typedef struct VDIOCTX
             uint64_t             uOffsetXferOrig;
             /** Original size of the transfer - required for fitlering read requests. */
             size_t               cbXferOrig;
+            /** Start offset of the range to write into the cache after the read completed. */
+            uint64_t             uOffsetCacheUpdate;
+            /** Size of the range to write into the cache, 0 if there is nothing to update. */
+            size_t               cbCacheUpdate;
+            /** The cache generation when the first cache miss was encountered. */
+            uint32_t             uCacheGeneration;
         } Io;
         /** Discard requests. */
         struct
@@ -546,6 +653,41 @@ typedef struct VDIOTASK
     } Type;
 } VDIOTASK;
 
+/**
+ * Completion state of a user data transfer with a completion callback
+ * which might be split into several I/O tasks.
+ */
+typedef struct VDIOUSERXFER
+{
+    /** Number of I/O tasks still pending plus one reference held while submitting. */
+    uint32_t                     cTasksPending;
+    /** Status code of the first failed I/O task. */
+    int                          rcReq;
+    /** Completion callback of the caller, called once after the last task completed. */
+    PFNVDXFERCOMPLETED           pfnComplete;
+    /** Opaque user data for the completion callback. */
+    void                        *pvCompleteUser;
+} VDIOUSERXFER, *PVDIOUSERXFER;
+
+/**
+ * Data transfer of a queued request waiting to be submitted to the I/O interface.
+ */
+typedef struct VDIOTASKSUBMIT
+{
+    /** Next transfer waiting in the list. */
+    struct VDIOTASKSUBMIT * volatile pNext;
+    /** The I/O task, completed through the regular path. */
+    PVDIOTASK                    pIoTask;
+    /** Start offset in the storage. */
+    uint64_t                     uOffset;
+    /** Flag whether this is a write. */
+    bool                         fWrite;
+    /** Number of segments. */
+    unsigned                     cSegs;
+    /** The segments - variable in size. */
+    RTSGSEG                      aSegs[1];
+} VDIOTASKSUBMIT;
+
 /**
  * Storage handle.
  */
@@ -555,6 +697,8 @@ typedef struct VDIOSTORAGE
     PVDIO                        pVDIo;
     /** AVL tree for pending async metadata transfers. */
     PAVLRFOFFTREE                pTreeMetaXfers;
+    /** AVL tree of the cached metadata tables, protected by the metadata cache lock. */
+    AVLRU64TREE                  TreeMetaCache;
     /** Storage handle */
     void                        *pStorage;
 } VDIOSTORAGE;
@@ -603,6 +747,50 @@ typedef struct VDMETAXFER
 #define VDMETAXFER_TXDIR_GET(flags)      ((flags) & VDMETAXFER_TXDIR_MASK)
 #define VDMETAXFER_TXDIR_SET(flags, dir) ((flags) = (flags & ~VDMETAXFER_TXDIR_MASK) | (dir))
 
+/**
+ * Metadata table cache entry, internal view.
+ */
+typedef struct VDMETACACHEENTRYINT
+{
+    /** The part visible to the backends. */
+    VDMETACACHEENTRY             Core;
+    /** AVL node in the tree of the owning storage, the key is the table offset. */
+    AVLRU64NODECORE              NodeTree;
+    /** Node for the global LRU list, only valid when inserted. */
+    RTLISTNODE                   NodeLru;
+    /** The storage the table belongs to. */
+    PVDIOSTORAGE                 pIoStorage;
+    /** Number of references. */
+    uint32_t                     cRefs;
+    /** Flag whether the entry is inserted into the tree and LRU list. */
+    bool                         fInserted;
+} VDMETACACHEENTRYINT;
+/** Pointer to the internal view of a metadata table cache entry. */
+typedef VDMETACACHEENTRYINT *PVDMETACACHEENTRYINT;
+
+/**
+ * Metadata table cache shared by all images.
+ */
+typedef struct VDMETACACHE
+{
+    /** Critical section protecting the cache state and the trees of all storages. */
+    RTCRITSECT                   CritSect;
+    /** LRU list of inserted entries, most recently used first. */
+    RTLISTANCHOR                 ListLru;
+    /** Maximum amount of memory to use. */
+    size_t                       cbMax;
+    /** Amount of memory used by all allocated entries. */
+    size_t                       cbUsed;
+    /** Number of allocated entries. */
+    uint32_t                     cEntries;
+    /** Number of lookup hits. */
+    uint64_t                     cHits;
+    /** Number of lookup misses. */
+    uint64_t                     cMisses;
+    /** Number of evicted entries. */
+    uint64_t                     cEvictions;
+} VDMETACACHE;
+
 /**
  * Plugin structure.
  */
@@ -638,6 +826,7 @@ static PCVDIMAGEBACKEND aStaticBackends[] =
     &g_QedBackend,
     &g_QCowBackend,
     &g_VhdxBackend,
+    &g_DdiBackend,
     &g_RawBackend,
     &g_ISCSIBackend
 };
@@ -663,11 +852,17 @@ static PCVDFILTERBACKEND *g_apFilterBackends = NULL;
 static PRTLDRMOD g_pahFilterBackendPlugins = NULL;
 #endif
 
+/** Once initializer for the metadata table cache. */
+static RTONCE      g_MetaCacheOnce = RTONCE_INITIALIZER;
+/** The metadata table cache shared by all images. */
+static VDMETACACHE g_MetaCache;
+
 /** Forward declaration of the async discard helper. */
 static DECLCALLBACK(int) vdDiscardHelperAsync(PVDIOCTX pIoCtx);
 static DECLCALLBACK(int) vdWriteHelperAsync(PVDIOCTX pIoCtx);
 static void vdDiskProcessBlockedIoCtx(PVBOXHDD pDisk);
 static int vdDiskUnlock(PVBOXHDD pDisk, PVDIOCTX pIoCtxRc);
+static void vdDiskSubmitDeferredIoTasks(PVBOXHDD pDisk);
 static DECLCALLBACK(void) vdIoCtxSyncComplete(void *pvUser1, void *pvUser2, int rcReq);
 
 /**
@@ -1061,13 +1256,17 @@ static int vdFilterChainApplyRead(PVBOXHDD pDisk, uint64_t uOffset, size_t cbRea
     return rc;
 }
 
-DECLINLINE(void) vdIoCtxRootComplete(PVBOXHDD pDisk, PVDIOCTX pIoCtx)
+DECLINLINE(void) vdIoCtxRootApplyReadFilters(PVBOXHDD pDisk, PVDIOCTX pIoCtx)
 {
     if (   RT_SUCCESS(pIoCtx->rcReq)
         && pIoCtx->enmTxDir == VDIOCTXTXDIR_READ)
         pIoCtx->rcReq = vdFilterChainApplyRead(pDisk, pIoCtx->Req.Io.uOffsetXferOrig,
                                                pIoCtx->Req.Io.cbXferOrig, pIoCtx);
+}
 
+DECLINLINE(void) vdIoCtxRootComplete(PVBOXHDD pDisk, PVDIOCTX pIoCtx)
+{
+    vdIoCtxRootApplyReadFilters(pDisk, pIoCtx);
     pIoCtx->Type.Root.pfnComplete(pIoCtx->Type.Root.pvUser1,
                                   pIoCtx->Type.Root.pvUser2,
                                   pIoCtx->rcReq);
@@ -1092,6 +1291,9 @@ DECLINLINE(void) vdIoCtxInit(PVDIOCTX pIoCtx, PVBOXHDD pDisk, VDIOCTXTXDIR enmTx
     pIoCtx->Req.Io.pImageParentOverride = NULL;
     pIoCtx->Req.Io.uOffsetXferOrig      = uOffset;
     pIoCtx->Req.Io.cbXferOrig           = cbTransfer;
+    pIoCtx->Req.Io.uOffsetCacheUpdate   = 0;
+    pIoCtx->Req.Io.cbCacheUpdate        = 0;
+    pIoCtx->Req.Io.uCacheGeneration     = 0;
     pIoCtx->cDataTransfersPending = 0;
     pIoCtx->cMetaTransfersPending = 0;
     pIoCtx->fComplete             = false;
@@ -1101,6 +1303,7 @@ DECLINLINE(void) vdIoCtxInit(PVDIOCTX pIoCtx, PVBOXHDD pDisk, VDIOCTXTXDIR enmTx
     pIoCtx->pfnIoCtxTransferNext  = NULL;
     pIoCtx->rcReq                 = VINF_SUCCESS;
     pIoCtx->pIoCtxParent          = NULL;
+    pIoCtx->pIoQueue              = NULL;
 
     /* There is no S/G list for a flush request. */
     if (   enmTxDir != VDIOCTXTXDIR_FLUSH
@@ -1191,6 +1394,47 @@ static int vdCacheWriteHelper(PVDCACHE pCache, uint64_t uOffset, size_t cbWrite,
     return rc;
 }
 
+/**
+ * Internal: Invalidates the given range in the cache after it was modified
+ * in the image chain.
+ *
+ * @param   pDisk          The disk to invalidate the cache for.
+ * @param   uOffset        Start offset of the modified range.
+ * @param   cbInvalidate   Size of the modified range.
+ */
+static void vdCacheInvalidateHelper(PVBOXHDD pDisk, uint64_t uOffset, size_t cbInvalidate)
+{
+    PVDCACHE pCache = pDisk->pCache;
+
+    LogFlowFunc(("pDisk=%#p uOffset=%llu cbInvalidate=%zu\n", pDisk, uOffset, cbInvalidate));
+
+    VD_IS_LOCKED(pDisk);
+    AssertPtr(pCache);
+
+    /* Reads which are in flight must not write stale data back. */
+    pDisk->uCacheGeneration++;
+
+    if (!pCache->Backend->pfnDiscard)
+        return;
+
+    while (cbInvalidate)
+    {
+        size_t cbPreAllocated = 0;
+        size_t cbPostAllocated = 0;
+        size_t cbDiscarded = 0;
+        void *pbmAllocationBitmap = NULL;
+
+        int rc = pCache->Backend->pfnDiscard(pCache->pBackendData, NULL, uOffset, cbInvalidate,
+                                             &cbPreAllocated, &cbPostAllocated, &cbDiscarded,
+                                             &pbmAllocationBitmap, 0);
+        AssertMsgBreak(RT_SUCCESS(rc) && cbDiscarded, ("rc=%Rrc cbDiscarded=%zu\n", rc, cbDiscarded));
+        Assert(!pbmAllocationBitmap);
+
+        uOffset      += cbDiscarded;
+        cbInvalidate -= RT_MIN(cbDiscarded, cbInvalidate);
+    }
+}
+
 /**
  * Creates a new empty discard state.
  *
@@ -1441,6 +1685,7 @@ DECLINLINE(void) vdIoCtxDiscardInit(PVDIOCTX pIoCtx, PVBOXHDD pDisk, PCRTRANGE p
     pIoCtx->Req.Discard.cbDiscardLeft = 0;
     pIoCtx->Req.Discard.offCur        = 0;
     pIoCtx->Req.Discard.cbThisDiscard = 0;
+    pIoCtx->pIoQueue                  = NULL;
 
     pIoCtx->pIoCtxParent          = NULL;
     pIoCtx->Type.Root.pfnComplete = pfnComplete;
@@ -1534,6 +1779,9 @@ DECLINLINE(void) vdIoCtxFree(PVBOXHDD pDisk, PVDIOCTX pIoCtx)
 {
     Log(("Freeing I/O context %#p\n", pIoCtx));
 
+    if (pIoCtx->pIoQueue)
+        ASMAtomicDecU32(&pDisk->cIoQueueRefs);
+
     if (!(pIoCtx->fFlags & VDIOCTX_FLAGS_DONT_FREE))
     {
         if (pIoCtx->pvAllocation)
@@ -1597,6 +1845,35 @@ DECLINLINE(void) vdIoCtxAddToWaitingList(volatile PVDIOCTX *ppList, PVDIOCTX pIo
     }
 }
 
+/**
+ * Completes a finished root I/O context and frees it.
+ *
+ * Contexts submitted through an I/O queue are only put onto the completion list
+ * of the queue here, the callback is called after the disk lock was released.
+ *
+ * @returns nothing.
+ * @param   pDisk    The disk.
+ * @param   pIoCtx   The root I/O context which finished.
+ */
+static void vdIoCtxRootCompleteFree(PVBOXHDD pDisk, PVDIOCTX pIoCtx)
+{
+    PVDIOQUEUE pIoQueue = pIoCtx->pIoQueue;
+
+    VD_IS_LOCKED(pDisk);
+
+    if (!pIoQueue)
+    {
+        vdIoCtxRootComplete(pDisk, pIoCtx);
+        vdIoCtxFree(pDisk, pIoCtx);
+    }
+    else
+    {
+        /* Filters are not required to be reentrant, apply them while the disk is still locked. */
+        vdIoCtxRootApplyReadFilters(pDisk, pIoCtx);
+        vdIoCtxAddToWaitingList(&pIoQueue->pIoCtxCompletedHead, pIoCtx);
+    }
+}
+
 DECLINLINE(void) vdIoCtxDefer(PVBOXHDD pDisk, PVDIOCTX pIoCtx)
 {
     LogFlowFunc(("Deferring I/O context pIoCtx=%#p\n", pIoCtx));
@@ -1737,6 +2014,17 @@ static int vdIoCtxProcessLocked(PVDIOCTX pIoCtx)
                 else
                     rc = VERR_VD_ASYNC_IO_IN_PROGRESS;
             }
+
+            /*
+             * Drop the written range from the cache once the write landed in the image,
+             * reads issued before would otherwise put the old data back into it.
+             */
+            if (   rc == VINF_VD_ASYNC_IO_FINISHED
+                && pIoCtx->enmTxDir == VDIOCTXTXDIR_WRITE
+                && !pIoCtx->pIoCtxParent
+                && pIoCtx->pDisk->pCache)
+                vdCacheInvalidateHelper(pIoCtx->pDisk, pIoCtx->Req.Io.uOffsetXferOrig,
+                                        pIoCtx->Req.Io.cbXferOrig);
         }
         else
             rc = VERR_VD_ASYNC_IO_IN_PROGRESS;
@@ -1761,16 +2049,18 @@ static int vdIoCtxProcessLocked(PVDIOCTX pIoCtx)
  *                   The status code is returned. NULL if there is no I/O context
  *                   to return the status code for.
  */
-static int vdDiskProcessWaitingIoCtx(PVBOXHDD pDisk, PVDIOCTX pIoCtxRc)
+static int vdDiskProcessWaitingIoCtxList(PVBOXHDD pDisk, volatile PVDIOCTX *ppList, PVDIOCTX pIoCtxRc)
 {
     int rc = VERR_VD_ASYNC_IO_IN_PROGRESS;
 
-    LogFlowFunc(("pDisk=%#p pIoCtxRc=%#p\n", pDisk, pIoCtxRc));
+    LogFlowFunc(("pDisk=%#p ppList=%#p pIoCtxRc=%#p\n", pDisk, ppList, pIoCtxRc));
 
     VD_IS_LOCKED(pDisk);
 
     /* Get the waiting list and process it in FIFO order. */
-    PVDIOCTX pIoCtxHead = ASMAtomicXchgPtrT(&pDisk->pIoCtxHead, NULL, PVDIOCTX);
+    PVDIOCTX pIoCtxHead = ASMAtomicXchgPtrT(ppList, NULL, PVDIOCTX);
+    if (!pIoCtxHead)
+        return rc;
 
     /* Reverse it. */
     PVDIOCTX pCur = pIoCtxHead;
@@ -1831,8 +2121,7 @@ static int vdDiskProcessWaitingIoCtx(PVBOXHDD pDisk, PVDIOCTX pIoCtxRc)
         {
             LogFlowFunc(("Waiting I/O context completed pTmp=%#p\n", pTmp));
             vdThreadFinishWrite(pDisk);
-            vdIoCtxRootComplete(pDisk, pTmp);
-            vdIoCtxFree(pDisk, pTmp);
+            vdIoCtxRootCompleteFree(pDisk, pTmp);
         }
     }
 
@@ -1840,6 +2129,116 @@ static int vdDiskProcessWaitingIoCtx(PVBOXHDD pDisk, PVDIOCTX pIoCtxRc)
     return rc;
 }
 
+/**
+ * Processes the lists of waiting I/O contexts of the disk and all I/O queues.
+ *
+ * @returns VBox status code, only valid if pIoCtxRc is not NULL, treat as void
+ *          function otherwise.
+ * @param   pDisk    The disk structure.
+ * @param   pIoCtxRc An I/O context handle which waits on one of the lists. When
+ *                   processed the status code is returned. NULL if there is no
+ *                   I/O context to return the status code for.
+ */
+static int vdDiskProcessWaitingIoCtx(PVBOXHDD pDisk, PVDIOCTX pIoCtxRc)
+{
+    VD_IS_LOCKED(pDisk);
+
+    int rc = vdDiskProcessWaitingIoCtxList(pDisk, &pDisk->pIoCtxHead, pIoCtxRc);
+
+    /* Start with a different queue every time so a busy queue can't starve the others. */
+    uint32_t const cIoQueues = pDisk->cIoQueues;
+    if (cIoQueues)
+    {
+        uint32_t iIoQueue = pDisk->iIoQueueNext;
+        pDisk->iIoQueueNext = (iIoQueue + 1) % cIoQueues;
+
+        for (uint32_t i = 0; i < cIoQueues; i++)
+        {
+            int rcQueue = vdDiskProcessWaitingIoCtxList(pDisk, &pDisk->paIoQueues[iIoQueue].pIoCtxHead,
+                                                        pIoCtxRc);
+            if (   pIoCtxRc
+                && pIoCtxRc->pIoQueue == &pDisk->paIoQueues[iIoQueue])
+                rc = rcQueue;
+            iIoQueue = (iIoQueue + 1) % cIoQueues;
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * Returns whether there are new I/O contexts waiting on one of the I/O queues.
+ *
+ * @returns true if there are I/O contexts waiting, false otherwise.
+ * @param   paIoQueues  The I/O queue array of the disk.
+ * @param   cIoQueues   Number of entries in the array.
+ */
+DECLINLINE(bool) vdDiskIoQueuesPending(PVDIOQUEUE paIoQueues, uint32_t cIoQueues)
+{
+    for (uint32_t i = 0; i < cIoQueues; i++)
+        if (ASMAtomicUoReadPtrT(&paIoQueues[i].pIoCtxHead, PVDIOCTX) != NULL)
+            return true;
+    return false;
+}
+
+/**
+ * Calls the completion callbacks of all I/O contexts which finished on one of
+ * the I/O queues. Must be called without the disk lock held.
+ *
+ * Every queue is drained by one thread at a time while different queues can
+ * be completed by different threads concurrently.
+ *
+ * The caller has to hold a reference to the I/O queue array, see
+ * VBOXHDD::cIoQueueRefs.
+ *
+ * @returns nothing.
+ * @param   pDisk       The disk structure.
+ * @param   paIoQueues  The I/O queue array of the disk.
+ * @param   cIoQueues   Number of entries in the array.
+ */
+static void vdDiskIoQueuesComplete(PVBOXHDD pDisk, PVDIOQUEUE paIoQueues, uint32_t cIoQueues)
+{
+    for (uint32_t i = 0; i < cIoQueues; i++)
+    {
+        PVDIOQUEUE pIoQueue = &paIoQueues[i];
+
+        /* Check again after releasing the queue, another thread might have added contexts in between. */
+        while (   ASMAtomicUoReadPtrT(&pIoQueue->pIoCtxCompletedHead, PVDIOCTX) != NULL
+               && ASMAtomicCmpXchgBool(&pIoQueue->fCompleting, true, false))
+        {
+            PVDIOCTX pIoCtxHead = ASMAtomicXchgPtrT(&pIoQueue->pIoCtxCompletedHead, NULL, PVDIOCTX);
+
+            /* Reverse it to complete in FIFO order. */
+            PVDIOCTX pCur = pIoCtxHead;
+            pIoCtxHead = NULL;
+            while (pCur)
+            {
+                PVDIOCTX pInsert = pCur;
+                pCur = pCur->pIoCtxNext;
+                pInsert->pIoCtxNext = pIoCtxHead;
+                pIoCtxHead = pInsert;
+            }
+
+            pCur = pIoCtxHead;
+            while (pCur)
+            {
+                PVDIOCTX pTmp = pCur;
+
+                pCur = pCur->pIoCtxNext;
+                pTmp->pIoCtxNext = NULL;
+
+                LogFlowFunc(("Queued I/O context completed pTmp=%#p rcReq=%Rrc\n", pTmp, pTmp->rcReq));
+                pTmp->Type.Root.pfnComplete(pTmp->Type.Root.pvUser1,
+                                            pTmp->Type.Root.pvUser2,
+                                            pTmp->rcReq);
+                vdIoCtxFree(pDisk, pTmp);
+            }
+
+            ASMAtomicXchgBool(&pIoQueue->fCompleting, false);
+        }
+    }
+}
+
 /**
  * Processes the list of blocked I/O contexts.
  *
@@ -1886,8 +2285,7 @@ static void vdDiskProcessBlockedIoCtx(PVBOXHDD pDisk)
         {
             LogFlowFunc(("Waiting I/O context completed pTmp=%#p\n", pTmp));
             vdThreadFinishWrite(pDisk);
-            vdIoCtxRootComplete(pDisk, pTmp);
-            vdIoCtxFree(pDisk, pTmp);
+            vdIoCtxRootCompleteFree(pDisk, pTmp);
         }
     }
 
@@ -1909,7 +2307,9 @@ static int vdIoCtxProcessTryLockDefer(PVDIOCTX pIoCtx)
     Log(("Defer pIoCtx=%#p\n", pIoCtx));
 
     /* Put it on the waiting list first. */
-    vdIoCtxAddToWaitingList(&pDisk->pIoCtxHead, pIoCtx);
+    vdIoCtxAddToWaitingList(  pIoCtx->pIoQueue
+                            ? &pIoCtx->pIoQueue->pIoCtxHead
+                            : &pDisk->pIoCtxHead, pIoCtx);
 
     if (ASMAtomicCmpXchgBool(&pDisk->fLocked, true, false))
     {
@@ -2045,6 +2445,52 @@ static int vdDiskReadHelper(PVBOXHDD pDisk, PVDIMAGE pImage, PVDIMAGE pImagePare
     return rc;
 }
 
+/**
+ * internal: writes the data of a read which missed the cache back into the
+ * cache after all reads from the image chain completed - async version.
+ */
+static DECLCALLBACK(int) vdReadHelperCacheUpdateAsync(PVDIOCTX pIoCtx)
+{
+    int rc = VINF_SUCCESS;
+    PVBOXHDD pDisk = pIoCtx->pDisk;
+    uint64_t uOffset = pIoCtx->Req.Io.uOffsetCacheUpdate;
+    size_t cbUpdate = pIoCtx->Req.Io.cbCacheUpdate;
+
+    /* Wait until the data arrived, we are called again when a transfer completes. */
+    if (pIoCtx->cDataTransfersPending)
+        return VERR_VD_ASYNC_IO_IN_PROGRESS;
+
+    pIoCtx->Req.Io.cbCacheUpdate = 0;
+
+    /*
+     * Skip the update if the read failed, a write or discard touched the cache
+     * in the meantime or the cache was closed.
+     */
+    if (   RT_SUCCESS(pIoCtx->rcReq)
+        && pDisk->pCache
+        && pIoCtx->Req.Io.uCacheGeneration == pDisk->uCacheGeneration
+        && (pIoCtx->fFlags & VDIOCTX_FLAGS_ZERO_FREE_BLOCKS))
+    {
+        LogFlowFunc(("pIoCtx=%#p uOffset=%llu cbUpdate=%zu\n", pIoCtx, uOffset, cbUpdate));
+
+        /* Position the S/G buffer at the start of the range, the cache consumes it. */
+        RTSgBufReset(&pIoCtx->Req.Io.SgBuf);
+        RTSgBufAdvance(&pIoCtx->Req.Io.SgBuf, uOffset - pIoCtx->Req.Io.uOffsetXferOrig);
+        ASMAtomicWriteU32(&pIoCtx->Req.Io.cbTransferLeft, (uint32_t)cbUpdate);
+
+        /*
+         * Failing to update the cache is not fatal for the read, the data
+         * is just fetched from the image again the next time.
+         */
+        rc = vdCacheWriteHelper(pDisk->pCache, uOffset, cbUpdate, pIoCtx, NULL);
+        if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+            LogFlowFunc(("Updating the cache failed with %Rrc\n", rc));
+        rc = VINF_SUCCESS;
+    }
+
+    return rc;
+}
+
 /**
  * internal: read the specified amount of data in whatever blocks the backend
  * will give us - async version.
@@ -2094,12 +2540,23 @@ static DECLCALLBACK(int) vdReadHelperAsync(PVDIOCTX pIoCtx)
                 rc = vdDiskReadHelper(pDisk, pCurrImage, NULL, uOffset, cbThisRead,
                                       pIoCtx, &cbThisRead);
 
-                /* If the read was successful, write the data back into the cache. */
-                if (   RT_SUCCESS(rc)
-                    && pIoCtx->fFlags & VDIOCTX_FLAGS_READ_UPDATE_CACHE)
+                /*
+                 * Remember the range to write back into the cache once all reads
+                 * completed, the data is not there yet when reading asynchronously.
+                 */
+                if (   (   RT_SUCCESS(rc)
+                        || rc == VERR_VD_ASYNC_IO_IN_PROGRESS
+                        || rc == VERR_VD_BLOCK_FREE)
+                    && (pIoCtx->fFlags & VDIOCTX_FLAGS_READ_UPDATE_CACHE)
+                    && pIoCtx->enmTxDir == VDIOCTXTXDIR_READ
+                    && !pIoCtx->pIoCtxParent)
                 {
-                    rc = vdCacheWriteHelper(pDisk->pCache, uOffset, cbThisRead,
-                                            pIoCtx, NULL);
+                    if (!pIoCtx->Req.Io.cbCacheUpdate)
+                    {
+                        pIoCtx->Req.Io.uOffsetCacheUpdate = uOffset;
+                        pIoCtx->Req.Io.uCacheGeneration   = pDisk->uCacheGeneration;
+                    }
+                    pIoCtx->Req.Io.cbCacheUpdate = uOffset + cbThisRead - pIoCtx->Req.Io.uOffsetCacheUpdate;
                 }
             }
         }
@@ -2194,8 +2651,16 @@ static DECLCALLBACK(int) vdReadHelperAsync(PVDIOCTX pIoCtx)
         pIoCtx->Req.Io.cbTransfer = cbToRead;
         pIoCtx->Req.Io.pImageCur  = pCurrImage ? pCurrImage : pIoCtx->Req.Io.pImageStart;
     }
-
-    return (!(pIoCtx->fFlags & VDIOCTX_FLAGS_ZERO_FREE_BLOCKS))
+    else if (   RT_SUCCESS(rc)
+             && !cbToRead
+             && pIoCtx->Req.Io.cbCacheUpdate
+             && !pIoCtx->pfnIoCtxTransferNext)
+        pIoCtx->pfnIoCtxTransferNext = vdReadHelperCacheUpdateAsync;
+
+    /* Only report the whole range as free if nothing failed or is still outstanding. */
+    return (   RT_SUCCESS(rc)
+            && !cbToRead
+            && !(pIoCtx->fFlags & VDIOCTX_FLAGS_ZERO_FREE_BLOCKS))
            ? VERR_VD_BLOCK_FREE
            : rc;
 }
@@ -2404,159 +2869,838 @@ static int vdWriteHelper(PVBOXHDD pDisk, PVDIMAGE pImage, uint64_t uOffset,
 }
 
 /**
- * Internal: Copies the content of one disk to another one applying optimizations
- * to speed up the copy process if possible.
+ * State of a transfer of the copy/merge engine.
+ */
+typedef enum VDCOPYREQSTATE
+{
+    /** Invalid state. */
+    VDCOPYREQSTATE_INVALID = 0,
+    /** The transfer is not in use. */
+    VDCOPYREQSTATE_FREE,
+    /** Reading the chunk from the source. */
+    VDCOPYREQSTATE_READING,
+    /** Reading the chunk completed. */
+    VDCOPYREQSTATE_READ_DONE,
+    /** Writing a range of the chunk to the destination. */
+    VDCOPYREQSTATE_WRITING,
+    /** Writing the range completed. */
+    VDCOPYREQSTATE_WRITE_DONE,
+    /** 32bit hack. */
+    VDCOPYREQSTATE_32BIT_HACK = 0x7fffffff
+} VDCOPYREQSTATE;
+
+/** The range can be skipped when writing because it is free in all searched images. */
+#define VDCOPY_F_SKIP_FREE          RT_BIT_32(0)
+/** The range can be skipped when writing because it is allocated in the first image. */
+#define VDCOPY_F_SKIP_ALLOCATED     RT_BIT_32(1)
+
+/** Forward declaration of a copy/merge worker. */
+typedef struct VDCOPYWORKER *PVDCOPYWORKER;
+
+/**
+ * A transfer of the copy/merge engine, reading one chunk from the source
+ * and writing the parts which need it to the destination.
+ */
+typedef struct VDCOPYREQ
+{
+    /** The worker owning the transfer. */
+    PVDCOPYWORKER           pWorker;
+    /** Current state. */
+    volatile VDCOPYREQSTATE enmState;
+    /** Status code of the last completed I/O context. */
+    volatile int            rcReq;
+    /** Start offset of the chunk on the disk. */
+    uint64_t                uOffset;
+    /** Size of the chunk. */
+    size_t                  cbChunk;
+    /** Offset of the range currently written, relative to the chunk start. */
+    size_t                  offWrite;
+    /** Size of the range currently written. */
+    size_t                  cbWrite;
+    /** Segment describing the buffer for the current I/O context. */
+    RTSGSEG                 Seg;
+    /** The chunk buffer. */
+    uint8_t                *pbBuf;
+    /** Bitmap of sectors not needing a write, one bit for every 512 bytes. */
+    uint32_t               *pbmSkip;
+} VDCOPYREQ, *PVDCOPYREQ;
+
+/**
+ * Copy/merge operation state shared by all workers.
+ */
+typedef struct VDCOPYSTATE
+{
+    /** Disk to read from. */
+    PVBOXHDD                pDiskFrom;
+    /** Image to start reading at. */
+    PVDIMAGE                pImageFrom;
+    /** First image not searched for data anymore, NULL to search the whole chain. */
+    PVDIMAGE                pImageFromStop;
+    /** Flags for the skip detection, VDCOPY_F_XXX. */
+    uint32_t                fFlags;
+    /** Disk to write to. */
+    PVBOXHDD                pDiskTo;
+    /** Image to write to. */
+    PVDIMAGE                pImageTo;
+    /** Parent image override for the reads of the writes, NULL for none. */
+    PVDIMAGE                pImageToParentOverride;
+    /** Number of images the writes read from until cut off, 0 for the whole chain. */
+    unsigned                cImagesToRead;
+    /** VDIOCTX_FLAGS_XXX for the write I/O contexts. */
+    uint32_t                fIoCtxWrite;
+    /** Flag whether to use synchronous I/O contexts. */
+    bool                    fSync;
+    /** Size of one chunk. */
+    size_t                  cbChunk;
+    /** Number of transfers in flight per worker. */
+    unsigned                cReqs;
+    /** Number of workers. */
+    unsigned                cWorkers;
+    /** Number of bytes to process. */
+    uint64_t                cbSize;
+    /** Number of bytes processed so far. */
+    volatile uint64_t       cbDone;
+    /** Status code of the operation, the first error stops all workers. */
+    volatile int32_t        rc;
+    /** Progress interface for the source, optional. */
+    PVDINTERFACEPROGRESS    pIfProgress;
+    /** Progress interface for the destination, optional. */
+    PVDINTERFACEPROGRESS    pDstIfProgress;
+    /** Critical section serializing the progress reports. */
+    RTCRITSECT              CritSectProgress;
+    /** Last reported progress in percent. */
+    unsigned                uPercentLast;
+} VDCOPYSTATE, *PVDCOPYSTATE;
+
+/**
+ * A worker of the copy/merge engine, processing one stripe of the disk.
+ */
+typedef struct VDCOPYWORKER
+{
+    /** The shared operation state. */
+    PVDCOPYSTATE            pState;
+    /** Start offset of the stripe. */
+    uint64_t                uOffsetStart;
+    /** First offset after the stripe. */
+    uint64_t                uOffsetEnd;
+    /** Start offset of the next chunk to process. */
+    uint64_t                uOffsetNext;
+    /** Event semaphore signalled when an I/O context completed. */
+    RTSEMEVENT              hEvtComplete;
+    /** Thread handle, NIL_RTTHREAD if running on the caller thread. */
+    RTTHREAD                hThread;
+    /** Status code of the worker. */
+    int                     rc;
+    /** The transfers - variable in size. */
+    VDCOPYREQ               aReqs[1];
+} VDCOPYWORKER;
+
+/**
+ * Checks whether all images from the given one down to the base can be
+ * accessed with asynchronous I/O contexts in any order.
+ *
+ * @returns true if async I/O contexts can be used, false otherwise.
+ * @param   pDisk       The disk.
+ * @param   pImage      The image to start with.
  */
-static int vdCopyHelper(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, PVBOXHDD pDiskTo,
-                        uint64_t cbSize, unsigned cImagesFromRead, unsigned cImagesToRead,
-                        bool fSuppressRedundantIo, PVDINTERFACEPROGRESS pIfProgress,
-                        PVDINTERFACEPROGRESS pDstIfProgress)
+static bool vdCopyIsAsyncCapable(PVBOXHDD pDisk, PVDIMAGE pImage)
 {
-    int rc = VINF_SUCCESS;
-    int rc2;
-    uint64_t uOffset = 0;
-    uint64_t cbRemaining = cbSize;
-    void *pvBuf = NULL;
-    bool fLockReadFrom = false;
-    bool fLockWriteTo = false;
-    bool fBlockwiseCopy = false;
-    unsigned uProgressOld = 0;
-
-    LogFlowFunc(("pDiskFrom=%#p pImageFrom=%#p pDiskTo=%#p cbSize=%llu cImagesFromRead=%u cImagesToRead=%u fSuppressRedundantIo=%RTbool pIfProgress=%#p pDstIfProgress=%#p\n",
-                 pDiskFrom, pImageFrom, pDiskTo, cbSize, cImagesFromRead, cImagesToRead, fSuppressRedundantIo, pDstIfProgress, pDstIfProgress));
-
-    if (   (fSuppressRedundantIo || (cImagesFromRead > 0))
-        && RTListIsEmpty(&pDiskFrom->ListFilterChainRead))
-        fBlockwiseCopy = true;
+    if (pDisk->pInterfaceThreadSync)
+        return false;
 
-    /* Allocate tmp buffer. */
-    pvBuf = RTMemTmpAlloc(VD_MERGE_BUFFER_SIZE);
-    if (!pvBuf)
-        return rc;
-
-    do
+    for (PVDIMAGE pCurrImage = pImage; pCurrImage; pCurrImage = pCurrImage->pPrev)
     {
-        size_t cbThisRead = RT_MIN(VD_MERGE_BUFFER_SIZE, cbRemaining);
-
-        /* Note that we don't attempt to synchronize cross-disk accesses.
-         * It wouldn't be very difficult to do, just the lock order would
-         * need to be defined somehow to prevent deadlocks. Postpone such
-         * magic as there is no use case for this. */
+        unsigned uOpenFlags = pCurrImage->Backend->pfnGetOpenFlags(pCurrImage->pBackendData);
+        unsigned uImageFlags = pCurrImage->Backend->pfnGetImageFlags(pCurrImage->pBackendData);
 
-        rc2 = vdThreadStartRead(pDiskFrom);
-        AssertRC(rc2);
-        fLockReadFrom = true;
+        if (   !(pCurrImage->Backend->uBackendCaps & VD_CAP_ASYNC)
+            || (uOpenFlags & VD_OPEN_FLAGS_SEQUENTIAL)
+            || (uImageFlags & VD_VMDK_IMAGE_FLAGS_STREAM_OPTIMIZED)
+            || (   pCurrImage->VDIo.pInterfaceIo != &pCurrImage->VDIo.VDIfIo
+                && !(uOpenFlags & VD_OPEN_FLAGS_ASYNC_IO)))
+            return false;
+    }
 
-        if (fBlockwiseCopy)
-        {
-            RTSGSEG SegmentBuf;
-            RTSGBUF SgBuf;
-            VDIOCTX IoCtx;
+    if (   pDisk->pCache
+        && pDisk->pCache->VDIo.pInterfaceIo != &pDisk->pCache->VDIo.VDIfIo
+        && !(pDisk->pCache->Backend->pfnGetOpenFlags(pDisk->pCache->pBackendData) & VD_OPEN_FLAGS_ASYNC_IO))
+        return false;
 
-            SegmentBuf.pvSeg = pvBuf;
-            SegmentBuf.cbSeg = VD_MERGE_BUFFER_SIZE;
-            RTSgBufInit(&SgBuf, &SegmentBuf, 1);
-            vdIoCtxInit(&IoCtx, pDiskFrom, VDIOCTXTXDIR_READ, 0, 0, NULL,
-                        &SgBuf, NULL, NULL, VDIOCTX_FLAGS_SYNC);
+    return true;
+}
 
-            /* Read the source data. */
-            rc = pImageFrom->Backend->pfnRead(pImageFrom->pBackendData,
-                                              uOffset, cbThisRead, &IoCtx,
-                                              &cbThisRead);
+/**
+ * Sets the transfer parameters of the copy/merge engine from the per-operation
+ * configuration interface if present.
+ *
+ * @returns VBox status code.
+ * @param   pState      The copy/merge operation state.
+ * @param   pIfCfg      The configuration interface, optional.
+ */
+static int vdCopyQueryConfig(PVDCOPYSTATE pState, PVDINTERFACECONFIG pIfCfg)
+{
+    uint32_t cbChunk  = VD_COPY_CHUNK_SIZE_DEFAULT;
+    uint32_t cReqs    = VD_COPY_REQS_DEFAULT;
+    uint32_t cWorkers = 1;
+    int rc = VINF_SUCCESS;
 
-            if (   rc == VERR_VD_BLOCK_FREE
-                && cImagesFromRead != 1)
-            {
-                unsigned cImagesToProcess = cImagesFromRead;
+    if (pIfCfg)
+    {
+        rc = VDCFGQueryU32Def(pIfCfg, "CopyChunkSize", &cbChunk, VD_COPY_CHUNK_SIZE_DEFAULT);
+        if (RT_SUCCESS(rc))
+            rc = VDCFGQueryU32Def(pIfCfg, "CopyQueueDepth", &cReqs, VD_COPY_REQS_DEFAULT);
+        if (RT_SUCCESS(rc))
+            rc = VDCFGQueryU32Def(pIfCfg, "CopyThreads", &cWorkers, 1);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
 
-                for (PVDIMAGE pCurrImage = pImageFrom->pPrev;
-                     pCurrImage != NULL && rc == VERR_VD_BLOCK_FREE;
-                     pCurrImage = pCurrImage->pPrev)
-                {
-                    rc = pCurrImage->Backend->pfnRead(pCurrImage->pBackendData,
-                                                           uOffset, cbThisRead,
-                                                           &IoCtx, &cbThisRead);
-                    if (cImagesToProcess == 1)
-                        break;
-                    else if (cImagesToProcess > 0)
-                        cImagesToProcess--;
-                }
-            }
-        }
-        else
-            rc = vdReadHelper(pDiskFrom, pImageFrom, uOffset, pvBuf, cbThisRead,
-                              false /* fUpdateCache */);
+    cbChunk  = RT_MIN(RT_MAX(RT_ALIGN_32(cbChunk, _4K), _64K), VD_MERGE_BUFFER_SIZE);
+    cReqs    = RT_MIN(RT_MAX(cReqs, 1), VD_COPY_REQS_MAX);
+    cWorkers = RT_MIN(RT_MAX(cWorkers, 1), VD_COPY_THREADS_MAX);
 
-        if (RT_FAILURE(rc) && rc != VERR_VD_BLOCK_FREE)
-            break;
+    /* Synchronous I/O contexts complete inline, more than one transfer doesn't gain anything. */
+    if (pState->fSync)
+    {
+        cReqs    = 1;
+        cWorkers = 1;
+    }
 
-        rc2 = vdThreadFinishRead(pDiskFrom);
-        AssertRC(rc2);
-        fLockReadFrom = false;
+    /* Don't create more stripes than there are chunks. */
+    uint64_t cChunks = (pState->cbSize + cbChunk - 1) / cbChunk;
+    cWorkers = (uint32_t)RT_MIN(cWorkers, RT_MAX(cChunks, 1));
 
-        if (rc != VERR_VD_BLOCK_FREE)
-        {
-            rc2 = vdThreadStartWrite(pDiskTo);
-            AssertRC(rc2);
-            fLockWriteTo = true;
+    /* Limit the memory used for the buffers. */
+    if ((uint64_t)cbChunk * cReqs * cWorkers > VD_COPY_BUFFER_MAX)
+        cReqs = RT_MAX(VD_COPY_BUFFER_MAX / ((uint64_t)cbChunk * cWorkers), 1);
 
-            /* Only do collapsed I/O if we are copying the data blockwise. */
-            rc = vdWriteHelperEx(pDiskTo, pDiskTo->pLast, NULL, uOffset, pvBuf,
-                                 cbThisRead, VDIOCTX_FLAGS_DONT_SET_MODIFIED_FLAG /* fFlags */,
-                                 fBlockwiseCopy ? cImagesToRead : 0);
-            if (RT_FAILURE(rc))
-                break;
+    pState->cbChunk  = cbChunk;
+    pState->cReqs    = cReqs;
+    pState->cWorkers = cWorkers;
+    return VINF_SUCCESS;
+}
 
-            rc2 = vdThreadFinishWrite(pDiskTo);
-            AssertRC(rc2);
-            fLockWriteTo = false;
-        }
-        else /* Don't propagate the error to the outside */
-            rc = VINF_SUCCESS;
+/**
+ * Records the status code of a copy/merge operation, keeping the first error.
+ *
+ * @returns nothing.
+ * @param   pState      The copy/merge operation state.
+ * @param   rc          The status code to record.
+ */
+DECLINLINE(void) vdCopySetError(PVDCOPYSTATE pState, int rc)
+{
+    if (RT_FAILURE(rc))
+        ASMAtomicCmpXchgS32(&pState->rc, rc, VINF_SUCCESS);
+}
 
-        uOffset += cbThisRead;
-        cbRemaining -= cbThisRead;
+/**
+ * Accounts for a processed chunk and reports the progress if it changed.
+ *
+ * @returns nothing.
+ * @param   pState      The copy/merge operation state.
+ * @param   cbChunk     Size of the processed chunk.
+ */
+static void vdCopyProgress(PVDCOPYSTATE pState, size_t cbChunk)
+{
+    uint64_t cbDone = ASMAtomicAddU64(&pState->cbDone, cbChunk) + cbChunk;
+    unsigned uPercent = (unsigned)(cbDone * 99 / pState->cbSize);
 
-        unsigned uProgressNew = uOffset * 99 / cbSize;
-        if (uProgressNew != uProgressOld)
-        {
-            uProgressOld = uProgressNew;
+    if (   !pState->pIfProgress
+        && !pState->pDstIfProgress)
+        return;
 
-            if (pIfProgress && pIfProgress->pfnProgress)
-            {
-                rc = pIfProgress->pfnProgress(pIfProgress->Core.pvUser,
-                                              uProgressOld);
-                if (RT_FAILURE(rc))
-                    break;
-            }
-            if (pDstIfProgress && pDstIfProgress->pfnProgress)
-            {
-                rc = pDstIfProgress->pfnProgress(pDstIfProgress->Core.pvUser,
-                                                 uProgressOld);
-                if (RT_FAILURE(rc))
-                    break;
-            }
-        }
-    } while (uOffset < cbSize);
+    RTCritSectEnter(&pState->CritSectProgress);
+    if (uPercent > pState->uPercentLast)
+    {
+        int rc = VINF_SUCCESS;
 
-    RTMemFree(pvBuf);
+        pState->uPercentLast = uPercent;
+        if (pState->pIfProgress && pState->pIfProgress->pfnProgress)
+            rc = pState->pIfProgress->pfnProgress(pState->pIfProgress->Core.pvUser, uPercent);
+        if (   RT_SUCCESS(rc)
+            && pState->pDstIfProgress
+            && pState->pDstIfProgress->pfnProgress)
+            rc = pState->pDstIfProgress->pfnProgress(pState->pDstIfProgress->Core.pvUser, uPercent);
 
-    if (fLockReadFrom)
-    {
-        rc2 = vdThreadFinishRead(pDiskFrom);
-        AssertRC(rc2);
+        /* Cancellation by the user. */
+        vdCopySetError(pState, rc);
     }
+    RTCritSectLeave(&pState->CritSectProgress);
+}
 
-    if (fLockWriteTo)
-    {
-        rc2 = vdThreadFinishWrite(pDiskTo);
-        AssertRC(rc2);
+/**
+ * I/O context transfer function reading a chunk for the copy/merge engine.
+ *
+ * Only the images from the start image down to the stop image are searched
+ * and the ranges which don't need to be written to the destination are marked
+ * in the skip bitmap of the transfer.
+ *
+ * @returns VBox status code.
+ * @param   pIoCtx      The I/O context.
+ */
+static DECLCALLBACK(int) vdCopyReadHelperAsync(PVDIOCTX pIoCtx)
+{
+    int rc = VINF_SUCCESS;
+    PVBOXHDD pDisk        = pIoCtx->pDisk;
+    PVDCOPYREQ pReq       = (PVDCOPYREQ)pIoCtx->Type.Root.pvUser2;
+    PVDCOPYSTATE pState   = pReq->pWorker->pState;
+    size_t cbToRead       = pIoCtx->Req.Io.cbTransfer;
+    uint64_t uOffset      = pIoCtx->Req.Io.uOffset;
+    PVDIMAGE pCurrImage   = pIoCtx->Req.Io.pImageCur;
+    size_t cbThisRead     = 0;
+
+    /* Defer the read if it interferes with a block allocation in progress. */
+    if (   pDisk->pIoCtxLockOwner != NIL_VDIOCTX
+        && uOffset < pDisk->uOffsetEndLocked
+        && uOffset + cbToRead > pDisk->uOffsetStartLocked)
+    {
+        Log(("Interferring read while allocating a new block => deferring read\n"));
+        vdIoCtxDefer(pDisk, pIoCtx);
+        return VERR_VD_ASYNC_IO_IN_PROGRESS;
+    }
+
+    while (cbToRead)
+    {
+        bool fSkip = false;
+
+        /* Search for the image with the data. Do not attempt to read more
+         * than the previous reads marked as valid. Otherwise this would return
+         * stale data when different block sizes are used for the images. */
+        cbThisRead = cbToRead;
+        rc = VERR_VD_BLOCK_FREE;
+        while (   pCurrImage
+               && pCurrImage != pState->pImageFromStop
+               && rc == VERR_VD_BLOCK_FREE)
+        {
+            rc = pCurrImage->Backend->pfnRead(pCurrImage->pBackendData, uOffset, cbThisRead,
+                                              pIoCtx, &cbThisRead);
+            if (rc == VERR_VD_BLOCK_FREE)
+                pCurrImage = pCurrImage->pPrev;
+        }
+
+        if (rc == VERR_VD_BLOCK_FREE)
+        {
+            /* No searched image contains the data, zero the range in the buffer. */
+            ASMAtomicSubU32(&pIoCtx->Req.Io.cbTransferLeft, (uint32_t)cbThisRead); Assert(cbThisRead == (uint32_t)cbThisRead);
+            vdIoCtxSet(pIoCtx, '\0', cbThisRead);
+            fSkip = RT_BOOL(pState->fFlags & VDCOPY_F_SKIP_FREE);
+            rc = VINF_SUCCESS;
+        }
+        else if (   RT_SUCCESS(rc)
+                 || rc == VERR_VD_ASYNC_IO_IN_PROGRESS
+                 || rc == VERR_VD_IOCTX_HALT)
+        {
+            fSkip =    (pState->fFlags & VDCOPY_F_SKIP_ALLOCATED)
+                    && pCurrImage == pIoCtx->Req.Io.pImageStart;
+            if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+                rc = VINF_SUCCESS;
+        }
+
+        if (fSkip)
+        {
+            uint64_t offChunk = uOffset - pReq->uOffset;
+            ASMBitSetRange(pReq->pbmSkip, (int32_t)(offChunk / 512),
+                           (int32_t)((offChunk + cbThisRead) / 512));
+        }
+
+        if (rc == VERR_VD_IOCTX_HALT)
+        {
+            uOffset  += cbThisRead;
+            cbToRead -= cbThisRead;
+            pCurrImage = pIoCtx->Req.Io.pImageStart;
+            pIoCtx->fFlags |= VDIOCTX_FLAGS_BLOCKED;
+        }
+
+        if (RT_FAILURE(rc))
+            break;
+
+        uOffset  += cbThisRead;
+        cbToRead -= cbThisRead;
+        pCurrImage = pIoCtx->Req.Io.pImageStart; /* Start with the highest image again. */
+    }
+
+    if (   rc == VERR_VD_NOT_ENOUGH_METADATA
+        || rc == VERR_VD_IOCTX_HALT)
+    {
+        /* Save the current state. */
+        pIoCtx->Req.Io.uOffset    = uOffset;
+        pIoCtx->Req.Io.cbTransfer = cbToRead;
+        pIoCtx->Req.Io.pImageCur  = pCurrImage ? pCurrImage : pIoCtx->Req.Io.pImageStart;
+    }
+
+    return rc;
+}
+
+/**
+ * Completion callback for the I/O contexts of the copy/merge engine.
+ */
+static DECLCALLBACK(void) vdCopyReqComplete(void *pvUser1, void *pvUser2, int rcReq)
+{
+    PVDCOPYWORKER pWorker = (PVDCOPYWORKER)pvUser1;
+    PVDCOPYREQ pReq = (PVDCOPYREQ)pvUser2;
+
+    pReq->rcReq = rcReq;
+    if (pReq->enmState == VDCOPYREQSTATE_READING)
+        ASMAtomicWriteU32((volatile uint32_t *)&pReq->enmState, VDCOPYREQSTATE_READ_DONE);
+    else
+    {
+        Assert(pReq->enmState == VDCOPYREQSTATE_WRITING);
+        ASMAtomicWriteU32((volatile uint32_t *)&pReq->enmState, VDCOPYREQSTATE_WRITE_DONE);
+    }
+    RTSemEventSignal(pWorker->hEvtComplete);
+}
+
+/**
+ * Starts the read or write I/O context of a copy/merge transfer, completing
+ * it right away if possible.
+ *
+ * @returns nothing, the state of the transfer is updated.
+ * @param   pReq        The transfer.
+ * @param   fWrite      Flag whether to write the current range or to read the chunk.
+ */
+static void vdCopyReqSubmit(PVDCOPYREQ pReq, bool fWrite)
+{
+    PVDCOPYWORKER pWorker = pReq->pWorker;
+    PVDCOPYSTATE pState = pWorker->pState;
+    PVBOXHDD pDisk = fWrite ? pState->pDiskTo : pState->pDiskFrom;
+    uint32_t fFlags = pState->fSync ? VDIOCTX_FLAGS_SYNC : VDIOCTX_FLAGS_DEFAULT;
+    PVDIOCTX pIoCtx;
+    RTSGBUF SgBuf;
+    int rc;
+
+    if (fWrite)
+    {
+        pReq->Seg.pvSeg = pReq->pbBuf + pReq->offWrite;
+        pReq->Seg.cbSeg = pReq->cbWrite;
     }
+    else
+    {
+        pReq->Seg.pvSeg = pReq->pbBuf;
+        pReq->Seg.cbSeg = pReq->cbChunk;
+        ASMBitClearRange(pReq->pbmSkip, 0, (int32_t)(pReq->cbChunk / 512));
+    }
+    RTSgBufInit(&SgBuf, &pReq->Seg, 1);
+
+    ASMAtomicWriteU32((volatile uint32_t *)&pReq->enmState,
+                      fWrite ? VDCOPYREQSTATE_WRITING : VDCOPYREQSTATE_READING);
+
+    if (fWrite)
+    {
+        rc = vdThreadStartWrite(pDisk);
+        AssertRC(rc);
+        pIoCtx = vdIoCtxRootAlloc(pDisk, VDIOCTXTXDIR_WRITE, pReq->uOffset + pReq->offWrite,
+                                  pReq->cbWrite, pState->pImageTo, &SgBuf,
+                                  vdCopyReqComplete, pWorker, pReq, NULL,
+                                  vdWriteHelperAsync, fFlags | pState->fIoCtxWrite);
+        if (pIoCtx)
+        {
+            pIoCtx->Req.Io.pImageParentOverride = pState->pImageToParentOverride;
+            pIoCtx->Req.Io.cImagesRead          = pState->cImagesToRead;
+        }
+    }
+    else
+    {
+        rc = vdThreadStartRead(pDisk);
+        AssertRC(rc);
+        pIoCtx = vdIoCtxRootAlloc(pDisk, VDIOCTXTXDIR_READ, pReq->uOffset, pReq->cbChunk,
+                                  pState->pImageFrom, &SgBuf, vdCopyReqComplete, pWorker,
+                                  pReq, NULL, vdCopyReadHelperAsync, fFlags);
+        if (pIoCtx)
+            pIoCtx->Req.Io.cImagesRead = 0;
+    }
+
+    if (pIoCtx)
+    {
+        rc = vdIoCtxProcessTryLockDefer(pIoCtx);
+        if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            return; /* The completion callback takes care of the rest. */
+
+        if (rc == VINF_VD_ASYNC_IO_FINISHED)
+        {
+            if (!ASMAtomicCmpXchgBool(&pIoCtx->fComplete, true, false))
+                return; /* Let the other handler complete the request. */
+            rc = pIoCtx->rcReq;
+        }
+        vdIoCtxFree(pDisk, pIoCtx);
+    }
+    else
+        rc = VERR_NO_MEMORY;
+
+    if (fWrite)
+        vdThreadFinishWrite(pDisk);
+    else
+        vdThreadFinishRead(pDisk);
+
+    pReq->rcReq = rc;
+    ASMAtomicWriteU32((volatile uint32_t *)&pReq->enmState,
+                      fWrite ? VDCOPYREQSTATE_WRITE_DONE : VDCOPYREQSTATE_READ_DONE);
+}
+
+/**
+ * Determines the next range of the chunk which needs to be written.
+ *
+ * @returns true if there is a range to write, false if the chunk is done.
+ * @param   pReq        The transfer, offWrite and cbWrite are updated.
+ */
+static bool vdCopyReqNextWrite(PVDCOPYREQ pReq)
+{
+    uint32_t cSectors = (uint32_t)(pReq->cbChunk / 512);
+    uint32_t iSector = (uint32_t)((pReq->offWrite + pReq->cbWrite) / 512);
+
+    while (   iSector < cSectors
+           && ASMBitTest(pReq->pbmSkip, iSector))
+        iSector++;
+
+    uint32_t iSectorEnd = iSector;
+    while (   iSectorEnd < cSectors
+           && !ASMBitTest(pReq->pbmSkip, iSectorEnd))
+        iSectorEnd++;
+
+    pReq->offWrite = (size_t)iSector * 512;
+    pReq->cbWrite  = (size_t)(iSectorEnd - iSector) * 512;
+    return pReq->cbWrite != 0;
+}
+
+/**
+ * Advances a copy/merge transfer as far as possible without waiting.
+ *
+ * @returns nothing.
+ * @param   pReq        The transfer.
+ */
+static void vdCopyReqAdvance(PVDCOPYREQ pReq)
+{
+    PVDCOPYWORKER pWorker = pReq->pWorker;
+    PVDCOPYSTATE pState = pWorker->pState;
+
+    for (;;)
+    {
+        switch (ASMAtomicReadU32((volatile uint32_t *)&pReq->enmState))
+        {
+            case VDCOPYREQSTATE_FREE:
+            {
+                if (   pWorker->uOffsetNext >= pWorker->uOffsetEnd
+                    || RT_FAILURE(ASMAtomicReadS32(&pState->rc)))
+                    return;
+
+                pReq->uOffset  = pWorker->uOffsetNext;
+                pReq->cbChunk  = (size_t)RT_MIN(pState->cbChunk, pWorker->uOffsetEnd - pReq->uOffset);
+                pReq->offWrite = 0;
+                pReq->cbWrite  = 0;
+                pWorker->uOffsetNext += pReq->cbChunk;
+                vdCopyReqSubmit(pReq, false /* fWrite */);
+                break;
+            }
+            case VDCOPYREQSTATE_READ_DONE:
+            case VDCOPYREQSTATE_WRITE_DONE:
+            {
+                if (RT_FAILURE(pReq->rcReq))
+                {
+                    vdCopySetError(pState, pReq->rcReq);
+                    ASMAtomicWriteU32((volatile uint32_t *)&pReq->enmState, VDCOPYREQSTATE_FREE);
+                    return;
+                }
+
+                /* Write the next range needing it or finish the chunk. */
+                if (   RT_SUCCESS(ASMAtomicReadS32(&pState->rc))
+                    && vdCopyReqNextWrite(pReq))
+                    vdCopyReqSubmit(pReq, true /* fWrite */);
+                else
+                {
+                    vdCopyProgress(pState, pReq->cbChunk);
+                    ASMAtomicWriteU32((volatile uint32_t *)&pReq->enmState, VDCOPYREQSTATE_FREE);
+                }
+                break;
+            }
+            case VDCOPYREQSTATE_READING:
+            case VDCOPYREQSTATE_WRITING:
+                return; /* Wait for the completion. */
+            default:
+                AssertMsgFailedReturnVoid(("Invalid state %d\n", pReq->enmState));
+        }
+    }
+}
+
+/**
+ * Processes the stripe of a copy/merge worker until everything was written
+ * or an error occurred.
+ *
+ * @returns nothing, the status is recorded in the operation state.
+ * @param   pWorker     The worker.
+ */
+static void vdCopyWorkerProcess(PVDCOPYWORKER pWorker)
+{
+    PVDCOPYSTATE pState = pWorker->pState;
+
+    for (;;)
+    {
+        bool fActive = false;
+
+        for (unsigned i = 0; i < pState->cReqs; i++)
+        {
+            PVDCOPYREQ pReq = &pWorker->aReqs[i];
+
+            vdCopyReqAdvance(pReq);
+            if (ASMAtomicReadU32((volatile uint32_t *)&pReq->enmState) != VDCOPYREQSTATE_FREE)
+                fActive = true;
+        }
+
+        /* Done if nothing is in flight anymore, new chunks are started above. */
+        if (!fActive)
+            break;
+
+        RTSemEventWait(pWorker->hEvtComplete, RT_INDEFINITE_WAIT);
+    }
+}
+
+/**
+ * Copy/merge worker thread.
+ *
+ * @returns VINF_SUCCESS.
+ * @param   hThread     The thread handle.
+ * @param   pvUser      The worker.
+ */
+static DECLCALLBACK(int) vdCopyWorkerThread(RTTHREAD hThread, void *pvUser)
+{
+    RT_NOREF1(hThread);
+    vdCopyWorkerProcess((PVDCOPYWORKER)pvUser);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Frees a copy/merge worker.
+ *
+ * @returns nothing.
+ * @param   pWorker     The worker to free.
+ */
+static void vdCopyWorkerFree(PVDCOPYWORKER pWorker)
+{
+    for (unsigned i = 0; i < pWorker->pState->cReqs; i++)
+    {
+        if (pWorker->aReqs[i].pbBuf)
+            RTMemPageFree(pWorker->aReqs[i].pbBuf, pWorker->pState->cbChunk);
+        if (pWorker->aReqs[i].pbmSkip)
+            RTMemFree(pWorker->aReqs[i].pbmSkip);
+    }
+    if (pWorker->hEvtComplete != NIL_RTSEMEVENT)
+        RTSemEventDestroy(pWorker->hEvtComplete);
+    RTMemFree(pWorker);
+}
+
+/**
+ * Allocates a copy/merge worker for the given stripe.
+ *
+ * @returns VBox status code.
+ * @param   pState          The copy/merge operation state.
+ * @param   uOffsetStart    Start offset of the stripe.
+ * @param   uOffsetEnd      First offset after the stripe.
+ * @param   ppWorker        Where to store the worker on success.
+ */
+static int vdCopyWorkerAlloc(PVDCOPYSTATE pState, uint64_t uOffsetStart, uint64_t uOffsetEnd,
+                             PVDCOPYWORKER *ppWorker)
+{
+    PVDCOPYWORKER pWorker = (PVDCOPYWORKER)RTMemAllocZ(RT_OFFSETOF(VDCOPYWORKER, aReqs[pState->cReqs]));
+    if (!pWorker)
+        return VERR_NO_MEMORY;
+
+    pWorker->pState       = pState;
+    pWorker->uOffsetStart = uOffsetStart;
+    pWorker->uOffsetEnd   = uOffsetEnd;
+    pWorker->uOffsetNext  = uOffsetStart;
+    pWorker->hEvtComplete = NIL_RTSEMEVENT;
+    pWorker->hThread      = NIL_RTTHREAD;
+
+    int rc = RTSemEventCreate(&pWorker->hEvtComplete);
+    for (unsigned i = 0; i < pState->cReqs && RT_SUCCESS(rc); i++)
+    {
+        PVDCOPYREQ pReq = &pWorker->aReqs[i];
+
+        pReq->pWorker  = pWorker;
+        pReq->enmState = VDCOPYREQSTATE_FREE;
+        pReq->pbBuf    = (uint8_t *)RTMemPageAlloc(pState->cbChunk);
+        pReq->pbmSkip  = (uint32_t *)RTMemAllocZ(RT_ALIGN_Z(pState->cbChunk / 512, 32) / 8);
+        if (   !pReq->pbBuf
+            || !pReq->pbmSkip)
+            rc = VERR_NO_MEMORY;
+    }
+
+    if (RT_SUCCESS(rc))
+        *ppWorker = pWorker;
+    else
+        vdCopyWorkerFree(pWorker);
+    return rc;
+}
+
+/**
+ * Runs a copy/merge operation, keeping several transfers in flight and
+ * optionally splitting the disk into stripes processed by separate threads.
+ *
+ * @returns VBox status code.
+ * @param   pState      The prepared copy/merge operation state.
+ */
+static int vdCopyEngineRun(PVDCOPYSTATE pState)
+{
+    PVDCOPYWORKER apWorkers[VD_COPY_THREADS_MAX];
+    uint64_t cbStripe = RT_ALIGN_64((pState->cbSize + pState->cWorkers - 1) / pState->cWorkers,
+                                    pState->cbChunk);
+    unsigned cWorkers = 0;
+    int rc;
+
+    LogFlowFunc(("pState=%#p cbSize=%llu cbChunk=%zu cReqs=%u cWorkers=%u fSync=%RTbool\n",
+                 pState, pState->cbSize, pState->cbChunk, pState->cReqs, pState->cWorkers,
+                 pState->fSync));
+
+    pState->rc           = VINF_SUCCESS;
+    pState->cbDone       = 0;
+    pState->uPercentLast = 0;
+
+    if (!pState->cbSize)
+        return VINF_SUCCESS;
+
+    rc = RTCritSectInit(&pState->CritSectProgress);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    for (uint64_t uOffset = 0; uOffset < pState->cbSize && RT_SUCCESS(rc); uOffset += cbStripe)
+    {
+        rc = vdCopyWorkerAlloc(pState, uOffset, RT_MIN(uOffset + cbStripe, pState->cbSize),
+                               &apWorkers[cWorkers]);
+        if (RT_SUCCESS(rc))
+            cWorkers++;
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        /* The first stripe is processed by the calling thread. */
+        for (unsigned i = 1; i < cWorkers; i++)
+        {
+            rc = RTThreadCreateF(&apWorkers[i]->hThread, vdCopyWorkerThread, apWorkers[i], 0,
+                                 RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE, "VDCopy%u", i);
+            if (RT_FAILURE(rc))
+            {
+                apWorkers[i]->hThread = NIL_RTTHREAD;
+                vdCopySetError(pState, rc);
+                break;
+            }
+        }
+
+        vdCopyWorkerProcess(apWorkers[0]);
+
+        for (unsigned i = 1; i < cWorkers; i++)
+            if (apWorkers[i]->hThread != NIL_RTTHREAD)
+                RTThreadWait(apWorkers[i]->hThread, RT_INDEFINITE_WAIT, NULL);
+
+        rc = ASMAtomicReadS32(&pState->rc);
+    }
+
+    for (unsigned i = 0; i < cWorkers; i++)
+        vdCopyWorkerFree(apWorkers[i]);
+    RTCritSectDelete(&pState->CritSectProgress);
 
     LogFlowFunc(("returns rc=%Rrc\n", rc));
     return rc;
 }
 
+/**
+ * Internal: Copies the content of one disk to another one applying optimizations
+ * to speed up the copy process if possible.
+ */
+static int vdCopyHelper(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, PVBOXHDD pDiskTo,
+                        uint64_t cbSize, unsigned cImagesFromRead, unsigned cImagesToRead,
+                        bool fSuppressRedundantIo, PVDINTERFACEPROGRESS pIfProgress,
+                        PVDINTERFACEPROGRESS pDstIfProgress, PVDINTERFACECONFIG pIfCfg)
+{
+    int rc = VINF_SUCCESS;
+    VDCOPYSTATE State;
+
+    LogFlowFunc(("pDiskFrom=%#p pImageFrom=%#p pDiskTo=%#p cbSize=%llu cImagesFromRead=%u cImagesToRead=%u fSuppressRedundantIo=%RTbool pIfProgress=%#p pDstIfProgress=%#p\n",
+                 pDiskFrom, pImageFrom, pDiskTo, cbSize, cImagesFromRead, cImagesToRead, fSuppressRedundantIo, pIfProgress, pDstIfProgress));
+
+    RT_ZERO(State);
+    State.pDiskFrom      = pDiskFrom;
+    State.pImageFrom     = pImageFrom;
+    State.pImageFromStop = NULL;
+    State.pDiskTo        = pDiskTo;
+    State.pImageTo       = pDiskTo->pLast;
+    State.fIoCtxWrite    = VDIOCTX_FLAGS_DONT_SET_MODIFIED_FLAG;
+    State.fSync          =    !vdCopyIsAsyncCapable(pDiskFrom, pImageFrom)
+                           || !vdCopyIsAsyncCapable(pDiskTo, pDiskTo->pLast);
+    State.cbSize         = cbSize;
+    State.pIfProgress    = pIfProgress;
+    State.pDstIfProgress = pDstIfProgress;
+
+    /*
+     * Only copy the allocated ranges if the read filters don't need to see
+     * everything. Otherwise the whole disk is read with free ranges zeroed and
+     * written to the destination.
+     */
+    if (   (fSuppressRedundantIo || (cImagesFromRead > 0))
+        && RTListIsEmpty(&pDiskFrom->ListFilterChainRead))
+    {
+        State.fFlags        = VDCOPY_F_SKIP_FREE;
+        State.cImagesToRead = cImagesToRead;
+
+        /* Don't search the images having the same content as the destination. */
+        if (cImagesFromRead)
+        {
+            PVDIMAGE pImageStop = pImageFrom;
+            for (unsigned i = 0; i < cImagesFromRead && pImageStop; i++)
+                pImageStop = pImageStop->pPrev;
+            State.pImageFromStop = pImageStop;
+        }
+    }
+
+    rc = vdCopyQueryConfig(&State, pIfCfg);
+    if (RT_SUCCESS(rc))
+        rc = vdCopyEngineRun(&State);
+
+    LogFlowFunc(("returns rc=%Rrc\n", rc));
+    return rc;
+}
+
+/**
+ * Internal: Merges the allocated ranges of a part of the image chain into
+ * another image of the same disk.
+ *
+ * @returns VBox status code.
+ * @param   pDisk           The disk.
+ * @param   pImageStart     Image to start searching for data at.
+ * @param   pImageStop      First image not searched anymore, NULL for the whole chain.
+ * @param   pImageTo        Image to write to.
+ * @param   pImageParentOverride Parent override for reads of partial block writes.
+ * @param   fFlags          VDCOPY_F_XXX.
+ * @param   cbSize          Number of bytes to process.
+ * @param   pIfProgress     Progress interface, optional.
+ * @param   pIfCfg          Configuration interface for the transfer parameters, optional.
+ */
+static int vdMergeHelper(PVBOXHDD pDisk, PVDIMAGE pImageStart, PVDIMAGE pImageStop,
+                         PVDIMAGE pImageTo, PVDIMAGE pImageParentOverride, uint32_t fFlags,
+                         uint64_t cbSize, PVDINTERFACEPROGRESS pIfProgress,
+                         PVDINTERFACECONFIG pIfCfg)
+{
+    int rc = VINF_SUCCESS;
+    VDCOPYSTATE State;
+
+    RT_ZERO(State);
+    State.pDiskFrom              = pDisk;
+    State.pImageFrom             = pImageStart;
+    State.pImageFromStop         = pImageStop;
+    State.fFlags                 = fFlags;
+    State.pDiskTo                = pDisk;
+    State.pImageTo               = pImageTo;
+    State.pImageToParentOverride = pImageParentOverride;
+    /* Updating the cache is required because this might be a live merge. */
+    State.fIoCtxWrite            = VDIOCTX_FLAGS_READ_UPDATE_CACHE;
+    State.fSync                  = !vdCopyIsAsyncCapable(pDisk, pDisk->pLast);
+    State.cbSize                 = cbSize;
+    State.pIfProgress            = pIfProgress;
+
+    rc = vdCopyQueryConfig(&State, pIfCfg);
+    if (RT_SUCCESS(rc))
+        rc = vdCopyEngineRun(&State);
+
+    return rc;
+}
+
 /**
  * Flush helper async version.
  */
@@ -3471,6 +4615,9 @@ static DECLCALLBACK(int) vdDiscardHelperAsync(PVDIOCTX pIoCtx)
             LogFlowFunc(("New range descriptor loaded (%u) offStart=%llu cbDiscard=%zu\n",
                          pIoCtx->Req.Discard.idxRange, offStart, cbDiscardLeft));
             pIoCtx->Req.Discard.idxRange++;
+
+            if (pDisk->pCache)
+                vdCacheInvalidateHelper(pDisk, offStart, cbDiscardLeft);
         }
 
         /* Look for a matching block in the AVL tree first. */
@@ -4094,6 +5241,193 @@ static DECLCALLBACK(int) vdIOFlushSyncFallback(void *pvUser, void *pvStorage)
     return RTFileFlush(pStorage->File);
 }
 
+/**
+ * Processes a single async request of the fallback I/O interface.
+ *
+ * @returns IPRT status code.
+ * @param   pReq    The request to process.
+ */
+static int vdIOFallbackReqProcess(PVDIIOFALLBACKREQ pReq)
+{
+    int rc = VINF_SUCCESS;
+    uint64_t uOffset = pReq->uOffset;
+
+    if (!pReq->cSegments)
+        return RTFileFlush(pReq->pStorage->File);
+
+    for (unsigned i = 0; i < pReq->cSegments && RT_SUCCESS(rc); i++)
+    {
+        if (pReq->fWrite)
+            rc = RTFileWriteAt(pReq->pStorage->File, uOffset, pReq->aSegments[i].pvSeg,
+                               pReq->aSegments[i].cbSeg, NULL);
+        else
+            rc = RTFileReadAt(pReq->pStorage->File, uOffset, pReq->aSegments[i].pvSeg,
+                              pReq->aSegments[i].cbSeg, NULL);
+        uOffset += pReq->aSegments[i].cbSeg;
+    }
+
+    return rc;
+}
+
+/**
+ * Thread servicing the async requests of the fallback I/O interface.
+ *
+ * @returns IPRT status code.
+ * @param   hThread     The thread handle.
+ * @param   pvUser      The fallback I/O thread state.
+ */
+static DECLCALLBACK(int) vdIOFallbackThread(RTTHREAD hThread, void *pvUser)
+{
+    PVDIIOFALLBACKTHREADS pThreads = (PVDIIOFALLBACKTHREADS)pvUser;
+    RT_NOREF1(hThread);
+
+    for (;;)
+    {
+        RTCritSectEnter(&pThreads->CritSect);
+        PVDIIOFALLBACKREQ pReq = RTListGetFirst(&pThreads->ListReqs, VDIIOFALLBACKREQ, NodeReq);
+        if (pReq)
+        {
+            RTListNodeRemove(&pReq->NodeReq);
+            /* Wake up another thread if there is more work to do. */
+            if (!RTListIsEmpty(&pThreads->ListReqs))
+                RTSemEventSignal(pThreads->hEvtReqs);
+        }
+        RTCritSectLeave(&pThreads->CritSect);
+
+        if (pReq)
+        {
+            int rc = vdIOFallbackReqProcess(pReq);
+            pReq->pStorage->pfnCompleted(pReq->pvCompletion, rc);
+            RTMemFree(pReq);
+            continue;
+        }
+
+        if (ASMAtomicReadBool(&pThreads->fShutdown))
+        {
+            /* Pass the shutdown notification on. */
+            RTSemEventSignal(pThreads->hEvtReqs);
+            break;
+        }
+
+        RTSemEventWait(pThreads->hEvtReqs, RT_INDEFINITE_WAIT);
+    }
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Stops the threads servicing the async requests of the fallback I/O interface
+ * and frees the state.
+ *
+ * @returns nothing.
+ * @param   pThreads    The fallback I/O thread state.
+ */
+static void vdIOFallbackThreadsDestroy(PVDIIOFALLBACKTHREADS pThreads)
+{
+    ASMAtomicWriteBool(&pThreads->fShutdown, true);
+    RTSemEventSignal(pThreads->hEvtReqs);
+    for (unsigned i = 0; i < pThreads->cThreads; i++)
+        RTThreadWait(pThreads->aThreads[i], RT_INDEFINITE_WAIT, NULL);
+
+    Assert(RTListIsEmpty(&pThreads->ListReqs));
+    RTSemEventDestroy(pThreads->hEvtReqs);
+    RTCritSectDelete(&pThreads->CritSect);
+    RTMemFree(pThreads);
+}
+
+/**
+ * Returns the fallback I/O thread state of the given disk, starting
+ * the threads if not done already.
+ *
+ * @returns Pointer to the fallback I/O thread state or NULL on failure.
+ * @param   pDisk       The disk the request is for.
+ */
+static PVDIIOFALLBACKTHREADS vdIOFallbackThreadsGet(PVBOXHDD pDisk)
+{
+    PVDIIOFALLBACKTHREADS pThreads = ASMAtomicReadPtrT(&pDisk->pIoFallbackThreads, PVDIIOFALLBACKTHREADS);
+    if (RT_LIKELY(pThreads))
+        return pThreads;
+
+    pThreads = (PVDIIOFALLBACKTHREADS)RTMemAllocZ(sizeof(VDIIOFALLBACKTHREADS));
+    if (!pThreads)
+        return NULL;
+
+    RTListInit(&pThreads->ListReqs);
+    int rc = RTCritSectInit(&pThreads->CritSect);
+    if (RT_SUCCESS(rc))
+    {
+        rc = RTSemEventCreate(&pThreads->hEvtReqs);
+        if (RT_SUCCESS(rc))
+        {
+            for (unsigned i = 0; i < VD_IO_FALLBACK_THREADS; i++)
+            {
+                rc = RTThreadCreateF(&pThreads->aThreads[i], vdIOFallbackThread, pThreads, 0,
+                                     RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE, "VDIo%u", i);
+                if (RT_FAILURE(rc))
+                    break;
+                pThreads->cThreads++;
+            }
+
+            /* Go with what we've got as long as there is at least one thread. */
+            if (   pThreads->cThreads
+                && ASMAtomicCmpXchgPtr(&pDisk->pIoFallbackThreads, pThreads, NULL))
+                return pThreads;
+
+            vdIOFallbackThreadsDestroy(pThreads);
+            return ASMAtomicReadPtrT(&pDisk->pIoFallbackThreads, PVDIIOFALLBACKTHREADS);
+        }
+        RTCritSectDelete(&pThreads->CritSect);
+    }
+
+    RTMemFree(pThreads);
+    return NULL;
+}
+
+/**
+ * Queues an async request for the fallback I/O threads.
+ *
+ * @returns VBox status code.
+ * @param   pvUser          The disk the storage belongs to.
+ * @param   pvStorage       The storage to access.
+ * @param   fWrite          Flag whether to write or to read, ignored for flushes.
+ * @param   uOffset         Start offset.
+ * @param   paSegments      Segment array, NULL for a flush.
+ * @param   cSegments       Number of segments, 0 for a flush.
+ * @param   pvCompletion    Opaque user data passed to the completion callback.
+ */
+static int vdIOFallbackReqQueue(void *pvUser, void *pvStorage, bool fWrite, uint64_t uOffset,
+                                PCRTSGSEG paSegments, size_t cSegments, void *pvCompletion)
+{
+    PVBOXHDD pDisk = (PVBOXHDD)pvUser;
+
+    /* The interface is only bound to a disk for opened images. */
+    if (!pDisk)
+        return VERR_NOT_SUPPORTED;
+
+    PVDIIOFALLBACKTHREADS pThreads = vdIOFallbackThreadsGet(pDisk);
+    if (!pThreads)
+        return VERR_NO_MEMORY;
+
+    PVDIIOFALLBACKREQ pReq = (PVDIIOFALLBACKREQ)RTMemAllocZ(RT_OFFSETOF(VDIIOFALLBACKREQ, aSegments[RT_MAX(cSegments, 1)]));
+    if (!pReq)
+        return VERR_NO_MEMORY;
+
+    pReq->pStorage     = (PVDIIOFALLBACKSTORAGE)pvStorage;
+    pReq->fWrite       = fWrite;
+    pReq->uOffset      = uOffset;
+    pReq->pvCompletion = pvCompletion;
+    pReq->cSegments    = (unsigned)cSegments;
+    for (unsigned i = 0; i < cSegments; i++)
+        pReq->aSegments[i] = paSegments[i];
+
+    RTCritSectEnter(&pThreads->CritSect);
+    RTListAppend(&pThreads->ListReqs, &pReq->NodeReq);
+    RTCritSectLeave(&pThreads->CritSect);
+    RTSemEventSignal(pThreads->hEvtReqs);
+
+    return VERR_VD_ASYNC_IO_IN_PROGRESS;
+}
+
 /**
  * VD async I/O interface callback for a asynchronous read from the file.
  */
@@ -4102,8 +5436,9 @@ static DECLCALLBACK(int) vdIOReadAsyncFallback(void *pvUser, void *pStorage, uin
                                                size_t cbRead, void *pvCompletion,
                                                void **ppTask)
 {
-    RT_NOREF8(pvUser, pStorage, uOffset, paSegments, cSegments, cbRead, pvCompletion, ppTask);
-    return VERR_NOT_IMPLEMENTED;
+    RT_NOREF2(cbRead, ppTask);
+    return vdIOFallbackReqQueue(pvUser, pStorage, false /* fWrite */, uOffset,
+                                paSegments, cSegments, pvCompletion);
 }
 
 /**
@@ -4114,8 +5449,9 @@ static DECLCALLBACK(int) vdIOWriteAsyncFallback(void *pvUser, void *pStorage, ui
                                                 size_t cbWrite, void *pvCompletion,
                                                 void **ppTask)
 {
-    RT_NOREF8(pvUser, pStorage, uOffset, paSegments, cSegments, cbWrite, pvCompletion, ppTask);
-    return VERR_NOT_IMPLEMENTED;
+    RT_NOREF2(cbWrite, ppTask);
+    return vdIOFallbackReqQueue(pvUser, pStorage, true /* fWrite */, uOffset,
+                                paSegments, cSegments, pvCompletion);
 }
 
 /**
@@ -4124,8 +5460,9 @@ static DECLCALLBACK(int) vdIOWriteAsyncFallback(void *pvUser, void *pStorage, ui
 static DECLCALLBACK(int) vdIOFlushAsyncFallback(void *pvUser, void *pStorage,
                                                 void *pvCompletion, void **ppTask)
 {
-    RT_NOREF4(pvUser, pStorage, pvCompletion, ppTask);
-    return VERR_NOT_IMPLEMENTED;
+    RT_NOREF1(ppTask);
+    return vdIOFallbackReqQueue(pvUser, pStorage, false /* fWrite */, 0 /* uOffset */,
+                                NULL, 0, pvCompletion);
 }
 
 /**
@@ -4188,9 +5525,8 @@ static int vdIoCtxContinue(PVDIOCTX pIoCtx, int rcReq)
                     && ASMAtomicCmpXchgBool(&pIoCtxParent->fComplete, true, false))
                 {
                     LogFlowFunc(("Parent I/O context completed pIoCtxParent=%#p rcReq=%Rrc\n", pIoCtxParent, pIoCtxParent->rcReq));
-                    vdIoCtxRootComplete(pDisk, pIoCtxParent);
                     vdThreadFinishWrite(pDisk);
-                    vdIoCtxFree(pDisk, pIoCtxParent);
+                    vdIoCtxRootCompleteFree(pDisk, pIoCtxParent);
                     vdDiskProcessBlockedIoCtx(pDisk);
                 }
                 else if (!vdIoCtxIsDiskLockOwner(pDisk, pIoCtx))
@@ -4198,6 +5534,8 @@ static int vdIoCtxContinue(PVDIOCTX pIoCtx, int rcReq)
                     /* Process any pending writes if the current request didn't caused another growing. */
                     vdDiskProcessBlockedIoCtx(pDisk);
                 }
+
+                vdIoCtxFree(pDisk, pIoCtx);
             }
             else
             {
@@ -4216,10 +5554,8 @@ static int vdIoCtxContinue(PVDIOCTX pIoCtx, int rcReq)
                 }
 
                 LogFlowFunc(("I/O context completed pIoCtx=%#p rcReq=%Rrc\n", pIoCtx, pIoCtx->rcReq));
-                vdIoCtxRootComplete(pDisk, pIoCtx);
+                vdIoCtxRootCompleteFree(pDisk, pIoCtx);
             }
-
-            vdIoCtxFree(pDisk, pIoCtx);
         }
     }
 
@@ -4503,6 +5839,15 @@ static int vdDiskUnlock(PVBOXHDD pDisk, PVDIOCTX pIoCtxRc)
 
     VD_IS_LOCKED(pDisk);
 
+    /*
+     * Reference the I/O queue array while the disk is still locked,
+     * VDIoQueuesSet() can't replace it while it is used after the lock was released.
+     */
+    PVDIOQUEUE paIoQueues = pDisk->paIoQueues;
+    uint32_t   cIoQueues  = pDisk->cIoQueues;
+    if (cIoQueues)
+        ASMAtomicIncU32(&pDisk->cIoQueueRefs);
+
     /*
      * Process the list of waiting I/O tasks first
      * because they might complete I/O contexts.
@@ -4521,7 +5866,8 @@ static int vdDiskUnlock(PVBOXHDD pDisk, PVDIOCTX pIoCtxRc)
      */
     while (   ASMAtomicUoReadPtrT(&pDisk->pIoCtxHead, PVDIOCTX) != NULL
            || ASMAtomicUoReadPtrT(&pDisk->pIoTasksPendingHead, PVDIOTASK) != NULL
-           || ASMAtomicUoReadPtrT(&pDisk->pIoCtxHaltedHead, PVDIOCTX) != NULL)
+           || ASMAtomicUoReadPtrT(&pDisk->pIoCtxHaltedHead, PVDIOCTX) != NULL
+           || vdDiskIoQueuesPending(paIoQueues, cIoQueues))
     {
         /* Try lock disk again. */
         if (ASMAtomicCmpXchgBool(&pDisk->fLocked, true, false))
@@ -4535,6 +5881,14 @@ static int vdDiskUnlock(PVBOXHDD pDisk, PVDIOCTX pIoCtxRc)
             break;
     }
 
+    /* Submit the transfers of queued requests and run their completion callbacks now that the lock is free. */
+    if (cIoQueues)
+    {
+        vdDiskSubmitDeferredIoTasks(pDisk);
+        vdDiskIoQueuesComplete(pDisk, paIoQueues, cIoQueues);
+        ASMAtomicDecU32(&pDisk->cIoQueueRefs);
+    }
+
     return rc;
 }
 
@@ -4582,6 +5936,192 @@ static DECLCALLBACK(int) vdIOIntReqCompleted(void *pvUser, int rcReq)
     return VINF_SUCCESS;
 }
 
+/**
+ * Submits the data transfers of queued requests to the I/O interface which
+ * were deferred while the disk was locked. Must be called without the disk
+ * lock held.
+ *
+ * @returns nothing.
+ * @param   pDisk    The disk structure.
+ */
+static void vdDiskSubmitDeferredIoTasks(PVBOXHDD pDisk)
+{
+    PVDIOTASKSUBMIT pHead = ASMAtomicXchgPtrT(&pDisk->pIoTasksSubmitHead, NULL, PVDIOTASKSUBMIT);
+
+    /* Reverse it to submit in FIFO order. */
+    PVDIOTASKSUBMIT pCur = pHead;
+    pHead = NULL;
+    while (pCur)
+    {
+        PVDIOTASKSUBMIT pInsert = pCur;
+        pCur = pCur->pNext;
+        pInsert->pNext = pHead;
+        pHead = pInsert;
+    }
+
+    pCur = pHead;
+    while (pCur)
+    {
+        PVDIOTASKSUBMIT pSubmit    = pCur;
+        PVDIOTASK       pIoTask    = pSubmit->pIoTask;
+        PVDIOSTORAGE    pIoStorage = pIoTask->pIoStorage;
+        PVDINTERFACEIO  pIfIo      = pIoStorage->pVDIo->pInterfaceIo;
+        void *pvTask;
+        int rc;
+
+        pCur = pCur->pNext;
+
+        if (pSubmit->fWrite)
+            rc = pIfIo->pfnWriteAsync(pIfIo->Core.pvUser, pIoStorage->pStorage, pSubmit->uOffset,
+                                      pSubmit->aSegs, pSubmit->cSegs, pIoTask->Type.User.cbTransfer,
+                                      pIoTask, &pvTask);
+        else
+            rc = pIfIo->pfnReadAsync(pIfIo->Core.pvUser, pIoStorage->pStorage, pSubmit->uOffset,
+                                     pSubmit->aSegs, pSubmit->cSegs, pIoTask->Type.User.cbTransfer,
+                                     pIoTask, &pvTask);
+
+        /* The request already waits for the task, finished or failed submissions go through the regular completion path. */
+        if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+            vdIOIntReqCompleted(pIoTask, RT_SUCCESS(rc) ? VINF_SUCCESS : rc);
+
+        RTMemFree(pSubmit);
+    }
+}
+
+/**
+ * Initializes the metadata table cache, called once.
+ */
+static DECLCALLBACK(int) vdMetaCacheInitOnce(void *pvUser)
+{
+    RT_NOREF1(pvUser);
+
+    RTListInit(&g_MetaCache.ListLru);
+    g_MetaCache.cbMax      = VD_META_CACHE_SIZE_DEFAULT;
+    g_MetaCache.cbUsed     = 0;
+    g_MetaCache.cEntries   = 0;
+    g_MetaCache.cHits      = 0;
+    g_MetaCache.cMisses    = 0;
+    g_MetaCache.cEvictions = 0;
+    return RTCritSectInit(&g_MetaCache.CritSect);
+}
+
+/**
+ * Enters the metadata table cache lock, initializing the cache if required.
+ *
+ * @returns VBox status code.
+ */
+static int vdMetaCacheLock(void)
+{
+    int rc = RTOnce(&g_MetaCacheOnce, vdMetaCacheInitOnce, NULL);
+    if (RT_SUCCESS(rc))
+        rc = RTCritSectEnter(&g_MetaCache.CritSect);
+    return rc;
+}
+
+/**
+ * Leaves the metadata table cache lock.
+ */
+static void vdMetaCacheUnlock(void)
+{
+    RTCritSectLeave(&g_MetaCache.CritSect);
+}
+
+/**
+ * Frees a metadata table cache entry which is not inserted, cache lock held.
+ *
+ * @returns nothing.
+ * @param   pEntry    The cache entry to free.
+ */
+static void vdMetaCacheEntryFree(PVDMETACACHEENTRYINT pEntry)
+{
+    Assert(!pEntry->fInserted);
+    Assert(g_MetaCache.cbUsed >= pEntry->Core.cbData);
+
+    g_MetaCache.cbUsed -= pEntry->Core.cbData;
+    g_MetaCache.cEntries--;
+    RTMemPageFree(pEntry->Core.pvData, pEntry->Core.cbData);
+    RTMemFree(pEntry);
+}
+
+/**
+ * Removes an inserted metadata table cache entry from the tree and LRU list,
+ * cache lock held.
+ *
+ * @returns nothing.
+ * @param   pEntry    The cache entry to remove.
+ */
+static void vdMetaCacheEntryRemove(PVDMETACACHEENTRYINT pEntry)
+{
+    Assert(pEntry->fInserted);
+
+    PAVLRU64NODECORE pNode = RTAvlrU64Remove(&pEntry->pIoStorage->TreeMetaCache, pEntry->NodeTree.Key);
+    Assert(pNode == &pEntry->NodeTree); NOREF(pNode);
+    RTListNodeRemove(&pEntry->NodeLru);
+    pEntry->fInserted = false;
+}
+
+/**
+ * Evicts entries not in use, least recently used first, until the given
+ * amount of memory fits into the budget, cache lock held.
+ *
+ * @returns nothing.
+ * @param   cbNeeded  Amount of memory which is about to be allocated.
+ */
+static void vdMetaCacheEvict(size_t cbNeeded)
+{
+    PVDMETACACHEENTRYINT pEntry, pEntryPrev;
+    RTListForEachReverseSafe(&g_MetaCache.ListLru, pEntry, pEntryPrev, VDMETACACHEENTRYINT, NodeLru)
+    {
+        if (g_MetaCache.cbUsed + cbNeeded <= g_MetaCache.cbMax)
+            break;
+
+        if (!pEntry->cRefs)
+        {
+            vdMetaCacheEntryRemove(pEntry);
+            vdMetaCacheEntryFree(pEntry);
+            g_MetaCache.cEvictions++;
+        }
+    }
+}
+
+/**
+ * Destroy callback for the metadata table cache tree of a storage.
+ *
+ * Entries still referenced by a backend are only unlinked, they become
+ * private and are freed when the last reference is released.
+ */
+static DECLCALLBACK(int) vdMetaCacheTreeDestroy(PAVLRU64NODECORE pNode, void *pvUser)
+{
+    RT_NOREF1(pvUser);
+    PVDMETACACHEENTRYINT pEntry = RT_FROM_MEMBER(pNode, VDMETACACHEENTRYINT, NodeTree);
+
+    RTListNodeRemove(&pEntry->NodeLru);
+    pEntry->fInserted  = false;
+    pEntry->pIoStorage = NULL;
+    if (!pEntry->cRefs)
+        vdMetaCacheEntryFree(pEntry);
+    else
+        LogRel(("VD: Metadata table at %llu still in use while closing the image\n", pEntry->Core.uOffset));
+    return VINF_SUCCESS;
+}
+
+/**
+ * Drops all cached metadata tables of the given storage.
+ *
+ * @returns nothing.
+ * @param   pIoStorage    The storage which is about to be closed.
+ */
+static void vdMetaCachePurge(PVDIOSTORAGE pIoStorage)
+{
+    if (pIoStorage->TreeMetaCache)
+    {
+        int rc = vdMetaCacheLock();
+        AssertRC(rc);
+        RTAvlrU64Destroy(&pIoStorage->TreeMetaCache, vdMetaCacheTreeDestroy, NULL);
+        vdMetaCacheUnlock();
+    }
+}
+
 /**
  * VD I/O interface callback for opening a file.
  */
@@ -4634,6 +6174,7 @@ static DECLCALLBACK(int) vdIOIntClose(void *pvUser, PVDIOSTORAGE pIoStorage)
     /* We free everything here, even if closing the file failed for some reason. */
     rc = pVDIo->pInterfaceIo->pfnClose(pVDIo->pInterfaceIo->Core.pvUser, pIoStorage->pStorage);
     RTAvlrFileOffsetDestroy(pIoStorage->pTreeMetaXfers, vdIOIntTreeMetaXferDestroy, NULL);
+    vdMetaCachePurge(pIoStorage);
     RTMemFree(pIoStorage->pTreeMetaXfers);
     RTMemFree(pIoStorage);
     return rc;
@@ -4745,15 +6286,135 @@ static DECLCALLBACK(int) vdIOIntSetAllocationSize(void *pvUser, PVDIOSTORAGE pIo
     return rc;
 }
 
+/**
+ * Completion callback for every I/O task of a user data transfer with a completion
+ * callback, calls the callback of the caller after the last task completed.
+ *
+ * @returns VBox status code.
+ * @param   pBackendData    The opaque backend data.
+ * @param   pIoCtx          I/O context associated with this request.
+ * @param   pvUser          The user data transfer state.
+ * @param   rcReq           Status code for the completed request.
+ */
+static DECLCALLBACK(int) vdIOIntUserXferTaskComplete(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    int rc = VINF_SUCCESS;
+    PVDIOUSERXFER pXfer = (PVDIOUSERXFER)pvUser;
+
+    if (RT_FAILURE(rcReq) && RT_SUCCESS(pXfer->rcReq))
+        pXfer->rcReq = rcReq;
+
+    Assert(pXfer->cTasksPending > 0);
+    if (!--pXfer->cTasksPending)
+    {
+        if (pXfer->pfnComplete)
+            rc = pXfer->pfnComplete(pBackendData, pIoCtx, pXfer->pvCompleteUser, pXfer->rcReq);
+        RTMemFree(pXfer);
+    }
+
+    return rc;
+}
+
+/**
+ * Drops the submission reference of a user data transfer after all I/O tasks
+ * were submitted and converts the status code for the caller.
+ *
+ * The completion callback of the caller is only called if this returns
+ * VERR_VD_ASYNC_IO_IN_PROGRESS. If submitting failed while some tasks are still
+ * pending the callback is disarmed and the tasks only complete the I/O context.
+ *
+ * @returns VBox status code.
+ * @param   pXfer           The user data transfer state.
+ * @param   rc              Status code of the submission.
+ */
+static int vdIOIntUserXferSubmitted(PVDIOUSERXFER pXfer, int rc)
+{
+    Assert(pXfer->cTasksPending > 0);
+    if (!--pXfer->cTasksPending)
+    {
+        /* Everything completed synchronously. */
+        RTMemFree(pXfer);
+        if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            rc = VINF_SUCCESS;
+    }
+    else if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+        rc = VERR_VD_ASYNC_IO_IN_PROGRESS;
+    else
+        pXfer->pfnComplete = NULL;
+
+    return rc;
+}
+
+/**
+ * Returns whether the given I/O context belongs to a request submitted through
+ * one of the I/O queues.
+ *
+ * @returns true if the request is queued, false otherwise.
+ * @param   pIoCtx    The I/O context, might be a child context.
+ */
+DECLINLINE(bool) vdIoCtxIsQueued(PVDIOCTX pIoCtx)
+{
+    if (pIoCtx->pIoCtxParent)
+        pIoCtx = pIoCtx->pIoCtxParent;
+    return pIoCtx->pIoQueue != NULL;
+}
+
+/**
+ * Defers submitting a data transfer of a queued request to the I/O interface
+ * until the disk lock is released, disk lock held.
+ *
+ * The image backends are not reentrant and have to run under the disk lock but
+ * handing the transfer to the host doesn't need it. Deferring it lets threads
+ * working on different queues submit their transfers concurrently instead of
+ * one after the other under the lock.
+ *
+ * @returns VERR_VD_ASYNC_IO_IN_PROGRESS if the transfer was deferred.
+ * @retval  VERR_NO_MEMORY if there is no memory to defer the transfer.
+ * @param   pDisk     The disk.
+ * @param   pIoTask   The I/O task of the transfer.
+ * @param   uOffset   Start offset in the storage.
+ * @param   paSegs    The segments to transfer.
+ * @param   cSegs     Number of segments.
+ * @param   fWrite    Flag whether this is a write.
+ */
+static int vdIoTaskSubmitDefer(PVBOXHDD pDisk, PVDIOTASK pIoTask, uint64_t uOffset,
+                               PCRTSGSEG paSegs, unsigned cSegs, bool fWrite)
+{
+    VD_IS_LOCKED(pDisk);
+
+    PVDIOTASKSUBMIT pSubmit = (PVDIOTASKSUBMIT)RTMemAlloc(RT_OFFSETOF(VDIOTASKSUBMIT, aSegs[cSegs]));
+    if (RT_UNLIKELY(!pSubmit))
+        return VERR_NO_MEMORY;
+
+    pSubmit->pIoTask = pIoTask;
+    pSubmit->uOffset = uOffset;
+    pSubmit->fWrite  = fWrite;
+    pSubmit->cSegs   = cSegs;
+    memcpy(&pSubmit->aSegs[0], paSegs, cSegs * sizeof(RTSGSEG));
+
+    PVDIOTASKSUBMIT pNext = ASMAtomicUoReadPtrT(&pDisk->pIoTasksSubmitHead, PVDIOTASKSUBMIT);
+    PVDIOTASKSUBMIT pHeadOld;
+    pSubmit->pNext = pNext;
+    while (!ASMAtomicCmpXchgExPtr(&pDisk->pIoTasksSubmitHead, pSubmit, pNext, &pHeadOld))
+    {
+        pNext = pHeadOld;
+        pSubmit->pNext = pNext;
+        ASMNopPause();
+    }
+
+    return VERR_VD_ASYNC_IO_IN_PROGRESS;
+}
+
 static DECLCALLBACK(int) vdIOIntReadUser(void *pvUser, PVDIOSTORAGE pIoStorage, uint64_t uOffset,
-                                         PVDIOCTX pIoCtx, size_t cbRead)
+                                         PVDIOCTX pIoCtx, size_t cbRead, PFNVDXFERCOMPLETED pfnComplete,
+                                         void *pvCompleteUser)
 {
     int rc = VINF_SUCCESS;
     PVDIO    pVDIo = (PVDIO)pvUser;
     PVBOXHDD pDisk = pVDIo->pDisk;
 
-    LogFlowFunc(("pvUser=%#p pIoStorage=%#p uOffset=%llu pIoCtx=%#p cbRead=%u\n",
-                 pvUser, pIoStorage, uOffset, pIoCtx, cbRead));
+    LogFlowFunc(("pvUser=%#p pIoStorage=%#p uOffset=%llu pIoCtx=%#p cbRead=%u pfnComplete=%#p pvCompleteUser=%#p\n",
+                 pvUser, pIoStorage, uOffset, pIoCtx, cbRead, pfnComplete, pvCompleteUser));
 
     /** @todo Enable check for sync I/O later. */
     if (!(pIoCtx->fFlags & VDIOCTX_FLAGS_SYNC))
@@ -4786,6 +6447,25 @@ static DECLCALLBACK(int) vdIOIntReadUser(void *pvUser, PVDIOSTORAGE pIoStorage,
     }
     else
     {
+        PVDIOUSERXFER pXfer = NULL;
+        bool fDefer = vdIoCtxIsQueued(pIoCtx);
+
+        /*
+         * The request might be split into several tasks, make sure the completion
+         * callback runs only once after all of them completed.
+         */
+        if (pfnComplete)
+        {
+            pXfer = (PVDIOUSERXFER)RTMemAllocZ(sizeof(VDIOUSERXFER));
+            if (!pXfer)
+                return VERR_NO_MEMORY;
+
+            pXfer->cTasksPending  = 1;
+            pXfer->rcReq          = VINF_SUCCESS;
+            pXfer->pfnComplete    = pfnComplete;
+            pXfer->pvCompleteUser = pvCompleteUser;
+        }
+
         /* Build the S/G array and spawn a new I/O task */
         while (cbRead)
         {
@@ -4806,19 +6486,26 @@ static DECLCALLBACK(int) vdIOIntReadUser(void *pvUser, PVDIOSTORAGE pIoStorage,
 #endif
 
             Assert(cbTaskRead == (uint32_t)cbTaskRead);
-            PVDIOTASK pIoTask = vdIoTaskUserAlloc(pIoStorage, NULL, NULL, pIoCtx, (uint32_t)cbTaskRead);
+            PVDIOTASK pIoTask = vdIoTaskUserAlloc(pIoStorage, pXfer ? vdIOIntUserXferTaskComplete : NULL,
+                                                  pXfer, pIoCtx, (uint32_t)cbTaskRead);
 
             if (!pIoTask)
-                return VERR_NO_MEMORY;
+            {
+                rc = VERR_NO_MEMORY;
+                break;
+            }
 
             ASMAtomicIncU32(&pIoCtx->cDataTransfersPending);
 
             void *pvTask;
             Log(("Spawning pIoTask=%p pIoCtx=%p\n", pIoTask, pIoCtx));
-            rc = pVDIo->pInterfaceIo->pfnReadAsync(pVDIo->pInterfaceIo->Core.pvUser,
-                                                   pIoStorage->pStorage, uOffset,
-                                                   aSeg, cSegments, cbTaskRead, pIoTask,
-                                                   &pvTask);
+            if (fDefer)
+                rc = vdIoTaskSubmitDefer(pDisk, pIoTask, uOffset, aSeg, cSegments, false /* fWrite */);
+            else
+                rc = pVDIo->pInterfaceIo->pfnReadAsync(pVDIo->pInterfaceIo->Core.pvUser,
+                                                       pIoStorage->pStorage, uOffset,
+                                                       aSeg, cSegments, cbTaskRead, pIoTask,
+                                                       &pvTask);
             if (RT_SUCCESS(rc))
             {
                 AssertMsg(cbTaskRead <= pIoCtx->Req.Io.cbTransferLeft, ("Impossible!\n"));
@@ -4832,10 +6519,15 @@ static DECLCALLBACK(int) vdIOIntReadUser(void *pvUser, PVDIOSTORAGE pIoStorage,
                 vdIoTaskFree(pDisk, pIoTask);
                 break;
             }
+            else if (pXfer)
+                pXfer->cTasksPending++;
 
             uOffset += cbTaskRead;
             cbRead  -= cbTaskRead;
         }
+
+        if (pXfer)
+            rc = vdIOIntUserXferSubmitted(pXfer, rc);
     }
 
     LogFlowFunc(("returns rc=%Rrc\n", rc));
@@ -4850,8 +6542,8 @@ static DECLCALLBACK(int) vdIOIntWriteUser(void *pvUser, PVDIOSTORAGE pIoStorage,
     PVDIO    pVDIo = (PVDIO)pvUser;
     PVBOXHDD pDisk = pVDIo->pDisk;
 
-    LogFlowFunc(("pvUser=%#p pIoStorage=%#p uOffset=%llu pIoCtx=%#p cbWrite=%u\n",
-                 pvUser, pIoStorage, uOffset, pIoCtx, cbWrite));
+    LogFlowFunc(("pvUser=%#p pIoStorage=%#p uOffset=%llu pIoCtx=%#p cbWrite=%u pfnComplete=%#p pvCompleteUser=%#p\n",
+                 pvUser, pIoStorage, uOffset, pIoCtx, cbWrite, pfnComplete, pvCompleteUser));
 
     /** @todo Enable check for sync I/O later. */
     if (!(pIoCtx->fFlags & VDIOCTX_FLAGS_SYNC))
@@ -4884,6 +6576,25 @@ static DECLCALLBACK(int) vdIOIntWriteUser(void *pvUser, PVDIOSTORAGE pIoStorage,
     }
     else
     {
+        PVDIOUSERXFER pXfer = NULL;
+        bool fDefer = vdIoCtxIsQueued(pIoCtx);
+
+        /*
+         * The request might be split into several tasks, make sure the completion
+         * callback runs only once after all of them completed.
+         */
+        if (pfnComplete)
+        {
+            pXfer = (PVDIOUSERXFER)RTMemAllocZ(sizeof(VDIOUSERXFER));
+            if (!pXfer)
+                return VERR_NO_MEMORY;
+
+            pXfer->cTasksPending  = 1;
+            pXfer->rcReq          = VINF_SUCCESS;
+            pXfer->pfnComplete    = pfnComplete;
+            pXfer->pvCompleteUser = pvCompleteUser;
+        }
+
         /* Build the S/G array and spawn a new I/O task */
         while (cbWrite)
         {
@@ -4906,19 +6617,26 @@ static DECLCALLBACK(int) vdIOIntWriteUser(void *pvUser, PVDIOSTORAGE pIoStorage,
 #endif
 
             Assert(cbTaskWrite == (uint32_t)cbTaskWrite);
-            PVDIOTASK pIoTask = vdIoTaskUserAlloc(pIoStorage, pfnComplete, pvCompleteUser, pIoCtx, (uint32_t)cbTaskWrite);
+            PVDIOTASK pIoTask = vdIoTaskUserAlloc(pIoStorage, pXfer ? vdIOIntUserXferTaskComplete : NULL,
+                                                  pXfer, pIoCtx, (uint32_t)cbTaskWrite);
 
             if (!pIoTask)
-                return VERR_NO_MEMORY;
+            {
+                rc = VERR_NO_MEMORY;
+                break;
+            }
 
             ASMAtomicIncU32(&pIoCtx->cDataTransfersPending);
 
             void *pvTask;
             Log(("Spawning pIoTask=%p pIoCtx=%p\n", pIoTask, pIoCtx));
-            rc = pVDIo->pInterfaceIo->pfnWriteAsync(pVDIo->pInterfaceIo->Core.pvUser,
-                                                    pIoStorage->pStorage,
-                                                    uOffset, aSeg, cSegments,
-                                                    cbTaskWrite, pIoTask, &pvTask);
+            if (fDefer)
+                rc = vdIoTaskSubmitDefer(pDisk, pIoTask, uOffset, aSeg, cSegments, true /* fWrite */);
+            else
+                rc = pVDIo->pInterfaceIo->pfnWriteAsync(pVDIo->pInterfaceIo->Core.pvUser,
+                                                        pIoStorage->pStorage,
+                                                        uOffset, aSeg, cSegments,
+                                                        cbTaskWrite, pIoTask, &pvTask);
             if (RT_SUCCESS(rc))
             {
                 AssertMsg(cbTaskWrite <= pIoCtx->Req.Io.cbTransferLeft, ("Impossible!\n"));
@@ -4932,10 +6650,15 @@ static DECLCALLBACK(int) vdIOIntWriteUser(void *pvUser, PVDIOSTORAGE pIoStorage,
                 vdIoTaskFree(pDisk, pIoTask);
                 break;
             }
+            else if (pXfer)
+                pXfer->cTasksPending++;
 
             uOffset += cbTaskWrite;
             cbWrite -= cbTaskWrite;
         }
+
+        if (pXfer)
+            rc = vdIOIntUserXferSubmitted(pXfer, rc);
     }
 
     LogFlowFunc(("returns rc=%Rrc\n", rc));
@@ -5222,39 +6945,169 @@ static DECLCALLBACK(int) vdIOIntWriteMeta(void *pvUser, PVDIOSTORAGE pIoStorage,
     return rc;
 }
 
-static DECLCALLBACK(void) vdIOIntMetaXferRelease(void *pvUser, PVDMETAXFER pMetaXfer)
+static DECLCALLBACK(void) vdIOIntMetaXferRelease(void *pvUser, PVDMETAXFER pMetaXfer)
+{
+    PVDIO    pVDIo = (PVDIO)pvUser;
+    PVBOXHDD pDisk = pVDIo->pDisk;
+    PVDIOSTORAGE pIoStorage;
+
+    /*
+     * It is possible that we get called with a NULL metadata xfer handle
+     * for synchronous I/O. Just exit.
+     */
+    if (!pMetaXfer)
+        return;
+
+    pIoStorage = pMetaXfer->pIoStorage;
+
+    VD_IS_LOCKED(pDisk);
+
+    Assert(   VDMETAXFER_TXDIR_GET(pMetaXfer->fFlags) == VDMETAXFER_TXDIR_NONE
+           || VDMETAXFER_TXDIR_GET(pMetaXfer->fFlags) == VDMETAXFER_TXDIR_WRITE);
+    Assert(pMetaXfer->cRefs > 0);
+
+    pMetaXfer->cRefs--;
+    if (   !pMetaXfer->cRefs
+        && RTListIsEmpty(&pMetaXfer->ListIoCtxWaiting)
+        && VDMETAXFER_TXDIR_GET(pMetaXfer->fFlags) == VDMETAXFER_TXDIR_NONE)
+    {
+        /* Free the meta data entry. */
+        LogFlow(("Removing meta xfer=%#p\n", pMetaXfer));
+        bool fRemoved = RTAvlrFileOffsetRemove(pIoStorage->pTreeMetaXfers, pMetaXfer->Core.Key) != NULL;
+        AssertMsg(fRemoved, ("Metadata transfer wasn't removed\n")); NOREF(fRemoved);
+
+        RTMemFree(pMetaXfer);
+    }
+}
+
+static DECLCALLBACK(PVDMETACACHEENTRY) vdIOIntMetaCacheLookup(void *pvUser, PVDIOSTORAGE pIoStorage,
+                                                              uint64_t uOffset)
+{
+    RT_NOREF1(pvUser);
+    PVDMETACACHEENTRY pEntryRet = NULL;
+
+    int rc = vdMetaCacheLock();
+    AssertRCReturn(rc, NULL);
+
+    PAVLRU64NODECORE pNode = RTAvlrU64Get(&pIoStorage->TreeMetaCache, uOffset);
+    if (pNode)
+    {
+        PVDMETACACHEENTRYINT pEntry = RT_FROM_MEMBER(pNode, VDMETACACHEENTRYINT, NodeTree);
+
+        /* Move to the front of the LRU list. */
+        RTListNodeRemove(&pEntry->NodeLru);
+        RTListPrepend(&g_MetaCache.ListLru, &pEntry->NodeLru);
+        pEntry->cRefs++;
+        g_MetaCache.cHits++;
+        pEntryRet = &pEntry->Core;
+    }
+    else
+        g_MetaCache.cMisses++;
+
+    vdMetaCacheUnlock();
+    return pEntryRet;
+}
+
+static DECLCALLBACK(PVDMETACACHEENTRY) vdIOIntMetaCacheEntryAlloc(void *pvUser, PVDIOSTORAGE pIoStorage,
+                                                                  uint64_t uOffset, size_t cbData)
+{
+    RT_NOREF1(pvUser);
+    AssertReturn(cbData, NULL);
+
+    int rc = vdMetaCacheLock();
+    AssertRCReturn(rc, NULL);
+
+    /*
+     * Make room by evicting tables not in use. If everything is in use
+     * the budget is exceeded temporarily instead of failing the request,
+     * the cache catches up when the references are released.
+     */
+    vdMetaCacheEvict(cbData);
+    vdMetaCacheUnlock();
+
+    PVDMETACACHEENTRYINT pEntry = (PVDMETACACHEENTRYINT)RTMemAllocZ(sizeof(VDMETACACHEENTRYINT));
+    if (pEntry)
+    {
+        pEntry->Core.pvData = RTMemPageAlloc(cbData);
+        if (RT_LIKELY(pEntry->Core.pvData))
+        {
+            pEntry->Core.uOffset     = uOffset;
+            pEntry->Core.cbData      = cbData;
+            pEntry->NodeTree.Key     = uOffset;
+            pEntry->NodeTree.KeyLast = uOffset + cbData - 1;
+            pEntry->pIoStorage       = pIoStorage;
+            pEntry->cRefs            = 1;
+            pEntry->fInserted        = false;
+
+            vdMetaCacheLock();
+            g_MetaCache.cbUsed += cbData;
+            g_MetaCache.cEntries++;
+            vdMetaCacheUnlock();
+            return &pEntry->Core;
+        }
+
+        RTMemFree(pEntry);
+    }
+
+    return NULL;
+}
+
+static DECLCALLBACK(void) vdIOIntMetaCacheEntryInsert(void *pvUser, PVDMETACACHEENTRY pEntryCore)
 {
-    PVDIO    pVDIo = (PVDIO)pvUser;
-    PVBOXHDD pDisk = pVDIo->pDisk;
-    PVDIOSTORAGE pIoStorage;
+    RT_NOREF1(pvUser);
+    PVDMETACACHEENTRYINT pEntry = RT_FROM_MEMBER(pEntryCore, VDMETACACHEENTRYINT, Core);
+
+    int rc = vdMetaCacheLock();
+    AssertRCReturnVoid(rc);
+
+    Assert(!pEntry->fInserted);
+    Assert(pEntry->cRefs > 0);
 
     /*
-     * It is possible that we get called with a NULL metadata xfer handle
-     * for synchronous I/O. Just exit.
+     * Another request might have read the same table in the meantime,
+     * the entry stays private and is freed on the last release then.
      */
-    if (!pMetaXfer)
-        return;
+    if (   pEntry->pIoStorage
+        && RTAvlrU64Insert(&pEntry->pIoStorage->TreeMetaCache, &pEntry->NodeTree))
+    {
+        RTListPrepend(&g_MetaCache.ListLru, &pEntry->NodeLru);
+        pEntry->fInserted = true;
+    }
 
-    pIoStorage = pMetaXfer->pIoStorage;
+    vdMetaCacheUnlock();
+}
 
-    VD_IS_LOCKED(pDisk);
+static DECLCALLBACK(void) vdIOIntMetaCacheEntryRetain(void *pvUser, PVDMETACACHEENTRY pEntryCore)
+{
+    RT_NOREF1(pvUser);
+    PVDMETACACHEENTRYINT pEntry = RT_FROM_MEMBER(pEntryCore, VDMETACACHEENTRYINT, Core);
 
-    Assert(   VDMETAXFER_TXDIR_GET(pMetaXfer->fFlags) == VDMETAXFER_TXDIR_NONE
-           || VDMETAXFER_TXDIR_GET(pMetaXfer->fFlags) == VDMETAXFER_TXDIR_WRITE);
-    Assert(pMetaXfer->cRefs > 0);
+    int rc = vdMetaCacheLock();
+    AssertRCReturnVoid(rc);
+    Assert(pEntry->cRefs > 0);
+    pEntry->cRefs++;
+    vdMetaCacheUnlock();
+}
 
-    pMetaXfer->cRefs--;
-    if (   !pMetaXfer->cRefs
-        && RTListIsEmpty(&pMetaXfer->ListIoCtxWaiting)
-        && VDMETAXFER_TXDIR_GET(pMetaXfer->fFlags) == VDMETAXFER_TXDIR_NONE)
-    {
-        /* Free the meta data entry. */
-        LogFlow(("Removing meta xfer=%#p\n", pMetaXfer));
-        bool fRemoved = RTAvlrFileOffsetRemove(pIoStorage->pTreeMetaXfers, pMetaXfer->Core.Key) != NULL;
-        AssertMsg(fRemoved, ("Metadata transfer wasn't removed\n")); NOREF(fRemoved);
+static DECLCALLBACK(void) vdIOIntMetaCacheEntryRelease(void *pvUser, PVDMETACACHEENTRY pEntryCore)
+{
+    RT_NOREF1(pvUser);
+    PVDMETACACHEENTRYINT pEntry = RT_FROM_MEMBER(pEntryCore, VDMETACACHEENTRYINT, Core);
 
-        RTMemFree(pMetaXfer);
+    int rc = vdMetaCacheLock();
+    AssertRCReturnVoid(rc);
+
+    Assert(pEntry->cRefs > 0);
+    pEntry->cRefs--;
+    if (!pEntry->cRefs)
+    {
+        if (!pEntry->fInserted)
+            vdMetaCacheEntryFree(pEntry);
+        else if (g_MetaCache.cbUsed > g_MetaCache.cbMax)
+            vdMetaCacheEvict(0); /* Catch up with an exceeded budget. */
     }
+
+    vdMetaCacheUnlock();
 }
 
 static DECLCALLBACK(int) vdIOIntFlush(void *pvUser, PVDIOSTORAGE pIoStorage, PVDIOCTX pIoCtx,
@@ -5298,7 +7151,7 @@ static DECLCALLBACK(int) vdIOIntFlush(void *pvUser, PVDIOSTORAGE pIoStorage, PVD
         if (!pMetaXfer)
             return VERR_NO_MEMORY;
 
-        pIoTask = vdIoTaskMetaAlloc(pIoStorage, pfnComplete, pvUser, pMetaXfer);
+        pIoTask = vdIoTaskMetaAlloc(pIoStorage, pfnComplete, pvCompleteUser, pMetaXfer);
         if (!pIoTask)
         {
             RTMemFree(pMetaXfer);
@@ -5575,13 +7428,16 @@ static DECLCALLBACK(int) vdIOIntWriteUserLimited(void *pvUser, PVDIOSTORAGE pSto
 
 static DECLCALLBACK(int) vdIOIntReadUserLimited(void *pvUser, PVDIOSTORAGE pStorage,
                                                 uint64_t uOffset, PVDIOCTX pIoCtx,
-                                                size_t cbRead)
+                                                size_t cbRead, PFNVDXFERCOMPLETED pfnComplete,
+                                                void *pvCompleteUser)
 {
     NOREF(pvUser);
     NOREF(pStorage);
     NOREF(uOffset);
     NOREF(pIoCtx);
     NOREF(cbRead);
+    NOREF(pfnComplete);
+    NOREF(pvCompleteUser);
     AssertMsgFailedReturn(("This needs to be implemented when called\n"), VERR_NOT_IMPLEMENTED);
 }
 
@@ -5724,6 +7580,7 @@ static void vdFixupLCHSGeometry(PVDGEOMETRY pLCHS, uint64_t cbSize)
  */
 static void vdIfIoFallbackCallbacksSetup(PVDINTERFACEIO pIfIo)
 {
+    pIfIo->Core.pvUser            = NULL; /* Set to the disk when bound to an image. */
     pIfIo->pfnOpen                = vdIOOpenFallback;
     pIfIo->pfnClose               = vdIOCloseFallback;
     pIfIo->pfnDelete              = vdIODeleteFallback;
@@ -5772,6 +7629,11 @@ static void vdIfIoIntCallbacksSetup(PVDINTERFACEIOINT pIfIoInt)
     pIfIoInt->pfnIoCtxIsSynchronous   = vdIOIntIoCtxIsSynchronous;
     pIfIoInt->pfnIoCtxIsZero          = vdIOIntIoCtxIsZero;
     pIfIoInt->pfnIoCtxGetDataUnitSize = vdIOIntIoCtxGetDataUnitSize;
+    pIfIoInt->pfnMetaCacheLookup      = vdIOIntMetaCacheLookup;
+    pIfIoInt->pfnMetaCacheEntryAlloc  = vdIOIntMetaCacheEntryAlloc;
+    pIfIoInt->pfnMetaCacheEntryInsert = vdIOIntMetaCacheEntryInsert;
+    pIfIoInt->pfnMetaCacheEntryRetain = vdIOIntMetaCacheEntryRetain;
+    pIfIoInt->pfnMetaCacheEntryRelease = vdIOIntMetaCacheEntryRelease;
 }
 
 /**
@@ -5841,6 +7703,53 @@ VBOXDDU_DECL(int) VDShutdown(void)
     return VINF_SUCCESS;
 }
 
+/**
+ * Sets the memory budget of the metadata table cache.
+ *
+ * @returns VBox status code.
+ * @param   cbMax           The new memory budget in bytes.
+ */
+VBOXDDU_DECL(int) VDMetaCacheSetMaxSize(size_t cbMax)
+{
+    LogFlowFunc(("cbMax=%zu\n", cbMax));
+
+    int rc = vdMetaCacheLock();
+    if (RT_SUCCESS(rc))
+    {
+        g_MetaCache.cbMax = cbMax;
+        vdMetaCacheEvict(0);
+        vdMetaCacheUnlock();
+    }
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/**
+ * Queries the statistics of the metadata table cache.
+ *
+ * @returns VBox status code.
+ * @param   pStats          Where to store the statistics.
+ */
+VBOXDDU_DECL(int) VDMetaCacheQueryStats(PVDMETACACHESTATS pStats)
+{
+    AssertPtrReturn(pStats, VERR_INVALID_POINTER);
+
+    int rc = vdMetaCacheLock();
+    if (RT_SUCCESS(rc))
+    {
+        pStats->cbMax      = g_MetaCache.cbMax;
+        pStats->cbUsed     = g_MetaCache.cbUsed;
+        pStats->cEntries   = g_MetaCache.cEntries;
+        pStats->cHits      = g_MetaCache.cHits;
+        pStats->cMisses    = g_MetaCache.cMisses;
+        pStats->cEvictions = g_MetaCache.cEvictions;
+        vdMetaCacheUnlock();
+    }
+
+    return rc;
+}
+
 /**
  * Loads a single plugin given by filename.
  *
@@ -6119,9 +8028,15 @@ VBOXDDU_DECL(int) VDCreate(PVDINTERFACE pVDIfsDisk, VDTYPE enmType, PVBOXHDD *pp
             pDisk->pInterfaceThreadSync    = NULL;
             pDisk->pIoCtxLockOwner         = NULL;
             pDisk->pIoCtxHead              = NULL;
+            pDisk->paIoQueues              = NULL;
+            pDisk->cIoQueues               = 0;
+            pDisk->iIoQueueNext            = 0;
+            pDisk->cIoQueueRefs            = 0;
+            pDisk->pIoTasksSubmitHead      = NULL;
             pDisk->fLocked                 = false;
             pDisk->hMemCacheIoCtx          = NIL_RTMEMCACHE;
             pDisk->hMemCacheIoTask         = NIL_RTMEMCACHE;
+            pDisk->pIoFallbackThreads      = NULL;
             RTListInit(&pDisk->ListFilterChainWrite);
             RTListInit(&pDisk->ListFilterChainRead);
 
@@ -6185,6 +8100,10 @@ VBOXDDU_DECL(int) VDDestroy(PVBOXHDD pDisk)
         if (RT_SUCCESS(rc))
             rc = rc2;
 
+        if (pDisk->pIoFallbackThreads)
+            vdIOFallbackThreadsDestroy(pDisk->pIoFallbackThreads);
+        if (pDisk->paIoQueues)
+            RTMemFree(pDisk->paIoQueues);
         RTMemCacheDestroy(pDisk->hMemCacheIoCtx);
         RTMemCacheDestroy(pDisk->hMemCacheIoTask);
         RTMemFree(pDisk);
@@ -6784,6 +8703,8 @@ VBOXDDU_DECL(int) VDCacheOpen(PVBOXHDD pDisk, const char *pszBackend,
             }
         }
 
+        pCache->VDIo.pBackendData = pCache->pBackendData;
+
         /* Lock disk for writing, as we modify pDisk information below. */
         rc2 = vdThreadStartWrite(pDisk);
         AssertRC(rc2);
@@ -7764,6 +9685,7 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
                  pDisk, nImageFrom, nImageTo, pVDIfsOperation));
 
     PVDINTERFACEPROGRESS pIfProgress = VDIfProgressGet(pVDIfsOperation);
+    PVDINTERFACECONFIG   pIfCfg      = VDIfConfigGet(pVDIfsOperation);
 
     do
     {
@@ -7806,12 +9728,23 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
         AssertRC(rc2);
         fLockWrite = false;
 
-        /* Allocate tmp buffer. */
-        pvBuf = RTMemTmpAlloc(VD_MERGE_BUFFER_SIZE);
-        if (!pvBuf)
+        /*
+         * Without a thread synchronization interface there can't be any
+         * concurrent guest I/O and the data can be merged with many transfers
+         * in flight. A live merge has to hold the write lock for each
+         * read/write pair and goes the synchronous way using a single buffer.
+         */
+        bool fMergeHelper =    !pDisk->pInterfaceThreadSync
+                            && !(cbSize % 512);
+        if (!fMergeHelper)
         {
-            rc = VERR_NO_MEMORY;
-            break;
+            /* Allocate tmp buffer. */
+            pvBuf = RTMemTmpAlloc(VD_MERGE_BUFFER_SIZE);
+            if (!pvBuf)
+            {
+                rc = VERR_NO_MEMORY;
+                break;
+            }
         }
 
         /* Merging is done directly on the images itself. This potentially
@@ -7821,79 +9754,86 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
             /* Merge parent state into child. This means writing all not
              * allocated blocks in the destination image which are allocated in
              * the images to be merged. */
-            uint64_t uOffset = 0;
-            uint64_t cbRemaining = cbSize;
-            do
+            if (fMergeHelper)
+                rc = vdMergeHelper(pDisk, pImageTo, pImageFrom->pPrev, pImageTo, pImageFrom->pPrev,
+                                   VDCOPY_F_SKIP_FREE | VDCOPY_F_SKIP_ALLOCATED, cbSize,
+                                   pIfProgress, pIfCfg);
+            else
             {
-                size_t cbThisRead = RT_MIN(VD_MERGE_BUFFER_SIZE, cbRemaining);
-                RTSGSEG SegmentBuf;
-                RTSGBUF SgBuf;
-                VDIOCTX IoCtx;
+                uint64_t uOffset = 0;
+                uint64_t cbRemaining = cbSize;
+                do
+                {
+                    size_t cbThisRead = RT_MIN(VD_MERGE_BUFFER_SIZE, cbRemaining);
+                    RTSGSEG SegmentBuf;
+                    RTSGBUF SgBuf;
+                    VDIOCTX IoCtx;
 
-                SegmentBuf.pvSeg = pvBuf;
-                SegmentBuf.cbSeg = VD_MERGE_BUFFER_SIZE;
-                RTSgBufInit(&SgBuf, &SegmentBuf, 1);
-                vdIoCtxInit(&IoCtx, pDisk, VDIOCTXTXDIR_READ, 0, 0, NULL,
-                            &SgBuf, NULL, NULL, VDIOCTX_FLAGS_SYNC);
+                    SegmentBuf.pvSeg = pvBuf;
+                    SegmentBuf.cbSeg = VD_MERGE_BUFFER_SIZE;
+                    RTSgBufInit(&SgBuf, &SegmentBuf, 1);
+                    vdIoCtxInit(&IoCtx, pDisk, VDIOCTXTXDIR_READ, 0, 0, NULL,
+                                &SgBuf, NULL, NULL, VDIOCTX_FLAGS_SYNC);
 
-                /* Need to hold the write lock during a read-write operation. */
-                rc2 = vdThreadStartWrite(pDisk);
-                AssertRC(rc2);
-                fLockWrite = true;
+                    /* Need to hold the write lock during a read-write operation. */
+                    rc2 = vdThreadStartWrite(pDisk);
+                    AssertRC(rc2);
+                    fLockWrite = true;
 
-                rc = pImageTo->Backend->pfnRead(pImageTo->pBackendData,
-                                                uOffset, cbThisRead,
-                                                &IoCtx, &cbThisRead);
-                if (rc == VERR_VD_BLOCK_FREE)
-                {
-                    /* Search for image with allocated block. Do not attempt to
-                     * read more than the previous reads marked as valid.
-                     * Otherwise this would return stale data when different
-                     * block sizes are used for the images. */
-                    for (PVDIMAGE pCurrImage = pImageTo->pPrev;
-                         pCurrImage != NULL && pCurrImage != pImageFrom->pPrev && rc == VERR_VD_BLOCK_FREE;
-                         pCurrImage = pCurrImage->pPrev)
+                    rc = pImageTo->Backend->pfnRead(pImageTo->pBackendData,
+                                                    uOffset, cbThisRead,
+                                                    &IoCtx, &cbThisRead);
+                    if (rc == VERR_VD_BLOCK_FREE)
                     {
-                        rc = pCurrImage->Backend->pfnRead(pCurrImage->pBackendData,
-                                                          uOffset, cbThisRead,
-                                                          &IoCtx, &cbThisRead);
+                        /* Search for image with allocated block. Do not attempt to
+                         * read more than the previous reads marked as valid.
+                         * Otherwise this would return stale data when different
+                         * block sizes are used for the images. */
+                        for (PVDIMAGE pCurrImage = pImageTo->pPrev;
+                             pCurrImage != NULL && pCurrImage != pImageFrom->pPrev && rc == VERR_VD_BLOCK_FREE;
+                             pCurrImage = pCurrImage->pPrev)
+                        {
+                            rc = pCurrImage->Backend->pfnRead(pCurrImage->pBackendData,
+                                                              uOffset, cbThisRead,
+                                                              &IoCtx, &cbThisRead);
+                        }
+
+                        if (rc != VERR_VD_BLOCK_FREE)
+                        {
+                            if (RT_FAILURE(rc))
+                                break;
+                            /* Updating the cache is required because this might be a live merge. */
+                            rc = vdWriteHelperEx(pDisk, pImageTo, pImageFrom->pPrev,
+                                                 uOffset, pvBuf, cbThisRead,
+                                                 VDIOCTX_FLAGS_READ_UPDATE_CACHE, 0);
+                            if (RT_FAILURE(rc))
+                                break;
+                        }
+                        else
+                            rc = VINF_SUCCESS;
                     }
+                    else if (RT_FAILURE(rc))
+                        break;
 
-                    if (rc != VERR_VD_BLOCK_FREE)
+                    rc2 = vdThreadFinishWrite(pDisk);
+                    AssertRC(rc2);
+                    fLockWrite = false;
+
+                    uOffset += cbThisRead;
+                    cbRemaining -= cbThisRead;
+
+                    if (pIfProgress && pIfProgress->pfnProgress)
                     {
-                        if (RT_FAILURE(rc))
-                            break;
-                        /* Updating the cache is required because this might be a live merge. */
-                        rc = vdWriteHelperEx(pDisk, pImageTo, pImageFrom->pPrev,
-                                             uOffset, pvBuf, cbThisRead,
-                                             VDIOCTX_FLAGS_READ_UPDATE_CACHE, 0);
+                        /** @todo r=klaus: this can update the progress to the same
+                         * percentage over and over again if the image format makes
+                         * relatively small increments. */
+                        rc = pIfProgress->pfnProgress(pIfProgress->Core.pvUser,
+                                                      uOffset * 99 / cbSize);
                         if (RT_FAILURE(rc))
                             break;
                     }
-                    else
-                        rc = VINF_SUCCESS;
-                }
-                else if (RT_FAILURE(rc))
-                    break;
-
-                rc2 = vdThreadFinishWrite(pDisk);
-                AssertRC(rc2);
-                fLockWrite = false;
-
-                uOffset += cbThisRead;
-                cbRemaining -= cbThisRead;
-
-                if (pIfProgress && pIfProgress->pfnProgress)
-                {
-                    /** @todo r=klaus: this can update the progress to the same
-                     * percentage over and over again if the image format makes
-                     * relatively small increments. */
-                    rc = pIfProgress->pfnProgress(pIfProgress->Core.pvUser,
-                                                  uOffset * 99 / cbSize);
-                    if (RT_FAILURE(rc))
-                        break;
-                }
-            } while (uOffset < cbSize);
+                } while (uOffset < cbSize);
+            }
         }
         else
         {
@@ -7950,71 +9890,77 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
             /* Merge child state into parent. This means writing all blocks
              * which are allocated in the image up to the source image to the
              * destination image. */
-            uint64_t uOffset = 0;
-            uint64_t cbRemaining = cbSize;
-            do
+            if (fMergeHelper)
+                rc = vdMergeHelper(pDisk, pImageFrom, pImageTo, pImageTo, NULL,
+                                   VDCOPY_F_SKIP_FREE, cbSize, pIfProgress, pIfCfg);
+            else
             {
-                size_t cbThisRead = RT_MIN(VD_MERGE_BUFFER_SIZE, cbRemaining);
-                RTSGSEG SegmentBuf;
-                RTSGBUF SgBuf;
-                VDIOCTX IoCtx;
+                uint64_t uOffset = 0;
+                uint64_t cbRemaining = cbSize;
+                do
+                {
+                    size_t cbThisRead = RT_MIN(VD_MERGE_BUFFER_SIZE, cbRemaining);
+                    RTSGSEG SegmentBuf;
+                    RTSGBUF SgBuf;
+                    VDIOCTX IoCtx;
 
-                rc = VERR_VD_BLOCK_FREE;
+                    rc = VERR_VD_BLOCK_FREE;
 
-                SegmentBuf.pvSeg = pvBuf;
-                SegmentBuf.cbSeg = VD_MERGE_BUFFER_SIZE;
-                RTSgBufInit(&SgBuf, &SegmentBuf, 1);
-                vdIoCtxInit(&IoCtx, pDisk, VDIOCTXTXDIR_READ, 0, 0, NULL,
-                            &SgBuf, NULL, NULL, VDIOCTX_FLAGS_SYNC);
+                    SegmentBuf.pvSeg = pvBuf;
+                    SegmentBuf.cbSeg = VD_MERGE_BUFFER_SIZE;
+                    RTSgBufInit(&SgBuf, &SegmentBuf, 1);
+                    vdIoCtxInit(&IoCtx, pDisk, VDIOCTXTXDIR_READ, 0, 0, NULL,
+                                &SgBuf, NULL, NULL, VDIOCTX_FLAGS_SYNC);
 
-                /* Need to hold the write lock during a read-write operation. */
-                rc2 = vdThreadStartWrite(pDisk);
-                AssertRC(rc2);
-                fLockWrite = true;
+                    /* Need to hold the write lock during a read-write operation. */
+                    rc2 = vdThreadStartWrite(pDisk);
+                    AssertRC(rc2);
+                    fLockWrite = true;
 
-                /* Search for image with allocated block. Do not attempt to
-                 * read more than the previous reads marked as valid. Otherwise
-                 * this would return stale data when different block sizes are
-                 * used for the images. */
-                for (PVDIMAGE pCurrImage = pImageFrom;
-                     pCurrImage != NULL && pCurrImage != pImageTo && rc == VERR_VD_BLOCK_FREE;
-                     pCurrImage = pCurrImage->pPrev)
-                {
-                    rc = pCurrImage->Backend->pfnRead(pCurrImage->pBackendData,
-                                                           uOffset, cbThisRead,
-                                                           &IoCtx, &cbThisRead);
-                }
+                    /* Search for image with allocated block. Do not attempt to
+                     * read more than the previous reads marked as valid. Otherwise
+                     * this would return stale data when different block sizes are
+                     * used for the images. */
+                    for (PVDIMAGE pCurrImage = pImageFrom;
+                         pCurrImage != NULL && pCurrImage != pImageTo && rc == VERR_VD_BLOCK_FREE;
+                         pCurrImage = pCurrImage->pPrev)
+                    {
+                        rc = pCurrImage->Backend->pfnRead(pCurrImage->pBackendData,
+                                                               uOffset, cbThisRead,
+                                                               &IoCtx, &cbThisRead);
+                    }
 
-                if (rc != VERR_VD_BLOCK_FREE)
-                {
-                    if (RT_FAILURE(rc))
-                        break;
-                    rc = vdWriteHelper(pDisk, pImageTo, uOffset, pvBuf,
-                                       cbThisRead, VDIOCTX_FLAGS_READ_UPDATE_CACHE);
-                    if (RT_FAILURE(rc))
-                        break;
-                }
-                else
-                    rc = VINF_SUCCESS;
+                    if (rc != VERR_VD_BLOCK_FREE)
+                    {
+                        if (RT_FAILURE(rc))
+                            break;
+                        rc = vdWriteHelper(pDisk, pImageTo, uOffset, pvBuf,
+                                           cbThisRead, VDIOCTX_FLAGS_READ_UPDATE_CACHE);
+                        if (RT_FAILURE(rc))
+                            break;
+                    }
+                    else
+                        rc = VINF_SUCCESS;
 
-                rc2 = vdThreadFinishWrite(pDisk);
-                AssertRC(rc2);
-                fLockWrite = false;
+                    rc2 = vdThreadFinishWrite(pDisk);
+                    AssertRC(rc2);
+                    fLockWrite = false;
 
-                uOffset += cbThisRead;
-                cbRemaining -= cbThisRead;
+                    uOffset += cbThisRead;
+                    cbRemaining -= cbThisRead;
 
-                if (pIfProgress && pIfProgress->pfnProgress)
-                {
-                    /** @todo r=klaus: this can update the progress to the same
-                     * percentage over and over again if the image format makes
-                     * relatively small increments. */
-                    rc = pIfProgress->pfnProgress(pIfProgress->Core.pvUser,
-                                                  uOffset * 99 / cbSize);
-                    if (RT_FAILURE(rc))
-                        break;
-                }
-            } while (uOffset < cbSize);
+                    if (pIfProgress && pIfProgress->pfnProgress)
+                    {
+                        /** @todo r=klaus: this can update the progress to the same
+                         * percentage over and over again if the image format makes
+                         * relatively small increments. */
+                        rc = pIfProgress->pfnProgress(pIfProgress->Core.pvUser,
+                                                      uOffset * 99 / cbSize);
+                        if (RT_FAILURE(rc))
+                            break;
+                    }
+                } while (uOffset < cbSize);
+            }
 
             /* In case we set up a "write proxy" image above we must clear
              * this again now to prevent stray writes. Failure or not. */
@@ -8221,6 +10167,10 @@ VBOXDDU_DECL(int) VDCopyEx(PVBOXHDD pDiskFrom, unsigned nImage, PVBOXHDD pDiskTo
 
     PVDINTERFACEPROGRESS pIfProgress    = VDIfProgressGet(pVDIfsOperation);
     PVDINTERFACEPROGRESS pDstIfProgress = VDIfProgressGet(pDstVDIfsOperation);
+    /* The copy parameters may come with either operation interface list. */
+    PVDINTERFACECONFIG   pIfCfg         = VDIfConfigGet(pVDIfsOperation);
+    if (!pIfCfg)
+        pIfCfg = VDIfConfigGet(pDstVDIfsOperation);
 
     do {
         /* Check arguments. */
@@ -8427,7 +10377,8 @@ VBOXDDU_DECL(int) VDCopyEx(PVBOXHDD pDiskFrom, unsigned nImage, PVBOXHDD pDiskTo
         /* Copy the data. */
         rc = vdCopyHelper(pDiskFrom, pImageFrom, pDiskTo, cbSize,
                           cImagesFromReadBack, cImagesToReadBack,
-                          fSuppressRedundantIo, pIfProgress, pDstIfProgress);
+                          fSuppressRedundantIo, pIfProgress, pDstIfProgress,
+                          pIfCfg);
 
         if (RT_SUCCESS(rc))
         {
@@ -10873,18 +12824,101 @@ VBOXDDU_DECL(int) VDDiscardRanges(PVBOXHDD pDisk, PCRTRANGE paRanges, unsigned c
 }
 
 
+VBOXDDU_DECL(int) VDIoQueuesSet(PVBOXHDD pDisk, uint32_t cIoQueues)
+{
+    int rc = VINF_SUCCESS;
+    int rc2;
+    bool fLockWrite = false;
+
+    LogFlowFunc(("pDisk=%#p cIoQueues=%u\n", pDisk, cIoQueues));
+    do
+    {
+        /* sanity check */
+        AssertPtrBreakStmt(pDisk, rc = VERR_INVALID_PARAMETER);
+        AssertMsg(pDisk->u32Signature == VBOXHDDDISK_SIGNATURE, ("u32Signature=%08x\n", pDisk->u32Signature));
+
+        /* Check arguments. */
+        AssertMsgBreakStmt(cIoQueues <= VD_IO_QUEUES_MAX,
+                           ("cIoQueues=%u\n", cIoQueues),
+                           rc = VERR_INVALID_PARAMETER);
+
+        rc2 = vdThreadStartWrite(pDisk);
+        AssertRC(rc2);
+        fLockWrite = true;
+
+        PVDIOQUEUE paIoQueues = NULL;
+        if (cIoQueues)
+        {
+            paIoQueues = (PVDIOQUEUE)RTMemAllocZ(cIoQueues * sizeof(VDIOQUEUE));
+            if (!paIoQueues)
+            {
+                rc = VERR_NO_MEMORY;
+                break;
+            }
+        }
+
+        /*
+         * The queues can only be changed while there is no I/O active. Taking the disk lock
+         * keeps other threads from referencing the array until the new one is in place.
+         */
+        bool fIdle = ASMAtomicCmpXchgBool(&pDisk->fLocked, true, false);
+        if (fIdle)
+        {
+            fIdle =    !ASMAtomicReadU32(&pDisk->cIoQueueRefs)
+                    && !ASMAtomicReadPtrT(&pDisk->pIoCtxHead, PVDIOCTX)
+                    && !ASMAtomicReadPtrT(&pDisk->pIoTasksSubmitHead, PVDIOTASKSUBMIT);
+            if (fIdle)
+            {
+                PVDIOQUEUE paIoQueuesOld = pDisk->paIoQueues;
+                pDisk->paIoQueues   = paIoQueues;
+                pDisk->cIoQueues    = cIoQueues;
+                pDisk->iIoQueueNext = 0;
+                paIoQueues = paIoQueuesOld;
+            }
+
+            /* Process whatever was deferred while the disk was locked. */
+            vdDiskUnlock(pDisk, NULL);
+        }
+
+        if (paIoQueues)
+            RTMemFree(paIoQueues);
+        AssertMsgBreakStmt(fIdle, ("Changing the I/O queues while I/O is active\n"),
+                           rc = VERR_VD_INVALID_STATE);
+    } while (0);
+
+    if (RT_UNLIKELY(fLockWrite))
+    {
+        rc2 = vdThreadFinishWrite(pDisk);
+        AssertRC(rc2);
+    }
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+
 VBOXDDU_DECL(int) VDAsyncRead(PVBOXHDD pDisk, uint64_t uOffset, size_t cbRead,
                               PCRTSGBUF pcSgBuf,
                               PFNVDASYNCTRANSFERCOMPLETE pfnComplete,
                               void *pvUser1, void *pvUser2)
+{
+    return VDAsyncReadQueued(pDisk, VD_IO_QUEUE_ID_NONE, uOffset, cbRead, pcSgBuf,
+                             pfnComplete, pvUser1, pvUser2);
+}
+
+
+VBOXDDU_DECL(int) VDAsyncReadQueued(PVBOXHDD pDisk, uint32_t idIoQueue, uint64_t uOffset,
+                                    size_t cbRead, PCRTSGBUF pcSgBuf,
+                                    PFNVDASYNCTRANSFERCOMPLETE pfnComplete,
+                                    void *pvUser1, void *pvUser2)
 {
     int rc = VERR_VD_BLOCK_FREE;
     int rc2;
     bool fLockRead = false;
     PVDIOCTX pIoCtx = NULL;
 
-    LogFlowFunc(("pDisk=%#p uOffset=%llu pcSgBuf=%#p cbRead=%zu pvUser1=%#p pvUser2=%#p\n",
-                 pDisk, uOffset, pcSgBuf, cbRead, pvUser1, pvUser2));
+    LogFlowFunc(("pDisk=%#p idIoQueue=%#x uOffset=%llu pcSgBuf=%#p cbRead=%zu pvUser1=%#p pvUser2=%#p\n",
+                 pDisk, idIoQueue, uOffset, pcSgBuf, cbRead, pvUser1, pvUser2));
 
     do
     {
@@ -10908,19 +12942,29 @@ VBOXDDU_DECL(int) VDAsyncRead(PVBOXHDD pDisk, uint64_t uOffset, size_t cbRead,
                            ("uOffset=%llu cbRead=%zu pDisk->cbSize=%llu\n",
                             uOffset, cbRead, pDisk->cbSize),
                            rc = VERR_INVALID_PARAMETER);
+        AssertMsgBreakStmt(   idIoQueue == VD_IO_QUEUE_ID_NONE
+                           || idIoQueue < pDisk->cIoQueues,
+                           ("idIoQueue=%#x cIoQueues=%u\n", idIoQueue, pDisk->cIoQueues),
+                           rc = VERR_INVALID_PARAMETER);
         AssertPtrBreakStmt(pDisk->pLast, rc = VERR_VD_NOT_OPENED);
 
         pIoCtx = vdIoCtxRootAlloc(pDisk, VDIOCTXTXDIR_READ, uOffset,
                                   cbRead, pDisk->pLast, pcSgBuf,
                                   pfnComplete, pvUser1, pvUser2,
                                   NULL, vdReadHelperAsync,
-                                  VDIOCTX_FLAGS_ZERO_FREE_BLOCKS);
+                                  VDIOCTX_FLAGS_ZERO_FREE_BLOCKS | VDIOCTX_FLAGS_READ_UPDATE_CACHE);
         if (!pIoCtx)
         {
             rc = VERR_NO_MEMORY;
             break;
         }
 
+        if (idIoQueue != VD_IO_QUEUE_ID_NONE)
+        {
+            ASMAtomicIncU32(&pDisk->cIoQueueRefs);
+            pIoCtx->pIoQueue = &pDisk->paIoQueues[idIoQueue];
+        }
+
         rc = vdIoCtxProcessTryLockDefer(pIoCtx);
         if (rc == VINF_VD_ASYNC_IO_FINISHED)
         {
@@ -10949,14 +12993,24 @@ VBOXDDU_DECL(int) VDAsyncWrite(PVBOXHDD pDisk, uint64_t uOffset, size_t cbWrite,
                                PCRTSGBUF pcSgBuf,
                                PFNVDASYNCTRANSFERCOMPLETE pfnComplete,
                                void *pvUser1, void *pvUser2)
+{
+    return VDAsyncWriteQueued(pDisk, VD_IO_QUEUE_ID_NONE, uOffset, cbWrite, pcSgBuf,
+                              pfnComplete, pvUser1, pvUser2);
+}
+
+
+VBOXDDU_DECL(int) VDAsyncWriteQueued(PVBOXHDD pDisk, uint32_t idIoQueue, uint64_t uOffset,
+                                     size_t cbWrite, PCRTSGBUF pcSgBuf,
+                                     PFNVDASYNCTRANSFERCOMPLETE pfnComplete,
+                                     void *pvUser1, void *pvUser2)
 {
     int rc;
     int rc2;
     bool fLockWrite = false;
     PVDIOCTX pIoCtx = NULL;
 
-    LogFlowFunc(("pDisk=%#p uOffset=%llu cSgBuf=%#p cbWrite=%zu pvUser1=%#p pvUser2=%#p\n",
-                 pDisk, uOffset, pcSgBuf, cbWrite, pvUser1, pvUser2));
+    LogFlowFunc(("pDisk=%#p idIoQueue=%#x uOffset=%llu cSgBuf=%#p cbWrite=%zu pvUser1=%#p pvUser2=%#p\n",
+                 pDisk, idIoQueue, uOffset, pcSgBuf, cbWrite, pvUser1, pvUser2));
     do
     {
         /* sanity check */
@@ -10979,6 +13033,10 @@ VBOXDDU_DECL(int) VDAsyncWrite(PVBOXHDD pDisk, uint64_t uOffset, size_t cbWrite,
                            ("uOffset=%llu cbWrite=%zu pDisk->cbSize=%llu\n",
                             uOffset, cbWrite, pDisk->cbSize),
                            rc = VERR_INVALID_PARAMETER);
+        AssertMsgBreakStmt(   idIoQueue == VD_IO_QUEUE_ID_NONE
+                           || idIoQueue < pDisk->cIoQueues,
+                           ("idIoQueue=%#x cIoQueues=%u\n", idIoQueue, pDisk->cIoQueues),
+                           rc = VERR_INVALID_PARAMETER);
         AssertPtrBreakStmt(pDisk->pLast, rc = VERR_VD_NOT_OPENED);
 
         pIoCtx = vdIoCtxRootAlloc(pDisk, VDIOCTXTXDIR_WRITE, uOffset,
@@ -10992,6 +13050,12 @@ VBOXDDU_DECL(int) VDAsyncWrite(PVBOXHDD pDisk, uint64_t uOffset, size_t cbWrite,
             break;
         }
 
+        if (idIoQueue != VD_IO_QUEUE_ID_NONE)
+        {
+            ASMAtomicIncU32(&pDisk->cIoQueueRefs);
+            pIoCtx->pIoQueue = &pDisk->paIoQueues[idIoQueue];
+        }
+
         rc = vdIoCtxProcessTryLockDefer(pIoCtx);
         if (rc == VINF_VD_ASYNC_IO_FINISHED)
         {
@@ -28,6 +28,8 @@
 #include <iprt/assert.h>
 #include <iprt/alloc.h>
 #include <iprt/path.h>
+#include <iprt/string.h>
+#include <iprt/utf16.h>
 #include <iprt/uuid.h>
 #include <iprt/crc.h>
 
@@ -260,6 +262,8 @@ typedef VhdxLogDataSector *PVhdxLogDataSector;
 
 /** Signature of a VHDX log data sector ("data"). */
 #define VHDX_LOG_DATA_SECTOR_SIGNATURE UINT32_C(0x61746164)
+/** Size of a log sector, log entries and updates are done in units of this size. */
+#define VHDX_LOG_SECTOR_SIZE           _4K
 
 /**
  * VHDX BAT entry.
@@ -279,6 +283,8 @@ typedef VhdxBatEntry *PVhdxBatEntry;
 #define VHDX_BAT_ENTRY_GET_FILE_OFFSET_MB(bat) (((bat) & UINT64_C(0xfffffffffff00000)) >> 20)
 /** Get a byte offset from the BAT entry. */
 #define VHDX_BAT_ENTRY_GET_FILE_OFFSET(bat) (VHDX_BAT_ENTRY_GET_FILE_OFFSET_MB(bat) * (uint64_t)_1M)
+/** Create a BAT entry from a 1MB aligned file offset and a state. */
+#define VHDX_BAT_ENTRY_MAKE(off, state) (((uint64_t)(off) & UINT64_C(0xfffffffffff00000)) | (uint64_t)(state))
 
 /** Block not present and the data is undefined. */
 #define VHDX_BAT_ENTRY_PAYLOAD_BLOCK_NOT_PRESENT       (0)
@@ -430,7 +436,7 @@ typedef struct VhdxVDiskLogicalSectorSize *PVhdxVDiskLogicalSectorSize;
 typedef struct VhdxVDiskPhysicalSectorSize
 {
     /** Physical sector size. */
-    uint64_t    u64PhysicalSectorSize;
+    uint32_t    u32PhysicalSectorSize;
 } VhdxVDiskPhysicalSectorSize;
 #pragma pack()
 /** Pointer to an on disk VHDX virtual disk physical sector size metadata item. */
@@ -455,6 +461,14 @@ typedef struct VhdxParentLocatorHeader *PVhdxParentLocatorHeader;
 
 /** VHDX parent locator type. */
 #define VHDX_PARENT_LOCATOR_TYPE_VHDX "b04aefb7-d19e-4a81-b789-25b8e9445913"
+/** Parent locator key holding the data write UUID of the parent. */
+#define VHDX_PARENT_LOCATOR_KEY_LINKAGE       "parent_linkage"
+/** Parent locator key holding the path of the parent relative to the image. */
+#define VHDX_PARENT_LOCATOR_KEY_RELATIVE_PATH "relative_path"
+/** Parent locator key holding the absolute path of the parent. */
+#define VHDX_PARENT_LOCATOR_KEY_ABSOLUTE_PATH "absolute_win32_path"
+/** VirtualBox specific parent locator key holding the image UUID of the parent. */
+#define VHDX_PARENT_LOCATOR_KEY_VBOX_PARENT_UUID "vbox_parent_uuid"
 
 /**
  * VHDX parent locator entry.
@@ -509,6 +523,176 @@ typedef struct VHDXMETADATAITEMPROPS
     VHDXMETADATAITEM     enmMetadataItem;
 } VHDXMETADATAITEMPROPS;
 
+/** Size of a page as tracked by the metadata log. */
+#define VHDX_PAGE_SIZE                   _4K
+/** Number of pages in a sector bitmap block. */
+#define VHDX_SB_BLOCK_PAGES              (_1M / VHDX_PAGE_SIZE)
+
+/** @name Defaults used when creating a new image.
+ * @{ */
+/** Default block size. */
+#define VHDX_CREATE_BLOCK_SIZE           _1M
+/** Default logical sector size. */
+#define VHDX_CREATE_LOGICAL_SECTOR_SIZE  512
+/** Default physical sector size. */
+#define VHDX_CREATE_PHYSICAL_SECTOR_SIZE _4K
+/** Offset of the log. */
+#define VHDX_CREATE_LOG_OFFSET           _1M
+/** Size of the log. */
+#define VHDX_CREATE_LOG_SIZE             _1M
+/** Offset of the metadata region. */
+#define VHDX_CREATE_METADATA_OFFSET      _2M
+/** Size of the metadata region. */
+#define VHDX_CREATE_METADATA_SIZE        _1M
+/** Offset of the first metadata item relative to the metadata region start. */
+#define VHDX_CREATE_METADATA_ITEM_OFFSET _64K
+/** Offset of the parent locator item relative to the metadata region start. */
+#define VHDX_CREATE_PARENT_LOCATOR_OFFSET (_64K + _4K)
+/** Offset of the BAT region. */
+#define VHDX_CREATE_BAT_OFFSET           (3 * _1M)
+/** @} */
+
+/** Maximum virtual disk size supported by the format. */
+#define VHDX_VDISK_SIZE_MAX              (UINT64_C(64) * _1T)
+
+/**
+ * A metadata page staged for the next log entry.
+ */
+typedef struct VHDXMETAPAGE
+{
+    /** File offset of the page. */
+    uint64_t            offFile;
+    /** Flag whether the page was changed since the last commit. */
+    bool                fDirty;
+    /** The page data. */
+    uint8_t             abData[VHDX_PAGE_SIZE];
+} VHDXMETAPAGE;
+/** Pointer to a staged metadata page. */
+typedef VHDXMETAPAGE *PVHDXMETAPAGE;
+
+/**
+ * A range of the file replaced by a log entry which was not applied yet
+ * (readonly images with a non empty log).
+ */
+typedef struct VHDXLOGRANGE
+{
+    /** Start offset in the file. */
+    uint64_t            offFile;
+    /** Size of the range. */
+    uint64_t            cbRange;
+    /** The data, NULL if the range reads as zero. */
+    uint8_t            *pbData;
+} VHDXLOGRANGE;
+/** Pointer to a log range. */
+typedef VHDXLOGRANGE *PVHDXLOGRANGE;
+
+/**
+ * List of payload block file offsets.
+ */
+typedef struct VHDXBLOCKLIST
+{
+    /** Array of block offsets. */
+    uint64_t           *paoffBlocks;
+    /** Number of entries used. */
+    uint32_t            cBlocks;
+    /** Number of entries allocated. */
+    uint32_t            cBlocksMax;
+} VHDXBLOCKLIST;
+/** Pointer to a block list. */
+typedef VHDXBLOCKLIST *PVHDXBLOCKLIST;
+
+/**
+ * States of a metadata commit.
+ */
+typedef enum VHDXCOMMITSTATE
+{
+    /** Invalid state, no commit active. */
+    VHDXCOMMITSTATE_INVALID = 0,
+    /** Flush the payload data written so far. */
+    VHDXCOMMITSTATE_FLUSH_DATA,
+    /** Write the non current header. */
+    VHDXCOMMITSTATE_WRITE_HDR,
+    /** Flush the header. */
+    VHDXCOMMITSTATE_FLUSH_HDR,
+    /** Collect the dirty metadata pages and build the log entry. */
+    VHDXCOMMITSTATE_COLLECT,
+    /** Write the log entry. */
+    VHDXCOMMITSTATE_WRITE_LOG,
+    /** Flush the log entry. */
+    VHDXCOMMITSTATE_FLUSH_LOG,
+    /** Write the pages to their final location. */
+    VHDXCOMMITSTATE_WRITE_PAGES,
+    /** Flush the pages. */
+    VHDXCOMMITSTATE_FLUSH_PAGES,
+    /** The commit completed. */
+    VHDXCOMMITSTATE_DONE,
+    VHDXCOMMITSTATE_32BIT_HACK = 0x7fffffff
+} VHDXCOMMITSTATE;
+
+/**
+ * Metadata commit state, the buffers are allocated once when the image
+ * is opened for writing.
+ */
+typedef struct VHDXCOMMIT
+{
+    /** Current state. */
+    VHDXCOMMITSTATE     enmState;
+    /** Number of pages collected for the current log entry. */
+    uint32_t            cPages;
+    /** Maximum number of pages fitting into one log entry. */
+    uint32_t            cPagesMax;
+    /** File offsets of the collected pages. */
+    uint64_t           *paoffPages;
+    /** Data of the collected pages. */
+    uint8_t            *pbPages;
+    /** The log entry buffer. */
+    uint8_t            *pbLogEntry;
+    /** Size of the current log entry. */
+    uint32_t            cbLogEntry;
+    /** Flag whether the header was written during this commit. */
+    bool                fHdrWritten;
+    /** Number of requests pending for the current state (including a guard reference). */
+    volatile uint32_t   cReqsPending;
+    /** Status of the first failed request. */
+    volatile int32_t    rcReqs;
+    /** Blocks freed by discards which become reusable after this commit. */
+    VHDXBLOCKLIST       BlocksFreed;
+} VHDXCOMMIT;
+/** Pointer to the metadata commit state. */
+typedef VHDXCOMMIT *PVHDXCOMMIT;
+
+/**
+ * Block allocation in progress.
+ */
+typedef struct VHDXBLOCKALLOC
+{
+    /** Next allocation in progress. */
+    struct VHDXBLOCKALLOC *pNext;
+    /** BAT index of the block. */
+    uint32_t            idxBat;
+    /** Number of full block writes to the new block in flight. */
+    uint32_t            cWritesPending;
+    /** Flag whether at least one of the writes succeeded. */
+    bool                fSuccess;
+    /** File offset of the new block. */
+    uint64_t            offFile;
+} VHDXBLOCKALLOC;
+/** Pointer to a block allocation. */
+typedef VHDXBLOCKALLOC *PVHDXBLOCKALLOC;
+
+/**
+ * Sector bitmap update for a write to a partially present block.
+ */
+typedef struct VHDXSBUPDATE
+{
+    /** Start offset of the write in the virtual disk. */
+    uint64_t            uOffset;
+    /** Size of the write. */
+    size_t              cb;
+} VHDXSBUPDATE;
+/** Pointer to a sector bitmap update. */
+typedef VHDXSBUPDATE *PVHDXSBUPDATE;
+
 /**
  * VHDX image data structure.
  */
@@ -545,10 +729,80 @@ typedef struct VHDXIMAGE
     /** Logical geometry of this image. */
     VDGEOMETRY          LCHSGeometry;
 
+    /** The current header in host endianess. */
+    VhdxHeader          Hdr;
+    /** Index of the current header (0 or 1). */
+    unsigned            idxHdr;
+    /** Flag whether the header needs to be written during the next commit. */
+    bool                fHdrDirty;
+    /** Flag whether the log was initialized for this session (image is writable). */
+    bool                fLogInitialized;
+    /** Sequence number of the next log entry. */
+    uint64_t            uLogSeqNext;
+    /** Flags from the file parameters metadata item. */
+    uint32_t            fFileParams;
+
     /** The BAT. */
     PVhdxBatEntry       paBat;
     /** Chunk ratio. */
     uint32_t            uChunkRatio;
+    /** Number of entries in the BAT. */
+    uint32_t            cBatEntries;
+    /** Start offset of the BAT region. */
+    uint64_t            offBat;
+    /** Bitmap of BAT pages changed since the last commit. */
+    void               *pbmBatDirty;
+    /** Number of sector bitmap blocks. */
+    uint32_t            cSbBlocks;
+    /** Array of sector bitmap blocks, NULL entries if not present. */
+    uint8_t           **papbSb;
+    /** Bitmap of sector bitmap pages changed since the last commit. */
+    void               *pbmSbDirty;
+
+    /** Start offset of the metadata region. */
+    uint64_t            offMetadata;
+    /** Size of the metadata region. */
+    uint32_t            cbMetadata;
+    /** File offset of the page 83 data item. */
+    uint64_t            offPage83;
+    /** The page 83 UUID, used as the image UUID. */
+    RTUUID              UuidPage83;
+
+    /** File offset of the metadata table entry for the parent locator. */
+    uint64_t            offParentLocatorEntry;
+    /** Copy of the metadata table entry for the parent locator in host endianess. */
+    VhdxMetadataTblEntry ParentLocatorEntry;
+    /** File offset of the parent locator. */
+    uint64_t            offParentLocator;
+    /** Maximum size the parent locator can grow to. */
+    uint32_t            cbParentLocatorMax;
+    /** Parent locator keys. */
+    char              **papszLocatorKeys;
+    /** Parent locator values. */
+    char              **papszLocatorValues;
+    /** Number of parent locator entries. */
+    uint32_t            cLocatorEntries;
+
+    /** Staged metadata region pages. */
+    PVHDXMETAPAGE      *papMetaPages;
+    /** Number of staged metadata pages. */
+    uint32_t            cMetaPages;
+
+    /** End of all allocated structures in the file, where new blocks are allocated. */
+    uint64_t            offFileEnd;
+    /** Blocks which can be reused for new allocations. */
+    VHDXBLOCKLIST       BlocksFree;
+    /** Blocks freed since the last commit, not reusable yet. */
+    VHDXBLOCKLIST       BlocksFreePending;
+    /** Head of the block allocations in progress. */
+    PVHDXBLOCKALLOC     pBlockAllocHead;
+    /** The metadata commit state. */
+    VHDXCOMMIT          Commit;
+
+    /** Ranges of a not yet applied log for readonly images. */
+    PVHDXLOGRANGE       paLogRanges;
+    /** Number of log ranges. */
+    uint32_t            cLogRanges;
 
 } VHDXIMAGE, *PVHDXIMAGE;
 
@@ -660,9 +914,9 @@ DECLINLINE(void) vhdxConvHeaderEndianess(VHDXECONV enmConv, PVhdxHeader pHdrConv
     pHdrConv->u32Signature      = SET_ENDIAN_U32(pHdr->u32Signature);
     pHdrConv->u32Checksum       = SET_ENDIAN_U32(pHdr->u32Checksum);
     pHdrConv->u64SequenceNumber = SET_ENDIAN_U64(pHdr->u64SequenceNumber);
-    vhdxConvUuidEndianess(enmConv, &pHdrConv->UuidFileWrite, &pHdrConv->UuidFileWrite);
-    vhdxConvUuidEndianess(enmConv, &pHdrConv->UuidDataWrite, &pHdrConv->UuidDataWrite);
-    vhdxConvUuidEndianess(enmConv, &pHdrConv->UuidLog, &pHdrConv->UuidLog);
+    vhdxConvUuidEndianess(enmConv, &pHdrConv->UuidFileWrite, &pHdr->UuidFileWrite);
+    vhdxConvUuidEndianess(enmConv, &pHdrConv->UuidDataWrite, &pHdr->UuidDataWrite);
+    vhdxConvUuidEndianess(enmConv, &pHdrConv->UuidLog, &pHdr->UuidLog);
     pHdrConv->u16LogVersion     = SET_ENDIAN_U16(pHdr->u16LogVersion);
     pHdrConv->u16Version        = SET_ENDIAN_U16(pHdr->u16Version);
     pHdrConv->u32LogLength      = SET_ENDIAN_U32(pHdr->u32LogLength);
@@ -707,8 +961,6 @@ DECLINLINE(void) vhdxConvRegionTblEntryEndianess(VHDXECONV enmConv, PVhdxRegionT
     pRegTblEntConv->u32Flags      = SET_ENDIAN_U32(pRegTblEnt->u32Flags);
 }
 
-#if 0 /* unused */
-
 /**
  * Converts a VHDX log entry header between file and host endianness.
  *
@@ -731,6 +983,7 @@ DECLINLINE(void) vhdxConvLogEntryHdrEndianess(VHDXECONV enmConv, PVhdxLogEntryHd
     pLogEntryHdrConv->u32Reserved          = SET_ENDIAN_U32(pLogEntryHdr->u32Reserved);
     vhdxConvUuidEndianess(enmConv, &pLogEntryHdrConv->UuidLog, &pLogEntryHdr->UuidLog);
     pLogEntryHdrConv->u64FlushedFileOffset = SET_ENDIAN_U64(pLogEntryHdr->u64FlushedFileOffset);
+    pLogEntryHdrConv->u64LastFileOffset    = SET_ENDIAN_U64(pLogEntryHdr->u64LastFileOffset);
 }
 
 /**
@@ -793,7 +1046,6 @@ DECLINLINE(void) vhdxConvLogDataSectorEndianess(VHDXECONV enmConv, PVhdxLogDataS
     pLogDataSectorConv->u32SequenceLow   = SET_ENDIAN_U32(pLogDataSector->u32SequenceLow);
 }
 
-#endif /* unused */
 
 /**
  * Converts a BAT between file and host endianess.
@@ -886,8 +1138,6 @@ DECLINLINE(void) vhdxConvVDiskSizeEndianess(VHDXECONV enmConv, PVhdxVDiskSize pV
     pVDiskSizeConv->u64VDiskSize  = SET_ENDIAN_U64(pVDiskSize->u64VDiskSize);
 }
 
-#if 0 /* unused */
-
 /**
  * Converts a VHDX page 83 data item between file and host endianness.
  *
@@ -903,7 +1153,6 @@ DECLINLINE(void) vhdxConvPage83DataEndianess(VHDXECONV enmConv, PVhdxPage83Data
 {
     vhdxConvUuidEndianess(enmConv, &pPage83DataConv->UuidPage83Data, &pPage83Data->UuidPage83Data);
 }
-#endif /* unused */
 
 /**
  * Converts a VHDX logical sector size item between file and host endianness.
@@ -921,8 +1170,6 @@ DECLINLINE(void) vhdxConvVDiskLogSectSizeEndianess(VHDXECONV enmConv, PVhdxVDisk
     pVDiskLogSectSizeConv->u32LogicalSectorSize = SET_ENDIAN_U32(pVDiskLogSectSize->u32LogicalSectorSize);
 }
 
-#if 0 /* unused */
-
 /**
  * Converts a VHDX physical sector size item between file and host endianness.
  *
@@ -936,7 +1183,7 @@ DECLINLINE(void) vhdxConvVDiskLogSectSizeEndianess(VHDXECONV enmConv, PVhdxVDisk
 DECLINLINE(void) vhdxConvVDiskPhysSectSizeEndianess(VHDXECONV enmConv, PVhdxVDiskPhysicalSectorSize pVDiskPhysSectSizeConv,
                                                     PVhdxVDiskPhysicalSectorSize pVDiskPhysSectSize)
 {
-    pVDiskPhysSectSizeConv->u64PhysicalSectorSize = SET_ENDIAN_U64(pVDiskPhysSectSize->u64PhysicalSectorSize);
+    pVDiskPhysSectSizeConv->u32PhysicalSectorSize = SET_ENDIAN_U32(pVDiskPhysSectSize->u32PhysicalSectorSize);
 }
 
 
@@ -978,31 +1225,1718 @@ DECLINLINE(void) vhdxConvParentLocatorEntryEndianess(VHDXECONV enmConv, PVhdxPar
     pParentLocatorEntryConv->u16ValueLength = SET_ENDIAN_U16(pParentLocatorEntry->u16ValueLength);
 }
 
-#endif /* unused */
 
 /**
- * Internal. Free all allocated space for representing an image except pImage,
- * and optionally delete the image from disk.
+ * Converts a little endian UTF-16 string from the image to UTF-8.
+ *
+ * @returns VBox status code.
+ * @param   pbUtf16     The UTF-16 string (not necessarily terminated or aligned).
+ * @param   cbUtf16     Size of the string in bytes.
+ * @param   ppsz        Where to store the pointer to the UTF-8 string on success,
+ *                      free with RTStrFree().
  */
-static int vhdxFreeImage(PVHDXIMAGE pImage, bool fDelete)
+static int vhdxUtf16LeToUtf8(const uint8_t *pbUtf16, size_t cbUtf16, char **ppsz)
+{
+    size_t cwc = cbUtf16 / sizeof(RTUTF16);
+    PRTUTF16 pwsz = (PRTUTF16)RTMemTmpAllocZ((cwc + 1) * sizeof(RTUTF16));
+    if (!pwsz)
+        return VERR_NO_MEMORY;
+
+    for (size_t i = 0; i < cwc; i++)
+    {
+        uint16_t u16;
+        memcpy(&u16, pbUtf16 + i * sizeof(RTUTF16), sizeof(u16));
+        pwsz[i] = RT_LE2H_U16(u16);
+    }
+
+    *ppsz = NULL;
+    int rc = RTUtf16ToUtf8Ex(pwsz, cwc, ppsz, 0, NULL);
+    RTMemTmpFree(pwsz);
+    return rc;
+}
+
+/**
+ * Converts a UTF-8 string to little endian UTF-16 as stored in the image.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_BUFFER_OVERFLOW if the buffer is too small.
+ * @param   psz         The UTF-8 string.
+ * @param   pbBuf       Where to store the UTF-16 string (without terminator).
+ * @param   cbBuf       Size of the buffer.
+ * @param   pcbUtf16    Where to store the size of the UTF-16 string in bytes.
+ */
+static int vhdxUtf8ToUtf16Le(const char *psz, uint8_t *pbBuf, size_t cbBuf, size_t *pcbUtf16)
+{
+    PRTUTF16 pwsz = NULL;
+    size_t cwc = 0;
+    int rc = RTStrToUtf16Ex(psz, RTSTR_MAX, &pwsz, 0, &cwc);
+    if (RT_SUCCESS(rc))
+    {
+        if (cwc * sizeof(RTUTF16) <= cbBuf)
+        {
+            for (size_t i = 0; i < cwc; i++)
+            {
+                uint16_t u16 = RT_H2LE_U16(pwsz[i]);
+                memcpy(pbBuf + i * sizeof(RTUTF16), &u16, sizeof(u16));
+            }
+            *pcbUtf16 = cwc * sizeof(RTUTF16);
+        }
+        else
+            rc = VERR_BUFFER_OVERFLOW;
+
+        RTUtf16Free(pwsz);
+    }
+
+    return rc;
+}
+
+/**
+ * Appends a block offset to the given block list.
+ *
+ * @returns VBox status code.
+ * @param   pList     The block list.
+ * @param   offBlock  The file offset of the block.
+ */
+static int vhdxBlockListAdd(PVHDXBLOCKLIST pList, uint64_t offBlock)
+{
+    if (pList->cBlocks == pList->cBlocksMax)
+    {
+        uint32_t cBlocksMaxNew = pList->cBlocksMax ? pList->cBlocksMax * 2 : 16;
+        uint64_t *paoffBlocksNew = (uint64_t *)RTMemRealloc(pList->paoffBlocks, cBlocksMaxNew * sizeof(uint64_t));
+        if (!paoffBlocksNew)
+            return VERR_NO_MEMORY;
+
+        pList->paoffBlocks = paoffBlocksNew;
+        pList->cBlocksMax  = cBlocksMaxNew;
+    }
+
+    pList->paoffBlocks[pList->cBlocks++] = offBlock;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Moves all blocks from one list to another.
+ *
+ * @returns VBox status code, the source list is unchanged on failure.
+ * @param   pDst      The list to append the blocks to.
+ * @param   pSrc      The list to take the blocks from, empty on success.
+ */
+static int vhdxBlockListMove(PVHDXBLOCKLIST pDst, PVHDXBLOCKLIST pSrc)
+{
+    if (!pSrc->cBlocks)
+        return VINF_SUCCESS;
+
+    if (pDst->cBlocks + pSrc->cBlocks > pDst->cBlocksMax)
+    {
+        uint32_t cBlocksMaxNew = pDst->cBlocks + pSrc->cBlocks;
+        uint64_t *paoffBlocksNew = (uint64_t *)RTMemRealloc(pDst->paoffBlocks, cBlocksMaxNew * sizeof(uint64_t));
+        if (!paoffBlocksNew)
+            return VERR_NO_MEMORY;
+
+        pDst->paoffBlocks = paoffBlocksNew;
+        pDst->cBlocksMax  = cBlocksMaxNew;
+    }
+
+    memcpy(&pDst->paoffBlocks[pDst->cBlocks], pSrc->paoffBlocks, pSrc->cBlocks * sizeof(uint64_t));
+    pDst->cBlocks += pSrc->cBlocks;
+    pSrc->cBlocks = 0;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Frees all resources of the given block list.
+ *
+ * @returns nothing.
+ * @param   pList     The block list.
+ */
+static void vhdxBlockListFree(PVHDXBLOCKLIST pList)
+{
+    if (pList->paoffBlocks)
+        RTMemFree(pList->paoffBlocks);
+    pList->paoffBlocks = NULL;
+    pList->cBlocks     = 0;
+    pList->cBlocksMax  = 0;
+}
+
+/**
+ * Reads data synchronously from the image, taking the ranges of a log which
+ * could not be replayed (readonly image) into account.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   off       Start offset in the file.
+ * @param   pvBuf     Where to store the data.
+ * @param   cbRead    How much to read.
+ */
+static int vhdxReadSync(PVHDXIMAGE pImage, uint64_t off, void *pvBuf, size_t cbRead)
+{
+    int rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, off, pvBuf, cbRead);
+    if (RT_SUCCESS(rc))
+    {
+        /* Ranges are kept in log order so later updates win. */
+        for (uint32_t i = 0; i < pImage->cLogRanges; i++)
+        {
+            PVHDXLOGRANGE pRange = &pImage->paLogRanges[i];
+            uint64_t offStart = RT_MAX(off, pRange->offFile);
+            uint64_t offEnd   = RT_MIN(off + cbRead, pRange->offFile + pRange->cbRange);
+
+            if (offStart < offEnd)
+            {
+                uint8_t *pbDst = (uint8_t *)pvBuf + (offStart - off);
+                if (pRange->pbData)
+                    memcpy(pbDst, pRange->pbData + (offStart - pRange->offFile), (size_t)(offEnd - offStart));
+                else
+                    memset(pbDst, 0, (size_t)(offEnd - offStart));
+            }
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * Frees the log ranges of the image.
+ *
+ * @returns nothing.
+ * @param   pImage    Image instance data.
+ */
+static void vhdxLogRangesFree(PVHDXIMAGE pImage)
+{
+    for (uint32_t i = 0; i < pImage->cLogRanges; i++)
+        if (pImage->paLogRanges[i].pbData)
+            RTMemFree(pImage->paLogRanges[i].pbData);
+
+    if (pImage->paLogRanges)
+        RTMemFree(pImage->paLogRanges);
+    pImage->paLogRanges = NULL;
+    pImage->cLogRanges  = 0;
+}
+
+/**
+ * Returns the BAT index for the payload block containing the given offset.
+ *
+ * @returns BAT index.
+ * @param   pImage    Image instance data.
+ * @param   uOffset   Offset in the virtual disk.
+ */
+DECLINLINE(uint32_t) vhdxBatIdxFromOffset(PVHDXIMAGE pImage, uint64_t uOffset)
+{
+    uint32_t idxBlock = (uint32_t)(uOffset / pImage->cbBlock); Assert(idxBlock == uOffset / pImage->cbBlock);
+    return idxBlock + idxBlock / pImage->uChunkRatio; /* Add interleaving sector bitmap entries. */
+}
+
+/**
+ * Returns the number of pages the BAT occupies in the file.
+ *
+ * @returns Number of BAT pages.
+ * @param   pImage    Image instance data.
+ */
+DECLINLINE(uint32_t) vhdxBatPageCount(PVHDXIMAGE pImage)
+{
+    return RT_ALIGN_32(pImage->cBatEntries, VHDX_PAGE_SIZE / sizeof(VhdxBatEntry)) / (VHDX_PAGE_SIZE / sizeof(VhdxBatEntry));
+}
+
+/**
+ * Changes a BAT entry and marks the containing page as dirty.
+ *
+ * @returns nothing.
+ * @param   pImage    Image instance data.
+ * @param   idxBat    The BAT index.
+ * @param   uBatEntry The new entry.
+ */
+static void vhdxBatSet(PVHDXIMAGE pImage, uint32_t idxBat, uint64_t uBatEntry)
+{
+    Assert(idxBat < pImage->cBatEntries);
+    pImage->paBat[idxBat].u64BatEntry = uBatEntry;
+    ASMBitSet(pImage->pbmBatDirty, idxBat / (VHDX_PAGE_SIZE / sizeof(VhdxBatEntry)));
+}
+
+/**
+ * Marks the sectors of the given range as present in the sector bitmap.
+ *
+ * @returns nothing.
+ * @param   pImage    Image instance data.
+ * @param   uOffset   Start offset in the virtual disk.
+ * @param   cb        Size of the range, must not cross a block boundary.
+ */
+static void vhdxSbSetRange(PVHDXIMAGE pImage, uint64_t uOffset, size_t cb)
+{
+    uint64_t cbChunk = (uint64_t)pImage->uChunkRatio * pImage->cbBlock;
+    uint32_t idxSb   = (uint32_t)(uOffset / cbChunk);
+    uint64_t offChunk = uOffset % cbChunk;
+    uint32_t iBitStart = (uint32_t)(offChunk / pImage->cbLogicalSector);
+    uint32_t iBitEnd   = (uint32_t)((offChunk + cb + pImage->cbLogicalSector - 1) / pImage->cbLogicalSector);
+    uint8_t *pbSb = pImage->papbSb[idxSb];
+
+    AssertPtrReturnVoid(pbSb);
+    ASMBitSetRange(pbSb, iBitStart, iBitEnd);
+
+    for (uint32_t idxPage = iBitStart / 8 / VHDX_PAGE_SIZE; idxPage <= (iBitEnd - 1) / 8 / VHDX_PAGE_SIZE; idxPage++)
+        ASMBitSet(pImage->pbmSbDirty, idxSb * VHDX_SB_BLOCK_PAGES + idxPage);
+}
+
+/**
+ * Returns the staged copy of the given metadata page, loading it if required.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   offPage   File offset of the page.
+ * @param   ppPage    Where to store the pointer to the page on success.
+ */
+static int vhdxMetaPageGet(PVHDXIMAGE pImage, uint64_t offPage, PVHDXMETAPAGE *ppPage)
+{
+    for (uint32_t i = 0; i < pImage->cMetaPages; i++)
+    {
+        if (pImage->papMetaPages[i]->offFile == offPage)
+        {
+            *ppPage = pImage->papMetaPages[i];
+            return VINF_SUCCESS;
+        }
+    }
+
+    PVHDXMETAPAGE *papMetaPagesNew = (PVHDXMETAPAGE *)RTMemRealloc(pImage->papMetaPages,
+                                                                  (pImage->cMetaPages + 1) * sizeof(PVHDXMETAPAGE));
+    if (!papMetaPagesNew)
+        return VERR_NO_MEMORY;
+    pImage->papMetaPages = papMetaPagesNew;
+
+    PVHDXMETAPAGE pPage = (PVHDXMETAPAGE)RTMemAllocZ(sizeof(VHDXMETAPAGE));
+    if (!pPage)
+        return VERR_NO_MEMORY;
+
+    int rc = vhdxReadSync(pImage, offPage, &pPage->abData[0], sizeof(pPage->abData));
+    if (RT_SUCCESS(rc))
+    {
+        pPage->offFile = offPage;
+        pImage->papMetaPages[pImage->cMetaPages++] = pPage;
+        *ppPage = pPage;
+    }
+    else
+        RTMemFree(pPage);
+
+    return rc;
+}
+
+/**
+ * Updates a part of the metadata region, the change is written to the file
+ * through the log during the next commit.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   offFile   File offset to write to.
+ * @param   pvBuf     The data to write.
+ * @param   cbWrite   Number of bytes to write.
+ */
+static int vhdxMetaWrite(PVHDXIMAGE pImage, uint64_t offFile, const void *pvBuf, size_t cbWrite)
 {
+    const uint8_t *pbBuf = (const uint8_t *)pvBuf;
     int rc = VINF_SUCCESS;
 
-    /* Freeing a never allocated image (e.g. because the open failed) is
-     * not signalled as an error. After all nothing bad happens. */
-    if (pImage)
+    while (   cbWrite
+           && RT_SUCCESS(rc))
     {
-        if (pImage->pStorage)
+        uint64_t offPage   = offFile & ~(uint64_t)(VHDX_PAGE_SIZE - 1);
+        size_t   offInPage = (size_t)(offFile - offPage);
+        size_t   cbThis    = RT_MIN(cbWrite, VHDX_PAGE_SIZE - offInPage);
+        PVHDXMETAPAGE pPage = NULL;
+
+        rc = vhdxMetaPageGet(pImage, offPage, &pPage);
+        if (RT_SUCCESS(rc))
         {
-            rc = vdIfIoIntFileClose(pImage->pIfIo, pImage->pStorage);
-            pImage->pStorage = NULL;
+            memcpy(&pPage->abData[offInPage], pbBuf, cbThis);
+            pPage->fDirty = true;
+
+            offFile += cbThis;
+            pbBuf   += cbThis;
+            cbWrite -= cbThis;
         }
+    }
 
-        if (pImage->paBat)
+    return rc;
+}
+
+/**
+ * Prepares the given header for writing, the sequence number is incremented.
+ *
+ * @returns File offset the header must be written to (the non current header).
+ * @param   pImage    Image instance data.
+ * @param   pHdr      Where to store the header in file endianess with a valid checksum.
+ */
+static uint64_t vhdxHeaderPrepare(PVHDXIMAGE pImage, PVhdxHeader pHdr)
+{
+    pImage->Hdr.u64SequenceNumber++;
+    memcpy(pHdr, &pImage->Hdr, sizeof(*pHdr));
+    pHdr->u32Checksum = 0;
+    vhdxConvHeaderEndianess(VHDXECONV_H2F, pHdr, pHdr);
+    pHdr->u32Checksum = RT_H2LE_U32(RTCrc32C(pHdr, sizeof(*pHdr)));
+
+    return pImage->idxHdr == 0 ? VHDX_HEADER2_OFFSET : VHDX_HEADER1_OFFSET;
+}
+
+/**
+ * Writes the in memory header synchronously, making it the current one.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ */
+static int vhdxHeaderWriteSync(PVHDXIMAGE pImage)
+{
+    VhdxHeader Hdr;
+    uint64_t offHdr = vhdxHeaderPrepare(pImage, &Hdr);
+
+    int rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, offHdr, &Hdr, sizeof(Hdr));
+    if (RT_SUCCESS(rc))
+        rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+    if (RT_SUCCESS(rc))
+    {
+        pImage->idxHdr ^= 1;
+        pImage->fHdrDirty = false;
+    }
+    else
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                       "VHDX: Writing the header of image \'%s\' failed",
+                       pImage->pszFilename);
+
+    return rc;
+}
+
+/**
+ * Checks whether the log entry at the given offset is valid.
+ *
+ * @returns true if the entry is valid, false otherwise.
+ * @param   pImage    Image instance data.
+ * @param   pbLog     The complete log, followed by a second copy so entries
+ *                    wrapping around the end can be accessed linearly.
+ * @param   cbLog     Size of the log.
+ * @param   offEntry  Offset of the entry in the log.
+ * @param   pLogHdr   Where to store the entry header in host endianess.
+ */
+static bool vhdxLogEntryIsValid(PVHDXIMAGE pImage, const uint8_t *pbLog, uint32_t cbLog,
+                                uint32_t offEntry, PVhdxLogEntryHdr pLogHdr)
+{
+    const uint8_t *pbEntry = pbLog + offEntry;
+
+    memcpy(pLogHdr, pbEntry, sizeof(*pLogHdr));
+    vhdxConvLogEntryHdrEndianess(VHDXECONV_F2H, pLogHdr, pLogHdr);
+
+    if (   pLogHdr->u32Signature != VHDX_LOG_ENTRY_HEADER_SIGNATURE
+        || !pLogHdr->u32EntryLength
+        || pLogHdr->u32EntryLength % VHDX_LOG_SECTOR_SIZE
+        || pLogHdr->u32EntryLength > cbLog
+        || pLogHdr->u32Tail % VHDX_LOG_SECTOR_SIZE
+        || pLogHdr->u32Tail >= cbLog
+        || RTUuidCompare(&pLogHdr->UuidLog, &pImage->Hdr.UuidLog)
+        || pLogHdr->u32DescriptorCount > (cbLog - sizeof(VhdxLogEntryHdr)) / sizeof(VhdxLogDataDesc))
+        return false;
+
+    uint32_t cbDesc = RT_ALIGN_32(sizeof(VhdxLogEntryHdr) + pLogHdr->u32DescriptorCount * sizeof(VhdxLogDataDesc),
+                                  VHDX_LOG_SECTOR_SIZE);
+    if (cbDesc > pLogHdr->u32EntryLength)
+        return false;
+
+    /* The checksum covers the complete entry with the checksum field set to 0. */
+    uint32_t u32Zero = 0;
+    uint32_t u32ChkSum = RTCrc32CStart();
+    u32ChkSum = RTCrc32CProcess(u32ChkSum, pbEntry, RT_OFFSETOF(VhdxLogEntryHdr, u32Checksum));
+    u32ChkSum = RTCrc32CProcess(u32ChkSum, &u32Zero, sizeof(u32Zero));
+    u32ChkSum = RTCrc32CProcess(u32ChkSum, pbEntry + RT_OFFSETOF(VhdxLogEntryHdr, u32EntryLength),
+                                pLogHdr->u32EntryLength - RT_OFFSETOF(VhdxLogEntryHdr, u32EntryLength));
+    if (RTCrc32CFinish(u32ChkSum) != pLogHdr->u32Checksum)
+        return false;
+
+    uint32_t cDataSectors = 0;
+    for (uint32_t i = 0; i < pLogHdr->u32DescriptorCount; i++)
+    {
+        const uint8_t *pbDesc = pbEntry + sizeof(VhdxLogEntryHdr) + i * sizeof(VhdxLogDataDesc);
+        uint32_t u32Signature;
+
+        memcpy(&u32Signature, pbDesc, sizeof(u32Signature));
+        u32Signature = RT_LE2H_U32(u32Signature);
+        if (u32Signature == VHDX_LOG_DATA_DESC_SIGNATURE)
         {
-            RTMemFree(pImage->paBat);
-            pImage->paBat = NULL;
+            VhdxLogDataDesc DataDesc;
+            VhdxLogDataSector DataSector;
+
+            memcpy(&DataDesc, pbDesc, sizeof(DataDesc));
+            vhdxConvLogDataDescEndianess(VHDXECONV_F2H, &DataDesc, &DataDesc);
+            if (   DataDesc.u64SequenceNumber != pLogHdr->u64SequenceNumber
+                || DataDesc.u64FileOffset % VHDX_LOG_SECTOR_SIZE
+                || cbDesc + (cDataSectors + 1) * VHDX_LOG_SECTOR_SIZE > pLogHdr->u32EntryLength)
+                return false;
+
+            memcpy(&DataSector, pbEntry + cbDesc + cDataSectors * VHDX_LOG_SECTOR_SIZE, sizeof(DataSector));
+            vhdxConvLogDataSectorEndianess(VHDXECONV_F2H, &DataSector, &DataSector);
+            if (   DataSector.u32DataSignature != VHDX_LOG_DATA_SECTOR_SIGNATURE
+                || RT_MAKE_U64(DataSector.u32SequenceLow, DataSector.u32SequenceHigh) != pLogHdr->u64SequenceNumber)
+                return false;
+
+            cDataSectors++;
+        }
+        else if (u32Signature == VHDX_LOG_ZERO_DESC_SIGNATURE)
+        {
+            VhdxLogZeroDesc ZeroDesc;
+
+            memcpy(&ZeroDesc, pbDesc, sizeof(ZeroDesc));
+            vhdxConvLogZeroDescEndianess(VHDXECONV_F2H, &ZeroDesc, &ZeroDesc);
+            if (   ZeroDesc.u64SequenceNumber != pLogHdr->u64SequenceNumber
+                || ZeroDesc.u64ZeroLength % VHDX_LOG_SECTOR_SIZE
+                || ZeroDesc.u64FileOffset % VHDX_LOG_SECTOR_SIZE)
+                return false;
+        }
+        else
+            return false;
+    }
+
+    return cbDesc + cDataSectors * VHDX_LOG_SECTOR_SIZE == pLogHdr->u32EntryLength;
+}
+
+/**
+ * Checks whether the given log entry is the head of a valid sequence, i.e. all
+ * entries from its tail up to the entry are valid and have consecutive sequence
+ * numbers.
+ *
+ * @returns true if the sequence is valid, false otherwise.
+ * @param   pImage    Image instance data.
+ * @param   pbLog     The log, see vhdxLogEntryIsValid().
+ * @param   cbLog     Size of the log.
+ * @param   offHead   Offset of the head entry.
+ * @param   pHdrHead  The header of the head entry in host endianess.
+ */
+static bool vhdxLogSequenceIsValid(PVHDXIMAGE pImage, const uint8_t *pbLog, uint32_t cbLog,
+                                   uint32_t offHead, PVhdxLogEntryHdr pHdrHead)
+{
+    uint32_t offEntry = pHdrHead->u32Tail;
+    uint64_t uSeqExpected = 0;
+    bool fFirst = true;
+
+    for (uint32_t cEntries = 0; cEntries <= cbLog / VHDX_LOG_SECTOR_SIZE; cEntries++)
+    {
+        VhdxLogEntryHdr LogHdr;
+
+        if (   !vhdxLogEntryIsValid(pImage, pbLog, cbLog, offEntry, &LogHdr)
+            || (   !fFirst
+                && LogHdr.u64SequenceNumber != uSeqExpected))
+            return false;
+
+        if (offEntry == offHead)
+            return LogHdr.u64SequenceNumber == pHdrHead->u64SequenceNumber;
+
+        fFirst       = false;
+        uSeqExpected = LogHdr.u64SequenceNumber + 1;
+        offEntry     = (offEntry + LogHdr.u32EntryLength) % cbLog;
+    }
+
+    return false;
+}
+
+/**
+ * Adds a log range to the image.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   offFile   Start offset of the range in the file.
+ * @param   cbRange   Size of the range.
+ * @param   pbData    The data for the range, NULL if the range is zeroed.
+ *                    Ownership is transferred to the image on success.
+ */
+static int vhdxLogRangeAdd(PVHDXIMAGE pImage, uint64_t offFile, uint64_t cbRange, uint8_t *pbData)
+{
+    PVHDXLOGRANGE paLogRangesNew = (PVHDXLOGRANGE)RTMemRealloc(pImage->paLogRanges,
+                                                               (pImage->cLogRanges + 1) * sizeof(VHDXLOGRANGE));
+    if (!paLogRangesNew)
+        return VERR_NO_MEMORY;
+
+    pImage->paLogRanges = paLogRangesNew;
+    pImage->paLogRanges[pImage->cLogRanges].offFile = offFile;
+    pImage->paLogRanges[pImage->cLogRanges].cbRange = cbRange;
+    pImage->paLogRanges[pImage->cLogRanges].pbData  = pbData;
+    pImage->cLogRanges++;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Adds the updates of a valid log entry to the log ranges of the image.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   pbEntry   The log entry.
+ * @param   pLogHdr   The log entry header in host endianess.
+ */
+static int vhdxLogEntryCollect(PVHDXIMAGE pImage, const uint8_t *pbEntry, PVhdxLogEntryHdr pLogHdr)
+{
+    uint32_t cbDesc = RT_ALIGN_32(sizeof(VhdxLogEntryHdr) + pLogHdr->u32DescriptorCount * sizeof(VhdxLogDataDesc),
+                                  VHDX_LOG_SECTOR_SIZE);
+    uint32_t cDataSectors = 0;
+    int rc = VINF_SUCCESS;
+
+    for (uint32_t i = 0; i < pLogHdr->u32DescriptorCount && RT_SUCCESS(rc); i++)
+    {
+        const uint8_t *pbDesc = pbEntry + sizeof(VhdxLogEntryHdr) + i * sizeof(VhdxLogDataDesc);
+        uint32_t u32Signature;
+
+        memcpy(&u32Signature, pbDesc, sizeof(u32Signature));
+        if (RT_LE2H_U32(u32Signature) == VHDX_LOG_DATA_DESC_SIGNATURE)
+        {
+            VhdxLogDataDesc DataDesc;
+            const uint8_t *pbSector = pbEntry + cbDesc + cDataSectors * VHDX_LOG_SECTOR_SIZE;
+            uint8_t *pbData = (uint8_t *)RTMemAlloc(VHDX_LOG_SECTOR_SIZE);
+
+            if (!pbData)
+            {
+                rc = VERR_NO_MEMORY;
+                break;
+            }
+
+            memcpy(&DataDesc, pbDesc, sizeof(DataDesc));
+            vhdxConvLogDataDescEndianess(VHDXECONV_F2H, &DataDesc, &DataDesc);
+
+            /* The leading and trailing bytes are stored in the descriptor. */
+            memcpy(pbData, pbDesc + RT_OFFSETOF(VhdxLogDataDesc, u64LeadingBytes), sizeof(uint64_t));
+            memcpy(pbData + sizeof(uint64_t), pbSector + RT_OFFSETOF(VhdxLogDataSector, u8Data),
+                   RT_SIZEOFMEMB(VhdxLogDataSector, u8Data));
+            memcpy(pbData + VHDX_LOG_SECTOR_SIZE - sizeof(uint32_t),
+                   pbDesc + RT_OFFSETOF(VhdxLogDataDesc, u32TrailingBytes), sizeof(uint32_t));
+
+            rc = vhdxLogRangeAdd(pImage, DataDesc.u64FileOffset, VHDX_LOG_SECTOR_SIZE, pbData);
+            if (RT_FAILURE(rc))
+                RTMemFree(pbData);
+            cDataSectors++;
+        }
+        else
+        {
+            VhdxLogZeroDesc ZeroDesc;
+
+            memcpy(&ZeroDesc, pbDesc, sizeof(ZeroDesc));
+            vhdxConvLogZeroDescEndianess(VHDXECONV_F2H, &ZeroDesc, &ZeroDesc);
+            rc = vhdxLogRangeAdd(pImage, ZeroDesc.u64FileOffset, ZeroDesc.u64ZeroLength, NULL);
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * Writes the collected log ranges to the file.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ */
+static int vhdxLogRangesApply(PVHDXIMAGE pImage)
+{
+    uint8_t *pbZero = NULL;
+    int rc = VINF_SUCCESS;
+
+    for (uint32_t i = 0; i < pImage->cLogRanges && RT_SUCCESS(rc); i++)
+    {
+        PVHDXLOGRANGE pRange = &pImage->paLogRanges[i];
+
+        if (pRange->pbData)
+            rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, pRange->offFile,
+                                        pRange->pbData, (size_t)pRange->cbRange);
+        else
+        {
+            if (!pbZero)
+            {
+                pbZero = (uint8_t *)RTMemTmpAllocZ(_1M);
+                if (!pbZero)
+                {
+                    rc = VERR_NO_MEMORY;
+                    break;
+                }
+            }
+
+            uint64_t offFile = pRange->offFile;
+            uint64_t cbLeft  = pRange->cbRange;
+            while (   cbLeft
+                   && RT_SUCCESS(rc))
+            {
+                size_t cbThisWrite = (size_t)RT_MIN(cbLeft, _1M);
+
+                rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, offFile,
+                                            pbZero, cbThisWrite);
+                offFile += cbThisWrite;
+                cbLeft  -= cbThisWrite;
+            }
+        }
+    }
+
+    if (pbZero)
+        RTMemTmpFree(pbZero);
+
+    return rc;
+}
+
+/**
+ * Replays the log of the image. Readonly images keep the updates in memory and
+ * apply them to all metadata reads instead.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   cbFile    Size of the image file.
+ */
+static int vhdxLogReplay(PVHDXIMAGE pImage, uint64_t cbFile)
+{
+    uint64_t offLog = pImage->Hdr.u64LogOffset;
+    uint32_t cbLog  = pImage->Hdr.u32LogLength;
+    int rc = VINF_SUCCESS;
+
+    LogFlowFunc(("pImage=%#p cbFile=%llu\n", pImage, cbFile));
+
+    if (   !cbLog
+        || cbLog % _1M
+        || offLog % _1M
+        || offLog + cbLog > cbFile)
+        return vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                         "VHDX: Invalid log location in the header of image \'%s\'",
+                         pImage->pszFilename);
+
+    /* Keep a second copy behind the log so wrapping entries are contiguous. */
+    uint8_t *pbLog = (uint8_t *)RTMemAlloc(2 * (size_t)cbLog);
+    if (!pbLog)
+        return vdIfError(pImage->pIfError, VERR_NO_MEMORY, RT_SRC_POS,
+                         "VHDX: Out of memory allocating memory for the log of image \'%s\'",
+                         pImage->pszFilename);
+
+    rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, offLog, pbLog, cbLog);
+    if (RT_SUCCESS(rc))
+    {
+        VhdxLogEntryHdr HdrHead;
+        uint32_t offHead = 0;
+        bool fHeadFound = false;
+
+        memcpy(pbLog + cbLog, pbLog, cbLog);
+
+        /* The active sequence is the valid one with the highest sequence number. */
+        for (uint32_t offEntry = 0; offEntry < cbLog; offEntry += VHDX_LOG_SECTOR_SIZE)
+        {
+            VhdxLogEntryHdr LogHdr;
+
+            if (   vhdxLogEntryIsValid(pImage, pbLog, cbLog, offEntry, &LogHdr)
+                && (   !fHeadFound
+                    || LogHdr.u64SequenceNumber > HdrHead.u64SequenceNumber)
+                && vhdxLogSequenceIsValid(pImage, pbLog, cbLog, offEntry, &LogHdr))
+            {
+                fHeadFound = true;
+                offHead    = offEntry;
+                memcpy(&HdrHead, &LogHdr, sizeof(HdrHead));
+            }
+        }
+
+        if (fHeadFound)
+        {
+            LogRel(("VHDX: Replaying log of image \'%s\' (head sequence number %llu)\n",
+                    pImage->pszFilename, HdrHead.u64SequenceNumber));
+
+            if (HdrHead.u64FlushedFileOffset > cbFile)
+                rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                               "VHDX: Image \'%s\' is truncated, the log can not be replayed",
+                               pImage->pszFilename);
+            else
+            {
+                uint32_t offEntry = HdrHead.u32Tail;
+
+                for (;;)
+                {
+                    VhdxLogEntryHdr LogHdr;
+
+                    vhdxLogEntryIsValid(pImage, pbLog, cbLog, offEntry, &LogHdr);
+                    rc = vhdxLogEntryCollect(pImage, pbLog + offEntry, &LogHdr);
+                    if (   RT_FAILURE(rc)
+                        || offEntry == offHead)
+                        break;
+                    offEntry = (offEntry + LogHdr.u32EntryLength) % cbLog;
+                }
+
+                if (   RT_SUCCESS(rc)
+                    && !(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
+                {
+                    rc = vhdxLogRangesApply(pImage);
+                    if (   RT_SUCCESS(rc)
+                        && HdrHead.u64LastFileOffset > cbFile)
+                        rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, HdrHead.u64LastFileOffset);
+                    if (RT_SUCCESS(rc))
+                        rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+                    vhdxLogRangesFree(pImage);
+
+                    if (RT_FAILURE(rc))
+                        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                                       "VHDX: Replaying the log of image \'%s\' failed",
+                                       pImage->pszFilename);
+                }
+            }
+        }
+    }
+    else
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                       "VHDX: Reading the log of image \'%s\' failed",
+                       pImage->pszFilename);
+
+    RTMemFree(pbLog);
+
+    LogFlowFunc(("returns rc=%Rrc\n", rc));
+    return rc;
+}
+
+/**
+ * Collects the dirty BAT, sector bitmap and metadata pages for the next log
+ * entry.
+ *
+ * @returns nothing.
+ * @param   pImage    Image instance data.
+ */
+static void vhdxCommitCollect(PVHDXIMAGE pImage)
+{
+    PVHDXCOMMIT pCommit = &pImage->Commit;
+    const uint32_t cEntriesPerPage = VHDX_PAGE_SIZE / sizeof(VhdxBatEntry);
+    uint32_t cBatPages = RT_ALIGN_32(vhdxBatPageCount(pImage), 32);
+    int idxPage;
+
+    pCommit->cPages = 0;
+
+    idxPage = ASMBitFirstSet(pImage->pbmBatDirty, cBatPages);
+    while (   idxPage != -1
+           && pCommit->cPages < pCommit->cPagesMax)
+    {
+        uint8_t *pbPage = pCommit->pbPages + pCommit->cPages * VHDX_PAGE_SIZE;
+        uint32_t idxBatFirst = (uint32_t)idxPage * cEntriesPerPage;
+
+        memset(pbPage, 0, VHDX_PAGE_SIZE);
+        vhdxConvBatTableEndianess(VHDXECONV_H2F, (PVhdxBatEntry)pbPage, &pImage->paBat[idxBatFirst],
+                                  RT_MIN(cEntriesPerPage, pImage->cBatEntries - idxBatFirst));
+        pCommit->paoffPages[pCommit->cPages++] = pImage->offBat + (uint64_t)idxPage * VHDX_PAGE_SIZE;
+        ASMBitClear(pImage->pbmBatDirty, idxPage);
+        idxPage = ASMBitNextSet(pImage->pbmBatDirty, cBatPages, idxPage);
+    }
+
+    if (pImage->cSbBlocks)
+    {
+        uint32_t cSbPages = pImage->cSbBlocks * VHDX_SB_BLOCK_PAGES;
+
+        idxPage = ASMBitFirstSet(pImage->pbmSbDirty, cSbPages);
+        while (   idxPage != -1
+               && pCommit->cPages < pCommit->cPagesMax)
+        {
+            uint32_t idxSb = (uint32_t)idxPage / VHDX_SB_BLOCK_PAGES;
+            uint32_t idxSbPage = (uint32_t)idxPage % VHDX_SB_BLOCK_PAGES;
+            uint64_t uSbEntry = pImage->paBat[idxSb * (pImage->uChunkRatio + 1) + pImage->uChunkRatio].u64BatEntry;
+
+            memcpy(pCommit->pbPages + pCommit->cPages * VHDX_PAGE_SIZE,
+                   pImage->papbSb[idxSb] + idxSbPage * VHDX_PAGE_SIZE, VHDX_PAGE_SIZE);
+            pCommit->paoffPages[pCommit->cPages++] =   VHDX_BAT_ENTRY_GET_FILE_OFFSET(uSbEntry)
+                                                     + idxSbPage * VHDX_PAGE_SIZE;
+            ASMBitClear(pImage->pbmSbDirty, idxPage);
+            idxPage = ASMBitNextSet(pImage->pbmSbDirty, cSbPages, idxPage);
+        }
+    }
+
+    for (uint32_t i = 0; i < pImage->cMetaPages && pCommit->cPages < pCommit->cPagesMax; i++)
+    {
+        PVHDXMETAPAGE pPage = pImage->papMetaPages[i];
+
+        if (pPage->fDirty)
+        {
+            memcpy(pCommit->pbPages + pCommit->cPages * VHDX_PAGE_SIZE, &pPage->abData[0], VHDX_PAGE_SIZE);
+            pCommit->paoffPages[pCommit->cPages++] = pPage->offFile;
+            pPage->fDirty = false;
+        }
+    }
+}
+
+/**
+ * Marks the pages collected for the current log entry as dirty again after
+ * a failed commit.
+ *
+ * @returns nothing.
+ * @param   pImage    Image instance data.
+ */
+static void vhdxCommitRedirtyPages(PVHDXIMAGE pImage)
+{
+    PVHDXCOMMIT pCommit = &pImage->Commit;
+    uint64_t cbBat = (uint64_t)vhdxBatPageCount(pImage) * VHDX_PAGE_SIZE;
+
+    for (uint32_t i = 0; i < pCommit->cPages; i++)
+    {
+        uint64_t offPage = pCommit->paoffPages[i];
+        bool fFound = false;
+
+        if (   offPage >= pImage->offBat
+            && offPage < pImage->offBat + cbBat)
+        {
+            ASMBitSet(pImage->pbmBatDirty, (int32_t)((offPage - pImage->offBat) / VHDX_PAGE_SIZE));
+            continue;
+        }
+
+        for (uint32_t idxMeta = 0; idxMeta < pImage->cMetaPages; idxMeta++)
+        {
+            if (pImage->papMetaPages[idxMeta]->offFile == offPage)
+            {
+                pImage->papMetaPages[idxMeta]->fDirty = true;
+                fFound = true;
+                break;
+            }
+        }
+
+        for (uint32_t idxSb = 0; idxSb < pImage->cSbBlocks && !fFound; idxSb++)
+        {
+            uint64_t uSbEntry = pImage->paBat[idxSb * (pImage->uChunkRatio + 1) + pImage->uChunkRatio].u64BatEntry;
+            uint64_t offSb = VHDX_BAT_ENTRY_GET_FILE_OFFSET(uSbEntry);
+
+            if (   pImage->papbSb[idxSb]
+                && offPage >= offSb
+                && offPage < offSb + _1M)
+            {
+                ASMBitSet(pImage->pbmSbDirty, idxSb * VHDX_SB_BLOCK_PAGES + (int32_t)((offPage - offSb) / VHDX_PAGE_SIZE));
+                fFound = true;
+            }
+        }
+
+        Assert(fFound);
+    }
+
+    pCommit->cPages = 0;
+}
+
+/**
+ * Builds the log entry for the collected pages.
+ *
+ * @returns nothing.
+ * @param   pImage    Image instance data.
+ * @param   cbFile    Current size of the image file.
+ */
+static void vhdxLogEntryBuild(PVHDXIMAGE pImage, uint64_t cbFile)
+{
+    PVHDXCOMMIT pCommit = &pImage->Commit;
+    uint32_t cbDesc = RT_ALIGN_32(sizeof(VhdxLogEntryHdr) + pCommit->cPages * sizeof(VhdxLogDataDesc),
+                                  VHDX_LOG_SECTOR_SIZE);
+    uint8_t *pbEntry = pCommit->pbLogEntry;
+    VhdxLogEntryHdr LogHdr;
+
+    memset(pbEntry, 0, cbDesc);
+
+    /*
+     * Each entry is written to the start of the log after the previous one was
+     * applied, so the entry is always its own tail.
+     */
+    RT_ZERO(LogHdr);
+    LogHdr.u32Signature         = VHDX_LOG_ENTRY_HEADER_SIGNATURE;
+    LogHdr.u32EntryLength       = cbDesc + pCommit->cPages * VHDX_LOG_SECTOR_SIZE;
+    LogHdr.u32Tail              = 0;
+    LogHdr.u64SequenceNumber    = pImage->uLogSeqNext++;
+    LogHdr.u32DescriptorCount   = pCommit->cPages;
+    LogHdr.UuidLog              = pImage->Hdr.UuidLog;
+    LogHdr.u64FlushedFileOffset = cbFile;
+    LogHdr.u64LastFileOffset    = RT_MAX(cbFile, pImage->offFileEnd);
+    vhdxConvLogEntryHdrEndianess(VHDXECONV_H2F, (PVhdxLogEntryHdr)pbEntry, &LogHdr);
+
+    for (uint32_t i = 0; i < pCommit->cPages; i++)
+    {
+        const uint8_t *pbPage = pCommit->pbPages + i * VHDX_PAGE_SIZE;
+        uint8_t *pbDesc = pbEntry + sizeof(VhdxLogEntryHdr) + i * sizeof(VhdxLogDataDesc);
+        uint8_t *pbSector = pbEntry + cbDesc + i * VHDX_LOG_SECTOR_SIZE;
+        VhdxLogDataDesc DataDesc;
+        VhdxLogDataSector DataSector;
+
+        DataDesc.u32DataSignature  = VHDX_LOG_DATA_DESC_SIGNATURE;
+        DataDesc.u32TrailingBytes  = 0;
+        DataDesc.u64LeadingBytes   = 0;
+        DataDesc.u64FileOffset     = pCommit->paoffPages[i];
+        DataDesc.u64SequenceNumber = LogHdr.u64SequenceNumber;
+        vhdxConvLogDataDescEndianess(VHDXECONV_H2F, &DataDesc, &DataDesc);
+        memcpy(pbDesc, &DataDesc, sizeof(DataDesc));
+
+        /* The leading and trailing bytes are raw page data. */
+        memcpy(pbDesc + RT_OFFSETOF(VhdxLogDataDesc, u64LeadingBytes), pbPage, sizeof(uint64_t));
+        memcpy(pbDesc + RT_OFFSETOF(VhdxLogDataDesc, u32TrailingBytes),
+               pbPage + VHDX_PAGE_SIZE - sizeof(uint32_t), sizeof(uint32_t));
+
+        DataSector.u32DataSignature = VHDX_LOG_DATA_SECTOR_SIGNATURE;
+        DataSector.u32SequenceHigh  = RT_HI_U32(LogHdr.u64SequenceNumber);
+        DataSector.u32SequenceLow   = RT_LO_U32(LogHdr.u64SequenceNumber);
+        vhdxConvLogDataSectorEndianess(VHDXECONV_H2F, &DataSector, &DataSector);
+        memcpy(&DataSector.u8Data[0], pbPage + sizeof(uint64_t), sizeof(DataSector.u8Data));
+        memcpy(pbSector, &DataSector, sizeof(DataSector));
+    }
+
+    ((PVhdxLogEntryHdr)pbEntry)->u32Checksum = RT_H2LE_U32(RTCrc32C(pbEntry, LogHdr.u32EntryLength));
+    pCommit->cbLogEntry = LogHdr.u32EntryLength;
+}
+
+static DECLCALLBACK(int) vhdxCommitReqComplete(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq);
+
+/**
+ * Records the status of a request issued for the current commit state.
+ *
+ * @returns nothing.
+ * @param   pCommit   The commit state.
+ * @param   rcReq     Status code returned when issuing the request.
+ */
+static void vhdxCommitReqIssued(PVHDXCOMMIT pCommit, int rcReq)
+{
+    if (rcReq != VERR_VD_ASYNC_IO_IN_PROGRESS)
+    {
+        if (RT_FAILURE(rcReq))
+            ASMAtomicCmpXchgS32(&pCommit->rcReqs, rcReq, VINF_SUCCESS);
+        ASMAtomicDecU32(&pCommit->cReqsPending);
+    }
+}
+
+/**
+ * Cleans up after a failed commit, everything which was not written is marked
+ * dirty again so the next commit retries it.
+ *
+ * @returns nothing.
+ * @param   pImage    Image instance data.
+ */
+static void vhdxCommitFailed(PVHDXIMAGE pImage)
+{
+    PVHDXCOMMIT pCommit = &pImage->Commit;
+
+    vhdxCommitRedirtyPages(pImage);
+
+    /*
+     * A header which was written but not accounted for yet is not necessarily
+     * durable, so the slot isn't switched and the next commit writes it again.
+     */
+    pCommit->fHdrWritten = false;
+
+    /* The discarded blocks stay pending until a commit succeeds. */
+    int rc = vhdxBlockListMove(&pImage->BlocksFreePending, &pCommit->BlocksFreed);
+    if (RT_FAILURE(rc))
+        pCommit->BlocksFreed.cBlocks = 0; /* Leaks the blocks in the file, no harm done. */
+
+    pCommit->enmState = VHDXCOMMITSTATE_INVALID;
+}
+
+/**
+ * Advances the metadata commit, issuing the I/O for the next state(s).
+ *
+ * The commit makes all metadata changes durable using the log: The payload
+ * data is flushed, the header is written if required, the dirty pages are
+ * written to the log and flushed and afterwards written to their final
+ * location. The last step is repeated until no dirty pages are left.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_VD_ASYNC_IO_IN_PROGRESS if the commit continues asynchronously.
+ * @param   pImage    Image instance data.
+ * @param   pIoCtx    The I/O context, NULL for synchronous operation.
+ */
+static int vhdxCommitProcess(PVHDXIMAGE pImage, PVDIOCTX pIoCtx)
+{
+    PVHDXCOMMIT pCommit = &pImage->Commit;
+    PFNVDXFERCOMPLETED pfnComplete = pIoCtx ? vhdxCommitReqComplete : NULL;
+    void *pvUser = pIoCtx ? pCommit : NULL;
+
+    for (;;)
+    {
+        int rc = ASMAtomicReadS32(&pCommit->rcReqs);
+        if (RT_FAILURE(rc))
+        {
+            vhdxCommitFailed(pImage);
+            return rc;
+        }
+
+        VHDXCOMMITSTATE enmStateNext = VHDXCOMMITSTATE_INVALID;
+
+        /* The guard reference keeps completions from continuing the commit while issuing requests. */
+        ASMAtomicWriteU32(&pCommit->cReqsPending, 1);
+
+        switch (pCommit->enmState)
+        {
+            case VHDXCOMMITSTATE_FLUSH_DATA:
+            {
+                ASMAtomicIncU32(&pCommit->cReqsPending);
+                rc = vdIfIoIntFileFlush(pImage->pIfIo, pImage->pStorage, pIoCtx, pfnComplete, pvUser);
+                vhdxCommitReqIssued(pCommit, rc);
+                enmStateNext = pImage->fHdrDirty ? VHDXCOMMITSTATE_WRITE_HDR : VHDXCOMMITSTATE_COLLECT;
+                break;
+            }
+            case VHDXCOMMITSTATE_WRITE_HDR:
+            {
+                VhdxHeader Hdr;
+                uint64_t offHdr = vhdxHeaderPrepare(pImage, &Hdr);
+
+                ASMAtomicIncU32(&pCommit->cReqsPending);
+                rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage, offHdr, &Hdr, sizeof(Hdr),
+                                            pIoCtx, pfnComplete, pvUser);
+                vhdxCommitReqIssued(pCommit, rc);
+                enmStateNext = VHDXCOMMITSTATE_FLUSH_HDR;
+                break;
+            }
+            case VHDXCOMMITSTATE_FLUSH_HDR:
+            {
+                pCommit->fHdrWritten = true;
+                ASMAtomicIncU32(&pCommit->cReqsPending);
+                rc = vdIfIoIntFileFlush(pImage->pIfIo, pImage->pStorage, pIoCtx, pfnComplete, pvUser);
+                vhdxCommitReqIssued(pCommit, rc);
+                enmStateNext = VHDXCOMMITSTATE_COLLECT;
+                break;
+            }
+            case VHDXCOMMITSTATE_COLLECT:
+            {
+                if (pCommit->fHdrWritten)
+                {
+                    pImage->idxHdr ^= 1;
+                    pImage->fHdrDirty    = false;
+                    pCommit->fHdrWritten = false;
+                }
+
+                vhdxCommitCollect(pImage);
+                if (pCommit->cPages)
+                {
+                    uint64_t cbFile = 0;
+
+                    rc = vdIfIoIntFileGetSize(pImage->pIfIo, pImage->pStorage, &cbFile);
+                    if (RT_FAILURE(rc))
+                    {
+                        ASMAtomicCmpXchgS32(&pCommit->rcReqs, rc, VINF_SUCCESS);
+                        break;
+                    }
+
+                    vhdxLogEntryBuild(pImage, cbFile);
+                    enmStateNext = VHDXCOMMITSTATE_WRITE_LOG;
+                }
+                else
+                    enmStateNext = VHDXCOMMITSTATE_DONE;
+                break;
+            }
+            case VHDXCOMMITSTATE_WRITE_LOG:
+            {
+                ASMAtomicIncU32(&pCommit->cReqsPending);
+                rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage, pImage->Hdr.u64LogOffset,
+                                            pCommit->pbLogEntry, pCommit->cbLogEntry,
+                                            pIoCtx, pfnComplete, pvUser);
+                vhdxCommitReqIssued(pCommit, rc);
+                enmStateNext = VHDXCOMMITSTATE_FLUSH_LOG;
+                break;
+            }
+            case VHDXCOMMITSTATE_FLUSH_LOG:
+            {
+                ASMAtomicIncU32(&pCommit->cReqsPending);
+                rc = vdIfIoIntFileFlush(pImage->pIfIo, pImage->pStorage, pIoCtx, pfnComplete, pvUser);
+                vhdxCommitReqIssued(pCommit, rc);
+                enmStateNext = VHDXCOMMITSTATE_WRITE_PAGES;
+                break;
+            }
+            case VHDXCOMMITSTATE_WRITE_PAGES:
+            {
+                /* Write runs of consecutive pages with one request. */
+                uint32_t idxPage = 0;
+                while (idxPage < pCommit->cPages)
+                {
+                    uint32_t cPagesRun = 1;
+                    while (   idxPage + cPagesRun < pCommit->cPages
+                           &&    pCommit->paoffPages[idxPage + cPagesRun]
+                              == pCommit->paoffPages[idxPage] + cPagesRun * VHDX_PAGE_SIZE)
+                        cPagesRun++;
+
+                    ASMAtomicIncU32(&pCommit->cReqsPending);
+                    rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage, pCommit->paoffPages[idxPage],
+                                                pCommit->pbPages + idxPage * VHDX_PAGE_SIZE,
+                                                cPagesRun * VHDX_PAGE_SIZE, pIoCtx, pfnComplete, pvUser);
+                    vhdxCommitReqIssued(pCommit, rc);
+                    if (   RT_FAILURE(rc)
+                        && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                        break;
+                    idxPage += cPagesRun;
+                }
+                enmStateNext = VHDXCOMMITSTATE_FLUSH_PAGES;
+                break;
+            }
+            case VHDXCOMMITSTATE_FLUSH_PAGES:
+            {
+                ASMAtomicIncU32(&pCommit->cReqsPending);
+                rc = vdIfIoIntFileFlush(pImage->pIfIo, pImage->pStorage, pIoCtx, pfnComplete, pvUser);
+                vhdxCommitReqIssued(pCommit, rc);
+                pCommit->cPages = 0;
+                enmStateNext = VHDXCOMMITSTATE_COLLECT; /* More dirty pages might be left. */
+                break;
+            }
+            case VHDXCOMMITSTATE_DONE:
+            {
+                /* The discards are durable now, so the blocks can be reused. */
+                rc = vhdxBlockListMove(&pImage->BlocksFree, &pCommit->BlocksFreed);
+                if (RT_FAILURE(rc))
+                    pCommit->BlocksFreed.cBlocks = 0; /* Leaks the blocks in the file, no harm done. */
+                pCommit->enmState = VHDXCOMMITSTATE_INVALID;
+                return VINF_SUCCESS;
+            }
+            default:
+                AssertMsgFailed(("Invalid commit state %d\n", pCommit->enmState));
+                return VERR_INTERNAL_ERROR;
+        }
+
+        if (enmStateNext != VHDXCOMMITSTATE_INVALID)
+            pCommit->enmState = enmStateNext;
+
+        /* Drop the guard reference, continue in the completion callback if requests are pending. */
+        if (ASMAtomicDecU32(&pCommit->cReqsPending))
+            return VERR_VD_ASYNC_IO_IN_PROGRESS;
+    }
+}
+
+/**
+ * Completion callback for the requests issued during a metadata commit.
+ *
+ * @copydoc FNVDXFERCOMPLETED
+ */
+static DECLCALLBACK(int) vhdxCommitReqComplete(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
+    PVHDXCOMMIT pCommit = (PVHDXCOMMIT)pvUser;
+
+    if (RT_FAILURE(rcReq))
+        ASMAtomicCmpXchgS32(&pCommit->rcReqs, rcReq, VINF_SUCCESS);
+
+    /* Failed requests report their status themselves, the continuation has to report its own failures. */
+    int rc = VINF_SUCCESS;
+    if (!ASMAtomicDecU32(&pCommit->cReqsPending))
+    {
+        rc = vhdxCommitProcess(pImage, pIoCtx);
+        if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            rc = VINF_SUCCESS;
+        else if (RT_FAILURE(rc))
+            LogRel(("VHDX: Committing the metadata of image \'%s\' failed with %Rrc\n",
+                    pImage->pszFilename, rc));
+    }
+
+    return rc;
+}
+
+/**
+ * Commits all metadata changes to the image, making everything written so
+ * far durable.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_VD_ASYNC_IO_IN_PROGRESS if the commit continues asynchronously.
+ * @param   pImage    Image instance data.
+ * @param   pIoCtx    The I/O context, NULL for synchronous operation.
+ */
+static int vhdxCommit(PVHDXIMAGE pImage, PVDIOCTX pIoCtx)
+{
+    PVHDXCOMMIT pCommit = &pImage->Commit;
+
+    AssertReturn(pCommit->enmState == VHDXCOMMITSTATE_INVALID, VERR_INTERNAL_ERROR_3);
+
+    int rc = vhdxBlockListMove(&pCommit->BlocksFreed, &pImage->BlocksFreePending);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    pCommit->cPages      = 0;
+    pCommit->fHdrWritten = false;
+    pCommit->rcReqs      = VINF_SUCCESS;
+    pCommit->enmState    = VHDXCOMMITSTATE_FLUSH_DATA;
+    return vhdxCommitProcess(pImage, pIoCtx);
+}
+
+/**
+ * Initializes the log for writing, the header gets a new log UUID so no stale
+ * log entry is replayed later.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ */
+static int vhdxLogInit(PVHDXIMAGE pImage)
+{
+    PVHDXCOMMIT pCommit = &pImage->Commit;
+    uint32_t cbLog = pImage->Hdr.u32LogLength;
+    int rc = VINF_SUCCESS;
+
+    LogFlowFunc(("pImage=%#p\n", pImage));
+
+    if (   cbLog < 2 * VHDX_LOG_SECTOR_SIZE
+        || cbLog % _1M
+        || pImage->Hdr.u64LogOffset % _1M)
+        return vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                         "VHDX: Invalid log location in the header of image \'%s\'",
+                         pImage->pszFilename);
+
+    /* Determine how many pages fit into a single log entry. */
+    uint32_t cPagesMax = cbLog / VHDX_LOG_SECTOR_SIZE;
+    while (   cPagesMax
+           &&   RT_ALIGN_32(sizeof(VhdxLogEntryHdr) + cPagesMax * sizeof(VhdxLogDataDesc), VHDX_LOG_SECTOR_SIZE)
+              + cPagesMax * VHDX_LOG_SECTOR_SIZE > cbLog)
+        cPagesMax--;
+
+    pCommit->paoffPages = (uint64_t *)RTMemAllocZ(cPagesMax * sizeof(uint64_t));
+    pCommit->pbPages    = (uint8_t *)RTMemPageAlloc(cPagesMax * VHDX_PAGE_SIZE);
+    pCommit->pbLogEntry = (uint8_t *)RTMemPageAlloc(cbLog);
+    if (   !pCommit->paoffPages
+        || !pCommit->pbPages
+        || !pCommit->pbLogEntry)
+        return vdIfError(pImage->pIfError, VERR_NO_MEMORY, RT_SRC_POS,
+                         "VHDX: Out of memory allocating the log buffers of image \'%s\'",
+                         pImage->pszFilename);
+    pCommit->cPagesMax = cPagesMax;
+
+    RTUuidCreate(&pImage->Hdr.UuidFileWrite);
+    RTUuidCreate(&pImage->Hdr.UuidLog);
+    rc = vhdxHeaderWriteSync(pImage);
+    if (RT_SUCCESS(rc))
+    {
+        pImage->fLogInitialized = true;
+        pImage->uLogSeqNext     = 1;
+    }
+
+    LogFlowFunc(("returns rc=%Rrc\n", rc));
+    return rc;
+}
+
+/**
+ * Frees the parent locator key value pairs.
+ *
+ * @returns nothing.
+ * @param   pImage    Image instance data.
+ */
+static void vhdxParentLocatorFree(PVHDXIMAGE pImage)
+{
+    for (uint32_t i = 0; i < pImage->cLocatorEntries; i++)
+    {
+        RTStrFree(pImage->papszLocatorKeys[i]);
+        RTStrFree(pImage->papszLocatorValues[i]);
+    }
+
+    if (pImage->papszLocatorKeys)
+        RTMemFree(pImage->papszLocatorKeys);
+    if (pImage->papszLocatorValues)
+        RTMemFree(pImage->papszLocatorValues);
+    pImage->papszLocatorKeys   = NULL;
+    pImage->papszLocatorValues = NULL;
+    pImage->cLocatorEntries    = 0;
+}
+
+/**
+ * Returns the value of the given parent locator key.
+ *
+ * @returns Pointer to the value or NULL if the key doesn't exist.
+ * @param   pImage    Image instance data.
+ * @param   pszKey    The key to look for.
+ */
+static const char *vhdxParentLocatorQuery(PVHDXIMAGE pImage, const char *pszKey)
+{
+    for (uint32_t i = 0; i < pImage->cLocatorEntries; i++)
+        if (!strcmp(pImage->papszLocatorKeys[i], pszKey))
+            return pImage->papszLocatorValues[i];
+
+    return NULL;
+}
+
+/**
+ * Changes the value of the given parent locator key in memory.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   pszKey    The key to change.
+ * @param   pszValue  The new value, NULL to remove the key.
+ */
+static int vhdxParentLocatorSet(PVHDXIMAGE pImage, const char *pszKey, const char *pszValue)
+{
+    uint32_t idx = 0;
+
+    while (   idx < pImage->cLocatorEntries
+           && strcmp(pImage->papszLocatorKeys[idx], pszKey))
+        idx++;
+
+    if (!pszValue)
+    {
+        if (idx < pImage->cLocatorEntries)
+        {
+            RTStrFree(pImage->papszLocatorKeys[idx]);
+            RTStrFree(pImage->papszLocatorValues[idx]);
+            pImage->cLocatorEntries--;
+            memmove(&pImage->papszLocatorKeys[idx], &pImage->papszLocatorKeys[idx + 1],
+                    (pImage->cLocatorEntries - idx) * sizeof(char *));
+            memmove(&pImage->papszLocatorValues[idx], &pImage->papszLocatorValues[idx + 1],
+                    (pImage->cLocatorEntries - idx) * sizeof(char *));
+        }
+        return VINF_SUCCESS;
+    }
+
+    char *pszValueNew = RTStrDup(pszValue);
+    if (!pszValueNew)
+        return VERR_NO_MEMORY;
+
+    if (idx < pImage->cLocatorEntries)
+    {
+        RTStrFree(pImage->papszLocatorValues[idx]);
+        pImage->papszLocatorValues[idx] = pszValueNew;
+        return VINF_SUCCESS;
+    }
+
+    char *pszKeyNew = RTStrDup(pszKey);
+    char **papszKeysNew = (char **)RTMemRealloc(pImage->papszLocatorKeys, (idx + 1) * sizeof(char *));
+    if (papszKeysNew)
+        pImage->papszLocatorKeys = papszKeysNew;
+    char **papszValuesNew = (char **)RTMemRealloc(pImage->papszLocatorValues, (idx + 1) * sizeof(char *));
+    if (papszValuesNew)
+        pImage->papszLocatorValues = papszValuesNew;
+
+    if (   !pszKeyNew
+        || !papszKeysNew
+        || !papszValuesNew)
+    {
+        RTStrFree(pszKeyNew);
+        RTStrFree(pszValueNew);
+        return VERR_NO_MEMORY;
+    }
+
+    pImage->papszLocatorKeys[idx]   = pszKeyNew;
+    pImage->papszLocatorValues[idx] = pszValueNew;
+    pImage->cLocatorEntries++;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Serializes the given parent locator key value pairs.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_BUFFER_OVERFLOW if the locator doesn't fit into the buffer.
+ * @param   papszKeys   The keys.
+ * @param   papszValues The values.
+ * @param   cEntries    Number of key value pairs.
+ * @param   pbBuf       Where to store the parent locator.
+ * @param   cbBuf       Size of the buffer.
+ * @param   pcbUsed     Where to store the size of the parent locator.
+ */
+static int vhdxParentLocatorSerialize(char * const *papszKeys, char * const *papszValues, uint32_t cEntries,
+                                      uint8_t *pbBuf, size_t cbBuf, size_t *pcbUsed)
+{
+    VhdxParentLocatorHeader LocatorHdr;
+    size_t offData = sizeof(VhdxParentLocatorHeader) + cEntries * sizeof(VhdxParentLocatorEntry);
+    int rc = VINF_SUCCESS;
+
+    if (   offData > cbBuf
+        || cEntries > UINT16_MAX)
+        return VERR_BUFFER_OVERFLOW;
+
+    RTUuidFromStr(&LocatorHdr.UuidLocatorType, VHDX_PARENT_LOCATOR_TYPE_VHDX);
+    LocatorHdr.u16Reserved      = 0;
+    LocatorHdr.u16KeyValueCount = (uint16_t)cEntries;
+    vhdxConvParentLocatorHeaderEndianness(VHDXECONV_H2F, &LocatorHdr, &LocatorHdr);
+    memcpy(pbBuf, &LocatorHdr, sizeof(LocatorHdr));
+
+    for (uint32_t i = 0; i < cEntries && RT_SUCCESS(rc); i++)
+    {
+        VhdxParentLocatorEntry LocatorEntry;
+        size_t cbKey = 0;
+        size_t cbValue = 0;
+
+        rc = vhdxUtf8ToUtf16Le(papszKeys[i], pbBuf + offData, cbBuf - offData, &cbKey);
+        if (RT_SUCCESS(rc))
+        {
+            LocatorEntry.u32KeyOffset = (uint32_t)offData;
+            offData += cbKey;
+            rc = vhdxUtf8ToUtf16Le(papszValues[i], pbBuf + offData, cbBuf - offData, &cbValue);
+        }
+        if (RT_SUCCESS(rc))
+        {
+            if (   cbKey > UINT16_MAX
+                || cbValue > UINT16_MAX)
+                rc = VERR_BUFFER_OVERFLOW;
+            else
+            {
+                LocatorEntry.u32ValueOffset = (uint32_t)offData;
+                LocatorEntry.u16KeyLength   = (uint16_t)cbKey;
+                LocatorEntry.u16ValueLength = (uint16_t)cbValue;
+                offData += cbValue;
+
+                vhdxConvParentLocatorEntryEndianess(VHDXECONV_H2F, &LocatorEntry, &LocatorEntry);
+                memcpy(pbBuf + sizeof(VhdxParentLocatorHeader) + i * sizeof(VhdxParentLocatorEntry),
+                       &LocatorEntry, sizeof(LocatorEntry));
+            }
+        }
+    }
+
+    if (RT_SUCCESS(rc))
+        *pcbUsed = offData;
+
+    return rc;
+}
+
+/**
+ * Writes the parent locator of the image, the update goes through the log.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ */
+static int vhdxParentLocatorStore(PVHDXIMAGE pImage)
+{
+    size_t cbUsed = 0;
+    int rc = VINF_SUCCESS;
+
+    if (!pImage->offParentLocator)
+        return VERR_NOT_SUPPORTED;
+
+    uint8_t *pbLocator = (uint8_t *)RTMemTmpAllocZ(pImage->cbParentLocatorMax);
+    if (!pbLocator)
+        return VERR_NO_MEMORY;
+
+    rc = vhdxParentLocatorSerialize(pImage->papszLocatorKeys, pImage->papszLocatorValues,
+                                    pImage->cLocatorEntries, pbLocator, pImage->cbParentLocatorMax,
+                                    &cbUsed);
+    if (RT_SUCCESS(rc))
+    {
+        /* Zero what is left of a larger old locator. */
+        rc = vhdxMetaWrite(pImage, pImage->offParentLocator, pbLocator,
+                           RT_MAX(cbUsed, pImage->ParentLocatorEntry.u32Length));
+        if (   RT_SUCCESS(rc)
+            && cbUsed != pImage->ParentLocatorEntry.u32Length)
+        {
+            VhdxMetadataTblEntry MetadataTblEntry;
+
+            pImage->ParentLocatorEntry.u32Length = (uint32_t)cbUsed;
+            vhdxConvMetadataTblEntryEndianess(VHDXECONV_H2F, &MetadataTblEntry, &pImage->ParentLocatorEntry);
+            rc = vhdxMetaWrite(pImage, pImage->offParentLocatorEntry, &MetadataTblEntry, sizeof(MetadataTblEntry));
+        }
+    }
+    else if (rc == VERR_BUFFER_OVERFLOW)
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                       "VHDX: The parent locator of image \'%s\' exceeds the space available",
+                       pImage->pszFilename);
+
+    RTMemTmpFree(pbLocator);
+    return rc;
+}
+
+/**
+ * Internal: Creates a allocation bitmap from the given data.
+ * Sectors which contain only 0 are marked as unallocated and sectors with
+ * other data as allocated.
+ *
+ * @returns Pointer to the allocation bitmap or NULL on failure.
+ * @param   pvData    The data to create the allocation bitmap for.
+ * @param   cbData    Number of bytes in the buffer.
+ */
+static void *vhdxAllocationBitmapCreate(void *pvData, size_t cbData)
+{
+    Assert(cbData <= UINT32_MAX / 8);
+    uint32_t cSectors = (uint32_t)(cbData / 512);
+    uint32_t uSectorCur = 0;
+    void *pbmAllocationBitmap = NULL;
+
+    Assert(!(cbData % 512));
+    Assert(!(cSectors % 8));
+
+    pbmAllocationBitmap = RTMemAllocZ(cSectors / 8);
+    if (!pbmAllocationBitmap)
+        return NULL;
+
+    while (uSectorCur < cSectors)
+    {
+        int idxSet = ASMBitFirstSet((uint8_t *)pvData + uSectorCur * 512, (uint32_t)cbData * 8);
+
+        if (idxSet != -1)
+        {
+            unsigned idxSectorAlloc = idxSet / 8 / 512;
+            ASMBitSet(pbmAllocationBitmap, uSectorCur + idxSectorAlloc);
+
+            uSectorCur += idxSectorAlloc + 1;
+            cbData     -= (idxSectorAlloc + 1) * 512;
+        }
+        else
+            break;
+    }
+
+    return pbmAllocationBitmap;
+}
+
+/**
+ * Returns a free payload block in the file.
+ *
+ * Blocks freed by discards are reused first, the file is not shrunk.
+ *
+ * @returns File offset of the block.
+ * @param   pImage    Image instance data.
+ */
+static uint64_t vhdxBlockAlloc(PVHDXIMAGE pImage)
+{
+    uint64_t offBlock;
+
+    if (pImage->BlocksFree.cBlocks)
+        offBlock = pImage->BlocksFree.paoffBlocks[--pImage->BlocksFree.cBlocks];
+    else
+    {
+        offBlock = pImage->offFileEnd;
+        pImage->offFileEnd += pImage->cbBlock;
+    }
+
+    return offBlock;
+}
+
+/**
+ * Marks a fully present block as discarded, the space in the file can be
+ * reused after the change was committed.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   idxBat    BAT index of the block.
+ */
+static int vhdxDiscardBlock(PVHDXIMAGE pImage, uint32_t idxBat)
+{
+    uint64_t offBlock = VHDX_BAT_ENTRY_GET_FILE_OFFSET(pImage->paBat[idxBat].u64BatEntry);
+    int rc = vhdxBlockListAdd(&pImage->BlocksFreePending, offBlock);
+    if (RT_SUCCESS(rc))
+    {
+        /* Differencing images must not expose the parent data for the discarded range. */
+        unsigned uState =   (pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF)
+                          ? VHDX_BAT_ENTRY_PAYLOAD_BLOCK_ZERO
+                          : VHDX_BAT_ENTRY_PAYLOAD_BLOCK_UNMAPPED;
+        vhdxBatSet(pImage, idxBat, VHDX_BAT_ENTRY_MAKE(0, uState));
+    }
+
+    return rc;
+}
+
+/**
+ * Updates the BAT after a block allocation completed.
+ *
+ * @returns VBox status code.
+ * @param   pBackendData    The opaque backend data.
+ * @param   pIoCtx          I/O context associated with this request.
+ * @param   pvUser          Opaque user data passed during a read/write request.
+ * @param   rcReq           Status code for the completed request.
+ */
+static DECLCALLBACK(int) vhdxBlockAllocUpdate(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    RT_NOREF1(pIoCtx);
+    PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
+    PVHDXBLOCKALLOC pBlockAlloc = (PVHDXBLOCKALLOC)pvUser;
+
+    if (RT_SUCCESS(rcReq))
+        pBlockAlloc->fSuccess = true;
+
+    Assert(pBlockAlloc->cWritesPending > 0);
+    if (--pBlockAlloc->cWritesPending)
+        return VINF_SUCCESS;
+
+    /* Last write to the new block completed, unlink the allocation. */
+    PVHDXBLOCKALLOC *ppPrev = &pImage->pBlockAllocHead;
+    while (*ppPrev != pBlockAlloc)
+        ppPrev = &(*ppPrev)->pNext;
+    *ppPrev = pBlockAlloc->pNext;
+
+    /* Every write covers the whole block so a single successful one is enough. */
+    if (pBlockAlloc->fSuccess)
+        vhdxBatSet(pImage, pBlockAlloc->idxBat,
+                   VHDX_BAT_ENTRY_MAKE(pBlockAlloc->offFile, VHDX_BAT_ENTRY_PAYLOAD_BLOCK_FULLY_PRESENT));
+    else
+    {
+        /* Return the block for reuse, it is leaked in the file if this fails, no harm done. */
+        vhdxBlockListAdd(&pImage->BlocksFree, pBlockAlloc->offFile);
+    }
+
+    RTMemFree(pBlockAlloc);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Updates the sector bitmap after a write to a partially present block
+ * completed.
+ *
+ * @returns VBox status code.
+ * @param   pBackendData    The opaque backend data.
+ * @param   pIoCtx          I/O context associated with this request.
+ * @param   pvUser          Opaque user data passed during a read/write request.
+ * @param   rcReq           Status code for the completed request.
+ */
+static DECLCALLBACK(int) vhdxSbUpdate(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    RT_NOREF1(pIoCtx);
+    PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
+    PVHDXSBUPDATE pSbUpdate = (PVHDXSBUPDATE)pvUser;
+
+    if (RT_SUCCESS(rcReq))
+        vhdxSbSetRange(pImage, pSbUpdate->uOffset, pSbUpdate->cb);
+
+    RTMemFree(pSbUpdate);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Internal. Free all allocated space for representing an image except pImage,
+ * and optionally delete the image from disk.
+ */
+static int vhdxFreeImage(PVHDXIMAGE pImage, bool fDelete)
+{
+    int rc = VINF_SUCCESS;
+
+    /* Freeing a never allocated image (e.g. because the open failed) is
+     * not signalled as an error. After all nothing bad happens. */
+    if (pImage)
+    {
+        if (pImage->pStorage)
+        {
+            /* Make everything durable and mark the log as empty. */
+            if (   !fDelete
+                && pImage->fLogInitialized)
+            {
+                rc = vhdxCommit(pImage, NULL);
+                if (RT_SUCCESS(rc))
+                {
+                    RTUuidClear(&pImage->Hdr.UuidLog);
+                    rc = vhdxHeaderWriteSync(pImage);
+                }
+            }
+
+            int rc2 = vdIfIoIntFileClose(pImage->pIfIo, pImage->pStorage);
+            if (RT_SUCCESS(rc))
+                rc = rc2;
+            pImage->pStorage = NULL;
+        }
+
+        if (pImage->paBat)
+        {
+            RTMemFree(pImage->paBat);
+            pImage->paBat = NULL;
+        }
+
+        if (pImage->papbSb)
+        {
+            for (uint32_t i = 0; i < pImage->cSbBlocks; i++)
+                if (pImage->papbSb[i])
+                    RTMemFree(pImage->papbSb[i]);
+            RTMemFree(pImage->papbSb);
+            pImage->papbSb = NULL;
+        }
+        pImage->cSbBlocks = 0;
+
+        if (pImage->pbmBatDirty)
+        {
+            RTMemFree(pImage->pbmBatDirty);
+            pImage->pbmBatDirty = NULL;
+        }
+
+        if (pImage->pbmSbDirty)
+        {
+            RTMemFree(pImage->pbmSbDirty);
+            pImage->pbmSbDirty = NULL;
+        }
+
+        for (uint32_t i = 0; i < pImage->cMetaPages; i++)
+            RTMemFree(pImage->papMetaPages[i]);
+        if (pImage->papMetaPages)
+        {
+            RTMemFree(pImage->papMetaPages);
+            pImage->papMetaPages = NULL;
         }
+        pImage->cMetaPages = 0;
+
+        vhdxParentLocatorFree(pImage);
+        vhdxBlockListFree(&pImage->BlocksFree);
+        vhdxBlockListFree(&pImage->BlocksFreePending);
+        vhdxBlockListFree(&pImage->Commit.BlocksFreed);
+        vhdxLogRangesFree(pImage);
+
+        if (pImage->Commit.paoffPages)
+            RTMemFree(pImage->Commit.paoffPages);
+        if (pImage->Commit.pbPages)
+            RTMemPageFree(pImage->Commit.pbPages, pImage->Commit.cPagesMax * VHDX_PAGE_SIZE);
+        if (pImage->Commit.pbLogEntry)
+            RTMemPageFree(pImage->Commit.pbLogEntry, pImage->Hdr.u32LogLength);
+        RT_ZERO(pImage->Commit);
+
+        pImage->fLogInitialized  = false;
+        pImage->fHdrDirty        = false;
+        pImage->offParentLocator = 0;
 
         if (fDelete && pImage->pszFilename)
             vdIfIoIntFileDelete(pImage->pIfIo, pImage->pszFilename);
@@ -1027,19 +2961,13 @@ static int vhdxLoadHeader(PVHDXIMAGE pImage, PVhdxHeader pHdr)
     LogFlowFunc(("pImage=%#p pHdr=%#p\n", pImage, pHdr));
 
     /*
-     * Most fields in the header are not required because the backend implements
-     * readonly access only so far.
-     * We just have to check that the log is empty, we have to refuse to load the
-     * image otherwsie because replaying the log is not implemented.
+     * The header is kept because it is rewritten with new UUIDs when the image
+     * is opened for writing. A non empty log is replayed after the header was loaded.
      */
     if (pHdr->u16Version == VHDX_HEADER_VHDX_VERSION)
     {
-        /* Check that the log UUID is zero. */
         pImage->uVersion = pHdr->u16Version;
-        if (!RTUuidIsNull(&pHdr->UuidLog))
-            rc = vdIfError(pImage->pIfError, VERR_NOT_SUPPORTED, RT_SRC_POS,
-                           "VHDX: Image \'%s\' has a non empty log which is not supported",
-                           pImage->pszFilename);
+        memcpy(&pImage->Hdr, pHdr, sizeof(pImage->Hdr));
     }
     else
         rc = vdIfError(pImage->pIfError, VERR_NOT_SUPPORTED, RT_SRC_POS,
@@ -1115,6 +3043,7 @@ static int vhdxFindAndLoadCurrentHeader(PVHDXIMAGE pImage)
         if (fHdr1Valid != fHdr2Valid)
         {
             /* Only one header is valid - use it. */
+            pImage->idxHdr = fHdr1Valid ? 0 : 1;
             rc = vhdxLoadHeader(pImage, fHdr1Valid ? pHdr1 : pHdr2);
         }
         else if (!fHdr1Valid && !fHdr2Valid)
@@ -1126,10 +3055,8 @@ static int vhdxFindAndLoadCurrentHeader(PVHDXIMAGE pImage)
         else
         {
             /* Both headers are valid. Use the sequence number to find the current one. */
-            if (pHdr1->u64SequenceNumber > pHdr2->u64SequenceNumber)
-                rc = vhdxLoadHeader(pImage, pHdr1);
-            else
-                rc = vhdxLoadHeader(pImage, pHdr2);
+            pImage->idxHdr = pHdr1->u64SequenceNumber > pHdr2->u64SequenceNumber ? 0 : 1;
+            rc = vhdxLoadHeader(pImage, pImage->idxHdr == 0 ? pHdr1 : pHdr2);
         }
     }
     else
@@ -1162,6 +3089,7 @@ static int vhdxLoadBatRegion(PVHDXIMAGE pImage, uint64_t offRegion,
     uint32_t cSectorBitmapBlocks;
     uint32_t cBatEntries;
     uint32_t cbBatEntries;
+    uint64_t cbFile = 0;
     PVhdxBatEntry paBatEntries = NULL;
 
     LogFlowFunc(("pImage=%#p\n", pImage));
@@ -1179,66 +3107,114 @@ static int vhdxLoadBatRegion(PVHDXIMAGE pImage, uint64_t offRegion,
     if (cDataBlocks % uChunkRatio)
         cSectorBitmapBlocks++;
 
-    cBatEntries = cDataBlocks + (cDataBlocks - 1)/uChunkRatio;
+    /*
+     * Every chunk is followed by its sector bitmap entry. Differencing images
+     * need the entry of the last chunk too, for all others it is optional.
+     */
+    if (pImage->fFileParams & VHDX_FILE_PARAMETERS_FLAGS_HAS_PARENT)
+        cBatEntries = cSectorBitmapBlocks * (uChunkRatio + 1);
+    else
+        cBatEntries = cDataBlocks + (cDataBlocks - 1)/uChunkRatio;
     cbBatEntries = cBatEntries * sizeof(VhdxBatEntry);
 
     if (cbBatEntries <= cbRegion)
     {
         /*
          * Load the complete BAT region first, convert to host endianess and process
-         * it afterwards. The SB entries can be removed because they are not needed yet.
+         * it afterwards.
          */
         paBatEntries = (PVhdxBatEntry)RTMemAlloc(cbBatEntries);
         if (paBatEntries)
         {
-            rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, offRegion,
-                                       paBatEntries, cbBatEntries);
+            rc = vhdxReadSync(pImage, offRegion, paBatEntries, cbBatEntries);
+            if (RT_SUCCESS(rc))
+                rc = vdIfIoIntFileGetSize(pImage->pIfIo, pImage->pStorage, &cbFile);
             if (RT_SUCCESS(rc))
             {
                 vhdxConvBatTableEndianess(VHDXECONV_F2H, paBatEntries, paBatEntries,
                                           cBatEntries);
 
-                /* Go through the table and validate it. */
-                for (unsigned i = 0; i < cBatEntries; i++)
+                pImage->paBat       = paBatEntries;
+                pImage->uChunkRatio = uChunkRatio;
+                pImage->cBatEntries = cBatEntries;
+                pImage->offBat      = offRegion;
+                pImage->offFileEnd  = RT_ALIGN_64(cbFile, _1M);
+
+                uint32_t cBatPages = RT_ALIGN_32(vhdxBatPageCount(pImage), 32);
+                pImage->pbmBatDirty = RTMemAllocZ(cBatPages / 8);
+                pImage->papbSb = (uint8_t **)RTMemAllocZ(cSectorBitmapBlocks * sizeof(uint8_t *));
+                pImage->pbmSbDirty = RTMemAllocZ(cSectorBitmapBlocks * VHDX_SB_BLOCK_PAGES / 8);
+                pImage->cSbBlocks = cSectorBitmapBlocks;
+                if (   !pImage->pbmBatDirty
+                    || !pImage->papbSb
+                    || !pImage->pbmSbDirty)
+                    rc = vdIfError(pImage->pIfError, VERR_NO_MEMORY, RT_SRC_POS,
+                                   "VHDX: Out of memory allocating the BAT state of image \'%s\'",
+                                   pImage->pszFilename);
+
+                /* Go through the table, validate it and load the sector bitmaps of differencing images. */
+                for (unsigned i = 0; i < cBatEntries && RT_SUCCESS(rc); i++)
                 {
-                    if (   i != 0
-                        && (i % uChunkRatio) == 0)
+                    uint64_t u64BatEntry = paBatEntries[i].u64BatEntry;
+                    uint64_t offBlock = VHDX_BAT_ENTRY_GET_FILE_OFFSET(u64BatEntry);
+
+                    if ((i % (uChunkRatio + 1)) == uChunkRatio)
                     {
-/**
- * Disabled the verification because there are images out there with the sector bitmap
- * marked as present. The entry is never accessed and the image is readonly anyway,
- * so no harm done.
- */
-#if 0
-                        /* Sector bitmap block. */
-                        if (   VHDX_BAT_ENTRY_GET_STATE(paBatEntries[i].u64BatEntry)
-                            != VHDX_BAT_ENTRY_SB_BLOCK_NOT_PRESENT)
+                        /*
+                         * Sector bitmap block. There are base images out there with the
+                         * sector bitmap marked as present opposed to the specification,
+                         * the entry is ignored for them.
+                         */
+                        if (   (pImage->fFileParams & VHDX_FILE_PARAMETERS_FLAGS_HAS_PARENT)
+                            && VHDX_BAT_ENTRY_GET_STATE(u64BatEntry) == VHDX_BAT_ENTRY_SB_BLOCK_PRESENT)
                         {
-                            rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
-                                           "VHDX: Sector bitmap block at entry %u of image \'%s\' marked as present, violation of the specification",
-                                           i, pImage->pszFilename);
-                            break;
+                            uint32_t idxSb = i / (uChunkRatio + 1);
+
+                            pImage->papbSb[idxSb] = (uint8_t *)RTMemAlloc(_1M);
+                            if (!pImage->papbSb[idxSb])
+                            {
+                                rc = vdIfError(pImage->pIfError, VERR_NO_MEMORY, RT_SRC_POS,
+                                               "VHDX: Out of memory allocating a sector bitmap of image \'%s\'",
+                                               pImage->pszFilename);
+                                break;
+                            }
+
+                            rc = vhdxReadSync(pImage, offBlock, pImage->papbSb[idxSb], _1M);
+                            if (RT_FAILURE(rc))
+                            {
+                                rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                                               "VHDX: Error reading a sector bitmap from image \'%s\'",
+                                               pImage->pszFilename);
+                                break;
+                            }
+
+                            pImage->offFileEnd = RT_MAX(pImage->offFileEnd, offBlock + _1M);
                         }
-#endif
                     }
                     else
                     {
                         /* Payload block. */
-                        if (   VHDX_BAT_ENTRY_GET_STATE(paBatEntries[i].u64BatEntry)
-                            == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_PARTIALLY_PRESENT)
+                        unsigned uState = VHDX_BAT_ENTRY_GET_STATE(u64BatEntry);
+
+                        if (uState == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_PARTIALLY_PRESENT)
                         {
-                            rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
-                                           "VHDX: Payload block at entry %u of image \'%s\' marked as partially present, violation of the specification",
-                                           i, pImage->pszFilename);
-                            break;
+                            uint32_t idxSbEntry = (i / (uChunkRatio + 1)) * (uChunkRatio + 1) + uChunkRatio;
+
+                            if (   !(pImage->fFileParams & VHDX_FILE_PARAMETERS_FLAGS_HAS_PARENT)
+                                ||    VHDX_BAT_ENTRY_GET_STATE(paBatEntries[idxSbEntry].u64BatEntry)
+                                   != VHDX_BAT_ENTRY_SB_BLOCK_PRESENT)
+                            {
+                                rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                                               "VHDX: Payload block at entry %u of image \'%s\' marked as partially present, violation of the specification",
+                                               i, pImage->pszFilename);
+                                break;
+                            }
                         }
-                    }
-                }
 
-                if (RT_SUCCESS(rc))
-                {
-                    pImage->paBat       = paBatEntries;
-                    pImage->uChunkRatio = uChunkRatio;
+                        if (   uState == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_FULLY_PRESENT
+                            || uState == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_PARTIALLY_PRESENT)
+                            pImage->offFileEnd = RT_MAX(pImage->offFileEnd, offBlock + pImage->cbBlock);
+                    }
                 }
             }
             else
@@ -1257,7 +3233,8 @@ static int vhdxLoadBatRegion(PVHDXIMAGE pImage, uint64_t offRegion,
                        cbBatEntries, cbRegion, pImage->pszFilename);
 
     if (   RT_FAILURE(rc)
-        && paBatEntries)
+        && paBatEntries
+        && pImage->paBat != paBatEntries)
         RTMemFree(paBatEntries);
 
     LogFlowFunc(("returns rc=%Rrc\n", rc));
@@ -1286,18 +3263,20 @@ static int vhdxLoadFileParametersMetadata(PVHDXIMAGE pImage, uint64_t offItem, s
     {
         VhdxFileParameters FileParameters;
 
-        rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, offItem,
-                                   &FileParameters, sizeof(FileParameters));
+        rc = vhdxReadSync(pImage, offItem,
+                          &FileParameters, sizeof(FileParameters));
         if (RT_SUCCESS(rc))
         {
             vhdxConvFileParamsEndianess(VHDXECONV_F2H, &FileParameters, &FileParameters);
-            pImage->cbBlock = FileParameters.u32BlockSize;
+            pImage->cbBlock     = FileParameters.u32BlockSize;
+            pImage->fFileParams = FileParameters.u32Flags;
 
-            /** @todo No support for differencing images yet. */
-            if (FileParameters.u32Flags & VHDX_FILE_PARAMETERS_FLAGS_HAS_PARENT)
-                rc = vdIfError(pImage->pIfError, VERR_NOT_SUPPORTED, RT_SRC_POS,
-                               "VHDX: Image \'%s\' is a differencing image which is not supported yet",
-                               pImage->pszFilename);
+            if (   pImage->cbBlock < _1M
+                || pImage->cbBlock > 256 * _1M
+                || !RT_IS_POWER_OF_TWO(pImage->cbBlock))
+                rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                               "VHDX: Invalid block size %u in image \'%s\'",
+                               FileParameters.u32BlockSize, pImage->pszFilename);
         }
         else
             rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
@@ -1331,8 +3310,8 @@ static int vhdxLoadVDiskSizeMetadata(PVHDXIMAGE pImage, uint64_t offItem, size_t
     {
         VhdxVDiskSize VDiskSize;
 
-        rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, offItem,
-                                   &VDiskSize, sizeof(VDiskSize));
+        rc = vhdxReadSync(pImage, offItem,
+                          &VDiskSize, sizeof(VDiskSize));
         if (RT_SUCCESS(rc))
         {
             vhdxConvVDiskSizeEndianess(VHDXECONV_F2H, &VDiskSize, &VDiskSize);
@@ -1370,8 +3349,8 @@ static int vhdxLoadVDiskLogSectorSizeMetadata(PVHDXIMAGE pImage, uint64_t offIte
     {
         VhdxVDiskLogicalSectorSize VDiskLogSectSize;
 
-        rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, offItem,
-                                   &VDiskLogSectSize, sizeof(VDiskLogSectSize));
+        rc = vhdxReadSync(pImage, offItem,
+                          &VDiskLogSectSize, sizeof(VDiskLogSectSize));
         if (RT_SUCCESS(rc))
         {
             vhdxConvVDiskLogSectSizeEndianess(VHDXECONV_F2H, &VDiskLogSectSize,
@@ -1388,6 +3367,145 @@ static int vhdxLoadVDiskLogSectorSizeMetadata(PVHDXIMAGE pImage, uint64_t offIte
     return rc;
 }
 
+/**
+ * Load the page 83 data metadata item from the file.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   offItem   File offset where the data is stored.
+ * @param   cbItem    Size of the item in the file.
+ */
+static int vhdxLoadPage83Metadata(PVHDXIMAGE pImage, uint64_t offItem, size_t cbItem)
+{
+    int rc = VINF_SUCCESS;
+
+    LogFlowFunc(("pImage=%#p offItem=%llu cbItem=%zu\n", pImage, offItem, cbItem));
+
+    if (cbItem != sizeof(VhdxPage83Data))
+        rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                       "VHDX: Page 83 data item size mismatch (expected %u got %zu) in image \'%s\'",
+                       sizeof(VhdxPage83Data), cbItem, pImage->pszFilename);
+    else
+    {
+        VhdxPage83Data Page83Data;
+
+        rc = vhdxReadSync(pImage, offItem, &Page83Data, sizeof(Page83Data));
+        if (RT_SUCCESS(rc))
+        {
+            vhdxConvPage83DataEndianess(VHDXECONV_F2H, &Page83Data, &Page83Data);
+            pImage->UuidPage83 = Page83Data.UuidPage83Data;
+            pImage->offPage83  = offItem;
+        }
+        else
+            rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                           "VHDX: Reading the page 83 data metadata item from image \'%s\' failed",
+                           pImage->pszFilename);
+    }
+
+    LogFlowFunc(("returns rc=%Rrc\n", rc));
+    return rc;
+}
+
+/**
+ * Load the parent locator metadata item from the file.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   offItem   File offset where the data is stored.
+ * @param   cbItem    Size of the item in the file.
+ */
+static int vhdxLoadParentLocatorMetadata(PVHDXIMAGE pImage, uint64_t offItem, size_t cbItem)
+{
+    VhdxParentLocatorHeader LocatorHdr;
+    uint8_t *pbLocator = NULL;
+    int rc = VINF_SUCCESS;
+
+    LogFlowFunc(("pImage=%#p offItem=%llu cbItem=%zu\n", pImage, offItem, cbItem));
+
+    if (   cbItem < sizeof(VhdxParentLocatorHeader)
+        || cbItem > VHDX_CREATE_METADATA_SIZE)
+        return vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                         "VHDX: Invalid parent locator item size %zu in image \'%s\'",
+                         cbItem, pImage->pszFilename);
+
+    pbLocator = (uint8_t *)RTMemTmpAlloc(cbItem);
+    if (!pbLocator)
+        return vdIfError(pImage->pIfError, VERR_NO_MEMORY, RT_SRC_POS,
+                         "VHDX: Out of memory allocating memory for the parent locator of image \'%s\'",
+                         pImage->pszFilename);
+
+    rc = vhdxReadSync(pImage, offItem, pbLocator, cbItem);
+    if (RT_SUCCESS(rc))
+    {
+        memcpy(&LocatorHdr, pbLocator, sizeof(LocatorHdr));
+        vhdxConvParentLocatorHeaderEndianness(VHDXECONV_F2H, &LocatorHdr, &LocatorHdr);
+
+        if (RTUuidCompareStr(&LocatorHdr.UuidLocatorType, VHDX_PARENT_LOCATOR_TYPE_VHDX))
+            rc = vdIfError(pImage->pIfError, VERR_NOT_SUPPORTED, RT_SRC_POS,
+                           "VHDX: Parent locator of image \'%s\' has an unsupported type",
+                           pImage->pszFilename);
+        else if (  sizeof(VhdxParentLocatorHeader)
+                 + LocatorHdr.u16KeyValueCount * sizeof(VhdxParentLocatorEntry) > cbItem)
+            rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                           "VHDX: Parent locator entries of image \'%s\' exceed the item size",
+                           pImage->pszFilename);
+        else
+        {
+            pImage->papszLocatorKeys   = (char **)RTMemAllocZ(RT_MAX(LocatorHdr.u16KeyValueCount, 1) * sizeof(char *));
+            pImage->papszLocatorValues = (char **)RTMemAllocZ(RT_MAX(LocatorHdr.u16KeyValueCount, 1) * sizeof(char *));
+            if (   !pImage->papszLocatorKeys
+                || !pImage->papszLocatorValues)
+                rc = VERR_NO_MEMORY;
+
+            for (unsigned i = 0; i < LocatorHdr.u16KeyValueCount && RT_SUCCESS(rc); i++)
+            {
+                VhdxParentLocatorEntry LocatorEntry;
+
+                memcpy(&LocatorEntry,
+                       pbLocator + sizeof(VhdxParentLocatorHeader) + i * sizeof(VhdxParentLocatorEntry),
+                       sizeof(LocatorEntry));
+                vhdxConvParentLocatorEntryEndianess(VHDXECONV_F2H, &LocatorEntry, &LocatorEntry);
+
+                if (   !LocatorEntry.u16KeyLength
+                    || !LocatorEntry.u16ValueLength
+                    || (uint64_t)LocatorEntry.u32KeyOffset + LocatorEntry.u16KeyLength > cbItem
+                    || (uint64_t)LocatorEntry.u32ValueOffset + LocatorEntry.u16ValueLength > cbItem)
+                {
+                    rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                                   "VHDX: Parent locator entry %u of image \'%s\' is invalid",
+                                   i, pImage->pszFilename);
+                    break;
+                }
+
+                rc = vhdxUtf16LeToUtf8(pbLocator + LocatorEntry.u32KeyOffset, LocatorEntry.u16KeyLength,
+                                       &pImage->papszLocatorKeys[i]);
+                if (RT_SUCCESS(rc))
+                {
+                    pImage->cLocatorEntries++;
+                    rc = vhdxUtf16LeToUtf8(pbLocator + LocatorEntry.u32ValueOffset, LocatorEntry.u16ValueLength,
+                                           &pImage->papszLocatorValues[i]);
+                }
+                if (RT_FAILURE(rc))
+                    rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                                   "VHDX: Parent locator entry %u of image \'%s\' contains an invalid string",
+                                   i, pImage->pszFilename);
+            }
+
+            if (RT_SUCCESS(rc))
+                pImage->offParentLocator = offItem;
+        }
+    }
+    else
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                       "VHDX: Reading the parent locator metadata item from image \'%s\' failed",
+                       pImage->pszFilename);
+
+    RTMemTmpFree(pbLocator);
+
+    LogFlowFunc(("returns rc=%Rrc\n", rc));
+    return rc;
+}
+
 /**
  * Loads the metadata region.
  *
@@ -1405,8 +3523,8 @@ static int vhdxLoadMetadataRegion(PVHDXIMAGE pImage, uint64_t offRegion,
     LogFlowFunc(("pImage=%#p\n", pImage));
 
     /* Load the header first. */
-    rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, offRegion,
-                               &MetadataTblHdr, sizeof(MetadataTblHdr));
+    rc = vhdxReadSync(pImage, offRegion,
+                      &MetadataTblHdr, sizeof(MetadataTblHdr));
     if (RT_SUCCESS(rc))
     {
         vhdxConvMetadataTblHdrEndianess(VHDXECONV_F2H, &MetadataTblHdr, &MetadataTblHdr);
@@ -1428,15 +3546,24 @@ static int vhdxLoadMetadataRegion(PVHDXIMAGE pImage, uint64_t offRegion,
         if (RT_SUCCESS(rc))
         {
             uint64_t offMetadataTblEntry = offRegion + sizeof(VhdxMetadataTblHdr);
+            uint32_t *pau32ItemOffsets = (uint32_t *)RTMemTmpAllocZ((MetadataTblHdr.u16EntryCount + 1) * sizeof(uint32_t));
+            bool fLocatorPresent = false;
+
+            pImage->offMetadata = offRegion;
+            pImage->cbMetadata  = (uint32_t)cbRegion;
+            if (!pau32ItemOffsets)
+                rc = vdIfError(pImage->pIfError, VERR_NO_MEMORY, RT_SRC_POS,
+                               "VHDX: Out of memory while loading the metadata table of image \'%s\'",
+                               pImage->pszFilename);
 
-            for (unsigned i = 0; i < MetadataTblHdr.u16EntryCount; i++)
+            for (unsigned i = 0; i < MetadataTblHdr.u16EntryCount && RT_SUCCESS(rc); i++)
             {
                 uint64_t offMetadataItem = 0;
                 VHDXMETADATAITEM enmMetadataItem = VHDXMETADATAITEM_UNKNOWN;
                 VhdxMetadataTblEntry MetadataTblEntry;
 
-                rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, offMetadataTblEntry,
-                                           &MetadataTblEntry, sizeof(MetadataTblEntry));
+                rc = vhdxReadSync(pImage, offMetadataTblEntry,
+                                  &MetadataTblEntry, sizeof(MetadataTblEntry));
                 if (RT_FAILURE(rc))
                 {
                     rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
@@ -1503,11 +3630,8 @@ static int vhdxLoadMetadataRegion(PVHDXIMAGE pImage, uint64_t offRegion,
                     }
                     case VHDXMETADATAITEM_PAGE83_DATA:
                     {
-                        /*
-                         * Nothing to do here for now (marked as required but
-                         * there is no API to pass this information to the caller)
-                         * so far.
-                         */
+                        rc = vhdxLoadPage83Metadata(pImage, offMetadataItem,
+                                                    MetadataTblEntry.u32Length);
                         break;
                     }
                     case VHDXMETADATAITEM_LOGICAL_SECTOR_SIZE:
@@ -1527,9 +3651,11 @@ static int vhdxLoadMetadataRegion(PVHDXIMAGE pImage, uint64_t offRegion,
                     }
                     case VHDXMETADATAITEM_PARENT_LOCATOR:
                     {
-                        rc = vdIfError(pImage->pIfError, VERR_NOT_SUPPORTED, RT_SRC_POS,
-                                       "VHDX: Image \'%s\' is a differencing image which is not supported yet",
-                                       pImage->pszFilename);
+                        fLocatorPresent = true;
+                        pImage->offParentLocatorEntry = offMetadataTblEntry;
+                        pImage->ParentLocatorEntry    = MetadataTblEntry;
+                        rc = vhdxLoadParentLocatorMetadata(pImage, offMetadataItem,
+                                                           MetadataTblEntry.u32Length);
                         break;
                     }
                     case VHDXMETADATAITEM_UNKNOWN:
@@ -1543,8 +3669,36 @@ static int vhdxLoadMetadataRegion(PVHDXIMAGE pImage, uint64_t offRegion,
                 if (RT_FAILURE(rc))
                     break;
 
+                pau32ItemOffsets[i] = MetadataTblEntry.u32Offset;
                 offMetadataTblEntry += sizeof(MetadataTblEntry);
             }
+
+            if (RT_SUCCESS(rc))
+            {
+                if (fLocatorPresent)
+                {
+                    /* The parent locator can grow up to the next item or the end of the region. */
+                    uint32_t offLocatorEnd = (uint32_t)cbRegion;
+                    for (unsigned i = 0; i < MetadataTblHdr.u16EntryCount; i++)
+                        if (   pau32ItemOffsets[i] > pImage->ParentLocatorEntry.u32Offset
+                            && pau32ItemOffsets[i] < offLocatorEnd)
+                            offLocatorEnd = pau32ItemOffsets[i];
+
+                    if (pImage->ParentLocatorEntry.u32Offset + pImage->ParentLocatorEntry.u32Length > offLocatorEnd)
+                        rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                                       "VHDX: Parent locator of image \'%s\' overlaps other metadata",
+                                       pImage->pszFilename);
+                    else
+                        pImage->cbParentLocatorMax = offLocatorEnd - pImage->ParentLocatorEntry.u32Offset;
+                }
+                else if (pImage->fFileParams & VHDX_FILE_PARAMETERS_FLAGS_HAS_PARENT)
+                    rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                                   "VHDX: Differencing image \'%s\' has no parent locator",
+                                   pImage->pszFilename);
+            }
+
+            if (pau32ItemOffsets)
+                RTMemTmpFree(pau32ItemOffsets);
         }
     }
     else
@@ -1573,8 +3727,8 @@ static int vhdxLoadRegionTable(PVHDXIMAGE pImage)
     pbRegionTbl = (uint8_t *)RTMemTmpAlloc(VHDX_REGION_TBL_SIZE_MAX);
     if (pbRegionTbl)
     {
-        rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, VHDX_REGION_TBL_HDR_OFFSET,
-                                   pbRegionTbl, VHDX_REGION_TBL_SIZE_MAX);
+        rc = vhdxReadSync(pImage, VHDX_REGION_TBL_HDR_OFFSET,
+                          pbRegionTbl, VHDX_REGION_TBL_SIZE_MAX);
         if (RT_SUCCESS(rc))
         {
             PVhdxRegionTblHdr pRegionTblHdr;
@@ -1661,12 +3815,15 @@ static int vhdxLoadRegionTable(PVHDXIMAGE pImage)
                     pRegTblEntry++;
                 }
 
-                if (fBatRegPresent)
-                    rc = vhdxLoadBatRegion(pImage, RegTblEntryBat.u64FileOffset, RegTblEntryBat.u32Length);
-                else
-                    rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
-                                   "VHDX: BAT region in image \'%s\' is missing",
-                                   pImage->pszFilename);
+                if (RT_SUCCESS(rc))
+                {
+                    if (fBatRegPresent)
+                        rc = vhdxLoadBatRegion(pImage, RegTblEntryBat.u64FileOffset, RegTblEntryBat.u32Length);
+                    else
+                        rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                                       "VHDX: BAT region in image \'%s\' is missing",
+                                       pImage->pszFilename);
+                }
             }
         }
         else
@@ -1702,10 +3859,6 @@ static int vhdxOpenImage(PVHDXIMAGE pImage, unsigned uOpenFlags)
     pImage->pIfIo = VDIfIoIntGet(pImage->pVDIfsImage);
     AssertPtrReturn(pImage->pIfIo, VERR_INVALID_PARAMETER);
 
-    /* Refuse write access, it is not implemented so far. */
-    if (!(uOpenFlags & VD_OPEN_FLAGS_READONLY))
-        return VERR_NOT_SUPPORTED;
-
     /*
      * Open the image.
      */
@@ -1734,9 +3887,26 @@ static int vhdxOpenImage(PVHDXIMAGE pImage, unsigned uOpenFlags)
                 else
                     rc = vhdxFindAndLoadCurrentHeader(pImage);
 
+                /* Bring the metadata up to date before anything else is loaded. */
+                if (   RT_SUCCESS(rc)
+                    && !RTUuidIsNull(&pImage->Hdr.UuidLog))
+                    rc = vhdxLogReplay(pImage, cbFile);
+
                 /* Load the region table. */
                 if (RT_SUCCESS(rc))
                     rc = vhdxLoadRegionTable(pImage);
+
+                if (RT_SUCCESS(rc))
+                {
+                    pImage->uImageFlags = 0;
+                    if (pImage->fFileParams & VHDX_FILE_PARAMETERS_FLAGS_HAS_PARENT)
+                        pImage->uImageFlags |= VD_IMAGE_FLAGS_DIFF;
+                    if (pImage->fFileParams & VHDX_FILE_PARAMETERS_FLAGS_LEAVE_BLOCKS_ALLOCATED)
+                        pImage->uImageFlags |= VD_IMAGE_FLAGS_FIXED;
+
+                    if (!(uOpenFlags & VD_OPEN_FLAGS_READONLY))
+                        rc = vhdxLogInit(pImage);
+                }
             }
         }
         else
@@ -1751,6 +3921,360 @@ static int vhdxOpenImage(PVHDXIMAGE pImage, unsigned uOpenFlags)
 }
 
 
+/**
+ * Fills in a metadata table entry for a new image.
+ *
+ * @returns nothing.
+ * @param   pbMetadata  The metadata region buffer.
+ * @param   idxEntry    Index of the table entry.
+ * @param   enmItem     The metadata item.
+ * @param   offItem     Offset of the item relative to the region start.
+ * @param   cbItem      Size of the item.
+ */
+static void vhdxCreateMetadataTblEntry(uint8_t *pbMetadata, unsigned idxEntry, VHDXMETADATAITEM enmItem,
+                                       uint32_t offItem, uint32_t cbItem)
+{
+    VhdxMetadataTblEntry MetadataTblEntry;
+
+    RT_ZERO(MetadataTblEntry);
+    for (unsigned idxProp = 0; idxProp < RT_ELEMENTS(s_aVhdxMetadataItemProps); idxProp++)
+    {
+        if (s_aVhdxMetadataItemProps[idxProp].enmMetadataItem == enmItem)
+        {
+            RTUuidFromStr(&MetadataTblEntry.UuidItem, s_aVhdxMetadataItemProps[idxProp].pszItemUuid);
+            if (s_aVhdxMetadataItemProps[idxProp].fIsUser)
+                MetadataTblEntry.u32Flags |= VHDX_METADATA_TBL_ENTRY_FLAGS_IS_USER;
+            if (s_aVhdxMetadataItemProps[idxProp].fIsVDisk)
+                MetadataTblEntry.u32Flags |= VHDX_METADATA_TBL_ENTRY_FLAGS_IS_VDISK;
+            if (s_aVhdxMetadataItemProps[idxProp].fIsRequired)
+                MetadataTblEntry.u32Flags |= VHDX_METADATA_TBL_ENTRY_FLAGS_IS_REQUIRED;
+            break;
+        }
+    }
+    MetadataTblEntry.u32Offset = offItem;
+    MetadataTblEntry.u32Length = cbItem;
+
+    vhdxConvMetadataTblEntryEndianess(VHDXECONV_H2F, &MetadataTblEntry, &MetadataTblEntry);
+    memcpy(pbMetadata + sizeof(VhdxMetadataTblHdr) + idxEntry * sizeof(VhdxMetadataTblEntry),
+           &MetadataTblEntry, sizeof(MetadataTblEntry));
+}
+
+/**
+ * Writes the metadata region of a new image.
+ *
+ * @returns VBox status code.
+ * @param   pImage      Image instance data.
+ * @param   pbBuf       Zeroed scratch buffer of VHDX_CREATE_METADATA_SIZE bytes.
+ * @param   pUuid       The image UUID.
+ */
+static int vhdxCreateMetadataRegion(PVHDXIMAGE pImage, uint8_t *pbBuf, PCRTUUID pUuid)
+{
+    bool fDiff = RT_BOOL(pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF);
+    uint32_t offItem = VHDX_CREATE_METADATA_ITEM_OFFSET;
+    unsigned idxEntry = 0;
+    int rc = VINF_SUCCESS;
+
+    VhdxFileParameters FileParams;
+    FileParams.u32BlockSize = (uint32_t)pImage->cbBlock;
+    FileParams.u32Flags     = 0;
+    if (pImage->uImageFlags & VD_IMAGE_FLAGS_FIXED)
+        FileParams.u32Flags |= VHDX_FILE_PARAMETERS_FLAGS_LEAVE_BLOCKS_ALLOCATED;
+    if (fDiff)
+        FileParams.u32Flags |= VHDX_FILE_PARAMETERS_FLAGS_HAS_PARENT;
+    vhdxConvFileParamsEndianess(VHDXECONV_H2F, &FileParams, &FileParams);
+    memcpy(pbBuf + offItem, &FileParams, sizeof(FileParams));
+    vhdxCreateMetadataTblEntry(pbBuf, idxEntry++, VHDXMETADATAITEM_FILE_PARAMS, offItem, sizeof(FileParams));
+    offItem += sizeof(FileParams);
+
+    VhdxVDiskSize VDiskSize;
+    VDiskSize.u64VDiskSize = pImage->cbSize;
+    vhdxConvVDiskSizeEndianess(VHDXECONV_H2F, &VDiskSize, &VDiskSize);
+    memcpy(pbBuf + offItem, &VDiskSize, sizeof(VDiskSize));
+    vhdxCreateMetadataTblEntry(pbBuf, idxEntry++, VHDXMETADATAITEM_VDISK_SIZE, offItem, sizeof(VDiskSize));
+    offItem += sizeof(VDiskSize);
+
+    VhdxPage83Data Page83Data;
+    if (pUuid && !RTUuidIsNull(pUuid))
+        Page83Data.UuidPage83Data = *pUuid;
+    else
+        RTUuidCreate(&Page83Data.UuidPage83Data);
+    vhdxConvPage83DataEndianess(VHDXECONV_H2F, &Page83Data, &Page83Data);
+    memcpy(pbBuf + offItem, &Page83Data, sizeof(Page83Data));
+    vhdxCreateMetadataTblEntry(pbBuf, idxEntry++, VHDXMETADATAITEM_PAGE83_DATA, offItem, sizeof(Page83Data));
+    offItem += sizeof(Page83Data);
+
+    VhdxVDiskLogicalSectorSize LogSectSize;
+    LogSectSize.u32LogicalSectorSize = pImage->cbLogicalSector;
+    vhdxConvVDiskLogSectSizeEndianess(VHDXECONV_H2F, &LogSectSize, &LogSectSize);
+    memcpy(pbBuf + offItem, &LogSectSize, sizeof(LogSectSize));
+    vhdxCreateMetadataTblEntry(pbBuf, idxEntry++, VHDXMETADATAITEM_LOGICAL_SECTOR_SIZE, offItem, sizeof(LogSectSize));
+    offItem += sizeof(LogSectSize);
+
+    VhdxVDiskPhysicalSectorSize PhysSectSize;
+    PhysSectSize.u32PhysicalSectorSize = VHDX_CREATE_PHYSICAL_SECTOR_SIZE;
+    vhdxConvVDiskPhysSectSizeEndianess(VHDXECONV_H2F, &PhysSectSize, &PhysSectSize);
+    memcpy(pbBuf + offItem, &PhysSectSize, sizeof(PhysSectSize));
+    vhdxCreateMetadataTblEntry(pbBuf, idxEntry++, VHDXMETADATAITEM_PHYSICAL_SECTOR_SIZE, offItem, sizeof(PhysSectSize));
+    offItem += sizeof(PhysSectSize);
+
+    if (fDiff)
+    {
+        /* The linkage is updated when the parent is set. */
+        char szLinkage[RTUUID_STR_LENGTH + 2];
+        char *pszKey = (char *)VHDX_PARENT_LOCATOR_KEY_LINKAGE;
+        char *pszValue = &szLinkage[0];
+        size_t cbLocator = 0;
+        RTUUID UuidNull;
+
+        RTUuidClear(&UuidNull);
+        RTStrPrintf(szLinkage, sizeof(szLinkage), "{%RTuuid}", &UuidNull);
+        rc = vhdxParentLocatorSerialize(&pszKey, &pszValue, 1,
+                                        pbBuf + VHDX_CREATE_PARENT_LOCATOR_OFFSET,
+                                        VHDX_CREATE_METADATA_SIZE - VHDX_CREATE_PARENT_LOCATOR_OFFSET,
+                                        &cbLocator);
+        if (RT_SUCCESS(rc))
+            vhdxCreateMetadataTblEntry(pbBuf, idxEntry++, VHDXMETADATAITEM_PARENT_LOCATOR,
+                                       VHDX_CREATE_PARENT_LOCATOR_OFFSET, (uint32_t)cbLocator);
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        VhdxMetadataTblHdr MetadataTblHdr;
+
+        RT_ZERO(MetadataTblHdr);
+        MetadataTblHdr.u64Signature  = VHDX_METADATA_TBL_HDR_SIGNATURE;
+        MetadataTblHdr.u16EntryCount = (uint16_t)idxEntry;
+        vhdxConvMetadataTblHdrEndianess(VHDXECONV_H2F, &MetadataTblHdr, &MetadataTblHdr);
+        memcpy(pbBuf, &MetadataTblHdr, sizeof(MetadataTblHdr));
+
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, VHDX_CREATE_METADATA_OFFSET,
+                                    pbBuf, VHDX_CREATE_METADATA_SIZE);
+    }
+
+    return rc;
+}
+
+/**
+ * Writes the BAT of a new fixed image, all payload blocks are allocated
+ * contiguously after the BAT region.
+ *
+ * @returns VBox status code.
+ * @param   pImage      Image instance data.
+ * @param   pbBuf       Scratch buffer of _1M bytes.
+ * @param   cBatEntries Number of BAT entries.
+ * @param   offData     Start offset of the first payload block.
+ */
+static int vhdxCreateFixedBat(PVHDXIMAGE pImage, uint8_t *pbBuf, uint32_t cBatEntries, uint64_t offData)
+{
+    uint32_t cEntriesPerBuf = _1M / sizeof(VhdxBatEntry);
+    PVhdxBatEntry paBatEntries = (PVhdxBatEntry)pbBuf;
+    int rc = VINF_SUCCESS;
+
+    for (uint32_t idxBat = 0; idxBat < cBatEntries && RT_SUCCESS(rc); idxBat += cEntriesPerBuf)
+    {
+        uint32_t cEntries = RT_MIN(cEntriesPerBuf, cBatEntries - idxBat);
+
+        for (uint32_t i = 0; i < cEntries; i++)
+        {
+            uint32_t idx = idxBat + i;
+
+            if ((idx % (pImage->uChunkRatio + 1)) == pImage->uChunkRatio)
+                paBatEntries[i].u64BatEntry = 0; /* Sector bitmap block, not present. */
+            else
+            {
+                uint64_t idxBlock = idx - idx / (pImage->uChunkRatio + 1);
+                paBatEntries[i].u64BatEntry = VHDX_BAT_ENTRY_MAKE(offData + idxBlock * pImage->cbBlock,
+                                                                  VHDX_BAT_ENTRY_PAYLOAD_BLOCK_FULLY_PRESENT);
+            }
+        }
+
+        vhdxConvBatTableEndianess(VHDXECONV_H2F, paBatEntries, paBatEntries, cEntries);
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage,
+                                    VHDX_CREATE_BAT_OFFSET + (uint64_t)idxBat * sizeof(VhdxBatEntry),
+                                    paBatEntries, cEntries * sizeof(VhdxBatEntry));
+    }
+
+    return rc;
+}
+
+/**
+ * Internal: Create a VHDX image.
+ */
+static int vhdxCreateImage(PVHDXIMAGE pImage, uint64_t cbSize,
+                           unsigned uImageFlags, PCVDGEOMETRY pPCHSGeometry,
+                           PCVDGEOMETRY pLCHSGeometry, PCRTUUID pUuid,
+                           unsigned uOpenFlags, PVDINTERFACEPROGRESS pIfProgress,
+                           unsigned uPercentStart, unsigned uPercentSpan)
+{
+    uint8_t *pbBuf = NULL;
+    int rc = VINF_SUCCESS;
+
+    pImage->pIfError = VDIfErrorGet(pImage->pVDIfsDisk);
+    pImage->pIfIo = VDIfIoIntGet(pImage->pVDIfsImage);
+    AssertPtrReturn(pImage->pIfIo, VERR_INVALID_PARAMETER);
+
+    pImage->uOpenFlags      = uOpenFlags & ~VD_OPEN_FLAGS_READONLY;
+    pImage->uImageFlags     = uImageFlags;
+    pImage->uVersion        = VHDX_HEADER_VHDX_VERSION;
+    pImage->cbSize          = cbSize;
+    pImage->cbBlock         = VHDX_CREATE_BLOCK_SIZE;
+    pImage->cbLogicalSector = VHDX_CREATE_LOGICAL_SECTOR_SIZE;
+    pImage->uChunkRatio     = (uint32_t)((RT_BIT_64(23) * pImage->cbLogicalSector) / pImage->cbBlock);
+
+    /* Same layout calculation as in vhdxLoadBatRegion(). */
+    uint32_t cDataBlocks = (uint32_t)((cbSize + pImage->cbBlock - 1) / pImage->cbBlock);
+    uint32_t cSbBlocks   = (cDataBlocks + pImage->uChunkRatio - 1) / pImage->uChunkRatio;
+    uint32_t cBatEntries =   (uImageFlags & VD_IMAGE_FLAGS_DIFF)
+                           ? cSbBlocks * (pImage->uChunkRatio + 1)
+                           : cDataBlocks + (cDataBlocks - 1) / pImage->uChunkRatio;
+    uint32_t cbBatRegion = RT_ALIGN_32(cBatEntries * sizeof(VhdxBatEntry), _1M);
+    uint64_t offData     = VHDX_CREATE_BAT_OFFSET + cbBatRegion;
+
+    rc = vdIfIoIntFileOpen(pImage->pIfIo, pImage->pszFilename,
+                           VDOpenFlagsToFileOpenFlags(pImage->uOpenFlags, true /* fCreate */),
+                           &pImage->pStorage);
+    if (RT_FAILURE(rc))
+        return vdIfError(pImage->pIfError, rc, RT_SRC_POS, "VHDX: cannot create image \'%s\'",
+                         pImage->pszFilename);
+
+    pbBuf = (uint8_t *)RTMemTmpAllocZ(_1M);
+    if (!pbBuf)
+        rc = VERR_NO_MEMORY;
+
+    if (RT_SUCCESS(rc))
+    {
+        if (uImageFlags & VD_IMAGE_FLAGS_FIXED)
+        {
+            uint64_t cbTotal = offData + (uint64_t)cDataBlocks * pImage->cbBlock;
+
+            /* Check the free space on the disk and leave early if there is not
+             * sufficient space available. */
+            int64_t cbFree = 0;
+            rc = vdIfIoIntFileGetFreeSpace(pImage->pIfIo, pImage->pszFilename, &cbFree);
+            if (RT_SUCCESS(rc) /* ignore errors */ && ((uint64_t)cbFree < cbTotal))
+                rc = vdIfError(pImage->pIfError, VERR_DISK_FULL, RT_SRC_POS,
+                               "VHDX: disk would overflow creating image \'%s\'", pImage->pszFilename);
+            else
+            {
+                rc = vdIfIoIntFileSetAllocationSize(pImage->pIfIo, pImage->pStorage, cbTotal, 0 /* fFlags */,
+                                                    pIfProgress, uPercentStart, uPercentSpan * 9 / 10);
+                if (RT_SUCCESS(rc))
+                    rc = vhdxCreateFixedBat(pImage, pbBuf, cBatEntries, offData);
+                memset(pbBuf, 0, _1M);
+            }
+        }
+        else
+            rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, offData);
+    }
+
+    /* The file identifier. */
+    if (RT_SUCCESS(rc))
+    {
+        static const char s_szCreator[] = "VirtualBox";
+        VhdxFileIdentifier FileIdentifier;
+
+        RT_ZERO(FileIdentifier);
+        FileIdentifier.u64Signature = VHDX_FILE_IDENTIFIER_SIGNATURE;
+        for (unsigned i = 0; i < sizeof(s_szCreator) - 1; i++)
+            FileIdentifier.awszCreator[i] = s_szCreator[i];
+        vhdxConvFileIdentifierEndianess(VHDXECONV_H2F, &FileIdentifier, &FileIdentifier);
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, VHDX_FILE_IDENTIFIER_OFFSET,
+                                    &FileIdentifier, sizeof(FileIdentifier));
+    }
+
+    /* Both headers, the second one becomes the current. */
+    if (RT_SUCCESS(rc))
+    {
+        pImage->Hdr.u32Signature      = VHDX_HEADER_SIGNATURE;
+        pImage->Hdr.u64SequenceNumber = 0;
+        RTUuidCreate(&pImage->Hdr.UuidFileWrite);
+        RTUuidCreate(&pImage->Hdr.UuidDataWrite);
+        RTUuidClear(&pImage->Hdr.UuidLog);
+        pImage->Hdr.u16LogVersion     = VHDX_HEADER_LOG_VERSION;
+        pImage->Hdr.u16Version        = VHDX_HEADER_VHDX_VERSION;
+        pImage->Hdr.u32LogLength      = VHDX_CREATE_LOG_SIZE;
+        pImage->Hdr.u64LogOffset      = VHDX_CREATE_LOG_OFFSET;
+        pImage->idxHdr                = 1;
+
+        for (unsigned i = 0; i < 2 && RT_SUCCESS(rc); i++)
+        {
+            VhdxHeader Hdr;
+            uint64_t offHdr = vhdxHeaderPrepare(pImage, &Hdr);
+
+            rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, offHdr, &Hdr, sizeof(Hdr));
+            pImage->idxHdr ^= 1;
+        }
+    }
+
+    /* Both copies of the region table. */
+    if (RT_SUCCESS(rc))
+    {
+        VhdxRegionTblHdr RegionTblHdr;
+        VhdxRegionTblEntry aRegTblEntries[2];
+
+        RegionTblHdr.u32Signature  = VHDX_REGION_TBL_HDR_SIGNATURE;
+        RegionTblHdr.u32Checksum   = 0;
+        RegionTblHdr.u32EntryCount = RT_ELEMENTS(aRegTblEntries);
+        RegionTblHdr.u32Reserved   = 0;
+        vhdxConvRegionTblHdrEndianess(VHDXECONV_H2F, &RegionTblHdr, &RegionTblHdr);
+
+        RTUuidFromStr(&aRegTblEntries[0].UuidObject, VHDX_REGION_TBL_ENTRY_UUID_BAT);
+        aRegTblEntries[0].u64FileOffset = VHDX_CREATE_BAT_OFFSET;
+        aRegTblEntries[0].u32Length     = cbBatRegion;
+        aRegTblEntries[0].u32Flags      = VHDX_REGION_TBL_ENTRY_FLAGS_IS_REQUIRED;
+        RTUuidFromStr(&aRegTblEntries[1].UuidObject, VHDX_REGION_TBL_ENTRY_UUID_METADATA);
+        aRegTblEntries[1].u64FileOffset = VHDX_CREATE_METADATA_OFFSET;
+        aRegTblEntries[1].u32Length     = VHDX_CREATE_METADATA_SIZE;
+        aRegTblEntries[1].u32Flags      = VHDX_REGION_TBL_ENTRY_FLAGS_IS_REQUIRED;
+        for (unsigned i = 0; i < RT_ELEMENTS(aRegTblEntries); i++)
+            vhdxConvRegionTblEntryEndianess(VHDXECONV_H2F, &aRegTblEntries[i], &aRegTblEntries[i]);
+
+        memset(pbBuf, 0, VHDX_REGION_TBL_SIZE_MAX);
+        memcpy(pbBuf, &RegionTblHdr, sizeof(RegionTblHdr));
+        memcpy(pbBuf + sizeof(RegionTblHdr), &aRegTblEntries[0], sizeof(aRegTblEntries));
+        ((PVhdxRegionTblHdr)pbBuf)->u32Checksum = RT_H2LE_U32(RTCrc32C(pbBuf, VHDX_REGION_TBL_SIZE_MAX));
+
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, VHDX_REGION_TBL_HDR_OFFSET,
+                                    pbBuf, VHDX_REGION_TBL_SIZE_MAX);
+        if (RT_SUCCESS(rc))
+            rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage,
+                                        VHDX_REGION_TBL_HDR_OFFSET + VHDX_REGION_TBL_SIZE_MAX,
+                                        pbBuf, VHDX_REGION_TBL_SIZE_MAX);
+        memset(pbBuf, 0, VHDX_REGION_TBL_SIZE_MAX);
+    }
+
+    if (RT_SUCCESS(rc))
+        rc = vhdxCreateMetadataRegion(pImage, pbBuf, pUuid);
+    if (RT_SUCCESS(rc))
+        rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+
+    if (pbBuf)
+        RTMemTmpFree(pbBuf);
+
+    /* Reopen the image to set up the in memory state from what was written. */
+    if (RT_SUCCESS(rc))
+    {
+        rc = vhdxFreeImage(pImage, false);
+        if (RT_SUCCESS(rc))
+            rc = vhdxOpenImage(pImage, uOpenFlags & ~VD_OPEN_FLAGS_READONLY);
+    }
+    else if (rc != VERR_DISK_FULL)
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, "VHDX: writing the structures of image \'%s\' failed",
+                       pImage->pszFilename);
+
+    if (RT_SUCCESS(rc))
+    {
+        pImage->PCHSGeometry = *pPCHSGeometry;
+        pImage->LCHSGeometry = *pLCHSGeometry;
+        vdIfProgress(pIfProgress, uPercentStart + uPercentSpan);
+    }
+
+    if (RT_FAILURE(rc))
+        vhdxFreeImage(pImage, rc != VERR_ALREADY_EXISTS);
+    return rc;
+}
+
+
 /** @copydoc VDIMAGEBACKEND::pfnProbe */
 static DECLCALLBACK(int) vhdxProbe(const char *pszFilename, PVDINTERFACE pVDIfsDisk,
                                    PVDINTERFACE pVDIfsImage, VDTYPE *penmType)
@@ -1859,11 +4383,62 @@ static DECLCALLBACK(int) vhdxCreate(const char *pszFilename, uint64_t cbSize,
                                     PVDINTERFACE pVDIfsOperation, VDTYPE enmType,
                                     void **ppBackendData)
 {
-    RT_NOREF8(pszFilename, cbSize, uImageFlags, pszComment, pPCHSGeometry, pLCHSGeometry, pUuid, uOpenFlags);
-    RT_NOREF7(uPercentStart, uPercentSpan, pVDIfsDisk, pVDIfsImage, pVDIfsOperation, enmType, ppBackendData);
+    RT_NOREF1(pszComment);
     LogFlowFunc(("pszFilename=\"%s\" cbSize=%llu uImageFlags=%#x pszComment=\"%s\" pPCHSGeometry=%#p pLCHSGeometry=%#p Uuid=%RTuuid uOpenFlags=%#x uPercentStart=%u uPercentSpan=%u pVDIfsDisk=%#p pVDIfsImage=%#p pVDIfsOperation=%#p enmType=%u ppBackendData=%#p",
                  pszFilename, cbSize, uImageFlags, pszComment, pPCHSGeometry, pLCHSGeometry, pUuid, uOpenFlags, uPercentStart, uPercentSpan, pVDIfsDisk, pVDIfsImage, pVDIfsOperation, enmType, ppBackendData));
-    int rc = VERR_NOT_SUPPORTED;
+    int rc;
+
+    /* Check the VD container type and image flags. */
+    if (   enmType != VDTYPE_HDD
+        || (uImageFlags & ~(VD_IMAGE_FLAGS_FIXED | VD_IMAGE_FLAGS_DIFF))
+        || (   (uImageFlags & VD_IMAGE_FLAGS_FIXED)
+            && (uImageFlags & VD_IMAGE_FLAGS_DIFF)))
+        return VERR_VD_INVALID_TYPE;
+
+    /* Check size. */
+    if (   !cbSize
+        || cbSize > VHDX_VDISK_SIZE_MAX
+        || (cbSize % 512))
+        return VERR_VD_INVALID_SIZE;
+
+    /* Check open flags. All valid flags are supported. */
+    AssertReturn(!(uOpenFlags & ~VD_OPEN_FLAGS_MASK), VERR_INVALID_PARAMETER);
+    AssertReturn(   VALID_PTR(pszFilename)
+                 && *pszFilename
+                 && VALID_PTR(pPCHSGeometry)
+                 && VALID_PTR(pLCHSGeometry), VERR_INVALID_PARAMETER);
+
+    PVHDXIMAGE pImage = (PVHDXIMAGE)RTMemAllocZ(sizeof(VHDXIMAGE));
+    if (pImage)
+    {
+        PVDINTERFACEPROGRESS pIfProgress = VDIfProgressGet(pVDIfsOperation);
+
+        pImage->pszFilename = pszFilename;
+        pImage->pStorage = NULL;
+        pImage->pVDIfsDisk = pVDIfsDisk;
+        pImage->pVDIfsImage = pVDIfsImage;
+
+        rc = vhdxCreateImage(pImage, cbSize, uImageFlags, pPCHSGeometry, pLCHSGeometry,
+                             pUuid, uOpenFlags, pIfProgress, uPercentStart, uPercentSpan);
+        if (RT_SUCCESS(rc))
+        {
+            /* So far the image is opened in read/write mode. Make sure the
+             * image is opened in read-only mode if the caller requested that. */
+            if (uOpenFlags & VD_OPEN_FLAGS_READONLY)
+            {
+                vhdxFreeImage(pImage, false);
+                rc = vhdxOpenImage(pImage, uOpenFlags);
+            }
+
+            if (RT_SUCCESS(rc))
+                *ppBackendData = pImage;
+        }
+
+        if (RT_FAILURE(rc))
+            RTMemFree(pImage);
+    }
+    else
+        rc = VERR_NO_MEMORY;
 
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
@@ -1943,25 +4518,34 @@ static DECLCALLBACK(int) vhdxRead(void *pBackendData, uint64_t uOffset, size_t c
         rc = VERR_INVALID_PARAMETER;
     else
     {
-        uint32_t idxBat = (uint32_t)(uOffset / pImage->cbBlock); Assert(idxBat == uOffset / pImage->cbBlock);
+        uint32_t idxBat = vhdxBatIdxFromOffset(pImage, uOffset);
         uint32_t offRead = uOffset % pImage->cbBlock;
-        uint64_t uBatEntry;
-
-        idxBat += idxBat / pImage->uChunkRatio; /* Add interleaving sector bitmap entries. */
-        uBatEntry = pImage->paBat[idxBat].u64BatEntry;
+        uint64_t uBatEntry = pImage->paBat[idxBat].u64BatEntry;
 
         cbToRead = RT_MIN(cbToRead, pImage->cbBlock - offRead);
 
         switch (VHDX_BAT_ENTRY_GET_STATE(uBatEntry))
         {
-            case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_NOT_PRESENT:
-            case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_UNDEFINED:
             case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_ZERO:
-            case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_UNMAPPED:
             {
                 vdIfIoIntIoCtxSet(pImage->pIfIo, pIoCtx, 0, cbToRead);
                 break;
             }
+            case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_UNMAPPED:
+            {
+                /* Differencing images must not expose the parent data for an unmapped block. */
+                if (pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF)
+                    vdIfIoIntIoCtxSet(pImage->pIfIo, pIoCtx, 0, cbToRead);
+                else
+                    rc = VERR_VD_BLOCK_FREE;
+                break;
+            }
+            case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_NOT_PRESENT:
+            case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_UNDEFINED:
+            {
+                rc = VERR_VD_BLOCK_FREE;
+                break;
+            }
             case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_FULLY_PRESENT:
             {
                 uint64_t offFile = VHDX_BAT_ENTRY_GET_FILE_OFFSET(uBatEntry) + offRead;
@@ -1970,8 +4554,33 @@ static DECLCALLBACK(int) vhdxRead(void *pBackendData, uint64_t uOffset, size_t c
                 break;
             }
             case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_PARTIALLY_PRESENT:
+            {
+                /* Clip the read to the run of sectors with the same state in the sector bitmap. */
+                uint64_t cbChunk = (uint64_t)pImage->uChunkRatio * pImage->cbBlock;
+                uint8_t *pbSb = pImage->papbSb[uOffset / cbChunk];
+                uint64_t offChunk = uOffset % cbChunk;
+                int32_t iBit = (int32_t)(offChunk / pImage->cbLogicalSector);
+                bool fPresent = ASMBitTest(pbSb, iBit);
+                int iBitNext =   fPresent
+                               ? ASMBitNextClear(pbSb, _1M * 8, iBit)
+                               : ASMBitNextSet(pbSb, _1M * 8, iBit);
+
+                if (   iBitNext != -1
+                    && (uint64_t)iBitNext * pImage->cbLogicalSector < offChunk + cbToRead)
+                    cbToRead = (size_t)((uint64_t)iBitNext * pImage->cbLogicalSector - offChunk);
+
+                if (fPresent)
+                {
+                    uint64_t offFile = VHDX_BAT_ENTRY_GET_FILE_OFFSET(uBatEntry) + offRead;
+                    rc = vdIfIoIntFileReadUser(pImage->pIfIo, pImage->pStorage, offFile,
+                                               pIoCtx, cbToRead);
+                }
+                else
+                    rc = VERR_VD_BLOCK_FREE;
+                break;
+            }
             default:
-                rc = VERR_INVALID_PARAMETER;
+                rc = VERR_VD_GEN_INVALID_HEADER;
                 break;
         }
 
@@ -1988,11 +4597,10 @@ static DECLCALLBACK(int) vhdxWrite(void *pBackendData, uint64_t uOffset,  size_t
                                    PVDIOCTX pIoCtx, size_t *pcbWriteProcess, size_t *pcbPreRead,
                                    size_t *pcbPostRead, unsigned fWrite)
 {
-    RT_NOREF5(pIoCtx, pcbWriteProcess, pcbPreRead, pcbPostRead, fWrite);
     LogFlowFunc(("pBackendData=%#p uOffset=%llu pIoCtx=%#p cbToWrite=%zu pcbWriteProcess=%#p pcbPreRead=%#p pcbPostRead=%#p\n",
                  pBackendData, uOffset, pIoCtx, cbToWrite, pcbWriteProcess, pcbPreRead, pcbPostRead));
     PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
-    int rc;
+    int rc = VINF_SUCCESS;
 
     AssertPtr(pImage);
     Assert(uOffset % 512 == 0);
@@ -2004,7 +4612,120 @@ static DECLCALLBACK(int) vhdxWrite(void *pBackendData, uint64_t uOffset,  size_t
              || cbToWrite == 0)
         rc = VERR_INVALID_PARAMETER;
     else
-        rc = VERR_NOT_SUPPORTED;
+    {
+        uint32_t idxBat = vhdxBatIdxFromOffset(pImage, uOffset);
+        uint32_t offWrite = uOffset % pImage->cbBlock;
+        uint64_t uBatEntry = pImage->paBat[idxBat].u64BatEntry;
+        unsigned uState = VHDX_BAT_ENTRY_GET_STATE(uBatEntry);
+
+        /* Clip write range to at most the rest of the block. */
+        cbToWrite = RT_MIN(cbToWrite, pImage->cbBlock - offWrite);
+
+        if (uState == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_FULLY_PRESENT)
+        {
+            /* Block present in image file, write relevant data. */
+            uint64_t offFile = VHDX_BAT_ENTRY_GET_FILE_OFFSET(uBatEntry) + offWrite;
+            rc = vdIfIoIntFileWriteUser(pImage->pIfIo, pImage->pStorage, offFile,
+                                        pIoCtx, cbToWrite, NULL, NULL);
+        }
+        else if (uState == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_PARTIALLY_PRESENT)
+        {
+            /* Write the data and mark the sectors as present afterwards. */
+            uint64_t offFile = VHDX_BAT_ENTRY_GET_FILE_OFFSET(uBatEntry) + offWrite;
+            PVHDXSBUPDATE pSbUpdate = (PVHDXSBUPDATE)RTMemAllocZ(sizeof(VHDXSBUPDATE));
+            if (pSbUpdate)
+            {
+                pSbUpdate->uOffset = uOffset;
+                pSbUpdate->cb      = cbToWrite;
+
+                rc = vdIfIoIntFileWriteUser(pImage->pIfIo, pImage->pStorage, offFile,
+                                            pIoCtx, cbToWrite, vhdxSbUpdate, pSbUpdate);
+                if (RT_SUCCESS(rc))
+                    rc = vhdxSbUpdate(pImage, pIoCtx, pSbUpdate, rc);
+                else if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                    RTMemFree(pSbUpdate);
+            }
+            else
+                rc = VERR_NO_MEMORY;
+        }
+        else
+        {
+            /*
+             * Block is not allocated. It reads as zero unless this is a differencing
+             * image where the data comes from the parent.
+             */
+            bool fReadsZero =    uState == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_ZERO
+                              || uState == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_UNMAPPED
+                              || !(pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF);
+
+            *pcbPreRead  = 0;
+            *pcbPostRead = 0;
+
+            if (   !(pImage->uOpenFlags & VD_OPEN_FLAGS_HONOR_ZEROES)
+                && (   fReadsZero
+                    || cbToWrite == pImage->cbBlock)
+                && vdIfIoIntIoCtxIsZero(pImage->pIfIo, pIoCtx, cbToWrite, true))
+            {
+                /* Nothing to write, just make sure the block reads as zero. */
+                if (!fReadsZero)
+                    vhdxBatSet(pImage, idxBat, VHDX_BAT_ENTRY_MAKE(0, VHDX_BAT_ENTRY_PAYLOAD_BLOCK_ZERO));
+            }
+            else if (   cbToWrite == pImage->cbBlock
+                     && !(fWrite & VD_WRITE_NO_ALLOC))
+            {
+                /* Full block write to previously unallocated block.
+                 * Allocate block and write data. */
+                Assert(!offWrite);
+
+                /*
+                 * Another full block write might be allocating the block already,
+                 * write to the same block instead of allocating a second one which
+                 * would leak when the BAT is updated.
+                 */
+                PVHDXBLOCKALLOC pBlockAlloc = pImage->pBlockAllocHead;
+                while (   pBlockAlloc
+                       && pBlockAlloc->idxBat != idxBat)
+                    pBlockAlloc = pBlockAlloc->pNext;
+
+                if (!pBlockAlloc)
+                {
+                    pBlockAlloc = (PVHDXBLOCKALLOC)RTMemAllocZ(sizeof(VHDXBLOCKALLOC));
+                    if (pBlockAlloc)
+                    {
+                        pBlockAlloc->idxBat  = idxBat;
+                        pBlockAlloc->offFile = vhdxBlockAlloc(pImage);
+                        pBlockAlloc->pNext   = pImage->pBlockAllocHead;
+                        pImage->pBlockAllocHead = pBlockAlloc;
+                    }
+                }
+
+                if (pBlockAlloc)
+                {
+                    pBlockAlloc->cWritesPending++;
+                    rc = vdIfIoIntFileWriteUser(pImage->pIfIo, pImage->pStorage, pBlockAlloc->offFile,
+                                                pIoCtx, cbToWrite, vhdxBlockAllocUpdate, pBlockAlloc);
+                    if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                    {
+                        /* Completed inline, update the BAT or give the block back. */
+                        vhdxBlockAllocUpdate(pImage, pIoCtx, pBlockAlloc, rc);
+                    }
+                }
+                else
+                    rc = VERR_NO_MEMORY;
+            }
+            else
+            {
+                /* Trying to do a partial write to an unallocated block. Don't do
+                 * anything except letting the upper layer know what to do. */
+                *pcbPreRead  = offWrite;
+                *pcbPostRead = pImage->cbBlock - cbToWrite - offWrite;
+                rc = VERR_VD_BLOCK_FREE;
+            }
+        }
+
+        if (pcbWriteProcess)
+            *pcbWriteProcess = cbToWrite;
+    }
 
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
@@ -2013,15 +4734,138 @@ static DECLCALLBACK(int) vhdxWrite(void *pBackendData, uint64_t uOffset,  size_t
 /** @copydoc VDIMAGEBACKEND::pfnFlush */
 static DECLCALLBACK(int) vhdxFlush(void *pBackendData, PVDIOCTX pIoCtx)
 {
-    RT_NOREF1(pIoCtx);
     LogFlowFunc(("pBackendData=%#p pIoCtx=%#p\n", pBackendData, pIoCtx));
     PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
     int rc;
 
+    AssertPtr(pImage);
+
+    /* The BAT, sector bitmap and metadata changes are committed through the log. */
     if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
-        rc = VERR_VD_IMAGE_READ_ONLY;
+        rc = VINF_SUCCESS;
     else
-        rc = VERR_NOT_SUPPORTED;
+        rc = vhdxCommit(pImage, pIoCtx);
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnDiscard */
+static DECLCALLBACK(int) vhdxDiscard(void *pBackendData, PVDIOCTX pIoCtx,
+                                     uint64_t uOffset, size_t cbDiscard,
+                                     size_t *pcbPreAllocated, size_t *pcbPostAllocated,
+                                     size_t *pcbActuallyDiscarded, void **ppbmAllocationBitmap,
+                                     unsigned fDiscard)
+{
+    LogFlowFunc(("pBackendData=%#p pIoCtx=%#p uOffset=%llu cbDiscard=%zu pcbPreAllocated=%#p pcbPostAllocated=%#p pcbActuallyDiscarded=%#p ppbmAllocationBitmap=%#p fDiscard=%#x\n",
+                 pBackendData, pIoCtx, uOffset, cbDiscard, pcbPreAllocated, pcbPostAllocated, pcbActuallyDiscarded, ppbmAllocationBitmap, fDiscard));
+    PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    AssertPtr(pImage);
+    Assert(!(uOffset % 512));
+    Assert(!(cbDiscard % 512));
+
+    AssertMsgReturn(!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY),
+                    ("Image is readonly\n"), VERR_VD_IMAGE_READ_ONLY);
+    AssertMsgReturn(   uOffset + cbDiscard <= pImage->cbSize
+                    && cbDiscard,
+                    ("Invalid parameters uOffset=%llu cbDiscard=%zu\n",
+                     uOffset, cbDiscard),
+                     VERR_INVALID_PARAMETER);
+
+    uint32_t idxBat = vhdxBatIdxFromOffset(pImage, uOffset);
+    uint32_t offDiscard = uOffset % pImage->cbBlock;
+    uint64_t uBatEntry = pImage->paBat[idxBat].u64BatEntry;
+
+    /* Clip range to at most the rest of the block. */
+    cbDiscard = RT_MIN(cbDiscard, pImage->cbBlock - offDiscard);
+
+    if (pcbPreAllocated)
+        *pcbPreAllocated = 0;
+    if (pcbPostAllocated)
+        *pcbPostAllocated = 0;
+
+    /*
+     * Only fully present blocks are released, the space of images with the
+     * leave blocks allocated flag stays in place. Partially present blocks
+     * would need the sector bitmap updated and are left alone.
+     */
+    if (   VHDX_BAT_ENTRY_GET_STATE(uBatEntry) == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_FULLY_PRESENT
+        && !(pImage->fFileParams & VHDX_FILE_PARAMETERS_FLAGS_LEAVE_BLOCKS_ALLOCATED))
+    {
+        size_t cbPreAllocated  = offDiscard;
+        size_t cbPostAllocated = pImage->cbBlock - cbDiscard - cbPreAllocated;
+        uint64_t offBlock = VHDX_BAT_ENTRY_GET_FILE_OFFSET(uBatEntry);
+
+        if (!cbPreAllocated && !cbPostAllocated)
+        {
+            /*
+             * Discarding a whole block, don't check for allocated sectors.
+             * It is possible to just remove the whole block which avoids
+             * one read and checking the whole block for data.
+             */
+            rc = vhdxDiscardBlock(pImage, idxBat);
+        }
+        else if (fDiscard & VD_DISCARD_MARK_UNUSED)
+        {
+            /* Just zero out the given range. */
+            void *pvZero = RTMemAllocZ(cbDiscard);
+            if (pvZero)
+            {
+                rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage, offBlock + offDiscard,
+                                            pvZero, cbDiscard, pIoCtx, NULL, NULL);
+                RTMemFree(pvZero);
+            }
+            else
+                rc = VERR_NO_MEMORY;
+        }
+        else
+        {
+            /*
+             * Read complete block as metadata, the I/O context has no memory buffer
+             * and we need to access the content directly anyway.
+             */
+            uint8_t *pbBlockData = (uint8_t *)RTMemAlloc(pImage->cbBlock);
+            if (pbBlockData)
+            {
+                PVDMETAXFER pMetaXfer;
+                rc = vdIfIoIntFileReadMeta(pImage->pIfIo, pImage->pStorage, offBlock,
+                                           pbBlockData, pImage->cbBlock,
+                                           pIoCtx, &pMetaXfer, NULL, NULL);
+                if (RT_SUCCESS(rc))
+                {
+                    vdIfIoIntMetaXferRelease(pImage->pIfIo, pMetaXfer);
+
+                    /* Clear data. */
+                    memset(pbBlockData + offDiscard, 0, cbDiscard);
+
+                    Assert(pImage->cbBlock * 8 <= UINT32_MAX);
+                    if (ASMBitFirstSet((volatile void *)pbBlockData, (uint32_t)pImage->cbBlock * 8) == -1)
+                        rc = vhdxDiscardBlock(pImage, idxBat);
+                    else
+                    {
+                        /* Block has data, create allocation bitmap. */
+                        *pcbPreAllocated = cbPreAllocated;
+                        *pcbPostAllocated = cbPostAllocated;
+                        *ppbmAllocationBitmap = vhdxAllocationBitmapCreate(pbBlockData, pImage->cbBlock);
+                        if (RT_UNLIKELY(!*ppbmAllocationBitmap))
+                            rc = VERR_NO_MEMORY;
+                        else
+                            rc = VERR_VD_DISCARD_ALIGNMENT_NOT_MET;
+                    }
+                }
+
+                RTMemFree(pbBlockData);
+            }
+            else
+                rc = VERR_NO_MEMORY;
+        }
+    }
+    /* else: nothing to do. */
+
+    if (pcbActuallyDiscarded)
+        *pcbActuallyDiscarded = cbDiscard;
 
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
@@ -2301,15 +5145,14 @@ static DECLCALLBACK(int) vhdxSetComment(void *pBackendData, const char *pszComme
 /** @copydoc VDIMAGEBACKEND::pfnGetUuid */
 static DECLCALLBACK(int) vhdxGetUuid(void *pBackendData, PRTUUID pUuid)
 {
-    RT_NOREF1(pUuid);
     LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
     PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
-    int rc;
+    int rc = VINF_SUCCESS;
 
     AssertPtr(pImage);
 
     if (pImage)
-        rc = VERR_NOT_SUPPORTED;
+        *pUuid = pImage->UuidPage83;
     else
         rc = VERR_VD_NOT_OPENED;
 
@@ -2320,7 +5163,6 @@ static DECLCALLBACK(int) vhdxGetUuid(void *pBackendData, PRTUUID pUuid)
 /** @copydoc VDIMAGEBACKEND::pfnSetUuid */
 static DECLCALLBACK(int) vhdxSetUuid(void *pBackendData, PCRTUUID pUuid)
 {
-    RT_NOREF1(pUuid);
     LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
     PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
     int rc;
@@ -2330,10 +5172,20 @@ static DECLCALLBACK(int) vhdxSetUuid(void *pBackendData, PCRTUUID pUuid)
 
     if (pImage)
     {
-        if (!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
+        if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+            rc = VERR_VD_IMAGE_READ_ONLY;
+        else if (!pImage->offPage83)
             rc = VERR_NOT_SUPPORTED;
         else
-            rc = VERR_VD_IMAGE_READ_ONLY;
+        {
+            VhdxPage83Data Page83Data;
+
+            Page83Data.UuidPage83Data = *pUuid;
+            vhdxConvPage83DataEndianess(VHDXECONV_H2F, &Page83Data, &Page83Data);
+            rc = vhdxMetaWrite(pImage, pImage->offPage83, &Page83Data, sizeof(Page83Data));
+            if (RT_SUCCESS(rc))
+                pImage->UuidPage83 = *pUuid;
+        }
     }
     else
         rc = VERR_VD_NOT_OPENED;
@@ -2345,15 +5197,14 @@ static DECLCALLBACK(int) vhdxSetUuid(void *pBackendData, PCRTUUID pUuid)
 /** @copydoc VDIMAGEBACKEND::pfnGetModificationUuid */
 static DECLCALLBACK(int) vhdxGetModificationUuid(void *pBackendData, PRTUUID pUuid)
 {
-    RT_NOREF1(pUuid);
     LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
     PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
-    int rc;
+    int rc = VINF_SUCCESS;
 
     AssertPtr(pImage);
 
     if (pImage)
-        rc = VERR_NOT_SUPPORTED;
+        *pUuid = pImage->Hdr.UuidDataWrite;
     else
         rc = VERR_VD_NOT_OPENED;
 
@@ -2364,19 +5215,22 @@ static DECLCALLBACK(int) vhdxGetModificationUuid(void *pBackendData, PRTUUID pUu
 /** @copydoc VDIMAGEBACKEND::pfnSetModificationUuid */
 static DECLCALLBACK(int) vhdxSetModificationUuid(void *pBackendData, PCRTUUID pUuid)
 {
-    RT_NOREF1(pUuid);
     LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
     PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
-    int rc;
+    int rc = VINF_SUCCESS;
 
     AssertPtr(pImage);
 
     if (pImage)
     {
-        if (!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
-            rc = VERR_NOT_SUPPORTED;
-        else
+        if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
             rc = VERR_VD_IMAGE_READ_ONLY;
+        else
+        {
+            /* The data write UUID lives in the header, written during the next commit. */
+            pImage->Hdr.UuidDataWrite = *pUuid;
+            pImage->fHdrDirty = true;
+        }
     }
     else
         rc = VERR_VD_NOT_OPENED;
@@ -2388,15 +5242,24 @@ static DECLCALLBACK(int) vhdxSetModificationUuid(void *pBackendData, PCRTUUID pU
 /** @copydoc VDIMAGEBACKEND::pfnGetParentUuid */
 static DECLCALLBACK(int) vhdxGetParentUuid(void *pBackendData, PRTUUID pUuid)
 {
-    RT_NOREF1(pUuid);
     LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
     PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
-    int rc;
+    int rc = VINF_SUCCESS;
 
     AssertPtr(pImage);
 
     if (pImage)
-        rc = VERR_NOT_SUPPORTED;
+    {
+        /*
+         * The format only links to the data write UUID of the parent, the
+         * image UUID of the parent is kept in a key of our own.
+         */
+        const char *pszUuid = vhdxParentLocatorQuery(pImage, VHDX_PARENT_LOCATOR_KEY_VBOX_PARENT_UUID);
+        if (pszUuid)
+            rc = RTUuidFromStr(pUuid, pszUuid);
+        else
+            RTUuidClear(pUuid);
+    }
     else
         rc = VERR_VD_NOT_OPENED;
 
@@ -2407,7 +5270,6 @@ static DECLCALLBACK(int) vhdxGetParentUuid(void *pBackendData, PRTUUID pUuid)
 /** @copydoc VDIMAGEBACKEND::pfnSetParentUuid */
 static DECLCALLBACK(int) vhdxSetParentUuid(void *pBackendData, PCRTUUID pUuid)
 {
-    RT_NOREF1(pUuid);
     LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
     PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
     int rc;
@@ -2416,10 +5278,20 @@ static DECLCALLBACK(int) vhdxSetParentUuid(void *pBackendData, PCRTUUID pUuid)
 
     if (pImage)
     {
-        if (!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
-            rc = VERR_NOT_SUPPORTED;
-        else
+        if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
             rc = VERR_VD_IMAGE_READ_ONLY;
+        else if (!(pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF))
+            rc = RTUuidIsNull(pUuid) ? VINF_SUCCESS : VERR_NOT_SUPPORTED;
+        else
+        {
+            char szUuid[RTUUID_STR_LENGTH];
+
+            rc = RTUuidToStr(pUuid, szUuid, sizeof(szUuid));
+            if (RT_SUCCESS(rc))
+                rc = vhdxParentLocatorSet(pImage, VHDX_PARENT_LOCATOR_KEY_VBOX_PARENT_UUID, szUuid);
+            if (RT_SUCCESS(rc))
+                rc = vhdxParentLocatorStore(pImage);
+        }
     }
     else
         rc = VERR_VD_NOT_OPENED;
@@ -2431,15 +5303,20 @@ static DECLCALLBACK(int) vhdxSetParentUuid(void *pBackendData, PCRTUUID pUuid)
 /** @copydoc VDIMAGEBACKEND::pfnGetParentModificationUuid */
 static DECLCALLBACK(int) vhdxGetParentModificationUuid(void *pBackendData, PRTUUID pUuid)
 {
-    RT_NOREF1(pUuid);
     LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
     PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
-    int rc;
+    int rc = VINF_SUCCESS;
 
     AssertPtr(pImage);
 
     if (pImage)
-        rc = VERR_NOT_SUPPORTED;
+    {
+        const char *pszLinkage = vhdxParentLocatorQuery(pImage, VHDX_PARENT_LOCATOR_KEY_LINKAGE);
+        if (pszLinkage)
+            rc = RTUuidFromStr(pUuid, pszLinkage);
+        else
+            RTUuidClear(pUuid);
+    }
     else
         rc = VERR_VD_NOT_OPENED;
 
@@ -2450,7 +5327,6 @@ static DECLCALLBACK(int) vhdxGetParentModificationUuid(void *pBackendData, PRTUU
 /** @copydoc VDIMAGEBACKEND::pfnSetParentModificationUuid */
 static DECLCALLBACK(int) vhdxSetParentModificationUuid(void *pBackendData, PCRTUUID pUuid)
 {
-    RT_NOREF1(pUuid);
     LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
     PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
     int rc;
@@ -2459,10 +5335,135 @@ static DECLCALLBACK(int) vhdxSetParentModificationUuid(void *pBackendData, PCRTU
 
     if (pImage)
     {
-        if (!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
+        if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+            rc = VERR_VD_IMAGE_READ_ONLY;
+        else if (!(pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF))
+            rc = RTUuidIsNull(pUuid) ? VINF_SUCCESS : VERR_NOT_SUPPORTED;
+        else
+        {
+            char szLinkage[RTUUID_STR_LENGTH + 2];
+
+            RTStrPrintf(szLinkage, sizeof(szLinkage), "{%RTuuid}", pUuid);
+            rc = vhdxParentLocatorSet(pImage, VHDX_PARENT_LOCATOR_KEY_LINKAGE, szLinkage);
+            if (RT_SUCCESS(rc))
+                rc = vhdxParentLocatorStore(pImage);
+        }
+    }
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnGetParentFilename */
+static DECLCALLBACK(int) vhdxGetParentFilename(void *pBackendData, char **ppszParentFilename)
+{
+    LogFlowFunc(("pBackendData=%#p ppszParentFilename=%#p\n", pBackendData, ppszParentFilename));
+    PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+    {
+        const char *pszRelative = vhdxParentLocatorQuery(pImage, VHDX_PARENT_LOCATOR_KEY_RELATIVE_PATH);
+        const char *pszAbsolute = vhdxParentLocatorQuery(pImage, VHDX_PARENT_LOCATOR_KEY_ABSOLUTE_PATH);
+
+        if (!(pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF))
             rc = VERR_NOT_SUPPORTED;
+        else if (pszRelative)
+        {
+            /* Resolve the relative path against the directory of the image. */
+            char szPath[RTPATH_MAX];
+
+            rc = RTStrCopy(szPath, sizeof(szPath), pImage->pszFilename);
+            if (RT_SUCCESS(rc))
+            {
+                char *pszRelativeDup = RTStrDup(pszRelative);
+                if (pszRelativeDup)
+                {
+                    RTPathChangeToUnixSlashes(pszRelativeDup, true /* fForce */);
+                    RTPathStripFilename(szPath);
+                    rc = RTPathAppend(szPath, sizeof(szPath), pszRelativeDup);
+                    RTStrFree(pszRelativeDup);
+                }
+                else
+                    rc = VERR_NO_MEMORY;
+            }
+            if (RT_SUCCESS(rc))
+            {
+                *ppszParentFilename = RTStrDup(szPath);
+                if (!*ppszParentFilename)
+                    rc = VERR_NO_MEMORY;
+            }
+        }
+        else if (pszAbsolute)
+        {
+            *ppszParentFilename = RTStrDup(pszAbsolute);
+            if (!*ppszParentFilename)
+                rc = VERR_NO_MEMORY;
+        }
         else
+            rc = VERR_NOT_FOUND;
+    }
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDIMAGEBACKEND::pfnSetParentFilename */
+static DECLCALLBACK(int) vhdxSetParentFilename(void *pBackendData, const char *pszParentFilename)
+{
+    LogFlowFunc(("pBackendData=%#p pszParentFilename=%s\n", pBackendData, pszParentFilename));
+    PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+    {
+        if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
             rc = VERR_VD_IMAGE_READ_ONLY;
+        else if (!(pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF))
+            rc = VERR_NOT_SUPPORTED;
+        else
+        {
+            char szParent[RTPATH_MAX];
+            char szImageDir[RTPATH_MAX];
+            char szParentDir[RTPATH_MAX];
+
+            rc = RTPathAbs(pszParentFilename, szParent, sizeof(szParent));
+            if (RT_SUCCESS(rc))
+                rc = RTPathAbs(pImage->pszFilename, szImageDir, sizeof(szImageDir));
+            if (RT_SUCCESS(rc))
+            {
+                RTPathStripFilename(szImageDir);
+                memcpy(szParentDir, szParent, sizeof(szParentDir));
+                RTPathStripFilename(szParentDir);
+
+                /* A relative path is only stored when both images live in the same directory. */
+                if (!RTPathCompare(szImageDir, szParentDir))
+                {
+                    char *pszRelative = RTStrAPrintf2(".\\%s", RTPathFilename(szParent));
+                    if (pszRelative)
+                    {
+                        rc = vhdxParentLocatorSet(pImage, VHDX_PARENT_LOCATOR_KEY_RELATIVE_PATH, pszRelative);
+                        RTStrFree(pszRelative);
+                    }
+                    else
+                        rc = VERR_NO_MEMORY;
+                }
+                else
+                    rc = vhdxParentLocatorSet(pImage, VHDX_PARENT_LOCATOR_KEY_RELATIVE_PATH, NULL);
+            }
+            if (RT_SUCCESS(rc))
+                rc = vhdxParentLocatorSet(pImage, VHDX_PARENT_LOCATOR_KEY_ABSOLUTE_PATH, szParent);
+            if (RT_SUCCESS(rc))
+                rc = vhdxParentLocatorStore(pImage);
+        }
     }
     else
         rc = VERR_VD_NOT_OPENED;
@@ -2483,6 +5484,16 @@ static DECLCALLBACK(void) vhdxDump(void *pBackendData)
                         pImage->PCHSGeometry.cCylinders, pImage->PCHSGeometry.cHeads, pImage->PCHSGeometry.cSectors,
                         pImage->LCHSGeometry.cCylinders, pImage->LCHSGeometry.cHeads, pImage->LCHSGeometry.cSectors,
                         pImage->cbLogicalSector);
+        vdIfErrorMessage(pImage->pIfError, "Header: uuidCreation={%RTuuid}\n", &pImage->UuidPage83);
+        vdIfErrorMessage(pImage->pIfError, "Header: uuidModification={%RTuuid}\n", &pImage->Hdr.UuidDataWrite);
+        vdIfErrorMessage(pImage->pIfError, "Header: uuidLog={%RTuuid} SeqNo=%llu\n",
+                         &pImage->Hdr.UuidLog, pImage->Hdr.u64SequenceNumber);
+        vdIfErrorMessage(pImage->pIfError, "Image:  cbBlock=%zu uChunkRatio=%u cBatEntries=%u offFileEnd=%llu cBlocksFree=%u\n",
+                         pImage->cbBlock, pImage->uChunkRatio, pImage->cBatEntries, pImage->offFileEnd,
+                         pImage->BlocksFree.cBlocks);
+        for (uint32_t i = 0; i < pImage->cLocatorEntries; i++)
+            vdIfErrorMessage(pImage->pIfError, "Parent locator: %s=%s\n",
+                             pImage->papszLocatorKeys[i], pImage->papszLocatorValues[i]);
     }
 }
 
@@ -2494,7 +5505,8 @@ const VDIMAGEBACKEND g_VhdxBackend =
     /* pszBackendName */
     "VHDX",
     /* uBackendCaps */
-    VD_CAP_FILE | VD_CAP_VFS,
+      VD_CAP_UUID | VD_CAP_CREATE_FIXED | VD_CAP_CREATE_DYNAMIC | VD_CAP_DIFF
+    | VD_CAP_FILE | VD_CAP_ASYNC | VD_CAP_VFS | VD_CAP_DISCARD,
     /* paFileExtensions */
     s_aVhdxFileExtensions,
     /* paConfigInfo */
@@ -2516,7 +5528,7 @@ const VDIMAGEBACKEND g_VhdxBackend =
     /* pfnFlush */
     vhdxFlush,
     /* pfnDiscard */
-    NULL,
+    vhdxDiscard,
     /* pfnGetVersion */
     vhdxGetVersion,
     /* pfnGetSectorSize */
@@ -2568,9 +5580,9 @@ const VDIMAGEBACKEND g_VhdxBackend =
     /* pfnSetParentTimestamp */
     NULL,
     /* pfnGetParentFilename */
-    NULL,
+    vhdxGetParentFilename,
     /* pfnSetParentFilename */
-    NULL,
+    vhdxSetParentFilename,
     /* pfnComposeLocation */
     genericFileComposeLocation,
     /* pfnComposeName */
@@ -75,6 +75,12 @@ typedef struct VDFILE
     unsigned       cAsyncWrites;
     /** Statistics: Number of async flushes. */
     unsigned       cAsyncFlushes;
+    /** Latency in milliseconds added to every read, simulates slow storage. */
+    uint32_t       cMilliesReadLatency;
+    /** Number of flushes until the file crashes, 0 if no crash is armed. */
+    uint32_t       cFlushesUntilCrash;
+    /** Flag whether the file crashed, all writes are dropped until it is opened again. */
+    bool           fCrashed;
 } VDFILE, *PVDFILE;
 
 /**
@@ -107,6 +113,12 @@ typedef struct VDDISK
     VDGEOMETRY     PhysGeom;
     /** Logical CHS geometry. */
     VDGEOMETRY     LogicalGeom;
+    /** File size recorded by the last markfilesize action. */
+    uint64_t       cbFileMark;
+    /** Number of I/O queues requests are spread over, 0 if queues are not used. */
+    uint32_t       cIoQueues;
+    /** Flags whether a completion callback of the queue is running. */
+    volatile bool  afIoQueueCompleting[VD_IO_QUEUES_MAX];
     /** Global test data. */
     PVDTESTGLOB    pTestGlob;
 } VDDISK, *PVDDISK;
@@ -153,6 +165,18 @@ typedef struct VDTESTGLOB
     char            *pszIoBackend;
     /** Testcase handle. */
     RTTEST           hTest;
+    /** Config interface handed to the copy operation. */
+    VDINTERFACECONFIG VDIfCfgCopy;
+    /** Pointer to the per operation interface list for copying, NULL for the defaults. */
+    PVDINTERFACE     pInterfacesCopy;
+    /** Number of copy threads, 0 for the default. */
+    uint32_t         cCopyThreads;
+    /** Copy queue depth, 0 for the default. */
+    uint32_t         cCopyQueueDepth;
+    /** Copy chunk size, 0 for the default. */
+    uint32_t         cbCopyChunk;
+    /** Metadata cache statistics at the last markmetacache action. */
+    VDMETACACHESTATS MetaCacheMark;
 } VDTESTGLOB;
 
 /**
@@ -238,6 +262,8 @@ static DECLCALLBACK(int) vdScriptHandlerMerge(PVDSCRIPTARG paScriptArgs, void *p
 static DECLCALLBACK(int) vdScriptHandlerCompact(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerDiscard(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerCopy(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerCopyConfig(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerIoQueues(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerClose(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerPrintFileSize(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerIoRngCreate(PVDSCRIPTARG paScriptArgs, void *pvUser);
@@ -254,8 +280,19 @@ static DECLCALLBACK(int) vdScriptHandlerDumpDiskInfo(PVDSCRIPTARG paScriptArgs,
 static DECLCALLBACK(int) vdScriptHandlerPrintMsg(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerShowStatistics(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerResetStatistics(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerCheckStatistics(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerMarkFileSize(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerCheckFileGrowth(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerSetMetaCacheSize(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerMarkMetaCache(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerCheckMetaCache(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerResize(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerSetFileBackend(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerSetFileLatency(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerCrashAfterFlushes(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerCreateCache(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerOpenCache(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerCloseCache(PVDSCRIPTARG paScriptArgs, void *pvUser);
 
 #ifdef VBOX_TSTVDIO_WITH_LOG_REPLAY
 static DECLCALLBACK(int) vdScriptHandlerIoLogReplay(PVDSCRIPTARG paScriptArgs, void *pvUser);
@@ -347,6 +384,21 @@ const VDSCRIPTTYPE g_aArgCopy[] =
     VDSCRIPTTYPE_UINT32  /* tosame */
 };
 
+/* I/O queues action */
+const VDSCRIPTTYPE g_aArgIoQueues[] =
+{
+    VDSCRIPTTYPE_STRING, /* disk */
+    VDSCRIPTTYPE_UINT32  /* number of queues, 0 to disable */
+};
+
+/* copy config action */
+const VDSCRIPTTYPE g_aArgCopyConfig[] =
+{
+    VDSCRIPTTYPE_UINT32, /* threads, 0 for the default */
+    VDSCRIPTTYPE_UINT32, /* queue depth, 0 for the default */
+    VDSCRIPTTYPE_UINT32  /* chunk size, 0 for the default */
+};
+
 /* close action */
 const VDSCRIPTTYPE g_aArgClose[] =
 {
@@ -457,6 +509,43 @@ const VDSCRIPTTYPE g_aArgResetStatistics[] =
     VDSCRIPTTYPE_STRING  /* file */
 };
 
+/* Check statistics */
+const VDSCRIPTTYPE g_aArgCheckStatistics[] =
+{
+    VDSCRIPTTYPE_STRING, /* file */
+    VDSCRIPTTYPE_UINT32, /* maximum number of reads */
+    VDSCRIPTTYPE_UINT32  /* maximum number of writes */
+};
+
+/* Record the file size of an image */
+const VDSCRIPTTYPE g_aArgMarkFileSize[] =
+{
+    VDSCRIPTTYPE_STRING, /* disk */
+    VDSCRIPTTYPE_UINT32  /* image */
+};
+
+/* Check the file growth of an image since the last mark */
+const VDSCRIPTTYPE g_aArgCheckFileGrowth[] =
+{
+    VDSCRIPTTYPE_STRING, /* disk */
+    VDSCRIPTTYPE_UINT32, /* image */
+    VDSCRIPTTYPE_UINT64  /* maximum growth in bytes */
+};
+
+/* Set the memory budget of the metadata table cache */
+const VDSCRIPTTYPE g_aArgSetMetaCacheSize[] =
+{
+    VDSCRIPTTYPE_UINT64  /* size */
+};
+
+/* Check the metadata table cache statistics since the last mark */
+const VDSCRIPTTYPE g_aArgCheckMetaCache[] =
+{
+    VDSCRIPTTYPE_UINT32, /* minimum number of hits */
+    VDSCRIPTTYPE_UINT32, /* minimum number of evictions */
+    VDSCRIPTTYPE_BOOL    /* whether the cache must be empty */
+};
+
 /* Resize disk. */
 const VDSCRIPTTYPE g_aArgResize[] =
 {
@@ -470,6 +559,46 @@ const VDSCRIPTTYPE g_aArgSetFileBackend[] =
     VDSCRIPTTYPE_STRING /* new file backend */
 };
 
+/* Set read latency of a file. */
+const VDSCRIPTTYPE g_aArgSetFileLatency[] =
+{
+    VDSCRIPTTYPE_STRING, /* file */
+    VDSCRIPTTYPE_UINT32  /* latency in ms */
+};
+
+/* Simulate a crash of a file after a number of flushes. */
+const VDSCRIPTTYPE g_aArgCrashAfterFlushes[] =
+{
+    VDSCRIPTTYPE_STRING, /* file */
+    VDSCRIPTTYPE_UINT32  /* number of flushes */
+};
+
+/* Create a cache. */
+const VDSCRIPTTYPE g_aArgCreateCache[] =
+{
+    VDSCRIPTTYPE_STRING, /* disk */
+    VDSCRIPTTYPE_STRING, /* name */
+    VDSCRIPTTYPE_STRING, /* type */
+    VDSCRIPTTYPE_STRING, /* backend */
+    VDSCRIPTTYPE_UINT64  /* size */
+};
+
+/* Open a cache. */
+const VDSCRIPTTYPE g_aArgOpenCache[] =
+{
+    VDSCRIPTTYPE_STRING, /* disk */
+    VDSCRIPTTYPE_STRING, /* name */
+    VDSCRIPTTYPE_STRING, /* backend */
+    VDSCRIPTTYPE_BOOL    /* readonly */
+};
+
+/* Close a cache. */
+const VDSCRIPTTYPE g_aArgCloseCache[] =
+{
+    VDSCRIPTTYPE_STRING, /* disk */
+    VDSCRIPTTYPE_BOOL    /* delete */
+};
+
 const VDSCRIPTCALLBACK g_aScriptActions[] =
 {
     /* pcszFnName                  enmTypeReturn      paArgDesc                          cArgDescs                                      pfnHandler */
@@ -486,6 +615,8 @@ const VDSCRIPTCALLBACK g_aScriptActions[] =
     {"compact",                    VDSCRIPTTYPE_VOID, g_aArgCompact,                     RT_ELEMENTS(g_aArgCompact),                    vdScriptHandlerCompact},
     {"discard",                    VDSCRIPTTYPE_VOID, g_aArgDiscard,                     RT_ELEMENTS(g_aArgDiscard),                    vdScriptHandlerDiscard},
     {"copy",                       VDSCRIPTTYPE_VOID, g_aArgCopy,                        RT_ELEMENTS(g_aArgCopy),                       vdScriptHandlerCopy},
+    {"copyconfig",                 VDSCRIPTTYPE_VOID, g_aArgCopyConfig,                  RT_ELEMENTS(g_aArgCopyConfig),                 vdScriptHandlerCopyConfig},
+    {"ioqueues",                   VDSCRIPTTYPE_VOID, g_aArgIoQueues,                    RT_ELEMENTS(g_aArgIoQueues),                   vdScriptHandlerIoQueues},
     {"iorngcreate",                VDSCRIPTTYPE_VOID, g_aArgIoRngCreate,                 RT_ELEMENTS(g_aArgIoRngCreate),                vdScriptHandlerIoRngCreate},
     {"iorngdestroy",               VDSCRIPTTYPE_VOID, NULL,                              0,                                             vdScriptHandlerIoRngDestroy},
     {"iopatterncreatefromnumber",  VDSCRIPTTYPE_VOID, g_aArgIoPatternCreateFromNumber,   RT_ELEMENTS(g_aArgIoPatternCreateFromNumber),  vdScriptHandlerIoPatternCreateFromNumber},
@@ -500,8 +631,19 @@ const VDSCRIPTCALLBACK g_aScriptActions[] =
     {"print",                      VDSCRIPTTYPE_VOID, g_aArgPrintMsg,                    RT_ELEMENTS(g_aArgPrintMsg),                   vdScriptHandlerPrintMsg},
     {"showstatistics",             VDSCRIPTTYPE_VOID, g_aArgShowStatistics,              RT_ELEMENTS(g_aArgShowStatistics),             vdScriptHandlerShowStatistics},
     {"resetstatistics",            VDSCRIPTTYPE_VOID, g_aArgResetStatistics,             RT_ELEMENTS(g_aArgResetStatistics),            vdScriptHandlerResetStatistics},
+    {"checkstatistics",            VDSCRIPTTYPE_VOID, g_aArgCheckStatistics,             RT_ELEMENTS(g_aArgCheckStatistics),            vdScriptHandlerCheckStatistics},
+    {"markfilesize",               VDSCRIPTTYPE_VOID, g_aArgMarkFileSize,                RT_ELEMENTS(g_aArgMarkFileSize),               vdScriptHandlerMarkFileSize},
+    {"checkfilegrowth",            VDSCRIPTTYPE_VOID, g_aArgCheckFileGrowth,             RT_ELEMENTS(g_aArgCheckFileGrowth),            vdScriptHandlerCheckFileGrowth},
+    {"setmetacachesize",           VDSCRIPTTYPE_VOID, g_aArgSetMetaCacheSize,            RT_ELEMENTS(g_aArgSetMetaCacheSize),           vdScriptHandlerSetMetaCacheSize},
+    {"markmetacache",              VDSCRIPTTYPE_VOID, NULL,                              0,                                             vdScriptHandlerMarkMetaCache},
+    {"checkmetacache",             VDSCRIPTTYPE_VOID, g_aArgCheckMetaCache,              RT_ELEMENTS(g_aArgCheckMetaCache),             vdScriptHandlerCheckMetaCache},
     {"resize",                     VDSCRIPTTYPE_VOID, g_aArgResize,                      RT_ELEMENTS(g_aArgResize),                     vdScriptHandlerResize},
     {"setfilebackend",             VDSCRIPTTYPE_VOID, g_aArgSetFileBackend,              RT_ELEMENTS(g_aArgSetFileBackend),             vdScriptHandlerSetFileBackend},
+    {"setfilelatency",             VDSCRIPTTYPE_VOID, g_aArgSetFileLatency,              RT_ELEMENTS(g_aArgSetFileLatency),             vdScriptHandlerSetFileLatency},
+    {"crashafterflushes",          VDSCRIPTTYPE_VOID, g_aArgCrashAfterFlushes,           RT_ELEMENTS(g_aArgCrashAfterFlushes),          vdScriptHandlerCrashAfterFlushes},
+    {"createcache",                VDSCRIPTTYPE_VOID, g_aArgCreateCache,                 RT_ELEMENTS(g_aArgCreateCache),                vdScriptHandlerCreateCache},
+    {"opencache",                  VDSCRIPTTYPE_VOID, g_aArgOpenCache,                   RT_ELEMENTS(g_aArgOpenCache),                  vdScriptHandlerOpenCache},
+    {"closecache",                 VDSCRIPTTYPE_VOID, g_aArgCloseCache,                  RT_ELEMENTS(g_aArgCloseCache),                 vdScriptHandlerCloseCache},
 };
 
 const unsigned g_cScriptActions = RT_ELEMENTS(g_aScriptActions);
@@ -531,6 +673,62 @@ static DECLCALLBACK(int) tstVDMessage(void *pvUser, const char *pszFormat, va_li
     return VINF_SUCCESS;
 }
 
+/**
+ * Returns the value set with the copyconfig action for the given key.
+ *
+ * @returns VBox status code, VERR_CFGM_VALUE_NOT_FOUND if the default should be used.
+ * @param   pGlob       Global test state.
+ * @param   pszName     The key to look up.
+ * @param   pu32Value   Where to store the value.
+ */
+static int tstVDCfgCopyGet(PVDTESTGLOB pGlob, const char *pszName, uint32_t *pu32Value)
+{
+    if (!RTStrCmp(pszName, "CopyThreads"))
+        *pu32Value = pGlob->cCopyThreads;
+    else if (!RTStrCmp(pszName, "CopyQueueDepth"))
+        *pu32Value = pGlob->cCopyQueueDepth;
+    else if (!RTStrCmp(pszName, "CopyChunkSize"))
+        *pu32Value = pGlob->cbCopyChunk;
+    else
+        return VERR_CFGM_VALUE_NOT_FOUND;
+
+    return *pu32Value ? VINF_SUCCESS : VERR_CFGM_VALUE_NOT_FOUND;
+}
+
+static DECLCALLBACK(bool) tstVDCfgCopyAreKeysValid(void *pvUser, const char *pszzValid)
+{
+    NOREF(pvUser); NOREF(pszzValid);
+    return true;
+}
+
+static DECLCALLBACK(int) tstVDCfgCopyQuerySize(void *pvUser, const char *pszName, size_t *pcbValue)
+{
+    uint32_t u32 = 0;
+    int rc = tstVDCfgCopyGet((PVDTESTGLOB)pvUser, pszName, &u32);
+    if (RT_SUCCESS(rc))
+    {
+        char szValue[16];
+        *pcbValue = RTStrPrintf(szValue, sizeof(szValue), "%u", u32) + 1;
+    }
+    return rc;
+}
+
+static DECLCALLBACK(int) tstVDCfgCopyQuery(void *pvUser, const char *pszName, char *pszValue, size_t cchValue)
+{
+    uint32_t u32 = 0;
+    int rc = tstVDCfgCopyGet((PVDTESTGLOB)pvUser, pszName, &u32);
+    if (RT_SUCCESS(rc))
+    {
+        char szValue[16];
+        size_t cch = RTStrPrintf(szValue, sizeof(szValue), "%u", u32);
+        if (cch < cchValue)
+            memcpy(pszValue, szValue, cch + 1);
+        else
+            rc = VERR_CFGM_NOT_ENOUGH_SPACE;
+    }
+    return rc;
+}
+
 static int tstVDIoTestInit(PVDIOTEST pIoTest, PVDTESTGLOB pGlob, bool fRandomAcc, uint64_t cbIo,
                            size_t cbBlkSize, uint64_t offStart, uint64_t offEnd,
                            unsigned uWriteChance, PVDPATTERN pPattern);
@@ -552,6 +750,7 @@ static DECLCALLBACK(int) vdScriptHandlerCreate(PVDSCRIPTARG paScriptArgs, void *
     PVDDISK pDisk = NULL;
     bool fBase = false;
     bool fDynamic = true;
+    bool fCompressed = false;
 
     const char *pcszDisk = paScriptArgs[0].psz;
     if (!RTStrICmp(paScriptArgs[1].psz, "base"))
@@ -568,6 +767,11 @@ static DECLCALLBACK(int) vdScriptHandlerCreate(PVDSCRIPTARG paScriptArgs, void *
         fDynamic = false;
     else if (!RTStrICmp(paScriptArgs[3].psz, "dynamic"))
         fDynamic = true;
+    else if (!RTStrICmp(paScriptArgs[3].psz, "compressed"))
+    {
+        fDynamic    = true;
+        fCompressed = true;
+    }
     else
     {
         RTPrintf("Invalid image type '%s' given\n", paScriptArgs[3].psz);
@@ -589,6 +793,9 @@ static DECLCALLBACK(int) vdScriptHandlerCreate(PVDSCRIPTARG paScriptArgs, void *
             if (!fDynamic)
                 fImageFlags |= VD_IMAGE_FLAGS_FIXED;
 
+            if (fCompressed)
+                fImageFlags |= VD_QCOW_IMAGE_FLAGS_COMPRESSED;
+
             if (fIgnoreFlush)
                 fOpenFlags |= VD_OPEN_FLAGS_IGNORE_FLUSH;
 
@@ -852,14 +1059,24 @@ static DECLCALLBACK(int) vdScriptHandlerIo(PVDSCRIPTARG paScriptArgs, void *pvUs
                                     {
                                         case VDIOREQTXDIR_READ:
                                         {
-                                            rc = VDAsyncRead(pDisk->pVD, paIoReq[idx].off, paIoReq[idx].cbReq, &paIoReq[idx].SgBuf,
-                                                             tstVDIoTestReqComplete, &paIoReq[idx], EventSem);
+                                            if (pDisk->cIoQueues)
+                                                rc = VDAsyncReadQueued(pDisk->pVD, idx % pDisk->cIoQueues, paIoReq[idx].off,
+                                                                       paIoReq[idx].cbReq, &paIoReq[idx].SgBuf,
+                                                                       tstVDIoTestReqComplete, &paIoReq[idx], EventSem);
+                                            else
+                                                rc = VDAsyncRead(pDisk->pVD, paIoReq[idx].off, paIoReq[idx].cbReq, &paIoReq[idx].SgBuf,
+                                                                 tstVDIoTestReqComplete, &paIoReq[idx], EventSem);
                                             break;
                                         }
                                         case VDIOREQTXDIR_WRITE:
                                         {
-                                            rc = VDAsyncWrite(pDisk->pVD, paIoReq[idx].off, paIoReq[idx].cbReq, &paIoReq[idx].SgBuf,
-                                                              tstVDIoTestReqComplete, &paIoReq[idx], EventSem);
+                                            if (pDisk->cIoQueues)
+                                                rc = VDAsyncWriteQueued(pDisk->pVD, idx % pDisk->cIoQueues, paIoReq[idx].off,
+                                                                        paIoReq[idx].cbReq, &paIoReq[idx].SgBuf,
+                                                                        tstVDIoTestReqComplete, &paIoReq[idx], EventSem);
+                                            else
+                                                rc = VDAsyncWrite(pDisk->pVD, paIoReq[idx].off, paIoReq[idx].cbReq, &paIoReq[idx].SgBuf,
+                                                                  tstVDIoTestReqComplete, &paIoReq[idx], EventSem);
                                             break;
                                         }
                                         case VDIOREQTXDIR_FLUSH:
@@ -1324,8 +1541,49 @@ static DECLCALLBACK(int) vdScriptHandlerCopy(PVDSCRIPTARG paScriptArgs, void *pv
         rc = VDCopyEx(pDiskFrom->pVD, nImageFrom, pDiskTo->pVD, pcszBackend, pcszFilename,
                       fMoveByRename, cbSize, nImageFromSame, nImageToSame,
                       VD_IMAGE_FLAGS_NONE, NULL, VD_OPEN_FLAGS_ASYNC_IO,
-                      NULL, pGlob->pInterfacesImages, NULL);
+                      pGlob->pInterfacesCopy, pGlob->pInterfacesImages, NULL);
+    }
+
+    return rc;
+}
+
+static DECLCALLBACK(int) vdScriptHandlerIoQueues(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+    const char *pcszDisk  = paScriptArgs[0].psz;
+    uint32_t    cIoQueues = paScriptArgs[1].u32;
+    PVDDISK pDisk = NULL;
+
+    pDisk = tstVDIoGetDiskByName(pGlob, pcszDisk);
+    if (pDisk)
+    {
+        rc = VDIoQueuesSet(pDisk->pVD, cIoQueues);
+        if (RT_SUCCESS(rc))
+            pDisk->cIoQueues = cIoQueues;
     }
+    else
+        rc = VERR_NOT_FOUND;
+
+    return rc;
+}
+
+static DECLCALLBACK(int) vdScriptHandlerCopyConfig(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+
+    pGlob->cCopyThreads    = paScriptArgs[0].u32;
+    pGlob->cCopyQueueDepth = paScriptArgs[1].u32;
+    pGlob->cbCopyChunk     = paScriptArgs[2].u32;
+
+    if (   !pGlob->cCopyThreads
+        && !pGlob->cCopyQueueDepth
+        && !pGlob->cbCopyChunk)
+        pGlob->pInterfacesCopy = NULL;
+    else if (!pGlob->pInterfacesCopy)
+        rc = VDInterfaceAdd(&pGlob->VDIfCfgCopy.Core, "tstVDIo_VDICfgCopy", VDINTERFACETYPE_CONFIG,
+                            pGlob, sizeof(VDINTERFACECONFIG), &pGlob->pInterfacesCopy);
 
     return rc;
 }
@@ -2002,6 +2260,151 @@ static DECLCALLBACK(int) vdScriptHandlerResetStatistics(PVDSCRIPTARG paScriptArg
     return rc;
 }
 
+static DECLCALLBACK(int) vdScriptHandlerCheckStatistics(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+    const char *pcszFile = paScriptArgs[0].psz;
+    uint32_t cReadsMax   = paScriptArgs[1].u32;
+    uint32_t cWritesMax  = paScriptArgs[2].u32;
+
+    /* Check for the file. */
+    bool fFound = false;
+    PVDFILE pIt;
+    RTListForEach(&pGlob->ListFiles, pIt, VDFILE, Node)
+    {
+        if (!RTStrCmp(pIt->pszName, pcszFile))
+        {
+            fFound = true;
+            break;
+        }
+    }
+
+    if (fFound)
+    {
+        uint32_t cReads  = pIt->cReads + pIt->cAsyncReads;
+        uint32_t cWrites = pIt->cWrites + pIt->cAsyncWrites;
+
+        if (cReads > cReadsMax)
+        {
+            RTTestFailed(pGlob->hTest, "%s: %u reads since the last reset, expected at most %u\n",
+                         pcszFile, cReads, cReadsMax);
+            rc = VERR_INVALID_STATE;
+        }
+        if (cWrites > cWritesMax)
+        {
+            RTTestFailed(pGlob->hTest, "%s: %u writes since the last reset, expected at most %u\n",
+                         pcszFile, cWrites, cWritesMax);
+            rc = VERR_INVALID_STATE;
+        }
+    }
+    else
+        rc = VERR_FILE_NOT_FOUND;
+
+    return rc;
+}
+
+static DECLCALLBACK(int) vdScriptHandlerMarkFileSize(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+    PVDDISK pDisk = NULL;
+    const char *pcszDisk = paScriptArgs[0].psz;
+    uint32_t nImage   = paScriptArgs[1].u32;
+
+    pDisk = tstVDIoGetDiskByName(pGlob, pcszDisk);
+    if (pDisk)
+        pDisk->cbFileMark = VDGetFileSize(pDisk->pVD, nImage);
+    else
+        rc = VERR_NOT_FOUND;
+
+    return rc;
+}
+
+static DECLCALLBACK(int) vdScriptHandlerCheckFileGrowth(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+    PVDDISK pDisk = NULL;
+    const char *pcszDisk = paScriptArgs[0].psz;
+    uint32_t nImage   = paScriptArgs[1].u32;
+    uint64_t cbGrowthMax = paScriptArgs[2].u64;
+
+    pDisk = tstVDIoGetDiskByName(pGlob, pcszDisk);
+    if (pDisk)
+    {
+        uint64_t cbFile = VDGetFileSize(pDisk->pVD, nImage);
+
+        if (   cbFile < pDisk->cbFileMark
+            || cbFile - pDisk->cbFileMark > cbGrowthMax)
+        {
+            RTTestFailed(pGlob->hTest, "%s: image %u is %llu bytes, expected between %llu and %llu\n",
+                         pcszDisk, nImage, cbFile, pDisk->cbFileMark, pDisk->cbFileMark + cbGrowthMax);
+            rc = VERR_INVALID_STATE;
+        }
+    }
+    else
+        rc = VERR_NOT_FOUND;
+
+    return rc;
+}
+
+static DECLCALLBACK(int) vdScriptHandlerSetMetaCacheSize(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    RT_NOREF1(pvUser);
+    return VDMetaCacheSetMaxSize((size_t)paScriptArgs[0].u64);
+}
+
+static DECLCALLBACK(int) vdScriptHandlerMarkMetaCache(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    RT_NOREF1(paScriptArgs);
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+
+    return VDMetaCacheQueryStats(&pGlob->MetaCacheMark);
+}
+
+static DECLCALLBACK(int) vdScriptHandlerCheckMetaCache(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+    uint32_t cHitsMin      = paScriptArgs[0].u32;
+    uint32_t cEvictionsMin = paScriptArgs[1].u32;
+    bool     fEmpty        = paScriptArgs[2].f;
+    VDMETACACHESTATS Stats;
+
+    int rc = VDMetaCacheQueryStats(&Stats);
+    if (RT_SUCCESS(rc))
+    {
+        uint64_t cHits      = Stats.cHits - pGlob->MetaCacheMark.cHits;
+        uint64_t cMisses    = Stats.cMisses - pGlob->MetaCacheMark.cMisses;
+        uint64_t cEvictions = Stats.cEvictions - pGlob->MetaCacheMark.cEvictions;
+
+        RTPrintf("Metadata cache: %llu hits, %llu misses, %llu evictions, %u tables using %zu of %zu bytes\n",
+                 cHits, cMisses, cEvictions, Stats.cEntries, Stats.cbUsed, Stats.cbMax);
+
+        if (cHits < cHitsMin)
+        {
+            RTTestFailed(pGlob->hTest, "Metadata cache: %llu hits since the last mark, expected at least %u\n",
+                         cHits, cHitsMin);
+            rc = VERR_INVALID_STATE;
+        }
+        if (cEvictions < cEvictionsMin)
+        {
+            RTTestFailed(pGlob->hTest, "Metadata cache: %llu evictions since the last mark, expected at least %u\n",
+                         cEvictions, cEvictionsMin);
+            rc = VERR_INVALID_STATE;
+        }
+        if (   fEmpty
+            && (Stats.cEntries || Stats.cbUsed))
+        {
+            RTTestFailed(pGlob->hTest, "Metadata cache: %u tables using %zu bytes left, expected an empty cache\n",
+                         Stats.cEntries, Stats.cbUsed);
+            rc = VERR_INVALID_STATE;
+        }
+    }
+
+    return rc;
+}
+
 static DECLCALLBACK(int) vdScriptHandlerResize(PVDSCRIPTARG paScriptArgs, void *pvUser)
 {
     int rc = VINF_SUCCESS;
@@ -2035,6 +2438,144 @@ static DECLCALLBACK(int) vdScriptHandlerSetFileBackend(PVDSCRIPTARG paScriptArgs
     return rc;
 }
 
+static DECLCALLBACK(int) vdScriptHandlerSetFileLatency(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+    const char *pcszFile = paScriptArgs[0].psz;
+    uint32_t cMillies = paScriptArgs[1].u32;
+
+    /* Check for the file. */
+    bool fFound = false;
+    PVDFILE pIt;
+    RTListForEach(&pGlob->ListFiles, pIt, VDFILE, Node)
+    {
+        if (!RTStrCmp(pIt->pszName, pcszFile))
+        {
+            fFound = true;
+            break;
+        }
+    }
+
+    if (fFound)
+        pIt->cMilliesReadLatency = cMillies;
+    else
+        rc = VERR_FILE_NOT_FOUND;
+
+    return rc;
+}
+
+static DECLCALLBACK(int) vdScriptHandlerCrashAfterFlushes(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+    const char *pcszFile = paScriptArgs[0].psz;
+    uint32_t cFlushes = paScriptArgs[1].u32;
+
+    /* Check for the file. */
+    bool fFound = false;
+    PVDFILE pIt;
+    RTListForEach(&pGlob->ListFiles, pIt, VDFILE, Node)
+    {
+        if (!RTStrCmp(pIt->pszName, pcszFile))
+        {
+            fFound = true;
+            break;
+        }
+    }
+
+    if (fFound)
+    {
+        /* The file keeps what was written before the last flush, everything else is lost. */
+        pIt->cFlushesUntilCrash = cFlushes;
+        pIt->fCrashed           = !cFlushes;
+    }
+    else
+        rc = VERR_FILE_NOT_FOUND;
+
+    return rc;
+}
+
+static DECLCALLBACK(int) vdScriptHandlerCreateCache(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+    PVDDISK pDisk = NULL;
+    bool fDynamic = true;
+
+    const char *pcszDisk = paScriptArgs[0].psz;
+    const char *pcszCache = paScriptArgs[1].psz;
+    if (!RTStrICmp(paScriptArgs[2].psz, "fixed"))
+        fDynamic = false;
+    else if (!RTStrICmp(paScriptArgs[2].psz, "dynamic"))
+        fDynamic = true;
+    else
+    {
+        RTPrintf("Invalid cache type '%s' given\n", paScriptArgs[2].psz);
+        rc = VERR_INVALID_PARAMETER;
+    }
+    const char *pcszBackend = paScriptArgs[3].psz;
+    uint64_t cbSize = paScriptArgs[4].u64;
+
+    if (RT_SUCCESS(rc))
+    {
+        pDisk = tstVDIoGetDiskByName(pGlob, pcszDisk);
+        if (pDisk)
+            rc = VDCreateCache(pDisk->pVD, pcszBackend, pcszCache, cbSize,
+                               fDynamic ? VD_IMAGE_FLAGS_NONE : VD_IMAGE_FLAGS_FIXED,
+                               NULL, NULL, VD_OPEN_FLAGS_ASYNC_IO, pGlob->pInterfacesImages, NULL);
+        else
+            rc = VERR_NOT_FOUND;
+    }
+
+    return rc;
+}
+
+static DECLCALLBACK(int) vdScriptHandlerOpenCache(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+    PVDDISK pDisk = NULL;
+
+    const char *pcszDisk = paScriptArgs[0].psz;
+    const char *pcszCache = paScriptArgs[1].psz;
+    const char *pcszBackend = paScriptArgs[2].psz;
+    bool fReadonly = paScriptArgs[3].f;
+
+    pDisk = tstVDIoGetDiskByName(pGlob, pcszDisk);
+    if (pDisk)
+    {
+        unsigned fOpenFlags = VD_OPEN_FLAGS_ASYNC_IO;
+
+        if (fReadonly)
+            fOpenFlags |= VD_OPEN_FLAGS_READONLY;
+
+        rc = VDCacheOpen(pDisk->pVD, pcszBackend, pcszCache, fOpenFlags, pGlob->pInterfacesImages);
+    }
+    else
+        rc = VERR_NOT_FOUND;
+
+    return rc;
+}
+
+static DECLCALLBACK(int) vdScriptHandlerCloseCache(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+    PVDDISK pDisk = NULL;
+
+    const char *pcszDisk = paScriptArgs[0].psz;
+    bool fDelete = paScriptArgs[1].f;
+
+    pDisk = tstVDIoGetDiskByName(pGlob, pcszDisk);
+    if (pDisk)
+        rc = VDCacheClose(pDisk->pVD, fDelete);
+    else
+        rc = VERR_NOT_FOUND;
+
+    return rc;
+}
+
 static DECLCALLBACK(int) tstVDIoFileOpen(void *pvUser, const char *pszLocation,
                                          uint32_t fOpen,
                                          PFNVDCOMPLETED pfnCompleted,
@@ -2103,6 +2644,12 @@ static DECLCALLBACK(int) tstVDIoFileOpen(void *pvUser, const char *pszLocation,
     {
         if (!fFound)
             rc = VERR_FILE_NOT_FOUND;
+        else
+        {
+            /* Reopening the file after a simulated crash makes it writable again. */
+            pIt->cFlushesUntilCrash = 0;
+            pIt->fCrashed           = false;
+        }
     }
     else
         rc = VERR_INVALID_PARAMETER;
@@ -2226,6 +2773,19 @@ static DECLCALLBACK(int) tstVDIoFileGetModificationTime(void *pvUser, const char
     return VINF_SUCCESS;
 }
 
+/**
+ * Accounts for a flush of the given file, crashing the file if it was armed.
+ *
+ * @returns nothing.
+ * @param   pFile    The file which was flushed.
+ */
+static void tstVDIoFileFlushed(PVDFILE pFile)
+{
+    if (   pFile->cFlushesUntilCrash
+        && !--pFile->cFlushesUntilCrash)
+        pFile->fCrashed = true;
+}
+
 static DECLCALLBACK(int) tstVDIoFileGetSize(void *pvUser, void *pStorage, uint64_t *pcbSize)
 {
     RT_NOREF1(pvUser);
@@ -2258,6 +2818,14 @@ static DECLCALLBACK(int) tstVDIoFileWriteSync(void *pvUser, void *pStorage, uint
     RTSGBUF SgBuf;
     RTSGSEG Seg;
 
+    /* Writes after a simulated crash never reach the storage. */
+    if (pIoStorage->pFile->fCrashed)
+    {
+        if (pcbWritten)
+            *pcbWritten = cbBuffer;
+        return VINF_SUCCESS;
+    }
+
     Seg.pvSeg = (void *)pvBuffer;
     Seg.cbSeg = cbBuffer;
     RTSgBufInit(&SgBuf, &Seg, 1);
@@ -2286,6 +2854,8 @@ static DECLCALLBACK(int) tstVDIoFileReadSync(void *pvUser, void *pStorage, uint6
     Seg.pvSeg = pvBuffer;
     Seg.cbSeg = cbBuffer;
     RTSgBufInit(&SgBuf, &Seg, 1);
+    if (pIoStorage->pFile->cMilliesReadLatency)
+        RTThreadSleep(pIoStorage->pFile->cMilliesReadLatency);
     rc = VDIoBackendTransfer(pIoStorage->pFile->pIoStorage, VDIOTXDIR_READ, uOffset,
                              cbBuffer, &SgBuf, NULL, true /* fSync */);
     if (RT_SUCCESS(rc))
@@ -2305,6 +2875,7 @@ static DECLCALLBACK(int) tstVDIoFileFlushSync(void *pvUser, void *pStorage)
     int rc = VDIoBackendTransfer(pIoStorage->pFile->pIoStorage, VDIOTXDIR_FLUSH, 0,
                                  0, NULL, NULL, true /* fSync */);
     pIoStorage->pFile->cFlushes++;
+    tstVDIoFileFlushed(pIoStorage->pFile);
     return rc;
 }
 
@@ -2319,6 +2890,8 @@ static DECLCALLBACK(int) tstVDIoFileReadAsync(void *pvUser, void *pStorage, uint
     RTSGBUF SgBuf;
 
     RTSgBufInit(&SgBuf, paSegments, cSegments);
+    if (pIoStorage->pFile->cMilliesReadLatency)
+        RTThreadSleep(pIoStorage->pFile->cMilliesReadLatency);
     rc = VDIoBackendTransfer(pIoStorage->pFile->pIoStorage, VDIOTXDIR_READ, uOffset,
                              cbRead, &SgBuf, pvCompletion, false /* fSync */);
     if (RT_SUCCESS(rc))
@@ -2340,6 +2913,19 @@ static DECLCALLBACK(int) tstVDIoFileWriteAsync(void *pvUser, void *pStorage, uin
     PVDSTORAGE pIoStorage = (PVDSTORAGE)pStorage;
     RTSGBUF SgBuf;
 
+    /*
+     * Writes after a simulated crash never reach the storage, a flush completes
+     * the request without touching the data.
+     */
+    if (pIoStorage->pFile->fCrashed)
+    {
+        rc = VDIoBackendTransfer(pIoStorage->pFile->pIoStorage, VDIOTXDIR_FLUSH, 0,
+                                 0, NULL, pvCompletion, false /* fSync */);
+        if (RT_SUCCESS(rc))
+            rc = VERR_VD_ASYNC_IO_IN_PROGRESS;
+        return rc;
+    }
+
     RTSgBufInit(&SgBuf, paSegments, cSegments);
     rc = VDIoBackendTransfer(pIoStorage->pFile->pIoStorage, VDIOTXDIR_WRITE, uOffset,
                              cbWrite, &SgBuf, pvCompletion, false /* fSync */);
@@ -2364,6 +2950,7 @@ static DECLCALLBACK(int) tstVDIoFileFlushAsync(void *pvUser, void *pStorage, voi
     if (RT_SUCCESS(rc))
     {
         pIoStorage->pFile->cAsyncFlushes++;
+        tstVDIoFileFlushed(pIoStorage->pFile);
         rc = VERR_VD_ASYNC_IO_IN_PROGRESS;
     }
 
@@ -2539,6 +3126,23 @@ static DECLCALLBACK(void) tstVDIoTestReqComplete(void *pvUser1, void *pvUser2, i
 
     LogFlow(("Request %d completed\n", pIoReq->idx));
 
+    /*
+     * Completion callbacks of queued requests run outside of the disk lock,
+     * but never concurrently for the same queue.
+     */
+    uint32_t idIoQueue = VD_IO_QUEUE_ID_NONE;
+    if (   pDisk->cIoQueues
+        && (   pIoReq->enmTxDir == VDIOREQTXDIR_READ
+            || pIoReq->enmTxDir == VDIOREQTXDIR_WRITE))
+    {
+        idIoQueue = pIoReq->idx % pDisk->cIoQueues;
+        if (!ASMAtomicCmpXchgBool(&pDisk->afIoQueueCompleting[idIoQueue], true, false))
+        {
+            RTTestFailed(pDisk->pTestGlob->hTest, "Completion callbacks of I/O queue %u overlap\n", idIoQueue);
+            idIoQueue = VD_IO_QUEUE_ID_NONE;
+        }
+    }
+
     if (pDisk->pMemDiskVerify)
     {
         switch (pIoReq->enmTxDir)
@@ -2570,6 +3174,9 @@ static DECLCALLBACK(void) tstVDIoTestReqComplete(void *pvUser1, void *pvUser2, i
         }
     }
 
+    if (idIoQueue != VD_IO_QUEUE_ID_NONE)
+        ASMAtomicXchgBool(&pDisk->afIoQueueCompleting[idIoQueue], false);
+
     ASMAtomicXchgBool(&pIoReq->fOutstanding, false);
     RTSemEventSignal(hEventSem);
     return;
@@ -2707,6 +3314,9 @@ static void tstVDIoScriptExec(const char *pszName, const char *pszScript)
     /* Init global test data. */
     GlobTest.VDIfError.pfnError     = tstVDError;
     GlobTest.VDIfError.pfnMessage   = tstVDMessage;
+    GlobTest.VDIfCfgCopy.pfnAreKeysValid = tstVDCfgCopyAreKeysValid;
+    GlobTest.VDIfCfgCopy.pfnQuerySize    = tstVDCfgCopyQuerySize;
+    GlobTest.VDIfCfgCopy.pfnQuery        = tstVDCfgCopyQuery;
 
     rc = VDInterfaceAdd(&GlobTest.VDIfError.Core, "tstVDIo_VDIError", VDINTERFACETYPE_ERROR,
                         NULL, sizeof(VDINTERFACEERROR), &GlobTest.pInterfacesDisk);
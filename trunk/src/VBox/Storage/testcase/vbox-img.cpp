@@ -58,7 +58,10 @@ static void printUsage(PRTSTREAM pStrm)
                  "                [--stdin]|[--stdout]\n"
                  "                [--srcformat VDI|VMDK|VHD|RAW|..]\n"
                  "                [--dstformat VDI|VMDK|VHD|RAW|..]\n"
-                 "                [--variant Standard,Fixed,Split2G,Stream,ESX]\n"
+                 "                [--variant Standard,Fixed,Split2G,Stream,ESX,Compressed]\n"
+                 "                [--chunksize <transfer size in bytes>]\n"
+                 "                [--queuedepth <number of transfers in flight>]\n"
+                 "                [--threads <number of threads>]\n"
                  "\n"
                  "   info         --filename <filename>\n"
                  "\n"
@@ -71,7 +74,7 @@ static void printUsage(PRTSTREAM pStrm)
                  "   createbase   --filename <filename>\n"
                  "                --size <size in bytes>\n"
                  "                [--format VDI|VMDK|VHD] (default: VDI)\n"
-                 "                [--variant Standard,Fixed,Split2G,Stream,ESX]\n"
+                 "                [--variant Standard,Fixed,Split2G,Stream,ESX,Compressed]\n"
                  "                [--dataalignment <alignment in bytes>]\n"
                  "\n"
                  "   repair       --filename <filename>\n"
@@ -179,6 +182,8 @@ static int parseDiskVariant(const char *psz, unsigned *puImageFlags)
                 uImageFlags |= VD_VMDK_IMAGE_FLAGS_STREAM_OPTIMIZED;
             else if (!RTStrNICmp(psz, "esx", len))
                 uImageFlags |= VD_VMDK_IMAGE_FLAGS_ESX;
+            else if (!RTStrNICmp(psz, "compressed", len))
+                uImageFlags |= VD_QCOW_IMAGE_FLAGS_COMPRESSED;
             else
                 rc = VERR_PARSE_ERROR;
         }
@@ -824,6 +829,68 @@ static DECLCALLBACK(int) convOutFlush(void *pvUser, void *pStorage)
     return VINF_SUCCESS;
 }
 
+/**
+ * Transfer parameters of the convert command, handed to the copy engine
+ * as configuration keys. A value of 0 selects the default.
+ */
+typedef struct CONVCFG
+{
+    uint32_t cbChunk;
+    uint32_t cQueueDepth;
+    uint32_t cThreads;
+} CONVCFG;
+
+static int convCfgGetValue(void *pvUser, const char *pszName, char *pszValue, size_t cchValue)
+{
+    CONVCFG *pCfg = (CONVCFG *)pvUser;
+    uint32_t u32 = 0;
+
+    AssertPtrReturn(pCfg, VERR_GENERAL_FAILURE);
+
+    if (!RTStrCmp(pszName, "CopyChunkSize"))
+        u32 = pCfg->cbChunk;
+    else if (!RTStrCmp(pszName, "CopyQueueDepth"))
+        u32 = pCfg->cQueueDepth;
+    else if (!RTStrCmp(pszName, "CopyThreads"))
+        u32 = pCfg->cThreads;
+    if (!u32)
+        return VERR_CFGM_VALUE_NOT_FOUND;
+
+    char szValue[16];
+    size_t cch = RTStrPrintf(szValue, sizeof(szValue), "%RU32", u32);
+    if (!pszValue)
+        return (int)cch + 1;
+    if (cch >= cchValue)
+        return VERR_CFGM_NOT_ENOUGH_SPACE;
+    memcpy(pszValue, szValue, cch + 1);
+    return VINF_SUCCESS;
+}
+
+static DECLCALLBACK(bool) convCfgAreKeysValid(void *pvUser, const char *pszzValid)
+{
+    RT_NOREF2(pvUser, pszzValid);
+    return true;
+}
+
+static DECLCALLBACK(int) convCfgQuerySize(void *pvUser, const char *pszName, size_t *pcbValue)
+{
+    AssertReturn(VALID_PTR(pcbValue), VERR_INVALID_POINTER);
+
+    int rc = convCfgGetValue(pvUser, pszName, NULL, 0);
+    if (rc < 0)
+        return rc;
+
+    *pcbValue = (size_t)rc;
+    return VINF_SUCCESS;
+}
+
+static DECLCALLBACK(int) convCfgQuery(void *pvUser, const char *pszName, char *pszValue, size_t cchValue)
+{
+    AssertReturn(VALID_PTR(pszValue), VERR_INVALID_POINTER);
+
+    return convCfgGetValue(pvUser, pszName, pszValue, cchValue);
+}
+
 static int handleConvert(HandlerArg *a)
 {
     const char *pszSrcFilename = NULL;
@@ -841,6 +908,9 @@ static int handleConvert(HandlerArg *a)
     PVDINTERFACE pIfsImageOutput = NULL;
     VDINTERFACEIO IfsInputIO;
     VDINTERFACEIO IfsOutputIO;
+    PVDINTERFACE pIfsOperation = NULL;
+    VDINTERFACECONFIG IfCfg;
+    CONVCFG ConvCfg = { 0, 0, 0 };
     int rc = VINF_SUCCESS;
 
     /* Parse the command line. */
@@ -852,7 +922,10 @@ static int handleConvert(HandlerArg *a)
         { "--stdout", 'P', RTGETOPT_REQ_NOTHING },
         { "--srcformat", 's', RTGETOPT_REQ_STRING },
         { "--dstformat", 'd', RTGETOPT_REQ_STRING },
-        { "--variant", 'v', RTGETOPT_REQ_STRING }
+        { "--variant", 'v', RTGETOPT_REQ_STRING },
+        { "--chunksize", 'c', RTGETOPT_REQ_UINT32 },
+        { "--queuedepth", 'q', RTGETOPT_REQ_UINT32 },
+        { "--threads", 't', RTGETOPT_REQ_UINT32 }
     };
     int ch;
     RTGETOPTUNION ValueUnion;
@@ -883,6 +956,15 @@ static int handleConvert(HandlerArg *a)
             case 'v':   // --variant
                 pszVariant = ValueUnion.psz;
                 break;
+            case 'c':   // --chunksize
+                ConvCfg.cbChunk = ValueUnion.u32;
+                break;
+            case 'q':   // --queuedepth
+                ConvCfg.cQueueDepth = ValueUnion.u32;
+                break;
+            case 't':   // --threads
+                ConvCfg.cThreads = ValueUnion.u32;
+                break;
 
             default:
                 ch = RTGetOptPrintError(ch, &ValueUnion);
@@ -950,6 +1032,12 @@ static int handleConvert(HandlerArg *a)
                        NULL, sizeof(VDINTERFACEIO), &pIfsImageOutput);
     }
 
+    IfCfg.pfnAreKeysValid = convCfgAreKeysValid;
+    IfCfg.pfnQuerySize    = convCfgQuerySize;
+    IfCfg.pfnQuery        = convCfgQuery;
+    VDInterfaceAdd(&IfCfg.Core, "Config", VDINTERFACETYPE_CONFIG, &ConvCfg,
+                   sizeof(IfCfg), &pIfsOperation);
+
     /* check the variant parameter */
     if (pszVariant)
     {
@@ -974,6 +1062,8 @@ static int handleConvert(HandlerArg *a)
                     uImageFlags |= VD_VMDK_IMAGE_FLAGS_STREAM_OPTIMIZED;
                 else if (!RTStrNICmp(pszVariant, "esx", len))
                     uImageFlags |= VD_VMDK_IMAGE_FLAGS_ESX;
+                else if (!RTStrNICmp(pszVariant, "compressed", len))
+                    uImageFlags |= VD_QCOW_IMAGE_FLAGS_COMPRESSED;
                 else
                     return errorSyntax("Invalid --variant option\n");
             }
@@ -1008,8 +1098,10 @@ static int handleConvert(HandlerArg *a)
             break;
         }
 
+        /* Only a pipe requires strictly sequential access, files can be read
+         * and written with several transfers in flight. */
         rc = VDOpen(pSrcDisk, pszSrcFormat, pszSrcFilename,
-                    VD_OPEN_FLAGS_READONLY | VD_OPEN_FLAGS_SEQUENTIAL,
+                    VD_OPEN_FLAGS_READONLY | (fStdIn ? VD_OPEN_FLAGS_SEQUENTIAL : 0),
                     pIfsImageInput);
         if (RT_FAILURE(rc))
         {
@@ -1030,8 +1122,8 @@ static int handleConvert(HandlerArg *a)
         /* Create the output image */
         rc = VDCopy(pSrcDisk, VD_LAST_IMAGE, pDstDisk, pszDstFormat,
                     pszDstFilename, false, 0, uImageFlags, NULL,
-                    VD_OPEN_FLAGS_NORMAL | VD_OPEN_FLAGS_SEQUENTIAL, NULL,
-                    pIfsImageOutput, NULL);
+                    VD_OPEN_FLAGS_NORMAL | (fStdOut ? VD_OPEN_FLAGS_SEQUENTIAL : 0),
+                    pIfsOperation, pIfsImageOutput, NULL);
         if (RT_FAILURE(rc))
         {
             errorRuntime("Error while copying the image: %Rrf (%Rrc)\n", rc, rc);
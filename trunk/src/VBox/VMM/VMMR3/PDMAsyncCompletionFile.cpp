@@ -36,6 +36,7 @@
 #include <iprt/env.h>
 #include <iprt/file.h>
 #include <iprt/mem.h>
+#include <iprt/mp.h>
 #include <iprt/semaphore.h>
 #include <iprt/string.h>
 #include <iprt/thread.h>
@@ -190,7 +191,7 @@ PPDMACTASKFILE pdmacFileEpGetNewTasks(PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint)
     return pTasks;
 }
 
-static void pdmacFileAioMgrWakeup(PPDMACEPFILEMGR pAioMgr)
+void pdmacFileAioMgrWakeup(PPDMACEPFILEMGR pAioMgr)
 {
     bool fWokenUp = ASMAtomicXchgBool(&pAioMgr->fWokenUp, true);
     if (!fWokenUp)
@@ -258,13 +259,27 @@ static int pdmacFileAioMgrRemoveEndpoint(PPDMACEPFILEMGR pAioMgr, PPDMASYNCCOMPL
 }
 #endif
 
-static int pdmacFileAioMgrCloseEndpoint(PPDMACEPFILEMGR pAioMgr, PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint)
+static int pdmacFileAioMgrCloseEndpoint(PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint)
 {
-    int rc = RTCritSectEnter(&pAioMgr->CritSectBlockingEvent);
-    AssertRCReturn(rc, rc);
+    /*
+     * With per CPU managers the endpoint may be handed over to another manager
+     * while we wait for the critical section, the hand over is done with the
+     * source manager's critical section owned.  So retry until we own the
+     * critical section of the manager the endpoint is really assigned to.
+     */
+    PPDMACEPFILEMGR pAioMgr;
+    for (;;)
+    {
+        pAioMgr = ASMAtomicReadPtrT(&pEndpoint->pAioMgr, PPDMACEPFILEMGR);
+        int rc = RTCritSectEnter(&pAioMgr->CritSectBlockingEvent);
+        AssertRCReturn(rc, rc);
+        if (pAioMgr == ASMAtomicReadPtrT(&pEndpoint->pAioMgr, PPDMACEPFILEMGR))
+            break;
+        RTCritSectLeave(&pAioMgr->CritSectBlockingEvent);
+    }
 
     ASMAtomicWritePtr(&pAioMgr->BlockingEventData.CloseEndpoint.pEndpoint, pEndpoint);
-    rc = pdmacFileAioMgrWaitForBlockingEvent(pAioMgr, PDMACEPFILEAIOMGRBLOCKINGEVENT_CLOSE_ENDPOINT);
+    int rc = pdmacFileAioMgrWaitForBlockingEvent(pAioMgr, PDMACEPFILEAIOMGRBLOCKINGEVENT_CLOSE_ENDPOINT);
     ASMAtomicWriteNullPtr(&pAioMgr->BlockingEventData.CloseEndpoint.pEndpoint);
 
     RTCritSectLeave(&pAioMgr->CritSectBlockingEvent);
@@ -293,7 +308,19 @@ int pdmacFileEpAddTask(PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint, PPDMACTASKFILE
         pTask->pNext = pNext;
     } while (!ASMAtomicCmpXchgPtr(&pEndpoint->pTasksNewHead, pTask, pNext));
 
-    pdmacFileAioMgrWakeup(ASMAtomicReadPtrT(&pEndpoint->pAioMgr, PPDMACEPFILEMGR));
+    PPDMACEPFILEMGR pAioMgr = ASMAtomicReadPtrT(&pEndpoint->pAioMgr, PPDMACEPFILEMGR);
+    PPDMASYNCCOMPLETIONEPCLASSFILE pEpClassFile = (PPDMASYNCCOMPLETIONEPCLASSFILE)pEndpoint->Core.pEpClass;
+    if (pEpClassFile->cCpusPerAioMgr)
+    {
+        /* Record where the request came from so the manager can move the endpoint closer. */
+        uint32_t idxCpuGroup = pdmacFileAioMgrCurCpuGroup(pEpClassFile);
+        ASMAtomicWriteU32(&pEndpoint->idxCpuGroupIssuer, idxCpuGroup);
+        ASMAtomicIncU32(&pEndpoint->cTasksIssued);
+        if (idxCpuGroup != pAioMgr->idxCpuGroup)
+            ASMAtomicIncU32(&pEndpoint->cTasksIssuedRemote);
+    }
+
+    pdmacFileAioMgrWakeup(pAioMgr);
 
     return VINF_SUCCESS;
 }
@@ -420,15 +447,17 @@ int pdmacFileEpTaskInitiate(PPDMASYNCCOMPLETIONTASK pTask,
 }
 
 /**
- * Creates a new async I/O manager.
+ * Creates a new async I/O manager, worker for pdmacFileAioMgrCreate() and
+ * pdmacFileAioMgrQueryForCpuGroup().
  *
  * @returns VBox status code.
  * @param   pEpClass    Pointer to the endpoint class data.
  * @param   ppAioMgr    Where to store the pointer to the new async I/O manager on success.
  * @param   enmMgrType  Wanted manager type - can be overwritten by the global override.
+ * @param   idxCpuGroup The CPU group the manager serves, UINT32_MAX for none.
  */
-int pdmacFileAioMgrCreate(PPDMASYNCCOMPLETIONEPCLASSFILE pEpClass, PPPDMACEPFILEMGR ppAioMgr,
-                          PDMACEPFILEMGRTYPE enmMgrType)
+static int pdmacFileAioMgrCreateEx(PPDMASYNCCOMPLETIONEPCLASSFILE pEpClass, PPPDMACEPFILEMGR ppAioMgr,
+                                   PDMACEPFILEMGRTYPE enmMgrType, uint32_t idxCpuGroup)
 {
     LogFlowFunc((": Entered\n"));
 
@@ -442,6 +471,18 @@ int pdmacFileAioMgrCreate(PPDMASYNCCOMPLETIONEPCLASSFILE pEpClass, PPPDMACEPFILE
             pAioMgrNew->enmMgrType = pEpClass->enmMgrTypeOverride;
 
         pAioMgrNew->msBwLimitExpired = RT_INDEFINITE_WAIT;
+        pAioMgrNew->idxCpuGroup      = idxCpuGroup;
+        RTCpuSetEmpty(&pAioMgrNew->AffinitySet);
+        if (idxCpuGroup != UINT32_MAX)
+        {
+            /* Bind the manager to the CPUs of its group, the thread applies it on startup. */
+            uint32_t const cCpus = RTMpGetArraySize();
+            for (uint32_t iCpu = idxCpuGroup * pEpClass->cCpusPerAioMgr;
+                 iCpu < (idxCpuGroup + 1) * pEpClass->cCpusPerAioMgr && iCpu < cCpus;
+                 iCpu++)
+                if (RTMpIsCpuPossible(RTMpCpuIdFromSetIndex(iCpu)))
+                    RTCpuSetAddByIndex(&pAioMgrNew->AffinitySet, iCpu);
+        }
 
         rc = RTSemEventCreate(&pAioMgrNew->EventSem);
         if (RT_SUCCESS(rc))
@@ -504,6 +545,66 @@ int pdmacFileAioMgrCreate(PPDMASYNCCOMPLETIONEPCLASSFILE pEpClass, PPPDMACEPFILE
     return rc;
 }
 
+/**
+ * Creates a new async I/O manager.
+ *
+ * @returns VBox status code.
+ * @param   pEpClass    Pointer to the endpoint class data.
+ * @param   ppAioMgr    Where to store the pointer to the new async I/O manager on success.
+ * @param   enmMgrType  Wanted manager type - can be overwritten by the global override.
+ */
+int pdmacFileAioMgrCreate(PPDMASYNCCOMPLETIONEPCLASSFILE pEpClass, PPPDMACEPFILEMGR ppAioMgr,
+                          PDMACEPFILEMGRTYPE enmMgrType)
+{
+    return pdmacFileAioMgrCreateEx(pEpClass, ppAioMgr, enmMgrType, UINT32_MAX);
+}
+
+/**
+ * Returns the CPU group of the calling thread when per CPU managers are enabled.
+ *
+ * @returns CPU group index.
+ * @param   pEpClass    Pointer to the endpoint class data.
+ */
+uint32_t pdmacFileAioMgrCurCpuGroup(PPDMASYNCCOMPLETIONEPCLASSFILE pEpClass)
+{
+    Assert(pEpClass->cCpusPerAioMgr);
+
+    int iCpu = RTMpCurSetIndex();
+    if (RT_UNLIKELY(iCpu < 0))
+        iCpu = 0;
+    return RT_MIN((uint32_t)iCpu / pEpClass->cCpusPerAioMgr, pEpClass->cCpuGroups - 1);
+}
+
+/**
+ * Returns the async I/O manager of the given CPU group, creating it if necessary.
+ *
+ * @returns VBox status code.
+ * @param   pEpClass    Pointer to the endpoint class data.
+ * @param   idxCpuGroup The CPU group.
+ * @param   ppAioMgr    Where to store the pointer to the async I/O manager on success.
+ */
+int pdmacFileAioMgrQueryForCpuGroup(PPDMASYNCCOMPLETIONEPCLASSFILE pEpClass, uint32_t idxCpuGroup, PPPDMACEPFILEMGR ppAioMgr)
+{
+    AssertReturn(idxCpuGroup < pEpClass->cCpuGroups, VERR_INVALID_PARAMETER);
+
+    int rc = VINF_SUCCESS;
+    RTCritSectEnter(&pEpClass->CritSect);
+    PPDMACEPFILEMGR pAioMgr = pEpClass->papAioMgrCpuGroups[idxCpuGroup];
+    if (!pAioMgr)
+    {
+        rc = pdmacFileAioMgrCreateEx(pEpClass, &pAioMgr, PDMACEPFILEMGRTYPE_ASYNC, idxCpuGroup);
+        if (RT_SUCCESS(rc))
+        {
+            pEpClass->papAioMgrCpuGroups[idxCpuGroup] = pAioMgr;
+            LogRel(("AIOMgr: Created I/O manager {%s} for CPU group %u\n", RTThreadGetName(pAioMgr->Thread), idxCpuGroup));
+        }
+    }
+    RTCritSectLeave(&pEpClass->CritSect);
+
+    *ppAioMgr = pAioMgr;
+    return rc;
+}
+
 /**
  * Destroys a async I/O manager.
  *
@@ -836,6 +937,16 @@ static DECLCALLBACK(int) pdmacFileInitialize(PPDMASYNCCOMPLETIONEPCLASS pClassGl
 
             LogRel(("AIOMgr: Default file backend is '%s'\n", pdmacFileBackendTypeToName(pEpClassFile->enmEpBackendDefault)));
 
+            /*
+             * Number of host CPUs sharing one manager.  By default all endpoints share a
+             * single manager.  With 1 there is a manager per host CPU, larger values
+             * group neighbouring CPUs (e.g. the cores of a NUMA node or package).
+             * Endpoints follow the CPU group issuing most of their requests, except on
+             * hosts where files stay associated with the first I/O context (Windows).
+             */
+            rc = CFGMR3QueryU32Def(pCfgNode, "CpusPerIoMgr", &pEpClassFile->cCpusPerAioMgr, 0);
+            AssertLogRelRCReturn(rc, rc);
+
 #ifdef RT_OS_LINUX
             if (   pEpClassFile->enmMgrTypeOverride == PDMACEPFILEMGRTYPE_ASYNC
                 && pEpClassFile->enmEpBackendDefault == PDMACFILEEPBACKEND_BUFFERED)
@@ -853,6 +964,23 @@ static DECLCALLBACK(int) pdmacFileInitialize(PPDMASYNCCOMPLETIONEPCLASS pClassGl
         }
     }
 
+    if (   pEpClassFile->cCpusPerAioMgr
+        && pEpClassFile->enmMgrTypeOverride == PDMACEPFILEMGRTYPE_ASYNC)
+    {
+        pEpClassFile->cCpuGroups = (RTMpGetArraySize() + pEpClassFile->cCpusPerAioMgr - 1) / pEpClassFile->cCpusPerAioMgr;
+        rc = MMR3HeapAllocZEx(pEpClassFile->Core.pVM, MM_TAG_PDM_ASYNC_COMPLETION,
+                              pEpClassFile->cCpuGroups * sizeof(PPDMACEPFILEMGR),
+                              (void **)&pEpClassFile->papAioMgrCpuGroups);
+        AssertLogRelRCReturn(rc, rc);
+        LogRel(("AIOMgr: Using one I/O manager per %u host CPU(s), %u groups\n",
+                pEpClassFile->cCpusPerAioMgr, pEpClassFile->cCpuGroups));
+#ifdef PDMACEPFILE_AIO_CTX_ASSOCIATION_PERMANENT
+        LogRel(("AIOMgr: Endpoints stay with the manager of the CPU group opening them on this host\n"));
+#endif
+    }
+    else
+        pEpClassFile->cCpusPerAioMgr = 0;
+
     /* Init critical section. */
     rc = RTCritSectInit(&pEpClassFile->CritSect);
 
@@ -885,6 +1013,12 @@ static DECLCALLBACK(void) pdmacFileTerminate(PPDMASYNCCOMPLETIONEPCLASS pClassGl
     while (pEpClassFile->pAioMgrHead)
         pdmacFileAioMgrDestroy(pEpClassFile, pEpClassFile->pAioMgrHead);
 
+    if (pEpClassFile->papAioMgrCpuGroups)
+    {
+        MMR3HeapFree(pEpClassFile->papAioMgrCpuGroups);
+        pEpClassFile->papAioMgrCpuGroups = NULL;
+    }
+
     RTCritSectDelete(&pEpClassFile->CritSect);
 }
 
@@ -1035,6 +1169,11 @@ static DECLCALLBACK(int) pdmacFileEpInitialize(PPDMASYNCCOMPLETIONENDPOINT pEndp
                     /* Simple mode. Every file has its own async I/O manager. */
                     rc = pdmacFileAioMgrCreate(pEpClassFile, &pAioMgr, PDMACEPFILEMGRTYPE_SIMPLE);
                 }
+                else if (pEpClassFile->cCpusPerAioMgr)
+                {
+                    /* Start out on the manager of the opening CPU, the endpoint moves once the I/O comes from elsewhere. */
+                    rc = pdmacFileAioMgrQueryForCpuGroup(pEpClassFile, pdmacFileAioMgrCurCpuGroup(pEpClassFile), &pAioMgr);
+                }
                 else
                 {
                     pAioMgr = pEpClassFile->pAioMgrHead;
@@ -1130,7 +1269,7 @@ static DECLCALLBACK(int) pdmacFileEpClose(PPDMASYNCCOMPLETIONENDPOINT pEndpoint)
     PPDMASYNCCOMPLETIONEPCLASSFILE  pEpClassFile = (PPDMASYNCCOMPLETIONEPCLASSFILE)pEndpoint->pEpClass;
 
     /* Make sure that all tasks finished for this endpoint. */
-    int rc = pdmacFileAioMgrCloseEndpoint(pEpFile->pAioMgr, pEpFile);
+    int rc = pdmacFileAioMgrCloseEndpoint(pEpFile);
     AssertRC(rc);
 
     /*
@@ -34,6 +34,9 @@
 #define PDMACEPFILEMGR_LOAD_UPDATE_PERIOD   1000
 /** Maximum number of requests a manager will handle. */
 #define PDMACEPFILEMGR_REQS_STEP              64
+/** Minimum number of tasks per load update period before an endpoint is
+ * moved to the manager of the CPU group issuing them. */
+#define PDMACEPFILEMGR_MOVE_TASKS_MIN         64
 
 
 /*********************************************************************************************************************************
@@ -180,6 +183,55 @@ static void pdmacFileAioMgrNormalEndpointsSortByLoad(PPDMACEPFILEMGR pAioMgr)
 }
 #endif /* currently unused */
 
+/**
+ * Links the given endpoint into the endpoint list of the manager and associates
+ * the file with the async I/O context.
+ *
+ * @returns VBox status code.
+ * @param   pAioMgr        The I/O manager.
+ * @param   pEndpointNew   The endpoint to add.
+ */
+static int pdmacFileAioMgrNormalEndpointLink(PPDMACEPFILEMGR pAioMgr, PPDMASYNCCOMPLETIONENDPOINTFILE pEndpointNew)
+{
+    pEndpointNew->enmState = PDMASYNCCOMPLETIONENDPOINTFILESTATE_ACTIVE;
+
+    pEndpointNew->AioMgr.pEndpointNext = pAioMgr->pEndpointsHead;
+    pEndpointNew->AioMgr.pEndpointPrev = NULL;
+    if (pAioMgr->pEndpointsHead)
+        pAioMgr->pEndpointsHead->AioMgr.pEndpointPrev = pEndpointNew;
+    pAioMgr->pEndpointsHead = pEndpointNew;
+    pAioMgr->cEndpoints++;
+
+    /* Assign the completion point to this file. */
+    return RTFileAioCtxAssociateWithFile(pAioMgr->hAioCtx, pEndpointNew->hFile);
+}
+
+/**
+ * Adopts the endpoints other managers handed over to this one.
+ *
+ * @returns VBox status code.
+ * @param   pAioMgr    The I/O manager.
+ */
+static int pdmacFileAioMgrNormalAdoptEndpoints(PPDMACEPFILEMGR pAioMgr)
+{
+    int rc = VINF_SUCCESS;
+    PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint = ASMAtomicXchgPtrT(&pAioMgr->pEndpointsHandOverHead, NULL,
+                                                                  PPDMASYNCCOMPLETIONENDPOINTFILE);
+    while (pEndpoint)
+    {
+        PPDMASYNCCOMPLETIONENDPOINTFILE pNext = pEndpoint->AioMgr.pEndpointNext;
+
+        Log(("%s: Adopting endpoint %#p{%s}\n", RTThreadGetName(pAioMgr->Thread), pEndpoint, pEndpoint->Core.pszUri));
+        int rc2 = pdmacFileAioMgrNormalEndpointLink(pAioMgr, pEndpoint);
+        if (RT_FAILURE(rc2) && RT_SUCCESS(rc))
+            rc = rc2;
+
+        pEndpoint = pNext;
+    }
+
+    return rc;
+}
+
 /**
  * Removes an endpoint from the currently assigned manager.
  *
@@ -218,6 +270,105 @@ static bool pdmacFileAioMgrNormalRemoveEndpoint(PPDMASYNCCOMPLETIONENDPOINTFILE
     return true;
 }
 
+/**
+ * Hands an endpoint over to the manager of another CPU group without waiting
+ * for the destination, so two managers swapping endpoints can't deadlock.
+ *
+ * The endpoint must not have any active requests.
+ *
+ * @returns true if the endpoint was handed over, false if a blocking event is
+ *          being posted to this manager (it might close the endpoint), try again
+ *          later.
+ * @param   pAioMgr        The I/O manager currently owning the endpoint.
+ * @param   pEndpoint      The endpoint to hand over.
+ * @param   pAioMgrDst     The destination manager.
+ */
+static bool pdmacFileAioMgrNormalEndpointHandOver(PPDMACEPFILEMGR pAioMgr, PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint,
+                                                  PPDMACEPFILEMGR pAioMgrDst)
+{
+    Assert(!pEndpoint->AioMgr.cRequestsActive);
+    Assert(pAioMgrDst->enmMgrType == PDMACEPFILEMGRTYPE_ASYNC);
+
+    /* Closing the endpoint goes thru this critical section and re-checks pAioMgr after entering it. */
+    if (RT_FAILURE(RTCritSectTryEnter(&pAioMgr->CritSectBlockingEvent)))
+        return false;
+
+    Log(("%s: Handing endpoint %#p{%s} over to {%s}\n", RTThreadGetName(pAioMgr->Thread),
+         pEndpoint, pEndpoint->Core.pszUri, RTThreadGetName(pAioMgrDst->Thread)));
+
+    bool fReqsPending = pdmacFileAioMgrNormalRemoveEndpoint(pEndpoint);
+    Assert(!fReqsPending); NOREF(fReqsPending);
+
+    pEndpoint->enmState          = PDMASYNCCOMPLETIONENDPOINTFILESTATE_MIGRATING;
+    pEndpoint->AioMgr.fMoving    = false;
+    pEndpoint->AioMgr.pAioMgrDst = NULL;
+    ASMAtomicWritePtr(&pEndpoint->pAioMgr, pAioMgrDst);
+
+    PPDMASYNCCOMPLETIONENDPOINTFILE pHead;
+    do
+    {
+        pHead = ASMAtomicReadPtrT(&pAioMgrDst->pEndpointsHandOverHead, PPDMASYNCCOMPLETIONENDPOINTFILE);
+        pEndpoint->AioMgr.pEndpointNext = pHead;
+    } while (!ASMAtomicCmpXchgPtr(&pAioMgrDst->pEndpointsHandOverHead, pEndpoint, pHead));
+
+    RTCritSectLeave(&pAioMgr->CritSectBlockingEvent);
+
+    /* The destination might be waiting for requests to complete, kick it in both cases. */
+    pdmacFileAioMgrWakeup(pAioMgrDst);
+    RTFileAioCtxWakeup(pAioMgrDst->hAioCtx);
+    return true;
+}
+
+#ifndef PDMACEPFILE_AIO_CTX_ASSOCIATION_PERMANENT
+/**
+ * Moves endpoints mostly getting requests from CPUs served by another manager
+ * to that manager, called once per load update period.
+ *
+ * @returns nothing.
+ * @param   pAioMgr    The I/O manager.
+ */
+static void pdmacFileAioMgrNormalMoveToIssuers(PPDMACEPFILEMGR pAioMgr)
+{
+    PPDMASYNCCOMPLETIONEPCLASSFILE pEpClassFile = NULL;
+    PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint = pAioMgr->pEndpointsHead;
+
+    while (pEndpoint)
+    {
+        PPDMASYNCCOMPLETIONENDPOINTFILE pNext = pEndpoint->AioMgr.pEndpointNext;
+        uint32_t const cTasksIssued       = ASMAtomicXchgU32(&pEndpoint->cTasksIssued, 0);
+        uint32_t const cTasksIssuedRemote = ASMAtomicXchgU32(&pEndpoint->cTasksIssuedRemote, 0);
+
+        if (   !pEndpoint->AioMgr.fMoving
+            && pEndpoint->enmState == PDMASYNCCOMPLETIONENDPOINTFILESTATE_ACTIVE
+            && cTasksIssued >= PDMACEPFILEMGR_MOVE_TASKS_MIN
+            && cTasksIssuedRemote > cTasksIssued / 4 * 3)
+        {
+            uint32_t const idxCpuGroup = ASMAtomicReadU32(&pEndpoint->idxCpuGroupIssuer);
+            PPDMACEPFILEMGR pAioMgrDst = NULL;
+
+            pEpClassFile = (PPDMASYNCCOMPLETIONEPCLASSFILE)pEndpoint->Core.pEpClass;
+            if (   idxCpuGroup != pAioMgr->idxCpuGroup
+                && RT_SUCCESS(pdmacFileAioMgrQueryForCpuGroup(pEpClassFile, idxCpuGroup, &pAioMgrDst)))
+            {
+                /*
+                 * Stop queuing new requests and move the endpoint once the active ones completed,
+                 * right now if there are none.
+                 */
+                pEndpoint->AioMgr.fMoving    = true;
+                pEndpoint->AioMgr.pAioMgrDst = pAioMgrDst;
+            }
+        }
+
+        if (   pEndpoint->AioMgr.fMoving
+            && !pEndpoint->AioMgr.cRequestsActive
+            && pEndpoint->AioMgr.pAioMgrDst->enmMgrType == PDMACEPFILEMGRTYPE_ASYNC)
+            pdmacFileAioMgrNormalEndpointHandOver(pAioMgr, pEndpoint, pEndpoint->AioMgr.pAioMgrDst);
+
+        pEndpoint = pNext;
+    }
+}
+#endif /* !PDMACEPFILE_AIO_CTX_ASSOCIATION_PERMANENT */
+
 #if 0 /* currently unused */
 
 static bool pdmacFileAioMgrNormalIsBalancePossible(PPDMACEPFILEMGR pAioMgr)
@@ -1195,18 +1346,8 @@ static int pdmacFileAioMgrNormalProcessBlockingEvent(PPDMACEPFILEMGR pAioMgr)
             PPDMASYNCCOMPLETIONENDPOINTFILE pEndpointNew = ASMAtomicReadPtrT(&pAioMgr->BlockingEventData.AddEndpoint.pEndpoint, PPDMASYNCCOMPLETIONENDPOINTFILE);
             AssertMsg(VALID_PTR(pEndpointNew), ("Adding endpoint event without a endpoint to add\n"));
 
-            pEndpointNew->enmState = PDMASYNCCOMPLETIONENDPOINTFILESTATE_ACTIVE;
-
-            pEndpointNew->AioMgr.pEndpointNext = pAioMgr->pEndpointsHead;
-            pEndpointNew->AioMgr.pEndpointPrev = NULL;
-            if (pAioMgr->pEndpointsHead)
-                pAioMgr->pEndpointsHead->AioMgr.pEndpointPrev = pEndpointNew;
-            pAioMgr->pEndpointsHead = pEndpointNew;
-
-            /* Assign the completion point to this file. */
-            rc = RTFileAioCtxAssociateWithFile(pAioMgr->hAioCtx, pEndpointNew->hFile);
+            rc = pdmacFileAioMgrNormalEndpointLink(pAioMgr, pEndpointNew);
             fNotifyWaiter = true;
-            pAioMgr->cEndpoints++;
             break;
         }
         case PDMACEPFILEAIOMGRBLOCKINGEVENT_REMOVE_ENDPOINT:
@@ -1227,6 +1368,14 @@ static int pdmacFileAioMgrNormalProcessBlockingEvent(PPDMACEPFILEMGR pAioMgr)
             {
                 LogFlowFunc((": Closing endpoint %#p{%s}\n", pEndpointClose, pEndpointClose->Core.pszUri));
 
+                /* Call off a pending move to another CPU group, it would move a closed endpoint. */
+                if (   pEndpointClose->AioMgr.fMoving
+                    && pEndpointClose->AioMgr.pAioMgrDst->enmMgrType == PDMACEPFILEMGRTYPE_ASYNC)
+                {
+                    pEndpointClose->AioMgr.fMoving    = false;
+                    pEndpointClose->AioMgr.pAioMgrDst = NULL;
+                }
+
                 /* Make sure all tasks finished. Process the queues a last time first. */
                 rc = pdmacFileAioMgrNormalQueueReqs(pAioMgr, pEndpointClose);
                 AssertRC(rc);
@@ -1292,6 +1441,8 @@ static int pdmacFileAioMgrNormalCheckEndpoints(PPDMACEPFILEMGR pAioMgr)
 
     while (pEndpoint)
     {
+        PPDMASYNCCOMPLETIONENDPOINTFILE pEndpointNext = pEndpoint->AioMgr.pEndpointNext;
+
         if (!pEndpoint->pFlushReq
             && (pEndpoint->enmState == PDMASYNCCOMPLETIONENDPOINTFILESTATE_ACTIVE)
             && !pEndpoint->AioMgr.fMoving)
@@ -1300,6 +1451,14 @@ static int pdmacFileAioMgrNormalCheckEndpoints(PPDMACEPFILEMGR pAioMgr)
             if (RT_FAILURE(rc))
                 return rc;
         }
+        else if (   pEndpoint->AioMgr.fMoving
+                 && !pEndpoint->AioMgr.cRequestsActive
+                 && pEndpoint->enmState == PDMASYNCCOMPLETIONENDPOINTFILESTATE_ACTIVE
+                 && pEndpoint->AioMgr.pAioMgrDst->enmMgrType == PDMACEPFILEMGRTYPE_ASYNC)
+        {
+            /* A move to another CPU group which couldn't be done earlier. */
+            pdmacFileAioMgrNormalEndpointHandOver(pAioMgr, pEndpoint, pEndpoint->AioMgr.pAioMgrDst);
+        }
         else if (   !pEndpoint->AioMgr.cRequestsActive
                  && pEndpoint->enmState != PDMASYNCCOMPLETIONENDPOINTFILESTATE_ACTIVE)
         {
@@ -1325,7 +1484,7 @@ static int pdmacFileAioMgrNormalCheckEndpoints(PPDMACEPFILEMGR pAioMgr)
             }
         }
 
-        pEndpoint = pEndpoint->AioMgr.pEndpointNext;
+        pEndpoint = pEndpointNext;
     }
 
     return rc;
@@ -1585,6 +1744,13 @@ static void pdmacFileAioMgrNormalReqCompleteRc(PPDMACEPFILEMGR pAioMgr, RTFILEAI
                 else if (RT_UNLIKELY(!pEndpoint->AioMgr.cRequestsActive && pEndpoint->AioMgr.fMoving))
                 {
                     /* If the endpoint is about to be migrated do it now. */
+                    if (pEndpoint->AioMgr.pAioMgrDst->enmMgrType == PDMACEPFILEMGRTYPE_ASYNC)
+                    {
+                        /* Moving to another CPU group, retried by pdmacFileAioMgrNormalCheckEndpoints if it fails. */
+                        pdmacFileAioMgrNormalEndpointHandOver(pAioMgr, pEndpoint, pEndpoint->AioMgr.pAioMgrDst);
+                        return;
+                    }
+
                     bool fReqsPending = pdmacFileAioMgrNormalRemoveEndpoint(pEndpoint);
                     Assert(!fReqsPending); NOREF(fReqsPending);
 
@@ -1618,6 +1784,16 @@ DECLCALLBACK(int) pdmacFileAioMgrNormal(RTTHREAD hThreadSelf, void *pvUser)
     uint64_t        uMillisEnd  = RTTimeMilliTS() + PDMACEPFILEMGR_LOAD_UPDATE_PERIOD;
     NOREF(hThreadSelf);
 
+    /* Managers serving a CPU group stay on its CPUs. */
+    if (RTCpuSetCount(&pAioMgr->AffinitySet))
+    {
+        rc = RTThreadSetAffinity(&pAioMgr->AffinitySet);
+        if (RT_FAILURE(rc))
+            LogRel(("AIOMgr: Failed to bind {%s} to CPU group %u: %Rrc\n",
+                    RTThreadGetName(pAioMgr->Thread), pAioMgr->idxCpuGroup, rc));
+        rc = VINF_SUCCESS;
+    }
+
     while (   pAioMgr->enmState == PDMACEPFILEMGRSTATE_RUNNING
            || pAioMgr->enmState == PDMACEPFILEMGRSTATE_SUSPENDING
            || pAioMgr->enmState == PDMACEPFILEMGRSTATE_GROWING)
@@ -1634,6 +1810,13 @@ DECLCALLBACK(int) pdmacFileAioMgrNormal(RTTHREAD hThreadSelf, void *pvUser)
             ASMAtomicWriteBool(&pAioMgr->fWokenUp, false);
         }
 
+        /* Take the endpoints other managers handed over, a blocking event might be about them. */
+        if (ASMAtomicReadPtrT(&pAioMgr->pEndpointsHandOverHead, PPDMASYNCCOMPLETIONENDPOINTFILE))
+        {
+            rc = pdmacFileAioMgrNormalAdoptEndpoints(pAioMgr);
+            CHECK_RC(pAioMgr, rc);
+        }
+
         /* Check for an external blocking event first. */
         if (pAioMgr->fBlockingEventPending)
         {
@@ -1673,6 +1856,12 @@ DECLCALLBACK(int) pdmacFileAioMgrNormal(RTTHREAD hThreadSelf, void *pvUser)
                 for (uint32_t i = 0; i < cReqsCompleted; i++)
                     pdmacFileAioMgrNormalReqComplete(pAioMgr, apReqs[i]);
 
+                if (ASMAtomicReadPtrT(&pAioMgr->pEndpointsHandOverHead, PPDMASYNCCOMPLETIONENDPOINTFILE))
+                {
+                    rc = pdmacFileAioMgrNormalAdoptEndpoints(pAioMgr);
+                    CHECK_RC(pAioMgr, rc);
+                }
+
                 /* Check for an external blocking event before we go to sleep again. */
                 if (pAioMgr->fBlockingEventPending)
                 {
@@ -1696,6 +1885,12 @@ DECLCALLBACK(int) pdmacFileAioMgrNormal(RTTHREAD hThreadSelf, void *pvUser)
                         pEndpointCurr = pEndpointCurr->AioMgr.pEndpointNext;
                     }
 
+#ifndef PDMACEPFILE_AIO_CTX_ASSOCIATION_PERMANENT
+                    /* Follow the issuing CPUs with per CPU managers. */
+                    if (pAioMgr->idxCpuGroup != UINT32_MAX)
+                        pdmacFileAioMgrNormalMoveToIssuers(pAioMgr);
+#endif
+
                     /* Set new update interval */
                     uMillisEnd = RTTimeMilliTS() + PDMACEPFILEMGR_LOAD_UPDATE_PERIOD;
                 }
@@ -26,7 +26,9 @@
 #define LOG_GROUP LOG_GROUP_PDM_BLK_CACHE
 #include "PDMInternal.h"
 #include <iprt/asm.h>
+#include <iprt/crc.h>
 #include <iprt/mem.h>
+#include <iprt/mp.h>
 #include <iprt/path.h>
 #include <iprt/string.h>
 #include <VBox/log.h>
@@ -71,7 +73,7 @@
 *   Internal Functions                                                                                                           *
 *********************************************************************************************************************************/
 
-static PPDMBLKCACHEENTRY pdmBlkCacheEntryAlloc(PPDMBLKCACHE pBlkCache,
+static PPDMBLKCACHEENTRY pdmBlkCacheEntryAlloc(PPDMBLKCACHE pBlkCache, PPDMBLKCACHESHARD pShard,
                                                uint64_t off, size_t cbData, uint8_t *pbBuffer);
 static bool pdmBlkCacheAddDirtyEntry(PPDMBLKCACHE pBlkCache, PPDMBLKCACHEENTRY pEntry);
 
@@ -99,47 +101,128 @@ DECLINLINE(void) pdmBlkCacheEntryRef(PPDMBLKCACHEENTRY pEntry)
 }
 
 #ifdef VBOX_STRICT
-static void pdmBlkCacheValidate(PPDMBLKCACHEGLOBAL pCache)
+static void pdmBlkCacheValidate(PPDMBLKCACHESHARD pShard)
 {
     /* Amount of cached data should never exceed the maximum amount. */
-    AssertMsg(pCache->cbCached <= pCache->cbMax,
+    AssertMsg(pShard->cbCached <= pShard->cbMax,
               ("Current amount of cached data exceeds maximum\n"));
 
     /* The amount of cached data in the LRU and FRU list should match cbCached */
-    AssertMsg(pCache->LruRecentlyUsedIn.cbCached + pCache->LruFrequentlyUsed.cbCached == pCache->cbCached,
+    AssertMsg(pShard->LruRecentlyUsedIn.cbCached + pShard->LruFrequentlyUsed.cbCached == pShard->cbCached,
               ("Amount of cached data doesn't match\n"));
 
-    AssertMsg(pCache->LruRecentlyUsedOut.cbCached <= pCache->cbRecentlyUsedOutMax,
+    AssertMsg(pShard->LruRecentlyUsedOut.cbCached <= pShard->cbRecentlyUsedOutMax,
               ("Paged out list exceeds maximum\n"));
+    AssertMsg(pShard->LruFrequentlyUsedOut.cbCached <= pShard->cbMax,
+              ("Frequently used paged out list exceeds maximum\n"));
+    AssertMsg(pShard->cbArcTarget <= pShard->cbMax,
+              ("ARC target exceeds maximum\n"));
 }
 #endif
 
+/**
+ * Enters the lock protecting the list of users.
+ *
+ * @param   pCache    The global cache data.
+ */
 DECLINLINE(void) pdmBlkCacheLockEnter(PPDMBLKCACHEGLOBAL pCache)
 {
     RTCritSectEnter(&pCache->CritSect);
+}
+
+/**
+ * Leaves the lock protecting the list of users.
+ *
+ * @param   pCache    The global cache data.
+ */
+DECLINLINE(void) pdmBlkCacheLockLeave(PPDMBLKCACHEGLOBAL pCache)
+{
+    RTCritSectLeave(&pCache->CritSect);
+}
+
+/**
+ * Enters the lock of a shard, counting contention.
+ *
+ * @param   pShard    The shard to lock.
+ */
+DECLINLINE(void) pdmBlkCacheShardLockEnter(PPDMBLKCACHESHARD pShard)
+{
+    STAM_REL_COUNTER_INC(&pShard->StatLockEnter);
+    if (RT_FAILURE(RTCritSectTryEnter(&pShard->CritSect)))
+    {
+        STAM_REL_COUNTER_INC(&pShard->StatLockContended);
+        RTCritSectEnter(&pShard->CritSect);
+    }
 #ifdef VBOX_STRICT
-    pdmBlkCacheValidate(pCache);
+    pdmBlkCacheValidate(pShard);
 #endif
 }
 
-DECLINLINE(void) pdmBlkCacheLockLeave(PPDMBLKCACHEGLOBAL pCache)
+/**
+ * Leaves the lock of a shard.
+ *
+ * @param   pShard    The shard to unlock.
+ */
+DECLINLINE(void) pdmBlkCacheShardLockLeave(PPDMBLKCACHESHARD pShard)
 {
 #ifdef VBOX_STRICT
-    pdmBlkCacheValidate(pCache);
+    pdmBlkCacheValidate(pShard);
 #endif
-    RTCritSectLeave(&pCache->CritSect);
+    RTCritSectLeave(&pShard->CritSect);
 }
 
-DECLINLINE(void) pdmBlkCacheSub(PPDMBLKCACHEGLOBAL pCache, uint32_t cbAmount)
+/**
+ * Enters the user list lock and all shard locks (in that order), for the
+ * rare operations working on the whole cache.
+ *
+ * @param   pCache    The global cache data.
+ */
+static void pdmBlkCacheLockEnterAll(PPDMBLKCACHEGLOBAL pCache)
 {
-    PDMACFILECACHE_IS_CRITSECT_OWNER(pCache);
-    pCache->cbCached -= cbAmount;
+    pdmBlkCacheLockEnter(pCache);
+    for (uint32_t i = 0; i < pCache->cShards; i++)
+        pdmBlkCacheShardLockEnter(&pCache->paShards[i]);
+}
+
+/**
+ * Leaves all locks entered by pdmBlkCacheLockEnterAll.
+ *
+ * @param   pCache    The global cache data.
+ */
+static void pdmBlkCacheLockLeaveAll(PPDMBLKCACHEGLOBAL pCache)
+{
+    for (uint32_t i = pCache->cShards; i-- > 0;)
+        pdmBlkCacheShardLockLeave(&pCache->paShards[i]);
+    pdmBlkCacheLockLeave(pCache);
+}
+
+/**
+ * Returns the shard an entry starting at the given offset goes into.
+ *
+ * @returns Pointer to the shard.
+ * @param   pBlkCache    The endpoint cache.
+ * @param   off          Start offset of the entry.
+ */
+DECLINLINE(PPDMBLKCACHESHARD) pdmBlkCacheShardGet(PPDMBLKCACHE pBlkCache, uint64_t off)
+{
+    PPDMBLKCACHEGLOBAL pCache = pBlkCache->pCache;
+    uint64_t uHash = (off >> PDMBLKCACHE_SHARD_STRIPE_SHIFT) + pBlkCache->uShardSeed;
+    uHash *= UINT64_C(0x9e3779b97f4a7c15); /* Fibonacci hashing. */
+    return &pCache->paShards[(uint32_t)(uHash >> 32) % pCache->cShards];
 }
 
-DECLINLINE(void) pdmBlkCacheAdd(PPDMBLKCACHEGLOBAL pCache, uint32_t cbAmount)
+DECLINLINE(void) pdmBlkCacheSub(PPDMBLKCACHESHARD pShard, uint32_t cbAmount)
 {
-    PDMACFILECACHE_IS_CRITSECT_OWNER(pCache);
-    pCache->cbCached += cbAmount;
+    PDMACFILECACHE_IS_CRITSECT_OWNER(pShard);
+    pShard->cbCached -= cbAmount;
+    ASMAtomicSubU32(&pShard->pCache->cbCached, cbAmount);
+}
+
+DECLINLINE(void) pdmBlkCacheAdd(PPDMBLKCACHESHARD pShard, uint32_t cbAmount)
+{
+    PDMACFILECACHE_IS_CRITSECT_OWNER(pShard);
+    pShard->cbCached += cbAmount;
+    ASMAtomicAddU32(&pShard->pCache->cbCached, cbAmount);
 }
 
 DECLINLINE(void) pdmBlkCacheListAdd(PPDMBLKLRULIST pList, uint32_t cbAmount)
@@ -302,12 +385,30 @@ static void pdmBlkCacheDestroyList(PPDMBLKLRULIST pList)
     }
 }
 
+/**
+ * Returns the maximum size of a ghost list.
+ *
+ * @returns Maximum number of bytes the entries on the ghost list may describe.
+ * @param   pShard           The shard the list belongs to.
+ * @param   pGhostList       The ghost list.
+ */
+DECLINLINE(uint32_t) pdmBlkCacheGhostListMax(PPDMBLKCACHESHARD pShard, PPDMBLKLRULIST pGhostList)
+{
+    if (pShard->pCache->enmPolicy != PDMBLKCACHEPOLICY_ARC)
+        return pShard->cbRecentlyUsedOutMax;
+
+    /* ARC keeps each list together with its ghost list within the cache size. */
+    PPDMBLKLRULIST pList = pGhostList == &pShard->LruRecentlyUsedOut
+                         ? &pShard->LruRecentlyUsedIn : &pShard->LruFrequentlyUsed;
+    return pShard->cbMax - RT_MIN(pList->cbCached, pShard->cbMax);
+}
+
 /**
  * Tries to remove the given amount of bytes from a given list in the cache
  * moving the entries to one of the given ghosts lists
  *
  * @returns Amount of data which could be freed.
- * @param    pCache           Pointer to the global cache data.
+ * @param    pShard           The shard to evict from.
  * @param    cbData           The amount of the data to free.
  * @param    pListSrc         The source list to evict data from.
  * @param    pGhostListDst    Where the ghost list removed entries should be
@@ -322,18 +423,19 @@ static void pdmBlkCacheDestroyList(PPDMBLKLRULIST pList)
  *          may be marked as non evictable if they are used for I/O at the
  *          moment.
  */
-static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData,
+static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHESHARD pShard, size_t cbData,
                                         PPDMBLKLRULIST pListSrc, PPDMBLKLRULIST pGhostListDst,
                                         bool fReuseBuffer, uint8_t **ppbBuffer)
 {
     size_t cbEvicted = 0;
 
-    PDMACFILECACHE_IS_CRITSECT_OWNER(pCache);
+    PDMACFILECACHE_IS_CRITSECT_OWNER(pShard);
 
     AssertMsg(cbData > 0, ("Evicting 0 bytes not possible\n"));
     AssertMsg(   !pGhostListDst
-              || (pGhostListDst == &pCache->LruRecentlyUsedOut),
-              ("Destination list must be NULL or the recently used but paged out list\n"));
+              || (pGhostListDst == &pShard->LruRecentlyUsedOut)
+              || (pGhostListDst == &pShard->LruFrequentlyUsedOut),
+              ("Destination list must be NULL or one of the paged out lists\n"));
 
     if (fReuseBuffer)
     {
@@ -366,7 +468,7 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
 
                 if (fReuseBuffer && pCurr->cbData == cbData)
                 {
-                    STAM_COUNTER_INC(&pCache->StatBuffersReused);
+                    STAM_COUNTER_INC(&pShard->pCache->StatBuffersReused);
                     *ppbBuffer = pCurr->pbData;
                 }
                 else if (pCurr->pbData)
@@ -376,16 +478,17 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
                 cbEvicted += pCurr->cbData;
 
                 pdmBlkCacheEntryRemoveFromList(pCurr);
-                pdmBlkCacheSub(pCache, pCurr->cbData);
+                pdmBlkCacheSub(pShard, pCurr->cbData);
 
                 if (pGhostListDst)
                 {
                     RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
 
                     PPDMBLKCACHEENTRY pGhostEntFree = pGhostListDst->pTail;
+                    uint32_t const    cbGhostMax    = pdmBlkCacheGhostListMax(pShard, pGhostListDst);
 
                     /* We have to remove the last entries from the paged out list. */
-                    while (   pGhostListDst->cbCached + pCurr->cbData > pCache->cbRecentlyUsedOutMax
+                    while (   pGhostListDst->cbCached + pCurr->cbData > cbGhostMax
                            && pGhostEntFree)
                     {
                         PPDMBLKCACHEENTRY pFree = pGhostEntFree;
@@ -399,9 +502,9 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
                         {
                             pdmBlkCacheEntryRemoveFromList(pFree);
 
-                            STAM_PROFILE_ADV_START(&pCache->StatTreeRemove, Cache);
+                            STAM_PROFILE_ADV_START(&pShard->pCache->StatTreeRemove, Cache);
                             RTAvlrU64Remove(pBlkCacheFree->pTree, pFree->Core.Key);
-                            STAM_PROFILE_ADV_STOP(&pCache->StatTreeRemove, Cache);
+                            STAM_PROFILE_ADV_STOP(&pShard->pCache->StatTreeRemove, Cache);
 
                             RTMemFree(pFree);
                         }
@@ -409,12 +512,12 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
                         RTSemRWReleaseWrite(pBlkCacheFree->SemRWEntries);
                     }
 
-                    if (pGhostListDst->cbCached + pCurr->cbData > pCache->cbRecentlyUsedOutMax)
+                    if (pGhostListDst->cbCached + pCurr->cbData > cbGhostMax)
                     {
                         /* Couldn't remove enough entries. Delete */
-                        STAM_PROFILE_ADV_START(&pCache->StatTreeRemove, Cache);
+                        STAM_PROFILE_ADV_START(&pShard->pCache->StatTreeRemove, Cache);
                         RTAvlrU64Remove(pCurr->pBlkCache->pTree, pCurr->Core.Key);
-                        STAM_PROFILE_ADV_STOP(&pCache->StatTreeRemove, Cache);
+                        STAM_PROFILE_ADV_STOP(&pShard->pCache->StatTreeRemove, Cache);
 
                         RTMemFree(pCurr);
                     }
@@ -424,9 +527,9 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
                 else
                 {
                     /* Delete the entry from the AVL tree it is assigned to. */
-                    STAM_PROFILE_ADV_START(&pCache->StatTreeRemove, Cache);
+                    STAM_PROFILE_ADV_START(&pShard->pCache->StatTreeRemove, Cache);
                     RTAvlrU64Remove(pCurr->pBlkCache->pTree, pCurr->Core.Key);
-                    STAM_PROFILE_ADV_STOP(&pCache->StatTreeRemove, Cache);
+                    STAM_PROFILE_ADV_STOP(&pShard->pCache->StatTreeRemove, Cache);
 
                     RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
                     RTMemFree(pCurr);
@@ -441,17 +544,79 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
     return cbEvicted;
 }
 
-static bool pdmBlkCacheReclaim(PPDMBLKCACHEGLOBAL pCache, size_t cbData, bool fReuseBuffer, uint8_t **ppbBuffer)
+/**
+ * Evicts data for the ARC policy.
+ *
+ * Data is taken from the recently used list (T1) while it is above the
+ * adaptive target and from the frequently used list (T2) otherwise, moving
+ * the evicted entries to the respective ghost list (B1 and B2).
+ *
+ * @returns Flag whether enough data could be evicted.
+ * @param   pShard            The shard to evict from.
+ * @param   cbData            The amount of data to evict.
+ * @param   fGhostHitFrequent Flag whether the space is needed for an entry
+ *                            found on the frequently used ghost list.
+ * @param   fReuseBuffer      See pdmBlkCacheEvictPagesFrom.
+ * @param   ppbBuffer         See pdmBlkCacheEvictPagesFrom.
+ */
+static bool pdmBlkCacheReclaimArc(PPDMBLKCACHESHARD pShard, size_t cbData, bool fGhostHitFrequent,
+                                  bool fReuseBuffer, uint8_t **ppbBuffer)
+{
+    PPDMBLKLRULIST pListFirst   = &pShard->LruFrequentlyUsed;
+    PPDMBLKLRULIST pGhostFirst  = &pShard->LruFrequentlyUsedOut;
+    PPDMBLKLRULIST pListSecond  = &pShard->LruRecentlyUsedIn;
+    PPDMBLKLRULIST pGhostSecond = &pShard->LruRecentlyUsedOut;
+    uint32_t const cbT1         = pShard->LruRecentlyUsedIn.cbCached;
+
+    if (   cbT1
+        && (   cbT1 > pShard->cbArcTarget
+            || (fGhostHitFrequent && cbT1 == pShard->cbArcTarget)))
+    {
+        pListFirst   = &pShard->LruRecentlyUsedIn;
+        pGhostFirst  = &pShard->LruRecentlyUsedOut;
+        pListSecond  = &pShard->LruFrequentlyUsed;
+        pGhostSecond = &pShard->LruFrequentlyUsedOut;
+    }
+
+    size_t cbRemoved = pdmBlkCacheEvictPagesFrom(pShard, cbData, pListFirst, pGhostFirst, fReuseBuffer, ppbBuffer);
+    if (cbRemoved < cbData)
+    {
+        Assert(!fReuseBuffer || !*ppbBuffer);
+        if (!cbRemoved)
+            cbRemoved += pdmBlkCacheEvictPagesFrom(pShard, cbData, pListSecond, pGhostSecond, fReuseBuffer, ppbBuffer);
+        else
+            cbRemoved += pdmBlkCacheEvictPagesFrom(pShard, cbData - cbRemoved, pListSecond, pGhostSecond, false, NULL);
+    }
+
+    LogFlowFunc((": removed %u bytes, requested %u\n", cbRemoved, cbData));
+    return (cbRemoved >= cbData);
+}
+
+/**
+ * Makes room for new data in a shard according to the replacement policy.
+ *
+ * @returns Flag whether enough data could be evicted.
+ * @param   pShard            The shard to make room in.
+ * @param   cbData            The amount of data needed.
+ * @param   fGhostHitFrequent Flag whether the space is needed for an entry
+ *                            found on the frequently used ghost list.
+ * @param   fReuseBuffer      See pdmBlkCacheEvictPagesFrom.
+ * @param   ppbBuffer         See pdmBlkCacheEvictPagesFrom.
+ */
+static bool pdmBlkCacheReclaim(PPDMBLKCACHESHARD pShard, size_t cbData, bool fGhostHitFrequent,
+                               bool fReuseBuffer, uint8_t **ppbBuffer)
 {
     size_t cbRemoved = 0;
 
-    if ((pCache->cbCached + cbData) < pCache->cbMax)
+    if ((pShard->cbCached + cbData) < pShard->cbMax)
         return true;
-    else if ((pCache->LruRecentlyUsedIn.cbCached + cbData) > pCache->cbRecentlyUsedInMax)
+    else if (pShard->pCache->enmPolicy == PDMBLKCACHEPOLICY_ARC)
+        return pdmBlkCacheReclaimArc(pShard, cbData, fGhostHitFrequent, fReuseBuffer, ppbBuffer);
+    else if ((pShard->LruRecentlyUsedIn.cbCached + cbData) > pShard->cbRecentlyUsedInMax)
     {
         /* Try to evict as many bytes as possible from A1in */
-        cbRemoved = pdmBlkCacheEvictPagesFrom(pCache, cbData, &pCache->LruRecentlyUsedIn,
-                                                 &pCache->LruRecentlyUsedOut, fReuseBuffer, ppbBuffer);
+        cbRemoved = pdmBlkCacheEvictPagesFrom(pShard, cbData, &pShard->LruRecentlyUsedIn,
+                                                 &pShard->LruRecentlyUsedOut, fReuseBuffer, ppbBuffer);
 
         /*
          * If it was not possible to remove enough entries
@@ -466,17 +631,17 @@ static bool pdmBlkCacheReclaim(PPDMBLKCACHEGLOBAL pCache, size_t cbData, bool fR
              * we don't need to evict that much data
              */
             if (!cbRemoved)
-                cbRemoved += pdmBlkCacheEvictPagesFrom(pCache, cbData, &pCache->LruFrequentlyUsed,
+                cbRemoved += pdmBlkCacheEvictPagesFrom(pShard, cbData, &pShard->LruFrequentlyUsed,
                                                           NULL, fReuseBuffer, ppbBuffer);
             else
-                cbRemoved += pdmBlkCacheEvictPagesFrom(pCache, cbData - cbRemoved, &pCache->LruFrequentlyUsed,
+                cbRemoved += pdmBlkCacheEvictPagesFrom(pShard, cbData - cbRemoved, &pShard->LruFrequentlyUsed,
                                                           NULL, false, NULL);
         }
     }
     else
     {
         /* We have to remove entries from frequently access list. */
-        cbRemoved = pdmBlkCacheEvictPagesFrom(pCache, cbData, &pCache->LruFrequentlyUsed,
+        cbRemoved = pdmBlkCacheEvictPagesFrom(pShard, cbData, &pShard->LruFrequentlyUsed,
                                                  NULL, fReuseBuffer, ppbBuffer);
     }
 
@@ -484,6 +649,106 @@ static bool pdmBlkCacheReclaim(PPDMBLKCACHEGLOBAL pCache, size_t cbData, bool fR
     return (cbRemoved >= cbData);
 }
 
+/**
+ * Updates the lists for an access hitting an entry which contains data.
+ *
+ * @returns nothing.
+ * @param   pEntry            The entry, referenced by the caller.
+ */
+static void pdmBlkCacheEntryHit(PPDMBLKCACHEENTRY pEntry)
+{
+    PPDMBLKCACHESHARD pShard = pEntry->pShard;
+
+    STAM_REL_COUNTER_INC(&pShard->StatPolicyHits);
+
+    /*
+     * Move the entry to the top of the frequently used list.  2Q leaves
+     * entries in the recently used FIFO, ARC promotes them on the second hit.
+     */
+    if (   pEntry->pList == &pShard->LruFrequentlyUsed
+        || (   pShard->pCache->enmPolicy == PDMBLKCACHEPOLICY_ARC
+            && pEntry->pList == &pShard->LruRecentlyUsedIn))
+    {
+        pdmBlkCacheShardLockEnter(pShard);
+        pdmBlkCacheEntryAddToList(&pShard->LruFrequentlyUsed, pEntry);
+        pdmBlkCacheShardLockLeave(pShard);
+    }
+}
+
+/**
+ * Takes an entry off its ghost list and makes room for its data, adapting the
+ * ARC target on the way.
+ *
+ * @returns Flag whether enough data could be evicted for the entry.  The caller
+ *          puts the entry on the frequently used list if so and frees it
+ *          otherwise.
+ * @param   pEntry            The entry on one of the ghost lists, referenced
+ *                            by the caller.
+ * @param   ppbBuffer         Where to store the buffer of an evicted entry
+ *                            with the same size, NULL if none.
+ *
+ * @note The caller must own the shard lock.
+ */
+static bool pdmBlkCacheEntryGhostHit(PPDMBLKCACHEENTRY pEntry, uint8_t **ppbBuffer)
+{
+    PPDMBLKCACHESHARD pShard    = pEntry->pShard;
+    bool const        fFrequent = pEntry->pList == &pShard->LruFrequentlyUsedOut;
+
+    PDMACFILECACHE_IS_CRITSECT_OWNER(pShard);
+    Assert(fFrequent || pEntry->pList == &pShard->LruRecentlyUsedOut);
+
+    if (pShard->pCache->enmPolicy == PDMBLKCACHEPOLICY_ARC)
+    {
+        /*
+         * A hit on a ghost list means the list it was evicted from was too
+         * small, so move the target towards it.  The step is scaled by the
+         * size ratio of the ghost lists like in the original ARC paper.
+         */
+        uint64_t const cbB1 = pShard->LruRecentlyUsedOut.cbCached;
+        uint64_t const cbB2 = pShard->LruFrequentlyUsedOut.cbCached;
+        if (!fFrequent)
+        {
+            uint64_t cbDelta = cbB1 >= cbB2 ? pEntry->cbData : pEntry->cbData * cbB2 / cbB1;
+            pShard->cbArcTarget = (uint32_t)RT_MIN(pShard->cbArcTarget + cbDelta, pShard->cbMax);
+        }
+        else
+        {
+            uint64_t cbDelta = cbB2 >= cbB1 ? pEntry->cbData : pEntry->cbData * cbB1 / cbB2;
+            pShard->cbArcTarget = pShard->cbArcTarget > cbDelta ? pShard->cbArcTarget - (uint32_t)cbDelta : 0;
+        }
+    }
+
+    if (fFrequent)
+        STAM_REL_COUNTER_INC(&pShard->StatPolicyGhostHitsFrequent);
+    else
+        STAM_REL_COUNTER_INC(&pShard->StatPolicyGhostHitsRecent);
+
+    /* Remove it before we remove data, otherwise it may get freed when evicting data. */
+    pdmBlkCacheEntryRemoveFromList(pEntry);
+    return pdmBlkCacheReclaim(pShard, pEntry->cbData, fFrequent, true /* fReuseBuffer */, ppbBuffer);
+}
+
+/**
+ * Checks whether a read continues a sequential scan which shouldn't displace
+ * the cache contents.
+ *
+ * @returns true if data not in the cache should be read without caching it.
+ * @param   pBlkCache         The endpoint cache.
+ * @param   off               Start offset of the read.
+ * @param   cbRead            Size of the read.
+ */
+DECLINLINE(bool) pdmBlkCacheReadIsScan(PPDMBLKCACHE pBlkCache, uint64_t off, size_t cbRead)
+{
+    uint32_t const cbScanThreshold = pBlkCache->pCache->cbScanThreshold;
+    if (!cbScanThreshold)
+        return false;
+
+    uint64_t const cbScanRun = off == pBlkCache->offScanNext ? pBlkCache->cbScanRun + cbRead : cbRead;
+    pBlkCache->cbScanRun   = cbScanRun;
+    pBlkCache->offScanNext = off + cbRead;
+    return cbScanRun >= cbScanThreshold;
+}
+
 DECLINLINE(int) pdmBlkCacheEnqueue(PPDMBLKCACHE pBlkCache, uint64_t off, size_t cbXfer, PPDMBLKCACHEIOXFER pIoXfer)
 {
     int rc = VINF_SUCCESS;
@@ -847,8 +1112,8 @@ static DECLCALLBACK(int) pdmR3BlkCacheSaveExec(PVM pVM, PSSMHANDLE pSSM)
             AssertMsg(pEntry->fFlags & PDMBLKCACHE_ENTRY_IS_DIRTY, ("Entry is not dirty\n"));
             AssertMsg(!(pEntry->fFlags & ~PDMBLKCACHE_ENTRY_IS_DIRTY), ("Invalid flags set\n"));
             AssertMsg(!pEntry->pWaitingHead && !pEntry->pWaitingTail, ("There are waiting requests\n"));
-            AssertMsg(   pEntry->pList == &pBlkCacheGlobal->LruRecentlyUsedIn
-                      || pEntry->pList == &pBlkCacheGlobal->LruFrequentlyUsed,
+            AssertMsg(   pEntry->pList == &pEntry->pShard->LruRecentlyUsedIn
+                      || pEntry->pList == &pEntry->pShard->LruFrequentlyUsed,
                       ("Invalid list\n"));
             AssertMsg(pEntry->cbData == pEntry->Core.KeyLast - pEntry->Core.Key + 1,
                       ("Size and range do not match\n"));
@@ -939,7 +1204,8 @@ static DECLCALLBACK(int) pdmR3BlkCacheLoadExec(PVM pVM, PSSMHANDLE pSSM, uint32_
             SSMR3GetU64(pSSM, &off);
             SSMR3GetU32(pSSM, &cbEntry);
 
-            pEntry = pdmBlkCacheEntryAlloc(pBlkCache, off, cbEntry, NULL);
+            PPDMBLKCACHESHARD pShard = pdmBlkCacheShardGet(pBlkCache, off);
+            pEntry = pdmBlkCacheEntryAlloc(pBlkCache, pShard, off, cbEntry, NULL);
             if (!pEntry)
             {
                 rc = VERR_NO_MEMORY;
@@ -960,8 +1226,10 @@ static DECLCALLBACK(int) pdmR3BlkCacheLoadExec(PVM pVM, PSSMHANDLE pSSM, uint32_
 
             /* Add to the dirty list. */
             pdmBlkCacheAddDirtyEntry(pBlkCache, pEntry);
-            pdmBlkCacheEntryAddToList(&pBlkCacheGlobal->LruRecentlyUsedIn, pEntry);
-            pdmBlkCacheAdd(pBlkCacheGlobal, cbEntry);
+            pdmBlkCacheShardLockEnter(pShard);
+            pdmBlkCacheEntryAddToList(&pShard->LruRecentlyUsedIn, pEntry);
+            pdmBlkCacheAdd(pShard, cbEntry);
+            pdmBlkCacheShardLockLeave(pShard);
             pdmBlkCacheEntryRelease(pEntry);
             cEntries--;
         }
@@ -989,6 +1257,114 @@ static DECLCALLBACK(int) pdmR3BlkCacheLoadExec(PVM pVM, PSSMHANDLE pSSM, uint32_
     return rc;
 }
 
+/**
+ * Returns the name of a replacement policy, as used for the configuration
+ * and the statistics.
+ *
+ * @returns Policy name.
+ * @param   enmPolicy    The policy.
+ */
+static const char *pdmR3BlkCachePolicyName(PDMBLKCACHEPOLICY enmPolicy)
+{
+    switch (enmPolicy)
+    {
+        case PDMBLKCACHEPOLICY_2Q:  return "2Q";
+        case PDMBLKCACHEPOLICY_ARC: return "ARC";
+        default:                    return "Invalid";
+    }
+}
+
+/**
+ * Allocates and initializes the cache shards, splitting the cache size
+ * evenly between them.
+ *
+ * @returns VBox status code.
+ * @param   pVM          The cross context VM structure.
+ * @param   pCache       The global cache data, cbMax and cShards set.
+ */
+static int pdmR3BlkCacheShardsInit(PVM pVM, PPDMBLKCACHEGLOBAL pCache)
+{
+    const char *pszPolicy = pdmR3BlkCachePolicyName(pCache->enmPolicy);
+
+    pCache->paShards = (PPDMBLKCACHESHARD)RTMemAllocZ(pCache->cShards * sizeof(PDMBLKCACHESHARD));
+    if (!pCache->paShards)
+        return VERR_NO_MEMORY;
+
+    uint32_t const cbShard = pCache->cbMax / pCache->cShards;
+    for (uint32_t i = 0; i < pCache->cShards; i++)
+    {
+        PPDMBLKCACHESHARD pShard = &pCache->paShards[i];
+
+        pShard->pCache               = pCache;
+        pShard->idxShard             = i;
+        pShard->cbMax                = cbShard;
+        pShard->cbCached             = 0;
+        pShard->cbRecentlyUsedInMax  = (cbShard / 100) * 25; /* 25% of the buffer size */
+        pShard->cbRecentlyUsedOutMax = (cbShard / 100) * 50; /* 50% of the buffer size */
+        pShard->cbArcTarget          = 0;
+        if (pCache->enmPolicy == PDMBLKCACHEPOLICY_ARC)
+            pShard->cbRecentlyUsedOutMax = cbShard; /* Upper bound only, see pdmBlkCacheGhostListMax. */
+
+        int rc = RTCritSectInit(&pShard->CritSect);
+        if (RT_FAILURE(rc))
+        {
+            while (i-- > 0)
+                RTCritSectDelete(&pCache->paShards[i].CritSect);
+            RTMemFree(pCache->paShards);
+            pCache->paShards = NULL;
+            return rc;
+        }
+
+        STAMR3RegisterF(pVM, &pShard->cbCached, STAMTYPE_U32, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,
+                        "Currently used cache", "/PDM/BlkCache/Shard%u/cbCached", i);
+        STAMR3RegisterF(pVM, &pShard->LruRecentlyUsedIn.cbCached, STAMTYPE_U32, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,
+                        "Number of bytes cached in MRU list", "/PDM/BlkCache/Shard%u/cbCachedMruIn", i);
+        STAMR3RegisterF(pVM, &pShard->LruRecentlyUsedOut.cbCached, STAMTYPE_U32, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,
+                        "Number of bytes cached in FRU list", "/PDM/BlkCache/Shard%u/cbCachedMruOut", i);
+        STAMR3RegisterF(pVM, &pShard->LruFrequentlyUsed.cbCached, STAMTYPE_U32, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,
+                        "Number of bytes cached in FRU ghost list", "/PDM/BlkCache/Shard%u/cbCachedFru", i);
+        STAMR3RegisterF(pVM, &pShard->StatLockEnter, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                        "Number of times the shard lock was entered", "/PDM/BlkCache/Shard%u/LockEnter", i);
+        STAMR3RegisterF(pVM, &pShard->StatLockContended, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                        "Number of times the shard lock was busy", "/PDM/BlkCache/Shard%u/LockContended", i);
+        STAMR3RegisterF(pVM, &pShard->StatPolicyHits, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                        "Number of accesses finding data in the cache", "/PDM/BlkCache/Shard%u/%s/Hits", i, pszPolicy);
+        STAMR3RegisterF(pVM, &pShard->StatPolicyMisses, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                        "Number of entries created for data not in the cache", "/PDM/BlkCache/Shard%u/%s/Misses", i, pszPolicy);
+        STAMR3RegisterF(pVM, &pShard->StatPolicyGhostHitsRecent, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                        "Number of hits on the recently used ghost list", "/PDM/BlkCache/Shard%u/%s/GhostHitsRecent", i, pszPolicy);
+        if (pCache->enmPolicy == PDMBLKCACHEPOLICY_ARC)
+        {
+            STAMR3RegisterF(pVM, &pShard->StatPolicyGhostHitsFrequent, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                            "Number of hits on the frequently used ghost list", "/PDM/BlkCache/Shard%u/%s/GhostHitsFrequent", i, pszPolicy);
+            STAMR3RegisterF(pVM, &pShard->LruFrequentlyUsedOut.cbCached, STAMTYPE_U32, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,
+                            "Number of bytes in the frequently used ghost list", "/PDM/BlkCache/Shard%u/%s/cbCachedFruOut", i, pszPolicy);
+            STAMR3RegisterF(pVM, &pShard->cbArcTarget, STAMTYPE_U32, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,
+                            "Adaptive target size of the recently used list", "/PDM/BlkCache/Shard%u/%s/cbTarget", i, pszPolicy);
+        }
+    }
+
+    LogFlowFunc(("cShards=%u cbShard=%u cbRecentlyUsedInMax=%u cbRecentlyUsedOutMax=%u\n", pCache->cShards, cbShard,
+                 pCache->paShards[0].cbRecentlyUsedInMax, pCache->paShards[0].cbRecentlyUsedOutMax));
+    return VINF_SUCCESS;
+}
+
+/**
+ * Destroys the shard locks and frees the shard array.
+ *
+ * @param   pCache       The global cache data.
+ */
+static void pdmR3BlkCacheShardsTerm(PPDMBLKCACHEGLOBAL pCache)
+{
+    if (pCache->paShards)
+    {
+        for (uint32_t i = 0; i < pCache->cShards; i++)
+            RTCritSectDelete(&pCache->paShards[i].CritSect);
+        RTMemFree(pCache->paShards);
+        pCache->paShards = NULL;
+    }
+}
+
 int pdmR3BlkCacheInit(PVM pVM)
 {
     int  rc   = VINF_SUCCESS;
@@ -1012,29 +1388,38 @@ int pdmR3BlkCacheInit(PVM pVM)
     pBlkCacheGlobal->cbCached  = 0;
     pBlkCacheGlobal->fCommitInProgress = false;
 
-    /* Initialize members */
-    pBlkCacheGlobal->LruRecentlyUsedIn.pHead    = NULL;
-    pBlkCacheGlobal->LruRecentlyUsedIn.pTail    = NULL;
-    pBlkCacheGlobal->LruRecentlyUsedIn.cbCached = 0;
-
-    pBlkCacheGlobal->LruRecentlyUsedOut.pHead    = NULL;
-    pBlkCacheGlobal->LruRecentlyUsedOut.pTail    = NULL;
-    pBlkCacheGlobal->LruRecentlyUsedOut.cbCached = 0;
-
-    pBlkCacheGlobal->LruFrequentlyUsed.pHead    = NULL;
-    pBlkCacheGlobal->LruFrequentlyUsed.pTail    = NULL;
-    pBlkCacheGlobal->LruFrequentlyUsed.cbCached = 0;
-
     do
     {
         rc = CFGMR3QueryU32Def(pCfgBlkCache, "CacheSize", &pBlkCacheGlobal->cbMax, 5 * _1M);
         AssertLogRelRCBreak(rc);
         LogFlowFunc(("Maximum number of bytes cached %u\n", pBlkCacheGlobal->cbMax));
 
-        pBlkCacheGlobal->cbRecentlyUsedInMax  = (pBlkCacheGlobal->cbMax / 100) * 25; /* 25% of the buffer size */
-        pBlkCacheGlobal->cbRecentlyUsedOutMax = (pBlkCacheGlobal->cbMax / 100) * 50; /* 50% of the buffer size */
-        LogFlowFunc(("cbRecentlyUsedInMax=%u cbRecentlyUsedOutMax=%u\n",
-                     pBlkCacheGlobal->cbRecentlyUsedInMax, pBlkCacheGlobal->cbRecentlyUsedOutMax));
+        /* Number of independently locked shards, defaults to one per host CPU. */
+        rc = CFGMR3QueryU32Def(pCfgBlkCache, "Shards", &pBlkCacheGlobal->cShards,
+                               RT_MIN(RTMpGetCount(), PDMBLKCACHE_SHARDS_MAX));
+        AssertLogRelRCBreak(rc);
+        pBlkCacheGlobal->cShards = RT_MIN(pBlkCacheGlobal->cShards, pBlkCacheGlobal->cbMax / PDMBLKCACHE_SHARD_MIN_SIZE);
+        pBlkCacheGlobal->cShards = RT_MAX(RT_MIN(pBlkCacheGlobal->cShards, PDMBLKCACHE_SHARDS_MAX), 1);
+
+        /* The replacement policy, "2Q" (default) or "ARC". */
+        char szPolicy[16];
+        rc = CFGMR3QueryStringDef(pCfgBlkCache, "Policy", szPolicy, sizeof(szPolicy), "2Q");
+        AssertLogRelRCBreak(rc);
+        if (!RTStrICmp(szPolicy, "2Q"))
+            pBlkCacheGlobal->enmPolicy = PDMBLKCACHEPOLICY_2Q;
+        else if (!RTStrICmp(szPolicy, "ARC"))
+            pBlkCacheGlobal->enmPolicy = PDMBLKCACHEPOLICY_ARC;
+        else
+        {
+            LogRel(("BlkCache: Unknown replacement policy \"%s\"\n", szPolicy));
+            rc = VERR_INVALID_PARAMETER;
+            break;
+        }
+
+        /* Sequential reads longer than this neither create entries nor fetch ghost
+           entries back into the cache, 0 disables the scan detection. */
+        rc = CFGMR3QueryU32Def(pCfgBlkCache, "ScanThreshold", &pBlkCacheGlobal->cbScanThreshold, 0);
+        AssertLogRelRCBreak(rc);
 
         /** @todo r=aeichner: Experiment to find optimal default values */
         rc = CFGMR3QueryU32Def(pCfgBlkCache, "CacheCommitIntervalMs", &pBlkCacheGlobal->u32CommitTimeoutMs, 10000 /* 10sec */);
@@ -1050,27 +1435,11 @@ int pdmR3BlkCacheInit(PVM pVM)
                        "/PDM/BlkCache/cbMax",
                        STAMUNIT_BYTES,
                        "Maximum cache size");
-        STAMR3Register(pVM, &pBlkCacheGlobal->cbCached,
+        STAMR3Register(pVM, (void *)&pBlkCacheGlobal->cbCached,
                        STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
                        "/PDM/BlkCache/cbCached",
                        STAMUNIT_BYTES,
                        "Currently used cache");
-        STAMR3Register(pVM, &pBlkCacheGlobal->LruRecentlyUsedIn.cbCached,
-                       STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
-                       "/PDM/BlkCache/cbCachedMruIn",
-                       STAMUNIT_BYTES,
-                       "Number of bytes cached in MRU list");
-        STAMR3Register(pVM, &pBlkCacheGlobal->LruRecentlyUsedOut.cbCached,
-                       STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
-                       "/PDM/BlkCache/cbCachedMruOut",
-                       STAMUNIT_BYTES,
-                       "Number of bytes cached in FRU list");
-        STAMR3Register(pVM, &pBlkCacheGlobal->LruFrequentlyUsed.cbCached,
-                       STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
-                       "/PDM/BlkCache/cbCachedFru",
-                       STAMUNIT_BYTES,
-                       "Number of bytes cached in FRU ghost list");
-
 #ifdef VBOX_WITH_STATISTICS
         STAMR3Register(pVM, &pBlkCacheGlobal->cHits,
                        STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS,
@@ -1112,6 +1481,12 @@ int pdmR3BlkCacheInit(PVM pVM)
 
         /* Initialize the critical section */
         rc = RTCritSectInit(&pBlkCacheGlobal->CritSect);
+        if (RT_SUCCESS(rc))
+        {
+            rc = pdmR3BlkCacheShardsInit(pVM, pBlkCacheGlobal);
+            if (RT_FAILURE(rc))
+                RTCritSectDelete(&pBlkCacheGlobal->CritSect);
+        }
     }
 
     if (RT_SUCCESS(rc))
@@ -1133,14 +1508,18 @@ int pdmR3BlkCacheInit(PVM pVM)
                                        NULL, pdmR3BlkCacheLoadExec, NULL);
             if (RT_SUCCESS(rc))
             {
-                LogRel(("BlkCache: Cache successfully initialized. Cache size is %u bytes\n", pBlkCacheGlobal->cbMax));
+                LogRel(("BlkCache: Cache successfully initialized. Cache size is %u bytes in %u shards\n",
+                        pBlkCacheGlobal->cbMax, pBlkCacheGlobal->cShards));
                 LogRel(("BlkCache: Cache commit interval is %u ms\n", pBlkCacheGlobal->u32CommitTimeoutMs));
                 LogRel(("BlkCache: Cache commit threshold is %u bytes\n", pBlkCacheGlobal->cbCommitDirtyThreshold));
+                LogRel(("BlkCache: Replacement policy is %s, scan threshold is %u bytes\n",
+                        pdmR3BlkCachePolicyName(pBlkCacheGlobal->enmPolicy), pBlkCacheGlobal->cbScanThreshold));
                 pUVM->pdm.s.pBlkCacheGlobal = pBlkCacheGlobal;
                 return VINF_SUCCESS;
             }
         }
 
+        pdmR3BlkCacheShardsTerm(pBlkCacheGlobal);
         RTCritSectDelete(&pBlkCacheGlobal->CritSect);
     }
 
@@ -1158,15 +1537,21 @@ void pdmR3BlkCacheTerm(PVM pVM)
     if (pBlkCacheGlobal)
     {
         /* Make sure no one else uses the cache now */
-        pdmBlkCacheLockEnter(pBlkCacheGlobal);
+        pdmBlkCacheLockEnterAll(pBlkCacheGlobal);
 
         /* Cleanup deleting all cache entries waiting for in progress entries to finish. */
-        pdmBlkCacheDestroyList(&pBlkCacheGlobal->LruRecentlyUsedIn);
-        pdmBlkCacheDestroyList(&pBlkCacheGlobal->LruRecentlyUsedOut);
-        pdmBlkCacheDestroyList(&pBlkCacheGlobal->LruFrequentlyUsed);
+        for (uint32_t i = 0; i < pBlkCacheGlobal->cShards; i++)
+        {
+            PPDMBLKCACHESHARD pShard = &pBlkCacheGlobal->paShards[i];
+            pdmBlkCacheDestroyList(&pShard->LruRecentlyUsedIn);
+            pdmBlkCacheDestroyList(&pShard->LruRecentlyUsedOut);
+            pdmBlkCacheDestroyList(&pShard->LruFrequentlyUsed);
+            pdmBlkCacheDestroyList(&pShard->LruFrequentlyUsedOut);
+        }
 
-        pdmBlkCacheLockLeave(pBlkCacheGlobal);
+        pdmBlkCacheLockLeaveAll(pBlkCacheGlobal);
 
+        pdmR3BlkCacheShardsTerm(pBlkCacheGlobal);
         RTCritSectDelete(&pBlkCacheGlobal->CritSect);
         RTMemFree(pBlkCacheGlobal);
         pVM->pUVM->pdm.s.pBlkCacheGlobal = NULL;
@@ -1218,6 +1603,7 @@ static int pdmR3BlkCacheRetain(PVM pVM, PPPDMBLKCACHE ppBlkCache, const char *pc
         {
             pBlkCache->fSuspended = false;
             pBlkCache->pCache = pBlkCacheGlobal;
+            pBlkCache->uShardSeed = RTCrc32(pcszId, strlen(pcszId));
             RTListInit(&pBlkCache->ListDirtyNotCommitted);
 
             rc = RTSpinlockCreate(&pBlkCache->LockList, RTSPINLOCK_FLAGS_INTERRUPT_UNSAFE, "pdmR3BlkCacheRetain");
@@ -1235,6 +1621,10 @@ static int pdmR3BlkCacheRetain(PVM pVM, PPPDMBLKCACHE ppBlkCache, const char *pc
                                         STAMUNIT_COUNT, "Number of deferred writes",
                                         "/PDM/BlkCache/%s/Cache/DeferredWrites", pBlkCache->pszId);
 #endif
+                        STAMR3RegisterF(pBlkCacheGlobal->pVM, &pBlkCache->StatScanBypassed,
+                                        STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS,
+                                        STAMUNIT_BYTES, "Number of bytes read past the cache as part of a scan",
+                                        "/PDM/BlkCache/%s/Cache/ScanBypassed", pBlkCache->pszId);
 
                         /* Add to the list of users. */
                         pBlkCacheGlobal->cRefs++;
@@ -1387,12 +1777,12 @@ static DECLCALLBACK(int) pdmBlkCacheEntryDestroy(PAVLRU64NODECORE pNode, void *p
         /* Leave the locks to let the I/O thread make progress but reference the entry to prevent eviction. */
         pdmBlkCacheEntryRef(pEntry);
         RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
-        pdmBlkCacheLockLeave(pCache);
+        pdmBlkCacheLockLeaveAll(pCache);
 
         RTThreadSleep(250);
 
         /* Re-enter all locks */
-        pdmBlkCacheLockEnter(pCache);
+        pdmBlkCacheLockEnterAll(pCache);
         RTSemRWRequestWrite(pBlkCache->SemRWEntries, RT_INDEFINITE_WAIT);
         pdmBlkCacheEntryRelease(pEntry);
     }
@@ -1400,13 +1790,14 @@ static DECLCALLBACK(int) pdmBlkCacheEntryDestroy(PAVLRU64NODECORE pNode, void *p
     AssertMsg(!(pEntry->fFlags & PDMBLKCACHE_ENTRY_IO_IN_PROGRESS),
                 ("Entry is dirty and/or still in progress fFlags=%#x\n", pEntry->fFlags));
 
-    bool fUpdateCache =    pEntry->pList == &pCache->LruFrequentlyUsed
-                        || pEntry->pList == &pCache->LruRecentlyUsedIn;
+    PPDMBLKCACHESHARD pShard = pEntry->pShard;
+    bool fUpdateCache =    pEntry->pList == &pShard->LruFrequentlyUsed
+                        || pEntry->pList == &pShard->LruRecentlyUsedIn;
 
     pdmBlkCacheEntryRemoveFromList(pEntry);
 
     if (fUpdateCache)
-        pdmBlkCacheSub(pCache, pEntry->cbData);
+        pdmBlkCacheSub(pShard, pEntry->cbData);
 
     RTMemPageFree(pEntry->pbData, pEntry->cbData);
     RTMemFree(pEntry);
@@ -1433,7 +1824,7 @@ VMMR3DECL(void) PDMR3BlkCacheRelease(PPDMBLKCACHE pBlkCache)
         pdmBlkCacheCommit(pBlkCache);
 
     /* Make sure nobody is accessing the cache while we delete the tree. */
-    pdmBlkCacheLockEnter(pCache);
+    pdmBlkCacheLockEnterAll(pCache);
     RTSemRWRequestWrite(pBlkCache->SemRWEntries, RT_INDEFINITE_WAIT);
     RTAvlrU64Destroy(pBlkCache->pTree, pdmBlkCacheEntryDestroy, pCache);
     RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
@@ -1443,13 +1834,14 @@ VMMR3DECL(void) PDMR3BlkCacheRelease(PPDMBLKCACHE pBlkCache)
     pCache->cRefs--;
     RTListNodeRemove(&pBlkCache->NodeCacheUser);
 
-    pdmBlkCacheLockLeave(pCache);
+    pdmBlkCacheLockLeaveAll(pCache);
 
     RTSemRWDestroy(pBlkCache->SemRWEntries);
 
 #ifdef VBOX_WITH_STATISTICS
     STAMR3DeregisterF(pCache->pVM->pUVM, "/PDM/BlkCache/%s/Cache/DeferredWrites", pBlkCache->pszId);
 #endif
+    STAMR3DeregisterF(pCache->pVM->pUVM, "/PDM/BlkCache/%s/Cache/ScanBypassed", pBlkCache->pszId);
 
     RTStrFree(pBlkCache->pszId);
     RTMemFree(pBlkCache);
@@ -1602,13 +1994,15 @@ static void pdmBlkCacheInsertEntry(PPDMBLKCACHE pBlkCache, PPDMBLKCACHEENTRY pEn
  *
  * @returns Pointer to the new cache entry or NULL if out of memory.
  * @param   pBlkCache The cache the entry belongs to.
+ * @param   pShard    The shard the entry goes into, see pdmBlkCacheShardGet.
  * @param   off       Start offset.
  * @param   cbData    Size of the cache entry.
  * @param   pbBuffer  Pointer to the buffer to use.
  *                    NULL if a new buffer should be allocated.
  *                    The buffer needs to have the same size of the entry.
  */
-static PPDMBLKCACHEENTRY pdmBlkCacheEntryAlloc(PPDMBLKCACHE pBlkCache, uint64_t off, size_t cbData, uint8_t *pbBuffer)
+static PPDMBLKCACHEENTRY pdmBlkCacheEntryAlloc(PPDMBLKCACHE pBlkCache, PPDMBLKCACHESHARD pShard,
+                                               uint64_t off, size_t cbData, uint8_t *pbBuffer)
 {
     AssertReturn(cbData <= UINT32_MAX, NULL);
     PPDMBLKCACHEENTRY pEntryNew = (PPDMBLKCACHEENTRY)RTMemAllocZ(sizeof(PDMBLKCACHEENTRY));
@@ -1622,6 +2016,7 @@ static PPDMBLKCACHEENTRY pdmBlkCacheEntryAlloc(PPDMBLKCACHE pBlkCache, uint64_t
     pEntryNew->fFlags        = 0;
     pEntryNew->cRefs         = 1; /* We are using it now. */
     pEntryNew->pList         = NULL;
+    pEntryNew->pShard        = pShard;
     pEntryNew->cbData        = (uint32_t)cbData;
     pEntryNew->pWaitingHead  = NULL;
     pEntryNew->pWaitingTail  = NULL;
@@ -1815,22 +2210,23 @@ static PPDMBLKCACHEENTRY pdmBlkCacheEntryCreate(PPDMBLKCACHE pBlkCache, uint64_t
     *pcbData = pdmBlkCacheEntryBoundariesCalc(pBlkCache, off, (uint32_t)cb, &cbEntry);
     AssertReturn(cb <= UINT32_MAX, NULL);
 
-    PPDMBLKCACHEGLOBAL pCache = pBlkCache->pCache;
-    pdmBlkCacheLockEnter(pCache);
+    PPDMBLKCACHESHARD pShard = pdmBlkCacheShardGet(pBlkCache, off);
+    pdmBlkCacheShardLockEnter(pShard);
 
     PPDMBLKCACHEENTRY pEntryNew = NULL;
     uint8_t          *pbBuffer  = NULL;
-    bool fEnough = pdmBlkCacheReclaim(pCache, cbEntry, true, &pbBuffer);
+    bool fEnough = pdmBlkCacheReclaim(pShard, cbEntry, false /* fGhostHitFrequent */, true /* fReuseBuffer */, &pbBuffer);
     if (fEnough)
     {
         LogFlow(("Evicted enough bytes (%u requested). Creating new cache entry\n", cbEntry));
+        STAM_REL_COUNTER_INC(&pShard->StatPolicyMisses);
 
-        pEntryNew = pdmBlkCacheEntryAlloc(pBlkCache, off, cbEntry, pbBuffer);
+        pEntryNew = pdmBlkCacheEntryAlloc(pBlkCache, pShard, off, cbEntry, pbBuffer);
         if (RT_LIKELY(pEntryNew))
         {
-            pdmBlkCacheEntryAddToList(&pCache->LruRecentlyUsedIn, pEntryNew);
-            pdmBlkCacheAdd(pCache, cbEntry);
-            pdmBlkCacheLockLeave(pCache);
+            pdmBlkCacheEntryAddToList(&pShard->LruRecentlyUsedIn, pEntryNew);
+            pdmBlkCacheAdd(pShard, cbEntry);
+            pdmBlkCacheShardLockLeave(pShard);
 
             pdmBlkCacheInsertEntry(pBlkCache, pEntryNew);
 
@@ -1839,10 +2235,10 @@ static PPDMBLKCACHEENTRY pdmBlkCacheEntryCreate(PPDMBLKCACHE pBlkCache, uint64_t
                       ("Overflow in calculation off=%llu\n", off));
         }
         else
-            pdmBlkCacheLockLeave(pCache);
+            pdmBlkCacheShardLockLeave(pShard);
     }
     else
-        pdmBlkCacheLockLeave(pCache);
+        pdmBlkCacheShardLockLeave(pShard);
 
     return pEntryNew;
 }
@@ -1941,6 +2337,9 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
     /* Increment data transfer counter to keep the request valid while we access it. */
     ASMAtomicIncU32(&pReq->cXfersPending);
 
+    /* Data of large sequential reads is unlikely to be read again soon, don't let it evict everything else. */
+    bool const fScan = pdmBlkCacheReadIsScan(pBlkCache, off, cbRead);
+
     while (cbRead)
     {
         size_t cbToRead;
@@ -1984,8 +2383,8 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
             STAM_COUNTER_ADD(&pCache->StatRead, cbToRead);
 
             /* Ghost lists contain no data. */
-            if (   (pEntry->pList == &pCache->LruRecentlyUsedIn)
-                || (pEntry->pList == &pCache->LruFrequentlyUsed))
+            if (   (pEntry->pList == &pEntry->pShard->LruRecentlyUsedIn)
+                || (pEntry->pList == &pEntry->pShard->LruFrequentlyUsed))
             {
                 if (pdmBlkCacheEntryFlagIsSetClearAcquireLock(pBlkCache, pEntry,
                                                               PDMBLKCACHE_ENTRY_IO_IN_PROGRESS,
@@ -2004,31 +2403,38 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
                 }
 
                 /* Move this entry to the top position */
-                if (pEntry->pList == &pCache->LruFrequentlyUsed)
-                {
-                    pdmBlkCacheLockEnter(pCache);
-                    pdmBlkCacheEntryAddToList(&pCache->LruFrequentlyUsed, pEntry);
-                    pdmBlkCacheLockLeave(pCache);
-                }
+                pdmBlkCacheEntryHit(pEntry);
                 /* Release the entry */
                 pdmBlkCacheEntryRelease(pEntry);
             }
+            else if (fScan)
+            {
+                /*
+                 * Don't fetch ghost entries back during a scan, making room for
+                 * them would evict data which is more likely to be used again.
+                 * The ghost entry holds no data, so read around it.
+                 */
+                pdmBlkCacheEntryRelease(pEntry);
+                STAM_REL_COUNTER_ADD(&pBlkCache->StatScanBypassed, cbToRead);
+                pdmBlkCacheRequestPassthrough(pBlkCache, pReq,
+                                              &SgBuf, off, cbToRead,
+                                              PDMBLKCACHEXFERDIR_READ);
+            }
             else
             {
                 uint8_t *pbBuffer = NULL;
 
                 LogFlow(("Fetching data for ghost entry %#p from file\n", pEntry));
 
-                pdmBlkCacheLockEnter(pCache);
-                pdmBlkCacheEntryRemoveFromList(pEntry); /* Remove it before we remove data, otherwise it may get freed when evicting data. */
-                bool fEnough = pdmBlkCacheReclaim(pCache, pEntry->cbData, true, &pbBuffer);
+                pdmBlkCacheShardLockEnter(pEntry->pShard);
+                bool fEnough = pdmBlkCacheEntryGhostHit(pEntry, &pbBuffer);
 
                 /* Move the entry to Am and fetch it to the cache. */
                 if (fEnough)
                 {
-                    pdmBlkCacheEntryAddToList(&pCache->LruFrequentlyUsed, pEntry);
-                    pdmBlkCacheAdd(pCache, pEntry->cbData);
-                    pdmBlkCacheLockLeave(pCache);
+                    pdmBlkCacheEntryAddToList(&pEntry->pShard->LruFrequentlyUsed, pEntry);
+                    pdmBlkCacheAdd(pEntry->pShard, pEntry->cbData);
+                    pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                     if (pbBuffer)
                         pEntry->pbData = pbBuffer;
@@ -2051,7 +2457,7 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
                     STAM_PROFILE_ADV_STOP(&pCache->StatTreeRemove, Cache);
                     RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
 
-                    pdmBlkCacheLockLeave(pCache);
+                    pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                     RTMemFree(pEntry);
 
@@ -2061,9 +2467,9 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
                 }
             }
         }
-        else
-        {
 #ifdef VBOX_WITH_IO_READ_CACHE
+        else if (!fScan)
+        {
             /* No entry found for this offset. Create a new entry and fetch the data to the cache. */
             PPDMBLKCACHEENTRY pEntryNew = pdmBlkCacheEntryCreate(pBlkCache,
                                                                  off, cbRead,
@@ -2098,7 +2504,10 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
                                               &SgBuf, off, cbToRead,
                                               PDMBLKCACHEXFERDIR_READ);
             }
-#else
+        }
+#endif
+        else
+        {
             /* Clip read size if necessary. */
             PPDMBLKCACHEENTRY pEntryAbove;
             pdmBlkCacheGetCacheBestFitEntryByOffset(pBlkCache, off, &pEntryAbove);
@@ -2116,10 +2525,15 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
                 cbToRead = cbRead;
 
             cbRead -= cbToRead;
+#ifdef VBOX_WITH_IO_READ_CACHE
+            /* Without the read cache misses are never cached, so this only
+               counts as a bypass when it would have created an entry. */
+            if (fScan)
+                STAM_REL_COUNTER_ADD(&pBlkCache->StatScanBypassed, cbToRead);
+#endif
             pdmBlkCacheRequestPassthrough(pBlkCache, pReq,
                                           &SgBuf, off, cbToRead,
                                           PDMBLKCACHEXFERDIR_READ);
-#endif
         }
         off += cbToRead;
     }
@@ -2185,8 +2599,8 @@ VMMR3DECL(int) PDMR3BlkCacheWrite(PPDMBLKCACHE pBlkCache, uint64_t off, PCRTSGBU
             STAM_COUNTER_ADD(&pCache->StatWritten, cbToWrite);
 
             /* Ghost lists contain no data. */
-            if (   (pEntry->pList == &pCache->LruRecentlyUsedIn)
-                || (pEntry->pList == &pCache->LruFrequentlyUsed))
+            if (   (pEntry->pList == &pEntry->pShard->LruRecentlyUsedIn)
+                || (pEntry->pList == &pEntry->pShard->LruFrequentlyUsed))
             {
                 /* Check if the entry is dirty. */
                 if (pdmBlkCacheEntryFlagIsSetClearAcquireLock(pBlkCache, pEntry,
@@ -2235,12 +2649,7 @@ VMMR3DECL(int) PDMR3BlkCacheWrite(PPDMBLKCACHE pBlkCache, uint64_t off, PCRTSGBU
                 } /* Dirty bit not set */
 
                 /* Move this entry to the top position */
-                if (pEntry->pList == &pCache->LruFrequentlyUsed)
-                {
-                    pdmBlkCacheLockEnter(pCache);
-                    pdmBlkCacheEntryAddToList(&pCache->LruFrequentlyUsed, pEntry);
-                    pdmBlkCacheLockLeave(pCache);
-                }
+                pdmBlkCacheEntryHit(pEntry);
 
                 pdmBlkCacheEntryRelease(pEntry);
             }
@@ -2248,16 +2657,15 @@ VMMR3DECL(int) PDMR3BlkCacheWrite(PPDMBLKCACHE pBlkCache, uint64_t off, PCRTSGBU
             {
                 uint8_t *pbBuffer = NULL;
 
-                pdmBlkCacheLockEnter(pCache);
-                pdmBlkCacheEntryRemoveFromList(pEntry); /* Remove it before we remove data, otherwise it may get freed when evicting data. */
-                bool fEnough = pdmBlkCacheReclaim(pCache, pEntry->cbData, true, &pbBuffer);
+                pdmBlkCacheShardLockEnter(pEntry->pShard);
+                bool fEnough = pdmBlkCacheEntryGhostHit(pEntry, &pbBuffer);
 
                 if (fEnough)
                 {
                     /* Move the entry to Am and fetch it to the cache. */
-                    pdmBlkCacheEntryAddToList(&pCache->LruFrequentlyUsed, pEntry);
-                    pdmBlkCacheAdd(pCache, pEntry->cbData);
-                    pdmBlkCacheLockLeave(pCache);
+                    pdmBlkCacheEntryAddToList(&pEntry->pShard->LruFrequentlyUsed, pEntry);
+                    pdmBlkCacheAdd(pEntry->pShard, pEntry->cbData);
+                    pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                     if (pbBuffer)
                         pEntry->pbData = pbBuffer;
@@ -2282,7 +2690,7 @@ VMMR3DECL(int) PDMR3BlkCacheWrite(PPDMBLKCACHE pBlkCache, uint64_t off, PCRTSGBU
                     STAM_PROFILE_ADV_STOP(&pCache->StatTreeRemove, Cache);
                     RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
 
-                    pdmBlkCacheLockLeave(pCache);
+                    pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                     RTMemFree(pEntry);
                     pdmBlkCacheRequestPassthrough(pBlkCache, pReq,
@@ -2439,8 +2847,8 @@ VMMR3DECL(int) PDMR3BlkCacheDiscard(PPDMBLKCACHE pBlkCache, PCRTRANGE paRanges,
                 cbThisDiscard = RT_MIN(pEntry->cbData - offDiff, cbLeft);
 
                 /* Ghost lists contain no data. */
-                if (   (pEntry->pList == &pCache->LruRecentlyUsedIn)
-                    || (pEntry->pList == &pCache->LruFrequentlyUsed))
+                if (   (pEntry->pList == &pEntry->pShard->LruRecentlyUsedIn)
+                    || (pEntry->pList == &pEntry->pShard->LruFrequentlyUsed))
                 {
                     /* Check if the entry is dirty. */
                     if (pdmBlkCacheEntryFlagIsSetClearAcquireLock(pBlkCache, pEntry,
@@ -2450,14 +2858,14 @@ VMMR3DECL(int) PDMR3BlkCacheDiscard(PPDMBLKCACHE pBlkCache, PCRTRANGE paRanges,
                         /* If it is dirty but not yet in progress remove it. */
                         if (!(pEntry->fFlags & PDMBLKCACHE_ENTRY_IO_IN_PROGRESS))
                         {
-                            pdmBlkCacheLockEnter(pCache);
+                            pdmBlkCacheShardLockEnter(pEntry->pShard);
                             pdmBlkCacheEntryRemoveFromList(pEntry);
 
                             STAM_PROFILE_ADV_START(&pCache->StatTreeRemove, Cache);
                             RTAvlrU64Remove(pBlkCache->pTree, pEntry->Core.Key);
                             STAM_PROFILE_ADV_STOP(&pCache->StatTreeRemove, Cache);
 
-                            pdmBlkCacheLockLeave(pCache);
+                            pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                             RTMemFree(pEntry);
                         }
@@ -2496,7 +2904,7 @@ VMMR3DECL(int) PDMR3BlkCacheDiscard(PPDMBLKCACHE pBlkCache, PCRTRANGE paRanges,
                         }
                         else /* I/O in progress flag not set */
                         {
-                            pdmBlkCacheLockEnter(pCache);
+                            pdmBlkCacheShardLockEnter(pEntry->pShard);
                             pdmBlkCacheEntryRemoveFromList(pEntry);
 
                             RTSemRWRequestWrite(pBlkCache->SemRWEntries, RT_INDEFINITE_WAIT);
@@ -2505,7 +2913,7 @@ VMMR3DECL(int) PDMR3BlkCacheDiscard(PPDMBLKCACHE pBlkCache, PCRTRANGE paRanges,
                             STAM_PROFILE_ADV_STOP(&pCache->StatTreeRemove, Cache);
                             RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
 
-                            pdmBlkCacheLockLeave(pCache);
+                            pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                             RTMemFree(pEntry);
                         }
@@ -2513,7 +2921,7 @@ VMMR3DECL(int) PDMR3BlkCacheDiscard(PPDMBLKCACHE pBlkCache, PCRTRANGE paRanges,
                 }
                 else /* Entry is on the ghost list just remove cache entry. */
                 {
-                    pdmBlkCacheLockEnter(pCache);
+                    pdmBlkCacheShardLockEnter(pEntry->pShard);
                     pdmBlkCacheEntryRemoveFromList(pEntry);
 
                     RTSemRWRequestWrite(pBlkCache->SemRWEntries, RT_INDEFINITE_WAIT);
@@ -2522,7 +2930,7 @@ VMMR3DECL(int) PDMR3BlkCacheDiscard(PPDMBLKCACHE pBlkCache, PCRTRANGE paRanges,
                     STAM_PROFILE_ADV_STOP(&pCache->StatTreeRemove, Cache);
                     RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
 
-                    pdmBlkCacheLockLeave(pCache);
+                    pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                     RTMemFree(pEntry);
                 }
@@ -2753,12 +3161,12 @@ VMMR3DECL(int) PDMR3BlkCacheClear(PPDMBLKCACHE pBlkCache)
         pdmBlkCacheCommit(pBlkCache);
 
     /* Make sure nobody is accessing the cache while we delete the tree. */
-    pdmBlkCacheLockEnter(pCache);
+    pdmBlkCacheLockEnterAll(pCache);
     RTSemRWRequestWrite(pBlkCache->SemRWEntries, RT_INDEFINITE_WAIT);
     RTAvlrU64Destroy(pBlkCache->pTree, pdmBlkCacheEntryDestroy, pCache);
     RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
 
-    pdmBlkCacheLockLeave(pCache);
+    pdmBlkCacheLockLeaveAll(pCache);
     return rc;
 }
 
@@ -1369,6 +1369,13 @@ VMMR3DECL(int) PGMR3Init(PVM pVM)
     rc = CFGMR3QueryBoolDef(pCfgPGM, "ZeroRamPagesOnReset", &pVM->pgm.s.fZeroRamPagesOnReset, true);
     AssertLogRelRCReturn(rc, rc);
 
+    /** @cfgm{/PGM/LazyRestore, boolean, false}
+     * Whether to load the guest RAM pages on demand and in the background after
+     * restoring a saved state from a file.  Only used with VT-x/AMD-V and when
+     * RAM isn't preallocated. */
+    rc = CFGMR3QueryBoolDef(pCfgPGM, "LazyRestore", &pVM->pgm.s.fLazyRestore, false);
+    AssertLogRelRCReturn(rc, rc);
+
 #ifdef VBOX_WITH_STATISTICS
     /*
      * Allocate memory for the statistics before someone tries to use them.
@@ -2582,6 +2589,11 @@ VMMR3_INT_DECL(void) PGMR3Reset(PVM pVM)
     LogFlow(("PGMR3Reset:\n"));
     VM_ASSERT_EMT(pVM);
 
+    /*
+     * Drop any pending lazy restore, the RAM content is going away.
+     */
+    pgmR3LazyRestoreTerm(pVM, true /*fDestroyTimer*/);
+
     pgmLock(pVM);
 
     /*
@@ -2711,6 +2723,8 @@ VMMR3_INT_DECL(void) PGMR3ResetNoMorePhysWritesFlag(PVM pVM)
  */
 VMMR3DECL(int) PGMR3Term(PVM pVM)
 {
+    pgmR3LazyRestoreTerm(pVM, false /*fDestroyTimer*/);
+
     /* Must free shared pages here. */
     pgmLock(pVM);
     pgmR3PhysRamTerm(pVM);
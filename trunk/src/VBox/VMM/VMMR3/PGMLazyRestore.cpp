@@ -0,0 +1,737 @@
+/* $Id$ */
+/** @file
+ * PGM - Page Manager and Monitor, Lazy Restore of Guest RAM.
+ */
+
+/*
+ * Copyright (C) 2016 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/** @page pg_pgm_lazy_restore    PGM Lazy Restore
+ *
+ * When restoring a saved state from a file, the content of the RAM pages can
+ * be loaded after the VM has been resumed instead of while loading the state.
+ * This is enabled by the /PGM/LazyRestore CFGM key.
+ *
+ * While loading the saved state, pgmR3LoadMemory asks SSM where each page is
+ * stored in the file (SSMR3GetMemLocation) instead of reading it, and leaves
+ * the page in the ZERO state.  Consecutive pages are grouped into runs, each
+ * covered by an ALL access handler that loads the page on first access.  Zero
+ * pages between the loaded pages are included in the runs to keep the number
+ * of handlers down; accessing one of these just disables the handler for it.
+ *
+ * A prefetcher thread reads and decompresses the remaining pages in the
+ * background.  Since allocating guest pages must be done on an EMT, the
+ * prefetched pages are installed by a timer callback.  Once all the pages
+ * have been loaded, the access handlers are deregistered.
+ *
+ * Saving the VM state loads all the remaining pages first, while resetting
+ * the VM just drops them since guest RAM is zeroed anyway.
+ *
+ * Since the pages are initially unbacked, this only works on freshly created
+ * VMs without RAM preallocation.  It also requires VT-x or AMD-V as the raw
+ * mode code doesn't route all guest memory accesses through the access
+ * handlers.
+ *
+ * Main deletes the saved state file right after the VM was restored.  The
+ * file handle for reading the remaining pages is opened by
+ * SSMR3OpenMemLocationFile in a way which permits deleting the file, so the
+ * pages stay readable through it until all of them are loaded, also on
+ * Windows.  A new saved state always goes to a new file.
+ */
+
+
+/*********************************************************************************************************************************
+*   Header Files                                                                                                                 *
+*********************************************************************************************************************************/
+#define LOG_GROUP LOG_GROUP_PGM
+#include <VBox/vmm/pgm.h>
+#include <VBox/vmm/hm.h>
+#include <VBox/vmm/ssm.h>
+#include <VBox/vmm/tm.h>
+#include "PGMInternal.h"
+#include <VBox/vmm/vm.h>
+#include "PGMInline.h"
+
+#include <VBox/param.h>
+#include <VBox/err.h>
+#include <VBox/log.h>
+
+#include <iprt/asm.h>
+#include <iprt/assert.h>
+#include <iprt/file.h>
+#include <iprt/mem.h>
+#include <iprt/semaphore.h>
+#include <iprt/string.h>
+#include <iprt/thread.h>
+
+
+/*********************************************************************************************************************************
+*   Defined Constants And Macros                                                                                                 *
+*********************************************************************************************************************************/
+/** The number of pages the prefetcher can have waiting for installation. */
+#define PGM_LAZY_RESTORE_SLOTS              128
+/** The initial interval of the timer installing the prefetched pages (ms). */
+#define PGM_LAZY_RESTORE_TIMER_INTERVAL     1
+/** The interval the timer backs off to while the prefetcher delivers
+ * nothing (ms). */
+#define PGM_LAZY_RESTORE_TIMER_INTERVAL_MAX 64
+
+/** @name Prefetch slot states.
+ * @{ */
+/** The slot is free and can be filled by the prefetcher. */
+#define PGM_LAZY_SLOT_FREE                  UINT32_C(0)
+/** The slot holds a page ready to be installed by the EMT. */
+#define PGM_LAZY_SLOT_READY                 UINT32_C(1)
+/** @} */
+
+
+/*********************************************************************************************************************************
+*   Structures and Typedefs                                                                                                      *
+*********************************************************************************************************************************/
+/**
+ * A run of lazily restored pages covered by one access handler.
+ */
+typedef struct PGMLAZYRUN
+{
+    /** The address of the first page. */
+    RTGCPHYS                GCPhys;
+    /** The number of pages in the run. */
+    uint32_t                cPages;
+    /** The number of entries allocated in auLocations. */
+    uint32_t                cPagesMax;
+    /** The number of pages which haven't been loaded yet. */
+    uint32_t                cPagesLeft;
+    /** Set if the access handler is registered. */
+    bool                    fRegistered;
+    /** Where the page content is in the saved state file, 0 if loaded or if
+     * the page is zero. */
+    uint64_t volatile       auLocations[1];
+} PGMLAZYRUN;
+/** Pointer to a lazy restore run. */
+typedef PGMLAZYRUN *PPGMLAZYRUN;
+
+/**
+ * A page read by the prefetcher.
+ */
+typedef struct PGMLAZYSLOT
+{
+    /** The slot state, PGM_LAZY_SLOT_XXX. */
+    uint32_t volatile       u32State;
+    /** The page index into the run. */
+    uint32_t                iPage;
+    /** The run. */
+    PPGMLAZYRUN             pRun;
+    /** The location the page was read from. */
+    uint64_t                uLocation;
+    /** The page content. */
+    uint8_t                 abPage[PAGE_SIZE];
+} PGMLAZYSLOT;
+/** Pointer to a prefetch slot. */
+typedef PGMLAZYSLOT *PPGMLAZYSLOT;
+
+/**
+ * The lazy restore state.
+ */
+typedef struct PGMLAZYRESTORE
+{
+    /** The saved state file. */
+    RTFILE                  hFile;
+    /** The access handler type. */
+    PGMPHYSHANDLERTYPE      hHandlerType;
+    /** The number of pages which haven't been loaded yet. */
+    uint32_t                cPagesLeft;
+    /** The number of runs. */
+    uint32_t                cRuns;
+    /** The runs sorted by address (the last one may still be growing while
+     * loading the saved state). */
+    PPGMLAZYRUN            *papRuns;
+    /** The number of entries allocated in papRuns. */
+    uint32_t                cRunsAlloc;
+    /** The number of pages loaded on demand. */
+    uint32_t                cDemandLoads;
+    /** The number of pages installed from the prefetcher. */
+    uint32_t                cPrefetchLoads;
+    /** Set when all the pages have been loaded and the handlers are gone. */
+    bool                    fDone;
+    /** Set when the prefetcher should quit. */
+    bool volatile           fTerminate;
+    /** Set when the prefetcher has gone over all the runs. */
+    bool volatile           fPrefetchDone;
+    /** The prefetcher thread. */
+    RTTHREAD                hThread;
+    /** Signalled when slots are freed. */
+    RTSEMEVENT              hEvtSlots;
+    /** The timer installing the prefetched pages. */
+    PTMTIMERR3              pTimer;
+    /** The current timer interval (ms). */
+    uint32_t                cMsTimerInterval;
+    /** The prefetch slots. */
+    PPGMLAZYSLOT            paSlots;
+} PGMLAZYRESTORE;
+/** Pointer to the lazy restore state. */
+typedef PGMLAZYRESTORE *PPGMLAZYRESTORE;
+
+
+/*********************************************************************************************************************************
+*   Internal Functions                                                                                                           *
+*********************************************************************************************************************************/
+static FNPGMPHYSHANDLER pgmR3LazyRestoreAccessHandler;
+
+
+/**
+ * Looks up the run containing a page.
+ *
+ * @returns Pointer to the run, NULL if not found.
+ * @param   pLazy           The lazy restore state.
+ * @param   GCPhys          The guest physical address.
+ * @param   piPage          Where to return the page index into the run.
+ */
+static PPGMLAZYRUN pgmR3LazyRestoreLookup(PPGMLAZYRESTORE pLazy, RTGCPHYS GCPhys, uint32_t *piPage)
+{
+    uint32_t iStart = 0;
+    uint32_t iEnd   = pLazy->cRuns;
+    while (iStart < iEnd)
+    {
+        uint32_t const iRun = iStart + (iEnd - iStart) / 2;
+        PPGMLAZYRUN    pRun = pLazy->papRuns[iRun];
+        if (GCPhys < pRun->GCPhys)
+            iEnd = iRun;
+        else if (GCPhys - pRun->GCPhys >= ((RTGCPHYS)pRun->cPages << PAGE_SHIFT))
+            iStart = iRun + 1;
+        else
+        {
+            *piPage = (uint32_t)((GCPhys - pRun->GCPhys) >> PAGE_SHIFT);
+            return pRun;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Loads a page and turns off the access handler for it.
+ *
+ * @returns VBox status code.
+ * @param   pVM             The cross context VM structure.
+ * @param   pLazy           The lazy restore state.
+ * @param   pRun            The run.
+ * @param   iPage           The page index into the run.
+ * @param   pSlot           The prefetched content, NULL if the page should be
+ *                          read from the file.
+ *
+ * @remarks Caller must own the PGM lock.
+ */
+static int pgmR3LazyRestoreLoadPage(PVM pVM, PPGMLAZYRESTORE pLazy, PPGMLAZYRUN pRun, uint32_t iPage, PPGMLAZYSLOT pSlot)
+{
+    PGM_LOCK_ASSERT_OWNER(pVM);
+    RTGCPHYS const GCPhys    = pRun->GCPhys + ((RTGCPHYS)iPage << PAGE_SHIFT);
+    uint64_t const uLocation = pRun->auLocations[iPage];
+    if (pSlot && pSlot->uLocation != uLocation)
+        return VINF_SUCCESS; /* loaded on demand in the meanwhile */
+
+    if (uLocation)
+    {
+        PPGMPAGE pPage;
+        int rc = pgmPhysGetPageEx(pVM, GCPhys, &pPage);
+        AssertRCReturn(rc, rc);
+
+        PGMPAGEMAPLOCK PgMpLck;
+        void          *pvDstPage;
+        rc = pgmPhysGCPhys2CCPtrInternal(pVM, pPage, GCPhys, &pvDstPage, &PgMpLck);
+        AssertLogRelMsgRCReturn(rc, ("GCPhys=%RGp %R[pgmpage] rc=%Rrc\n", GCPhys, pPage, rc), rc);
+        if (pSlot)
+            memcpy(pvDstPage, pSlot->abPage, PAGE_SIZE);
+        else
+            rc = SSMR3ReadMemLocation(pLazy->hFile, uLocation, pvDstPage, PAGE_SIZE);
+        pgmPhysReleaseInternalPageMappingLock(pVM, &PgMpLck);
+        if (RT_FAILURE(rc))
+        {
+            LogRel(("PGM: Failed to load page %RGp from the saved state: %Rrc\n", GCPhys, rc));
+            return rc;
+        }
+
+        ASMAtomicWriteU64(&pRun->auLocations[iPage], 0);
+        pRun->cPagesLeft--;
+        pLazy->cPagesLeft--;
+        if (pSlot)
+            pLazy->cPrefetchLoads++;
+        else
+            pLazy->cDemandLoads++;
+    }
+
+    if (pRun->fRegistered)
+        return PGMHandlerPhysicalPageTempOff(pVM, pRun->GCPhys, GCPhys);
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Loads a page, if it's being restored lazily.
+ *
+ * This is for code accessing guest RAM without going thru the access
+ * handlers.
+ *
+ * @returns VBox status code.
+ * @param   pVM             The cross context VM structure.
+ * @param   GCPhys          The guest physical address.
+ *
+ * @remarks Caller must own the PGM lock.
+ */
+int pgmR3LazyRestoreFetchPage(PVM pVM, RTGCPHYS GCPhys)
+{
+    PGM_LOCK_ASSERT_OWNER(pVM);
+    PPGMLAZYRESTORE pLazy = pVM->pgm.s.pLazyRestoreR3;
+    if (!pLazy || pLazy->fDone)
+        return VINF_SUCCESS;
+
+    uint32_t    iPage;
+    PPGMLAZYRUN pRun = pgmR3LazyRestoreLookup(pLazy, GCPhys, &iPage);
+    if (!pRun)
+        return VINF_SUCCESS;
+    return pgmR3LazyRestoreLoadPage(pVM, pLazy, pRun, iPage, NULL /*pSlot*/);
+}
+
+
+/**
+ * @callback_method_impl{FNPGMPHYSHANDLER,
+ *      Loads the page on the first access.}
+ */
+static DECLCALLBACK(VBOXSTRICTRC)
+pgmR3LazyRestoreAccessHandler(PVM pVM, PVMCPU pVCpu, RTGCPHYS GCPhys, void *pvPhys, void *pvBuf, size_t cbBuf,
+                              PGMACCESSTYPE enmAccessType, PGMACCESSORIGIN enmOrigin, void *pvUser)
+{
+    NOREF(pVCpu); NOREF(pvPhys); NOREF(enmOrigin); NOREF(pvUser);
+    Assert(cbBuf <= PAGE_SIZE - (GCPhys & PAGE_OFFSET_MASK));
+
+    pgmLock(pVM);
+    int rc = pgmR3LazyRestoreFetchPage(pVM, GCPhys);
+    if (RT_SUCCESS(rc))
+    {
+        /* pvPhys may be the zero page, so carry out the access ourselves. */
+        PPGMPAGE pPage;
+        rc = pgmPhysGetPageEx(pVM, GCPhys, &pPage);
+        if (RT_SUCCESS(rc))
+        {
+            PGMPAGEMAPLOCK PgMpLck;
+            if (enmAccessType == PGMACCESSTYPE_WRITE)
+            {
+                void *pv;
+                rc = pgmPhysGCPhys2CCPtrInternal(pVM, pPage, GCPhys, &pv, &PgMpLck);
+                if (RT_SUCCESS(rc))
+                    memcpy(pv, pvBuf, cbBuf);
+            }
+            else
+            {
+                void const *pv;
+                rc = pgmPhysGCPhys2CCPtrInternalReadOnly(pVM, pPage, GCPhys, &pv, &PgMpLck);
+                if (RT_SUCCESS(rc))
+                    memcpy(pvBuf, pv, cbBuf);
+            }
+            if (RT_SUCCESS(rc))
+                pgmPhysReleaseInternalPageMappingLock(pVM, &PgMpLck);
+        }
+    }
+    pgmUnlock(pVM);
+    return rc;
+}
+
+
+/**
+ * Registers the access handler for the last run, trimming trailing zero pages.
+ *
+ * The pages are loaded right away if the handler cannot be registered.
+ *
+ * @returns VBox status code.
+ * @param   pVM             The cross context VM structure.
+ * @param   pLazy           The lazy restore state.
+ */
+static int pgmR3LazyRestoreCloseRun(PVM pVM, PPGMLAZYRESTORE pLazy)
+{
+    if (!pLazy->cRuns)
+        return VINF_SUCCESS;
+    PPGMLAZYRUN pRun = pLazy->papRuns[pLazy->cRuns - 1];
+    if (pRun->fRegistered || !pRun->cPagesLeft)
+        return VINF_SUCCESS;
+
+    while (!pRun->auLocations[pRun->cPages - 1])
+        pRun->cPages--;
+    PPGMLAZYRUN pRunNew = (PPGMLAZYRUN)RTMemRealloc(pRun, RT_OFFSETOF(PGMLAZYRUN, auLocations[pRun->cPages]));
+    if (pRunNew)
+        pLazy->papRuns[pLazy->cRuns - 1] = pRun = pRunNew;
+    pRun->cPagesMax = pRun->cPages;
+
+    int rc = PGMHandlerPhysicalRegister(pVM, pRun->GCPhys, pRun->GCPhys + ((RTGCPHYS)pRun->cPages << PAGE_SHIFT) - 1,
+                                        pLazy->hHandlerType, pRun, NIL_RTR0PTR, NIL_RTRCPTR, "Lazy restore");
+    if (RT_SUCCESS(rc))
+    {
+        pRun->fRegistered = true;
+        return VINF_SUCCESS;
+    }
+
+    LogRel(("PGM: Failed to register lazy restore handler for %RGp LB %#x pages (%Rrc), loading them now\n",
+            pRun->GCPhys, pRun->cPages, rc));
+    for (uint32_t iPage = 0; iPage < pRun->cPages; iPage++)
+    {
+        rc = pgmR3LazyRestoreLoadPage(pVM, pLazy, pRun, iPage, NULL /*pSlot*/);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Prepares a lazy restore when loading the guest RAM, if configured.
+ *
+ * @returns true if pages can be restored lazily, false if not.
+ * @param   pVM             The cross context VM structure.
+ * @param   pSSM            The saved state handle.
+ * @param   uPass           The pass number.
+ */
+bool pgmR3LazyRestoreBegin(PVM pVM, PSSMHANDLE pSSM, uint32_t uPass)
+{
+    if (   !pVM->pgm.s.fLazyRestore
+        || uPass != SSM_PASS_FINAL
+        || pVM->pgm.s.fRamPreAlloc
+        || !HMIsEnabled(pVM))
+        return false;
+    if (pVM->pgm.s.pLazyRestoreR3)
+        return !pVM->pgm.s.pLazyRestoreR3->fDone;
+
+    PPGMLAZYRESTORE pLazy = (PPGMLAZYRESTORE)RTMemAllocZ(sizeof(*pLazy));
+    if (!pLazy)
+        return false;
+    pLazy->hHandlerType = NIL_PGMPHYSHANDLERTYPE;
+    pLazy->hThread      = NIL_RTTHREAD;
+    pLazy->hEvtSlots    = NIL_RTSEMEVENT;
+    int rc = SSMR3OpenMemLocationFile(pSSM, &pLazy->hFile);
+    if (RT_SUCCESS(rc))
+    {
+        rc = PGMR3HandlerPhysicalTypeRegister(pVM, PGMPHYSHANDLERKIND_ALL, pgmR3LazyRestoreAccessHandler,
+                                              NULL, NULL, NULL, NULL, NULL, NULL,
+                                              "Lazy restore", &pLazy->hHandlerType);
+        if (RT_SUCCESS(rc))
+        {
+            pVM->pgm.s.pLazyRestoreR3 = pLazy;
+            return true;
+        }
+        RTFileClose(pLazy->hFile);
+    }
+    LogRel(("PGM: Lazy restore not possible (%Rrc), loading all of guest RAM\n", rc));
+    RTMemFree(pLazy);
+    return false;
+}
+
+
+/**
+ * Adds a page to the lazy restore.
+ *
+ * @returns VBox status code.
+ * @param   pVM             The cross context VM structure.
+ * @param   pRam            The RAM range containing the page.
+ * @param   GCPhys          The guest physical address of the page.
+ * @param   uLocation       Where the page is stored in the saved state file, 0
+ *                          if the page is zero, UINT64_MAX if the page has
+ *                          been loaded the normal way.
+ *
+ * @remarks Caller must own the PGM lock.
+ */
+int pgmR3LazyRestoreAddPage(PVM pVM, PPGMRAMRANGE pRam, RTGCPHYS GCPhys, uint64_t uLocation)
+{
+    PPGMLAZYRESTORE pLazy = pVM->pgm.s.pLazyRestoreR3;
+    AssertReturn(pLazy, VERR_INTERNAL_ERROR_3);
+
+    /*
+     * Extend the current run if the page follows it.  The run was sized for
+     * the RAM range it started in, so it cannot grow into the next one even
+     * when that is adjacent.
+     */
+    PPGMLAZYRUN pRun = pLazy->cRuns ? pLazy->papRuns[pLazy->cRuns - 1] : NULL;
+    if (   pRun
+        && !pRun->fRegistered
+        && uLocation != UINT64_MAX
+        && GCPhys == pRun->GCPhys + ((RTGCPHYS)pRun->cPages << PAGE_SHIFT)
+        && pRun->cPages < pRun->cPagesMax)
+    {
+        pRun->auLocations[pRun->cPages++] = uLocation;
+        if (uLocation)
+        {
+            pRun->cPagesLeft++;
+            pLazy->cPagesLeft++;
+        }
+        return VINF_SUCCESS;
+    }
+
+    int rc = pgmR3LazyRestoreCloseRun(pVM, pLazy);
+    if (RT_FAILURE(rc) || !uLocation || uLocation == UINT64_MAX)
+        return rc;
+
+    /*
+     * Start a new run, allocating enough for the rest of the RAM range.
+     */
+    if (pLazy->cRuns >= pLazy->cRunsAlloc)
+    {
+        uint32_t const cNew = pLazy->cRunsAlloc ? pLazy->cRunsAlloc * 2 : 64;
+        void *pvNew = RTMemRealloc(pLazy->papRuns, cNew * sizeof(pLazy->papRuns[0]));
+        AssertReturn(pvNew, VERR_NO_MEMORY);
+        pLazy->papRuns    = (PPGMLAZYRUN *)pvNew;
+        pLazy->cRunsAlloc = cNew;
+    }
+    AssertReturn(!pLazy->cRuns || GCPhys > pLazy->papRuns[pLazy->cRuns - 1]->GCPhys, VERR_INTERNAL_ERROR_4);
+
+    uint32_t const cMaxPages = (uint32_t)((pRam->GCPhysLast - GCPhys) >> PAGE_SHIFT) + 1;
+    pRun = (PPGMLAZYRUN)RTMemAlloc(RT_OFFSETOF(PGMLAZYRUN, auLocations[cMaxPages]));
+    AssertReturn(pRun, VERR_NO_MEMORY);
+    pRun->GCPhys         = GCPhys;
+    pRun->cPages         = 1;
+    pRun->cPagesMax      = cMaxPages;
+    pRun->cPagesLeft     = 1;
+    pRun->fRegistered    = false;
+    pRun->auLocations[0] = uLocation;
+    pLazy->papRuns[pLazy->cRuns++] = pRun;
+    pLazy->cPagesLeft++;
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Deregisters the handlers of the completely loaded runs.
+ *
+ * @param   pVM             The cross context VM structure.
+ * @param   pLazy           The lazy restore state.
+ *
+ * @remarks Caller must own the PGM lock.
+ */
+static void pgmR3LazyRestoreDeregisterLoaded(PVM pVM, PPGMLAZYRESTORE pLazy)
+{
+    for (uint32_t iRun = 0; iRun < pLazy->cRuns; iRun++)
+    {
+        PPGMLAZYRUN pRun = pLazy->papRuns[iRun];
+        if (pRun->fRegistered && !pRun->cPagesLeft)
+        {
+            int rc = PGMHandlerPhysicalDeregister(pVM, pRun->GCPhys);
+            AssertRC(rc);
+            pRun->fRegistered = false;
+        }
+    }
+
+    if (!pLazy->cPagesLeft && !pLazy->fDone)
+    {
+        pLazy->fDone = true;
+        LogRel(("PGM: Lazy restore completed: %u pages loaded on demand, %u prefetched\n",
+                pLazy->cDemandLoads, pLazy->cPrefetchLoads));
+    }
+}
+
+
+/**
+ * @callback_method_impl{FNTMTIMERINT,
+ *      Installs the prefetched pages.}
+ */
+static DECLCALLBACK(void) pgmR3LazyRestoreTimer(PVM pVM, PTMTIMER pTimer, void *pvUser)
+{
+    PPGMLAZYRESTORE pLazy = (PPGMLAZYRESTORE)pvUser;
+    bool const      fPrefetchDone = ASMAtomicReadBool(&pLazy->fPrefetchDone);
+
+    pgmLock(pVM);
+    uint32_t cInstalled = 0;
+    for (uint32_t iSlot = 0; iSlot < PGM_LAZY_RESTORE_SLOTS; iSlot++)
+    {
+        PPGMLAZYSLOT pSlot = &pLazy->paSlots[iSlot];
+        if (ASMAtomicReadU32(&pSlot->u32State) == PGM_LAZY_SLOT_READY)
+        {
+            int rc = pgmR3LazyRestoreLoadPage(pVM, pLazy, pSlot->pRun, pSlot->iPage, pSlot);
+            AssertLogRelRC(rc); /* the page will be loaded on demand instead. */
+            ASMAtomicWriteU32(&pSlot->u32State, PGM_LAZY_SLOT_FREE);
+            cInstalled++;
+        }
+    }
+    if (cInstalled || fPrefetchDone)
+        pgmR3LazyRestoreDeregisterLoaded(pVM, pLazy);
+    bool const fDone = pLazy->fDone;
+    pgmUnlock(pVM);
+
+    /* Back off while the prefetcher has nothing for us (waiting on the disk
+       or done), so an idle restore doesn't wake the EMT every millisecond. */
+    if (cInstalled)
+    {
+        RTSemEventSignal(pLazy->hEvtSlots);
+        pLazy->cMsTimerInterval = PGM_LAZY_RESTORE_TIMER_INTERVAL;
+    }
+    else
+        pLazy->cMsTimerInterval = RT_MIN(pLazy->cMsTimerInterval * 2, PGM_LAZY_RESTORE_TIMER_INTERVAL_MAX);
+    if (!fDone && !fPrefetchDone)
+        TMTimerSetMillies(pTimer, pLazy->cMsTimerInterval);
+}
+
+
+/**
+ * The prefetcher thread.
+ *
+ * @returns VINF_SUCCESS.
+ * @param   hThreadSelf     The thread handle.
+ * @param   pvUser          The cross context VM structure.
+ */
+static DECLCALLBACK(int) pgmR3LazyRestorePrefetchThread(RTTHREAD hThreadSelf, void *pvUser)
+{
+    PVM             pVM   = (PVM)pvUser;
+    PPGMLAZYRESTORE pLazy = pVM->pgm.s.pLazyRestoreR3;
+    NOREF(hThreadSelf);
+
+    uint32_t iSlot = 0;
+    for (uint32_t iRun = 0; iRun < pLazy->cRuns && !pLazy->fTerminate; iRun++)
+    {
+        PPGMLAZYRUN pRun = pLazy->papRuns[iRun];
+        for (uint32_t iPage = 0; iPage < pRun->cPages && !pLazy->fTerminate; iPage++)
+        {
+            uint64_t const uLocation = ASMAtomicReadU64(&pRun->auLocations[iPage]);
+            if (!uLocation)
+                continue;
+
+            /* Wait for a free slot. */
+            PPGMLAZYSLOT pSlot = &pLazy->paSlots[iSlot];
+            while (   ASMAtomicReadU32(&pSlot->u32State) != PGM_LAZY_SLOT_FREE
+                   && !pLazy->fTerminate)
+                RTSemEventWait(pLazy->hEvtSlots, 100);
+            if (pLazy->fTerminate)
+                break;
+
+            int rc = SSMR3ReadMemLocation(pLazy->hFile, uLocation, pSlot->abPage, PAGE_SIZE);
+            if (RT_FAILURE(rc))
+                continue; /* leave it for the access handler to report */
+            pSlot->pRun      = pRun;
+            pSlot->iPage     = iPage;
+            pSlot->uLocation = uLocation;
+            ASMAtomicWriteU32(&pSlot->u32State, PGM_LAZY_SLOT_READY);
+            iSlot = (iSlot + 1) % PGM_LAZY_RESTORE_SLOTS;
+        }
+    }
+
+    ASMAtomicWriteBool(&pLazy->fPrefetchDone, true);
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Starts the prefetching after the saved state has been loaded.
+ *
+ * @returns VBox status code.
+ * @param   pVM             The cross context VM structure.
+ */
+int pgmR3LazyRestoreStart(PVM pVM)
+{
+    PPGMLAZYRESTORE pLazy = pVM->pgm.s.pLazyRestoreR3;
+    if (!pLazy || pLazy->pTimer)
+        return VINF_SUCCESS;
+
+    pgmLock(pVM);
+    int rc = pgmR3LazyRestoreCloseRun(pVM, pLazy);
+    pgmR3LazyRestoreDeregisterLoaded(pVM, pLazy);
+    pgmUnlock(pVM);
+    if (RT_FAILURE(rc) || pLazy->fDone)
+        return rc;
+    LogRel(("PGM: Restoring %u guest RAM pages lazily (%u ranges)\n", pLazy->cPagesLeft, pLazy->cRuns));
+
+    pLazy->paSlots = (PPGMLAZYSLOT)RTMemPageAllocZ(sizeof(pLazy->paSlots[0]) * PGM_LAZY_RESTORE_SLOTS);
+    AssertReturn(pLazy->paSlots, VERR_NO_PAGE_MEMORY);
+    rc = RTSemEventCreate(&pLazy->hEvtSlots);
+    AssertRCReturn(rc, rc);
+    rc = TMR3TimerCreateInternal(pVM, TMCLOCK_REAL, pgmR3LazyRestoreTimer, pLazy, "PGM lazy restore", &pLazy->pTimer);
+    AssertRCReturn(rc, rc);
+    rc = RTThreadCreate(&pLazy->hThread, pgmR3LazyRestorePrefetchThread, pVM, 0, RTTHREADTYPE_IO,
+                        RTTHREADFLAGS_WAITABLE, "PGMLazyRst");
+    AssertRCReturn(rc, rc);
+    pLazy->cMsTimerInterval = PGM_LAZY_RESTORE_TIMER_INTERVAL;
+    return TMTimerSetMillies(pLazy->pTimer, pLazy->cMsTimerInterval);
+}
+
+
+/**
+ * Stops the prefetcher and frees the lazy restore state.
+ *
+ * Any pages not loaded yet stay zero, so this is for when the guest RAM is
+ * about to be reset or freed.  Use pgmR3LazyRestoreFinish to load them first.
+ *
+ * @param   pVM             The cross context VM structure.
+ * @param   fDestroyTimer   Whether to destroy the timer.  This is false when
+ *                          destroying the VM since TM is terminated first.
+ */
+void pgmR3LazyRestoreTerm(PVM pVM, bool fDestroyTimer)
+{
+    PPGMLAZYRESTORE pLazy = pVM->pgm.s.pLazyRestoreR3;
+    if (!pLazy)
+        return;
+
+    if (pLazy->hThread != NIL_RTTHREAD)
+    {
+        ASMAtomicWriteBool(&pLazy->fTerminate, true);
+        RTSemEventSignal(pLazy->hEvtSlots);
+        int rc = RTThreadWait(pLazy->hThread, RT_INDEFINITE_WAIT, NULL);
+        AssertRC(rc);
+    }
+    if (pLazy->pTimer && fDestroyTimer)
+        TMR3TimerDestroy(pLazy->pTimer);
+
+    pgmLock(pVM);
+    for (uint32_t iRun = 0; iRun < pLazy->cRuns; iRun++)
+    {
+        PPGMLAZYRUN pRun = pLazy->papRuns[iRun];
+        if (pRun->fRegistered)
+        {
+            int rc = PGMHandlerPhysicalDeregister(pVM, pRun->GCPhys);
+            AssertRC(rc);
+        }
+        RTMemFree(pRun);
+    }
+    pVM->pgm.s.pLazyRestoreR3 = NULL;
+    pgmUnlock(pVM);
+
+    if (pLazy->hHandlerType != NIL_PGMPHYSHANDLERTYPE)
+        PGMHandlerPhysicalTypeRelease(pVM, pLazy->hHandlerType);
+    RTSemEventDestroy(pLazy->hEvtSlots);
+    if (pLazy->paSlots)
+        RTMemPageFree(pLazy->paSlots, sizeof(pLazy->paSlots[0]) * PGM_LAZY_RESTORE_SLOTS);
+    RTMemFree(pLazy->papRuns);
+    RTFileClose(pLazy->hFile);
+    RTMemFree(pLazy);
+}
+
+
+/**
+ * Loads all the remaining pages and frees the lazy restore state.
+ *
+ * @returns VBox status code.
+ * @param   pVM             The cross context VM structure.
+ */
+int pgmR3LazyRestoreFinish(PVM pVM)
+{
+    PPGMLAZYRESTORE pLazy = pVM->pgm.s.pLazyRestoreR3;
+    if (!pLazy)
+        return VINF_SUCCESS;
+
+    int rc = VINF_SUCCESS;
+    pgmLock(pVM);
+    for (uint32_t iRun = 0; iRun < pLazy->cRuns && RT_SUCCESS(rc); iRun++)
+    {
+        PPGMLAZYRUN pRun = pLazy->papRuns[iRun];
+        for (uint32_t iPage = 0; iPage < pRun->cPages && pRun->cPagesLeft && RT_SUCCESS(rc); iPage++)
+            if (pRun->auLocations[iPage])
+                rc = pgmR3LazyRestoreLoadPage(pVM, pLazy, pRun, iPage, NULL /*pSlot*/);
+    }
+    if (RT_SUCCESS(rc))
+        pgmR3LazyRestoreDeregisterLoaded(pVM, pLazy);
+    pgmUnlock(pVM);
+
+    if (RT_SUCCESS(rc))
+        pgmR3LazyRestoreTerm(pVM, true /*fDestroyTimer*/);
+    return rc;
+}
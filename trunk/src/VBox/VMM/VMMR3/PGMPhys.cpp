@@ -353,6 +353,49 @@ VMMDECL(int) PGMR3PhysWriteExternal(PVM pVM, RTGCPHYS GCPhys, const void *pvBuf,
 }
 
 
+/**
+ * VMR3ReqCall worker for pgmR3PhysLazyRestoreFetchExternal.
+ *
+ * @returns VBox status code.
+ * @param   pVM         The cross context VM structure.
+ * @param   pGCPhys     Pointer to the guest physical address.
+ */
+static DECLCALLBACK(int) pgmR3PhysLazyRestoreFetchDelegated(PVM pVM, PRTGCPHYS pGCPhys)
+{
+    pgmLock(pVM);
+    int rc = pgmR3LazyRestoreFetchPage(pVM, *pGCPhys);
+    pgmUnlock(pVM);
+    return rc;
+}
+
+
+/**
+ * Makes sure a page being restored lazily is loaded before it is mapped by the
+ * external mapping APIs, which do not go thru the access handlers.
+ *
+ * @returns VBox status code.
+ * @param   pVM         The cross context VM structure.
+ * @param   GCPhys      The guest physical address.
+ */
+static int pgmR3PhysLazyRestoreFetchExternal(PVM pVM, RTGCPHYS GCPhys)
+{
+    int rc = pgmLock(pVM);
+    AssertRCReturn(rc, rc);
+    PPGMPAGE   pPage    = pgmPhysGetPage(pVM, GCPhys);
+    bool const fPending = pPage
+                       && PGM_PAGE_HAS_ACTIVE_ALL_HANDLERS(pPage)
+                       && !PGM_PAGE_IS_MMIO_OR_SPECIAL_ALIAS(pPage);
+    if (fPending && VM_IS_EMT(pVM))
+        rc = pgmR3LazyRestoreFetchPage(pVM, GCPhys);
+    pgmUnlock(pVM);
+
+    /* Allocating the page requires an EMT. */
+    if (fPending && !VM_IS_EMT(pVM))
+        rc = VMR3ReqPriorityCallWait(pVM, VMCPUID_ANY, (PFNRT)pgmR3PhysLazyRestoreFetchDelegated, 2, pVM, &GCPhys);
+    return rc;
+}
+
+
 /**
  * VMR3ReqCall worker for PGMR3PhysGCPhys2CCPtrExternal to make pages writable.
  *
@@ -438,7 +481,15 @@ VMMR3DECL(int) PGMR3PhysGCPhys2CCPtrExternal(PVM pVM, RTGCPHYS GCPhys, void **pp
 
     Assert(VM_IS_EMT(pVM) || !PGMIsLockOwner(pVM));
 
-    int rc = pgmLock(pVM);
+    int rc;
+    if (pVM->pgm.s.pLazyRestoreR3)
+    {
+        rc = pgmR3PhysLazyRestoreFetchExternal(pVM, GCPhys);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+
+    rc = pgmLock(pVM);
     AssertRCReturn(rc, rc);
 
     /*
@@ -539,7 +590,15 @@ VMMR3DECL(int) PGMR3PhysGCPhys2CCPtrExternal(PVM pVM, RTGCPHYS GCPhys, void **pp
  */
 VMMR3DECL(int) PGMR3PhysGCPhys2CCPtrReadOnlyExternal(PVM pVM, RTGCPHYS GCPhys, void const **ppv, PPGMPAGEMAPLOCK pLock)
 {
-    int rc = pgmLock(pVM);
+    int rc;
+    if (pVM->pgm.s.pLazyRestoreR3)
+    {
+        rc = pgmR3PhysLazyRestoreFetchExternal(pVM, GCPhys);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+
+    rc = pgmLock(pVM);
     AssertRCReturn(rc, rc);
 
     /*
@@ -0,0 +1,161 @@
+; $Id$
+;; @file
+; PGM - Page Manager and Monitor - Live Save Page Scanning Optimizations.
+;
+
+;
+; Copyright (C) 2016 Oracle Corporation
+;
+; This file is part of VirtualBox Open Source Edition (OSE), as
+; available from http://www.virtualbox.org. This file is free software;
+; you can redistribute it and/or modify it under the terms of the GNU
+; General Public License (GPL) as published by the Free Software
+; Foundation, in version 2 as it comes in the "COPYING" file of the
+; VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+; hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+;
+
+
+;*******************************************************************************
+;* Header Files                                                                *
+;*******************************************************************************
+%define RT_ASM_WITH_SEH64
+%include "VBox/asmdefs.mac"
+
+BEGINCODE
+
+
+;;
+; Hashes half a page using the SSE4.2 CRC32 instruction.
+;
+; The half page is split into four interleaved CRC-32C streams to keep the
+; CRC32 unit busy, the stream results are then folded into one value.  This
+; is not a standard CRC-32C and the value differs between 32-bit and 64-bit
+; hosts, which is fine since it's only compared with earlier results.
+;
+; @returns  The hash value in eax.
+; @param    pvHalfPage  [msc:rcx, gcc:rdi, x86:esp+04h]  The 2KB to hash.
+;
+; @remarks  The caller must make sure the CPU supports SSE4.2.
+;
+BEGINPROC pgmR3LiveHashHalfPageSse42
+%ifdef RT_ARCH_AMD64
+ %ifdef ASM_CALL64_MSC
+        mov     r10, rcx
+ %else
+        mov     r10, rdi
+ %endif
+SEH64_END_PROLOGUE
+        mov     eax, 0ffffffffh
+        mov     edx, eax
+        mov     r8d, eax
+        mov     r9d, eax
+        mov     r11d, 512 / 8
+.next:
+        crc32   rax, qword [r10]
+        crc32   rdx, qword [r10 + 512]
+        crc32   r8,  qword [r10 + 1024]
+        crc32   r9,  qword [r10 + 1536]
+        add     r10, 8
+        dec     r11d
+        jnz     .next
+
+        crc32   eax, edx
+        crc32   eax, r8d
+        crc32   eax, r9d
+        not     eax
+        ret
+
+%elifdef RT_ARCH_X86
+        push    ebp
+        mov     ebp, esp
+        push    ebx
+        push    esi
+        push    edi
+        mov     edi, [ebp + 08h]        ; pvHalfPage
+        mov     eax, 0ffffffffh
+        mov     edx, eax
+        mov     ebx, eax
+        mov     esi, eax
+        mov     ecx, 512 / 4
+.next:
+        crc32   eax, dword [edi]
+        crc32   edx, dword [edi + 512]
+        crc32   ebx, dword [edi + 1024]
+        crc32   esi, dword [edi + 1536]
+        add     edi, 4
+        dec     ecx
+        jnz     .next
+
+        crc32   eax, edx
+        crc32   eax, ebx
+        crc32   eax, esi
+        not     eax
+        pop     edi
+        pop     esi
+        pop     ebx
+        leave
+        ret
+%else
+ %error "Unsupported arch!"
+%endif
+ENDPROC   pgmR3LiveHashHalfPageSse42
+
+
+;;
+; Checks if a page is all zeros using SSE2.
+;
+; @returns  1 if all zeros, 0 if not (in eax).
+; @param    pvPage      [msc:rcx, gcc:rdi, x86:esp+04h]  The page.  No
+;                       alignment requirements.
+;
+; @remarks  The caller must make sure the CPU supports SSE2.
+;
+BEGINPROC pgmR3LiveIsZeroPageSse2
+%ifdef ASM_CALL64_MSC
+        mov     r10, rcx
+ %define pbPage r10
+%elifdef ASM_CALL64_GCC
+ %define pbPage rdi
+%elifdef RT_ARCH_X86
+        mov     ecx, [esp + 04h]
+ %define pbPage ecx
+%else
+ %error "Unsupported arch!"
+%endif
+SEH64_END_PROLOGUE
+        pxor    xmm4, xmm4
+        mov     edx, 4096 / 128
+.next:
+        movdqu  xmm0, [pbPage]
+        movdqu  xmm1, [pbPage + 16]
+        movdqu  xmm2, [pbPage + 32]
+        movdqu  xmm3, [pbPage + 48]
+        por     xmm0, xmm1
+        por     xmm2, xmm3
+        movdqu  xmm1, [pbPage + 64]
+        movdqu  xmm3, [pbPage + 80]
+        por     xmm0, xmm1
+        por     xmm2, xmm3
+        movdqu  xmm1, [pbPage + 96]
+        movdqu  xmm3, [pbPage + 112]
+        por     xmm0, xmm1
+        por     xmm2, xmm3
+        por     xmm0, xmm2
+        pcmpeqb xmm0, xmm4
+        pmovmskb eax, xmm0
+        cmp     eax, 0ffffh
+        jne     .not_zero
+        add     pbPage, 128
+        dec     edx
+        jnz     .next
+
+        mov     eax, 1
+        ret
+
+.not_zero:
+        xor     eax, eax
+        ret
+%undef pbPage
+ENDPROC   pgmR3LiveIsZeroPageSse2
+
@@ -34,12 +34,15 @@
 #include <VBox/vmm/ftm.h>
 
 #include <iprt/asm.h>
+#include <iprt/asm-amd64-x86.h>
 #include <iprt/assert.h>
 #include <iprt/crc.h>
 #include <iprt/mem.h>
 #include <iprt/sha.h>
 #include <iprt/string.h>
 #include <iprt/thread.h>
+#include <iprt/x86.h>
+#include <iprt/zero.h>
 
 
 /*********************************************************************************************************************************
@@ -103,6 +106,10 @@
 /** The CRC-32 for a zero half page. */
 #define PGM_STATE_CRC32_ZERO_HALF_PAGE  UINT32_C(0xf1e8ba9e)
 
+/** The max number of RAM pages pgmR3LoadMemory keeps mapped while SSM is
+ * decompressing their content on its worker threads. */
+#define PGM_LOAD_MAX_DEFERRED_PAGES     128
+
 
 
 /** @name Old Page types used in older saved states.
@@ -148,6 +155,30 @@ typedef struct
     PGMMODE                         enmGuestMode;
 } PGMOLD;
 
+/**
+ * The RAM pages pgmR3LoadMemory has handed to SSMR3GetMemDeferred.
+ *
+ * The mappings must be kept until SSMR3GetMemDeferredWait has returned.
+ */
+typedef struct PGMLOADDEFERRED
+{
+    /** Number of valid entries in aLocks. */
+    uint32_t                        cLocks;
+    /** Set if RAM pages are restored lazily (see @ref pg_pgm_lazy_restore). */
+    bool                            fLazy;
+    /** The page mapping locks. */
+    PGMPAGEMAPLOCK                  aLocks[PGM_LOAD_MAX_DEFERRED_PAGES];
+} PGMLOADDEFERRED;
+/** Pointer to the deferred RAM page loads. */
+typedef PGMLOADDEFERRED *PPGMLOADDEFERRED;
+
+
+/*********************************************************************************************************************************
+*   Internal Functions                                                                                                           *
+*********************************************************************************************************************************/
+DECLASM(uint32_t) pgmR3LiveHashHalfPageSse42(void const *pvHalfPage);
+DECLASM(bool)     pgmR3LiveIsZeroPageSse2(void const *pvPage);
+
 
 /*********************************************************************************************************************************
 *   Global Variables                                                                                                             *
@@ -628,6 +659,37 @@ static void pgmR3DoneRomPages(PVM pVM)
 }
 
 
+/**
+ * Hashes half a page for detecting changes to MMIO2 pages during live save.
+ *
+ * @returns Hash value, compare with PGM::LiveSave::u32ZeroHalfPageHash to
+ *          check for zero.
+ * @param   pVM                 The cross context VM structure.
+ * @param   pbHalfPage          The half page to hash.
+ */
+DECLINLINE(uint32_t) pgmR3LiveHashHalfPage(PVM pVM, uint8_t const *pbHalfPage)
+{
+    if (pVM->pgm.s.LiveSave.fHashSse42)
+        return pgmR3LiveHashHalfPageSse42(pbHalfPage);
+    return RTCrc32(pbHalfPage, PAGE_SIZE / 2);
+}
+
+
+/**
+ * Checks if a page is all zeros, using SSE2 when available.
+ *
+ * @returns true / false.
+ * @param   pVM                 The cross context VM structure.
+ * @param   pvPage              The page bits.
+ */
+DECLINLINE(bool) pgmR3LiveIsZeroPage(PVM pVM, void const *pvPage)
+{
+    if (pVM->pgm.s.LiveSave.fZeroCheckSse2)
+        return pgmR3LiveIsZeroPageSse2(pvPage);
+    return ASMMemIsZeroPage(pvPage);
+}
+
+
 /**
  * Prepares the MMIO2 pages for a live save.
  *
@@ -657,8 +719,8 @@ static int pgmR3PrepMmio2Pages(PVM pVM)
                 paLSPages[iPage].fDirty          = true;
                 paLSPages[iPage].cUnchangedScans = 0;
                 paLSPages[iPage].fZero           = true;
-                paLSPages[iPage].u32CrcH1        = PGM_STATE_CRC32_ZERO_HALF_PAGE;
-                paLSPages[iPage].u32CrcH2        = PGM_STATE_CRC32_ZERO_HALF_PAGE;
+                paLSPages[iPage].u32CrcH1        = pVM->pgm.s.LiveSave.u32ZeroHalfPageHash;
+                paLSPages[iPage].u32CrcH2        = pVM->pgm.s.LiveSave.u32ZeroHalfPageHash;
             }
 
             pgmLock(pVM);
@@ -809,7 +871,7 @@ DECLINLINE(bool) pgmR3ScanMmio2Page(PVM pVM, uint8_t const *pbPage, PPGMLIVESAVE
     bool const fZero = pLSPage->fZero;
     if (fZero)
     {
-        if (ASMMemIsZeroPage(pbPage))
+        if (pgmR3LiveIsZeroPage(pVM, pbPage))
         {
             /* Not modified. */
             if (pLSPage->fDirty)
@@ -818,7 +880,7 @@ DECLINLINE(bool) pgmR3ScanMmio2Page(PVM pVM, uint8_t const *pbPage, PPGMLIVESAVE
         }
 
         pLSPage->fZero    = false;
-        pLSPage->u32CrcH1 = RTCrc32(pbPage, PAGE_SIZE / 2);
+        pLSPage->u32CrcH1 = pgmR3LiveHashHalfPage(pVM, pbPage);
     }
     else
     {
@@ -826,10 +888,10 @@ DECLINLINE(bool) pgmR3ScanMmio2Page(PVM pVM, uint8_t const *pbPage, PPGMLIVESAVE
          * CRC the first half, if it doesn't match the page is dirty and
          * we won't check the 2nd half (we'll do that next time).
          */
-        uint32_t u32CrcH1 = RTCrc32(pbPage, PAGE_SIZE / 2);
+        uint32_t u32CrcH1 = pgmR3LiveHashHalfPage(pVM, pbPage);
         if (u32CrcH1 == pLSPage->u32CrcH1)
         {
-            uint32_t u32CrcH2 = RTCrc32(pbPage + PAGE_SIZE / 2, PAGE_SIZE / 2);
+            uint32_t u32CrcH2 = pgmR3LiveHashHalfPage(pVM, pbPage + PAGE_SIZE / 2);
             if (u32CrcH2 == pLSPage->u32CrcH2)
             {
                 /* Probably not modified. */
@@ -843,10 +905,10 @@ DECLINLINE(bool) pgmR3ScanMmio2Page(PVM pVM, uint8_t const *pbPage, PPGMLIVESAVE
         else
         {
             pLSPage->u32CrcH1 = u32CrcH1;
-            if (    u32CrcH1 == PGM_STATE_CRC32_ZERO_HALF_PAGE
-                &&  ASMMemIsZeroPage(pbPage))
+            if (    u32CrcH1 == pVM->pgm.s.LiveSave.u32ZeroHalfPageHash
+                &&  pgmR3LiveIsZeroPage(pVM, pbPage))
             {
-                pLSPage->u32CrcH2 = PGM_STATE_CRC32_ZERO_HALF_PAGE;
+                pLSPage->u32CrcH2 = pVM->pgm.s.LiveSave.u32ZeroHalfPageHash;
                 pLSPage->fZero    = true;
             }
         }
@@ -937,7 +999,7 @@ static int pgmR3SaveMmio2Pages(PVM pVM, PSSMHANDLE pSSM, bool fLiveSave, uint32_
                 {
                     uint8_t u8Type;
                     if (!fLiveSave)
-                        u8Type = ASMMemIsZeroPage(pbPage) ? PGM_STATE_REC_MMIO2_ZERO : PGM_STATE_REC_MMIO2_RAW;
+                        u8Type = pgmR3LiveIsZeroPage(pVM, pbPage) ? PGM_STATE_REC_MMIO2_ZERO : PGM_STATE_REC_MMIO2_RAW;
                     else
                     {
                         /* Try figure if it's a clean page, compare the SHA-1 to be really sure. */
@@ -1671,7 +1733,7 @@ static int pgmR3SaveRamPages(PVM pVM, PSSMHANDLE pSSM, bool fLiveSave, uint32_t
                         AssertLogRelMsgRCReturn(rc, ("rc=%Rrc GCPhys=%RGp\n", rc, GCPhys), rc);
 
                         /* Try save some memory when restoring. */
-                        if (!ASMMemIsZeroPage(pvPage))
+                        if (!pgmR3LiveIsZeroPage(pVM, pvPage))
                         {
                             if (fFTMDeltaSaveActive)
                             {
@@ -2010,6 +2072,12 @@ static DECLCALLBACK(int)  pgmR3LiveVote(PVM pVM, PSSMHANDLE pSSM, uint32_t uPass
  */
 static DECLCALLBACK(int) pgmR3LivePrep(PVM pVM, PSSMHANDLE pSSM)
 {
+    /*
+     * Load what's left of a lazy restore, the pages must be in RAM.
+     */
+    int rc = pgmR3LazyRestoreFinish(pVM);
+    AssertLogRelRCReturn(rc, rc);
+
     /*
      * Indicate that we will be using the write monitoring.
      */
@@ -2044,7 +2112,7 @@ static DECLCALLBACK(int) pgmR3LivePrep(PVM pVM, PSSMHANDLE pSSM)
     /*
      * Per page type.
      */
-    int rc = pgmR3PrepRomPages(pVM);
+    rc = pgmR3PrepRomPages(pVM);
     if (RT_SUCCESS(rc))
         rc = pgmR3PrepMmio2Pages(pVM);
     if (RT_SUCCESS(rc))
@@ -2055,6 +2123,20 @@ static DECLCALLBACK(int) pgmR3LivePrep(PVM pVM, PSSMHANDLE pSSM)
 }
 
 
+/**
+ * @callback_method_impl{FNSSMINTSAVEPREP}
+ *
+ * Loads what's left of a lazy restore before the RAM is saved.
+ */
+static DECLCALLBACK(int) pgmR3SavePrep(PVM pVM, PSSMHANDLE pSSM)
+{
+    NOREF(pSSM);
+    int rc = pgmR3LazyRestoreFinish(pVM);
+    AssertLogRelRC(rc);
+    return rc;
+}
+
+
 /**
  * @callback_method_impl{FNSSMINTSAVEEXEC}
  */
@@ -2608,21 +2690,41 @@ static int pgmR3LoadMemoryOld(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion)
 
 
 /**
- * Worker for pgmR3Load and pgmR3LoadLocked.
+ * Waits for the deferred RAM page loads and releases the page mappings.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 The cross context VM structure.
+ * @param   pSSM                The SSM handle.
+ * @param   pDeferred           The deferred page loads.
+ */
+static int pgmR3LoadMemoryFlushDeferred(PVM pVM, PSSMHANDLE pSSM, PPGMLOADDEFERRED pDeferred)
+{
+    if (!pDeferred->cLocks)
+        return VINF_SUCCESS;
+    int rc = SSMR3GetMemDeferredWait(pSSM);
+    for (uint32_t i = 0; i < pDeferred->cLocks; i++)
+        pgmPhysReleaseInternalPageMappingLock(pVM, &pDeferred->aLocks[i]);
+    pDeferred->cLocks = 0;
+    return rc;
+}
+
+
+/**
+ * Worker for pgmR3LoadMemory.
  *
  * @returns VBox status code.
  *
  * @param   pVM                 The cross context VM structure.
  * @param   pSSM                The SSM handle.
  * @param   uVersion            The PGM saved state unit version.
- * @param   uPass               The pass number.
+ * @param   pDeferred           The deferred page loads.  The caller flushes
+ *                              these when we return.
  *
  * @todo    This needs splitting up if more record types or code twists are
  *          added...
  */
-static int pgmR3LoadMemory(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t uPass)
+static int pgmR3LoadMemoryWorker(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, PPGMLOADDEFERRED pDeferred)
 {
-    NOREF(uPass);
 
     /*
      * Process page records until we hit the terminator.
@@ -2702,7 +2804,24 @@ static int pgmR3LoadMemory(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t
                     case PGM_STATE_REC_RAM_ZERO:
                     {
                         if (PGM_PAGE_IS_ZERO(pPage))
+                        {
+                            if (pDeferred->fLazy)
+                            {
+                                rc = pgmR3LazyRestoreAddPage(pVM, pRamHint, GCPhys, 0 /*uLocation*/);
+                                if (RT_FAILURE(rc))
+                                    return rc;
+                            }
                             break;
+                        }
+                        if (pDeferred->fLazy)
+                        {
+                            rc = pgmR3LazyRestoreAddPage(pVM, pRamHint, GCPhys, UINT64_MAX);
+                            if (RT_FAILURE(rc))
+                                return rc;
+                        }
+                        rc = pgmR3LoadMemoryFlushDeferred(pVM, pSSM, pDeferred);
+                        if (RT_FAILURE(rc))
+                            return rc;
 
                         /* Ballooned pages must be unmarked (live snapshot and
                            teleportation scenarios). */
@@ -2749,6 +2868,9 @@ static int pgmR3LoadMemory(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t
                         Assert(PGM_PAGE_GET_TYPE(pPage) == PGMPAGETYPE_RAM);
                         if (PGM_PAGE_IS_BALLOONED(pPage))
                             break;
+                        rc = pgmR3LoadMemoryFlushDeferred(pVM, pSSM, pDeferred);
+                        if (RT_FAILURE(rc))
+                            return rc;
 
                         /* We don't map ballooned pages in our shadow page tables, let's
                            just free it if allocated and mark as ballooned.  See @bugref{5515}. */
@@ -2770,14 +2892,61 @@ static int pgmR3LoadMemory(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t
 
                     case PGM_STATE_REC_RAM_RAW:
                     {
-                        PGMPAGEMAPLOCK PgMpLck;
-                        void          *pvDstPage;
-                        rc = pgmPhysGCPhys2CCPtrInternal(pVM, pPage, GCPhys, &pvDstPage, &PgMpLck);
-                        AssertLogRelMsgRCReturn(rc, ("GCPhys=%RGp %R[pgmpage] rc=%Rrc\n", GCPhys, pPage, rc), rc);
-                        rc = SSMR3GetMem(pSSM, pvDstPage, PAGE_SIZE);
-                        pgmPhysReleaseInternalPageMappingLock(pVM, &PgMpLck);
+                        /* Leave zero pages unbacked when the content is all zeros. */
+                        bool fZeroData;
+                        rc = SSMR3SkipZeroMem(pSSM, PAGE_SIZE, &fZeroData);
                         if (RT_FAILURE(rc))
                             return rc;
+                        if (fZeroData && PGM_PAGE_IS_ZERO(pPage))
+                        {
+                            if (pDeferred->fLazy)
+                            {
+                                rc = pgmR3LazyRestoreAddPage(pVM, pRamHint, GCPhys, 0 /*uLocation*/);
+                                if (RT_FAILURE(rc))
+                                    return rc;
+                            }
+                            break;
+                        }
+
+                        /* Leave unbacked RAM pages for the lazy restore to load. */
+                        if (pDeferred->fLazy)
+                        {
+                            uint64_t uLocation = 0;
+                            if (   PGM_PAGE_IS_ZERO(pPage)
+                                && PGM_PAGE_GET_TYPE(pPage) == PGMPAGETYPE_RAM)
+                            {
+                                rc = SSMR3GetMemLocation(pSSM, PAGE_SIZE, &uLocation);
+                                if (RT_FAILURE(rc))
+                                    return rc;
+                            }
+                            rc = pgmR3LazyRestoreAddPage(pVM, pRamHint, GCPhys, uLocation ? uLocation : UINT64_MAX);
+                            if (RT_FAILURE(rc))
+                                return rc;
+                            if (uLocation)
+                                break;
+                        }
+
+                        if (pDeferred->cLocks >= RT_ELEMENTS(pDeferred->aLocks))
+                        {
+                            rc = pgmR3LoadMemoryFlushDeferred(pVM, pSSM, pDeferred);
+                            if (RT_FAILURE(rc))
+                                return rc;
+                        }
+                        PPGMPAGEMAPLOCK pPgMpLck = &pDeferred->aLocks[pDeferred->cLocks];
+                        void           *pvDstPage;
+                        rc = pgmPhysGCPhys2CCPtrInternal(pVM, pPage, GCPhys, &pvDstPage, pPgMpLck);
+                        AssertLogRelMsgRCReturn(rc, ("GCPhys=%RGp %R[pgmpage] rc=%Rrc\n", GCPhys, pPage, rc), rc);
+                        pDeferred->cLocks++;
+                        if (fZeroData)
+                            ASMMemZeroPage(pvDstPage);
+                        else
+                        {
+                            /* The decompression may complete on an SSM worker thread, so
+                               the mapping lock is kept till the next flush. */
+                            rc = SSMR3GetMemDeferred(pSSM, pvDstPage, PAGE_SIZE);
+                            if (RT_FAILURE(rc))
+                                return rc;
+                        }
                         break;
                     }
 
@@ -2794,6 +2963,10 @@ static int pgmR3LoadMemory(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t
             case PGM_STATE_REC_MMIO2_RAW:
             case PGM_STATE_REC_MMIO2_ZERO:
             {
+                rc = pgmR3LoadMemoryFlushDeferred(pVM, pSSM, pDeferred);
+                if (RT_FAILURE(rc))
+                    return rc;
+
                 /*
                  * Get the ID + page number and resolved that into a MMIO2 page.
                  */
@@ -2841,6 +3014,10 @@ static int pgmR3LoadMemory(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t
             case PGM_STATE_REC_ROM_SHW_ZERO:
             case PGM_STATE_REC_ROM_PROT:
             {
+                rc = pgmR3LoadMemoryFlushDeferred(pVM, pSSM, pDeferred);
+                if (RT_FAILURE(rc))
+                    return rc;
+
                 /*
                  * Get the ID + page number and resolved that into a ROM page descriptor.
                  */
@@ -2973,6 +3150,39 @@ static int pgmR3LoadMemory(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t
 }
 
 
+/**
+ * Worker for pgmR3Load and pgmR3LoadLocked.
+ *
+ * RAM pages are loaded using SSMR3GetMemDeferred so that SSM can decompress
+ * them on its worker threads while we parse the next records, and pages that
+ * are zero in the saved state are left unbacked if they aren't backed already.
+ * With /PGM/LazyRestore, unbacked pages are instead left for loading after
+ * the VM has been resumed.
+ *
+ * @returns VBox status code.
+ *
+ * @param   pVM                 The cross context VM structure.
+ * @param   pSSM                The SSM handle.
+ * @param   uVersion            The PGM saved state unit version.
+ * @param   uPass               The pass number.
+ */
+static int pgmR3LoadMemory(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t uPass)
+{
+    PPGMLOADDEFERRED pDeferred = (PPGMLOADDEFERRED)RTMemTmpAlloc(sizeof(*pDeferred));
+    AssertReturn(pDeferred, VERR_NO_TMP_MEMORY);
+    pDeferred->cLocks = 0;
+    pDeferred->fLazy  = pgmR3LazyRestoreBegin(pVM, pSSM, uPass);
+
+    int rc  = pgmR3LoadMemoryWorker(pVM, pSSM, uVersion, pDeferred);
+    int rc2 = pgmR3LoadMemoryFlushDeferred(pVM, pSSM, pDeferred);
+    if (RT_SUCCESS(rc))
+        rc = rc2;
+
+    RTMemTmpFree(pDeferred);
+    return rc;
+}
+
+
 /**
  * Worker for pgmR3Load.
  *
@@ -3317,7 +3527,19 @@ static DECLCALLBACK(int) pgmR3Load(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion,
 static DECLCALLBACK(int) pgmR3LoadDone(PVM pVM, PSSMHANDLE pSSM)
 {
     pVM->pgm.s.fRestoreRomPagesOnReset = true;
-    NOREF(pSSM);
+
+    /*
+     * Start loading the lazily restored pages in the background.
+     */
+    if (pVM->pgm.s.pLazyRestoreR3)
+    {
+        int rc = VINF_SUCCESS;
+        if (RT_SUCCESS(SSMR3HandleGetStatus(pSSM)))
+            rc = pgmR3LazyRestoreStart(pVM);
+        if (RT_FAILURE(rc) || RT_FAILURE(SSMR3HandleGetStatus(pSSM)))
+            pgmR3LazyRestoreTerm(pVM, true /*fDestroyTimer*/);
+        return rc;
+    }
     return VINF_SUCCESS;
 }
 
@@ -3331,9 +3553,26 @@ static DECLCALLBACK(int) pgmR3LoadDone(PVM pVM, PSSMHANDLE pSSM)
  */
 int pgmR3InitSavedState(PVM pVM, uint64_t cbRam)
 {
+    /*
+     * Pick the page scanning code for live saving.
+     */
+    pVM->pgm.s.LiveSave.fHashSse42          = false;
+    pVM->pgm.s.LiveSave.fZeroCheckSse2      = false;
+    if (ASMHasCpuId())
+    {
+        uint32_t uEAX, uEBX, uECX, uEDX;
+        ASMCpuId(1, &uEAX, &uEBX, &uECX, &uEDX);
+        pVM->pgm.s.LiveSave.fHashSse42      = RT_BOOL(uECX & X86_CPUID_FEATURE_ECX_SSE4_2);
+        pVM->pgm.s.LiveSave.fZeroCheckSse2  = RT_BOOL(uEDX & X86_CPUID_FEATURE_EDX_SSE2);
+    }
+    pVM->pgm.s.LiveSave.u32ZeroHalfPageHash = pgmR3LiveHashHalfPage(pVM, g_abRTZeroPage);
+    Assert(pVM->pgm.s.LiveSave.fHashSse42 || pVM->pgm.s.LiveSave.u32ZeroHalfPageHash == PGM_STATE_CRC32_ZERO_HALF_PAGE);
+    LogRel(("PGM: Live save page scanning uses %s hashing and %s zero checks\n",
+            pVM->pgm.s.LiveSave.fHashSse42 ? "SSE4.2" : "CRC-32", pVM->pgm.s.LiveSave.fZeroCheckSse2 ? "SSE2" : "scalar"));
+
     return SSMR3RegisterInternal(pVM, "pgm", 1, PGM_SAVED_STATE_VERSION, (size_t)cbRam + sizeof(PGM),
                                  pgmR3LivePrep, pgmR3LiveExec, pgmR3LiveVote,
-                                 NULL,          pgmR3SaveExec, pgmR3SaveDone,
+                                 pgmR3SavePrep, pgmR3SaveExec, pgmR3SaveDone,
                                  pgmR3LoadPrep, pgmR3Load,     pgmR3LoadDone);
 }
 
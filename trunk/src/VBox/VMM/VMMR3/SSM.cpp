@@ -145,6 +145,7 @@
 *********************************************************************************************************************************/
 #define LOG_GROUP LOG_GROUP_SSM
 #include <VBox/vmm/ssm.h>
+#include <VBox/vmm/cfgm.h>
 #include <VBox/vmm/dbgf.h>
 #include <VBox/vmm/pdmapi.h>
 #include <VBox/vmm/pdmcritsect.h>
@@ -161,6 +162,7 @@
 #include <iprt/crc.h>
 #include <iprt/file.h>
 #include <iprt/mem.h>
+#include <iprt/mp.h>
 #include <iprt/param.h>
 #include <iprt/thread.h>
 #include <iprt/semaphore.h>
@@ -227,10 +229,14 @@
 /** Named data items.
  * A length prefix zero terminated string (i.e. max 255) followed by the data.  */
 #define SSM_REC_TYPE_NAMED                      5
+/** Raw data compressed by zlib.
+ * Same layout as SSM_REC_TYPE_RAW_LZF, the compressed data is a zlib stream
+ * (RFC 1950) produced by RTZipBlockCompress(RTZIPTYPE_ZLIB). */
+#define SSM_REC_TYPE_RAW_ZLIB                   6
 /** Macro for validating the record type.
  * This can be used with the flags+type byte, no need to mask out the type first. */
 #define SSM_REC_TYPE_IS_VALID(u8Type)           (   ((u8Type) & SSM_REC_TYPE_MASK) >  SSM_REC_TYPE_INVALID \
-                                                 && ((u8Type) & SSM_REC_TYPE_MASK) <= SSM_REC_TYPE_NAMED )
+                                                 && ((u8Type) & SSM_REC_TYPE_MASK) <= SSM_REC_TYPE_RAW_ZLIB )
 /** @} */
 
 /** The flag mask. */
@@ -285,6 +291,29 @@
 #define SSM_ZIP_BLOCK_SIZE                      _4K
 AssertCompile(SSM_ZIP_BLOCK_SIZE / _1K * _1K == SSM_ZIP_BLOCK_SIZE);
 
+/** The max number of compression worker threads. */
+#define SSM_ZIP_MAX_THREADS                     16
+/** The max number of SSM_ZIP_BLOCK_SIZE blocks in one compression job. */
+#define SSM_ZIP_JOB_MAX_BLOCKS                  16
+/** The max number of segments in one compression job.
+ * Adjacent raw segments are merged, so blocks and raw segments alternate. */
+#define SSM_ZIP_JOB_MAX_SEGS                    (SSM_ZIP_JOB_MAX_BLOCKS * 2 + 1)
+/** The size of the input buffer of a compression job. */
+#define SSM_ZIP_JOB_INPUT_SIZE                  ((SSM_ZIP_JOB_MAX_BLOCKS + 1) * SSM_ZIP_BLOCK_SIZE)
+/** The size of the output buffer of a compression job.
+ * A block record is at most 4 bytes larger than the block (incompressible). */
+#define SSM_ZIP_JOB_OUTPUT_SIZE                 (SSM_ZIP_JOB_INPUT_SIZE + SSM_ZIP_JOB_MAX_BLOCKS * 4)
+
+/** @name SSMZIPJOB::u32State
+ * @{ */
+/** The job is free or being filled by the producer. */
+#define SSMZIPJOB_STATE_FILLING                 UINT32_C(0)
+/** The job has been submitted and is waiting for a worker. */
+#define SSMZIPJOB_STATE_QUEUED                  UINT32_C(1)
+/** The job has been processed and can be written to the stream. */
+#define SSMZIPJOB_STATE_DONE                    UINT32_C(2)
+/** @} */
+
 
 /**
  * Asserts that the handle is writable and returns with VERR_SSM_INVALID_STATE
@@ -447,6 +476,104 @@ typedef struct SSMSTRM
 typedef SSMSTRM *PSSMSTRM;
 
 
+/**
+ * A segment of a compression or decompression job.
+ */
+typedef struct SSMZIPSEG
+{
+    /** Offset into SSMZIPJOB::abInput. */
+    uint32_t                offInput;
+    /** Number of input bytes. */
+    uint32_t                cb;
+    /** Set if this is a SSM_ZIP_BLOCK_SIZE block that should be compressed,
+     * clear if it is record bytes that are passed thru as-is. */
+    bool                    fCompress;
+    /** Decompression: The compression type of the input bytes. */
+    RTZIPTYPE               enmZipType;
+    /** Decompression: The size of the decompressed data. */
+    uint32_t                cbDst;
+    /** Decompression: Where to put the decompressed data. */
+    void                   *pvDst;
+} SSMZIPSEG;
+/** Pointer to a compression job segment. */
+typedef SSMZIPSEG *PSSMZIPSEG;
+
+/** Pointer to a compression job. */
+typedef struct SSMZIPJOB *PSSMZIPJOB;
+/**
+ * A compression job.
+ *
+ * This is a slice of the data unit stream with the blocks still uncompressed.
+ * A worker thread turns it into the final record bytes, which the producer then
+ * writes to the stream in submission order.
+ */
+typedef struct SSMZIPJOB
+{
+    /** The job state, SSMZIPJOB_STATE_XXX. */
+    uint32_t volatile       u32State;
+    /** Number of segments. */
+    uint32_t                cSegs;
+    /** Number of blocks to compress. */
+    uint32_t                cBlocks;
+    /** Number of bytes used in abInput. */
+    uint32_t                cbInput;
+    /** Number of bytes produced in abOutput. */
+    uint32_t                cbOutput;
+    /** Decompression: The status of the job. */
+    int32_t                 rc;
+    /** The segments. */
+    SSMZIPSEG               aSegs[SSM_ZIP_JOB_MAX_SEGS];
+    /** The input data. */
+    uint8_t                 abInput[SSM_ZIP_JOB_INPUT_SIZE];
+    /** The output data (complete records). */
+    uint8_t                 abOutput[SSM_ZIP_JOB_OUTPUT_SIZE];
+} SSMZIPJOB;
+
+/**
+ * Parallel compression pipeline for a write stream, or decompression pipeline
+ * for a read stream.
+ *
+ * Jobs are kept in a ring and are identified by a sequence number.  The
+ * producer fills the job at iSubmitted, the workers (and the producer, while
+ * it is waiting) claim jobs by advancing iClaimed, and the producer retires
+ * the completed jobs in order by advancing iRetired.
+ *
+ * When decompressing, the jobs carry compressed record payloads which the
+ * workers expand straight into the buffers given to SSMR3GetMemDeferred.
+ */
+typedef struct SSMZIP
+{
+    /** Set when the workers should quit. */
+    bool volatile           fTerminate;
+    /** Set if this is a decompression pipeline. */
+    bool                    fDecompress;
+    /** The number of worker threads. */
+    uint32_t                cThreads;
+    /** The number of jobs in the ring. */
+    uint32_t                cJobs;
+    /** How to compress the blocks (SSMHANDLE::u.Write.enmCompression). */
+    SSMCOMPRESSION          enmCompression;
+    /** Event that's signalled when a job is submitted. */
+    RTSEMEVENT              hEvtWork;
+    /** Event that's signalled when a job has been completed. */
+    RTSEMEVENT              hEvtDone;
+    /** Number of jobs submitted by the producer. */
+    uint64_t volatile       iSubmitted;
+    /** Number of jobs claimed for processing. */
+    uint64_t volatile       iClaimed;
+    /** Number of jobs written to the stream (producer only). */
+    uint64_t                iRetired;
+    /** The job currently being filled, NULL if none (producer only). */
+    PSSMZIPJOB              pCur;
+    /** The worker threads. */
+    RTTHREAD                ahThreads[SSM_ZIP_MAX_THREADS];
+    /** The job ring. */
+    PSSMZIPJOB              apJobs[SSM_ZIP_MAX_THREADS * 2];
+} SSMZIP;
+/** Pointer to a compression pipeline. */
+typedef SSMZIP *PSSMZIP;
+
+
 /**
  * Handle structure.
  */
@@ -514,6 +641,10 @@ typedef struct SSMHANDLE
             uint8_t         abDataBuffer[4096];
             /** The maximum downtime given as milliseconds. */
             uint32_t        cMsMaxDowntime;
+            /** How to compress the data blocks (never SSMCOMPRESSION_DEFAULT). */
+            SSMCOMPRESSION  enmCompression;
+            /** The parallel compression pipeline, NULL if compressing inline. */
+            PSSMZIP         pZip;
         } Write;
 
         /** Read data. */
@@ -528,6 +659,8 @@ typedef struct SSMHANDLE
 
             /** V2: Unread bytes in the current record. */
             uint32_t        cbRecLeft;
+            /** V2: The size of the current record (sans header). */
+            uint32_t        cbRec;
             /** V2: Bytes in the data buffer. */
             uint32_t        cbDataBuffer;
             /** V2: Current buffer position. */
@@ -536,6 +669,11 @@ typedef struct SSMHANDLE
             bool            fEndOfData;
             /** V2: The type and flags byte fo the current record. */
             uint8_t         u8TypeAndFlags;
+            /** V2: Set if we've tried creating pUnzip. */
+            bool            fUnzipTried;
+            /** V2: The parallel decompression pipeline used by SSMR3GetMemDeferred,
+             * NULL if not created (yet). */
+            PSSMZIP         pUnzip;
 
             /** @name Context info for SSMR3SetLoadError.
              * @{  */
@@ -3272,6 +3410,476 @@ DECLINLINE(bool) ssmR3IsHostMsc32(PSSMHANDLE pSSM)
 
 #ifndef SSM_STANDALONE
 
+/**
+ * Compresses a SSM_ZIP_BLOCK_SIZE block into a complete data record, falling
+ * back on a raw record if the block doesn't compress.
+ *
+ * @returns The size of the record, header included.
+ * @param   enmCompression  How to compress it.
+ * @param   pvBlock         The block to compress.
+ * @param   pb              Where to put the record.  There must be room for at
+ *                          least 1 + 3 + 1 + SSM_ZIP_BLOCK_SIZE bytes.
+ *
+ * @thread  Any.
+ */
+static uint32_t ssmR3DataCompressBlock(SSMCOMPRESSION enmCompression, void const *pvBlock, uint8_t *pb)
+{
+    AssertCompile(1 + 3 + 1 + SSM_ZIP_BLOCK_SIZE < 0x00010000);
+    uint8_t     u8Type;
+    RTZIPTYPE   enmZipType;
+    RTZIPLEVEL  enmZipLevel;
+    switch (enmCompression)
+    {
+        case SSMCOMPRESSION_FAST:   u8Type = SSM_REC_TYPE_RAW_LZF;  enmZipType = RTZIPTYPE_LZF;  enmZipLevel = RTZIPLEVEL_FAST;    break;
+        case SSMCOMPRESSION_SMALL:  u8Type = SSM_REC_TYPE_RAW_ZLIB; enmZipType = RTZIPTYPE_ZLIB; enmZipLevel = RTZIPLEVEL_FAST;    break;
+        case SSMCOMPRESSION_MAX:    u8Type = SSM_REC_TYPE_RAW_ZLIB; enmZipType = RTZIPTYPE_ZLIB; enmZipLevel = RTZIPLEVEL_MAX;     break;
+        default:                    u8Type = SSM_REC_TYPE_RAW;      enmZipType = RTZIPTYPE_STORE; enmZipLevel = RTZIPLEVEL_STORE; break;
+    }
+
+    size_t cbRec = SSM_ZIP_BLOCK_SIZE - (SSM_ZIP_BLOCK_SIZE / 16);
+    int rc = VERR_NOT_SUPPORTED;
+    if (u8Type != SSM_REC_TYPE_RAW)
+        rc = RTZipBlockCompress(enmZipType, enmZipLevel, 0 /*fFlags*/,
+                                pvBlock, SSM_ZIP_BLOCK_SIZE,
+                                pb + 1 + 3 + 1, cbRec, &cbRec);
+    if (RT_SUCCESS(rc))
+    {
+        pb[0] = SSM_REC_FLAGS_FIXED | SSM_REC_FLAGS_IMPORTANT | u8Type;
+        pb[4] = SSM_ZIP_BLOCK_SIZE / _1K;
+        cbRec += 1;
+    }
+    else
+    {
+        pb[0] = SSM_REC_FLAGS_FIXED | SSM_REC_FLAGS_IMPORTANT | SSM_REC_TYPE_RAW;
+        memcpy(&pb[4], pvBlock, SSM_ZIP_BLOCK_SIZE);
+        cbRec = SSM_ZIP_BLOCK_SIZE;
+    }
+    pb[1] = (uint8_t)(0xe0 | ( cbRec >> 12));
+    pb[2] = (uint8_t)(0x80 | ((cbRec >>  6) & 0x3f));
+    pb[3] = (uint8_t)(0x80 | ( cbRec        & 0x3f));
+    return (uint32_t)cbRec + 1 + 3;
+}
+
+
+/**
+ * Turns the input of a compression job into the final record bytes.
+ *
+ * @param   pZip            The compression pipeline.
+ * @param   pJob            The job.
+ *
+ * @thread  Any.
+ */
+static void ssmR3ZipProcessJob(PSSMZIP pZip, PSSMZIPJOB pJob)
+{
+    if (pZip->fDecompress)
+    {
+        int rc = VINF_SUCCESS;
+        for (uint32_t iSeg = 0; iSeg < pJob->cSegs && RT_SUCCESS(rc); iSeg++)
+        {
+            SSMZIPSEG const *pSeg = &pJob->aSegs[iSeg];
+            size_t cbDstActual = 0;
+            rc = RTZipBlockDecompress(pSeg->enmZipType, 0 /*fFlags*/,
+                                      &pJob->abInput[pSeg->offInput], pSeg->cb, NULL /*pcbSrcActual*/,
+                                      pSeg->pvDst, pSeg->cbDst, &cbDstActual);
+            if (RT_SUCCESS(rc) && cbDstActual != pSeg->cbDst)
+                rc = VERR_SSM_INTEGRITY_DECOMPRESSION;
+            if (RT_FAILURE(rc))
+            {
+                LogRel(("SSM: Deferred decompression failed: cbCompr=%#x cbDecompr=%#x rc=%Rrc\n", pSeg->cb, pSeg->cbDst, rc));
+                rc = VERR_SSM_INTEGRITY_DECOMPRESSION;
+            }
+        }
+        pJob->rc = rc;
+        return;
+    }
+
+    uint32_t offOutput = 0;
+    for (uint32_t iSeg = 0; iSeg < pJob->cSegs; iSeg++)
+    {
+        SSMZIPSEG const *pSeg = &pJob->aSegs[iSeg];
+        if (pSeg->fCompress)
+            offOutput += ssmR3DataCompressBlock(pZip->enmCompression, &pJob->abInput[pSeg->offInput],
+                                                &pJob->abOutput[offOutput]);
+        else
+        {
+            memcpy(&pJob->abOutput[offOutput], &pJob->abInput[pSeg->offInput], pSeg->cb);
+            offOutput += pSeg->cb;
+        }
+        Assert(offOutput <= sizeof(pJob->abOutput));
+    }
+    pJob->cbOutput = offOutput;
+}
+
+
+/**
+ * Claims and processes one queued compression job, if there is one.
+ *
+ * @returns true if a job was processed, false if there was nothing to do.
+ * @param   pZip            The compression pipeline.
+ *
+ * @thread  Any.
+ */
+static bool ssmR3ZipTryProcessOne(PSSMZIP pZip)
+{
+    for (;;)
+    {
+        uint64_t const iClaimed   = ASMAtomicReadU64(&pZip->iClaimed);
+        uint64_t const iSubmitted = ASMAtomicReadU64(&pZip->iSubmitted);
+        if (iClaimed >= iSubmitted)
+            return false;
+        if (ASMAtomicCmpXchgU64(&pZip->iClaimed, iClaimed + 1, iClaimed))
+        {
+            /* Wake up another worker if there is more to do, the event may
+               have collapsed several submissions into one wakeup. */
+            if (iClaimed + 1 < iSubmitted)
+                RTSemEventSignal(pZip->hEvtWork);
+
+            PSSMZIPJOB pJob = pZip->apJobs[iClaimed % pZip->cJobs];
+            Assert(pJob->u32State == SSMZIPJOB_STATE_QUEUED);
+            ssmR3ZipProcessJob(pZip, pJob);
+            ASMAtomicWriteU32(&pJob->u32State, SSMZIPJOB_STATE_DONE);
+
+            int rc = RTSemEventSignal(pZip->hEvtDone);
+            AssertRC(rc);
+            return true;
+        }
+    }
+}
+
+
+/**
+ * The compression worker thread.
+ *
+ * @returns VINF_SUCCESS (ignored).
+ * @param   hSelf       The thread handle.
+ * @param   pvZip       The compression pipeline.
+ */
+static DECLCALLBACK(int) ssmR3ZipThread(RTTHREAD hSelf, void *pvZip)
+{
+    PSSMZIP pZip = (PSSMZIP)pvZip;
+    NOREF(hSelf);
+
+    while (!ASMAtomicReadBool(&pZip->fTerminate))
+    {
+        if (!ssmR3ZipTryProcessOne(pZip))
+            RTSemEventWait(pZip->hEvtWork, RT_INDEFINITE_WAIT);
+    }
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Destroys a compression pipeline, discarding any pending jobs.
+ *
+ * @param   pZip            The compression pipeline.  NULL is ignored.
+ */
+static void ssmR3ZipDestroy(PSSMZIP pZip)
+{
+    if (!pZip)
+        return;
+
+    /*
+     * Stop the workers.  Keep kicking the event since each signal only wakes
+     * up one of them.
+     */
+    ASMAtomicWriteBool(&pZip->fTerminate, true);
+    for (uint32_t i = 0; i < pZip->cThreads; i++)
+    {
+        int rc;
+        do
+        {
+            RTSemEventSignal(pZip->hEvtWork);
+            rc = RTThreadWait(pZip->ahThreads[i], 100, NULL);
+        } while (rc == VERR_TIMEOUT);
+        AssertLogRelRC(rc);
+        pZip->ahThreads[i] = NIL_RTTHREAD;
+    }
+
+    for (uint32_t i = 0; i < pZip->cJobs; i++)
+    {
+        RTMemPageFree(pZip->apJobs[i], sizeof(*pZip->apJobs[i]));
+        pZip->apJobs[i] = NULL;
+    }
+
+    RTSemEventDestroy(pZip->hEvtWork);
+    pZip->hEvtWork = NIL_RTSEMEVENT;
+    RTSemEventDestroy(pZip->hEvtDone);
+    pZip->hEvtDone = NIL_RTSEMEVENT;
+    RTMemFree(pZip);
+}
+
+
+/**
+ * Sets up a parallel compression or decompression pipeline.
+ *
+ * Failures are not fatal, the caller just ends up doing the work inline.
+ *
+ * @returns Pointer to the pipeline, NULL if not configured or on failure.
+ * @param   pVM             The cross context VM structure.
+ * @param   fDecompress     Set for a decompression pipeline.
+ * @param   enmCompression  How to compress (ignored when decompressing).
+ */
+static PSSMZIP ssmR3ZipCreate(PVM pVM, bool fDecompress, SSMCOMPRESSION enmCompression)
+{
+    /** @cfgm{/SSM/ZipThreads, uint32_t, 0, 16, half the host CPUs}
+     * The number of threads compressing the saved state data, or decompressing
+     * it when restoring guest memory.  Zero means the EMT does all the work
+     * itself. */
+    uint32_t cThreads = RT_MIN(RTMpGetOnlineCount() / 2, SSM_ZIP_MAX_THREADS);
+    int rc = CFGMR3QueryU32Def(CFGMR3GetChild(CFGMR3GetRoot(pVM), "SSM"), "ZipThreads", &cThreads, cThreads);
+    AssertLogRelRCReturn(rc, NULL);
+    cThreads = RT_MIN(cThreads, SSM_ZIP_MAX_THREADS);
+    if (!cThreads)
+        return NULL;
+
+    PSSMZIP pZip = (PSSMZIP)RTMemAllocZ(sizeof(*pZip));
+    if (!pZip)
+        return NULL;
+    pZip->fDecompress    = fDecompress;
+    pZip->enmCompression = enmCompression;
+    pZip->hEvtWork = NIL_RTSEMEVENT;
+    pZip->hEvtDone = NIL_RTSEMEVENT;
+
+    rc = RTSemEventCreate(&pZip->hEvtWork);
+    if (RT_SUCCESS(rc))
+        rc = RTSemEventCreate(&pZip->hEvtDone);
+
+    /* Two jobs per worker so the saving thread can fill one while the other
+       is being compressed. */
+    for (uint32_t i = 0; i < cThreads * 2 && RT_SUCCESS(rc); i++)
+    {
+        pZip->apJobs[i] = (PSSMZIPJOB)RTMemPageAllocZ(sizeof(*pZip->apJobs[i]));
+        if (pZip->apJobs[i])
+            pZip->cJobs++;
+        else
+            rc = VERR_NO_MEMORY;
+    }
+
+    for (uint32_t i = 0; i < cThreads && RT_SUCCESS(rc); i++)
+    {
+        rc = RTThreadCreateF(&pZip->ahThreads[i], ssmR3ZipThread, pZip, 0, RTTHREADTYPE_DEFAULT, RTTHREADFLAGS_WAITABLE,
+                             fDecompress ? "SSM-Unzip%u" : "SSM-Zip%u", i);
+        if (RT_SUCCESS(rc))
+            pZip->cThreads++;
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        LogRel(("SSM: %s using %u threads\n", fDecompress ? "Decompressing" : "Compressing", pZip->cThreads));
+        return pZip;
+    }
+
+    LogRel(("SSM: Failed to set up %u compression threads (rc=%Rrc), doing it inline.\n", cThreads, rc));
+    ssmR3ZipDestroy(pZip);
+    return NULL;
+}
+
+
+/**
+ * Retires completed jobs in submission order.
+ *
+ * Compression output is written to the stream, decompression jobs only have
+ * their status collected.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ * @param   pZip            The pipeline.
+ * @param   iRetireTo       The jobs with lower sequence numbers than this are
+ *                          waited for, later ones are only retired if they
+ *                          have already been completed.
+ */
+static int ssmR3ZipRetire(PSSMHANDLE pSSM, PSSMZIP pZip, uint64_t iRetireTo)
+{
+    int rc = VINF_SUCCESS;
+    while (pZip->iRetired < pZip->iSubmitted)
+    {
+        PSSMZIPJOB pJob = pZip->apJobs[pZip->iRetired % pZip->cJobs];
+        while (ASMAtomicReadU32(&pJob->u32State) != SSMZIPJOB_STATE_DONE)
+        {
+            if (pZip->iRetired >= iRetireTo)
+                return rc;
+            /* Lend a hand while waiting. */
+            if (!ssmR3ZipTryProcessOne(pZip))
+                RTSemEventWait(pZip->hEvtDone, 1000);
+        }
+
+        if (RT_FAILURE(rc))
+        { /* keep the first error */ }
+        else if (pZip->fDecompress)
+            rc = pJob->rc;
+        else
+        {
+            rc = ssmR3StrmWrite(&pSSM->Strm, &pJob->abOutput[0], pJob->cbOutput);
+            if (RT_SUCCESS(rc))
+                pSSM->offUnit += pJob->cbOutput;
+        }
+        ASMAtomicWriteU32(&pJob->u32State, SSMZIPJOB_STATE_FILLING);
+        pZip->iRetired++;
+    }
+    return rc;
+}
+
+
+/**
+ * Submits the current compression job to the workers.
+ *
+ * @param   pZip            The compression pipeline.
+ */
+static void ssmR3ZipSubmit(PSSMZIP pZip)
+{
+    PSSMZIPJOB pJob = pZip->pCur;
+    Assert(pJob && pJob->cSegs > 0);
+    pZip->pCur = NULL;
+
+    ASMAtomicWriteU32(&pJob->u32State, SSMZIPJOB_STATE_QUEUED);
+    ASMAtomicIncU64(&pZip->iSubmitted);
+    int rc = RTSemEventSignal(pZip->hEvtWork);
+    AssertRC(rc);
+}
+
+
+/**
+ * Gets the job being filled, starting a new one if necessary.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ * @param   pZip            The pipeline.
+ * @param   ppJob           Where to return the job.
+ */
+static int ssmR3ZipGetCurJob(PSSMHANDLE pSSM, PSSMZIP pZip, PSSMZIPJOB *ppJob)
+{
+    PSSMZIPJOB pJob = pZip->pCur;
+    if (!pJob)
+    {
+        /* The ring is full, wait for the oldest job and retire it. */
+        if (pZip->iSubmitted - pZip->iRetired >= pZip->cJobs)
+        {
+            int rc = ssmR3ZipRetire(pSSM, pZip, pZip->iRetired + 1);
+            if (RT_FAILURE(rc))
+                return rc;
+        }
+
+        pJob = pZip->apJobs[pZip->iSubmitted % pZip->cJobs];
+        Assert(pJob->u32State == SSMZIPJOB_STATE_FILLING);
+        pJob->cSegs    = 0;
+        pJob->cBlocks  = 0;
+        pJob->cbInput  = 0;
+        pJob->cbOutput = 0;
+        pJob->rc       = VINF_SUCCESS;
+        pZip->pCur = pJob;
+    }
+    *ppJob = pJob;
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Queues a block for compression.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ * @param   pvBlock         The SSM_ZIP_BLOCK_SIZE block.  This is copied.
+ */
+static int ssmR3ZipAddBlock(PSSMHANDLE pSSM, void const *pvBlock)
+{
+    PSSMZIP    pZip = pSSM->u.Write.pZip;
+    PSSMZIPJOB pJob;
+    int rc = ssmR3ZipGetCurJob(pSSM, pZip, &pJob);
+    if (RT_FAILURE(rc))
+        return rc;
+    if (pJob->cbInput + SSM_ZIP_BLOCK_SIZE > sizeof(pJob->abInput))
+    {
+        ssmR3ZipSubmit(pZip);
+        rc = ssmR3ZipGetCurJob(pSSM, pZip, &pJob);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+    Assert(pJob->cSegs < SSM_ZIP_JOB_MAX_SEGS);
+
+    PSSMZIPSEG pSeg = &pJob->aSegs[pJob->cSegs++];
+    pSeg->offInput  = pJob->cbInput;
+    pSeg->cb        = SSM_ZIP_BLOCK_SIZE;
+    pSeg->fCompress = true;
+    memcpy(&pJob->abInput[pJob->cbInput], pvBlock, SSM_ZIP_BLOCK_SIZE);
+    pJob->cbInput  += SSM_ZIP_BLOCK_SIZE;
+
+    /* Submit it when full and write out whatever the workers have finished. */
+    if (++pJob->cBlocks >= SSM_ZIP_JOB_MAX_BLOCKS)
+    {
+        ssmR3ZipSubmit(pZip);
+        rc = ssmR3ZipRetire(pSSM, pZip, 0);
+    }
+    return rc;
+}
+
+
+/**
+ * Queues record bytes behind the pending compression jobs.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ * @param   pvBuf           The bytes to write.
+ * @param   cbBuf           The number of bytes to write.
+ */
+static int ssmR3ZipAddRaw(PSSMHANDLE pSSM, const void *pvBuf, size_t cbBuf)
+{
+    PSSMZIP pZip = pSSM->u.Write.pZip;
+    while (cbBuf > 0)
+    {
+        PSSMZIPJOB pJob;
+        int rc = ssmR3ZipGetCurJob(pSSM, pZip, &pJob);
+        if (RT_FAILURE(rc))
+            return rc;
+
+        /* Append to the previous segment if it's raw, otherwise start a new one. */
+        uint32_t   cbFree = sizeof(pJob->abInput) - pJob->cbInput;
+        PSSMZIPSEG pSeg   = pJob->cSegs ? &pJob->aSegs[pJob->cSegs - 1] : NULL;
+        bool       fNewSeg = !pSeg || pSeg->fCompress;
+        if (   !cbFree
+            || (fNewSeg && pJob->cSegs >= SSM_ZIP_JOB_MAX_SEGS))
+        {
+            ssmR3ZipSubmit(pZip);
+            continue;
+        }
+        if (fNewSeg)
+        {
+            pSeg = &pJob->aSegs[pJob->cSegs++];
+            pSeg->offInput  = pJob->cbInput;
+            pSeg->cb        = 0;
+            pSeg->fCompress = false;
+        }
+
+        uint32_t cbCopy = (uint32_t)RT_MIN(cbFree, cbBuf);
+        memcpy(&pJob->abInput[pJob->cbInput], pvBuf, cbCopy);
+        pJob->cbInput += cbCopy;
+        pSeg->cb      += cbCopy;
+        cbBuf         -= cbCopy;
+        pvBuf          = (uint8_t const *)pvBuf + cbCopy;
+    }
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Submits the current job and waits for all the pending ones to be retired.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ * @param   pZip            The pipeline.
+ */
+static int ssmR3ZipFlush(PSSMHANDLE pSSM, PSSMZIP pZip)
+{
+    if (pZip->pCur)
+    {
+        if (pZip->pCur->cSegs)
+            ssmR3ZipSubmit(pZip);
+        else
+            pZip->pCur = NULL;
+    }
+    return ssmR3ZipRetire(pSSM, pZip, pZip->iSubmitted);
+}
+
+
 /**
  * Finishes a data unit.
  * All buffers and compressor instances are flushed and destroyed.
@@ -3330,6 +3938,15 @@ static int ssmR3DataWriteRaw(PSSMHANDLE pSSM, const void *pvBuf, size_t cbBuf)
     if (RT_FAILURE(pSSM->rc))
         return pSSM->rc;
 
+    /*
+     * Queue it up behind the pending compression jobs to keep the order.
+     */
+    PSSMZIP pZip = pSSM->u.Write.pZip;
+    if (   pZip
+        && (   pZip->pCur
+            || pZip->iRetired != pZip->iSubmitted))
+        return ssmR3ZipAddRaw(pSSM, pvBuf, cbBuf);
+
     /*
      * Write the data item in 1MB chunks for progress indicator reasons.
      */
@@ -3445,6 +4062,30 @@ static int ssmR3DataFlushBuffer(PSSMHANDLE pSSM)
 }
 
 
+/**
+ * Flushes the buffered data and waits for the pending compression jobs to be
+ * written to the stream.
+ *
+ * This must be done before writing the termination record since it requires
+ * the stream CRC and the unit size to be up to date.
+ *
+ * @returns VBox status code. Will set pSSM->rc on error.
+ * @param   pSSM            The saved state handle.
+ */
+static int ssmR3DataFlushAll(PSSMHANDLE pSSM)
+{
+    int rc = ssmR3DataFlushBuffer(pSSM);
+    if (   RT_SUCCESS(rc)
+        && pSSM->u.Write.pZip)
+    {
+        rc = ssmR3ZipFlush(pSSM, pSSM->u.Write.pZip);
+        if (RT_FAILURE(rc) && RT_SUCCESS(pSSM->rc))
+            pSSM->rc = rc;
+    }
+    return rc;
+}
+
+
 /**
  * ssmR3DataWrite worker that writes big stuff.
  *
@@ -3472,38 +4113,27 @@ static int ssmR3DataWriteBig(PSSMHANDLE pSSM, const void *pvBuf, size_t cbBuf)
                )
             {
                 /*
-                 * Compress it.
+                 * Compress it, either by handing it to the worker threads or
+                 * straight into the stream buffer.
                  */
-                AssertCompile(1 + 3 + 1 + SSM_ZIP_BLOCK_SIZE < 0x00010000);
-                uint8_t *pb;
-                rc = ssmR3StrmReserveWriteBufferSpace(&pSSM->Strm, 1 + 3 + 1 + SSM_ZIP_BLOCK_SIZE, &pb);
-                if (RT_FAILURE(rc))
-                    break;
-                size_t cbRec = SSM_ZIP_BLOCK_SIZE - (SSM_ZIP_BLOCK_SIZE / 16);
-                rc = RTZipBlockCompress(RTZIPTYPE_LZF, RTZIPLEVEL_FAST, 0 /*fFlags*/,
-                                        pvBuf, SSM_ZIP_BLOCK_SIZE,
-                                        pb + 1 + 3 + 1, cbRec, &cbRec);
-                if (RT_SUCCESS(rc))
+                if (pSSM->u.Write.pZip)
                 {
-                    pb[0] = SSM_REC_FLAGS_FIXED | SSM_REC_FLAGS_IMPORTANT | SSM_REC_TYPE_RAW_LZF;
-                    pb[4] = SSM_ZIP_BLOCK_SIZE / _1K;
-                    cbRec += 1;
+                    rc = ssmR3ZipAddBlock(pSSM, pvBuf);
+                    if (RT_FAILURE(rc))
+                        break;
                 }
                 else
                 {
-                    pb[0] = SSM_REC_FLAGS_FIXED | SSM_REC_FLAGS_IMPORTANT | SSM_REC_TYPE_RAW;
-                    memcpy(&pb[4], pvBuf, SSM_ZIP_BLOCK_SIZE);
-                    cbRec = SSM_ZIP_BLOCK_SIZE;
+                    uint8_t *pb;
+                    rc = ssmR3StrmReserveWriteBufferSpace(&pSSM->Strm, 1 + 3 + 1 + SSM_ZIP_BLOCK_SIZE, &pb);
+                    if (RT_FAILURE(rc))
+                        break;
+                    uint32_t cbRec = ssmR3DataCompressBlock(pSSM->u.Write.enmCompression, pvBuf, pb);
+                    rc = ssmR3StrmCommitWriteBufferSpace(&pSSM->Strm, cbRec);
+                    if (RT_FAILURE(rc))
+                        break;
+                    pSSM->offUnit += cbRec;
                 }
-                pb[1] = (uint8_t)(0xe0 | ( cbRec >> 12));
-                pb[2] = (uint8_t)(0x80 | ((cbRec >>  6) & 0x3f));
-                pb[3] = (uint8_t)(0x80 | ( cbRec        & 0x3f));
-                cbRec += 1 + 3;
-                rc = ssmR3StrmCommitWriteBufferSpace(&pSSM->Strm, cbRec);
-                if (RT_FAILURE(rc))
-                    break;
-
-                pSSM->offUnit += cbRec;
                 ssmR3ProgressByByte(pSSM, SSM_ZIP_BLOCK_SIZE);
 
                 /* advance */
@@ -4434,7 +5064,7 @@ static int ssmR3LiveControlEmit(PSSMHANDLE pSSM, long double lrdPct, uint32_t uP
         AssertMsg(u16PartsPerTenThousand <= 10000, ("%u\n", u16PartsPerTenThousand));
         ssmR3DataWrite(pSSM, &u16PartsPerTenThousand, sizeof(u16PartsPerTenThousand));
 
-        rc = ssmR3DataFlushBuffer(pSSM); /* will return SSMHANDLE::rc if it is set */
+        rc = ssmR3DataFlushAll(pSSM); /* will return SSMHANDLE::rc if it is set */
         if (RT_SUCCESS(rc))
         {
             /*
@@ -4583,6 +5213,8 @@ static int ssmR3SaveDoClose(PVM pVM, PSSMHANDLE pSSM)
      * Make it non-cancellable, close the stream and delete the file on failure.
      */
     ssmR3SetCancellable(pVM, pSSM, false);
+    ssmR3ZipDestroy(pSSM->u.Write.pZip);
+    pSSM->u.Write.pZip = NULL;
     int rc = ssmR3StrmClose(&pSSM->Strm, pSSM->rc == VERR_SSM_CANCELLED);
     if (RT_SUCCESS(rc))
         rc = pSSM->rc;
@@ -4909,7 +5541,7 @@ static int ssmR3SaveDoExecRun(PVM pVM, PSSMHANDLE pSSM)
         if (RT_FAILURE(rc) && RT_SUCCESS_NP(pSSM->rc))
             pSSM->rc = rc;
         else
-            rc = ssmR3DataFlushBuffer(pSSM); /* will return SSMHANDLE::rc if it is set */
+            rc = ssmR3DataFlushAll(pSSM); /* will return SSMHANDLE::rc if it is set */
         if (RT_FAILURE(rc))
         {
             LogRel(("SSM: Execute save failed with rc=%Rrc for data unit '%s'/#%u.\n", rc, pUnit->szName, pUnit->u32Instance));
@@ -5147,6 +5779,7 @@ static int ssmR3WriteHeaderAndClearPerUnitData(PVM pVM, PSSMHANDLE pSSM)
  *                              used.
  * @param   pvStreamOpsUser     The user argument to the stream methods.
  * @param   enmAfter            What to do afterwards.
+ * @param   enmCompression      How to compress the data.
  * @param   pfnProgress         The progress callback.
  * @param   pvProgressUser      The progress callback user argument.
  * @param   ppSSM               Where to return the pointer to the saved state
@@ -5154,7 +5787,8 @@ static int ssmR3WriteHeaderAndClearPerUnitData(PVM pVM, PSSMHANDLE pSSM)
  *                              RTMemFree after closing the stream.
  */
 static int ssmR3SaveDoCreateFile(PVM pVM, const char *pszFilename, PCSSMSTRMOPS pStreamOps, void *pvStreamOpsUser,
-                                 SSMAFTER enmAfter, PFNVMPROGRESS pfnProgress, void *pvProgressUser, PSSMHANDLE *ppSSM)
+                                 SSMAFTER enmAfter, SSMCOMPRESSION enmCompression, PFNVMPROGRESS pfnProgress,
+                                 void *pvProgressUser, PSSMHANDLE *ppSSM)
 {
     PSSMHANDLE pSSM = (PSSMHANDLE)RTMemAllocZ(sizeof(*pSSM));
     if (!pSSM)
@@ -5183,6 +5817,8 @@ static int ssmR3SaveDoCreateFile(PVM pVM, const char *pszFilename, PCSSMSTRMOPS
     pSSM->pszFilename               = pszFilename;
     pSSM->u.Write.offDataBuffer     = 0;
     pSSM->u.Write.cMsMaxDowntime    = UINT32_MAX;
+    pSSM->u.Write.enmCompression    = enmCompression != SSMCOMPRESSION_DEFAULT ? enmCompression : SSMCOMPRESSION_FAST;
+    pSSM->u.Write.pZip              = NULL;
 
     int rc;
     if (pStreamOps)
@@ -5196,6 +5832,9 @@ static int ssmR3SaveDoCreateFile(PVM pVM, const char *pszFilename, PCSSMSTRMOPS
         return rc;
     }
 
+    if (pSSM->u.Write.enmCompression != SSMCOMPRESSION_NONE)
+        pSSM->u.Write.pZip = ssmR3ZipCreate(pVM, false /*fDecompress*/, pSSM->u.Write.enmCompression);
+
     *ppSSM = pSSM;
     return VINF_SUCCESS;
 }
@@ -5212,15 +5851,17 @@ static int ssmR3SaveDoCreateFile(PVM pVM, const char *pszFilename, PCSSMSTRMOPS
  *                          used.
  * @param   pvStreamOpsUser The user argument to the stream methods.
  * @param   enmAfter        What is planned after a successful save operation.
+ * @param   enmCompression  How to compress the data.
  * @param   pfnProgress     Progress callback. Optional.
  * @param   pvUser          User argument for the progress callback.
  *
  * @thread  EMT
  */
 VMMR3DECL(int) SSMR3Save(PVM pVM, const char *pszFilename, PCSSMSTRMOPS pStreamOps, void *pvStreamOpsUser,
-                         SSMAFTER enmAfter, PFNVMPROGRESS pfnProgress, void *pvUser)
+                         SSMAFTER enmAfter, SSMCOMPRESSION enmCompression, PFNVMPROGRESS pfnProgress, void *pvUser)
 {
-    LogFlow(("SSMR3Save: pszFilename=%p:{%s} enmAfter=%d pfnProgress=%p pvUser=%p\n", pszFilename, pszFilename, enmAfter, pfnProgress, pvUser));
+    LogFlow(("SSMR3Save: pszFilename=%p:{%s} enmAfter=%d enmCompression=%d pfnProgress=%p pvUser=%p\n",
+             pszFilename, pszFilename, enmAfter, enmCompression, pfnProgress, pvUser));
     VM_ASSERT_EMT0(pVM);
 
     /*
@@ -5230,6 +5871,9 @@ VMMR3DECL(int) SSMR3Save(PVM pVM, const char *pszFilename, PCSSMSTRMOPS pStreamO
                     || enmAfter == SSMAFTER_CONTINUE,
                     ("%d\n", enmAfter),
                     VERR_INVALID_PARAMETER);
+    AssertMsgReturn(enmCompression > SSMCOMPRESSION_INVALID && enmCompression < SSMCOMPRESSION_END,
+                    ("%d\n", enmCompression),
+                    VERR_INVALID_PARAMETER);
 
     AssertReturn(!pszFilename != !pStreamOps, VERR_INVALID_PARAMETER);
     if (pStreamOps)
@@ -5252,7 +5896,7 @@ VMMR3DECL(int) SSMR3Save(PVM pVM, const char *pszFilename, PCSSMSTRMOPS pStreamO
      */
     PSSMHANDLE pSSM;
     int rc = ssmR3SaveDoCreateFile(pVM, pszFilename, pStreamOps, pvStreamOpsUser,
-                                   enmAfter, pfnProgress, pvUser, &pSSM);
+                                   enmAfter, enmCompression, pfnProgress, pvUser, &pSSM);
     if (RT_FAILURE(rc))
         return rc;
     pSSM->uPercentLive    = 0;
@@ -5493,7 +6137,7 @@ static int ssmR3LiveDoExecRun(PVM pVM, PSSMHANDLE pSSM, uint32_t uPass)
         {
             if (rc == VINF_SSM_DONT_CALL_AGAIN)
                 pUnit->fDoneLive = true;
-            rc = ssmR3DataFlushBuffer(pSSM); /* will return SSMHANDLE::rc if it is set */
+            rc = ssmR3DataFlushAll(pSSM); /* will return SSMHANDLE::rc if it is set */
         }
         if (RT_FAILURE(rc))
         {
@@ -5730,6 +6374,7 @@ VMMR3_INT_DECL(int) SSMR3LiveDoStep1(PSSMHANDLE pSSM)
  *                          used.
  * @param   pvStreamOpsUser The user argument to the stream methods.
  * @param   enmAfter        What is planned after a successful save operation.
+ * @param   enmCompression  How to compress the data.
  * @param   pfnProgress     Progress callback. Optional.
  * @param   pvProgressUser  User argument for the progress callback.
  * @param   ppSSM           Where to return the saved state handle on success.
@@ -5738,11 +6383,11 @@ VMMR3_INT_DECL(int) SSMR3LiveDoStep1(PSSMHANDLE pSSM)
  */
 VMMR3_INT_DECL(int) SSMR3LiveSave(PVM pVM, uint32_t cMsMaxDowntime,
                                   const char *pszFilename, PCSSMSTRMOPS pStreamOps, void *pvStreamOpsUser,
-                                  SSMAFTER enmAfter, PFNVMPROGRESS pfnProgress, void *pvProgressUser,
-                                  PSSMHANDLE *ppSSM)
+                                  SSMAFTER enmAfter, SSMCOMPRESSION enmCompression, PFNVMPROGRESS pfnProgress,
+                                  void *pvProgressUser, PSSMHANDLE *ppSSM)
 {
-    LogFlow(("SSMR3LiveSave: cMsMaxDowntime=%u pszFilename=%p:{%s} pStreamOps=%p pvStreamOpsUser=%p enmAfter=%d pfnProgress=%p pvProgressUser=%p\n",
-             cMsMaxDowntime, pszFilename, pszFilename, pStreamOps, pvStreamOpsUser, enmAfter, pfnProgress, pvProgressUser));
+    LogFlow(("SSMR3LiveSave: cMsMaxDowntime=%u pszFilename=%p:{%s} pStreamOps=%p pvStreamOpsUser=%p enmAfter=%d enmCompression=%d pfnProgress=%p pvProgressUser=%p\n",
+             cMsMaxDowntime, pszFilename, pszFilename, pStreamOps, pvStreamOpsUser, enmAfter, enmCompression, pfnProgress, pvProgressUser));
     VM_ASSERT_EMT0(pVM);
 
     /*
@@ -5753,6 +6398,9 @@ VMMR3_INT_DECL(int) SSMR3LiveSave(PVM pVM, uint32_t cMsMaxDowntime,
                     || enmAfter == SSMAFTER_TELEPORT,
                     ("%d\n", enmAfter),
                     VERR_INVALID_PARAMETER);
+    AssertMsgReturn(enmCompression > SSMCOMPRESSION_INVALID && enmCompression < SSMCOMPRESSION_END,
+                    ("%d\n", enmCompression),
+                    VERR_INVALID_PARAMETER);
     AssertReturn(!pszFilename != !pStreamOps, VERR_INVALID_PARAMETER);
     if (pStreamOps)
     {
@@ -5774,7 +6422,7 @@ VMMR3_INT_DECL(int) SSMR3LiveSave(PVM pVM, uint32_t cMsMaxDowntime,
      */
     PSSMHANDLE pSSM;
     int rc = ssmR3SaveDoCreateFile(pVM, pszFilename, pStreamOps, pvStreamOpsUser,
-                                   enmAfter, pfnProgress, pvProgressUser, &pSSM);
+                                   enmAfter, enmCompression, pfnProgress, pvProgressUser, &pSSM);
     if (RT_FAILURE(rc))
         return rc;
     pSSM->uPercentLive           = 93;
@@ -5801,6 +6449,7 @@ VMMR3_INT_DECL(int) SSMR3LiveSave(PVM pVM, uint32_t cMsMaxDowntime,
         return VINF_SUCCESS;
     }
     /* bail out. */
+    ssmR3ZipDestroy(pSSM->u.Write.pZip);
     int rc2 = ssmR3StrmClose(&pSSM->Strm, pSSM->rc == VERR_SSM_CANCELLED);
     RTMemFree(pSSM);
     rc2 = RTFileDelete(pszFilename);
@@ -5939,6 +6588,7 @@ static void ssmR3DataReadBeginV2(PSSMHANDLE pSSM)
     pSSM->offUnit     = 0;
     pSSM->offUnitUser = 0;
     pSSM->u.Read.cbRecLeft      = 0;
+    pSSM->u.Read.cbRec          = 0;
     pSSM->u.Read.cbDataBuffer   = 0;
     pSSM->u.Read.offDataBuffer  = 0;
     pSSM->u.Read.fEndOfData     = false;
@@ -5958,9 +6608,19 @@ static void ssmR3DataReadBeginV2(PSSMHANDLE pSSM)
 static int ssmR3DataReadFinishV2(PSSMHANDLE pSSM)
 {
     /*
-     * If we haven't encountered the end of the record, it must be the next one.
+     * Wait for any deferred decompression the unit didn't wait for itself.
      */
     int rc = pSSM->rc;
+    if (pSSM->u.Read.pUnzip)
+    {
+        int rc2 = ssmR3ZipFlush(pSSM, pSSM->u.Read.pUnzip);
+        if (RT_FAILURE(rc2) && RT_SUCCESS(rc))
+            pSSM->rc = rc = rc2;
+    }
+
+    /*
+     * If we haven't encountered the end of the record, it must be the next one.
+     */
     if (    !pSSM->u.Read.fEndOfData
         &&  RT_SUCCESS(rc))
     {
@@ -6016,13 +6676,13 @@ DECLINLINE(int) ssmR3DataReadV2Raw(PSSMHANDLE pSSM, void *pvBuf, size_t cbToRead
 
 
 /**
- * Reads and checks the LZF "header".
+ * Reads and checks the LZF / zlib "header".
  *
  * @returns VBox status code. Sets pSSM->rc on error.
  * @param   pSSM            The saved state handle..
  * @param   pcbDecompr      Where to store the size of the decompressed data.
  */
-DECLINLINE(int) ssmR3DataReadV2RawLzfHdr(PSSMHANDLE pSSM, uint32_t *pcbDecompr)
+DECLINLINE(int) ssmR3DataReadV2RawComprHdr(PSSMHANDLE pSSM, uint32_t *pcbDecompr)
 {
     *pcbDecompr = 0; /* shuts up gcc. */
     AssertLogRelMsgReturn(   pSSM->u.Read.cbRecLeft > 1
@@ -6048,15 +6708,15 @@ DECLINLINE(int) ssmR3DataReadV2RawLzfHdr(PSSMHANDLE pSSM, uint32_t *pcbDecompr)
 
 
 /**
- * Reads an LZF block from the stream and decompresses into the specified
- * buffer.
+ * Reads an LZF or zlib block from the stream and decompresses into the
+ * specified buffer.
  *
  * @returns VBox status code. Sets pSSM->rc on error.
  * @param   pSSM            The saved state handle.
  * @param   pvDst           Pointer to the output buffer.
  * @param   cbDecompr       The size of the decompressed data.
  */
-static int ssmR3DataReadV2RawLzf(PSSMHANDLE pSSM, void *pvDst, size_t cbDecompr)
+static int ssmR3DataReadV2RawCompr(PSSMHANDLE pSSM, void *pvDst, size_t cbDecompr)
 {
     int         rc;
     uint32_t    cbCompr    = pSSM->u.Read.cbRecLeft;
@@ -6083,7 +6743,9 @@ static int ssmR3DataReadV2RawLzf(PSSMHANDLE pSSM, void *pvDst, size_t cbDecompr)
      * Decompress it.
      */
     size_t cbDstActual;
-    rc = RTZipBlockDecompress(RTZIPTYPE_LZF, 0 /*fFlags*/,
+    RTZIPTYPE const enmZipType = (pSSM->u.Read.u8TypeAndFlags & SSM_REC_TYPE_MASK) == SSM_REC_TYPE_RAW_ZLIB
+                               ? RTZIPTYPE_ZLIB : RTZIPTYPE_LZF;
+    rc = RTZipBlockDecompress(enmZipType, 0 /*fFlags*/,
                               pb, cbCompr, NULL /*pcbSrcActual*/,
                               pvDst, cbDecompr, &cbDstActual);
     if (RT_SUCCESS(rc))
@@ -6282,6 +6944,7 @@ static int ssmR3DataReadRecHdrV2(PSSMHANDLE pSSM)
 
         pSSM->u.Read.cbRecLeft = cb;
     }
+    pSSM->u.Read.cbRec = pSSM->u.Read.cbRecLeft;
 
     Log3(("ssmR3DataReadRecHdrV2: %08llx|%08llx/%08x: Type=%02x fImportant=%RTbool cbHdr=%u\n",
           ssmR3StrmTell(&pSSM->Strm), pSSM->offUnit, pSSM->u.Read.cbRecLeft,
@@ -6356,20 +7019,21 @@ static int ssmR3DataReadUnbufferedV2(PSSMHANDLE pSSM, void *pvBuf, size_t cbBuf)
             }
 
             case SSM_REC_TYPE_RAW_LZF:
+            case SSM_REC_TYPE_RAW_ZLIB:
             {
-                int rc = ssmR3DataReadV2RawLzfHdr(pSSM, &cbToRead);
+                int rc = ssmR3DataReadV2RawComprHdr(pSSM, &cbToRead);
                 if (RT_FAILURE(rc))
                     return rc;
                 if (cbToRead <= cbBuf)
                 {
-                    rc = ssmR3DataReadV2RawLzf(pSSM, pvBuf, cbToRead);
+                    rc = ssmR3DataReadV2RawCompr(pSSM, pvBuf, cbToRead);
                     if (RT_FAILURE(rc))
                         return rc;
                 }
                 else
                 {
                     /* The output buffer is too small, use the data buffer. */
-                    rc = ssmR3DataReadV2RawLzf(pSSM, &pSSM->u.Read.abDataBuffer[0], cbToRead);
+                    rc = ssmR3DataReadV2RawCompr(pSSM, &pSSM->u.Read.abDataBuffer[0], cbToRead);
                     if (RT_FAILURE(rc))
                         return rc;
                     pSSM->u.Read.cbDataBuffer  = cbToRead;
@@ -6479,11 +7143,12 @@ static int ssmR3DataReadBufferedV2(PSSMHANDLE pSSM, void *pvBuf, size_t cbBuf)
             }
 
             case SSM_REC_TYPE_RAW_LZF:
+            case SSM_REC_TYPE_RAW_ZLIB:
             {
-                int rc = ssmR3DataReadV2RawLzfHdr(pSSM, &cbToRead);
+                int rc = ssmR3DataReadV2RawComprHdr(pSSM, &cbToRead);
                 if (RT_FAILURE(rc))
                     return rc;
-                rc = ssmR3DataReadV2RawLzf(pSSM, &pSSM->u.Read.abDataBuffer[0], cbToRead);
+                rc = ssmR3DataReadV2RawCompr(pSSM, &pSSM->u.Read.abDataBuffer[0], cbToRead);
                 if (RT_FAILURE(rc))
                     return rc;
                 pSSM->u.Read.cbDataBuffer = cbToRead;
@@ -6567,6 +7232,106 @@ DECLINLINE(int) ssmR3DataRead(PSSMHANDLE pSSM, void *pvBuf, size_t cbBuf)
     return pSSM->rc;
 }
 
+#ifndef SSM_STANDALONE
+
+/**
+ * SSMR3GetMemDeferred worker that queues whole LZF and zlib records for
+ * decompression on the worker threads.
+ *
+ * Anything else is handed to ssmR3DataRead.
+ *
+ * @returns VBox status code. Sets pSSM->rc on error.
+ * @param   pSSM            The saved state handle.
+ * @param   pvBuf           Where to store the read data.
+ * @param   cbBuf           Number of bytes to read.
+ */
+static int ssmR3DataReadDeferredV2(PSSMHANDLE pSSM, void *pvBuf, size_t cbBuf)
+{
+    Assert(pSSM->u.Read.offDataBuffer == pSSM->u.Read.cbDataBuffer);
+
+    if (!pSSM->u.Read.fUnzipTried)
+    {
+        pSSM->u.Read.fUnzipTried = true;
+        pSSM->u.Read.pUnzip      = ssmR3ZipCreate(pSSM->pVM, true /*fDecompress*/, SSMCOMPRESSION_INVALID);
+    }
+    PSSMZIP pZip = pSSM->u.Read.pUnzip;
+    if (!pZip)
+        return ssmR3DataRead(pSSM, pvBuf, cbBuf);
+
+    /*
+     * Peek at the next record.
+     */
+    if (!pSSM->u.Read.cbRecLeft)
+    {
+        int rc = ssmR3DataReadRecHdrV2(pSSM);
+        if (RT_FAILURE(rc))
+            return pSSM->rc = rc;
+        AssertLogRelMsgReturn(!pSSM->u.Read.fEndOfData, ("cbBuf=%zu\n", cbBuf), pSSM->rc = VERR_SSM_LOADED_TOO_MUCH);
+    }
+    uint8_t const u8Type = pSSM->u.Read.u8TypeAndFlags & SSM_REC_TYPE_MASK;
+    if (   u8Type != SSM_REC_TYPE_RAW_LZF
+        && u8Type != SSM_REC_TYPE_RAW_ZLIB)
+        return ssmR3DataRead(pSSM, pvBuf, cbBuf);
+
+    uint32_t cbDecompr;
+    int rc = ssmR3DataReadV2RawComprHdr(pSSM, &cbDecompr);
+    if (RT_FAILURE(rc))
+        return rc;
+    if (cbDecompr != cbBuf)
+    {
+        /* Not a perfect fit, decompress it into the data buffer and let the
+           regular code take it from there. */
+        rc = ssmR3DataReadV2RawCompr(pSSM, &pSSM->u.Read.abDataBuffer[0], cbDecompr);
+        if (RT_FAILURE(rc))
+            return rc;
+        pSSM->u.Read.cbDataBuffer  = cbDecompr;
+        pSSM->u.Read.offDataBuffer = 0;
+        return ssmR3DataRead(pSSM, pvBuf, cbBuf);
+    }
+
+    /*
+     * Copy the compressed bytes into the current job.
+     */
+    uint32_t const cbCompr = pSSM->u.Read.cbRecLeft;
+    PSSMZIPJOB pJob;
+    rc = ssmR3ZipGetCurJob(pSSM, pZip, &pJob);
+    if (RT_SUCCESS(rc) && pJob->cbInput + cbCompr > sizeof(pJob->abInput))
+    {
+        ssmR3ZipSubmit(pZip);
+        rc = ssmR3ZipGetCurJob(pSSM, pZip, &pJob);
+    }
+    if (RT_FAILURE(rc))
+        return pSSM->rc = rc;
+
+    rc = ssmR3DataReadV2Raw(pSSM, &pJob->abInput[pJob->cbInput], cbCompr);
+    if (RT_FAILURE(rc))
+        return pSSM->rc = rc;
+    pSSM->u.Read.cbRecLeft = 0;
+    pSSM->offUnitUser     += cbBuf;
+
+    Assert(pJob->cSegs < SSM_ZIP_JOB_MAX_SEGS);
+    PSSMZIPSEG pSeg = &pJob->aSegs[pJob->cSegs++];
+    pSeg->offInput   = pJob->cbInput;
+    pSeg->cb         = cbCompr;
+    pSeg->fCompress  = false;
+    pSeg->enmZipType = u8Type == SSM_REC_TYPE_RAW_ZLIB ? RTZIPTYPE_ZLIB : RTZIPTYPE_LZF;
+    pSeg->cbDst      = cbDecompr;
+    pSeg->pvDst      = pvBuf;
+    pJob->cbInput   += cbCompr;
+
+    /* Submit it when full and collect whatever the workers have finished. */
+    if (++pJob->cBlocks >= SSM_ZIP_JOB_MAX_BLOCKS)
+    {
+        ssmR3ZipSubmit(pZip);
+        rc = ssmR3ZipRetire(pSSM, pZip, 0);
+        if (RT_FAILURE(rc))
+            pSSM->rc = rc;
+    }
+    return rc;
+}
+
+#endif /* !SSM_STANDALONE */
+
 
 /**
  * Gets a structure.
@@ -7430,6 +8195,297 @@ VMMR3DECL(int) SSMR3GetMem(PSSMHANDLE pSSM, void *pv, size_t cb)
 }
 
 
+/**
+ * Loads a memory item from the current data unit, possibly leaving the
+ * decompression to a worker thread.
+ *
+ * The memory must not be accessed or freed before SSMR3GetMemDeferredWait has
+ * been called.  SSM also waits when the load exec callback returns.  This is
+ * intended for bulk data like guest RAM, where the EMT can parse the next
+ * record while earlier ones are still being decompressed.
+ *
+ * @returns VBox status code.  Decompression errors are reported by
+ *          SSMR3GetMemDeferredWait.
+ * @param   pSSM            The saved state handle.
+ * @param   pv              Where to store the item.
+ * @param   cb              Size of the item.
+ */
+VMMR3DECL(int) SSMR3GetMemDeferred(PSSMHANDLE pSSM, void *pv, size_t cb)
+{
+    SSM_ASSERT_READABLE_RET(pSSM);
+    SSM_CHECK_CANCELLED_RET(pSSM);
+#ifndef SSM_STANDALONE
+    if (   RT_SUCCESS(pSSM->rc)
+        && pSSM->pVM
+        && pSSM->u.Read.uFmtVerMajor != 1
+        && pSSM->u.Read.offDataBuffer == pSSM->u.Read.cbDataBuffer)
+        return ssmR3DataReadDeferredV2(pSSM, pv, cb);
+#endif
+    return ssmR3DataRead(pSSM, pv, cb);
+}
+
+
+/**
+ * Waits for all the items loaded by SSMR3GetMemDeferred.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ */
+VMMR3DECL(int) SSMR3GetMemDeferredWait(PSSMHANDLE pSSM)
+{
+    SSM_ASSERT_READABLE_RET(pSSM);
+#ifndef SSM_STANDALONE
+    if (pSSM->u.Read.pUnzip)
+    {
+        int rc = ssmR3ZipFlush(pSSM, pSSM->u.Read.pUnzip);
+        if (RT_FAILURE(rc) && RT_SUCCESS(pSSM->rc))
+            pSSM->rc = rc;
+    }
+#endif
+    return pSSM->rc;
+}
+
+
+/**
+ * Skips the next @a cb bytes if the saved state has them recorded as zeros.
+ *
+ * This allows the caller to avoid touching (and thereby allocating) memory
+ * that is already zero.  When the data isn't known to be zero nothing is
+ * consumed and the caller should read it the normal way.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ * @param   cb              The number of bytes.
+ * @param   pfSkipped       Where to return whether the bytes were zeros and
+ *                          have been skipped.
+ */
+VMMR3DECL(int) SSMR3SkipZeroMem(PSSMHANDLE pSSM, size_t cb, bool *pfSkipped)
+{
+    *pfSkipped = false;
+    SSM_ASSERT_READABLE_RET(pSSM);
+    SSM_CHECK_CANCELLED_RET(pSSM);
+    if (RT_FAILURE(pSSM->rc))
+        return pSSM->rc;
+    if (   pSSM->u.Read.uFmtVerMajor == 1
+        || pSSM->u.Read.offDataBuffer != pSSM->u.Read.cbDataBuffer)
+        return VINF_SUCCESS;
+
+    /*
+     * Peek at the next record.
+     */
+    if (!pSSM->u.Read.cbRecLeft)
+    {
+        int rc = ssmR3DataReadRecHdrV2(pSSM);
+        if (RT_FAILURE(rc))
+            return pSSM->rc = rc;
+        AssertLogRelMsgReturn(!pSSM->u.Read.fEndOfData, ("cb=%zu\n", cb), pSSM->rc = VERR_SSM_LOADED_TOO_MUCH);
+    }
+    if ((pSSM->u.Read.u8TypeAndFlags & SSM_REC_TYPE_MASK) != SSM_REC_TYPE_RAW_ZERO)
+        return VINF_SUCCESS;
+
+    /*
+     * Consume it, spilling anything we don't skip into the data buffer.
+     */
+    uint32_t cbZero;
+    int rc = ssmR3DataReadV2RawZeroHdr(pSSM, &cbZero);
+    if (RT_FAILURE(rc))
+        return rc;
+    pSSM->u.Read.offDataBuffer = 0;
+    if (cbZero >= cb)
+    {
+        pSSM->u.Read.cbDataBuffer = cbZero - (uint32_t)cb;
+        pSSM->offUnitUser        += cb;
+        *pfSkipped = true;
+    }
+    else
+        pSSM->u.Read.cbDataBuffer = cbZero;
+    memset(&pSSM->u.Read.abDataBuffer[0], 0, pSSM->u.Read.cbDataBuffer);
+    return VINF_SUCCESS;
+}
+
+#ifndef SSM_STANDALONE
+
+/** @name Memory location cookies (SSMR3GetMemLocation).
+ * @{ */
+/** The record type. */
+#define SSM_MEM_LOC_TYPE_MASK           UINT64_C(0x0000000000000007)
+/** The size of the (compressed) data. */
+#define SSM_MEM_LOC_CB_MASK             UINT64_C(0x000000000000fff8)
+#define SSM_MEM_LOC_CB_SHIFT            3
+/** The file offset of the (compressed) data. */
+#define SSM_MEM_LOC_OFF_SHIFT           16
+/** @} */
+
+/**
+ * Skips a memory item and returns where it can be read from later.
+ *
+ * This only works for saved state files and for items SSM stored in one
+ * record, which is what a page sized SSMR3PutMem call produces.  When that
+ * isn't the case, nothing is consumed and the caller should read the item
+ * the normal way.  Zero items aren't indexed, use SSMR3SkipZeroMem first.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ * @param   cb              Size of the item.
+ * @param   puLocation      Where to return the location cookie for use with
+ *                          SSMR3ReadMemLocation.  Set to 0 if the item wasn't
+ *                          skipped.
+ */
+VMMR3DECL(int) SSMR3GetMemLocation(PSSMHANDLE pSSM, size_t cb, uint64_t *puLocation)
+{
+    *puLocation = 0;
+    SSM_ASSERT_READABLE_RET(pSSM);
+    SSM_CHECK_CANCELLED_RET(pSSM);
+    if (RT_FAILURE(pSSM->rc))
+        return pSSM->rc;
+    if (   !pSSM->pszFilename
+        || pSSM->u.Read.uFmtVerMajor == 1
+        || pSSM->u.Read.offDataBuffer != pSSM->u.Read.cbDataBuffer
+        || cb > sizeof(pSSM->u.Read.abDataBuffer))
+        return VINF_SUCCESS;
+
+    /*
+     * Peek at the next record and check that it is untouched and of the
+     * right kind and size.
+     */
+    if (!pSSM->u.Read.cbRecLeft)
+    {
+        int rc = ssmR3DataReadRecHdrV2(pSSM);
+        if (RT_FAILURE(rc))
+            return pSSM->rc = rc;
+        AssertLogRelMsgReturn(!pSSM->u.Read.fEndOfData, ("cb=%zu\n", cb), pSSM->rc = VERR_SSM_LOADED_TOO_MUCH);
+    }
+    if (pSSM->u.Read.cbRecLeft != pSSM->u.Read.cbRec)
+        return VINF_SUCCESS;
+
+    uint8_t const u8Type = pSSM->u.Read.u8TypeAndFlags & SSM_REC_TYPE_MASK;
+    uint32_t      cbData;
+    switch (u8Type)
+    {
+        case SSM_REC_TYPE_RAW:
+            if (pSSM->u.Read.cbRecLeft != cb)
+                return VINF_SUCCESS;
+            cbData = (uint32_t)cb;
+            break;
+
+        case SSM_REC_TYPE_RAW_LZF:
+        case SSM_REC_TYPE_RAW_ZLIB:
+        {
+            /* The decompressed size is in the first byte, which we have to
+               consume to find out.  The item is then read out of the
+               data buffer if the size doesn't match. */
+            uint32_t cbDecompr;
+            int rc = ssmR3DataReadV2RawComprHdr(pSSM, &cbDecompr);
+            if (RT_FAILURE(rc))
+                return rc;
+            if (cbDecompr != cb)
+            {
+                rc = ssmR3DataReadV2RawCompr(pSSM, &pSSM->u.Read.abDataBuffer[0], cbDecompr);
+                if (RT_FAILURE(rc))
+                    return rc;
+                pSSM->u.Read.cbDataBuffer  = cbDecompr;
+                pSSM->u.Read.offDataBuffer = 0;
+                return VINF_SUCCESS;
+            }
+            cbData = pSSM->u.Read.cbRecLeft;
+            break;
+        }
+
+        default:
+            return VINF_SUCCESS;
+    }
+
+    /*
+     * Note down the location and skip the data.
+     */
+    uint64_t const offData = ssmR3StrmTell(&pSSM->Strm);
+    int rc = ssmR3DataReadV2Raw(pSSM, &pSSM->u.Read.abComprBuffer[0], cbData);
+    if (RT_FAILURE(rc))
+        return pSSM->rc = rc;
+    pSSM->u.Read.cbRecLeft = 0;
+    pSSM->offUnitUser     += cb;
+
+    *puLocation = (offData << SSM_MEM_LOC_OFF_SHIFT)
+                | ((uint64_t)cbData << SSM_MEM_LOC_CB_SHIFT)
+                | u8Type;
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Opens the file of a saved state for use with SSMR3ReadMemLocation.
+ *
+ * The file handle stays valid after the saved state handle is closed, which
+ * allows loading memory items after the VM has been restored.  The file can
+ * be deleted while the handle is open (Main does so right after restoring),
+ * the content stays readable through the handle until it is closed.
+ *
+ * @returns VBox status code.  VERR_NOT_SUPPORTED if the saved state isn't
+ *          being loaded from a file.
+ * @param   pSSM            The saved state handle.
+ * @param   phFile          Where to return the file handle.  Close it using
+ *                          RTFileClose.
+ */
+VMMR3DECL(int) SSMR3OpenMemLocationFile(PSSMHANDLE pSSM, PRTFILE phFile)
+{
+    SSM_ASSERT_READABLE_RET(pSSM);
+    *phFile = NIL_RTFILE;
+    if (!pSSM->pszFilename)
+        return VERR_NOT_SUPPORTED;
+    return RTFileOpen(phFile, pSSM->pszFilename,
+                      RTFILE_O_READ | RTFILE_O_OPEN | RTFILE_O_DENY_NONE | RTFILE_O_DENY_NOT_DELETE);
+}
+
+
+/**
+ * Reads a memory item at a location returned by SSMR3GetMemLocation.
+ *
+ * @returns VBox status code.
+ * @param   hFile           The file handle returned by SSMR3OpenMemLocationFile.
+ * @param   uLocation       The location cookie.
+ * @param   pv              Where to store the item.
+ * @param   cb              Size of the item, must be the same as was passed to
+ *                          SSMR3GetMemLocation.
+ *
+ * @thread  Any.
+ */
+VMMR3DECL(int) SSMR3ReadMemLocation(RTFILE hFile, uint64_t uLocation, void *pv, size_t cb)
+{
+    uint8_t const  u8Type  = (uint8_t)(uLocation & SSM_MEM_LOC_TYPE_MASK);
+    uint32_t const cbData  = (uint32_t)((uLocation & SSM_MEM_LOC_CB_MASK) >> SSM_MEM_LOC_CB_SHIFT);
+    uint64_t const offData = uLocation >> SSM_MEM_LOC_OFF_SHIFT;
+    AssertReturn(cbData > 0 && cb <= _4K, VERR_INVALID_PARAMETER);
+
+    if (u8Type == SSM_REC_TYPE_RAW)
+    {
+        AssertReturn(cbData == cb, VERR_INVALID_PARAMETER);
+        return RTFileReadAt(hFile, offData, pv, cb, NULL);
+    }
+    AssertReturn(u8Type == SSM_REC_TYPE_RAW_LZF || u8Type == SSM_REC_TYPE_RAW_ZLIB, VERR_INVALID_PARAMETER);
+
+    uint8_t abCompr[_4K + 2];
+    AssertReturn(cbData <= sizeof(abCompr), VERR_INVALID_PARAMETER);
+    int rc = RTFileReadAt(hFile, offData, abCompr, cbData, NULL);
+    if (RT_SUCCESS(rc))
+    {
+        size_t cbDstActual;
+        rc = RTZipBlockDecompress(u8Type == SSM_REC_TYPE_RAW_ZLIB ? RTZIPTYPE_ZLIB : RTZIPTYPE_LZF, 0 /*fFlags*/,
+                                  abCompr, cbData, NULL /*pcbSrcActual*/,
+                                  pv, cb, &cbDstActual);
+        if (RT_SUCCESS(rc) && cbDstActual != cb)
+            rc = VERR_SSM_INTEGRITY_DECOMPRESSION;
+        if (RT_FAILURE(rc))
+        {
+            LogRel(("SSM: Failed to decompress %#x bytes at %#RX64: %Rrc\n", cbData, offData, rc));
+            rc = VERR_SSM_INTEGRITY_DECOMPRESSION;
+        }
+    }
+    return rc;
+}
+
+#endif /* !SSM_STANDALONE */
+
+
 /**
  * Loads a string item from the current data unit.
  *
@@ -8061,10 +9117,13 @@ static int ssmR3OpenFile(PVM pVM, const char *pszFilename, PCSSMSTRMOPS pStreamO
     pSSM->u.Read.cbLoadFile     = UINT64_MAX;
 
     pSSM->u.Read.cbRecLeft      = 0;
+    pSSM->u.Read.cbRec          = 0;
     pSSM->u.Read.cbDataBuffer   = 0;
     pSSM->u.Read.offDataBuffer  = 0;
     pSSM->u.Read.fEndOfData     = 0;
     pSSM->u.Read.u8TypeAndFlags = 0;
+    pSSM->u.Read.fUnzipTried    = false;
+    pSSM->u.Read.pUnzip         = NULL;
 
     pSSM->u.Read.pCurUnit       = NULL;
     pSSM->u.Read.uCurUnitVer    = UINT32_MAX;
@@ -8959,6 +10018,8 @@ VMMR3DECL(int) SSMR3Load(PVM pVM, const char *pszFilename, PCSSMSTRMOPS pStreamO
             pfnProgress(pVM->pUVM, 99, pvProgressUser);
 
         ssmR3SetCancellable(pVM, &Handle, false);
+        ssmR3ZipDestroy(Handle.u.Read.pUnzip);
+        Handle.u.Read.pUnzip = NULL;
         ssmR3StrmClose(&Handle.Strm, Handle.rc == VERR_SSM_CANCELLED);
         rc = Handle.rc;
     }
@@ -9183,6 +10244,10 @@ VMMR3DECL(int) SSMR3Close(PSSMHANDLE pSSM)
     /*
      * Close the stream and free the handle.
      */
+#ifndef SSM_STANDALONE
+    ssmR3ZipDestroy(pSSM->u.Read.pUnzip);
+    pSSM->u.Read.pUnzip = NULL;
+#endif
     int rc = ssmR3StrmClose(&pSSM->Strm, pSSM->rc == VERR_SSM_CANCELLED);
     if (pSSM->u.Read.pZipDecompV1)
     {
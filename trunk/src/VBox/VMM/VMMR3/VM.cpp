@@ -1760,6 +1760,7 @@ static DECLCALLBACK(int) vmR3LiveDoStep2(PVM pVM, PSSMHANDLE pSSM)
  * @param   pStreamOps          The stream methods.  NULL if pszFilename is used.
  * @param   pvStreamOpsUser     The user argument to the stream methods.
  * @param   enmAfter            What to do afterwards.
+ * @param   enmCompression      How to compress the saved state data.
  * @param   pfnProgress         Progress callback. Optional.
  * @param   pvProgressUser      User argument for the progress callback.
  * @param   ppSSM               Where to return the saved state handle in case of a
@@ -1769,13 +1770,13 @@ static DECLCALLBACK(int) vmR3LiveDoStep2(PVM pVM, PSSMHANDLE pSSM)
  * @thread  EMT
  */
 static DECLCALLBACK(int) vmR3Save(PVM pVM, uint32_t cMsMaxDowntime, const char *pszFilename, PCSSMSTRMOPS pStreamOps, void *pvStreamOpsUser,
-                                  SSMAFTER enmAfter, PFNVMPROGRESS pfnProgress, void *pvProgressUser, PSSMHANDLE *ppSSM,
-                                  bool fSkipStateChanges)
+                                  SSMAFTER enmAfter, SSMCOMPRESSION enmCompression, PFNVMPROGRESS pfnProgress, void *pvProgressUser,
+                                  PSSMHANDLE *ppSSM, bool fSkipStateChanges)
 {
     int rc = VINF_SUCCESS;
 
-    LogFlow(("vmR3Save: pVM=%p cMsMaxDowntime=%u pszFilename=%p:{%s} pStreamOps=%p pvStreamOpsUser=%p enmAfter=%d pfnProgress=%p pvProgressUser=%p ppSSM=%p\n",
-             pVM, cMsMaxDowntime, pszFilename, pszFilename, pStreamOps, pvStreamOpsUser, enmAfter, pfnProgress, pvProgressUser, ppSSM));
+    LogFlow(("vmR3Save: pVM=%p cMsMaxDowntime=%u pszFilename=%p:{%s} pStreamOps=%p pvStreamOpsUser=%p enmAfter=%d enmCompression=%d pfnProgress=%p pvProgressUser=%p ppSSM=%p\n",
+             pVM, cMsMaxDowntime, pszFilename, pszFilename, pStreamOps, pvStreamOpsUser, enmAfter, enmCompression, pfnProgress, pvProgressUser, ppSSM));
 
     /*
      * Validate input.
@@ -1806,7 +1807,7 @@ static DECLCALLBACK(int) vmR3Save(PVM pVM, uint32_t cMsMaxDowntime, const char *
 
     if (rc == 1 && enmAfter != SSMAFTER_TELEPORT)
     {
-        rc = SSMR3Save(pVM, pszFilename, pStreamOps, pvStreamOpsUser, enmAfter, pfnProgress, pvProgressUser);
+        rc = SSMR3Save(pVM, pszFilename, pStreamOps, pvStreamOpsUser, enmAfter, enmCompression, pfnProgress, pvProgressUser);
         if (!fSkipStateChanges)
             vmR3SetState(pVM, VMSTATE_SUSPENDED, VMSTATE_SAVING);
     }
@@ -1816,7 +1817,7 @@ static DECLCALLBACK(int) vmR3Save(PVM pVM, uint32_t cMsMaxDowntime, const char *
         if (enmAfter == SSMAFTER_TELEPORT)
             pVM->vm.s.fTeleportedAndNotFullyResumedYet = true;
         rc = SSMR3LiveSave(pVM, cMsMaxDowntime, pszFilename, pStreamOps, pvStreamOpsUser,
-                           enmAfter, pfnProgress, pvProgressUser, ppSSM);
+                           enmAfter, enmCompression, pfnProgress, pvProgressUser, ppSSM);
         /* (We're not subject to cancellation just yet.) */
     }
     else
@@ -1836,6 +1837,7 @@ static DECLCALLBACK(int) vmR3Save(PVM pVM, uint32_t cMsMaxDowntime, const char *
  * @param   pStreamOps          The stream methods.  NULL if pszFilename is used.
  * @param   pvStreamOpsUser     The user argument to the stream methods.
  * @param   enmAfter            What to do afterwards.
+ * @param   enmCompression      How to compress the saved state data.
  * @param   pfnProgress         Progress callback. Optional.
  * @param   pvProgressUser      User argument for the progress callback.
  * @param   pfSuspended         Set if we suspended the VM.
@@ -1845,16 +1847,16 @@ static DECLCALLBACK(int) vmR3Save(PVM pVM, uint32_t cMsMaxDowntime, const char *
  */
 static int vmR3SaveTeleport(PVM pVM, uint32_t cMsMaxDowntime,
                             const char *pszFilename, PCSSMSTRMOPS pStreamOps, void *pvStreamOpsUser,
-                            SSMAFTER enmAfter, PFNVMPROGRESS pfnProgress, void *pvProgressUser, bool *pfSuspended,
-                            bool fSkipStateChanges)
+                            SSMAFTER enmAfter, SSMCOMPRESSION enmCompression, PFNVMPROGRESS pfnProgress, void *pvProgressUser,
+                            bool *pfSuspended, bool fSkipStateChanges)
 {
     /*
      * Request the operation in EMT(0).
      */
     PSSMHANDLE pSSM;
     int rc = VMR3ReqCallWait(pVM, 0 /*idDstCpu*/,
-                             (PFNRT)vmR3Save, 10, pVM, cMsMaxDowntime, pszFilename, pStreamOps, pvStreamOpsUser,
-                             enmAfter, pfnProgress, pvProgressUser, &pSSM, fSkipStateChanges);
+                             (PFNRT)vmR3Save, 11, pVM, cMsMaxDowntime, pszFilename, pStreamOps, pvStreamOpsUser,
+                             enmAfter, enmCompression, pfnProgress, pvProgressUser, &pSSM, fSkipStateChanges);
     if (    RT_SUCCESS(rc)
         &&  pSSM)
     {
@@ -1921,6 +1923,8 @@ static int vmR3SaveTeleport(PVM pVM, uint32_t cMsMaxDowntime,
  * @param   pszFilename         The name of the save state file.
  * @param   fContinueAfterwards Whether continue execution afterwards or not.
  *                              When in doubt, set this to true.
+ * @param   enmCompression      How to compress the saved state data.  When in
+ *                              doubt, use SSMCOMPRESSION_DEFAULT.
  * @param   pfnProgress         Progress callback. Optional.
  * @param   pvUser              User argument for the progress callback.
  * @param   pfSuspended         Set if we suspended the VM.
@@ -1930,11 +1934,11 @@ static int vmR3SaveTeleport(PVM pVM, uint32_t cMsMaxDowntime,
  * @vmstateto   Saving+Suspended or
  *              RunningLS+SuspendingLS+SuspendedLS+Saving+Suspended.
  */
-VMMR3DECL(int) VMR3Save(PUVM pUVM, const char *pszFilename, bool fContinueAfterwards, PFNVMPROGRESS pfnProgress, void *pvUser,
-                        bool *pfSuspended)
+VMMR3DECL(int) VMR3Save(PUVM pUVM, const char *pszFilename, bool fContinueAfterwards, SSMCOMPRESSION enmCompression,
+                        PFNVMPROGRESS pfnProgress, void *pvUser, bool *pfSuspended)
 {
-    LogFlow(("VMR3Save: pUVM=%p pszFilename=%p:{%s} fContinueAfterwards=%RTbool pfnProgress=%p pvUser=%p pfSuspended=%p\n",
-             pUVM, pszFilename, pszFilename, fContinueAfterwards, pfnProgress, pvUser, pfSuspended));
+    LogFlow(("VMR3Save: pUVM=%p pszFilename=%p:{%s} fContinueAfterwards=%RTbool enmCompression=%d pfnProgress=%p pvUser=%p pfSuspended=%p\n",
+             pUVM, pszFilename, pszFilename, fContinueAfterwards, enmCompression, pfnProgress, pvUser, pfSuspended));
 
     /*
      * Validate input.
@@ -1947,6 +1951,7 @@ VMMR3DECL(int) VMR3Save(PUVM pUVM, const char *pszFilename, bool fContinueAfterw
     VM_ASSERT_OTHER_THREAD(pVM);
     AssertReturn(VALID_PTR(pszFilename), VERR_INVALID_POINTER);
     AssertReturn(*pszFilename, VERR_INVALID_PARAMETER);
+    AssertReturn(enmCompression > SSMCOMPRESSION_INVALID && enmCompression < SSMCOMPRESSION_END, VERR_INVALID_PARAMETER);
     AssertPtrNullReturn(pfnProgress, VERR_INVALID_POINTER);
 
     /*
@@ -1955,7 +1960,7 @@ VMMR3DECL(int) VMR3Save(PUVM pUVM, const char *pszFilename, bool fContinueAfterw
     SSMAFTER enmAfter = fContinueAfterwards ? SSMAFTER_CONTINUE : SSMAFTER_DESTROY;
     int rc = vmR3SaveTeleport(pVM, 250 /*cMsMaxDowntime*/,
                               pszFilename, NULL /* pStreamOps */, NULL /* pvStreamOpsUser */,
-                              enmAfter, pfnProgress, pvUser, pfSuspended,
+                              enmAfter, enmCompression, pfnProgress, pvUser, pfSuspended,
                               false /* fSkipStateChanges */);
     LogFlow(("VMR3Save: returns %Rrc (*pfSuspended=%RTbool)\n", rc, *pfSuspended));
     return rc;
@@ -1998,7 +2003,7 @@ VMMR3_INT_DECL(int) VMR3SaveFT(PUVM pUVM, PCSSMSTRMOPS pStreamOps, void *pvStrea
      */
     int rc = vmR3SaveTeleport(pVM, 250 /*cMsMaxDowntime*/,
                               NULL, pStreamOps, pvStreamOpsUser,
-                              SSMAFTER_CONTINUE, NULL, NULL, pfSuspended,
+                              SSMAFTER_CONTINUE, SSMCOMPRESSION_DEFAULT, NULL, NULL, pfSuspended,
                               fSkipStateChanges);
     LogFlow(("VMR3SaveFT: returns %Rrc (*pfSuspended=%RTbool)\n", rc, *pfSuspended));
     return rc;
@@ -2046,7 +2051,7 @@ VMMR3DECL(int) VMR3Teleport(PUVM pUVM, uint32_t cMsMaxDowntime, PCSSMSTRMOPS pSt
      */
     int rc = vmR3SaveTeleport(pVM, cMsMaxDowntime,
                               NULL /*pszFilename*/, pStreamOps, pvStreamOpsUser,
-                              SSMAFTER_TELEPORT, pfnProgress, pvProgressUser, pfSuspended,
+                              SSMAFTER_TELEPORT, SSMCOMPRESSION_DEFAULT, pfnProgress, pvProgressUser, pfSuspended,
                               false /* fSkipStateChanges */);
     LogFlow(("VMR3Teleport: returns %Rrc (*pfSuspended=%RTbool)\n", rc, *pfSuspended));
     return rc;
@@ -22,6 +22,7 @@
 #include <VBox/vmm/stam.h>
 #include <VBox/vmm/tm.h>
 #include <iprt/types.h>
+#include <iprt/cpuset.h>
 #include <iprt/file.h>
 #include <iprt/thread.h>
 #include <iprt/semaphore.h>
@@ -48,6 +49,13 @@
 # define PDM_ASYNC_COMPLETION_FILE_WITH_DELAY
 #endif
 
+/** Defined when a file can't be associated with another async I/O context
+ * after it was associated with one (I/O completion ports on Windows), so
+ * endpoints can't move between the per CPU group managers. */
+#ifdef RT_OS_WINDOWS
+# define PDMACEPFILE_AIO_CTX_ASSOCIATION_PERMANENT
+#endif
+
 RT_C_DECLS_BEGIN
 
 /**
@@ -145,6 +153,14 @@ typedef struct PDMACEPFILEMGR
     R3PTRTYPE(struct PDMACEPFILEMGR *)     pPrev;
     /** Manager type */
     PDMACEPFILEMGRTYPE                     enmMgrType;
+    /** The CPU group this manager serves when per CPU managers are enabled,
+     * UINT32_MAX for the shared manager. */
+    uint32_t                               idxCpuGroup;
+    /** The host CPUs the manager thread is bound to, empty for no binding. */
+    RTCPUSET                               AffinitySet;
+    /** Endpoints handed over by other managers, waiting to be adopted.
+     * Singly linked LIFO thru AioMgr.pEndpointNext, pushed without locking. */
+    R3PTRTYPE(volatile PPDMASYNCCOMPLETIONENDPOINTFILE) pEndpointsHandOverHead;
     /** Current state of the manager. */
     PDMACEPFILEMGRSTATE                    enmState;
     /** Event semaphore the manager sleeps on when waiting for new requests. */
@@ -263,6 +279,14 @@ typedef struct PDMASYNCCOMPLETIONEPCLASSFILE
     R3PTRTYPE(PPDMACEPFILEMGR)          pAioMgrHead;
     /** Number of async I/O managers currently running. */
     unsigned                            cAioMgrs;
+    /** Number of host CPUs sharing one async I/O manager, 0 if all endpoints
+     * share a single manager (the default). */
+    uint32_t                            cCpusPerAioMgr;
+    /** Number of CPU groups (size of papAioMgrCpuGroups). */
+    uint32_t                            cCpuGroups;
+    /** The async I/O manager of each CPU group, created on demand.
+     * Protected by CritSect. */
+    R3PTRTYPE(PPDMACEPFILEMGR *)        papAioMgrCpuGroups;
     /** Maximum number of segments to cache per endpoint */
     unsigned                            cTasksCacheMax;
     /** Maximum number of simultaneous outstandingrequests. */
@@ -376,6 +400,13 @@ typedef struct PDMASYNCCOMPLETIONENDPOINTFILE
     bool                                   fReadonly;
     /** Flag whether the host supports the async flush API. */
     bool                                   fAsyncFlushSupported;
+    /** CPU group of the thread which issued the last task, for per CPU managers. */
+    volatile uint32_t                      idxCpuGroupIssuer;
+    /** Number of tasks issued since the last load update. */
+    volatile uint32_t                      cTasksIssued;
+    /** Number of tasks issued from CPUs not served by the current manager
+     * since the last load update. */
+    volatile uint32_t                      cTasksIssuedRemote;
 #ifdef VBOX_WITH_DEBUGGER
     /** Status code to inject for the next complete read. */
     volatile int                           rcReqRead;
@@ -534,6 +565,9 @@ void pdmacFileAioMgrNormalDestroy(PPDMACEPFILEMGR pAioMgr);
 int pdmacFileAioMgrCreate(PPDMASYNCCOMPLETIONEPCLASSFILE pEpClass, PPPDMACEPFILEMGR ppAioMgr, PDMACEPFILEMGRTYPE enmMgrType);
 
 int pdmacFileAioMgrAddEndpoint(PPDMACEPFILEMGR pAioMgr, PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint);
+int pdmacFileAioMgrQueryForCpuGroup(PPDMASYNCCOMPLETIONEPCLASSFILE pEpClass, uint32_t idxCpuGroup, PPPDMACEPFILEMGR ppAioMgr);
+uint32_t pdmacFileAioMgrCurCpuGroup(PPDMASYNCCOMPLETIONEPCLASSFILE pEpClass);
+void pdmacFileAioMgrWakeup(PPDMACEPFILEMGR pAioMgr);
 
 PPDMACTASKFILE pdmacFileEpGetNewTasks(PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint);
 PPDMACTASKFILE pdmacFileTaskAlloc(PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint);
@@ -41,6 +41,8 @@ RT_C_DECLS_BEGIN
 typedef struct PDMBLKLRULIST *PPDMBLKLRULIST;
 /** Pointer to the global cache structure. */
 typedef struct PDMBLKCACHEGLOBAL *PPDMBLKCACHEGLOBAL;
+/** Pointer to a cache shard. */
+typedef struct PDMBLKCACHESHARD *PPDMBLKCACHESHARD;
 /** Pointer to a cache entry waiter structure. */
 typedef struct PDMBLKCACHEWAITER *PPDMBLKCACHEWAITER;
 
@@ -57,6 +59,8 @@ typedef struct PDMBLKCACHEENTRY
     struct PDMBLKCACHEENTRY        *pNext;
     /** Pointer to the list the entry is in. */
     PPDMBLKLRULIST                  pList;
+    /** The shard the entry belongs to, fixed for the lifetime of the entry. */
+    PPDMBLKCACHESHARD               pShard;
     /** Cache the entry belongs to. */
     PPDMBLKCACHE                    pBlkCache;
     /** Flags for this entry. Combinations of PDMACFILECACHE_* \#defines */
@@ -96,29 +100,109 @@ typedef struct PDMBLKLRULIST
     uint32_t          cbCached;
 } PDMBLKLRULIST;
 
+/** Maximum number of cache shards. */
+#define PDMBLKCACHE_SHARDS_MAX          64
+/** Minimum number of bytes per shard, the shard count is reduced for small
+ * caches to keep room for a reasonable number of entries in each. */
+#define PDMBLKCACHE_SHARD_MIN_SIZE      _1M
+/** Shift applied to the entry offset when picking a shard, so neighbouring
+ * small entries of a disk spread over the shards in 64KB stripes. */
+#define PDMBLKCACHE_SHARD_STRIPE_SHIFT  16
+
 /**
- * Global cache data.
+ * Cache replacement policy.
  */
-typedef struct PDMBLKCACHEGLOBAL
+typedef enum PDMBLKCACHEPOLICY
 {
-    /** Pointer to the owning VM instance. */
-    PVM                 pVM;
-    /** Maximum size of the cache in bytes. */
+    /** Invalid policy. */
+    PDMBLKCACHEPOLICY_INVALID = 0,
+    /** 2Q: new entries go to a FIFO (A1in) with a fixed size, entries hit
+     * again after being evicted from it go to the LRU (Am).  The default. */
+    PDMBLKCACHEPOLICY_2Q,
+    /** ARC: like 2Q but the split between the recently used (T1) and the
+     * frequently used (T2) list adapts to the hits on the two ghost lists. */
+    PDMBLKCACHEPOLICY_ARC,
+    /** 32bit hack. */
+    PDMBLKCACHEPOLICY_32BIT_HACK = 0x7fffffff
+} PDMBLKCACHEPOLICY;
+
+/**
+ * Cache shard.
+ *
+ * The cache is partitioned into shards, each with its own lock, LRU lists
+ * and share of the cache size.  This way hits, insertions and evictions for
+ * different parts of a disk or different disks don't all serialize on one
+ * lock.  An entry stays in the shard it was created in for its whole
+ * lifetime, including the time it spends on the ghost list.
+ */
+typedef struct PDMBLKCACHESHARD
+{
+    /** Critical section protecting the lists of this shard. */
+    RTCRITSECT          CritSect;
+    /** Pointer to the global cache data. */
+    PPDMBLKCACHEGLOBAL  pCache;
+    /** Index of this shard. */
+    uint32_t            idxShard;
+    /** Maximum size of the shard in bytes. */
     uint32_t            cbMax;
-    /** Current size of the cache in bytes. */
+    /** Current size of the shard in bytes. */
     uint32_t            cbCached;
-    /** Critical section protecting the cache. */
-    RTCRITSECT          CritSect;
     /** Maximum number of bytes cached. */
     uint32_t            cbRecentlyUsedInMax;
     /** Maximum number of bytes in the paged out list .*/
     uint32_t            cbRecentlyUsedOutMax;
+    /** ARC: The adaptive target size of the recently used list (p). */
+    uint32_t            cbArcTarget;
     /** Recently used cache entries list */
     PDMBLKLRULIST       LruRecentlyUsedIn;
     /** Scorecard cache entry list. */
     PDMBLKLRULIST       LruRecentlyUsedOut;
     /** List of frequently used cache entries */
     PDMBLKLRULIST       LruFrequentlyUsed;
+    /** ARC: Ghost list of entries evicted from the frequently used list (B2),
+     * always empty with the 2Q policy. */
+    PDMBLKLRULIST       LruFrequentlyUsedOut;
+    /** Number of times the shard lock was entered. */
+    STAMCOUNTER         StatLockEnter;
+    /** Number of times the shard lock was owned by someone else on entry. */
+    STAMCOUNTER         StatLockContended;
+    /** Number of accesses finding the data in the cache. */
+    STAMCOUNTER         StatPolicyHits;
+    /** Number of new entries created for accesses not in the cache. */
+    STAMCOUNTER         StatPolicyMisses;
+    /** Number of accesses hitting an entry on the recently used ghost list. */
+    STAMCOUNTER         StatPolicyGhostHitsRecent;
+    /** Number of accesses hitting an entry on the frequently used ghost list. */
+    STAMCOUNTER         StatPolicyGhostHitsFrequent;
+    /** Padding to keep the locks of neighbouring shards in different cache lines. */
+    uint8_t             abPadding[64];
+} PDMBLKCACHESHARD;
+AssertCompileMemberAlignment(PDMBLKCACHESHARD, StatLockEnter, sizeof(uint64_t));
+
+/**
+ * Global cache data.
+ */
+typedef struct PDMBLKCACHEGLOBAL
+{
+    /** Pointer to the owning VM instance. */
+    PVM                 pVM;
+    /** Maximum size of the cache in bytes. */
+    uint32_t            cbMax;
+    /** Current size of the cache in bytes, the sum over all shards (updated
+     * atomically). */
+    volatile uint32_t   cbCached;
+    /** Critical section protecting the list of users.  Taken before any shard
+     * lock when both are needed. */
+    RTCRITSECT          CritSect;
+    /** The replacement policy. */
+    PDMBLKCACHEPOLICY   enmPolicy;
+    /** Length of a sequential read run after which reads missing the cache
+     * are passed through without creating entries, 0 to never bypass. */
+    uint32_t            cbScanThreshold;
+    /** Number of shards. */
+    uint32_t            cShards;
+    /** The shards. */
+    PPDMBLKCACHESHARD   paShards;
     /** Commit timeout in milli seconds */
     uint32_t            u32CommitTimeoutMs;
     /** Number of dirty bytes needed to start a commit of the data to the disk. */
@@ -196,6 +280,16 @@ typedef struct PDMBLKCACHE
     RTLISTNODE                    NodeCacheUser;
     /** Block cache type. */
     PDMBLKCACHETYPE               enmType;
+    /** Seed for picking the shard of an entry, derived from the id so the
+     * disks don't all start in the same shard. */
+    uint32_t                      uShardSeed;
+    /** Offset following the last read, for detecting sequential scans.  Not
+     * serialized, concurrent reads only make the detection less accurate. */
+    uint64_t                      offScanNext;
+    /** Number of bytes read sequentially up to offScanNext. */
+    uint64_t                      cbScanRun;
+    /** Number of bytes not cached because they were part of a scan. */
+    STAMCOUNTER                   StatScanBypassed;
     /** Type specific data. */
     union
     {
@@ -3299,8 +3299,10 @@ typedef struct PGM
     bool                            fRestoreRomPagesOnReset;
     /** Whether to automatically clear all RAM pages on reset. */
     bool                            fZeroRamPagesOnReset;
+    /** Whether to load RAM pages lazily when restoring a saved state. */
+    bool                            fLazyRestore;
     /** Alignment padding. */
-    bool                            afAlignment3[7];
+    bool                            afAlignment3[6];
 
     /** Indicates that PGMR3FinalizeMappings has been called and that further
      * PGMR3MapIntermediate calls will be rejected. */
@@ -3581,8 +3583,10 @@ typedef struct PGM
         uint32_t                    cIgnoredPages;
         /** Indicates that a live save operation is active. */
         bool                        fActive;
-        /** Padding. */
-        bool                        afReserved[2];
+        /** Whether to hash the MMIO2 pages using the SSE4.2 CRC32 instruction. */
+        bool                        fHashSse42;
+        /** Whether to check for zero pages using SSE2. */
+        bool                        fZeroCheckSse2;
         /** The next history index. */
         uint8_t                     iDirtyPagesHistory;
         /** History of the total amount of dirty pages. */
@@ -3600,9 +3604,16 @@ typedef struct PGM
         uint64_t                    uSaveStartNS;
         /** Pages per second (for statistics). */
         uint32_t                    cPagesPerSecond;
-        uint32_t                    cAlignment;
+        /** The hash of a zero half page (see pgmR3LiveHashHalfPage). */
+        uint32_t                    u32ZeroHalfPageHash;
     } LiveSave;
 
+    /** The lazy restore state, NULL if not active. */
+    R3PTRTYPE(struct PGMLAZYRESTORE *) pLazyRestoreR3;
+#if HC_ARCH_BITS == 32
+    RTR3PTR                         R3PtrAlignment5;
+#endif
+
     /** @name   Error injection.
      * @{ */
     /** Inject handy page allocation errors pretending we're completely out of
@@ -4209,6 +4220,12 @@ void            pgmHandlerVirtualDumpPhysPages(PVM pVM);
 #endif /* VBOX_WITH_RAW_MODE */
 DECLCALLBACK(void) pgmR3InfoHandlers(PVM pVM, PCDBGFINFOHLP pHlp, const char *pszArgs);
 int             pgmR3InitSavedState(PVM pVM, uint64_t cbRam);
+bool            pgmR3LazyRestoreBegin(PVM pVM, PSSMHANDLE pSSM, uint32_t uPass);
+int             pgmR3LazyRestoreAddPage(PVM pVM, PPGMRAMRANGE pRam, RTGCPHYS GCPhys, uint64_t uLocation);
+int             pgmR3LazyRestoreStart(PVM pVM);
+int             pgmR3LazyRestoreFetchPage(PVM pVM, RTGCPHYS GCPhys);
+int             pgmR3LazyRestoreFinish(PVM pVM);
+void            pgmR3LazyRestoreTerm(PVM pVM, bool fDestroyTimer);
 
 int             pgmPhysAllocPage(PVM pVM, PPGMPAGE pPage, RTGCPHYS GCPhys);
 int             pgmPhysAllocLargePage(PVM pVM, RTGCPHYS GCPhys);
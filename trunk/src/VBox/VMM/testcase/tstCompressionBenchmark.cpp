@@ -397,6 +397,8 @@ int main(int argc, char **argv)
 /*      { 0, 0, 0, VINF_SUCCESS, false, RTZIPTYPE_ZLIB,  RTZIPLEVEL_DEFAULT, "RTZip/zlib"       }, - slow plus it randomly hits VERR_GENERAL_FAILURE atm. */
         { 0, 0, 0, VINF_SUCCESS, true,  RTZIPTYPE_STORE, RTZIPLEVEL_DEFAULT, "RTZipBlock/Store" },
         { 0, 0, 0, VINF_SUCCESS, true,  RTZIPTYPE_LZF,   RTZIPLEVEL_DEFAULT, "RTZipBlock/LZF"   },
+        { 0, 0, 0, VINF_SUCCESS, true,  RTZIPTYPE_ZLIB,  RTZIPLEVEL_FAST,    "RTZipBlock/zlib/fast" },
+        { 0, 0, 0, VINF_SUCCESS, true,  RTZIPTYPE_ZLIB,  RTZIPLEVEL_MAX,     "RTZipBlock/zlib/max"  },
         { 0, 0, 0, VINF_SUCCESS, true,  RTZIPTYPE_LZJB,  RTZIPLEVEL_DEFAULT, "RTZipBlock/LZJB"  },
         { 0, 0, 0, VINF_SUCCESS, true,  RTZIPTYPE_LZO,   RTZIPLEVEL_DEFAULT, "RTZipBlock/LZO"   },
     };
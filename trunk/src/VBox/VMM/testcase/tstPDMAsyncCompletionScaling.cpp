@@ -0,0 +1,369 @@
+/* $Id$ */
+/** @file
+ * PDM Asynchronous Completion Scaling Benchmark.
+ *
+ * Measures the random read IOPS of the file endpoints with an increasing
+ * number of issuing threads, each bound to its own host CPU and using its own
+ * endpoint.  Run it once with the default shared I/O manager and once with per
+ * CPU managers to compare how the two scale with the core count.
+ *
+ * Use: ./tstPDMAsyncCompletionScaling <file> [cpus-per-io-mgr] [seconds-per-step]
+ */
+
+/*
+ * Copyright (C) 2016 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+
+/*********************************************************************************************************************************
+*   Header Files                                                                                                                 *
+*********************************************************************************************************************************/
+#define LOG_GROUP LOG_GROUP_PDM_ASYNC_COMPLETION
+
+#include "VMInternal.h" /* UVM */
+#include <VBox/vmm/vm.h>
+#include <VBox/vmm/uvm.h>
+#include <VBox/vmm/cfgm.h>
+#include <VBox/vmm/pdmasynccompletion.h>
+#include <VBox/vmm/vmm.h>
+#include <VBox/err.h>
+#include <VBox/log.h>
+#include <VBox/vmm/pdmapi.h>
+#include <iprt/asm.h>
+#include <iprt/assert.h>
+#include <iprt/initterm.h>
+#include <iprt/mem.h>
+#include <iprt/mp.h>
+#include <iprt/param.h>
+#include <iprt/rand.h>
+#include <iprt/semaphore.h>
+#include <iprt/stream.h>
+#include <iprt/string.h>
+#include <iprt/thread.h>
+#include <iprt/time.h>
+
+#define TESTCASE "tstPDMAsyncCompletionScaling"
+
+/** Maximum number of issuing threads. */
+#define NR_THREADS_MAX      64
+/** Number of requests each thread keeps in flight. */
+#define QUEUE_DEPTH         32
+/** Size of a single read. */
+#define REQ_SIZE            _4K
+
+
+/*********************************************************************************************************************************
+*   Structures and Typedefs                                                                                                      *
+*********************************************************************************************************************************/
+/**
+ * An issuing thread.
+ */
+typedef struct TSTWORKER
+{
+    /** The endpoint the thread reads from. */
+    PPDMASYNCCOMPLETIONENDPOINT hEndpoint;
+    /** The host CPU the thread is bound to. */
+    RTCPUID                     idCpu;
+    /** The thread handle. */
+    RTTHREAD                    hThread;
+    /** Signalled when a request completed. */
+    RTSEMEVENT                  hEvtCompleted;
+    /** The read buffers, QUEUE_DEPTH * REQ_SIZE bytes. */
+    uint8_t                    *pbBuf;
+    /** Number of requests in flight. */
+    volatile uint32_t           cReqsActive;
+    /** Number of completed requests. */
+    volatile uint64_t           cReqsCompleted;
+    /** Number of failed requests. */
+    volatile uint32_t           cReqsFailed;
+} TSTWORKER;
+/** Pointer to an issuing thread. */
+typedef TSTWORKER *PTSTWORKER;
+
+
+/*********************************************************************************************************************************
+*   Global Variables                                                                                                             *
+*********************************************************************************************************************************/
+/** The issuing threads. */
+static TSTWORKER        g_aWorkers[NR_THREADS_MAX];
+/** Size of the test file. */
+static uint64_t         g_cbFile;
+/** Set while the threads should keep issuing requests. */
+static volatile bool    g_fRunning;
+/** The I/O manager configuration. */
+static uint32_t         g_cCpusPerIoMgr = 0;
+
+
+static DECLCALLBACK(void) tstPDMACScalingTaskCompleted(PVM pVM, void *pvUser, void *pvUser2, int rcReq)
+{
+    RT_NOREF2(pVM, pvUser2);
+    PTSTWORKER pWorker = (PTSTWORKER)pvUser;
+
+    if (RT_FAILURE(rcReq))
+        ASMAtomicIncU32(&pWorker->cReqsFailed);
+    ASMAtomicIncU64(&pWorker->cReqsCompleted);
+    ASMAtomicDecU32(&pWorker->cReqsActive);
+    RTSemEventSignal(pWorker->hEvtCompleted);
+}
+
+
+static DECLCALLBACK(int) tstPDMACScalingWorker(RTTHREAD hThreadSelf, void *pvUser)
+{
+    RT_NOREF1(hThreadSelf);
+    PTSTWORKER pWorker = (PTSTWORKER)pvUser;
+    uint32_t   iBuf    = 0;
+
+    RTThreadSetAffinityToCpu(pWorker->idCpu);
+
+    while (ASMAtomicReadBool(&g_fRunning))
+    {
+        while (ASMAtomicReadU32(&pWorker->cReqsActive) < QUEUE_DEPTH)
+        {
+            RTSGSEG Seg;
+            Seg.pvSeg = pWorker->pbBuf + iBuf * REQ_SIZE;
+            Seg.cbSeg = REQ_SIZE;
+            iBuf = (iBuf + 1) % QUEUE_DEPTH;
+
+            RTFOFF off = (RTFOFF)RTRandU64Ex(0, g_cbFile / REQ_SIZE - 1) * REQ_SIZE;
+            PPDMASYNCCOMPLETIONTASK pTask;
+            ASMAtomicIncU32(&pWorker->cReqsActive);
+            int rc = PDMR3AsyncCompletionEpRead(pWorker->hEndpoint, off, &Seg, 1, REQ_SIZE, pWorker, &pTask);
+            if (rc != VINF_AIO_TASK_PENDING)
+            {
+                if (RT_FAILURE(rc))
+                    ASMAtomicIncU32(&pWorker->cReqsFailed);
+                ASMAtomicIncU64(&pWorker->cReqsCompleted);
+                ASMAtomicDecU32(&pWorker->cReqsActive);
+            }
+        }
+
+        RTSemEventWait(pWorker->hEvtCompleted, 100);
+    }
+
+    /* Wait for the outstanding requests. */
+    while (ASMAtomicReadU32(&pWorker->cReqsActive))
+        RTSemEventWait(pWorker->hEvtCompleted, 100);
+
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Runs one step with the given number of threads.
+ *
+ * @returns IOPS.
+ * @param   cThreads    Number of issuing threads.
+ * @param   cSecs       Number of seconds to measure.
+ */
+static uint64_t tstPDMACScalingRun(uint32_t cThreads, uint32_t cSecs)
+{
+    ASMAtomicWriteBool(&g_fRunning, true);
+    for (uint32_t i = 0; i < cThreads; i++)
+    {
+        g_aWorkers[i].cReqsCompleted = 0;
+        int rc = RTThreadCreateF(&g_aWorkers[i].hThread, tstPDMACScalingWorker, &g_aWorkers[i], 0,
+                                 RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE, "Issuer%u", i);
+        AssertRC(rc);
+    }
+
+    /* Give the endpoints time to settle on the managers of their issuers. */
+    RTThreadSleep(3 * RT_MS_1SEC);
+
+    uint64_t cReqsStart = 0;
+    for (uint32_t i = 0; i < cThreads; i++)
+        cReqsStart += ASMAtomicReadU64(&g_aWorkers[i].cReqsCompleted);
+    uint64_t const nsStart = RTTimeNanoTS();
+
+    RTThreadSleep(cSecs * RT_MS_1SEC);
+
+    uint64_t cReqsEnd = 0;
+    for (uint32_t i = 0; i < cThreads; i++)
+        cReqsEnd += ASMAtomicReadU64(&g_aWorkers[i].cReqsCompleted);
+    uint64_t const cNs = RT_MAX(RTTimeNanoTS() - nsStart, 1);
+
+    ASMAtomicWriteBool(&g_fRunning, false);
+    for (uint32_t i = 0; i < cThreads; i++)
+        RTThreadWait(g_aWorkers[i].hThread, RT_INDEFINITE_WAIT, NULL);
+
+    return (cReqsEnd - cReqsStart) * RT_NS_1SEC / cNs;
+}
+
+
+/**
+ * Default configuration plus the I/O manager setting under test.
+ */
+static DECLCALLBACK(int) tstPDMACScalingCfgmConstructor(PUVM pUVM, PVM pVM, void *pvUser)
+{
+    RT_NOREF2(pUVM, pvUser);
+    int rc = CFGMR3ConstructDefaultTree(pVM);
+    if (RT_SUCCESS(rc))
+    {
+        PCFGMNODE pAc;
+        PCFGMNODE pFile;
+        rc = CFGMR3InsertNode(CFGMR3GetChild(CFGMR3GetRoot(pVM), "PDM"), "AsyncCompletion", &pAc);
+        if (RT_SUCCESS(rc))
+            rc = CFGMR3InsertNode(pAc, "File", &pFile);
+        if (RT_SUCCESS(rc))
+            rc = CFGMR3InsertInteger(pFile, "CpusPerIoMgr", g_cCpusPerIoMgr);
+    }
+    return rc;
+}
+
+
+/**
+ *  Entry point.
+ */
+extern "C" DECLEXPORT(int) TrustedMain(int argc, char **argv, char **envp)
+{
+    RT_NOREF1(envp);
+    int rcRet = 0; /* error count */
+
+    RTR3InitExe(argc, &argv, RTR3INIT_FLAGS_SUPLIB);
+
+    if (argc < 2 || argc > 4)
+    {
+        RTPrintf(TESTCASE ": Usage is ./tstPDMAsyncCompletionScaling <file> [cpus-per-io-mgr] [seconds-per-step]\n");
+        return 1;
+    }
+    g_cCpusPerIoMgr = argc > 2 ? RTStrToUInt32(argv[2]) : 0;
+    uint32_t const cSecs = argc > 3 ? RT_MAX(RTStrToUInt32(argv[3]), 1) : 10;
+
+    /* One issuing thread per online CPU at most. */
+    RTCPUSET OnlineSet;
+    RTMpGetOnlineSet(&OnlineSet);
+    uint32_t cCpus = 0;
+    for (int iCpu = 0; iCpu < RTCPUSET_MAX_CPUS && cCpus < NR_THREADS_MAX; iCpu++)
+        if (RTCpuSetIsMemberByIndex(&OnlineSet, iCpu))
+            g_aWorkers[cCpus++].idCpu = RTMpCpuIdFromSetIndex(iCpu);
+
+    PVM pVM;
+    PUVM pUVM;
+    int rc = VMR3Create(1, NULL, NULL, NULL, tstPDMACScalingCfgmConstructor, NULL, &pVM, &pUVM);
+    if (RT_SUCCESS(rc))
+    {
+        /*
+         * Little hack to avoid the VM_ASSERT_EMT assertion.
+         */
+        RTTlsSet(pVM->pUVM->vm.s.idxTLS, &pVM->pUVM->aCpus[0]);
+        pVM->pUVM->aCpus[0].pUVM = pVM->pUVM;
+        pVM->pUVM->aCpus[0].vm.s.NativeThreadEMT = RTThreadNativeSelf();
+
+        PPDMASYNCCOMPLETIONTEMPLATE pTemplate;
+        rc = PDMR3AsyncCompletionTemplateCreateInternal(pVM, &pTemplate, tstPDMACScalingTaskCompleted, NULL, "Scaling");
+        if (RT_SUCCESS(rc))
+        {
+            /* Every thread gets its own endpoint, all start out on the manager of this thread's CPU. */
+            uint32_t cEndpoints;
+            for (cEndpoints = 0; cEndpoints < cCpus; cEndpoints++)
+            {
+                PTSTWORKER pWorker = &g_aWorkers[cEndpoints];
+                rc = PDMR3AsyncCompletionEpCreateForFile(&pWorker->hEndpoint, argv[1],
+                                                         PDMACEP_FILE_FLAGS_READ_ONLY | PDMACEP_FILE_FLAGS_DONT_LOCK,
+                                                         pTemplate);
+                if (RT_SUCCESS(rc))
+                {
+                    rc = RTSemEventCreate(&pWorker->hEvtCompleted);
+                    if (RT_SUCCESS(rc))
+                    {
+                        pWorker->pbBuf = (uint8_t *)RTMemPageAlloc(QUEUE_DEPTH * REQ_SIZE);
+                        if (pWorker->pbBuf)
+                            continue;
+                        rc = VERR_NO_MEMORY;
+                        RTSemEventDestroy(pWorker->hEvtCompleted);
+                    }
+                    PDMR3AsyncCompletionEpClose(pWorker->hEndpoint);
+                }
+                RTPrintf(TESTCASE ": Failed to set up endpoint %u: %Rrc\n", cEndpoints, rc);
+                rcRet++;
+                break;
+            }
+
+            if (RT_SUCCESS(rc))
+                rc = PDMR3AsyncCompletionEpGetSize(g_aWorkers[0].hEndpoint, &g_cbFile);
+            if (RT_SUCCESS(rc) && g_cbFile < QUEUE_DEPTH * REQ_SIZE)
+                rc = VERR_OUT_OF_RANGE;
+
+            if (RT_SUCCESS(rc))
+            {
+                PDMR3PowerOn(pVM);
+
+                RTPrintf(TESTCASE ": %u CPUs, %s, queue depth %u, %u byte random reads\n", cCpus,
+                         g_cCpusPerIoMgr ? "per CPU group I/O managers" : "shared I/O manager",
+                         QUEUE_DEPTH, REQ_SIZE);
+                if (g_cCpusPerIoMgr)
+                    RTPrintf(TESTCASE ": %u CPU(s) per I/O manager\n", g_cCpusPerIoMgr);
+
+                uint64_t cIopsSingle = 0;
+                for (uint32_t cThreads = 1; cThreads <= cCpus; cThreads = cThreads < cCpus ? RT_MIN(cThreads * 2, cCpus) : cCpus + 1)
+                {
+                    uint64_t const cIops = tstPDMACScalingRun(cThreads, cSecs);
+                    if (cThreads == 1)
+                        cIopsSingle = RT_MAX(cIops, 1);
+                    RTPrintf(TESTCASE ": %2u threads: %8llu IOPS, %3llu%% of linear scaling\n",
+                             cThreads, cIops, cIops * 100 / (cIopsSingle * cThreads));
+                }
+
+                uint32_t cReqsFailed = 0;
+                for (uint32_t i = 0; i < cCpus; i++)
+                    cReqsFailed += g_aWorkers[i].cReqsFailed;
+                if (cReqsFailed)
+                {
+                    RTPrintf(TESTCASE ": %u requests failed!\n", cReqsFailed);
+                    rcRet++;
+                }
+
+                PDMR3PowerOff(pVM);
+            }
+            else if (cEndpoints == cCpus)
+            {
+                RTPrintf(TESTCASE ": Can't use the file: %Rrc\n", rc);
+                rcRet++;
+            }
+
+            while (cEndpoints-- > 0)
+            {
+                PDMR3AsyncCompletionEpClose(g_aWorkers[cEndpoints].hEndpoint);
+                RTSemEventDestroy(g_aWorkers[cEndpoints].hEvtCompleted);
+                RTMemPageFree(g_aWorkers[cEndpoints].pbBuf, QUEUE_DEPTH * REQ_SIZE);
+            }
+
+            PDMR3AsyncCompletionTemplateDestroy(pTemplate);
+        }
+        else
+        {
+            RTPrintf(TESTCASE ": Error while creating the template!! rc=%Rrc\n", rc);
+            rcRet++;
+        }
+
+        rc = VMR3Destroy(pUVM);
+        AssertMsg(rc == VINF_SUCCESS, ("%s: Destroying VM failed rc=%Rrc!!\n", __FUNCTION__, rc));
+        VMR3ReleaseUVM(pUVM);
+    }
+    else
+    {
+        RTPrintf(TESTCASE ": failed to create VM!! rc=%Rrc\n", rc);
+        rcRet++;
+    }
+
+    return rcRet;
+}
+
+
+#if !defined(VBOX_WITH_HARDENING) || !defined(RT_OS_WINDOWS)
+/**
+ * Main entry point.
+ */
+int main(int argc, char **argv, char **envp)
+{
+    return TrustedMain(argc, argv, envp);
+}
+#endif
+
@@ -44,6 +44,7 @@
 #include <iprt/path.h>
 #include <iprt/stream.h>
 #include <iprt/thread.h>
+#include <iprt/time.h>
 #include <iprt/param.h>
 #include <iprt/message.h>
 
@@ -155,6 +156,10 @@ uint8_t *g_pbTestPattern = NULL;
 size_t   g_cbTestPattern;
 /** Array holding test files. */
 PDMACTESTFILE g_aTestFiles[NR_OPEN_ENDPOINTS];
+/** Number of completed tasks over all files, for the IOPS figure. */
+volatile uint64_t g_cTasksCompleted = 0;
+/** Number of bytes transferred by the completed tasks. */
+volatile uint64_t g_cbTransferred = 0;
 
 static DECLCALLBACK(void) tstPDMACStressTestFileTaskCompleted(PVM pVM, void *pvUser, void *pvUser2, int rcReq);
 
@@ -403,6 +408,9 @@ static DECLCALLBACK(void) tstPDMACStressTestFileTaskCompleted(PVM pVM, void *pvU
         tstPDMACStressTestFileVerify(pTestFile, pTestTask); /* Will assert if it fails */
     }
 
+    ASMAtomicIncU64(&g_cTasksCompleted);
+    ASMAtomicAddU64(&g_cbTransferred, pTestTask->DataSeg.cbSeg);
+
     RTMemFree(pTestTask->DataSeg.pvSeg);
     pTestTask->fActive = false;
     AssertMsg(pTestFile->cTasksActiveCurr > 0, ("Trying to complete a non active task\n"));
@@ -579,6 +587,9 @@ extern "C" DECLEXPORT(int) TrustedMain(int argc, char **argv, char **envp)
 
     RTR3InitExe(argc, &argv, RTR3INIT_FLAGS_SUPLIB);
 
+    /* Optional run time in seconds, runs forever by default. */
+    uint32_t cSecsRuntime = argc > 1 ? RTStrToUInt32(argv[1]) : 0;
+
     PVM pVM;
     PUVM pUVM;
     int rc = VMR3Create(1, NULL, NULL, NULL, NULL, NULL, &pVM, &pUVM);
@@ -607,8 +618,29 @@ extern "C" DECLEXPORT(int) TrustedMain(int argc, char **argv, char **envp)
             if (RT_SUCCESS(rc))
             {
                 /* Tests are running now. */
-                RTPrintf(TESTCASE ": Successfully opened all files. Running tests forever now or until an error is hit :)\n");
-                RTThreadSleep(RT_INDEFINITE_WAIT);
+                if (cSecsRuntime)
+                    RTPrintf(TESTCASE ": Successfully opened all files. Running tests for %u seconds\n", cSecsRuntime);
+                else
+                    RTPrintf(TESTCASE ": Successfully opened all files. Running tests forever now or until an error is hit :)\n");
+
+                /*
+                 * Report the throughput every 10 seconds.  On Linux the I/O goes through
+                 * io_uring if the host supports it, run with IPRT_FILEAIO_NO_IO_URING=1
+                 * set for the io_* system calls to compare.
+                 */
+                uint64_t const nsStart = RTTimeNanoTS();
+                for (;;)
+                {
+                    RTThreadSleep(RT_MIN(cSecsRuntime ? cSecsRuntime : 10, 10) * RT_MS_1SEC);
+
+                    uint64_t const cMsElapsed = RT_MAX((RTTimeNanoTS() - nsStart) / RT_NS_1MS, 1);
+                    uint64_t const cTasks     = ASMAtomicReadU64(&g_cTasksCompleted);
+                    uint64_t const cbXfer     = ASMAtomicReadU64(&g_cbTransferred);
+                    RTPrintf(TESTCASE ": %llu tasks completed in %llu ms, %llu IOPS, %llu KB/s\n",
+                             cTasks, cMsElapsed, cTasks * RT_MS_1SEC / cMsElapsed, cbXfer * RT_MS_1SEC / cMsElapsed / _1K);
+                    if (cSecsRuntime && cMsElapsed >= (uint64_t)cSecsRuntime * RT_MS_1SEC)
+                        break;
+                }
             }
 
             /* Close opened endpoints. */
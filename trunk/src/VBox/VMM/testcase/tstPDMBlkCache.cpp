@@ -0,0 +1,414 @@
+/* $Id$ */
+/** @file
+ * PDM Block Cache Testcase.
+ *
+ * Runs the block cache with the ARC replacement policy and scan detection
+ * against a memory backed disk.  It checks that the data read back is right,
+ * that a frequently used set of blocks survives a sequential scan of data
+ * which was evicted before, and that the scan is read past the cache.
+ */
+
+/*
+ * Copyright (C) 2016 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+
+/*********************************************************************************************************************************
+*   Header Files                                                                                                                 *
+*********************************************************************************************************************************/
+#define LOG_GROUP LOG_GROUP_PDM_BLK_CACHE
+
+#include "VMInternal.h" /* UVM */
+#include <VBox/vmm/vm.h>
+#include <VBox/vmm/uvm.h>
+#include <VBox/vmm/cfgm.h>
+#include <VBox/vmm/pdmblkcache.h>
+#include <VBox/vmm/stam.h>
+#include <VBox/vmm/vmm.h>
+#include <VBox/err.h>
+#include <VBox/log.h>
+#include <VBox/vmm/pdmapi.h>
+#include <iprt/asm.h>
+#include <iprt/assert.h>
+#include <iprt/initterm.h>
+#include <iprt/mem.h>
+#include <iprt/param.h>
+#include <iprt/semaphore.h>
+#include <iprt/sg.h>
+#include <iprt/stream.h>
+#include <iprt/string.h>
+#include <iprt/thread.h>
+
+#define TESTCASE "tstPDMBlkCache"
+
+/** Size of the cache. */
+#define CACHE_SIZE          _1M
+/** Sequential reads longer than this are a scan. */
+#define SCAN_THRESHOLD      (256 * _1K)
+/** Size of the disk. */
+#define DISK_SIZE           (4 * _1M)
+/** Size of a single request. */
+#define REQ_SIZE            (64 * _1K)
+/** Start and size of the frequently used set. */
+#define HOT_OFF             0
+#define HOT_SIZE            (CACHE_SIZE / 2)
+/** Start and size of the data which is evicted and then scanned. */
+#define SCAN_OFF            _1M
+#define SCAN_SIZE           CACHE_SIZE
+
+
+/*********************************************************************************************************************************
+*   Global Variables                                                                                                             *
+*********************************************************************************************************************************/
+/** The block cache user. */
+static PPDMBLKCACHE         g_pBlkCache;
+/** The disk contents. */
+static uint8_t             *g_pbDisk;
+/** What the guest expects to read. */
+static uint8_t             *g_pbRef;
+/** Number of bytes read from the disk. */
+static volatile uint64_t    g_cbDiskRead;
+/** Signalled when a request completed. */
+static RTSEMEVENT           g_hEvtCompleted;
+/** Status of the last completed request. */
+static volatile int         g_rcReq;
+/** Set when the last request completed. */
+static volatile bool        g_fReqCompleted;
+
+
+static DECLCALLBACK(void) tstPDMBlkCacheXferComplete(void *pvUserInt, void *pvUser, int rcReq)
+{
+    RT_NOREF2(pvUserInt, pvUser);
+    ASMAtomicWriteS32(&g_rcReq, rcReq);
+    ASMAtomicWriteBool(&g_fReqCompleted, true);
+    RTSemEventSignal(g_hEvtCompleted);
+}
+
+
+static DECLCALLBACK(int) tstPDMBlkCacheXferEnqueue(void *pvUser, PDMBLKCACHEXFERDIR enmXferDir, uint64_t off, size_t cbXfer,
+                                                   PCRTSGBUF pSgBuf, PPDMBLKCACHEIOXFER hIoXfer)
+{
+    RT_NOREF1(pvUser);
+    int rc = VINF_SUCCESS;
+    if (   enmXferDir != PDMBLKCACHEXFERDIR_FLUSH
+        && (off >= DISK_SIZE || cbXfer > DISK_SIZE - off))
+        rc = VERR_OUT_OF_RANGE;
+    else if (enmXferDir == PDMBLKCACHEXFERDIR_READ)
+    {
+        RTSGBUF SgBuf;
+        RTSgBufClone(&SgBuf, pSgBuf);
+        RTSgBufCopyFromBuf(&SgBuf, &g_pbDisk[off], cbXfer);
+        ASMAtomicAddU64(&g_cbDiskRead, cbXfer);
+    }
+    else if (enmXferDir == PDMBLKCACHEXFERDIR_WRITE)
+    {
+        RTSGBUF SgBuf;
+        RTSgBufClone(&SgBuf, pSgBuf);
+        RTSgBufCopyToBuf(&SgBuf, &g_pbDisk[off], cbXfer);
+    }
+
+    /* The disk is synchronous, complete the transfer right away like DrvVD does. */
+    PDMR3BlkCacheIoXferComplete(g_pBlkCache, hIoXfer, rc);
+    return VINF_SUCCESS;
+}
+
+
+static DECLCALLBACK(int) tstPDMBlkCacheXferEnqueueDiscard(void *pvUser, PCRTRANGE paRanges, unsigned cRanges,
+                                                          PPDMBLKCACHEIOXFER hIoXfer)
+{
+    RT_NOREF3(pvUser, paRanges, cRanges);
+    PDMR3BlkCacheIoXferComplete(g_pBlkCache, hIoXfer, VINF_SUCCESS);
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Waits for a request which returned VINF_AIO_TASK_PENDING.
+ *
+ * @returns Status of the request.
+ * @param   rc          What the cache returned when issuing the request.
+ */
+static int tstPDMBlkCacheWait(int rc)
+{
+    if (rc != VINF_AIO_TASK_PENDING)
+        return rc;
+    while (!ASMAtomicReadBool(&g_fReqCompleted))
+        RTSemEventWait(g_hEvtCompleted, 100);
+    return ASMAtomicReadS32(&g_rcReq);
+}
+
+
+/**
+ * Reads from the cache in REQ_SIZE chunks and checks the data.
+ *
+ * @returns 0 on success, 1 on failure.
+ * @param   off         Where to start reading.
+ * @param   cb          How much to read.
+ */
+static int tstPDMBlkCacheRead(uint64_t off, size_t cb)
+{
+    uint8_t *pbBuf = (uint8_t *)RTMemAlloc(REQ_SIZE);
+    if (!pbBuf)
+        return 1;
+
+    int rcRet = 0;
+    for (size_t offChunk = 0; offChunk < cb && !rcRet; offChunk += REQ_SIZE)
+    {
+        RTSGSEG Seg;
+        Seg.pvSeg = pbBuf;
+        Seg.cbSeg = REQ_SIZE;
+        RTSGBUF SgBuf;
+        RTSgBufInit(&SgBuf, &Seg, 1);
+        memset(pbBuf, 0xf6, REQ_SIZE);
+
+        ASMAtomicWriteBool(&g_fReqCompleted, false);
+        int rc = tstPDMBlkCacheWait(PDMR3BlkCacheRead(g_pBlkCache, off + offChunk, &SgBuf, REQ_SIZE, NULL));
+        if (RT_FAILURE(rc))
+        {
+            RTPrintf(TESTCASE ": Reading %#llx failed: %Rrc\n", off + offChunk, rc);
+            rcRet = 1;
+        }
+        else if (memcmp(pbBuf, &g_pbRef[off + offChunk], REQ_SIZE))
+        {
+            RTPrintf(TESTCASE ": Data read at %#llx doesn't match\n", off + offChunk);
+            rcRet = 1;
+        }
+    }
+
+    RTMemFree(pbBuf);
+    return rcRet;
+}
+
+
+/**
+ * Writes new data thru the cache in REQ_SIZE chunks, flushing after each.
+ *
+ * The flush commits the dirty entries so they can be evicted again.
+ *
+ * @returns 0 on success, 1 on failure.
+ * @param   off         Where to start writing.
+ * @param   cb          How much to write.
+ * @param   bXor        What to XOR the original disk contents with.
+ */
+static int tstPDMBlkCacheWrite(uint64_t off, size_t cb, uint8_t bXor)
+{
+    for (size_t offChunk = 0; offChunk < cb; offChunk += REQ_SIZE)
+    {
+        uint8_t *pbRef = &g_pbRef[off + offChunk];
+        for (size_t i = 0; i < REQ_SIZE; i++)
+            pbRef[i] ^= bXor;
+
+        RTSGSEG Seg;
+        Seg.pvSeg = pbRef;
+        Seg.cbSeg = REQ_SIZE;
+        RTSGBUF SgBuf;
+        RTSgBufInit(&SgBuf, &Seg, 1);
+
+        ASMAtomicWriteBool(&g_fReqCompleted, false);
+        int rc = tstPDMBlkCacheWait(PDMR3BlkCacheWrite(g_pBlkCache, off + offChunk, &SgBuf, REQ_SIZE, NULL));
+        if (RT_SUCCESS(rc))
+        {
+            ASMAtomicWriteBool(&g_fReqCompleted, false);
+            rc = tstPDMBlkCacheWait(PDMR3BlkCacheFlush(g_pBlkCache, NULL));
+        }
+        if (RT_FAILURE(rc))
+        {
+            RTPrintf(TESTCASE ": Writing %#llx failed: %Rrc\n", off + offChunk, rc);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @callback_method_impl{FNSTAMR3ENUM, Fetches a counter.}
+ */
+static DECLCALLBACK(int) tstPDMBlkCacheStatEnum(const char *pszName, STAMTYPE enmType, void *pvSample, STAMUNIT enmUnit,
+                                                STAMVISIBILITY enmVisiblity, const char *pszDesc, void *pvUser)
+{
+    RT_NOREF4(pszName, enmUnit, enmVisiblity, pszDesc);
+    if (enmType == STAMTYPE_COUNTER)
+        *(uint64_t *)pvUser = ((PSTAMCOUNTER)pvSample)->c;
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Default configuration plus the block cache setup under test.
+ */
+static DECLCALLBACK(int) tstPDMBlkCacheCfgmConstructor(PUVM pUVM, PVM pVM, void *pvUser)
+{
+    RT_NOREF2(pUVM, pvUser);
+    int rc = CFGMR3ConstructDefaultTree(pVM);
+    if (RT_SUCCESS(rc))
+    {
+        PCFGMNODE pBlkCache;
+        rc = CFGMR3InsertNode(CFGMR3GetChild(CFGMR3GetRoot(pVM), "PDM"), "BlkCache", &pBlkCache);
+        if (RT_SUCCESS(rc))
+            rc = CFGMR3InsertInteger(pBlkCache, "CacheSize", CACHE_SIZE);
+        if (RT_SUCCESS(rc))
+            rc = CFGMR3InsertInteger(pBlkCache, "Shards", 1);
+        if (RT_SUCCESS(rc))
+            rc = CFGMR3InsertString(pBlkCache, "Policy", "ARC");
+        if (RT_SUCCESS(rc))
+            rc = CFGMR3InsertInteger(pBlkCache, "ScanThreshold", SCAN_THRESHOLD);
+    }
+    return rc;
+}
+
+
+/**
+ * Runs the test on the block cache user.
+ *
+ * @returns Error count.
+ * @param   pUVM        The user mode VM handle.
+ */
+static int tstPDMBlkCacheRun(PUVM pUVM)
+{
+    int rcRet = 0;
+
+    /*
+     * Write the frequently used set and read it twice so ARC promotes it.
+     * Then write enough other data to evict the first part of it from the
+     * recently used list onto the ghost list.
+     */
+    rcRet += tstPDMBlkCacheWrite(HOT_OFF, HOT_SIZE, 0x5a);
+    rcRet += tstPDMBlkCacheRead(HOT_OFF, HOT_SIZE);
+    rcRet += tstPDMBlkCacheRead(HOT_OFF, HOT_SIZE);
+    rcRet += tstPDMBlkCacheWrite(SCAN_OFF, SCAN_SIZE, 0xa5);
+    if (rcRet)
+        return rcRet;
+
+    uint64_t const cbDiskReadStart = ASMAtomicReadU64(&g_cbDiskRead);
+    rcRet += tstPDMBlkCacheRead(HOT_OFF, HOT_SIZE);
+    if (ASMAtomicReadU64(&g_cbDiskRead) != cbDiskReadStart)
+    {
+        RTPrintf(TESTCASE ": The frequently used set wasn't cached (%llu bytes read from the disk)\n",
+                 ASMAtomicReadU64(&g_cbDiskRead) - cbDiskReadStart);
+        rcRet++;
+    }
+
+    /*
+     * Scan the evicted data.  The ghost hits mustn't bring it back into the
+     * cache at the expense of the frequently used set.
+     */
+    rcRet += tstPDMBlkCacheRead(SCAN_OFF, SCAN_SIZE);
+    uint64_t const cbDiskReadScan = ASMAtomicReadU64(&g_cbDiskRead);
+    rcRet += tstPDMBlkCacheRead(HOT_OFF, HOT_SIZE);
+    if (ASMAtomicReadU64(&g_cbDiskRead) != cbDiskReadScan)
+    {
+        RTPrintf(TESTCASE ": The scan evicted the frequently used set (%llu bytes read from the disk)\n",
+                 ASMAtomicReadU64(&g_cbDiskRead) - cbDiskReadScan);
+        rcRet++;
+    }
+
+    uint64_t cbBypassed = 0;
+    STAMR3Enum(pUVM, "/PDM/BlkCache/tstPDMBlkCache/Cache/ScanBypassed", tstPDMBlkCacheStatEnum, &cbBypassed);
+    if (!cbBypassed)
+    {
+        RTPrintf(TESTCASE ": Nothing of the scan was read past the cache\n");
+        rcRet++;
+    }
+    else
+        RTPrintf(TESTCASE ": %llu bytes of the scan were read past the cache\n", cbBypassed);
+
+    return rcRet;
+}
+
+
+/**
+ *  Entry point.
+ */
+extern "C" DECLEXPORT(int) TrustedMain(int argc, char **argv, char **envp)
+{
+    RT_NOREF1(envp);
+    int rcRet = 0; /* error count */
+
+    RTR3InitExe(argc, &argv, RTR3INIT_FLAGS_SUPLIB);
+
+    g_pbDisk = (uint8_t *)RTMemAlloc(DISK_SIZE);
+    g_pbRef  = (uint8_t *)RTMemAlloc(DISK_SIZE);
+    if (!g_pbDisk || !g_pbRef)
+    {
+        RTPrintf(TESTCASE ": out of memory!\n");
+        return 1;
+    }
+    for (uint32_t off = 0; off < DISK_SIZE; off += sizeof(uint32_t))
+        *(uint32_t *)&g_pbDisk[off] = off;
+    memcpy(g_pbRef, g_pbDisk, DISK_SIZE);
+
+    PVM pVM;
+    PUVM pUVM;
+    int rc = VMR3Create(1, NULL, NULL, NULL, tstPDMBlkCacheCfgmConstructor, NULL, &pVM, &pUVM);
+    if (RT_SUCCESS(rc))
+    {
+        /*
+         * Little hack to avoid the VM_ASSERT_EMT assertion.
+         */
+        RTTlsSet(pVM->pUVM->vm.s.idxTLS, &pVM->pUVM->aCpus[0]);
+        pVM->pUVM->aCpus[0].pUVM = pVM->pUVM;
+        pVM->pUVM->aCpus[0].vm.s.NativeThreadEMT = RTThreadNativeSelf();
+
+        rc = RTSemEventCreate(&g_hEvtCompleted);
+        AssertRC(rc);
+
+        rc = PDMR3BlkCacheRetainInt(pVM, NULL, &g_pBlkCache, tstPDMBlkCacheXferComplete, tstPDMBlkCacheXferEnqueue,
+                                    tstPDMBlkCacheXferEnqueueDiscard, TESTCASE);
+        if (RT_SUCCESS(rc))
+        {
+            rcRet += tstPDMBlkCacheRun(pUVM);
+            PDMR3BlkCacheRelease(g_pBlkCache);
+
+            if (memcmp(g_pbDisk, g_pbRef, DISK_SIZE))
+            {
+                RTPrintf(TESTCASE ": The disk contents don't match after releasing the cache\n");
+                rcRet++;
+            }
+        }
+        else
+        {
+            RTPrintf(TESTCASE ": Error while creating the block cache user!! rc=%Rrc\n", rc);
+            rcRet++;
+        }
+
+        RTSemEventDestroy(g_hEvtCompleted);
+        rc = VMR3Destroy(pUVM);
+        AssertMsg(rc == VINF_SUCCESS, ("%s: Destroying VM failed rc=%Rrc!!\n", __FUNCTION__, rc));
+        VMR3ReleaseUVM(pUVM);
+    }
+    else
+    {
+        RTPrintf(TESTCASE ": failed to create VM!! rc=%Rrc\n", rc);
+        rcRet++;
+    }
+
+    RTMemFree(g_pbDisk);
+    RTMemFree(g_pbRef);
+
+    if (!rcRet)
+        RTPrintf(TESTCASE ": SUCCESS\n");
+    else
+        RTPrintf(TESTCASE ": FAILURE - %d errors\n", rcRet);
+    return rcRet;
+}
+
+
+#if !defined(VBOX_WITH_HARDENING) || !defined(RT_OS_WINDOWS)
+/**
+ * Main entry point.
+ */
+int main(int argc, char **argv, char **envp)
+{
+    return TrustedMain(argc, argv, envp);
+}
+#endif
+
@@ -0,0 +1,187 @@
+/* $Id$ */
+/** @file
+ * Live save page scanning benchmark for PGM.
+ */
+
+/*
+ * Copyright (C) 2016 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+
+/*********************************************************************************************************************************
+*   Header Files                                                                                                                 *
+*********************************************************************************************************************************/
+#include <iprt/asm.h>
+#include <iprt/asm-amd64-x86.h>
+#include <iprt/crc.h>
+#include <iprt/mem.h>
+#include <iprt/param.h>
+#include <iprt/rand.h>
+#include <iprt/string.h>
+#include <iprt/test.h>
+#include <iprt/time.h>
+#include <iprt/x86.h>
+#include <iprt/zero.h>
+
+
+/*********************************************************************************************************************************
+*   Internal Functions                                                                                                           *
+*********************************************************************************************************************************/
+RT_C_DECLS_BEGIN
+DECLASM(uint32_t) pgmR3LiveHashHalfPageSse42(void const *pvHalfPage);
+DECLASM(bool)     pgmR3LiveIsZeroPageSse2(void const *pvPage);
+RT_C_DECLS_END
+
+
+/*********************************************************************************************************************************
+*   Global Variables                                                                                                             *
+*********************************************************************************************************************************/
+/** The number of pages to scan per run. */
+static uint32_t g_cPages = 32*_1M / PAGE_SIZE;
+/** The pages. */
+static uint8_t *g_pabPages;
+/** Sum of the hashes, to keep the compiler from dropping them. */
+static uint32_t volatile g_uHashSink;
+/** The test handle. */
+static RTTEST   g_hTest;
+
+
+static uint32_t hashCrc32(void const *pvHalfPage)
+{
+    return RTCrc32(pvHalfPage, PAGE_SIZE / 2);
+}
+
+
+static bool isZeroPageAsm(void const *pvPage)
+{
+    return ASMMemIsZeroPage(pvPage);
+}
+
+
+/**
+ * Hashes both halves of all the pages, like pgmR3ScanMmio2Page does for
+ * unchanged pages, and reports the pages per second.
+ */
+static void benchmarkHash(const char *pszName, uint32_t (*pfnHash)(void const *))
+{
+    uint32_t       uSum    = 0;
+    uint64_t const nsStart = RTTimeNanoTS();
+    for (uint32_t iPage = 0; iPage < g_cPages; iPage++)
+    {
+        uint8_t const *pbPage = &g_pabPages[(size_t)iPage << PAGE_SHIFT];
+        uSum += pfnHash(pbPage);
+        uSum += pfnHash(pbPage + PAGE_SIZE / 2);
+    }
+    uint64_t const cNs = RT_MAX(RTTimeNanoTS() - nsStart, 1);
+    g_uHashSink += uSum;
+    RTTestValueF(g_hTest, (uint64_t)g_cPages * RT_NS_1SEC / cNs, RTTESTUNIT_OCCURRENCES_PER_SEC, "%s pages", pszName);
+}
+
+
+/**
+ * Checks all the pages for zeros and reports the pages per second.
+ */
+static void benchmarkZero(const char *pszName, bool (*pfnIsZero)(void const *), bool fExpect)
+{
+    uint32_t       cMismatches = 0;
+    uint64_t const nsStart     = RTTimeNanoTS();
+    for (uint32_t iPage = 0; iPage < g_cPages; iPage++)
+        if (pfnIsZero(&g_pabPages[(size_t)iPage << PAGE_SHIFT]) != fExpect)
+            cMismatches++;
+    uint64_t const cNs = RT_MAX(RTTimeNanoTS() - nsStart, 1);
+    RTTEST_CHECK(g_hTest, cMismatches == 0);
+    RTTestValueF(g_hTest, (uint64_t)g_cPages * RT_NS_1SEC / cNs, RTTESTUNIT_OCCURRENCES_PER_SEC, "%s pages", pszName);
+}
+
+
+int main(int argc, char **argv)
+{
+    RTEXITCODE rcExit = RTTestInitAndCreate("tstPGMLiveSaveScan", &g_hTest);
+    if (rcExit != RTEXITCODE_SUCCESS)
+        return rcExit;
+    if (argc > 1)
+        g_cPages = RTStrToUInt32(argv[1]);
+    RTTestBanner(g_hTest);
+
+    uint32_t uEAX, uEBX, uECX, uEDX;
+    ASMCpuId(1, &uEAX, &uEBX, &uECX, &uEDX);
+    bool const fSse42 = RT_BOOL(uECX & X86_CPUID_FEATURE_ECX_SSE4_2);
+    bool const fSse2  = RT_BOOL(uEDX & X86_CPUID_FEATURE_EDX_SSE2);
+
+    g_cPages   = RT_MAX(g_cPages, 2);
+    g_pabPages = (uint8_t *)RTMemPageAlloc((size_t)g_cPages << PAGE_SHIFT);
+    RTTESTI_CHECK_RET(g_pabPages != NULL, RTTestSummaryAndDestroy(g_hTest));
+    RTRandBytes(g_pabPages, (size_t)g_cPages << PAGE_SHIFT);
+
+    /*
+     * Check that the SIMD code gets it right before timing it.
+     */
+    RTTestSub(g_hTest, "Correctness");
+    if (fSse42)
+    {
+        uint8_t *pbPage = g_pabPages;
+        uint32_t const uHash = pgmR3LiveHashHalfPageSse42(pbPage);
+        RTTESTI_CHECK(pgmR3LiveHashHalfPageSse42(pbPage) == uHash);
+        for (uint32_t off = 0; off < PAGE_SIZE / 2; off += 97)
+        {
+            pbPage[off] ^= 0x01;
+            RTTESTI_CHECK_MSG(pgmR3LiveHashHalfPageSse42(pbPage) != uHash, ("off=%#x\n", off));
+            pbPage[off] ^= 0x01;
+        }
+        RTTESTI_CHECK(pgmR3LiveHashHalfPageSse42(g_abRTZeroPage) != uHash);
+    }
+    else
+        RTTestIPrintf(RTTESTLVL_ALWAYS, "SSE4.2 not supported, skipping its checks\n");
+    if (fSse2)
+    {
+        /* Uses the first two pages so the unaligned checks stay within the buffer. */
+        uint8_t *pbPage = g_pabPages;
+        RT_BZERO(pbPage, PAGE_SIZE * 2);
+        RTTESTI_CHECK(pgmR3LiveIsZeroPageSse2(pbPage));
+        RTTESTI_CHECK(pgmR3LiveIsZeroPageSse2(pbPage + 1));
+        for (uint32_t off = 0; off <= PAGE_SIZE; off++)
+        {
+            pbPage[off] = 0x80;
+            if (off < PAGE_SIZE)
+                RTTESTI_CHECK_MSG(!pgmR3LiveIsZeroPageSse2(pbPage), ("off=%#x\n", off));
+            if (off > 0)
+                RTTESTI_CHECK_MSG(!pgmR3LiveIsZeroPageSse2(pbPage + 1), ("off=%#x (unaligned)\n", off));
+            pbPage[off] = 0;
+        }
+        RTRandBytes(pbPage, PAGE_SIZE * 2);
+    }
+    else
+        RTTestIPrintf(RTTESTLVL_ALWAYS, "SSE2 not supported, skipping its checks\n");
+
+    /*
+     * Hashing pages (the common unchanged MMIO2 page case).
+     */
+    RTTestSub(g_hTest, "Hashing");
+    benchmarkHash("RTCrc32", hashCrc32);
+    if (fSse42)
+        benchmarkHash("SSE4.2", pgmR3LiveHashHalfPageSse42);
+
+    /*
+     * Zero page checks, both for zero pages which must be scanned entirely
+     * and for random pages which bail out at once.
+     */
+    RTTestSub(g_hTest, "Zero checks");
+    benchmarkZero("ASMMemIsZeroPage random", isZeroPageAsm, false);
+    if (fSse2)
+        benchmarkZero("SSE2 random", pgmR3LiveIsZeroPageSse2, false);
+    RT_BZERO(g_pabPages, (size_t)g_cPages << PAGE_SHIFT);
+    benchmarkZero("ASMMemIsZeroPage zero", isZeroPageAsm, true);
+    if (fSse2)
+        benchmarkZero("SSE2 zero", pgmR3LiveIsZeroPageSse2, true);
+
+    RTMemPageFree(g_pabPages, (size_t)g_cPages << PAGE_SHIFT);
+    return RTTestSummaryAndDestroy(g_hTest);
+}
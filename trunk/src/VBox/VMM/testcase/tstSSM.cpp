@@ -30,6 +30,7 @@
 #include <VBox/sup.h>
 #include <VBox/err.h>
 #include <VBox/param.h>
+#include <iprt/asm.h>
 #include <iprt/assert.h>
 #include <iprt/file.h>
 #include <iprt/initterm.h>
@@ -39,6 +40,9 @@
 #include <iprt/time.h>
 #include <iprt/thread.h>
 #include <iprt/path.h>
+#ifdef RT_OS_LINUX
+# include <sys/mman.h>
+#endif
 
 
 /*********************************************************************************************************************************
@@ -52,6 +56,10 @@
 # define TSTSSM_ITEM_SIZE    (5*_1M)
 #endif
 
+/** The number of pages Item03Load keeps in flight when using
+ *  SSMR3GetMemDeferred. */
+#define TSTSSM_DEFERRED_PAGES   64
+
 
 /*********************************************************************************************************************************
 *   Global Variables                                                                                                             *
@@ -63,6 +71,14 @@ uint8_t         gabBigMem[_1M];
 #else
 uint8_t         gabBigMem[8*_1M];
 #endif
+/** Whether the big items should be loaded the way PGM loads guest RAM, i.e.
+ * using SSMR3GetMemDeferred and SSMR3SkipZeroMem. */
+bool            g_fLoadDeferred = false;
+/** The number of zero pages Item04Load didn't have to touch. */
+uint32_t        g_cZeroPagesSkipped = 0;
+/** Lazily backed stand-in for guest RAM that Item04Load restores into when
+ * loading deferred, used to check that zero pages stay unbacked. */
+uint8_t        *g_pbItem04Ram = NULL;
 
 
 /** initializes gabBigMem with some non zero stuff. */
@@ -451,6 +467,71 @@ DECLCALLBACK(int) Item03Save(PVM pVM, PSSMHANDLE pSSM)
     return 0;
 }
 
+/**
+ * Item03Load worker that loads the pages the way PGM loads guest RAM.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            SSM operation handle.
+ * @param   cb              The number of bytes to load.
+ */
+static int Item03LoadDeferred(PSSMHANDLE pSSM, uint32_t cb)
+{
+    uint8_t *pbPages = (uint8_t *)RTMemPageAlloc(TSTSSM_DEFERRED_PAGES * PAGE_SIZE);
+    if (!pbPages)
+        return VERR_NO_MEMORY;
+
+    int            rc     = VINF_SUCCESS;
+    const uint8_t *pu8Org = &gabBigMem[0];
+    uint32_t       iPage  = 0;
+    while (cb > 0 && RT_SUCCESS(rc))
+    {
+        bool fZero;
+        rc = SSMR3SkipZeroMem(pSSM, PAGE_SIZE, &fZero);
+        if (RT_SUCCESS(rc))
+        {
+            if (fZero)
+                ASMMemZeroPage(&pbPages[iPage * PAGE_SIZE]);
+            else
+                rc = SSMR3GetMemDeferred(pSSM, &pbPages[iPage * PAGE_SIZE], PAGE_SIZE);
+        }
+        if (RT_FAILURE(rc))
+        {
+            RTPrintf("Item03: SSMR3GetMemDeferred(,,%#x) -> %Rrc offset %#x\n", PAGE_SIZE, rc, TSTSSM_ITEM_SIZE - cb);
+            break;
+        }
+        cb -= PAGE_SIZE;
+
+        /* Wait and check the batch when it's full or we're done. */
+        if (++iPage == TSTSSM_DEFERRED_PAGES || !cb)
+        {
+            rc = SSMR3GetMemDeferredWait(pSSM);
+            if (RT_FAILURE(rc))
+            {
+                RTPrintf("Item03: SSMR3GetMemDeferredWait -> %Rrc offset %#x\n", rc, TSTSSM_ITEM_SIZE - cb);
+                break;
+            }
+            for (uint32_t i = 0; i < iPage; i++)
+            {
+                if (memcmp(&pbPages[i * PAGE_SIZE], pu8Org, PAGE_SIZE))
+                {
+                    RTPrintf("Item03: compare failed. mem offset=%#x\n", TSTSSM_ITEM_SIZE - cb - (iPage - i) * PAGE_SIZE);
+                    rc = VERR_GENERAL_FAILURE;
+                    break;
+                }
+                pu8Org += PAGE_SIZE;
+                if (pu8Org >= &gabBigMem[sizeof(gabBigMem)])
+                    pu8Org = &gabBigMem[0];
+            }
+            iPage = 0;
+        }
+    }
+
+    /* The pages must not be freed while the workers may still write to them. */
+    SSMR3GetMemDeferredWait(pSSM);
+    RTMemPageFree(pbPages, TSTSSM_DEFERRED_PAGES * PAGE_SIZE);
+    return rc;
+}
+
 /**
  * Prepare state load operation.
  *
@@ -488,6 +569,8 @@ DECLCALLBACK(int) Item03Load(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, uint32
     /*
      * Load the memory page by page.
      */
+    if (g_fLoadDeferred)
+        return Item03LoadDeferred(pSSM, cb);
     const uint8_t *pu8Org = &gabBigMem[0];
     while (cb > 0)
     {
@@ -539,20 +622,26 @@ DECLCALLBACK(int) Item04Save(PVM pVM, PSSMHANDLE pSSM)
     }
 
     /*
-     * Put 512 MB page by page.
+     * Put 512 MB page by page.  Use a page aligned source like guest RAM,
+     * SSM only squeezes aligned zero pages into zero records.
      */
+    void *pvZeroPage = RTMemPageAllocZ(PAGE_SIZE);
+    if (!pvZeroPage)
+        return VERR_NO_PAGE_MEMORY;
     while (cb > 0)
     {
-        rc = SSMR3PutMem(pSSM, gabPage, PAGE_SIZE);
+        rc = SSMR3PutMem(pSSM, pvZeroPage, PAGE_SIZE);
         if (RT_FAILURE(rc))
         {
-            RTPrintf("Item04: PutMem(,%p,%#x) -> %Rrc\n", gabPage, PAGE_SIZE, rc);
+            RTPrintf("Item04: PutMem(,%p,%#x) -> %Rrc\n", pvZeroPage, PAGE_SIZE, rc);
+            RTMemPageFree(pvZeroPage, PAGE_SIZE);
             return rc;
         }
 
         /* next */
         cb -= PAGE_SIZE;
     }
+    RTMemPageFree(pvZeroPage, PAGE_SIZE);
 
     uint64_t u64Elapsed = RTTimeNanoTS() - u64Start;
     RTPrintf("tstSSM: Saved 4th item in %'RI64 ns\n", u64Elapsed);
@@ -598,6 +687,35 @@ DECLCALLBACK(int) Item04Load(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, uint32
      */
     while (cb > 0)
     {
+        if (g_fLoadDeferred)
+        {
+            /* Zero pages needn't be touched, which is what keeps guest RAM unbacked. */
+            bool fZero;
+            rc = SSMR3SkipZeroMem(pSSM, PAGE_SIZE, &fZero);
+            if (RT_FAILURE(rc))
+            {
+                RTPrintf("Item04: SSMR3SkipZeroMem(,%#x,) -> %Rrc offset %#x\n", PAGE_SIZE, rc, 512*_1M - cb);
+                return rc;
+            }
+            if (fZero)
+            {
+                g_cZeroPagesSkipped++;
+                cb -= PAGE_SIZE;
+                continue;
+            }
+            if (g_pbItem04Ram)
+            {
+                rc = SSMR3GetMem(pSSM, &g_pbItem04Ram[512*_1M - cb], PAGE_SIZE);
+                if (RT_FAILURE(rc))
+                {
+                    RTPrintf("Item04: SSMR3GetMem(,,%#x) -> %Rrc offset %#x\n", PAGE_SIZE, rc, 512*_1M - cb);
+                    return rc;
+                }
+                cb -= PAGE_SIZE;
+                continue;
+            }
+        }
+
         char achPage[PAGE_SIZE];
         rc = SSMR3GetMem(pSSM, &achPage[0], PAGE_SIZE);
         if (RT_FAILURE(rc))
@@ -619,6 +737,37 @@ DECLCALLBACK(int) Item04Load(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, uint32
 }
 
 
+/**
+ * Counts the resident pages in a page aligned range.
+ *
+ * @returns Number of resident pages, UINT32_MAX if the host can't tell.
+ * @param   pv              The start of the range.
+ * @param   cb              The size of the range.
+ */
+static uint32_t tstSSMCountResidentPages(void *pv, size_t cb)
+{
+#ifdef RT_OS_LINUX
+    size_t const   cPages  = cb >> PAGE_SHIFT;
+    unsigned char *pabVec  = (unsigned char *)RTMemAlloc(cPages);
+    uint32_t       cResident = UINT32_MAX;
+    if (pabVec)
+    {
+        if (mincore(pv, cb, pabVec) == 0)
+        {
+            cResident = 0;
+            for (size_t i = 0; i < cPages; i++)
+                cResident += pabVec[i] & 1;
+        }
+        RTMemFree(pabVec);
+    }
+    return cResident;
+#else
+    RT_NOREF(pv, cb);
+    return UINT32_MAX;
+#endif
+}
+
+
 /**
  * Creates a mockup VM structure for testing SSM.
  *
@@ -697,6 +846,218 @@ static void destroyFakeVM(PVM pVM)
 }
 
 
+/**
+ * Saves with the zlib based compression settings and reads the zlib records
+ * back thru SSMR3Open/SSMR3Seek, checking that they really are zlib records
+ * by comparing the file size with the LZF one.
+ *
+ * @returns 0 on success, 1 on failure.
+ * @param   pVM             The cross context VM handle.
+ * @param   pszFilename     The file to save to.
+ */
+static int tstSSMZlibRoundTrip(PVM pVM, const char *pszFilename)
+{
+    static const struct
+    {
+        SSMCOMPRESSION  enmCompression;
+        const char     *pszName;
+    } s_aCompressions[] =
+    {
+        { SSMCOMPRESSION_FAST,  "fast"  },  /* LZF reference, must be first. */
+        { SSMCOMPRESSION_SMALL, "small" },
+        { SSMCOMPRESSION_MAX,   "max"   },
+    };
+    RTFOFF cbLzf = 0;
+    for (unsigned i = 0; i < RT_ELEMENTS(s_aCompressions); i++)
+    {
+        int rc = SSMR3Save(pVM, pszFilename, NULL, NULL, SSMAFTER_DESTROY, s_aCompressions[i].enmCompression, NULL, NULL);
+        if (RT_FAILURE(rc))
+        {
+            RTPrintf("tstSSM: zlib: SSMR3Save/%s -> %Rrc\n", s_aCompressions[i].pszName, rc);
+            return 1;
+        }
+
+        RTFSOBJINFO Info;
+        rc = RTPathQueryInfo(pszFilename, &Info, RTFSOBJATTRADD_NOTHING);
+        if (RT_FAILURE(rc))
+        {
+            RTPrintf("tstSSM: zlib: failed to query file size: %Rrc\n", rc);
+            return 1;
+        }
+        if (s_aCompressions[i].enmCompression == SSMCOMPRESSION_FAST)
+        {
+            cbLzf = Info.cbObject;
+            continue;
+        }
+
+        /* zlib compresses the test pattern noticeably better than LZF, a file
+           that isn't smaller means the setting didn't make it to the writer. */
+        if (Info.cbObject >= cbLzf)
+        {
+            RTPrintf("tstSSM: zlib: '%s' file is %'RI64 bytes, not smaller than the LZF one (%'RI64 bytes)\n",
+                     s_aCompressions[i].pszName, Info.cbObject, cbLzf);
+            return 1;
+        }
+
+        PSSMHANDLE pSSM;
+        rc = SSMR3Open(pszFilename, 0, &pSSM);
+        if (RT_FAILURE(rc))
+        {
+            RTPrintf("tstSSM: zlib: SSMR3Open/%s -> %Rrc\n", s_aCompressions[i].pszName, rc);
+            return 1;
+        }
+        uint32_t uVersion = 0xbadc0ded;
+        rc = SSMR3Seek(pSSM, "SSM Testcase Data Item no.2 (rand mem)", 2, &uVersion);
+        if (RT_SUCCESS(rc))
+            rc = Item02Load(NULL, pSSM, uVersion, SSM_PASS_FINAL);
+        if (RT_SUCCESS(rc))
+            rc = SSMR3Seek(pSSM, "SSM Testcase Data Item no.3 (big mem)", 0, &uVersion);
+        if (RT_SUCCESS(rc))
+            rc = Item03Load(NULL, pSSM, uVersion, SSM_PASS_FINAL);
+        int rc2 = SSMR3Close(pSSM);
+        if (RT_FAILURE(rc) || RT_FAILURE(rc2))
+        {
+            RTPrintf("tstSSM: zlib: reading back '%s' failed: rc=%Rrc rc2=%Rrc\n", s_aCompressions[i].pszName, rc, rc2);
+            return 1;
+        }
+        RTPrintf("tstSSM: zlib: '%s' round trip ok, %'RI64 bytes vs %'RI64 bytes with LZF\n",
+                 s_aCompressions[i].pszName, Info.cbObject, cbLzf);
+    }
+    return 0;
+}
+
+
+/**
+ * Loads item 3 the way PGM does a lazy restore of guest RAM, only noting down
+ * where the pages are with SSMR3GetMemLocation, and then reads all the pages
+ * back with SSMR3ReadMemLocation after the saved state has been closed.
+ *
+ * @returns 0 on success, 1 on failure.
+ * @param   pVM             The cross context VM handle.
+ * @param   pszFilename     The file to save to.
+ */
+static int tstSSMLazyRoundTrip(PVM pVM, const char *pszFilename)
+{
+    static const struct
+    {
+        SSMCOMPRESSION  enmCompression;
+        const char     *pszName;
+    } s_aCompressions[] =
+    {
+        { SSMCOMPRESSION_NONE,  "none"  },
+        { SSMCOMPRESSION_FAST,  "fast"  },
+        { SSMCOMPRESSION_SMALL, "small" },
+    };
+    uint32_t const cPages = TSTSSM_ITEM_SIZE / PAGE_SIZE;
+    uint64_t *pauLocations = (uint64_t *)RTMemAllocZ(cPages * sizeof(uint64_t));
+    if (!pauLocations)
+    {
+        RTPrintf("tstSSM: lazy: out of memory\n");
+        return 1;
+    }
+
+    int rcRet = 0;
+    for (unsigned i = 0; i < RT_ELEMENTS(s_aCompressions) && !rcRet; i++)
+    {
+        const char *pszName = s_aCompressions[i].pszName;
+        int rc = SSMR3Save(pVM, pszFilename, NULL, NULL, SSMAFTER_DESTROY, s_aCompressions[i].enmCompression, NULL, NULL);
+        if (RT_FAILURE(rc))
+        {
+            RTPrintf("tstSSM: lazy: SSMR3Save/%s -> %Rrc\n", pszName, rc);
+            rcRet = 1;
+            break;
+        }
+
+        /*
+         * Index the pages, loading the ones SSM cannot locate right away.
+         */
+        PSSMHANDLE pSSM;
+        rc = SSMR3Open(pszFilename, 0, &pSSM);
+        if (RT_FAILURE(rc))
+        {
+            RTPrintf("tstSSM: lazy: SSMR3Open/%s -> %Rrc\n", pszName, rc);
+            rcRet = 1;
+            break;
+        }
+        RTFILE   hFile    = NIL_RTFILE;
+        uint32_t uVersion = 0xbadc0ded;
+        uint32_t cb       = 0;
+        uint32_t cLazy    = 0;
+        rc = SSMR3Seek(pSSM, "SSM Testcase Data Item no.3 (big mem)", 0, &uVersion);
+        if (RT_SUCCESS(rc))
+            rc = SSMR3GetU32(pSSM, &cb);
+        if (RT_SUCCESS(rc) && cb != TSTSSM_ITEM_SIZE)
+            rc = VERR_GENERAL_FAILURE;
+        if (RT_SUCCESS(rc))
+            rc = SSMR3OpenMemLocationFile(pSSM, &hFile);
+        for (uint32_t iPage = 0; iPage < cPages && RT_SUCCESS(rc); iPage++)
+        {
+            const uint8_t *pu8Org = &gabBigMem[(iPage * PAGE_SIZE) % sizeof(gabBigMem)];
+            bool fZero;
+            rc = SSMR3SkipZeroMem(pSSM, PAGE_SIZE, &fZero);
+            if (RT_SUCCESS(rc) && !fZero)
+                rc = SSMR3GetMemLocation(pSSM, PAGE_SIZE, &pauLocations[iPage]);
+            if (RT_SUCCESS(rc) && !fZero && !pauLocations[iPage])
+            {
+                char achPage[PAGE_SIZE];
+                rc = SSMR3GetMem(pSSM, &achPage[0], PAGE_SIZE);
+                if (RT_SUCCESS(rc) && memcmp(achPage, pu8Org, PAGE_SIZE))
+                {
+                    RTPrintf("tstSSM: lazy: '%s' compare failed. mem offset=%#x\n", pszName, iPage * PAGE_SIZE);
+                    rc = VERR_GENERAL_FAILURE;
+                }
+            }
+            else if (RT_SUCCESS(rc) && fZero && !ASMMemIsZeroPage(pu8Org))
+            {
+                RTPrintf("tstSSM: lazy: '%s' page at mem offset=%#x skipped as zero\n", pszName, iPage * PAGE_SIZE);
+                rc = VERR_GENERAL_FAILURE;
+            }
+            if (RT_SUCCESS(rc) && pauLocations[iPage])
+                cLazy++;
+        }
+        int rc2 = SSMR3Close(pSSM);
+        if (RT_FAILURE(rc) || RT_FAILURE(rc2))
+        {
+            RTPrintf("tstSSM: lazy: indexing '%s' failed: rc=%Rrc rc2=%Rrc\n", pszName, rc, rc2);
+            rcRet = 1;
+        }
+        else if (!cLazy)
+        {
+            RTPrintf("tstSSM: lazy: no pages of '%s' could be located\n", pszName);
+            rcRet = 1;
+        }
+
+        /*
+         * Read the pages back after the handle is closed, backwards to make
+         * sure the locations don't depend on the file position.
+         */
+        for (uint32_t iPage = cPages; iPage-- > 0 && !rcRet;)
+            if (pauLocations[iPage])
+            {
+                uint8_t abPage[PAGE_SIZE];
+                rc = SSMR3ReadMemLocation(hFile, pauLocations[iPage], abPage, PAGE_SIZE);
+                if (RT_FAILURE(rc))
+                {
+                    RTPrintf("tstSSM: lazy: SSMR3ReadMemLocation/%s(%#RX64) -> %Rrc\n", pszName, pauLocations[iPage], rc);
+                    rcRet = 1;
+                }
+                else if (memcmp(abPage, &gabBigMem[(iPage * PAGE_SIZE) % sizeof(gabBigMem)], PAGE_SIZE))
+                {
+                    RTPrintf("tstSSM: lazy: '%s' compare failed after close. mem offset=%#x\n", pszName, iPage * PAGE_SIZE);
+                    rcRet = 1;
+                }
+                pauLocations[iPage] = 0;
+            }
+        RTFileClose(hFile);
+        if (!rcRet)
+            RTPrintf("tstSSM: lazy: '%s' round trip ok, %u of %u pages read after close\n", pszName, cLazy, cPages);
+    }
+
+    RTMemFree(pauLocations);
+    return rcRet;
+}
+
+
 /**
  *  Entry point.
  */
@@ -772,7 +1133,7 @@ extern "C" DECLEXPORT(int) TrustedMain(int argc, char **argv, char **envp)
      * Attempt a save.
      */
     uint64_t u64Start = RTTimeNanoTS();
-    rc = SSMR3Save(pVM, pszFilename, NULL, NULL, SSMAFTER_DESTROY, NULL, NULL);
+    rc = SSMR3Save(pVM, pszFilename, NULL, NULL, SSMAFTER_DESTROY, SSMCOMPRESSION_DEFAULT, NULL, NULL);
     if (RT_FAILURE(rc))
     {
         RTPrintf("SSMR3Save #1 -> %Rrc\n", rc);
@@ -827,6 +1188,111 @@ extern "C" DECLEXPORT(int) TrustedMain(int argc, char **argv, char **envp)
     u64Elapsed = RTTimeNanoTS() - u64Start;
     RTPrintf("tstSSM: Validated and checksummed in %'RI64 ns\n", u64Elapsed);
 
+    /*
+     * Round trip with the other compression methods.
+     */
+    static const struct
+    {
+        SSMCOMPRESSION  enmCompression;
+        const char     *pszName;
+    } s_aCompressions[] =
+    {
+        { SSMCOMPRESSION_NONE,  "none"  },
+        { SSMCOMPRESSION_FAST,  "fast"  },
+        { SSMCOMPRESSION_SMALL, "small" },
+        { SSMCOMPRESSION_MAX,   "max"   },
+    };
+    for (unsigned i = 0; i < RT_ELEMENTS(s_aCompressions); i++)
+    {
+        u64Start = RTTimeNanoTS();
+        rc = SSMR3Save(pVM, pszFilename, NULL, NULL, SSMAFTER_DESTROY, s_aCompressions[i].enmCompression, NULL, NULL);
+        if (RT_FAILURE(rc))
+        {
+            RTPrintf("SSMR3Save #2/%s -> %Rrc\n", s_aCompressions[i].pszName, rc);
+            return 1;
+        }
+        u64Elapsed = RTTimeNanoTS() - u64Start;
+        RTPrintf("tstSSM: Saved with compression '%s' in %'RI64 ns\n", s_aCompressions[i].pszName, u64Elapsed);
+
+        rc = RTPathQueryInfo(pszFilename, &Info, RTFSOBJATTRADD_NOTHING);
+        if (RT_FAILURE(rc))
+        {
+            RTPrintf("tstSSM: failed to query file size: %Rrc\n", rc);
+            return 1;
+        }
+        RTPrintf("tstSSM: file size %'RI64 bytes\n", Info.cbObject);
+
+        u64Start = RTTimeNanoTS();
+        rc = SSMR3Load(pVM, pszFilename, NULL /*pStreamOps*/, NULL /*pStreamOpsUser*/,
+                       SSMAFTER_RESUME, NULL /*pfnProgress*/, NULL /*pvProgressUser*/);
+        if (RT_FAILURE(rc))
+        {
+            RTPrintf("SSMR3Load #2/%s -> %Rrc\n", s_aCompressions[i].pszName, rc);
+            return 1;
+        }
+        u64Elapsed = RTTimeNanoTS() - u64Start;
+        RTPrintf("tstSSM: Loaded in %'RI64 ns\n", u64Elapsed);
+
+        /* Again, the way PGM loads guest RAM, restoring the zero item into
+           lazily backed memory that must still be unbacked afterwards. */
+        g_pbItem04Ram = (uint8_t *)RTMemPageAlloc(512*_1M);
+        if (!g_pbItem04Ram)
+        {
+            RTPrintf("tstSSM: failed to allocate 512MB of address space\n");
+            return 1;
+        }
+        g_fLoadDeferred     = true;
+        g_cZeroPagesSkipped = 0;
+        u64Start = RTTimeNanoTS();
+        rc = SSMR3Load(pVM, pszFilename, NULL /*pStreamOps*/, NULL /*pStreamOpsUser*/,
+                       SSMAFTER_RESUME, NULL /*pfnProgress*/, NULL /*pvProgressUser*/);
+        g_fLoadDeferred     = false;
+        if (RT_FAILURE(rc))
+        {
+            RTPrintf("SSMR3Load #3/%s -> %Rrc\n", s_aCompressions[i].pszName, rc);
+            return 1;
+        }
+        u64Elapsed = RTTimeNanoTS() - u64Start;
+        RTPrintf("tstSSM: Loaded deferred in %'RI64 ns, %'RU64 bytes of zero pages left untouched\n",
+                 u64Elapsed, (uint64_t)g_cZeroPagesSkipped * PAGE_SIZE);
+        if (g_cZeroPagesSkipped != 512*_1M / PAGE_SIZE)
+        {
+            RTPrintf("tstSSM: Only %u of %u zero pages were skipped with '%s'\n",
+                     g_cZeroPagesSkipped, 512*_1M / PAGE_SIZE, s_aCompressions[i].pszName);
+            return 1;
+        }
+
+        uint32_t cResident = tstSSMCountResidentPages(g_pbItem04Ram, 512*_1M);
+        if (cResident != UINT32_MAX)
+        {
+            RTPrintf("tstSSM: %'RU64 bytes of the restored zero memory are resident\n", (uint64_t)cResident * PAGE_SIZE);
+            if (cResident != 0)
+            {
+                RTPrintf("tstSSM: Restoring zero pages backed %u pages with '%s'\n", cResident, s_aCompressions[i].pszName);
+                return 1;
+            }
+
+            /* Make sure the residency check itself works. */
+            g_pbItem04Ram[0] = 1;
+            cResident = tstSSMCountResidentPages(g_pbItem04Ram, 512*_1M);
+            if (cResident != 1)
+            {
+                RTPrintf("tstSSM: Residency check is broken: %u pages resident after touching one\n", cResident);
+                return 1;
+            }
+        }
+        RTMemPageFree(g_pbItem04Ram, 512*_1M);
+        g_pbItem04Ram = NULL;
+    }
+
+    /*
+     * The zlib records, written and read back thru open/seek.
+     */
+    if (tstSSMZlibRoundTrip(pVM, pszFilename))
+        return 1;
+    if (tstSSMLazyRoundTrip(pVM, pszFilename))
+        return 1;
+
     /*
      * Open it and read.
      */
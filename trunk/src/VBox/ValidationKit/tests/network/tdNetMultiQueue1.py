@@ -0,0 +1,393 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+# $Id$
+
+"""
+VirtualBox Validation Kit - Virtio-net multi-queue test #1.
+"""
+
+__copyright__ = \
+"""
+Copyright (C) 2016 Oracle Corporation
+
+This file is part of VirtualBox Open Source Edition (OSE), as
+available from http://www.virtualbox.org. This file is free software;
+you can redistribute it and/or modify it under the terms of the GNU
+General Public License (GPL) as published by the Free Software
+Foundation, in version 2 as it comes in the "COPYING" file of the
+VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+
+The contents of this file may alternatively be used under the terms
+of the Common Development and Distribution License Version 1.0
+(CDDL) only, as it comes in the "COPYING.CDDL" file of the
+VirtualBox OSE distribution, in which case the provisions of the
+CDDL are applicable instead of those of the GPL.
+
+You may elect to license modified versions of this file under the
+terms and conditions of either the GPL or the CDDL or both.
+"""
+__version__ = "$Revision$"
+
+
+# Standard Python imports.
+import os;
+import re;
+import socket;
+import sys;
+
+# Only the main script needs to modify the path.
+try:    __file__
+except: __file__ = sys.argv[0];
+g_ksValidationKitDir = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))));
+sys.path.append(g_ksValidationKitDir);
+
+# Validation Kit imports.
+from testdriver import reporter;
+from testdriver import base;
+from testdriver import vbox;
+from testdriver import vboxcon;
+
+
+class tdNetMultiQueue1(vbox.TestDriver):                                        # pylint: disable=R0902
+    """
+    Virtio-net multi-queue test #1.
+
+    Runs several TCP throughput streams in parallel from a Linux guest with
+    the given number of virtio-net queue pairs, checks that all of them
+    complete and that the device spread the traffic over the queue pairs.
+
+    A NetPerf server has to listen on each of the ports used, i.e.
+    'NetPerf --server --port <port>' for --base-port up to --base-port +
+    the number of streams - 1, on the server host.
+    """
+
+    def __init__(self):
+        vbox.TestDriver.__init__(self);
+        self.asRsrcs            = None;
+        self.sServerName        = socket.getfqdn();
+        self.sServerIP          = None;
+        self.uBasePort          = 5002;
+        self.asTestVMsDef       = ['tst-storage',];
+        self.asTestVMs          = self.asTestVMsDef;
+        self.asSkipVMs          = [];
+        self.asVirtModesDef     = ['hwvirt', 'hwvirt-np',];
+        self.asVirtModes        = self.asVirtModesDef;
+        self.acCpusDef          = [4,];
+        self.acCpus             = self.acCpusDef;
+        self.acQueuePairsDef    = [1, 4,];
+        self.acQueuePairs       = self.acQueuePairsDef;
+        self.cStreamsDef        = 8;
+        self.cStreams           = self.cStreamsDef;
+        self.sNicAttachmentDef  = 'bridged';
+        self.sNicAttachment     = self.sNicAttachmentDef;
+        self.cSecsRunDef        = 30;
+        self.cSecsRun           = self.cSecsRunDef;
+
+    #
+    # Overridden methods.
+    #
+    def showUsage(self):
+        rc = vbox.TestDriver.showUsage(self);
+        reporter.log('');
+        reporter.log('tdNetMultiQueue1 Options:');
+        reporter.log('  --server-host  <hostname|address>');
+        reporter.log('      The host running the NetPerf servers.  Default: %s' % (self.sServerName));
+        reporter.log('  --base-port    <port>');
+        reporter.log('      The port of the first NetPerf server.  Default: %u' % (self.uBasePort));
+        reporter.log('  --virt-modes   <m1[:m2[:]]');
+        reporter.log('      Default: %s' % (':'.join(self.asVirtModesDef)));
+        reporter.log('  --cpu-counts   <c1[:c2[:]]');
+        reporter.log('      Default: %s' % (':'.join(str(c) for c in self.acCpusDef)));
+        reporter.log('  --queue-pairs  <n1[:n2[:]]');
+        reporter.log('      Default: %s' % (':'.join(str(c) for c in self.acQueuePairsDef)));
+        reporter.log('  --streams      <count>');
+        reporter.log('      Default: %u' % (self.cStreamsDef));
+        reporter.log('  --nic-attachment <bridged|nat>');
+        reporter.log('      Default: %s' % (self.sNicAttachmentDef));
+        reporter.log('  --secs-per-run <seconds>');
+        reporter.log('      Default: %s' % (self.cSecsRunDef));
+        reporter.log('  --test-vms     <vm1[:vm2[:...]]>');
+        reporter.log('      Test the specified VMs in the given order. Use this to change');
+        reporter.log('      the execution order or limit the choice of VMs');
+        reporter.log('      Default: %s  (all)' % (':'.join(self.asTestVMsDef)));
+        reporter.log('  --skip-vms     <vm1[:vm2[:...]]>');
+        reporter.log('      Skip the specified VMs when testing.');
+        reporter.log('  --quick');
+        reporter.log('      Shorthand for: --virt-modes hwvirt --secs-per-run 5');
+        return rc;
+
+    def parseOption(self, asArgs, iArg):                                        # pylint: disable=R0912,R0915
+        if asArgs[iArg] == '--server-host':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--server-host" takes an IP address or a hostname');
+            self.sServerName = asArgs[iArg];
+        elif asArgs[iArg] == '--base-port':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--base-port" takes a port number');
+            try:    self.uBasePort = int(asArgs[iArg]);
+            except: raise base.InvalidOption('The "--base-port" value "%s" is not an integer' % (asArgs[iArg],));
+            if self.uBasePort <= 0 or self.uBasePort >= 65536:
+                raise base.InvalidOption('The "--base-port" value "%s" is not a valid port' % (asArgs[iArg],));
+        elif asArgs[iArg] == '--virt-modes':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--virt-modes" takes a colon separated list of modes');
+            self.asVirtModes = asArgs[iArg].split(':');
+            for s in self.asVirtModes:
+                if s not in self.asVirtModesDef:
+                    raise base.InvalidOption('The "--virt-modes" value "%s" is not valid; valid values are: %s' \
+                        % (s, ' '.join(self.asVirtModesDef)));
+        elif asArgs[iArg] == '--cpu-counts':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--cpu-counts" takes a colon separated list of cpu counts');
+            self.acCpus = [];
+            for s in asArgs[iArg].split(':'):
+                try: c = int(s);
+                except: raise base.InvalidOption('The "--cpu-counts" value "%s" is not an integer' % (s,));
+                if c <= 0:  raise base.InvalidOption('The "--cpu-counts" value "%s" is zero or negative' % (s,));
+                self.acCpus.append(c);
+        elif asArgs[iArg] == '--queue-pairs':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--queue-pairs" takes a colon separated list of counts');
+            self.acQueuePairs = [];
+            for s in asArgs[iArg].split(':'):
+                try: c = int(s);
+                except: raise base.InvalidOption('The "--queue-pairs" value "%s" is not an integer' % (s,));
+                if c <= 0 or c > 8:
+                    raise base.InvalidOption('The "--queue-pairs" value "%s" is not in the range 1..8' % (s,));
+                self.acQueuePairs.append(c);
+        elif asArgs[iArg] == '--streams':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--streams" takes a stream count');
+            try:    self.cStreams = int(asArgs[iArg]);
+            except: raise base.InvalidOption('The "--streams" value "%s" is not an integer' % (asArgs[iArg],));
+            if self.cStreams <= 0:
+                raise base.InvalidOption('The "--streams" value "%s" is zero or negative.' % (asArgs[iArg],));
+        elif asArgs[iArg] == '--nic-attachment':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--nic-attachment" takes an argument');
+            self.sNicAttachment = asArgs[iArg];
+            if self.sNicAttachment not in ('bridged', 'nat'):
+                raise base.InvalidOption('The "--nic-attachment" value "%s" is not supported. Valid values are: bridged, nat' \
+                        % (self.sNicAttachment));
+        elif asArgs[iArg] == '--secs-per-run':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--secs-per-run" takes second count');
+            try:    self.cSecsRun = int(asArgs[iArg]);
+            except: raise base.InvalidOption('The "--secs-per-run" value "%s" is not an integer' % (asArgs[iArg],));
+            if self.cSecsRun <= 0:
+                raise base.InvalidOption('The "--secs-per-run" value "%s" is zero or negative.' % (self.cSecsRun,));
+        elif asArgs[iArg] == '--test-vms':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--test-vms" takes colon separated list');
+            self.asTestVMs = asArgs[iArg].split(':');
+            for s in self.asTestVMs:
+                if s not in self.asTestVMsDef:
+                    raise base.InvalidOption('The "--test-vms" value "%s" is not valid; valid values are: %s' \
+                        % (s, ' '.join(self.asTestVMsDef)));
+        elif asArgs[iArg] == '--skip-vms':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--skip-vms" takes colon separated list');
+            self.asSkipVMs = asArgs[iArg].split(':');
+            for s in self.asSkipVMs:
+                if s not in self.asTestVMsDef:
+                    reporter.log('warning: The "--test-vms" value "%s" does not specify any of our test VMs.' % (s));
+        elif asArgs[iArg] == '--quick':
+            self.cSecsRun           = 5;
+            self.asVirtModes        = ['hwvirt',];
+        else:
+            return vbox.TestDriver.parseOption(self, asArgs, iArg);
+        return iArg + 1;
+
+    def completeOptions(self):
+        # Remove skipped VMs from the test list.
+        for sVM in self.asSkipVMs:
+            try:    self.asTestVMs.remove(sVM);
+            except: pass;
+
+        self.sServerIP = base.tryGetHostByName(self.sServerName);
+        reporter.log('Server IP: %s' % (self.sServerIP));
+
+        return vbox.TestDriver.completeOptions(self);
+
+    def getResourceSet(self):
+        # Construct the resource list the first time it's queried.
+        if self.asRsrcs is None:
+            self.asRsrcs = [];
+            if 'tst-storage' in self.asTestVMs:
+                self.asRsrcs.append('5.0/storage/tst-storage.vdi');
+        return self.asRsrcs;
+
+    def actionConfig(self):
+        # Make sure vboxapi has been imported so we can use the constants.
+        if not self.importVBoxApi():
+            return False;
+
+        eNic0AttachType = vboxcon.NetworkAttachmentType_Bridged;
+        if self.sNicAttachment == 'nat':
+            eNic0AttachType = vboxcon.NetworkAttachmentType_NAT;
+
+        # Linux VMs, the guest kernel needs to know about VIRTIO_NET_F_MQ.
+        if 'tst-storage' in self.asTestVMs:
+            oVM = self.createTestVM('tst-storage', 1, '5.0/storage/tst-storage.vdi', sKind = 'ArchLinux_64', fIoApic = True, \
+                                    eNic0AttachType = eNic0AttachType, eNic0Type = vboxcon.NetworkAdapterType_Virtio);
+            if oVM is None:
+                return False;
+
+        return True;
+
+    def actionExecute(self):
+        """
+        Execute the testcase.
+        """
+        fRc = self.test1();
+        return fRc;
+
+
+    #
+    # Test execution helpers.
+    #
+
+    def test1QueryQueueStats(self, oSession):
+        """
+        Returns a list with the number of transmitted and received packets
+        for each queue pair of the first virtio-net instance, None on failure.
+        """
+        try:
+            sStats = oSession.o.console.debugger.getStats('/Devices/VNet0/Queue*', False);
+        except:
+            reporter.errorXcpt('IMachineDebugger::getStats failed');
+            return None;
+
+        aacPackets = [];
+        for oMatch in re.finditer(r'c="(\d+)"[^>]*name="/Devices/VNet0/Queue(\d+)/(Transmit|Receive)Packets"', sStats):
+            iPair = int(oMatch.group(2));
+            while len(aacPackets) <= iPair:
+                aacPackets.append([0, 0]);
+            aacPackets[iPair][0 if oMatch.group(3) == 'Transmit' else 1] = int(oMatch.group(1));
+        return aacPackets;
+
+    def test1RunStreams(self, oTxsSession):
+        """
+        Runs the NetPerf throughput streams in parallel in the guest.
+
+        TXS runs one process at a time, so a shell starts the clients and
+        fails if any of them does.  TXS expands '${...}' itself and doesn't
+        cope with other uses of '$', so the script does without shell variables.
+        """
+        sFailed = '${SCRATCH}/tdNetMultiQueue1-failed';
+        sScript = 'rm -f %s; ' % (sFailed,);
+        for i in range(self.cStreams):
+            sScript += '(${CDROM}/${OS/ARCH}/NetPerf --client %s --port %u --interval %u --mode throughput || touch %s) & ' \
+                     % (self.sServerIP, self.uBasePort + i, self.cSecsRun, sFailed);
+        sScript += 'wait; test ! -e %s' % (sFailed,);
+
+        # Each stream runs the interval in both directions, allow for a stalled queue to show up as a timeout.
+        return self.txsRunTest(oTxsSession, '%u streams' % (self.cStreams,), self.cSecsRun * 2 * 1000 * 4,
+                               '/bin/sh', ('sh', '-c', sScript));
+
+    def test1OneCfg(self, sVmName, cQueuePairs, cCpus, fNestedPaging):
+        """
+        Runs the specified VM thru test #1.
+
+        Returns a success indicator on the general test execution. This is not
+        the actual test result.
+        """
+        oVM = self.getVmByName(sVmName);
+
+        # Reconfigure the VM
+        fRc = True;
+        oSession = self.openSession(oVM);
+        if oSession is not None:
+            fRc = fRc and oSession.setExtraData('VBoxInternal/Devices/virtio-net/0/Config/QueuePairs', str(cQueuePairs));
+            fRc = fRc and oSession.enableVirtEx(True);
+            fRc = fRc and oSession.enableNestedPaging(fNestedPaging);
+            fRc = fRc and oSession.setCpuCount(cCpus);
+            fRc = fRc and oSession.saveSettings();
+            fRc = oSession.close() and fRc and True; # pychecker hack.
+            oSession = None;
+        else:
+            fRc = False;
+
+        # Start up.
+        if fRc is True:
+            self.logVmInfo(oVM);
+            oSession, oTxsSession = self.startVmAndConnectToTxsViaTcp(sVmName, fCdWait = True);
+            if oSession is not None:
+                self.addTask(oSession);
+
+                # Fudge factor - Allow the guest to finish starting up.
+                self.sleep(5);
+
+                fRc = self.test1RunStreams(oTxsSession);
+                if fRc:
+                    aacPackets = self.test1QueryQueueStats(oSession);
+                    if aacPackets is None:
+                        fRc = False;
+                    else:
+                        reporter.log('Packets per queue pair (transmitted, received): %s' % (aacPackets,));
+                        cTxPairs = len([acPackets for acPackets in aacPackets if acPackets[0] > 0]);
+                        cRxPairs = len([acPackets for acPackets in aacPackets if acPackets[1] > 0]);
+                        if len(aacPackets) != cQueuePairs:
+                            reporter.testFailure('Expected statistics for %u queue pairs, got %u' \
+                                                 % (cQueuePairs, len(aacPackets)));
+                        elif cTxPairs == 0 or cRxPairs == 0:
+                            reporter.testFailure('No traffic on any queue pair');
+                        elif cQueuePairs > 1 and (cTxPairs < 2 or cRxPairs < 2):
+                            reporter.testFailure('The traffic was not spread over the queue pairs (%u transmitting, %u receiving)' \
+                                                 % (cTxPairs, cRxPairs));
+
+                # cleanup.
+                self.removeTask(oTxsSession);
+                self.terminateVmBySession(oSession);
+            else:
+                fRc = False;
+        return fRc;
+
+    def test1OneVM(self, sVmName):
+        """
+        Runs one VM thru the various configurations.
+        """
+        reporter.testStart(sVmName);
+        fRc = True;
+        for cQueuePairs in self.acQueuePairs:
+            if cQueuePairs == 1:    reporter.testStart('1 queue pair');
+            else:                   reporter.testStart('%u queue pairs' % (cQueuePairs));
+
+            for cCpus in self.acCpus:
+                if cCpus == 1:  reporter.testStart('1 cpu');
+                else:           reporter.testStart('%u cpus' % (cCpus));
+
+                for sVirtMode in self.asVirtModes:
+                    hsVirtModeDesc = {};
+                    hsVirtModeDesc['hwvirt']    = 'HwVirt';
+                    hsVirtModeDesc['hwvirt-np'] = 'NestedPaging';
+                    reporter.testStart(hsVirtModeDesc[sVirtMode]);
+
+                    fNestedPaging = sVirtMode == 'hwvirt-np';
+                    fRc = self.test1OneCfg(sVmName, cQueuePairs, cCpus, fNestedPaging) and fRc and True; # pychecker hack.
+
+                    reporter.testDone();
+                reporter.testDone();
+            reporter.testDone();
+        reporter.testDone();
+        return fRc;
+
+    def test1(self):
+        """
+        Executes test #1.
+        """
+        if self.sServerIP is None:
+            reporter.error('Unable to resolve the server host "%s"' % (self.sServerName,));
+            return False;
+
+        fRc = True;
+        for sVM in self.asTestVMs:
+            if not self.test1OneVM(sVM):
+                fRc = False;
+        return fRc;
+
+
+
+if __name__ == '__main__':
+    sys.exit(tdNetMultiQueue1().main(sys.argv));
@@ -0,0 +1,392 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+# $Id$
+
+"""
+VirtualBox Validation Kit - NAT with many idle connections test #1.
+"""
+
+__copyright__ = \
+"""
+Copyright (C) 2016 Oracle Corporation
+
+This file is part of VirtualBox Open Source Edition (OSE), as
+available from http://www.virtualbox.org. This file is free software;
+you can redistribute it and/or modify it under the terms of the GNU
+General Public License (GPL) as published by the Free Software
+Foundation, in version 2 as it comes in the "COPYING" file of the
+VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+
+The contents of this file may alternatively be used under the terms
+of the Common Development and Distribution License Version 1.0
+(CDDL) only, as it comes in the "COPYING.CDDL" file of the
+VirtualBox OSE distribution, in which case the provisions of the
+CDDL are applicable instead of those of the GPL.
+
+You may elect to license modified versions of this file under the
+terms and conditions of either the GPL or the CDDL or both.
+"""
+__version__ = "$Revision$"
+
+
+# Standard Python imports.
+import os;
+import re;
+import socket;
+import sys;
+import threading;
+import time;
+
+# Only the main script needs to modify the path.
+try:    __file__
+except: __file__ = sys.argv[0];
+g_ksValidationKitDir = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))));
+sys.path.append(g_ksValidationKitDir);
+
+# Validation Kit imports.
+from testdriver import reporter;
+from testdriver import base;
+from testdriver import vbox;
+from testdriver import vboxcon;
+
+
+class IdleConnServer(object):
+    """
+    Accepts the guest connections on the host and keeps them open, one of
+    them gets a byte every few milliseconds to keep the NAT engine busy.
+    """
+
+    def __init__(self, uPort):
+        self.uPort      = uPort;
+        self.oLock      = threading.Lock();
+        self.aoConns    = [];
+        self.fBusy      = False;
+        self.fTerminate = False;
+        self.oListener  = None;
+        self.oThread    = None;
+
+    def start(self):
+        """ Starts listening, returns success indicator. """
+        try:
+            self.oListener = socket.socket(socket.AF_INET, socket.SOCK_STREAM);
+            self.oListener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1);
+            self.oListener.bind(('127.0.0.1', self.uPort));
+            self.oListener.listen(128);
+            self.oListener.settimeout(0.01);
+        except:
+            reporter.errorXcpt('Failed to listen on port %u' % (self.uPort,));
+            return False;
+        self.oThread = threading.Thread(target = self.threadProc, name = 'IdleConnServer');
+        self.oThread.start();
+        return True;
+
+    def stop(self):
+        """ Stops the server and closes all connections. """
+        self.fTerminate = True;
+        if self.oThread is not None:
+            self.oThread.join();
+            self.oThread = None;
+        for oConn in self.aoConns:
+            try:    oConn.close();
+            except: pass;
+        self.aoConns = [];
+        if self.oListener is not None:
+            self.oListener.close();
+            self.oListener = None;
+
+    def getConnectionCount(self):
+        """ Returns the number of connections accepted so far. """
+        self.oLock.acquire();
+        cConns = len(self.aoConns);
+        self.oLock.release();
+        return cConns;
+
+    def setBusy(self, fBusy):
+        """ Starts or stops sending on the first connection. """
+        self.fBusy = fBusy;
+
+    def threadProc(self):
+        """ Accepts connections and sends on the first one while busy. """
+        while not self.fTerminate:
+            try:
+                (oConn, _) = self.oListener.accept();
+                self.oLock.acquire();
+                self.aoConns.append(oConn);
+                self.oLock.release();
+            except socket.timeout:
+                pass;
+            except:
+                reporter.logXcpt();
+                time.sleep(0.01);
+            if self.fBusy and self.aoConns:
+                try:    self.aoConns[0].send(b'x');
+                except: pass;
+        return True;
+
+
+class tdNetNatIdle1(vbox.TestDriver):                                           # pylint: disable=R0902
+    """
+    NAT with many idle connections test #1.
+
+    A Linux guest opens a number of TCP connections thru NAT to a listener in
+    the test driver which keeps them open.  While all but one of them stay
+    idle, the test checks from the NAT statistics that the sockets looked at
+    per NAT event loop wakeup, i.e. the ones epoll reported plus the dirty
+    ones recalculated, don't grow with the number of connections.  Only the
+    periodic full resyncs are allowed to walk all of them.
+
+    The statistics are only available in builds with VBOX_WITH_STATISTICS,
+    the check is skipped otherwise.
+    """
+
+    def __init__(self):
+        vbox.TestDriver.__init__(self);
+        self.asRsrcs            = None;
+        self.uPort              = 5020;
+        self.asTestVMsDef       = ['tst-storage',];
+        self.asTestVMs          = self.asTestVMsDef;
+        self.asSkipVMs          = [];
+        self.acConnsDef         = [16, 384,];
+        self.acConns            = self.acConnsDef;
+        self.cSecsIdleDef       = 10;
+        self.cSecsIdle          = self.cSecsIdleDef;
+
+    #
+    # Overridden methods.
+    #
+    def showUsage(self):
+        rc = vbox.TestDriver.showUsage(self);
+        reporter.log('');
+        reporter.log('tdNetNatIdle1 Options:');
+        reporter.log('  --port         <port>');
+        reporter.log('      The host port to listen on.  Default: %u' % (self.uPort));
+        reporter.log('  --connections  <c1[:c2[:]]');
+        reporter.log('      Default: %s' % (':'.join(str(c) for c in self.acConnsDef)));
+        reporter.log('  --secs-idle    <seconds>');
+        reporter.log('      How long to sample the statistics.  Default: %s' % (self.cSecsIdleDef));
+        reporter.log('  --test-vms     <vm1[:vm2[:...]]>');
+        reporter.log('      Test the specified VMs in the given order. Use this to change');
+        reporter.log('      the execution order or limit the choice of VMs');
+        reporter.log('      Default: %s  (all)' % (':'.join(self.asTestVMsDef)));
+        reporter.log('  --skip-vms     <vm1[:vm2[:...]]>');
+        reporter.log('      Skip the specified VMs when testing.');
+        reporter.log('  --quick');
+        reporter.log('      Shorthand for: --connections 256 --secs-idle 5');
+        return rc;
+
+    def parseOption(self, asArgs, iArg):                                        # pylint: disable=R0912
+        if asArgs[iArg] == '--port':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--port" takes a port number');
+            try:    self.uPort = int(asArgs[iArg]);
+            except: raise base.InvalidOption('The "--port" value "%s" is not an integer' % (asArgs[iArg],));
+            if self.uPort <= 0 or self.uPort >= 65536:
+                raise base.InvalidOption('The "--port" value "%s" is not a valid port' % (asArgs[iArg],));
+        elif asArgs[iArg] == '--connections':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--connections" takes a colon separated list of counts');
+            self.acConns = [];
+            for s in asArgs[iArg].split(':'):
+                try: c = int(s);
+                except: raise base.InvalidOption('The "--connections" value "%s" is not an integer' % (s,));
+                if c <= 0:  raise base.InvalidOption('The "--connections" value "%s" is zero or negative' % (s,));
+                self.acConns.append(c);
+        elif asArgs[iArg] == '--secs-idle':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--secs-idle" takes second count');
+            try:    self.cSecsIdle = int(asArgs[iArg]);
+            except: raise base.InvalidOption('The "--secs-idle" value "%s" is not an integer' % (asArgs[iArg],));
+            if self.cSecsIdle <= 0:
+                raise base.InvalidOption('The "--secs-idle" value "%s" is zero or negative.' % (self.cSecsIdle,));
+        elif asArgs[iArg] == '--test-vms':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--test-vms" takes colon separated list');
+            self.asTestVMs = asArgs[iArg].split(':');
+            for s in self.asTestVMs:
+                if s not in self.asTestVMsDef:
+                    raise base.InvalidOption('The "--test-vms" value "%s" is not valid; valid values are: %s' \
+                        % (s, ' '.join(self.asTestVMsDef)));
+        elif asArgs[iArg] == '--skip-vms':
+            iArg += 1;
+            if iArg >= len(asArgs): raise base.InvalidOption('The "--skip-vms" takes colon separated list');
+            self.asSkipVMs = asArgs[iArg].split(':');
+            for s in self.asSkipVMs:
+                if s not in self.asTestVMsDef:
+                    reporter.log('warning: The "--test-vms" value "%s" does not specify any of our test VMs.' % (s));
+        elif asArgs[iArg] == '--quick':
+            self.acConns    = [256,];
+            self.cSecsIdle  = 5;
+        else:
+            return vbox.TestDriver.parseOption(self, asArgs, iArg);
+        return iArg + 1;
+
+    def completeOptions(self):
+        # Remove skipped VMs from the test list.
+        for sVM in self.asSkipVMs:
+            try:    self.asTestVMs.remove(sVM);
+            except: pass;
+
+        return vbox.TestDriver.completeOptions(self);
+
+    def getResourceSet(self):
+        # Construct the resource list the first time it's queried.
+        if self.asRsrcs is None:
+            self.asRsrcs = [];
+            if 'tst-storage' in self.asTestVMs:
+                self.asRsrcs.append('5.0/storage/tst-storage.vdi');
+        return self.asRsrcs;
+
+    def actionConfig(self):
+        # Make sure vboxapi has been imported so we can use the constants.
+        if not self.importVBoxApi():
+            return False;
+
+        # Linux VMs, the guest opens the connections with bash.
+        if 'tst-storage' in self.asTestVMs:
+            oVM = self.createTestVM('tst-storage', 1, '5.0/storage/tst-storage.vdi', sKind = 'ArchLinux_64', fIoApic = True, \
+                                    eNic0AttachType = vboxcon.NetworkAttachmentType_NAT, \
+                                    eNic0Type = vboxcon.NetworkAdapterType_Virtio);
+            if oVM is None:
+                return False;
+
+        return True;
+
+    def actionExecute(self):
+        """
+        Execute the testcase.
+        """
+        fRc = self.test1();
+        return fRc;
+
+
+    #
+    # Test execution helpers.
+    #
+
+    def test1QueryNatStats(self, oSession):
+        """
+        Returns a dictionary with the epoll counters of the first NAT instance,
+        an empty one if the build doesn't have them and None on failure.
+        """
+        try:
+            sStats = oSession.o.console.debugger.getStats('/Drivers/NAT0/Epoll*', False);
+        except:
+            reporter.errorXcpt('IMachineDebugger::getStats failed');
+            return None;
+
+        dcValues = {};
+        for oMatch in re.finditer(r'c="(\d+)"[^>]*name="/Drivers/NAT0/(Epoll\w+)"', sStats):
+            dcValues[oMatch.group(2)] = int(oMatch.group(1));
+        return dcValues;
+
+    def test1OpenConnections(self, oTxsSession, oServer, cConns):
+        """
+        Makes the guest open the connections and waits for the server to accept them.
+
+        The connections are held by background processes so TXS doesn't wait
+        for them.  TXS expands '${...}' itself and doesn't cope with other uses
+        of '$', so the script does without shell variables.
+        """
+        sScript = '(seq 1 %u | xargs -n 1 -P %u bash -c \'exec 3<>/dev/tcp/10.0.2.2/%u && sleep %u\') ' \
+                  '</dev/null >/dev/null 2>&1 &' \
+                % (cConns, cConns, self.uPort, self.cSecsIdle * 4 + 60);
+        fRc = self.txsRunTest(oTxsSession, 'Open %u connections' % (cConns,), 30 * 1000,
+                              '/bin/sh', ('sh', '-c', sScript));
+        if not fRc:
+            return False;
+
+        msStart = base.timestampMilli();
+        while oServer.getConnectionCount() < cConns:
+            if base.timestampMilli() - msStart > 60 * 1000:
+                reporter.testFailure('Only %u of %u connections were established' % (oServer.getConnectionCount(), cConns));
+                return False;
+            self.sleep(1);
+        return True;
+
+    def test1OneCfg(self, sVmName, cConns):
+        """
+        Runs the specified VM thru test #1 with the given number of connections.
+
+        Returns a success indicator on the general test execution. This is not
+        the actual test result.
+        """
+        oServer = IdleConnServer(self.uPort);
+        if not oServer.start():
+            return False;
+
+        fRc = True;
+        oSession, oTxsSession = self.startVmAndConnectToTxsViaTcp(sVmName, fCdWait = False, fNatForwardingForTxs = True);
+        if oSession is not None:
+            self.addTask(oSession);
+
+            # Fudge factor - Allow the guest to finish starting up.
+            self.sleep(5);
+
+            fRc = self.test1OpenConnections(oTxsSession, oServer, cConns);
+            if fRc:
+                oServer.setBusy(True);
+                dcBefore = self.test1QueryNatStats(oSession);
+                self.sleep(self.cSecsIdle);
+                dcAfter  = self.test1QueryNatStats(oSession);
+                oServer.setBusy(False);
+
+                if dcBefore is None or dcAfter is None:
+                    fRc = False;
+                elif 'EpollWakeups' not in dcAfter:
+                    reporter.log('No epoll statistics for the NAT engine, skipping the check');
+                else:
+                    cWakeups = dcAfter['EpollWakeups'] - dcBefore['EpollWakeups'];
+                    cSockets = dcAfter['EpollSockets'] - dcBefore['EpollSockets'];
+                    cDirty   = dcAfter['EpollDirty']   - dcBefore['EpollDirty'];
+                    cResyncs = dcAfter['EpollResync']  - dcBefore['EpollResync'];
+                    reporter.log('%u wakeups servicing %u sockets and recalculating %u dirty ones, %u full resyncs' \
+                                 % (cWakeups, cSockets, cDirty, cResyncs));
+                    if cWakeups == 0:
+                        reporter.testFailure('The NAT engine did not wake up while one connection was busy');
+                    else:
+                        # The busy connection, the TXS one and maybe a few closing ones.
+                        rdPerWakeup = float(cSockets + cDirty) / cWakeups;
+                        reporter.testValue('Sockets per wakeup', int(rdPerWakeup * 1000), 'pp1k');
+                        reporter.testValue('Full resyncs', cResyncs, 'occurrences');
+                        rdMax = max(8.0, cConns / 16.0);
+                        if rdPerWakeup > rdMax:
+                            reporter.testFailure('Looked at %.2f sockets per wakeup with %u idle connections (max %.2f)' \
+                                                 % (rdPerWakeup, cConns, rdMax));
+
+            # cleanup.
+            self.removeTask(oTxsSession);
+            self.terminateVmBySession(oSession);
+        else:
+            fRc = False;
+
+        oServer.stop();
+        return fRc;
+
+    def test1OneVM(self, sVmName):
+        """
+        Runs one VM thru the various configurations.
+        """
+        reporter.testStart(sVmName);
+        fRc = True;
+        for cConns in self.acConns:
+            reporter.testStart('%u connections' % (cConns,));
+            fRc = self.test1OneCfg(sVmName, cConns) and fRc and True; # pychecker hack.
+            reporter.testDone();
+        reporter.testDone();
+        return fRc;
+
+    def test1(self):
+        """
+        Executes test #1.
+        """
+        fRc = True;
+        for sVM in self.asTestVMs:
+            if not self.test1OneVM(sVM):
+                fRc = False;
+        return fRc;
+
+
+
+if __name__ == '__main__':
+    sys.exit(tdNetNatIdle1().main(sys.argv));